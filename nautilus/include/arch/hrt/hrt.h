@@ -38,6 +38,22 @@ extern "C" {
 
 #define HVM_HCALL_NUM 0xf000
 
+/*
+ * Upcalls the ROS makes beyond the base protocol, and the HRT's
+ * hypercall back. Each is used by more than one facility, so they
+ * are numbered here and nowhere else.
+ */
+#define HRT_UPCALL_RING_REGISTER  0x40  /* arg: the ring's (ROS) address */
+#define HRT_UPCALL_RING_KICK      0x41
+#define HRT_UPCALL_QUEUE_REGISTER 0x42  /* arg: the queue's (ROS) address */
+#define HRT_UPCALL_QUEUE_KICK     0x43
+
+/* the HRT's notification to the ROS, the argument is the ring or queue */
+#define HVM_HCALL_SIGNAL_ROS      0x41
+
+/* the ROS half of the merged address space */
+#define ROS_HALF_END 0x0000800000000000ULL
+
 /*
   Calling convention:
 
@@ -96,6 +112,7 @@ hvm_hcall (uint64_t cmd, uint64_t a1, uint64_t a2, uint64_t a3,
 }
 
 int nautilus_hrt_upcall_handler (excp_entry_t * excp, excp_vec_t vec);
+int hrt_request (uint64_t cmd, uint64_t arg);
 
 int __early_init_hrt (struct naut_info * naut);
 int hrt_init_cpus (struct sys_info * sys);
@@ -106,10 +123,13 @@ void hrt_print(const char *s);
 void hrt_puts (const char * s);
 
 int hvm_hrt_init (void);
+int hrt_merge_init (void);
 
 
 #endif /* !__ASSEMBLER__! */
 
+#define HRT_FLAGS_PS_MASK 0xf00
+
 #ifdef NAUT_CONFIG_HRT_PS_512G
 #define HRT_FLAGS 0x800
 #elif defined(NAUT_CONFIG_HRT_PS_1G)
@@ -0,0 +1,92 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __HRT_RING_H__
+#define __HRT_RING_H__
+
+#include <nautilus/naut_types.h>
+#include <arch/hrt/hrt.h>
+
+/*
+ * Shared-memory rings between the HRT and the ROS.
+ *
+ * Once the address spaces are merged, the HRT sees the ROS's lower
+ * half directly, so a ring the ROS allocates in its own memory is
+ * read and written in place by both sides, no copies and no trips
+ * through the VMM. A ring carries bytes in one direction. head and
+ * tail are free-running byte counts, each written by one side only
+ * and kept on its own cache line.
+ *
+ * A side that finds the ring empty (consumer) or full (producer)
+ * sets its waiting flag, looks once more, and sleeps. The other side
+ * checks the flag after each update and only then sends a
+ * notification: an upcall (HRT_UPCALL_RING_KICK) to wake the HRT, a
+ * hypercall (HVM_HCALL_SIGNAL_ROS) to wake the ROS. A busy stream
+ * therefore has no notifications at all.
+ *
+ * The layout below is shared with the ROS side and must not change
+ * without it.
+ */
+
+#define HRT_RING_MAGIC     0x474e495254524821ULL   /* "!HRTRING" */
+#define HRT_RING_NAME_LEN  32
+
+#define HRT_RING_ROS_TO_HRT 0
+#define HRT_RING_HRT_TO_ROS 1
+
+struct hrt_ring {
+    uint64_t magic;
+    uint64_t size;        /* bytes in data[], a power of two */
+    uint32_t dir;
+    uint32_t rsvd;
+    char     name[HRT_RING_NAME_LEN];
+
+    /* written by the producer */
+    volatile uint64_t head             __attribute__((aligned(64)));
+    volatile uint32_t producer_waiting;
+
+    /* written by the consumer */
+    volatile uint64_t tail             __attribute__((aligned(64)));
+    volatile uint32_t consumer_waiting;
+
+    uint8_t data[]                     __attribute__((aligned(64)));
+};
+
+/* the HRT's handle on a registered ring */
+struct nk_hrt_ring;
+
+struct nk_hrt_ring * nk_hrt_ring_open(const char * name, int wait);
+void nk_hrt_ring_close(struct nk_hrt_ring * r);
+
+void * nk_hrt_ring_reserve(struct nk_hrt_ring * r, uint64_t * len);
+void   nk_hrt_ring_commit(struct nk_hrt_ring * r, uint64_t len);
+void * nk_hrt_ring_peek(struct nk_hrt_ring * r, uint64_t * len);
+void   nk_hrt_ring_release(struct nk_hrt_ring * r, uint64_t len);
+
+int nk_hrt_ring_write(struct nk_hrt_ring * r, const void * buf, uint64_t len);
+int nk_hrt_ring_read(struct nk_hrt_ring * r, void * buf, uint64_t len);
+
+int hrt_ring_init(void);
+
+/* called from the upcall handler */
+int  hrt_ring_register(struct hrt_ring * ring);
+void hrt_ring_kick(struct hrt_ring * ring);
+void hrt_ring_unmerge(void);
+
+#endif
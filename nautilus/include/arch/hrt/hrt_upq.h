@@ -0,0 +1,81 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __HRT_UPQ_H__
+#define __HRT_UPQ_H__
+
+#include <nautilus/naut_types.h>
+#include <arch/hrt/hrt.h>
+
+/*
+ * Polled upcall queue between the ROS and the HRT.
+ *
+ * Every upcall costs the ROS an exit and the HRT an interrupt, and
+ * each one is answered with its own completion hypercall. Once the
+ * address spaces are merged, the ROS can instead register a queue in
+ * its own memory and post requests to it. A thread bound to one HRT
+ * core polls the queue, runs whatever has been posted as one batch,
+ * and publishes all of their results with a single update of done.
+ *
+ * Interrupts are only a wake mechanism. When the poller has found
+ * nothing for a while it sets hrt_idle, looks once more, and sleeps;
+ * a ROS that posts and sees hrt_idle sends HRT_UPCALL_QUEUE_KICK. A
+ * ROS that waits for a completion sets ros_waiting, and only then
+ * does the HRT end a batch with a hypercall (HVM_HCALL_SIGNAL_ROS).
+ *
+ * Requests take the commands and arguments of the upcalls, except
+ * those that change the address space or take over the core (merge,
+ * unmerge and the synchronous protocol), which still have to come
+ * as upcalls. head, done and the slots are free-running counts, each
+ * written by one side only. The layout below is shared with the ROS
+ * side and must not change without it.
+ */
+
+#define HRT_UPQ_MAGIC 0x5143505554524821ULL   /* "!HRTUPCQ" */
+
+struct hrt_upq_req {
+    uint64_t          cmd;
+    uint64_t          arg;
+    volatile sint64_t result;     /* valid once done has passed it */
+    uint64_t          rsvd;
+};
+
+struct hrt_upq {
+    uint64_t magic;
+    uint64_t size;                /* slots in reqs[], a power of two */
+
+    /* written by the ROS */
+    volatile uint64_t head        __attribute__((aligned(64)));
+    volatile uint32_t ros_waiting;
+
+    /* written by the HRT */
+    volatile uint64_t done        __attribute__((aligned(64)));
+    volatile uint32_t hrt_idle;
+
+    struct hrt_upq_req reqs[]     __attribute__((aligned(64)));
+};
+
+int hrt_upq_init(void);
+
+/* called from the upcall handler */
+int  hrt_upq_register(struct hrt_upq * q);
+void hrt_upq_kick(struct hrt_upq * q);
+void hrt_upq_unmerge(void);
+
+#endif
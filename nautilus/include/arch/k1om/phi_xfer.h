@@ -0,0 +1,91 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __PHI_XFER_H__
+#define __PHI_XFER_H__
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Bulk transfers between the card and phi_console on the host.
+ *
+ * A window of card memory the host also maps holds a control block
+ * and two data buffers. The card asks for a host file by name, then
+ * one side fills a buffer while the other drains the other one, each
+ * handing a buffer over by flipping its state. phi_console serves
+ * files from the directory given with -d. The layout is shared with
+ * xeon_phi/linux_usr/phi_console.c and must be kept in step with it.
+ */
+
+#define PHI_XFER_BASE      0x1000000ULL         /* card physical */
+#define PHI_XFER_CTRL_LEN  0x1000
+#define PHI_XFER_CHUNK     (4*1024*1024)
+#define PHI_XFER_NBUFS     2
+#define PHI_XFER_LEN       (PHI_XFER_CTRL_LEN + PHI_XFER_NBUFS*PHI_XFER_CHUNK)
+
+#define PHI_XFER_MAGIC     0x78666572           /* "xfer" */
+#define PHI_XFER_NAME_LEN  256
+
+/* requests, from the card */
+#define PHI_XFER_REQ_NONE   0
+#define PHI_XFER_REQ_OPEN   1
+#define PHI_XFER_REQ_CLOSE  2
+
+/* open modes */
+#define PHI_XFER_RD 1   /* host file to card */
+#define PHI_XFER_WR 2   /* card to host file, truncating it */
+
+/* buffer states */
+#define PHI_XFER_BUF_EMPTY 0    /* the producer's to fill */
+#define PHI_XFER_BUF_FULL  1    /* the consumer's to drain */
+#define PHI_XFER_BUF_EOF   2    /* full, and nothing comes after it */
+
+struct phi_xfer_buf {
+    volatile uint32_t state;
+    volatile uint32_t len;
+} __packed;
+
+struct phi_xfer_ctrl {
+    volatile uint32_t magic;
+    uint32_t chunk;
+    uint32_t nbufs;
+
+    volatile uint32_t req;
+    volatile uint32_t req_seq;      /* bumped by the card for each request */
+    volatile uint32_t ack_seq;      /* set to req_seq by the host when done */
+    volatile sint32_t status;       /* 0 or -errno from the host */
+    uint32_t mode;
+    volatile uint64_t size;         /* of the file opened for reading */
+    char name[PHI_XFER_NAME_LEN];
+
+    struct phi_xfer_buf bufs[PHI_XFER_NBUFS];
+} __packed;
+
+int phi_xfer_init(void);
+
+/* one transfer at a time, returns 0 on success */
+int phi_xfer_open(const char * name, int mode);
+/* size of the file open for reading */
+uint64_t phi_xfer_size(void);
+/* bytes read, 0 at the end of the file */
+ssize_t phi_xfer_read(void * buf, size_t len);
+ssize_t phi_xfer_write(const void * buf, size_t len);
+int phi_xfer_close(void);
+
+#endif
@@ -49,6 +49,10 @@ void phi_cons_notify_scrollup(void);
 void phi_cons_notify_line_draw(unsigned row);
 void phi_cons_notify_redraw(void);
 
+void phi_cons_mark_dirty(unsigned row);
+void phi_cons_mark_dirty_all(void);
+void phi_cons_flush(void);
+
 void phi_cons_clear_screen(void);
 void phi_cons_init(void);
 void phi_cons_print(char *buf);
@@ -33,7 +33,7 @@ extern "C" {
 #define APIC_TIMER_INT_VEC     0xf0
 #define APIC_ERROR_INT_VEC     0xf1
 #define APIC_THRML_INT_VEC     0xf2
-#define APIC_PC_INT_VEC        0xf3
+#define APIC_PC_INT_VEC        0xf7
 #define APIC_CMCR_INT_VEC      0xf4
 #define APIC_EXT_LVT_DUMMY_VEC 0xf5
 #define APIC_NULL_KICK_VEC     0xfc
@@ -55,6 +55,7 @@ extern "C" {
 
 #define IA32_APIC_BASE_MSR_BSP    0x100 
 #define IA32_APIC_BASE_MSR_ENABLE 0x800
+#define IA32_APIC_BASE_MSR_EXTD   0x400 /* x2APIC mode */
 
 #define APIC_BASE_ADDR_MASK 0xfffffffffffff000ULL
 #define APIC_IS_BSP(x)      ((x) & (1 << 8))
@@ -139,6 +140,15 @@ extern "C" {
 /* Extended LVT entries */
 #define APIC_REG_EXTLVT(n) (0x500 + 0x10*(n))
 
+/* 
+ * In x2APIC mode each 16-byte xAPIC register becomes one MSR, and the
+ * ICR/ICR2 pair is merged into a single 64-bit MSR with the full
+ * 32-bit destination in the upper half
+ */
+#define X2APIC_MSR_BASE   0x800
+#define X2APIC_MSR(reg)   (X2APIC_MSR_BASE + ((reg) >> 4))
+#define X2APIC_MSR_ICR    X2APIC_MSR(APIC_REG_ICR)
+
     /* for LVT entries */
 #define APIC_DEL_MODE_FIXED  0x00000
 #define APIC_DEL_MODE_LOWEST 0x00100
@@ -198,19 +208,44 @@ struct apic_dev {
     uint64_t err_int_cnt;
     uint64_t scale;
     uint64_t frequency;
+    uint8_t  tsc_deadline; /* oneshot timer runs in TSC-deadline mode */
+    uint8_t  x2apic;       /* registers are MSRs, not MMIO */
 };
 
 
+#ifdef NAUT_CONFIG_APIC_X2APIC
+static inline void
+x2apic_msr_write (uint32_t msr, uint64_t val)
+{
+    asm volatile ("wrmsr" : : "c"(msr), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+static inline uint32_t
+x2apic_msr_read (uint32_t msr)
+{
+    uint32_t lo, hi;
+    asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return lo;
+}
+#endif
+
 
 static inline void
 apic_write (struct apic_dev * apic, 
             uint_t reg, 
             uint32_t val)
 {
+#ifdef NAUT_CONFIG_APIC_X2APIC
+    if (apic->x2apic) {
+        x2apic_msr_write(X2APIC_MSR(reg), val);
+        return;
+    }
+#endif
     *((volatile uint32_t *)(apic->base_addr + reg)) = val;
 }
     
 inline void apic_oneshot_write(struct apic_dev *apic, uint64_t time);
+void apic_deadline_write(struct apic_dev *apic, uint64_t tsc);
 
 void calibrate_apic(struct apic_dev *apic);
 
@@ -218,10 +253,41 @@ void calibrate_apic(struct apic_dev *apic);
 static inline uint32_t
 apic_read (struct apic_dev * apic, uint_t reg)
 {
+#ifdef NAUT_CONFIG_APIC_X2APIC
+    if (apic->x2apic) {
+        return x2apic_msr_read(X2APIC_MSR(reg));
+    }
+#endif
     return *((volatile uint32_t *)(apic->base_addr + reg));
 }
 
 
+/*
+ * Send an IPI: dest is a physical or logical APIC ID (ignored when
+ * lo carries a destination shorthand) and lo is the low ICR word.
+ * 
+ * In x2APIC mode this is a single WRMSR and there is no delivery
+ * status to poll. That WRMSR is not serializing, though, so we fence
+ * first to make sure anything the target is about to read from
+ * memory is visible before the interrupt is.
+ */
+static inline void
+apic_write_icr (struct apic_dev * apic, uint32_t dest, uint32_t lo)
+{
+#ifdef NAUT_CONFIG_APIC_X2APIC
+    if (apic->x2apic) {
+        asm volatile ("mfence" : : : "memory");
+        x2apic_msr_write(X2APIC_MSR_ICR, ((uint64_t)dest << 32) | lo);
+        return;
+    }
+#endif
+    if (!(lo & APIC_IPI_OTHERS)) {
+        apic_write(apic, APIC_REG_ICR2, dest << APIC_ICR2_DST_SHIFT);
+    }
+    apic_write(apic, APIC_REG_ICR, lo);
+}
+
+
 struct naut_info;
 
 
@@ -233,14 +299,13 @@ apic_ipi (struct apic_dev * apic,
           uint_t remote_id,
           uint_t vector) 
 {
-    apic_write(apic, APIC_REG_ICR2, remote_id << APIC_ICR2_DST_SHIFT);
-    apic_write(apic, APIC_REG_ICR, APIC_DEL_MODE_FIXED | vector);
+    apic_write_icr(apic, remote_id, APIC_DEL_MODE_FIXED | vector);
 }
 
 static inline void 
 apic_bcast_ipi (struct apic_dev * apic, uint_t vector)
 {
-    apic_write(apic, APIC_REG_ICR, APIC_IPI_OTHERS | APIC_DEL_MODE_FIXED | vector);
+    apic_write_icr(apic, 0, APIC_IPI_OTHERS | APIC_DEL_MODE_FIXED | vector);
 }
 
 
@@ -147,6 +147,24 @@ hpet_read (struct hpet_dev * hpet, uint32_t reg)
     return *((volatile uint64_t*)(hpet->base_addr + reg));
 }
 
+#ifdef NAUT_CONFIG_HPET_BROADCAST
+/*
+ * Broadcast wakeups for cores whose APIC timer stops in deep C-states.
+ * One comparator is shared: each sleeping core has an entry on a list
+ * sorted by expiry, the comparator is set for the head, and when it
+ * fires the owner sends each expired core an APIC timer interrupt.
+ */
+#define HPET_BCAST_VEC 0xf6
+
+#define TN_INT_ROUTE(x) (((x) & 0x1fULL) << 9)
+#define TN_FSB_EN       (1<<14)
+
+int nk_hpet_bcast_init(void);
+/* wake this core at TSC time tsc, returns -1 if it cannot be done */
+int nk_hpet_bcast_enter(uint64_t tsc);
+void nk_hpet_bcast_exit(void);
+#endif
+
 struct naut_info;
 extern struct naut_info * nk_get_nautilus_info(void);
 static inline unsigned long
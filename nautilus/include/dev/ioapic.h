@@ -127,6 +127,9 @@ struct sys_info;
 int ioapic_init(struct sys_info * sys);
 void ioapic_mask_irq (struct ioapic * ioapic, uint8_t irq);
 void ioapic_unmask_irq (struct ioapic * ioapic, uint8_t irq);
+void ioapic_set_irq_dest (struct ioapic * ioapic, uint8_t irq, uint8_t apic_id);
+uint8_t ioapic_get_irq_dest (struct ioapic * ioapic, uint8_t irq);
+int ioapic_route_pin (struct ioapic * ioapic, uint8_t pin, uint8_t vector, uint8_t apic_id);
 
 
 static inline void
@@ -63,6 +63,58 @@
 
 #define PCI_SUBCLASS_BRIDGE_PCI 0x4
 
+#define PCI_CMD_IO_EN        (1 << 0)
+#define PCI_CMD_MEM_EN       (1 << 1)
+#define PCI_CMD_BUS_MASTER   (1 << 2)
+#define PCI_CMD_INTX_DISABLE (1 << 10)
+
+#define PCI_STATUS_CAP_LIST  (1 << 4)
+
+#define PCI_CAP_PTR_OFF      0x34
+
+#define PCI_CAP_ID_MSI  0x05
+#define PCI_CAP_ID_PCIE 0x10
+#define PCI_CAP_ID_MSIX 0x11
+
+// MSI capability, offsets from the capability
+#define PCI_MSI_CTRL        0x2
+#define PCI_MSI_ADDR_LO     0x4
+#define PCI_MSI_ADDR_HI     0x8
+#define PCI_MSI_DATA_32     0x8
+#define PCI_MSI_DATA_64     0xc
+#define PCI_MSI_MASK_32     0xc
+#define PCI_MSI_MASK_64     0x10
+
+#define PCI_MSI_CTRL_EN        (1 << 0)
+#define PCI_MSI_CTRL_MMC(x)    (((x) >> 1) & 0x7)  // log2 of vectors capable
+#define PCI_MSI_CTRL_MME_SHIFT 4                   // log2 of vectors enabled
+#define PCI_MSI_CTRL_MME_MASK  (0x7 << 4)
+#define PCI_MSI_CTRL_64BIT     (1 << 7)
+#define PCI_MSI_CTRL_MASKABLE  (1 << 8)
+
+// MSI-X capability
+#define PCI_MSIX_CTRL       0x2
+#define PCI_MSIX_TABLE      0x4
+#define PCI_MSIX_PBA        0x8
+
+#define PCI_MSIX_CTRL_SIZE(x)  (((x) & 0x7ff) + 1)
+#define PCI_MSIX_CTRL_FMASK    (1 << 14)
+#define PCI_MSIX_CTRL_EN       (1 << 15)
+#define PCI_MSIX_BIR(x)        ((x) & 0x7)
+#define PCI_MSIX_OFF(x)        ((x) & ~0x7)
+
+// MSI-X table entries, in a memory BAR
+#define PCI_MSIX_ENTRY_SIZE     16
+#define PCI_MSIX_ENTRY_ADDR_LO  0x0
+#define PCI_MSIX_ENTRY_ADDR_HI  0x4
+#define PCI_MSIX_ENTRY_DATA     0x8
+#define PCI_MSIX_ENTRY_CTRL     0xc
+#define PCI_MSIX_ENTRY_MASKED   0x1
+
+// messages are writes to the target's local APIC window, fixed and edge triggered
+#define PCI_MSI_ADDR_BASE       0xfee00000UL
+#define PCI_MSI_ADDR_DEST(id)   (((uint32_t)(id) & 0xff) << 12)
+
 
 struct naut_info; 
 
@@ -164,11 +216,35 @@ struct pci_cfg_space {
 } __packed;
 
 
+// standard header, the part of config space we shadow
+#define PCI_CFG_HDR_SIZE 64
+
+struct pci_bar {
+    uint64_t addr;
+    uint64_t size;               // 0 if the BAR is not implemented
+    uint8_t  io;
+    uint8_t  is64;               // takes the next BAR slot as its upper half
+    uint8_t  prefetch;
+};
+
 struct pci_dev {
     uint32_t num;
     struct pci_bus * bus;
     struct list_head dev_node;
+    // the standard header as read at enumeration, kept current by
+    // pci_dev_cfg_write*; status and the device-specific rest are read live
     struct pci_cfg_space cfg;
+    struct pci_bar bar[6];
+
+    // message-signaled interrupts, filled in at enumeration (caps) and when enabled
+    uint8_t  msi_cap;
+    uint8_t  msix_cap;
+    uint8_t  msi_on;
+    uint8_t  msix_on;
+    uint8_t  msi_vec;             // first of msi_num consecutive vectors
+    uint16_t msi_num;
+    uint16_t msix_num;            // entries in the MSI-X table
+    volatile uint8_t * msix_table;
 };
 
 
@@ -185,6 +261,33 @@ uint32_t pci_cfg_readl(uint8_t bus, uint8_t slot, uint8_t fun, uint8_t off);
 void pci_cfg_writew(uint8_t bus, uint8_t slot, uint8_t fun, uint8_t off, uint16_t val);
 void pci_cfg_writel(uint8_t bus, uint8_t slot, uint8_t fun, uint8_t off, uint32_t val);
 
+uint16_t pci_dev_cfg_readw(struct pci_dev * dev, uint8_t off);
+uint32_t pci_dev_cfg_readl(struct pci_dev * dev, uint8_t off);
+void pci_dev_cfg_writew(struct pci_dev * dev, uint8_t off, uint16_t val);
+void pci_dev_cfg_writel(struct pci_dev * dev, uint8_t off, uint32_t val);
+
+// offset of the capability in config space, 0 if the device has none
+uint8_t pci_find_cap(struct pci_dev * dev, uint8_t cap_id);
+
+/*
+ * MSI gives up to 32 consecutive vectors, all delivered to one CPU.
+ * n must be a power of two; fewer may be granted, *first and the
+ * return value say what the device got. The vectors are reserved
+ * but unclaimed, register_int_handler them before use.
+ */
+int pci_msi_enable(struct pci_dev * dev, uint16_t n, int cpu, uint8_t * first);
+int pci_msi_disable(struct pci_dev * dev);
+
+/*
+ * MSI-X gives each table entry its own vector and target. enable
+ * leaves every entry masked; set_vector programs one and unmasks it.
+ */
+int pci_msix_count(struct pci_dev * dev);
+int pci_msix_enable(struct pci_dev * dev);
+int pci_msix_disable(struct pci_dev * dev);
+int pci_msix_set_vector(struct pci_dev * dev, uint16_t entry, uint8_t vec, int cpu);
+int pci_msix_mask(struct pci_dev * dev, uint16_t entry, int mask);
+
 int pci_init (struct naut_info * naut);
 
 
@@ -55,4 +55,9 @@ uint8_t serial_get_irq(void);
 void serial_init(void);
 void serial_init_addr(unsigned short io_addr);
 
+#ifdef NAUT_CONFIG_SERIAL_ASYNC
+void serial_async_start(void);
+void serial_async_panic(void);
+#endif
+
 #endif
@@ -36,9 +36,20 @@ struct nk_timer_event {
     volatile uint8_t event_flag;
 };
 
+/*
+ * One-shot callbacks on a TSC deadline. They are checked on every
+ * timer interrupt, on whatever core takes it, so they fire within
+ * about a scheduling quantum of the deadline, in interrupt context.
+ * With hrtimers each one is an hrtimer on the core that armed it.
+ */
+#define NUM_TIMER_CALLBACKS 64
+
 #include <nautilus/idt.h>
 int nk_timer_handler(excp_entry_t *, excp_vec_t);
 int nk_timer_init (struct naut_info * naut);
 void nk_sleep (uint_t msec);
 
+int nk_timer_callback_arm(uint64_t ns, void (*fn)(void * arg), void * arg);
+int nk_timer_callback_cancel(int id);
+
 #endif
@@ -89,5 +89,10 @@ static inline void vga_copy_in(void *src, uint32_t n)
   memcpy((void*)VGA_BASE_ADDR, src, n);
 }
 
+static inline void vga_copy_in_row(uint8_t y, void *src)
+{
+  memcpy((void*)(((uint16_t *)VGA_BASE_ADDR)+y*VGA_WIDTH), src, VGA_WIDTH*sizeof(uint16_t));
+}
+
 
 #endif
@@ -0,0 +1,124 @@
+#ifndef __VIRTIO_BLK
+#define __VIRTIO_BLK
+
+#include <nautilus/list.h>
+#include <dev/virtio_pci.h>
+
+#define VIRTIO_BLK_F_SIZE_MAX (1U << 1)
+#define VIRTIO_BLK_F_SEG_MAX  (1U << 2)
+#define VIRTIO_BLK_F_RO       (1U << 5)
+#define VIRTIO_BLK_F_BLK_SIZE (1U << 6)
+#define VIRTIO_BLK_F_FLUSH    (1U << 9)
+#define VIRTIO_BLK_F_MQ       (1U << 12)
+
+#define VIRTIO_BLK_T_IN    0
+#define VIRTIO_BLK_T_OUT   1
+#define VIRTIO_BLK_T_FLUSH 4
+
+#define VIRTIO_BLK_S_OK      0
+#define VIRTIO_BLK_S_IOERR   1
+#define VIRTIO_BLK_S_UNSUPP  2
+#define VIRTIO_BLK_S_PENDING 0xff
+
+// sectors are always 512 bytes to the device, whatever its block size
+#define VIRTIO_BLK_SECTOR 512
+
+// data buffers in one request at most
+#define VIRTIO_BLK_MAX_SG 64
+
+#define VIRTIO_BLK_MAX_QUEUES 64
+
+struct virtio_blk_outhdr {
+  uint32_t type;
+  uint32_t ioprio;
+  uint64_t sector;
+} __packed;
+
+/*
+ * An asynchronous request. The caller fills in type, sector and the
+ * data buffers, which must stay put until the request completes;
+ * write flags are set by the driver. The request itself belongs to
+ * the driver from a successful submit until it completes: status
+ * leaves VIRTIO_BLK_S_PENDING and done, if set, is called. done runs
+ * in interrupt context on an interrupt-driven queue and in the
+ * poller's context otherwise.
+ */
+struct virtio_blk_req {
+  uint32_t type;
+  uint64_t sector;
+  uint16_t nsg;
+  struct virtio_pci_sg *sg;
+
+  void (*done)(struct virtio_blk_req *req, void *priv);
+  void  *priv;
+
+  volatile uint8_t status;
+
+  // driver's
+  struct virtio_blk_outhdr hdr;
+  uint8_t dev_status;
+  struct virtio_blk_req *next;
+};
+
+struct virtio_blk_queue {
+  struct virtio_pci_vring *vr;
+  uint8_t polled;           // interrupts off, completions only by virtio_blk_poll
+
+  uint64_t submitted;
+  uint64_t completed;
+  uint64_t full;
+};
+
+struct virtio_blk_dev {
+  struct virtio_pci_dev *pci;
+  struct list_head node;
+  int num;
+
+  uint32_t features;
+  uint64_t capacity;          // in sectors
+  uint32_t blk_size;
+  uint32_t seg_max;
+  uint16_t num_queues;
+  uint8_t  irq;               // interrupts can be had
+
+  struct virtio_blk_queue *q;
+};
+
+int virtio_blk_init(struct virtio_pci_dev *pdev);
+
+struct virtio_blk_dev *virtio_blk_get(int num);
+
+static inline uint16_t virtio_blk_queue_for_cpu(struct virtio_blk_dev *dev, int cpu)
+{
+  return cpu % dev->num_queues;
+}
+
+// 0 if the request is in flight, -1 if the queue is full or the request is bad
+int virtio_blk_submit(struct virtio_blk_dev *dev, uint16_t qid, struct virtio_blk_req *req);
+// complete whatever the device has finished on the queue, returns how many
+int virtio_blk_poll(struct virtio_blk_dev *dev, uint16_t qid);
+// spin on the queue until the request completes, returns its status
+int virtio_blk_wait(struct virtio_blk_dev *dev, uint16_t qid, struct virtio_blk_req *req);
+// switch a queue between interrupt completion and polling
+int virtio_blk_set_polled(struct virtio_blk_dev *dev, uint16_t qid, int polled);
+
+#ifdef NAUT_CONFIG_POLL_IO
+/*
+ * complete the queue's requests on a poll core; done callbacks then
+ * run there, and typically push the request onto a worker's ring.
+ * Nobody else should poll or wait on a bound queue.
+ */
+int virtio_blk_poll_bind(struct virtio_blk_dev *dev, uint16_t qid, int cpu);
+#endif
+
+// synchronous helpers on the caller's queue, count is in sectors
+int virtio_blk_read(struct virtio_blk_dev *dev, uint64_t sector, void *buf, uint32_t count);
+int virtio_blk_write(struct virtio_blk_dev *dev, uint64_t sector, void *buf, uint32_t count);
+int virtio_blk_flush(struct virtio_blk_dev *dev);
+
+#ifdef NAUT_CONFIG_EVQ
+// a done callback posting the nk_evq_source in priv, with the request and its status
+void virtio_blk_done_evq(struct virtio_blk_req *req, void *priv);
+#endif
+
+#endif
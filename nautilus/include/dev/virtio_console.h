@@ -0,0 +1,44 @@
+#ifndef __VIRTIO_CONSOLE
+#define __VIRTIO_CONSOLE
+
+#include <dev/virtio_pci.h>
+
+// what one transmit descriptor carries at most
+#define VIRTIO_CONSOLE_CHUNK 4096
+
+/*
+ * Port 0's transmit queue, used as a log channel. Writes are copied
+ * into the chunk being filled, which goes to the device when it is
+ * full or when nothing else is in flight. While the device is busy,
+ * output piles up in the open chunk and leaves in one descriptor
+ * when the next completion comes in, so a burst of lines costs a
+ * handful of kicks rather than one per line, and nothing per byte.
+ */
+struct virtio_console_dev {
+  struct virtio_pci_dev *pci;
+  struct virtio_pci_vring *tx;
+  uint8_t irq;                 // completions by interrupt, else reclaimed on write
+
+  uint16_t nchunks;
+  char **chunk;
+  char **free;                 // chunks neither open nor on the ring
+  uint16_t nfree;
+  char *open;                  // being filled, or NULL
+  uint32_t open_len;
+  uint16_t inflight;
+
+  uint64_t bytes;
+  uint64_t posts;
+  uint64_t dropped;            // bytes that found every chunk in use
+};
+
+int virtio_console_init(struct virtio_pci_dev *pdev);
+
+// 0 if buf went to the console, -1 if there is none and it should go elsewhere
+int  virtio_console_write(const char *buf, size_t len);
+// send the open chunk now, whatever is in flight
+void virtio_console_flush(void);
+void virtio_console_panic(void);
+void virtio_console_dump(void);
+
+#endif
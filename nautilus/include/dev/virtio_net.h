@@ -0,0 +1,119 @@
+#ifndef __VIRTIO_NET
+#define __VIRTIO_NET
+
+#include <nautilus/list.h>
+#include <nautilus/spinlock.h>
+#include <dev/virtio_pci.h>
+
+#define VIRTIO_NET_F_MAC     (1U << 5)
+#define VIRTIO_NET_F_STATUS  (1U << 16)
+#define VIRTIO_NET_F_CTRL_VQ (1U << 17)
+#define VIRTIO_NET_F_MQ      (1U << 22)
+
+// queue pairs we will use at most, fewer if there are fewer cores
+#define VIRTIO_NET_MAX_PAIRS 64
+
+// enough for a full ethernet frame at the default MTU, with room to spare
+#define VIRTIO_NET_BUF_DATA 1536
+
+// the header every packet carries, we ask for no offloads so it stays zero
+struct virtio_net_hdr {
+  uint8_t  flags;
+  uint8_t  gso_type;
+  uint16_t hdr_len;
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+} __packed;
+
+struct virtio_net_pool;
+
+/*
+ * Packet buffers. A buffer is handed to the device where it sits, the
+ * header and the frame going in two descriptors that point into it,
+ * so nothing is copied on either path. Buffers come from a pool, go
+ * back to it when freed, and a sent buffer is freed for the caller
+ * once the device is done with it.
+ */
+struct virtio_net_buf {
+  struct virtio_net_buf  *next;   // pool free list
+  struct virtio_net_pool *pool;
+  uint32_t len;                   // bytes of frame in data
+  struct virtio_net_hdr hdr;
+  uint8_t data[VIRTIO_NET_BUF_DATA];
+};
+
+struct virtio_net_pool {
+  spinlock_t lock;
+  struct virtio_net_buf *free;
+  uint32_t count;
+  uint32_t avail;
+  struct virtio_net_buf *bufs;
+};
+
+// one receive and one transmit queue, used by one core
+struct virtio_net_qp {
+  struct virtio_pci_vring *rx;
+  struct virtio_pci_vring *tx;
+  struct virtio_net_pool  *rx_pool;
+  uint16_t rx_posted;
+
+  uint64_t rx_packets;
+  uint64_t tx_packets;
+  uint64_t tx_full;
+};
+
+struct virtio_net_dev {
+  struct virtio_pci_dev *pci;
+  struct list_head node;
+  int num;
+
+  uint32_t features;
+  uint8_t  mac[6];
+  uint16_t max_pairs;             // device's limit
+  uint16_t num_pairs;             // in use
+
+  struct virtio_net_qp     *qp;
+  struct virtio_pci_vring  *ctrl;
+
+  // called in interrupt context for a pair that has received packets
+  void (*rx_callback)(struct virtio_net_dev *dev, uint16_t qid, void *priv);
+  void  *rx_priv;
+};
+
+int virtio_net_init(struct virtio_pci_dev *pdev);
+
+struct virtio_net_dev *virtio_net_get(int num);
+
+struct virtio_net_pool *virtio_net_pool_create(uint32_t count);
+int  virtio_net_pool_destroy(struct virtio_net_pool *pool);
+struct virtio_net_buf *virtio_net_buf_alloc(struct virtio_net_pool *pool);
+void virtio_net_buf_free(struct virtio_net_buf *buf);
+
+// the pair a core should use
+static inline uint16_t virtio_net_queue_for_cpu(struct virtio_net_dev *dev, int cpu)
+{
+  return cpu % dev->num_pairs;
+}
+
+// the buffer belongs to the driver from here, 0 on success, -1 if the queue is full
+int virtio_net_send(struct virtio_net_dev *dev, uint16_t qid, struct virtio_net_buf *buf);
+// a received frame or NULL, free it when done
+struct virtio_net_buf *virtio_net_recv(struct virtio_net_dev *dev, uint16_t qid);
+
+void virtio_net_set_rx_callback(struct virtio_net_dev *dev,
+                                void (*callback)(struct virtio_net_dev *, uint16_t, void *),
+                                void *priv);
+
+#ifdef NAUT_CONFIG_EVQ
+// an rx callback posting the nk_evq_source in priv, with the device and the pair
+void virtio_net_rx_evq(struct virtio_net_dev *dev, uint16_t qid, void *priv);
+#endif
+
+#ifdef NAUT_CONFIG_POLL_IO
+struct nk_poll_ring;
+// receive on the pair from a poll core, frames go onto the ring for one worker
+int virtio_net_poll_bind(struct virtio_net_dev *dev, uint16_t qid, int cpu, struct nk_poll_ring *ring);
+#endif
+
+#endif
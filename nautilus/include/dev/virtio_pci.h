@@ -1,13 +1,100 @@
 #ifndef __VIRTIO_PCI
 #define __VIRTIO_PCI
 
-#define MAX_VRINGS 2
+#include <nautilus/spinlock.h>
 
-enum virtio_pci_dev_type { VIRTIO_PCI_NET, VIRTIO_PCI_BLOCK, VIRTIO_PCI_OTHER };
+enum virtio_pci_dev_type { VIRTIO_PCI_NET, VIRTIO_PCI_BLOCK, VIRTIO_PCI_CONSOLE, VIRTIO_PCI_OTHER };
 
+// legacy (0.9.5) register layout, in the I/O BAR
+#define VIRTIO_PCI_HOST_FEATURES  0x00
+#define VIRTIO_PCI_GUEST_FEATURES 0x04
+#define VIRTIO_PCI_QUEUE_PFN      0x08
+#define VIRTIO_PCI_QUEUE_SIZE     0x0c
+#define VIRTIO_PCI_QUEUE_SEL      0x0e
+#define VIRTIO_PCI_QUEUE_NOTIFY   0x10
+#define VIRTIO_PCI_STATUS         0x12
+#define VIRTIO_PCI_ISR            0x13
+#define VIRTIO_PCI_CONFIG_VECTOR  0x14  // only with MSI-X on
+#define VIRTIO_PCI_QUEUE_VECTOR   0x16
+#define VIRTIO_PCI_CONFIG         0x14  // device config, at 0x18 with MSI-X on
+#define VIRTIO_PCI_CONFIG_MSIX    0x18
+
+#define VIRTIO_STATUS_ACK       0x01
+#define VIRTIO_STATUS_DRIVER    0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED    0x80
+
+#define VIRTIO_ISR_QUEUE  0x1
+#define VIRTIO_ISR_CONFIG 0x2
+
+#define VIRTIO_MSI_NO_VECTOR 0xffff
+
+#define VIRTIO_VRING_ALIGN 4096
+
+#define VIRTQ_DESC_F_NEXT  1
+#define VIRTQ_DESC_F_WRITE 2
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY     1
+
+struct virtq_desc {
+  uint64_t addr;
+  uint32_t len;
+  uint16_t flags;
+  uint16_t next;
+} __packed;
+
+struct virtq_avail {
+  uint16_t flags;
+  uint16_t idx;
+  uint16_t ring[0];
+} __packed;
+
+struct virtq_used_elem {
+  uint32_t id;
+  uint32_t len;
+} __packed;
+
+struct virtq_used {
+  uint16_t flags;
+  uint16_t idx;
+  struct virtq_used_elem ring[0];
+} __packed;
+
+struct virtio_pci_dev;
+
+// a split virtqueue, laid out the legacy way in one page-aligned block
 struct virtio_pci_vring {
+  struct virtio_pci_dev *dev;
+  uint16_t qidx;
+  uint16_t size;            // entries, set by the device
+
   uint64_t size_bytes;
-  uint8_t data[0];
+  void    *mem;
+
+  volatile struct virtq_desc  *desc;
+  volatile struct virtq_avail *avail;
+  volatile struct virtq_used  *used;
+
+  uint16_t free_head;       // chain of free descriptors
+  uint16_t num_free;
+  uint16_t last_used;       // next used entry we have not looked at
+  void   **cookie;          // caller's handle for each posted chain, by head
+
+  // the vring functions do not lock, drivers hold this around them
+  spinlock_t lock;
+
+  // with MSI-X, the queue's own vector and where it is delivered
+  uint8_t vec;
+  int     cpu;
+  void  (*callback)(struct virtio_pci_vring *vr);
+};
+
+// one buffer of a request, device-writable ones go after the readable ones
+struct virtio_pci_sg {
+  void    *addr;
+  uint32_t len;
+  uint8_t  write;
 };
 
 struct virtio_pci_dev {
@@ -23,19 +110,68 @@ struct virtio_pci_dev {
 
   // Where registers are mapped into the I/O address space
   uint16_t  ioport_start;
-  uint16_t  ioport_end;  
+  uint16_t  ioport_end;
 
   // Where registers are mapped into the physical memory address space
   uint64_t  mem_start;
   uint64_t  mem_end;
 
-  // The number of vrings
-  uint8_t num_vrings;
-  struct virtio_pci_dev_vring *vring[2];
+  // The vrings the driver has set up, by queue index
+  uint16_t num_vrings;
+  struct virtio_pci_vring **vring;
+
+  // called in interrupt context when the ISR says a queue has work
+  void (*irq_callback)(struct virtio_pci_dev *dev);
+  void  *driver;
+
+  // per-queue MSI-X vectors are in use, which moves the device config
+  uint8_t msix;
 };
 
 int virtio_pci_init(struct naut_info * naut);
 int virtio_pci_deinit();
 
+uint8_t  virtio_pci_read8(struct virtio_pci_dev *dev, uint16_t off);
+uint16_t virtio_pci_read16(struct virtio_pci_dev *dev, uint16_t off);
+uint32_t virtio_pci_read32(struct virtio_pci_dev *dev, uint16_t off);
+void     virtio_pci_write8(struct virtio_pci_dev *dev, uint16_t off, uint8_t val);
+void     virtio_pci_write16(struct virtio_pci_dev *dev, uint16_t off, uint16_t val);
+void     virtio_pci_write32(struct virtio_pci_dev *dev, uint16_t off, uint32_t val);
+
+// device-specific config space
+uint8_t  virtio_pci_cfg_read8(struct virtio_pci_dev *dev, uint16_t off);
+uint16_t virtio_pci_cfg_read16(struct virtio_pci_dev *dev, uint16_t off);
+uint32_t virtio_pci_cfg_read32(struct virtio_pci_dev *dev, uint16_t off);
+
+// reset, acknowledge, and agree on the features both sides have
+uint32_t virtio_pci_start(struct virtio_pci_dev *dev, uint32_t wanted);
+void     virtio_pci_driver_ok(struct virtio_pci_dev *dev);
+void     virtio_pci_fail(struct virtio_pci_dev *dev);
+
+int  virtio_pci_vrings_alloc(struct virtio_pci_dev *dev, uint16_t num);
+struct virtio_pci_vring *virtio_pci_vring_init(struct virtio_pci_dev *dev, uint16_t qidx);
+
+// returns the chain's head, or -1 if there are not n free descriptors
+int   virtio_pci_vring_post(struct virtio_pci_vring *vr, struct virtio_pci_sg *sg, uint16_t n, void *cookie);
+void  virtio_pci_vring_kick(struct virtio_pci_vring *vr);
+// the cookie of the next completed chain and what the device wrote, or NULL
+void *virtio_pci_vring_get(struct virtio_pci_vring *vr, uint32_t *len);
+int   virtio_pci_vring_pending(struct virtio_pci_vring *vr);
+void  virtio_pci_vring_irq(struct virtio_pci_vring *vr, int on);
+
+// one interrupt for the whole device, on its legacy INTx line
+int virtio_pci_irq_register(struct virtio_pci_dev *dev, void (*callback)(struct virtio_pci_dev *));
+
+/*
+ * An MSI-X vector of its own for each of the n vrings, delivered to
+ * cpu[i] and handed to callback in interrupt context. All or nothing:
+ * on failure the device is left as it was and INTx is still there to
+ * fall back on. Queues not given a vector here get no interrupts.
+ */
+int virtio_pci_msix_register(struct virtio_pci_dev *dev, uint16_t n,
+                             struct virtio_pci_vring **vr, int *cpu,
+                             void (*callback)(struct virtio_pci_vring *));
+// move a vring's interrupt to another CPU
+int virtio_pci_vring_irq_steer(struct virtio_pci_vring *vr, int cpu);
 
 #endif
@@ -0,0 +1,75 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <nautilus/naut_types.h>
+#include <nautilus/intrinsics.h>
+
+/*
+ * Arenas hand out memory by bumping a pointer through large chunks
+ * taken from the buddy system, and give it all back at once with
+ * nk_arena_reset() or nk_arena_destroy(). Individual objects are
+ * never freed. Meant for phases that allocate many small objects
+ * that all die together.
+ *
+ * An arena is not locked; it must only be used by one thread at a
+ * time. nk_arena_thread() returns an arena private to the calling
+ * thread, which is destroyed when the thread exits.
+ */
+#define NK_ARENA_ALIGN         16
+#define NK_ARENA_DEFAULT_CHUNK (2UL << 20)
+
+struct nk_arena_chunk;
+
+typedef struct nk_arena {
+    char *   cur;               /* next free byte in the current chunk */
+    char *   end;               /* end of the current chunk */
+    size_t   chunk_size;
+    struct nk_arena_chunk * chunks;  /* current chunk first */
+    uint64_t num_chunks;
+    uint64_t bytes_allocated;
+} nk_arena_t;
+
+nk_arena_t * nk_arena_create(size_t chunk_size);
+void nk_arena_destroy(nk_arena_t * arena);
+void nk_arena_reset(nk_arena_t * arena);
+nk_arena_t * nk_arena_thread(void);
+
+void * nk_arena_alloc_slow(nk_arena_t * arena, size_t size);
+
+
+static inline void *
+nk_arena_alloc (nk_arena_t * arena, size_t size)
+{
+    char * p = arena->cur;
+
+    size = (size + NK_ARENA_ALIGN - 1) & ~(size_t)(NK_ARENA_ALIGN - 1);
+
+    if (likely(size <= (size_t)(arena->end - p))) {
+        arena->cur = p + size;
+        arena->bytes_allocated += size;
+        return p;
+    }
+
+    return nk_arena_alloc_slow(arena, size);
+}
+
+#endif
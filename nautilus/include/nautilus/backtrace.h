@@ -40,6 +40,7 @@ extern "C" {
 
 struct nk_regs;
 void __do_backtrace(void **, unsigned);
+int nk_backtrace_collect(void ** fp, void * lo, void * hi, uint64_t * rips, int max);
 void nk_dump_mem(void *, ulong_t);
 void nk_stack_dump(ulong_t);
 void nk_print_regs(struct nk_regs * r);
@@ -31,6 +31,31 @@ extern "C" {
 
 #define NK_BARRIER_LAST 1
 
+/*
+ * How the participants of a thread barrier meet.
+ *
+ * CENTRAL: everyone counts down one shared counter. Any threads may
+ * take part.
+ *
+ * TREE and DISSEMINATION are for threads bound one per CPU on CPUs
+ * 0 .. count-1. Each participant spins only on its own cache line.
+ * Participants are ranked by NUMA domain, package, core and SMT
+ * thread, so the first steps pair up neighbours.
+ *
+ * TREE: arrivals combine up a tree with fan-in NK_BARRIER_FANIN and
+ * are released back down it.
+ *
+ * DISSEMINATION: log2(count) rounds of pairwise signals, with no
+ * single point of contention.
+ */
+typedef enum {
+    NK_BARRIER_CENTRAL = 0,
+    NK_BARRIER_TREE,
+    NK_BARRIER_DISSEMINATION,
+} nk_barrier_type_t;
+
+#define NK_BARRIER_FANIN 4
+
 typedef struct nk_barrier nk_barrier_t;
 
 struct nk_barrier {
@@ -41,13 +66,17 @@ struct nk_barrier {
 
     uint8_t  active; /* used for core barriers */
 
-    uint8_t pad[52];
+    uint8_t  type;   /* nk_barrier_type_t */
+    void *   nodes;  /* per-participant state for TREE/DISSEMINATION */
+
+    uint8_t pad[43];
 
     /* this is on another cache line (Assuming 64b) */
     volatile unsigned notify;
 } __attribute__ ((packed));
 
 int nk_barrier_init (nk_barrier_t * barrier, uint32_t count);
+int nk_barrier_init_type (nk_barrier_t * barrier, uint32_t count, nk_barrier_type_t type);
 int nk_barrier_destroy (nk_barrier_t * barrier);
 int nk_barrier_wait (nk_barrier_t * barrier);
 void nk_barrier_test(void);
@@ -0,0 +1,69 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __BOOT_TASK_H__
+#define __BOOT_TASK_H__
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Boot steps as a dependency graph.
+ *
+ * A step waits for the steps named in its deps, and otherwise can run
+ * anywhere and alongside anything. nk_boot_tasks_run() hands the
+ * steps that are ready to the APs (through xcalls, so a step must not
+ * block) and works through them on the calling core as well; it
+ * returns once every step of the pass is done. Steps marked
+ * NK_BOOT_TASK_DEFER are left out of that pass and run later, in the
+ * background, by nk_boot_tasks_defer(), so the workload can start
+ * without waiting for them.
+ *
+ * A step whose dependency failed is not run, and counts as failed.
+ */
+
+#define NK_BOOT_MAX_TASKS 64
+
+#define NK_BOOT_DEP(i) (1ULL << (i))
+
+/* only on the core that runs the pass */
+#define NK_BOOT_TASK_HOME  0x1
+/* not needed before the workload starts */
+#define NK_BOOT_TASK_DEFER 0x2
+
+struct naut_info;
+
+struct nk_boot_task {
+    const char * name;
+    int       (*init)(struct naut_info * naut);
+    uint64_t     deps;
+    uint8_t      flags;
+
+    /* the runner's */
+    volatile uint8_t state;
+    int          rc;
+    uint64_t     cycles;
+};
+
+int nk_boot_tasks_run(struct naut_info * naut, struct nk_boot_task * tasks, unsigned n);
+int nk_boot_tasks_defer(struct naut_info * naut, struct nk_boot_task * tasks, unsigned n);
+
+/* the TSC when init() was entered, for boot timing */
+extern uint64_t nk_boot_start_tsc;
+
+#endif
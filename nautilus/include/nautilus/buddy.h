@@ -42,14 +42,84 @@ struct buddy_mempool {
                                     *   avail[i] = free list of 2^i blocks
                                     */
 
+    volatile ulong_t avail_map;    /** bit i set iff avail[i] is non-empty */
+
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+    spinlock_t *order_locks;       /** one lock per avail[] list */
+    volatile ulong_t inflight;     /** blocks being split or merged,
+                                    * and so on no free list
+                                    */
+#endif
+
+#ifdef NAUT_CONFIG_KMEM_NUMA_SPILL
+    volatile uint64_t *free_ctr;   /** counts the bytes free here, or NULL */
+#endif
+
     spinlock_t lock;
 };
 
+
+/*
+ * Callers serialize on the zone with these. With per-order locks
+ * the buddy system locks internally, so they only mask interrupts.
+ */
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+#include <nautilus/irq.h>
+
+static inline void buddy_lock (struct buddy_mempool * mp) { }
+static inline void buddy_unlock (struct buddy_mempool * mp) { }
+
+static inline uint8_t
+buddy_lock_irq_save (struct buddy_mempool * mp)
+{
+    return irq_disable_save();
+}
+
+static inline void
+buddy_unlock_irq_restore (struct buddy_mempool * mp, uint8_t flags)
+{
+    irq_enable_restore(flags);
+}
+#else
+static inline void buddy_lock (struct buddy_mempool * mp) { spin_lock(&mp->lock); }
+static inline void buddy_unlock (struct buddy_mempool * mp) { spin_unlock(&mp->lock); }
+
+static inline uint8_t
+buddy_lock_irq_save (struct buddy_mempool * mp)
+{
+    return spin_lock_irq_save(&mp->lock);
+}
+
+static inline void
+buddy_unlock_irq_restore (struct buddy_mempool * mp, uint8_t flags)
+{
+    spin_unlock_irq_restore(&mp->lock, flags);
+}
+#endif
+
 struct buddy_mempool * buddy_init(ulong_t base_addr, ulong_t pool_order, ulong_t min_order);
 
 void buddy_free(struct buddy_mempool * mp, void * addr, ulong_t order);
 void * buddy_alloc(struct buddy_mempool * mp, ulong_t order);
+#ifdef NAUT_CONFIG_KMEM_PAGE_COLORS
+/* a block whose pages all have colors in the mask, out of 1 << bits */
+void * buddy_alloc_colored(struct buddy_mempool * mp, ulong_t order, uint64_t colors, ulong_t bits);
+#endif
+
+/*
+ * Free space in a pool. frag is the share of free memory, in
+ * thousandths, that is not in the largest free block: 0 when all of
+ * it is one block, approaching 1000 as it splinters.
+ */
+struct buddy_stats {
+    ulong_t pool_bytes;
+    ulong_t free_bytes;
+    ulong_t largest_free;           /* bytes in the largest free block */
+    ulong_t frag;
+    ulong_t free_blocks[64];        /* free blocks of each order */
+};
 
+void buddy_get_stats(struct buddy_mempool *mp, struct buddy_stats *stats);
 void buddy_dump_mempool(struct buddy_mempool *mp);
 
 #endif
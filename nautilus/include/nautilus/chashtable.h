@@ -0,0 +1,69 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __CHASHTABLE_H__
+#define __CHASHTABLE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * A hashtable any number of cores can use at once
+ *
+ * Each bucket has its own lock, so operations on different keys only
+ * meet when the keys share a bucket. The table grows by doubling, and
+ * the move to the bigger array is done a few buckets at a time by the
+ * inserts and removes that come along while it is under way, rather
+ * than all at once by whoever tipped it over its load limit. Lookups
+ * keep working throughout: a bucket that has been moved says so, and
+ * the lookup follows it to the new array.
+ *
+ * Unlike nk_hashtable a key is only ever in the table once.
+ * hash_fn and eq_fn are called with a bucket lock held, as are the
+ * frees done by nk_chtable_remove(). The table never shrinks.
+ */
+
+struct nk_chtable;
+
+struct nk_chtable * nk_create_chtable(uint_t min_size,
+				      uint_t (*hash_fn) (addr_t key),
+				      int (*eq_fn) (addr_t key1, addr_t key2));
+
+// nobody may be using the table
+void nk_free_chtable(struct nk_chtable * htable, int free_values, int free_keys);
+
+// non-zero if the pair went in, zero if the key was already there or out of memory
+int nk_chtable_insert(struct nk_chtable * htable, addr_t key, addr_t value);
+
+// the value for the key, 0 if there is none
+addr_t nk_chtable_search(struct nk_chtable * htable, addr_t key);
+
+// takes the key out and returns its value, 0 if it wasn't there
+addr_t nk_chtable_remove(struct nk_chtable * htable, addr_t key, int free_key);
+
+uint_t nk_chtable_count(struct nk_chtable * htable);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,81 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __CLOCKSOURCE_H__
+#define __CLOCKSOURCE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+#include <nautilus/cpu.h>
+
+/*
+ * The TSC as the kernel's clock, calibrated once at boot against the
+ * HPET (or the PIT-derived cpu_khz if there is no HPET).
+ *
+ * Conversions are a 64x64->128 multiply by a 32.32 fixed-point
+ * factor and a shift, so there is no division on any path that uses
+ * them. Both factors come from the one calibrated frequency, and the
+ * rounding error is under a nanosecond per second.
+ *
+ * If CPUID does not report an invariant TSC, the rate can change with
+ * P-states and deep C-states and the conversions are only as good as
+ * the frequency the core happens to be running at.
+ */
+
+#define NK_CLOCK_SHIFT 32
+
+struct nk_clocksource {
+    uint64_t tsc_hz;
+    uint64_t ns_mult;    /* ns per cycle << NK_CLOCK_SHIFT */
+    uint64_t cyc_mult;   /* cycles per ns << NK_CLOCK_SHIFT */
+    uint8_t  invariant;
+    uint8_t  hpet;       /* calibrated against the HPET */
+};
+
+extern struct nk_clocksource nk_clock;
+
+static inline uint64_t
+nk_cycles_to_ns (uint64_t cycles)
+{
+    return (uint64_t)(((unsigned __int128)cycles * nk_clock.ns_mult) >> NK_CLOCK_SHIFT);
+}
+
+static inline uint64_t
+nk_ns_to_cycles (uint64_t ns)
+{
+    return (uint64_t)(((unsigned __int128)ns * nk_clock.cyc_mult) >> NK_CLOCK_SHIFT);
+}
+
+/* nanoseconds since the TSC was reset */
+static inline uint64_t
+nk_clock_ns (void)
+{
+    return nk_cycles_to_ns(rdtsc());
+}
+
+int nk_clocksource_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
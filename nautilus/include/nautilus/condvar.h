@@ -29,19 +29,27 @@ extern "C" {
 
 #include <nautilus/thread.h>
 
+/*
+ * Waiters sleep futex-style on seq, which every signal and broadcast
+ * bumps. A broadcast only wakes the first waiter. Each waiter woken
+ * by it wakes the next one once it holds the caller's mutex, so the
+ * waiters come out one behind the other instead of all piling onto
+ * the mutex at once. This is wait morphing for a spinning
+ * NK_LOCK_T, which has no wait queue to move them onto.
+ */
 typedef struct nk_condvar {
     NK_LOCK_T lock;
     nk_thread_queue_t * wait_queue;
     unsigned nwaiters;
-    unsigned long long wakeup_seq;
-    unsigned long long woken_seq;
-    unsigned long long main_seq;
-    unsigned bcast_seq;
+    unsigned handoff;      /* broadcast wakeups still to be passed on */
+    uint32_t bcast_seq;    /* seq as of the last broadcast */
+    volatile uint32_t seq;
 } nk_condvar_t;
 
 int nk_condvar_init(nk_condvar_t * c);
 int nk_condvar_destroy(nk_condvar_t * c);
 uint8_t nk_condvar_wait(nk_condvar_t * c, NK_LOCK_T * l);
+int nk_condvar_timedwait(nk_condvar_t * c, NK_LOCK_T * l, uint64_t ns);
 int nk_condvar_signal(nk_condvar_t * c);
 int nk_condvar_bcast(nk_condvar_t * c);
 void nk_condvar_test(void);
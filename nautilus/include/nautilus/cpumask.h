@@ -0,0 +1,104 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __CPUMASK_H__
+#define __CPUMASK_H__
+
+#include <nautilus/naut_types.h>
+
+/* a set of CPUs, one bit per CPU id */
+
+#define NK_CPUMASK_WORDS ((NAUT_CONFIG_MAX_CPUS + 63) / 64)
+
+typedef struct nk_cpumask {
+    uint64_t bits[NK_CPUMASK_WORDS];
+} nk_cpumask_t;
+
+static inline void
+nk_cpumask_zero (nk_cpumask_t * m)
+{
+    int i;
+    for (i = 0; i < NK_CPUMASK_WORDS; i++) {
+        m->bits[i] = 0;
+    }
+}
+
+static inline void
+nk_cpumask_set (nk_cpumask_t * m, uint32_t cpu)
+{
+    m->bits[cpu / 64] |= 1ULL << (cpu % 64);
+}
+
+static inline void
+nk_cpumask_clear (nk_cpumask_t * m, uint32_t cpu)
+{
+    m->bits[cpu / 64] &= ~(1ULL << (cpu % 64));
+}
+
+static inline int
+nk_cpumask_test (const nk_cpumask_t * m, uint32_t cpu)
+{
+    return !!(m->bits[cpu / 64] & (1ULL << (cpu % 64)));
+}
+
+/* CPUs 0 .. n-1 */
+static inline void
+nk_cpumask_fill (nk_cpumask_t * m, uint32_t n)
+{
+    uint32_t i;
+    nk_cpumask_zero(m);
+    for (i = 0; i < n; i++) {
+        nk_cpumask_set(m, i);
+    }
+}
+
+static inline uint32_t
+nk_cpumask_count (const nk_cpumask_t * m)
+{
+    uint32_t n = 0;
+    int i;
+    for (i = 0; i < NK_CPUMASK_WORDS; i++) {
+        n += __builtin_popcountll(m->bits[i]);
+    }
+    return n;
+}
+
+/* first CPU in the set at or after cpu, NAUT_CONFIG_MAX_CPUS if none */
+static inline uint32_t
+nk_cpumask_next (const nk_cpumask_t * m, uint32_t cpu)
+{
+    uint64_t w;
+
+    while (cpu < NAUT_CONFIG_MAX_CPUS) {
+        w = m->bits[cpu / 64] & (~0ULL << (cpu % 64));
+        if (w) {
+            return (cpu & ~63U) + __builtin_ctzll(w);
+        }
+        cpu = (cpu & ~63U) + 64;
+    }
+
+    return NAUT_CONFIG_MAX_CPUS;
+}
+
+#define nk_cpumask_for_each(cpu, m)                 \
+    for ((cpu) = nk_cpumask_next((m), 0);           \
+         (cpu) < NAUT_CONFIG_MAX_CPUS;              \
+         (cpu) = nk_cpumask_next((m), (cpu) + 1))
+
+#endif
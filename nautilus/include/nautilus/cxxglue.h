@@ -36,6 +36,9 @@ struct atexit_func_entry_t
     void *dso_handle;
 };
 
+#ifdef NAUT_CONFIG_CXX_EXCEPTIONS
+#include <nautilus/unwind.h>
+#else
 typedef enum {
     _URC_NO_REASON = 0,
     _URC_FOREIGN_EXCEPTION_CAUGHT = 1,
@@ -56,10 +59,30 @@ struct _Unwind_Context {
     void * empty;
 };
 
+void _Unwind_Resume(void);
+#endif
+
 void __cxa_pure_virtual(void);
 int __cxa_atexit(void (*destructor)(void*), void * arg, void * __dso_handle);
 void __cxa_finalize(void *f);
-void _Unwind_Resume(void);
+
+/*
+ * A global whose constructor neither uses nor is used by any other
+ * constructor, so it can run on any core, in any order, alongside the
+ * rest. These run from xcall handlers, so they must not block.
+ *
+ *   static Table t NK_CXX_INDEPENDENT;
+ */
+#define NK_CXX_INDEPENDENT_PRIO 65500
+#define NK_CXX_INDEPENDENT __attribute__((init_priority(NK_CXX_INDEPENDENT_PRIO)))
+
+void nk_cxx_init(void);
+/* with NAUT_CONFIG_CXX_LAZY_INIT, call before first entering C++ */
+void nk_cxx_ensure_init(void);
+
+#ifdef NAUT_CONFIG_CXX_SLAB_ALLOC
+void nk_cxx_alloc_init(void);
+#endif
 
 #ifdef __cplusplus
 }
@@ -57,4 +57,5 @@
 #define EPIPE       32  /* Broken pipe */
 #define EDOM        33  /* Math argument out of domain of func */
 #define ERANGE      34  /* Math result not representable */
+#define ETIMEDOUT  110  /* Connection timed out */
 #endif
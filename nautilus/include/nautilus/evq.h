@@ -0,0 +1,102 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __EVQ_H__
+#define __EVQ_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/smp.h>
+#include <nautilus/nemo.h>
+
+/*
+ * Completion queues.
+ *
+ * Anything that finishes asynchronously -- a timer, a virtio request,
+ * an xcall, a NEMO event, or the caller's own code -- can post a
+ * completion to an nk_evq, from any core and from interrupt context.
+ * A thread waits on all of them with one sleep in nk_evq_wait() and
+ * takes whatever has arrived in one batch.
+ *
+ * A source is caller-owned storage saying which queue it posts to
+ * and what the completion looks like. It must stay put until it has
+ * posted; a source can be reused once its completion is dequeued.
+ * A full queue drops the completion and counts it.
+ */
+
+enum nk_evq_type {
+    NK_EVQ_USER,
+    NK_EVQ_TIMER,
+    NK_EVQ_IO,         /* data: status, or the queue for receives */
+    NK_EVQ_XCALL,
+    NK_EVQ_NEMO,       /* data: the event's payload */
+};
+
+struct nk_evq_event {
+    uint32_t type;
+    uint32_t tag;      /* the caller's */
+    uint64_t data;     /* filled in by the source, see above */
+    void *   ptr;      /* the caller's, or the request that completed */
+};
+
+typedef struct nk_evq nk_evq_t;
+
+typedef struct nk_evq_source {
+    nk_evq_t * q;
+    struct nk_evq_event ev;
+
+    /* for nk_evq_xcall() */
+    nk_xcall_func_t fun;
+    void * arg;
+} nk_evq_source_t;
+
+// size is rounded up to a power of two
+nk_evq_t * nk_evq_create(uint32_t size);
+void nk_evq_destroy(nk_evq_t * q);
+
+// 0, or -1 if the queue was full and the completion was dropped
+int nk_evq_post(nk_evq_t * q, const struct nk_evq_event * ev);
+
+// takes up to max completions, returns how many, never blocks
+int nk_evq_dequeue(nk_evq_t * q, struct nk_evq_event * evs, int max);
+// like nk_evq_dequeue, but sleeps until there is at least one
+int nk_evq_wait(nk_evq_t * q, struct nk_evq_event * evs, int max);
+
+void nk_evq_stats(nk_evq_t * q, uint64_t * posted, uint64_t * dropped);
+
+void nk_evq_source_init(nk_evq_source_t * src, nk_evq_t * q,
+                        enum nk_evq_type type, uint32_t tag, void * ptr);
+int  nk_evq_source_post(nk_evq_source_t * src);
+
+// posts after ns, returns the timer id for nk_timer_callback_cancel()
+int nk_evq_timer(nk_evq_source_t * src, uint64_t ns);
+// runs fun(arg) on cpu without waiting, and posts once it has
+int nk_evq_xcall(nk_evq_source_t * src, cpu_id_t cpu, nk_xcall_func_t fun, void * arg);
+// a NEMO event that posts, with its payload, wherever it is delivered
+nemo_event_id_t nk_evq_nemo_register(nk_evq_source_t * src);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
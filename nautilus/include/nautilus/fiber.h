@@ -0,0 +1,75 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __FIBER_H__
+#define __FIBER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Fibers are cooperative tasks that run inside the thread that
+ * started them. nk_fiber_run() turns the calling thread into their
+ * scheduler until all of them have finished. A fiber gives up the
+ * thread only by yielding, waiting or returning, and the switch
+ * saves nothing but the callee-saved registers, so one costs a few
+ * loads and stores rather than a trip through nk_thread_switch.
+ *
+ * Stacks are NAUT_CONFIG_FIBER_STACK_SIZE bytes and are recycled
+ * through a per-CPU pool. The thread is still preempted as usual;
+ * that just takes the running fiber along with it.
+ *
+ * A fiber must not block its thread (condvars, nk_join, ...) while
+ * others are waiting, since they cannot run until it returns. Wait
+ * with nk_fiber_wait() instead.
+ */
+
+typedef void (*nk_fiber_fun_t)(void *input);
+
+// returns nonzero once what the fiber waits for has happened
+typedef int (*nk_fiber_cond_t)(void *state);
+
+typedef struct nk_fiber nk_fiber_t;
+
+// queue a fiber on the calling thread, it first runs in nk_fiber_run()
+nk_fiber_t * nk_fiber_start(nk_fiber_fun_t fun, void *input);
+
+// run the calling thread's fibers until none are left
+int nk_fiber_run(void);
+
+// the fiber we are in, NULL outside of one
+nk_fiber_t * nk_fiber_current(void);
+
+// let the next ready fiber run
+void nk_fiber_yield(void);
+
+// let other fibers run until cond(state) holds
+void nk_fiber_wait(nk_fiber_cond_t cond, void *state);
+
+// low-level switch, in fiber_lowlevel.S
+void nk_fiber_switch(void **save_rsp, void *new_rsp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -46,6 +46,11 @@ extern "C" {
 struct naut_info;
 
 void fpu_init(struct naut_info *);
+void nk_fpu_state_init(void * state);
+uint32_t nk_fpu_state_size(void);
+uint64_t nk_fpu_xcr0(void);
+void nk_fpu_save(void * state);
+void nk_fpu_restore(void * state);
 
 #ifdef __cplusplus
 }
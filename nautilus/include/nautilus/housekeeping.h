@@ -0,0 +1,48 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __HOUSEKEEPING_H__
+#define __HOUSEKEEPING_H__
+
+#include <nautilus/cpumask.h>
+
+/*
+ * Housekeeping cores take the work that would otherwise interrupt
+ * every core: device IRQs are steered to them, IRQ threads and the
+ * printk_fast drain thread run on them, the HPET broadcast interrupt
+ * lands on the BSP, which is always one of them, and RCU callbacks
+ * queued on the other cores are run by them. The other cores are
+ * left with their own timer and xcalls.
+ *
+ * The set is CPU 0 through NAUT_CONFIG_HOUSEKEEPING_CPUS-1, unless the
+ * boot command line gives one, as in housekeeping=0-1,8
+ */
+
+struct naut_info;
+
+int nk_housekeeping_init(struct naut_info * naut);
+/* steer the IRQs assigned so far, again after late device init */
+int nk_housekeeping_steer_irqs(void);
+
+const nk_cpumask_t * nk_housekeeping_mask(void);
+int nk_is_housekeeping(int cpu);
+/* one of the housekeeping cores, spreading work round robin */
+int nk_housekeeping_cpu(void);
+
+#endif
@@ -0,0 +1,97 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __HRTIMER_H__
+#define __HRTIMER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * High-resolution kernel timers.
+ *
+ * Expiries are absolute TSC times kept in a binary heap on the core
+ * that started the timer, and the callback runs there, from the
+ * timer interrupt with interrupts off. Once the RT scheduler has
+ * taken over the local APIC timer (nk_hrtimer_program()), the timer
+ * is programmed, one-shot or TSC-deadline, for whichever comes first
+ * of the scheduler's own deadline and the earliest hrtimer. Before
+ * that, and in kernels that keep the periodic tick, expired timers
+ * are picked up on the next tick.
+ *
+ * A periodic timer is re-queued one period after its last expiry,
+ * skipping any periods that were missed entirely. The callback may
+ * restart or cancel its own timer.
+ */
+
+#define NK_HRTIMER_MAX 64   /* queued timers per core */
+
+#define NK_HRTIMER_IDLE    0
+#define NK_HRTIMER_QUEUED  1
+#define NK_HRTIMER_RUNNING 2
+
+struct nk_hrtimer;
+
+typedef void (*nk_hrtimer_fn_t)(struct nk_hrtimer * t, void * arg);
+
+struct nk_hrtimer {
+    uint64_t          expiry;   /* TSC */
+    uint64_t          period;   /* TSC cycles, 0 for a one-shot */
+    nk_hrtimer_fn_t   fn;
+    void *            arg;
+    volatile uint32_t cpu;      /* core whose heap it is on */
+    volatile uint32_t state;
+    uint32_t          idx;      /* heap slot while queued */
+};
+
+void nk_hrtimer_init(struct nk_hrtimer * t, nk_hrtimer_fn_t fn, void * arg);
+
+/* fire ns nanoseconds from now, then every period_ns if that is non-zero */
+int nk_hrtimer_start(struct nk_hrtimer * t, uint64_t ns, uint64_t period_ns);
+/* the same, with an absolute TSC expiry and a period in cycles */
+int nk_hrtimer_start_tsc(struct nk_hrtimer * t, uint64_t tsc, uint64_t period);
+
+/*
+ * returns 0 if the timer was stopped before it fired, 1 if it had
+ * fired or is running. A running callback on another core is waited
+ * for, so the timer can be freed once this returns.
+ */
+int nk_hrtimer_cancel(struct nk_hrtimer * t);
+
+/* earliest expiry queued on this core, 0 if none */
+uint64_t nk_hrtimer_next(void);
+
+/*
+ * The RT scheduler's timer. tsc is the absolute time it wants to be
+ * interrupted at (0 for never), and from the first call on this core
+ * the hrtimer code owns the APIC timer.
+ */
+void nk_hrtimer_program(uint64_t tsc);
+
+/* run expired timers, called from the timer interrupt */
+void nk_hrtimer_run(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
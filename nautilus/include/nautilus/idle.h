@@ -30,4 +30,18 @@ void screensaver(void * in, void ** out);
 void side_screensaver(void * in, void ** out);
 void idle(void * in, void ** out);
 
+#ifdef NAUT_CONFIG_MWAIT_WAKEUP
+/*
+ * Idle cores MWAIT on a word of their own, and a core that queues work
+ * for one wakes it by clearing the word. nk_idle_wake() returns 1 if
+ * it did that, and 0 if the core is not waiting there, in which case
+ * it takes an IPI to get its attention.
+ */
+int  nk_idle_wake(int cpu);
+/* interrupts off on entry, on at return */
+void nk_idle_mwait(uint32_t hint);
+#else
+static inline int nk_idle_wake(int cpu) { return 0; }
+#endif
+
 #endif
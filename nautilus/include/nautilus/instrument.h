@@ -30,14 +30,148 @@ extern "C" {
 
 #define INSTR_CAL_LOOPS 1000
 
+/*
+ * Profiled regions.
+ *
+ * Every NK_PROFILE_ENTRY site owns a static nk_prof_site, gathered by
+ * the linker into one array. A site's ID is its index there, so
+ * recording a call is an array access in the current CPU's counters
+ * with no lookup. Entry times go on the running thread's shadow stack,
+ * and the matching exit pops them, so every entry must be paired with
+ * an exit on every path out of the region.
+ *
+ * With PROFILE_FUNCTIONS every function is also instrumented through
+ * -finstrument-functions. A function's ID is its offset into .text in
+ * 16-byte units. Functions are aligned to 16 bytes in that build, so
+ * the layout fixed at link time gives each function its own ID.
+ */
+#define NK_PROF_SHADOW_DEPTH 32
+#define NK_PROF_FUNC_SHIFT   4
+
+struct nk_prof_site {
+    const char * name;
+};
+
+/* per-CPU counters, one per site or function */
+struct nk_prof_slot {
+    uint64_t calls;
+    uint64_t cycles;
+    uint64_t max_cycles;
+};
+
+struct nk_prof_frame {
+    const void * key;   /* site or function */
+    uint64_t tsc;
+};
+
+/*
+ * Log-linear latency histograms, in the style of HdrHistogram. Each
+ * power of two is split into 2^NK_HDR_SUB_BITS buckets, so a value is
+ * kept to within about 6%. Values are in cycles, anything at or above
+ * 2^40 lands in the last bucket.
+ */
+#define NK_HDR_SUB_BITS 4
+#define NK_HDR_BUCKETS  ((40 - NK_HDR_SUB_BITS + 1) << NK_HDR_SUB_BITS)
+
+struct nk_hdr_hist {
+    uint64_t count;
+    uint64_t max;
+    uint32_t bucket[NK_HDR_BUCKETS];
+};
+
+static inline unsigned
+nk_hdr_index (uint64_t v)
+{
+    unsigned e, idx;
+
+    if (v < (1ULL << NK_HDR_SUB_BITS)) {
+        return v;
+    }
+
+    e   = 63 - __builtin_clzll(v);
+    idx = ((e - NK_HDR_SUB_BITS + 1) << NK_HDR_SUB_BITS) +
+          ((v >> (e - NK_HDR_SUB_BITS)) & ((1 << NK_HDR_SUB_BITS) - 1));
+
+    return idx < NK_HDR_BUCKETS ? idx : NK_HDR_BUCKETS - 1;
+}
+
+static inline void
+nk_hdr_record (struct nk_hdr_hist * h, uint64_t v)
+{
+    h->bucket[nk_hdr_index(v)]++;
+    h->count++;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+/*
+ * Lock contention profiling (LOCK_PROFILE). Sites are gathered by the
+ * linker like profiled regions and their counters are per-CPU slots
+ * indexed by site. Locks taken on a CPU are remembered on a small
+ * per-CPU stack until released, which gives the hold time. A lock
+ * released on another CPU, or taken past the stack's depth, is still
+ * counted but has no hold time.
+ */
+#define NK_LOCK_HELD_DEPTH 16
+
+struct nk_lock_site {
+    const char * file;
+    const char * func;
+    uint64_t     line;
+};
+
+struct nk_lock_slot {
+    uint64_t acquires;
+    uint64_t contended;
+    uint64_t wait_cycles;
+    uint64_t wait_max;
+    uint64_t holds;
+    uint64_t hold_cycles;
+    uint64_t hold_max;
+};
+
+struct nk_lock_held {
+    volatile uint32_t * lock;
+    struct nk_lock_site * site;
+    uint64_t tsc;
+};
+
+#ifdef NAUT_CONFIG_LOCK_PROFILE
+#define NK_LOCK_SITE()                                                   \
+    ({                                                                   \
+        static struct nk_lock_site __nk_lock_site                        \
+            __attribute__((section("nk_lock_sites"), used, aligned(8)))  \
+            = { __FILE__, __func__, __LINE__ };                          \
+        &__nk_lock_site;                                                 \
+    })
+#endif
+
+/* histograms are kept per real-time class, everything is APERIODIC without the RT scheduler */
+#define NK_PROF_CLASSES 3
+
+typedef enum { NK_PROF_SWITCH = 0,    /* cost of a context switch */
+               NK_PROF_IRQ_WAKE = 1   /* interrupt arrival to first run of the thread it woke */
+} nk_prof_hist_t;
+
 #ifdef NAUT_CONFIG_PROFILE
-#define NK_PROFILE_ENTRY() nk_profile_func_enter(__func__)
-#define NK_PROFILE_ENTRY_NAME(s) nk_profile_func_enter(#s)
-#define NK_PROFILE_EXIT_NAME(s) nk_profile_func_exit(#s)
-#define NK_PROFILE_EXIT() nk_profile_func_exit(__func__)
+#define NK_PROF_WAKEUP(t) nk_prof_wakeup(t)
+#define NK_PROFILE_SITE(s)                                              \
+    do {                                                                \
+        static struct nk_prof_site __nk_prof_site                       \
+            __attribute__((section("nk_prof_sites"), used, aligned(8))) \
+            = { s };                                                    \
+        nk_profile_site_enter(&__nk_prof_site);                         \
+    } while (0)
+
+#define NK_PROFILE_ENTRY() NK_PROFILE_SITE(__func__)
+#define NK_PROFILE_ENTRY_NAME(s) NK_PROFILE_SITE(#s)
+#define NK_PROFILE_EXIT_NAME(s) nk_profile_site_exit()
+#define NK_PROFILE_EXIT() nk_profile_site_exit()
 #define NK_MALLOC_PROF_ENTRY() nk_malloc_enter()
 #define NK_MALLOC_PROF_EXIT() nk_malloc_exit()
 #else
+#define NK_PROF_WAKEUP(t)
 #define NK_PROFILE_ENTRY() 
 #define NK_PROFILE_EXIT()
 #define NK_PROFILE_ENTRY_NAME(s)
@@ -46,8 +180,6 @@ extern "C" {
 #define NK_MALLOC_PROF_EXIT()
 #endif
 
-struct nk_hashtable;
-
 struct malloc_data {
     uint64_t count;
     uint64_t start_count;
@@ -73,20 +205,41 @@ struct thread_switch_data {
 };
 
 struct nk_instr_data {
-    struct nk_hashtable * func_htable;
+    struct nk_prof_slot * sites;
+    struct nk_prof_slot * funcs;    /* PROFILE_FUNCTIONS only */
     struct irq_data irqstat;
     struct malloc_data mallocstat;
     struct thread_switch_data thr_switch;
+    uint64_t switch_tsc;
+    uint64_t irq_tsc;               /* arrival of the outermost interrupt */
+    uint32_t irq_depth;
+    struct nk_hdr_hist switch_hist[NK_PROF_CLASSES];
+    struct nk_hdr_hist wake_hist[NK_PROF_CLASSES];
+#ifdef NAUT_CONFIG_LOCK_PROFILE
+    struct nk_lock_slot * locks;
+    struct nk_lock_held held[NK_LOCK_HELD_DEPTH];
+    uint32_t nheld;
+#endif
 };
 
 
-void nk_profile_func_enter(const char * func);
-void nk_profile_func_exit(const char * func);
+void nk_profile_site_enter(struct nk_prof_site * site);
+void nk_profile_site_exit(void);
 void nk_thr_switch_prof_enter(void);
 void nk_thr_switch_prof_exit(void);
 void nk_irq_prof_enter(void);
 void nk_irq_prof_exit(void);
 
+struct nk_thread;
+void nk_prof_wakeup(struct nk_thread * t);
+
+/* pct in hundredths of a percent (9990 is p99.9), cpu -1 merges all cores */
+uint64_t nk_prof_percentile(nk_prof_hist_t which, int cpu, int rt_class, uint32_t pct);
+
+/* start is 0 for an acquire that did not have to wait */
+void nk_lock_prof_acquired(volatile uint32_t * lock, struct nk_lock_site * site, uint64_t start);
+void nk_lock_prof_released(volatile uint32_t * lock);
+
 void nk_malloc_enter(void);
 void nk_malloc_exit(void);
 void nk_instrument_init(void);
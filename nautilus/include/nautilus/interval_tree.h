@@ -0,0 +1,64 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __INTERVAL_TREE_H__
+#define __INTERVAL_TREE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+#include <nautilus/rbtree.h>
+
+/*
+ * Intrusive interval tree on the augmented rbtree
+ *
+ * Intervals are closed, [start, last], and kept in order of start. Each
+ * node also knows the largest last in its subtree, which is what lets a
+ * search for overlaps skip whole subtrees. Embed a struct
+ * nk_interval_node and use rb_entry() to get back to the container.
+ *
+ *     struct nk_interval_node * n;
+ *     for (n = nk_interval_tree_iter_first(root, s, l); n;
+ *          n = nk_interval_tree_iter_next(n, s, l))
+ *         ... n overlaps [s, l] ...
+ */
+struct nk_interval_node {
+    struct rb_node rb;
+    uint64_t start;
+    uint64_t last;
+    uint64_t subtree_last;
+};
+
+void nk_interval_tree_insert(struct nk_interval_node * node, struct rb_root_cached * root);
+void nk_interval_tree_remove(struct nk_interval_node * node, struct rb_root_cached * root);
+
+// the first interval overlapping [start, last] in order of start, NULL if none
+struct nk_interval_node * nk_interval_tree_iter_first(struct rb_root_cached * root,
+                                                      uint64_t start, uint64_t last);
+// the one after node
+struct nk_interval_node * nk_interval_tree_iter_next(struct nk_interval_node * node,
+                                                     uint64_t start, uint64_t last);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -102,6 +102,11 @@ inline void nk_mask_irq(uint8_t irq);
 inline void nk_unmask_irq(uint8_t irq);
 inline uint8_t nk_irq_is_assigned(uint8_t irq);
 
+struct nk_cpumask;
+int nk_irq_set_affinity(uint8_t irq, int cpu);
+int nk_irq_get_affinity(uint8_t irq);
+int nk_irq_steer_all(struct nk_cpumask * cpus);
+
 inline uint8_t irq_to_vec (uint8_t irq);
 inline void irqmap_set_ioapic (uint8_t irq, struct ioapic * ioapic);
 void disable_8259pic(void);
@@ -112,9 +117,37 @@ int register_irq_handler (uint16_t irq,
 int register_int_handler (uint16_t int_vec,
                           int (*handler)(excp_entry_t *, excp_vec_t),
                           void * priv_data);
+int nk_int_vec_reserve (uint16_t n, int aligned, uint8_t * first);
+void nk_int_vec_release (uint8_t first, uint16_t n);
 
 int nk_int_init(struct sys_info * sys);
 
+#ifdef NAUT_CONFIG_THREADED_IRQS
+/*
+ * Threaded IRQs
+ *
+ * The top half runs in interrupt context: it calls ack() to quiet
+ * the device (and grab anything that must be read right away), EOIs,
+ * and wakes the IRQ's kernel thread, which calls work() with
+ * interrupts on. With a coalescing window, interrupts that arrive
+ * within coalesce_ns of the first one are folded into a single
+ * bottom half pass.
+ *
+ * Handlers registered before nk_irq_threads_start() run work()
+ * directly from the top half until their thread exists.
+ */
+typedef void (*nk_irq_ack_t)(void * priv_data);
+typedef void (*nk_irq_work_t)(void * priv_data);
+
+int register_threaded_irq_handler (uint16_t irq,
+                                   nk_irq_ack_t ack,
+                                   nk_irq_work_t work,
+                                   void * priv_data,
+                                   uint64_t coalesce_ns);
+
+int nk_irq_threads_start(void);
+#endif
+
 uint8_t nk_int_matches_bus(struct nk_int_entry * entry, const char * bus_type, const uint8_t len);
 void nk_add_bus_entry(const uint8_t bus_id, const char * bus_type);
 void nk_add_int_entry (int_trig_t trig_mode,
@@ -0,0 +1,64 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __LOADAVG_H__
+#define __LOADAVG_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Per-core load averages. Each core samples itself from the scheduler
+ * about once every NAUT_CONFIG_LOAD_AVG_INTERVAL_US and folds the
+ * sample into exponentially decayed averages. These are published in
+ * a cache line of its own, under a sequence count, so any core can
+ * read them at any time without a lock and without disturbing the
+ * owner.
+ *
+ * A core that is not scheduling does not sample. When it does next,
+ * the intervals it missed are folded in with the sample it takes
+ * then. A reader sees how old a snapshot is from its stamp.
+ */
+#define NK_LOAD_SHIFT 16
+#define NK_LOAD_ONE   (1ULL << NK_LOAD_SHIFT)
+
+struct nk_load {
+    uint64_t stamp;         /* TSC of the last sample, 0 if never sampled */
+    uint64_t runnable;      /* threads running or ready to, NK_LOAD_ONE per thread */
+    uint64_t rt_util;       /* committed real-time utilization, 100000 for a whole core */
+    uint64_t idle;          /* share of time idle, NK_LOAD_ONE for all of it */
+};
+
+/* called by the scheduler: has this core's interval passed? */
+int nk_load_due(void);
+void nk_load_sample(uint64_t runnable, uint64_t rt_util, int idle);
+
+/* a consistent snapshot of cpu's averages, -1 if it has none yet */
+int nk_load_read(int cpu, struct nk_load *load);
+
+void nk_load_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
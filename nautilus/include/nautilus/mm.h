@@ -59,6 +59,9 @@ ulong_t mm_boot_last_pfn(void);
 int mm_boot_init (ulong_t mbd);
 void mm_boot_kmem_init(void);
 void mm_boot_kmem_cleanup(void);
+#ifdef NAUT_CONFIG_KMEM_PARALLEL_INIT
+void mm_boot_kmem_init_remote(void);
+#endif
 
 void mm_dump_page_map(void);
 
@@ -74,8 +77,40 @@ void mm_boot_free(void *addr, ulong_t size);
 
 /* KMEM FUNCTIONS */
 
+#ifdef NAUT_CONFIG_KMEM_MAGAZINES
+/* one magazine per order, 32 bytes (MIN_ORDER in kmem.c) through 4KB */
+#define KMEM_MAG_ORDERS 8
+
+struct kmem_magazine {
+    uint64_t count;
+    void *   blocks[NAUT_CONFIG_KMEM_MAGAZINE_SIZE];
+};
+#endif
+
+#ifdef NAUT_CONFIG_KMEM_STATS
+/* block orders counted individually, larger ones share the last slot */
+#define KMEM_STAT_ORDERS 48
+
+struct kmem_order_stats {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t fails;
+};
+#endif
+
 struct kmem_data {
     struct list_head ordered_regions;
+#ifdef NAUT_CONFIG_KMEM_MAGAZINES
+    struct kmem_magazine mags[KMEM_MAG_ORDERS];
+#endif
+#ifdef NAUT_CONFIG_KMEM_STATS
+    struct kmem_order_stats stats[KMEM_STAT_ORDERS];
+#endif
+#ifdef NAUT_CONFIG_KMEM_REMOTE_FREE
+    /* our blocks freed by other CPUs, linked through their first word;
+       on a line of its own so pushing does not disturb the magazines */
+    void * volatile remote_free __attribute__((aligned(64)));
+#endif
 };
 
 int nk_kmem_init(void);
@@ -87,6 +122,38 @@ struct mem_region * kmem_get_region_by_addr(ulong_t addr);
 void kmem_add_memory(struct mem_region * mem, ulong_t base_addr, size_t size);
 void * malloc(size_t size);
 void free(void * addr);
+int kmem_is_block(void * addr);
+void * malloc_zeroed(size_t size);
+void * malloc_node(size_t size, unsigned node);
+void * malloc_huge(size_t size, ulong_t page_size);
+#ifdef NAUT_CONFIG_KMEM_PAGE_COLORS
+void * malloc_colored(size_t size, uint64_t colors);
+int kmem_page_colors(void);
+int kmem_reserve_colors(uint64_t colors);
+uint64_t kmem_colors_reserved(void);
+#endif
+#ifdef NAUT_CONFIG_KMEM_NUMA_SPILL
+uint64_t kmem_node_free(unsigned node);
+#endif
+#ifdef NAUT_CONFIG_KMEM_INTERLEAVE
+void * malloc_interleave(size_t size, size_t stride);
+#endif
+#ifdef NAUT_CONFIG_KMEM_PREZERO
+/* called by idle threads, 1 if it zeroed a block */
+int kmem_prezero_idle(void);
+#endif
+
+struct buddy_mempool;
+struct buddy_stats;
+
+#ifdef NAUT_CONFIG_NUMA_BENCH
+void kmem_order_regions(const uint32_t * cost);
+#endif
+
+#if defined(NAUT_CONFIG_KMEM_SLAB) || defined(NAUT_CONFIG_KMEM_INTERLEAVE)
+void * kmem_alloc_block(ulong_t order, struct buddy_mempool ** zone);
+void kmem_free_block(struct buddy_mempool * zone, void * block, ulong_t order);
+#endif
 
 
 /* arch specific */
@@ -96,4 +163,18 @@ void arch_reserve_boot_regions(unsigned long mbd);
 
 void kmem_dump_my_view();
 
+#ifdef NAUT_CONFIG_KMEM_STATS
+/* a snapshot of the allocator, summed over all CPUs */
+struct nk_kmem_stats {
+    uint64_t bytes_managed;
+    uint64_t bytes_allocated;
+    uint64_t num_zones;
+    struct kmem_order_stats orders[KMEM_STAT_ORDERS];
+};
+
+int nk_kmem_stats(struct nk_kmem_stats * stats);
+int nk_kmem_zone_stats(unsigned zone, struct buddy_stats * stats);
+void nk_kmem_stats_dump(void);
+#endif
+
 #endif /* !__MM_H__! */
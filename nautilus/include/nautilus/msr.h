@@ -35,6 +35,8 @@ extern "C" {
 #define     MSR_APIC_IS_BSP(x)   (x & 0x100)
 #define     MSR_APIC_GET_ADDR(x) ((x >> 12) & 0xfffff) 
 #define IA32_MISC_ENABLES  0x1a0
+#define IA32_MSR_TSC_DEADLINE 0x6e0
+#define IA32_MSR_TSC_ADJUST   0x3b
 
 #define MSR_FS_BASE 0xc0000100
 #define MSR_GS_BASE 0xc0000101
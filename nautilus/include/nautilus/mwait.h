@@ -66,6 +66,7 @@ nk_mwait (uint32_t eax, uint32_t ecx)
 }
 
 int nk_mwait_init(void);
+uint8_t nk_mwait_cstates(void);
 
 
 #ifdef __cplusplus
@@ -172,6 +172,10 @@ uint64_t atox (const char * buf);
 uint64_t strtox (const char * nptr, char ** endptr);
 void str_toupper (char * s);
 void str_tolower (char * s);
+// choose how memcpy()/memset() work on this CPU, once on the BSP
+void nk_string_init (void);
+// switch to the SIMD string routines once every core has run fpu_init()
+void nk_string_simd_init (void);
 
 
 #ifdef __cplusplus
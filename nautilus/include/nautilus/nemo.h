@@ -24,27 +24,36 @@
 #define __NEMO_H__
 
 
+#include <nautilus/naut_types.h>
+
 #define NEMO_MAX_EVENTS 1024
 #define NEMO_INT_VEC    0xe8
 
+/* per-CPU event ring, must be a power of two */
+#define NEMO_RING_SIZE  256
 
 typedef void (*nemo_action_t)(void);
+typedef void (*nemo_data_action_t)(uint64_t payload, void * priv_data);
 
 typedef int nemo_event_id_t;
 
 typedef struct nemo_event {
-	nemo_action_t   action;
-	nemo_event_id_t id;
-	void *          priv_data;
+	nemo_action_t      action;
+	nemo_data_action_t data_action; /* used instead of action if set */
+	nemo_event_id_t    id;
+	void *             priv_data;
 } nemo_event_t;
 
 
 int nemo_init(void);
 nemo_event_id_t nemo_register_event_action(void (*func)(void), void * priv_data);
+nemo_event_id_t nemo_register_event_data_action(nemo_data_action_t func, void * priv_data);
 void nemo_unregister_event_action(nemo_event_id_t eid);
-void nemo_event_notify(nemo_event_id_t eid, int cpu);
+int nemo_event_notify(nemo_event_id_t eid, int cpu);
+int nemo_event_notify_data(nemo_event_id_t eid, int cpu, uint64_t payload);
 void nemo_event_broadcast(nemo_event_id_t eid);
 void nemo_event_await(void);
+void nemo_get_stats(int cpu, uint64_t * handled, uint64_t * ipis);
 
 
 
@@ -40,6 +40,11 @@ struct numa_domain {
 
     /* list of other domains, ordered by distance */
     struct list_head adj_list;
+
+#ifdef NAUT_CONFIG_KMEM_NUMA_SPILL
+    /* bytes free in the domain's kmem zones */
+    volatile uint64_t free_bytes;
+#endif
 };
 
 struct buddy_mempool;
@@ -75,6 +80,12 @@ struct mem_region {
 struct nk_locality_info {
     uint32_t  num_domains;
     uint8_t * numa_matrix;
+#ifdef NAUT_CONFIG_NUMA_BENCH
+    /* filled in by nk_numa_bench(), NULL until then */
+    uint8_t  * slit_matrix;    /* firmware distances the measured ones replaced */
+    uint32_t * lat_ns;         /* num_cpus x num_domains, load latency */
+    uint32_t * bw_mbs;         /* num_cpus x num_domains, triad bandwidth in MB/s */
+#endif
 
     struct numa_domain * domains[MAX_NUMA_DOMAINS];
 };
@@ -87,6 +98,22 @@ unsigned nk_my_numa_node(void);
 unsigned nk_get_num_domains(void);
 struct mem_region * nk_get_base_region_by_cpu(cpu_id_t cpu);
 struct mem_region * nk_get_base_region_by_num (unsigned num);
+#ifdef NAUT_CONFIG_NUMA_BENCH
+int nk_numa_bench(void);
+void nk_numa_bench_dump(void);
+#endif
+
+/* SMT topology, from the coordinates of every core */
+int nk_topo_init(void);
+unsigned nk_topo_threads_per_core(void);
+unsigned nk_topo_num_phys_cores(void);
+// dense index of the physical core the CPU belongs to
+unsigned nk_topo_phys_core(cpu_id_t cpu);
+int nk_topo_same_core(cpu_id_t a, cpu_id_t b);
+// the other hardware threads of the CPU's core, returns how many
+int nk_topo_siblings(cpu_id_t cpu, cpu_id_t * sibs, int max);
+// the idx-th CPU when filling physical cores before their siblings
+cpu_id_t nk_topo_spread_cpu(unsigned idx);
 
 
 struct nk_topo_params {
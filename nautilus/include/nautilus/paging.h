@@ -100,8 +100,68 @@ typedef enum {
 int nk_map_page (addr_t vaddr, addr_t paddr, uint64_t flags, page_size_t ps);
 int nk_map_page_nocache (addr_t paddr, uint64_t flags, page_size_t ps);
 void nk_paging_init(struct nk_mem_info * mem, ulong_t mbd);
+page_size_t nk_kern_page_size(void);
 int nk_pf_handler(excp_entry_t * excp, excp_vec_t vector, addr_t fault_addr);
 
+#ifdef NAUT_CONFIG_PAGE_FAULT_STATS
+/*
+ * Page faults counted per CPU and by how they were resolved, with
+ * the cycles spent on the ones that were handled and the number
+ * taken while a real-time thread was running.
+ */
+typedef enum {
+    NK_PF_STACK = 0,   /* lazy stack grown with demand-zero pages */
+    NK_PF_SPURIOUS,    /* translation was already valid, e.g. stale TLB */
+    NK_PF_UPCALL,      /* HRT upcall */
+    NK_PF_FATAL,
+    NK_PF_TYPES,
+} nk_pf_type_t;
+
+struct nk_pf_stats {
+    uint64_t count[NK_PF_TYPES];
+    uint64_t cycles;   /* in faults that were handled */
+    uint64_t rt;       /* taken by real-time threads */
+};
+
+int nk_pf_stats(int cpu, struct nk_pf_stats * stats);
+void nk_pf_stats_dump(void);
+#endif
+
+#ifdef NAUT_CONFIG_THREAD_LAZY_STACKS
+/*
+ * Thread stacks that are reserved in a virtual window and backed
+ * with 4KB pages as they are first touched. Each stack has a 4MB
+ * slot: the lower 2MB are never mapped and act as the guard, the
+ * upper 2MB hold the stack, which grows down from the slot's top.
+ */
+#define NK_VSTACK_BASE      0xffff808000000000ULL
+#define NK_VSTACK_SLOT_SIZE (4UL << 20)
+#define NK_VSTACK_MAX       (2UL << 20)
+#define NK_VSTACK_SIZE      ((uint64_t)NAUT_CONFIG_THREAD_LAZY_STACK_SLOTS * NK_VSTACK_SLOT_SIZE)
+
+void * nk_vstack_alloc(ulong_t size);
+void nk_vstack_free(void * stack);
+
+static inline int
+nk_vstack_owns (void * addr)
+{
+    return (addr_t)addr >= NK_VSTACK_BASE && (addr_t)addr - NK_VSTACK_BASE < NK_VSTACK_SIZE;
+}
+#endif
+
+#ifdef NAUT_CONFIG_KMEM_INTERLEAVE
+/*
+ * A window of virtual address space outside the identity map. Its
+ * page directories are made at boot, so 2MB pages can be mapped into
+ * it later without allocating page tables.
+ */
+#define NK_REMAP_BASE 0xffff800000000000ULL
+#define NK_REMAP_SIZE ((uint64_t)NAUT_CONFIG_KMEM_INTERLEAVE_WINDOW_GB << 30)
+
+int nk_remap_2mb(addr_t vaddr, addr_t paddr);
+void nk_unmap_2mb(addr_t vaddr);
+#endif
+
 #define PAGE_SHIFT_4KB 12UL
 #define PAGE_SHIFT_2MB 21UL
 #define PAGE_SHIFT_1GB 30UL
@@ -0,0 +1,82 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Parallel loops and task groups on a pool of worker threads, one
+ * bound to each core (other than the housekeeping cores), started
+ * once at boot. Nothing is created per parallel region; a region
+ * just hands work items to workers that are already there.
+ *
+ * A loop's range is split into one contiguous block per
+ * participant, the caller included, with the participants ordered
+ * by NUMA domain so that neighbouring blocks land on the same
+ * domain. With NK_PAR_STATIC each participant runs its own block
+ * and nothing more. With NK_PAR_DYNAMIC it takes grain-sized chunks
+ * of its block, then of the others', nearest first. NK_PAR_GUIDED
+ * is the same, but each chunk is half of what is left of the block,
+ * down to grain.
+ *
+ * Loops run one at a time; a loop started from inside a worker runs
+ * serially in the caller.
+ */
+
+typedef enum {
+    NK_PAR_STATIC,
+    NK_PAR_DYNAMIC,
+    NK_PAR_GUIDED,
+} nk_par_sched_t;
+
+// runs iterations [begin, end)
+typedef void (*nk_par_for_fn_t)(uint64_t begin, uint64_t end, void *state);
+
+typedef void (*nk_task_fn_t)(void *arg);
+
+typedef struct nk_task_group {
+    volatile uint64_t pending;
+} nk_task_group_t;
+
+int nk_parallel_init(void);
+
+// dynamic scheduling
+int nk_parallel_for(uint64_t begin, uint64_t end, uint64_t grain,
+                    nk_par_for_fn_t fn, void *state);
+
+int nk_parallel_for_sched(uint64_t begin, uint64_t end, uint64_t grain,
+                          nk_par_sched_t sched, nk_par_for_fn_t fn, void *state);
+
+void nk_task_group_init(nk_task_group_t *g);
+// fn(arg) runs on some worker, or right here if there is no pool
+int  nk_task_group_spawn(nk_task_group_t *g, nk_task_fn_t fn, void *arg);
+// runs queued tasks itself until all of the group's are done
+void nk_task_group_wait(nk_task_group_t *g);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
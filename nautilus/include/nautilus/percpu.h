@@ -129,6 +129,40 @@ get_cpu (void)
     return (struct cpu*)msr_read(MSR_GS_BASE);
 }
 
+/* the same, without the MSR read */
+static inline struct cpu*
+this_cpu (void)
+{
+    return per_cpu_get(self);
+}
+
+
+/*
+ * Per-CPU variables kept outside struct cpu. DEFINE_PER_CPU puts the
+ * variable in the nk_percpu section, which is only a template: each
+ * core gets its own copy of the section in nk_percpu_init(), and its
+ * struct cpu holds the distance from the template to that copy. This
+ * core's copy is then one %gs-relative load and an add away.
+ */
+#define DEFINE_PER_CPU(type, name) \
+    __attribute__((section("nk_percpu"))) __typeof__(type) per_cpu__##name
+
+#define DECLARE_PER_CPU(type, name) \
+    extern __typeof__(type) per_cpu__##name
+
+#define this_cpu_ptr(name) \
+    ((__typeof__(&per_cpu__##name))((char*)&per_cpu__##name + per_cpu_get(percpu_off)))
+
+#define this_cpu_read(name)       (*this_cpu_ptr(name))
+#define this_cpu_write(name, val) (*this_cpu_ptr(name) = (val))
+
+// another core's copy
+#define per_cpu_ptr(name, cpu)                                       \
+    ((__typeof__(&per_cpu__##name))((char*)&per_cpu__##name +        \
+        nk_get_nautilus_info()->sys.cpus[(cpu)]->percpu_off))
+
+int nk_percpu_init(struct naut_info * naut);
+
 #ifdef __cplusplus
 }
 #endif
@@ -49,6 +49,21 @@
 #define PERF_CTL_MSR_N(n) (AMD_PERF_CTL0_MSR + 2*(n))
 #define PERF_CTR_MSR_N(n) (AMD_PERF_CTR0_MSR + 2*(n))
 
+/* Intel architectural PMU, the event select layout matches pmc_ctl_t */
+#define INTEL_PERFEVTSEL0_MSR      0x186
+#define INTEL_PMC0_MSR             0xc1
+#define INTEL_PERF_GLOBAL_STATUS   0x38e
+#define INTEL_PERF_GLOBAL_CTRL     0x38f
+#define INTEL_PERF_GLOBAL_OVF_CTRL 0x390
+
+#define INTEL_PMC_CORE_CYCLES      0x3c // unhalted core cycles, unit mask 0
+#define INTEL_PMC_INSTR_RETIRED    0xc0 // unit mask 0
+#define INTEL_PMC_LLC_MISS         0x2e // unit mask 0x41
+#define INTEL_PMC_BRANCH_MISS      0xc5 // unit mask 0
+
+/* counters are at least this wide on both vendors */
+#define PMC_CTR_MASK ((1ULL << 48) - 1)
+
 
 /* EVENTS */
 
@@ -56,6 +71,8 @@
 #define AMD_PMC_ICACHE_MISS  0x81 // PERF_CTL[2:0]
 #define AMD_PMC_L2_MISS      0x7e // PERF_CTL[2:0]
 #define AMD_PMC_TLB_MISS     0x46 // PERF_CTL[2:0]
+#define AMD_PMC_CPU_CLOCKS   0x76 // PERF_CTL[5:0]
+#define AMD_PMC_INSTR_RETIRED 0xc0 // PERF_CTL[5:0]
 
 /* Counts the number of SMIs received. */
 #define AMD_PMC_SMI_CNT      0x2b // PERF_CTL[5:0]
@@ -127,6 +144,28 @@ typedef struct pmc_ctl {
 } __attribute__((packed)) pmc_ctl_t;
 
 
+/* what the core's general-purpose counters are, see pmc_detect() */
+typedef enum { PMC_ARCH_NONE = 0, PMC_ARCH_INTEL = 1, PMC_ARCH_AMD = 2 } pmc_arch_t;
+
+struct pmc_hw {
+    pmc_arch_t arch;
+    uint8_t num;        /* general-purpose counters, at most 8 */
+    uint8_t global;     /* Intel v2+: global control and status MSRs */
+};
+
+const struct pmc_hw * pmc_detect(void);
+uint32_t pmc_ctl_msr(uint8_t idx);
+uint32_t pmc_ctr_msr(uint8_t idx);
+uint8_t pmc_event_slots(uint8_t event_id);
+
+/*
+ * Counters held machine-wide, by assign_perf_event() or the sampler.
+ * Per-thread counter sets only use the rest.
+ */
+void pmc_reserve(uint8_t idx);
+void pmc_unreserve(uint8_t idx);
+uint8_t pmc_reserved_mask(void);
+
 perf_event_t * assign_perf_event(uint8_t event_id, uint8_t unit_mask);
 void release_perf_event(perf_event_t * event);
 
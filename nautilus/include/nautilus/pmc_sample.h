@@ -0,0 +1,68 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __PMC_SAMPLE_H__
+#define __PMC_SAMPLE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Sampling profiler driven by performance counter overflow.
+ *
+ * Every core counts unhalted cycles in one counter, preloaded so that
+ * it overflows after the sampling period. Each overflow interrupt
+ * appends the interrupted RIP, the running thread and up to
+ * NK_SAMPLE_DEPTH return addresses to the core's own buffer. Once a
+ * buffer fills, later samples are counted as dropped. The counter
+ * interrupt is a normal vector, so code that runs with interrupts
+ * off is charged to the point where it turns them back on.
+ *
+ * Addresses are not symbolized here. Feed them to addr2line or nm
+ * against nautilus.bin.
+ */
+#define NK_SAMPLE_DEPTH 8
+
+struct nk_sample {
+    uint64_t rip;
+    uint32_t tid;
+    uint32_t depth;                     /* valid entries in calls */
+    uint64_t calls[NK_SAMPLE_DEPTH];    /* return addresses, innermost first */
+};
+
+int  nk_sample_start(uint64_t period);  /* cycles between samples, on every core */
+void nk_sample_stop(void);
+void nk_sample_reset(void);
+uint64_t nk_sample_read(int cpu, struct nk_sample *dst, uint64_t max);
+
+void nk_sample_report_flat(unsigned top);
+void nk_sample_report_graph(unsigned top);
+
+/* called from the APIC performance counter interrupt */
+struct excp_entry_state;
+void nk_sample_overflow(struct excp_entry_state *excp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
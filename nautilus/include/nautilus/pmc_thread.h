@@ -0,0 +1,87 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __PMC_THREAD_H__
+#define __PMC_THREAD_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Per-thread performance counters.
+ *
+ * A thread opts in by adding events to itself. From then on its
+ * events are loaded onto the core's free counters when it is switched
+ * in, and read back and stopped when it is switched out, so its counts
+ * only include its own execution. Threads that never opt in cost one
+ * pointer test per switch.
+ *
+ * If a thread asks for more events than there are free counters, the
+ * events take turns. The set rotates at every switch-in and every
+ * NK_PMC_ROTATE_CYCLES while the thread keeps the core. Each event
+ * tracks how long the thread ran (enabled) and how long the event was
+ * actually counted (running). nk_pmc_count_scaled() scales the raw
+ * count up to the whole run.
+ */
+#define NK_PMC_THREAD_EVENTS 8
+#define NK_PMC_ROTATE_CYCLES 10000000ULL
+
+typedef enum {  NK_PMC_CYCLES = 0,
+                NK_PMC_INSTRUCTIONS = 1,
+                NK_PMC_LLC_MISSES = 2,
+                NK_PMC_BRANCH_MISSES = 3} nk_pmc_generic_t;
+
+struct nk_pmc_count {
+    uint64_t count;     /* events counted */
+    uint64_t enabled;   /* cycles the thread ran with the event requested */
+    uint64_t running;   /* cycles the event was on a counter */
+};
+
+struct nk_pmc_thread {
+    uint8_t  num;
+    uint8_t  rotate;                        /* first event to load next */
+    uint8_t  slot[NK_PMC_THREAD_EVENTS];    /* counter holding each event, 0xff if none */
+    uint64_t ctl[NK_PMC_THREAD_EVENTS];     /* event select values */
+    uint64_t in_tsc;                        /* when the set was loaded */
+    struct nk_pmc_count ev[NK_PMC_THREAD_EVENTS];
+};
+
+struct nk_thread;
+
+/* on the calling thread, return the event's index or -1 */
+int nk_pmc_thread_add(uint8_t event, uint8_t unit_mask);
+int nk_pmc_thread_add_generic(nk_pmc_generic_t event);
+
+int nk_pmc_thread_read(struct nk_thread * t, int idx, struct nk_pmc_count * c);
+uint64_t nk_pmc_count_scaled(struct nk_pmc_count * c);
+void nk_pmc_thread_report(struct nk_thread * t);
+void nk_pmc_thread_free(struct nk_thread * t);
+
+/* scheduler hooks */
+void nk_pmc_thread_switch(struct nk_thread * next);
+void nk_pmc_thread_tick(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
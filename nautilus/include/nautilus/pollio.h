@@ -0,0 +1,167 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __POLLIO_H__
+#define __POLLIO_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+#include <nautilus/intrinsics.h>
+#include <nautilus/thread.h>
+#include <nautilus/spinlock.h>
+
+/*
+ * Polling-mode I/O on dedicated cores.
+ *
+ * A poll core runs one thread that loops over the device queues
+ * bound to it and never takes their interrupts. It is taken out of
+ * real-time placement when it starts, so nothing else gets put
+ * there. Work moves between the poll core and ordinary threads
+ * through single-producer, single-consumer rings, one per direction
+ * and worker, so neither side locks.
+ *
+ * When a full pass over its sources finds nothing for a while, the
+ * core MONITORs the one address that will change when work arrives
+ * and MWAITs on it. That is a source's own memory (a used ring index
+ * the device writes) when the core has exactly one source that gives
+ * one, otherwise the core's doorbell, which producers ring with
+ * nk_poll_core_ring(). A core with several device-written sources
+ * has no single line to watch and keeps spinning.
+ */
+
+#define NK_POLL_MAX_SOURCES 16
+
+/* a source does some work and says how much, 0 for none */
+typedef int (*nk_poll_fn_t)(void * priv);
+
+struct nk_poll_source {
+    nk_poll_fn_t       poll;
+    void             * priv;
+    volatile void    * monitor;   /* where its work shows up, or NULL */
+};
+
+struct nk_poll_core {
+    int                   cpu;
+    nk_thread_id_t        tid;
+
+    volatile uint32_t     doorbell __align(64);
+
+    spinlock_t            lock;       /* adders */
+    volatile int          nsrc __align(64);
+    struct nk_poll_source src[NK_POLL_MAX_SOURCES];
+    volatile int          stop;
+    volatile int          running;
+
+    uint64_t              passes;
+    uint64_t              work;
+    uint64_t              sleeps;
+};
+
+int  nk_poll_core_start(int cpu);
+int  nk_poll_core_stop(int cpu);
+struct nk_poll_core * nk_poll_core_get(int cpu);
+int  nk_poll_cpu_reserved(int cpu);
+
+/*
+ * sources can be added while the core runs, but never removed; a core
+ * asleep on another source's line may not notice until its next tick
+ */
+int  nk_poll_add(int cpu, nk_poll_fn_t poll, void * priv, volatile void * monitor);
+
+static inline void
+nk_poll_core_ring (struct nk_poll_core * core)
+{
+    __sync_fetch_and_add(&core->doorbell, 1);
+}
+
+
+/*
+ * The handoff ring. head is the consumer's, tail the producer's; each
+ * is written by its owner alone and sits on its own line. A consumer
+ * that finds the ring empty may sleep on tail futex-style, with
+ * waiting telling the producer whether a wake is needed.
+ */
+struct nk_poll_ring {
+    volatile uint32_t   head __align(64);
+    volatile uint32_t   waiting;
+    volatile uint32_t   tail __align(64);
+    uint32_t            mask;
+    nk_thread_queue_t * wq;
+    void              * slots[0];
+};
+
+struct nk_poll_ring * nk_poll_ring_create(uint32_t size);
+void nk_poll_ring_destroy(struct nk_poll_ring * r);
+
+/* producer: -1 if full; follow a batch of pushes with one kick */
+static inline int
+nk_poll_ring_push (struct nk_poll_ring * r, void * item)
+{
+    uint32_t t = r->tail;
+
+    if (t - r->head > r->mask) {
+        return -1;
+    }
+
+    r->slots[t & r->mask] = item;
+    /* the slot is visible before the tail that covers it */
+    asm volatile ("" ::: "memory");
+    r->tail = t + 1;
+
+    return 0;
+}
+
+/* consumer: NULL if empty */
+static inline void *
+nk_poll_ring_pop (struct nk_poll_ring * r)
+{
+    uint32_t h = r->head;
+    void * item;
+
+    if (h == r->tail) {
+        return NULL;
+    }
+
+    item = r->slots[h & r->mask];
+    asm volatile ("" ::: "memory");
+    r->head = h + 1;
+
+    return item;
+}
+
+static inline uint32_t
+nk_poll_ring_count (struct nk_poll_ring * r)
+{
+    return r->tail - r->head;
+}
+
+/* producer: wake a consumer sleeping in nk_poll_ring_wait() */
+void nk_poll_ring_kick(struct nk_poll_ring * r);
+/* consumer: pop, sleeping while the ring is empty */
+void * nk_poll_ring_wait(struct nk_poll_ring * r);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
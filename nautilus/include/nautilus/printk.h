@@ -54,6 +54,31 @@ int sscanf(const char * buf, const char * fmt, ...);
 
 void warn_slowpath(const char * file, int line, const char * fmt, ...);
 
+/*
+ * printk_fast() logs a message for later: the format and up to
+ * PRINTK_FAST_MAX_ARGS integer, pointer or string arguments are
+ * copied into a per-CPU ring and formatted on another core. The
+ * format and any strings must stay put until then, so use literals.
+ * No floating point. Without PRINTK_FAST it is plain printk().
+ */
+#ifdef NAUT_CONFIG_PRINTK_FAST
+#define PRINTK_FAST_MAX_ARGS 6
+
+#define __PRINTK_FAST_NARGS(args...) __PRINTK_FAST_NARGS_(0, ##args, 7, 6, 5, 4, 3, 2, 1, 0)
+#define __PRINTK_FAST_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, n, ...) n
+
+#define printk_fast(fmt, args...) nk_printk_fast(fmt, __PRINTK_FAST_NARGS(args), ##args)
+
+int  nk_printk_fast(const char * fmt, int nargs, ...);
+int  nk_printk_fast_init(void);
+int  nk_printk_fast_start(void);
+/* print everything logged so far */
+void nk_printk_fast_flush(void);
+void nk_printk_fast_panic(void);
+#else
+#define printk_fast(fmt, args...) printk(fmt, ##args)
+#endif
+
 
 #ifdef __cplusplus
 }
@@ -30,13 +30,20 @@ extern "C" {
 #include <nautilus/spinlock.h>
 #include <nautilus/list.h>
 
+struct nk_queue_entry {
+    struct list_head node;
+};
+
 struct nk_queue {
     struct list_head queue;
     spinlock_t lock;
-};
-
-struct nk_queue_entry {
-    struct list_head node;
+    volatile unsigned long waiters; /* sleepers in nk_thread_queue_wait_word() */
+#ifdef NAUT_CONFIG_LOCKFREE_RUNQ
+    /* Vyukov intrusive MPSC inbox, linked through node.next */
+    struct nk_queue_entry * volatile mpsc_head;
+    struct nk_queue_entry * mpsc_tail;
+    struct nk_queue_entry mpsc_stub;
+#endif
 };
 
 typedef struct nk_queue nk_queue_t;
@@ -74,6 +81,34 @@ nk_enqueue_entry_atomic (nk_queue_t * q, nk_queue_entry_t * entry)
 }
 
 
+#ifdef NAUT_CONFIG_LOCKFREE_RUNQ
+/*
+ * Any number of producers may push onto the inbox, without locking.
+ * Only the queue's owner may pop, and it moves entries onto its
+ * private list. While an entry sits in the inbox its node.next is the
+ * link and node.prev is unused, so entries do not grow.
+ */
+static inline void
+nk_queue_mpsc_push (nk_queue_t * q, nk_queue_entry_t * entry)
+{
+    nk_queue_entry_t * prev;
+
+    entry->node.next = NULL;
+    prev = __sync_lock_test_and_set(&(q->mpsc_head), entry);
+    prev->node.next = &(entry->node);
+}
+
+/* a hint, like nk_queue_empty(); a push may be in flight */
+static inline uint8_t
+nk_queue_mpsc_empty (nk_queue_t * q)
+{
+    return q->mpsc_head == &(q->mpsc_stub);
+}
+
+nk_queue_entry_t* nk_queue_mpsc_pop(nk_queue_t * q);
+#endif
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -31,6 +31,9 @@ extern "C" {
 #include <nautilus/spinlock.h>
 
 struct nk_rand_info {
+    // the generator behind nk_get_rand_u64() and nk_get_rand_bytes()
+    uint64_t ctr;
+    // lrand48()/drand48() state, lock is for drand48()
     spinlock_t lock;
     uint64_t seed;
     uint64_t xi; 
@@ -41,6 +44,7 @@ struct cpu;
 int nk_rand_init(struct cpu * cpu);
 void nk_rand_set_xi(uint64_t xi);
 void nk_rand_seed(uint64_t seed);
+uint64_t nk_get_rand_u64(void);
 void nk_get_rand_bytes(uint8_t *buf, unsigned len);
 
 #ifdef __cplusplus
@@ -168,6 +168,67 @@ static inline void rb_link_node(struct rb_node * node, struct rb_node * parent,
     *rb_link = node;
 }
 
+/*
+ * Augmented trees: func recomputes a node's subtree value from its
+ * children. For an insert, call nk_rb_augment_insert() after
+ * nk_rb_insert_color(). For an erase, call nk_rb_augment_erase_begin()
+ * before nk_rb_erase() and nk_rb_augment_erase_end() with its result
+ * afterwards.
+ */
+typedef void (*nk_rb_augment_f)(struct rb_node *node, void *data);
+
+extern void nk_rb_augment_insert(struct rb_node *node, nk_rb_augment_f func, void *data);
+extern struct rb_node *nk_rb_augment_erase_begin(struct rb_node *node);
+extern void nk_rb_augment_erase_end(struct rb_node *node, nk_rb_augment_f func, void *data);
+
+/*
+ * A root that remembers its leftmost node, for trees that mostly get
+ * asked for their smallest element (timer queues, run queues).
+ * leftmost says whether the insert only ever went left on its way down.
+ */
+struct rb_root_cached
+{
+    struct rb_root rb_root;
+    struct rb_node *rb_leftmost;
+};
+
+#define RB_ROOT_CACHED (struct rb_root_cached) { { NULL, }, NULL }
+
+#define nk_rb_first_cached(root) ((root)->rb_leftmost)
+
+static inline void nk_rb_insert_color_cached(struct rb_node *node,
+					     struct rb_root_cached *root,
+					     int leftmost)
+{
+    if (leftmost)
+	root->rb_leftmost = node;
+    nk_rb_insert_color(node, &root->rb_root);
+}
+
+static inline void nk_rb_erase_cached(struct rb_node *node,
+				      struct rb_root_cached *root)
+{
+    if (root->rb_leftmost == node)
+	root->rb_leftmost = nk_rb_next(node);
+    nk_rb_erase(node, &root->rb_root);
+}
+
+/*
+ * Order statistics. Embed an nk_rb_os_node, link it in order with
+ * rb_link_node() as usual, then nk_rb_os_insert_color() instead of
+ * nk_rb_insert_color(); erase with nk_rb_os_erase(). Ranks count from 0.
+ */
+struct nk_rb_os_node
+{
+    struct rb_node rb;
+    unsigned long size;
+};
+
+extern void nk_rb_os_insert_color(struct nk_rb_os_node *node, struct rb_root *root);
+extern void nk_rb_os_erase(struct nk_rb_os_node *node, struct rb_root *root);
+extern struct nk_rb_os_node *nk_rb_os_select(struct rb_root *root, unsigned long k);
+extern unsigned long nk_rb_os_rank(struct nk_rb_os_node *node);
+
 #define nk_rb_for_each_entry(pos, root, member)				\
     for (pos = rb_entry(nk_rb_first(root), typeof(*pos), member);	\
 	 &pos->member != nk_rb_last(root);				\
@@ -0,0 +1,89 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+#include <nautilus/irq.h>
+
+/*
+ * Read-copy-update for read-mostly kernel structures.
+ *
+ * A read-side critical section only masks interrupts on the local
+ * core, so readers take no locks and issue no atomics. Because the
+ * section cannot be interrupted, any point at which a core returns
+ * to thread context through nk_need_resched() is a quiescent state
+ * for that core: none of its readers is still in flight. A grace
+ * period is complete once every core has passed a quiescent state
+ * after it started.
+ *
+ * Updaters publish with nk_rcu_assign_pointer() and then either wait
+ * with nk_rcu_synchronize() or hand the old copy to nk_call_rcu().
+ * Callbacks run on the core that queued them, from interrupt context
+ * with interrupts off, so they should be short (typically a free()).
+ *
+ * Readers must not yield, sleep or re-enable interrupts inside the
+ * section.
+ */
+
+struct nk_rcu_head {
+    struct nk_rcu_head * next;
+    void (*func)(struct nk_rcu_head * head);
+};
+
+static inline uint8_t
+nk_rcu_read_lock (void)
+{
+    return irq_disable_save();
+}
+
+static inline void
+nk_rcu_read_unlock (uint8_t flags)
+{
+    irq_enable_restore(flags);
+}
+
+/* x86 keeps stores in order, so only the compiler has to be told */
+#define nk_rcu_dereference(p) \
+    ({ typeof(p) __p = *(volatile typeof(p) *)&(p); asm volatile ("":::"memory"); __p; })
+
+#define nk_rcu_assign_pointer(p, v)             \
+    do {                                        \
+        asm volatile ("":::"memory");           \
+        *(volatile typeof(p) *)&(p) = (v);      \
+    } while (0)
+
+void nk_call_rcu(struct nk_rcu_head * head, void (*func)(struct nk_rcu_head * head));
+void nk_rcu_synchronize(void);
+
+/* quiescent state hook, called from nk_need_resched() */
+void nk_rcu_check(void);
+
+int nk_rcu_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
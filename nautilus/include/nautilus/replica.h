@@ -0,0 +1,66 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __REPLICA_H__
+#define __REPLICA_H__
+
+#include <nautilus/naut_types.h>
+#include <nautilus/numa.h>
+
+/*
+ * Read-only data replicated per NUMA domain.
+ *
+ * nk_numa_replicate() copies a range into every domain that has
+ * memory, and nk_numa_local() gives back the copy in the caller's
+ * domain, so data every core reads is read without crossing the
+ * interconnect. There is one address space and one page table, so a
+ * copy is found through the handle, not at the original's address.
+ * The data must not change while it is replicated; after changing
+ * the original, nk_numa_replica_sync() brings the copies up to date.
+ * A domain whose copy could not be allocated reads the original.
+ */
+struct nk_numa_replica {
+    void *   orig;
+    size_t   len;
+    unsigned home;              /* domain the original is in */
+    unsigned num_domains;
+    void *   copy[];            /* per domain, the original in home */
+};
+
+struct nk_numa_replica * nk_numa_replicate(void * data, size_t len);
+int  nk_numa_replica_sync(struct nk_numa_replica * r);
+void nk_numa_replica_destroy(struct nk_numa_replica * r);
+
+static inline void *
+nk_numa_local (struct nk_numa_replica * r)
+{
+    return r->copy[nk_my_numa_node()];
+}
+
+/* the domain memory is in, -1 if kmem doesn't manage it */
+int nk_numa_node_of(void * addr);
+
+/*
+ * Moves malloc()ed data to a domain. Returns the new copy and frees
+ * the old block, or returns NULL and leaves it alone. Nobody may
+ * touch the old block during the call or hold on to it after.
+ */
+void * nk_numa_migrate(void * data, size_t len, unsigned node);
+
+#endif
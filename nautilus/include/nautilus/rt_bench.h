@@ -0,0 +1,74 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __RT_BENCH_H__
+#define __RT_BENCH_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+#include <nautilus/rt_scheduler.h>
+
+/*
+ * Real-time scheduler stress benchmark.
+ *
+ * For each total utilization from util_lo to util_hi, sets random
+ * periodic task sets are generated with UUniFast-distributed
+ * utilizations. Each set is simulated, then started for real on cpu
+ * and run for hyperperiods hyperperiods. Every job spins for fill
+ * percent of its slice and then ends itself with rt_thread_job_done().
+ * The report gives, per utilization, how admission control's verdict
+ * compares with the simulator's, the deadline miss ratio, and the
+ * cost of each scheduling decision.
+ *
+ * Utilizations are x100000, as in admission control, and times are
+ * in cycles. Periods are period_min times a divisor of 120, up to
+ * period_max, so a hyperperiod is never more than 120 * period_min.
+ */
+struct nk_rt_bench_cfg {
+    int cpu;                    /* core the sets run on, -1 for the last one */
+    uint32_t sets;              /* task sets per utilization */
+    uint32_t tasks;             /* threads per set */
+    uint64_t util_lo, util_hi, util_step;
+    uint64_t period_min, period_max;
+    uint32_t hyperperiods;      /* how long each set runs */
+    uint32_t fill;              /* percent of its slice a job uses */
+    uint64_t seed;              /* 0 for a TSC-seeded run */
+};
+
+/* fills in the defaults used by nk_rt_bench(NULL) */
+void nk_rt_bench_defaults(struct nk_rt_bench_cfg *cfg);
+
+/*
+ * Draw n periodic constraints with total utilization util into set.
+ * Returns the set's hyperperiod, or 0 if the arguments are unusable.
+ */
+uint64_t nk_rt_taskset_gen(uint64_t *seed, uint32_t n, uint64_t util,
+                           uint64_t period_min, uint64_t period_max,
+                           rt_constraints *set);
+
+int nk_rt_bench(struct nk_rt_bench_cfg *cfg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
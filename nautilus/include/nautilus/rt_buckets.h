@@ -0,0 +1,49 @@
+//
+//  rt_buckets.h
+//
+//  Deadline-bucketed EDF run queue: deadlines are quantized into
+//  slots of 2^RT_BUCKET_SHIFT TSC cycles on a rotating window, and
+//  the earliest occupied slot is found with two bit scans.
+//
+
+#ifndef rt_buckets_h
+#define rt_buckets_h
+
+#include <nautilus/list.h>
+
+#define RT_BUCKET_WORDS 64
+#define RT_BUCKET_SLOTS (RT_BUCKET_WORDS * 64)
+#define RT_BUCKET_MASK  (RT_BUCKET_SLOTS - 1)
+
+/* log2 of the number of TSC cycles one slot spans */
+#define RT_BUCKET_SHIFT NAUT_CONFIG_RT_EDF_BUCKET_SHIFT
+#define RT_BUCKET_WIDTH (1ULL << RT_BUCKET_SHIFT)
+
+/* bucket_slot of a thread parked beyond the window */
+#define RT_BUCKET_FAR   ((uint64_t)-1)
+
+struct rt_thread;
+
+typedef struct rt_buckets {
+    uint64_t base;      /* absolute slot at the start of the window */
+    uint64_t count;
+    uint64_t summary;   /* bit w set if map[w] is nonzero */
+    uint64_t map[RT_BUCKET_WORDS];
+    struct list_head slots[RT_BUCKET_SLOTS];
+    struct list_head far;       /* deadlines past the end of the window */
+    uint64_t far_count;
+    uint64_t far_min;   /* no far thread is in an earlier slot */
+} rt_buckets;
+
+rt_buckets* rt_buckets_create(uint64_t now);
+void rt_buckets_destroy(rt_buckets *buckets);
+
+/* file a thread under its current deadline */
+void rt_buckets_add(rt_buckets *buckets, struct rt_thread *thread);
+void rt_buckets_remove(rt_buckets *buckets, struct rt_thread *thread);
+int rt_buckets_linked(struct rt_thread *thread);
+
+/* earliest thread at time now, first in its slot; NULL if empty */
+struct rt_thread* rt_buckets_first(rt_buckets *buckets, uint64_t now);
+
+#endif /* rt_buckets_h */
@@ -0,0 +1,54 @@
+//
+//  rt_cat.h
+//
+//  Cache allocation (Intel CAT) and memory bandwidth allocation (MBA)
+//  classes for the real-time scheduler. A periodic or sporadic thread
+//  names a class of service in its constraints, aperiodic threads all
+//  run in one background class, and the class is switched in with the
+//  thread.
+//
+
+#ifndef rt_cat_h
+#define rt_cat_h
+
+#define IA32_PQR_ASSOC          0xc8f
+#define IA32_L3_QOS_MASK(n)     (0xc90 + (n))
+#define IA32_MBA_THRTL(n)       (0xd50 + (n))
+
+#define RT_CAT_CLASSES  16
+#define RT_CAT_DEFAULT  0       /* all ways, unthrottled, unless redefined */
+
+struct rt_thread;
+struct nk_thread;
+
+typedef struct rt_cat_class {
+    uint64_t l3_mask;       /* ways the class may fill, 0 if undefined */
+    uint32_t mba_delay;     /* memory bandwidth throttle, 0 for none */
+    uint8_t locked;         /* an admitted thread relies on it being isolated */
+} rt_cat_class;
+
+/* detect the hardware, once */
+void rt_cat_init(void);
+
+/* number of classes available, 0 if there is no cache allocation */
+int rt_cat_classes(void);
+
+/*
+ * Define or redefine a class. l3_mask must be a contiguous run of
+ * ways. Every core picks the change up at its next context switch.
+ */
+int rt_cat_class_set(int cos, uint64_t l3_mask, uint32_t mba_delay);
+
+/* the class aperiodic threads run in */
+int rt_cat_set_background(int cos);
+
+/*
+ * Admission: 0 if the thread asked for no class, or for one whose ways
+ * nobody outside it can fill, which is then locked as it is.
+ */
+int rt_cat_admit(struct rt_thread *thread);
+
+/* scheduler hook, load the incoming thread's class */
+void rt_cat_switch(struct nk_thread *next);
+
+#endif /* rt_cat_h */
@@ -0,0 +1,97 @@
+//
+//  rt_heap.h
+//
+//  4-ary min-heap operations for the real-time scheduler's queues,
+//  generated once per key so that the comparison in every sift is a
+//  plain load rather than a dispatch on the queue type. The same
+//  template serves the scheduler's own queues and the simulator's.
+//
+//  RT_HEAP_DEFINE(name, queue_t, thread_t, KEY, SET_POS) defines
+//  name_sift_up(), name_sift_down(), name_push() and name_remove_at()
+//  over a queue_t with size and threads[] members. KEY(queue, thread)
+//  gives the key, smallest first, and SET_POS(thread, pos) is called
+//  whenever a thread lands in a new slot so that it can remember
+//  where it is.
+//
+
+#ifndef rt_heap_h
+#define rt_heap_h
+
+#define RT_HEAP_ARITY 4
+#define rt_heap_parent(i) (((i) - 1) / RT_HEAP_ARITY)
+#define rt_heap_first_child(i) ((i) * RT_HEAP_ARITY + 1)
+
+#define RT_HEAP_NO_POS(thread, pos) ((void)0)
+
+#define RT_HEAP_DEFINE(name, queue_t, thread_t, KEY, SET_POS)                  \
+static inline void name##_sift_up(queue_t *queue, uint64_t pos)               \
+{                                                                             \
+    thread_t *thread = queue->threads[pos];                                   \
+    uint64_t key = KEY(queue, thread);                                        \
+                                                                              \
+    while (pos != 0 && KEY(queue, queue->threads[rt_heap_parent(pos)]) > key) \
+    {                                                                         \
+        queue->threads[pos] = queue->threads[rt_heap_parent(pos)];            \
+        SET_POS(queue->threads[pos], pos);                                    \
+        pos = rt_heap_parent(pos);                                            \
+    }                                                                         \
+    queue->threads[pos] = thread;                                             \
+    SET_POS(thread, pos);                                                     \
+}                                                                             \
+                                                                              \
+static inline void name##_sift_down(queue_t *queue, uint64_t pos)             \
+{                                                                             \
+    thread_t *thread = queue->threads[pos];                                   \
+    uint64_t key = KEY(queue, thread);                                        \
+    uint64_t first, last, child, min;                                         \
+                                                                              \
+    while ((first = rt_heap_first_child(pos)) < queue->size)                  \
+    {                                                                         \
+        last = first + RT_HEAP_ARITY;                                         \
+        if (last > queue->size) {                                             \
+            last = queue->size;                                               \
+        }                                                                     \
+        min = first;                                                          \
+        for (child = first + 1; child < last; child++) {                      \
+            if (KEY(queue, queue->threads[child]) < KEY(queue, queue->threads[min])) { \
+                min = child;                                                  \
+            }                                                                 \
+        }                                                                     \
+                                                                              \
+        if (KEY(queue, queue->threads[min]) >= key) {                         \
+            break;                                                            \
+        }                                                                     \
+        queue->threads[pos] = queue->threads[min];                            \
+        SET_POS(queue->threads[pos], pos);                                    \
+        pos = min;                                                            \
+    }                                                                         \
+    queue->threads[pos] = thread;                                             \
+    SET_POS(thread, pos);                                                     \
+}                                                                             \
+                                                                              \
+static inline void name##_push(queue_t *queue, thread_t *thread)              \
+{                                                                             \
+    uint64_t pos = queue->size++;                                             \
+                                                                              \
+    queue->threads[pos] = thread;                                             \
+    name##_sift_up(queue, pos);                                               \
+}                                                                             \
+                                                                              \
+static inline thread_t* name##_remove_at(queue_t *queue, uint64_t pos)        \
+{                                                                             \
+    thread_t *target = queue->threads[pos];                                   \
+    thread_t *last = queue->threads[--queue->size];                           \
+                                                                              \
+    if (pos != queue->size) {                                                 \
+        queue->threads[pos] = last;                                           \
+        SET_POS(last, pos);                                                   \
+        if (pos > 0 && KEY(queue, last) < KEY(queue, queue->threads[rt_heap_parent(pos)])) { \
+            name##_sift_up(queue, pos);                                       \
+        } else {                                                              \
+            name##_sift_down(queue, pos);                                     \
+        }                                                                     \
+    }                                                                         \
+    return target;                                                            \
+}
+
+#endif /* rt_heap_h */
@@ -0,0 +1,64 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __RT_LATENCY_H__
+#define __RT_LATENCY_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Wakeup latency measurement, in the manner of cyclictest.
+ *
+ * A periodic thread on every core ends each job at once and, when it
+ * is next dispatched, records how long after its intended release it
+ * got the CPU back. That covers the timer interrupt, the scheduling
+ * pass, the context switch and the return to the thread. While it
+ * runs, aperiodic threads on every core can put the system under
+ * load. The report gives, per core and over all of them, the min,
+ * average, 99th and 99.99th percentile and max latency in cycles.
+ */
+#define RT_LAT_LOAD_MALLOC  0x1     /* malloc and free of random sizes */
+#define RT_LAT_LOAD_IPI     0x2     /* kick IPIs at the next core */
+#define RT_LAT_LOAD_SERIAL  0x4     /* lines written to the serial port */
+
+/* histogram buckets per core, longer latencies only count in max */
+#define RT_LAT_BUCKETS      1024
+
+struct nk_rt_latency_cfg {
+    uint64_t period;            /* cycles between releases */
+    uint64_t slice;             /* budget of each measuring thread */
+    uint32_t loops;             /* releases measured per core */
+    uint64_t bucket;            /* histogram bucket width in cycles */
+    uint32_t load;              /* RT_LAT_LOAD_* */
+};
+
+/* fills in the defaults used by nk_rt_latency(NULL) */
+void nk_rt_latency_defaults(struct nk_rt_latency_cfg *cfg);
+
+int nk_rt_latency(struct nk_rt_latency_cfg *cfg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,55 @@
+//
+//  rt_mlfq.h
+//
+//  Multi-level feedback queue for the real-time scheduler's aperiodic
+//  class: a FIFO per level, a bitmap of the levels in use, a quantum
+//  that doubles with every level and a periodic boost back to the top.
+//
+
+#ifndef rt_mlfq_h
+#define rt_mlfq_h
+
+#include <nautilus/list.h>
+
+#define RT_MLFQ_LEVELS  NAUT_CONFIG_RT_MLFQ_LEVELS
+
+/* TSC cycles a thread may run at level 0; level l gets this << l */
+#define RT_MLFQ_QUANTUM NAUT_CONFIG_RT_MLFQ_QUANTUM
+
+/* TSC cycles between boosts of every thread to level 0 */
+#define RT_MLFQ_BOOST   NAUT_CONFIG_RT_MLFQ_BOOST
+
+struct rt_thread;
+
+typedef struct rt_mlfq {
+    uint64_t count;
+    uint64_t bitmap;        /* bit l set if level l is non-empty */
+    uint64_t epoch;         /* advanced by every boost */
+    uint64_t last_boost;
+    struct list_head levels[RT_MLFQ_LEVELS];
+} rt_mlfq;
+
+rt_mlfq* rt_mlfq_create(uint64_t now);
+void rt_mlfq_destroy(rt_mlfq *mlfq);
+
+/* start a thread over at the top level */
+void rt_mlfq_reset(struct rt_thread *thread);
+
+/* queue a thread at the tail of its level */
+void rt_mlfq_add(rt_mlfq *mlfq, struct rt_thread *thread);
+void rt_mlfq_remove(rt_mlfq *mlfq, struct rt_thread *thread);
+
+/* first thread on the highest non-empty level, boosting if one is due */
+struct rt_thread* rt_mlfq_first(rt_mlfq *mlfq, uint64_t now);
+
+/*
+ * Charge a thread that is not on the queue for what it ran since it
+ * was last charged, and move it down a level once it has used up its
+ * level's quantum.
+ */
+void rt_mlfq_charge(rt_mlfq *mlfq, struct rt_thread *thread);
+
+/* what is left of the thread's quantum at its level */
+uint64_t rt_mlfq_quantum(rt_mlfq *mlfq, struct rt_thread *thread);
+
+#endif /* rt_mlfq_h */
@@ -10,6 +10,24 @@
 #define rt_scheduler_h
 
 #include <nautilus/thread.h>
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+#include <nautilus/list.h>
+#include <nautilus/rt_wheel.h>
+#endif
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+#include <nautilus/list.h>
+#include <nautilus/rt_buckets.h>
+#endif
+#ifdef NAUT_CONFIG_RT_APERIODIC_MLFQ
+#include <nautilus/list.h>
+#include <nautilus/rt_mlfq.h>
+#endif
+#ifdef NAUT_CONFIG_TSC_CLOCKSOURCE
+#include <nautilus/clocksource.h>
+#endif
+#ifdef NAUT_CONFIG_RT_CACHE_PARTITION
+#include <nautilus/rt_cat.h>
+#endif
 
 /******************************************************************
  REAL TIME THREAD
@@ -25,12 +43,26 @@
  
  ******************************************************************/
 
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+typedef enum { RT_CRIT_LO = 0, RT_CRIT_HI = 1 } rt_criticality;
+#endif
+
 struct periodic_constraints {
     uint64_t period, slice;
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+    uint64_t slice_hi;          /* HI mode budget, HI threads only */
+    uint8_t criticality;        /* rt_criticality, LO unless set */
+#endif
+#ifdef NAUT_CONFIG_RT_CACHE_PARTITION
+    uint8_t cache_class;        /* rt_cat class of service, RT_CAT_DEFAULT for none */
+#endif
 };
 
 struct sporadic_constraints {
     uint64_t work;
+#ifdef NAUT_CONFIG_RT_CACHE_PARTITION
+    uint8_t cache_class;
+#endif
 };
 
 struct aperiodic_constraints {
@@ -47,23 +79,177 @@ typedef enum { APERIODIC = 0, SPORADIC = 1, PERIODIC = 2} rt_type;
 
 typedef enum {  RUNNABLE_QUEUE = 0, PENDING_QUEUE = 1, 
                 APERIODIC_QUEUE = 2, ARRIVAL_QUEUE = 3,
-                WAITING_QUEUE = 4, SLEEPING_QUEUE = 5, EXITED_QUEUE = 6} queue_type;
+                WAITING_QUEUE = 4, SLEEPING_QUEUE = 5, EXITED_QUEUE = 6,
+                SERVER_QUEUE = 7, SUSPENDED_QUEUE = 8,
+                GROUP_EDF_QUEUE = 9, GROUP_FP_QUEUE = 10} queue_type;
 
 typedef enum {  ARRIVED = 0, ADMITTED = 1, WAITING = 2, 
                 RUNNING = 3, TOBE_REMOVED = 4, REMOVED = 5, 
-                SLEEPING = 6} rt_status;
+                SLEEPING = 6, BLOCKED = 7} rt_status;
+
+#define RT_NOT_QUEUED ((uint64_t)-1)
+
+/* sporadic_state of a sporadic thread */
+#define RT_SPORADIC_ACTIVE  0   /* in a job */
+#define RT_SPORADIC_PARKED  1   /* between jobs, waiting for rt_sporadic_release() */
+#define RT_SPORADIC_PENDING 2   /* released while still in a job */
+
+#ifdef NAUT_CONFIG_RT_HISTOGRAMS
+/* bucket 0 counts zeros, bucket i > 0 counts [2^(i-1), 2^i), the last catches the rest */
+#define RT_HIST_BUCKETS 48
+
+typedef struct rt_hist {
+    uint64_t count[RT_HIST_BUCKETS];
+} rt_hist;
+#endif
+
+#ifdef NAUT_CONFIG_RT_OVERHEAD_HIST
+/*
+ * Bucket 0..3 count 0..3 exactly, above that each power of two is
+ * split in four, so a value read back off the top of a bucket is at
+ * most a quarter too high.
+ */
+#define RT_OH_SUB_BITS 2
+#define RT_OH_BUCKETS  (64 << RT_OH_SUB_BITS)
+
+typedef struct rt_overhead_hist {
+    uint64_t total;
+    uint64_t count[RT_OH_BUCKETS];
+} rt_overhead_hist;
+#endif
+
+/* per-thread counters, read with rt_thread_get_stats() */
+typedef struct rt_stats {
+    uint64_t releases;          /* periodic jobs released */
+    uint64_t jitter_sum;        /* release latency, summed over releases */
+    uint64_t jitter_max;
+    uint64_t skipped;           /* releases dropped, lost periods or RT_MISS_SKIP */
+    uint64_t misses;            /* jobs completed after their deadline */
+    uint64_t lateness_max;
+    uint64_t overruns;          /* misses absorbed by RT_MISS_OVERRUN */
+    uint64_t demotions;
+#ifdef NAUT_CONFIG_RT_HISTOGRAMS
+    /* per job, times in cycles */
+    rt_hist response;           /* release to completion */
+    rt_hist lateness;           /* completion past the deadline, 0 if met */
+    rt_hist jitter;             /* release to first dispatch */
+    rt_hist preempts;           /* times the job was switched back in */
+#endif
+} rt_stats;
+
+/*
+ * What to do with a periodic thread whose job completes past its
+ * deadline. The handler runs in the scheduler with interrupts off, so
+ * a callback must not block or print; it returns the action to take.
+ * Sporadic threads only count the miss and fire the callback.
+ */
+typedef enum {  RT_MISS_NONE = 0,       /* release the next job at once */
+                RT_MISS_SKIP = 1,       /* drop the next job */
+                RT_MISS_OVERRUN = 2,    /* as NONE if no later than the bound, else SKIP */
+                RT_MISS_DEMOTE = 3,     /* continue as an aperiodic thread */
+                RT_MISS_CALLBACK = 4} rt_miss_policy;
 
+struct rt_thread;
+typedef rt_miss_policy (*rt_miss_callback)(struct rt_thread *thread, uint64_t lateness, void *state);
+
+typedef struct rt_miss_handler {
+    rt_miss_policy policy;
+    uint64_t overrun;
+    rt_miss_callback fn;
+    void *state;
+} rt_miss_handler;
+
+struct rt_server;
+
+/*
+ * The first cache line holds what every scheduling decision reads,
+ * with the constraints inline right after it; statistics, miss
+ * handling and the optional features come last.
+ */
 typedef struct rt_thread {
     rt_type type;
     queue_type q_type;
     rt_status status;
-    rt_constraints *constraints;
-    uint64_t start_time; 
-    uint64_t run_time;
+    uint8_t q_account;  /* type counted in q_type's totals, APERIODIC if none */
+    uint64_t q_spor_util;       /* sporadic only: density counted in q_type's spor_util */
+    uint8_t job_done;   /* set by rt_thread_job_done() */
+    uint8_t blocking;           /* set when it blocks, cleared by the scheduler */
+    volatile sint8_t admitted;  /* 0 until its core decides, then 1, or -1 if refused */
+    uint64_t q_index;   /* slot in q_type's heap, RT_NOT_QUEUED otherwise */
     uint64_t deadline;
-    uint64_t exit_time;
+    uint64_t run_time;
+    uint64_t start_time; 
+    rt_constraints *constraints;    /* &constr, or a server's for its proxy */
     struct nk_thread *thread;
-} rt_thread;
+
+    rt_constraints constr;
+    uint64_t release;   /* release time of the current periodic job */
+    struct rt_thread *mpsc_next;    /* link on a core's arrival, waiting or inbox list */
+#ifdef NAUT_CONFIG_RT_CBS
+    struct rt_server *server;   /* server it runs under, or the one it stands in for */
+#endif
+    int migrate_cpu;    /* core to move to at the end of this job, -1 if none */
+    int placed_cpu;     /* core holding its nk_rt_place() reservation, -1 if none */
+    uint64_t placed_util;
+    int owner_cpu;      /* core whose queues keep room for it, -1 if none */
+    int slab_cpu;       /* per-CPU cache it returns to when freed */
+    uint64_t exit_time;
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+    uint64_t g_util;    /* utilization reserved by global admission */
+    uint8_t g_owned;    /* counted in the room kept on the shared heap */
+#endif
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+    uint8_t mc_admitted;        /* counted in its core's per-mode totals */
+#endif
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+    int split_cpu;              /* second core of a split job, -1 if not split */
+    int split_home;
+    uint8_t split_phase;        /* 0 on the home core, 1 on split_cpu */
+    uint64_t split_slice;       /* budget of the home portion */
+    uint64_t split_home_util;
+    uint64_t split_util;
+#endif
+    rt_stats stats;
+#ifdef NAUT_CONFIG_RT_HISTOGRAMS
+    uint8_t job_started;        /* dispatched at least once in this job */
+    uint32_t job_preempts;
+#endif
+    rt_miss_handler miss;
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+    struct list_head wheel_node;    /* on the scheduler's timer wheel (or expired list) */
+    uint64_t wheel_expiry;
+    uint64_t wheel_slot;
+#endif
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+    struct list_head bucket_node;   /* on its run queue's deadline slot */
+    uint64_t bucket_slot;
+#endif
+#ifdef NAUT_CONFIG_RT_APERIODIC_MLFQ
+    struct list_head mlfq_node;     /* on its level of the aperiodic queue */
+    uint64_t mlfq_level;
+    uint64_t mlfq_epoch;        /* boost epoch mlfq_level was set in */
+    uint64_t mlfq_used;         /* run time charged at mlfq_level */
+    uint64_t mlfq_mark;         /* run_time when last charged */
+#endif
+#ifdef NAUT_CONFIG_RT_MUTEX
+    struct rt_mutex *blocked_on;    /* mutex it is waiting for */
+    struct rt_thread *mutex_next;   /* next waiter on that mutex */
+    struct rt_thread *boost_next;   /* link on a core's boost list */
+    uint64_t inherited;         /* earliest deadline among its waiters, 0 if none */
+    uint64_t base_deadline;     /* its own deadline while boosted */
+    uint32_t mutex_held;
+    uint8_t boost_queued;
+    uint8_t boosted;
+#endif
+    struct rt_thread *joiner;   /* woken once it is removed */
+    volatile uint64_t join_count;   /* threads it is still joining */
+    uint64_t rel_deadline;      /* sporadic only: deadline of a job after its release */
+    volatile uint64_t sporadic_state;   /* sporadic only: in a job, parked or released early */
+#ifdef NAUT_CONFIG_RT_TASK_SETS
+    struct rt_set *set;         /* task set waiting to hear if it was admitted */
+    uint64_t set_start;         /* the set's first release */
+#endif
+} __attribute__((aligned(64))) rt_thread;
 
 rt_thread* rt_thread_init(int type,
                           rt_constraints *constraints,
@@ -74,9 +260,36 @@ rt_thread* rt_thread_init(int type,
 typedef struct rt_queue {
     queue_type type;
     uint64_t size, head, tail;
-    rt_thread *threads[0];
+    uint64_t capacity;
+    uint64_t floor;             /* capacity kept for the threads its core owns */
+    rt_thread **threads;
+    /* totals over the periodic/sporadic threads on a RUNNABLE or PENDING queue */
+    uint64_t util, sum_period, sum_freq, num_periodic;
+    uint64_t min_period, min_count;
+    uint8_t min_stale;
+    uint64_t num_sporadic;
+    uint64_t spor_util;     /* sporadic densities as of queueing, for other cores */
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+    rt_buckets *buckets;    /* RUNNABLE only: threads[0] is the head, the rest unordered */
+#endif
+#ifdef NAUT_CONFIG_RT_APERIODIC_MLFQ
+    rt_mlfq *mlfq;          /* APERIODIC only: threads[0] is the head, the rest unordered */
+#endif
 } rt_queue ;
 
+/*
+ * Threads handed to a core by any other core: producers push with a
+ * compare-and-swap, the owning core takes the whole list at once with
+ * an exchange, so neither side takes a lock.
+ */
+typedef struct rt_mpsc {
+    rt_thread *head;
+} rt_mpsc;
+
+#ifdef NAUT_CONFIG_RT_IDLE_CSTATES
+#define RT_IDLE_STATES 5    /* none, C1 .. C4 */
+#endif
+
 typedef struct tsc_info {
     uint64_t set_time;
     uint64_t start_time;
@@ -89,14 +302,88 @@ typedef struct rt_scheduler {
     rt_queue *runnable;
     rt_queue *pending;
     rt_queue *aperiodic;
-    rt_queue *arrival;
-    rt_queue *waiting;
+    rt_mpsc arrival;            /* new or woken threads to admit */
+    rt_mpsc waiting;            /* aperiodic threads ready to run */
+    rt_mpsc unblocked;          /* threads handed an rt_mutex, done joining or released */
+#ifdef NAUT_CONFIG_RT_MUTEX
+    rt_mpsc boost;              /* mutex holders whose inherited deadline changed */
+#endif
     rt_queue *exited;
     rt_queue *sleeping;
     rt_queue *trash;
     rt_thread *main_thread;
+    int cpu;                    /* the core this scheduler runs */
     uint64_t run_time;
     tsc_info *tsc;
+    rt_mpsc inbox;              /* threads migrating to this core */
+    uint64_t owned;             /* threads its queues keep room for */
+    uint64_t placed_util;       /* placed by nk_rt_place(), not yet admitted */
+    uint64_t migrating_in;
+    uint64_t migrating_out;
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+    rt_wheel *wheel;
+#endif
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+    uint64_t split_util;        /* utilization reserved for split portions */
+#endif
+#ifdef NAUT_CONFIG_RT_CBS
+    uint64_t server_util;       /* utilization reserved by bandwidth servers */
+#endif
+#ifdef NAUT_CONFIG_RT_LAZY_RESCHED
+    rt_thread *lazy_thread;     /* what the last full pass chose */
+    uint64_t lazy_expiry;       /* when its timer fires */
+    rt_thread *lazy_head;       /* head of runnable at the time */
+    uint64_t lazy_runnable, lazy_pending, lazy_aperiodic;
+#endif
+#ifdef NAUT_CONFIG_RT_RECLAIM
+    uint64_t slack;             /* budget given back by periodic jobs */
+    uint64_t slack_deadline;    /* ... and the deadline it must be used by */
+    rt_thread *slack_thread;    /* aperiodic thread running on it */
+    uint64_t slack_mark;
+#endif
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+    uint8_t crit_mode;          /* RT_CRIT_LO or RT_CRIT_HI */
+    uint64_t mc_lo_util;        /* LO threads on their budget */
+    uint64_t mc_hi_lo_util;     /* HI threads on their LO budget */
+    uint64_t mc_hi_util;        /* HI threads on their HI budget */
+    uint64_t vd_scale;          /* HI virtual deadline as a share of the period, x100000 */
+    rt_queue *suspended;        /* LO threads held back in HI mode */
+    uint64_t mode_switches;
+#endif
+#ifdef NAUT_CONFIG_RT_IDLE_CSTATES
+    uint8_t idle_cstates;       /* C-states MWAIT offers, bit n for Cn */
+    uint8_t idle_state;         /* chosen for the idle thread, 0 for none */
+    volatile uint8_t idle_entered;  /* state it is sitting in, monitored by MWAIT */
+    uint64_t idle_wake;         /* when its timer fires */
+    uint64_t idle_latency[RT_IDLE_STATES];  /* exit latency in cycles */
+#ifdef NAUT_CONFIG_HPET_BROADCAST
+    uint8_t idle_arat;          /* APIC timer keeps running in deep C-states */
+#endif
+#endif
+#ifdef NAUT_CONFIG_RT_DEMAND_ANALYSIS
+    uint64_t demand_gen;        /* bumped whenever this core's thread set changes */
+    struct rt_demand *demand;   /* cached by the demand test */
+#endif
+#ifdef NAUT_CONFIG_RT_SIM_ADMISSION
+    struct rt_simulator *sim;   /* pool and queues for the admission simulation */
+#endif
+#ifdef NAUT_CONFIG_RT_OVERHEAD_HIST
+    rt_overhead_hist decision;  /* cycles spent in each scheduling pass */
+    rt_overhead_hist cswitch;   /* end of the pass to the new thread's registers */
+    uint64_t switch_mark;       /* when the pass handed off a new thread, 0 if none */
+#endif
+#ifdef NAUT_CONFIG_RT_BENCH
+    uint64_t passes;            /* calls to rt_need_resched() */
+    uint64_t pass_cycles;       /* ... and the cycles they took */
+    uint64_t pass_max;
+#endif
+#ifdef NAUT_CONFIG_POLL_IO
+    uint8_t reserved;           /* a dedicated I/O core, never placed on */
+#endif
+#ifdef NAUT_CONFIG_RT_CACHE_PARTITION
+    int cat_class;              /* class of service loaded on this core */
+    uint64_t cat_gen;           /* class table generation loaded on this core */
+#endif
 } rt_scheduler;
 
 rt_scheduler* rt_scheduler_init(rt_thread *main_thread);
@@ -104,24 +391,176 @@ struct nk_thread* rt_need_resched();
 void rt_start(uint64_t sched_slice_time, uint64_t sched_period);
 
 void enqueue_thread(rt_queue *queue, rt_thread *thread);
+void rt_thread_submit(int cpu, rt_thread *thread);
 rt_thread* dequeue_thread(rt_queue *queue);
 rt_thread* remove_thread(rt_thread *thread);
+void rt_thread_set_deadline(rt_thread *thread, uint64_t deadline);
+void rt_thread_set_priority(rt_thread *thread, uint64_t priority);
+int rt_thread_migrate(rt_thread *thread, int cpu);
 int rt_thread_exit(rt_thread *thread);
+int rt_thread_join_on(rt_thread *thread);
+void rt_thread_join_wait(void);
+int rt_thread_job_done(void);
+int rt_wait_next_period(void);
+int rt_sporadic_release(struct nk_thread *thread);
 void rt_thread_free(rt_thread *thread);
 void rt_thread_dump(rt_thread *thread);
+void rt_thread_get_stats(rt_thread *thread, rt_stats *stats);
+#ifdef NAUT_CONFIG_RT_HISTOGRAMS
+void rt_stats_enter(rt_thread *thread, rt_thread *prev);
+#endif
+int rt_thread_set_miss_policy(rt_thread *thread, rt_miss_policy policy, uint64_t overrun,
+                              rt_miss_callback fn, void *state);
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+int rt_thread_sleep_until(uint64_t wake_time);
+#endif
+void rt_thread_unblock(rt_thread *thread);
+#ifdef NAUT_CONFIG_RT_IDLE_CSTATES
+void rt_idle_enter(void);
+#endif
+#ifdef NAUT_CONFIG_RT_OVERHEAD_HIST
+void rt_overhead_decided(uint64_t cycles, int switching);
+void rt_overhead_switched(void);
+uint64_t rt_overhead_percentile(rt_overhead_hist *h, uint32_t pct);
+void rt_overhead_dump(int cpu);
+#endif
+#ifdef NAUT_CONFIG_LOAD_AVG
+uint64_t rt_load_util(rt_scheduler *scheduler);
+#endif
+#ifdef NAUT_CONFIG_RT_BENCH
+int rt_simulate_taskset(int cpu, rt_constraints *set, uint64_t n, uint64_t end, uint64_t *lateness);
+#endif
+
+#ifdef NAUT_CONFIG_RT_MUTEX
+/* REAL-TIME MUTEXES */
+
+/*
+ * A sleeping lock whose holder inherits the earliest deadline of the
+ * threads waiting for it, so a waiter is blocked for at most the
+ * holder's critical section rather than by whatever else is runnable.
+ * The low bit of owner says there are waiters.
+ */
+#define RT_MUTEX_WAITERS 1ULL
+
+typedef struct rt_mutex {
+    spinlock_t lock;
+    volatile uint64_t owner;    /* rt_thread holding it, 0 if free */
+    rt_thread *waiters;         /* earliest deadline first */
+} rt_mutex;
+
+void rt_mutex_init(rt_mutex *mutex);
+void rt_mutex_lock(rt_mutex *mutex);
+int rt_mutex_trylock(rt_mutex *mutex);
+void rt_mutex_unlock(rt_mutex *mutex);
+#endif
 
 // Time
 uint64_t cur_time();
 
+#ifdef NAUT_CONFIG_TSC_CLOCKSOURCE
+/* RT times are TSC cycles; these convert from and to nanoseconds */
+static inline uint64_t rt_ns(uint64_t ns)
+{
+    return nk_ns_to_cycles(ns);
+}
+
+static inline uint64_t rt_to_ns(uint64_t cycles)
+{
+    return nk_cycles_to_ns(cycles);
+}
+#endif
+
 /*
  nk_thread_t * nk_rt_need_resched();
  */
 
 /* ADMISSION CONTROL */
 
+#ifdef NAUT_CONFIG_RT_CBS
+/* CONSTANT BANDWIDTH SERVERS */
+
+#ifdef NAUT_CONFIG_RT_GROUPS
+typedef enum { RT_GROUP_RR = 0, RT_GROUP_EDF = 1, RT_GROUP_FP = 2 } rt_group_policy;
+#endif
+
+typedef struct rt_server {
+    uint64_t budget, period;    /* Q every T */
+    uint64_t remaining;         /* budget left before the deadline is postponed */
+    int cpu;
+    rt_queue *members;          /* ready members, round robin */
+    rt_thread *proxy;           /* the server on the runnable heap */
+    rt_thread *active;          /* member running now */
+    uint64_t active_mark;       /* its run_time when it was dispatched */
+    uint64_t num_members;
+    rt_constraints constraints;
+#ifdef NAUT_CONFIG_RT_GROUPS
+    rt_group_policy policy;     /* how members are ordered */
+    struct rt_server *parent;   /* group this one is a member of, NULL at top level */
+    uint64_t child_util;        /* density admitted to periodic members and child groups */
+#endif
+} rt_server;
+
+rt_server* rt_server_create(uint64_t budget, uint64_t period);
+int rt_server_destroy(rt_server *server);
+int rt_server_attach(rt_server *server, rt_thread *thread);
+void rt_server_wake(rt_thread *thread);
+#ifdef NAUT_CONFIG_RT_GROUPS
+rt_server* rt_group_create(rt_server *parent, uint64_t budget, uint64_t period,
+                           rt_group_policy policy);
+#endif
+#endif
+
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+uint8_t rt_global_lock(void);
+void rt_global_unlock(uint8_t flags);
+int rt_global_admit(rt_thread *thread);
+void rt_global_enqueue(rt_thread *thread);
+void rt_global_release(rt_thread *thread);
+#endif
+
 
 
 int rt_admit(rt_scheduler *scheduler, rt_thread *thread);
+#ifdef NAUT_CONFIG_RT_SIM_ADMISSION
+/* 1 if the simulated schedule meets every deadline; lateness may be NULL */
+int rt_admit_simulate(rt_scheduler *scheduler, rt_thread *thread, uint64_t *lateness);
+#endif
+
+/* PLACEMENT */
+
+typedef enum { RT_PLACE_FIRST_FIT = 0, RT_PLACE_BEST_FIT = 1, RT_PLACE_WORST_FIT = 2 } rt_place_policy;
+
+/* allow moving an already admitted periodic thread to make room */
+#define RT_PLACE_REBALANCE 0x1
+
+/* or'd into nk_thread_start()'s rt_type: the thread takes over nk_rt_place()'s reservation on its cpu */
+#define RT_PLACED 0x100
+
+int nk_rt_place(rt_type type, rt_constraints *constraints, uint64_t deadline,
+                rt_place_policy policy, int flags);
+void nk_rt_unplace(int cpu, rt_type type, rt_constraints *constraints);
+void rt_thread_placed(rt_thread *thread, int cpu);
+
+#ifdef NAUT_CONFIG_RT_TASK_SETS
+/* how the cores decided on a task set nk_rt_admit_set() handed them */
+typedef struct rt_set {
+    volatile uint64_t undecided;    /* members not yet admitted or refused */
+    volatile uint64_t refused;
+} rt_set;
+
+struct nk_rt_set_member;
+
+/* reserve a core for every member or for none, 0 on success */
+int rt_set_place(struct nk_rt_set_member *set, int n, rt_place_policy policy);
+void rt_set_unplace(struct nk_rt_set_member *set, int n);
+void rt_set_submit(int cpu, rt_thread *thread, rt_set *set, uint64_t start);
+void rt_set_withdraw(rt_thread *thread);
+#endif
+
+#ifdef NAUT_CONFIG_POLL_IO
+/* take the calling core out of placement (and global EDF), for good */
+int nk_rt_reserve_self(void);
+#endif
 
 
 
@@ -0,0 +1,43 @@
+//
+//  rt_wheel.h
+//
+//  Hierarchical timing wheel keyed on TSC expiry times, used by the
+//  real-time scheduler for periodic releases and timed sleepers.
+//
+
+#ifndef rt_wheel_h
+#define rt_wheel_h
+
+#include <nautilus/list.h>
+
+#define RT_WHEEL_BITS   6
+#define RT_WHEEL_SIZE   (1 << RT_WHEEL_BITS)
+#define RT_WHEEL_MASK   (RT_WHEEL_SIZE - 1)
+#define RT_WHEEL_LEVELS 4
+
+/* log2 of the number of TSC cycles in one wheel tick */
+#define RT_WHEEL_SHIFT  NAUT_CONFIG_RT_WHEEL_SHIFT
+
+struct rt_thread;
+
+typedef struct rt_wheel {
+    uint64_t now;       /* next tick to be processed */
+    uint64_t count;
+    uint64_t bitmap[RT_WHEEL_LEVELS];
+    struct list_head slots[RT_WHEEL_LEVELS][RT_WHEEL_SIZE];
+} rt_wheel;
+
+rt_wheel* rt_wheel_create(uint64_t now);
+void rt_wheel_destroy(rt_wheel *wheel);
+
+void rt_wheel_add(rt_wheel *wheel, struct rt_thread *thread, uint64_t expiry);
+void rt_wheel_remove(rt_wheel *wheel, struct rt_thread *thread);
+int rt_wheel_pending(struct rt_thread *thread);
+
+/* move every thread due at or before now onto expired (linked by wheel_node) */
+uint64_t rt_wheel_advance(rt_wheel *wheel, uint64_t now, struct list_head *expired);
+
+/* TSC time of the next wheel event, 0 if the wheel is empty */
+uint64_t rt_wheel_next(rt_wheel *wheel);
+
+#endif /* rt_wheel_h */
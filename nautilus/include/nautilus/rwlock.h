@@ -44,6 +44,41 @@ int nk_rwlock_wr_unlock(nk_rwlock_t * l);
 uint8_t nk_rwlock_wr_lock_irq_save(nk_rwlock_t * l);
 int nk_rwlock_wr_unlock_irq_restore(nk_rwlock_t * l, uint8_t flags);
 
+
+/*
+ * Big-reader lock for read-mostly data. Each CPU has its own
+ * cache-line sized reader count, so a read acquisition only touches
+ * a line local to the reading core. A writer announces itself in
+ * the shared writer word and then waits for every CPU's count to
+ * drain, so writes pay the cross-core cost instead.
+ *
+ * nk_brlock_rd_lock() returns the slot it counted itself on, which
+ * must be handed back to nk_brlock_rd_unlock(). This keeps the lock
+ * correct if the reader is migrated inside its critical section.
+ * Pending writers hold off new readers.
+ */
+struct nk_brlock_cpu {
+    volatile uint32_t readers;
+} __attribute__((aligned(64)));
+
+struct nk_brlock {
+    spinlock_t wlock;
+    volatile uint32_t writer;
+    uint32_t ncpus;
+    struct nk_brlock_cpu * cpus;
+};
+
+typedef struct nk_brlock nk_brlock_t;
+
+int nk_brlock_init(nk_brlock_t * l);
+void nk_brlock_deinit(nk_brlock_t * l);
+int nk_brlock_rd_lock(nk_brlock_t * l);
+void nk_brlock_rd_unlock(nk_brlock_t * l, int slot);
+void nk_brlock_wr_lock(nk_brlock_t * l);
+void nk_brlock_wr_unlock(nk_brlock_t * l);
+uint8_t nk_brlock_wr_lock_irq_save(nk_brlock_t * l);
+void nk_brlock_wr_unlock_irq_restore(nk_brlock_t * l, uint8_t flags);
+
 void nk_rwlock_test(void);
 
 #ifdef __cplusplus
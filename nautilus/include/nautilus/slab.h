@@ -0,0 +1,60 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Caches of fixed-size kernel objects. Objects are carved out of
+ * slabs taken straight from the buddy system, so they are packed at
+ * their own size rather than rounded up to a power of two like
+ * malloc(). Each CPU allocates from its own partial slabs with
+ * interrupts off and no lock. An object freed on another CPU goes
+ * back to the CPU that owns its slab.
+ *
+ * ctor, if given, is run once on each object when its slab is made,
+ * and objects are expected to be freed in that constructed state.
+ */
+struct nk_slab_cache;
+
+struct nk_slab_cache * nk_slab_cache_create(const char * name, size_t size, size_t align, void (*ctor)(void * obj));
+int nk_slab_cache_destroy(struct nk_slab_cache * cache);
+
+void * nk_slab_alloc(struct nk_slab_cache * cache);
+void nk_slab_free(struct nk_slab_cache * cache, void * obj);
+
+/*
+ * log2 of a cache's slab size, and the cache an object belongs to
+ * given that size, for callers that keep several caches whose slabs
+ * are all the same size and do not know which one an object is from
+ */
+ulong_t nk_slab_cache_order(struct nk_slab_cache * cache);
+struct nk_slab_cache * nk_slab_cache_of(void * obj, ulong_t order);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -43,6 +43,7 @@ uint8_t nk_get_cpu_by_lapicid (uint8_t lapicid);
 #include <nautilus/spinlock.h>
 #include <nautilus/mm.h>
 #include <nautilus/queue.h>
+#include <nautilus/cpumask.h>
 
 struct naut_info;
 struct nk_topo_params;
@@ -70,6 +71,41 @@ struct nk_xcall {
     uint8_t has_waiter;
 };
 
+/*
+ * Completion for asynchronous xcalls. Every call issued against a
+ * token counts it up and the target counts it back down once the
+ * function has run, so one token can cover calls to many cores.
+ */
+struct nk_xcall_token {
+    volatile uint32_t pending;
+};
+
+typedef struct nk_xcall_token nk_xcall_token_t;
+
+#ifdef NAUT_CONFIG_XCALL_RINGS
+/*
+ * Each target has one single-producer ring per sender. A sender
+ * fills a slot and bumps tail and the target drains from head, so
+ * neither side takes a lock. A bit per sender in the target's
+ * pending mask says which rings to look at.
+ */
+#define NK_XCALL_RING_SIZE 4
+
+struct nk_xcall_slot {
+    nk_xcall_func_t     fun;
+    void *              arg;
+    nk_xcall_token_t *  tok;
+};
+
+struct nk_xcall_ring {
+    volatile uint32_t    head;   /* target */
+    volatile uint32_t    tail;   /* sender */
+    struct nk_xcall_slot slots[NK_XCALL_RING_SIZE];
+} __attribute__((aligned(64)));
+
+#define NK_XCALL_PENDING_WORDS ((NAUT_CONFIG_MAX_CPUS + 63) / 64)
+#endif
+
 
 #ifdef NAUT_CONFIG_PROFILE
     struct nk_instr_data;
@@ -79,7 +115,7 @@ struct cpu {
     struct nk_thread * cur_thread; /* KCH: this must be first! */
 
     cpu_id_t id;
-    uint8_t lapic_id;
+    uint32_t lapic_id;
     uint8_t enabled;
     uint8_t is_bsp;
     uint32_t cpu_sig;
@@ -94,11 +130,27 @@ struct cpu {
     spinlock_t lock;
 
     struct nk_queue * run_q;
+    struct nk_thread * idle_thread; /* kept off run_q, run when it is empty */
+#ifdef NAUT_CONFIG_FPU_LAZY
+    struct nk_thread * fpu_owner;   /* last thread whose FPU state was loaded here */
+#endif
+#ifdef NAUT_CONFIG_THREAD_WORK_STEALING
+    struct nk_steal_deque * steal_q;
+#endif
 
     nk_queue_t * xcall_q;
     struct nk_xcall xcall_nowait_info;
+#ifdef NAUT_CONFIG_XCALL_RINGS
+    struct nk_xcall_ring * xcall_rings;  /* indexed by sender */
+    volatile uint64_t xcall_pending[NK_XCALL_PENDING_WORDS];
+    volatile uint32_t xcall_ipi;         /* an IPI is on its way */
+#endif
 
     ulong_t cpu_khz; 
+#ifdef NAUT_CONFIG_TSC_SYNC
+    sint64_t tsc_skew_lo;   /* bounds on this TSC minus the BSP's, in cycles */
+    sint64_t tsc_skew_hi;
+#endif
     
     /* NUMA info */
     struct nk_topo_params * tp;
@@ -107,6 +159,9 @@ struct cpu {
 
     struct kmem_data kmem;
 
+    struct cpu * self;      /* where GS points, so this_cpu() is one load */
+    addr_t percpu_off;      /* from DEFINE_PER_CPU variables to this core's copies */
+
 
     struct nk_rand_info * rand;
 
@@ -137,12 +192,32 @@ struct ap_init_area {
 
     void (*entry)(struct cpu * core); // 90
 
+    /* parallel boot only, indexed by initial APIC ID */
+    uint64_t * stacks; // 98
+    struct cpu ** cpus; // 106
+
 } __packed;
 
 
 int smp_early_init(struct naut_info * naut);
 int smp_bringup_aps(struct naut_info * naut);
+
+#ifdef NAUT_CONFIG_TSC_SYNC
+/* best estimate of cpu's TSC minus the BSP's */
+sint64_t nk_tsc_skew(cpu_id_t cpu);
+/* how far apart any two cores' TSCs can be, in cycles */
+uint64_t nk_tsc_skew_bound(void);
+#endif
 int smp_xcall(cpu_id_t cpu_id, nk_xcall_func_t fun, void * arg, uint8_t wait);
+int smp_xcall_async(cpu_id_t cpu_id, nk_xcall_func_t fun, void * arg, nk_xcall_token_t * tok);
+void smp_xcall_token_wait(nk_xcall_token_t * tok);
+int smp_xcall_mask(const nk_cpumask_t * mask, nk_xcall_func_t fun, void * arg, uint8_t wait);
+
+static inline void
+smp_xcall_token_init (nk_xcall_token_t * tok)
+{
+    tok->pending = 0;
+}
 void smp_ap_entry (struct cpu * core);
 int smp_setup_xcall_bsp (struct cpu * core);
 
@@ -162,6 +237,10 @@ int arch_early_init (struct naut_info * naut);
 #define AP_BOOT_STACK_ADDR 0x1000
 #define AP_INFO_AREA       0x2000
 
+/* parallel boot gives each AP its own boot stack, found by APIC ID */
+#define AP_BOOT_STACK_SIZE 0x1000
+#define AP_MAX_APIC_ID     256
+
 #define BASE_MEM_LAST_KILO 0x9fc00
 #define BIOS_ROM_BASE      0xf0000
 #define BIOS_ROM_END       0xfffff
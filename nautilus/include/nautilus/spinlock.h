@@ -44,12 +44,126 @@ spinlock_init (volatile spinlock_t * lock);
 void
 spinlock_deinit (volatile spinlock_t * lock);
 
+/*
+ * The lock word is always one 32-bit, zero-initialized spinlock_t,
+ * so the backend (NAUT_CONFIG_SPINLOCK_*) is invisible to callers.
+ *
+ * TAS:    0 is free, 1 is held.
+ * TICKET: the low half is the ticket being served, the high half
+ *         the next ticket to hand out. Waiters get FIFO order but
+ *         all spin on the lock word.
+ * QUEUED: the low byte is the held flag, the high half names the
+ *         last waiter's queue node (cpu and nesting level). An
+ *         uncontended acquire is one cmpxchg; contended waiters
+ *         line up in an MCS queue of per-CPU nodes and each spins
+ *         on its own node, only the front one watches the word.
+ *         See spinlock.c.
+ */
+#if defined(NAUT_CONFIG_SPINLOCK_TICKET)
+
+static inline void
+__spin_acquire (volatile spinlock_t * lock)
+{
+    uint16_t me = __sync_fetch_and_add(lock, 1U << 16) >> 16;
+    PAUSE_WHILE(*(volatile uint16_t*)lock != me);
+}
+
+static inline void
+__spin_acquire_nopause (volatile spinlock_t * lock)
+{
+    uint16_t me = __sync_fetch_and_add(lock, 1U << 16) >> 16;
+    while (*(volatile uint16_t*)lock != me) {
+        /* nothing */
+    }
+}
+
+static inline int
+__spin_try_acquire (volatile spinlock_t * lock)
+{
+    uint32_t v = *lock;
+    return (v & 0xffff) == (v >> 16) && __sync_bool_compare_and_swap(lock, v, v + (1U << 16));
+}
+
+static inline void
+__spin_release (volatile spinlock_t * lock)
+{
+    /* only the holder writes the low half */
+    asm volatile ("" ::: "memory");
+    *(volatile uint16_t*)lock = *(volatile uint16_t*)lock + 1;
+}
+
+#elif defined(NAUT_CONFIG_SPINLOCK_QUEUED)
+
+#define SPIN_Q_LOCKED    0x1U
+#define SPIN_Q_TAIL_MASK 0xffff0000U
+
+void __spin_lock_queued(volatile spinlock_t * lock);
+
+static inline void
+__spin_acquire (volatile spinlock_t * lock)
+{
+    if (likely(__sync_bool_compare_and_swap(lock, 0, SPIN_Q_LOCKED))) {
+        return;
+    }
+    __spin_lock_queued(lock);
+}
+
+#define __spin_acquire_nopause(l) __spin_acquire(l)
+
+static inline int
+__spin_try_acquire (volatile spinlock_t * lock)
+{
+    return __sync_bool_compare_and_swap(lock, 0, SPIN_Q_LOCKED);
+}
+
+static inline void
+__spin_release (volatile spinlock_t * lock)
+{
+    /* the tail is left alone, the next in line will see the flag go */
+    asm volatile ("" ::: "memory");
+    *(volatile uint8_t*)lock = 0;
+}
+
+#else
+
+static inline void
+__spin_acquire (volatile spinlock_t * lock)
+{
+    PAUSE_WHILE(__sync_lock_test_and_set(lock, 1));
+}
+
+static inline void
+__spin_acquire_nopause (volatile spinlock_t * lock)
+{
+    while (__sync_lock_test_and_set(lock, 1)) {
+        /* nothing */
+    }
+}
+
+static inline int
+__spin_try_acquire (volatile spinlock_t * lock)
+{
+    return !__sync_lock_test_and_set(lock, 1);
+}
+
+static inline void
+__spin_release (volatile spinlock_t * lock)
+{
+    __sync_lock_release(lock);
+}
+
+#endif
+
 static inline void
 spin_lock (volatile spinlock_t * lock) 
 {
     NK_PROFILE_ENTRY();
     
+#if defined(NAUT_CONFIG_SPINLOCK_TICKET) || defined(NAUT_CONFIG_SPINLOCK_QUEUED)
+    __spin_acquire(lock);
+#else
     while (__sync_lock_test_and_set(lock, 1));
+#endif
 
     NK_PROFILE_EXIT();
 }
@@ -62,7 +176,7 @@ spin_lock_irq_save (volatile spinlock_t * lock)
     if (flags) {
         asm volatile ("cli");
     }
-    PAUSE_WHILE(__sync_lock_test_and_set(lock, 1));
+    __spin_acquire(lock);
     return flags;
 }
 
@@ -76,20 +190,73 @@ static inline void
 spin_unlock (volatile spinlock_t * lock) 
 {
     NK_PROFILE_ENTRY();
-    __sync_lock_release(lock);
+    __spin_release(lock);
     NK_PROFILE_EXIT();
 }
 
 static void
 spin_unlock_irq_restore (volatile spinlock_t * lock, uint8_t flags)
 {
-    __sync_lock_release(lock);
+    __spin_release(lock);
     if (flags) {
         asm volatile ("sti");
     }
 }
 
 
+#ifdef NAUT_CONFIG_LOCK_PROFILE
+/*
+ * Lock profiling. Every spin_lock and spin_lock_irq_save call site
+ * gets a static nk_lock_site (see instrument.h), so a site stands in
+ * for a lock class. An acquire first tries the lock once, and only
+ * if that fails is the wait timed. The hold time runs from there to
+ * the matching unlock on the same CPU.
+ */
+static inline void
+__spin_lock_prof (volatile spinlock_t * lock, struct nk_lock_site * site)
+{
+    uint64_t start = 0;
+
+    if (!__spin_try_acquire(lock)) {
+        start = rdtsc();
+        __spin_acquire(lock);
+    }
+
+    nk_lock_prof_acquired(lock, site, start);
+}
+
+static inline uint8_t
+__spin_lock_irq_save_prof (volatile spinlock_t * lock, struct nk_lock_site * site)
+{
+    uint64_t rflags = read_rflags();
+    uint8_t flags = (rflags & RFLAGS_IF) != 0;
+    if (flags) {
+        asm volatile ("cli");
+    }
+    __spin_lock_prof(lock, site);
+    return flags;
+}
+
+static inline void
+__spin_unlock_prof (volatile spinlock_t * lock)
+{
+    nk_lock_prof_released(lock);
+    __spin_release(lock);
+}
+
+#define spin_lock(l)                  __spin_lock_prof(l, NK_LOCK_SITE())
+#define spin_lock_irq_save(l)         __spin_lock_irq_save_prof(l, NK_LOCK_SITE())
+#define spin_unlock(l)                __spin_unlock_prof(l)
+#define spin_unlock_irq_restore(l, f)                   \
+    do {                                                \
+        uint8_t __nk_lock_f = (f);                      \
+        __spin_unlock_prof(l);                          \
+        if (__nk_lock_f) {                              \
+            asm volatile ("sti");                       \
+        }                                               \
+    } while (0)
+#endif
+
 
 #ifdef NAUT_CONFIG_USE_TICKETLOCKS
 #include <nautilus/ticketlock.h>
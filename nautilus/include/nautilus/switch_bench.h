@@ -0,0 +1,46 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __SWITCH_BENCH_H__
+#define __SWITCH_BENCH_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Context switch benchmark.
+ *
+ * The calling thread and a partner on the same core hand the core
+ * back and forth with nk_yield() for switches rounds each. Both
+ * count their own cycles and LLC misses with per-thread counters,
+ * which stop as a thread is switched out, so the totals cover every
+ * switch once, plus the loop around the yield. The report gives
+ * both per switch, along with the sizes of nk_thread and rt_thread
+ * and how many cache lines their scheduler-hot fields span.
+ */
+int nk_switch_bench(uint64_t switches);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
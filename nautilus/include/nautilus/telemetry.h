@@ -0,0 +1,109 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * A page-aligned region of guest memory that a kernel thread rewrites
+ * every NAUT_CONFIG_TELEMETRY_INTERVAL_MS with per-core and per-thread
+ * statistics, so that a host tool can read them out of guest memory
+ * (a VMM, gdb, QEMU's pmemsave) instead of scraping serial output.
+ * Its guest physical address is printed at boot, and it starts with
+ * NK_TELEMETRY_MAGIC so it can also be found by a scan.
+ *
+ * The writer makes seq odd, updates and makes seq even again. A
+ * reader copies the region between two reads of the same even seq.
+ * Fields a configuration does not have are left at 0.
+ *
+ * The layout below is what host tools read and must not change
+ * without bumping NK_TELEMETRY_VERSION.
+ */
+
+#define NK_TELEMETRY_MAGIC   0x314d454c45544b4eULL   /* "NKTELEM1" */
+#define NK_TELEMETRY_VERSION 1
+
+#define NK_TELEMETRY_PMC 4
+
+struct nk_telemetry_cpu {
+    uint64_t runnable;          /* load averages, as in struct nk_load */
+    uint64_t rt_util;
+    uint64_t idle;
+    uint64_t sched_pass;        /* cycles of the last RT scheduling pass */
+    uint64_t passes;            /* with RT_OVERHEAD_HIST */
+    uint64_t decision_pct;      /* pass cost at RT_OVERHEAD_PERCENTILE */
+    uint64_t cswitch_pct;       /* switch cost at RT_OVERHEAD_PERCENTILE */
+    uint64_t rsvd;
+} __attribute__((packed));
+
+struct nk_telemetry_thread {
+    uint64_t tid;
+    uint32_t cpu;               /* bound_cpu */
+    uint8_t  status;            /* nk_thread_status_t */
+    uint8_t  rt_type;           /* rt_type, 0 (aperiodic) without the RT scheduler */
+    uint8_t  rt_status;
+    uint8_t  npmc;              /* valid entries in pmc[] */
+    uint64_t period;            /* or the sporadic work */
+    uint64_t slice;             /* or the aperiodic priority */
+    uint64_t deadline;
+    uint64_t run_time;
+    uint64_t releases;          /* rt_stats */
+    uint64_t misses;
+    uint64_t skipped;
+    uint64_t overruns;
+    uint64_t lateness_max;
+    uint64_t jitter_max;
+    uint64_t jitter_sum;
+    uint64_t pmc[NK_TELEMETRY_PMC];  /* its first events, scaled to its whole run */
+} __attribute__((packed));
+
+struct nk_telemetry {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t size;              /* bytes in the whole region */
+    uint32_t num_cpus;
+    uint32_t max_threads;       /* slots in thread[] */
+    uint32_t num_threads;       /* slots filled in this update */
+    uint32_t lost_threads;      /* threads that did not fit */
+    uint64_t cpu_khz;
+    uint64_t interval_ms;
+    volatile uint64_t seq;
+    uint64_t stamp;             /* TSC of this update */
+    uint64_t updates;
+
+    struct nk_telemetry_cpu cpu[NAUT_CONFIG_MAX_CPUS] __attribute__((aligned(64)));
+    struct nk_telemetry_thread thread[NAUT_CONFIG_TELEMETRY_THREADS];
+};
+
+int nk_telemetry_start(void);
+
+// rewrite the region now, besides the periodic updates
+void nk_telemetry_update(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
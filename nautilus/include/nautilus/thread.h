@@ -32,9 +32,15 @@ extern "C" {
 #include <nautilus/spinlock.h>
 #include <nautilus/queue.h>
 #include <nautilus/intrinsics.h>
+#ifdef NAUT_CONFIG_PROFILE
+#include <nautilus/instrument.h>
+#endif
 #ifdef NAUT_CONFIG_USE_RT_SCHEDULER
 #include <nautilus/rt_scheduler.h>
 #endif
+#ifdef NAUT_CONFIG_WORKQUEUE
+#include <nautilus/workqueue.h>
+#endif
     
 #define CPU_ANY       -1
     
@@ -87,11 +93,26 @@ extern "C" {
                         int rt_type,
                         rt_constraints *rt_constraints,
                         uint64_t rt_deadline);
+#endif
+#ifdef NAUT_CONFIG_RT_TASK_SETS
+    /* one periodic thread of a set started by nk_rt_admit_set() */
+    typedef struct nk_rt_set_member {
+        nk_thread_fun_t fun;
+        void *input;
+        void **output;
+        nk_stack_size_t stack_size;
+        rt_constraints *constraints;
+        int cpu;                /* filled in: where it was placed */
+        nk_thread_id_t tid;     /* filled in */
+    } nk_rt_set_member;
+
+    int nk_rt_admit_set(nk_rt_set_member *set, int n, int policy, uint64_t start);
 #endif
     extern nk_thread_id_t nk_thread_fork(void);
     
     void nk_set_thread_fork_output(void * result);
     void nk_yield(void);
+    int nk_thread_migrate(nk_thread_id_t tid, int cpu);
     void nk_thread_exit(void * retval);
     void nk_thread_destroy(nk_thread_id_t t); /* like thread_kill */
     void nk_wait(nk_thread_id_t t);
@@ -116,6 +137,11 @@ extern "C" {
     /********* INTERNALS ***********/
     
 #define FXSAVE_SIZE 512
+#ifdef NAUT_CONFIG_FPU_XSAVE
+#define FPU_STATE_ALIGN 64
+#else
+#define FPU_STATE_ALIGN 16
+#endif
     
     
     /* FOR TLS */
@@ -136,18 +162,43 @@ extern "C" {
     
     typedef struct nk_queue nk_thread_queue_t;
     
+    /*
+     * The first cache line holds what a context switch and the
+     * schedulers touch on every decision. Everything else follows,
+     * the TLS key values live out of line, and the FPU area is last.
+     */
     struct nk_thread {
         uint64_t rsp; /* SHOULD NOT CHANGE POSITION */
         void * stack; /* SHOULD NOT CHANGE POSITION */
         uint16_t fpu_state_offset; /* SHOULD NOT CHANGE POSITION */
         
+        /* thread state */
+        nk_thread_status_t status;
+        int bound_cpu;
+        uint8_t is_idle;
+        
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+        rt_thread *rt_thread;
+#endif
+        nk_thread_queue_t * cur_run_q;
+        nk_queue_entry_t runq_node; // formerly q_node
+        
+        /* end of the hot line */
+        
+#ifdef NAUT_CONFIG_THREAD_WORK_STEALING
+        uint8_t is_stealable; /* created with CPU_ANY */
+#endif
+#ifdef NAUT_CONFIG_FPU_LAZY
+        int fpu_cpu; /* CPU our FPU state was last loaded on, -1 if none */
+#endif
+        
         nk_stack_size_t stack_size;
         unsigned long tid;
         
         int lock;
         
-        nk_queue_entry_t runq_node; // formerly q_node
-        nk_queue_entry_t thr_list_node;
+        struct list_head thr_list_node;
+        int tlist_cpu;               /* whose thread list it is on */
         
         /* parent/child relationship */
         struct nk_thread * parent;
@@ -158,14 +209,13 @@ extern "C" {
         nk_thread_queue_t * waitq;
         nk_queue_entry_t wait_node;
         
-        nk_thread_queue_t * cur_run_q;
-        
-        /* thread state */
-        nk_thread_status_t status;
-        
-        int bound_cpu;
-        
-        uint8_t is_idle;
+#ifdef NAUT_CONFIG_THREAD_CACHE
+        uint8_t tls_dirty; /* a TLS key was set, clear tls[] on reuse */
+        struct nk_thread * cache_next;
+#endif
+#ifdef NAUT_CONFIG_WORKQUEUE
+        struct nk_work reap_work; /* finishes nk_thread_destroy() on a worker */
+#endif
         
         void * output;
         void * input;
@@ -173,28 +223,67 @@ extern "C" {
         
         struct nk_virtual_console *vc;
         
-        const void * tls[TLS_MAX_KEYS];
+#ifdef NAUT_CONFIG_PMC_THREAD
+        struct nk_pmc_thread * pmc; /* counter set, NULL unless it opted in */
+#endif
+#ifdef NAUT_CONFIG_PROFILE
+        uint64_t prof_wake_tsc; /* interrupt that woke it, until it runs */
+        uint32_t prof_depth; /* may run past NK_PROF_SHADOW_DEPTH, deeper frames are not timed */
+        struct nk_prof_frame prof_stack[NK_PROF_SHADOW_DEPTH];
+#endif
         
-        uint8_t fpu_state[FXSAVE_SIZE] __align(16);
+#ifdef NAUT_CONFIG_FIBERS
+        struct nk_fiber_sched * fibers; /* fibers it has started, NULL if none */
+#endif
         
-#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
-        rt_thread *rt_thread;
+#ifdef NAUT_CONFIG_HW_TLS
+        void * tls_block;    /* its __thread variables */
+        addr_t fs_base;      /* the end of tls_block, loaded into FS when it runs */
 #endif
+        
+        /* TLS_MAX_KEYS values, allocated by the first nk_tls_set() */
+        const void ** tls;
+        
+        /* keep last, with XSAVE the area runs past FXSAVE_SIZE
+         * (see nk_fpu_state_size()) */
+        uint8_t fpu_state[FXSAVE_SIZE] __align(FPU_STATE_ALIGN);
     } __packed;
     
     // internal thread representations
     typedef struct nk_thread nk_thread_t;
     
+    /*
+     * Threads are listed on the core that created them, and each core
+     * hands out thread ids from a range of its own, so creating a
+     * thread touches nothing another core is using.
+     */
+    struct nk_thread_list {
+        spinlock_t lock;
+        struct list_head threads;
+        uint64_t count;
+        unsigned long next_tid;      /* the core's current range of ids */
+        unsigned long end_tid;
+    } __attribute__((aligned(64)));
+    
     struct nk_sched_state {
-        nk_thread_queue_t * thread_list;
-        uint_t num_threads;
+        struct nk_thread_list thread_lists[NAUT_CONFIG_MAX_CPUS];
     };
     
+#ifdef NAUT_CONFIG_HW_TLS
+    // called by nk_thread_switch for the incoming thread
+    void nk_tls_switch(nk_thread_t * next);
+#endif
+    
+    // calls fn on every thread until it returns nonzero, and returns that
+    int nk_thread_for_each(int (*fn)(nk_thread_t *t, void *state), void *state);
+    uint64_t nk_thread_count(void);
+    
     
     nk_thread_id_t __thread_fork(void);
     nk_thread_t* nk_need_resched(void);
     int nk_sched_init(void);
     int nk_sched_init_ap(void);
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
     int nk_thread_start_sim (nk_thread_fun_t fun,
                  void *input,
                  void **output,
@@ -205,6 +294,7 @@ extern "C" {
                  int rt_type,
                  rt_constraints *rt_constraints,
                  uint64_t rt_deadline);
+#endif
     
     void nk_schedule(void);
     
@@ -218,6 +308,9 @@ extern "C" {
     int nk_thread_queue_sleep(nk_thread_queue_t * q);
     int nk_thread_queue_wake_one(nk_thread_queue_t * q);
     int nk_thread_queue_wake_all(nk_thread_queue_t * q);
+    int nk_thread_queue_wait_word(nk_thread_queue_t * q, volatile uint32_t * word, uint32_t val);
+    int nk_thread_queue_wake_word(nk_thread_queue_t * q, uint8_t all);
+    int nk_thread_queue_wake_thread(nk_thread_queue_t * q, nk_thread_t * t);
     
     struct nk_tls {
         unsigned seq_num;
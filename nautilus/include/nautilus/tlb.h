@@ -0,0 +1,73 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __TLB_H__
+#define __TLB_H__
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Batched TLB shootdown. A caller that has changed shared page
+ * table entries describes the affected ranges and every core drops
+ * them with one xcall each, all sent before any is waited on. A core
+ * flushes a batch with INVLPG while it spans at most
+ * NAUT_CONFIG_TLB_INVLPG_THRESHOLD pages, and with a context flush
+ * above that. With PCIDs the context flush only drops the kernel
+ * PCID's non-global entries.
+ *
+ * Shootdowns must be started with interrupts on and no spinlocks
+ * held, since a core waiting to start one has to keep answering
+ * the one in progress.
+ */
+
+#define NK_TLB_KERNEL_PCID 0
+
+struct nk_tlb_range {
+    addr_t  addr;
+    ulong_t len;
+    ulong_t page_size;   /* size of the pages mapping the range */
+};
+
+#define NK_TLB_BATCH_MAX 16
+
+struct nk_tlb_batch {
+    unsigned            n;
+    uint8_t             full;   /* overflowed, flush everything */
+    struct nk_tlb_range ranges[NK_TLB_BATCH_MAX];
+};
+
+static inline void
+nk_tlb_batch_init (struct nk_tlb_batch * b)
+{
+    b->n    = 0;
+    b->full = 0;
+}
+
+void nk_tlb_batch_add(struct nk_tlb_batch * b, addr_t addr, ulong_t len, ulong_t page_size);
+int  nk_tlb_batch_flush(struct nk_tlb_batch * b);
+
+int nk_tlb_shootdown(struct nk_tlb_range * ranges, unsigned n);
+int nk_tlb_shootdown_all(void);
+
+void nk_tlb_flush_local(struct nk_tlb_range * ranges, unsigned n);
+
+struct cpu;
+int nk_tlb_init(struct cpu * core);
+
+#endif
@@ -0,0 +1,95 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Scheduler event tracing.
+ *
+ * Each core writes fixed-size binary records into its own ring. A
+ * record's slot is claimed with an unlocked XADD, which cannot be
+ * split by an interrupt, so an IRQ that traces in the middle of
+ * another record just takes the next slot. Nothing waits and no
+ * other core is involved. Once the ring wraps the oldest records are
+ * overwritten. Stop tracing before reading the rings out with
+ * nk_trace_read() or nk_trace_dump().
+ *
+ * deadline and run_time are the thread's for scheduler events. Other
+ * events put their own arguments there, as noted.
+ */
+#define NK_TRACE_RESCHED   1    /* thread picked to run next */
+#define NK_TRACE_SWITCH    2    /* context switch to tid */
+#define NK_TRACE_IRQ_ENTER 3    /* deadline = vector */
+#define NK_TRACE_IRQ_EXIT  4    /* deadline = vector */
+#define NK_TRACE_XCALL     5    /* deadline = function, run_time = sending core */
+
+/*
+ * Legion profiling, with LEGION_RT_TRACE_PROF. tid is the Legion
+ * processor's local id and deadline an operation's unique id, or an
+ * instance id for instance events. NK_TRACE_LEGION plus a ProfKind
+ * marks the begin or end of a phase of that operation.
+ */
+#define NK_TRACE_LEGION              0x100
+#define NK_TRACE_LEGION_KINDS        0x80
+#define NK_TRACE_LEGION_TASK         0x180  /* run_time = task id */
+#define NK_TRACE_LEGION_MAP          0x181  /* run_time = parent's unique id */
+#define NK_TRACE_LEGION_CLOSE        0x182  /* run_time = parent's unique id */
+#define NK_TRACE_LEGION_COPY         0x183  /* run_time = parent's unique id */
+#define NK_TRACE_LEGION_INST_CREATE  0x184  /* run_time = memory */
+#define NK_TRACE_LEGION_INST_DESTROY 0x185
+
+struct nk_trace_rec {
+    uint64_t tsc;
+    uint32_t event;
+    uint32_t tid;
+    uint64_t deadline;
+    uint64_t run_time;
+};
+
+#ifdef NAUT_CONFIG_SCHED_TRACE
+void nk_trace(uint32_t event, uint32_t tid, uint64_t deadline, uint64_t run_time);
+
+#define NK_TRACE(event, tid, deadline, run_time) nk_trace(event, tid, deadline, run_time)
+
+int nk_trace_init(void);
+void nk_trace_enable(int on);
+void nk_trace_reset(void);
+/* copy up to max of cpu's records out, oldest first, returns how many */
+uint64_t nk_trace_read(int cpu, struct nk_trace_rec * dst, uint64_t max);
+void nk_trace_dump(void);
+
+/* called from the interrupt entry path */
+void nk_trace_irq_enter(uint64_t vec);
+void nk_trace_irq_exit(uint64_t vec);
+#else
+#define NK_TRACE(event, tid, deadline, run_time)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,51 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __TSS_H__
+#define __TSS_H__
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Each core gets its own GDT with a 64-bit TSS, whose interrupt stack
+ * table gives the page fault and double fault handlers stacks of
+ * their own. They can then run when the faulting thread's stack is
+ * not mapped, as with lazily backed stacks.
+ */
+#define KERNEL_TSS 24
+
+#define TSS_IST_PF 1
+#define TSS_IST_DF 2
+
+#define TSS_IST_SIZE (16UL << 10)
+
+struct tss64 {
+    uint32_t rsvd0;
+    uint64_t rsp[3];
+    uint64_t rsvd1;
+    uint64_t ist[7];
+    uint64_t rsvd2;
+    uint16_t rsvd3;
+    uint16_t iomap_base;
+} __packed;
+
+struct cpu;
+int nk_tss_init(struct cpu * core);
+
+#endif
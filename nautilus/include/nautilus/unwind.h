@@ -0,0 +1,110 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __UNWIND_H__
+#define __UNWIND_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * The base unwinding interface of the Itanium C++ ABI, which the C++
+ * runtime's exceptions (__cxa_throw() and the personality routine in
+ * libsupc++) are written against.
+ *
+ * Frames are unwound table-driven from the DWARF call frame
+ * information the compiler puts in .eh_frame, so code that throws
+ * nothing pays nothing. The FDE covering a pc is found by a binary
+ * search of the sorted table the linker writes to .eh_frame_hdr, or
+ * of one built from .eh_frame at boot if there is none.
+ */
+
+typedef enum {
+    _URC_NO_REASON = 0,
+    _URC_FOREIGN_EXCEPTION_CAUGHT = 1,
+    _URC_FATAL_PHASE2_ERROR = 2,
+    _URC_FATAL_PHASE1_ERROR = 3,
+    _URC_NORMAL_STOP = 4,
+    _URC_END_OF_STACK = 5,
+    _URC_HANDLER_FOUND = 6,
+    _URC_INSTALL_CONTEXT = 7,
+    _URC_CONTINUE_UNWIND = 8
+} _Unwind_Reason_Code;
+
+typedef int _Unwind_Action;
+
+#define _UA_SEARCH_PHASE  1
+#define _UA_CLEANUP_PHASE 2
+#define _UA_HANDLER_FRAME 4
+#define _UA_FORCE_UNWIND  8
+#define _UA_END_OF_STACK  16
+
+typedef uint64_t _Unwind_Exception_Class;
+typedef uint64_t _Unwind_Word;
+typedef uint64_t _Unwind_Ptr;
+
+struct _Unwind_Exception;
+struct _Unwind_Context;
+
+typedef void (*_Unwind_Exception_Cleanup_Fn)(_Unwind_Reason_Code reason,
+                                             struct _Unwind_Exception * exc);
+
+/* private_2 holds the CFA of the handler's frame between the phases */
+struct _Unwind_Exception {
+    _Unwind_Exception_Class      exception_class;
+    _Unwind_Exception_Cleanup_Fn exception_cleanup;
+    _Unwind_Word                 private_1;
+    _Unwind_Word                 private_2;
+} __attribute__((aligned(16)));
+
+typedef _Unwind_Reason_Code (*_Unwind_Personality_Fn)(int version,
+                                                      _Unwind_Action actions,
+                                                      _Unwind_Exception_Class exception_class,
+                                                      struct _Unwind_Exception * exc,
+                                                      struct _Unwind_Context * ctx);
+
+typedef _Unwind_Reason_Code (*_Unwind_Trace_Fn)(struct _Unwind_Context * ctx, void * arg);
+
+_Unwind_Reason_Code _Unwind_RaiseException(struct _Unwind_Exception * exc);
+void _Unwind_Resume(struct _Unwind_Exception * exc);
+_Unwind_Reason_Code _Unwind_Resume_or_Rethrow(struct _Unwind_Exception * exc);
+void _Unwind_DeleteException(struct _Unwind_Exception * exc);
+_Unwind_Reason_Code _Unwind_Backtrace(_Unwind_Trace_Fn fn, void * arg);
+
+_Unwind_Word _Unwind_GetGR(struct _Unwind_Context * ctx, int index);
+void _Unwind_SetGR(struct _Unwind_Context * ctx, int index, _Unwind_Word value);
+_Unwind_Ptr _Unwind_GetIP(struct _Unwind_Context * ctx);
+_Unwind_Ptr _Unwind_GetIPInfo(struct _Unwind_Context * ctx, int * ip_before_insn);
+void _Unwind_SetIP(struct _Unwind_Context * ctx, _Unwind_Ptr ip);
+_Unwind_Word _Unwind_GetCFA(struct _Unwind_Context * ctx);
+_Unwind_Ptr _Unwind_GetLanguageSpecificData(struct _Unwind_Context * ctx);
+_Unwind_Ptr _Unwind_GetRegionStart(struct _Unwind_Context * ctx);
+_Unwind_Ptr _Unwind_GetTextRelBase(struct _Unwind_Context * ctx);
+_Unwind_Ptr _Unwind_GetDataRelBase(struct _Unwind_Context * ctx);
+
+int nk_unwind_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
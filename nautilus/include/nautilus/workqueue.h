@@ -0,0 +1,66 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __WORKQUEUE_H__
+#define __WORKQUEUE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Deferred work, run later by a low-priority worker thread bound to
+ * each core. Queuing is a single compare-and-swap onto that core's
+ * list, with no lock and no allocation, so paths that cannot afford
+ * to free memory or print can hand that off in O(1) and get on with
+ * it. The worker is only woken when its list was empty.
+ *
+ * The nk_work is the caller's, usually embedded in whatever the
+ * work is about, and must stay put until func has been called. func
+ * runs in thread context with interrupts on. Work that finds it
+ * cannot be done yet hands itself to nk_work_retry(), and is run
+ * again after a back-off rather than at once. A core whose worker is
+ * not running (yet) refuses work, and the caller does it itself.
+ *
+ * Waking the worker goes through its wait queue, so the scheduler
+ * itself must not queue work.
+ */
+
+struct nk_work {
+    struct nk_work * next;
+    void (*func)(struct nk_work * work);
+};
+
+// runs on this core's worker, -1 if it has none
+int nk_work_queue(struct nk_work * work, void (*func)(struct nk_work * work));
+int nk_work_queue_on(int cpu, struct nk_work * work, void (*func)(struct nk_work * work));
+
+// from func only: run it again after NK_WORK_RETRY_MS
+#define NK_WORK_RETRY_MS 1
+void nk_work_retry(struct nk_work * work);
+
+int nk_workqueue_init(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
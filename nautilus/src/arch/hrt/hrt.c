@@ -27,7 +27,17 @@
 #include <nautilus/paging.h>
 #include <nautilus/irq.h>
 #include <nautilus/mm.h>
+#include <nautilus/errno.h>
+#include <nautilus/cpu.h>
+#include <nautilus/cpuid.h>
+#include <nautilus/smp.h>
 #include <arch/hrt/hrt.h>
+#ifdef NAUT_CONFIG_HRT_RINGS
+#include <arch/hrt/hrt_ring.h>
+#endif
+#ifdef NAUT_CONFIG_HRT_UPCALL_QUEUE
+#include <arch/hrt/hrt_upq.h>
+#endif
 
 #define PML4_STRIDE (0x1ULL << (12+9+9+9))
 
@@ -42,6 +52,7 @@
 
 static volatile unsigned long long *sync_proto = 0;
 static volatile int done_sync = 0;
+static volatile int ros_merged = 0;
 
 
 static void 
@@ -83,37 +94,256 @@ get_my_cr3 (void)
 }
 
 
-static inline void 
-flush_tlb (void)
+/*
+ * Merged address spaces are cached, one PML4 for each ROS CR3 we
+ * have merged with: the ROS's lower half next to a copy of our upper
+ * half, which points at our own page tables and so keeps whatever
+ * page size (HRT_PS_*) the VMM built them with. Our own PML4 is never
+ * merged into. A merge with a ROS address space we have seen before
+ * is then a CR3 switch on every core, and with PCIDs each merged
+ * address space keeps its TLB entries, and we keep ours, while
+ * another one runs.
+ *
+ * The ROS says whether its mappings changed since it last merged the
+ * way the CPU is told, with bit 63 of the CR3 it passes: set, the
+ * cached translations are kept; clear, they are dropped.
+ */
+#define MERGE_CACHE_SIZE 8
+#define CR3_ADDR_MASK    0x000ffffffffff000ULL
+#define CR3_NOFLUSH      (1ULL << 63)
+#define PML4_HALF        2048
+
+struct merged_as {
+    uint64_t   ros_cr3;     /* 0 if unused */
+    uint64_t * pml4;
+    uint16_t   pcid;
+    uint64_t   last_use;
+};
+
+struct cr3_switch {
+    uint64_t cr3;           /* with the PCID in the low bits */
+    uint8_t  flush;
+};
+
+static struct merged_as merge_cache[MERGE_CACHE_SIZE];
+static uint64_t         merge_clock = 0;
+static uint64_t         hrt_cr3     = 0;   /* our own, unmerged */
+static uint8_t          have_pcid   = 0;
+static uint8_t          in_place    = 0;   /* merged into our own PML4, no cache */
+
+
+static inline uint64_t
+gva_to_cr3 (void * gva)
 {
-  __asm__ __volatile__ (" movq %%cr3, %%rax;"
-            " movq %%rax, %%cr3;"
-            " movq %%cr4, %%rax;"
-            " movq %%rax, %%cr4;"
-            :
-            :
-            : "%rax");
+  return (uint64_t)gva - nautilus_info.sys.mb_info->hrt_info->gva_offset;
+}
+
+
+static void
+load_cr3 (void * arg)
+{
+  struct cr3_switch * s = (struct cr3_switch *)arg;
+
+  if (have_pcid && !(read_cr4() & CR4_PCIDE) && !(read_cr3() & 0xfff)) {
+    write_cr4(read_cr4() | CR4_PCIDE);
+  }
+
+  if (read_cr4() & CR4_PCIDE) {
+    write_cr3(s->cr3 | (s->flush ? 0 : CR3_NOFLUSH));
+  } else {
+    /* without PCIDs the low bits would be PWT/PCD, and any load flushes */
+    write_cr3(s->cr3 & CR3_ADDR_MASK);
+  }
+}
+
+
+/* every core runs the HRT, so every core switches */
+static void
+switch_cores (uint64_t cr3, uint8_t flush)
+{
+  struct cr3_switch s = { cr3, flush };
+  nk_cpumask_t all;
+
+  nk_cpumask_fill(&all, nk_get_num_cpus());
+
+  if (smp_xcall_mask(&all, load_cr3, &s, 1)) {
+    ERROR_PRINT("Could not switch every core to CR3 %p\n", (void*)cr3);
+    load_cr3(&s);
+  }
+}
+
+
+static struct merged_as *
+merge_lookup (uint64_t ros_cr3)
+{
+  struct merged_as * lru = NULL;
+  int i;
+
+  for (i = 0; i < MERGE_CACHE_SIZE; i++) {
+    struct merged_as * m = &merge_cache[i];
+
+    if (!m->pml4) {
+      continue;
+    }
+    if (m->ros_cr3 == ros_cr3) {
+      return m;
+    }
+    if (!lru || m->last_use < lru->last_use) {
+      lru = m;
+    }
+  }
+
+  return lru;
 }
 
 
 static void 
 merge_with_ros_cr3 (uint64_t ros_cr3)
 {
-  void *hrt_pml4_gva=cr3_to_gva(get_my_cr3());
-  void *ros_pml4_gva=cr3_to_gva(ros_cr3);
+  uint64_t key = ros_cr3 & CR3_ADDR_MASK;
+  void *ros_pml4_gva = cr3_to_gva(key);
+  struct merged_as *m = merge_lookup(key);
+  uint8_t flush = !(ros_cr3 & CR3_NOFLUSH);
+
+  if (!m) {
+    /* no cache, merge into our own and flush as we always did */
+    memcpy(cr3_to_gva(hrt_cr3),ros_pml4_gva,PML4_HALF);
+    in_place = 1;
+    switch_cores(hrt_cr3, 1);
+    ros_merged = 1;
+    return;
+  }
 
-  memcpy(hrt_pml4_gva,ros_pml4_gva,2048);
+  if (m->ros_cr3 != key) {
+    /* a recycled PCID still has another address space's entries */
+    HRT_DEBUG("Caching merge with ROS CR3 %p in PCID %u\n", (void*)key, m->pcid);
+    m->ros_cr3 = key;
+    flush = 1;
+  }
+
+  if (memcmp(m->pml4, ros_pml4_gva, PML4_HALF)) {
+    memcpy(m->pml4, ros_pml4_gva, PML4_HALF);
+    flush = 1;
+  }
 
-  flush_tlb();
+  m->last_use = ++merge_clock;
+
+  switch_cores(gva_to_cr3(m->pml4) | m->pcid, flush);
+
+  ros_merged = 1;
 }
 
 
 static void 
 unmerge_from_ros (void)
 {
-  void *hrt_pml4_gva = cr3_to_gva(get_my_cr3());
-  memset(hrt_pml4_gva,0,2048);
-  flush_tlb();
+  ros_merged = 0;
+#ifdef NAUT_CONFIG_HRT_RINGS
+  hrt_ring_unmerge();
+#endif
+#ifdef NAUT_CONFIG_HRT_UPCALL_QUEUE
+  hrt_upq_unmerge();
+#endif
+
+  if (in_place) {
+    memset(cr3_to_gva(hrt_cr3),0,PML4_HALF);
+    in_place = 0;
+    switch_cores(hrt_cr3, 1);
+    return;
+  }
+
+  /* the merged entries stay behind in their PCID for the next merge */
+  switch_cores(hrt_cr3, 0);
+}
+
+
+/*
+ * hrt_merge_init
+ *
+ * set up the merge cache, once there is a heap. Without it merges
+ * still work, they just go into our own PML4 each time
+ *
+ */
+int
+hrt_merge_init (void)
+{
+  struct cpuid_ecx_flags ecx;
+  cpuid_ret_t ret;
+  void * hrt_pml4_gva;
+  int i;
+
+  hrt_cr3      = get_my_cr3() & CR3_ADDR_MASK;
+  hrt_pml4_gva = cr3_to_gva(hrt_cr3);
+
+  cpuid(CPUID_FEATURE_INFO, &ret);
+  ecx.val   = ret.c;
+  have_pcid = ecx.pcid;
+
+  for (i = 0; i < MERGE_CACHE_SIZE; i++) {
+    uint64_t * pml4 = malloc(PAGE_SIZE_4KB);
+
+    if (!pml4 || ((addr_t)pml4 & (PAGE_SIZE_4KB - 1))) {
+      ERROR_PRINT("Could not allocate PML4 for merge cache entry %d\n", i);
+      if (pml4) {
+        free(pml4);
+      }
+      break;
+    }
+
+    memset(pml4, 0, PML4_HALF);
+    memcpy((uint8_t*)pml4 + PML4_HALF, (uint8_t*)hrt_pml4_gva + PML4_HALF, PML4_HALF);
+
+    merge_cache[i].pml4 = pml4;
+    merge_cache[i].pcid = i + 1;
+  }
+
+  HRT_PRINT("Caching %d merged address spaces, PCID %s\n", i, have_pcid ? "on" : "off");
+
+  return 0;
+}
+
+
+/*
+ * the part of a request that does not depend on how it arrived, an
+ * upcall or the upcall queue; the caller sends the completion
+ */
+int
+hrt_request (uint64_t cmd, uint64_t arg)
+{
+    switch (cmd) {
+    case 0x0:
+        HRT_DEBUG("HRT null request\n");
+        return 0;
+    case 0x20:
+        HRT_DEBUG("HRT invoke function %p\n", (void*)arg);
+        // fake, our function is "print this string"
+        HRT_DEBUG("First word of string is %llx\n",*((uint64_t*)arg));
+        HRT_DEBUG("The ROS sent us the string %s\n",arg);
+        return 0;
+    case 0x21:
+        HRT_DEBUG("HRT invoke paralllel function %p\n", (void*)arg);
+        return 0;
+
+#ifdef NAUT_CONFIG_HRT_RINGS
+    case HRT_UPCALL_RING_REGISTER:
+        HRT_DEBUG("HRT register ring at %p\n", (void*)arg);
+        if (!ros_merged) {
+            ERROR_PRINT("Ring registered before the address space merge\n");
+            return -EINVAL;
+        }
+        return hrt_ring_register((struct hrt_ring*)arg);
+
+    case HRT_UPCALL_RING_KICK:
+        HRT_DEBUG("HRT ring kick for %p\n", (void*)arg);
+        if (ros_merged) {
+            hrt_ring_kick((struct hrt_ring*)arg);
+        }
+        return 0;
+#endif
+    default:
+        ERROR_PRINT("Unknown HVM request %p\n",(void*)cmd);
+        return -EINVAL;
+    }
 }
 
 
@@ -136,16 +366,9 @@ nautilus_hrt_upcall_handler (excp_entry_t * excp, excp_vec_t vec)
         HRT_DEBUG("HRT null upcall\n");
         break;
     case 0x20:
-        HRT_DEBUG("HRT invoke function %p\n", (void*)a2);
-        // fake, our function is "print this string"
-        HRT_DEBUG("First word of string is %llx\n",*((uint64_t*)a2));
-        HRT_DEBUG("The ROS sent us the string %s\n",a2);
-        HRT_DEBUG("HRT indicating function completion\n");
-        hvm_hcall(0x2f,0,0,0,0,0,0,0);
-        break;
     case 0x21:
-        HRT_DEBUG("HRT invoke paralllel function %p\n", (void*)a2);
-        HRT_DEBUG("HRT indicating parallel function completion\n");
+        hrt_request(a1, a2);
+        HRT_DEBUG("HRT indicating function completion\n");
         hvm_hcall(0x2f,0,0,0,0,0,0,0);
         break;
 
@@ -189,6 +412,34 @@ nautilus_hrt_upcall_handler (excp_entry_t * excp, excp_vec_t vec)
         HRT_DEBUG("HRT indicating unmerge completion\n");
         hvm_hcall(0x3f,0,0,0,0,0,0,0);
         break;
+
+#ifdef NAUT_CONFIG_HRT_RINGS
+    case HRT_UPCALL_RING_REGISTER:
+    case HRT_UPCALL_RING_KICK:
+        hrt_request(a1, a2);
+        hvm_hcall(0x2f,0,0,0,0,0,0,0);
+        break;
+#endif
+
+#ifdef NAUT_CONFIG_HRT_UPCALL_QUEUE
+    case HRT_UPCALL_QUEUE_REGISTER:
+        HRT_DEBUG("HRT register upcall queue at %p\n", (void*)a2);
+        if (!ros_merged) {
+            ERROR_PRINT("Upcall queue registered before the address space merge\n");
+        } else {
+            hrt_upq_register((struct hrt_upq*)a2);
+        }
+        hvm_hcall(0x2f,0,0,0,0,0,0,0);
+        break;
+
+    case HRT_UPCALL_QUEUE_KICK:
+        HRT_DEBUG("HRT upcall queue kick for %p\n", (void*)a2);
+        if (ros_merged) {
+            hrt_upq_kick((struct hrt_upq*)a2);
+        }
+        hvm_hcall(0x2f,0,0,0,0,0,0,0);
+        break;
+#endif
     default:
         ERROR_PRINT("Unknown HVM request %p\n",(void*)a1);
         break;
@@ -228,6 +479,7 @@ hrt_init_cpus (struct sys_info * sys)
             return -1;
         }
         memset(new_cpu, 0, sizeof(struct cpu));
+        new_cpu->self = new_cpu;
 
         if (i == sys->bsp_id) {
             new_cpu->is_bsp = 1;
@@ -330,11 +582,18 @@ hrt_puts (const char *s)
 int
 hvm_hrt_init (void)
 {
+    struct multiboot_tag_hrt * hrt = nautilus_info.sys.mb_info->hrt_info;
+
+    if ((hrt->hrt_flags & HRT_FLAGS_PS_MASK) != HRT_FLAGS) {
+        HRT_WARN("Asked for page size flags 0x%x, VMM mapped us with 0x%lx\n",
+                 HRT_FLAGS, hrt->hrt_flags & HRT_FLAGS_PS_MASK);
+    }
+
     HRT_DEBUG("Pinging the VMM with HRT init status\n");
     hvm_hcall(0,0,0,0,0,0,0,0);
 
     HRT_PRINT("Registering HRT upcall handler\n");
-    if (register_int_handler(nautilus_info.sys.mb_info->hrt_info->hrt_int_vec,
+    if (register_int_handler(hrt->hrt_int_vec,
                 nautilus_hrt_upcall_handler, 0)) {
         ERROR_PRINT("Cannot install HRT upcall handler\n");
     }
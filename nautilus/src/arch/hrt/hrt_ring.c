@@ -0,0 +1,442 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/naut_string.h>
+#include <nautilus/cpu.h>
+#include <nautilus/atomic.h>
+#include <nautilus/errno.h>
+#include <arch/hrt/hrt.h>
+#include <arch/hrt/hrt_ring.h>
+
+#ifndef NAUT_CONFIG_DEBUG_HRT
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define RING_DEBUG(fmt, args...) DEBUG_PRINT("HRT RING: " fmt, ##args)
+#define RING_ERROR(fmt, args...) ERROR_PRINT("HRT RING: " fmt, ##args)
+
+#define HRT_RING_MAX 16
+
+/* keep the compiler from moving data accesses across head/tail */
+#define ring_barrier() asm volatile ("" ::: "memory")
+
+/*
+ * dir and size are copied at registration, so nothing but the
+ * head/tail and the data itself is read from the ROS after that,
+ * and then only while the ring is not dead
+ */
+struct nk_hrt_ring {
+    struct hrt_ring *   ring;
+    uint64_t            size;
+    uint32_t            dir;
+    char                name[HRT_RING_NAME_LEN];
+    nk_thread_queue_t * waitq;
+    volatile uint32_t   sleeping;   /* an HRT thread waits for a kick */
+    volatile uint32_t   dead;       /* the ROS has unmerged */
+};
+
+static struct nk_hrt_ring  rings[HRT_RING_MAX];
+static spinlock_t          ring_lock  = 0;
+static nk_thread_queue_t * open_waitq = 0;
+static volatile uint32_t   ring_gen   = 0;
+
+
+static inline uint64_t
+min64 (uint64_t a, uint64_t b)
+{
+    return a < b ? a : b;
+}
+
+
+static inline int
+ring_ready (struct nk_hrt_ring * h, int producer)
+{
+    struct hrt_ring * r = h->ring;
+
+    return producer ? (r->head - r->tail < h->size) : (r->head != r->tail);
+}
+
+
+static inline void
+signal_ros (struct nk_hrt_ring * h)
+{
+    hvm_hcall(HVM_HCALL_SIGNAL_ROS, (uint64_t)h->ring, 0, 0, 0, 0, 0, 0);
+}
+
+
+/*
+ * wait until the ring has room (producer) or data (consumer). The
+ * waiting flag is raised before the second look, and the ROS checks
+ * it after each update, so between the two of us one always sees
+ * the other
+ */
+static int
+ring_wait (struct nk_hrt_ring * h, int producer)
+{
+    struct hrt_ring * r = h->ring;
+    volatile uint32_t * flag = producer ? &r->producer_waiting : &r->consumer_waiting;
+
+    /* only the flag's address is taken above, nothing is read yet */
+
+    while (!h->dead) {
+
+        if (ring_ready(h, producer)) {
+            return 0;
+        }
+
+        h->sleeping = 1;
+        *flag = 1;
+        mbarrier();
+
+        if (ring_ready(h, producer)) {
+            *flag = 0;
+            h->sleeping = 0;
+            return 0;
+        }
+
+        nk_thread_queue_wait_word(h->waitq, &h->sleeping, 1);
+    }
+
+    return -ENXIO;
+}
+
+
+/*
+ * nk_hrt_ring_reserve
+ *
+ * wait for free space in an HRT-to-ROS ring and return where to
+ * write it. On entry *len is the most the caller wants, on return
+ * the contiguous amount it may write, which nk_hrt_ring_commit()
+ * then publishes
+ *
+ * returns NULL if the ring is gone or goes the other way
+ *
+ */
+void *
+nk_hrt_ring_reserve (struct nk_hrt_ring * h, uint64_t * len)
+{
+    struct hrt_ring * r = h->ring;
+    uint64_t head, off;
+
+    if (h->dead || h->dir != HRT_RING_HRT_TO_ROS || ring_wait(h, 1) != 0) {
+        return NULL;
+    }
+
+    head = r->head;
+    off  = head & (h->size - 1);
+    *len = min64(*len, min64(h->size - (head - r->tail), h->size - off));
+    ring_barrier();
+
+    return r->data + off;
+}
+
+
+void
+nk_hrt_ring_commit (struct nk_hrt_ring * h, uint64_t len)
+{
+    struct hrt_ring * r = h->ring;
+
+    if (h->dead) {
+        return;
+    }
+
+    ring_barrier();
+    r->head += len;
+    mbarrier();
+
+    if (r->consumer_waiting) {
+        signal_ros(h);
+    }
+}
+
+
+/*
+ * nk_hrt_ring_peek
+ *
+ * wait for data in a ROS-to-HRT ring and return where it starts.
+ * On entry *len is the most the caller wants, on return the
+ * contiguous amount available, which nk_hrt_ring_release() hands
+ * back to the ROS once consumed
+ *
+ * returns NULL if the ring is gone or goes the other way
+ *
+ */
+void *
+nk_hrt_ring_peek (struct nk_hrt_ring * h, uint64_t * len)
+{
+    struct hrt_ring * r = h->ring;
+    uint64_t tail, off;
+
+    if (h->dead || h->dir != HRT_RING_ROS_TO_HRT || ring_wait(h, 0) != 0) {
+        return NULL;
+    }
+
+    tail = r->tail;
+    off  = tail & (h->size - 1);
+    *len = min64(*len, min64(r->head - tail, h->size - off));
+    ring_barrier();
+
+    return r->data + off;
+}
+
+
+void
+nk_hrt_ring_release (struct nk_hrt_ring * h, uint64_t len)
+{
+    struct hrt_ring * r = h->ring;
+
+    if (h->dead) {
+        return;
+    }
+
+    ring_barrier();
+    r->tail += len;
+    mbarrier();
+
+    if (r->producer_waiting) {
+        signal_ros(h);
+    }
+}
+
+
+int
+nk_hrt_ring_write (struct nk_hrt_ring * h, const void * buf, uint64_t len)
+{
+    const uint8_t * src = (const uint8_t*)buf;
+
+    while (len) {
+        uint64_t n = len;
+        void * dst = nk_hrt_ring_reserve(h, &n);
+
+        if (!dst) {
+            return -ENXIO;
+        }
+
+        memcpy(dst, src, n);
+        nk_hrt_ring_commit(h, n);
+
+        src += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+int
+nk_hrt_ring_read (struct nk_hrt_ring * h, void * buf, uint64_t len)
+{
+    uint8_t * dst = (uint8_t*)buf;
+
+    while (len) {
+        uint64_t n = len;
+        void * src = nk_hrt_ring_peek(h, &n);
+
+        if (!src) {
+            return -ENXIO;
+        }
+
+        memcpy(dst, src, n);
+        nk_hrt_ring_release(h, n);
+
+        dst += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+/*
+ * nk_hrt_ring_open
+ *
+ * find the ring the ROS registered under this name, optionally
+ * waiting for it to appear
+ *
+ */
+struct nk_hrt_ring *
+nk_hrt_ring_open (const char * name, int wait)
+{
+    struct nk_hrt_ring * found = NULL;
+    uint32_t gen;
+    uint8_t flags;
+    int i;
+
+    while (1) {
+
+        gen = ring_gen;
+
+        flags = spin_lock_irq_save(&ring_lock);
+        for (i = 0; i < HRT_RING_MAX; i++) {
+            if (rings[i].ring && !rings[i].dead &&
+                !strncmp(rings[i].name, name, HRT_RING_NAME_LEN)) {
+                found = &rings[i];
+                break;
+            }
+        }
+        spin_unlock_irq_restore(&ring_lock, flags);
+
+        if (found || !wait) {
+            return found;
+        }
+
+        nk_thread_queue_wait_word(open_waitq, &ring_gen, gen);
+    }
+}
+
+
+/*
+ * nk_hrt_ring_close
+ *
+ * give up the handle. The ring's memory stays with the ROS
+ *
+ */
+void
+nk_hrt_ring_close (struct nk_hrt_ring * h)
+{
+    uint8_t flags = spin_lock_irq_save(&ring_lock);
+    h->ring = NULL;
+    h->dead = 0;
+    spin_unlock_irq_restore(&ring_lock, flags);
+}
+
+
+int
+hrt_ring_register (struct hrt_ring * ring)
+{
+    struct nk_hrt_ring * h = NULL;
+    uint8_t flags;
+    int i;
+
+    /* the header and then the data must lie in the ROS half */
+    if (!ring || (uint64_t)ring > ROS_HALF_END - sizeof(struct hrt_ring) ||
+        ring->magic != HRT_RING_MAGIC ||
+        !ring->size || (ring->size & (ring->size - 1)) ||
+        ring->size > ROS_HALF_END - sizeof(struct hrt_ring) - (uint64_t)ring ||
+        ring->dir > HRT_RING_HRT_TO_ROS) {
+        RING_ERROR("Rejecting malformed ring at %p\n", ring);
+        return -EINVAL;
+    }
+
+    flags = spin_lock_irq_save(&ring_lock);
+    for (i = 0; i < HRT_RING_MAX; i++) {
+        if (!rings[i].ring && rings[i].waitq) {
+            h = &rings[i];
+            break;
+        }
+    }
+
+    if (!h) {
+        spin_unlock_irq_restore(&ring_lock, flags);
+        RING_ERROR("No room to register ring at %p\n", ring);
+        return -EINVAL;
+    }
+
+    memcpy(h->name, ring->name, HRT_RING_NAME_LEN);
+    h->name[HRT_RING_NAME_LEN - 1] = 0;
+    h->size     = ring->size;
+    h->dir      = ring->dir;
+    h->sleeping = 0;
+    h->dead     = 0;
+    h->ring     = ring;
+    spin_unlock_irq_restore(&ring_lock, flags);
+
+    RING_DEBUG("Registered ring %s at %p (%lu bytes, %s)\n",
+            h->name, ring, h->size,
+            h->dir == HRT_RING_ROS_TO_HRT ? "ROS->HRT" : "HRT->ROS");
+
+    atomic_inc(ring_gen);
+    nk_thread_queue_wake_word(open_waitq, 1);
+
+    return 0;
+}
+
+
+/*
+ * the ROS saw our waiting flag after updating the ring
+ */
+void
+hrt_ring_kick (struct hrt_ring * ring)
+{
+    int i;
+
+    for (i = 0; i < HRT_RING_MAX; i++) {
+        struct nk_hrt_ring * h = &rings[i];
+
+        if (h->ring == ring && !h->dead) {
+            if (h->dir == HRT_RING_ROS_TO_HRT) {
+                ring->consumer_waiting = 0;
+            } else {
+                ring->producer_waiting = 0;
+            }
+            h->sleeping = 0;
+            nk_thread_queue_wake_word(h->waitq, 1);
+            return;
+        }
+    }
+
+    RING_ERROR("Kick for unknown ring %p\n", ring);
+}
+
+
+/*
+ * the ROS half is about to disappear. The ROS must have stopped
+ * using its rings by now; anyone still waiting on one is woken
+ * and sees it gone
+ */
+void
+hrt_ring_unmerge (void)
+{
+    int i;
+
+    for (i = 0; i < HRT_RING_MAX; i++) {
+        if (rings[i].ring) {
+            rings[i].dead     = 1;
+            rings[i].sleeping = 0;
+            nk_thread_queue_wake_word(rings[i].waitq, 1);
+        }
+    }
+}
+
+
+int
+hrt_ring_init (void)
+{
+    int i;
+
+    open_waitq = nk_thread_queue_create();
+    if (!open_waitq) {
+        RING_ERROR("Could not create ring wait queue\n");
+        return -1;
+    }
+
+    for (i = 0; i < HRT_RING_MAX; i++) {
+        rings[i].waitq = nk_thread_queue_create();
+        if (!rings[i].waitq) {
+            RING_ERROR("Could not create wait queue for ring %d\n", i);
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,294 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/cpu.h>
+#include <nautilus/errno.h>
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+#include <nautilus/rt_scheduler.h>
+#endif
+#include <arch/hrt/hrt.h>
+#include <arch/hrt/hrt_upq.h>
+
+#ifndef NAUT_CONFIG_DEBUG_HRT
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define UPQ_DEBUG(fmt, args...) DEBUG_PRINT("HRT UPQ: " fmt, ##args)
+#define UPQ_PRINT(fmt, args...) printk("HRT UPQ: " fmt, ##args)
+#define UPQ_ERROR(fmt, args...) ERROR_PRINT("HRT UPQ: " fmt, ##args)
+
+/* requests run before their results are published */
+#define UPQ_BATCH 64
+
+/* empty looks at the queue before the poller goes to sleep */
+#define UPQ_SPINS 100000
+
+/* keep the compiler from moving slot accesses across head/done */
+#define upq_barrier() asm volatile ("" ::: "memory")
+
+static struct hrt_upq * volatile upq = 0;
+static nk_thread_queue_t *       upq_waitq = 0;
+static volatile uint32_t         upq_sleeping = 0;  /* the poller waits for a kick */
+static volatile uint32_t         upq_dead = 0;      /* the ROS has unmerged */
+static volatile uint32_t         upq_busy = 0;      /* the poller is in the queue */
+static int                       upq_cpu = -1;
+
+static uint64_t upq_reqs    = 0;
+static uint64_t upq_batches = 0;
+static uint64_t upq_signals = 0;
+static uint64_t upq_sleeps  = 0;
+
+
+static inline void
+signal_ros (struct hrt_upq * q)
+{
+    upq_signals++;
+    hvm_hcall(HVM_HCALL_SIGNAL_ROS, (uint64_t)q, 0, 0, 0, 0, 0, 0);
+}
+
+
+/*
+ * run what the ROS has posted, at most one batch, and publish the
+ * results with one update of done; returns how many ran
+ */
+static int
+upq_drain (struct hrt_upq * q)
+{
+    uint64_t done = q->done;
+    uint64_t head = q->head;
+    uint64_t n, i;
+
+    if (head == done) {
+        return 0;
+    }
+
+    n = head - done;
+    if (n > q->size) {
+        UPQ_ERROR("ROS queue head %lu is %lu past done, ignoring\n", head, n);
+        return 0;
+    }
+    if (n > UPQ_BATCH) {
+        n = UPQ_BATCH;
+    }
+
+    /* the slots are not read before the head that covers them */
+    upq_barrier();
+
+    for (i = 0; i < n; i++) {
+        struct hrt_upq_req * r = &q->reqs[(done + i) & (q->size - 1)];
+        r->result = hrt_request(r->cmd, r->arg);
+    }
+
+    /* the results are visible before the done that covers them */
+    upq_barrier();
+    q->done = done + n;
+    mbarrier();
+
+    if (q->ros_waiting) {
+        q->ros_waiting = 0;
+        signal_ros(q);
+    }
+
+    upq_reqs += n;
+    upq_batches++;
+
+    return n;
+}
+
+
+/*
+ * nothing has been posted for a while. hrt_idle is raised before the
+ * second look, and the ROS checks it after each post, so between the
+ * two of us one always sees the other
+ */
+static void
+upq_sleep (struct hrt_upq * q)
+{
+    upq_sleeping = 1;
+    if (q) {
+        q->hrt_idle = 1;
+    }
+    mbarrier();
+
+    /* a queue came or went, or something was posted, meanwhile */
+    if (upq != q || (q && q->head != q->done)) {
+        if (q) {
+            q->hrt_idle = 0;
+        }
+        upq_sleeping = 0;
+        return;
+    }
+
+    upq_busy = 0;
+    upq_sleeps++;
+    nk_thread_queue_wait_word(upq_waitq, &upq_sleeping, 1);
+}
+
+
+static void
+upq_poll (void * in, void ** out)
+{
+    int idle = 0;
+
+    UPQ_PRINT("Polling for ROS requests on CPU %d\n", upq_cpu);
+
+    while (1) {
+        struct hrt_upq * q;
+
+        upq_busy = 1;
+        mbarrier();
+
+        q = upq;
+        if (!q || upq_dead) {
+            idle = 0;
+            upq_sleep(0);
+            continue;
+        }
+
+        if (upq_drain(q)) {
+            idle = 0;
+        } else if (++idle >= UPQ_SPINS) {
+            idle = 0;
+            upq_sleep(q);
+        } else {
+            asm volatile ("pause");
+        }
+    }
+}
+
+
+int
+hrt_upq_register (struct hrt_upq * q)
+{
+    if (!q || (uint64_t)q >= ROS_HALF_END ||
+        q->magic != HRT_UPQ_MAGIC ||
+        !q->size || (q->size & (q->size - 1))) {
+        UPQ_ERROR("Rejecting malformed queue at %p\n", q);
+        return -EINVAL;
+    }
+
+    if (!upq_waitq) {
+        UPQ_ERROR("No poller for queue at %p\n", q);
+        return -EINVAL;
+    }
+
+    if (upq && !upq_dead) {
+        UPQ_ERROR("Queue at %p already registered, rejecting %p\n", upq, q);
+        return -EINVAL;
+    }
+
+    UPQ_DEBUG("Registered queue at %p (%lu slots, done=%lu)\n", q, q->size, q->done);
+
+    q->hrt_idle = 0;
+    upq      = q;
+    upq_dead = 0;
+    mbarrier();
+
+    upq_sleeping = 0;
+    nk_thread_queue_wake_word(upq_waitq, 1);
+
+    return 0;
+}
+
+
+/*
+ * the ROS saw hrt_idle after posting
+ */
+void
+hrt_upq_kick (struct hrt_upq * q)
+{
+    if (q != upq || upq_dead) {
+        UPQ_ERROR("Kick for unknown queue %p\n", q);
+        return;
+    }
+
+    q->hrt_idle  = 0;
+    upq_sleeping = 0;
+    nk_thread_queue_wake_word(upq_waitq, 1);
+}
+
+
+/*
+ * the ROS half is about to disappear. The ROS must have stopped
+ * posting by now; the poller is told to let go of the queue, and
+ * unless we have interrupted it, waited for until it has
+ */
+void
+hrt_upq_unmerge (void)
+{
+    if (!upq) {
+        return;
+    }
+
+    upq_dead = 1;
+    mbarrier();
+
+    if (my_cpu_id() != upq_cpu) {
+        while (upq_busy) {
+            asm volatile ("pause");
+        }
+    }
+
+    upq = 0;
+
+    UPQ_DEBUG("Queue gone after %lu requests in %lu batches, %lu signals, %lu sleeps\n",
+              upq_reqs, upq_batches, upq_signals, upq_sleeps);
+}
+
+
+int
+hrt_upq_init (void)
+{
+    struct sys_info * sys = per_cpu_get(system);
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    rt_constraints c = { .aperiodic = { .priority = 0 } };
+#endif
+
+    upq_cpu = NAUT_CONFIG_HRT_UPCALL_QUEUE_CPU;
+    if (upq_cpu < 0 || upq_cpu >= sys->num_cpus) {
+        upq_cpu = sys->num_cpus - 1;
+    }
+
+    /* its scheduler has to be up before the poller can be put there */
+    if (upq_cpu != my_cpu_id()) {
+        PAUSE_WHILE(!sys->cpus[upq_cpu]->booted);
+    }
+
+    upq_waitq = nk_thread_queue_create();
+    if (!upq_waitq) {
+        UPQ_ERROR("Could not create upcall queue wait queue\n");
+        return -1;
+    }
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    if (nk_thread_start(upq_poll, 0, 0, 1, TSTACK_DEFAULT, 0, upq_cpu, APERIODIC, &c, 0)) {
+#else
+    if (nk_thread_start(upq_poll, 0, 0, 1, TSTACK_DEFAULT, 0, upq_cpu)) {
+#endif
+        UPQ_ERROR("Could not start upcall queue poller on CPU %d\n", upq_cpu);
+        nk_thread_queue_destroy(upq_waitq);
+        upq_waitq = 0;
+        return -1;
+    }
+
+    return 0;
+}
@@ -45,10 +45,31 @@
 #include <nautilus/libccompat.h>
 #include <nautilus/barrier.h>
 #include <arch/hrt/hrt.h>
+#ifdef NAUT_CONFIG_HRT_RINGS
+#include <arch/hrt/hrt_ring.h>
+#endif
+#ifdef NAUT_CONFIG_HRT_UPCALL_QUEUE
+#include <arch/hrt/hrt_upq.h>
+#endif
+#ifdef NAUT_CONFIG_RCU
+#include <nautilus/rcu.h>
+#endif
+#ifdef NAUT_CONFIG_PARALLEL
+#include <nautilus/parallel.h>
+#endif
+#ifdef NAUT_CONFIG_WORKQUEUE
+#include <nautilus/workqueue.h>
+#endif
 
 #include <dev/apic.h>
 #include <dev/pci.h>
 #include <dev/hpet.h>
+#ifdef NAUT_CONFIG_SCHED_TRACE
+#include <nautilus/trace.h>
+#endif
+#ifdef NAUT_CONFIG_TSC_CLOCKSOURCE
+#include <nautilus/clocksource.h>
+#endif
 #include <dev/ioapic.h>
 #include <dev/timer.h>
 #include <dev/i8254.h>
@@ -207,6 +228,9 @@ hrt_bsp_init (unsigned long mbd,
 
     mm_boot_kmem_init();
 
+    /* every core's copy of the DEFINE_PER_CPU variables */
+    nk_percpu_init(naut);
+
     /* from this point on, we can use percpu macros (even if the APs aren't up) */
     sysinfo_init(&(naut->sys));
 
@@ -218,10 +242,18 @@ hrt_bsp_init (unsigned long mbd,
 
     fpu_init(naut);
 
+    nk_string_init();
+
     nk_rand_init(naut->sys.cpus[0]);
 
     nk_sched_init();
 
+    hrt_merge_init();
+
+#ifdef NAUT_CONFIG_HRT_RINGS
+    hrt_ring_init();
+#endif
+
     /* we now switch away from the boot-time stack in low memory */
     struct cpu * me = naut->sys.cpus[my_cpu_id()];
     smp_ap_stack_switch(get_cur_thread()->rsp, get_cur_thread()->rsp, me);
@@ -253,6 +285,10 @@ hrt_bsp_init (unsigned long mbd,
     /* let the other cores loose */
     __sync_lock_test_and_set(&hrt_core_sync, 1);
 
+#ifdef NAUT_CONFIG_HRT_UPCALL_QUEUE
+    hrt_upq_init();
+#endif
+
     printk("Nautilus boot thread yielding (indefinitely)\n");
 
     /* we don't come back from this */
@@ -314,6 +350,9 @@ default_init (unsigned long mbd,
      * allocated in the boot mem allocator are kept reserved */
     mm_boot_kmem_init();
 
+    /* every core's copy of the DEFINE_PER_CPU variables */
+    nk_percpu_init(naut);
+
     naut->sys.mb_info = multiboot_parse(mbd, magic);
     if (!naut->sys.mb_info) {
         ERROR_PRINT("Problem parsing multiboot header\n");
@@ -343,6 +382,10 @@ default_init (unsigned long mbd,
 
     nk_sched_init();
 
+#ifdef NAUT_CONFIG_HRT_RINGS
+    hrt_ring_init();
+#endif
+
     smp_setup_xcall_bsp(naut->sys.cpus[0]);
 
     nk_cpu_topo_discover(naut->sys.cpus[0]); 
@@ -350,12 +393,32 @@ default_init (unsigned long mbd,
     nk_hpet_init();
 #endif
 
+#ifdef NAUT_CONFIG_TSC_CLOCKSOURCE
+    nk_clocksource_init();
+#endif
+
+#ifdef NAUT_CONFIG_HPET_BROADCAST
+    nk_hpet_bcast_init();
+#endif
+
 #ifdef NAUT_CONFIG_PROFILE
     nk_instrument_init();
 #endif
 
     smp_bringup_aps(naut);
 
+    nk_topo_init();
+
+    nk_string_simd_init();
+
+#ifdef NAUT_CONFIG_SCHED_TRACE
+    nk_trace_init();
+#endif
+
+#ifdef NAUT_CONFIG_RCU
+    nk_rcu_init();
+#endif
+
     extern void nk_mwait_init(void);
     nk_mwait_init();
 
@@ -370,6 +433,22 @@ default_init (unsigned long mbd,
     /* interrupts on */
     sti();
 
+#ifdef NAUT_CONFIG_THREADED_IRQS
+    nk_irq_threads_start();
+#endif
+
+#ifdef NAUT_CONFIG_SERIAL_ASYNC
+    serial_async_start();
+#endif
+
+#ifdef NAUT_CONFIG_PARALLEL
+    nk_parallel_init();
+#endif
+
+#ifdef NAUT_CONFIG_WORKQUEUE
+    nk_workqueue_init();
+#endif
+
     runtime_init();
 
     printk("Nautilus boot thread yielding (indefinitely)\n");
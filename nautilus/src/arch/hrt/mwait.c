@@ -69,6 +69,8 @@ nk_mwait_init (void)
 {
     cpuid_ret_t ret;
 
+    memset(&mwait, 0, sizeof(mwait));
+
     if (has_mwait()) {
         printk("Processor supports MONITOR/MWAIT extensions\n");
         mwait.available = 1;
@@ -77,8 +79,6 @@ nk_mwait_init (void)
         return 0;
     }
 
-    memset(&mwait, 0, sizeof(mwait));
-
     cpuid(0x5, &ret);
 
     mwait.min_line_size = ret.a & 0xffff;
@@ -97,3 +97,34 @@ nk_mwait_init (void)
 
     return 0;
 }
+
+
+/*
+ * C-states (C1 through C4) that MWAIT can enter, as a bitmask with
+ * bit n set for Cn. Only states with at least one sub-state count,
+ * and only when interrupts are break events, since the idle loop
+ * relies on the timer to wake it.
+ */
+uint8_t
+nk_mwait_cstates (void)
+{
+    uint8_t mask = 0;
+
+    if (!mwait.available || !mwait.ints_as_breaks) {
+        return 0;
+    }
+
+    if (mwait.c1_substates) {
+        mask |= 1 << 1;
+    }
+    if (mwait.c2_substates) {
+        mask |= 1 << 2;
+    }
+    if (mwait.c3_substates) {
+        mask |= 1 << 3;
+    }
+    if (mwait.c4_substates) {
+        mask |= 1 << 4;
+    }
+    return mask;
+}
@@ -27,6 +27,7 @@
 #include <nautilus/naut_types.h>
 #include <nautilus/multiboot2.h>
 #include <nautilus/macros.h>
+#include <arch/k1om/phi_xfer.h>
 
 extern char * mem_region_types[6];
 
@@ -78,6 +79,10 @@ arch_reserve_boot_regions (unsigned long mbd)
      * allocations failed when they return zero! */
 	BMM_PRINT("Reserving zero page\n");
 	mm_boot_reserve_mem(0, PAGE_SIZE);
+
+	/* phi_console shares this window with us for bulk transfers */
+	BMM_PRINT("Reserving host transfer window\n");
+	mm_boot_reserve_mem(PHI_XFER_BASE, PHI_XFER_LEN);
 }
 
 
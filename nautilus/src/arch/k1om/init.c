@@ -46,12 +46,16 @@
 #include <nautilus/barrier.h>
 #include <nautilus/rwlock.h>
 #include <nautilus/condvar.h>
+#ifdef NAUT_CONFIG_RCU
+#include <nautilus/rcu.h>
+#endif
 
 #include <dev/apic.h>
 #include <dev/pci.h>
 #include <dev/ioapic.h>
 #include <dev/timer.h>
 #include <arch/k1om/xeon_phi.h>
+#include <arch/k1om/phi_xfer.h>
 
 #ifdef NAUT_CONFIG_NDPC_RT
 #include "ndpc_preempt_threads.h"
@@ -161,6 +165,9 @@ init (unsigned long mbd, unsigned long magic)
 
     mm_boot_kmem_init();
 
+    /* every core's copy of the DEFINE_PER_CPU variables */
+    nk_percpu_init(naut);
+
     /* from this point on, we can use percpu macros (even if the APs aren't up) */
 
     sysinfo_init(&(naut->sys));
@@ -185,6 +192,12 @@ init (unsigned long mbd, unsigned long magic)
 
     smp_bringup_aps(naut);
 
+    nk_topo_init();
+
+#ifdef NAUT_CONFIG_RCU
+    nk_rcu_init();
+#endif
+
 #ifdef NAUT_CONFIG_CXX_SUPPORT
     extern void nk_cxx_init(void);
     // Assuming we don't encounter C++ before here
@@ -196,6 +209,8 @@ init (unsigned long mbd, unsigned long magic)
 
     nk_vc_init();
 
+    phi_xfer_init();
+
 #ifdef NAUT_CONFIG_LEGION_RT
 
 #ifdef NAUT_CONFIG_PROFILE
@@ -0,0 +1,272 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/atomic.h>
+#include <nautilus/naut_string.h>
+#include <arch/k1om/phi_xfer.h>
+
+#ifndef NAUT_CONFIG_DEBUG_PRINTS
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define XFER_PRINT(fmt, args...) printk("PHI XFER: " fmt, ##args)
+#define XFER_DEBUG(fmt, args...) DEBUG_PRINT("PHI XFER: " fmt, ##args)
+#define XFER_ERROR(fmt, args...) ERROR_PRINT("PHI XFER: " fmt, ##args)
+
+/* 
+ * the host sees our stores in program order, so only the compiler
+ * has to be kept from moving them
+ */
+#define xfer_barrier() asm volatile ("" ::: "memory")
+
+static struct {
+    volatile struct phi_xfer_ctrl * ctrl;
+    volatile uint8_t * data;
+
+    int      busy;      /* a file is open */
+    int      mode;
+    unsigned cur;       /* buffer being drained or filled */
+    uint32_t off;       /* how far into it */
+    int      eof;
+} xfer;
+
+#define XFER_BUF(i) ((uint8_t*)(xfer.data + (i)*PHI_XFER_CHUNK))
+
+
+static inline void
+xfer_wait (void)
+{
+    nk_yield();
+}
+
+
+static int
+xfer_request (uint32_t req)
+{
+    uint32_t seq = xfer.ctrl->req_seq + 1;
+
+    xfer.ctrl->req = req;
+    xfer_barrier();
+    xfer.ctrl->req_seq = seq;
+
+    while (xfer.ctrl->ack_seq != seq) {
+        xfer_wait();
+    }
+
+    return xfer.ctrl->status;
+}
+
+
+int
+phi_xfer_init (void)
+{
+    xfer.ctrl = (volatile struct phi_xfer_ctrl*)PHI_XFER_BASE;
+    xfer.data = (volatile uint8_t*)(PHI_XFER_BASE + PHI_XFER_CTRL_LEN);
+
+    memset((void*)xfer.ctrl, 0, sizeof(struct phi_xfer_ctrl));
+
+    xfer.ctrl->chunk = PHI_XFER_CHUNK;
+    xfer.ctrl->nbufs = PHI_XFER_NBUFS;
+    xfer_barrier();
+
+    /* the host looks for this before touching anything else */
+    xfer.ctrl->magic = PHI_XFER_MAGIC;
+
+    XFER_PRINT("Channel at %p, %u buffers of %u bytes\n",
+               (void*)xfer.ctrl, PHI_XFER_NBUFS, PHI_XFER_CHUNK);
+
+    return 0;
+}
+
+
+int
+phi_xfer_open (const char * name, int mode)
+{
+    unsigned i;
+    int rc;
+
+    if (!xfer.ctrl || (mode != PHI_XFER_RD && mode != PHI_XFER_WR)) {
+        return -1;
+    }
+
+    if (strlen(name) >= PHI_XFER_NAME_LEN) {
+        XFER_ERROR("File name %s is too long\n", name);
+        return -1;
+    }
+
+    if (atomic_cmpswap(xfer.busy, 0, 1) != 0) {
+        XFER_ERROR("A transfer is already open\n");
+        return -1;
+    }
+
+    xfer.mode = mode;
+    xfer.cur  = 0;
+    xfer.off  = 0;
+    xfer.eof  = 0;
+
+    for (i = 0; i < PHI_XFER_NBUFS; i++) {
+        xfer.ctrl->bufs[i].state = PHI_XFER_BUF_EMPTY;
+        xfer.ctrl->bufs[i].len   = 0;
+    }
+
+    strcpy((char*)xfer.ctrl->name, name);
+    xfer.ctrl->mode = mode;
+    xfer.ctrl->size = 0;
+
+    rc = xfer_request(PHI_XFER_REQ_OPEN);
+    if (rc) {
+        XFER_ERROR("Host could not open %s (%d)\n", name, rc);
+        xfer.busy = 0;
+        return -1;
+    }
+
+    XFER_DEBUG("Opened %s for %s\n", name, mode == PHI_XFER_RD ? "reading" : "writing");
+
+    return 0;
+}
+
+
+uint64_t
+phi_xfer_size (void)
+{
+    return (xfer.busy && xfer.mode == PHI_XFER_RD) ? xfer.ctrl->size : 0;
+}
+
+
+ssize_t
+phi_xfer_read (void * buf, size_t len)
+{
+    size_t done = 0;
+
+    if (!xfer.busy || xfer.mode != PHI_XFER_RD) {
+        return -1;
+    }
+
+    while (done < len && !xfer.eof) {
+        volatile struct phi_xfer_buf * b = &xfer.ctrl->bufs[xfer.cur];
+        uint32_t n;
+
+        /* the host is still filling it */
+        while (b->state == PHI_XFER_BUF_EMPTY) {
+            xfer_wait();
+        }
+
+        n = b->len - xfer.off;
+        if (n > len - done) {
+            n = len - done;
+        }
+
+        memcpy((uint8_t*)buf + done, XFER_BUF(xfer.cur) + xfer.off, n);
+        done     += n;
+        xfer.off += n;
+
+        if (xfer.off == b->len) {
+            xfer.eof = (b->state == PHI_XFER_BUF_EOF);
+            xfer_barrier();
+            /* hand it back while we drain the other one */
+            b->state = PHI_XFER_BUF_EMPTY;
+            xfer.cur = (xfer.cur + 1) % PHI_XFER_NBUFS;
+            xfer.off = 0;
+        }
+    }
+
+    return done;
+}
+
+
+ssize_t
+phi_xfer_write (const void * buf, size_t len)
+{
+    size_t done = 0;
+
+    if (!xfer.busy || xfer.mode != PHI_XFER_WR) {
+        return -1;
+    }
+
+    while (done < len) {
+        volatile struct phi_xfer_buf * b = &xfer.ctrl->bufs[xfer.cur];
+        uint32_t n;
+
+        /* the host is still draining it */
+        while (b->state != PHI_XFER_BUF_EMPTY) {
+            xfer_wait();
+        }
+
+        n = PHI_XFER_CHUNK - xfer.off;
+        if (n > len - done) {
+            n = len - done;
+        }
+
+        memcpy(XFER_BUF(xfer.cur) + xfer.off, (const uint8_t*)buf + done, n);
+        done     += n;
+        xfer.off += n;
+
+        if (xfer.off == PHI_XFER_CHUNK) {
+            b->len = xfer.off;
+            xfer_barrier();
+            b->state = PHI_XFER_BUF_FULL;
+            xfer.cur = (xfer.cur + 1) % PHI_XFER_NBUFS;
+            xfer.off = 0;
+        }
+    }
+
+    return done;
+}
+
+
+int
+phi_xfer_close (void)
+{
+    int rc;
+
+    if (!xfer.busy) {
+        return -1;
+    }
+
+    if (xfer.mode == PHI_XFER_WR) {
+        volatile struct phi_xfer_buf * b = &xfer.ctrl->bufs[xfer.cur];
+        unsigned i;
+
+        /* what is left goes out marked as the end, even if it is nothing */
+        while (b->state != PHI_XFER_BUF_EMPTY) {
+            xfer_wait();
+        }
+
+        b->len = xfer.off;
+        xfer_barrier();
+        b->state = PHI_XFER_BUF_EOF;
+
+        /* the host has written everything once it hands all of them back */
+        for (i = 0; i < PHI_XFER_NBUFS; i++) {
+            while (xfer.ctrl->bufs[i].state != PHI_XFER_BUF_EMPTY) {
+                xfer_wait();
+            }
+        }
+    }
+
+    rc = xfer_request(PHI_XFER_REQ_CLOSE);
+
+    xfer_barrier();
+    xfer.busy = 0;
+
+    return rc ? -1 : 0;
+}
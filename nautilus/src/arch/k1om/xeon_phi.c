@@ -30,6 +30,10 @@ static struct {
   uint8_t color;
   volatile uint16_t * fb;
   spinlock_t lock;
+
+  /* rows written since the host last drew, lo > hi when none are */
+  unsigned dirty_lo;
+  unsigned dirty_hi;
 } phi_term;
 
 
@@ -56,6 +60,7 @@ typedef enum {
     TYPE_SCREEN_REDRAW,
     TYPE_CONSOLE_SHUTDOWN,
     TYPE_SCROLLUP,
+    TYPE_LINES_DRAWN,
     TYPE_INVAL
 } update_type_t;
 
@@ -125,36 +130,88 @@ phi_cons_get_cursor (uint8_t * x, uint8_t * y)
 }
 
 
-static void 
-phi_cons_scrollup (void)
+/*
+ * Every notification is a round trip over PCIe to the host, so
+ * characters only go into the frame buffer and the rows they touch
+ * are remembered. phi_cons_flush() then has the host draw all of
+ * them at once, which happens at the end of a line or of a print.
+ */
+void
+phi_cons_mark_dirty (unsigned row)
 {
-    int i;
-    volatile uint16_t *buf = phi_term.fb;
+    uint8_t flags = spin_lock_irq_save(&phi_term.lock);
 
-    for (i = 0; i < VGA_WIDTH*(VGA_HEIGHT-1); i++) {
-        buf[i] = buf[i+VGA_WIDTH];
+    if (row < phi_term.dirty_lo) {
+        phi_term.dirty_lo = row;
     }
-
-    for (i = VGA_WIDTH*(VGA_HEIGHT-1); i < VGA_WIDTH*VGA_HEIGHT; i++) {
-        buf[i] = vga_make_entry(' ', phi_term.color);
+    if (row > phi_term.dirty_hi) {
+        phi_term.dirty_hi = row;
     }
 
-    phi_cons_notify_scrollup();
+    spin_unlock_irq_restore(&phi_term.lock, flags);
 }
 
 
-static void 
-phi_cons_notify_char_write (uint16_t x, uint16_t y)
+void
+phi_cons_mark_dirty_all (void)
+{
+    uint8_t flags = spin_lock_irq_save(&phi_term.lock);
+    phi_term.dirty_lo = 0;
+    phi_term.dirty_hi = VGA_HEIGHT - 1;
+    spin_unlock_irq_restore(&phi_term.lock, flags);
+}
+
+
+void
+phi_cons_flush (void)
 {
-    uint32_t coords = (uint32_t)(x | y << 16);
+    unsigned lo, hi;
+    uint8_t flags = spin_lock_irq_save(&phi_term.lock);
 
-    /* where did we draw the char? */
-    phi_cons_write_reg(CHAR_REG_OFFSET, coords);
+    lo = phi_term.dirty_lo;
+    hi = phi_term.dirty_hi;
+
+    if (lo > hi) {
+        spin_unlock_irq_restore(&phi_term.lock, flags);
+        return;
+    }
+
+    phi_term.dirty_lo = ~0U;
+    phi_term.dirty_hi = 0;
+
+    /* which rows did we write to? */
+    phi_cons_write_reg(LINE_REG_OFFSET, (uint32_t)(lo | hi << 16));
 
     /* we have output ready to be drawn */
-    phi_cons_write_reg(OUTPUT_AVAIL_REG_OFFSET, TYPE_CHAR_DRAWN);
+    phi_cons_write_reg(OUTPUT_AVAIL_REG_OFFSET, TYPE_LINES_DRAWN);
 
     phi_cons_wait_for_out_cmpl();
+
+    spin_unlock_irq_restore(&phi_term.lock, flags);
+}
+
+
+static void 
+phi_cons_scrollup (void)
+{
+    int i;
+    volatile uint16_t *buf = phi_term.fb;
+
+    /* 
+     * the host saves the top line to its history when told, so it
+     * has to hear about it before the line is gone
+     */
+    phi_cons_notify_scrollup();
+
+    for (i = 0; i < VGA_WIDTH*(VGA_HEIGHT-1); i++) {
+        buf[i] = buf[i+VGA_WIDTH];
+    }
+
+    for (i = VGA_WIDTH*(VGA_HEIGHT-1); i < VGA_WIDTH*VGA_HEIGHT; i++) {
+        buf[i] = vga_make_entry(' ', phi_term.color);
+    }
+
+    phi_cons_mark_dirty_all();
 }
 
 
@@ -172,40 +229,36 @@ phi_cons_notify_line_draw (unsigned row)
 
 
 static void 
-phi_cons_write_fb_and_notify (uint16_t x, uint16_t y, char c, uint8_t color)
+phi_cons_write_fb (uint16_t x, uint16_t y, char c, uint8_t color)
 {
     const size_t index = y * VGA_WIDTH + x;
     phi_term.fb[index] = vga_make_entry(c, color);
-    phi_cons_notify_char_write(x, y);
+    phi_cons_mark_dirty(y);
 }
 
 
-void 
-phi_cons_putchar (char c)
+static void
+phi_cons_newline (void)
 {
-    if (c == '\n') {
-        phi_term.col = 0;
+    phi_term.col = 0;
 
-        phi_cons_notify_line_draw(phi_term.row);
+    if (++phi_term.row == VGA_HEIGHT) {
+        phi_cons_scrollup();
+        phi_term.row--;
+    }
+}
 
-        if (++phi_term.row == VGA_HEIGHT) {
-            phi_cons_scrollup();
-            phi_term.row--;
-        }
-    } else {
 
-        // KCH: NOTE: We may not want to notify here
-        phi_cons_write_fb_and_notify(phi_term.col, phi_term.row, c, phi_term.color);
+static void
+phi_cons_putc (char c)
+{
+    if (c == '\n') {
+        phi_cons_newline();
+    } else {
+        phi_cons_write_fb(phi_term.col, phi_term.row, c, phi_term.color);
 
         if (++phi_term.col == VGA_WIDTH) {
-            phi_term.col = 0;
-
-            phi_cons_notify_line_draw(phi_term.row);
-            
-            if (++phi_term.row == VGA_HEIGHT) {
-                phi_cons_scrollup();
-                phi_term.row--;
-            }
+            phi_cons_newline();
         }
     }
 
@@ -213,13 +266,26 @@ phi_cons_putchar (char c)
 }
 
 
+void 
+phi_cons_putchar (char c)
+{
+    phi_cons_putc(c);
+
+    if (c == '\n') {
+        phi_cons_flush();
+    }
+}
+
+
 void 
 phi_cons_print (char *buf)
 {
     while (*buf) {
-        phi_cons_putchar(*buf);
+        phi_cons_putc(*buf);
         buf++;
     }
+
+    phi_cons_flush();
 }
 
 
@@ -247,6 +313,9 @@ phi_cons_init (void)
     phi_term.fb    = (volatile uint16_t*)VGA_BASE_ADDR;
     phi_term.color = vga_make_entry(COLOR_LIGHT_GREY, COLOR_BLACK);
 
+    phi_term.dirty_lo = ~0U;
+    phi_term.dirty_hi = 0;
+
     spinlock_init(&(phi_term.lock));
 
     size_t x,y;
@@ -48,11 +48,20 @@
 #include <dev/apic.h>
 #include <dev/pci.h>
 #include <dev/hpet.h>
+#ifdef NAUT_CONFIG_SCHED_TRACE
+#include <nautilus/trace.h>
+#endif
+#ifdef NAUT_CONFIG_TSC_CLOCKSOURCE
+#include <nautilus/clocksource.h>
+#endif
 #include <dev/ioapic.h>
 #include <dev/timer.h>
 #include <dev/i8254.h>
 #include <dev/kbd.h>
 #include <dev/serial.h>
+#ifdef NAUT_CONFIG_VIRTIO_PCI
+#include <dev/virtio_pci.h>
+#endif
 #include <dev/vga.h>
 
 #ifdef NAUT_CONFIG_NDPC_RT
@@ -67,6 +76,47 @@
 #include <nautilus/rt_scheduler.h>
 #endif
 
+#ifdef NAUT_CONFIG_RT_BENCH
+#include <nautilus/rt_bench.h>
+#endif
+#ifdef NAUT_CONFIG_RT_LATENCY
+#include <nautilus/rt_latency.h>
+#endif
+#ifdef NAUT_CONFIG_SWITCH_BENCH
+#include <nautilus/switch_bench.h>
+#endif
+#ifdef NAUT_CONFIG_PARALLEL
+#include <nautilus/parallel.h>
+#endif
+
+#ifdef NAUT_CONFIG_THREAD_LAZY_STACKS
+#include <nautilus/tss.h>
+#endif
+
+#ifdef NAUT_CONFIG_TLB_SHOOTDOWN
+#include <nautilus/tlb.h>
+#endif
+
+#ifdef NAUT_CONFIG_RCU
+#include <nautilus/rcu.h>
+#endif
+
+#ifdef NAUT_CONFIG_WORKQUEUE
+#include <nautilus/workqueue.h>
+#endif
+
+#ifdef NAUT_CONFIG_TELEMETRY
+#include <nautilus/telemetry.h>
+#endif
+
+#ifdef NAUT_CONFIG_BOOT_TASKS
+#include <nautilus/boot_task.h>
+#endif
+
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+#include <nautilus/housekeeping.h>
+#endif
+
 
 extern spinlock_t printk_lock;
 
@@ -218,12 +268,31 @@ int start_shell()
 
 extern struct naut_info * smp_ap_stack_switch(uint64_t, uint64_t, struct naut_info*);
 
+#ifdef NAUT_CONFIG_BOOT_TASKS
+enum { BOOT_KBD, BOOT_PCI, BOOT_VIRTIO_PCI };
+
+/* device setup nothing before the APs come up depends on */
+static struct nk_boot_task boot_tasks[] = {
+    [BOOT_KBD]        = { "kbd", kbd_init, 0, NK_BOOT_TASK_HOME },
+    [BOOT_PCI]        = { "pci", pci_init, 0, 0 },
+#ifdef NAUT_CONFIG_VIRTIO_PCI
+    [BOOT_VIRTIO_PCI] = { "virtio-pci", virtio_pci_init, NK_BOOT_DEP(BOOT_PCI), NK_BOOT_TASK_DEFER },
+#endif
+};
+
+#define NUM_BOOT_TASKS (sizeof(boot_tasks)/sizeof(boot_tasks[0]))
+#endif
+
 void
 init (unsigned long mbd,
       unsigned long magic)
 {
     struct naut_info * naut = &nautilus_info;
 
+#ifdef NAUT_CONFIG_BOOT_TASKS
+    nk_boot_start_tsc = rdtsc();
+#endif
+
     memset(naut, 0, sizeof(struct naut_info));
 
     vga_init();
@@ -268,6 +337,14 @@ init (unsigned long mbd,
      * allocated in the boot mem allocator are kept reserved */
     mm_boot_kmem_init();
 
+    /* every core's copy of the DEFINE_PER_CPU variables */
+    nk_percpu_init(naut);
+
+#ifdef NAUT_CONFIG_THREAD_LAZY_STACKS
+    /* fault handlers get their own stacks before any lazy stack exists */
+    nk_tss_init(naut->sys.cpus[0]);
+#endif
+
     disable_8259pic();
 
     i8254_init(naut);
@@ -284,12 +361,24 @@ init (unsigned long mbd,
 
     fpu_init(naut);
 
+    nk_string_init();
+
+#ifdef NAUT_CONFIG_TLB_SHOOTDOWN
+    nk_tlb_init(naut->sys.cpus[0]);
+#endif
+
     nk_rand_init(naut->sys.cpus[0]);
 
+#ifndef NAUT_CONFIG_BOOT_TASKS
     kbd_init(naut);
 
     pci_init(naut);
 
+#ifdef NAUT_CONFIG_VIRTIO_PCI
+    virtio_pci_init(naut);
+#endif
+#endif
+
     nk_sched_init();
 
 
@@ -305,12 +394,51 @@ init (unsigned long mbd,
     nk_hpet_init();
 #endif
 
+#ifdef NAUT_CONFIG_TSC_CLOCKSOURCE
+    nk_clocksource_init();
+#endif
+
+#ifdef NAUT_CONFIG_HPET_BROADCAST
+    nk_hpet_bcast_init();
+#endif
+
 #ifdef NAUT_CONFIG_PROFILE
     nk_instrument_init();
 #endif
 
     smp_bringup_aps(naut);
 
+#ifdef NAUT_CONFIG_BOOT_TASKS
+    /* the APs take the device steps that can go in parallel */
+    nk_boot_tasks_run(naut, boot_tasks, NUM_BOOT_TASKS);
+#endif
+
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+    /* device IRQs go to the housekeeping cores from here on */
+    nk_housekeeping_init(naut);
+#endif
+
+    nk_topo_init();
+
+    nk_string_simd_init();
+
+#ifdef NAUT_CONFIG_SCHED_TRACE
+    nk_trace_init();
+#endif
+
+#ifdef NAUT_CONFIG_PRINTK_FAST
+    nk_printk_fast_init();
+#endif
+
+#ifdef NAUT_CONFIG_KMEM_PARALLEL_INIT
+    /* the APs now hand their own domains' memory to kmem */
+    mm_boot_kmem_init_remote();
+#endif
+
+#ifdef NAUT_CONFIG_RCU
+    nk_rcu_init();
+#endif
+
     extern void nk_mwait_init(void);
     nk_mwait_init();
 
@@ -323,7 +451,52 @@ init (unsigned long mbd,
     /* interrupts on */
     sti();
     calibrate_apic(naut->sys.cpus[0]->apic);
+
+#ifdef NAUT_CONFIG_THREADED_IRQS
+    nk_irq_threads_start();
+#endif
+
+#ifdef NAUT_CONFIG_SERIAL_ASYNC
+    serial_async_start();
+#endif
+
+#ifdef NAUT_CONFIG_PRINTK_FAST
+    nk_printk_fast_start();
+#endif
+
+#ifdef NAUT_CONFIG_WORKQUEUE
+    nk_workqueue_init();
+#endif
+
+#ifdef NAUT_CONFIG_TELEMETRY
+    nk_telemetry_start();
+#endif
+
+#ifdef NAUT_CONFIG_PARALLEL
+    nk_parallel_init();
+#endif
+
+#ifdef NAUT_CONFIG_BOOT_TASKS
+    /* the rest finishes in the background while the workload starts */
+    nk_boot_tasks_defer(naut, boot_tasks, NUM_BOOT_TASKS);
+#endif
     
+#ifdef NAUT_CONFIG_NUMA_BENCH
+    nk_numa_bench();
+#endif
+
+#ifdef NAUT_CONFIG_RT_BENCH
+    nk_rt_bench(NULL);
+#endif
+
+#ifdef NAUT_CONFIG_RT_LATENCY
+    nk_rt_latency(NULL);
+#endif
+
+#ifdef NAUT_CONFIG_SWITCH_BENCH
+    nk_switch_bench(100000);
+#endif
+
 #ifdef NAUT_CONFIG_USE_RT_SCHEDULER
     printk("BEGIN TESTING THE REAL-TIME SCHEDULER\n");
     rt_start(1000000, 10000000);
@@ -61,6 +61,7 @@ parse_mptable_cpu (struct sys_info * sys, struct mp_table_entry_cpu * cpu)
     } 
     memset(new_cpu, 0, sizeof(struct cpu));
 
+    new_cpu->self       = new_cpu;
     new_cpu->id         = sys->num_cpus;
     new_cpu->lapic_id   = cpu->lapic_id;
 
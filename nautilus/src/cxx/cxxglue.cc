@@ -26,7 +26,7 @@
   Kernel needs to be compiled with:
 
   -fno-rtti
-  -fno-exceptions
+  -fno-exceptions (unless NAUT_CONFIG_CXX_EXCEPTIONS)
   -fno-omit-frame-pointer
 
   Do not link glibc/etc, but rather link this
@@ -36,6 +36,9 @@
 
 #include <nautilus/naut_types.h>
 #include <nautilus/cxxglue.h>
+#ifdef NAUT_CONFIG_CXX_SLAB_ALLOC
+#include <nautilus/slab.h>
+#endif
 
 void * __dso_handle;
 unsigned __atexit_func_count = 0;
@@ -45,6 +48,10 @@ extern "C" void printk(const char *fmt, ...);
 extern "C" void *malloc(size_t);
 extern "C" void *free(void *);
 extern "C" void panic(const char * fmt, ...);
+#ifdef NAUT_CONFIG_CXX_SLAB_ALLOC
+extern "C" int kmem_is_block(void *);
+extern "C" int sprintf(char * buf, const char * fmt, ...);
+#endif
 
 #define BAD() panic("Undefined C++ function (%s)\n", __func__)
 
@@ -94,7 +101,11 @@ __cxa_finalize (void *f)
     }
 }
 
-// Not really needed since we will compile with -fno-rtti and -fno-exceptions
+#ifndef NAUT_CONFIG_CXX_EXCEPTIONS
+/*
+ * Not really needed since we will compile with -fno-rtti and -fno-exceptions.
+ * With NAUT_CONFIG_CXX_EXCEPTIONS these come from unwind.c instead.
+ */
 void _Unwind_Resume(void)
 {
   BAD();
@@ -185,33 +196,175 @@ _Unwind_GetDataRelBase(struct _Unwind_Context * context)
     BAD();
     return 0;
 }
+#endif
+
+
+#ifdef NAUT_CONFIG_CXX_SLAB_ALLOC
+/*
+ * Objects of up to CXX_MAX_SIZE bytes come from one slab cache per
+ * size class instead of malloc(), which locks a zone and rounds up to
+ * a power of two. Slabs belong to the CPU that made them and come
+ * from its nearest zone, so the STL containers a runtime thread fills
+ * stay on its own core and node. Sized delete goes straight to the
+ * class. Plain delete asks kmem whether the pointer is a malloc()
+ * block first, which is no more than the lookup free() makes.
+ */
+#define CXX_MAX_SIZE 1024
+#define CXX_ALIGN    16    // what new must give, __STDCPP_DEFAULT_NEW_ALIGNMENT__
+
+static const uint16_t cxx_class_size[] = {
+    16,  32,  48,  64,  80,  96,  112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024,
+};
+
+#define CXX_NUM_CLASSES (sizeof(cxx_class_size) / sizeof(cxx_class_size[0]))
+
+static struct nk_slab_cache * cxx_caches[CXX_NUM_CLASSES];
+static uint8_t cxx_class_of[CXX_MAX_SIZE / CXX_ALIGN + 1];
+static ulong_t cxx_slab_order = 0;
+static int     cxx_slabs_on   = 0;
+
+
+static inline struct nk_slab_cache *
+cxx_cache (size_t size)
+{
+    if (!cxx_slabs_on || size > CXX_MAX_SIZE) {
+        return 0;
+    }
+    return cxx_caches[cxx_class_of[(size + CXX_ALIGN - 1) / CXX_ALIGN]];
+}
+
+
+/*
+ * before any constructor runs, so nothing the caches would be asked
+ * to free was ever malloc()ed for a size they serve
+ */
+extern "C" void
+nk_cxx_alloc_init (void)
+{
+    unsigned i, c = 0;
+    char name[32];
+
+    for (i = 0; i < CXX_NUM_CLASSES; i++) {
+        sprintf(name, "c++-%u", cxx_class_size[i]);
+        cxx_caches[i] = nk_slab_cache_create(name, cxx_class_size[i], CXX_ALIGN, 0);
+        if (!cxx_caches[i]) {
+            goto fail;
+        }
+        /* plain delete finds the cache by masking, so one slab size for all */
+        if (i && nk_slab_cache_order(cxx_caches[i]) != cxx_slab_order) {
+            printk("C++: size classes do not share a slab size\n");
+            i++;
+            goto fail;
+        }
+        cxx_slab_order = nk_slab_cache_order(cxx_caches[i]);
+    }
+
+    for (i = 0; i <= CXX_MAX_SIZE / CXX_ALIGN; i++) {
+        while (cxx_class_size[c] < i * CXX_ALIGN) {
+            c++;
+        }
+        cxx_class_of[i] = c;
+    }
+
+    cxx_slabs_on = 1;
+    return;
+
+ fail:
+    printk("C++: no slab caches for operator new, using malloc\n");
+    while (i--) {
+        if (cxx_caches[i]) {
+            nk_slab_cache_destroy(cxx_caches[i]);
+            cxx_caches[i] = 0;
+        }
+    }
+}
+
+
+static inline void *
+cxx_alloc (size_t size)
+{
+    struct nk_slab_cache * c = cxx_cache(size);
+
+    return c ? nk_slab_alloc(c) : malloc(size);
+}
+
+
+static inline void
+cxx_free (void * p)
+{
+    if (!p) {
+        return;
+    }
+    if (!cxx_slabs_on || kmem_is_block(p)) {
+        free(p);
+    } else {
+        nk_slab_free(nk_slab_cache_of(p, cxx_slab_order), p);
+    }
+}
+
+
+static inline void
+cxx_free_sized (void * p, size_t size)
+{
+    struct nk_slab_cache * c = cxx_cache(size);
+
+    if (c) {
+        nk_slab_free(c, p);
+    } else {
+        free(p);
+    }
+}
+
+#else
+
+#define cxx_alloc(size)         malloc(size)
+#define cxx_free(p)             free(p)
+#define cxx_free_sized(p, size) free(p)
+
+#endif
 
 
 void *operator 
 new (size_t size)
 {
-  return malloc(size);
+  return cxx_alloc(size);
 }
 
 
 void *operator 
 new[] (size_t size)
 {
-  return malloc(size);
+  return cxx_alloc(size);
 }
 
 
 void operator 
 delete (void *p)
 {
-  free(p);
+  cxx_free(p);
 }
 
 
 void operator 
 delete[] (void *p)
 {
-  free(p);
+  cxx_free(p);
+}
+
+
+void operator 
+delete (void *p, size_t size)
+{
+  cxx_free_sized(p, size);
+}
+
+
+void operator 
+delete[] (void *p, size_t size)
+{
+  cxx_free_sized(p, size);
 }
 
 
@@ -21,6 +21,11 @@
  * redistribute, and modify it as specified in the file "LICENSE.txt".
  */
 #include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/smp.h>
+#include <nautilus/percpu.h>
+#include <nautilus/atomic.h>
+#include <nautilus/cxxglue.h>
 
 #ifndef NAUT_CONFIG_DEBUG_CXX
 #undef DEBUG_PRINT
@@ -34,6 +39,18 @@
 extern void (*_init_array_start []) (void) __attribute__((weak));
 extern void (*_init_array_end []) (void) __attribute__((weak));
 
+/* constructors marked NK_CXX_INDEPENDENT, kept apart by the linker script */
+extern void (*_init_array_indep_start []) (void) __attribute__((weak));
+extern void (*_init_array_indep_end []) (void) __attribute__((weak));
+
+enum { CTORS_NOT_RUN = 0, CTORS_RUNNING, CTORS_DONE };
+
+static volatile int ctors_state = CTORS_NOT_RUN;
+
+/* next independent constructor to hand out, and how many have finished */
+static volatile uint64_t indep_next = 0;
+static volatile uint64_t indep_done = 0;
+
 static void 
 __do_ctors_init (void) 
 {
@@ -48,8 +65,91 @@ __do_ctors_init (void)
 }
 
 
+/* run independent constructors until there are none left to take */
+static void
+__do_indep_ctors (void * arg)
+{
+    uint64_t n = _init_array_indep_end - _init_array_indep_start;
+    uint64_t i;
+
+    while ((i = atomic_add(indep_next, 1)) < n) {
+        if (_init_array_indep_start[i]) {
+            CXX_DEBUG("Calling independent constructor (%p) on core %u\n",
+                      (void*)_init_array_indep_start[i], my_cpu_id());
+            _init_array_indep_start[i]();
+        }
+        atomic_inc(indep_done);
+    }
+}
+
+
+/*
+ * Independent constructors are farmed out to the other cores, which
+ * run them from their xcall handlers, while this core runs the
+ * ordered ones and then helps with whatever is left. Cores that come
+ * late find nothing to do, so we only wait for the work, not for them.
+ */
+static void
+__do_all_ctors (void)
+{
+    uint64_t n = _init_array_indep_end - _init_array_indep_start;
+    unsigned ncpus = nk_get_num_cpus();
+    unsigned me = my_cpu_id();
+    unsigned i;
+
+    if (n) {
+        for (i = 0; i < ncpus && i <= n; i++) {
+            if (i != me) {
+                smp_xcall(i, __do_indep_ctors, NULL, 0);
+            }
+        }
+    }
+
+    __do_ctors_init();
+
+    __do_indep_ctors(NULL);
+
+    BARRIER_WHILE(indep_done != n);
+
+    CXX_DEBUG("Ran %lu ordered and %lu independent constructors\n",
+              (uint64_t)(_init_array_end - _init_array_start), n);
+}
+
+
+/*
+ * Runs the global constructors if nobody has yet. Anyone else who
+ * gets here in the meantime waits for them to finish.
+ */
+void
+nk_cxx_ensure_init (void)
+{
+    if (ctors_state == CTORS_DONE) {
+        return;
+    }
+
+    if (atomic_cmpswap(ctors_state, CTORS_NOT_RUN, CTORS_RUNNING) == CTORS_NOT_RUN) {
+        __do_all_ctors();
+        mbarrier();
+        ctors_state = CTORS_DONE;
+        return;
+    }
+
+    PAUSE_WHILE(ctors_state != CTORS_DONE);
+}
+
+
 void 
 nk_cxx_init (void)
 {
-    __do_ctors_init();
+#ifdef NAUT_CONFIG_CXX_SLAB_ALLOC
+    nk_cxx_alloc_init();
+#endif
+#ifdef NAUT_CONFIG_CXX_EXCEPTIONS
+    if (nk_unwind_init()) {
+        CXX_PRINT("Failed to set up unwinding, exceptions will terminate\n");
+    }
+#endif
+#ifndef NAUT_CONFIG_CXX_LAZY_INIT
+    nk_cxx_ensure_init();
+#endif
 }
@@ -0,0 +1,1264 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/naut_string.h>
+#include <nautilus/mm.h>
+#include <nautilus/unwind.h>
+
+#ifndef NAUT_CONFIG_DEBUG_CXX
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...) 
+#endif
+
+#define UNWIND_DEBUG(fmt, args...) DEBUG_PRINT("UNWIND: " fmt, ##args)
+#define UNWIND_ERROR(fmt, args...) ERROR_PRINT("UNWIND: " fmt, ##args)
+#define UNWIND_PRINT(fmt, args...) printk("UNWIND: " fmt, ##args)
+
+/* laid out by the linker script */
+extern const uint8_t _eh_frame_hdr_start[], _eh_frame_hdr_end[];
+extern const uint8_t _eh_frame_start[], _eh_frame_end[];
+
+/* DWARF register numbers on x86_64 */
+#define DW_RAX    0
+#define DW_RDX    1
+#define DW_RBX    3
+#define DW_RBP    6
+#define DW_RSP    7
+#define DW_R12    12
+#define DW_R13    13
+#define DW_R14    14
+#define DW_R15    15
+#define DW_RA     16
+#define DW_NREGS  17
+
+/* pointer encodings */
+#define DW_EH_PE_absptr   0x00
+#define DW_EH_PE_uleb128  0x01
+#define DW_EH_PE_udata2   0x02
+#define DW_EH_PE_udata4   0x03
+#define DW_EH_PE_udata8   0x04
+#define DW_EH_PE_sleb128  0x09
+#define DW_EH_PE_sdata2   0x0a
+#define DW_EH_PE_sdata4   0x0b
+#define DW_EH_PE_sdata8   0x0c
+#define DW_EH_PE_pcrel    0x10
+#define DW_EH_PE_datarel  0x30
+#define DW_EH_PE_indirect 0x80
+#define DW_EH_PE_omit     0xff
+
+/*
+ * A frame: the registers as they are at its ip, and its CFA once it
+ * has been stepped out of. reg[] must stay first, the context
+ * capture and install code below index it directly.
+ */
+struct _Unwind_Context {
+    uint64_t reg[DW_NREGS];
+    uint64_t cfa;
+    uint64_t func_start;
+    uint64_t lsda;
+    uint8_t  signal;     /* ip is the faulting insn, not a return address */
+};
+
+enum { RULE_SAME = 0, RULE_UNDEF, RULE_OFFSET, RULE_VAL_OFFSET,
+       RULE_REG, RULE_EXPR, RULE_VAL_EXPR };
+
+struct reg_rule {
+    uint8_t how;
+    union {
+        sint64_t        off;
+        uint64_t        reg;
+        const uint8_t * expr;   /* uleb128 length, then the ops */
+    };
+};
+
+struct cfi_rules {
+    struct reg_rule reg[DW_NREGS];
+    uint8_t         cfa_expr;
+    uint64_t        cfa_reg;
+    sint64_t        cfa_off;
+    const uint8_t * cfa_ops;
+};
+
+/* remember_state nesting, gcc never goes deeper than one */
+#define CFI_STACK 4
+
+struct cie_info {
+    uint64_t code_align;
+    sint64_t data_align;
+    uint64_t ra_reg;
+    uint8_t  fde_enc;
+    uint8_t  lsda_enc;
+    uint8_t  aug_z;
+    uint8_t  signal;
+    _Unwind_Personality_Fn personality;
+    const uint8_t * insns;
+    const uint8_t * end;
+};
+
+struct frame_info {
+    struct cie_info  cie;
+    struct cfi_rules rules;
+    uint64_t pc_begin;
+    uint64_t lsda;
+};
+
+/*
+ * The FDE lookup table. The linker's .eh_frame_hdr table is used in
+ * place when it has the usual encoding, entries of (pc, fde) as 32 bit
+ * offsets from the start of the header. Otherwise one is built from
+ * .eh_frame at boot. Either is sorted by pc and never changes after
+ * nk_unwind_init(), so lookups take no lock.
+ */
+struct fde_ent {
+    uint64_t        pc;
+    const uint8_t * fde;
+};
+
+static const sint32_t * hdr_table = 0;
+static uint64_t         hdr_count = 0;
+static struct fde_ent * fde_table = 0;
+static uint64_t         fde_count = 0;
+
+
+static inline uint16_t rd16 (const uint8_t * p) { uint16_t v; memcpy(&v, p, 2); return v; }
+static inline uint32_t rd32 (const uint8_t * p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline uint64_t rd64 (const uint8_t * p) { uint64_t v; memcpy(&v, p, 8); return v; }
+
+
+static uint64_t
+read_uleb (const uint8_t ** p)
+{
+    uint64_t v = 0;
+    unsigned shift = 0;
+    uint8_t b;
+
+    do {
+        b = *(*p)++;
+        if (shift < 64) {
+            v |= (uint64_t)(b & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (b & 0x80);
+
+    return v;
+}
+
+
+static sint64_t
+read_sleb (const uint8_t ** p)
+{
+    uint64_t v = 0;
+    unsigned shift = 0;
+    uint8_t b;
+
+    do {
+        b = *(*p)++;
+        if (shift < 64) {
+            v |= (uint64_t)(b & 0x7f) << shift;
+        }
+        shift += 7;
+    } while (b & 0x80);
+
+    if (shift < 64 && (b & 0x40)) {
+        v |= -(1ULL << shift);
+    }
+
+    return (sint64_t)v;
+}
+
+
+static int
+read_encoded (const uint8_t ** p, uint8_t enc, uint64_t datarel, uint64_t * out)
+{
+    const uint8_t * start = *p;
+    uint64_t v;
+
+    if (enc == DW_EH_PE_omit) {
+        *out = 0;
+        return 0;
+    }
+
+    switch (enc & 0x0f) {
+        case DW_EH_PE_absptr:
+        case DW_EH_PE_udata8:
+        case DW_EH_PE_sdata8:
+            v = rd64(*p); *p += 8;
+            break;
+        case DW_EH_PE_uleb128:
+            v = read_uleb(p);
+            break;
+        case DW_EH_PE_sleb128:
+            v = (uint64_t)read_sleb(p);
+            break;
+        case DW_EH_PE_udata2:
+            v = rd16(*p); *p += 2;
+            break;
+        case DW_EH_PE_sdata2:
+            v = (uint64_t)(sint64_t)(sint16_t)rd16(*p); *p += 2;
+            break;
+        case DW_EH_PE_udata4:
+            v = rd32(*p); *p += 4;
+            break;
+        case DW_EH_PE_sdata4:
+            v = (uint64_t)(sint64_t)(sint32_t)rd32(*p); *p += 4;
+            break;
+        default:
+            return -1;
+    }
+
+    /* a zero is a null pointer whatever it is relative to */
+    if (!v) {
+        *out = 0;
+        return 0;
+    }
+
+    switch (enc & 0x70) {
+        case 0:
+            break;
+        case DW_EH_PE_pcrel:
+            v += (uint64_t)start;
+            break;
+        case DW_EH_PE_datarel:
+            v += datarel;
+            break;
+        default:
+            return -1;
+    }
+
+    if (enc & DW_EH_PE_indirect) {
+        v = *(uint64_t *)v;
+    }
+
+    *out = v;
+    return 0;
+}
+
+
+/* the length of a CIE or FDE and where its body starts */
+static const uint8_t *
+record_body (const uint8_t * rec, uint64_t * len)
+{
+    const uint8_t * p = rec;
+
+    *len = rd32(p); p += 4;
+    if (*len == 0xffffffff) {
+        *len = rd64(p); p += 8;
+    }
+    return p;
+}
+
+
+static int
+parse_cie (const uint8_t * cie, struct cie_info * ci)
+{
+    const uint8_t * p;
+    const uint8_t * aug_end = 0;
+    const char * aug;
+    uint64_t len;
+    uint8_t version;
+
+    p = record_body(cie, &len);
+    ci->end = p + len;
+
+    if (rd32(p) != 0) {
+        return -1;
+    }
+    p += 4;
+
+    version = *p++;
+    aug = (const char *)p;
+    p += strlen(aug) + 1;
+
+    if (aug[0] == 'e' && aug[1] == 'h') {
+        p += 8;
+    }
+    if (version >= 4) {
+        p += 2;     /* address and segment selector sizes */
+    }
+
+    ci->code_align  = read_uleb(&p);
+    ci->data_align  = read_sleb(&p);
+    ci->ra_reg      = version == 1 ? *p++ : read_uleb(&p);
+    ci->fde_enc     = DW_EH_PE_absptr;
+    ci->lsda_enc    = DW_EH_PE_omit;
+    ci->aug_z       = 0;
+    ci->signal      = 0;
+    ci->personality = 0;
+
+    if (aug[0] == 'z') {
+        uint64_t alen = read_uleb(&p);
+
+        aug_end = p + alen;
+        ci->aug_z = 1;
+
+        for (aug++; *aug; aug++) {
+            uint64_t v;
+            uint8_t enc;
+
+            switch (*aug) {
+                case 'R':
+                    ci->fde_enc = *p++;
+                    break;
+                case 'L':
+                    ci->lsda_enc = *p++;
+                    break;
+                case 'P':
+                    enc = *p++;
+                    if (read_encoded(&p, enc, 0, &v)) {
+                        return -1;
+                    }
+                    ci->personality = (_Unwind_Personality_Fn)v;
+                    break;
+                case 'S':
+                    ci->signal = 1;
+                    break;
+                default:
+                    /* the rest is skippable, z gave us its length */
+                    goto done;
+            }
+        }
+    done:
+        p = aug_end;
+    }
+
+    ci->insns = p;
+    return 0;
+}
+
+
+/*
+ * the CIE of an FDE, the range of pcs it covers and where its
+ * augmentation data starts; returns the end of the FDE
+ */
+static const uint8_t *
+fde_range (const uint8_t * fde, struct cie_info * ci, uint64_t * begin, uint64_t * range,
+           const uint8_t ** body)
+{
+    const uint8_t * p;
+    const uint8_t * end;
+    uint64_t len;
+    uint32_t id;
+
+    p = record_body(fde, &len);
+    end = p + len;
+
+    id = rd32(p);
+    if (!id || parse_cie(p - id, ci)) {
+        return 0;
+    }
+    p += 4;
+
+    if (read_encoded(&p, ci->fde_enc, 0, begin) ||
+        read_encoded(&p, ci->fde_enc & 0x0f, 0, range)) {
+        return 0;
+    }
+
+    *body = p;
+    return end;
+}
+
+
+/* the FDE of the last function starting at or before pc */
+static const uint8_t *
+find_fde (uint64_t pc)
+{
+    const uint8_t * h = _eh_frame_hdr_start;
+    uint64_t lo = 0;
+    uint64_t hi;
+
+    if (hdr_table) {
+        hi = hdr_count;
+        while (lo < hi) {
+            uint64_t mid = lo + (hi - lo) / 2;
+            if ((uint64_t)(h + hdr_table[2 * mid]) <= pc) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo ? h + hdr_table[2 * (lo - 1) + 1] : 0;
+    }
+
+    hi = fde_count;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (fde_table[mid].pc <= pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo ? fde_table[lo - 1].fde : 0;
+}
+
+
+#define PUSH(v)   do { if (sp == 16) return -1; stack[sp++] = (v); } while (0)
+#define NEED(n)   do { if (sp < (n)) return -1; } while (0)
+#define BINOP(op) do { NEED(2); sp--; stack[sp - 1] = stack[sp - 1] op stack[sp]; } while (0)
+#define CMPOP(op) do { NEED(2); sp--; stack[sp - 1] =                            \
+                           (sint64_t)stack[sp - 1] op (sint64_t)stack[sp]; } while (0)
+
+/*
+ * A DWARF expression as CFI uses them: where a register was saved, or
+ * what the CFA is, from the registers of the frame. The ops gcc and
+ * binutils emit for that and a little more, anything else fails.
+ */
+static int
+eval_expr (const uint8_t * expr, const uint64_t * regs, uint64_t initial, int push_initial,
+           uint64_t * out)
+{
+    uint64_t stack[16];
+    int sp = 0;
+    const uint8_t * p = expr;
+    const uint8_t * end;
+    uint64_t len, t;
+
+    len = read_uleb(&p);
+    end = p + len;
+
+    if (push_initial) {
+        PUSH(initial);
+    }
+
+    while (p < end) {
+        uint8_t op = *p++;
+
+        if (op >= 0x30 && op <= 0x4f) {         /* DW_OP_lit0..31 */
+            PUSH(op - 0x30);
+            continue;
+        }
+        if (op >= 0x70 && op <= 0x8f) {         /* DW_OP_breg0..31 */
+            if (op - 0x70 >= DW_NREGS) {
+                return -1;
+            }
+            t = regs[op - 0x70];
+            PUSH(t + read_sleb(&p));
+            continue;
+        }
+
+        switch (op) {
+            case 0x03:  /* addr */
+                PUSH(rd64(p)); p += 8;
+                break;
+            case 0x06:  /* deref */
+                NEED(1);
+                stack[sp - 1] = *(uint64_t *)stack[sp - 1];
+                break;
+            case 0x08:  /* const1u */
+                PUSH(*p); p++;
+                break;
+            case 0x09:  /* const1s */
+                PUSH((uint64_t)(sint64_t)(sint8_t)*p); p++;
+                break;
+            case 0x0a:  /* const2u */
+                PUSH(rd16(p)); p += 2;
+                break;
+            case 0x0b:  /* const2s */
+                PUSH((uint64_t)(sint64_t)(sint16_t)rd16(p)); p += 2;
+                break;
+            case 0x0c:  /* const4u */
+                PUSH(rd32(p)); p += 4;
+                break;
+            case 0x0d:  /* const4s */
+                PUSH((uint64_t)(sint64_t)(sint32_t)rd32(p)); p += 4;
+                break;
+            case 0x0e:  /* const8u */
+            case 0x0f:  /* const8s */
+                PUSH(rd64(p)); p += 8;
+                break;
+            case 0x10:  /* constu */
+                t = read_uleb(&p);
+                PUSH(t);
+                break;
+            case 0x11:  /* consts */
+                t = (uint64_t)read_sleb(&p);
+                PUSH(t);
+                break;
+            case 0x12:  /* dup */
+                NEED(1);
+                t = stack[sp - 1];
+                PUSH(t);
+                break;
+            case 0x13:  /* drop */
+                NEED(1);
+                sp--;
+                break;
+            case 0x14:  /* over */
+                NEED(2);
+                t = stack[sp - 2];
+                PUSH(t);
+                break;
+            case 0x15:  /* pick */
+                NEED(*p + 1);
+                t = stack[sp - 1 - *p]; p++;
+                PUSH(t);
+                break;
+            case 0x16:  /* swap */
+                NEED(2);
+                t = stack[sp - 1];
+                stack[sp - 1] = stack[sp - 2];
+                stack[sp - 2] = t;
+                break;
+            case 0x1a: BINOP(&);  break;
+            case 0x1c: BINOP(-);  break;
+            case 0x1e: BINOP(*);  break;
+            case 0x21: BINOP(|);  break;
+            case 0x22: BINOP(+);  break;
+            case 0x24: BINOP(<<); break;
+            case 0x25: BINOP(>>); break;
+            case 0x27: BINOP(^);  break;
+            case 0x29: CMPOP(==); break;
+            case 0x2a: CMPOP(>=); break;
+            case 0x2b: CMPOP(>);  break;
+            case 0x2c: CMPOP(<=); break;
+            case 0x2d: CMPOP(<);  break;
+            case 0x2e: CMPOP(!=); break;
+            case 0x23:  /* plus_uconst */
+                NEED(1);
+                stack[sp - 1] += read_uleb(&p);
+                break;
+            case 0x2f:  /* skip */
+                p += 2 + (sint16_t)rd16(p);
+                break;
+            case 0x28:  /* bra */
+                NEED(1);
+                if (stack[--sp]) {
+                    p += 2 + (sint16_t)rd16(p);
+                } else {
+                    p += 2;
+                }
+                break;
+            case 0x92:  /* bregx */
+                t = read_uleb(&p);
+                if (t >= DW_NREGS) {
+                    return -1;
+                }
+                t = regs[t];
+                PUSH(t + read_sleb(&p));
+                break;
+            case 0x96:  /* nop */
+                break;
+            default:
+                UNWIND_ERROR("DWARF op 0x%x not supported\n", op);
+                return -1;
+        }
+    }
+
+    NEED(1);
+    *out = stack[sp - 1];
+    return 0;
+}
+
+#undef PUSH
+#undef NEED
+#undef BINOP
+#undef CMPOP
+
+
+static inline void
+set_rule (struct cfi_rules * r, uint64_t reg, uint8_t how, uint64_t val)
+{
+    /* vector registers and the like are nothing to us */
+    if (reg < DW_NREGS) {
+        r->reg[reg].how = how;
+        r->reg[reg].reg = val;
+    }
+}
+
+
+/*
+ * Run call frame instructions up to the row covering pc. The CIE's
+ * are run with init NULL; init is what they left, for DW_CFA_restore
+ * in the FDE's.
+ */
+static int
+run_cfi (const uint8_t * p, const uint8_t * end, struct frame_info * fi,
+         const struct cfi_rules * init, uint64_t loc, uint64_t pc)
+{
+    struct cfi_rules * r = &fi->rules;
+    struct cfi_rules saved[CFI_STACK];
+    struct cie_info * ci = &fi->cie;
+    unsigned depth = 0;
+    uint64_t reg, val;
+
+    while (p < end && loc <= pc) {
+        uint8_t op = *p++;
+
+        switch (op & 0xc0) {
+            case 0x40:  /* advance_loc */
+                loc += (op & 0x3f) * ci->code_align;
+                continue;
+            case 0x80:  /* offset */
+                val = read_uleb(&p);
+                set_rule(r, op & 0x3f, RULE_OFFSET, val * ci->data_align);
+                continue;
+            case 0xc0:  /* restore */
+                reg = op & 0x3f;
+                if (reg < DW_NREGS) {
+                    if (init) {
+                        r->reg[reg] = init->reg[reg];
+                    } else {
+                        r->reg[reg].how = RULE_SAME;
+                    }
+                }
+                continue;
+        }
+
+        switch (op) {
+            case 0x00:  /* nop */
+                break;
+            case 0x01:  /* set_loc */
+                if (read_encoded(&p, ci->fde_enc, 0, &loc)) {
+                    return -1;
+                }
+                break;
+            case 0x02:  /* advance_loc1 */
+                loc += *p * ci->code_align; p++;
+                break;
+            case 0x03:  /* advance_loc2 */
+                loc += rd16(p) * ci->code_align; p += 2;
+                break;
+            case 0x04:  /* advance_loc4 */
+                loc += rd32(p) * ci->code_align; p += 4;
+                break;
+            case 0x05:  /* offset_extended */
+                reg = read_uleb(&p);
+                val = read_uleb(&p);
+                set_rule(r, reg, RULE_OFFSET, val * ci->data_align);
+                break;
+            case 0x06:  /* restore_extended */
+                reg = read_uleb(&p);
+                if (reg < DW_NREGS) {
+                    if (init) {
+                        r->reg[reg] = init->reg[reg];
+                    } else {
+                        r->reg[reg].how = RULE_SAME;
+                    }
+                }
+                break;
+            case 0x07:  /* undefined */
+                set_rule(r, read_uleb(&p), RULE_UNDEF, 0);
+                break;
+            case 0x08:  /* same_value */
+                set_rule(r, read_uleb(&p), RULE_SAME, 0);
+                break;
+            case 0x09:  /* register */
+                reg = read_uleb(&p);
+                val = read_uleb(&p);
+                set_rule(r, reg, RULE_REG, val);
+                break;
+            case 0x0a:  /* remember_state */
+                if (depth == CFI_STACK) {
+                    UNWIND_ERROR("remember_state nested too deep\n");
+                    return -1;
+                }
+                saved[depth++] = *r;
+                break;
+            case 0x0b:  /* restore_state */
+                if (!depth) {
+                    return -1;
+                }
+                /* the whole row, the CFA rule included */
+                *r = saved[--depth];
+                break;
+            case 0x0c:  /* def_cfa */
+                r->cfa_expr = 0;
+                r->cfa_reg = read_uleb(&p);
+                r->cfa_off = read_uleb(&p);
+                break;
+            case 0x0d:  /* def_cfa_register */
+                r->cfa_expr = 0;
+                r->cfa_reg = read_uleb(&p);
+                break;
+            case 0x0e:  /* def_cfa_offset */
+                r->cfa_off = read_uleb(&p);
+                break;
+            case 0x0f:  /* def_cfa_expression */
+                r->cfa_expr = 1;
+                r->cfa_ops = p;
+                val = read_uleb(&p);
+                p += val;
+                break;
+            case 0x10:  /* expression */
+            case 0x16:  /* val_expression */
+                reg = read_uleb(&p);
+                set_rule(r, reg, op == 0x10 ? RULE_EXPR : RULE_VAL_EXPR, (uint64_t)p);
+                val = read_uleb(&p);
+                p += val;
+                break;
+            case 0x11:  /* offset_extended_sf */
+                reg = read_uleb(&p);
+                val = (uint64_t)(read_sleb(&p) * ci->data_align);
+                set_rule(r, reg, RULE_OFFSET, val);
+                break;
+            case 0x12:  /* def_cfa_sf */
+                r->cfa_expr = 0;
+                r->cfa_reg = read_uleb(&p);
+                r->cfa_off = read_sleb(&p) * ci->data_align;
+                break;
+            case 0x13:  /* def_cfa_offset_sf */
+                r->cfa_off = read_sleb(&p) * ci->data_align;
+                break;
+            case 0x14:  /* val_offset */
+                reg = read_uleb(&p);
+                val = read_uleb(&p);
+                set_rule(r, reg, RULE_VAL_OFFSET, val * ci->data_align);
+                break;
+            case 0x15:  /* val_offset_sf */
+                reg = read_uleb(&p);
+                val = (uint64_t)(read_sleb(&p) * ci->data_align);
+                set_rule(r, reg, RULE_VAL_OFFSET, val);
+                break;
+            case 0x2e:  /* GNU_args_size */
+                read_uleb(&p);
+                break;
+            case 0x2f:  /* GNU_negative_offset_extended */
+                reg = read_uleb(&p);
+                val = read_uleb(&p);
+                set_rule(r, reg, RULE_OFFSET, -(val * ci->data_align));
+                break;
+            default:
+                UNWIND_ERROR("call frame instruction 0x%x not supported\n", op);
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/* find and run the CFI of the frame ctx is in */
+static _Unwind_Reason_Code
+uw_frame (struct _Unwind_Context * ctx, struct frame_info * fi)
+{
+    struct cfi_rules init;
+    const uint8_t * fde;
+    const uint8_t * end;
+    const uint8_t * p;
+    uint64_t range;
+    uint64_t pc;
+
+    if (!ctx->reg[DW_RA]) {
+        return _URC_END_OF_STACK;
+    }
+
+    /* a return address may be just past the end of the function */
+    pc = ctx->reg[DW_RA] - (ctx->signal ? 0 : 1);
+
+    fde = find_fde(pc);
+    if (!fde) {
+        return _URC_END_OF_STACK;
+    }
+
+    end = fde_range(fde, &fi->cie, &fi->pc_begin, &range, &p);
+    if (!end) {
+        return _URC_FATAL_PHASE1_ERROR;
+    }
+    if (pc < fi->pc_begin || pc >= fi->pc_begin + range) {
+        return _URC_END_OF_STACK;
+    }
+    if (fi->cie.ra_reg != DW_RA) {
+        return _URC_FATAL_PHASE1_ERROR;
+    }
+
+    fi->lsda = 0;
+    if (fi->cie.aug_z) {
+        uint64_t alen = read_uleb(&p);
+        const uint8_t * insns = p + alen;
+
+        if (read_encoded(&p, fi->cie.lsda_enc, 0, &fi->lsda)) {
+            return _URC_FATAL_PHASE1_ERROR;
+        }
+        p = insns;
+    }
+
+    memset(&fi->rules, 0, sizeof(fi->rules));
+    if (run_cfi(fi->cie.insns, fi->cie.end, fi, 0, 0, ~0ULL)) {
+        return _URC_FATAL_PHASE1_ERROR;
+    }
+    init = fi->rules;
+    if (run_cfi(p, end, fi, &init, fi->pc_begin, pc)) {
+        return _URC_FATAL_PHASE1_ERROR;
+    }
+
+    ctx->func_start = fi->pc_begin;
+    ctx->lsda = fi->lsda;
+
+    return _URC_NO_REASON;
+}
+
+
+/* step ctx out to the caller of the frame fi describes */
+static int
+uw_update (struct _Unwind_Context * ctx, struct frame_info * fi)
+{
+    struct cfi_rules * r = &fi->rules;
+    uint64_t old[DW_NREGS];
+    uint64_t cfa, v;
+    int i;
+
+    memcpy(old, ctx->reg, sizeof(old));
+
+    if (r->cfa_expr) {
+        if (eval_expr(r->cfa_ops, old, 0, 0, &cfa)) {
+            return -1;
+        }
+    } else {
+        if (r->cfa_reg >= DW_NREGS) {
+            return -1;
+        }
+        cfa = old[r->cfa_reg] + r->cfa_off;
+    }
+
+    for (i = 0; i < DW_NREGS; i++) {
+        struct reg_rule * rr = &r->reg[i];
+
+        switch (rr->how) {
+            case RULE_SAME:
+                break;
+            case RULE_UNDEF:
+                ctx->reg[i] = 0;
+                break;
+            case RULE_OFFSET:
+                ctx->reg[i] = *(uint64_t *)(cfa + rr->off);
+                break;
+            case RULE_VAL_OFFSET:
+                ctx->reg[i] = cfa + rr->off;
+                break;
+            case RULE_REG:
+                if (rr->reg >= DW_NREGS) {
+                    return -1;
+                }
+                ctx->reg[i] = old[rr->reg];
+                break;
+            case RULE_EXPR:
+            case RULE_VAL_EXPR:
+                if (eval_expr(rr->expr, old, cfa, 1, &v)) {
+                    return -1;
+                }
+                ctx->reg[i] = rr->how == RULE_EXPR ? *(uint64_t *)v : v;
+                break;
+        }
+    }
+
+    /* the caller's stack pointer is the CFA unless said otherwise */
+    if (r->reg[DW_RSP].how == RULE_SAME) {
+        ctx->reg[DW_RSP] = cfa;
+    }
+
+    ctx->cfa = cfa;
+    ctx->signal = fi->cie.signal;
+
+    return 0;
+}
+
+
+static int
+uw_step (struct _Unwind_Context * ctx)
+{
+    struct frame_info fi;
+
+    if (uw_frame(ctx, &fi) != _URC_NO_REASON) {
+        return -1;
+    }
+    return uw_update(ctx, &fi);
+}
+
+
+/*
+ * uw_getcontext() records the callee-saved registers, stack pointer
+ * and return address of its caller, as they are at the call.
+ * uw_install() loads a context, with rax and rdx as the personality
+ * routine set them for a landing pad, and jumps to its ip. Offsets
+ * are into reg[].
+ */
+void uw_getcontext (struct _Unwind_Context * ctx);
+void uw_install (struct _Unwind_Context * ctx) __attribute__((noreturn));
+
+__asm__ (
+    ".text\n"
+    ".align 16\n"
+    "uw_getcontext:\n"
+    "    movq %rbx, 24(%rdi)\n"
+    "    movq %rbp, 48(%rdi)\n"
+    "    movq %r12, 96(%rdi)\n"
+    "    movq %r13, 104(%rdi)\n"
+    "    movq %r14, 112(%rdi)\n"
+    "    movq %r15, 120(%rdi)\n"
+    "    leaq 8(%rsp), %rax\n"
+    "    movq %rax, 56(%rdi)\n"
+    "    movq (%rsp), %rax\n"
+    "    movq %rax, 128(%rdi)\n"
+    "    ret\n"
+    ".align 16\n"
+    "uw_install:\n"
+    "    movq 0(%rdi), %rax\n"
+    "    movq 8(%rdi), %rdx\n"
+    "    movq 24(%rdi), %rbx\n"
+    "    movq 48(%rdi), %rbp\n"
+    "    movq 96(%rdi), %r12\n"
+    "    movq 104(%rdi), %r13\n"
+    "    movq 112(%rdi), %r14\n"
+    "    movq 120(%rdi), %r15\n"
+    "    movq 128(%rdi), %rcx\n"
+    "    movq 56(%rdi), %rsp\n"
+    "    jmp *%rcx\n"
+);
+
+/*
+ * A context for the caller of the function this is used in. It has to
+ * be a macro: the context is taken in that function's own frame,
+ * whose save slots stepping out of it reads.
+ */
+#define uw_init_context(ctx)                  \
+    (memset((ctx), 0, sizeof(*(ctx))),        \
+     uw_getcontext(ctx),                      \
+     uw_step(ctx))
+
+
+/* the cleanup phase, from ctx up to the frame of the handler */
+static _Unwind_Reason_Code
+uw_phase2 (struct _Unwind_Exception * exc, struct _Unwind_Context * ctx)
+{
+    struct frame_info fi;
+    _Unwind_Reason_Code code;
+
+    while (1) {
+        _Unwind_Action actions = _UA_CLEANUP_PHASE;
+
+        if (uw_frame(ctx, &fi) != _URC_NO_REASON) {
+            return _URC_FATAL_PHASE2_ERROR;
+        }
+
+        if (ctx->cfa == exc->private_2) {
+            actions |= _UA_HANDLER_FRAME;
+        }
+
+        if (fi.cie.personality) {
+            code = fi.cie.personality(1, actions, exc->exception_class, exc, ctx);
+            if (code == _URC_INSTALL_CONTEXT) {
+                uw_install(ctx);
+            }
+            if (code != _URC_CONTINUE_UNWIND) {
+                return _URC_FATAL_PHASE2_ERROR;
+            }
+        }
+
+        /* the handler's frame has to take it */
+        if (actions & _UA_HANDLER_FRAME) {
+            return _URC_FATAL_PHASE2_ERROR;
+        }
+
+        if (uw_update(ctx, &fi)) {
+            return _URC_FATAL_PHASE2_ERROR;
+        }
+    }
+}
+
+
+_Unwind_Reason_Code __attribute__((noinline))
+_Unwind_RaiseException (struct _Unwind_Exception * exc)
+{
+    struct _Unwind_Context this_ctx;
+    struct _Unwind_Context cur;
+    struct frame_info fi;
+    _Unwind_Reason_Code code;
+
+    if (uw_init_context(&this_ctx)) {
+        return _URC_FATAL_PHASE1_ERROR;
+    }
+
+    /* search: find the frame that will catch it without changing anything */
+    cur = this_ctx;
+    while (1) {
+        code = uw_frame(&cur, &fi);
+        if (code == _URC_END_OF_STACK) {
+            UNWIND_DEBUG("no handler for exception %p\n", exc);
+            return _URC_END_OF_STACK;
+        }
+        if (code != _URC_NO_REASON) {
+            return _URC_FATAL_PHASE1_ERROR;
+        }
+
+        if (fi.cie.personality) {
+            code = fi.cie.personality(1, _UA_SEARCH_PHASE, exc->exception_class, exc, &cur);
+            if (code == _URC_HANDLER_FOUND) {
+                break;
+            }
+            if (code != _URC_CONTINUE_UNWIND) {
+                return _URC_FATAL_PHASE1_ERROR;
+            }
+        }
+
+        if (uw_update(&cur, &fi)) {
+            return _URC_FATAL_PHASE1_ERROR;
+        }
+    }
+
+    UNWIND_DEBUG("handler for exception %p in frame %p\n", exc, (void *)cur.cfa);
+
+    exc->private_1 = 0;
+    exc->private_2 = cur.cfa;
+
+    cur = this_ctx;
+    return uw_phase2(exc, &cur);
+}
+
+
+/* called at the end of a cleanup that did not catch */
+void __attribute__((noinline))
+_Unwind_Resume (struct _Unwind_Exception * exc)
+{
+    struct _Unwind_Context ctx;
+
+    if (!uw_init_context(&ctx)) {
+        uw_phase2(exc, &ctx);
+    }
+
+    panic("Failed to resume unwinding exception %p\n", exc);
+}
+
+
+/* forced unwinds are not supported, so this is always a rethrow */
+_Unwind_Reason_Code
+_Unwind_Resume_or_Rethrow (struct _Unwind_Exception * exc)
+{
+    return _Unwind_RaiseException(exc);
+}
+
+
+void
+_Unwind_DeleteException (struct _Unwind_Exception * exc)
+{
+    if (exc->exception_cleanup) {
+        exc->exception_cleanup(_URC_FOREIGN_EXCEPTION_CAUGHT, exc);
+    }
+}
+
+
+_Unwind_Reason_Code __attribute__((noinline))
+_Unwind_Backtrace (_Unwind_Trace_Fn fn, void * arg)
+{
+    struct _Unwind_Context ctx;
+    struct frame_info fi;
+    _Unwind_Reason_Code code;
+
+    if (uw_init_context(&ctx)) {
+        return _URC_FATAL_PHASE1_ERROR;
+    }
+
+    while (1) {
+        code = uw_frame(&ctx, &fi);
+        if (code != _URC_NO_REASON && code != _URC_END_OF_STACK) {
+            return _URC_FATAL_PHASE1_ERROR;
+        }
+        if (fn(&ctx, arg) != _URC_NO_REASON) {
+            return _URC_FATAL_PHASE1_ERROR;
+        }
+        if (code == _URC_END_OF_STACK) {
+            return _URC_END_OF_STACK;
+        }
+        if (uw_update(&ctx, &fi)) {
+            return _URC_FATAL_PHASE1_ERROR;
+        }
+    }
+}
+
+
+_Unwind_Word
+_Unwind_GetGR (struct _Unwind_Context * ctx, int index)
+{
+    if (index < 0 || index >= DW_NREGS) {
+        UNWIND_ERROR("no register %d\n", index);
+        return 0;
+    }
+    return ctx->reg[index];
+}
+
+
+void
+_Unwind_SetGR (struct _Unwind_Context * ctx, int index, _Unwind_Word value)
+{
+    if (index < 0 || index >= DW_NREGS) {
+        UNWIND_ERROR("no register %d\n", index);
+        return;
+    }
+    ctx->reg[index] = value;
+}
+
+
+_Unwind_Ptr
+_Unwind_GetIP (struct _Unwind_Context * ctx)
+{
+    return ctx->reg[DW_RA];
+}
+
+
+_Unwind_Ptr
+_Unwind_GetIPInfo (struct _Unwind_Context * ctx, int * ip_before_insn)
+{
+    *ip_before_insn = ctx->signal;
+    return ctx->reg[DW_RA];
+}
+
+
+void
+_Unwind_SetIP (struct _Unwind_Context * ctx, _Unwind_Ptr ip)
+{
+    ctx->reg[DW_RA] = ip;
+}
+
+
+_Unwind_Word
+_Unwind_GetCFA (struct _Unwind_Context * ctx)
+{
+    return ctx->cfa;
+}
+
+
+_Unwind_Ptr
+_Unwind_GetLanguageSpecificData (struct _Unwind_Context * ctx)
+{
+    return ctx->lsda;
+}
+
+
+_Unwind_Ptr
+_Unwind_GetRegionStart (struct _Unwind_Context * ctx)
+{
+    return ctx->func_start;
+}
+
+
+/* nothing on x86_64 is encoded relative to these */
+_Unwind_Ptr
+_Unwind_GetTextRelBase (struct _Unwind_Context * ctx)
+{
+    return 0;
+}
+
+
+_Unwind_Ptr
+_Unwind_GetDataRelBase (struct _Unwind_Context * ctx)
+{
+    return 0;
+}
+
+
+static void
+fde_sift (struct fde_ent * t, uint64_t i, uint64_t n)
+{
+    while (2 * i + 1 < n) {
+        uint64_t c = 2 * i + 1;
+        struct fde_ent tmp;
+
+        if (c + 1 < n && t[c + 1].pc > t[c].pc) {
+            c++;
+        }
+        if (t[i].pc >= t[c].pc) {
+            return;
+        }
+        tmp = t[i]; t[i] = t[c]; t[c] = tmp;
+        i = c;
+    }
+}
+
+
+/* when the linker left no usable index, make one from .eh_frame */
+static int
+fde_table_build (void)
+{
+    const uint8_t * p;
+    uint64_t n = 0;
+    uint64_t i;
+    int pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        for (p = _eh_frame_start; p + 4 <= _eh_frame_end; ) {
+            struct cie_info ci;
+            const uint8_t * body;
+            uint64_t len, begin, range;
+
+            body = record_body(p, &len);
+            if (!len) {
+                break;
+            }
+            /* FDEs of discarded code have no range */
+            if (rd32(body) && fde_range(p, &ci, &begin, &range, &body) && begin && range) {
+                if (pass) {
+                    fde_table[n].pc  = begin;
+                    fde_table[n].fde = p;
+                }
+                n++;
+            }
+            p = record_body(p, &len) + len;
+        }
+
+        if (!pass) {
+            if (!n) {
+                UNWIND_PRINT("no unwind tables, exceptions will terminate\n");
+                return 0;
+            }
+            fde_table = malloc(n * sizeof(struct fde_ent));
+            if (!fde_table) {
+                UNWIND_ERROR("cannot allocate FDE table of %lu entries\n", n);
+                return -1;
+            }
+            fde_count = n;
+            n = 0;
+        }
+    }
+
+    for (i = n / 2; i-- > 0; ) {
+        fde_sift(fde_table, i, n);
+    }
+    for (i = n; i-- > 1; ) {
+        struct fde_ent tmp = fde_table[0];
+        fde_table[0] = fde_table[i];
+        fde_table[i] = tmp;
+        fde_sift(fde_table, 0, i);
+    }
+
+    UNWIND_PRINT("%lu FDEs indexed from .eh_frame\n", n);
+    return 0;
+}
+
+
+int
+nk_unwind_init (void)
+{
+    const uint8_t * h = _eh_frame_hdr_start;
+    const uint8_t * p = h + 4;
+    uint64_t eh_frame, count;
+
+    if (_eh_frame_hdr_end - h >= 4 && h[0] == 1 &&
+        h[2] != DW_EH_PE_omit &&
+        h[3] == (DW_EH_PE_datarel | DW_EH_PE_sdata4) &&
+        !read_encoded(&p, h[1], (uint64_t)h, &eh_frame) &&
+        !read_encoded(&p, h[2], (uint64_t)h, &count) &&
+        (const uint8_t *)eh_frame == _eh_frame_start) {
+        hdr_table = (const sint32_t *)p;
+        hdr_count = count;
+        UNWIND_PRINT("%lu FDEs indexed by .eh_frame_hdr\n", count);
+        return 0;
+    }
+
+    return fde_table_build();
+}
@@ -33,6 +33,9 @@
 #include <dev/i8254.h>
 #include <dev/timer.h>
 #include <lib/bitops.h>
+#ifdef NAUT_CONFIG_PMC_SAMPLING
+#include <nautilus/pmc_sample.h>
+#endif
 
 #ifndef NAUT_CONFIG_DEBUG_APIC
 #undef DEBUG_PRINT
@@ -139,6 +142,11 @@ dummy_int_handler (excp_entry_t * excp, excp_vec_t v)
 static int
 pc_int_handler (excp_entry_t * excp, excp_vec_t v)
 {
+#ifdef NAUT_CONFIG_PMC_SAMPLING
+    nk_sample_overflow(excp);
+    IRQ_HANDLER_END();
+    return 0;
+#endif
     panic("Received a performance counter interrupt from the LAPIC (0x%x) on core %u (Should be masked)\n",
         per_cpu_get(apic)->id,
         my_cpu_id());
@@ -171,6 +179,50 @@ check_apic_avail (void)
 }
 
 
+static uint8_t
+check_tsc_deadline_avail (void)
+{
+    cpuid_ret_t cp;
+    struct cpuid_feature_flags * flags;
+
+    cpuid(CPUID_FEATURE_INFO, &cp);
+    flags = (struct cpuid_feature_flags *)&cp.c;
+
+    return flags->ecx.tsc_dline;
+}
+
+
+#ifdef NAUT_CONFIG_APIC_X2APIC
+static uint8_t
+check_x2apic_avail (void)
+{
+    cpuid_ret_t cp;
+    struct cpuid_feature_flags * flags;
+
+    cpuid(CPUID_FEATURE_INFO, &cp);
+    flags = (struct cpuid_feature_flags *)&cp.c;
+
+    return flags->ecx.x2apic;
+}
+
+
+/*
+ * Switch this core's APIC into x2APIC mode. Going straight from
+ * disabled or xAPIC mode to x2APIC mode is a legal transition, so
+ * we set both enables in one write. In x2APIC mode the MMIO window
+ * is dead and every register access goes through apic_read/write.
+ */
+static void
+apic_x2apic_enable (struct apic_dev * apic)
+{
+    msr_write(APIC_BASE_MSR, msr_read(APIC_BASE_MSR) | 
+            IA32_APIC_BASE_MSR_ENABLE | 
+            IA32_APIC_BASE_MSR_EXTD);
+    apic->x2apic = 1;
+}
+#endif
+
+
 static uint8_t
 apic_is_bsp (struct apic_dev * apic)
 {
@@ -249,6 +301,10 @@ apic_do_eoi (void)
 uint32_t
 apic_get_id (struct apic_dev * apic)
 {
+    if (apic->x2apic) {
+        return apic_read(apic, APIC_REG_ID);
+    }
+
     return (apic_read(apic, APIC_REG_ID) >> APIC_ID_SHIFT) & 0xff;
 }
 
@@ -266,6 +322,11 @@ apic_wait_for_send(struct apic_dev * apic)
     uint32_t res;
     int n = 0;
 
+    /* x2APIC has no delivery status bit; the WRMSR is the send */
+    if (apic->x2apic) {
+        return 0;
+    }
+
     do {
         if (!(res = apic_read(apic, APIC_REG_ICR) & ICR_SEND_PENDING)) {
             break;
@@ -298,7 +359,11 @@ void
 apic_self_ipi (struct apic_dev * apic, uint_t vector)
 {
     uint8_t flags = irq_disable_save();
-    apic_write(apic, APIC_IPI_SELF, vector);
+    if (apic->x2apic) {
+        apic_write(apic, APIC_REG_SELF_IPI, vector);
+    } else {
+        apic_write_icr(apic, 0, APIC_IPI_SELF | APIC_DEL_MODE_FIXED | vector);
+    }
     irq_enable_restore(flags);
 }
 
@@ -307,8 +372,7 @@ void
 apic_send_iipi (struct apic_dev * apic, uint32_t remote_id) 
 {
     uint8_t flags = irq_disable_save();
-    apic_write(apic, APIC_REG_ICR2, remote_id << APIC_ICR2_DST_SHIFT);
-    apic_write(apic, APIC_REG_ICR, ICR_TRIG_MODE_LEVEL| ICR_LEVEL_ASSERT | ICR_DEL_MODE_INIT);
+    apic_write_icr(apic, remote_id, ICR_TRIG_MODE_LEVEL| ICR_LEVEL_ASSERT | ICR_DEL_MODE_INIT);
     irq_enable_restore(flags);
 }
 
@@ -317,8 +381,7 @@ void
 apic_deinit_iipi (struct apic_dev * apic, uint32_t remote_id)
 {
     uint8_t flags = irq_disable_save();
-    apic_write(apic, APIC_REG_ICR2, remote_id << APIC_ICR2_DST_SHIFT);
-    apic_write(apic, APIC_REG_ICR, ICR_TRIG_MODE_LEVEL| ICR_DEL_MODE_INIT);
+    apic_write_icr(apic, remote_id, ICR_TRIG_MODE_LEVEL| ICR_DEL_MODE_INIT);
     irq_enable_restore(flags);
 }
 
@@ -327,8 +390,7 @@ void
 apic_send_sipi (struct apic_dev * apic, uint32_t remote_id, uint8_t target)
 {
     uint8_t flags = irq_disable_save();
-    apic_write(apic, APIC_REG_ICR2, remote_id << APIC_ICR2_DST_SHIFT);
-    apic_write(apic, APIC_REG_ICR, ICR_DEL_MODE_STARTUP | target);
+    apic_write_icr(apic, remote_id, ICR_DEL_MODE_STARTUP | target);
     irq_enable_restore(flags);
 }
 
@@ -337,7 +399,7 @@ void
 apic_bcast_iipi (struct apic_dev * apic) 
 {
     uint8_t flags = irq_disable_save();
-    apic_write(apic, APIC_REG_ICR, APIC_IPI_OTHERS | ICR_LEVEL_ASSERT | ICR_TRIG_MODE_LEVEL | ICR_DEL_MODE_INIT);
+    apic_write_icr(apic, 0, APIC_IPI_OTHERS | ICR_LEVEL_ASSERT | ICR_TRIG_MODE_LEVEL | ICR_DEL_MODE_INIT);
     irq_enable_restore(flags);
 }
 
@@ -346,7 +408,7 @@ void
 apic_bcast_deinit_iipi (struct apic_dev * apic)
 {
     uint8_t flags = irq_disable_save();
-    apic_write(apic, APIC_REG_ICR, APIC_IPI_OTHERS | ICR_TRIG_MODE_LEVEL | ICR_DEL_MODE_INIT);
+    apic_write_icr(apic, 0, APIC_IPI_OTHERS | ICR_TRIG_MODE_LEVEL | ICR_DEL_MODE_INIT);
     irq_enable_restore(flags);
 }
 
@@ -355,7 +417,7 @@ void
 apic_bcast_sipi (struct apic_dev * apic, uint8_t target)
 {
     uint8_t flags = irq_disable_save();
-    apic_write(apic, APIC_REG_ICR, APIC_IPI_OTHERS | ICR_DEL_MODE_STARTUP | target);
+    apic_write_icr(apic, 0, APIC_IPI_OTHERS | ICR_DEL_MODE_STARTUP | target);
     irq_enable_restore(flags);
 }
 
@@ -469,6 +531,11 @@ amd_has_ext_lvt (struct apic_dev * apic)
 {
     uint32_t ver = apic_read(apic, APIC_REG_LVR);
 
+    /* the extended register space is only reachable through MMIO */
+    if (apic->x2apic) {
+        return 0;
+    }
+
     if (APIC_HAS_EXT_LVT(ver)) {
         return 1;
     }
@@ -619,10 +686,17 @@ apic_dump (struct apic_dev * apic)
 		apic_read(apic, APIC_REG_LDR),
 		GET_APIC_LOGICAL_ID(apic_read(apic, APIC_REG_LDR))
 	);
-	APIC_DEBUG("      DFR (Dest Format Reg):   0x%08x (%s)\n",
-		apic_read(apic, APIC_REG_DFR),
-		(apic_read(apic, APIC_REG_DFR) == APIC_DFR_FLAT) ? "FLAT" : "CLUSTER"
-	);
+	if (apic->x2apic) {
+		/* no DFR in x2APIC mode, logical mode is always cluster */
+		APIC_DEBUG("      x2APIC cluster=0x%x\n", 
+			apic_read(apic, APIC_REG_LDR) >> 16
+		);
+	} else {
+		APIC_DEBUG("      DFR (Dest Format Reg):   0x%08x (%s)\n",
+			apic_read(apic, APIC_REG_DFR),
+			(apic_read(apic, APIC_REG_DFR) == APIC_DFR_FLAT) ? "FLAT" : "CLUSTER"
+		);
+	}
 
 	/*
  	 * Task/processor/arbitration priority registers
@@ -725,6 +799,13 @@ apic_init (struct cpu * core)
     }
 #endif
 
+#ifdef NAUT_CONFIG_APIC_X2APIC
+    if (check_x2apic_avail()) {
+        apic_x2apic_enable(apic);
+        APIC_DEBUG("Core %u using x2APIC mode\n", core->id);
+    }
+#endif
+
     apic->version   = apic_get_version(apic);
     apic->id        = apic_get_id(apic);
 
@@ -734,9 +815,12 @@ apic_init (struct cpu * core)
     }
 #endif
 
-    val = apic_read(apic, APIC_REG_LDR) & ~APIC_LDR_MASK;
-    val |= SET_APIC_LOGICAL_ID(0);
-    apic_write(apic, APIC_REG_LDR, val);
+    /* the x2APIC LDR is derived from the ID and is read-only */
+    if (!apic->x2apic) {
+        val = apic_read(apic, APIC_REG_LDR) & ~APIC_LDR_MASK;
+        val |= SET_APIC_LOGICAL_ID(0);
+        apic_write(apic, APIC_REG_LDR, val);
+    }
 
     apic_write(apic, APIC_REG_TPR, apic_read(apic, APIC_REG_TPR) & 0xffffff00);                       // accept all interrupts
     apic_write(apic, APIC_REG_LVTT,    APIC_DEL_MODE_FIXED | APIC_LVT_DISABLED);                      // disable timer interrupts intially
@@ -779,7 +863,7 @@ apic_init (struct cpu * core)
             return;
         }
 
-        /* we shouldn't ever get these, but just in case */
+        /* only unmasked by the sampling profiler */
         if (register_int_handler(APIC_PC_INT_VEC, pc_int_handler, apic) != 0) {
             panic("Could not register perf counter interrupt handler\n");
             return;
@@ -806,6 +890,13 @@ apic_init (struct cpu * core)
     apic_timer_setup(apic, 1000/NAUT_CONFIG_HZ);
 #endif
 
+#ifdef NAUT_CONFIG_APIC_TSC_DEADLINE
+    if (check_tsc_deadline_avail()) {
+        APIC_DEBUG("APIC 0x%x supports TSC-deadline timer mode\n", apic->id);
+        apic->tsc_deadline = 1;
+    }
+#endif
+
     apic_dump(apic);
 }
 
@@ -813,9 +904,38 @@ inline void apic_oneshot_write(struct apic_dev *apic, uint64_t time) {
     apic_write(apic, APIC_REG_LVTT, APIC_TIMER_ONESHOT | APIC_DEL_MODE_FIXED | APIC_TIMER_INT_VEC);
     apic_write(apic, APIC_REG_TMDCR, APIC_TIMER_DIVCODE);
     uint32_t count = (apic->scale == 0) ? (time / 43) : (time / (apic->scale + 1));
+    if (time && !count) {
+        /* a zero count would stop the timer instead of firing it */
+        count = 1;
+    }
     apic_write(apic, APIC_REG_TMICT, count);
 }
 
+
+/*
+ * Arm the timer to fire at an absolute TSC time (0 disarms it).
+ *
+ * In TSC-deadline mode the deadline goes straight into
+ * IA32_TSC_DEADLINE, so there is no TSC to APIC-tick conversion and
+ * no drift from the calibrated scale. Otherwise we fall back to a
+ * relative oneshot count computed from the current TSC.
+ */
+void apic_deadline_write(struct apic_dev *apic, uint64_t tsc) {
+    if (apic->tsc_deadline) {
+        apic_write(apic, APIC_REG_LVTT, APIC_TIMER_TSCDLINE | APIC_DEL_MODE_FIXED | APIC_TIMER_INT_VEC);
+        /* the LVT write must land before the MSR write (SDM 10.5.4.1) */
+        mbarrier();
+        msr_write(IA32_MSR_TSC_DEADLINE, tsc);
+        return;
+    }
+
+    if (tsc == 0) {
+        apic_oneshot_write(apic, 0);
+    } else {
+        uint64_t now = rdtsc();
+        apic_oneshot_write(apic, (tsc > now) ? (tsc - now) : 1);
+    }
+}
                
                
 void apic_oneshot_test(struct apic_dev *apic) {
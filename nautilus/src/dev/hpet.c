@@ -30,6 +30,18 @@
 #include <dev/hpet.h>
 #include <nautilus/math.h>
 
+#ifdef NAUT_CONFIG_HPET_BROADCAST
+#include <nautilus/irq.h>
+#include <nautilus/list.h>
+#include <nautilus/percpu.h>
+#include <nautilus/spinlock.h>
+#include <dev/apic.h>
+#include <dev/ioapic.h>
+#ifdef NAUT_CONFIG_TSC_CLOCKSOURCE
+#include <nautilus/clocksource.h>
+#endif
+#endif
+
 #ifndef NAUT_CONFIG_DEBUG_HPET
 #undef DEBUG_PRINT
 #define DEBUG_PRINT(fmt, args...)
@@ -336,3 +348,248 @@ nk_hpet_init (void)
 
 
 
+
+
+#ifdef NAUT_CONFIG_HPET_BROADCAST
+struct hpet_bcast_cpu {
+    struct list_head node;
+    uint64_t         expiry;    /* TSC */
+    uint8_t          queued;
+};
+
+static struct {
+    spinlock_t               lock;
+    struct hpet_comparator * cmp;
+    struct list_head         sleepers;   /* sorted by expiry */
+    uint64_t                 armed;      /* TSC time the comparator is set for, 0 if idle */
+    uint64_t                 tsc_hz;
+    struct hpet_bcast_cpu    cpus[NAUT_CONFIG_MAX_CPUS];
+} bcast;
+
+
+/* has the main counter reached val? 32-bit comparators only match the low half */
+static inline uint8_t
+hpet_cmp_passed (struct hpet_comparator * cmp, uint64_t val)
+{
+    uint64_t now = hpet_read(cmp->parent, HPET_MAIN_CTR_REG);
+
+    if (cmp->size == TIMER_SIZE_32) {
+        return (sint32_t)((uint32_t)now - (uint32_t)val) >= 0;
+    }
+
+    return (sint64_t)(now - val) >= 0;
+}
+
+
+/*
+ * Set the comparator for TSC time tsc. Returns -1 if that time had
+ * already arrived by the time the comparator was written, since an
+ * HPET comparator set in the past only matches once the counter wraps.
+ */
+static int
+bcast_program (uint64_t tsc)
+{
+    struct hpet_dev * hpet = bcast.cmp->parent;
+    uint64_t now = rdtsc();
+    uint64_t delta, val;
+
+    delta = (tsc > now) ? tsc - now : 0;
+
+    /* keep the multiply in range, we get re-armed long before 10s are up */
+    if (delta > bcast.tsc_hz * 10) {
+        delta = bcast.tsc_hz * 10;
+    }
+
+    val = hpet_read(hpet, HPET_MAIN_CTR_REG) + delta * hpet->freq / bcast.tsc_hz + 1;
+    hpet_write_cmp_val(bcast.cmp, val);
+
+    if (hpet_cmp_passed(bcast.cmp, val)) {
+        bcast.armed = 0;
+        return -1;
+    }
+
+    bcast.armed = tsc;
+    return 0;
+}
+
+
+static int
+bcast_handler (excp_entry_t * excp, excp_vec_t vec)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    struct apic_dev * apic = per_cpu_get(apic);
+    struct hpet_bcast_cpu * c;
+    uint64_t now;
+    cpu_id_t cpu;
+
+    spin_lock(&bcast.lock);
+
+    bcast.armed = 0;
+
+    while (!list_empty(&bcast.sleepers)) {
+        now = rdtsc();
+
+        c = list_first_entry(&bcast.sleepers, struct hpet_bcast_cpu, node);
+        if (c->expiry > now && bcast_program(c->expiry) == 0) {
+            break;
+        }
+
+        list_del_init(&c->node);
+        c->queued = 0;
+
+        /* stands in for the APIC timer interrupt it slept through */
+        cpu = c - bcast.cpus;
+        if (cpu == my_cpu_id()) {
+            apic_self_ipi(apic, APIC_TIMER_INT_VEC);
+        } else {
+            apic_ipi(apic, sys->cpus[cpu]->lapic_id, APIC_TIMER_INT_VEC);
+        }
+    }
+
+    spin_unlock(&bcast.lock);
+
+    IRQ_HANDLER_END();
+    return 0;
+}
+
+
+int
+nk_hpet_bcast_enter (uint64_t tsc)
+{
+    struct hpet_bcast_cpu * c, * pos;
+    uint8_t flags;
+    int ret = 0;
+
+    if (!bcast.cmp || !tsc) {
+        return -1;
+    }
+
+    flags = spin_lock_irq_save(&bcast.lock);
+
+    c = &bcast.cpus[my_cpu_id()];
+    if (c->queued) {
+        list_del_init(&c->node);
+    }
+
+    c->expiry = tsc;
+    c->queued = 1;
+
+    /* sleepers are few, a sorted insert is cheap */
+    list_for_each_entry(pos, &bcast.sleepers, node) {
+        if (pos->expiry > tsc) {
+            break;
+        }
+    }
+    list_add_tail(&c->node, &pos->node);
+
+    if (bcast.sleepers.next == &c->node && (!bcast.armed || tsc < bcast.armed)) {
+        if (bcast_program(tsc) != 0) {
+            /* already due, so don't sleep on it */
+            list_del_init(&c->node);
+            c->queued = 0;
+            ret = -1;
+        }
+    }
+
+    spin_unlock_irq_restore(&bcast.lock, flags);
+
+    return ret;
+}
+
+
+void
+nk_hpet_bcast_exit (void)
+{
+    struct hpet_bcast_cpu * c = &bcast.cpus[my_cpu_id()];
+    uint8_t flags;
+
+    if (!c->queued) {
+        return;
+    }
+
+    /* the comparator stays as it is, an early interrupt is harmless */
+    flags = spin_lock_irq_save(&bcast.lock);
+    if (c->queued) {
+        list_del_init(&c->node);
+        c->queued = 0;
+    }
+    spin_unlock_irq_restore(&bcast.lock, flags);
+}
+
+
+/*
+ * Claim a comparator for broadcast wakeups and point its interrupt
+ * at this core, by FSB (MSI) delivery if the comparator has it and
+ * through a free IOAPIC pin otherwise.
+ */
+int
+nk_hpet_bcast_init (void)
+{
+    struct naut_info * naut = nk_get_nautilus_info();
+    struct hpet_dev * hpet = naut->sys.hpet;
+    struct hpet_comparator * cmp;
+    uint32_t apic_id = per_cpu_get(lapic_id);
+    uint64_t cfg;
+    int pin;
+
+    if (!hpet) {
+        return -1;
+    }
+
+    cmp = hpet_get_free_timer(hpet);
+    if (!cmp) {
+        HPET_PRINT("No free comparator for broadcast wakeups\n");
+        return -1;
+    }
+
+#ifdef NAUT_CONFIG_TSC_CLOCKSOURCE
+    bcast.tsc_hz = nk_clock.tsc_hz;
+#else
+    bcast.tsc_hz = per_cpu_get(cpu_khz) * 1000ULL;
+#endif
+    if (!bcast.tsc_hz) {
+        HPET_PRINT("TSC rate unknown, no broadcast wakeups\n");
+        return -1;
+    }
+
+    if (register_int_handler(HPET_BCAST_VEC, bcast_handler, NULL) != 0) {
+        ERROR_PRINT("Could not register HPET broadcast handler\n");
+        return -1;
+    }
+
+    /* edge triggered, one-shot, 64-bit where it can be */
+    cfg = hpet_read(hpet, TIMER_N_CFG_CAP_REG(cmp->idx));
+    cfg &= ~(TN_PERIODIC | TN_ENABLE | TN_FSB_EN | TN_INT_ROUTE(0x1f) | (1 << 1) | (1 << 8));
+
+    if (cmp->supports_fsb_del && apic_id <= 0xff) {
+        hpet_write(hpet, TIMER_N_FSB_IR_REG(cmp->idx),
+                   ((0xfee00000ULL | (apic_id << 12)) << 32) | HPET_BCAST_VEC);
+        cfg |= TN_FSB_EN;
+        HPET_DEBUG("Broadcast comparator %u uses FSB delivery\n", cmp->idx);
+    } else {
+        for (pin = 16; pin < 32; pin++) {
+            if ((cmp->int_route_cap & (1U << pin)) &&
+                ioapic_route_pin(naut->sys.ioapics[0], pin, HPET_BCAST_VEC, apic_id) == 0) {
+                break;
+            }
+        }
+        if (pin == 32) {
+            HPET_PRINT("No IOAPIC pin for broadcast comparator %u\n", cmp->idx);
+            return -1;
+        }
+        cmp->int_route = pin;
+        cfg |= TN_INT_ROUTE(pin);
+        HPET_DEBUG("Broadcast comparator %u routed to IOAPIC pin %u\n", cmp->idx, pin);
+    }
+
+    hpet_write(hpet, TIMER_N_CFG_CAP_REG(cmp->idx), cfg);
+    INIT_LIST_HEAD(&bcast.sleepers);
+    cmp->stat = TIMER_RUNNING;
+    bcast.cmp = cmp;
+    hpet_cmp_run(cmp);
+
+    HPET_PRINT("Broadcast wakeups on comparator %u\n", cmp->idx);
+
+    return 0;
+}
+#endif
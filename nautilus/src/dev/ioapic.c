@@ -89,6 +89,29 @@ ioapic_unmask_irq (struct ioapic * ioapic, uint8_t irq)
 }
 
 
+/*
+ * Point an entry at a different (physical) local APIC. The
+ * destination lives alone in the high word, so we can rewrite it
+ * without touching the mask, and the next interrupt goes there.
+ */
+void
+ioapic_set_irq_dest (struct ioapic * ioapic, uint8_t irq, uint8_t apic_id)
+{
+    uint32_t hi;
+    ASSERT(irq < ioapic->num_entries);
+    hi = ioapic_read_reg(ioapic, IOAPIC_IRQ_ENTRY_HI(irq)) & ~IORED_DST_MASK_LOG;
+    ioapic_write_reg(ioapic, IOAPIC_IRQ_ENTRY_HI(irq), hi | ((uint32_t)apic_id << 24));
+}
+
+
+uint8_t
+ioapic_get_irq_dest (struct ioapic * ioapic, uint8_t irq)
+{
+    ASSERT(irq < ioapic->num_entries);
+    return IORED_GET_DEST(ioapic_read_irq_entry(ioapic, irq));
+}
+
+
 static void 
 ioapic_assign_irq (struct ioapic * ioapic,
                    uint8_t irq, 
@@ -107,6 +130,30 @@ ioapic_assign_irq (struct ioapic * ioapic,
 }
 
 
+/*
+ * ioapic_route_pin
+ *
+ * route a pin that no bus interrupt claimed straight to a vector on
+ * one CPU, edge triggered and active high, and unmask it
+ *
+ * returns -1 if the pin is taken or doesn't exist, 0 on success
+ *
+ */
+int
+ioapic_route_pin (struct ioapic * ioapic, uint8_t pin, uint8_t vector, uint8_t apic_id)
+{
+    if (pin >= ioapic->num_entries || ioapic->entries[pin].boot_info || ioapic->entries[pin].enabled) {
+        return -1;
+    }
+
+    ioapic_assign_irq(ioapic, pin, vector, PIN_POLARITY_HI, TRIGGER_MODE_EDGE, 1);
+    ioapic_set_irq_dest(ioapic, pin, apic_id);
+    ioapic_unmask_irq(ioapic, pin);
+
+    return 0;
+}
+
+
 static uint8_t 
 ioapic_get_id (struct ioapic * ioapic)
 {
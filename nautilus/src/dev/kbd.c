@@ -385,6 +385,64 @@ static int switcher(nk_scancode_t scan)
 }
 
 
+#ifdef NAUT_CONFIG_THREADED_IRQS
+/* scancodes read by the top half, waiting for the bottom half */
+#define KBD_RX_QUEUE 16
+static nk_scancode_t kbd_rx_queue[KBD_RX_QUEUE];
+static volatile uint32_t kbd_rx_head = 0;
+static volatile uint32_t kbd_rx_tail = 0;
+
+/* the controller won't interrupt again until we take the scancode */
+static void
+kbd_irq_ack (void * priv_data)
+{
+  uint8_t status;
+  nk_scancode_t scan;
+
+  status = inb(KBD_CMD_REG);
+
+  io_delay();
+
+  if ((status & STATUS_OUTPUT_FULL) != 0) {
+    scan  = inb(KBD_DATA_REG);
+    DEBUG("Keyboard: status=0x%x, scancode=0x%x\n", status, scan);
+    io_delay();
+
+#if NAUT_CONFIG_THREAD_EXIT_KEYCODE == 0xc4
+    // Vestigal debug handling to force thread exit, 
+    // which has to hit the interrupted thread
+    if (scan == 0xc4) {
+      void * ret = NULL;
+      IRQ_HANDLER_END();
+      kbd_reset();
+      nk_thread_exit(ret);
+    }
+#endif
+
+    if (kbd_rx_tail - kbd_rx_head < KBD_RX_QUEUE) {
+      kbd_rx_queue[kbd_rx_tail % KBD_RX_QUEUE] = scan;
+      asm volatile ("" ::: "memory");
+      kbd_rx_tail++;
+    }
+  }
+}
+
+
+static void
+kbd_irq_work (void * priv_data)
+{
+  nk_scancode_t scan;
+
+  while (kbd_rx_head != kbd_rx_tail) {
+    scan = kbd_rx_queue[kbd_rx_head % KBD_RX_QUEUE];
+    asm volatile ("" ::: "memory");
+    kbd_rx_head++;
+    switcher(scan);
+  }
+}
+
+#else
+
 static int 
 kbd_handler (excp_entry_t * excp, excp_vec_t vec)
 {
@@ -421,6 +479,7 @@ kbd_handler (excp_entry_t * excp, excp_vec_t vec)
   IRQ_HANDLER_END();
   return 0;
 }
+#endif
 
 
 
@@ -428,7 +487,11 @@ int
 kbd_init (struct naut_info * naut)
 {
   INFO("init\n");
+#ifdef NAUT_CONFIG_THREADED_IRQS
+  register_threaded_irq_handler(1, kbd_irq_ack, kbd_irq_work, NULL, 0);
+#else
   register_irq_handler(1, kbd_handler, NULL);
+#endif
   kbd_reset();
   return 0;
 }
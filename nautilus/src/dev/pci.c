@@ -25,6 +25,12 @@
 #include <nautilus/cpu.h>
 #include <nautilus/intrinsics.h>
 #include <nautilus/mm.h>
+#include <nautilus/irq.h>
+#include <nautilus/paging.h>
+#include <nautilus/spinlock.h>
+#ifdef NAUT_CONFIG_PCI_ECAM
+#include <nautilus/acpi.h>
+#endif
 
 #ifndef NAUT_CONFIG_DEBUG_PCI
 #undef DEBUG_PRINT
@@ -33,27 +39,77 @@
 
 #define PCI_PRINT(fmt, args...) printk("PCI: " fmt, ##args)
 
+/* the 0xcf8/0xcfc pair is one global address/data latch */
+static spinlock_t pci_cfg_lock;
 
-uint16_t 
-pci_cfg_readw (uint8_t bus, 
-               uint8_t slot,
-               uint8_t fun,
-               uint8_t off)
+#ifdef NAUT_CONFIG_PCI_ECAM
+#define PCI_ECAM_MAX 8
+
+/* memory-mapped config space (ECAM) windows from the MCFG, segment 0 only */
+static struct pci_ecam {
+    addr_t  base;       // of start_bus
+    uint8_t start_bus;
+    uint8_t end_bus;
+} pci_ecam[PCI_ECAM_MAX];
+
+static int pci_num_ecam = 0;
+
+static inline volatile uint8_t *
+pci_ecam_addr (uint8_t bus, uint8_t slot, uint8_t fun, uint8_t off)
+{
+    int i;
+
+    for (i = 0; i < pci_num_ecam; i++) {
+        if (bus >= pci_ecam[i].start_bus && bus <= pci_ecam[i].end_bus) {
+            return (volatile uint8_t *)(pci_ecam[i].base +
+                                        ((addr_t)(bus - pci_ecam[i].start_bus) << 20) +
+                                        ((addr_t)slot << 15) +
+                                        ((addr_t)fun << 12) +
+                                        off);
+        }
+    }
+
+    return NULL;
+}
+#endif
+
+
+static inline uint32_t
+pci_cfg_addr (uint8_t bus, uint8_t slot, uint8_t fun, uint8_t off)
 {
-    uint32_t addr;
     uint32_t lbus  = (uint32_t)bus;
     uint32_t lslot = (uint32_t)slot;
     uint32_t lfun  = (uint32_t)fun;
-    uint32_t ret;
 
-    addr = (lbus  << PCI_BUS_SHIFT) | 
+    return (lbus  << PCI_BUS_SHIFT) | 
            (lslot << PCI_SLOT_SHIFT) | 
            (lfun  << PCI_FUN_SHIFT) |
            PCI_REG_MASK(off) | 
            PCI_ENABLE_BIT;
+}
+
 
-    outl(addr, PCI_CFG_ADDR_PORT);
+uint16_t 
+pci_cfg_readw (uint8_t bus, 
+               uint8_t slot,
+               uint8_t fun,
+               uint8_t off)
+{
+    uint32_t ret;
+    uint8_t flags;
+
+#ifdef NAUT_CONFIG_PCI_ECAM
+    volatile uint8_t * p = pci_ecam_addr(bus, slot, fun, off & 0xfe);
+    if (p) {
+        return *(volatile uint16_t *)p;
+    }
+#endif
+
+    flags = spin_lock_irq_save(&pci_cfg_lock);
+    outl(pci_cfg_addr(bus, slot, fun, off), PCI_CFG_ADDR_PORT);
     ret = inl(PCI_CFG_DATA_PORT);
+    spin_unlock_irq_restore(&pci_cfg_lock, flags);
+
     return (ret >> ((off & 0x2) * 8)) & 0xffff;
 }
 
@@ -64,19 +120,22 @@ pci_cfg_readl (uint8_t bus,
                uint8_t fun,
                uint8_t off)
 {
-    uint32_t addr;
-    uint32_t lbus  = (uint32_t)bus;
-    uint32_t lslot = (uint32_t)slot;
-    uint32_t lfun  = (uint32_t)fun;
+    uint32_t ret;
+    uint8_t flags;
 
-    addr = (lbus  << PCI_BUS_SHIFT) | 
-           (lslot << PCI_SLOT_SHIFT) | 
-           (lfun  << PCI_FUN_SHIFT) |
-           PCI_REG_MASK(off) | 
-           PCI_ENABLE_BIT;
+#ifdef NAUT_CONFIG_PCI_ECAM
+    volatile uint8_t * p = pci_ecam_addr(bus, slot, fun, off & 0xfc);
+    if (p) {
+        return *(volatile uint32_t *)p;
+    }
+#endif
+
+    flags = spin_lock_irq_save(&pci_cfg_lock);
+    outl(pci_cfg_addr(bus, slot, fun, off), PCI_CFG_ADDR_PORT);
+    ret = inl(PCI_CFG_DATA_PORT);
+    spin_unlock_irq_restore(&pci_cfg_lock, flags);
 
-    outl(addr, PCI_CFG_ADDR_PORT);
-    return inl(PCI_CFG_DATA_PORT);
+    return ret;
 }
 
 void
@@ -86,20 +145,20 @@ pci_cfg_writew (uint8_t bus,
 		uint8_t off,
 		uint16_t val)
 {
-    uint32_t addr;
-    uint32_t lbus  = (uint32_t)bus;
-    uint32_t lslot = (uint32_t)slot;
-    uint32_t lfun  = (uint32_t)fun;
-    uint32_t ret;
+    uint8_t flags;
 
-    addr = (lbus  << PCI_BUS_SHIFT) | 
-           (lslot << PCI_SLOT_SHIFT) | 
-           (lfun  << PCI_FUN_SHIFT) |
-           PCI_REG_MASK(off) | 
-           PCI_ENABLE_BIT;
+#ifdef NAUT_CONFIG_PCI_ECAM
+    volatile uint8_t * p = pci_ecam_addr(bus, slot, fun, off & 0xfe);
+    if (p) {
+        *(volatile uint16_t *)p = val;
+        return;
+    }
+#endif
 
-    outl(addr, PCI_CFG_ADDR_PORT);
-    outw(val,PCI_CFG_DATA_PORT);
+    flags = spin_lock_irq_save(&pci_cfg_lock);
+    outl(pci_cfg_addr(bus, slot, fun, off), PCI_CFG_ADDR_PORT);
+    outw(val,PCI_CFG_DATA_PORT + (off & 0x2));
+    spin_unlock_irq_restore(&pci_cfg_lock, flags);
 }
 
 
@@ -110,19 +169,55 @@ pci_cfg_writel (uint8_t bus,
 		uint8_t off,
 		uint32_t val)
 {
-    uint32_t addr;
-    uint32_t lbus  = (uint32_t)bus;
-    uint32_t lslot = (uint32_t)slot;
-    uint32_t lfun  = (uint32_t)fun;
+    uint8_t flags;
 
-    addr = (lbus  << PCI_BUS_SHIFT) | 
-           (lslot << PCI_SLOT_SHIFT) | 
-           (lfun  << PCI_FUN_SHIFT) |
-           PCI_REG_MASK(off) | 
-           PCI_ENABLE_BIT;
+#ifdef NAUT_CONFIG_PCI_ECAM
+    volatile uint8_t * p = pci_ecam_addr(bus, slot, fun, off & 0xfc);
+    if (p) {
+        *(volatile uint32_t *)p = val;
+        return;
+    }
+#endif
 
-    outl(addr, PCI_CFG_ADDR_PORT);
+    flags = spin_lock_irq_save(&pci_cfg_lock);
+    outl(pci_cfg_addr(bus, slot, fun, off), PCI_CFG_ADDR_PORT);
     outl(val, PCI_CFG_DATA_PORT);
+    spin_unlock_irq_restore(&pci_cfg_lock, flags);
+}
+
+
+uint16_t
+pci_dev_cfg_readw (struct pci_dev * dev, uint8_t off)
+{
+    return pci_cfg_readw(dev->bus->num, dev->num, 0, off);
+}
+
+
+uint32_t
+pci_dev_cfg_readl (struct pci_dev * dev, uint8_t off)
+{
+    return pci_cfg_readl(dev->bus->num, dev->num, 0, off);
+}
+
+
+/* writes through the device keep its shadowed header in step */
+void
+pci_dev_cfg_writew (struct pci_dev * dev, uint8_t off, uint16_t val)
+{
+    pci_cfg_writew(dev->bus->num, dev->num, 0, off, val);
+    if (off < PCI_CFG_HDR_SIZE) {
+        ((uint16_t*)&dev->cfg)[off / 2] = val;
+    }
+}
+
+
+void
+pci_dev_cfg_writel (struct pci_dev * dev, uint8_t off, uint32_t val)
+{
+    pci_cfg_writel(dev->bus->num, dev->num, 0, off, val);
+    if (off < PCI_CFG_HDR_SIZE) {
+        ((uint32_t*)&dev->cfg)[off / 4] = val;
+    }
 }
 
 
@@ -193,13 +288,82 @@ static void
 pci_copy_cfg_space(struct pci_dev *dev, struct pci_bus *bus)
 {
   uint32_t i;
-  // 4 bytes at a time
-  for (i=0;i<sizeof(dev->cfg);i+=4) {
+  // 4 bytes at a time, the device-specific rest is read live when needed
+  for (i=0;i<PCI_CFG_HDR_SIZE;i+=4) {
     ((uint32_t*)(&dev->cfg))[i/4] = pci_cfg_readl(bus->num,dev->num,0,i);
   }
 }
 
 
+/*
+ * size every BAR once, with decode off so the all-ones probe never
+ * claims addresses, and keep the results with the device
+ */
+static void
+pci_size_bars (struct pci_dev * dev)
+{
+    uint16_t cmd = dev->cfg.cmd;
+    int host = dev->cfg.class_code == PCI_CLASS_BRIDGE && dev->cfg.subclass == 0;
+    int nbars;
+    int i;
+
+    switch (dev->cfg.hdr_type & 0x7f) {
+        case 0:  nbars = 6; break;
+        case 1:  nbars = 2; break;
+        default: return;
+    }
+
+    /* host bridges may decode memory itself through their command bits */
+    if (!host) {
+        pci_dev_cfg_writew(dev, 0x4, cmd & ~(PCI_CMD_IO_EN | PCI_CMD_MEM_EN));
+    }
+
+    for (i = 0; i < nbars; i++) {
+        uint8_t  off = 0x10 + i * 4;
+        uint32_t bar = pci_dev_cfg_readl(dev, off);
+        uint64_t mask;
+        struct pci_bar * b = &dev->bar[i];
+
+        pci_cfg_writel(dev->bus->num, dev->num, 0, off, 0xffffffff);
+        mask = pci_cfg_readl(dev->bus->num, dev->num, 0, off);
+        pci_cfg_writel(dev->bus->num, dev->num, 0, off, bar);
+
+        if (bar & 0x1) {
+            b->io   = 1;
+            b->addr = bar & ~0x3UL;
+            mask   &= ~0x3UL;
+        } else {
+            b->prefetch = (bar >> 3) & 0x1;
+            b->addr     = bar & ~0xfUL;
+            mask       &= ~0xfUL;
+
+            if (((bar >> 1) & 0x3) == 0x2 && i + 1 < nbars) {
+                uint32_t hi = pci_dev_cfg_readl(dev, off + 4);
+
+                pci_cfg_writel(dev->bus->num, dev->num, 0, off + 4, 0xffffffff);
+                mask |= (uint64_t)pci_cfg_readl(dev->bus->num, dev->num, 0, off + 4) << 32;
+                pci_cfg_writel(dev->bus->num, dev->num, 0, off + 4, hi);
+
+                b->is64  = 1;
+                b->addr |= (uint64_t)hi << 32;
+            }
+        }
+
+        /* the lowest writable address bit is the size, none means no BAR */
+        b->size = mask & ~(mask - 1);
+
+        if (b->is64) {
+            /* the upper half is not a BAR of its own */
+            i++;
+        }
+    }
+
+    if (!host) {
+        pci_dev_cfg_writew(dev, 0x4, cmd);
+    }
+}
+
+
 static struct pci_dev*
 pci_dev_create (uint32_t num, struct pci_bus * bus)
 {
@@ -217,10 +381,381 @@ pci_dev_create (uint32_t num, struct pci_bus * bus)
 
     pci_add_dev_to_bus(dev, bus);
 
+    pci_size_bars(dev);
+
+    dev->msi_cap  = pci_find_cap(dev, PCI_CAP_ID_MSI);
+    dev->msix_cap = pci_find_cap(dev, PCI_CAP_ID_MSIX);
+    if (dev->msix_cap) {
+        dev->msix_num = PCI_MSIX_CTRL_SIZE(pci_dev_cfg_readw(dev, dev->msix_cap + PCI_MSIX_CTRL));
+    }
+
+    DEBUG_PRINT("PCI: device %u on bus %u: MSI cap 0x%x, MSI-X cap 0x%x (%u entries)\n",
+                dev->num, bus->num, dev->msi_cap, dev->msix_cap, dev->msix_num);
+
     return dev;
 }
 
 
+uint8_t
+pci_find_cap (struct pci_dev * dev, uint8_t cap_id)
+{
+    uint8_t ptr;
+    int i;
+
+    if (!(pci_dev_cfg_readw(dev, 0x6) & PCI_STATUS_CAP_LIST)) {
+        return 0;
+    }
+
+    /* cardbus bridges keep the pointer elsewhere, we do not drive them */
+    if ((dev->cfg.hdr_type & 0x7f) > 1) {
+        return 0;
+    }
+
+    ptr = pci_dev_cfg_readl(dev, PCI_CAP_PTR_OFF) & 0xfc;
+
+    /* 48 capabilities fill the 192 bytes after the header, beyond that it is a loop */
+    for (i = 0; ptr && i < 48; i++) {
+        uint16_t hdr = pci_dev_cfg_readw(dev, ptr);
+
+        if ((hdr & 0xff) == cap_id) {
+            return ptr;
+        }
+
+        ptr = (hdr >> 8) & 0xfc;
+    }
+
+    return 0;
+}
+
+
+static int
+pci_msi_apic_id (int cpu, uint32_t * apic_id)
+{
+    struct sys_info * sys = &(nk_get_nautilus_info()->sys);
+
+    if (cpu < 0 || cpu >= sys->num_cpus) {
+        ERROR_PRINT("Cannot target MSI at invalid CPU %d\n", cpu);
+        return -1;
+    }
+
+    *apic_id = sys->cpus[cpu]->lapic_id;
+
+    /* the destination field is 8 bits without interrupt remapping */
+    if (*apic_id > 0xff) {
+        ERROR_PRINT("Cannot target MSI at CPU %d (APIC ID 0x%x)\n", cpu, *apic_id);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void
+pci_msi_cmd (struct pci_dev * dev, int on)
+{
+    uint16_t cmd = pci_dev_cfg_readw(dev, 0x4);
+
+    if (on) {
+        cmd |= PCI_CMD_BUS_MASTER | PCI_CMD_INTX_DISABLE;
+    } else {
+        cmd &= ~PCI_CMD_INTX_DISABLE;
+    }
+
+    pci_dev_cfg_writew(dev, 0x4, cmd);
+}
+
+
+/*
+ * pci_msi_enable
+ *
+ * returns the number of vectors granted, or -1 on error
+ *
+ */
+int
+pci_msi_enable (struct pci_dev * dev, uint16_t n, int cpu, uint8_t * first)
+{
+    uint8_t  cap = dev->msi_cap;
+    uint16_t ctrl;
+    uint16_t max;
+    uint32_t apic_id;
+    uint8_t  vec;
+    uint8_t  log2n;
+
+    if (!cap) {
+        ERROR_PRINT("Device %u on bus %u has no MSI capability\n", dev->num, dev->bus->num);
+        return -1;
+    }
+
+    if (dev->msi_on || dev->msix_on) {
+        ERROR_PRINT("Device %u on bus %u already has message-signaled interrupts on\n", 
+                    dev->num, dev->bus->num);
+        return -1;
+    }
+
+    if (!n || (n & (n - 1))) {
+        ERROR_PRINT("MSI vector count %u is not a power of two\n", n);
+        return -1;
+    }
+
+    if (pci_msi_apic_id(cpu, &apic_id)) {
+        return -1;
+    }
+
+    ctrl = pci_dev_cfg_readw(dev, cap + PCI_MSI_CTRL);
+    max  = 1 << PCI_MSI_CTRL_MMC(ctrl);
+
+    if (n > max) {
+        n = max;
+    }
+
+    if (nk_int_vec_reserve(n, 1, &vec)) {
+        return -1;
+    }
+
+    for (log2n = 0; (1 << log2n) < n; log2n++) {
+    }
+
+    pci_dev_cfg_writel(dev, cap + PCI_MSI_ADDR_LO, PCI_MSI_ADDR_BASE | PCI_MSI_ADDR_DEST(apic_id));
+
+    if (ctrl & PCI_MSI_CTRL_64BIT) {
+        pci_dev_cfg_writel(dev, cap + PCI_MSI_ADDR_HI, 0);
+        pci_dev_cfg_writew(dev, cap + PCI_MSI_DATA_64, vec);
+        if (ctrl & PCI_MSI_CTRL_MASKABLE) {
+            pci_dev_cfg_writel(dev, cap + PCI_MSI_MASK_64, 0);
+        }
+    } else {
+        pci_dev_cfg_writew(dev, cap + PCI_MSI_DATA_32, vec);
+        if (ctrl & PCI_MSI_CTRL_MASKABLE) {
+            pci_dev_cfg_writel(dev, cap + PCI_MSI_MASK_32, 0);
+        }
+    }
+
+    ctrl &= ~PCI_MSI_CTRL_MME_MASK;
+    ctrl |= (log2n << PCI_MSI_CTRL_MME_SHIFT) | PCI_MSI_CTRL_EN;
+    pci_dev_cfg_writew(dev, cap + PCI_MSI_CTRL, ctrl);
+
+    pci_msi_cmd(dev, 1);
+
+    dev->msi_on  = 1;
+    dev->msi_vec = vec;
+    dev->msi_num = n;
+    *first = vec;
+
+    DEBUG_PRINT("PCI: device %u on bus %u: MSI vectors 0x%x-0x%x to CPU %d\n",
+                dev->num, dev->bus->num, vec, vec + n - 1, cpu);
+
+    return n;
+}
+
+
+int
+pci_msi_disable (struct pci_dev * dev)
+{
+    uint16_t ctrl;
+
+    if (!dev->msi_on) {
+        return 0;
+    }
+
+    ctrl = pci_dev_cfg_readw(dev, dev->msi_cap + PCI_MSI_CTRL);
+    pci_dev_cfg_writew(dev, dev->msi_cap + PCI_MSI_CTRL, ctrl & ~PCI_MSI_CTRL_EN);
+
+    pci_msi_cmd(dev, 0);
+
+    nk_int_vec_release(dev->msi_vec, dev->msi_num);
+
+    dev->msi_on  = 0;
+    dev->msi_num = 0;
+
+    return 0;
+}
+
+
+int
+pci_msix_count (struct pci_dev * dev)
+{
+    return dev->msix_cap ? dev->msix_num : 0;
+}
+
+
+static inline volatile uint32_t *
+msix_entry (struct pci_dev * dev, uint16_t entry, uint8_t reg)
+{
+    return (volatile uint32_t *)(dev->msix_table + entry * PCI_MSIX_ENTRY_SIZE + reg);
+}
+
+
+/*
+ * pci_msix_enable
+ *
+ * find and map the table, then turn MSI-X on with every entry masked
+ *
+ * returns -1 on error, 0 on success
+ *
+ */
+int
+pci_msix_enable (struct pci_dev * dev)
+{
+    uint8_t  cap = dev->msix_cap;
+    uint16_t ctrl;
+    uint32_t tbl;
+    uint64_t pa;
+    uint16_t i;
+
+    if (!cap) {
+        ERROR_PRINT("Device %u on bus %u has no MSI-X capability\n", dev->num, dev->bus->num);
+        return -1;
+    }
+
+    if (dev->msix_on) {
+        return 0;
+    }
+
+    if (dev->msi_on) {
+        ERROR_PRINT("Device %u on bus %u already has MSI on\n", dev->num, dev->bus->num);
+        return -1;
+    }
+
+    tbl = pci_dev_cfg_readl(dev, cap + PCI_MSIX_TABLE);
+
+    if (PCI_MSIX_BIR(tbl) > 5) {
+        ERROR_PRINT("MSI-X table in invalid BAR %u\n", PCI_MSIX_BIR(tbl));
+        return -1;
+    }
+
+    if (dev->bar[PCI_MSIX_BIR(tbl)].io) {
+        ERROR_PRINT("MSI-X table is in an I/O BAR\n");
+        return -1;
+    }
+
+    pa = dev->bar[PCI_MSIX_BIR(tbl)].addr;
+
+    if (!pa) {
+        ERROR_PRINT("MSI-X table BAR is not assigned\n");
+        return -1;
+    }
+
+    pa += PCI_MSIX_OFF(tbl);
+
+#ifndef NAUT_CONFIG_HVM_HRT
+    {
+        uint64_t p;
+        for (p = pa & ~(PAGE_SIZE_4KB - 1); p < pa + dev->msix_num * PCI_MSIX_ENTRY_SIZE; p += PAGE_SIZE_4KB) {
+            if (nk_map_page_nocache(p, PTE_PRESENT_BIT|PTE_WRITABLE_BIT, PS_4K)) {
+                ERROR_PRINT("Cannot map MSI-X table\n");
+                return -1;
+            }
+        }
+    }
+#endif
+
+    dev->msix_table = (volatile uint8_t *)pa_to_va(pa);
+
+    /* hold the whole function masked while the entries are made safe */
+    ctrl = pci_dev_cfg_readw(dev, cap + PCI_MSIX_CTRL);
+    pci_dev_cfg_writew(dev, cap + PCI_MSIX_CTRL, ctrl | PCI_MSIX_CTRL_EN | PCI_MSIX_CTRL_FMASK);
+
+    for (i = 0; i < dev->msix_num; i++) {
+        *msix_entry(dev, i, PCI_MSIX_ENTRY_CTRL) |= PCI_MSIX_ENTRY_MASKED;
+    }
+
+    pci_dev_cfg_writew(dev, cap + PCI_MSIX_CTRL, (ctrl | PCI_MSIX_CTRL_EN) & ~PCI_MSIX_CTRL_FMASK);
+
+    /* the device needs memory decode for the table and mastering to send */
+    pci_dev_cfg_writew(dev, 0x4, pci_dev_cfg_readw(dev, 0x4) | PCI_CMD_MEM_EN);
+    pci_msi_cmd(dev, 1);
+
+    dev->msix_on = 1;
+
+    DEBUG_PRINT("PCI: device %u on bus %u: MSI-X on, %u entries at %p\n",
+                dev->num, dev->bus->num, dev->msix_num, (void*)pa);
+
+    return 0;
+}
+
+
+/* the vectors are the caller's (nk_int_vec_reserve), we only stop using them */
+int
+pci_msix_disable (struct pci_dev * dev)
+{
+    uint16_t ctrl;
+    uint16_t i;
+
+    if (!dev->msix_on) {
+        return 0;
+    }
+
+    for (i = 0; i < dev->msix_num; i++) {
+        *msix_entry(dev, i, PCI_MSIX_ENTRY_CTRL) |= PCI_MSIX_ENTRY_MASKED;
+    }
+
+    ctrl = pci_dev_cfg_readw(dev, dev->msix_cap + PCI_MSIX_CTRL);
+    pci_dev_cfg_writew(dev, dev->msix_cap + PCI_MSIX_CTRL, ctrl & ~PCI_MSIX_CTRL_EN);
+
+    pci_msi_cmd(dev, 0);
+
+    dev->msix_on = 0;
+
+    return 0;
+}
+
+
+/*
+ * pci_msix_set_vector
+ *
+ * deliver table entry to vec on cpu; the entry is masked while it is
+ * rewritten so the device never sends half an update. This is also
+ * how an entry is moved to another CPU.
+ *
+ */
+int
+pci_msix_set_vector (struct pci_dev * dev, uint16_t entry, uint8_t vec, int cpu)
+{
+    uint32_t apic_id;
+    uint32_t vctrl;
+
+    if (!dev->msix_on || entry >= dev->msix_num) {
+        ERROR_PRINT("Invalid MSI-X entry %u\n", entry);
+        return -1;
+    }
+
+    if (pci_msi_apic_id(cpu, &apic_id)) {
+        return -1;
+    }
+
+    vctrl = *msix_entry(dev, entry, PCI_MSIX_ENTRY_CTRL);
+
+    *msix_entry(dev, entry, PCI_MSIX_ENTRY_CTRL)    = vctrl | PCI_MSIX_ENTRY_MASKED;
+    *msix_entry(dev, entry, PCI_MSIX_ENTRY_ADDR_LO) = PCI_MSI_ADDR_BASE | PCI_MSI_ADDR_DEST(apic_id);
+    *msix_entry(dev, entry, PCI_MSIX_ENTRY_ADDR_HI) = 0;
+    *msix_entry(dev, entry, PCI_MSIX_ENTRY_DATA)    = vec;
+    *msix_entry(dev, entry, PCI_MSIX_ENTRY_CTRL)    = vctrl & ~PCI_MSIX_ENTRY_MASKED;
+
+    DEBUG_PRINT("PCI: device %u on bus %u: MSI-X entry %u -> vector 0x%x on CPU %d\n",
+                dev->num, dev->bus->num, entry, vec, cpu);
+
+    return 0;
+}
+
+
+int
+pci_msix_mask (struct pci_dev * dev, uint16_t entry, int mask)
+{
+    if (!dev->msix_on || entry >= dev->msix_num) {
+        ERROR_PRINT("Invalid MSI-X entry %u\n", entry);
+        return -1;
+    }
+
+    if (mask) {
+        *msix_entry(dev, entry, PCI_MSIX_ENTRY_CTRL) |= PCI_MSIX_ENTRY_MASKED;
+    } else {
+        *msix_entry(dev, entry, PCI_MSIX_ENTRY_CTRL) &= ~PCI_MSIX_ENTRY_MASKED;
+    }
+
+    return 0;
+}
+
+
 static void
 pci_add_bus (struct pci_bus * bus, struct pci_info * pci)
 {
@@ -248,41 +783,41 @@ pci_bus_create (uint32_t num, struct pci_info * pci)
 }
                 
 
-static void pci_fun_probe(struct pci_info * pci, uint8_t bus, uint8_t dev, uint8_t fun);
+static void pci_fun_probe(struct pci_info * pci, uint8_t bus, uint8_t base_class, uint8_t sub_class, uint8_t sec_bus);
 
+/* the caller has seen a vendor ID, everything for function 0 comes from the shadow */
 static void
 pci_dev_probe (struct pci_bus * bus, uint8_t dev)
 {
     uint8_t fun;
-    uint16_t vendor_id;
-    uint8_t hdr_type;
+    struct pci_dev * pdev;
+    struct pci_cfg_space * cfg;
 
     fun = 0;
 
-    vendor_id = pci_get_vendor_id(bus->num, dev, fun);
-    if (vendor_id == 0xffff) {
-        return;
-    }
-
-    PCI_PRINT("%04d:%02d:%02d.%d %x:%x (rev %d)\n", 0, bus->num, dev, fun, vendor_id, 
-            pci_get_dev_id(bus->num, dev, fun), 
-            pci_get_rev_id(bus->num, dev, fun));
-
-    if (pci_dev_create(dev, bus) == NULL) {
+    pdev = pci_dev_create(dev, bus);
+    if (pdev == NULL) {
         ERROR_PRINT("Could not create PCI device\n");
         return;
     }
 
-    pci_fun_probe(bus->pci, bus->num, dev, fun);
+    cfg = &pdev->cfg;
+
+    PCI_PRINT("%04d:%02d:%02d.%d %x:%x (rev %d)\n", 0, bus->num, dev, fun, cfg->vendor_id, 
+            cfg->device_id, 
+            cfg->rev_id);
 
-    hdr_type = pci_get_hdr_type(bus->num, dev, fun);
+    pci_fun_probe(bus->pci, bus->num, cfg->class_code, cfg->subclass,
+                  (cfg->hdr_type & 0x7f) == 1 ? cfg->pci_to_pci_bridge_cfg.secondary_bus_num : 0);
 
     /* multi-function device */
-    if ((hdr_type & 0x80) != 0) {
+    if ((cfg->hdr_type & 0x80) != 0) {
       PCI_PRINT("Multifunction Device\n");
         for (fun = 1; fun < PCI_MAX_FUN; fun++) {
             if (pci_get_vendor_id(bus->num, dev, fun) != 0xffff) {
-                pci_fun_probe(bus->pci, bus->num, dev, fun);
+                uint32_t class = pci_cfg_readl(bus->num, dev, fun, 0x8);
+                pci_fun_probe(bus->pci, bus->num, (class >> 24) & 0xff, (class >> 16) & 0xff,
+                              pci_get_sec_bus(bus->num, dev, fun));
             }
         }
     }
@@ -293,44 +828,33 @@ static void
 pci_bus_probe (struct pci_info * pci, uint8_t bus)
 {
     uint8_t dev;
-    uint8_t dev_found = 0;
     struct pci_bus * bus_ptr = NULL;
 
-
+    /* one vendor ID read per slot, the bus exists once something answers */
     for (dev = 0; dev < PCI_MAX_DEV; dev++) {
-        if (pci_get_vendor_id(bus, dev, 0) != 0xffff) {
-            dev_found = 1;
-            break;
+        if (pci_get_vendor_id(bus, dev, 0) == 0xffff) {
+            continue;
         }
-    }
 
-    if (dev_found) {
-        bus_ptr = pci_bus_create(bus, pci);
         if (!bus_ptr) {
-            ERROR_PRINT("Could not create PCI bus\n");
-            return;
+            bus_ptr = pci_bus_create(bus, pci);
+            if (!bus_ptr) {
+                ERROR_PRINT("Could not create PCI bus\n");
+                return;
+            }
         }
 
-        for (dev = 0; dev < PCI_MAX_DEV; dev++) {
-            pci_dev_probe(bus_ptr, dev);
-        }
+        pci_dev_probe(bus_ptr, dev);
     }
 }
 
 
 
 static void
-pci_fun_probe (struct pci_info * pci, uint8_t bus, uint8_t dev, uint8_t fun)
+pci_fun_probe (struct pci_info * pci, uint8_t bus, uint8_t base_class, uint8_t sub_class, uint8_t sec_bus)
 {
-    uint8_t base_class; 
-    uint8_t sub_class; 
-    uint8_t sec_bus;
-
-    base_class = pci_get_base_class(bus, dev, fun);
-    sub_class = pci_get_sub_class(bus, dev, fun);
-
-    if (base_class == PCI_CLASS_BRIDGE && sub_class == PCI_SUBCLASS_BRIDGE_PCI) {
-        sec_bus = pci_get_sec_bus(bus, dev, fun);
+    /* a bridge pointing back at its own bus would have us recurse forever */
+    if (base_class == PCI_CLASS_BRIDGE && sub_class == PCI_SUBCLASS_BRIDGE_PCI && sec_bus > bus) {
         pci_bus_probe(pci, sec_bus);
     }
 }
@@ -352,6 +876,95 @@ pci_bus_scan (struct pci_info * pci)
 }
 
 
+#ifdef NAUT_CONFIG_PCI_ECAM
+static int
+pci_parse_mcfg (struct acpi_table_header * hdr, void * arg)
+{
+    struct acpi_mcfg_allocation * alloc = (struct acpi_mcfg_allocation *)((struct acpi_table_mcfg *)hdr + 1);
+    int n = (hdr->length - sizeof(struct acpi_table_mcfg)) / sizeof(struct acpi_mcfg_allocation);
+    int i;
+
+    for (i = 0; i < n; i++, alloc++) {
+        uint64_t len = ((uint64_t)(alloc->end_bus_number - alloc->start_bus_number) + 1) << 20;
+        /* the table's address is where bus 0 would be */
+        uint64_t base = alloc->address + ((uint64_t)alloc->start_bus_number << 20);
+
+        DEBUG_PRINT("PCI: MCFG segment %u buses %u-%u at %p\n", alloc->pci_segment,
+                    alloc->start_bus_number, alloc->end_bus_number, (void*)base);
+
+        /* we only enumerate segment 0 */
+        if (alloc->pci_segment != 0 || alloc->end_bus_number < alloc->start_bus_number) {
+            continue;
+        }
+
+        if (pci_num_ecam == PCI_ECAM_MAX) {
+            ERROR_PRINT("Too many ECAM windows, the rest use port I/O\n");
+            break;
+        }
+
+#ifndef NAUT_CONFIG_HVM_HRT
+        {
+            uint64_t p;
+            for (p = base & ~(PAGE_SIZE_2MB - 1); p < base + len; p += PAGE_SIZE_2MB) {
+                if (nk_map_page_nocache(p, PTE_PRESENT_BIT|PTE_WRITABLE_BIT, PS_2M)) {
+                    ERROR_PRINT("Cannot map ECAM window at %p\n", (void*)base);
+                    break;
+                }
+            }
+            if (p < base + len) {
+                continue;
+            }
+        }
+#endif
+
+        pci_ecam[pci_num_ecam].base      = pa_to_va(base);
+        pci_ecam[pci_num_ecam].start_bus = alloc->start_bus_number;
+        pci_ecam[pci_num_ecam].end_bus   = alloc->end_bus_number;
+        pci_num_ecam++;
+    }
+
+    return 0;
+}
+
+
+/*
+ * use ECAM where the firmware describes it, and only if it agrees
+ * with port I/O about the host bridge
+ */
+static void
+pci_ecam_init (void)
+{
+    uint32_t legacy;
+    uint32_t ecam;
+    int n;
+
+    if (acpi_table_parse(ACPI_SIG_MCFG, pci_parse_mcfg, NULL)) {
+        PCI_PRINT("No MCFG table, config space through port I/O\n");
+        return;
+    }
+
+    if (!pci_num_ecam) {
+        return;
+    }
+
+    n = pci_num_ecam;
+
+    ecam = pci_cfg_readl(0, 0, 0, 0);
+    pci_num_ecam = 0;
+    legacy = pci_cfg_readl(0, 0, 0, 0);
+
+    if (ecam != legacy) {
+        ERROR_PRINT("ECAM reads 0x%x for 00:00.0, port I/O 0x%x; not using ECAM\n", ecam, legacy);
+        return;
+    }
+
+    pci_num_ecam = n;
+
+    PCI_PRINT("Config space memory-mapped (ECAM), %d window%s\n", n, n > 1 ? "s" : "");
+}
+#endif
+
+
 int 
 pci_init (struct naut_info * naut)
 {
@@ -366,6 +979,12 @@ pci_init (struct naut_info * naut)
 
     INIT_LIST_HEAD(&(pci->bus_list));
 
+    spinlock_init(&pci_cfg_lock);
+
+#ifdef NAUT_CONFIG_PCI_ECAM
+    pci_ecam_init();
+#endif
+
     PCI_PRINT("Probing PCI bus...\n");
     pci_bus_scan(pci);
 
@@ -30,6 +30,14 @@
 #include <nautilus/shutdown.h>
 #include <dev/serial.h>
 
+#ifdef NAUT_CONFIG_SERIAL_ASYNC
+#include <nautilus/percpu.h>
+#include <nautilus/mm.h>
+#endif
+#ifdef NAUT_CONFIG_VIRTIO_CONSOLE
+#include <dev/virtio_console.h>
+#endif
+
 
 extern int vprintk(const char * fmt, va_list args);
 
@@ -39,19 +47,279 @@ uint16_t serial_io_addr = 0;
 uint_t serial_print_level;
 static uint8_t com_irq;
 
+#define SERIAL_IER_RX   0x01
+#define SERIAL_IER_THRE 0x02
 
-static int 
-serial_irq_handler (excp_entry_t * excp,
-                    excp_vec_t vec)
+#define SERIAL_IIR_NONE    0x01
+#define SERIAL_IIR_ID      0x0e
+#define SERIAL_IIR_MSR     0x00
+#define SERIAL_IIR_THRE    0x02
+#define SERIAL_IIR_RX      0x04
+#define SERIAL_IIR_LSR     0x06
+#define SERIAL_IIR_TIMEOUT 0x0c
+
+#define SERIAL_FCR_FIFO   0xc7 /* enable, clear both, 14-byte receive trigger */
+#define SERIAL_IIR_FIFO   0xc0
+#define SERIAL_FIFO_DEPTH 16
+
+#define SERIAL_LSR_THRE 0x20   /* holding register (or FIFO) empty */
+#define SERIAL_LSR_TEMT 0x40   /* and the shift register too */
+
+/* conditions taken care of in one interrupt, in case the line never goes quiet */
+#define SERIAL_IRQ_LOOPS 16
+
+/* configurations from before the baud rate was an option */
+#ifndef NAUT_CONFIG_SERIAL_BAUD
+#define NAUT_CONFIG_SERIAL_BAUD 115200
+#endif
+#ifndef NAUT_CONFIG_SERIAL_UART_CLOCK
+#define NAUT_CONFIG_SERIAL_UART_CLOCK 1843200
+#endif
+
+#define SERIAL_DIVISOR (NAUT_CONFIG_SERIAL_UART_CLOCK / (16 * NAUT_CONFIG_SERIAL_BAUD))
+
+#if SERIAL_DIVISOR < 1 || SERIAL_DIVISOR > 0xffff
+#error SERIAL_BAUD cannot be reached from SERIAL_UART_CLOCK
+#endif
+
+/* bytes the transmitter takes at once when empty */
+static uint8_t serial_tx_depth = 1;
+
+
+/* spin until the transmitter is empty, then send */
+static inline void
+serial_tx_poll (uchar_t c)
 {
-  char rcv_byte;
-  char irq_id;
+    while ((inb(serial_io_addr + 5) & SERIAL_LSR_TEMT) == 0);
+    outb(c, serial_io_addr + 0);
+}
+
+
+/* 
+ * Send up to len bytes of buf (stopping at a NUL), a FIFO's worth each
+ * time it drains, with newlines turned into CR-LF.
+ */
+static void
+serial_tx_poll_buf (const char * buf, size_t len)
+{
+    uint8_t room;
+    int cr = 0;
+
+    while (len && *buf) {
+        while ((inb(serial_io_addr + 5) & SERIAL_LSR_THRE) == 0);
+
+        for (room = serial_tx_depth; room && len && *buf; room--) {
+            if (*buf == '\n' && !cr) {
+                outb('\r', serial_io_addr + 0);
+                cr = 1;
+                continue;
+            }
+            outb(*buf, serial_io_addr + 0);
+            cr = 0;
+            buf++;
+            len--;
+        }
+    }
+}
+
+
+#ifdef NAUT_CONFIG_SERIAL_ASYNC
+/*
+ * Asynchronous output. Each CPU appends to its own ring with
+ * interrupts off, so it is the only producer and needs no lock. The
+ * transmit-empty interrupt is the only consumer: it sends a byte each
+ * time the UART is ready, finishing a line from one CPU before going
+ * on to the next, and turns itself off once every ring is empty.
+ * Whoever finds it off and wins tx_idle turns it back on.
+ *
+ * A full ring drops what does not fit and the drop is reported in the
+ * output. panic() goes back to sending synchronously.
+ */
+#if (NAUT_CONFIG_SERIAL_ASYNC_RING & (NAUT_CONFIG_SERIAL_ASYNC_RING - 1))
+#error SERIAL_ASYNC_RING must be a power of two
+#endif
+
+#define SERIAL_RING_MASK (NAUT_CONFIG_SERIAL_ASYNC_RING - 1)
+
+struct serial_ring {
+    volatile uint32_t head;     /* next byte to send, written by the consumer */
+    volatile uint32_t tail;     /* next free byte, written by the owning CPU */
+    volatile uint32_t dropped;
+    char buf[NAUT_CONFIG_SERIAL_ASYNC_RING];
+} __attribute__((aligned(64)));
+
+static struct serial_ring * serial_rings;
+static int serial_nrings;
+static volatile uint8_t serial_async = 0;
+static volatile uint32_t tx_idle = 1;
+static int tx_ring = 0;
+static char tx_note[48];
+static int tx_note_len = 0;
+static int tx_note_pos = 0;
+
+
+static inline void
+serial_ring_put (struct serial_ring * r, char c)
+{
+    if (r->tail - r->head >= NAUT_CONFIG_SERIAL_ASYNC_RING) {
+        __sync_fetch_and_add(&r->dropped, 1);
+        return;
+    }
+
+    r->buf[r->tail & SERIAL_RING_MASK] = c;
+    asm volatile ("" ::: "memory");
+    r->tail++;
+}
 
-  irq_id = inb(serial_io_addr + 2);
 
-  if ((irq_id & com_irq) != 0) {
-    rcv_byte = inb(serial_io_addr + 0);
+static void
+serial_async_write (const char * buf, size_t len)
+{
+    uint8_t flags = irq_disable_save();
+    struct serial_ring * r = &serial_rings[my_cpu_id()];
+
+    for (; len && *buf; buf++, len--) {
+        if (*buf == '\n') {
+            serial_ring_put(r, '\r');
+        }
+        serial_ring_put(r, *buf);
+    }
+
+    irq_enable_restore(flags);
+
+    if (tx_idle && __sync_bool_compare_and_swap(&tx_idle, 1, 0)) {
+        outb(SERIAL_IER_RX | SERIAL_IER_THRE, serial_io_addr + 1);
+    }
+}
+
+
+/* the next byte to send, or -1 if there is none */
+static int
+serial_tx_next (void)
+{
+    int i;
+
+    if (tx_note_pos < tx_note_len) {
+        return (uchar_t)tx_note[tx_note_pos++];
+    }
+
+    for (i = 0; i < serial_nrings; i++) {
+        struct serial_ring * r = &serial_rings[tx_ring];
+        uint32_t lost;
+        char c;
+
+        if (r->head != r->tail) {
+            c = r->buf[r->head & SERIAL_RING_MASK];
+            asm volatile ("" ::: "memory");
+            r->head++;
+            if (c == '\n') {
+                if (r->dropped && (lost = __sync_lock_test_and_set(&r->dropped, 0))) {
+                    tx_note_len = snprintf(tx_note, sizeof(tx_note),
+                                           "[serial: cpu %d dropped %u bytes]\r\n", tx_ring, lost);
+                    tx_note_pos = 0;
+                }
+                tx_ring = (tx_ring + 1) % serial_nrings;
+            }
+            return (uchar_t)c;
+        }
+
+        tx_ring = (tx_ring + 1) % serial_nrings;
+    }
+
+    return -1;
+}
+
+
+static int
+serial_rings_empty (void)
+{
+    int i;
+
+    for (i = 0; i < serial_nrings; i++) {
+        if (serial_rings[i].head != serial_rings[i].tail) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/* interrupt context, the transmitter (and its FIFO) is empty */
+static void
+serial_tx_irq (void)
+{
+    uint8_t room;
+    int c = serial_tx_next();
+
+    if (c >= 0) {
+        outb(c, serial_io_addr + 0);
+        for (room = serial_tx_depth - 1; room && (c = serial_tx_next()) >= 0; room--) {
+            outb(c, serial_io_addr + 0);
+        }
+        return;
+    }
+
+    outb(SERIAL_IER_RX, serial_io_addr + 1);
+    asm volatile ("" ::: "memory");
+    tx_idle = 1;
 
+    /* a byte may have come in after we looked but before it could see tx_idle */
+    if (!serial_rings_empty() && __sync_bool_compare_and_swap(&tx_idle, 1, 0)) {
+        outb(SERIAL_IER_RX | SERIAL_IER_THRE, serial_io_addr + 1);
+    }
+}
+
+
+/* threads and interrupts must be up, as the interrupt does the sending */
+void
+serial_async_start (void)
+{
+    int n = nk_get_nautilus_info()->sys.num_cpus;
+
+    if (!serial_device_ready) {
+        return;
+    }
+
+    serial_rings = malloc(n * sizeof(struct serial_ring));
+    if (!serial_rings) {
+        serial_print("Could not allocate serial rings, output stays synchronous\n");
+        return;
+    }
+    memset(serial_rings, 0, n * sizeof(struct serial_ring));
+    serial_nrings = n;
+
+    asm volatile ("" ::: "memory");
+    serial_async = 1;
+}
+
+
+/*
+ * Nothing else will run again, so send what is queued by polling,
+ * without the lock its holder may never drop, and stay synchronous.
+ */
+void
+serial_async_panic (void)
+{
+    int c;
+
+    if (!serial_async) {
+        return;
+    }
+
+    serial_async = 0;
+    outb(SERIAL_IER_RX, serial_io_addr + 1);
+
+    while ((c = serial_tx_next()) >= 0) {
+        serial_tx_poll(c);
+    }
+}
+#endif
+
+
+static void
+serial_handle_byte (char rcv_byte)
+{
     switch (rcv_byte) {
         case 'k' :
             serial_print("Rebooting Machine\n");
@@ -67,13 +335,123 @@ serial_irq_handler (excp_entry_t * excp,
         default:
             break;
     }
-      
+}
+
+
+#ifdef NAUT_CONFIG_THREADED_IRQS
+/* 
+ * bytes read by the top half, waiting for the bottom half. If it 
+ * falls more than a queue behind, the newest bytes are dropped.
+ */
+#define SERIAL_RX_QUEUE 64
+static char serial_rx_queue[SERIAL_RX_QUEUE];
+static volatile uint32_t serial_rx_head = 0;
+static volatile uint32_t serial_rx_tail = 0;
+
+static void
+serial_rx_queue_byte (char rcv_byte)
+{
+  if (serial_rx_tail - serial_rx_head < SERIAL_RX_QUEUE) {
+    serial_rx_queue[serial_rx_tail % SERIAL_RX_QUEUE] = rcv_byte;
+    asm volatile ("" ::: "memory");
+    serial_rx_tail++;
+  }
+}
+#define SERIAL_RX(b) serial_rx_queue_byte(b)
+#else
+#define SERIAL_RX(b) serial_handle_byte(b)
+#endif
+
+
+/* 
+ * Take care of everything the UART has pending. Reading the byte is
+ * what clears the receive interrupt, and the line stays raised until
+ * no condition is left.
+ */
+static void
+serial_irq_service (void)
+{
+  int n;
+  char irq_id;
+
+  for (n = 0; n < SERIAL_IRQ_LOOPS; n++) {
+    irq_id = inb(serial_io_addr + 2);
+
+    if (irq_id & SERIAL_IIR_NONE) {
+      break;
+    }
+
+    switch (irq_id & SERIAL_IIR_ID) {
+      case SERIAL_IIR_RX:
+      case SERIAL_IIR_TIMEOUT:
+        SERIAL_RX(inb(serial_io_addr + 0));
+        break;
+      case SERIAL_IIR_THRE:
+#ifdef NAUT_CONFIG_SERIAL_ASYNC
+        serial_tx_irq();
+#endif
+        break;
+      case SERIAL_IIR_LSR:
+        inb(serial_io_addr + 5);
+        break;
+      default:
+        inb(serial_io_addr + 6);
+        break;
+    }
   }
+}
+
+
+#ifdef NAUT_CONFIG_THREADED_IRQS
+static void
+serial_irq_ack (void * priv_data)
+{
+  serial_irq_service();
+}
+
+
+static void
+serial_irq_work (void * priv_data)
+{
+  char rcv_byte;
+
+  while (serial_rx_head != serial_rx_tail) {
+    rcv_byte = serial_rx_queue[serial_rx_head % SERIAL_RX_QUEUE];
+    asm volatile ("" ::: "memory");
+    serial_rx_head++;
+    serial_handle_byte(rcv_byte);
+  }
+}
+
+#else
+
+static int 
+serial_irq_handler (excp_entry_t * excp,
+                    excp_vec_t vec)
+{
+  serial_irq_service();
 
   IRQ_HANDLER_END();
 
   return 0;
 }
+#endif
+
+
+static void
+serial_register_irq (uint8_t irq)
+{
+#ifdef NAUT_CONFIG_THREADED_IRQS
+  /* input comes in bursts (pastes), so coalesce them */
+  register_threaded_irq_handler(irq, 
+                                serial_irq_ack, 
+                                serial_irq_work, 
+                                NULL,
+                                NAUT_CONFIG_THREADED_IRQS_COALESCE_NS);
+#else
+  register_irq_handler(irq, serial_irq_handler, NULL);
+#endif
+}
 
 
 void 
@@ -85,9 +463,9 @@ serial_init_addr (uint16_t io_addr)
   //  io_adr = 0x3F8;	/* 3F8=COM1, 2F8=COM2, 3E8=COM3, 2E8=COM4 */
   outb(0x80, io_addr + 3);
 
-  // 115200 /* 115200 / 12 = 9600 baud */
-  outb(1, io_addr + 0);
-  outb(0, io_addr + 1);
+  /* divisor latch, 1843200 / (16 * 115200) = 1 for 115200 baud */
+  outb(SERIAL_DIVISOR & 0xff, io_addr + 0);
+  outb(SERIAL_DIVISOR >> 8, io_addr + 1);
 
   /* 8N1 */
   outb(0x03, io_addr + 3);
@@ -96,8 +474,19 @@ serial_init_addr (uint16_t io_addr)
   //  outb(0, io_addr + 1);
   outb(0x01, io_addr + 1);
 
+#ifdef NAUT_CONFIG_SERIAL_FIFO
+  /* a 16550A reports its FIFOs in the top of the IIR, older parts do not have them */
+  outb(SERIAL_FCR_FIFO, io_addr + 2);
+  if ((inb(io_addr + 2) & SERIAL_IIR_FIFO) == SERIAL_IIR_FIFO) {
+    serial_tx_depth = SERIAL_FIFO_DEPTH;
+  } else {
+    outb(0, io_addr + 2);
+    serial_tx_depth = 1;
+  }
+#else
   /* turn off FIFO, if any */
   outb(0, io_addr + 2);
+#endif
 
   /* loopback off, interrupts (Out2) off, Out1/RTS/DTR off */
   //  outb(0, io_addr + 4);
@@ -109,6 +498,12 @@ serial_init_addr (uint16_t io_addr)
 void 
 serial_putchar (uchar_t c)
 {
+#ifdef NAUT_CONFIG_VIRTIO_CONSOLE
+    if (!virtio_console_write((const char *)&c, 1)) {
+        return;
+    }
+#endif
+
     //  static unsigned short io_adr;
     if (serial_io_addr==0) { 
         return;
@@ -118,24 +513,49 @@ serial_putchar (uchar_t c)
         return;
     }
 
+#ifdef NAUT_CONFIG_SERIAL_ASYNC
+    if (serial_async) {
+        serial_async_write((const char *)&c, 1);
+        return;
+    }
+#endif
+
     int flags = spin_lock_irq_save(&serial_lock);
 
     if (c == '\n') { 
+        serial_tx_poll('\r');
+    } 
 
-        /* wait for transmitter ready */
-        while( (inb(serial_io_addr + 5) & 0x40) == 0);
+    serial_tx_poll(c);
 
-        /* send char */
-        outb('\r', serial_io_addr + 0);
+    spin_unlock_irq_restore(&serial_lock, flags);
+}
 
-        /* wait for transmitter ready */
-    } 
 
-    while( (inb(serial_io_addr + 5) & 0x40) == 0);
+static void
+serial_write_len (const char * buf, size_t len)
+{
+    uint8_t flags;
 
-    /* send char */
-    outb(c, serial_io_addr + 0);
+#ifdef NAUT_CONFIG_VIRTIO_CONSOLE
+    if (!virtio_console_write(buf, len)) {
+        return;
+    }
+#endif
+
+    if (serial_io_addr == 0 || !serial_device_ready) {
+        return;
+    }
 
+#ifdef NAUT_CONFIG_SERIAL_ASYNC
+    if (serial_async) {
+        serial_async_write(buf, len);
+        return;
+    }
+#endif
+
+    flags = spin_lock_irq_save(&serial_lock);
+    serial_tx_poll_buf(buf, len);
     spin_unlock_irq_restore(&serial_lock, flags);
 }
 
@@ -143,8 +563,8 @@ serial_putchar (uchar_t c)
 void 
 serial_putlnn (const char * line, int len) 
 {
-  while ((*line) && len--) {
-      serial_putchar(*line);
+  if (len > 0) {
+      serial_write_len(line, len);
   }
 
   serial_putchar('\n');
@@ -154,10 +574,7 @@ serial_putlnn (const char * line, int len)
 void 
 serial_write (const char *buf) 
 {
-  while (*buf) {
-      serial_putchar(*buf);
-      ++buf;
-  }
+  serial_write_len(buf, (size_t)-1);
 }
 
 void 
@@ -296,19 +713,19 @@ serial_init (void)
 
 #if NAUT_CONFIG_SERIAL_PORT == 1 
   serial_init_addr(COM1_ADDR);
-  register_irq_handler(COM1_3_IRQ, serial_irq_handler, NULL);
+  serial_register_irq(COM1_3_IRQ);
   com_irq = COM1_3_IRQ;
 #elif NAUT_CONFIG_SERIAL_PORT == 2 
   serial_init_addr(COM2_ADDR);
-  register_irq_handler(COM2_4_IRQ, serial_irq_handler, NULL);
+  serial_register_irq(COM2_4_IRQ);
   com_irq = COM2_4_IRQ;
 #elif NAUT_CONFIG_SERIAL_PORT == 3 
   serial_init_addr(COM3_ADDR);
-  register_irq_handler(COM1_3_IRQ, serial_irq_handler, NULL);
+  serial_register_irq(COM1_3_IRQ);
   com_irq = COM1_3_IRQ;
 #elif NAUT_CONFIG_SERIAL_PORT == 4
   serial_init_addr(COM4_ADDR);
-  register_irq_handler(COM2_4_IRQ, serial_irq_handler, NULL);
+  serial_register_irq(COM2_4_IRQ);
   com_irq = COM2_4_IRQ;;
 #else
 #error Invalid serial port
@@ -25,17 +25,64 @@
 #include <nautilus/cpu.h>
 #include <nautilus/percpu.h>
 #include <nautilus/mm.h>
+#include <nautilus/atomic.h>
 
 #include <stddef.h>
 
 #include <dev/timer.h>
 
+#ifdef NAUT_CONFIG_HRTIMERS
+#include <nautilus/thread.h>
+#include <nautilus/hrtimer.h>
+#endif
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+#include <nautilus/rt_scheduler.h>
+#endif
+
 #ifndef NAUT_CONFIG_DEBUG_TIMERS
 #undef DEBUG_PRINT
 #define DEBUG_PRINT(fmt, args...) 
 #endif
 
 
+/*
+ * A callback slot's state sits in the low byte of its control word
+ * and a generation count in the rest. The generation is bumped each
+ * time the slot is freed, so a stale handle cannot cancel whoever
+ * reused the slot.
+ */
+#define TCB_FREE   0
+#define TCB_ARMED  1
+#define TCB_BUSY   2   /* being filled in, or running */
+
+#define TCB_GEN_MASK   0x7fffff
+#define TCB_WORD(g, s) ((((g) & TCB_GEN_MASK) << 8) | (s))
+#define TCB_GEN(w)     (((w) >> 8) & TCB_GEN_MASK)
+#define TCB_STATE(w)   ((w) & 0xff)
+
+struct timer_callback {
+    volatile uint32_t ctl;
+#ifdef NAUT_CONFIG_HRTIMERS
+    struct nk_hrtimer timer;
+#else
+    uint64_t deadline;   /* TSC */
+#endif
+    void (*fn)(void * arg);
+    void * arg;
+};
+
+static struct timer_callback timer_cbs[NUM_TIMER_CALLBACKS];
+
+#ifdef NAUT_CONFIG_HRTIMERS
+static nk_thread_queue_t * sleep_queue;
+#else
+static volatile uint32_t timer_cbs_armed = 0;
+#endif
+
+
+#ifndef NAUT_CONFIG_HRTIMERS
+
+
 static inline void 
 timer_init_event (struct nk_timer_event * t, uint_t delay)
 {
@@ -80,10 +127,15 @@ timer_notify_event (struct nk_timer_event * te)
 }
 
 
+#endif /* !NAUT_CONFIG_HRTIMERS */
+
+
 int
 nk_timer_handler (excp_entry_t * excp, excp_vec_t vec)
 {
-
+#ifdef NAUT_CONFIG_HRTIMERS
+    nk_hrtimer_run();
+#else
     struct sys_info  * sys = per_cpu_get(system);
     int i;
     struct nk_timer_event * te = sys->time_events;
@@ -97,11 +149,101 @@ nk_timer_handler (excp_entry_t * excp, excp_vec_t vec)
         }
     }
 
+    if (timer_cbs_armed) {
+        uint64_t now = rdtsc();
+        struct timer_callback * cb;
+        uint32_t w;
+
+        for (i = 0; i < NUM_TIMER_CALLBACKS; i++) {
+            cb = &timer_cbs[i];
+            w  = cb->ctl;
+            if (TCB_STATE(w) == TCB_ARMED && cb->deadline <= now &&
+                atomic_cmpswap(cb->ctl, w, TCB_WORD(TCB_GEN(w), TCB_BUSY)) == w) {
+                atomic_dec(timer_cbs_armed);
+                cb->fn(cb->arg);
+                cb->ctl = TCB_WORD(TCB_GEN(w) + 1, TCB_FREE);
+            }
+        }
+    }
+#endif
+
     IRQ_HANDLER_END();
     return 0;
 }
 
 
+#ifdef NAUT_CONFIG_HRTIMERS
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+/*
+ * block the calling thread for msec milliseconds. The RT scheduler
+ * does not look at wait queues, a thread it is to leave alone has to
+ * be parked with the scheduler itself.
+ */
+void 
+nk_sleep (uint_t msec) 
+{
+    uint64_t until = rdtsc() + (uint64_t)msec * per_cpu_get(cpu_khz);
+
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+    rt_thread_sleep_until(until);
+#else
+    while (rdtsc() < until) {
+        asm volatile ("pause");
+    }
+#endif
+}
+#else
+struct timer_sleeper {
+    nk_thread_t *     t;
+    volatile uint32_t done;
+};
+
+
+static void
+timer_sleep_wake (struct nk_hrtimer * t, void * arg)
+{
+    struct timer_sleeper * s = (struct timer_sleeper*)arg;
+
+    s->done = 1;
+    nk_thread_queue_wake_thread(sleep_queue, s->t);
+}
+
+
+/* block the calling thread for msec milliseconds */
+void 
+nk_sleep (uint_t msec) 
+{
+    struct timer_sleeper s = { get_cur_thread(), 0 };
+    struct nk_hrtimer t;
+
+    nk_hrtimer_init(&t, timer_sleep_wake, &s);
+
+    if (nk_hrtimer_start(&t, msec * 1000000ULL, 0) != 0) {
+        return;
+    }
+
+    nk_thread_queue_wait_word(sleep_queue, &s.done, 0);
+    nk_hrtimer_cancel(&t);
+}
+#endif
+
+
+/* the callback slots are run from an hrtimer and only then marked busy */
+static void
+timer_callback_fire (struct nk_hrtimer * t, void * arg)
+{
+    struct timer_callback * cb = (struct timer_callback*)arg;
+    uint32_t w = cb->ctl;
+
+    if (TCB_STATE(w) == TCB_ARMED &&
+        atomic_cmpswap(cb->ctl, w, TCB_WORD(TCB_GEN(w), TCB_BUSY)) == w) {
+        cb->fn(cb->arg);
+        cb->ctl = TCB_WORD(TCB_GEN(w) + 1, TCB_FREE);
+    }
+}
+
+#else
+
 static struct nk_timer_event * 
 find_avail_timer_event (void)
 {
@@ -131,11 +273,103 @@ nk_sleep (uint_t msec)
     timer_wait_event(t);
     timer_clear_event(t);
 }
+#endif /* NAUT_CONFIG_HRTIMERS */
+
+
+/*
+ * nk_timer_callback_arm
+ *
+ * run fn(arg) from the timer interrupt once ns nanoseconds have passed.
+ * With hrtimers it runs on the calling core
+ *
+ * returns a handle for nk_timer_callback_cancel(), or -1 if
+ * all callback slots are in use
+ *
+ */
+int
+nk_timer_callback_arm (uint64_t ns, void (*fn)(void * arg), void * arg)
+{
+#ifndef NAUT_CONFIG_HRTIMERS
+    uint64_t khz = per_cpu_get(system)->cpus[my_cpu_id()]->cpu_khz;
+#endif
+    struct timer_callback * cb;
+    uint32_t w;
+    int i;
+
+    for (i = 0; i < NUM_TIMER_CALLBACKS; i++) {
+        cb = &timer_cbs[i];
+        w  = cb->ctl;
+        if (TCB_STATE(w) == TCB_FREE &&
+            atomic_cmpswap(cb->ctl, w, TCB_WORD(TCB_GEN(w), TCB_BUSY)) == w) {
+            cb->fn       = fn;
+            cb->arg      = arg;
+#ifdef NAUT_CONFIG_HRTIMERS
+            nk_hrtimer_init(&cb->timer, timer_callback_fire, cb);
+            cb->ctl      = TCB_WORD(TCB_GEN(w), TCB_ARMED);
+            if (nk_hrtimer_start(&cb->timer, ns, 0) != 0) {
+                cb->ctl  = TCB_WORD(TCB_GEN(w) + 1, TCB_FREE);
+                return -1;
+            }
+#else
+            cb->deadline = rdtsc() + ns * khz / 1000000;
+            atomic_inc(timer_cbs_armed);
+            cb->ctl      = TCB_WORD(TCB_GEN(w), TCB_ARMED);
+#endif
+            return (TCB_GEN(w) << 8) | i;
+        }
+    }
+
+    ERROR_PRINT("No free timer callbacks\n");
+    return -1;
+}
+
+
+/*
+ * nk_timer_callback_cancel
+ *
+ * cancel an armed callback. If it is running we wait for it to
+ * finish, so its argument can be released once we return
+ *
+ * returns 0 if it was cancelled before it ran, 1 if it ran
+ *
+ */
+int
+nk_timer_callback_cancel (int id)
+{
+    struct timer_callback * cb = &timer_cbs[id & 0xff];
+    uint32_t gen = TCB_GEN((uint32_t)id);
+
+#ifdef NAUT_CONFIG_HRTIMERS
+    /* hold the slot busy so it cannot be reused under the hrtimer */
+    if (atomic_cmpswap(cb->ctl, TCB_WORD(gen, TCB_ARMED), TCB_WORD(gen, TCB_BUSY)) == TCB_WORD(gen, TCB_ARMED)) {
+        nk_hrtimer_cancel(&cb->timer);
+        cb->ctl = TCB_WORD(gen + 1, TCB_FREE);
+        return 0;
+    }
+#else
+    if (atomic_cmpswap(cb->ctl, TCB_WORD(gen, TCB_ARMED), TCB_WORD(gen + 1, TCB_FREE)) == TCB_WORD(gen, TCB_ARMED)) {
+        atomic_dec(timer_cbs_armed);
+        return 0;
+    }
+#endif
+
+    PAUSE_WHILE(cb->ctl == TCB_WORD(gen, TCB_BUSY));
+    return 1;
+}
 
 
 int 
 nk_timer_init (struct naut_info * naut)
 {
+#ifdef NAUT_CONFIG_HRTIMERS
+    sleep_queue = nk_thread_queue_create();
+    if (!sleep_queue) {
+        ERROR_PRINT("Could not allocate sleep queue\n");
+        return -1;
+    }
+
+    return 0;
+#else
     uint16_t hz;
 
     naut->sys.num_tevents = NUM_TIMERS;
@@ -148,5 +382,6 @@ nk_timer_init (struct naut_info * naut)
     memset(naut->sys.time_events, 0, NUM_TIMERS*sizeof(struct nk_timer_event));
 
     return 0;
+#endif
 }
 
@@ -0,0 +1,470 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/mm.h>
+#include <nautilus/percpu.h>
+#include <dev/pci.h>
+#include <dev/virtio_pci.h>
+#include <dev/virtio_blk.h>
+#ifdef NAUT_CONFIG_POLL_IO
+#include <nautilus/pollio.h>
+#endif
+#ifdef NAUT_CONFIG_EVQ
+#include <nautilus/evq.h>
+#endif
+
+#ifndef NAUT_CONFIG_DEBUG_VIRTIO_BLK
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif 
+
+#define INFO(fmt, args...) printk("VIRTIO_BLK: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("VIRTIO_BLK: DEBUG: " fmt, ##args)
+#define ERROR(fmt, args...) printk("VIRTIO_BLK: ERROR: " fmt, ##args)
+
+// device config, legacy layout
+#define CFG_CAPACITY   0
+#define CFG_SIZE_MAX   8
+#define CFG_SEG_MAX    12
+#define CFG_BLK_SIZE   20
+#define CFG_NUM_QUEUES 34
+
+// what a segment is split to when the device sets no limit
+#define DEFAULT_SIZE_MAX (1U << 20)
+
+static struct list_head blk_list = LIST_HEAD_INIT(blk_list);
+static int num_blk = 0;
+
+
+int virtio_blk_submit(struct virtio_blk_dev *dev, uint16_t qid, struct virtio_blk_req *req)
+{
+  struct virtio_blk_queue *q = &dev->q[qid];
+  struct virtio_pci_sg sg[VIRTIO_BLK_MAX_SG + 2];
+  uint8_t flags;
+  uint16_t i;
+  int rc;
+
+  if (req->nsg > VIRTIO_BLK_MAX_SG || req->nsg > dev->seg_max) {
+    ERROR("Request has %u buffers, at most %u\n", req->nsg, dev->seg_max);
+    return -1;
+  }
+
+  if (req->type == VIRTIO_BLK_T_OUT && (dev->features & VIRTIO_BLK_F_RO)) {
+    ERROR("Write to a read-only device\n");
+    return -1;
+  }
+
+  req->hdr.type = req->type;
+  req->hdr.ioprio = 0;
+  req->hdr.sector = req->sector;
+  req->dev_status = VIRTIO_BLK_S_PENDING;
+  req->status = VIRTIO_BLK_S_PENDING;
+
+  // header, the data, then the status byte the device writes
+  sg[0].addr = &req->hdr;
+  sg[0].len = sizeof(req->hdr);
+  sg[0].write = 0;
+  for (i = 0; i < req->nsg; i++) {
+    sg[i + 1] = req->sg[i];
+    sg[i + 1].write = req->type == VIRTIO_BLK_T_IN;
+  }
+  sg[i + 1].addr = &req->dev_status;
+  sg[i + 1].len = 1;
+  sg[i + 1].write = 1;
+
+  flags = spin_lock_irq_save(&q->vr->lock);
+
+  rc = virtio_pci_vring_post(q->vr, sg, req->nsg + 2, req);
+  if (rc < 0) {
+    q->full++;
+  } else {
+    q->submitted++;
+    virtio_pci_vring_kick(q->vr);
+  }
+
+  spin_unlock_irq_restore(&q->vr->lock, flags);
+
+  return rc < 0 ? -1 : 0;
+}
+
+
+// completions are taken off under the lock, then reported without it
+int virtio_blk_poll(struct virtio_blk_dev *dev, uint16_t qid)
+{
+  struct virtio_blk_queue *q = &dev->q[qid];
+  struct virtio_blk_req *done = NULL, *last = NULL, *req;
+  uint8_t flags;
+  int n = 0;
+
+  if (!virtio_pci_vring_pending(q->vr)) {
+    return 0;
+  }
+
+  flags = spin_lock_irq_save(&q->vr->lock);
+
+  while ((req = virtio_pci_vring_get(q->vr, NULL))) {
+    req->next = NULL;
+    if (last) {
+      last->next = req;
+    } else {
+      done = req;
+    }
+    last = req;
+    n++;
+  }
+  q->completed += n;
+
+  spin_unlock_irq_restore(&q->vr->lock, flags);
+
+  while ((req = done)) {
+    done = req->next;
+    // once status is published the caller may reuse the request
+    asm volatile ("" ::: "memory");
+    req->status = req->dev_status;
+    if (req->done) {
+      req->done(req, req->priv);
+    }
+  }
+
+  return n;
+}
+
+
+int virtio_blk_wait(struct virtio_blk_dev *dev, uint16_t qid, struct virtio_blk_req *req)
+{
+  // on an interrupt-driven queue the handler may get there first
+  while (req->status == VIRTIO_BLK_S_PENDING) {
+    virtio_blk_poll(dev, qid);
+  }
+  return req->status;
+}
+
+
+int virtio_blk_set_polled(struct virtio_blk_dev *dev, uint16_t qid, int polled)
+{
+  if (!polled && !dev->irq) {
+    ERROR("Device has no interrupts, queue %u stays polled\n", qid);
+    return -1;
+  }
+  dev->q[qid].polled = polled;
+  virtio_pci_vring_irq(dev->q[qid].vr, !polled);
+  return 0;
+}
+
+
+static void virtio_blk_irq(struct virtio_pci_dev *pdev)
+{
+  struct virtio_blk_dev *dev = (struct virtio_blk_dev *)pdev->driver;
+  uint16_t i;
+
+  for (i = 0; i < dev->num_queues; i++) {
+    if (!dev->q[i].polled) {
+      virtio_blk_poll(dev, i);
+    }
+  }
+}
+
+
+static void virtio_blk_queue_irq(struct virtio_pci_vring *vr)
+{
+  struct virtio_blk_dev *dev = (struct virtio_blk_dev *)vr->dev->driver;
+
+  if (!dev->q[vr->qidx].polled) {
+    virtio_blk_poll(dev, vr->qidx);
+  }
+}
+
+
+// queue i takes cores i, i + num_queues, ... its completions go to core i
+static int virtio_blk_msix(struct virtio_blk_dev *dev)
+{
+  struct virtio_pci_vring *vr[VIRTIO_BLK_MAX_QUEUES];
+  int cpu[VIRTIO_BLK_MAX_QUEUES];
+  uint16_t i;
+
+  for (i = 0; i < dev->num_queues; i++) {
+    vr[i] = dev->q[i].vr;
+    cpu[i] = i;
+  }
+
+  return virtio_pci_msix_register(dev->pci, dev->num_queues, vr, cpu, virtio_blk_queue_irq);
+}
+
+
+#ifdef NAUT_CONFIG_POLL_IO
+struct blk_poll {
+  struct virtio_blk_dev *dev;
+  uint16_t qid;
+};
+
+static int blk_poll_queue(void *priv)
+{
+  struct blk_poll *bp = (struct blk_poll *)priv;
+  return virtio_blk_poll(bp->dev, bp->qid);
+}
+
+int virtio_blk_poll_bind(struct virtio_blk_dev *dev, uint16_t qid, int cpu)
+{
+  struct blk_poll *bp;
+
+  if (qid >= dev->num_queues) {
+    ERROR("No queue %u\n", qid);
+    return -1;
+  }
+
+  bp = malloc(sizeof(*bp));
+  if (!bp) {
+    ERROR("Cannot allocate poll binding\n");
+    return -1;
+  }
+  bp->dev = dev;
+  bp->qid = qid;
+
+  virtio_blk_set_polled(dev, qid, 1);
+
+  if (nk_poll_add(cpu, blk_poll_queue, bp, &dev->q[qid].vr->used->idx)) {
+    free(bp);
+    return -1;
+  }
+
+  INFO("blk%d: queue %u completed on poll core %d\n", dev->num, qid, cpu);
+
+  return 0;
+}
+#endif
+
+
+// split into requests the device accepts, each waited for in turn
+static int blk_rw(struct virtio_blk_dev *dev, uint32_t type, uint64_t sector, void *buf, uint32_t count)
+{
+  struct virtio_pci_sg sg[VIRTIO_BLK_MAX_SG];
+  struct virtio_blk_req req;
+  uint16_t qid = virtio_blk_queue_for_cpu(dev, my_cpu_id());
+  uint32_t seg = dev->features & VIRTIO_BLK_F_SIZE_MAX ? 0 : DEFAULT_SIZE_MAX;
+  uint64_t left = (uint64_t)count * VIRTIO_BLK_SECTOR;
+  uint8_t *p = buf;
+  uint16_t maxsg = dev->seg_max < VIRTIO_BLK_MAX_SG ? dev->seg_max : VIRTIO_BLK_MAX_SG;
+  int rc;
+
+  if (!seg) {
+    seg = virtio_pci_cfg_read32(dev->pci, CFG_SIZE_MAX);
+  }
+  // keep segments whole sectors
+  seg &= ~(VIRTIO_BLK_SECTOR - 1);
+  if (!seg) {
+    seg = VIRTIO_BLK_SECTOR;
+  }
+
+  if (sector + count > dev->capacity) {
+    ERROR("Access past the end of the device\n");
+    return -1;
+  }
+
+  while (left) {
+    uint64_t bytes = 0;
+
+    memset(&req, 0, sizeof(req));
+    req.type = type;
+    req.sector = sector;
+    req.sg = sg;
+
+    while (left && req.nsg < maxsg) {
+      uint32_t len = left < seg ? left : seg;
+      sg[req.nsg].addr = p;
+      sg[req.nsg].len = len;
+      req.nsg++;
+      p += len;
+      left -= len;
+      bytes += len;
+    }
+
+    while (virtio_blk_submit(dev, qid, &req)) {
+      if (dev->q[qid].vr->size < req.nsg + 2) {
+        ERROR("Request cannot fit the queue\n");
+        return -1;
+      }
+      // full, make room
+      virtio_blk_poll(dev, qid);
+    }
+
+    if ((rc = virtio_blk_wait(dev, qid, &req)) != VIRTIO_BLK_S_OK) {
+      ERROR("Request at sector %lu failed with status %d\n", sector, rc);
+      return -1;
+    }
+
+    sector += bytes / VIRTIO_BLK_SECTOR;
+  }
+
+  return 0;
+}
+
+
+int virtio_blk_read(struct virtio_blk_dev *dev, uint64_t sector, void *buf, uint32_t count)
+{
+  return blk_rw(dev, VIRTIO_BLK_T_IN, sector, buf, count);
+}
+
+
+int virtio_blk_write(struct virtio_blk_dev *dev, uint64_t sector, void *buf, uint32_t count)
+{
+  return blk_rw(dev, VIRTIO_BLK_T_OUT, sector, buf, count);
+}
+
+
+int virtio_blk_flush(struct virtio_blk_dev *dev)
+{
+  struct virtio_blk_req req;
+  uint16_t qid = virtio_blk_queue_for_cpu(dev, my_cpu_id());
+
+  if (!(dev->features & VIRTIO_BLK_F_FLUSH)) {
+    // no write cache to flush
+    return 0;
+  }
+
+  memset(&req, 0, sizeof(req));
+  req.type = VIRTIO_BLK_T_FLUSH;
+
+  while (virtio_blk_submit(dev, qid, &req)) {
+    virtio_blk_poll(dev, qid);
+  }
+
+  return virtio_blk_wait(dev, qid, &req) == VIRTIO_BLK_S_OK ? 0 : -1;
+}
+
+
+int virtio_blk_init(struct virtio_pci_dev *pdev)
+{
+  struct virtio_blk_dev *dev;
+  uint16_t i, nq = 1;
+  int cpus = nk_get_nautilus_info()->sys.num_cpus;
+
+  dev = malloc(sizeof(*dev));
+  if (!dev) {
+    ERROR("Cannot allocate device\n");
+    return -1;
+  }
+  memset(dev, 0, sizeof(*dev));
+
+  dev->pci = pdev;
+  pdev->driver = dev;
+
+  dev->features = virtio_pci_start(pdev, VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX |
+                                         VIRTIO_BLK_F_RO | VIRTIO_BLK_F_BLK_SIZE |
+                                         VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_MQ);
+
+  dev->capacity = (uint64_t)virtio_pci_cfg_read32(pdev, CFG_CAPACITY) |
+    ((uint64_t)virtio_pci_cfg_read32(pdev, CFG_CAPACITY + 4) << 32);
+
+  dev->blk_size = dev->features & VIRTIO_BLK_F_BLK_SIZE ?
+    virtio_pci_cfg_read32(pdev, CFG_BLK_SIZE) : VIRTIO_BLK_SECTOR;
+
+  // without a limit, the header and status still need two of the ring's descriptors
+  dev->seg_max = dev->features & VIRTIO_BLK_F_SEG_MAX ?
+    virtio_pci_cfg_read32(pdev, CFG_SEG_MAX) : VIRTIO_BLK_MAX_SG;
+  if (!dev->seg_max) {
+    dev->seg_max = 1;
+  }
+
+  if (dev->features & VIRTIO_BLK_F_MQ) {
+    nq = virtio_pci_cfg_read16(pdev, CFG_NUM_QUEUES);
+    if (!nq) {
+      nq = 1;
+    }
+  }
+
+  if (virtio_pci_vrings_alloc(pdev, nq)) {
+    goto fail;
+  }
+
+  if (nq > cpus) {
+    nq = cpus;
+  }
+  if (nq > VIRTIO_BLK_MAX_QUEUES) {
+    nq = VIRTIO_BLK_MAX_QUEUES;
+  }
+
+  dev->q = malloc(nq * sizeof(struct virtio_blk_queue));
+  if (!dev->q) {
+    ERROR("Cannot allocate queues\n");
+    goto fail;
+  }
+  memset(dev->q, 0, nq * sizeof(struct virtio_blk_queue));
+
+  for (i = 0; i < nq; i++) {
+    if (!(dev->q[i].vr = virtio_pci_vring_init(pdev, i))) {
+      goto fail;
+    }
+  }
+  dev->num_queues = nq;
+
+  virtio_pci_driver_ok(pdev);
+
+  dev->irq = !virtio_blk_msix(dev) || !virtio_pci_irq_register(pdev, virtio_blk_irq);
+
+  // interrupt-driven where we can be, callers can switch a queue to polling
+  for (i = 0; i < nq; i++) {
+    dev->q[i].polled = !dev->irq;
+    virtio_pci_vring_irq(dev->q[i].vr, dev->irq);
+  }
+
+  dev->num = num_blk++;
+  list_add_tail(&dev->node, &blk_list);
+
+  INFO("blk%d: %lu sectors (%lu MB), block size %u, %u queues%s%s\n",
+       dev->num, dev->capacity, dev->capacity * VIRTIO_BLK_SECTOR >> 20, dev->blk_size,
+       dev->num_queues, !dev->irq ? ", polled only" : pdev->msix ? ", MSI-X" : "",
+       dev->features & VIRTIO_BLK_F_RO ? ", read-only" : "");
+
+  return 0;
+
+ fail:
+  ERROR("Cannot set up device\n");
+  virtio_pci_fail(pdev);
+  pdev->driver = NULL;
+  return -1;
+}
+
+
+struct virtio_blk_dev *virtio_blk_get(int num)
+{
+  struct list_head *cur;
+
+  list_for_each(cur, &blk_list) {
+    struct virtio_blk_dev *dev = list_entry(cur, struct virtio_blk_dev, node);
+    if (dev->num == num) {
+      return dev;
+    }
+  }
+
+  return NULL;
+}
+
+
+#ifdef NAUT_CONFIG_EVQ
+void virtio_blk_done_evq(struct virtio_blk_req *req, void *priv)
+{
+  nk_evq_source_t *src = (nk_evq_source_t *)priv;
+  struct nk_evq_event ev = src->ev;
+
+  ev.data = req->status;
+  ev.ptr = req;
+  nk_evq_post(src->q, &ev);
+}
+#endif
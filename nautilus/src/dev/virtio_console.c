@@ -0,0 +1,281 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/spinlock.h>
+#include <dev/pci.h>
+#include <dev/virtio_pci.h>
+#include <dev/virtio_console.h>
+
+#ifndef NAUT_CONFIG_DEBUG_VIRTIO_CONSOLE
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif 
+
+#define INFO(fmt, args...) printk("VIRTIO_CONSOLE: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("VIRTIO_CONSOLE: DEBUG: " fmt, ##args)
+#define ERROR(fmt, args...) printk("VIRTIO_CONSOLE: ERROR: " fmt, ##args)
+
+// without MULTIPORT, port 0 is queues 0 (receive) and 1 (transmit)
+#define TX_QUEUE 1
+
+/*
+ * Only the first console is used. Nothing on the write path may
+ * print, since printk comes back here.
+ */
+static struct virtio_console_dev *cons;
+
+
+// the lock is held
+static void reclaim(struct virtio_console_dev *c)
+{
+  char *buf;
+
+  while ((buf = virtio_pci_vring_get(c->tx, NULL))) {
+    c->free[c->nfree++] = buf;
+    c->inflight--;
+  }
+}
+
+
+// the lock is held
+static void post_open(struct virtio_console_dev *c)
+{
+  struct virtio_pci_sg sg;
+
+  if (!c->open || !c->open_len) {
+    return;
+  }
+
+  sg.addr = c->open;
+  sg.len = c->open_len;
+  sg.write = 0;
+
+  if (virtio_pci_vring_post(c->tx, &sg, 1, c->open) < 0) {
+    // the ring is full, the chunk stays open
+    return;
+  }
+
+  virtio_pci_vring_kick(c->tx);
+
+  c->inflight++;
+  c->posts++;
+  c->open = NULL;
+  c->open_len = 0;
+}
+
+
+int virtio_console_write(const char *buf, size_t len)
+{
+  struct virtio_console_dev *c = cons;
+  uint8_t flags;
+  uint32_t n;
+
+  if (!c) {
+    return -1;
+  }
+
+  if (len == (size_t)-1) {
+    len = strlen(buf);
+  }
+
+  flags = spin_lock_irq_save(&c->tx->lock);
+
+  if (!c->irq) {
+    reclaim(c);
+  }
+
+  while (len) {
+    if (!c->open) {
+      if (!c->nfree) {
+        reclaim(c);
+      }
+      if (!c->nfree) {
+        c->dropped += len;
+        break;
+      }
+      c->open = c->free[--c->nfree];
+      c->open_len = 0;
+    }
+
+    n = VIRTIO_CONSOLE_CHUNK - c->open_len;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(c->open + c->open_len, buf, n);
+    c->open_len += n;
+    c->bytes += n;
+    buf += n;
+    len -= n;
+
+    if (c->open_len == VIRTIO_CONSOLE_CHUNK) {
+      post_open(c);
+      if (c->open) {
+        // no room on the ring either
+        c->dropped += len;
+        break;
+      }
+    }
+  }
+
+  // an idle device gets it now, a busy one when it next completes
+  if (!c->inflight || !c->irq) {
+    post_open(c);
+  }
+
+  spin_unlock_irq_restore(&c->tx->lock, flags);
+
+  return 0;
+}
+
+
+void virtio_console_flush(void)
+{
+  struct virtio_console_dev *c = cons;
+  uint8_t flags;
+
+  if (!c) {
+    return;
+  }
+
+  flags = spin_lock_irq_save(&c->tx->lock);
+  reclaim(c);
+  post_open(c);
+  spin_unlock_irq_restore(&c->tx->lock, flags);
+}
+
+
+// from panic, with interrupts off for good: every write goes out as it is made
+void virtio_console_panic(void)
+{
+  struct virtio_console_dev *c = cons;
+
+  if (c) {
+    c->irq = 0;
+    virtio_console_flush();
+  }
+}
+
+
+static void virtio_console_irq(struct virtio_pci_dev *pdev)
+{
+  struct virtio_console_dev *c = (struct virtio_console_dev *)pdev->driver;
+  uint8_t flags;
+
+  flags = spin_lock_irq_save(&c->tx->lock);
+  reclaim(c);
+  // what piled up while those were in flight
+  post_open(c);
+  spin_unlock_irq_restore(&c->tx->lock, flags);
+}
+
+
+void virtio_console_dump(void)
+{
+  struct virtio_console_dev *c = cons;
+  uint64_t bytes, posts, dropped;
+
+  if (!c) {
+    printk("No virtio console\n");
+    return;
+  }
+
+  // copied first, printing it adds to it
+  bytes = c->bytes;
+  posts = c->posts;
+  dropped = c->dropped;
+
+  printk("virtio console: %lu bytes in %lu descriptors (%lu bytes each), %lu dropped, %u in flight\n",
+         bytes, posts, posts ? bytes / posts : 0, dropped, c->inflight);
+}
+
+
+int virtio_console_init(struct virtio_pci_dev *pdev)
+{
+  struct virtio_console_dev *c;
+  uint16_t i;
+
+  if (cons) {
+    INFO("Already have a console, ignoring this one\n");
+    return 0;
+  }
+
+  c = malloc(sizeof(*c));
+  if (!c) {
+    ERROR("Cannot allocate device\n");
+    return -1;
+  }
+  memset(c, 0, sizeof(*c));
+
+  c->pci = pdev;
+  pdev->driver = c;
+
+  // no multiport, no emergency write, just port 0
+  virtio_pci_start(pdev, 0);
+
+  if (virtio_pci_vrings_alloc(pdev, TX_QUEUE + 1)) {
+    goto fail;
+  }
+
+  if (!(c->tx = virtio_pci_vring_init(pdev, TX_QUEUE))) {
+    goto fail;
+  }
+
+  c->nchunks = NAUT_CONFIG_VIRTIO_CONSOLE_CHUNKS;
+  if (c->nchunks > c->tx->size) {
+    c->nchunks = c->tx->size;
+  }
+
+  c->chunk = malloc(c->nchunks * sizeof(char *));
+  c->free = malloc(c->nchunks * sizeof(char *));
+  if (!c->chunk || !c->free) {
+    ERROR("Cannot allocate chunk table\n");
+    goto fail;
+  }
+
+  // page-sized blocks from malloc come page aligned, so each is one descriptor
+  for (i = 0; i < c->nchunks; i++) {
+    if (!(c->chunk[i] = malloc(VIRTIO_CONSOLE_CHUNK))) {
+      ERROR("Cannot allocate chunk %u\n", i);
+      goto fail;
+    }
+    c->free[i] = c->chunk[i];
+  }
+  c->nfree = c->nchunks;
+
+  virtio_pci_driver_ok(pdev);
+
+  c->irq = !virtio_pci_irq_register(pdev, virtio_console_irq);
+  virtio_pci_vring_irq(c->tx, c->irq);
+
+  INFO("%u chunks of %u bytes%s\n", c->nchunks, VIRTIO_CONSOLE_CHUNK,
+       c->irq ? "" : ", polled");
+
+  // only now does printk start coming here
+  __sync_synchronize();
+  cons = c;
+
+  return 0;
+
+ fail:
+  ERROR("Cannot set up device\n");
+  virtio_pci_fail(pdev);
+  pdev->driver = NULL;
+  return -1;
+}
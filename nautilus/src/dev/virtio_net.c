@@ -0,0 +1,550 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/mm.h>
+#include <dev/pci.h>
+#include <dev/virtio_pci.h>
+#include <dev/virtio_net.h>
+#ifdef NAUT_CONFIG_POLL_IO
+#include <nautilus/pollio.h>
+#endif
+#ifdef NAUT_CONFIG_EVQ
+#include <nautilus/evq.h>
+#endif
+
+#ifndef NAUT_CONFIG_DEBUG_VIRTIO_NET
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif 
+
+#define INFO(fmt, args...) printk("VIRTIO_NET: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("VIRTIO_NET: DEBUG: " fmt, ##args)
+#define ERROR(fmt, args...) printk("VIRTIO_NET: ERROR: " fmt, ##args)
+
+// device config, legacy layout
+#define CFG_MAC       0
+#define CFG_STATUS    6
+#define CFG_MAX_PAIRS 8
+
+#define CTRL_MQ            4
+#define CTRL_MQ_PAIRS_SET  0
+#define CTRL_OK            0
+
+// polls of the used ring before a control command is given up on
+#define CTRL_SPINS 10000000
+
+#define RX_Q(i) (2*(i))
+#define TX_Q(i) (2*(i)+1)
+
+static struct list_head net_list = LIST_HEAD_INIT(net_list);
+static int num_net = 0;
+
+
+struct virtio_net_pool *virtio_net_pool_create(uint32_t count)
+{
+  struct virtio_net_pool *pool;
+  uint32_t i;
+
+  pool = malloc(sizeof(*pool));
+  if (!pool) {
+    ERROR("Cannot allocate pool\n");
+    return NULL;
+  }
+  memset(pool, 0, sizeof(*pool));
+
+  pool->bufs = malloc(count * sizeof(struct virtio_net_buf));
+  if (!pool->bufs) {
+    ERROR("Cannot allocate %u buffers for pool\n", count);
+    free(pool);
+    return NULL;
+  }
+
+  spinlock_init(&pool->lock);
+  pool->count = pool->avail = count;
+
+  for (i = 0; i < count; i++) {
+    pool->bufs[i].pool = pool;
+    pool->bufs[i].next = i + 1 < count ? &pool->bufs[i + 1] : NULL;
+  }
+  pool->free = pool->bufs;
+
+  return pool;
+}
+
+
+// only once every buffer has come back
+int virtio_net_pool_destroy(struct virtio_net_pool *pool)
+{
+  if (pool->avail != pool->count) {
+    ERROR("Pool still has %u buffers out\n", pool->count - pool->avail);
+    return -1;
+  }
+  free(pool->bufs);
+  free(pool);
+  return 0;
+}
+
+
+struct virtio_net_buf *virtio_net_buf_alloc(struct virtio_net_pool *pool)
+{
+  struct virtio_net_buf *buf;
+  uint8_t flags = spin_lock_irq_save(&pool->lock);
+
+  buf = pool->free;
+  if (buf) {
+    pool->free = buf->next;
+    pool->avail--;
+  }
+
+  spin_unlock_irq_restore(&pool->lock, flags);
+
+  if (buf) {
+    buf->next = NULL;
+    buf->len = 0;
+  }
+
+  return buf;
+}
+
+
+void virtio_net_buf_free(struct virtio_net_buf *buf)
+{
+  struct virtio_net_pool *pool = buf->pool;
+  uint8_t flags = spin_lock_irq_save(&pool->lock);
+
+  buf->next = pool->free;
+  pool->free = buf;
+  pool->avail++;
+
+  spin_unlock_irq_restore(&pool->lock, flags);
+}
+
+
+// called with the rx vring locked
+static void rx_refill(struct virtio_net_qp *qp)
+{
+  struct virtio_pci_sg sg[2];
+  struct virtio_net_buf *buf;
+  int posted = 0;
+
+  while (qp->rx_posted < qp->rx->size) {
+    if (!(buf = virtio_net_buf_alloc(qp->rx_pool))) {
+      break;
+    }
+
+    sg[0].addr = &buf->hdr;
+    sg[0].len = sizeof(buf->hdr);
+    sg[0].write = 1;
+    sg[1].addr = buf->data;
+    sg[1].len = VIRTIO_NET_BUF_DATA;
+    sg[1].write = 1;
+
+    if (virtio_pci_vring_post(qp->rx, sg, 2, buf) < 0) {
+      virtio_net_buf_free(buf);
+      break;
+    }
+
+    qp->rx_posted++;
+    posted++;
+  }
+
+  if (posted) {
+    virtio_pci_vring_kick(qp->rx);
+  }
+}
+
+
+struct virtio_net_buf *virtio_net_recv(struct virtio_net_dev *dev, uint16_t qid)
+{
+  struct virtio_net_qp *qp = &dev->qp[qid];
+  struct virtio_net_buf *buf;
+  uint32_t len;
+  uint8_t flags;
+
+  flags = spin_lock_irq_save(&qp->rx->lock);
+
+  buf = virtio_pci_vring_get(qp->rx, &len);
+  if (buf) {
+    qp->rx_posted--;
+    qp->rx_packets++;
+    buf->len = len > sizeof(buf->hdr) ? len - sizeof(buf->hdr) : 0;
+  }
+
+  // also picks up buffers freed since the pool last ran dry
+  if (qp->rx_posted < qp->rx->size) {
+    rx_refill(qp);
+  }
+
+  spin_unlock_irq_restore(&qp->rx->lock, flags);
+
+  return buf;
+}
+
+
+#ifdef NAUT_CONFIG_POLL_IO
+// frames per pass, so one busy queue cannot starve the core's others
+#define NET_POLL_BATCH 32
+
+struct net_poll {
+  struct virtio_net_dev *dev;
+  uint16_t qid;
+  struct nk_poll_ring *ring;
+  uint64_t dropped;
+};
+
+static int net_poll_rx(void *priv)
+{
+  struct net_poll *np = (struct net_poll *)priv;
+  struct virtio_net_buf *buf;
+  int n = 0;
+
+  while (n < NET_POLL_BATCH && (buf = virtio_net_recv(np->dev, np->qid))) {
+    if (nk_poll_ring_push(np->ring, buf)) {
+      // the worker is behind, dropping here keeps the device's ring moving
+      virtio_net_buf_free(buf);
+      np->dropped++;
+    }
+    n++;
+  }
+
+  if (n) {
+    nk_poll_ring_kick(np->ring);
+  }
+
+  return n;
+}
+
+int virtio_net_poll_bind(struct virtio_net_dev *dev, uint16_t qid, int cpu, struct nk_poll_ring *ring)
+{
+  struct net_poll *np;
+
+  if (qid >= dev->num_pairs) {
+    ERROR("No queue pair %u\n", qid);
+    return -1;
+  }
+
+  np = malloc(sizeof(*np));
+  if (!np) {
+    ERROR("Cannot allocate poll binding\n");
+    return -1;
+  }
+  np->dev = dev;
+  np->qid = qid;
+  np->ring = ring;
+  np->dropped = 0;
+
+  virtio_pci_vring_irq(dev->qp[qid].rx, 0);
+
+  if (nk_poll_add(cpu, net_poll_rx, np, &dev->qp[qid].rx->used->idx)) {
+    free(np);
+    return -1;
+  }
+
+  INFO("net%d: pair %u received on poll core %d\n", dev->num, qid, cpu);
+
+  return 0;
+}
+#endif
+
+
+int virtio_net_send(struct virtio_net_dev *dev, uint16_t qid, struct virtio_net_buf *buf)
+{
+  struct virtio_net_qp *qp = &dev->qp[qid];
+  struct virtio_net_buf *done;
+  struct virtio_pci_sg sg[2];
+  uint8_t flags;
+  int rc;
+
+  if (buf->len > VIRTIO_NET_BUF_DATA) {
+    ERROR("Frame of %u bytes is too long\n", buf->len);
+    return -1;
+  }
+
+  memset(&buf->hdr, 0, sizeof(buf->hdr));
+
+  sg[0].addr = &buf->hdr;
+  sg[0].len = sizeof(buf->hdr);
+  sg[0].write = 0;
+  sg[1].addr = buf->data;
+  sg[1].len = buf->len;
+  sg[1].write = 0;
+
+  flags = spin_lock_irq_save(&qp->tx->lock);
+
+  // transmit completions are reaped here rather than by interrupt
+  while ((done = virtio_pci_vring_get(qp->tx, NULL))) {
+    virtio_net_buf_free(done);
+  }
+
+  rc = virtio_pci_vring_post(qp->tx, sg, 2, buf);
+  if (rc < 0) {
+    qp->tx_full++;
+  } else {
+    qp->tx_packets++;
+    virtio_pci_vring_kick(qp->tx);
+  }
+
+  spin_unlock_irq_restore(&qp->tx->lock, flags);
+
+  return rc < 0 ? -1 : 0;
+}
+
+
+void virtio_net_set_rx_callback(struct virtio_net_dev *dev,
+                                void (*callback)(struct virtio_net_dev *, uint16_t, void *),
+                                void *priv)
+{
+  uint16_t i;
+
+  dev->rx_priv = priv;
+  dev->rx_callback = callback;
+
+  // without a callback nobody needs receive interrupts
+  for (i = 0; i < dev->num_pairs; i++) {
+    virtio_pci_vring_irq(dev->qp[i].rx, callback != NULL);
+  }
+}
+
+
+#ifdef NAUT_CONFIG_EVQ
+void virtio_net_rx_evq(struct virtio_net_dev *dev, uint16_t qid, void *priv)
+{
+  nk_evq_source_t *src = (nk_evq_source_t *)priv;
+  struct nk_evq_event ev = src->ev;
+
+  ev.data = qid;
+  ev.ptr = dev;
+  nk_evq_post(src->q, &ev);
+}
+#endif
+
+
+static void virtio_net_irq(struct virtio_pci_dev *pdev)
+{
+  struct virtio_net_dev *dev = (struct virtio_net_dev *)pdev->driver;
+  uint16_t i;
+
+  if (!dev->rx_callback) {
+    return;
+  }
+
+  for (i = 0; i < dev->num_pairs; i++) {
+    if (virtio_pci_vring_pending(dev->qp[i].rx)) {
+      dev->rx_callback(dev, i, dev->rx_priv);
+    }
+  }
+}
+
+
+// with MSI-X each receive queue interrupts the core that uses it
+static void virtio_net_rx_irq(struct virtio_pci_vring *vr)
+{
+  struct virtio_net_dev *dev = (struct virtio_net_dev *)vr->dev->driver;
+
+  if (dev->rx_callback) {
+    dev->rx_callback(dev, vr->qidx / 2, dev->rx_priv);
+  }
+}
+
+
+static int virtio_net_msix(struct virtio_net_dev *dev)
+{
+  struct virtio_pci_vring *vr[VIRTIO_NET_MAX_PAIRS];
+  int cpu[VIRTIO_NET_MAX_PAIRS];
+  uint16_t i;
+
+  // pair i serves cores i, i + num_pairs, ... so core i takes its interrupts
+  for (i = 0; i < dev->num_pairs; i++) {
+    vr[i] = dev->qp[i].rx;
+    cpu[i] = i;
+  }
+
+  return virtio_pci_msix_register(dev->pci, dev->num_pairs, vr, cpu, virtio_net_rx_irq);
+}
+
+
+// the device only uses more than the first pair once told to
+static int set_pairs(struct virtio_net_dev *dev, uint16_t pairs)
+{
+  struct {
+    uint8_t class;
+    uint8_t cmd;
+  } __packed hdr = { CTRL_MQ, CTRL_MQ_PAIRS_SET };
+  volatile uint8_t ack = 0xff;
+  struct virtio_pci_sg sg[3];
+  uint64_t spins;
+
+  sg[0].addr = &hdr;
+  sg[0].len = sizeof(hdr);
+  sg[0].write = 0;
+  sg[1].addr = &pairs;
+  sg[1].len = sizeof(pairs);
+  sg[1].write = 0;
+  sg[2].addr = (void *)&ack;
+  sg[2].len = sizeof(ack);
+  sg[2].write = 1;
+
+  if (virtio_pci_vring_post(dev->ctrl, sg, 3, &hdr) < 0) {
+    return -1;
+  }
+  virtio_pci_vring_kick(dev->ctrl);
+
+  for (spins = 0; !virtio_pci_vring_get(dev->ctrl, NULL); spins++) {
+    if (spins == CTRL_SPINS) {
+      ERROR("Control command timed out\n");
+      return -1;
+    }
+  }
+
+  return ack == CTRL_OK ? 0 : -1;
+}
+
+
+int virtio_net_init(struct virtio_pci_dev *pdev)
+{
+  struct virtio_net_dev *dev;
+  uint16_t i, pairs;
+  int cpus = nk_get_nautilus_info()->sys.num_cpus;
+
+  dev = malloc(sizeof(*dev));
+  if (!dev) {
+    ERROR("Cannot allocate device\n");
+    return -1;
+  }
+  memset(dev, 0, sizeof(*dev));
+
+  dev->pci = pdev;
+  pdev->driver = dev;
+
+  dev->features = virtio_pci_start(pdev, VIRTIO_NET_F_MAC | VIRTIO_NET_F_STATUS |
+                                         VIRTIO_NET_F_CTRL_VQ | VIRTIO_NET_F_MQ);
+
+  if ((dev->features & VIRTIO_NET_F_MQ) && !(dev->features & VIRTIO_NET_F_CTRL_VQ)) {
+    dev->features &= ~VIRTIO_NET_F_MQ;
+  }
+
+  if (dev->features & VIRTIO_NET_F_MAC) {
+    for (i = 0; i < 6; i++) {
+      dev->mac[i] = virtio_pci_cfg_read8(pdev, CFG_MAC + i);
+    }
+  }
+
+  dev->max_pairs = 1;
+  if (dev->features & VIRTIO_NET_F_MQ) {
+    dev->max_pairs = virtio_pci_cfg_read16(pdev, CFG_MAX_PAIRS);
+    if (!dev->max_pairs) {
+      dev->max_pairs = 1;
+    }
+  }
+
+  pairs = dev->max_pairs;
+  if (pairs > cpus) {
+    pairs = cpus;
+  }
+  if (pairs > VIRTIO_NET_MAX_PAIRS) {
+    pairs = VIRTIO_NET_MAX_PAIRS;
+  }
+
+  // the control queue comes after every pair the device has, used or not
+  if (virtio_pci_vrings_alloc(pdev, 2 * dev->max_pairs + 1)) {
+    goto fail;
+  }
+
+  dev->qp = malloc(pairs * sizeof(struct virtio_net_qp));
+  if (!dev->qp) {
+    ERROR("Cannot allocate queue pairs\n");
+    goto fail;
+  }
+  memset(dev->qp, 0, pairs * sizeof(struct virtio_net_qp));
+
+  for (i = 0; i < pairs; i++) {
+    struct virtio_net_qp *qp = &dev->qp[i];
+
+    qp->rx = virtio_pci_vring_init(pdev, RX_Q(i));
+    qp->tx = virtio_pci_vring_init(pdev, TX_Q(i));
+    if (!qp->rx || !qp->tx) {
+      goto fail;
+    }
+
+    qp->rx_pool = virtio_net_pool_create(qp->rx->size);
+    if (!qp->rx_pool) {
+      goto fail;
+    }
+
+    // polled until someone asks for a callback, sends are reaped on the next send
+    virtio_pci_vring_irq(qp->rx, 0);
+    virtio_pci_vring_irq(qp->tx, 0);
+
+    rx_refill(qp);
+  }
+  dev->num_pairs = pairs;
+
+  if (dev->features & VIRTIO_NET_F_CTRL_VQ) {
+    dev->ctrl = virtio_pci_vring_init(pdev, 2 * dev->max_pairs);
+    if (!dev->ctrl) {
+      goto fail;
+    }
+    virtio_pci_vring_irq(dev->ctrl, 0);
+  }
+
+  virtio_pci_driver_ok(pdev);
+
+  if (pairs > 1 && set_pairs(dev, pairs)) {
+    ERROR("Device refused %u queue pairs, using one\n", pairs);
+    dev->num_pairs = 1;
+  }
+
+  if (!virtio_net_msix(dev)) {
+    DEBUG("Receive interrupts by MSI-X, one vector per pair\n");
+  } else if (virtio_pci_irq_register(pdev, virtio_net_irq)) {
+    INFO("No interrupts, receive is polled only\n");
+  }
+
+  dev->num = num_net++;
+  list_add_tail(&dev->node, &net_list);
+
+  INFO("net%d: mac %02x:%02x:%02x:%02x:%02x:%02x, %u of %u queue pairs\n",
+       dev->num, dev->mac[0], dev->mac[1], dev->mac[2], dev->mac[3], dev->mac[4], dev->mac[5],
+       dev->num_pairs, dev->max_pairs);
+
+  return 0;
+
+ fail:
+  // the rings stay allocated, a failed device is not reset and reused
+  ERROR("Cannot set up device\n");
+  virtio_pci_fail(pdev);
+  pdev->driver = NULL;
+  return -1;
+}
+
+
+struct virtio_net_dev *virtio_net_get(int num)
+{
+  struct list_head *cur;
+
+  list_for_each(cur, &net_list) {
+    struct virtio_net_dev *dev = list_entry(cur, struct virtio_net_dev, node);
+    if (dev->num == num) {
+      return dev;
+    }
+  }
+
+  return NULL;
+}
@@ -1,6 +1,18 @@
 #include <nautilus/nautilus.h>
+#include <nautilus/irq.h>
+#include <nautilus/mm.h>
+#include <nautilus/paging.h>
 #include <dev/pci.h>
 #include <dev/virtio_pci.h>
+#ifdef NAUT_CONFIG_VIRTIO_NET
+#include <dev/virtio_net.h>
+#endif
+#ifdef NAUT_CONFIG_VIRTIO_BLK
+#include <dev/virtio_blk.h>
+#endif
+#ifdef NAUT_CONFIG_VIRTIO_CONSOLE
+#include <dev/virtio_console.h>
+#endif
 
 #ifndef NAUT_CONFIG_DEBUG_VIRTIO_PCI
 #undef DEBUG_PRINT
@@ -15,6 +27,449 @@
 static struct list_head dev_list;
 
 
+uint8_t virtio_pci_read8(struct virtio_pci_dev *dev, uint16_t off)
+{
+  return inb(dev->ioport_start + off);
+}
+
+uint16_t virtio_pci_read16(struct virtio_pci_dev *dev, uint16_t off)
+{
+  return inw(dev->ioport_start + off);
+}
+
+uint32_t virtio_pci_read32(struct virtio_pci_dev *dev, uint16_t off)
+{
+  return inl(dev->ioport_start + off);
+}
+
+void virtio_pci_write8(struct virtio_pci_dev *dev, uint16_t off, uint8_t val)
+{
+  outb(val, dev->ioport_start + off);
+}
+
+void virtio_pci_write16(struct virtio_pci_dev *dev, uint16_t off, uint16_t val)
+{
+  outw(val, dev->ioport_start + off);
+}
+
+void virtio_pci_write32(struct virtio_pci_dev *dev, uint16_t off, uint32_t val)
+{
+  outl(val, dev->ioport_start + off);
+}
+
+
+static inline uint16_t cfg_base(struct virtio_pci_dev *dev)
+{
+  return dev->msix ? VIRTIO_PCI_CONFIG_MSIX : VIRTIO_PCI_CONFIG;
+}
+
+uint8_t virtio_pci_cfg_read8(struct virtio_pci_dev *dev, uint16_t off)
+{
+  return virtio_pci_read8(dev, cfg_base(dev) + off);
+}
+
+uint16_t virtio_pci_cfg_read16(struct virtio_pci_dev *dev, uint16_t off)
+{
+  return virtio_pci_read16(dev, cfg_base(dev) + off);
+}
+
+uint32_t virtio_pci_cfg_read32(struct virtio_pci_dev *dev, uint16_t off)
+{
+  return virtio_pci_read32(dev, cfg_base(dev) + off);
+}
+
+
+uint32_t virtio_pci_start(struct virtio_pci_dev *dev, uint32_t wanted)
+{
+  uint32_t features;
+
+  // writing zero resets the device
+  virtio_pci_write8(dev, VIRTIO_PCI_STATUS, 0);
+  virtio_pci_write8(dev, VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK);
+  virtio_pci_write8(dev, VIRTIO_PCI_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+  features = virtio_pci_read32(dev, VIRTIO_PCI_HOST_FEATURES) & wanted;
+  virtio_pci_write32(dev, VIRTIO_PCI_GUEST_FEATURES, features);
+
+  DEBUG("Negotiated features 0x%x\n", features);
+
+  return features;
+}
+
+void virtio_pci_driver_ok(struct virtio_pci_dev *dev)
+{
+  virtio_pci_write8(dev, VIRTIO_PCI_STATUS,
+                    virtio_pci_read8(dev, VIRTIO_PCI_STATUS) | VIRTIO_STATUS_DRIVER_OK);
+}
+
+void virtio_pci_fail(struct virtio_pci_dev *dev)
+{
+  virtio_pci_write8(dev, VIRTIO_PCI_STATUS,
+                    virtio_pci_read8(dev, VIRTIO_PCI_STATUS) | VIRTIO_STATUS_FAILED);
+}
+
+
+int virtio_pci_vrings_alloc(struct virtio_pci_dev *dev, uint16_t num)
+{
+  dev->vring = malloc(num * sizeof(struct virtio_pci_vring *));
+  if (!dev->vring) {
+    ERROR("Cannot allocate vring table\n");
+    return -1;
+  }
+  memset(dev->vring, 0, num * sizeof(struct virtio_pci_vring *));
+  dev->num_vrings = num;
+  return 0;
+}
+
+
+static inline uint64_t vring_bytes(uint16_t n)
+{
+  uint64_t first = sizeof(struct virtq_desc) * n + sizeof(uint16_t) * (3 + n);
+  uint64_t second = sizeof(struct virtq_used_elem) * n + sizeof(uint16_t) * 3;
+
+  first = (first + VIRTIO_VRING_ALIGN - 1) & ~(uint64_t)(VIRTIO_VRING_ALIGN - 1);
+  second = (second + VIRTIO_VRING_ALIGN - 1) & ~(uint64_t)(VIRTIO_VRING_ALIGN - 1);
+
+  return first + second;
+}
+
+
+/*
+ * The legacy interface takes the ring's page number and fixes the
+ * layout: descriptors, then the available ring, then the used ring at
+ * the next page. malloc hands out naturally aligned blocks, so the
+ * block is page aligned.
+ */
+struct virtio_pci_vring *virtio_pci_vring_init(struct virtio_pci_dev *dev, uint16_t qidx)
+{
+  struct virtio_pci_vring *vr;
+  uint16_t n;
+  uint64_t used_off;
+  int i;
+
+  if (qidx >= dev->num_vrings) {
+    ERROR("No slot for vring %u\n", qidx);
+    return NULL;
+  }
+
+  virtio_pci_write16(dev, VIRTIO_PCI_QUEUE_SEL, qidx);
+  n = virtio_pci_read16(dev, VIRTIO_PCI_QUEUE_SIZE);
+
+  if (!n) {
+    ERROR("Device has no queue %u\n", qidx);
+    return NULL;
+  }
+
+  vr = malloc(sizeof(*vr));
+  if (!vr) {
+    ERROR("Cannot allocate vring %u\n", qidx);
+    return NULL;
+  }
+  memset(vr, 0, sizeof(*vr));
+
+  vr->dev = dev;
+  vr->qidx = qidx;
+  vr->size = n;
+  vr->size_bytes = vring_bytes(n);
+  vr->mem = malloc(vr->size_bytes);
+  vr->cookie = malloc(n * sizeof(void *));
+
+  if (!vr->mem || !vr->cookie || ((addr_t)vr->mem & (VIRTIO_VRING_ALIGN - 1))) {
+    ERROR("Cannot allocate %lu bytes for vring %u\n", vr->size_bytes, qidx);
+    if (vr->mem) { free(vr->mem); }
+    if (vr->cookie) { free(vr->cookie); }
+    free(vr);
+    return NULL;
+  }
+
+  memset(vr->mem, 0, vr->size_bytes);
+  memset(vr->cookie, 0, n * sizeof(void *));
+
+  used_off = (sizeof(struct virtq_desc) * n + sizeof(uint16_t) * (3 + n) + VIRTIO_VRING_ALIGN - 1)
+    & ~(uint64_t)(VIRTIO_VRING_ALIGN - 1);
+
+  vr->desc = (struct virtq_desc *)vr->mem;
+  vr->avail = (struct virtq_avail *)(vr->mem + sizeof(struct virtq_desc) * n);
+  vr->used = (struct virtq_used *)(vr->mem + used_off);
+
+  for (i = 0; i < n; i++) {
+    vr->desc[i].next = i + 1;
+  }
+  vr->free_head = 0;
+  vr->num_free = n;
+  vr->last_used = 0;
+  spinlock_init(&vr->lock);
+
+  virtio_pci_write32(dev, VIRTIO_PCI_QUEUE_PFN, va_to_pa((addr_t)vr->mem) >> 12);
+
+  dev->vring[qidx] = vr;
+
+  DEBUG("vring %u: %u entries at %p\n", qidx, n, vr->mem);
+
+  return vr;
+}
+
+
+int virtio_pci_vring_post(struct virtio_pci_vring *vr, struct virtio_pci_sg *sg, uint16_t n, void *cookie)
+{
+  uint16_t head, d;
+  int i;
+
+  if (!n || vr->num_free < n) {
+    return -1;
+  }
+
+  head = d = vr->free_head;
+
+  for (i = 0; i < n; i++) {
+    vr->desc[d].addr = va_to_pa((addr_t)sg[i].addr);
+    vr->desc[d].len = sg[i].len;
+    vr->desc[d].flags = (sg[i].write ? VIRTQ_DESC_F_WRITE : 0) | (i + 1 < n ? VIRTQ_DESC_F_NEXT : 0);
+    d = vr->desc[d].next;
+  }
+
+  vr->free_head = d;
+  vr->num_free -= n;
+  vr->cookie[head] = cookie;
+
+  vr->avail->ring[vr->avail->idx % vr->size] = head;
+  // the entry must be visible before the index that publishes it
+  asm volatile ("" ::: "memory");
+  vr->avail->idx++;
+
+  return head;
+}
+
+
+void virtio_pci_vring_kick(struct virtio_pci_vring *vr)
+{
+  // the index store has to land before we look at whether the device wants a kick
+  __sync_synchronize();
+
+  if (!(vr->used->flags & VIRTQ_USED_F_NO_NOTIFY)) {
+    virtio_pci_write16(vr->dev, VIRTIO_PCI_QUEUE_NOTIFY, vr->qidx);
+  }
+}
+
+
+int virtio_pci_vring_pending(struct virtio_pci_vring *vr)
+{
+  return vr->last_used != vr->used->idx;
+}
+
+
+void *virtio_pci_vring_get(struct virtio_pci_vring *vr, uint32_t *len)
+{
+  volatile struct virtq_used_elem *e;
+  uint16_t head, d, n;
+  void *cookie;
+
+  if (vr->last_used == vr->used->idx) {
+    return NULL;
+  }
+
+  // read the entry only after seeing the index that covers it
+  asm volatile ("" ::: "memory");
+
+  e = &vr->used->ring[vr->last_used % vr->size];
+  head = e->id;
+  if (len) {
+    *len = e->len;
+  }
+  vr->last_used++;
+
+  // put the chain back on the free list
+  for (d = head, n = 1; vr->desc[d].flags & VIRTQ_DESC_F_NEXT; n++) {
+    d = vr->desc[d].next;
+  }
+  vr->desc[d].next = vr->free_head;
+  vr->free_head = head;
+  vr->num_free += n;
+
+  cookie = vr->cookie[head];
+  vr->cookie[head] = NULL;
+
+  return cookie;
+}
+
+
+// suppress or allow the device's interrupts for this queue, a hint only
+void virtio_pci_vring_irq(struct virtio_pci_vring *vr, int on)
+{
+  if (on) {
+    vr->avail->flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+  } else {
+    vr->avail->flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+  }
+}
+
+
+// reading the ISR acks it, and with INTx the line may be shared
+static int virtio_pci_irq_handler(excp_entry_t *excp, excp_vec_t vec)
+{
+  struct list_head *cur;
+
+  list_for_each(cur, &dev_list) {
+    struct virtio_pci_dev *dev = list_entry(cur, struct virtio_pci_dev, virtio_node);
+
+    if (dev->intr_vec == vec && dev->irq_callback &&
+        (virtio_pci_read8(dev, VIRTIO_PCI_ISR) & VIRTIO_ISR_QUEUE)) {
+      dev->irq_callback(dev);
+    }
+  }
+
+  IRQ_HANDLER_END();
+
+  return 0;
+}
+
+
+int virtio_pci_irq_register(struct virtio_pci_dev *dev, void (*callback)(struct virtio_pci_dev *))
+{
+  uint8_t irq = dev->pci_dev->cfg.dev_cfg.intr_line;
+
+  if (!dev->pci_intr || irq == 0xff || irq > 15) {
+    ERROR("Device has no usable legacy interrupt, use polling\n");
+    return -1;
+  }
+
+  dev->irq_callback = callback;
+  dev->intr_vec = irq_to_vec(irq);
+
+  if (register_irq_handler(irq, virtio_pci_irq_handler, NULL)) {
+    ERROR("Cannot register handler for IRQ %u\n", irq);
+    dev->irq_callback = NULL;
+    return -1;
+  }
+
+  nk_unmask_irq(irq);
+
+  DEBUG("Device interrupts on IRQ %u (vector %u)\n", irq, dev->intr_vec);
+
+  return 0;
+}
+
+
+// the vring each MSI-X vector belongs to
+static struct virtio_pci_vring *msix_vring[NUM_IDT_ENTRIES];
+
+static int virtio_pci_msix_handler(excp_entry_t *excp, excp_vec_t vec)
+{
+  struct virtio_pci_vring *vr = msix_vring[vec];
+
+  // no ISR to read, the vector says which queue
+  if (vr && vr->callback) {
+    vr->callback(vr);
+  }
+
+  IRQ_HANDLER_END();
+
+  return 0;
+}
+
+
+static void msix_unregister(struct virtio_pci_dev *dev, uint16_t n, struct virtio_pci_vring **vr)
+{
+  uint16_t i;
+
+  for (i = 0; i < n; i++) {
+    virtio_pci_write16(dev, VIRTIO_PCI_QUEUE_SEL, vr[i]->qidx);
+    virtio_pci_write16(dev, VIRTIO_PCI_QUEUE_VECTOR, VIRTIO_MSI_NO_VECTOR);
+    msix_vring[vr[i]->vec] = NULL;
+    nk_int_vec_release(vr[i]->vec, 1);
+    vr[i]->callback = NULL;
+    vr[i]->vec = 0;
+  }
+
+  pci_msix_disable(dev->pci_dev);
+  dev->msix = 0;
+}
+
+
+int virtio_pci_msix_register(struct virtio_pci_dev *dev, uint16_t n,
+                             struct virtio_pci_vring **vr, int *cpu,
+                             void (*callback)(struct virtio_pci_vring *))
+{
+  uint16_t i;
+
+  if (pci_msix_count(dev->pci_dev) < n) {
+    DEBUG("Device has %d MSI-X entries, %u needed\n", pci_msix_count(dev->pci_dev), n);
+    return -1;
+  }
+
+  if (dev->msix) {
+    ERROR("MSI-X vectors already registered\n");
+    return -1;
+  }
+
+  if (pci_msix_enable(dev->pci_dev)) {
+    return -1;
+  }
+  dev->msix = 1;
+
+  // we do not watch for config changes
+  virtio_pci_write16(dev, VIRTIO_PCI_CONFIG_VECTOR, VIRTIO_MSI_NO_VECTOR);
+
+  for (i = 0; i < n; i++) {
+    uint8_t vec;
+
+    if (nk_int_vec_reserve(1, 0, &vec)) {
+      goto fail;
+    }
+
+    vr[i]->vec = vec;
+    vr[i]->cpu = cpu[i];
+    vr[i]->callback = callback;
+    msix_vring[vec] = vr[i];
+
+    if (register_int_handler(vec, virtio_pci_msix_handler, NULL) ||
+        pci_msix_set_vector(dev->pci_dev, i, vec, cpu[i])) {
+      i++;
+      goto fail;
+    }
+
+    // entry i for this queue, the device answers NO_VECTOR if it cannot
+    virtio_pci_write16(dev, VIRTIO_PCI_QUEUE_SEL, vr[i]->qidx);
+    virtio_pci_write16(dev, VIRTIO_PCI_QUEUE_VECTOR, i);
+    if (virtio_pci_read16(dev, VIRTIO_PCI_QUEUE_VECTOR) != i) {
+      ERROR("Device refused MSI-X entry %u for queue %u\n", i, vr[i]->qidx);
+      i++;
+      goto fail;
+    }
+
+    DEBUG("Queue %u interrupts on vector 0x%x, CPU %d\n", vr[i]->qidx, vec, cpu[i]);
+  }
+
+  return 0;
+
+ fail:
+  msix_unregister(dev, i, vr);
+  return -1;
+}
+
+
+int virtio_pci_vring_irq_steer(struct virtio_pci_vring *vr, int cpu)
+{
+  uint16_t entry;
+
+  if (!vr->callback) {
+    ERROR("Queue %u has no vector of its own\n", vr->qidx);
+    return -1;
+  }
+
+  virtio_pci_write16(vr->dev, VIRTIO_PCI_QUEUE_SEL, vr->qidx);
+  entry = virtio_pci_read16(vr->dev, VIRTIO_PCI_QUEUE_VECTOR);
+
+  if (pci_msix_set_vector(vr->dev->pci_dev, entry, vr->vec, cpu)) {
+    return -1;
+  }
+
+  vr->cpu = cpu;
+
+  return 0;
+}
+
+
 int virtio_pci_init(struct naut_info * naut)
 {
   struct pci_info *pci = naut->sys.pci;
@@ -65,6 +520,10 @@ int virtio_pci_init(struct naut_info * naut)
 	  DEBUG("Block Device\n");
 	  vdev->type = VIRTIO_PCI_BLOCK;
 	  break;
+	case 0x1003:
+	  DEBUG("Console Device\n");
+	  vdev->type = VIRTIO_PCI_CONSOLE;
+	  break;
 	default:
 	  DEBUG("Other Device\n");
 	  vdev->type = VIRTIO_PCI_OTHER;
@@ -73,83 +532,90 @@ int virtio_pci_init(struct naut_info * naut)
 
 	// PCI Interrupt (A..D)
 	vdev->pci_intr = cfg->dev_cfg.intr_pin;
-	// Figure out mapping here or look at capabilities for MSI-X
-	// vdev->intr_vec = ...
+	// drivers map this in virtio_pci_irq_register, or use MSI-X
+	// (virtio_pci_msix_register) when the device has enough entries
 
 	// we expect two bars exist, one for memory, one for i/o
 	// and these will be bar 0 and 1
 	// check to see if there are no others
 	for (int i=0;i<6;i++) { 
-	  uint32_t bar = pci_cfg_readl(bus->num,pdev->num, 0, 0x10 + i*4);
-	  uint32_t size;
-	  DEBUG("bar %d: 0x%0x\n",i, bar);
-	  if (i>=2 && bar!=0) { 
+	  struct pci_bar *bar = &pdev->bar[i];
+	  DEBUG("bar %d: 0x%lx size 0x%lx%s\n",i, bar->addr, bar->size, bar->io ? " (i/o)" : "");
+	  if (i>=2 && bar->size) { 
 	    DEBUG("Not expecting this to be a non-empty bar...\n");
 	  }
-	  if (!(bar & 0x0)) { 
-	    uint8_t mem_bar_type = (bar & 0x6) >> 1;
-	    if (mem_bar_type != 0) { 
-	      ERROR("Cannot handle memory bar type 0x%x\n", mem_bar_type);
-	      return -1;
-	    }
+	  if (i>=2) {
+	    // transitional devices also have modern (possibly 64 bit) bars,
+	    // the legacy interface does not need them
+	    continue;
 	  }
-
-	  // determine size
-	  // write all 1s, get back the size mask
-	  pci_cfg_writel(bus->num,pdev->num,0,0x10 + i*4, 0xffffffff);
-	  // size mask comes back + info bits
-	  size = pci_cfg_readl(bus->num,pdev->num,0,0x10 + i*4);
-
-	  // mask all but size mask
-	  if (bar & 0x1) { 
-	    // I/O
-	    size &= 0xfffffffc;
-	  } else {
-	    // memory
-	    size &= 0xfffffff0;
+	  if (!bar->io && bar->is64) { 
+	    ERROR("Cannot handle 64 bit memory bar\n");
+	    return -1;
 	  }
-	  size = ~size;
-	  size++; 
 
-	  // now we have to put back the original bar
-	  pci_cfg_writel(bus->num,pdev->num,0,0x10 + i*4, bar);
-
-	  if (!size) { 
+	  // sized once at enumeration
+	  if (!bar->size) { 
 	    // non-existent bar, skip to next one
 	    continue;
 	  }
 
-	  if (size>0 && i>=2) { 
-	    ERROR("unexpected virtio pci bar with size>0!\n");
-	    return -1;
-	  }
-	  
-	  if (bar & 0x1) { 
-	    vdev->ioport_start = bar & 0xffffffc0;
-	    vdev->ioport_end = vdev->ioport_start + size;
+	  if (bar->io) { 
+	    vdev->ioport_start = bar->addr;
+	    vdev->ioport_end = vdev->ioport_start + bar->size;
 	  } else {
-	    vdev->mem_start = bar & 0xfffffff0;
-	    vdev->mem_end = vdev->mem_start + size;
+	    vdev->mem_start = bar->addr;
+	    vdev->mem_end = vdev->mem_start + bar->size;
 	  }
 
 	}
 
 	INFO("Adding virtio %s device: bus=%u dev=%u func=%u: pci_intr=%u intr_vec=%u ioport_start=%p ioport_end=%p mem_start=%p mem_end=%p\n",
 	     vdev->type==VIRTIO_PCI_BLOCK ? "block" :
-	     vdev->type==VIRTIO_PCI_NET ? "net" : "other",
+	     vdev->type==VIRTIO_PCI_NET ? "net" :
+	     vdev->type==VIRTIO_PCI_CONSOLE ? "console" : "other",
 	     bus->num, pdev->num, 0,
 	     vdev->pci_intr, vdev->intr_vec,
 	     vdev->ioport_start, vdev->ioport_end,
 	     vdev->mem_start, vdev->mem_end);
 	     
 
-	list_add(&dev_list, &vdev->virtio_node);
+	list_add(&vdev->virtio_node, &dev_list);
       }
       
     }
   }
       
-
+  // drivers may register interrupts, so only run them once the list is complete
+  list_for_each(curdev, &dev_list) {
+    struct virtio_pci_dev *vdev = list_entry(curdev, struct virtio_pci_dev, virtio_node);
+
+    switch (vdev->type) {
+#ifdef NAUT_CONFIG_VIRTIO_NET
+    case VIRTIO_PCI_NET:
+      if (virtio_net_init(vdev)) {
+	ERROR("Cannot start net device\n");
+      }
+      break;
+#endif
+#ifdef NAUT_CONFIG_VIRTIO_BLK
+    case VIRTIO_PCI_BLOCK:
+      if (virtio_blk_init(vdev)) {
+	ERROR("Cannot start block device\n");
+      }
+      break;
+#endif
+#ifdef NAUT_CONFIG_VIRTIO_CONSOLE
+    case VIRTIO_PCI_CONSOLE:
+      if (virtio_console_init(vdev)) {
+	ERROR("Cannot start console device\n");
+      }
+      break;
+#endif
+    default:
+      break;
+    }
+  }
   
   return 0;
 }
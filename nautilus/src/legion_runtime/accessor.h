@@ -135,6 +135,7 @@ namespace LegionRuntime {
       template <size_t STRIDE> struct AOS;
       template <size_t STRIDE> struct SOA;
       template <size_t STRIDE, size_t BLOCK_SIZE, size_t BLOCK_STRIDE> struct HybridSOA;
+      template <unsigned DIM, size_t STRIDE = 0> struct Affine;
 
       template <typename REDOP> struct ReductionFold;
       template <typename REDOP> struct ReductionList;
@@ -247,6 +248,21 @@ namespace LegionRuntime {
 					 size_t& block_size, size_t& block_stride) const;
 	  bool get_redfold_parameters(void *& base) const;
 	  bool get_redlist_parameters(void *& base, ptr_t *& next_ptr) const;
+
+	  // base is where the origin would be, so that any point of r is at
+	  // base + sum(p[i] * strides[i]); fails unless r is in one piece
+	  template <unsigned DIM>
+	  bool get_affine_parameters(const Rect<DIM>& r, void *& base, ByteOffset *strides) const
+	  {
+	    Rect<DIM> subrect;
+	    char *lo = (char *)const_cast<Untyped *>(this)->raw_rect_ptr<DIM>(r, subrect, strides);
+	    if (!lo || (subrect != r))
+	      return false;
+	    for (unsigned i = 0; i < DIM; i++)
+	      lo -= r.lo[i] * strides[i].offset;
+	    base = lo;
+	    return true;
+	  }
 	};
 
 	// empty class that will have stuff put in it later if T is a struct
@@ -377,6 +393,42 @@ namespace LegionRuntime {
 #if defined(PRIVILEGE_CHECKS) || defined(BOUNDS_CHECKS) 
             result.set_region(region);
 #endif
+#ifdef PRIVILEGE_CHECKS
+            result.set_privileges(priv);
+#endif
+            return result;
+	  }
+
+	  // affine layouts are only affine over some rect, so these take one
+	  template <typename AT, unsigned DIM>
+	  bool can_convert(const Rect<DIM>& r) const {
+	    return can_convert_helper<AT>(static_cast<AT *>(0), r);
+	  }
+
+	  template <typename AT, unsigned DIM>
+	  RegionAccessor<AT, T> convert(const Rect<DIM>& r) const {
+	    return convert_helper<AT>(static_cast<AT *>(0), r);
+	  }
+
+	  template <typename AT, unsigned DIM, size_t STRIDE>
+	  bool can_convert_helper(Affine<DIM, STRIDE> *dummy, const Rect<DIM>& r) const {
+	    void *affine_base = 0;
+	    ByteOffset affine_strides[DIM];
+	    bool ok = get_affine_parameters<DIM>(r, affine_base, affine_strides);
+	    return ok && (!STRIDE || (affine_strides[0].offset == (off_t)STRIDE));
+	  }
+
+	  template <typename AT, unsigned DIM, size_t STRIDE>
+	  RegionAccessor<AT, T> convert_helper(Affine<DIM, STRIDE> *dummy, const Rect<DIM>& r) const {
+	    void *affine_base = 0;
+	    ByteOffset affine_strides[DIM];
+	    bool ok = get_affine_parameters<DIM>(r, affine_base, affine_strides);
+	    assert(ok);
+	    typename AT::template Typed<T, T> t(affine_base, affine_strides);
+            RegionAccessor<AT,T> result(t);
+#if defined(PRIVILEGE_CHECKS) || defined(BOUNDS_CHECKS) 
+            result.set_region(region);
+#endif
 #ifdef PRIVILEGE_CHECKS
             result.set_privileges(priv);
 #endif
@@ -720,6 +772,108 @@ namespace LegionRuntime {
 	};
       };
 
+      // A field laid out affinely over a rect, as a SOA instance is over
+      // any rect it was not cut from.  Elements are found with plain
+      // arithmetic, and a non-zero STRIDE (usually sizeof(T)) fixes the
+      // innermost stride at compile time, so a loop over dimension 0 is
+      // a unit-stride loop over raw memory.  Made with convert(rect) on
+      // a Generic accessor, and only good for points inside that rect.
+      template <unsigned DIM, size_t STRIDE> 
+      struct Affine {
+	struct Untyped : public Stride<STRIDE> {
+          CUDAPREFIX
+	  Untyped() : Stride<STRIDE>(), base(0) {}
+          CUDAPREFIX
+	  Untyped(void *_base, const ByteOffset *_strides)
+	    : Stride<STRIDE>(_strides[0].offset), base((char *)_base)
+	  {
+	    for (unsigned i = 0; i < DIM; i++)
+	      strides[i] = _strides[i];
+	  }
+
+          CUDAPREFIX
+	  inline char *elem_ptr(const Point<DIM>& p) const
+	  {
+	    char *ptr = base + (p[0] * Stride<STRIDE>::value);
+	    for (unsigned i = 1; i < DIM; i++)
+	      ptr += p[i] * strides[i].offset;
+	    return ptr;
+	  }
+
+	  char *base;
+	  ByteOffset strides[DIM];
+#if defined(PRIVILEGE_CHECKS) || defined(BOUNDS_CHECKS)
+        protected:
+          void *region;
+        public:
+          inline void set_region_untyped(void *r) { region = r; }
+#endif
+#ifdef PRIVILEGE_CHECKS
+        protected:
+          AccessorPrivilege priv;
+        public:
+          inline void set_privileges_untyped(AccessorPrivilege p) { priv = p; }
+#endif
+	};
+
+	template <typename T, typename PT>
+	struct Typed : protected Untyped {
+          CUDAPREFIX
+	  Typed() : Untyped() {}
+          CUDAPREFIX
+	  Typed(void *_base, const ByteOffset *_strides) : Untyped(_base, _strides) {}
+
+#if defined(PRIVILEGE_CHECKS) || defined(BOUNDS_CHECKS) 
+          inline void set_region(void *r) { this->region = r; }
+#endif
+#ifdef PRIVILEGE_CHECKS
+          inline void set_privileges(AccessorPrivilege p) { this->priv = p; }
+#endif
+
+          CUDAPREFIX
+	  inline T read(const Point<DIM>& p) const 
+          { 
+#ifdef PRIVILEGE_CHECKS
+            check_privileges<ACCESSOR_READ>(this->template priv, this->template region);
+#endif
+            return *(const T *)(Untyped::elem_ptr(p)); 
+          }
+          CUDAPREFIX
+	  inline void write(const Point<DIM>& p, const T& newval) const 
+          { 
+#ifdef PRIVILEGE_CHECKS
+            check_privileges<ACCESSOR_WRITE>(this->template priv, this->template region);
+#endif
+            *(T *)(Untyped::elem_ptr(p)) = newval; 
+          }
+          CUDAPREFIX
+	  inline T *ptr(const Point<DIM>& p) const 
+          { 
+            return (T *)Untyped::elem_ptr(p); 
+          }
+          CUDAPREFIX
+          inline T& ref(const Point<DIM>& p) const 
+          { 
+            return *((T *)Untyped::elem_ptr(p)); 
+          }
+          // in bytes, for walking the outer dimensions by hand
+          CUDAPREFIX
+          inline off_t stride(int dim) const
+          {
+            return dim ? this->strides[dim].offset : Stride<STRIDE>::value;
+          }
+
+	  template<typename REDOP> CUDAPREFIX
+	  inline void reduce(const Point<DIM>& p, typename REDOP::RHS newval) const
+	  {
+#ifdef PRIVILEGE_CHECKS
+            check_privileges<ACCESSOR_REDUCE>(this->template priv, this->template region);
+#endif
+	    REDOP::template apply<false>(*(T *)Untyped::elem_ptr(p), newval);
+	  }
+	};
+      };
+
       template <size_t STRIDE, size_t BLOCK_SIZE, size_t BLOCK_STRIDE> 
       struct HybridSOA {
 	struct Untyped : public Stride<STRIDE>, public BlockSize<BLOCK_SIZE>, public BlockStride<BLOCK_STRIDE> {
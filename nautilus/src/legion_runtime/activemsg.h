@@ -19,11 +19,15 @@
 #ifndef ACTIVEMSG_H
 #define ACTIVEMSG_H
 
+#ifdef NAUT_CONFIG_LEGION_RT_SHM_AM
+#include "nk_gasnet.h"
+#else
 #define GASNET_PAR
 #include <gasnet.h>
 
 #define GASNETT_THREAD_SAFE
 #include <gasnet_tools.h>
+#endif
 
 #ifdef CHECK_REENTRANT_MESSAGES
 GASNETT_THREADKEY_DECLARE(in_handler);
@@ -16,7 +16,9 @@
 
 #include "alt_mappers.h"
 #include "utilities.h"
+#include "legion_utilities.h"
 #include <cstdlib>
+#include <algorithm>
 
 namespace LegionRuntime {
   namespace HighLevel {
@@ -305,6 +307,119 @@ namespace LegionRuntime {
         create_one = true;
       }
     }
+
+    //////////////////////////////////////
+    // NUMA Aware Mapper 
+    //////////////////////////////////////
+
+    Logger::Category log_numa("numamapper");
+
+    /*static*/ std::map<LogicalRegion,Memory> NumaAwareMapper::region_homes;
+    /*static*/ Reservation NumaAwareMapper::homes_lock = Reservation::NO_RESERVATION;
+
+    //--------------------------------------------------------------------------------------------
+    NumaAwareMapper::NumaAwareMapper(Machine *m, HighLevelRuntime *rt, Processor local)
+      : DefaultMapper(m,rt,local)
+    //--------------------------------------------------------------------------------------------
+    {
+      log_numa(LEVEL_SPEW,"Initializing the NUMA aware mapper on processor %x",local_proc.id);
+      // Mappers are all made by the registration callback, one at a time
+      if (!homes_lock.exists())
+        homes_lock = Reservation::create_reservation();
+    }
+
+    //--------------------------------------------------------------------------------------------
+    unsigned NumaAwareMapper::memory_distance(Processor p, Memory m) const
+    //--------------------------------------------------------------------------------------------
+    {
+      int proc_domain = machine->get_numa_domain(p);
+      int mem_domain = machine->get_numa_domain(m);
+      // A memory that is not tied to a domain is as good as local
+      if ((proc_domain < 0) || (mem_domain < 0))
+        return 10;
+      return machine->get_numa_distance(proc_domain, mem_domain);
+    }
+
+    //--------------------------------------------------------------------------------------------
+    unsigned NumaAwareMapper::placement_cost(const Task *task, Processor p)
+    //--------------------------------------------------------------------------------------------
+    {
+      unsigned cost = 0;
+      AutoLock h_lock(homes_lock);
+      for (unsigned idx = 0; idx < task->regions.size(); idx++)
+      {
+        std::map<LogicalRegion,Memory>::const_iterator finder = 
+          region_homes.find(task->regions[idx].region);
+        if (finder != region_homes.end())
+          cost += memory_distance(p, finder->second);
+      }
+      return cost;
+    }
+
+    //--------------------------------------------------------------------------------------------
+    void NumaAwareMapper::select_task_options(Task *task)
+    //--------------------------------------------------------------------------------------------
+    {
+      DefaultMapper::select_task_options(task);
+      if (task->regions.empty())
+        return;
+      // Of the processors of the kind the default mapper picked, take
+      // the one closest to the data, keeping its pick on a tie
+      Processor::Kind kind = machine->get_processor_kind(task->target_proc);
+      Processor best = task->target_proc;
+      unsigned best_cost = placement_cost(task, best);
+      const std::set<Processor> &all_procs = machine->get_all_processors();
+      for (std::set<Processor>::const_iterator it = all_procs.begin();
+            it != all_procs.end(); it++)
+      {
+        if (machine->get_processor_kind(*it) != kind)
+          continue;
+        unsigned cost = placement_cost(task, *it);
+        if (cost < best_cost)
+        {
+          best = *it;
+          best_cost = cost;
+        }
+      }
+      log_numa(LEVEL_DEBUG,"Task %s (ID %lld) goes to processor %x (cost %d)",
+          task->variants->name, task->get_unique_task_id(), best.id, best_cost);
+      task->target_proc = best;
+    }
+
+    //--------------------------------------------------------------------------------------------
+    bool NumaAwareMapper::map_task(Task *task)
+    //--------------------------------------------------------------------------------------------
+    {
+      DefaultMapper::map_task(task);
+      // Keep the default order within a domain, but nearer domains first
+      NearerMemory nearer(this, task->target_proc);
+      for (unsigned idx = 0; idx < task->regions.size(); idx++)
+      {
+        if (task->regions[idx].restricted)
+          continue;
+        std::vector<Memory> &ranking = task->regions[idx].target_ranking;
+        std::stable_sort(ranking.begin(), ranking.end(), nearer);
+      }
+      // We want to hear where the instances ended up
+      return true;
+    }
+
+    //--------------------------------------------------------------------------------------------
+    void NumaAwareMapper::notify_mapping_result(const Mappable *mappable)
+    //--------------------------------------------------------------------------------------------
+    {
+      if (mappable->get_mappable_kind() == Mappable::TASK_MAPPABLE)
+      {
+        const Task *task = mappable->as_mappable_task();
+        AutoLock h_lock(homes_lock);
+        for (unsigned idx = 0; idx < task->regions.size(); idx++)
+        {
+          if (task->regions[idx].selected_memory.exists())
+            region_homes[task->regions[idx].region] = task->regions[idx].selected_memory;
+        }
+      }
+      DefaultMapper::notify_mapping_result(mappable);
+    }
   }; // namespace HighLevel
 }; // namespace LegionRuntime
 
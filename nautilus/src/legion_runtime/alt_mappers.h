@@ -102,6 +102,37 @@ namespace LegionRuntime {
                                     std::vector<Memory> &to_create,
                                     bool &create_one);
     };
+
+    // A mapper that uses the NUMA topology of the machine
+    // to send tasks to processors in the domain that holds
+    // the instances they used last, and to rank memories
+    // in the target's own domain ahead of remote ones
+    class NumaAwareMapper : public DefaultMapper {
+    public:
+      NumaAwareMapper(Machine *m, HighLevelRuntime *rt, Processor local);
+    public:
+      virtual void select_task_options(Task *task);
+      virtual bool map_task(Task *task);
+      virtual void notify_mapping_result(const Mappable *mappable);
+    protected:
+      unsigned memory_distance(Processor p, Memory m) const;
+      unsigned placement_cost(const Task *task, Processor p);
+      // Orders memories by their distance from one processor
+      class NearerMemory {
+      public:
+        NearerMemory(const NumaAwareMapper *m, Processor p) : mapper(m), proc(p) { }
+        bool operator()(Memory a, Memory b) const
+        { return (mapper->memory_distance(proc, a) < mapper->memory_distance(proc, b)); }
+      protected:
+        const NumaAwareMapper *mapper;
+        Processor proc;
+      };
+    protected:
+      // Where each region's instance was last placed, shared by
+      // the mappers of all the processors
+      static std::map<LogicalRegion,Memory> region_homes;
+      static Reservation homes_lock;
+    };
   };
 };
 
@@ -23,6 +23,7 @@
 #define STATIC_MAX_PERMITTED_STEALS   4
 #define STATIC_MAX_STEAL_COUNT        2
 #define STATIC_SPLIT_FACTOR           2
+#define STATIC_NUMA_SLICING           true
 #define STATIC_BREADTH_FIRST          false
 #define STATIC_WAR_ENABLED            false 
 #define STATIC_STEALING_ENABLED       false
@@ -46,6 +47,7 @@ namespace LegionRuntime {
         max_steals_per_theft(STATIC_MAX_PERMITTED_STEALS),
         max_steal_count(STATIC_MAX_STEAL_COUNT),
         splitting_factor(STATIC_SPLIT_FACTOR),
+        numa_slicing(STATIC_NUMA_SLICING),
         breadth_first_traversal(STATIC_BREADTH_FIRST),
         war_enabled(STATIC_WAR_ENABLED),
         stealing_enabled(STATIC_STEALING_ENABLED),
@@ -78,6 +80,7 @@ namespace LegionRuntime {
           INT_ARG("-dm:thefts", max_steals_per_theft);
           INT_ARG("-dm:count", max_steal_count);
           INT_ARG("-dm:split", splitting_factor);
+          BOOL_ARG("-dm:numa", numa_slicing);
           BOOL_ARG("-dm:war", war_enabled);
           BOOL_ARG("-dm:steal", stealing_enabled);
           BOOL_ARG("-dm:bft", breadth_first_traversal);
@@ -367,6 +370,35 @@ namespace LegionRuntime {
       machine_interface.filter_processors(machine, best_kind, all_procs);
       std::vector<Processor> procs(all_procs.begin(),all_procs.end());
 
+      if (numa_slicing && (machine->get_numa_domain_count() > 1))
+      {
+        // The slicer on the launching node only cuts the domain into a
+        // share per node, and sends every other share to be sliced over
+        // its own cores by a processor there.  So that is what we are
+        // doing if this is not the launching node.
+        int home_node = machine->get_numa_domain(task->orig_proc);
+        int local_node = machine->get_numa_domain(local_proc);
+        if (local_node != home_node)
+        {
+          std::vector<Processor> node_procs;
+          for (std::vector<Processor>::const_iterator it = procs.begin();
+                it != procs.end(); it++)
+          {
+            if (machine->get_numa_domain(*it) == local_node)
+              node_procs.push_back(*it);
+          }
+          if (!node_procs.empty())
+          {
+            DefaultMapper::decompose_index_space(domain, node_procs,
+                                                 splitting_factor, slices);
+            return;
+          }
+        }
+        DefaultMapper::decompose_by_numa_node(domain, procs, home_node,
+                                      machine, splitting_factor, slices);
+        return;
+      }
+
       DefaultMapper::decompose_index_space(domain, procs, 
                                            splitting_factor, slices);
     }
@@ -844,6 +876,87 @@ namespace LegionRuntime {
       }
     }
 
+    template <unsigned DIM>
+    static void numa_block_assign(const Domain &domain,
+                     const std::map<int,std::vector<Processor> > &node_procs,
+                                  int home_node, unsigned splitting_factor,
+                                  std::vector<Mapper::DomainSplit> &slices)
+    {
+      Arrays::Rect<DIM> r = domain.get_rect<DIM>();
+      // Cut along the longest dimension, giving each node 
+      // a block in proportion to its processors
+      unsigned dim = 0;
+      for (unsigned i = 1; i < DIM; i++)
+      {
+        if ((r.hi.x[i] - r.lo.x[i]) > (r.hi.x[dim] - r.lo.x[dim]))
+          dim = i;
+      }
+      long extent = r.hi.x[dim] - r.lo.x[dim] + 1;
+      size_t total = 0;
+      for (std::map<int,std::vector<Processor> >::const_iterator it = 
+            node_procs.begin(); it != node_procs.end(); it++)
+        total += it->second.size();
+      size_t before = 0;
+      for (std::map<int,std::vector<Processor> >::const_iterator it = 
+            node_procs.begin(); it != node_procs.end(); it++)
+      {
+        long start = r.lo.x[dim] + (extent * before) / total;
+        before += it->second.size();
+        long stop = r.lo.x[dim] + (extent * before) / total;
+        // Fewer rows than nodes leaves some nodes out
+        if (start == stop)
+          continue;
+        Arrays::Rect<DIM> block(r);
+        block.lo.x[dim] = start;
+        block.hi.x[dim] = stop - 1;
+        Domain sub = Domain::from_rect<DIM>(block);
+        if (it->first == home_node)
+          DefaultMapper::decompose_index_space(sub, it->second, 
+                                               splitting_factor, slices);
+        else
+          slices.push_back(Mapper::DomainSplit(sub, it->second[0],
+                               true /* recurse */, false /* stealable */));
+      }
+    }
+
+    //--------------------------------------------------------------------------
+    /*static*/ void DefaultMapper::decompose_by_numa_node(
+                                          const Domain &domain,
+                                          const std::vector<Processor> &targets,
+                                          int home_node, Machine *machine,
+                                          unsigned splitting_factor,
+                                      std::vector<Mapper::DomainSplit> &slices)
+    //--------------------------------------------------------------------------
+    {
+      std::map<int,std::vector<Processor> > node_procs;
+      for (std::vector<Processor>::const_iterator it = targets.begin();
+            it != targets.end(); it++)
+        node_procs[machine->get_numa_domain(*it)].push_back(*it);
+      // Unstructured index spaces and single nodes are sliced flat
+      if (node_procs.size() > 1)
+      {
+        switch (domain.get_dim())
+        {
+          case 1:
+            numa_block_assign<1>(domain, node_procs, home_node,
+                                 splitting_factor, slices);
+            return;
+          case 2:
+            numa_block_assign<2>(domain, node_procs, home_node,
+                                 splitting_factor, slices);
+            return;
+          case 3:
+            numa_block_assign<3>(domain, node_procs, home_node,
+                                 splitting_factor, slices);
+            return;
+          default:
+            break;
+        }
+      }
+      DefaultMapper::decompose_index_space(domain, targets, 
+                                           splitting_factor, slices);
+    }
+
     //--------------------------------------------------------------------------
     /*static*/ void DefaultMapper::decompose_index_space(const Domain &domain, 
                                           const std::vector<Processor> &targets,
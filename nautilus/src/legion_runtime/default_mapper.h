@@ -102,6 +102,14 @@ namespace LegionRuntime {
                               const std::vector<Processor> &targets,
                               unsigned splitting_factor, 
                               std::vector<Mapper::DomainSplit> &slice);
+      // Break a domain into a block per NUMA node, slicing the block of 
+      // home_node over its processors here and sending each other block
+      // to one of its node's processors to be sliced there
+      static void decompose_by_numa_node(const Domain &domain,
+                              const std::vector<Processor> &targets,
+                              int home_node, Machine *machine,
+                              unsigned splitting_factor,
+                              std::vector<Mapper::DomainSplit> &slices);
     protected:
       const Processor local_proc;
       const Processor::Kind local_kind;
@@ -117,6 +125,10 @@ namespace LegionRuntime {
       // difference pieces
       // Controlled by -dm:split
       unsigned splitting_factor;
+      // Slice index spaces by NUMA node first and then by core within
+      // each node, the second step done on the node itself
+      // Controlled by -dm:numa
+      bool numa_slicing;
       // Do a breadth-first traversal of the task tree, by default we do
       // a depth-first traversal to improve locality
       bool breadth_first_traversal;
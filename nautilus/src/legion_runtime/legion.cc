@@ -19,6 +19,7 @@
 #include "legion_ops.h"
 #include "legion_logging.h"
 #include "legion_profiling.h"
+#include "legion_spy.h"
 
 namespace LegionRuntime {
   namespace HighLevel {
@@ -35,7 +36,11 @@ namespace LegionRuntime {
     Logger::Category log_allocation("allocation");
 #ifdef LEGION_SPY
     namespace LegionSpy {
+#ifdef NAUT_CONFIG_LEGION_RT_SPY_BINARY
+      BinaryLogger log_spy;
+#else
       Logger::Category log_spy("legion_spy");
+#endif
     };
 #endif
 
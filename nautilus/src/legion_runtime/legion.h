@@ -2415,6 +2415,21 @@ namespace LegionRuntime {
       virtual void handle_message(Processor source,
                                   const void *message, size_t length) = 0;
 
+      /**
+       * ----------------------------------------------------------------------
+       *  Reserve Processor
+       * ----------------------------------------------------------------------
+       * Ask for a real-time reservation for the thread behind a local
+       * processor.  Called once for each local processor after the
+       * registration callback, on its default mapper.  The default
+       * implementation asks for nothing.
+       * @param target the processor to be reserved for
+       * @param hint the reservation to fill in
+       * @return true if the hint should be used
+       */
+      virtual bool reserve_processor(Processor target,
+                                     Processor::RTHint &hint) { return false; }
+
       //------------------------------------------------------------------------
       // All methods below here are methods that are already implemented
       // and serve as an interface for inheriting mapper classes to 
@@ -237,6 +237,15 @@ namespace LegionRuntime {
       NAUTILUS_DEEP_DEBUG("initialize operation\n");
     }
 
+    //--------------------------------------------------------------------------
+    bool Operation::get_dependence_footprint(
+                           std::vector<const RegionRequirement*> &reqs) const
+    //--------------------------------------------------------------------------
+    {
+      // By default we don't know what the analysis touches
+      return false;
+    }
+
     //--------------------------------------------------------------------------
     void Operation::trigger_dependence_analysis(void)
     //--------------------------------------------------------------------------
@@ -1809,6 +1818,15 @@ namespace LegionRuntime {
       return "Mapping";
     }
 
+    //--------------------------------------------------------------------------
+    bool MapOp::get_dependence_footprint(
+                           std::vector<const RegionRequirement*> &reqs) const
+    //--------------------------------------------------------------------------
+    {
+      reqs.push_back(&requirement);
+      return true;
+    }
+
     //--------------------------------------------------------------------------
     void MapOp::trigger_dependence_analysis(void)
     //--------------------------------------------------------------------------
@@ -2556,6 +2574,18 @@ namespace LegionRuntime {
       return "Copy";
     }
 
+    //--------------------------------------------------------------------------
+    bool CopyOp::get_dependence_footprint(
+                           std::vector<const RegionRequirement*> &reqs) const
+    //--------------------------------------------------------------------------
+    {
+      for (unsigned idx = 0; idx < src_requirements.size(); idx++)
+        reqs.push_back(&src_requirements[idx]);
+      for (unsigned idx = 0; idx < dst_requirements.size(); idx++)
+        reqs.push_back(&dst_requirements[idx]);
+      return true;
+    }
+
     //--------------------------------------------------------------------------
     void CopyOp::trigger_dependence_analysis(void)
     //--------------------------------------------------------------------------
@@ -67,6 +67,7 @@ namespace LegionRuntime {
       inline bool is_tracing(void) const { return tracing; }
       inline bool already_traced(void) const 
         { return ((trace != NULL) && !tracing); }
+      inline LegionTrace* get_trace(void) const { return trace; }
     public:
       // Be careful using this call as it is only valid when the operation
       // actually has a parent task.  Right now the only place it is used
@@ -102,6 +103,12 @@ namespace LegionRuntime {
       // provide base versions of them so that operations
       // only have to overload the stages that they care
       // about modifying.
+      // The region requirements the dependence analysis will
+      // traverse, used to run the analyses of operations that cannot
+      // interfere in parallel.  Return false if the analysis touches
+      // anything else and must be serialized with its neighbors.
+      virtual bool get_dependence_footprint(
+                          std::vector<const RegionRequirement*> &reqs) const;
       // The function to call for depence analysis
       virtual void trigger_dependence_analysis(void);
       // The function to call when the operation is ready to map 
@@ -432,6 +439,8 @@ namespace LegionRuntime {
       virtual void deactivate(void);
       virtual const char* get_logging_name(void);
     public:
+      virtual bool get_dependence_footprint(
+                          std::vector<const RegionRequirement*> &reqs) const;
       virtual void trigger_dependence_analysis(void);
       virtual bool trigger_execution(void);
     public:
@@ -477,6 +486,8 @@ namespace LegionRuntime {
       virtual void deactivate(void);
       virtual const char* get_logging_name(void);
     public:
+      virtual bool get_dependence_footprint(
+                          std::vector<const RegionRequirement*> &reqs) const;
       virtual void trigger_dependence_analysis(void);
       virtual bool trigger_execution(void);
       virtual void deferred_complete(void);
@@ -25,6 +25,12 @@
 #include <cassert>
 #include <deque>
 
+#ifdef NAUT_CONFIG_LEGION_RT_TRACE_PROF
+// Events go straight into the per-CPU trace rings with a TSC
+// timestamp instead of being queued here and logged at the end
+#include <nautilus/trace.h>
+#endif
+
 namespace LegionRuntime {
   namespace HighLevel {
 
@@ -266,9 +272,14 @@ namespace LegionRuntime {
       {
         if (profiling_enabled)
         {
+#ifdef NAUT_CONFIG_LEGION_RT_TRACE_PROF
+          NK_TRACE(NK_TRACE_LEGION + kind,
+                   Machine::get_executing_processor().local_id(), uid, 0);
+#else
           unsigned long long time = TimeStamp::get_current_time_in_micros();
           Processor proc = Machine::get_executing_processor();
           get_profiler(proc).add_event(ProfilingEvent(kind, uid, time));
+#endif
         }
       }
 
@@ -277,8 +288,14 @@ namespace LegionRuntime {
       {
         if (profiling_enabled)
         {
+#ifdef NAUT_CONFIG_LEGION_RT_TRACE_PROF
+          // a record has no room for the point
+          NK_TRACE(NK_TRACE_LEGION_TASK,
+                   Machine::get_executing_processor().local_id(), uid, tid);
+#else
           Processor proc = Machine::get_executing_processor();
           get_profiler(proc).add_task(TaskInstance(tid, uid, point));
+#endif
         }
       }
 
@@ -286,8 +303,13 @@ namespace LegionRuntime {
       {
         if (profiling_enabled)
         {
+#ifdef NAUT_CONFIG_LEGION_RT_TRACE_PROF
+          NK_TRACE(NK_TRACE_LEGION_MAP,
+                   Machine::get_executing_processor().local_id(), uid, pid);
+#else
           Processor proc = Machine::get_executing_processor();
           get_profiler(proc).add_map(OpInstance(uid, pid));
+#endif
         }
       }
 
@@ -295,8 +317,13 @@ namespace LegionRuntime {
       {
         if (profiling_enabled)
         {
+#ifdef NAUT_CONFIG_LEGION_RT_TRACE_PROF
+          NK_TRACE(NK_TRACE_LEGION_CLOSE,
+                   Machine::get_executing_processor().local_id(), uid, pid);
+#else
           Processor proc = Machine::get_executing_processor();
           get_profiler(proc).add_close(OpInstance(uid, pid));
+#endif
         }
       }
 
@@ -304,8 +331,13 @@ namespace LegionRuntime {
       {
         if (profiling_enabled)
         {
+#ifdef NAUT_CONFIG_LEGION_RT_TRACE_PROF
+          NK_TRACE(NK_TRACE_LEGION_COPY,
+                   Machine::get_executing_processor().local_id(), uid, pid);
+#else
           Processor proc = Machine::get_executing_processor();
           get_profiler(proc).add_copy(OpInstance(uid, pid));
+#endif
         }
       }
 
@@ -315,10 +347,17 @@ namespace LegionRuntime {
       {
         if (profiling_enabled)
         {
+#ifdef NAUT_CONFIG_LEGION_RT_TRACE_PROF
+          // nor for the layout, only where the instance lives
+          NK_TRACE(NK_TRACE_LEGION_INST_CREATE,
+                   Machine::get_executing_processor().local_id(),
+                   inst_id, memory);
+#else
           unsigned long long time = TimeStamp::get_current_time_in_micros();
           Processor proc = Machine::get_executing_processor();
           get_profiler(proc).add_event(MemoryEvent(inst_id, memory, 
                                         redop, blocking_factor, fields, time));
+#endif
         }
       }
 
@@ -326,15 +365,23 @@ namespace LegionRuntime {
       {
         if (profiling_enabled)
         {
+#ifdef NAUT_CONFIG_LEGION_RT_TRACE_PROF
+          NK_TRACE(NK_TRACE_LEGION_INST_DESTROY,
+                   Machine::get_executing_processor().local_id(), inst_id, 0);
+#else
           unsigned long long time = TimeStamp::get_current_time_in_micros();
           Processor proc = Machine::get_executing_processor();
           get_profiler(proc).add_event(MemoryEvent(inst_id, time));
+#endif
         }
       }
 
       static inline void enable_profiling(void)
       {
         profiling_enabled = true;        
+#ifdef NAUT_CONFIG_LEGION_RT_TRACE_PROF
+        nk_trace_enable(1);
+#endif
       }
 
       static inline void disable_profiling(void)
@@ -350,6 +397,11 @@ namespace LegionRuntime {
           if (proc.exists())
             finalize_processor(proc);
         }
+#ifdef NAUT_CONFIG_LEGION_RT_TRACE_PROF
+        // the events themselves, with the scheduler's around them
+        nk_trace_enable(0);
+        nk_trace_dump();
+#endif
       }
 
     };
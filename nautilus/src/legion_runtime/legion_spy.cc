@@ -19,6 +19,20 @@
 #include "legion_spy.h"
 #include "runtime.h"
 
+#ifdef NAUT_CONFIG_LEGION_RT_SPY_BINARY
+#include <cstdarg>
+#define __LEGION__
+#include <nautilus/thread.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/condvar.h>
+extern "C" {
+#include <dev/serial.h>
+#ifdef NAUT_CONFIG_HRT_RINGS
+#include <arch/hrt/hrt_ring.h>
+#endif
+}
+#endif
+
 namespace LegionRuntime {
   namespace HighLevel {
 
@@ -259,6 +273,378 @@ namespace LegionRuntime {
       }
     }
 
+#ifdef NAUT_CONFIG_LEGION_RT_SPY_BINARY
+    namespace LegionSpy {
+
+      // The stream is a sequence of frames, each a type, a length and
+      // that many bytes.  A format frame gives a format string its id,
+      // ahead of any records using it.  A records frame holds records
+      // logged by one processor, each a 16-bit format id followed by its
+      // arguments: integers as 8 bytes, strings as a 16-bit length and
+      // the bytes.  Everything is little endian.  Over serial the stream
+      // goes out as hex on lines starting with SPY_SERIAL_TAG, so that it
+      // can be picked out of the console output.
+      enum {
+        SPY_FRAME_FORMAT  = 0x46595053, // "SPYF"
+        SPY_FRAME_RECORDS = 0x52595053  // "SPYR"
+      };
+#define SPY_SERIAL_TAG      "SPYB "
+#define SPY_MAX_FORMATS     256
+#define SPY_MAX_ARGS        16
+#define SPY_MAX_RECORD      1024
+#define SPY_MAX_STRING      255
+#define SPY_FLUSH_NS        10000000ULL   // 10 ms
+#define SPY_RING_SIZE       (NAUT_CONFIG_LEGION_RT_SPY_BINARY_BUF_KB * 1024ULL)
+
+      enum SpyArg {
+        SPY_ARG_INT,
+        SPY_ARG_LONG,
+        SPY_ARG_LONG_LONG,
+        SPY_ARG_SIZE,
+        SPY_ARG_PTR,
+        SPY_ARG_STRING
+      };
+
+      struct SpyFormat {
+        const char *volatile fmt; // set last, so a match means the rest is there
+        unsigned id;
+        unsigned num_args;
+        unsigned char args[SPY_MAX_ARGS];
+      };
+
+      // One per logging thread, written by it and drained by the flusher.
+      // head and tail are free-running byte counts, head only ever moves
+      // past whole records.
+      struct SpyRing {
+        SpyRing *next;
+        unsigned long long proc;
+        volatile unsigned long long head;
+        volatile unsigned long long tail;
+        unsigned char data[SPY_RING_SIZE];
+      };
+
+      static struct {
+        volatile int state; // 0 not started, 1 starting, 2 running
+        nk_tls_key_t ring_key;
+        spinlock_t lock;          // for rings and format registration
+        SpyRing *rings;
+        SpyFormat formats[SPY_MAX_FORMATS];
+        volatile unsigned num_formats;
+        unsigned formats_sent;    // only touched by whoever holds drain_lock
+        NK_LOCK_T drain_lock;
+        NK_LOCK_T wait_lock;
+        nk_condvar_t wait_cond;
+#ifdef NAUT_CONFIG_HRT_RINGS
+        struct nk_hrt_ring *host;
+#endif
+      } spy;
+
+      static void spy_flusher(void *in, void **out);
+
+      static void spy_start(void)
+      {
+        if (__sync_bool_compare_and_swap(&spy.state, 0, 1))
+        {
+          nk_tls_key_create(&spy.ring_key, NULL);
+          spinlock_init(&spy.lock);
+          NK_LOCK_INIT(&spy.drain_lock);
+          NK_LOCK_INIT(&spy.wait_lock);
+          nk_condvar_init(&spy.wait_cond);
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+          rt_constraints c;
+          memset(&c, 0, sizeof(c));
+          nk_thread_start(spy_flusher, NULL, NULL, 1, TSTACK_1MB, NULL,
+                          CPU_ANY, APERIODIC, &c, 0);
+#else
+          nk_thread_start(spy_flusher, NULL, NULL, 1, TSTACK_1MB, NULL, CPU_ANY);
+#endif
+          __sync_synchronize();
+          spy.state = 2;
+        }
+        while (spy.state != 2)
+          nk_yield();
+      }
+
+      static SpyRing* spy_ring(void)
+      {
+        if (spy.state != 2)
+          spy_start();
+        SpyRing *ring = (SpyRing*)nk_tls_get(spy.ring_key);
+        if (ring == NULL)
+        {
+          ring = (SpyRing*)malloc(sizeof(SpyRing));
+          assert(ring != NULL);
+          ring->proc = Machine::get_executing_processor().id;
+          ring->head = 0;
+          ring->tail = 0;
+          uint8_t flags = spin_lock_irq_save(&spy.lock);
+          ring->next = spy.rings;
+          spy.rings = ring;
+          spin_unlock_irq_restore(&spy.lock, flags);
+          nk_tls_set(spy.ring_key, ring);
+        }
+        return ring;
+      }
+
+      // Work out the arguments of a format once, when it is first seen
+      static const SpyFormat* spy_format(const char *fmt)
+      {
+        unsigned hash = (unsigned)(((unsigned long)fmt >> 3) % SPY_MAX_FORMATS);
+        for (unsigned idx = 0; idx < SPY_MAX_FORMATS; idx++)
+        {
+          SpyFormat *f = &spy.formats[(hash + idx) % SPY_MAX_FORMATS];
+          if (f->fmt == fmt)
+            return f;
+          if (f->fmt == NULL)
+            break;
+        }
+
+        const SpyFormat *result = NULL;
+        uint8_t flags = spin_lock_irq_save(&spy.lock);
+        for (unsigned idx = 0; idx < SPY_MAX_FORMATS; idx++)
+        {
+          SpyFormat *f = &spy.formats[(hash + idx) % SPY_MAX_FORMATS];
+          if (f->fmt == fmt)
+          {
+            result = f;
+            break;
+          }
+          if (f->fmt != NULL)
+            continue;
+          f->id = spy.num_formats;
+          f->num_args = 0;
+          for (const char *p = fmt; *p; p++)
+          {
+            if (*p != '%')
+              continue;
+            if (*++p == '%')
+              continue;
+            while (*p && strchr("-+ #0123456789.", *p))
+              p++;
+            unsigned longs = 0;
+            bool size = false;
+            for (; *p == 'l' || *p == 'z' || *p == 'h'; p++)
+            {
+              if (*p == 'l')
+                longs++;
+              else if (*p == 'z')
+                size = true;
+            }
+            if (!*p)
+              break;
+            assert(f->num_args < SPY_MAX_ARGS);
+            unsigned char arg;
+            if (*p == 's')
+              arg = SPY_ARG_STRING;
+            else if (*p == 'p')
+              arg = SPY_ARG_PTR;
+            else if (size)
+              arg = SPY_ARG_SIZE;
+            else
+              arg = (longs == 0) ? SPY_ARG_INT : 
+                    (longs == 1) ? SPY_ARG_LONG : SPY_ARG_LONG_LONG;
+            f->args[f->num_args++] = arg;
+          }
+          __sync_synchronize();
+          f->fmt = fmt;
+          spy.num_formats++;
+          result = f;
+          break;
+        }
+        spin_unlock_irq_restore(&spy.lock, flags);
+        if (result == NULL)
+          printk("Legion Spy: more than %d formats, dropping \"%s\"\n",
+                 SPY_MAX_FORMATS, fmt);
+        return result;
+      }
+
+      void BinaryLogger::operator()(int level, const char *fmt, ...)
+      {
+        if (level < COMPILE_TIME_MIN_LEVEL)
+          return;
+        SpyRing *ring = spy_ring();
+        const SpyFormat *f = spy_format(fmt);
+        if (f == NULL)
+          return;
+
+        unsigned char record[SPY_MAX_RECORD];
+        unsigned len = 0;
+        record[len++] = f->id & 0xff;
+        record[len++] = f->id >> 8;
+        va_list args;
+        va_start(args, fmt);
+        for (unsigned idx = 0; idx < f->num_args; idx++)
+        {
+          unsigned long long value;
+          switch (f->args[idx])
+          {
+            case SPY_ARG_STRING:
+              {
+                const char *str = va_arg(args, const char*);
+                size_t slen = (str == NULL) ? 0 : strlen(str);
+                if (slen > SPY_MAX_STRING)
+                  slen = SPY_MAX_STRING;
+                record[len++] = slen & 0xff;
+                record[len++] = slen >> 8;
+                memcpy(record + len, str, slen);
+                len += slen;
+                continue;
+              }
+            // sign extended, the converter knows which are unsigned
+            case SPY_ARG_INT:
+              value = (long long)va_arg(args, int);
+              break;
+            case SPY_ARG_LONG:
+              value = (long long)va_arg(args, long);
+              break;
+            case SPY_ARG_SIZE:
+              value = va_arg(args, size_t);
+              break;
+            case SPY_ARG_PTR:
+              value = (unsigned long)va_arg(args, void*);
+              break;
+            default:
+              value = va_arg(args, unsigned long long);
+              break;
+          }
+          for (unsigned b = 0; b < 8; b++)
+            record[len++] = (value >> (8*b)) & 0xff;
+        }
+        va_end(args);
+
+        // Wait for the flusher if the ring is full
+        while ((SPY_RING_SIZE - (ring->head - ring->tail)) < len)
+        {
+          nk_condvar_signal(&spy.wait_cond);
+          nk_yield();
+        }
+        unsigned long long at = ring->head % SPY_RING_SIZE;
+        unsigned first = (len < (SPY_RING_SIZE - at)) ? len : 
+                                                   (unsigned)(SPY_RING_SIZE - at);
+        memcpy(ring->data + at, record, first);
+        memcpy(ring->data, record + first, len - first);
+        __sync_synchronize();
+        ring->head += len;
+        // Wake the flusher early once it has half a ring to do
+        if ((ring->head - ring->tail) > (SPY_RING_SIZE / 2))
+          nk_condvar_signal(&spy.wait_cond);
+      }
+
+      static void spy_write(const void *buf, size_t len)
+      {
+#ifdef NAUT_CONFIG_HRT_RINGS
+        if (spy.host == NULL)
+          spy.host = nk_hrt_ring_open("legion-spy", 0);
+        if (spy.host != NULL)
+        {
+          nk_hrt_ring_write(spy.host, buf, len);
+          return;
+        }
+#endif
+        static const char hex[] = "0123456789abcdef";
+        const unsigned char *bytes = (const unsigned char*)buf;
+        char line[sizeof(SPY_SERIAL_TAG) + 2*64 + 1];
+        while (len > 0)
+        {
+          size_t n = (len < 64) ? len : 64;
+          char *p = line + sizeof(SPY_SERIAL_TAG) - 1;
+          memcpy(line, SPY_SERIAL_TAG, sizeof(SPY_SERIAL_TAG) - 1);
+          for (size_t idx = 0; idx < n; idx++)
+          {
+            *p++ = hex[bytes[idx] >> 4];
+            *p++ = hex[bytes[idx] & 0xf];
+          }
+          *p++ = '\n';
+          *p = '\0';
+          serial_write(line);
+          bytes += n;
+          len -= n;
+        }
+      }
+
+      static void spy_frame(unsigned type, unsigned len)
+      {
+        unsigned char header[8];
+        for (unsigned b = 0; b < 4; b++)
+        {
+          header[b] = (type >> (8*b)) & 0xff;
+          header[4+b] = (len >> (8*b)) & 0xff;
+        }
+        spy_write(header, sizeof(header));
+      }
+
+      // Always called holding drain_lock
+      static void spy_drain(void)
+      {
+        uint8_t flags = spin_lock_irq_save(&spy.lock);
+        SpyRing *rings = spy.rings;
+        spin_unlock_irq_restore(&spy.lock, flags);
+        for (SpyRing *ring = rings; ring != NULL; ring = ring->next)
+        {
+          unsigned long long head = ring->head;
+          unsigned long long tail = ring->tail;
+          if (head == tail)
+            continue;
+          __sync_synchronize();
+          // Formats go out before any record that uses them
+          while (spy.formats_sent < spy.num_formats)
+          {
+            for (unsigned idx = 0; idx < SPY_MAX_FORMATS; idx++)
+            {
+              const SpyFormat *f = &spy.formats[idx];
+              if ((f->fmt == NULL) || (f->id != spy.formats_sent))
+                continue;
+              unsigned char id[4] = { (unsigned char)(f->id & 0xff), 
+                                      (unsigned char)(f->id >> 8), 0, 0 };
+              spy_frame(SPY_FRAME_FORMAT, sizeof(id) + strlen(f->fmt));
+              spy_write(id, sizeof(id));
+              spy_write(f->fmt, strlen(f->fmt));
+              break;
+            }
+            spy.formats_sent++;
+          }
+          unsigned char proc[8];
+          for (unsigned b = 0; b < 8; b++)
+            proc[b] = (ring->proc >> (8*b)) & 0xff;
+          spy_frame(SPY_FRAME_RECORDS, sizeof(proc) + (unsigned)(head - tail));
+          spy_write(proc, sizeof(proc));
+          unsigned long long at = tail % SPY_RING_SIZE;
+          unsigned long long len = head - tail;
+          unsigned long long first = (len < (SPY_RING_SIZE - at)) ? len : 
+                                                          (SPY_RING_SIZE - at);
+          spy_write(ring->data + at, first);
+          if (len > first)
+            spy_write(ring->data, len - first);
+          __sync_synchronize();
+          ring->tail = head;
+        }
+      }
+
+      static void spy_flusher(void *in, void **out)
+      {
+        while (true)
+        {
+          NK_LOCK(&spy.wait_lock);
+          nk_condvar_timedwait(&spy.wait_cond, &spy.wait_lock, SPY_FLUSH_NS);
+          NK_UNLOCK(&spy.wait_lock);
+          NK_LOCK(&spy.drain_lock);
+          spy_drain();
+          NK_UNLOCK(&spy.drain_lock);
+        }
+      }
+
+      /*static*/ void BinaryLogger::flush(void)
+      {
+        if (spy.state != 2)
+          return;
+        NK_LOCK(&spy.drain_lock);
+        spy_drain();
+        NK_UNLOCK(&spy.drain_lock);
+      }
+
+    }; // namespace LegionSpy
+#endif
+
   }; // namespace HighLevel
 }; // namespace LegionRuntime
 
@@ -34,7 +34,23 @@ namespace LegionRuntime {
 
       typedef LegionRuntime::LowLevel::IDType IDType;
 
+#ifdef NAUT_CONFIG_LEGION_RT_SPY_BINARY
+      // Takes the same calls as a logger category, but keeps the format
+      // and the raw arguments in a buffer of the calling thread instead
+      // of printing them.  A background thread sends the buffers out and
+      // tools/spy_binary_log.py turns them back into the text log.
+      class BinaryLogger {
+      public:
+        void operator()(int level, const char *fmt, ...)
+                                      __attribute__((format (printf, 3, 4)));
+        // Send out everything logged so far, at shutdown
+        static void flush(void);
+      };
+
+      extern BinaryLogger log_spy;
+#else
       extern Logger::Category log_spy;
+#endif
 
       static int next_point_id = 0;
 
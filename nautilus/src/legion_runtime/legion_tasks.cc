@@ -490,6 +490,19 @@ namespace LegionRuntime {
       return variants->name;
     }
 
+    //--------------------------------------------------------------------------
+    bool TaskOp::get_dependence_footprint(
+                           std::vector<const RegionRequirement*> &reqs) const
+    //--------------------------------------------------------------------------
+    {
+      // Tasks in a must epoch are analyzed together
+      if (must_epoch != NULL)
+        return false;
+      for (unsigned idx = 0; idx < regions.size(); idx++)
+        reqs.push_back(&regions[idx]);
+      return true;
+    }
+
     //--------------------------------------------------------------------------
     void TaskOp::trigger_complete(void) 
     //--------------------------------------------------------------------------
@@ -9325,28 +9338,28 @@ namespace LegionRuntime {
                                   size_t result_size, bool owner)
     //--------------------------------------------------------------------------
     {
-      // If we're remote, just handle it ourselves, otherwise pass
-      // it back to the enclosing index owner
-      if (is_remote())
+      // Reductions are always folded into our own state first so the
+      // points of different slices don't all contend on the index
+      // owner's; it gets one fold per slice when we complete.  Other
+      // futures we keep if we're remote, otherwise pass them back to
+      // the enclosing index owner
+      if (redop != 0)
+        fold_reduction_future(result, result_size, owner, false/*exclusive*/);
+      else if (is_remote())
       {
-        if (redop != 0)
-          fold_reduction_future(result, result_size, owner, false/*exclusive*/);
-        else
-        {
-          // Store it in our temporary futures
+        // Store it in our temporary futures
 #ifdef DEBUG_HIGH_LEVEL
-          assert(temporary_futures.find(point) == temporary_futures.end());
+        assert(temporary_futures.find(point) == temporary_futures.end());
 #endif
-          if (owner)
-            temporary_futures[point] = 
-              std::pair<void*,size_t>(const_cast<void*>(result),result_size);
-          else
-          {
-            void *copy = legion_malloc(FUTURE_RESULT_ALLOC, result_size);
-            memcpy(copy,result,result_size);
-            temporary_futures[point] = 
-              std::pair<void*,size_t>(copy,result_size);
-          }
+        if (owner)
+          temporary_futures[point] = 
+            std::pair<void*,size_t>(const_cast<void*>(result),result_size);
+        else
+        {
+          void *copy = legion_malloc(FUTURE_RESULT_ALLOC, result_size);
+          memcpy(copy,result,result_size);
+          temporary_futures[point] = 
+            std::pair<void*,size_t>(copy,result_size);
         }
       }
       else
@@ -9590,6 +9603,9 @@ namespace LegionRuntime {
       }
       else
       {
+        if (redop != 0)
+          index_owner->handle_future(DomainPoint(), reduction_state,
+                                     reduction_state_size, false/*owner*/);
         index_owner->return_slice_complete(points.size());
       }
       complete_operation();
@@ -76,6 +76,8 @@ namespace LegionRuntime {
       virtual void deactivate(void) = 0;
       virtual const char* get_logging_name(void);
     public:
+      virtual bool get_dependence_footprint(
+                          std::vector<const RegionRequirement*> &reqs) const;
       virtual void trigger_dependence_analysis(void) = 0;
       virtual void trigger_complete(void);
       virtual void trigger_commit(void);
@@ -31,7 +31,7 @@ namespace LegionRuntime {
 
     //--------------------------------------------------------------------------
     LegionTrace::LegionTrace(TraceID t, SingleTask *c)
-      : tid(t), ctx(c), fixed(false), tracing(true)
+      : tid(t), ctx(c), fixed(false), tracing(true), replayable(true)
     //--------------------------------------------------------------------------
     {
     }
@@ -60,6 +60,9 @@ namespace LegionRuntime {
       // Called by task execution thread
       inline bool is_fixed(void) const { return fixed; }
       void fix_trace(void);
+      // A fixed trace is replayed without touching the region tree
+      // unless something in its capture needed more than dependences
+      inline bool is_replayable(void) const { return fixed && replayable; }
     public:
       // Called by analysis thread
       void end_trace_capture(void);
@@ -77,6 +80,8 @@ namespace LegionRuntime {
                                     Operation *source, GenerationID source_gen,
                                     unsigned target_idx, unsigned source_idx,
                                     DependenceType dtype);
+      // Called by analysis thread during capture
+      inline void record_no_replay(void) { replayable = false; }
     protected:
       std::vector<std::pair<Operation*,GenerationID> > operations;
       // Only need this backwards lookup for recording dependences
@@ -91,6 +96,7 @@ namespace LegionRuntime {
       SingleTask *const ctx;
       bool fixed;
       bool tracing;
+      bool replayable;
     };
 
     /**
@@ -117,6 +117,12 @@
 #ifndef DEFAULT_GC_EPOCH_SIZE
 #define DEFAULT_GC_EPOCH_SIZE           64
 #endif
+// Number of dependence analyses in a context that may be
+// in flight at once on disjoint parts of the region tree
+// before the next one is serialized behind all of them
+#ifndef DEFAULT_MAX_PARALLEL_ANALYSES
+#define DEFAULT_MAX_PARALLEL_ANALYSES   32
+#endif
 
 // Used for debugging memory leaks
 // How often tracing information is dumped
@@ -192,6 +192,16 @@ namespace LegionRuntime {
       void enable_idle_task(void);
       void disable_idle_task(void);
 
+      // A real-time reservation for the thread behind a processor, used
+      // where the kernel can give one; it takes effect once every
+      // processor is through initialization
+      struct RTHint {
+        enum Kind { RT_NONE, RT_PERIODIC, RT_SPORADIC } kind;
+        unsigned long long period_ns;   // a sporadic's relative deadline
+        unsigned long long slice_ns;    // budget per period, a sporadic's work
+      };
+      void set_rt_hint(const RTHint &hint) const;
+
       // Return the address space for this processor
       AddressSpace address_space(void) const;
       // Return the local ID within the address space
@@ -212,6 +222,11 @@ namespace LegionRuntime {
 
       Event spawn(TaskFuncID func_id, const void *args, size_t arglen,
 		  Event wait_on = Event::NO_EVENT, int priority = 0) const;
+      // Like spawn, but the task gets args itself instead of a copy,
+      // so the caller must keep it intact until the returned event
+      // has triggered
+      Event spawn_nocopy(TaskFuncID func_id, const void *args, size_t arglen,
+                         Event wait_on = Event::NO_EVENT, int priority = 0) const;
     };
 
     class Memory {
@@ -398,6 +413,56 @@ namespace LegionRuntime {
       RHS rhs;
     };
 
+    // Vectorized runs for reductions that are a plain sum or product
+    // on float or double. A reduction opts in by specializing
+    // ReductionSimd, e.g.
+    //   template <> struct ReductionSimd<SumFloat> {
+    //     static const ReductionSimdKind kind = REDOP_SIMD_SUM;
+    //   };
+    // Its unstrided apply and fold then run with AVX or AVX-512 when
+    // the cores and kernel have them, and without atomics, so only opt
+    // in for reductions whose destinations are not reduced into from
+    // two places at once.
+    enum ReductionSimdKind {
+      REDOP_SIMD_NONE,
+      REDOP_SIMD_SUM,
+      REDOP_SIMD_PROD
+    };
+
+    template <class REDOP>
+    struct ReductionSimd {
+      static const ReductionSimdKind kind = REDOP_SIMD_NONE;
+    };
+
+    namespace SimdKernels {
+      // lhs[i] = lhs[i] op rhs[i]
+      void reduce(ReductionSimdKind kind, float *lhs, const float *rhs, size_t count);
+      void reduce(ReductionSimdKind kind, double *lhs, const double *rhs, size_t count);
+      void copy(void *dst, const void *src, size_t bytes);
+    };
+
+    template <class REDOP, ReductionSimdKind KIND>
+    struct ReductionSimdRun {
+      static bool apply(typename REDOP::LHS *lhs, const typename REDOP::RHS *rhs, size_t count)
+      {
+        SimdKernels::reduce(KIND, lhs, rhs, count);
+        return true;
+      }
+      static bool fold(typename REDOP::RHS *rhs1, const typename REDOP::RHS *rhs2, size_t count)
+      {
+        SimdKernels::reduce(KIND, rhs1, rhs2, count);
+        return true;
+      }
+    };
+
+    template <class REDOP>
+    struct ReductionSimdRun<REDOP, REDOP_SIMD_NONE> {
+      static bool apply(typename REDOP::LHS *lhs, const typename REDOP::RHS *rhs, size_t count)
+      { return false; }
+      static bool fold(typename REDOP::RHS *rhs1, const typename REDOP::RHS *rhs2, size_t count)
+      { return false; }
+    };
+
     template <class REDOP>
     class ReductionOp : public ReductionOpUntyped {
     public:
@@ -413,6 +478,8 @@ namespace LegionRuntime {
       {
 	typename REDOP::LHS *lhs = (typename REDOP::LHS *)lhs_ptr;
 	const typename REDOP::RHS *rhs = (const typename REDOP::RHS *)rhs_ptr;
+	if(ReductionSimdRun<REDOP, ReductionSimd<REDOP>::kind>::apply(lhs, rhs, count))
+	  return;
 	if(exclusive) {
 	  for(size_t i = 0; i < count; i++)
 	    REDOP::template apply<true>(lhs[i], rhs[i]);
@@ -450,6 +517,8 @@ namespace LegionRuntime {
       {
 	typename REDOP::RHS *rhs1 = (typename REDOP::RHS *)rhs1_ptr;
 	const typename REDOP::RHS *rhs2 = (const typename REDOP::RHS *)rhs2_ptr;
+	if(ReductionSimdRun<REDOP, ReductionSimd<REDOP>::kind>::fold(rhs1, rhs2, count))
+	  return;
 	if(exclusive) {
 	  for(size_t i = 0; i < count; i++)
 	    REDOP::template fold<true>(rhs1[i], rhs2[i]);
@@ -1625,6 +1694,27 @@ namespace LegionRuntime {
 			       Memory restrict_mem1 = Memory::NO_MEMORY,
 			       Memory restrict_mem2 = Memory::NO_MEMORY);
 
+    public:
+      // Where processors and memories sit in the NUMA topology
+      struct ProcessorCoords {
+        unsigned cpu;       // logical CPU the processor runs on
+        unsigned smt_id;    // hardware thread within its core
+        unsigned core_id;   // core within its package
+        unsigned pkg_id;
+      };
+
+      unsigned get_numa_domain_count(void) const;
+      // -1 if it is not tied to one domain
+      int get_numa_domain(Processor p) const;
+      int get_numa_domain(Memory m) const;
+      // relative distance as in the ACPI SLIT, 10 is local
+      unsigned get_numa_distance(unsigned d1, unsigned d2) const;
+      bool get_processor_coords(Processor p, ProcessorCoords &coords) const;
+      // hardware threads per physical core, 1 without SMT
+      unsigned get_smt_width(void) const;
+      // processors on other hardware threads of p's physical core
+      void get_smt_siblings(Processor p, std::vector<Processor> &siblings) const;
+
     protected:
       std::set<Processor> procs;
       std::set<Memory> memories;
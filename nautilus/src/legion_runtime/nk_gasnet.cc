@@ -0,0 +1,465 @@
+/* Active messages between Nautilus cores, see nk_gasnet.h
+ *
+ * Every node has one ring of NK_AM_RING_SIZE cells.  A cell's seq
+ * says whose turn it is: it equals the enqueue position when the
+ * cell is free for that position, and the position plus one once a
+ * packet for it has been written.  Senders claim a position with a
+ * CAS on head, pollers with a CAS on tail, so any core can send to
+ * any node and any core of a node can poll it.
+ */
+
+#include "nk_gasnet.h"
+
+#include <nautilus/thread.h>
+#include <nautilus/barrier.h>
+#include <nautilus/smp.h>
+
+extern "C" {
+#include <nautilus/nemo.h>
+}
+
+#define NK_AM_RING_MASK (NK_AM_RING_SIZE - 1)
+#define NK_AM_MAX_HANDLERS 256
+#define NK_AM_MAX_SEGMENT ((uintptr_t)1 << 30)
+
+struct nk_am_token {
+  gasnet_node_t src;
+};
+
+struct nk_am_packet {
+  uint8_t kind;
+  uint8_t reply;
+  uint8_t nargs;
+  gasnet_handler_t handler;
+  gasnet_node_t src;
+  void *buf;
+  size_t nbytes;
+  gasnet_handlerarg_t args[NK_AM_MAX_ARGS];
+};
+
+struct nk_am_cell {
+  volatile uint64_t seq;
+  struct nk_am_packet pkt;
+};
+
+struct nk_am_node {
+  // senders and pollers each get their own line
+  volatile uint64_t head __attribute__((aligned(64)));
+  volatile uint64_t tail __attribute__((aligned(64)));
+
+  // a poller is, or is about to be, asleep on doorbell
+  volatile uint32_t sleeping __attribute__((aligned(64)));
+  volatile uint32_t doorbell;
+  volatile int sleep_cpu;
+  nk_thread_queue_t *waitq;
+
+  void *seg;
+  uintptr_t segsize;
+
+  struct nk_am_cell ring[NK_AM_RING_SIZE];
+};
+
+static struct nk_am_node *am_nodes;
+static unsigned am_num_nodes;
+static gasnet_node_t *am_node_of_cpu;
+static volatile uint8_t *am_in_handler;
+static void (*am_handlers[NK_AM_MAX_HANDLERS])();
+static nk_barrier_t am_attach_barrier;
+static nemo_event_id_t am_wake_event;
+
+//--------------------------------------------------------------------------
+static void am_wake(uint64_t node, void *priv)
+//--------------------------------------------------------------------------
+{
+  // in interrupt context on the sleeper's core
+  struct nk_am_node *n = &am_nodes[node];
+  __sync_fetch_and_add(&n->doorbell, 1);
+  nk_thread_queue_wake_word(n->waitq, 1);
+}
+
+//--------------------------------------------------------------------------
+int nk_gasnet_init(int nodes)
+//--------------------------------------------------------------------------
+{
+  unsigned ncpus = nk_get_num_cpus();
+
+  if (am_nodes)
+    return GASNET_OK;
+  if (nodes < 1)
+    nodes = 1;
+  if ((unsigned)nodes > ncpus)
+    nodes = ncpus;
+
+  am_nodes = (struct nk_am_node *)malloc(nodes * sizeof(struct nk_am_node));
+  am_node_of_cpu = (gasnet_node_t *)malloc(ncpus * sizeof(gasnet_node_t));
+  am_in_handler = (volatile uint8_t *)malloc(ncpus);
+  if (!am_nodes || !am_node_of_cpu || !am_in_handler)
+    return GASNET_ERR_RESOURCE;
+  memset(am_nodes, 0, nodes * sizeof(struct nk_am_node));
+  memset((void *)am_in_handler, 0, ncpus);
+
+  for (int i = 0; i < nodes; i++) {
+    struct nk_am_node *n = &am_nodes[i];
+    for (unsigned c = 0; c < NK_AM_RING_SIZE; c++)
+      n->ring[c].seq = c;
+    n->waitq = nk_thread_queue_create();
+    if (!n->waitq)
+      return GASNET_ERR_RESOURCE;
+  }
+
+  // contiguous cores make a node
+  for (unsigned c = 0; c < ncpus; c++)
+    am_node_of_cpu[c] = (c * nodes) / ncpus;
+
+  am_wake_event = nemo_register_event_data_action(am_wake, NULL);
+  if (am_wake_event < 0)
+    return GASNET_ERR_RESOURCE;
+
+  nk_barrier_init(&am_attach_barrier, nodes);
+  am_num_nodes = nodes;
+  return GASNET_OK;
+}
+
+//--------------------------------------------------------------------------
+int gasnet_init(int *argc, char ***argv)
+//--------------------------------------------------------------------------
+{
+  return nk_gasnet_init(NAUT_CONFIG_LEGION_RT_SHM_AM_NODES);
+}
+
+//--------------------------------------------------------------------------
+gasnet_node_t gasnet_mynode(void)
+//--------------------------------------------------------------------------
+{
+  return am_node_of_cpu ? am_node_of_cpu[my_cpu_id()] : 0;
+}
+
+//--------------------------------------------------------------------------
+gasnet_node_t gasnet_nodes(void)
+//--------------------------------------------------------------------------
+{
+  return am_num_nodes ? am_num_nodes : 1;
+}
+
+//--------------------------------------------------------------------------
+int gasnet_attach(gasnet_handlerentry_t *table, int numentries,
+                  uintptr_t segsize, uintptr_t minheapoffset)
+//--------------------------------------------------------------------------
+{
+  // one thread per node, each bringing the same table
+  struct nk_am_node *n;
+
+  if (!am_nodes)
+    return GASNET_ERR_NOT_READY;
+  if (segsize > NK_AM_MAX_SEGMENT)
+    return GASNET_ERR_BAD_ARG;
+
+  for (int i = 0; i < numentries; i++)
+    am_handlers[table[i].index] = table[i].fnptr;
+
+  n = &am_nodes[gasnet_mynode()];
+  if (segsize) {
+    n->seg = malloc(segsize);
+    if (!n->seg)
+      return GASNET_ERR_RESOURCE;
+    n->segsize = segsize;
+  }
+
+  nk_barrier_wait(&am_attach_barrier);
+  return GASNET_OK;
+}
+
+//--------------------------------------------------------------------------
+int gasnet_getSegmentInfo(gasnet_seginfo_t *seginfo_table, int numentries)
+//--------------------------------------------------------------------------
+{
+  for (int i = 0; i < numentries && (unsigned)i < am_num_nodes; i++) {
+    seginfo_table[i].addr = am_nodes[i].seg;
+    seginfo_table[i].size = am_nodes[i].segsize;
+  }
+  return GASNET_OK;
+}
+
+//--------------------------------------------------------------------------
+uintptr_t gasnet_getMaxLocalSegmentSize(void)
+//--------------------------------------------------------------------------
+{
+  return NK_AM_MAX_SEGMENT;
+}
+
+//--------------------------------------------------------------------------
+gasnet_node_t nk_am_token_source(gasnet_token_t token)
+//--------------------------------------------------------------------------
+{
+  return token->src;
+}
+
+//--------------------------------------------------------------------------
+int gasnet_AMGetMsgSource(gasnet_token_t token, gasnet_node_t *srcindex)
+//--------------------------------------------------------------------------
+{
+  *srcindex = token->src;
+  return GASNET_OK;
+}
+
+//--------------------------------------------------------------------------
+static int am_push(struct nk_am_node *n, const struct nk_am_packet *pkt)
+//--------------------------------------------------------------------------
+{
+  uint64_t pos = n->head;
+  struct nk_am_cell *cell;
+
+  for (;;) {
+    cell = &n->ring[pos & NK_AM_RING_MASK];
+    int64_t diff = (int64_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+                   (int64_t)pos;
+    if (diff == 0) {
+      if (__sync_bool_compare_and_swap(&n->head, pos, pos + 1))
+        break;
+      pos = n->head;
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = n->head;
+    }
+  }
+
+  cell->pkt = *pkt;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+//--------------------------------------------------------------------------
+static int am_pop(struct nk_am_node *n, struct nk_am_packet *pkt)
+//--------------------------------------------------------------------------
+{
+  uint64_t pos = n->tail;
+  struct nk_am_cell *cell;
+
+  for (;;) {
+    cell = &n->ring[pos & NK_AM_RING_MASK];
+    int64_t diff = (int64_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+                   (int64_t)(pos + 1);
+    if (diff == 0) {
+      if (__sync_bool_compare_and_swap(&n->tail, pos, pos + 1))
+        break;
+      pos = n->tail;
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = n->tail;
+    }
+  }
+
+  *pkt = cell->pkt;
+  __atomic_store_n(&cell->seq, pos + NK_AM_RING_SIZE, __ATOMIC_RELEASE);
+  return 1;
+}
+
+//--------------------------------------------------------------------------
+static inline int am_pending(struct nk_am_node *n)
+//--------------------------------------------------------------------------
+{
+  uint64_t pos = n->tail;
+  return __atomic_load_n(&n->ring[pos & NK_AM_RING_MASK].seq,
+                         __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+#define NK_AM_T_0
+#define NK_AM_T_1  NK_AM_T_0,  gasnet_handlerarg_t
+#define NK_AM_T_2  NK_AM_T_1,  gasnet_handlerarg_t
+#define NK_AM_T_3  NK_AM_T_2,  gasnet_handlerarg_t
+#define NK_AM_T_4  NK_AM_T_3,  gasnet_handlerarg_t
+#define NK_AM_T_5  NK_AM_T_4,  gasnet_handlerarg_t
+#define NK_AM_T_6  NK_AM_T_5,  gasnet_handlerarg_t
+#define NK_AM_T_7  NK_AM_T_6,  gasnet_handlerarg_t
+#define NK_AM_T_8  NK_AM_T_7,  gasnet_handlerarg_t
+#define NK_AM_T_9  NK_AM_T_8,  gasnet_handlerarg_t
+#define NK_AM_T_10 NK_AM_T_9,  gasnet_handlerarg_t
+#define NK_AM_T_11 NK_AM_T_10, gasnet_handlerarg_t
+#define NK_AM_T_12 NK_AM_T_11, gasnet_handlerarg_t
+#define NK_AM_T_13 NK_AM_T_12, gasnet_handlerarg_t
+#define NK_AM_T_14 NK_AM_T_13, gasnet_handlerarg_t
+#define NK_AM_T_15 NK_AM_T_14, gasnet_handlerarg_t
+#define NK_AM_T_16 NK_AM_T_15, gasnet_handlerarg_t
+
+#define NK_AM_A_0
+#define NK_AM_A_1  NK_AM_A_0,  a[0]
+#define NK_AM_A_2  NK_AM_A_1,  a[1]
+#define NK_AM_A_3  NK_AM_A_2,  a[2]
+#define NK_AM_A_4  NK_AM_A_3,  a[3]
+#define NK_AM_A_5  NK_AM_A_4,  a[4]
+#define NK_AM_A_6  NK_AM_A_5,  a[5]
+#define NK_AM_A_7  NK_AM_A_6,  a[6]
+#define NK_AM_A_8  NK_AM_A_7,  a[7]
+#define NK_AM_A_9  NK_AM_A_8,  a[8]
+#define NK_AM_A_10 NK_AM_A_9,  a[9]
+#define NK_AM_A_11 NK_AM_A_10, a[10]
+#define NK_AM_A_12 NK_AM_A_11, a[11]
+#define NK_AM_A_13 NK_AM_A_12, a[12]
+#define NK_AM_A_14 NK_AM_A_13, a[13]
+#define NK_AM_A_15 NK_AM_A_14, a[14]
+#define NK_AM_A_16 NK_AM_A_15, a[15]
+
+#define NK_AM_CALL(n)                                                         \
+  case n:                                                                     \
+    if (pkt->kind == NK_AM_SHORT)                                             \
+      ((void (*)(gasnet_token_t NK_AM_T_##n))fn)(&token NK_AM_A_##n);         \
+    else                                                                      \
+      ((void (*)(gasnet_token_t, void *, size_t NK_AM_T_##n))fn)(             \
+          &token, pkt->buf, pkt->nbytes NK_AM_A_##n);                         \
+    break;
+
+//--------------------------------------------------------------------------
+static void am_dispatch(const struct nk_am_packet *pkt)
+//--------------------------------------------------------------------------
+{
+  struct nk_am_token token = { pkt->src };
+  const gasnet_handlerarg_t *a = pkt->args;
+  void (*fn)() = am_handlers[pkt->handler];
+  unsigned cpu = my_cpu_id();
+
+  am_in_handler[cpu]++;
+  switch (pkt->nargs) {
+    NK_AM_CALL(0)  NK_AM_CALL(1)  NK_AM_CALL(2)  NK_AM_CALL(3)
+    NK_AM_CALL(4)  NK_AM_CALL(5)  NK_AM_CALL(6)  NK_AM_CALL(7)
+    NK_AM_CALL(8)  NK_AM_CALL(9)  NK_AM_CALL(10) NK_AM_CALL(11)
+    NK_AM_CALL(12) NK_AM_CALL(13) NK_AM_CALL(14) NK_AM_CALL(15)
+    NK_AM_CALL(16)
+  }
+  am_in_handler[cpu]--;
+
+  // medium payloads were ours to copy, long ones belong to the segment
+  if (pkt->kind == NK_AM_MEDIUM)
+    free(pkt->buf);
+}
+
+//--------------------------------------------------------------------------
+int nk_am_send(gasnet_node_t dest, enum nk_am_kind kind, int reply,
+               gasnet_handler_t handler, int nargs,
+               const gasnet_handlerarg_t *args,
+               const void *buf, size_t nbytes, void *dst_addr)
+//--------------------------------------------------------------------------
+{
+  struct nk_am_packet pkt;
+  struct nk_am_node *n;
+
+  if (dest >= am_num_nodes || nargs > NK_AM_MAX_ARGS)
+    return GASNET_ERR_BAD_ARG;
+  if (kind == NK_AM_MEDIUM && nbytes > NK_AM_MAX_MEDIUM)
+    return GASNET_ERR_BAD_ARG;
+
+  pkt.kind = kind;
+  pkt.reply = reply;
+  pkt.nargs = nargs;
+  pkt.handler = handler;
+  pkt.src = gasnet_mynode();
+  pkt.buf = 0;
+  pkt.nbytes = nbytes;
+  memcpy(pkt.args, args, nargs * sizeof(gasnet_handlerarg_t));
+
+  switch (kind) {
+  case NK_AM_MEDIUM:
+    // the sender may reuse buf as soon as we return
+    if (nbytes) {
+      pkt.buf = malloc(nbytes);
+      if (!pkt.buf)
+        return GASNET_ERR_RESOURCE;
+      memcpy(pkt.buf, buf, nbytes);
+    }
+    break;
+  case NK_AM_LONG:
+    // same address space, so the payload lands before the message does
+    if (nbytes && dst_addr != buf)
+      memcpy(dst_addr, buf, nbytes);
+    pkt.buf = dst_addr;
+    break;
+  default:
+    break;
+  }
+
+  n = &am_nodes[dest];
+  while (!am_push(n, &pkt)) {
+    // a full ring may be waiting on replies that are sitting in ours,
+    // so drain it, unless we are already inside one of its handlers
+    if (am_in_handler[my_cpu_id()])
+      __asm__ __volatile__ ("pause");
+    else
+      gasnet_AMPoll();
+  }
+
+  __sync_synchronize();
+  if (n->sleeping)
+    nemo_event_notify_data(am_wake_event, n->sleep_cpu, dest);
+
+  return GASNET_OK;
+}
+
+//--------------------------------------------------------------------------
+int gasnet_AMPoll(void)
+//--------------------------------------------------------------------------
+{
+  struct nk_am_packet pkt;
+  struct nk_am_node *n;
+
+  if (!am_nodes)
+    return GASNET_OK;
+
+  n = &am_nodes[gasnet_mynode()];
+  while (am_pop(n, &pkt))
+    am_dispatch(&pkt);
+
+  return GASNET_OK;
+}
+
+//--------------------------------------------------------------------------
+int nk_gasnet_poll_wait(void)
+//--------------------------------------------------------------------------
+{
+  struct nk_am_node *n;
+  uint32_t bell;
+
+  if (!am_nodes)
+    return GASNET_ERR_NOT_READY;
+
+  n = &am_nodes[gasnet_mynode()];
+  if (!am_pending(n)) {
+    bell = n->doorbell;
+    n->sleep_cpu = my_cpu_id();
+    n->sleeping = 1;
+    // senders look at sleeping after they push, we look at the ring
+    // after we set it, so one of us sees the other
+    __sync_synchronize();
+    if (!am_pending(n))
+      nk_thread_queue_wait_word(n->waitq, &n->doorbell, bell);
+    n->sleeping = 0;
+  }
+
+  return gasnet_AMPoll();
+}
+
+//--------------------------------------------------------------------------
+const char *gasnet_ErrorName(int errval)
+//--------------------------------------------------------------------------
+{
+  switch (errval) {
+  case GASNET_OK:             return "GASNET_OK";
+  case GASNET_ERR_RESOURCE:   return "GASNET_ERR_RESOURCE";
+  case GASNET_ERR_BAD_ARG:    return "GASNET_ERR_BAD_ARG";
+  case GASNET_ERR_NOT_READY:  return "GASNET_ERR_NOT_READY";
+  default:                    return "unknown";
+  }
+}
+
+//--------------------------------------------------------------------------
+const char *gasnet_ErrorDesc(int errval)
+//--------------------------------------------------------------------------
+{
+  switch (errval) {
+  case GASNET_OK:             return "no error";
+  case GASNET_ERR_RESOURCE:   return "out of memory or events";
+  case GASNET_ERR_BAD_ARG:    return "bad node, argument count or size";
+  case GASNET_ERR_NOT_READY:  return "not initialized, or busy";
+  default:                    return "unknown error";
+  }
+}
@@ -0,0 +1,217 @@
+/* The subset of GASNet that activemsg uses, on shared memory
+ *
+ * Nautilus runs all of its cores in one address space, so Legion's
+ * nodes become groups of cores and a message between them never has
+ * to leave memory.  Each node owns a bounded ring that any core can
+ * push packets onto without a lock; only the node's poller pops from
+ * it.  Medium payloads are copied once into a buffer that travels
+ * with the packet, long payloads are copied by the sender straight
+ * to where they are going.  A poller that has gone to sleep on an
+ * empty ring is woken with a NEMO event on its own core instead of
+ * being spun on.
+ */
+
+#ifndef NK_GASNET_H
+#define NK_GASNET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <nautilus/spinlock.h>
+#include <nautilus/condvar.h>
+
+typedef uint32_t gasnet_node_t;
+typedef int32_t  gasnet_handlerarg_t;
+typedef uint8_t  gasnet_handler_t;
+
+struct nk_am_token;
+typedef struct nk_am_token *gasnet_token_t;
+
+typedef struct {
+  gasnet_handler_t index;
+  void (*fnptr)();
+} gasnet_handlerentry_t;
+
+typedef struct {
+  void *addr;
+  uintptr_t size;
+} gasnet_seginfo_t;
+
+#define GASNET_OK               0
+#define GASNET_ERR_RESOURCE     10001
+#define GASNET_ERR_BAD_ARG      10002
+#define GASNET_ERR_NOT_READY    10004
+
+// arguments a message carries at most
+#define NK_AM_MAX_ARGS          16
+// packets a node's ring holds, a power of two
+#define NK_AM_RING_SIZE         1024
+// largest payload of a medium message, bigger ones go as long messages
+#define NK_AM_MAX_MEDIUM        (64 << 10)
+#define NK_AM_MAX_LONG          (~(size_t)0)
+
+#define gasnet_AMMaxMedium()      ((size_t)NK_AM_MAX_MEDIUM)
+#define gasnet_AMMaxLongRequest() ((size_t)NK_AM_MAX_LONG)
+
+// split the cores into nodes, before anyone attaches
+int nk_gasnet_init(int nodes);
+
+gasnet_node_t gasnet_mynode(void);
+gasnet_node_t gasnet_nodes(void);
+
+int gasnet_attach(gasnet_handlerentry_t *table, int numentries,
+                  uintptr_t segsize, uintptr_t minheapoffset);
+int gasnet_getSegmentInfo(gasnet_seginfo_t *seginfo_table, int numentries);
+uintptr_t gasnet_getMaxLocalSegmentSize(void);
+
+int gasnet_AMGetMsgSource(gasnet_token_t token, gasnet_node_t *srcindex);
+
+// run whatever is waiting for this node, never blocks
+int gasnet_AMPoll(void);
+// like gasnet_AMPoll, but sleeps until something arrives
+int nk_gasnet_poll_wait(void);
+
+const char *gasnet_ErrorName(int errval);
+const char *gasnet_ErrorDesc(int errval);
+
+// handler-safe locks and their condition variables
+typedef struct { NK_LOCK_T lock; } gasnet_hsl_t;
+typedef nk_condvar_t gasnett_cond_t;
+
+static inline void gasnet_hsl_init(gasnet_hsl_t *hsl) { NK_LOCK_INIT(&hsl->lock); }
+static inline void gasnet_hsl_destroy(gasnet_hsl_t *hsl) { NK_LOCK_DEINIT(&hsl->lock); }
+static inline void gasnet_hsl_lock(gasnet_hsl_t *hsl) { NK_LOCK(&hsl->lock); }
+static inline void gasnet_hsl_unlock(gasnet_hsl_t *hsl) { NK_UNLOCK(&hsl->lock); }
+
+static inline int gasnet_hsl_trylock(gasnet_hsl_t *hsl)
+{
+#ifdef NAUT_CONFIG_USE_TICKETLOCKS
+  return nk_ticket_trylock(&hsl->lock) ? GASNET_ERR_NOT_READY : GASNET_OK;
+#else
+  return __spin_try_acquire(&hsl->lock) ? GASNET_OK : GASNET_ERR_NOT_READY;
+#endif
+}
+
+#define gasnett_cond_init(c)       nk_condvar_init(c)
+#define gasnett_cond_destroy(c)    nk_condvar_destroy(c)
+#define gasnett_cond_wait(c, l)    nk_condvar_wait(c, l)
+#define gasnett_cond_signal(c)     nk_condvar_signal(c)
+#define gasnett_cond_broadcast(c)  nk_condvar_bcast(c)
+
+enum nk_am_kind {
+  NK_AM_SHORT,
+  NK_AM_MEDIUM,
+  NK_AM_LONG,
+};
+
+// the one entry point all of the GASNet calls below turn into
+int nk_am_send(gasnet_node_t dest, enum nk_am_kind kind, int reply,
+               gasnet_handler_t handler, int nargs,
+               const gasnet_handlerarg_t *args,
+               const void *buf, size_t nbytes, void *dst_addr);
+gasnet_node_t nk_am_token_source(gasnet_token_t token);
+
+#define NK_AM_P_0
+#define NK_AM_P_1  NK_AM_P_0,  gasnet_handlerarg_t a0
+#define NK_AM_P_2  NK_AM_P_1,  gasnet_handlerarg_t a1
+#define NK_AM_P_3  NK_AM_P_2,  gasnet_handlerarg_t a2
+#define NK_AM_P_4  NK_AM_P_3,  gasnet_handlerarg_t a3
+#define NK_AM_P_5  NK_AM_P_4,  gasnet_handlerarg_t a4
+#define NK_AM_P_6  NK_AM_P_5,  gasnet_handlerarg_t a5
+#define NK_AM_P_7  NK_AM_P_6,  gasnet_handlerarg_t a6
+#define NK_AM_P_8  NK_AM_P_7,  gasnet_handlerarg_t a7
+#define NK_AM_P_9  NK_AM_P_8,  gasnet_handlerarg_t a8
+#define NK_AM_P_10 NK_AM_P_9,  gasnet_handlerarg_t a9
+#define NK_AM_P_11 NK_AM_P_10, gasnet_handlerarg_t a10
+#define NK_AM_P_12 NK_AM_P_11, gasnet_handlerarg_t a11
+#define NK_AM_P_13 NK_AM_P_12, gasnet_handlerarg_t a12
+#define NK_AM_P_14 NK_AM_P_13, gasnet_handlerarg_t a13
+#define NK_AM_P_15 NK_AM_P_14, gasnet_handlerarg_t a14
+#define NK_AM_P_16 NK_AM_P_15, gasnet_handlerarg_t a15
+
+// an array of size 0 is not allowed, so there is always one spare
+#define NK_AM_V_0  0
+#define NK_AM_V_1  a0
+#define NK_AM_V_2  NK_AM_V_1,  a1
+#define NK_AM_V_3  NK_AM_V_2,  a2
+#define NK_AM_V_4  NK_AM_V_3,  a3
+#define NK_AM_V_5  NK_AM_V_4,  a4
+#define NK_AM_V_6  NK_AM_V_5,  a5
+#define NK_AM_V_7  NK_AM_V_6,  a6
+#define NK_AM_V_8  NK_AM_V_7,  a7
+#define NK_AM_V_9  NK_AM_V_8,  a8
+#define NK_AM_V_10 NK_AM_V_9,  a9
+#define NK_AM_V_11 NK_AM_V_10, a10
+#define NK_AM_V_12 NK_AM_V_11, a11
+#define NK_AM_V_13 NK_AM_V_12, a12
+#define NK_AM_V_14 NK_AM_V_13, a13
+#define NK_AM_V_15 NK_AM_V_14, a14
+#define NK_AM_V_16 NK_AM_V_15, a15
+
+#define NK_AM_DEFINE(n)                                                       \
+static inline int gasnet_AMRequestShort##n(gasnet_node_t dest,                \
+                                           gasnet_handler_t h NK_AM_P_##n)    \
+{                                                                             \
+  gasnet_handlerarg_t args[] = { NK_AM_V_##n };                               \
+  return nk_am_send(dest, NK_AM_SHORT, 0, h, n, args, 0, 0, 0);               \
+}                                                                             \
+static inline int gasnet_AMRequestMedium##n(gasnet_node_t dest,               \
+                                            gasnet_handler_t h,               \
+                                            void *buf, size_t nbytes          \
+                                            NK_AM_P_##n)                      \
+{                                                                             \
+  gasnet_handlerarg_t args[] = { NK_AM_V_##n };                               \
+  return nk_am_send(dest, NK_AM_MEDIUM, 0, h, n, args, buf, nbytes, 0);       \
+}                                                                             \
+static inline int gasnet_AMRequestLong##n(gasnet_node_t dest,                 \
+                                          gasnet_handler_t h,                 \
+                                          void *buf, size_t nbytes,           \
+                                          void *dst_addr NK_AM_P_##n)         \
+{                                                                             \
+  gasnet_handlerarg_t args[] = { NK_AM_V_##n };                               \
+  return nk_am_send(dest, NK_AM_LONG, 0, h, n, args, buf, nbytes, dst_addr);  \
+}                                                                             \
+static inline int gasnet_AMRequestLongAsync##n(gasnet_node_t dest,            \
+                                               gasnet_handler_t h,            \
+                                               void *buf, size_t nbytes,      \
+                                               void *dst_addr NK_AM_P_##n)    \
+{                                                                             \
+  gasnet_handlerarg_t args[] = { NK_AM_V_##n };                               \
+  return nk_am_send(dest, NK_AM_LONG, 0, h, n, args, buf, nbytes, dst_addr);  \
+}                                                                             \
+static inline int gasnet_AMReplyShort##n(gasnet_token_t token,                \
+                                         gasnet_handler_t h NK_AM_P_##n)      \
+{                                                                             \
+  gasnet_handlerarg_t args[] = { NK_AM_V_##n };                               \
+  return nk_am_send(nk_am_token_source(token), NK_AM_SHORT, 1, h, n, args,    \
+                    0, 0, 0);                                                 \
+}                                                                             \
+static inline int gasnet_AMReplyMedium##n(gasnet_token_t token,               \
+                                          gasnet_handler_t h,                 \
+                                          void *buf, size_t nbytes            \
+                                          NK_AM_P_##n)                        \
+{                                                                             \
+  gasnet_handlerarg_t args[] = { NK_AM_V_##n };                               \
+  return nk_am_send(nk_am_token_source(token), NK_AM_MEDIUM, 1, h, n, args,   \
+                    buf, nbytes, 0);                                          \
+}
+
+NK_AM_DEFINE(0)
+NK_AM_DEFINE(1)
+NK_AM_DEFINE(2)
+NK_AM_DEFINE(3)
+NK_AM_DEFINE(4)
+NK_AM_DEFINE(5)
+NK_AM_DEFINE(6)
+NK_AM_DEFINE(7)
+NK_AM_DEFINE(8)
+NK_AM_DEFINE(9)
+NK_AM_DEFINE(10)
+NK_AM_DEFINE(11)
+NK_AM_DEFINE(12)
+NK_AM_DEFINE(13)
+NK_AM_DEFINE(14)
+NK_AM_DEFINE(15)
+NK_AM_DEFINE(16)
+
+#endif
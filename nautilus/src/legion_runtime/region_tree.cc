@@ -18,6 +18,7 @@
 #include "runtime.h"
 #include "legion_ops.h"
 #include "legion_tasks.h"
+#include "legion_trace.h"
 #include "region_tree.h"
 #include "legion_spy.h"
 #include "legion_logging.h"
@@ -758,6 +759,22 @@ namespace LegionRuntime {
 #ifdef DEBUG_HIGH_LEVEL
       assert(ctx.exists());
 #endif
+      // Replaying a trace: the recorded dependences cover everything
+      // inside it and the fences around it everything outside, so the
+      // region tree is left alone.  Operations after the trace depend
+      // on its completion fence, so missing users do them no harm.
+      if (op->already_traced() && op->get_trace()->is_replayable() &&
+          !req.restricted)
+      {
+#ifdef DEBUG_PERF
+        end_perf_trace(Runtime::perf_trace_tolerance);
+#endif
+        return;
+      }
+      // Restrictions come out of the tree's state, which a replay
+      // would not have
+      if (op->is_tracing() && req.restricted)
+        op->get_trace()->record_no_replay();
       RegionNode *parent_node = get_node(req.parent);
       
       FieldMask user_mask = 
@@ -774,8 +791,9 @@ namespace LegionRuntime {
                                      FieldMask(FIELD_ALL_ONES), user_mask);
 #endif
       // Finally do the traversal, note that we don't need to hold the
-      // context lock since the runtime guarantees that all dependence
-      // analysis for a single context are performed in order
+      // context lock since the runtime guarantees that dependence
+      // analyses in a context whose footprints overlap are performed
+      // in order; disjoint ones share nodes only under the node locks
       parent_node->register_logical_node(ctx.get_id(), user, 
                                          path, op->already_traced());
       // Now check to see if we have any simultaneous restrictions
@@ -5372,6 +5390,10 @@ namespace LegionRuntime {
         // If we couldn't recycle one, then try making one
         if (!inst.exists())
           inst = domain.create_instance(location, field_size);
+        // If the memory is full, give back what we've been holding
+        if (!inst.exists() &&
+            context->runtime->reclaim_deferred_instances(location))
+          inst = domain.create_instance(location, field_size);
         if (inst.exists())
         {
           FieldMask inst_mask = get_field_mask(create_fields);
@@ -5442,6 +5464,9 @@ namespace LegionRuntime {
         // If that didn't work, try making one
         if (!inst.exists())
           inst = domain.create_instance(location, field_sizes, blocking_factor);
+        if (!inst.exists() &&
+            context->runtime->reclaim_deferred_instances(location))
+          inst = domain.create_instance(location, field_sizes, blocking_factor);
         if (inst.exists())
         {
           FieldMask inst_mask = get_field_mask(create_fields);
@@ -5555,6 +5580,9 @@ namespace LegionRuntime {
         // Ease case of making a foldable reduction
         PhysicalInstance inst = domain.create_instance(location, op->sizeof_rhs,
                                                         redop);
+        if (!inst.exists() &&
+            context->runtime->reclaim_deferred_instances(location))
+          inst = domain.create_instance(location, op->sizeof_rhs, redop);
         if (inst.exists())
         {
           DistributedID did = context->runtime->get_available_distributed_id();
@@ -8775,6 +8803,7 @@ namespace LegionRuntime {
     //--------------------------------------------------------------------------
     {
       this->node_lock = Reservation::create_reservation(); 
+      this->logical_lock = Reservation::create_reservation();
     }
 
     //--------------------------------------------------------------------------
@@ -8783,6 +8812,8 @@ namespace LegionRuntime {
     {
       node_lock.destroy_reservation();
       node_lock = Reservation::NO_RESERVATION;
+      logical_lock.destroy_reservation();
+      logical_lock = Reservation::NO_RESERVATION;
     }
 
     //--------------------------------------------------------------------------
@@ -8954,149 +8985,162 @@ namespace LegionRuntime {
 #endif
       LogicalState &state = logical_states[ctx];
       unsigned depth = get_depth();
-      // Before we start, record the "before" versions
-      // of all our fields
-      record_field_versions(state,path,user.field_mask,depth,true/*before*/);
-      if (!path.has_child(depth))
-      {
-        // Don't need to do these things if we've already traced
-        if (!already_traced)
-        {
-          // We've arrived at our destination node
-          FieldMask dominator_mask = perform_dependence_checks(user,
-                    state.curr_epoch_users, user.field_mask, true/*validates*/);
-          FieldMask non_dominated_mask = user.field_mask - dominator_mask;
-          // For the fields that weren't dominated, we have to check
-          // those fields against the previous epoch's users
-          if (!!non_dominated_mask)
+      RegionTreeNode *child = NULL;
+      bool open_only = false;
+      {
+        // Analyses of disjoint footprints in the same context can
+        // pass through this node at the same time
+        AutoLock l_lock(logical_lock);
+        // Before we start, record the "before" versions
+        // of all our fields
+        record_field_versions(state,path,user.field_mask,depth,true/*before*/);
+        if (!path.has_child(depth))
+        {
+          // Don't need to do these things if we've already traced
+          if (!already_traced)
           {
-            perform_dependence_checks(user,state.prev_epoch_users,
-                                      non_dominated_mask, true/*validates*/);
+            // We've arrived at our destination node
+            FieldMask dominator_mask = perform_dependence_checks(user,
+                  state.curr_epoch_users, user.field_mask, true/*validates*/);
+            FieldMask non_dominated_mask = user.field_mask - dominator_mask;
+            // For the fields that weren't dominated, we have to check
+            // those fields against the previous epoch's users
+            if (!!non_dominated_mask)
+            {
+              perform_dependence_checks(user,state.prev_epoch_users,
+                                        non_dominated_mask, true/*validates*/);
+            }
+            // Update the dominated fields
+            if (!!dominator_mask)
+            {
+              // Dominator mask is not empty
+              // Mask off all the dominated fields from the previous set
+              // of epoch users and remove any previous epoch users
+              // that were totally dominated
+              filter_prev_epoch_users(state, dominator_mask); 
+              // Mask off all dominated fields from current epoch users and
+              // move them to prev epoch users.  If all fields masked off,
+              // then remove them from the list of current epoch users.
+              filter_curr_epoch_users(state, dominator_mask); 
+              // Finally remove any close operations which have now been
+              // dominated
+              filter_close_operations(state, dominator_mask); 
+              // Update the version IDs of any fields which we dominated
+              advance_field_versions(state, dominator_mask); 
+            }
           }
-          // Update the dominated fields
-          if (!!dominator_mask)
+          // Now close up any children which we may have dependences on below
+          LogicalCloser closer(ctx, user, true/*validates*/);
+          // If we are in read-only or reduce mode then we need to record
+          // the close operation so that it gets done by the first user
+          // otherwise read-write will invalidate its state and write over
+          // it so we don't need to have consensus over who does the close
+          siphon_logical_children(closer, state, user.field_mask, 
+              IS_READ_ONLY(user.usage) || IS_REDUCE(user.usage)/*record*/);
+          // Update the list of closed users and close operations
+          if (!closer.closed_users.empty())
           {
-            // Dominator mask is not empty
-            // Mask off all the dominated fields from the previous set
-            // of epoch users and remove any previous epoch users
-            // that were totally dominated
-            filter_prev_epoch_users(state, dominator_mask); 
-            // Mask off all dominated fields from current epoch users and move
-            // them to prev epoch users.  If all fields masked off, then remove
-            // them from the list of current epoch users.
-            filter_curr_epoch_users(state, dominator_mask); 
-            // Finally remove any close operations which have now been dominated
-            filter_close_operations(state, dominator_mask); 
-            // Update the version IDs of any fields which we dominated
-            advance_field_versions(state, dominator_mask); 
-          }
-        }
-        // Now close up any children which we may have dependences on below
-        LogicalCloser closer(ctx, user, true/*validates*/);
-        // If we are in read-only or reduce mode then we need to record
-        // the close operation so that it gets done by the first user
-        // otherwise read-write will invalidate its state and write over
-        // it so we don't need to have consensus over who does the close
-        siphon_logical_children(closer, state, user.field_mask, 
-            IS_READ_ONLY(user.usage) || IS_REDUCE(user.usage)/*record*/);
-        // Update the list of closed users and close operations
-        if (!closer.closed_users.empty())
-        {
-          // Add the closed users to the prev epoch users, we already
-          // registered mapping dependences on them as part of the
-          // closing process so we don't need to do it again
+            // Add the closed users to the prev epoch users, we already
+            // registered mapping dependences on them as part of the
+            // closing process so we don't need to do it again
 #ifndef LOGICAL_FIELD_TREE
-          state.prev_epoch_users.insert(state.prev_epoch_users.end(),
-                                        closer.closed_users.begin(),
-                                        closer.closed_users.end());
+            state.prev_epoch_users.insert(state.prev_epoch_users.end(),
+                                          closer.closed_users.begin(),
+                                          closer.closed_users.end());
 #else
-          for (std::deque<LogicalUser>::const_iterator it = 
-                closer.closed_users.begin(); it != 
-                closer.closed_users.end(); it++)
-          {
-            state.prev_epoch_users->insert(*it);
-          }
+            for (std::deque<LogicalUser>::const_iterator it = 
+                  closer.closed_users.begin(); it != 
+                  closer.closed_users.end(); it++)
+            {
+              state.prev_epoch_users->insert(*it);
+            }
 #endif
-        }
-        if (!closer.close_operations.empty())
-          update_close_operations(state, closer.close_operations);
-        // Record any close operations that need to be done
-        record_close_operations(state, path, user.field_mask, depth); 
-        // No need to do this if we've already traced
-        if (!already_traced)
-        {
-          // Record a mapping reference on this operation
-          user.op->add_mapping_reference(user.gen);
+          }
+          if (!closer.close_operations.empty())
+            update_close_operations(state, closer.close_operations);
+          // Record any close operations that need to be done
+          record_close_operations(state, path, user.field_mask, depth); 
+          // No need to do this if we've already traced
+          if (!already_traced)
+          {
+            // Record a mapping reference on this operation
+            user.op->add_mapping_reference(user.gen);
 #ifndef LOGICAL_FIELD_TREE
-          // Add ourselves to the current epoch
-          state.curr_epoch_users.push_back(user);
+            // Add ourselves to the current epoch
+            state.curr_epoch_users.push_back(user);
 #else
-          state.curr_epoch_users->insert(user);
+            state.curr_epoch_users->insert(user);
 #endif
+          }
         }
-      }
-      else
-      {
-        // No need to do this if we've already traced
-        if (!already_traced)
-        {
-          // First perform dependence checks on the current and 
-          // previous epoch users since we're still traversing
-          perform_dependence_checks(user, state.curr_epoch_users, 
-                                    user.field_mask, false/*validates*/);
-          perform_dependence_checks(user, state.prev_epoch_users,
-                                    user.field_mask, false/*validates*/);
-        }
-        // Otherwise see what we have to close up and
-        // then continue the traversal
-        // Close up any children that are open which we
-        // will have a dependence on
-        Color next_child = path.get_child(depth);
-        LogicalCloser closer(ctx, user, false/*validates*/);
-        // This also updates the new states
-        bool open_only = siphon_logical_children(closer, state, 
-                          user.field_mask, true/*record*/, next_child);
-
-        // Filter all the close field users
-        if (!!closer.closed_mask)
-        {
-          filter_prev_epoch_users(state, closer.closed_mask);
-          filter_curr_epoch_users(state, closer.closed_mask);
-          filter_close_operations(state, closer.closed_mask);
-          // Advance the field versions for the closed fields
-          advance_field_versions(state, closer.closed_mask);
-        }
-
-        if (!closer.closed_users.empty())
-        {
-          // Add the closed users to the prev epoch users, we already
-          // registered mapping dependences on them as part of the
-          // closing process so we don't need to do it again
-#ifndef LOGICAL_FIELD_TREE
-          state.prev_epoch_users.insert(state.prev_epoch_users.end(),
-                                        closer.closed_users.begin(),
-                                        closer.closed_users.end());
-#else
-          for (std::deque<LogicalUser>::const_iterator it = 
-                closer.closed_users.begin(); it != 
-                closer.closed_users.end(); it++)
+        else
+        {
+          // No need to do this if we've already traced
+          if (!already_traced)
+          {
+            // First perform dependence checks on the current and 
+            // previous epoch users since we're still traversing
+            perform_dependence_checks(user, state.curr_epoch_users, 
+                                      user.field_mask, false/*validates*/);
+            perform_dependence_checks(user, state.prev_epoch_users,
+                                      user.field_mask, false/*validates*/);
+          }
+          // Otherwise see what we have to close up and
+          // then continue the traversal
+          // Close up any children that are open which we
+          // will have a dependence on
+          Color next_child = path.get_child(depth);
+          LogicalCloser closer(ctx, user, false/*validates*/);
+          // This also updates the new states
+          open_only = siphon_logical_children(closer, state, 
+                            user.field_mask, true/*record*/, next_child);
+
+          // Filter all the close field users
+          if (!!closer.closed_mask)
           {
-            state.prev_epoch_users->insert(*it);
+            filter_prev_epoch_users(state, closer.closed_mask);
+            filter_curr_epoch_users(state, closer.closed_mask);
+            filter_close_operations(state, closer.closed_mask);
+            // Advance the field versions for the closed fields
+            advance_field_versions(state, closer.closed_mask);
           }
+
+          if (!closer.closed_users.empty())
+          {
+            // Add the closed users to the prev epoch users, we already
+            // registered mapping dependences on them as part of the
+            // closing process so we don't need to do it again
+#ifndef LOGICAL_FIELD_TREE
+            state.prev_epoch_users.insert(state.prev_epoch_users.end(),
+                                          closer.closed_users.begin(),
+                                          closer.closed_users.end());
+#else
+            for (std::deque<LogicalUser>::const_iterator it = 
+                  closer.closed_users.begin(); it != 
+                  closer.closed_users.end(); it++)
+            {
+              state.prev_epoch_users->insert(*it);
+            }
 #endif
-        }
+          }
         
-        if (!closer.close_operations.empty())
-          update_close_operations(state, closer.close_operations);
-        // Also register any close operations which need to be done
-        record_close_operations(state, path, user.field_mask, depth);
+          if (!closer.close_operations.empty())
+            update_close_operations(state, closer.close_operations);
+          // Also register any close operations which need to be done
+          record_close_operations(state, path, user.field_mask, depth);
         
-        RegionTreeNode *child = get_tree_child(next_child);
+          child = get_tree_child(next_child);
+        }
+      }
+      // Don't hold our lock while the child does its analysis
+      if (child != NULL)
+      {
         if (open_only)
           child->open_logical_node(ctx, user, path, already_traced);
         else
           child->register_logical_node(ctx, user, path, already_traced);
       }
+      AutoLock l_lock(logical_lock);
       record_field_versions(state,path,user.field_mask,depth,false/*before*/); 
     }
 
@@ -9115,38 +9159,44 @@ namespace LegionRuntime {
 #endif
       LogicalState &state = logical_states[ctx];
       unsigned depth = get_depth();
-      // Before we start, record the "before" versions
-      // of all our fields
-      record_field_versions(state,path,user.field_mask,depth,true/*before*/);
-      if (!path.has_child(depth))
-      {
-        // No need to record ourselves if we've already traced
-        if (!already_traced)
-        {
-          // We've arrived where we're going,
-          // add ourselves as a user
-          // Record a mapping reference on this operation
-          user.op->add_mapping_reference(user.gen);
+      RegionTreeNode *child_node = NULL;
+      {
+        AutoLock l_lock(logical_lock);
+        // Before we start, record the "before" versions
+        // of all our fields
+        record_field_versions(state,path,user.field_mask,depth,true/*before*/);
+        if (!path.has_child(depth))
+        {
+          // No need to record ourselves if we've already traced
+          if (!already_traced)
+          {
+            // We've arrived where we're going,
+            // add ourselves as a user
+            // Record a mapping reference on this operation
+            user.op->add_mapping_reference(user.gen);
 #ifndef LOGICAL_FIELD_TREE
-          state.curr_epoch_users.push_back(user);
+            state.curr_epoch_users.push_back(user);
 #else
-          state.curr_epoch_users->insert(user);
+            state.curr_epoch_users->insert(user);
 #endif
+          }
         }
-      }
-      else
-      {
-        Color next_child = path.get_child(depth);
-        // Update our field states
-        merge_new_field_state(state, 
-                              FieldState(user, user.field_mask, next_child));
+        else
+        {
+          Color next_child = path.get_child(depth);
+          // Update our field states
+          merge_new_field_state(state, 
+                                FieldState(user, user.field_mask, next_child));
 #ifdef DEBUG_HIGH_LEVEL
-        sanity_check_logical_state(state);
+          sanity_check_logical_state(state);
 #endif
-        // Then continue the traversal
-        RegionTreeNode *child_node = get_tree_child(next_child);
-        child_node->open_logical_node(ctx, user, path, already_traced);
+          // Then continue the traversal
+          child_node = get_tree_child(next_child);
+        }
       }
+      if (child_node != NULL)
+        child_node->open_logical_node(ctx, user, path, already_traced);
+      AutoLock l_lock(logical_lock);
       record_field_versions(state,path,user.field_mask,depth,false/*before*/);
     }
 
@@ -9163,6 +9213,9 @@ namespace LegionRuntime {
       assert(closer.ctx < logical_state_size);
 #endif
       LogicalState &state = logical_states[closer.ctx];
+      // Closes come down from a parent holding its own lock,
+      // so node locks are always taken top down
+      AutoLock l_lock(logical_lock);
 
       // Perform closing checks on both the current epoch users
       // as well as the previous epoch users
@@ -15080,7 +15133,8 @@ namespace LegionRuntime {
           LegionProf::register_instance_deletion(instance.id);
 #endif
 #ifndef DISABLE_GC
-          instance.destroy(use_event);
+          context->runtime->defer_instance_deletion(memory, instance,
+                                                    use_event);
 #endif
         }
         else // Otherwise it has been recycled, so don't release valid views
@@ -15513,7 +15567,8 @@ namespace LegionRuntime {
         LegionProf::register_instance_deletion(instance.id);
 #endif
 #ifndef DISABLE_GC
-        instance.destroy();
+        context->runtime->defer_instance_deletion(memory, instance,
+                                                  Event::NO_EVENT);
 #endif
         instance = PhysicalInstance::NO_INST;
       }
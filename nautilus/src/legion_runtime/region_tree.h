@@ -1778,6 +1778,9 @@ namespace LegionRuntime {
       NodeMask destruction_set;
     protected:
       Reservation node_lock;
+      // Protects the logical states while a dependence analysis is in
+      // this node, always taken parent before child
+      Reservation logical_lock;
       LegionStack<LogicalState,MAX_CONTEXTS,DEFAULT_CONTEXTS> logical_states;
       LegionStack<PhysicalState,MAX_CONTEXTS,DEFAULT_CONTEXTS> physical_states;
 #ifdef DEBUG_HIGH_LEVEL
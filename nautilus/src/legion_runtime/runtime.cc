@@ -1703,6 +1703,7 @@ namespace LegionRuntime {
       this->thieving_lock = Reservation::create_reservation();
       context_states.resize(MAX_CONTEXTS);
       dependence_preconditions.resize(MAX_CONTEXTS, Event::NO_EVENT);
+      pending_analyses.resize(MAX_CONTEXTS);
       local_scheduler_preconditions.resize(superscalar_width, Event::NO_EVENT);
     }
 
@@ -2582,10 +2583,120 @@ namespace LegionRuntime {
       args.manager = this;
       args.op = op;
       ContextID ctx_id = op->get_parent()->get_context_id();
+      // Operations in a trace are recorded and replayed in order
+      std::vector<const RegionRequirement*> reqs;
+      bool serial = (op->get_trace() != NULL) || 
+                    !op->get_dependence_footprint(reqs);
+      PendingAnalysis analysis;
+      for (unsigned idx = 0; !serial && (idx < reqs.size()); idx++)
+      {
+        const RegionRequirement &req = *(reqs[idx]);
+        // Restrictions are checked against the whole tree
+        if (req.restricted || (req.prop == SIMULTANEOUS))
+        {
+          serial = true;
+          break;
+        }
+        AnalysisFootprint footprint;
+        footprint.is_partition = (req.handle_type == PART_PROJECTION);
+        if (footprint.is_partition)
+        {
+          footprint.tid = req.partition.get_tree_id();
+          footprint.part = req.partition.get_index_partition();
+        }
+        else
+        {
+          footprint.tid = req.region.get_tree_id();
+          footprint.space = req.region.get_index_space();
+        }
+        footprint.fields = req.privilege_fields;
+        analysis.footprint.push_back(footprint);
+      }
       AutoLock d_lock(dependence_lock);
+      std::list<PendingAnalysis> &pending = pending_analyses[ctx_id];
+      if (pending.size() >= DEFAULT_MAX_PARALLEL_ANALYSES)
+        serial = true;
+      std::set<Event> preconditions;
+      preconditions.insert(dependence_preconditions[ctx_id]);
+      for (std::list<PendingAnalysis>::iterator it = pending.begin();
+            it != pending.end(); /*nothing*/)
+      {
+        if (it->done.has_triggered())
+        {
+          it = pending.erase(it);
+          continue;
+        }
+        bool interferes = serial;
+        for (unsigned idx1 = 0; !interferes && 
+              (idx1 < analysis.footprint.size()); idx1++)
+        {
+          for (unsigned idx2 = 0; idx2 < it->footprint.size(); idx2++)
+          {
+            if (footprints_interfere(analysis.footprint[idx1],
+                                     it->footprint[idx2]))
+            {
+              interferes = true;
+              break;
+            }
+          }
+        }
+        if (interferes)
+          preconditions.insert(it->done);
+        it++;
+      }
       Event next = utility_proc.spawn(HLR_TASK_ID, &args, sizeof(args),
-                                      dependence_preconditions[ctx_id]);
-      dependence_preconditions[ctx_id] = next;
+                                      Event::merge_events(preconditions));
+      if (serial)
+      {
+        // Everything after this waits on it
+        dependence_preconditions[ctx_id] = next;
+        pending.clear();
+      }
+      else
+      {
+        analysis.done = next;
+        pending.push_back(analysis);
+      }
+    }
+
+    //--------------------------------------------------------------------------
+    bool ProcessorManager::footprints_interfere(const AnalysisFootprint &one,
+                                           const AnalysisFootprint &two) const
+    //--------------------------------------------------------------------------
+    {
+      if (one.tid != two.tid)
+        return false;
+      bool shared_field = false;
+      for (std::set<FieldID>::const_iterator it = one.fields.begin();
+            it != one.fields.end(); it++)
+      {
+        if (two.fields.find(*it) != two.fields.end())
+        {
+          shared_field = true;
+          break;
+        }
+      }
+      if (!shared_field)
+        return false;
+      // Analyses of disjoint subtrees only meet in the logical
+      // states of common ancestors, which the node locks protect
+      RegionTreeForest *forest = runtime->forest;
+      if (!one.is_partition && !two.is_partition)
+      {
+        if (one.space == two.space)
+          return true;
+        std::vector<Color> path;
+        if (forest->compute_index_path(one.space, two.space, path) ||
+            forest->compute_index_path(two.space, one.space, path))
+          return true;
+        return !forest->are_disjoint(one.space, two.space);
+      }
+      if (!one.is_partition)
+        return !forest->are_disjoint(one.space, two.part);
+      if (!two.is_partition)
+        return !forest->are_disjoint(two.space, one.part);
+      // Be conservative about two partitions
+      return true;
     }
 
     //--------------------------------------------------------------------------
@@ -3010,6 +3121,40 @@ namespace LegionRuntime {
       return reclaim;
     }
 
+    //--------------------------------------------------------------------------
+    void MemoryManager::defer_instance_deletion(PhysicalInstance inst,
+                                                Event use_event)
+    //--------------------------------------------------------------------------
+    {
+      bool reclaim;
+      {
+        AutoLock m_lock(manager_lock);
+        deferred_deletions.push_back(
+            std::pair<PhysicalInstance,Event>(inst, use_event));
+        reclaim = (deferred_deletions.size() >= Runtime::gc_epoch_size);
+      }
+      if (reclaim)
+        reclaim_deferred_instances();
+    }
+
+    //--------------------------------------------------------------------------
+    bool MemoryManager::reclaim_deferred_instances(void)
+    //--------------------------------------------------------------------------
+    {
+      std::vector<std::pair<PhysicalInstance,Event> > to_delete;
+      {
+        AutoLock m_lock(manager_lock);
+        to_delete.swap(deferred_deletions);
+      }
+      // The low-level runtime waits on the use events for us
+      for (std::vector<std::pair<PhysicalInstance,Event> >::const_iterator 
+            it = to_delete.begin(); it != to_delete.end(); it++)
+      {
+        it->first.destroy(it->second);
+      }
+      return !to_delete.empty();
+    }
+
     //--------------------------------------------------------------------------
     PhysicalInstance MemoryManager::find_physical_instance(size_t field_size,
                                                            const Domain &dom,
@@ -4394,6 +4539,16 @@ namespace LegionRuntime {
       if (Runtime::registration_callback != NULL)
         (*Runtime::registration_callback)(machine, high_level, 
                                                 local_procs);
+      // Now that the mappers are in place, see what reservations
+      // they want for our processors
+      for (std::set<Processor>::const_iterator it = local_procs.begin();
+            it != local_procs.end(); it++)
+      {
+        Processor::RTHint hint;
+        hint.kind = Processor::RTHint::RT_NONE;
+        if (proc_managers[*it]->find_mapper(0)->reserve_processor(*it, hint))
+          it->set_rt_hint(hint);
+      }
     }
 
     //--------------------------------------------------------------------------
@@ -7728,6 +7883,9 @@ namespace LegionRuntime {
       // Mark that we are done with the trace
       ctx->end_trace(tid); 
 #endif
+      // The end of a trace is the end of a phase, so now is the
+      // time to give back the instances the phase stopped using
+      reclaim_deferred_instances();
     }
 
     //--------------------------------------------------------------------------
@@ -8160,6 +8318,36 @@ namespace LegionRuntime {
       return find_memory(inst->memory)->reclaim_physical_instance(inst);
     }
 
+    //--------------------------------------------------------------------------
+    void Runtime::defer_instance_deletion(Memory mem, PhysicalInstance inst,
+                                          Event use_event)
+    //--------------------------------------------------------------------------
+    {
+      find_memory(mem)->defer_instance_deletion(inst, use_event);
+    }
+
+    //--------------------------------------------------------------------------
+    bool Runtime::reclaim_deferred_instances(Memory mem)
+    //--------------------------------------------------------------------------
+    {
+      return find_memory(mem)->reclaim_deferred_instances();
+    }
+
+    //--------------------------------------------------------------------------
+    void Runtime::reclaim_deferred_instances(void)
+    //--------------------------------------------------------------------------
+    {
+      std::vector<MemoryManager*> managers;
+      {
+        AutoLock m_lock(memory_manager_lock);
+        for (std::map<Memory,MemoryManager*>::const_iterator it = 
+              memory_managers.begin(); it != memory_managers.end(); it++)
+          managers.push_back(it->second);
+      }
+      for (unsigned idx = 0; idx < managers.size(); idx++)
+        managers[idx]->reclaim_deferred_instances();
+    }
+
     //--------------------------------------------------------------------------
     PhysicalInstance Runtime::find_physical_instance(Memory mem, 
                                         size_t field_size, const Domain &dom, 
@@ -12539,6 +12727,9 @@ namespace LegionRuntime {
     //--------------------------------------------------------------------------
     {
         NAUTILUS_DEEP_DEBUG("Shutting down runtime\n");
+#if defined(LEGION_SPY) && defined(NAUT_CONFIG_LEGION_RT_SPY_BINARY)
+      LegionSpy::BinaryLogger::flush();
+#endif
       if (separate_runtime_instances)
         delete get_runtime(p);
       else
@@ -413,6 +413,21 @@ namespace LegionRuntime {
         ProcessorManager *manager;
         Operation *op;
       };
+      // What one region requirement of an operation in the
+      // dependence queue can touch in the region tree
+      struct AnalysisFootprint {
+      public:
+        RegionTreeID tid;
+        bool is_partition;
+        IndexSpace space;
+        IndexPartition part;
+        std::set<FieldID> fields;
+      };
+      struct PendingAnalysis {
+      public:
+        std::vector<AnalysisFootprint> footprint;
+        Event done;
+      };
       struct TriggerOpArgs {
       public:
         HLRTaskID hlr_id;
@@ -519,6 +534,8 @@ namespace LegionRuntime {
     protected:
       void perform_mapping_operations(void);
       void issue_advertisements(MapperID mid);
+      bool footprints_interfere(const AnalysisFootprint &one,
+                                const AnalysisFootprint &two) const;
     protected:
       void increment_active_contexts(void);
       void decrement_active_contexts(void);
@@ -537,9 +554,12 @@ namespace LegionRuntime {
       // Maximum number of outstanding steals permitted by any mapper
       const unsigned max_outstanding_steals;
     protected:
-      // Dependence analysis state
+      // Dependence analysis state, everything in a context waits on
+      // the last serialized analysis and on the pending analyses
+      // since then that it could interfere with
       Reservation dependence_lock;
       std::vector<Event> dependence_preconditions;
+      std::vector<std::list<PendingAnalysis> > pending_analyses;
     protected:
       // Local queue state
       Reservation local_queue_lock;
@@ -606,6 +626,12 @@ namespace LegionRuntime {
     public:
       void recycle_physical_instance(InstanceManager *manager);
       bool reclaim_physical_instance(InstanceManager *manager);
+    public:
+      // Unreachable instances are destroyed in batches at trace
+      // boundaries, when the memory runs short, or once an epoch's
+      // worth of them have built up
+      void defer_instance_deletion(PhysicalInstance inst, Event use_event);
+      bool reclaim_deferred_instances(void);
     public:
       PhysicalInstance find_physical_instance(size_t field_size,
                                               const Domain &dom, 
@@ -641,6 +667,8 @@ namespace LegionRuntime {
       // Set of physical instances which are currently eligible for recycling
       LegionContainer<InstanceManager*,
                       MEMORY_AVAILABLE_ALLOC>::set available_instances;
+      // Instances waiting to be destroyed and what they wait on
+      std::vector<std::pair<PhysicalInstance,Event> > deferred_deletions;
     };
 
     /**
@@ -1181,6 +1209,10 @@ namespace LegionRuntime {
       // Functions for recycling physical instances
       void recycle_physical_instance(InstanceManager *instance);
       bool reclaim_physical_instance(InstanceManager *instance);
+      void defer_instance_deletion(Memory mem, PhysicalInstance inst,
+                                   Event use_event);
+      bool reclaim_deferred_instances(Memory mem);
+      void reclaim_deferred_instances(void);
       PhysicalInstance find_physical_instance(Memory mem, size_t field_size,
                    const Domain &dom, const unsigned depth, Event &use_event);
       PhysicalInstance find_physical_instance(Memory mem, 
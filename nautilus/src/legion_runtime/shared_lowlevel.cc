@@ -24,6 +24,8 @@
 
 extern "C" void __do_backtrace(void*, unsigned);
 extern "C" unsigned nk_my_numa_node(void);
+extern "C" struct mem_region * kmem_get_region_by_addr(unsigned long addr);
+extern "C" void * malloc_node(size_t size, unsigned node);
 
 using namespace LegionRuntime::Accessor;
 
@@ -60,12 +62,22 @@ using namespace LegionRuntime::Accessor;
 #include <nautilus/irq.h>
 #include <nautilus/instrument.h>
 #include <nautilus/numa.h>
+#include <nautilus/fpu.h>
+#include <nautilus/paging.h>
+#ifdef NAUT_CONFIG_LEGION_RT_FIBERS
+#include <nautilus/fiber.h>
+#endif
+
+#include <cpuid.h>
+#include <immintrin.h>
 
 #include "naut_debug.h"
 //#include <libccompat.h>
 //#include <atomic.h>
 
 #define BASE_EVENTS	  1024	
+// events moved between a core's cache and the global pool at a time
+#define EVENT_BATCH       64
 #define BASE_RESERVATIONS 64	
 #define BASE_METAS	  64
 #define BASE_ALLOCATORS	  64
@@ -77,6 +89,17 @@ using namespace LegionRuntime::Accessor;
 //#define NUM_PROCS	1
 #define NUM_UTIL_PROCS  1
 #define NUM_DMA_THREADS 1
+// Index space copies bigger than two of these are split across DMA
+// threads, a huge page so a span's destination is one TLB entry
+#define DMA_CHUNK_BYTES PAGE_SIZE_2MB
+// How far ahead of a streaming copy to prefetch the source
+#define STREAM_PREFETCH 512
+// Task arguments up to this size are kept in the TaskDesc itself
+#define TASK_INLINE_ARGS 128
+// Smallest block kept in a memory's instance cache, and the share
+// of the memory the cache may hold on to
+#define INST_CACHE_MIN_BLOCK 4096
+#define INST_CACHE_SHARE     4
 // Maximum memory in global
 #define GLOBAL_MEM      4096   // (MB)	
 #define LOCAL_MEM       16384  // (KB)
@@ -178,6 +201,8 @@ NK_LOCK_T debug_mutex;
 //pthread_key_t local_proc_key;
 
 nk_tls_key_t local_proc_key;
+// The dependents still to be triggered by this thread, see EventImpl::trigger
+nk_tls_key_t trigger_worklist_key;
 static void thread_proc_free(void *arg)
 {
   assert(arg != NULL);
@@ -246,7 +271,28 @@ namespace LegionRuntime {
       friend class Machine;
       ReductionOpTable redop_table;
       std::vector<EventImpl*> events;
-      std::deque<EventImpl*> free_events; 
+      /*
+       * Free events sit in per-core caches in front of a global pool.
+       * A core allocates and frees from its own cache with interrupts
+       * off and nothing shared; only an empty or overfull cache goes
+       * to the pool, taking or giving back a whole batch of
+       * EVENT_BATCH events. The pool is a lock-free stack of batches,
+       * each chained through next_free on its events and linked to
+       * the next batch through next_batch on its first. The top of
+       * the stack carries a tag in its unused upper 16 bits so a
+       * batch popped and pushed again in the middle of a pop cannot
+       * fool the compare-and-swap. Events are never deleted, so a
+       * stale top can always be read safely.
+       */
+      struct EventCache {
+        EventImpl *ev[2*EVENT_BATCH];
+        unsigned count;
+      } __attribute__((aligned(64)));
+      EventCache event_caches[NAUT_CONFIG_MAX_CPUS];
+      volatile uint64_t free_batches;
+      void push_event_batch(EventImpl *head);
+      EventImpl *pop_event_batch(void);
+      void add_free_events(EventImpl **ev, unsigned count);
       std::vector<ReservationImpl*> reservations;
       std::deque<ReservationImpl*> free_reservations;
       std::vector<MemoryImpl*> memories;
@@ -272,7 +318,6 @@ namespace LegionRuntime {
       */
 
       nk_rwlock_t         event_lock;
-      NK_LOCK_T       free_event_lock;
       nk_rwlock_t         reservation_lock;
       NK_LOCK_T       free_reservation_lock;
       nk_rwlock_t         proc_group_lock;
@@ -288,29 +333,59 @@ namespace LegionRuntime {
     Runtime *Runtime::runtime = NULL;
     DMAQueue *Runtime::dma_queue = NULL;
 
+    /*
+     * Each DMA thread has its own queue of work, bound to a core and
+     * tagged with that core's NUMA domain. A copy goes to a thread in
+     * the domain its destination lives in, so the writes stay local.
+     * A thread takes work from the front of its own queue and, when
+     * that is empty, steals from the back of the others' before going
+     * to sleep on its own condition variable. Large index space
+     * copies are cut into spans of about DMA_CHUNK_BYTES that are
+     * dealt out round the threads, and the copy completes when the
+     * last of its spans does.
+     */
     class DMAQueue {
     public:
       DMAQueue(unsigned num_threads);
     public:
       void start(void);
       void shutdown(void);
-      void run_dma_loop(void);
       void enqueue_dma(CopyOperation *copy);
     public:
       static void* start_dma_thread(void *args);
     public:
       const unsigned num_dma_threads;
     protected:
-      bool dma_shutdown;
+      struct DMAWork {
+        CopyOperation *copy;
+        int start, count;   // span of the index space, count -1 for all
+      };
+      struct DMAWorker {
+        DMAQueue *queue;
+        unsigned index;
+        int cpu;
+        unsigned domain;
+        bool sleeping;
+        NK_LOCK_T lock;
+        nk_condvar_t cond;
+        std::deque<DMAWork> work;
+      };
+      void run_dma_loop(DMAWorker *w);
+      bool next_work(DMAWorker *w, DMAWork &work);
+      void push_work(DMAWorker *w, const DMAWork &work);
+      void do_work(const DMAWork &work);
+      DMAWorker *pick_worker(CopyOperation *copy);
+      static int pick_dma_cpu(unsigned idx);
+    protected:
+      volatile bool dma_shutdown;
+      volatile unsigned next_worker;
       /*
       pthread_mutex_t dma_lock;
       pthread_cond_t dma_cond;
       std::vector<pthread_t> dma_threads;
       */
-      NK_LOCK_T      dma_lock;
-      nk_condvar_t       dma_cond;
       std::vector<nk_thread_id_t> dma_threads;
-      std::deque<CopyOperation*> ready_copies;
+      std::vector<DMAWorker*> workers;
     };
     
     struct TimerStackEntry {
@@ -515,6 +590,72 @@ namespace LegionRuntime {
     
     
 
+    // A vector holding its first N elements inline, going to the heap
+    // only past that.  Most events have one or two waiters, so keeping
+    // them this way stays off the allocator on the trigger path.
+    // Elements must be default constructible and copyable.
+    template<typename T, unsigned N>
+    class SmallVector {
+    public:
+        SmallVector(void) : elems(inline_elems), count(0), capacity(N) { }
+        ~SmallVector(void)
+        {
+          if (elems != inline_elems)
+            delete [] elems;
+        }
+    public:
+        inline size_t size(void) const { return count; }
+        inline bool empty(void) const { return (count == 0); }
+        inline T& operator[](unsigned idx) { return elems[idx]; }
+        inline const T& operator[](unsigned idx) const { return elems[idx]; }
+        inline void clear(void) { count = 0; }
+        inline void truncate(unsigned n) { count = n; }
+        void push_back(const T &elem)
+        {
+          if (count == capacity)
+          {
+            T *grown = new T[2*capacity];
+            for (unsigned idx = 0; idx < count; idx++)
+              grown[idx] = elems[idx];
+            if (elems != inline_elems)
+              delete [] elems;
+            elems = grown;
+            capacity *= 2;
+          }
+          elems[count++] = elem;
+        }
+        // Move everything in other over to here, leaving other empty
+        void take(SmallVector &other)
+        {
+          count = 0;
+          if (other.elems != other.inline_elems)
+          {
+            if (elems != inline_elems)
+              delete [] elems;
+            elems = other.elems;
+            capacity = other.capacity;
+            count = other.count;
+            other.elems = other.inline_elems;
+            other.capacity = N;
+          }
+          else
+          {
+            for (unsigned idx = 0; idx < other.count; idx++)
+              push_back(other.elems[idx]);
+          }
+          other.count = 0;
+        }
+    private:
+	// no copy constructor or assignment
+        SmallVector(const SmallVector &copy_from);
+        SmallVector& operator=(const SmallVector &copy_from);
+    private:
+        T *elems;
+        unsigned count;
+        unsigned capacity;
+        T inline_elems[N];
+    };
+
     // Any object which can be triggered should be able to triggered
     // This will include Events and Reservations 
     class Triggerable {
@@ -536,6 +677,7 @@ namespace LegionRuntime {
     public:
         struct TriggerableInfo {
         public:
+            TriggerableInfo(void) { }
             TriggerableInfo(Triggerable *t, TriggerHandle h,
                             EventGeneration n)
               : target(t), handle(h), needed(n) { }
@@ -615,6 +757,11 @@ namespace LegionRuntime {
         // A debug helper method
         void print_waiters(void);
     private: 
+    public:
+        // free list links, owned by the runtime while the event is free
+        EventImpl *next_free;
+        EventImpl *next_batch;
+    private:
 	bool in_use;
 	unsigned sources;
         unsigned arrivals; // for use with barriers
@@ -629,9 +776,11 @@ namespace LegionRuntime {
 	//pthread_cond_t *wait_cond;
     NK_LOCK_T *mutex;
     nk_condvar_t *wait_cond;
-        std::list<TriggerableInfo> triggerables;
+        SmallVector<TriggerableInfo,2> triggerables;
     }; 
 
+    typedef SmallVector<EventImpl::TriggerableInfo,16> TriggerWorklist;
+
     ////////////////////////////////////////////////////////
     // Processor Impl (up here since we need it in Event) 
     ////////////////////////////////////////////////////////
@@ -718,11 +867,21 @@ namespace LegionRuntime {
         virtual void get_group_members(std::vector<Processor>& members);
     public:
         virtual Event spawn(Processor::TaskFuncID func_id, const void * args,
-                            size_t arglen, Event wait_on, int priority);
+                            size_t arglen, Event wait_on, int priority,
+                            bool copy_args = true);
         void run(void);
 	bool trigger(unsigned count = 1, TriggerHandle handle = 0);
 	static void* start(void *proc);
 	void preempt(EventImpl *event, EventImpl::EventGeneration needed);
+        void set_rt_hint(const Processor::RTHint &hint) { rt_hint = hint; }
+        // the logical CPU the processor's thread is started on
+        int get_cpu(void) const { return cpu; }
+    protected:
+        void run_tasks(void);
+#ifdef NAUT_CONFIG_LEGION_RT_PROCS
+        bool run_reserved(void);
+        static void* start_reserved(void *proc);
+#endif
     public:
         void enable_idle_task(void);
         void disable_idle_task(void);
@@ -734,24 +893,48 @@ namespace LegionRuntime {
     protected:
 	class TaskDesc {
         public:
-          TaskDesc(Processor::TaskFuncID id, const void *_args, size_t _arglen,
-                   Event _wait, EventImpl *_complete, int _priority,
-                   int _start_arrivals, int _finish_arrivals, int _expected)
-            : func_id(id), args(0), arglen(_arglen), wait(_wait),
-              complete(_complete), priority(_priority), 
-              start_arrivals(_start_arrivals), finish_arrivals(_finish_arrivals),
-              expected(_expected)
+          TaskDesc(void) : args(0), heap_args(false) { }
+          ~TaskDesc(void)
           {
-            if (arglen > 0)
+            release_args();
+          }
+          void init(Processor::TaskFuncID id, const void *_args, size_t _arglen,
+                    Event _wait, EventImpl *_complete, int _priority,
+                    int _start_arrivals, int _finish_arrivals, int _expected,
+                    bool copy_args = true)
+          {
+            func_id = id;
+            arglen = _arglen;
+            wait = _wait;
+            complete = _complete;
+            priority = _priority;
+            start_arrivals = _start_arrivals;
+            finish_arrivals = _finish_arrivals;
+            expected = _expected;
+            args = 0;
+            heap_args = false;
+            if (arglen == 0)
+              return;
+            if (!copy_args)
+              args = (void*)_args;
+            else
             {
-              args = malloc(arglen);
+              if (arglen <= TASK_INLINE_ARGS)
+                args = inline_args;
+              else
+              {
+                args = malloc(arglen);
+                heap_args = true;
+              }
               memcpy(args, _args, arglen);
             }
           }
-          ~TaskDesc(void)
+          void release_args(void)
           {
-            if (args)
+            if (heap_args)
               free(args);
+            args = 0;
+            heap_args = false;
           }
 	public:
 		Processor::TaskFuncID func_id;
@@ -764,11 +947,40 @@ namespace LegionRuntime {
                 int start_arrivals;
                 int finish_arrivals;
                 int expected;
+                // Where it goes back to when it is done
+                TaskDesc *next_free;
+                unsigned home;
+#ifdef NAUT_CONFIG_LEGION_RT_FIBERS
+                // The processor whose fiber it runs on
+                ProcessorImpl *runner;
+#endif
+                bool heap_args;
+                char inline_args[TASK_INLINE_ARGS];
 	};
+        /*
+         * TaskDescs are recycled through per-core pools. A core takes
+         * them off its own free list with interrupts off. One that
+         * finishes on another core is pushed onto its home's returned
+         * stack, which the home core empties with a single exchange
+         * when its own list runs dry, so pops never race each other.
+         */
+        struct TaskPool {
+          TaskDesc *free;
+          TaskDesc * volatile returned;
+        } __attribute__((aligned(64)));
+        static TaskPool task_pools[NAUT_CONFIG_MAX_CPUS];
+        static TaskDesc *alloc_task(void);
+        static void free_task(TaskDesc *task);
     public:
         void enqueue_task(TaskDesc *task);
     protected:
         void add_to_ready_queue(TaskDesc *desc);
+        void run_task(TaskDesc *task);
+#ifdef NAUT_CONFIG_LEGION_RT_FIBERS
+        void spawn_task(TaskDesc *task);
+        static void task_fiber(void *task);
+        static int preempt_ready(void *waiter);
+#endif
     public:
         //pthread_attr_t attr; // For setting pthread parameters when starting the thread
     protected:
@@ -785,6 +997,8 @@ namespace LegionRuntime {
 	//pthread_cond_t *wait_cond;
     NK_LOCK_T *mutex;
     nk_condvar_t *wait_cond;
+        Processor::RTHint rt_hint;
+        int cpu;
 	// Used for detecting the shutdown condition
 	bool shutdown;
         bool idle_task_enabled;
@@ -819,7 +1033,8 @@ namespace LegionRuntime {
       virtual void get_group_members(std::vector<Processor>& members);
 
       virtual Event spawn(Processor::TaskFuncID func_id, const void * args,
-			  size_t arglen, Event wait_on, int priority);
+			  size_t arglen, Event wait_on, int priority,
+                          bool copy_args = true);
 
     protected:
       std::vector<ProcessorImpl *> members;
@@ -1069,20 +1284,30 @@ namespace LegionRuntime {
 #ifdef DEBUG_LOW_LEVEL
 		assert(generation == current.gen);
 #endif
-                // Get the set of people to trigger
-                std::vector<TriggerableInfo> to_trigger;
-                for (std::list<TriggerableInfo>::iterator it = triggerables.begin();
-                      it != triggerables.end(); /*nothing*/)
+                // Dependents are triggered from a worklist rather than by
+                // recursion, so a long chain of events needs neither stack
+                // nor locks held all the way down it.  The outermost trigger
+                // on this thread owns the worklist and runs it once our lock
+                // is dropped; triggers nested in the dependents it runs only
+                // add theirs to it.
+                TriggerWorklist *worklist = 
+                  (TriggerWorklist*)nk_tls_get(trigger_worklist_key);
+                TriggerWorklist local_worklist;
+                const bool owner = (worklist == NULL);
+                if (owner)
+                  worklist = &local_worklist;
+                // Get the set of people to trigger, keeping the rest in order
+                unsigned kept = 0;
+                for (unsigned idx = 0; idx < triggerables.size(); idx++)
                 {
-                    NAUTILUS_DEEP_DEBUG("Trigger loop looking at %p\n", (*it));
-                  if (it->needed == generation)
-                  {
-                    to_trigger.push_back(*it);
-                    it = triggerables.erase(it);
-                  }
+                  const TriggerableInfo &info = triggerables[idx];
+                  NAUTILUS_DEEP_DEBUG("Trigger loop looking at %p\n", info.target);
+                  if (info.needed == generation)
+                    worklist->push_back(info);
                   else
-                    it++;
+                    triggerables[kept++] = info;
                 }
+                triggerables.truncate(kept);
                 finished = (generation == free_generation);
                 if (finished)
                 {
@@ -1101,19 +1326,31 @@ namespace LegionRuntime {
 		// Can't be holding the lock when triggering other triggerables
 		//PTHREAD_SAFE_CALL(pthread_mutex_unlock(mutex));
         NK_UNLOCK(mutex);
-        NAUTILUS_DEEP_DEBUG("Triggering other events\n");
-		// Trigger any dependent events for this generation
-                for (std::vector<TriggerableInfo>::const_iterator it = 
-                      to_trigger.begin(); it != to_trigger.end(); it++)
+                if (owner)
                 {
-                    NAUTILUS_DEEP_DEBUG("other trigger\n");
-                  bool nuke = it->target->trigger(1, it->handle);
-                  if (nuke) {
-                      NAUTILUS_DEEP_DEBUG("nuking it\n");
-                      delete it->target;
+                  NAUTILUS_DEEP_DEBUG("Triggering other events\n");
+                  // If the worklist can't be published, nested triggers
+                  // own worklists of their own, as they recursed before
+                  nk_tls_set(trigger_worklist_key, worklist);
+                  // Trigger a batch at a time, what they make ready
+                  // goes in the next one
+                  TriggerWorklist batch;
+                  while (!worklist->empty())
+                  {
+                    batch.take(*worklist);
+                    for (unsigned idx = 0; idx < batch.size(); idx++)
+                    {
+                      NAUTILUS_DEEP_DEBUG("other trigger\n");
+                      bool nuke = batch[idx].target->trigger(1, batch[idx].handle);
+                      if (nuke) {
+                        NAUTILUS_DEEP_DEBUG("nuking it\n");
+                        delete batch[idx].target;
+                      }
+                    }
                   }
+                  nk_tls_set(trigger_worklist_key, NULL);
+                  NAUTILUS_DEEP_DEBUG("Other events triggered\n");
                 }
-        NAUTILUS_DEEP_DEBUG("Other events triggered\n");
         }
         else
         {
@@ -1257,10 +1494,8 @@ namespace LegionRuntime {
         fprintf(stdout,"Event %d, Generation %d has %ld waiters\n",
             index, generation, triggerables.size());
         for (unsigned idx = 0; idx < triggerables.size(); idx++)
-        for (std::list<TriggerableInfo>::const_iterator it = triggerables.begin();
-              it != triggerables.end(); it++)
         {
-          fprintf(stdout,"  Waiter: %p\n", it->target);
+          fprintf(stdout,"  Waiter: %p\n", triggerables[idx].target);
         }
         fflush(stdout);
       }
@@ -1370,6 +1605,7 @@ namespace LegionRuntime {
 		holders = 0;
 		waiters = false;
                 next_handle = 1;
+                fast_state = FAST_FREE;
                 //mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
 		//PTHREAD_SAFE_CALL(pthread_mutex_init(mutex,NULL));
         mutex = (NK_LOCK_T*)malloc(sizeof(NK_LOCK_T));
@@ -1427,7 +1663,19 @@ namespace LegionRuntime {
     private:
 	Event register_request(unsigned m, bool exc, TriggerHandle handle = 0);
 	void perform_release(std::set<EventImpl*> &to_trigger);
+        void absorb_fast_state(void);
+        void settle_fast_state(void);
     private:
+        // An exclusive acquire of an idle reservation, and its release,
+        // only swing fast_state between FAST_FREE and FAST_HELD.  All
+        // else takes the mutex and first moves the state to SLOW, after
+        // which the fields below say who holds the reservation, until a
+        // slow path leaves it idle again.
+        enum {
+          FAST_FREE = 0,
+          FAST_HELD = 1,
+          SLOW = 2
+        };
 	class ReservationRecord {
 	public:
 		unsigned mode;
@@ -1447,6 +1695,7 @@ namespace LegionRuntime {
 	unsigned holders;
         TriggerHandle next_handle; // all numbers >0 are reservation requests, 0 is release trigger handle
 	std::list<ReservationRecord> requests;
+        volatile unsigned fast_state;
 	//pthread_mutex_t *mutex;
     NK_LOCK_T *mutex;
         void *data;
@@ -1497,8 +1746,13 @@ namespace LegionRuntime {
     Event ReservationImpl::acquire(unsigned m, bool exc, Event wait_on)
     {
 	Event result = Event::NO_EVENT;
+        // Uncontended, nothing to wait for and nobody else to admit
+        if (exc && !wait_on.exists() &&
+            __sync_bool_compare_and_swap(&fast_state, FAST_FREE, FAST_HELD))
+          return result;
 	//PTHREAD_SAFE_CALL(pthread_mutex_lock(mutex));
     NK_LOCK(mutex);
+        absorb_fast_state();
         log_reservation(LEVEL_DEBUG,"reservation request: reservation=%x mode=%d "
                                     "excl=%d event=" IDFMT "/%d count=%d",
                  index, m, exc, wait_on.id, wait_on.gen, holders); 
@@ -1556,11 +1810,52 @@ namespace LegionRuntime {
 #endif
           }
         }
+        settle_fast_state();
 	//PTHREAD_SAFE_CALL(pthread_mutex_unlock(mutex));
     NK_UNLOCK(mutex);
 	return result;
     }
 
+    // Always called while holding the mutex, before looking at the
+    // reservation's state
+    void ReservationImpl::absorb_fast_state(void)
+    {
+        while (true)
+        {
+          unsigned state = fast_state;
+          if (state == SLOW)
+            return;
+          if (__sync_bool_compare_and_swap(&fast_state, state, SLOW))
+          {
+            if (state == FAST_HELD)
+            {
+              // The fast holder now releases through the slow path
+#ifdef DEBUG_LOW_LEVEL
+              assert(!taken && requests.empty());
+#endif
+              taken = true;
+              // nobody shares with an exclusive holder, so its mode is moot
+              exclusive = true;
+              mode = 0;
+              holders = 1;
+            }
+            return;
+          }
+        }
+    }
+
+    // Always called while holding the mutex, when done with the 
+    // reservation's state
+    void ReservationImpl::settle_fast_state(void)
+    {
+        // Idle again, so the next uncontended acquire can skip the mutex
+        if (!taken && requests.empty())
+        {
+          __sync_synchronize();
+          fast_state = FAST_FREE;
+        }
+    }
+
     // Always called while holding the mutex 
     Event ReservationImpl::register_request(unsigned m, bool exc, TriggerHandle handle)
     {
@@ -1585,8 +1880,13 @@ namespace LegionRuntime {
 
     void ReservationImpl::release(Event wait_on)
     {
+        // Held through the fast path and nobody has come asking since
+        if (!wait_on.exists() &&
+            __sync_bool_compare_and_swap(&fast_state, FAST_HELD, FAST_FREE))
+          return;
 	//PTHREAD_SAFE_CALL(pthread_mutex_lock(mutex));
     NK_LOCK(mutex);
+        absorb_fast_state();
         log_reservation(LEVEL_DEBUG,"release request: reservation=%x mode=%d excl=%d event=" IDFMT "/%d count=%d",
                  index, mode, exclusive, wait_on.id, wait_on.gen, holders);
         std::set<EventImpl*> to_trigger;
@@ -1607,6 +1907,7 @@ namespace LegionRuntime {
 		// No need to wait to perform the release 
 		perform_release(to_trigger);		
 	}
+        settle_fast_state();
 	//PTHREAD_SAFE_CALL(pthread_mutex_unlock(mutex));
     NK_UNLOCK(mutex);
         // Don't perform any triggers while holding the reservation's mutex 
@@ -1625,6 +1926,7 @@ namespace LegionRuntime {
         std::set<EventImpl*> to_trigger;
 	//PTHREAD_SAFE_CALL(pthread_mutex_lock(mutex));
     NK_LOCK(mutex);
+        absorb_fast_state();
         // If the trigger handle is 0 then release the reservation, 
         // otherwise find the reservation request to wake up
         if (handle == 0)
@@ -1687,6 +1989,7 @@ namespace LegionRuntime {
           assert(found);
 #endif
         }
+        settle_fast_state();
 	//PTHREAD_SAFE_CALL(pthread_mutex_unlock(mutex));
     NK_UNLOCK(mutex);
     NAUTILUS_DEEP_DEBUG("iterating triggers\n");
@@ -1801,6 +2104,7 @@ namespace LegionRuntime {
 		active = true;
 		result = true;
 		waiters = false;
+                fast_state = FAST_FREE;
                 if (dsize > 0)
                 {
                     data_size = dsize;
@@ -1875,6 +2179,14 @@ namespace LegionRuntime {
 	return p->spawn(func_id, args, arglen, wait_on, priority);
     }
 
+    Event Processor::spawn_nocopy(Processor::TaskFuncID func_id, const void * args,
+                                  size_t arglen, Event wait_on, int priority) const
+    {
+        DetailedTimer::ScopedPush sp(TIME_LOW_LEVEL);
+	ProcessorImpl *p = Runtime::get_runtime()->get_processor_impl(*this);
+	return p->spawn(func_id, args, arglen, wait_on, priority, false);
+    }
+
     Processor Processor::get_utility_processor(void) const
     {
         DetailedTimer::ScopedPush sp(TIME_LOW_LEVEL);
@@ -1903,6 +2215,13 @@ namespace LegionRuntime {
         p->disable_idle_task();
     }
 
+    void Processor::set_rt_hint(const RTHint &hint) const
+    {
+        DetailedTimer::ScopedPush sp(TIME_LOW_LEVEL);
+        ProcessorImpl *p = Runtime::get_runtime()->get_processor_impl(*this);
+        p->set_rt_hint(hint);
+    }
+
     AddressSpace Processor::address_space(void) const
     {
       return 0;
@@ -1925,6 +2244,20 @@ namespace LegionRuntime {
 
     void ProcessorImpl::initialize_state(size_t stacksize)
     {
+        // Machine::run() starts processor N on the Nth CPU in spread
+        // order, one hardware thread per physical core before any of
+        // their siblings, except for the first, which runs on the
+        // thread that set up the machine
+        cpu = (proc.id == 1) ? (int)my_cpu_id() : (int)nk_topo_spread_cpu(proc.id);
+        rt_hint.kind = Processor::RTHint::RT_NONE;
+#ifdef NAUT_CONFIG_LEGION_RT_PROCS
+        if (NAUT_CONFIG_LEGION_RT_PROC_SLICE_US > 0)
+        {
+          rt_hint.kind = Processor::RTHint::RT_PERIODIC;
+          rt_hint.period_ns = NAUT_CONFIG_LEGION_RT_PROC_PERIOD_US * 1000ULL;
+          rt_hint.slice_ns = NAUT_CONFIG_LEGION_RT_PROC_SLICE_US * 1000ULL;
+        }
+#endif
         // stack size is 0 if we don't need a thread at all
         if(stacksize == 0) return;
 
@@ -1953,13 +2286,56 @@ namespace LegionRuntime {
         members.push_back(proc);
     }
 
+    /*static*/ ProcessorImpl::TaskPool ProcessorImpl::task_pools[NAUT_CONFIG_MAX_CPUS];
+
+    /*static*/ ProcessorImpl::TaskDesc* ProcessorImpl::alloc_task(void)
+    {
+        uint8_t flags = irq_disable_save();
+        unsigned cpu = my_cpu_id();
+        TaskPool *pool = &task_pools[cpu];
+        TaskDesc *task = pool->free;
+        if (!task)
+          task = __sync_lock_test_and_set(&pool->returned, (TaskDesc*)NULL);
+        if (task)
+          pool->free = task->next_free;
+        irq_enable_restore(flags);
+        if (!task)
+        {
+          task = new TaskDesc();
+          task->home = cpu;
+        }
+        return task;
+    }
+
+    /*static*/ void ProcessorImpl::free_task(TaskDesc *task)
+    {
+        task->release_args();
+        TaskPool *pool = &task_pools[task->home];
+        uint8_t flags = irq_disable_save();
+        if (task->home == my_cpu_id())
+        {
+          task->next_free = pool->free;
+          pool->free = task;
+        }
+        else
+        {
+          TaskDesc *old;
+          do {
+            old = pool->returned;
+            task->next_free = old;
+          } while (!__sync_bool_compare_and_swap(&pool->returned, old, task));
+        }
+        irq_enable_restore(flags);
+    }
+
     Event ProcessorImpl::spawn(Processor::TaskFuncID func_id, const void * args,
-				size_t arglen, Event wait_on, int priority)
+				size_t arglen, Event wait_on, int priority, bool copy_args)
     {
         NK_PROFILE_ENTRY();
-	TaskDesc *task = new TaskDesc(func_id, args, arglen, wait_on,
-                                      Runtime::get_runtime()->get_free_event(),
-                                      priority, 0, 0, 1);
+	TaskDesc *task = alloc_task();
+        task->init(func_id, args, arglen, wait_on,
+                   Runtime::get_runtime()->get_free_event(),
+                   priority, 0, 0, 1, copy_args);
 	Event result = task->complete->get_event();
 
         enqueue_task(task);	
@@ -2152,6 +2528,20 @@ namespace LegionRuntime {
       NK_UNLOCK(mutex);
     }
 
+    // Legion's own threads are aperiodic to the real-time scheduler
+    static int legion_thread_start(void (*fun)(void*, void**), void *input,
+                                   nk_thread_id_t *tid, int cpu)
+    {
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+        rt_constraints c;
+        memset(&c, 0, sizeof(c));
+        return nk_thread_start(fun, input, NULL, 0, TSTACK_2MB, tid, cpu,
+                               APERIODIC, &c, 0);
+#else
+        return nk_thread_start(fun, input, NULL, 0, TSTACK_2MB, tid, cpu);
+#endif
+    }
+
     void ProcessorImpl::run(void)
     {
         printk("This processor starting ProcessorImpl::run (%d)\n", proc.id);
@@ -2193,6 +2583,16 @@ namespace LegionRuntime {
         init_bar = NULL;
         //fprintf(stdout,"Processor %d is starting\n",proc.id);
         //fflush(stdout);
+#ifdef NAUT_CONFIG_LEGION_RT_PROCS
+        // The mappers have had their say by now
+        if (rt_hint.kind != Processor::RTHint::RT_NONE && run_reserved())
+          return;
+#endif
+        run_tasks();
+    }
+
+    void ProcessorImpl::run_tasks(void)
+    {
 	// Processors run forever and permit shutdowns
 	while (true)
 	{
@@ -2208,6 +2608,97 @@ namespace LegionRuntime {
     NAUTILUS_DEEP_DEBUG("Processor quitting\n");
     }
 
+#ifdef NAUT_CONFIG_LEGION_RT_PROCS
+    // Hand the task loop to a thread on this core with the reservation
+    // we were given, and wait for it; the thread we started on does
+    // nothing more than that
+    bool ProcessorImpl::run_reserved(void)
+    {
+        rt_constraints c;
+        uint64_t deadline = 0;
+        int type;
+        memset(&c, 0, sizeof(c));
+        if (rt_hint.kind == Processor::RTHint::RT_PERIODIC)
+        {
+          type = PERIODIC;
+          c.periodic.period = rt_ns(rt_hint.period_ns);
+          c.periodic.slice = rt_ns(rt_hint.slice_ns);
+        }
+        else
+        {
+          type = SPORADIC;
+          c.sporadic.work = rt_ns(rt_hint.slice_ns);
+          deadline = cur_time() + rt_ns(rt_hint.period_ns);
+        }
+        nk_thread_id_t tid;
+        if (nk_thread_start((void (*)(void*, void**))start_reserved, (void*)this,
+                            NULL, 0, TSTACK_2MB, &tid, my_cpu_id(),
+                            type, &c, deadline))
+        {
+          printk("Processor %d could not get its reservation, running aperiodic\n",
+                 proc.id);
+          return false;
+        }
+        void *result;
+        nk_join(tid, &result);
+        return true;
+    }
+
+    void* ProcessorImpl::start_reserved(void *p)
+    {
+        ProcessorImpl *proc = (ProcessorImpl*)p;
+        {
+          unsigned *thread_id = (unsigned*)malloc(sizeof(unsigned));
+          *thread_id = proc->proc.id;
+          nk_tls_set(local_proc_key, thread_id);
+        }
+        nk_tls_set(thread_timer_key, NULL);
+        proc->run_tasks();
+        nk_thread_exit(NULL);
+        return NULL;
+    }
+#endif
+
+#ifdef NAUT_CONFIG_LEGION_RT_FIBERS
+    // Runs the task on a fiber of its own.  Outside of a fiber we
+    // become the fiber scheduler until the task, and whatever its
+    // waits have started, are done; inside one the task is only
+    // queued, and runs once the current fiber waits.
+    void ProcessorImpl::spawn_task(TaskDesc *task)
+    {
+        task->runner = this;
+        if (!nk_fiber_start(task_fiber, task))
+        {
+          run_task(task);
+          return;
+        }
+        if (!nk_fiber_current())
+          nk_fiber_run();
+    }
+
+    /*static*/ void ProcessorImpl::task_fiber(void *t)
+    {
+        TaskDesc *task = (TaskDesc*)t;
+        task->runner->run_task(task);
+    }
+
+    struct PreemptWaiter {
+        ProcessorImpl *proc;
+        EventImpl *event;
+        EventImpl::EventGeneration needed;
+    };
+
+    // The waiting fiber goes again once its event has triggered or
+    // there is a task it could start.  The queue is only peeked at,
+    // the fiber takes the lock before popping.
+    /*static*/ int ProcessorImpl::preempt_ready(void *w)
+    {
+        PreemptWaiter *waiter = (PreemptWaiter*)w;
+        return (waiter->event->has_triggered(waiter->needed) ||
+                !waiter->proc->ready_queue.empty());
+    }
+#endif
+
     void ProcessorImpl::preempt(EventImpl *event, EventImpl::EventGeneration needed)
     {
 	// Try registering this processor with the event in case it goes to sleep
@@ -2220,6 +2711,31 @@ namespace LegionRuntime {
         NK_UNLOCK(mutex);
 		return;
 	}
+#ifdef NAUT_CONFIG_LEGION_RT_FIBERS
+        // On a fiber, start ready tasks on fibers of their own and
+        // let them run while we wait, rather than nesting them on
+        // our stack
+        if (nk_fiber_current())
+        {
+          NK_UNLOCK(mutex);
+          PreemptWaiter waiter = { this, event, needed };
+          while (!(event->has_triggered(needed)))
+          {
+            NK_LOCK(mutex);
+            if (!ready_queue.empty() && !scheduler_invoked)
+            {
+              TaskDesc *task = ready_queue.front();
+              ready_queue.pop_front();
+              NK_UNLOCK(mutex);
+              spawn_task(task);
+            }
+            else
+              NK_UNLOCK(mutex);
+            nk_fiber_wait(preempt_ready, &waiter);
+          }
+          return;
+        }
+#endif
         // have to hold the lock here when testing this
         // so we don't accidentally miss a wake-up when
         // going to sleep.
@@ -2415,80 +2931,90 @@ namespace LegionRuntime {
             NAUTILUS_DEEP_DEBUG("arglen after q pop: %u\n", task->arglen);
             //PTHREAD_SAFE_CALL(pthread_mutex_unlock(mutex));	
             NK_UNLOCK(mutex);
-            // See if we need to run it or if has already been done
-            NAUTILUS_DEEP_DEBUG("atomic add start_arrivals\n");
-            int start_count = __sync_fetch_and_add(&(task->start_arrivals),1);
-            // If we are the first one to do arrival at this task do it
-            if (start_count == 0)
+#ifdef NAUT_CONFIG_LEGION_RT_FIBERS
+            spawn_task(task);
+#else
+            run_task(task);
+#endif
+        }
+        NK_PROFILE_EXIT_NAME(ProcessorImpl::execute_task2);
+        //irq_enable_restore(irqflags);
+        return false;
+    }
+
+    // Runs a task popped off the ready queue, without the lock
+    void ProcessorImpl::run_task(TaskDesc *task)
+    {
+        // See if we need to run it or if has already been done
+        NAUTILUS_DEEP_DEBUG("atomic add start_arrivals\n");
+        int start_count = __sync_fetch_and_add(&(task->start_arrivals),1);
+        // If we are the first one to do arrival at this task do it
+        if (start_count == 0)
+        {
+        NK_PROFILE_ENTRY_NAME(ProcessorImpl::execute_taskACTUALLYDOING);
+            NAUTILUS_DEEP_DEBUG("start count == 0, checking for shutdown\n");
+            // Check for the shutdown function
+            if (task->func_id == 0)
             {
-            NK_PROFILE_ENTRY_NAME(ProcessorImpl::execute_taskACTUALLYDOING);
-                NAUTILUS_DEEP_DEBUG("start count == 0, checking for shutdown\n");
-                // Check for the shutdown function
-                if (task->func_id == 0)
+                NAUTILUS_DEEP_DEBUG("task func id == 0\n");
+                shutdown = true;
+                shutdown_trigger = task->complete;
+                // Check to see if we have a utility processor, if so mark that we're done
+                // and then set the flag to indicate when the utility processor has drained
+                // its tasks
+                if (!is_utility_proc && (utility_proc != this))
                 {
-                    NAUTILUS_DEEP_DEBUG("task func id == 0\n");
-                    shutdown = true;
-                    shutdown_trigger = task->complete;
-                    // Check to see if we have a utility processor, if so mark that we're done
-                    // and then set the flag to indicate when the utility processor has drained
-                    // its tasks
-                    if (!is_utility_proc && (utility_proc != this))
-                    {
-                        util_shutdown = false;
-                        // Tell our utility processor to tell us when it's done
-                        utility_proc->release_user();
-                    }
-                    else
-                    {
-                        // We didn't have a utility processor to shutdown
-                        util_shutdown = true;
-                    }
+                    util_shutdown = false;
+                    // Tell our utility processor to tell us when it's done
+                    utility_proc->release_user();
                 }
                 else
                 {
-                    NAUTILUS_DEEP_DEBUG("func id != 0 (%u)\n", task->func_id);
+                    // We didn't have a utility processor to shutdown
+                    util_shutdown = true;
+                }
+            }
+            else
+            {
+                NAUTILUS_DEEP_DEBUG("func id != 0 (%u)\n", task->func_id);
 #ifdef DEBUG_LOW_LEVEL
-                    assert(task_table.find(task->func_id) != task_table.end());
+                assert(task_table.find(task->func_id) != task_table.end());
 #endif
-                    Processor::TaskFuncPtr func = task_table[task->func_id];	
-
-                    /*
-                       for (std::map<Processor::TaskFuncID, Processor::TaskFuncPtr>::iterator it = task_table.begin(); it != task_table.end(); ++it) {
-                       printk("task = (%u, %p)\n", (*it).first, (*it).second);
-                       NAUTILUS_DEEP_DEBUG("task = (%u, %p)\n", (*it).first, (*it).second);
-                       }
-                       */
-
-                    // KCH: added
-                    //__do_backtrace(__builtin_frame_address(0), 0);
-
-
-                    NAUTILUS_DEEP_DEBUG("invoking func :%p\n", func);
-                    //uint8_t flags = irq_disable_save();
-                    func(task->args, task->arglen, proc);
-                    //irq_enable_restore(flags);
-                    // Trigger the event indicating that the task has been run
-                    NAUTILUS_DEEP_DEBUG("triggering in execute task: %p\n", task);
-                    if (!task || !task->complete) {
-                        NAUTILUS_DEEP_DEBUG("null pointer task: %p\n", task);
-                    }
-                    task->complete->trigger();
+                Processor::TaskFuncPtr func = task_table[task->func_id];	
+
+                /*
+                   for (std::map<Processor::TaskFuncID, Processor::TaskFuncPtr>::iterator it = task_table.begin(); it != task_table.end(); ++it) {
+                   printk("task = (%u, %p)\n", (*it).first, (*it).second);
+                   NAUTILUS_DEEP_DEBUG("task = (%u, %p)\n", (*it).first, (*it).second);
+                   }
+                   */
+
+                // KCH: added
+                //__do_backtrace(__builtin_frame_address(0), 0);
+
+
+                NAUTILUS_DEEP_DEBUG("invoking func :%p\n", func);
+                //uint8_t flags = irq_disable_save();
+                func(task->args, task->arglen, proc);
+                //irq_enable_restore(flags);
+                // Trigger the event indicating that the task has been run
+                NAUTILUS_DEEP_DEBUG("triggering in execute task: %p\n", task);
+                if (!task || !task->complete) {
+                    NAUTILUS_DEEP_DEBUG("null pointer task: %p\n", task);
                 }
-            NK_PROFILE_EXIT_NAME(ProcessorImpl::execute_taskACTUALLYDOING);
-            }
-            NAUTILUS_DEEP_DEBUG("out of start_count block\n");
-            // Now see if we need to delete it
-            int expected_finish = task->expected;
-            int finish_count = __sync_add_and_fetch(&(task->finish_arrivals),1);
-            if (finish_count == expected_finish) {
-                NAUTILUS_DEEP_DEBUG("deleting task\n");
-                delete task;
-                NAUTILUS_DEEP_DEBUG("task deleted\n");
+                task->complete->trigger();
             }
+        NK_PROFILE_EXIT_NAME(ProcessorImpl::execute_taskACTUALLYDOING);
+        }
+        NAUTILUS_DEEP_DEBUG("out of start_count block\n");
+        // Now see if we need to delete it
+        int expected_finish = task->expected;
+        int finish_count = __sync_add_and_fetch(&(task->finish_arrivals),1);
+        if (finish_count == expected_finish) {
+            NAUTILUS_DEEP_DEBUG("deleting task\n");
+            free_task(task);
+            NAUTILUS_DEEP_DEBUG("task deleted\n");
         }
-        NK_PROFILE_EXIT_NAME(ProcessorImpl::execute_task2);
-        //irq_enable_restore(irqflags);
-        return false;
     }
 
     bool ProcessorImpl::trigger(unsigned count, TriggerHandle handle)
@@ -2555,12 +3081,13 @@ namespace LegionRuntime {
     }
 
     Event ProcessorGroup::spawn(Processor::TaskFuncID func_id, const void * args,
-				size_t arglen, Event wait_on, int priority)
+				size_t arglen, Event wait_on, int priority, bool copy_args)
     {
       // Create a new task description and enqueue it for all the members
-      TaskDesc *task = new TaskDesc(func_id, args, arglen, wait_on,
-                                    Runtime::get_runtime()->get_free_event(),
-                                    priority, 0, 0, members.size());
+      TaskDesc *task = alloc_task();
+      task->init(func_id, args, arglen, wait_on,
+                 Runtime::get_runtime()->get_free_event(),
+                 priority, 0, 0, members.size(), copy_args);
       Event result = task->complete->get_event();
 
       for (std::vector<ProcessorImpl*>::const_iterator it = members.begin();
@@ -2579,8 +3106,9 @@ namespace LegionRuntime {
 
     class MemoryImpl {
     public:
-	MemoryImpl(size_t max, Memory::Kind k) 
-		: max_size(max), remaining(max), kind(k)
+	MemoryImpl(size_t max, Memory::Kind k, int domain = -1) 
+		: max_size(max), remaining(max), cached_bytes(0),
+		  kind(k), numa_domain(domain)
 	{
                 //mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
 		//PTHREAD_SAFE_CALL(pthread_mutex_init(mutex,NULL));
@@ -2590,6 +3118,7 @@ namespace LegionRuntime {
 	}
         ~MemoryImpl(void)
         {
+                release_cache();
                 //PTHREAD_SAFE_CALL(pthread_mutex_destroy(mutex));
                 NK_LOCK_DEINIT(mutex);
                 free(mutex);
@@ -2600,35 +3129,94 @@ namespace LegionRuntime {
 	void free_space(void *ptr, size_t size);
         size_t total_space(void) const;  
         Memory::Kind get_kind(void) const;
+        // the NUMA domain its space comes from, -1 if it could be any
+        int get_numa_domain(void) const { return numa_domain; }
+    private:
+        static size_t block_size(size_t size);
+        // give the cached blocks back to the heap, mutex held
+        void release_cache(void);
     private:
 	const size_t max_size;
 	size_t remaining;
+        // Freed instances are kept here by size class so the next
+        // instance of that size doesn't go to the heap; their space
+        // counts as used until the cache is released
+        std::map<size_t,std::vector<void*> > cached_blocks;
+        size_t cached_bytes;
 	//pthread_mutex_t *mutex;
     NK_LOCK_T *mutex;
         const Memory::Kind kind;
+        const int numa_domain;
     };
 
     size_t MemoryImpl::remaining_bytes(void) 
     {
 	//PTHREAD_SAFE_CALL(pthread_mutex_lock(mutex));
     NK_LOCK(mutex);
-	size_t result = remaining;
+	size_t result = remaining + cached_bytes;
 	//PTHREAD_SAFE_CALL(pthread_mutex_unlock(mutex));
     NK_UNLOCK(mutex);
 	return result;
     }
 
+    // Sizes are rounded up to one of four classes per power of two,
+    // so a cached block fits any request of its class
+    size_t MemoryImpl::block_size(size_t size)
+    {
+	if (size <= INST_CACHE_MIN_BLOCK)
+		return INST_CACHE_MIN_BLOCK;
+	unsigned shift = (63 - __builtin_clzl(size - 1)) - 2;
+	size_t step = 1UL << shift;
+	return (size + step - 1) & ~(step - 1);
+    }
+
+    void MemoryImpl::release_cache(void)
+    {
+	for (std::map<size_t,std::vector<void*> >::iterator it = 
+		cached_blocks.begin(); it != cached_blocks.end(); it++)
+	{
+		for (unsigned idx = 0; idx < it->second.size(); idx++)
+			free(it->second[idx]);
+	}
+	cached_blocks.clear();
+	remaining += cached_bytes;
+	cached_bytes = 0;
+    }
+
     void* MemoryImpl::allocate_space(size_t size)
     {
+	size = block_size(size);
 	//PTHREAD_SAFE_CALL(pthread_mutex_lock(mutex));
     NK_LOCK(mutex);
 	void *ptr = NULL;
+	std::map<size_t,std::vector<void*> >::iterator finder = 
+		cached_blocks.find(size);
+	if ((finder != cached_blocks.end()) && !finder->second.empty())
+	{
+		ptr = finder->second.back();
+		finder->second.pop_back();
+		cached_bytes -= size;
+		NK_UNLOCK(mutex);
+		return ptr;
+	}
+	// Under pressure, trade the cache for the space it holds
+	if ((size >= remaining) && (cached_bytes > 0))
+		release_cache();
 	if (size < remaining)
 	{
 		remaining -= size;
-		ptr = malloc(size);
+		if (numa_domain >= 0)
+		{
+			// The domain can run out before our share of it does,
+			// in which case the instance goes to the next memory
+			ptr = malloc_node(size, numa_domain);
+			if (!ptr)
+				remaining += size;
+		}
+		else
+			ptr = malloc(size);
 #ifdef DEBUG_LOW_LEVEL
-		assert(ptr != NULL);
+		assert((ptr != NULL) || (numa_domain >= 0));
 #endif
 	}
 	//PTHREAD_SAFE_CALL(pthread_mutex_unlock(mutex));
@@ -2643,8 +3231,17 @@ namespace LegionRuntime {
 #ifdef DEBUG_LOW_LEVEL
 	assert(ptr != NULL);
 #endif
-	remaining += size;
-	free(ptr);
+	size = block_size(size);
+	if ((cached_bytes + size) <= (max_size / INST_CACHE_SHARE))
+	{
+		cached_blocks[size].push_back(ptr);
+		cached_bytes += size;
+	}
+	else
+	{
+		remaining += size;
+		free(ptr);
+	}
 	//PTHREAD_SAFE_CALL(pthread_mutex_unlock(mutex));
     NK_UNLOCK(mutex);
     }
@@ -3123,7 +3720,7 @@ namespace LegionRuntime {
         : srcs(_srcs), dsts(_dsts), 
           domain(_domain),
           redop_id(_redop_id), red_fold(_red_fold),
-          done_event(_done_event) 
+          done_event(_done_event), spans_left(1), started(0), streaming(-1)
       {
         //PTHREAD_SAFE_CALL(pthread_mutex_init(&mutex,NULL));    
         NK_LOCK_INIT(&mutex);
@@ -3139,6 +3736,12 @@ namespace LegionRuntime {
       }
 
       void perform_copy_operation(void);
+      // copy part of an index space, the spans of a copy may run at once
+      void perform_copy_span(int start, int count);
+      // once every span is done, returns true if this was the last one
+      bool finish_copy_span(void);
+      // bytes written over the whole copy
+      size_t copy_bytes(void);
 
       virtual bool trigger(unsigned count = 1, TriggerHandle handle = 0);
 
@@ -3153,6 +3756,11 @@ namespace LegionRuntime {
       EventImpl *done_event;
       //pthread_mutex_t mutex;
       NK_LOCK_T mutex;
+      // spans the DMA queue split this copy into that are still running
+      volatile int spans_left;
+      volatile int started;
+      volatile int streaming;     // -1 until the first span looks
+      friend class DMAQueue;
     };
 
     ////////////////////////////////////////////////////////
@@ -3658,26 +4266,258 @@ namespace LegionRuntime {
         return false;
     }
 
+    ////////////////////////////////////////////////////////
+    // SIMD Kernels 
+    ////////////////////////////////////////////////////////
+
+    // The widest vectors both the core and the kernel's saved FPU
+    // state allow, picked the first time a kernel runs. These are
+    // built with per-function targets, so the rest of the runtime
+    // stays free of AVX and runs on any core.
+    namespace SimdKernels {
+      enum { SIMD_UNKNOWN = -1, SIMD_SCALAR, SIMD_AVX, SIMD_AVX512 };
+
+#define XCR0_AVX    0x06ULL   // SSE and the upper halves of the YMMs
+#define XCR0_AVX512 0xe6ULL   // and opmasks and the rest of the ZMMs
+
+      static volatile int simd_level = SIMD_UNKNOWN;
+
+      static int pick_simd_level(void)
+      {
+        unsigned a, b, c, d;
+        uint64_t xcr0 = nk_fpu_xcr0();
+        int level = SIMD_SCALAR;
+        __cpuid(1, a, b, c, d);
+        if ((c & bit_AVX) && (c & bit_OSXSAVE) && ((xcr0 & XCR0_AVX) == XCR0_AVX))
+        {
+          level = SIMD_AVX;
+          __cpuid_count(7, 0, a, b, c, d);
+          if ((b & bit_AVX512F) && ((xcr0 & XCR0_AVX512) == XCR0_AVX512))
+            level = SIMD_AVX512;
+        }
+        printk("Legion DMA kernels use %s\n", 
+               level == SIMD_AVX512 ? "AVX-512" : level == SIMD_AVX ? "AVX" : "scalar code");
+        return level;
+      }
+
+      static inline int get_simd_level(void)
+      {
+        if (simd_level == SIMD_UNKNOWN)
+          simd_level = pick_simd_level();
+        return simd_level;
+      }
+
+      // One vector loop per element type, operation and width, the
+      // remainder is left to the scalar code
+#define SIMD_REDUCE(name, isa, T, VT, WIDTH, LOAD, OP, STORE)      \
+      __attribute__((target(isa)))                                \
+      static size_t name(T *lhs, const T *rhs, size_t count)      \
+      {                                                           \
+        size_t i;                                                 \
+        for (i = 0; i + WIDTH <= count; i += WIDTH) {             \
+          VT l = LOAD(lhs + i);                                   \
+          VT r = LOAD(rhs + i);                                   \
+          STORE(lhs + i, OP(l, r));                               \
+        }                                                         \
+        return i;                                                 \
+      }
+
+      SIMD_REDUCE(sum_f32_avx, "avx", float, __m256, 8, _mm256_loadu_ps, _mm256_add_ps, _mm256_storeu_ps)
+      SIMD_REDUCE(prod_f32_avx, "avx", float, __m256, 8, _mm256_loadu_ps, _mm256_mul_ps, _mm256_storeu_ps)
+      SIMD_REDUCE(sum_f64_avx, "avx", double, __m256d, 4, _mm256_loadu_pd, _mm256_add_pd, _mm256_storeu_pd)
+      SIMD_REDUCE(prod_f64_avx, "avx", double, __m256d, 4, _mm256_loadu_pd, _mm256_mul_pd, _mm256_storeu_pd)
+      SIMD_REDUCE(sum_f32_avx512, "avx512f", float, __m512, 16, _mm512_loadu_ps, _mm512_add_ps, _mm512_storeu_ps)
+      SIMD_REDUCE(prod_f32_avx512, "avx512f", float, __m512, 16, _mm512_loadu_ps, _mm512_mul_ps, _mm512_storeu_ps)
+      SIMD_REDUCE(sum_f64_avx512, "avx512f", double, __m512d, 8, _mm512_loadu_pd, _mm512_add_pd, _mm512_storeu_pd)
+      SIMD_REDUCE(prod_f64_avx512, "avx512f", double, __m512d, 8, _mm512_loadu_pd, _mm512_mul_pd, _mm512_storeu_pd)
+
+#undef SIMD_REDUCE
+
+      void reduce(ReductionSimdKind kind, float *lhs, const float *rhs, size_t count)
+      {
+        size_t i = 0;
+        switch (get_simd_level()) {
+          case SIMD_AVX512:
+            i = (kind == REDOP_SIMD_SUM) ? sum_f32_avx512(lhs, rhs, count) 
+                                         : prod_f32_avx512(lhs, rhs, count);
+            break;
+          case SIMD_AVX:
+            i = (kind == REDOP_SIMD_SUM) ? sum_f32_avx(lhs, rhs, count) 
+                                         : prod_f32_avx(lhs, rhs, count);
+            break;
+        }
+        for (; i < count; i++)
+          lhs[i] = (kind == REDOP_SIMD_SUM) ? lhs[i] + rhs[i] : lhs[i] * rhs[i];
+      }
+
+      void reduce(ReductionSimdKind kind, double *lhs, const double *rhs, size_t count)
+      {
+        size_t i = 0;
+        switch (get_simd_level()) {
+          case SIMD_AVX512:
+            i = (kind == REDOP_SIMD_SUM) ? sum_f64_avx512(lhs, rhs, count) 
+                                         : prod_f64_avx512(lhs, rhs, count);
+            break;
+          case SIMD_AVX:
+            i = (kind == REDOP_SIMD_SUM) ? sum_f64_avx(lhs, rhs, count) 
+                                         : prod_f64_avx(lhs, rhs, count);
+            break;
+        }
+        for (; i < count; i++)
+          lhs[i] = (kind == REDOP_SIMD_SUM) ? lhs[i] + rhs[i] : lhs[i] * rhs[i];
+      }
+
+      __attribute__((target("avx")))
+      static size_t copy_avx(char *dst, const char *src, size_t bytes)
+      {
+        size_t i;
+        for (i = 0; i + 128 <= bytes; i += 128) {
+          __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+          __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+          __m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+          __m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 96));
+          _mm256_storeu_si256((__m256i *)(dst + i), a);
+          _mm256_storeu_si256((__m256i *)(dst + i + 32), b);
+          _mm256_storeu_si256((__m256i *)(dst + i + 64), c);
+          _mm256_storeu_si256((__m256i *)(dst + i + 96), d);
+        }
+        return i;
+      }
+
+      __attribute__((target("avx512f")))
+      static size_t copy_avx512(char *dst, const char *src, size_t bytes)
+      {
+        size_t i;
+        for (i = 0; i + 256 <= bytes; i += 256) {
+          __m512i a = _mm512_loadu_si512((const void *)(src + i));
+          __m512i b = _mm512_loadu_si512((const void *)(src + i + 64));
+          __m512i c = _mm512_loadu_si512((const void *)(src + i + 128));
+          __m512i d = _mm512_loadu_si512((const void *)(src + i + 192));
+          _mm512_storeu_si512((void *)(dst + i), a);
+          _mm512_storeu_si512((void *)(dst + i + 64), b);
+          _mm512_storeu_si512((void *)(dst + i + 128), c);
+          _mm512_storeu_si512((void *)(dst + i + 192), d);
+        }
+        return i;
+      }
+
+      // Bytes in the biggest cache, from CPUID leaf 4 on Intel and
+      // extended leaf 0x80000006 on AMD
+      size_t llc_bytes(void)
+      {
+        static size_t llc = 0;
+        if (llc)
+          return llc;
+        unsigned a, b, c, d;
+        size_t best = 0;
+        __cpuid(0, a, b, c, d);
+        if (a >= 4) {
+          for (unsigned i = 0; ; i++) {
+            __cpuid_count(4, i, a, b, c, d);
+            if (!(a & 0x1f))
+              break;
+            size_t size = (size_t)((b >> 22) + 1) * (((b >> 12) & 0x3ff) + 1) *
+                          ((b & 0xfff) + 1) * (c + 1);
+            if (size > best)
+              best = size;
+          }
+        }
+        if (!best) {
+          __cpuid(0x80000000, a, b, c, d);
+          if (a >= 0x80000006) {
+            __cpuid(0x80000006, a, b, c, d);
+            best = (size_t)(d >> 18) * 512 * 1024;
+            if (!best)
+              best = (size_t)(c >> 16) * 1024;
+          }
+        }
+        llc = best ? best : (8 << 20);
+        return llc;
+      }
+
+      void copy(void *dst, const void *src, size_t bytes);
+
+      // For copies bigger than the cache: non-temporal stores and a
+      // prefetch ahead of the loads, so nothing the cores around us
+      // are using gets evicted for data nobody will read soon
+      void stream_copy(void *dst, const void *src, size_t bytes)
+      {
+        char *d = (char *)dst;
+        const char *s = (const char *)src;
+        if (bytes < 4096) {
+          copy(d, s, bytes);
+          return;
+        }
+        size_t head = (size_t)(-(uintptr_t)d) & 15;
+        copy(d, s, head);
+        d += head;
+        s += head;
+        bytes -= head;
+        size_t i;
+        for (i = 0; i + 64 <= bytes; i += 64) {
+          _mm_prefetch(s + i + STREAM_PREFETCH, _MM_HINT_NTA);
+          __m128i w = _mm_loadu_si128((const __m128i *)(s + i));
+          __m128i x = _mm_loadu_si128((const __m128i *)(s + i + 16));
+          __m128i y = _mm_loadu_si128((const __m128i *)(s + i + 32));
+          __m128i z = _mm_loadu_si128((const __m128i *)(s + i + 48));
+          _mm_stream_si128((__m128i *)(d + i), w);
+          _mm_stream_si128((__m128i *)(d + i + 16), x);
+          _mm_stream_si128((__m128i *)(d + i + 32), y);
+          _mm_stream_si128((__m128i *)(d + i + 48), z);
+        }
+        // the streamed lines are out before anyone is told the copy is done
+        _mm_sfence();
+        copy(d + i, s + i, bytes - i);
+      }
+
+      // The kernel's memcpy goes a byte at a time
+      void copy(void *dst, const void *src, size_t bytes)
+      {
+        char *d = (char *)dst;
+        const char *s = (const char *)src;
+        size_t i = 0;
+        switch (get_simd_level()) {
+          case SIMD_AVX512:
+            i = copy_avx512(d, s, bytes);
+            break;
+          case SIMD_AVX:
+            i = copy_avx(d, s, bytes);
+            break;
+        }
+        for (; i + sizeof(uint64_t) <= bytes; i += sizeof(uint64_t))
+          *(uint64_t *)(d + i) = *(const uint64_t *)(s + i);
+        for (; i < bytes; i++)
+          d[i] = s[i];
+      }
+    };
+
     namespace RangeExecutors {
       class Memcpy {
       public:
-        Memcpy(void *_dst_base, const void *_src_base, size_t _elmt_size)
+        Memcpy(void *_dst_base, const void *_src_base, size_t _elmt_size,
+               bool _streaming = false)
           : dst_base((char*)_dst_base), src_base((const char*)_src_base), 
-            elmt_size(_elmt_size) { }
+            elmt_size(_elmt_size), streaming(_streaming) { }
 
         void do_span(int offset, int count)
         {
           off_t byte_offset = offset * elmt_size;
           size_t byte_count = count  * elmt_size;
-          memcpy(dst_base + byte_offset,
-                 src_base + byte_offset,
-                 byte_count);
+          if (streaming)
+            SimdKernels::stream_copy(dst_base + byte_offset,
+                                     src_base + byte_offset,
+                                     byte_count);
+          else
+            SimdKernels::copy(dst_base + byte_offset,
+                              src_base + byte_offset,
+                              byte_count);
         }
 
       protected:
         char *dst_base;
         const char *src_base;
         size_t elmt_size;
+        bool streaming;
       };
 
       class RedopApply {
@@ -3747,7 +4587,11 @@ namespace LegionRuntime {
           // This is a normal copy
 	  // but it assumes AOS!
 	  assert((block_size == 1) && (target->block_size == 1));
-          RangeExecutors::Memcpy rexec(tgt_ptr, src_ptr, elmt_size);
+          size_t bytes = 0;
+          if (dst_mask.last_enabled() >= dst_mask.first_enabled())
+            bytes = (size_t)(dst_mask.last_enabled() - dst_mask.first_enabled() + 1) * elmt_size;
+          RangeExecutors::Memcpy rexec(tgt_ptr, src_ptr, elmt_size, 
+                                       bytes > SimdKernels::llc_bytes());
           ElementMask::forall_ranges(rexec, dst_mask, src_mask);
         }
         else
@@ -4589,11 +5433,37 @@ namespace LegionRuntime {
 	  
       
     namespace RangeExecutors {
+      // Where a span of one field starts, if its elements sit back to
+      // back so the span can be handled in one go, otherwise NULL
+      static char *contiguous_span(RegionInstance::Impl *inst, size_t offset, size_t size,
+                                   int start, int count)
+      {
+        size_t field_start, field_size, within_field;
+        size_t bytes = find_field(inst->get_field_sizes(), offset, size,
+                                  field_start, field_size, within_field);
+        if ((count < 2) || (bytes != size))
+          return NULL;
+        int first = start;
+        int last = start + count - 1;
+        if (inst->get_linearization().get_dim() == 1) {
+          first = inst->get_linearization().get_mapping<1>()->image(first);
+          last = inst->get_linearization().get_mapping<1>()->image(last);
+        }
+        if ((last - first) != (count - 1))
+          return NULL;
+        char *a = (char *)inst->get_address(first, field_start, field_size, within_field);
+        char *b = (char *)inst->get_address(last, field_start, field_size, within_field);
+        if ((size_t)(b - a) != (size_t)(count - 1) * size)
+          return NULL;
+        return a;
+      }
+
       class GatherScatter {
       public:
 	GatherScatter(const std::vector<Domain::CopySrcDstField>& _srcs,
-		      const std::vector<Domain::CopySrcDstField>& _dsts)
-	  : srcs(_srcs), dsts(_dsts)
+		      const std::vector<Domain::CopySrcDstField>& _dsts,
+                      bool _streaming = false)
+	  : srcs(_srcs), dsts(_dsts), streaming(_streaming)
 	{
 	  // determine element size
 	  elem_size = 0;
@@ -4610,6 +5480,20 @@ namespace LegionRuntime {
 
         void do_span(int start, int count)
         {
+          // One field to one field, both laid out as arrays
+          if ((srcs.size() == 1) && (dsts.size() == 1) && (srcs[0].size == dsts[0].size)) {
+            char *src = contiguous_span(Runtime::get_runtime()->get_instance_impl(srcs[0].inst),
+                                        srcs[0].offset, srcs[0].size, start, count);
+            char *dst = contiguous_span(Runtime::get_runtime()->get_instance_impl(dsts[0].inst),
+                                        dsts[0].offset, dsts[0].size, start, count);
+            if (src && dst) {
+              if (streaming)
+                SimdKernels::stream_copy(dst, src, (size_t)count * srcs[0].size);
+              else
+                SimdKernels::copy(dst, src, (size_t)count * srcs[0].size);
+              return;
+            }
+          }
 	  for(int index = start; index < (start + count); index++) {
 	    // gather data from source
 	    int write_offset = 0;
@@ -4729,6 +5613,7 @@ namespace LegionRuntime {
 	std::vector<Domain::CopySrcDstField> dsts;
 	size_t elem_size;
 	char *buffer;
+        bool streaming;
       };
 
       class ReductionFold {
@@ -4747,6 +5632,12 @@ namespace LegionRuntime {
         {
           RegionInstance::Impl *src_inst = Runtime::get_runtime()->get_instance_impl(srcs[0].inst);
           RegionInstance::Impl *dst_inst = Runtime::get_runtime()->get_instance_impl(dsts[0].inst);
+          char *src_run = contiguous_span(src_inst, 0, redop->sizeof_rhs, start, count);
+          char *dst_run = contiguous_span(dst_inst, 0, redop->sizeof_rhs, start, count);
+          if (src_run && dst_run) {
+            redop->fold(dst_run, src_run, count, false/*exclusive*/);
+            return;
+          }
           // This should be from one reduction fold instance to another
           for (int index = start; index < (start+count); index++)
 	  {
@@ -4800,6 +5691,14 @@ namespace LegionRuntime {
           size_t field_start, field_size, within_field;
           size_t bytes = find_field(dst_inst->get_field_sizes(), offset, size,
                                     field_start, field_size, within_field);
+          if (size == redop->sizeof_lhs) {
+            char *src_run = contiguous_span(src_inst, 0, redop->sizeof_rhs, start, count);
+            char *dst_run = contiguous_span(dst_inst, offset, size, start, count);
+            if (src_run && dst_run) {
+              redop->apply(dst_run, src_run, count, false/*exclusive*/);
+              return;
+            }
+          }
           for (int index = start; index < (start+count); index++)
           {
 	    int src_index = index;
@@ -4878,23 +5777,33 @@ namespace LegionRuntime {
     }
 
     void CopyOperation::perform_copy_operation(void)
+    {
+      perform_copy_span(0, -1);
+      finish_copy_span();
+    }
+
+    void CopyOperation::perform_copy_span(int start, int count)
     {
       DetailedTimer::ScopedPush sp(TIME_COPY); 
 #ifdef LEGION_LOGGING
-      LegionRuntime::HighLevel::LegionLogging::log_timing_event(
+      if (__sync_bool_compare_and_swap(&started, 0, 1))
+        LegionRuntime::HighLevel::LegionLogging::log_timing_event(
                                     Processor::NO_PROC,
                                     done_event->get_event(), COPY_BEGIN);
 #endif
 
       if (redop_id == 0)
       {
-        RangeExecutors::GatherScatter rexec(srcs, dsts);
+        // Copies that would not fit in the cache go around it
+        if (streaming < 0)
+          streaming = (copy_bytes() > SimdKernels::llc_bytes());
+        RangeExecutors::GatherScatter rexec(srcs, dsts, streaming > 0);
 
         if(domain.get_dim() == 0) {
           // This is an index space copy
           IndexSpace::Impl *r = Runtime::get_runtime()->get_metadata_impl(domain.get_index_space());
           const ElementMask& mask = r->get_element_mask();
-          ElementMask::forall_ranges(rexec, mask, mask);
+          ElementMask::forall_ranges(rexec, mask, mask, start, count);
         } else {
           rexec.do_domain(domain);
         }
@@ -4910,7 +5819,7 @@ namespace LegionRuntime {
           if (domain.get_dim() == 0) {
             IndexSpace::Impl *r = Runtime::get_runtime()->get_metadata_impl(domain.get_index_space());
             const ElementMask& mask = r->get_element_mask();
-            ElementMask::forall_ranges(rexec, mask, mask);
+            ElementMask::forall_ranges(rexec, mask, mask, start, count);
           } else {
             rexec.do_domain(domain);
           }
@@ -4921,12 +5830,32 @@ namespace LegionRuntime {
           if (domain.get_dim() == 0) {
             IndexSpace::Impl *r = Runtime::get_runtime()->get_metadata_impl(domain.get_index_space());
             const ElementMask& mask = r->get_element_mask();
-            ElementMask::forall_ranges(rexec, mask, mask);
+            ElementMask::forall_ranges(rexec, mask, mask, start, count);
           } else {
             rexec.do_domain(domain);
           }
         }
       }
+    }
+
+    size_t CopyOperation::copy_bytes(void)
+    {
+      size_t elmt_bytes = 0;
+      for (unsigned i = 0; i < dsts.size(); i++)
+        elmt_bytes += dsts[i].size;
+      if (domain.get_dim() > 0)
+        return (size_t)domain.get_volume() * elmt_bytes;
+      IndexSpace::Impl *r = Runtime::get_runtime()->get_metadata_impl(domain.get_index_space());
+      const ElementMask& mask = r->get_element_mask();
+      if (mask.last_enabled() < mask.first_enabled())
+        return 0;
+      return (size_t)(mask.last_enabled() - mask.first_enabled() + 1) * elmt_bytes;
+    }
+
+    bool CopyOperation::finish_copy_span(void)
+    {
+      if (__sync_sub_and_fetch(&spans_left, 1) != 0)
+        return false;
 #ifdef LEGION_LOGGING
       LegionRuntime::HighLevel::LegionLogging::log_timing_event(
                                       Processor::NO_PROC,
@@ -4935,6 +5864,7 @@ namespace LegionRuntime {
       // Trigger the event indicating that we are done
       NAUTILUS_DEEP_DEBUG("Done event trigger\n");
       done_event->trigger();
+      return true;
     }
 
     Event IndexSpace::Impl::copy(RegionInstance src_inst, RegionInstance dst_inst, size_t elem_size,
@@ -4973,14 +5903,46 @@ namespace LegionRuntime {
     ////////////////////////////////////////////////////////
 
     DMAQueue::DMAQueue(unsigned num_threads)
-      : num_dma_threads(num_threads), dma_shutdown(false)
+      : num_dma_threads(num_threads), dma_shutdown(false), next_worker(0)
     {
-      //PTHREAD_SAFE_CALL(pthread_mutex_init(&dma_lock,NULL));
-      NK_LOCK_INIT(&dma_lock);
-      //PTHREAD_SAFE_CALL(pthread_cond_init(&dma_cond,NULL));
-      NAUTILUS_DEEP_DEBUG("dmaqueue condvar init\n");
-      nk_condvar_init(&dma_cond);
       dma_threads.resize(num_dma_threads);
+      workers.resize(num_dma_threads);
+      for (unsigned idx = 0; idx < num_dma_threads; idx++)
+      {
+        DMAWorker *w = new DMAWorker;
+        w->queue = this;
+        w->index = idx;
+        w->cpu = pick_dma_cpu(idx);
+        struct cpu *c = nk_get_nautilus_info()->sys.cpus[w->cpu];
+        w->domain = c->domain ? c->domain->id : 0;
+        w->sleeping = false;
+        //PTHREAD_SAFE_CALL(pthread_mutex_init(&dma_lock,NULL));
+        NK_LOCK_INIT(&w->lock);
+        //PTHREAD_SAFE_CALL(pthread_cond_init(&dma_cond,NULL));
+        NAUTILUS_DEEP_DEBUG("dmaqueue condvar init\n");
+        nk_condvar_init(&w->cond);
+        workers[idx] = w;
+      }
+    }
+
+    // Spread the DMA threads over the NUMA domains, from the top
+    // cores down, away from the processors at the bottom
+    /*static*/ int DMAQueue::pick_dma_cpu(unsigned idx)
+    {
+      int num_cpus = nk_get_num_cpus();
+      unsigned num_domains = nk_get_num_domains();
+      if (num_domains == 0)
+        num_domains = 1;
+      unsigned domain = idx % num_domains;
+      unsigned skip = idx / num_domains;
+      for (int c = num_cpus - 1; c >= 0; c--)
+      {
+        struct cpu *cpu = nk_get_nautilus_info()->sys.cpus[c];
+        unsigned d = cpu->domain ? cpu->domain->id : 0;
+        if ((d == domain) && (skip-- == 0))
+          return c;
+      }
+      return num_cpus - 1 - (idx % num_cpus);
     }
 
     void DMAQueue::start(void)
@@ -4993,26 +5955,26 @@ namespace LegionRuntime {
         PTHREAD_SAFE_CALL(pthread_create(&dma_threads[idx], &attr,
                                          DMAQueue::start_dma_thread, (void*)this));
                                          */
-          nk_thread_start((void (*)(void*,void**))DMAQueue::start_dma_thread, 
-                                          (void*)this, 
-                                          NULL,
-                                          0,
-                                          TSTACK_2MB,
-                                          &dma_threads[idx],
-                                          0);
+          legion_thread_start((void (*)(void*,void**))DMAQueue::start_dma_thread, 
+                              (void*)workers[idx], 
+                              &dma_threads[idx],
+                              workers[idx]->cpu);
       }
       //PTHREAD_SAFE_CALL(pthread_attr_destroy(&attr));
     }
 
     void DMAQueue::shutdown(void)
     {
-      //PTHREAD_SAFE_CALL(pthread_mutex_lock(&dma_lock));
-      NK_LOCK(&dma_lock);
       dma_shutdown = true;
-      //PTHREAD_SAFE_CALL(pthread_cond_broadcast(&dma_cond));
-      //PTHREAD_SAFE_CALL(pthread_mutex_unlock(&dma_lock));
-      nk_condvar_bcast(&dma_cond);
-      NK_UNLOCK(&dma_lock);
+      for (unsigned idx = 0; idx < num_dma_threads; idx++)
+      {
+        //PTHREAD_SAFE_CALL(pthread_mutex_lock(&dma_lock));
+        NK_LOCK(&workers[idx]->lock);
+        //PTHREAD_SAFE_CALL(pthread_cond_broadcast(&dma_cond));
+        //PTHREAD_SAFE_CALL(pthread_mutex_unlock(&dma_lock));
+        nk_condvar_bcast(&workers[idx]->cond);
+        NK_UNLOCK(&workers[idx]->lock);
+      }
       // Now join on all the threads
       NAUTILUS_DEEP_DEBUG("joining %u DMA threads\n", num_dma_threads);
       for (unsigned idx = 0; idx < num_dma_threads; idx++)
@@ -5024,56 +5986,162 @@ namespace LegionRuntime {
       }
     }
 
-    void DMAQueue::run_dma_loop(void)
+    // Our own work first, oldest first, then the newest of someone else's
+    bool DMAQueue::next_work(DMAWorker *w, DMAWork &work)
+    {
+      NK_LOCK(&w->lock);
+      if (!w->work.empty())
+      {
+        work = w->work.front();
+        w->work.pop_front();
+        NK_UNLOCK(&w->lock);
+        return true;
+      }
+      NK_UNLOCK(&w->lock);
+      for (unsigned i = 1; i < num_dma_threads; i++)
+      {
+        DMAWorker *victim = workers[(w->index + i) % num_dma_threads];
+        if (victim->work.empty())
+          continue;
+        NK_LOCK(&victim->lock);
+        if (!victim->work.empty())
+        {
+          work = victim->work.back();
+          victim->work.pop_back();
+          NK_UNLOCK(&victim->lock);
+          return true;
+        }
+        NK_UNLOCK(&victim->lock);
+      }
+      return false;
+    }
+
+    void DMAQueue::do_work(const DMAWork &work)
+    {
+      work.copy->perform_copy_span(work.start, work.count);
+      // Whoever runs the last span triggers the copy and deletes it
+      if (work.copy->finish_copy_span())
+        delete work.copy;
+    }
+
+    void DMAQueue::run_dma_loop(DMAWorker *w)
     {
       while (true)
       {
-        CopyOperation *copy = NULL;
+        DMAWork work;
+        if (next_work(w, work))
+        {
+          do_work(work);
+          continue;
+        }
         //PTHREAD_SAFE_CALL(pthread_mutex_lock(&dma_lock));
-        NK_LOCK(&dma_lock);
-        if (ready_copies.empty() && !dma_shutdown)
+        NK_LOCK(&w->lock);
+        if (w->work.empty() && !dma_shutdown)
         {
-          // Go to sleep
+          // Go to sleep, anything put on our queue wakes us
           //PTHREAD_SAFE_CALL(pthread_cond_wait(&dma_cond, &dma_lock));
-          nk_condvar_wait(&dma_cond, &dma_lock);
+          w->sleeping = true;
+          nk_condvar_wait(&w->cond, &w->lock);
+          w->sleeping = false;
         }
         // When we wake up see if there is anything
         // to do or see if we are done
-        if (!ready_copies.empty())
-        {
-          copy = ready_copies.front();
-          ready_copies.pop_front();
-        }
-        else if (dma_shutdown)
-        {
-          //PTHREAD_SAFE_CALL(pthread_mutex_unlock(&dma_lock));
-          NK_UNLOCK(&dma_lock);
-          // Break out of the loop
-          break;
-        }
-        // Release our lock
+        bool done = w->work.empty() && dma_shutdown;
         //PTHREAD_SAFE_CALL(pthread_mutex_unlock(&dma_lock));
-        NK_UNLOCK(&dma_lock);
-        // If we have a copy perform it and then delete it
-        if (copy != NULL)
+        NK_UNLOCK(&w->lock);
+        if (done)
+          break;
+      }
+    }
+
+    void DMAQueue::push_work(DMAWorker *w, const DMAWork &work)
+    {
+      //PTHREAD_SAFE_CALL(pthread_mutex_lock(&dma_lock));
+      NK_LOCK(&w->lock);
+      w->work.push_back(work);
+      //PTHREAD_SAFE_CALL(pthread_cond_signal(&dma_cond));
+      if (w->sleeping)
+        nk_condvar_signal(&w->cond);
+      //PTHREAD_SAFE_CALL(pthread_mutex_unlock(&dma_lock));
+      NK_UNLOCK(&w->lock);
+    }
+
+    // A thread in the destination's NUMA domain, taking turns among them
+    DMAQueue::DMAWorker *DMAQueue::pick_worker(CopyOperation *copy)
+    {
+      unsigned turn = __sync_fetch_and_add(&next_worker, 1);
+      if (!copy->dsts.empty())
+      {
+        RegionInstance::Impl *inst = 
+          Runtime::get_runtime()->get_instance_impl(copy->dsts[0].inst);
+        struct mem_region *region = 
+          kmem_get_region_by_addr((ulong_t)inst->get_base_ptr());
+        if (region)
         {
-          copy->perform_copy_operation();
-          delete copy;
+          for (unsigned i = 0; i < num_dma_threads; i++)
+          {
+            DMAWorker *w = workers[(turn + i) % num_dma_threads];
+            if (w->domain == region->domain_id)
+              return w;
+          }
         }
       }
+      return workers[turn % num_dma_threads];
     }
 
     void DMAQueue::enqueue_dma(CopyOperation *copy)
     {
       if (num_dma_threads > 0)
       {
-        //PTHREAD_SAFE_CALL(pthread_mutex_lock(&dma_lock));
-        NK_LOCK(&dma_lock);
-        ready_copies.push_back(copy);
-        //PTHREAD_SAFE_CALL(pthread_cond_signal(&dma_cond));
-        nk_condvar_signal(&dma_cond);
-        //PTHREAD_SAFE_CALL(pthread_mutex_unlock(&dma_lock));
-        NK_UNLOCK(&dma_lock);
+        DMAWorker *home = pick_worker(copy);
+        DMAWork work;
+        work.copy = copy;
+        work.start = 0;
+        work.count = -1;
+        if ((num_dma_threads > 1) && (copy->domain.get_dim() == 0))
+        {
+          // See if the copy is big enough to be worth splitting up
+          IndexSpace::Impl *r = 
+            Runtime::get_runtime()->get_metadata_impl(copy->domain.get_index_space());
+          const ElementMask& mask = r->get_element_mask();
+          size_t elmt_bytes = 0;
+          for (unsigned i = 0; i < copy->dsts.size(); i++)
+            elmt_bytes += copy->dsts[i].size;
+          int first = mask.first_enabled();
+          int last = mask.last_enabled();
+          if ((elmt_bytes > 0) && (first >= 0) && (last >= first) &&
+              ((size_t)(last - first + 1) * elmt_bytes > 2 * DMA_CHUNK_BYTES))
+          {
+            int span = DMA_CHUNK_BYTES / elmt_bytes;
+            if (span < 1)
+              span = 1;
+            // Cut the first span short so the rest start on huge page
+            // boundaries of a destination laid out as an array
+            int lead = span;
+            if (copy->dsts.size() == 1)
+            {
+              char *dst = RangeExecutors::contiguous_span(
+                  Runtime::get_runtime()->get_instance_impl(copy->dsts[0].inst),
+                  copy->dsts[0].offset, copy->dsts[0].size, first, last - first + 1);
+              size_t mis = (size_t)dst & (DMA_CHUNK_BYTES - 1);
+              if (dst && mis && ((DMA_CHUNK_BYTES - mis) / elmt_bytes > 0))
+                lead = (DMA_CHUNK_BYTES - mis) / elmt_bytes;
+            }
+            int spans = 1 + (last - first - lead + span) / span;
+            if (lead > last - first)
+              spans = 1;
+            // Every span is counted before any of them can finish
+            copy->spans_left = spans;
+            for (int i = 0; i < spans; i++)
+            {
+              work.start = (i == 0) ? first : first + lead + (i - 1) * span;
+              work.count = (i == 0) ? lead : span;
+              push_work(workers[(home->index + i) % num_dma_threads], work);
+            }
+            return;
+          }
+        }
+        push_work(home, work);
       }
       else
       {
@@ -5085,8 +6153,8 @@ namespace LegionRuntime {
 
     /*static*/ void* DMAQueue::start_dma_thread(void *args)
     {
-      DMAQueue *dma_queue = (DMAQueue*)args;
-      dma_queue->run_dma_loop();
+      DMAWorker *worker = (DMAWorker*)args;
+      worker->queue->run_dma_loop(worker);
       // pthread_exit(NULL);
       nk_thread_exit(NULL);
     }
@@ -5116,6 +6184,26 @@ namespace LegionRuntime {
     // Machine 
     ////////////////////////////////////////////////////////
 
+    // Distance between a processor's or memory's domain and a memory's,
+    // with anything not tied to a domain counted as local
+    static unsigned numa_mem_distance(const Machine *m, int d1, int d2)
+    {
+      if ((d1 < 0) || (d2 < 0))
+        return 10;
+      return m->get_numa_distance(d1, d2);
+    }
+
+    // Scale the numbers for a local system memory by the distance
+    static unsigned numa_bandwidth(unsigned distance)
+    {
+      return (32 * 10) / (distance ? distance : 10);
+    }
+
+    static unsigned numa_latency(unsigned distance)
+    {
+      return (50 * distance) / 10;
+    }
+
     Machine::Machine(int *argc, char ***argv,
 			const Processor::TaskIDTable &task_table,
                         const ReductionOpTable &redop_table,
@@ -5149,6 +6237,7 @@ namespace LegionRuntime {
         //PTHREAD_SAFE_CALL( pthread_key_create(&thread_timer_key, thread_timer_free) );
         nk_tls_key_create(&local_proc_key, thread_proc_free);
         nk_tls_key_create(&thread_timer_key, thread_timer_free);
+        nk_tls_key_create(&trigger_worklist_key, NULL);
 
         for (int i=1; i < *argc; i++)
         {
@@ -5288,16 +6377,28 @@ namespace LegionRuntime {
                 Runtime::runtime->processors.push_back(impl);
         }
 #endif
+        struct nk_locality_info *loc = &nk_get_nautilus_info()->sys.locality_info;
+        // One system memory for each NUMA domain, with its space coming
+        // from that domain; without NUMA information a single one takes
+        // it from anywhere
+        const unsigned num_sys_mems = loc->num_domains ? loc->num_domains : 1;
+        const unsigned first_l1 = num_sys_mems + 1;
+        const unsigned num_l1s = (cpu_l1_size_in_kb > 0) ? num_cpus : 0;
         if (cpu_mem_size_in_mb > 0)
 	{
                 // Make the first memory null
                 Runtime::runtime->memories.push_back(NULL);
-                // Do the global memory
-		Memory global;
-		global.id = 1;
-		memories.insert(global);
-		MemoryImpl *impl = new MemoryImpl(cpu_mem_size_in_mb*1024*1024, Memory::SYSTEM_MEM);
-		Runtime::runtime->memories.push_back(impl);
+                // The global memory is split evenly over the domains
+                for (unsigned d = 0; d < num_sys_mems; d++)
+                {
+                  Memory global;
+                  global.id = d + 1;
+                  memories.insert(global);
+                  int domain = (loc->num_domains && loc->domains[d]) ? (int)d : -1;
+                  MemoryImpl *impl = new MemoryImpl(cpu_mem_size_in_mb*1024*1024 / num_sys_mems,
+                                                    Memory::SYSTEM_MEM, domain);
+                  Runtime::runtime->memories.push_back(impl);
+                }
 	}
         else
         {
@@ -5308,14 +6409,18 @@ namespace LegionRuntime {
                 //exit(1);
                 abort();
         }
-        if (cpu_l1_size_in_kb > 0)
+        if (num_l1s > 0)
         {
-          for (unsigned id=2; id<=(num_cpus+1); id++)
+          // Each processor's L1 is in the processor's own domain
+          for (unsigned idx = 0; idx < num_l1s; idx++)
           {
                   Memory m;
-                  m.id = id;
+                  m.id = first_l1 + idx;
                   memories.insert(m);
-                  MemoryImpl *impl = new MemoryImpl(cpu_l1_size_in_kb*1024, Memory::LEVEL1_CACHE);
+                  Processor owner;
+                  owner.id = idx + 1;
+                  MemoryImpl *impl = new MemoryImpl(cpu_l1_size_in_kb*1024, Memory::LEVEL1_CACHE,
+                                                    get_numa_domain(owner));
                   Runtime::runtime->memories.push_back(impl);
           }
         }
@@ -5327,7 +6432,7 @@ namespace LegionRuntime {
 		visible_memories_from_procs.insert(std::pair<Processor,std::set<Memory> >(p,memories));
 	}	
 	// All memories are visible from all memories, all processors are visible from all memories
-	for (unsigned id=1; id<=(num_cpus+1); id++)
+	for (unsigned id=1; id<(first_l1+num_l1s); id++)
 	{
 		Memory m;
 		m.id = id;
@@ -5338,43 +6443,74 @@ namespace LegionRuntime {
         // Now set up the affinities for each of the different processors and memories
         for (std::set<Processor>::iterator it = procs.begin(); it != procs.end(); it++)
         {
-          // Give all processors 32 GB/s to the global memory
+          // Give all processors 32 GB/s to the global memory in their
+          // domain, and less the further away the others are
+          int proc_domain = get_numa_domain(*it);
+          for (unsigned d = 0; d < num_sys_mems; d++)
           {
-            ProcessorMemoryAffinity global_affin = { *it, {1}, 32, 50/* higher latency */ };
+            Memory m;
+            m.id = d + 1;
+            unsigned dist = numa_mem_distance(this, proc_domain, get_numa_domain(m));
+            ProcessorMemoryAffinity global_affin = { *it, m, numa_bandwidth(dist), numa_latency(dist) };
             proc_mem_affinities.push_back(global_affin);
           }
           // Give the processor good affinity to its L1, but not to other L1
-          for (unsigned id = 2; id <= (num_cpus+1); id++)
+          for (unsigned idx = 0; idx < num_l1s; idx++)
           {
-            if (id == (it->id+1))
+            Memory m;
+            m.id = first_l1 + idx;
+            if (idx == (it->id-1))
             {
               // Our L1, high bandwidth with low latency
-              ProcessorMemoryAffinity local_affin = { *it, {id}, 100, 1/* small latency */};
+              ProcessorMemoryAffinity local_affin = { *it, m, 100, 1/* small latency */};
               proc_mem_affinities.push_back(local_affin);
             }
             else
             {
               // Other L1, low bandwidth with long latency
-              ProcessorMemoryAffinity other_affin = { *it, {id}, 10, 100 /*high latency*/ };
+              ProcessorMemoryAffinity other_affin = { *it, m, 10, 100 /*high latency*/ };
               proc_mem_affinities.push_back(other_affin);
             }
           }
         }
         // Set up the affinities between the different memories
         {
+          // Global to global, by the distance between their domains
+          for (unsigned d = 0; d < num_sys_mems; d++)
+          {
+            for (unsigned other = d+1; other < num_sys_mems; other++)
+            {
+              Memory m1, m2;
+              m1.id = d + 1;
+              m2.id = other + 1;
+              unsigned dist = numa_mem_distance(this, get_numa_domain(m1), get_numa_domain(m2));
+              MemoryMemoryAffinity pair_affin = { m1, m2, numa_bandwidth(dist), numa_latency(dist) };
+              mem_mem_affinities.push_back(pair_affin);
+            }
+          }
           // Global to all others
-          for (unsigned id = 2; id <= (num_cpus+1); id++)
+          for (unsigned d = 0; d < num_sys_mems; d++)
           {
-            MemoryMemoryAffinity global_affin = { {1}, {id}, 32, 50 };
-            mem_mem_affinities.push_back(global_affin);
+            for (unsigned idx = 0; idx < num_l1s; idx++)
+            {
+              Memory m1, m2;
+              m1.id = d + 1;
+              m2.id = first_l1 + idx;
+              unsigned dist = numa_mem_distance(this, get_numa_domain(m1), get_numa_domain(m2));
+              MemoryMemoryAffinity global_affin = { m1, m2, numa_bandwidth(dist), numa_latency(dist) };
+              mem_mem_affinities.push_back(global_affin);
+            }
           }
 
           // From any one to any other one
-          for (unsigned id = 2; id <= (num_cpus+1); id++)
+          for (unsigned idx = 0; idx < num_l1s; idx++)
           {
-            for (unsigned other=id+1; other <= (num_cpus+1); other++)
+            for (unsigned other = idx+1; other < num_l1s; other++)
             {
-              MemoryMemoryAffinity pair_affin = { {id}, {other}, 10, 100 };
+              Memory m1, m2;
+              m1.id = first_l1 + idx;
+              m2.id = first_l1 + other;
+              MemoryMemoryAffinity pair_affin = { m1, m2, 10, 100 };
               mem_mem_affinities.push_back(pair_affin);
             }
           }
@@ -5460,11 +6596,8 @@ namespace LegionRuntime {
                */
             printk("KCH: legion runtime starting background thread\n");
             nk_thread_id_t threadp;
-            nk_thread_start((void (*) (void*, void**))background_run_thread, 
+            legion_thread_start((void (*) (void*, void**))background_run_thread, 
                     (void*)margs, 
-                    NULL,
-                    0,
-                    TSTACK_2MB,
                     &threadp,
                     0);
 
@@ -5490,13 +6623,10 @@ namespace LegionRuntime {
             ProcessorImpl *impl = Runtime::runtime->processors[id];
             //PTHREAD_SAFE_CALL(pthread_create(&(other_threads[id]), &(impl->attr), ProcessorImpl::start, (void*)impl));
             
-            nk_thread_start((void (*)(void*, void**))ProcessorImpl::start,
+            legion_thread_start((void (*)(void*, void**))ProcessorImpl::start,
                     (void*)impl,
-                    NULL,
-                    0,
-                    TSTACK_2MB,
                     &other_threads[id],
-                    id);
+                    impl->get_cpu());
                     //nk_get_cpu_by_lapicid(lev_lapic_pref_order[id]));
         }
         /* NOTE: check */
@@ -5566,6 +6696,82 @@ namespace LegionRuntime {
         return Runtime::get_runtime()->get_memory_impl(m)->get_kind();
     }
 
+    unsigned Machine::get_numa_domain_count(void) const
+    {
+        unsigned n = nk_get_nautilus_info()->sys.locality_info.num_domains;
+        return n ? n : 1;
+    }
+
+    int Machine::get_numa_domain(Processor p) const
+    {
+        ProcessorImpl *impl = Runtime::get_runtime()->get_processor_impl(p);
+        if (impl->get_proc_kind() == Processor::PROC_GROUP)
+          return -1;
+        struct sys_info *sys = &nk_get_nautilus_info()->sys;
+        int cpu = impl->get_cpu();
+        if ((cpu < 0) || ((unsigned)cpu >= sys->num_cpus) || !sys->cpus[cpu]->domain)
+          return -1;
+        return sys->cpus[cpu]->domain->id;
+    }
+
+    int Machine::get_numa_domain(Memory m) const
+    {
+        return Runtime::get_runtime()->get_memory_impl(m)->get_numa_domain();
+    }
+
+    unsigned Machine::get_numa_distance(unsigned d1, unsigned d2) const
+    {
+        struct nk_locality_info *loc = &nk_get_nautilus_info()->sys.locality_info;
+        // Without a SLIT all we know is local or not
+        if (!loc->numa_matrix || (d1 >= loc->num_domains) || (d2 >= loc->num_domains))
+          return (d1 == d2) ? 10 : 20;
+        return loc->numa_matrix[d1 * loc->num_domains + d2];
+    }
+
+    bool Machine::get_processor_coords(Processor p, ProcessorCoords &coords) const
+    {
+        ProcessorImpl *impl = Runtime::get_runtime()->get_processor_impl(p);
+        if (impl->get_proc_kind() == Processor::PROC_GROUP)
+          return false;
+        struct sys_info *sys = &nk_get_nautilus_info()->sys;
+        int cpu = impl->get_cpu();
+        if ((cpu < 0) || ((unsigned)cpu >= sys->num_cpus) || !sys->cpus[cpu]->coord)
+          return false;
+        coords.cpu = cpu;
+        coords.smt_id = sys->cpus[cpu]->coord->smt_id;
+        coords.core_id = sys->cpus[cpu]->coord->core_id;
+        coords.pkg_id = sys->cpus[cpu]->coord->pkg_id;
+        return true;
+    }
+
+    unsigned Machine::get_smt_width(void) const
+    {
+        return nk_topo_threads_per_core();
+    }
+
+    void Machine::get_smt_siblings(Processor p, std::vector<Processor> &siblings) const
+    {
+        ProcessorImpl *impl = Runtime::get_runtime()->get_processor_impl(p);
+        if (impl->get_proc_kind() == Processor::PROC_GROUP)
+          return;
+        int cpu = impl->get_cpu();
+        if ((cpu < 0) || ((unsigned)cpu >= nk_get_num_cpus()))
+          return;
+        for (std::set<Processor>::const_iterator it = procs.begin();
+              it != procs.end(); it++)
+        {
+          if (*it == p)
+            continue;
+          ProcessorImpl *other = Runtime::get_runtime()->get_processor_impl(*it);
+          if (other->get_proc_kind() == Processor::PROC_GROUP)
+            continue;
+          int other_cpu = other->get_cpu();
+          if ((other_cpu >= 0) && ((unsigned)other_cpu < nk_get_num_cpus()) &&
+              nk_topo_same_core(cpu, other_cpu))
+            siblings.push_back(*it);
+        }
+    }
+
     size_t Machine::get_memory_size(const Memory m) const
     {
         return Runtime::runtime->get_memory_impl(m)->total_space();
@@ -5653,13 +6859,16 @@ namespace LegionRuntime {
     Runtime::Runtime(Machine *m, const ReductionOpTable &table)
 	: redop_table(table), machine(m)
     {
+        memset(event_caches, 0, sizeof(event_caches));
+        free_batches = 0;
+
 	for (unsigned i=0; i<BASE_EVENTS; i++)
         {
             EventImpl *event = new EventImpl(i);
             events.push_back(event);
-            if (i != 0) // Don't hand out the NO_EVENT event
-              free_events.push_back(event);
         }
+        // Don't hand out the NO_EVENT event
+        add_free_events(&events[1], BASE_EVENTS-1);
 
 	for (unsigned i=0; i<BASE_RESERVATIONS; i++)
         {
@@ -5708,7 +6917,6 @@ namespace LegionRuntime {
 
 
     nk_rwlock_init(&event_lock);
-    NK_LOCK_INIT(&free_event_lock);
     nk_rwlock_init(&reservation_lock);
     NK_LOCK_INIT(&free_reservation_lock);
     nk_rwlock_init(&proc_group_lock);
@@ -5738,16 +6946,58 @@ namespace LegionRuntime {
 	return result;
     }
 
+#define EVENT_PTR_MASK ((1ULL << 48) - 1)
+#define EVENT_TAG_ONE  (1ULL << 48)
+
+    void Runtime::push_event_batch(EventImpl *head)
+    {
+      uint64_t old, top;
+      do {
+        old = free_batches;
+        head->next_batch = (EventImpl*)(old & EVENT_PTR_MASK);
+        top = (uint64_t)head | ((old + EVENT_TAG_ONE) & ~EVENT_PTR_MASK);
+      } while (!__sync_bool_compare_and_swap(&free_batches, old, top));
+    }
+
+    EventImpl* Runtime::pop_event_batch(void)
+    {
+      uint64_t old, top;
+      EventImpl *head;
+      do {
+        old = free_batches;
+        head = (EventImpl*)(old & EVENT_PTR_MASK);
+        if (!head)
+          return NULL;
+        top = (uint64_t)head->next_batch | ((old + EVENT_TAG_ONE) & ~EVENT_PTR_MASK);
+      } while (!__sync_bool_compare_and_swap(&free_batches, old, top));
+      return head;
+    }
+
+    // Chain events into batches and put them in the global pool
+    void Runtime::add_free_events(EventImpl **ev, unsigned count)
+    {
+      for (unsigned i = 0; i < count; i += EVENT_BATCH)
+      {
+        unsigned n = (count - i < EVENT_BATCH) ? count - i : EVENT_BATCH;
+        for (unsigned j = 0; j < n; j++)
+          ev[i+j]->next_free = (j+1 < n) ? ev[i+j+1] : NULL;
+        push_event_batch(ev[i]);
+      }
+    }
+
     void Runtime::free_event(EventImpl *e)
     {
-      // Put this event back on the list of free events
-      //PTHREAD_SAFE_CALL(pthread_mutex_lock(&free_event_lock));
-      NK_LOCK(&free_event_lock);
-      NAUTILUS_DEEP_DEBUG("Inside free event, about to push back\n");
-      free_events.push_back(e);
-      NAUTILUS_DEEP_DEBUG("Inside free event, pushed back\n");
-      //PTHREAD_SAFE_CALL(pthread_mutex_unlock(&free_event_lock));
-      NK_UNLOCK(&free_event_lock);
+      // Put this event back in this core's cache, spilling half
+      // of it to the global pool when it is full
+      uint8_t flags = irq_disable_save();
+      EventCache *c = &event_caches[my_cpu_id()];
+      c->ev[c->count++] = e;
+      if (c->count == 2*EVENT_BATCH)
+      {
+        add_free_events(&c->ev[EVENT_BATCH], EVENT_BATCH);
+        c->count = EVENT_BATCH;
+      }
+      irq_enable_restore(flags);
     }
 
     void Runtime::print_event_waiters(void)
@@ -5864,15 +7114,18 @@ namespace LegionRuntime {
 
     EventImpl* Runtime::get_free_event()
     {
-        //PTHREAD_SAFE_CALL(pthread_mutex_lock(&free_event_lock));
-        NK_LOCK(&free_event_lock);
-        if (!free_events.empty())
+        uint8_t flags = irq_disable_save();
+        EventCache *c = &event_caches[my_cpu_id()];
+        if (!c->count)
+        {
+          // Refill the cache with a batch from the global pool
+          for (EventImpl *e = pop_event_batch(); e; e = e->next_free)
+            c->ev[c->count++] = e;
+        }
+        if (c->count)
         {
-          EventImpl *result = free_events.front();
-          free_events.pop_front();
-          // Release the lock
-          //PTHREAD_SAFE_CALL(pthread_mutex_unlock(&free_event_lock));
-          NK_UNLOCK(&free_event_lock);
+          EventImpl *result = c->ev[--c->count];
+          irq_enable_restore(flags);
           // Activate this event
           bool activated = result->activate();
 #ifdef DEBUG_LOW_LEVEL
@@ -5880,6 +7133,7 @@ namespace LegionRuntime {
 #endif
           return result;
         }
+        irq_enable_restore(flags);
         // We weren't able to get a new event, get the writer lock
         // for the vector of event implementations and add some more
         //PTHREAD_SAFE_CALL(pthread_rwlock_wrlock(&event_lock));
@@ -5892,14 +7146,11 @@ namespace LegionRuntime {
         {
           EventImpl *temp = new EventImpl(index+idx,false);
           events.push_back(temp);
-          free_events.push_back(temp);
         }
+        add_free_events(&events[index+1], BASE_EVENTS-1);
         // Release the lock on events
         //PTHREAD_SAFE_CALL(pthread_rwlock_unlock(&event_lock));
         nk_rwlock_wr_unlock(&event_lock);
-        // Release the lock on free events
-        //PTHREAD_SAFE_CALL(pthread_mutex_unlock(&free_event_lock));
-        NK_UNLOCK(&free_event_lock);
         return result;
     }
 
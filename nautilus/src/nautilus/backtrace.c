@@ -41,6 +41,34 @@ __do_backtrace (void ** fp, unsigned depth)
 }
 
 
+/*
+ * Walk at most max frames from fp into rips without printing, for use
+ * in interrupt context. Frames must lie in [lo, hi) and move up the
+ * stack, so a corrupt or absent frame pointer just ends the walk.
+ */
+int
+nk_backtrace_collect (void ** fp, void * lo, void * hi, uint64_t * rips, int max)
+{
+    int n = 0;
+
+    while (n < max &&
+           (void*)fp >= lo &&
+           (void*)(fp + 2) <= hi &&
+           !((ulong_t)fp & 0x7)) {
+
+        rips[n++] = (uint64_t)*(fp + 1);
+
+        if ((void**)*fp <= fp) {
+            break;
+        }
+
+        fp = (void**)*fp;
+    }
+
+    return n;
+}
+
+
 /*
  * dump memory in 16 byte chunks
  */
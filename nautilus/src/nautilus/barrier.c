@@ -28,6 +28,8 @@
 #include <nautilus/intrinsics.h>
 #include <nautilus/thread.h>
 #include <nautilus/mm.h>
+#include <nautilus/numa.h>
+#include <nautilus/percpu.h>
 
 
 #ifndef NAUT_CONFIG_DEBUG_BARRIER
@@ -35,16 +37,18 @@
 #define DEBUG_PRINT(fmt, args...)
 #endif
 
+/* the same word is also taken with spin_lock_irq_save(), so it has
+   to go through whichever spinlock backend is configured */
 static inline void
-bspin_lock (volatile int * lock)
+bspin_lock (volatile spinlock_t * lock)
 {
-        while (__sync_lock_test_and_set(lock, 1));
+        spin_lock(lock);
 }
 
 static inline void
-bspin_unlock (volatile int * lock)
+bspin_unlock (volatile spinlock_t * lock)
 {
-        __sync_lock_release(lock);
+        spin_unlock(lock);
 }
 
 /* 
@@ -60,6 +64,164 @@ barrier_xcall_handler (void * arg)
 }
 
 
+/*
+ * Per-participant state for TREE and DISSEMINATION barriers. Each
+ * participant gets its own cache line and spins only on it.
+ *
+ * In the tree, rank r is the parent of r + j * k^L for j = 1 .. k-1
+ * at every level L where r is a multiple of k^(L+1), with k the
+ * fan-in. Consecutive ranks therefore meet first, and ranks are
+ * handed out in topology order.
+ */
+#define TREE_MAX_CHILDREN ((NK_BARRIER_FANIN - 1) * 8)
+#define DISS_MAX_ROUNDS   16
+
+struct tree_node {
+    volatile uint8_t arrived[TREE_MAX_CHILDREN]; /* written by children */
+    volatile uint8_t release;                    /* written by parent */
+    uint8_t          sense;
+    uint8_t          slot;    /* our index in the parent's arrived[] */
+    int              parent;
+} __align(64);
+
+struct diss_node {
+    volatile uint8_t flags[2][DISS_MAX_ROUNDS];  /* written by partners */
+    uint8_t          parity;
+    uint8_t          sense;
+} __align(64);
+
+
+static inline size_t
+barrier_node_size (uint8_t type)
+{
+    return type == NK_BARRIER_TREE ? sizeof(struct tree_node) : sizeof(struct diss_node);
+}
+
+
+/* the cpu -> rank table lives right after the nodes */
+static inline uint32_t *
+barrier_ranks (nk_barrier_t * b)
+{
+    return (uint32_t*)((char*)b->nodes + barrier_node_size(b->type) * b->init_count);
+}
+
+
+static uint64_t
+cpu_topo_key (cpu_id_t cpu)
+{
+    struct cpu * c = per_cpu_get(system)->cpus[cpu];
+    uint64_t key = 0;
+
+    if (c->domain) {
+        key |= (uint64_t)(c->domain->id & 0xff) << 56;
+    }
+    if (c->coord) {
+        key |= (uint64_t)(c->coord->pkg_id & 0xffff) << 40;
+        key |= (uint64_t)(c->coord->core_id & 0xffff) << 24;
+        key |= (uint64_t)(c->coord->smt_id & 0xff) << 16;
+    }
+
+    return key | cpu;
+}
+
+
+/* rank CPUs 0 .. count-1 by NUMA domain, package, core, SMT thread */
+static void
+barrier_rank_cpus (uint32_t * rank, uint32_t count)
+{
+    cpu_id_t order[count];
+    uint32_t i, j;
+    cpu_id_t c;
+
+    for (i = 0; i < count; i++) {
+        c = i;
+        for (j = i; j > 0 && cpu_topo_key(order[j-1]) > cpu_topo_key(c); j--) {
+            order[j] = order[j-1];
+        }
+        order[j] = c;
+    }
+
+    for (i = 0; i < count; i++) {
+        rank[order[i]] = i;
+    }
+}
+
+
+static void
+tree_setup (struct tree_node * nodes, uint32_t count)
+{
+    uint32_t r, span, level;
+
+    for (r = 0; r < count; r++) {
+        nodes[r].parent = -1;
+        for (level = 0, span = 1; span < count; level++, span *= NK_BARRIER_FANIN) {
+            if (r % (span * NK_BARRIER_FANIN)) {
+                nodes[r].parent = r - (r % (span * NK_BARRIER_FANIN));
+                nodes[r].slot   = level * (NK_BARRIER_FANIN - 1) + (r % (span * NK_BARRIER_FANIN)) / span - 1;
+                break;
+            }
+        }
+    }
+}
+
+
+static int
+tree_wait (nk_barrier_t * barrier, uint32_t r)
+{
+    struct tree_node * nodes = (struct tree_node*)barrier->nodes;
+    struct tree_node * me    = &nodes[r];
+    uint32_t count = barrier->init_count;
+    uint32_t span, level, j, c;
+    uint8_t e;
+
+    me->sense = !me->sense;
+    e = me->sense;
+
+    /* gather our subtree, nearest children first */
+    for (level = 0, span = 1; span < count && !(r % (span * NK_BARRIER_FANIN)); level++, span *= NK_BARRIER_FANIN) {
+        for (j = 1; j < NK_BARRIER_FANIN && (c = r + j * span) < count; j++) {
+            PAUSE_WHILE(me->arrived[level * (NK_BARRIER_FANIN - 1) + j - 1] != e);
+        }
+    }
+
+    if (me->parent >= 0) {
+        nodes[me->parent].arrived[me->slot] = e;
+        PAUSE_WHILE(me->release != e);
+    }
+
+    /* and release it */
+    for (level = 0, span = 1; span < count && !(r % (span * NK_BARRIER_FANIN)); level++, span *= NK_BARRIER_FANIN) {
+        for (j = 1; j < NK_BARRIER_FANIN && (c = r + j * span) < count; j++) {
+            nodes[c].release = e;
+        }
+    }
+
+    return me->parent < 0 ? NK_BARRIER_LAST : 0;
+}
+
+
+static int
+diss_wait (nk_barrier_t * barrier, uint32_t r)
+{
+    struct diss_node * nodes = (struct diss_node*)barrier->nodes;
+    struct diss_node * me    = &nodes[r];
+    uint32_t count = barrier->init_count;
+    uint32_t round, dist;
+
+    for (round = 0, dist = 1; dist < count; round++, dist <<= 1) {
+        nodes[(r + dist) % count].flags[me->parity][round] = me->sense;
+        PAUSE_WHILE(me->flags[me->parity][round] != me->sense);
+    }
+
+    if (me->parity) {
+        me->sense = !me->sense;
+    }
+    me->parity = !me->parity;
+
+    return r == 0 ? NK_BARRIER_LAST : 0;
+}
+
+
 /*
  * nk_barrier_init
  *
@@ -75,7 +237,28 @@ barrier_xcall_handler (void * arg)
 int 
 nk_barrier_init (nk_barrier_t * barrier, uint32_t count) 
 {
-    int ret = 0;
+    return nk_barrier_init_type(barrier, count, NK_BARRIER_CENTRAL);
+}
+
+
+/*
+ * nk_barrier_init_type
+ *
+ * initialize a thread barrier of a given type (see barrier.h)
+ *
+ * @barrier: the barrier to initialize
+ * @count: the number of participants
+ * @type: how the participants meet
+ *
+ * returns 0 on succes, -EINVAL on error, -ENOMEM if
+ * the per-participant state could not be allocated
+ *
+ */
+int 
+nk_barrier_init_type (nk_barrier_t * barrier, uint32_t count, nk_barrier_type_t type) 
+{
+    size_t size;
+
     memset(barrier, 0, sizeof(nk_barrier_t));
     barrier->lock = 0;
 
@@ -84,10 +267,45 @@ nk_barrier_init (nk_barrier_t * barrier, uint32_t count)
         return -EINVAL;
     }
 
-
-    DEBUG_PRINT("Initializing barier, barrier at %p, count=%u\n", (void*)barrier, count);
+    DEBUG_PRINT("Initializing barier, barrier at %p, count=%u, type=%u\n", (void*)barrier, count, type);
     barrier->init_count = count;
     barrier->remaining  = count;
+    barrier->type       = type;
+
+    if (type == NK_BARRIER_CENTRAL) {
+        return 0;
+    }
+
+    if (type != NK_BARRIER_TREE && type != NK_BARRIER_DISSEMINATION) {
+        ERROR_PRINT("Unknown barrier type %u\n", type);
+        return -EINVAL;
+    }
+
+    if (count > nk_get_num_cpus()) {
+        ERROR_PRINT("Barrier type %u needs one CPU per participant (%u > %u)\n", 
+                    type, count, nk_get_num_cpus());
+        return -EINVAL;
+    }
+
+    size = barrier_node_size(type) * count + sizeof(uint32_t) * count;
+
+    barrier->nodes = malloc(size);
+    if (!barrier->nodes) {
+        ERROR_PRINT("Could not allocate barrier state\n");
+        return -ENOMEM;
+    }
+    memset(barrier->nodes, 0, size);
+
+    if (type == NK_BARRIER_TREE) {
+        tree_setup((struct tree_node*)barrier->nodes, count);
+    } else {
+        uint32_t i;
+        for (i = 0; i < count; i++) {
+            ((struct diss_node*)barrier->nodes)[i].sense = 1;
+        }
+    }
+
+    barrier_rank_cpus(barrier_ranks(barrier), count);
 
     return 0;
 }
@@ -114,6 +332,12 @@ nk_barrier_destroy (nk_barrier_t * barrier)
 
     DEBUG_PRINT("Destroying barrier (%p)\n", (void*)barrier);
 
+    if (barrier->type != NK_BARRIER_CENTRAL) {
+        free(barrier->nodes);
+        barrier->nodes = NULL;
+        return 0;
+    }
+
     bspin_lock(&barrier->lock);
     
     if (likely(barrier->remaining == barrier->init_count)) {
@@ -141,6 +365,9 @@ nk_barrier_destroy (nk_barrier_t * barrier)
  * is useful for having one thread in charge of cleaning 
  * the barrier up. Again, similar to POSIX
  *
+ * TREE and DISSEMINATION barriers must be waited on from threads
+ * bound to CPUs below the participant count, one per CPU
+ *
  */
 int 
 nk_barrier_wait (nk_barrier_t * barrier) 
@@ -149,6 +376,21 @@ nk_barrier_wait (nk_barrier_t * barrier)
 
     DEBUG_PRINT("Thread (%p) entering barrier (%p)\n", (void*)get_cur_thread(), (void*)barrier);
 
+    if (barrier->type != NK_BARRIER_CENTRAL) {
+        cpu_id_t cpu = my_cpu_id();
+
+        if (unlikely(cpu >= barrier->init_count)) {
+            ERROR_PRINT("CPU %u is not a participant in barrier %p\n", cpu, (void*)barrier);
+            return -EINVAL;
+        }
+
+        if (barrier->type == NK_BARRIER_TREE) {
+            return tree_wait(barrier, barrier_ranks(barrier)[cpu]);
+        } else {
+            return diss_wait(barrier, barrier_ranks(barrier)[cpu]);
+        }
+    }
+
     bspin_lock(&barrier->lock);
 
     if (--barrier->remaining == 0) {
@@ -227,6 +469,21 @@ nk_core_barrier_raise (void)
 
         cpu_id_t me = my_cpu_id();
 
+#ifdef NAUT_CONFIG_XCALL_RINGS
+        nk_cpumask_t others;
+
+        nk_cpumask_fill(&others, per_cpu_get(system)->num_cpus);
+        nk_cpumask_clear(&others, me);
+
+        // force other cores to wait at the barrier, through the relay tree
+        if (smp_xcall_mask(&others,
+                           barrier_xcall_handler,
+                           NULL,
+                           0) != 0) { // blocking would be catastrophic here
+            ERROR_PRINT("Could not force cores to wait at barrier\n");
+            return -EINVAL;
+        }
+#else
         // force other cores to wait at the barrier
         for (i = 0; i < per_cpu_get(system)->num_cpus; i++) {
 
@@ -244,6 +501,7 @@ nk_core_barrier_raise (void)
             }
 
         }
+#endif
 
     } else {
 
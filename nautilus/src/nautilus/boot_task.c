@@ -0,0 +1,313 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/smp.h>
+#include <nautilus/atomic.h>
+#include <nautilus/percpu.h>
+#include <nautilus/thread.h>
+#include <nautilus/boot_task.h>
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+#include <nautilus/rt_scheduler.h>
+#endif
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+#include <nautilus/housekeeping.h>
+#endif
+
+#define BOOT_PRINT(fmt, args...) printk("BOOT: " fmt, ##args)
+#define BOOT_ERROR(fmt, args...) ERROR_PRINT("BOOT: " fmt, ##args)
+
+enum { TASK_WAITING = 0, TASK_RUNNING, TASK_DONE };
+
+uint64_t nk_boot_start_tsc = 0;
+
+struct boot_graph {
+    struct naut_info    * naut;
+    struct nk_boot_task * tasks;
+    unsigned              n;
+    uint8_t               defer;        /* which pass */
+    uint64_t              todo;         /* the pass's steps */
+    volatile uint64_t     done;
+    volatile uint64_t     failed;
+};
+
+/* an AP may look at a pass after it is over, so they live here */
+static struct boot_graph eager_pass;
+static struct boot_graph defer_pass;
+
+
+/* take a step that is ready; left says how many we could still take */
+static struct nk_boot_task *
+boot_take (struct boot_graph * g, int home, unsigned * left)
+{
+    unsigned i;
+
+    *left = 0;
+
+    for (i = 0; i < g->n; i++) {
+        struct nk_boot_task * t = &g->tasks[i];
+
+        if (!(g->todo & NK_BOOT_DEP(i)) || t->state != TASK_WAITING) {
+            continue;
+        }
+        if ((t->flags & NK_BOOT_TASK_HOME) && !home) {
+            continue;
+        }
+
+        (*left)++;
+
+        if ((g->done & t->deps) == t->deps &&
+            atomic_cmpswap(t->state, TASK_WAITING, TASK_RUNNING) == TASK_WAITING) {
+            return t;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+boot_do (struct boot_graph * g, struct nk_boot_task * t)
+{
+    uint64_t bit = NK_BOOT_DEP(t - g->tasks);
+    uint64_t start = rdtsc();
+
+    if (t->deps & g->failed) {
+        BOOT_ERROR("%s skipped, a step it needs failed\n", t->name);
+        t->rc = -1;
+    } else {
+        t->rc = t->init(g->naut);
+        if (t->rc) {
+            BOOT_ERROR("%s failed (%d)\n", t->name, t->rc);
+        }
+    }
+
+    t->cycles = rdtsc() - start;
+
+    if (t->rc) {
+        atomic_or(g->failed, bit);
+    }
+    t->state = TASK_DONE;
+    atomic_or(g->done, bit);
+
+    BOOT_PRINT("%s done on core %u in %lu cycles\n", t->name, my_cpu_id(), t->cycles);
+}
+
+
+/* an AP's share, from its xcall handler */
+static void
+boot_worker (void * arg)
+{
+    struct boot_graph * g = (struct boot_graph*)arg;
+    struct nk_boot_task * t;
+    unsigned left;
+
+    while (1) {
+        t = boot_take(g, 0, &left);
+        if (t) {
+            boot_do(g, t);
+        } else if (!left) {
+            return;
+        } else {
+            asm volatile ("pause");
+        }
+    }
+}
+
+
+/* the core running the pass stays until all of it is done */
+static void
+boot_home (struct boot_graph * g)
+{
+    struct nk_boot_task * t;
+    unsigned left;
+
+    while ((g->done & g->todo) != g->todo) {
+        t = boot_take(g, 1, &left);
+        if (t) {
+            boot_do(g, t);
+        } else {
+            asm volatile ("pause");
+        }
+    }
+}
+
+
+/*
+ * Sets up a pass and checks that it can finish: every dependency is
+ * done already or in the pass, and there is no cycle.
+ */
+static int
+boot_graph_init (struct boot_graph * g,
+                 struct naut_info * naut,
+                 struct nk_boot_task * tasks,
+                 unsigned n,
+                 uint8_t defer)
+{
+    uint64_t resolved = 0;
+    uint64_t left;
+    unsigned i;
+
+    if (n > NK_BOOT_MAX_TASKS) {
+        BOOT_ERROR("Too many boot steps (%u)\n", n);
+        return -1;
+    }
+
+    memset(g, 0, sizeof(*g));
+    g->naut  = naut;
+    g->tasks = tasks;
+    g->n     = n;
+    g->defer = defer;
+
+    for (i = 0; i < n; i++) {
+        if (tasks[i].state == TASK_DONE) {
+            g->done |= NK_BOOT_DEP(i);
+            if (tasks[i].rc) {
+                g->failed |= NK_BOOT_DEP(i);
+            }
+        } else if (!!(tasks[i].flags & NK_BOOT_TASK_DEFER) == defer) {
+            g->todo |= NK_BOOT_DEP(i);
+        }
+    }
+
+    resolved = g->done;
+    left     = g->todo;
+
+    while (left) {
+        uint64_t ready = 0;
+
+        for (i = 0; i < n; i++) {
+            if ((left & NK_BOOT_DEP(i)) && (tasks[i].deps & ~resolved) == 0) {
+                ready |= NK_BOOT_DEP(i);
+            }
+        }
+
+        if (!ready) {
+            for (i = 0; i < n; i++) {
+                if (left & NK_BOOT_DEP(i)) {
+                    BOOT_ERROR("%s can never run, it waits on a later pass or itself\n",
+                               tasks[i].name);
+                }
+            }
+            return -1;
+        }
+
+        resolved |= ready;
+        left     &= ~ready;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Runs the steps that aren't deferred, on the APs as far as they go
+ * and on this core, and returns when they are all done. The APs must
+ * be up and taking xcalls.
+ */
+int
+nk_boot_tasks_run (struct naut_info * naut, struct nk_boot_task * tasks, unsigned n)
+{
+    struct boot_graph * g = &eager_pass;
+    unsigned ncpus = nk_get_num_cpus();
+    unsigned me = my_cpu_id();
+    unsigned helpers = 0;
+    uint64_t start = rdtsc();
+    unsigned i;
+
+    if (boot_graph_init(g, naut, tasks, n, 0)) {
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        if ((g->todo & NK_BOOT_DEP(i)) && !(tasks[i].flags & NK_BOOT_TASK_HOME)) {
+            helpers++;
+        }
+    }
+
+    /* one step is ours */
+    for (i = 0; i < ncpus && helpers > 1; i++) {
+        if (i != me && smp_xcall(i, boot_worker, g, 0) == 0) {
+            helpers--;
+        }
+    }
+
+    boot_home(g);
+
+    BOOT_PRINT("Boot steps done in %lu cycles\n", rdtsc() - start);
+
+    return g->failed & g->todo ? -1 : 0;
+}
+
+
+static void
+boot_defer_thread (void * in, void ** out)
+{
+    struct boot_graph * g = (struct boot_graph*)in;
+
+    boot_home(g);
+
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+    /* devices set up just now registered IRQs of their own */
+    nk_housekeeping_steer_irqs();
+#endif
+
+    BOOT_PRINT("Deferred boot steps done, %lu cycles after boot\n", rdtsc() - nk_boot_start_tsc);
+}
+
+
+/*
+ * Runs the deferred steps in a thread of their own, on the last core
+ * (a housekeeping one if there are any), and returns right away. Call it just before starting the workload.
+ */
+int
+nk_boot_tasks_defer (struct naut_info * naut, struct nk_boot_task * tasks, unsigned n)
+{
+    struct boot_graph * g = &defer_pass;
+    int cpu = nk_get_num_cpus() - 1;
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    rt_constraints c = { .aperiodic = { .priority = 0 } };
+#endif
+
+    BOOT_PRINT("Starting the workload %lu cycles after boot\n", rdtsc() - nk_boot_start_tsc);
+
+    if (boot_graph_init(g, naut, tasks, n, 1)) {
+        return -1;
+    }
+
+    if (!g->todo) {
+        return 0;
+    }
+
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+    cpu = nk_housekeeping_cpu();
+#endif
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    if (nk_thread_start(boot_defer_thread, g, 0, 1, TSTACK_DEFAULT, 0, cpu, APERIODIC, &c, 0)) {
+#else
+    if (nk_thread_start(boot_defer_thread, g, 0, 1, TSTACK_DEFAULT, 0, cpu)) {
+#endif
+        BOOT_ERROR("Cannot start thread for deferred steps, running them now\n");
+        boot_defer_thread(g, NULL);
+    }
+
+    return 0;
+}
@@ -0,0 +1,410 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/atomic.h>
+#include <nautilus/mm.h>
+#include <nautilus/chashtable.h>
+
+#define ERROR(fmt, args...) ERROR_PRINT("CHTABLE: " fmt, ##args)
+
+// entries per bucket, on average, before the table doubles
+#define CHT_LOAD        2
+// buckets an insert or remove moves along while the table grows
+#define CHT_MOVE_STEP   4
+
+struct cht_entry {
+    addr_t key;
+    addr_t value;
+    uint_t hash;
+    struct cht_entry * next;
+};
+
+struct cht_bucket {
+    spinlock_t lock;
+    // entries now live in the next array
+    uint8_t moved;
+    struct cht_entry * head;
+};
+
+/*
+ * One array of buckets. An array that has been grown out of stays
+ * around, linked to its successor, until the table is freed: someone
+ * may still be on their way into it, and will find their bucket moved
+ * and follow next. Together the old arrays are smaller than the live one.
+ */
+struct cht_array {
+    uint64_t size;                  // a power of two
+    struct cht_bucket * buckets;
+    struct cht_array * volatile next;
+    // the move to next: buckets claimed and buckets done
+    uint64_t move_claim;
+    uint64_t move_done;
+};
+
+struct nk_chtable {
+    // where operations start, the newest array once a move finishes
+    struct cht_array * volatile cur;
+    // the array being moved out of, NULL if none
+    struct cht_array * volatile moving;
+    // the first array, the others follow it through next
+    struct cht_array * oldest;
+    spinlock_t grow_lock;
+    uint64_t count;
+    uint_t (*hash_fn) (addr_t key);
+    int (*eq_fn) (addr_t key1, addr_t key2);
+};
+
+
+static inline uint_t
+cht_hash (struct nk_chtable * t, addr_t key)
+{
+    // spread whatever the caller's hash gives us over all of the bits
+    uint64_t h = (uint64_t)t->hash_fn(key) * 0x9e3779b97f4a7c15ULL;
+    return (uint_t)(h >> 32);
+}
+
+
+static struct cht_array *
+cht_array_create (uint64_t size)
+{
+    struct cht_array * a = malloc(sizeof(struct cht_array));
+    uint64_t i;
+
+    if (!a) {
+        return NULL;
+    }
+
+    a->buckets = malloc(size * sizeof(struct cht_bucket));
+    if (!a->buckets) {
+        free(a);
+        return NULL;
+    }
+
+    memset(a->buckets, 0, size * sizeof(struct cht_bucket));
+    for (i = 0; i < size; i++) {
+        spinlock_init(&a->buckets[i].lock);
+    }
+
+    a->size       = size;
+    a->next       = NULL;
+    a->move_claim = 0;
+    a->move_done  = 0;
+
+    return a;
+}
+
+
+/*
+ * Lock the bucket the hash belongs to right now, going forward through
+ * the arrays past any that have been moved out of.
+ */
+static struct cht_bucket *
+cht_lock_bucket (struct nk_chtable * t, uint_t hash, uint8_t * flags)
+{
+    struct cht_array * a = t->cur;
+    struct cht_bucket * b;
+
+    while (1) {
+        b = &a->buckets[hash & (a->size - 1)];
+        *flags = spin_lock_irq_save(&b->lock);
+        if (!b->moved) {
+            return b;
+        }
+        spin_unlock_irq_restore(&b->lock, *flags);
+        a = a->next;
+    }
+}
+
+
+/*
+ * Move bucket i of a into a->next. The new array is twice the size, so
+ * the entries split between buckets i and i + a->size there. Locks are
+ * taken old before new, the same order as everyone else.
+ */
+static void
+cht_move_bucket (struct cht_array * a, uint64_t i)
+{
+    struct cht_array * n = a->next;
+    struct cht_bucket * ob = &a->buckets[i];
+    struct cht_bucket * lo = &n->buckets[i];
+    struct cht_bucket * hi = &n->buckets[i + a->size];
+    struct cht_entry * e, * next;
+    uint8_t of, lf, hf;
+
+    of = spin_lock_irq_save(&ob->lock);
+    lf = spin_lock_irq_save(&lo->lock);
+    hf = spin_lock_irq_save(&hi->lock);
+
+    for (e = ob->head; e; e = next) {
+        struct cht_bucket * to = (e->hash & (n->size - 1)) == i ? lo : hi;
+        next = e->next;
+        e->next = to->head;
+        to->head = e;
+    }
+
+    ob->head  = NULL;
+    ob->moved = 1;
+
+    spin_unlock_irq_restore(&hi->lock, hf);
+    spin_unlock_irq_restore(&lo->lock, lf);
+    spin_unlock_irq_restore(&ob->lock, of);
+}
+
+
+/* do our share of a move that is under way */
+static void
+cht_help_move (struct nk_chtable * t)
+{
+    struct cht_array * a = t->moving;
+    uint64_t i;
+    int k;
+
+    if (!a) {
+        return;
+    }
+
+    for (k = 0; k < CHT_MOVE_STEP; k++) {
+        i = atomic_add(a->move_claim, 1);
+        if (i >= a->size) {
+            return;
+        }
+        cht_move_bucket(a, i);
+        // whoever moves the last bucket finishes the move
+        if (atomic_inc_val(a->move_done) == a->size) {
+            t->cur = a->next;
+            __sync_synchronize();
+            t->moving = NULL;
+            return;
+        }
+    }
+}
+
+
+/* start doubling the table, unless that's already happening */
+static void
+cht_grow (struct nk_chtable * t)
+{
+    struct cht_array * a;
+    struct cht_array * n;
+    uint8_t flags;
+
+    if (t->moving) {
+        return;
+    }
+
+    flags = spin_lock_irq_save(&t->grow_lock);
+
+    a = t->cur;
+
+    if (t->moving || t->count <= a->size * CHT_LOAD) {
+        spin_unlock_irq_restore(&t->grow_lock, flags);
+        return;
+    }
+
+    n = cht_array_create(a->size * 2);
+    if (!n) {
+        // we'll try again on the next insert
+        spin_unlock_irq_restore(&t->grow_lock, flags);
+        return;
+    }
+
+    a->next = n;
+    __sync_synchronize();
+    t->moving = a;
+
+    spin_unlock_irq_restore(&t->grow_lock, flags);
+}
+
+
+struct nk_chtable *
+nk_create_chtable (uint_t min_size,
+                   uint_t (*hash_fn) (addr_t key),
+                   int (*eq_fn) (addr_t key1, addr_t key2))
+{
+    struct nk_chtable * t;
+    uint64_t size = 16;
+
+    while (size < min_size) {
+        size <<= 1;
+    }
+
+    t = malloc(sizeof(struct nk_chtable));
+    if (!t) {
+        ERROR("Could not allocate table\n");
+        return NULL;
+    }
+
+    memset(t, 0, sizeof(struct nk_chtable));
+
+    t->cur = cht_array_create(size);
+    if (!t->cur) {
+        ERROR("Could not allocate %lu buckets\n", size);
+        free(t);
+        return NULL;
+    }
+
+    t->oldest = t->cur;
+    spinlock_init(&t->grow_lock);
+    t->hash_fn = hash_fn;
+    t->eq_fn   = eq_fn;
+
+    return t;
+}
+
+
+void
+nk_free_chtable (struct nk_chtable * t, int free_values, int free_keys)
+{
+    struct cht_array * a;
+    struct cht_array * next;
+    struct cht_entry * e;
+    struct cht_entry * en;
+    uint64_t i;
+
+    // every entry is in exactly one bucket that hasn't been moved
+    for (a = t->oldest; a; a = next) {
+        for (i = 0; i < a->size; i++) {
+            for (e = a->buckets[i].head; e; e = en) {
+                en = e->next;
+                if (free_values) {
+                    free((void *)e->value);
+                }
+                if (free_keys) {
+                    free((void *)e->key);
+                }
+                free(e);
+            }
+        }
+        next = a->next;
+        free(a->buckets);
+        free(a);
+    }
+
+    free(t);
+}
+
+
+int
+nk_chtable_insert (struct nk_chtable * t, addr_t key, addr_t value)
+{
+    uint_t hash = cht_hash(t, key);
+    struct cht_bucket * b;
+    struct cht_entry * e;
+    struct cht_entry * n;
+    uint8_t flags;
+
+    cht_help_move(t);
+
+    n = malloc(sizeof(struct cht_entry));
+    if (!n) {
+        ERROR("Could not allocate entry\n");
+        return 0;
+    }
+
+    n->key   = key;
+    n->value = value;
+    n->hash  = hash;
+
+    b = cht_lock_bucket(t, hash, &flags);
+
+    for (e = b->head; e; e = e->next) {
+        if (e->hash == hash && t->eq_fn(e->key, key)) {
+            spin_unlock_irq_restore(&b->lock, flags);
+            free(n);
+            return 0;
+        }
+    }
+
+    n->next = b->head;
+    b->head = n;
+
+    spin_unlock_irq_restore(&b->lock, flags);
+
+    if (atomic_inc_val(t->count) > t->cur->size * CHT_LOAD) {
+        cht_grow(t);
+    }
+
+    return 1;
+}
+
+
+addr_t
+nk_chtable_search (struct nk_chtable * t, addr_t key)
+{
+    uint_t hash = cht_hash(t, key);
+    struct cht_bucket * b;
+    struct cht_entry * e;
+    addr_t value = 0;
+    uint8_t flags;
+
+    b = cht_lock_bucket(t, hash, &flags);
+
+    for (e = b->head; e; e = e->next) {
+        if (e->hash == hash && t->eq_fn(e->key, key)) {
+            value = e->value;
+            break;
+        }
+    }
+
+    spin_unlock_irq_restore(&b->lock, flags);
+
+    return value;
+}
+
+
+addr_t
+nk_chtable_remove (struct nk_chtable * t, addr_t key, int free_key)
+{
+    uint_t hash = cht_hash(t, key);
+    struct cht_bucket * b;
+    struct cht_entry ** p;
+    struct cht_entry * e;
+    addr_t value = 0;
+    uint8_t flags;
+
+    cht_help_move(t);
+
+    b = cht_lock_bucket(t, hash, &flags);
+
+    for (p = &b->head; (e = *p); p = &e->next) {
+        if (e->hash == hash && t->eq_fn(e->key, key)) {
+            *p = e->next;
+            value = e->value;
+            if (free_key) {
+                free((void *)e->key);
+            }
+            free(e);
+            atomic_dec(t->count);
+            break;
+        }
+    }
+
+    spin_unlock_irq_restore(&b->lock, flags);
+
+    return value;
+}
+
+
+uint_t
+nk_chtable_count (struct nk_chtable * t)
+{
+    return (uint_t)t->count;
+}
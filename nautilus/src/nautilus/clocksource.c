@@ -0,0 +1,126 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/cpuid.h>
+#include <nautilus/irq.h>
+#include <nautilus/percpu.h>
+#include <nautilus/clocksource.h>
+#ifdef NAUT_CONFIG_HPET
+#include <dev/hpet.h>
+#endif
+
+#define CLOCK_PRINT(fmt, args...) printk("CLOCK: " fmt, ##args)
+
+#define CLOCK_CALIB_MS 20
+
+struct nk_clocksource nk_clock;
+
+
+static uint8_t
+tsc_is_invariant (void)
+{
+    cpuid_ret_t ret;
+
+    cpuid(0x80000000, &ret);
+    if (ret.a < 0x80000007) {
+        return 0;
+    }
+
+    cpuid(0x80000007, &ret);
+    return (ret.d >> 8) & 1;
+}
+
+
+#ifdef NAUT_CONFIG_HPET
+/*
+ * Count TSC cycles over CLOCK_CALIB_MS of HPET time. Each HPET read is
+ * an uncached MMIO access, so the TSC is read on both sides of the
+ * first one and the midpoint used. The window is short enough that
+ * the difference fits in 32 bits even if the counter is only 32 wide.
+ */
+static uint64_t
+hpet_calib_tsc (void)
+{
+    struct hpet_dev * hpet = nk_get_nautilus_info()->sys.hpet;
+    uint64_t freq = hpet->freq;
+    uint64_t t0, t1, h0, h1, ticks;
+    uint8_t flags;
+
+    ticks = freq * CLOCK_CALIB_MS / 1000;
+
+    flags = irq_disable_save();
+
+    t0 = rdtsc();
+    h0 = nk_hpet_get_cntr();
+    t0 = (t0 + rdtsc()) / 2;
+
+    do {
+        h1 = nk_hpet_get_cntr();
+    } while ((uint32_t)(h1 - h0) < ticks);
+
+    t1 = rdtsc();
+
+    irq_enable_restore(flags);
+
+    return (t1 - t0) * freq / (uint32_t)(h1 - h0);
+}
+#endif
+
+
+int
+nk_clocksource_init (void)
+{
+    uint64_t hz = 0;
+
+    nk_clock.invariant = tsc_is_invariant();
+    if (!nk_clock.invariant) {
+        CLOCK_PRINT("TSC is not invariant, conversions may drift\n");
+    }
+
+#ifdef NAUT_CONFIG_HPET
+    if (nk_get_nautilus_info()->sys.hpet) {
+        hz = hpet_calib_tsc();
+        nk_clock.hpet = 1;
+    }
+#endif
+
+    if (!hz) {
+        hz = per_cpu_get(cpu_khz) * 1000ULL;
+    }
+
+    if (!hz) {
+        ERROR_PRINT("Cannot calibrate the TSC\n");
+        return -1;
+    }
+
+    nk_clock.tsc_hz   = hz;
+    /* 10^9 << 32 still fits in 64 bits, hz << 32 need not */
+    nk_clock.ns_mult  = (1000000000ULL << NK_CLOCK_SHIFT) / hz;
+    nk_clock.cyc_mult = ((hz / 1000000000ULL) << NK_CLOCK_SHIFT) +
+                        ((hz % 1000000000ULL) << NK_CLOCK_SHIFT) / 1000000000ULL;
+
+    CLOCK_PRINT("TSC at %lu.%06lu MHz (%s%s)\n",
+                hz / 1000000, hz % 1000000,
+                nk_clock.hpet ? "HPET" : "PIT",
+                nk_clock.invariant ? ", invariant" : "");
+
+    return 0;
+}
@@ -31,6 +31,10 @@
 #include <nautilus/mm.h>
 
 #include <dev/apic.h>
+#include <dev/timer.h>
+#ifdef NAUT_CONFIG_HRTIMERS
+#include <nautilus/hrtimer.h>
+#endif
 
 #ifndef NAUT_CONFIG_DEBUG_SYNCH
 #undef DEBUG_PRINT
@@ -74,57 +78,156 @@ nk_condvar_destroy (nk_condvar_t * c)
 }
 
 
-uint8_t
-nk_condvar_wait (nk_condvar_t * c, NK_LOCK_T * l)
+/*
+ * hand a broadcast wakeup on to the next waiter. Anyone who was
+ * waiting when the broadcast happened uses one up; a later arrival
+ * woken in their place passes it on without counting. c->lock held
+ */
+static inline uint8_t
+condvar_pass_on (nk_condvar_t * c, uint32_t seq)
 {
-    NK_PROFILE_ENTRY();
+    if (!c->handoff) {
+        return 0;
+    }
 
-    DEBUG_PRINT("Condvar wait on (%p) mutex=%p\n", (void*)c, (void*)l);
+    if ((sint32_t)(c->bcast_seq - seq) > 0) {
+        --c->handoff;
+    }
 
-    NK_LOCK(&c->lock);
+    return c->handoff != 0;
+}
 
-    /* now we can unlock the mutex and go to sleep */
-    NK_UNLOCK(l);
 
-    ++c->nwaiters;
-    ++c->main_seq;
+struct condvar_timeout {
+    nk_condvar_t * c;
+    nk_thread_t *  t;
+    volatile uint8_t fired;
+};
 
-    unsigned long long val;
-    unsigned long long seq;
-    unsigned bc = *(volatile unsigned*)&(c->bcast_seq);
-    val = seq = c->wakeup_seq;
 
-    do {
+static void
+condvar_timeout (void * arg)
+{
+    struct condvar_timeout * to = (struct condvar_timeout*)arg;
 
-        NK_UNLOCK(&c->lock);
-        nk_thread_queue_sleep(c->wait_queue);
-        NK_LOCK(&c->lock);
+    to->fired = 1;
+    nk_thread_queue_wake_thread(to->c->wait_queue, to->t);
+}
 
-        if (bc != *(volatile unsigned*)&(c->bcast_seq)) {
-            goto bcout;
-        }
+#ifdef NAUT_CONFIG_HRTIMERS
+static void
+condvar_hrtimeout (struct nk_hrtimer * t, void * arg)
+{
+    condvar_timeout(arg);
+}
+#endif
 
-        val = *(volatile unsigned long long*)&(c->wakeup_seq);
 
-    } while (val == seq || val == *(volatile unsigned long long*)&(c->woken_seq));
+static int
+condvar_wait (nk_condvar_t * c, NK_LOCK_T * l, uint64_t ns)
+{
+    struct condvar_timeout to = { c, get_cur_thread(), 0 };
+    uint32_t seq;
+    uint8_t pass;
+    uint8_t timed = 0;
+#ifdef NAUT_CONFIG_HRTIMERS
+    struct nk_hrtimer timer;
+#else
+    int timer = -1;
+#endif
+    int res = 0;
 
-    ++c->woken_seq;
+    NK_LOCK(&c->lock);
+    ++c->nwaiters;
+    seq = c->seq;
+    NK_UNLOCK(&c->lock);
 
-bcout:
+    /* now we can unlock the mutex and go to sleep */
+    NK_UNLOCK(l);
 
-    --c->nwaiters;
+    if (ns) {
+#ifdef NAUT_CONFIG_HRTIMERS
+        nk_hrtimer_init(&timer, condvar_hrtimeout, &to);
+        timed = nk_hrtimer_start(&timer, ns, 0) == 0;
+#else
+        timer = nk_timer_callback_arm(ns, condvar_timeout, &to);
+        timed = timer >= 0;
+#endif
+    }
 
-    NK_UNLOCK(&c->lock);
+    /* a signal since we looked at seq means we won't sleep at all */
+    nk_thread_queue_wait_word(c->wait_queue, &c->seq, seq);
+
+    if (timed) {
+#ifdef NAUT_CONFIG_HRTIMERS
+        nk_hrtimer_cancel(&timer);
+#else
+        nk_timer_callback_cancel(timer);
+#endif
+        if (to.fired && c->seq == seq) {
+            res = -ETIMEDOUT;
+        }
+    }
 
     /* reacquire lock */
     NK_LOCK(l);
 
+    NK_LOCK(&c->lock);
+    --c->nwaiters;
+    pass = condvar_pass_on(c, seq);
+    NK_UNLOCK(&c->lock);
+
+    if (pass) {
+        nk_thread_queue_wake_one(c->wait_queue);
+    }
+
+    return res;
+}
+
+
+uint8_t
+nk_condvar_wait (nk_condvar_t * c, NK_LOCK_T * l)
+{
+    NK_PROFILE_ENTRY();
+
+    DEBUG_PRINT("Condvar wait on (%p) mutex=%p\n", (void*)c, (void*)l);
+
+    condvar_wait(c, l, 0);
+
     NK_PROFILE_EXIT();
 
     return 0;
 }
 
 
+/*
+ * nk_condvar_timedwait
+ *
+ * like nk_condvar_wait(), but give up after ns nanoseconds. The
+ * timeout is taken by the timer interrupt, so it is only accurate
+ * to about a scheduling quantum. The mutex is held again on return
+ * either way
+ *
+ * returns 0 when woken, -ETIMEDOUT on timeout
+ *
+ */
+int
+nk_condvar_timedwait (nk_condvar_t * c, NK_LOCK_T * l, uint64_t ns)
+{
+    int res;
+
+    NK_PROFILE_ENTRY();
+
+    DEBUG_PRINT("Condvar timed wait on (%p) mutex=%p ns=%lu\n", (void*)c, (void*)l, ns);
+
+    res = condvar_wait(c, l, ns ? ns : 1);
+
+    NK_PROFILE_EXIT();
+
+    return res;
+}
+
+
 int 
 nk_condvar_signal (nk_condvar_t * c)
 {
@@ -133,13 +236,14 @@ nk_condvar_signal (nk_condvar_t * c)
     NK_LOCK(&c->lock);
 
     // do we have anyone to signal?
-    if (c->main_seq > c->wakeup_seq) {
+    if (c->nwaiters) {
 
-        ++c->wakeup_seq;
+        atomic_inc(c->seq);
 
         DEBUG_PRINT("Condvar signaling on (%p)\n", (void*)c);
 
-        if (unlikely(nk_thread_queue_wake_one(c->wait_queue) != 0)) {
+        if (unlikely(nk_thread_queue_wake_word(c->wait_queue, 0) != 0)) {
+            NK_UNLOCK(&c->lock);
             ERROR_PRINT("Could not signal on condvar\n");
             return -1;
         }
@@ -160,20 +264,19 @@ nk_condvar_bcast (nk_condvar_t * c)
     NK_LOCK(&c->lock);
 
     // do we have anyone to wakeup?
-    if (c->main_seq > c->wakeup_seq) {
+    if (c->nwaiters) {
 
-        c->woken_seq = c->main_seq;
-        c->wakeup_seq = c->main_seq;
-        ++c->bcast_seq;
-
-        NK_UNLOCK(&c->lock);
+        c->bcast_seq = atomic_inc_val(c->seq);
+        c->handoff   = c->nwaiters;
 
         DEBUG_PRINT("Condvar broadcasting on (%p) (core=%u)\n", (void*)c, my_cpu_id());
-        if (unlikely(nk_thread_queue_wake_all(c->wait_queue) != 0)) {
+
+        /* the rest of the waiters are woken one at a time by each other */
+        if (unlikely(nk_thread_queue_wake_word(c->wait_queue, 0) != 0)) {
+            NK_UNLOCK(&c->lock);
             ERROR_PRINT("Could not broadcast on condvar\n");
             return -1;
         }
-        return 0;
 
     }
 
@@ -0,0 +1,235 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/atomic.h>
+#include <nautilus/evq.h>
+#include <dev/timer.h>
+
+#define EVQ_ERROR(fmt, args...) ERROR_PRINT("EVQ: " fmt, ##args)
+
+struct nk_evq {
+    spinlock_t lock;
+    uint32_t mask;
+    uint32_t head;
+    uint32_t tail;
+
+    volatile uint32_t seq;       /* bumped on every post, for sleepers */
+    nk_thread_queue_t * waitq;
+
+    uint64_t posted;
+    uint64_t dropped;
+
+    struct nk_evq_event * ring;
+};
+
+
+nk_evq_t *
+nk_evq_create (uint32_t size)
+{
+    nk_evq_t * q;
+    uint32_t n = 1;
+
+    while (n < size) {
+        n <<= 1;
+    }
+
+    q = malloc(sizeof(*q));
+    if (!q) {
+        EVQ_ERROR("Could not allocate queue\n");
+        return NULL;
+    }
+    memset(q, 0, sizeof(*q));
+
+    q->ring = malloc(n * sizeof(struct nk_evq_event));
+    if (!q->ring) {
+        EVQ_ERROR("Could not allocate %u entries\n", n);
+        goto out_err;
+    }
+
+    q->waitq = nk_thread_queue_create();
+    if (!q->waitq) {
+        EVQ_ERROR("Could not create wait queue\n");
+        goto out_err1;
+    }
+
+    spinlock_init(&q->lock);
+    q->mask = n - 1;
+
+    return q;
+
+out_err1:
+    free(q->ring);
+out_err:
+    free(q);
+    return NULL;
+}
+
+
+void
+nk_evq_destroy (nk_evq_t * q)
+{
+    nk_thread_queue_destroy(q->waitq);
+    free(q->ring);
+    free(q);
+}
+
+
+int
+nk_evq_post (nk_evq_t * q, const struct nk_evq_event * ev)
+{
+    uint8_t flags = spin_lock_irq_save(&q->lock);
+
+    if (q->tail - q->head > q->mask) {
+        q->dropped++;
+        spin_unlock_irq_restore(&q->lock, flags);
+        return -1;
+    }
+
+    q->ring[q->tail++ & q->mask] = *ev;
+    q->posted++;
+
+    spin_unlock_irq_restore(&q->lock, flags);
+
+    atomic_inc(q->seq);
+    nk_thread_queue_wake_word(q->waitq, 1);
+
+    return 0;
+}
+
+
+int
+nk_evq_dequeue (nk_evq_t * q, struct nk_evq_event * evs, int max)
+{
+    uint8_t flags;
+    int n = 0;
+
+    if (q->head == q->tail) {
+        return 0;
+    }
+
+    flags = spin_lock_irq_save(&q->lock);
+    while (n < max && q->head != q->tail) {
+        evs[n++] = q->ring[q->head++ & q->mask];
+    }
+    spin_unlock_irq_restore(&q->lock, flags);
+
+    return n;
+}
+
+
+int
+nk_evq_wait (nk_evq_t * q, struct nk_evq_event * evs, int max)
+{
+    uint32_t seq;
+    int n;
+
+    while (1) {
+        seq = q->seq;
+        n = nk_evq_dequeue(q, evs, max);
+        if (n) {
+            return n;
+        }
+        nk_thread_queue_wait_word(q->waitq, &q->seq, seq);
+    }
+}
+
+
+void
+nk_evq_stats (nk_evq_t * q, uint64_t * posted, uint64_t * dropped)
+{
+    *posted  = q->posted;
+    *dropped = q->dropped;
+}
+
+
+void
+nk_evq_source_init (nk_evq_source_t * src,
+                    nk_evq_t * q,
+                    enum nk_evq_type type,
+                    uint32_t tag,
+                    void * ptr)
+{
+    memset(src, 0, sizeof(*src));
+    src->q       = q;
+    src->ev.type = type;
+    src->ev.tag  = tag;
+    src->ev.ptr  = ptr;
+}
+
+
+int
+nk_evq_source_post (nk_evq_source_t * src)
+{
+    return nk_evq_post(src->q, &src->ev);
+}
+
+
+static void
+evq_source_fire (void * arg)
+{
+    nk_evq_source_post((nk_evq_source_t*)arg);
+}
+
+
+int
+nk_evq_timer (nk_evq_source_t * src, uint64_t ns)
+{
+    return nk_timer_callback_arm(ns, evq_source_fire, src);
+}
+
+
+static void
+evq_xcall_tramp (void * arg)
+{
+    nk_evq_source_t * src = (nk_evq_source_t*)arg;
+
+    src->fun(src->arg);
+    nk_evq_source_post(src);
+}
+
+
+int
+nk_evq_xcall (nk_evq_source_t * src, cpu_id_t cpu, nk_xcall_func_t fun, void * arg)
+{
+    src->fun = fun;
+    src->arg = arg;
+
+    return smp_xcall(cpu, evq_xcall_tramp, src, 0);
+}
+
+
+static void
+evq_nemo_action (uint64_t payload, void * priv)
+{
+    nk_evq_source_t * src = (nk_evq_source_t*)priv;
+    struct nk_evq_event ev = src->ev;
+
+    /* the source is shared by every delivery, so post a copy */
+    ev.data = payload;
+    nk_evq_post(src->q, &ev);
+}
+
+
+nemo_event_id_t
+nk_evq_nemo_register (nk_evq_source_t * src)
+{
+    return nemo_register_event_data_action(evq_nemo_action, src);
+}
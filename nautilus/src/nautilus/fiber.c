@@ -0,0 +1,388 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/irq.h>
+#include <nautilus/percpu.h>
+#include <nautilus/fiber.h>
+
+#ifndef NAUT_CONFIG_DEBUG_FIBERS
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define FIBER_PRINT(fmt, args...) printk("FIBER: " fmt, ##args)
+#define FIBER_DEBUG(fmt, args...) DEBUG_PRINT("FIBER: " fmt, ##args)
+#define FIBER_ERROR(fmt, args...) ERROR_PRINT("FIBER: " fmt, ##args)
+
+#define FIBER_STACK_SIZE NAUT_CONFIG_FIBER_STACK_SIZE
+
+/* ready fibers run this many times between looks at the waiters */
+#define FIBER_POLL_INTERVAL 64
+
+typedef enum {
+    FIBER_READY,
+    FIBER_RUNNING,
+    FIBER_WAITING,
+    FIBER_DONE,
+} fiber_status_t;
+
+/* lives at the bottom of its own stack */
+struct nk_fiber {
+    void * rsp;
+    struct nk_fiber * next;      /* on the ready or the wait list */
+    struct nk_fiber_sched * sched;
+    fiber_status_t status;
+
+    nk_fiber_fun_t fun;
+    void * input;
+
+    nk_fiber_cond_t cond;        /* what it waits for */
+    void * cond_state;
+};
+
+struct nk_fiber_sched {
+    void * main_rsp;             /* the thread, while a fiber runs */
+    struct nk_fiber * cur;
+
+    struct nk_fiber * ready_head;
+    struct nk_fiber * ready_tail;
+    struct nk_fiber * waiting;
+
+    struct nk_fiber * done;      /* finished, for nk_fiber_run() to free */
+
+    uint64_t count;              /* fibers not yet done */
+    uint32_t picks;              /* since the waiters were last looked at */
+};
+
+/*
+ * Free stacks, per CPU. Only the CPU itself touches its pool, with
+ * interrupts off so that a thread preempted on it cannot interleave.
+ */
+struct fiber_pool {
+    struct nk_fiber * free;
+    uint64_t count;
+};
+
+static DEFINE_PER_CPU(struct fiber_pool, fiber_pool);
+
+
+static struct nk_fiber *
+fiber_alloc (void)
+{
+    struct fiber_pool * p;
+    struct nk_fiber * f;
+    uint8_t flags = irq_disable_save();
+
+    p = this_cpu_ptr(fiber_pool);
+    f = p->free;
+    if (f) {
+        p->free = f->next;
+        p->count--;
+    }
+
+    irq_enable_restore(flags);
+
+    if (!f) {
+        f = malloc(FIBER_STACK_SIZE);
+    }
+
+    return f;
+}
+
+
+static void
+fiber_free (struct nk_fiber * f)
+{
+    struct fiber_pool * p;
+    uint8_t flags = irq_disable_save();
+
+    p = this_cpu_ptr(fiber_pool);
+    if (p->count < NAUT_CONFIG_FIBER_POOL_DEPTH) {
+        f->next = p->free;
+        p->free = f;
+        p->count++;
+        f = NULL;
+    }
+
+    irq_enable_restore(flags);
+
+    if (f) {
+        free(f);
+    }
+}
+
+
+extern void nk_fiber_entry(void);
+
+/*
+ * Lays out the top of the stack the way nk_fiber_switch() leaves it,
+ * so that switching in pops the fiber into %r12 and "returns" to
+ * nk_fiber_entry
+ */
+static void
+fiber_stack_init (struct nk_fiber * f)
+{
+    uint64_t * sp = (uint64_t*)(((addr_t)f + FIBER_STACK_SIZE) & ~0xfUL);
+
+    *--sp = 0;                        /* keep the entry's frame aligned */
+    *--sp = (uint64_t)nk_fiber_entry; /* ret */
+    *--sp = 0;                        /* rbp */
+    *--sp = 0;                        /* rbx */
+    *--sp = (uint64_t)f;              /* r12 */
+    *--sp = 0;                        /* r13 */
+    *--sp = 0;                        /* r14 */
+    *--sp = 0;                        /* r15 */
+
+    f->rsp = sp;
+}
+
+
+static inline void
+ready_push (struct nk_fiber_sched * s, struct nk_fiber * f)
+{
+    f->status = FIBER_READY;
+    f->next = NULL;
+    if (s->ready_tail) {
+        s->ready_tail->next = f;
+    } else {
+        s->ready_head = f;
+    }
+    s->ready_tail = f;
+}
+
+
+/* moves the waiters whose condition now holds onto the ready list */
+static void
+poll_waiters (struct nk_fiber_sched * s)
+{
+    struct nk_fiber ** pp = &s->waiting;
+    struct nk_fiber * f;
+
+    s->picks = 0;
+
+    while ((f = *pp)) {
+        if (f->cond(f->cond_state)) {
+            *pp = f->next;
+            ready_push(s, f);
+        } else {
+            pp = &f->next;
+        }
+    }
+}
+
+
+static struct nk_fiber *
+next_fiber (struct nk_fiber_sched * s)
+{
+    struct nk_fiber * f;
+
+    if (s->waiting && (!s->ready_head || ++s->picks >= FIBER_POLL_INTERVAL)) {
+        poll_waiters(s);
+    }
+
+    f = s->ready_head;
+    if (f) {
+        s->ready_head = f->next;
+        if (!s->ready_head) {
+            s->ready_tail = NULL;
+        }
+        f->status = FIBER_RUNNING;
+        s->cur = f;
+    }
+
+    return f;
+}
+
+
+/*
+ * The running fiber has been put where it belongs, hand the thread
+ * straight to the next ready fiber, or back to nk_fiber_run() if
+ * there is none
+ */
+static void
+fiber_switch_out (struct nk_fiber * me)
+{
+    struct nk_fiber_sched * s = me->sched;
+    struct nk_fiber * next = next_fiber(s);
+
+    if (next == me) {
+        return;
+    }
+
+    if (!next) {
+        s->cur = NULL;
+    }
+
+    nk_fiber_switch(&me->rsp, next ? next->rsp : s->main_rsp);
+}
+
+
+void
+nk_fiber_main (struct nk_fiber * f)
+{
+    struct nk_fiber_sched * s = f->sched;
+
+    f->fun(f->input);
+
+    FIBER_DEBUG("fiber %p done\n", f);
+
+    /* nk_fiber_run() frees it, since we are still standing on it */
+    f->status = FIBER_DONE;
+    s->done = f;
+    s->cur = NULL;
+    nk_fiber_switch(&f->rsp, s->main_rsp);
+
+    panic("Finished fiber %p switched back in\n", f);
+}
+
+
+nk_fiber_t *
+nk_fiber_start (nk_fiber_fun_t fun, void * input)
+{
+    nk_thread_t * t = get_cur_thread();
+    struct nk_fiber_sched * s = t->fibers;
+    struct nk_fiber * f;
+
+    if (!s) {
+        s = malloc(sizeof(*s));
+        if (!s) {
+            FIBER_ERROR("Could not allocate fiber scheduler\n");
+            return NULL;
+        }
+        memset(s, 0, sizeof(*s));
+        t->fibers = s;
+    }
+
+    f = fiber_alloc();
+    if (!f) {
+        FIBER_ERROR("Could not allocate fiber\n");
+        return NULL;
+    }
+
+    memset(f, 0, sizeof(*f));
+    f->fun   = fun;
+    f->input = input;
+    f->sched = s;
+    fiber_stack_init(f);
+
+    s->count++;
+    ready_push(s, f);
+
+    return f;
+}
+
+
+int
+nk_fiber_run (void)
+{
+    nk_thread_t * t = get_cur_thread();
+    struct nk_fiber_sched * s = t->fibers;
+    struct nk_fiber * f;
+
+    if (!s) {
+        return 0;
+    }
+
+    if (s->cur) {
+        FIBER_ERROR("nk_fiber_run() called from fiber %p\n", s->cur);
+        return -1;
+    }
+
+    while (s->count) {
+
+        f = next_fiber(s);
+
+        if (!f) {
+            /* everyone is waiting, let other threads make it happen */
+            nk_yield();
+            continue;
+        }
+
+        nk_fiber_switch(&s->main_rsp, f->rsp);
+
+        /* whichever fiber came back here, if it finished */
+        if (s->done) {
+            fiber_free(s->done);
+            s->done = NULL;
+            s->count--;
+        }
+    }
+
+    t->fibers = NULL;
+    free(s);
+
+    return 0;
+}
+
+
+nk_fiber_t *
+nk_fiber_current (void)
+{
+    struct nk_fiber_sched * s = get_cur_thread()->fibers;
+
+    return s ? s->cur : NULL;
+}
+
+
+void
+nk_fiber_yield (void)
+{
+    struct nk_fiber * me = nk_fiber_current();
+
+    if (!me) {
+        nk_yield();
+        return;
+    }
+
+    ready_push(me->sched, me);
+    fiber_switch_out(me);
+}
+
+
+void
+nk_fiber_wait (nk_fiber_cond_t cond, void * state)
+{
+    struct nk_fiber * me;
+    struct nk_fiber_sched * s;
+
+    if (cond(state)) {
+        return;
+    }
+
+    me = nk_fiber_current();
+
+    if (!me) {
+        while (!cond(state)) {
+            nk_yield();
+        }
+        return;
+    }
+
+    s = me->sched;
+
+    me->cond       = cond;
+    me->cond_state = state;
+    me->status     = FIBER_WAITING;
+    me->next       = s->waiting;
+    s->waiting     = me;
+
+    fiber_switch_out(me);
+}
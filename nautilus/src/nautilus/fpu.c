@@ -28,6 +28,7 @@
 #include <nautilus/idt.h>
 #include <nautilus/irq.h>
 #include <nautilus/msr.h>
+#include <nautilus/thread.h>
 
 #ifndef NAUT_CONFIG_DEBUG_FPU
 #undef DEBUG_PRINT
@@ -89,6 +90,170 @@ xm_handler (excp_entry_t * excp, excp_vec_t vec)
 }
 
 
+#ifdef NAUT_CONFIG_FPU_XSAVE
+/*
+ * Components we are willing to enable in XCR0: x87, SSE, AVX and the
+ * three AVX-512 pieces (opmask, ZMM_Hi256, Hi16_ZMM)
+ */
+#define XSAVE_WANTED_MASK 0xe7ULL
+
+enum fpu_save_insn {
+    FPU_SAVE_FXSAVE = 0,
+    FPU_SAVE_XSAVE,
+    FPU_SAVE_XSAVEOPT,
+    FPU_SAVE_XSAVEC,
+};
+
+static uint8_t  fpu_insn       = FPU_SAVE_FXSAVE;
+static uint8_t  fpu_probed     = 0;
+static uint64_t fpu_xcr0       = 0;
+static uint32_t fpu_state_size = FXSAVE_SIZE;
+#endif
+
+
+/*
+ * Bytes of save area a thread needs. The XSAVE area is laid out by the
+ * CPU, so this is only known after fpu_init() on the BSP.
+ */
+uint32_t
+nk_fpu_state_size (void)
+{
+#ifdef NAUT_CONFIG_FPU_XSAVE
+    return fpu_state_size;
+#else
+    return FXSAVE_SIZE;
+#endif
+}
+
+
+/*
+ * The state components enabled in XCR0, 0 without XSAVE. AVX and
+ * AVX-512 registers survive a context switch only if their components
+ * are here, so code choosing those instructions checks this first.
+ */
+uint64_t
+nk_fpu_xcr0 (void)
+{
+#ifdef NAUT_CONFIG_FPU_XSAVE
+    return fpu_xcr0;
+#else
+    return 0;
+#endif
+}
+
+
+void
+nk_fpu_save (void * state)
+{
+#ifdef NAUT_CONFIG_FPU_XSAVE
+    uint32_t lo = (uint32_t)fpu_xcr0;
+    uint32_t hi = (uint32_t)(fpu_xcr0 >> 32);
+    
+    switch (fpu_insn) {
+        case FPU_SAVE_XSAVEC:
+            asm volatile ("xsavec64 (%0)" : : "r"(state), "a"(lo), "d"(hi) : "memory");
+            return;
+        case FPU_SAVE_XSAVEOPT:
+            asm volatile ("xsaveopt64 (%0)" : : "r"(state), "a"(lo), "d"(hi) : "memory");
+            return;
+        case FPU_SAVE_XSAVE:
+            asm volatile ("xsave64 (%0)" : : "r"(state), "a"(lo), "d"(hi) : "memory");
+            return;
+        default:
+            break;
+    }
+#endif
+    asm volatile ("fxsave (%0)" : : "r"(state) : "memory");
+}
+
+
+void
+nk_fpu_restore (void * state)
+{
+#ifdef NAUT_CONFIG_FPU_XSAVE
+    if (fpu_insn != FPU_SAVE_FXSAVE) {
+        uint32_t lo = (uint32_t)fpu_xcr0;
+        uint32_t hi = (uint32_t)(fpu_xcr0 >> 32);
+        asm volatile ("xrstor64 (%0)" : : "r"(state), "a"(lo), "d"(hi) : "memory");
+        return;
+    }
+#endif
+    asm volatile ("fxrstor (%0)" : : "r"(state) : "memory");
+}
+
+
+/*
+ * Give a new thread the state fninit and enable_sse() would leave
+ * behind: all x87 and SIMD exceptions masked, empty register stack.
+ * A zeroed XSAVE header marks every extended component as in its
+ * initial state.
+ */
+void
+nk_fpu_state_init (void * state)
+{
+    memset(state, 0, nk_fpu_state_size());
+    *(uint16_t*)state             = 0x037f; // FCW
+    *(uint32_t*)((uint8_t*)state + 24) = 0x1f80; // MXCSR
+}
+
+
+#ifdef NAUT_CONFIG_FPU_LAZY
+/*
+ * Lazy FPU switching
+ *
+ * CR0.TS is set on every context switch, so the first FPU/SIMD
+ * instruction a thread issues traps to nm_handler(), which loads the
+ * thread's state and clears TS. TS being clear at switch time therefore
+ * means the outgoing thread used the FPU during its run and its state is
+ * saved then. The registers keep that state afterward, so fpu_owner
+ * and the thread's fpu_cpu let the trap skip the restore when the thread
+ * comes back to the same CPU with nobody else having loaded theirs.
+ * Threads that never touch the FPU never pay for a save or a restore.
+ */
+static inline void
+fpu_clts (void)
+{
+    asm volatile ("clts" ::: "memory");
+}
+
+
+/* called from nk_thread_switch() before the current thread changes */
+void nk_fpu_lazy_switch(void);
+void
+nk_fpu_lazy_switch (void)
+{
+    ulong_t cr0 = read_cr0();
+    
+    if (!(cr0 & CR0_TS)) {
+        nk_fpu_save(get_cur_thread()->fpu_state);
+        write_cr0(cr0 | CR0_TS);
+    }
+}
+
+
+int nm_handler (excp_entry_t * excp, excp_vec_t vec);
+int
+nm_handler (excp_entry_t * excp, excp_vec_t vec)
+{
+    nk_thread_t * me = get_cur_thread();
+    int cpu          = my_cpu_id();
+    
+    fpu_clts();
+    
+    /* our registers are still loaded from last time */
+    if (per_cpu_get(fpu_owner) == me && me->fpu_cpu == cpu) {
+        return 0;
+    }
+    
+    nk_fpu_restore(me->fpu_state);
+    me->fpu_cpu = cpu;
+    per_cpu_put(fpu_owner, me);
+    
+    return 0;
+}
+#endif /* NAUT_CONFIG_FPU_LAZY */
+
+
 static uint8_t 
 has_x87 (void)
 {
@@ -277,6 +442,72 @@ set_osxsave (void)
     write_cr4(r);
 }
 
+#ifdef NAUT_CONFIG_FPU_XSAVE
+static inline void
+xsetbv (uint32_t reg, uint64_t val)
+{
+    asm volatile ("xsetbv" : : "c"(reg), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)));
+}
+
+
+/*
+ * Turn on XSAVE for the components both we and the CPU support. The
+ * first CPU through here (the BSP) picks XCR0, the save instruction and
+ * the per-thread area size. The others then just enable the same XCR0.
+ */
+static void
+enable_xsave (void)
+{
+    cpuid_ret_t r;
+    uint64_t supported;
+    
+    if (fpu_probed) {
+        if (fpu_xcr0) {
+            set_osxsave();
+            xsetbv(0, fpu_xcr0);
+        }
+        return;
+    }
+    
+    fpu_probed = 1;
+    
+    if (!has_xsave()) {
+        FPU_DEBUG("	No XSAVE, extended state will not be saved\n");
+        return;
+    }
+    
+    set_osxsave();
+    
+    cpuid_sub(0xd, 0, &r);
+    supported = r.a | ((uint64_t)r.d << 32);
+    fpu_xcr0  = supported & XSAVE_WANTED_MASK;
+    xsetbv(0, fpu_xcr0);
+    
+    cpuid_sub(0xd, 1, &r);
+    if (r.a & 0x2) {
+        /* EBX: compacted size for the components enabled in XCR0 */
+        fpu_insn       = FPU_SAVE_XSAVEC;
+        fpu_state_size = r.b;
+    } else {
+        fpu_insn = (r.a & 0x1) ? FPU_SAVE_XSAVEOPT : FPU_SAVE_XSAVE;
+        cpuid_sub(0xd, 0, &r);
+        /* EBX: standard size for the components enabled in XCR0 */
+        fpu_state_size = r.b;
+    }
+    
+    if (fpu_state_size < FXSAVE_SIZE) {
+        fpu_state_size = FXSAVE_SIZE;
+    }
+    
+    FPU_DEBUG("	XSAVE enabled (XCR0=0x%lx, %s, %u byte area)\n",
+              fpu_xcr0,
+              fpu_insn == FPU_SAVE_XSAVEC ? "XSAVEC" :
+              fpu_insn == FPU_SAVE_XSAVEOPT ? "XSAVEOPT" : "XSAVE",
+              fpu_state_size);
+}
+#endif
+
+
 static void 
 amd_fpu_init (struct naut_info * naut)
 {
@@ -348,6 +579,10 @@ fpu_init_common (struct naut_info * naut)
         FPU_DEBUG("\tInitializing SSE extensions\n");
         enable_sse();
     }
+
+#ifdef NAUT_CONFIG_FPU_XSAVE
+    enable_xsave();
+#endif
 }
 
 /* 
@@ -383,4 +618,11 @@ fpu_init (struct naut_info * naut)
         return;
     }
 
+#ifdef NAUT_CONFIG_FPU_LAZY
+    if (register_int_handler(NM_EXCP, nm_handler, NULL) != 0) {
+        ERROR_PRINT("Could not register excp handler for NM\n");
+        return;
+    }
+#endif
+
 }
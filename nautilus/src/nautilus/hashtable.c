@@ -38,6 +38,10 @@
 #include <nautilus/hashtable.h>
 #include <nautilus/naut_string.h>
 #include <nautilus/mm.h>
+#ifdef NAUT_CONFIG_KMEM_SLAB
+#include <nautilus/slab.h>
+#include <nautilus/atomic.h>
+#endif
 
 
 struct nk_hash_entry {
@@ -159,6 +163,34 @@ indexFor (uint_t table_length, uint_t hash_value)
 /*****************************************************************************/
 #define freekey(X) free(X)
 
+#ifdef NAUT_CONFIG_KMEM_SLAB
+static struct nk_slab_cache * entry_slab = NULL;
+
+/* made on first use, a core that loses the race drops its own */
+static struct nk_hash_entry *
+alloc_entry (void)
+{
+    struct nk_slab_cache * c = entry_slab;
+
+    if (!c) {
+        c = nk_slab_cache_create("nk_hash_entry", sizeof(struct nk_hash_entry), 0, NULL);
+        if (c && atomic_cmpswap(entry_slab, NULL, c) != NULL) {
+            nk_slab_cache_destroy(c);
+        }
+        c = entry_slab;
+        if (!c) {
+            return NULL;
+        }
+    }
+    return (struct nk_hash_entry *)nk_slab_alloc(c);
+}
+
+#define free_entry(X) nk_slab_free(entry_slab, (X))
+#else
+#define alloc_entry() ((struct nk_hash_entry *)malloc(sizeof(struct nk_hash_entry)))
+#define free_entry(X) free(X)
+#endif
+
 
 static void* 
 tmp_realloc (void * old_ptr, uint_t old_size, uint_t new_size) 
@@ -374,7 +406,7 @@ nk_htable_insert (struct nk_hashtable * htable,
     }
 
 
-    new_entry = (struct nk_hash_entry *)malloc(sizeof(struct nk_hash_entry));
+    new_entry = alloc_entry();
 
     if (new_entry == NULL) { 
         (htable->entry_count)--; 
@@ -548,7 +580,7 @@ nk_htable_remove(struct nk_hashtable * htable, addr_t key, int free_key)
             if (free_key) {
                 freekey((void *)(cursor->key));
             }
-            free(cursor);
+            free_entry(cursor);
 
             return value;
         }
@@ -582,7 +614,7 @@ nk_free_htable (struct nk_hashtable * htable, int free_values, int free_keys)
                     freekey((void *)(tmp->key)); 
                 }
                 free((void *)(tmp->value)); 
-                free(tmp); 
+                free_entry(tmp); 
             }
         }
     } else {
@@ -598,7 +630,7 @@ nk_free_htable (struct nk_hashtable * htable, int free_values, int free_keys)
                 if (free_keys) {
                     freekey((void *)(tmp->key)); 
                 }
-                free(tmp); 
+                free_entry(tmp); 
             }
         }
     }
@@ -747,7 +779,7 @@ nk_htable_iter_remove (struct nk_hashtable_iter * iter, int free_key)
         iter->parent = remember_parent; 
     }
 
-    free(remember_entry);
+    free_entry(remember_entry);
     return ret;
 }
 
@@ -0,0 +1,151 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpumask.h>
+#include <nautilus/irq.h>
+#include <nautilus/atomic.h>
+#include <nautilus/naut_string.h>
+#include <nautilus/mb_utils.h>
+#include <nautilus/housekeeping.h>
+
+#define HK_PRINT(fmt, args...) printk("HOUSEKEEPING: " fmt, ##args)
+#define HK_ERROR(fmt, args...) ERROR_PRINT("HOUSEKEEPING: " fmt, ##args)
+
+static nk_cpumask_t hk_mask;
+static uint32_t     hk_next = 0;
+
+
+static unsigned
+parse_num (const char ** s)
+{
+    unsigned n = 0;
+
+    while (isdigit(**s)) {
+        n = n * 10 + (**s - '0');
+        (*s)++;
+    }
+
+    return n;
+}
+
+
+/* housekeeping=<cpu>[-<cpu>][,...], returns 0 if it is there and good */
+static int
+parse_cmdline (const char * cmdline, nk_cpumask_t * m, unsigned ncpus)
+{
+    const char * s;
+    unsigned lo, hi;
+
+    if (!cmdline || !(s = strstr(cmdline, "housekeeping="))) {
+        return -1;
+    }
+
+    s += strlen("housekeeping=");
+    nk_cpumask_zero(m);
+
+    while (isdigit(*s)) {
+        lo = hi = parse_num(&s);
+        if (*s == '-') {
+            s++;
+            hi = parse_num(&s);
+        }
+        for (; lo <= hi && lo < ncpus; lo++) {
+            nk_cpumask_set(m, lo);
+        }
+        if (*s != ',') {
+            break;
+        }
+        s++;
+    }
+
+    if (*s && *s != ' ') {
+        HK_ERROR("Cannot parse housekeeping= on the command line\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int
+nk_housekeeping_init (struct naut_info * naut)
+{
+    unsigned ncpus = naut->sys.num_cpus;
+    const char * cmdline = naut->sys.mb_info ? naut->sys.mb_info->boot_cmd_line : NULL;
+    uint32_t cpu;
+
+    if (parse_cmdline(cmdline, &hk_mask, ncpus)) {
+        nk_cpumask_fill(&hk_mask, NAUT_CONFIG_HOUSEKEEPING_CPUS < ncpus ? NAUT_CONFIG_HOUSEKEEPING_CPUS : ncpus);
+    }
+
+    /* the BSP took the HPET broadcast and boot-time work already */
+    nk_cpumask_set(&hk_mask, 0);
+
+    HK_PRINT("%u of %u cores do housekeeping:", nk_cpumask_count(&hk_mask), ncpus);
+    nk_cpumask_for_each(cpu, &hk_mask) {
+        printk(" %u", cpu);
+    }
+    printk("\n");
+
+    return nk_housekeeping_steer_irqs();
+}
+
+
+int
+nk_housekeeping_steer_irqs (void)
+{
+    return nk_irq_steer_all(&hk_mask);
+}
+
+
+const nk_cpumask_t *
+nk_housekeeping_mask (void)
+{
+    return &hk_mask;
+}
+
+
+int
+nk_is_housekeeping (int cpu)
+{
+    return cpu >= 0 && cpu < NAUT_CONFIG_MAX_CPUS && nk_cpumask_test(&hk_mask, cpu);
+}
+
+
+int
+nk_housekeeping_cpu (void)
+{
+    uint32_t n = nk_cpumask_count(&hk_mask);
+    uint32_t i, cpu;
+
+    if (!n) {
+        return 0;
+    }
+
+    i = atomic_add(hk_next, 1) % n;
+
+    nk_cpumask_for_each(cpu, &hk_mask) {
+        if (!i--) {
+            return cpu;
+        }
+    }
+
+    return 0;
+}
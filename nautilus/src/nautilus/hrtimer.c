@@ -0,0 +1,331 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/percpu.h>
+#include <nautilus/irq.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/intrinsics.h>
+#include <nautilus/hrtimer.h>
+#ifdef NAUT_CONFIG_TSC_CLOCKSOURCE
+#include <nautilus/clocksource.h>
+#endif
+#include <dev/apic.h>
+
+#ifndef NAUT_CONFIG_DEBUG_TIMERS
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define HRT_DEBUG(fmt, args...) DEBUG_PRINT("HRTIMER: " fmt, ##args)
+
+struct hrtimer_base {
+    spinlock_t          lock;
+    uint32_t            n;
+    uint8_t             oneshot;   /* the APIC timer is ours to program */
+    uint64_t            sched;     /* the RT scheduler's deadline, 0 if none */
+    struct nk_hrtimer * volatile running;
+    struct nk_hrtimer * heap[NK_HRTIMER_MAX];
+} __align(64);
+
+static struct hrtimer_base bases[NAUT_CONFIG_MAX_CPUS];
+
+
+static inline void
+heap_set (struct hrtimer_base * b, uint32_t i, struct nk_hrtimer * t)
+{
+    b->heap[i] = t;
+    t->idx     = i;
+}
+
+
+static void
+heap_up (struct hrtimer_base * b, uint32_t i)
+{
+    struct nk_hrtimer * t = b->heap[i];
+
+    while (i > 0 && b->heap[(i - 1) / 2]->expiry > t->expiry) {
+        heap_set(b, i, b->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+
+    heap_set(b, i, t);
+}
+
+
+static void
+heap_down (struct hrtimer_base * b, uint32_t i)
+{
+    struct nk_hrtimer * t = b->heap[i];
+    uint32_t c;
+
+    while ((c = 2 * i + 1) < b->n) {
+        if (c + 1 < b->n && b->heap[c + 1]->expiry < b->heap[c]->expiry) {
+            c++;
+        }
+        if (b->heap[c]->expiry >= t->expiry) {
+            break;
+        }
+        heap_set(b, i, b->heap[c]);
+        i = c;
+    }
+
+    heap_set(b, i, t);
+}
+
+
+static void
+heap_remove (struct hrtimer_base * b, uint32_t i)
+{
+    struct nk_hrtimer * last = b->heap[--b->n];
+
+    if (i == b->n) {
+        return;
+    }
+
+    heap_set(b, i, last);
+    heap_up(b, i);
+    heap_down(b, last->idx);
+}
+
+
+/* lock held, and only on the base's own core */
+static void
+hrtimer_reprogram (struct hrtimer_base * b)
+{
+    uint64_t next = b->sched;
+
+    if (!b->oneshot) {
+        return;
+    }
+
+    if (b->n && (!next || b->heap[0]->expiry < next)) {
+        next = b->heap[0]->expiry;
+    }
+
+    apic_deadline_write(per_cpu_get(apic), next);
+}
+
+
+static inline uint64_t
+ns_to_cycles (uint64_t ns)
+{
+#ifdef NAUT_CONFIG_TSC_CLOCKSOURCE
+    return nk_ns_to_cycles(ns);
+#else
+    uint64_t khz = per_cpu_get(cpu_khz);
+
+    /* split so that long timeouts do not overflow */
+    return (ns / 1000000) * khz + (ns % 1000000) * khz / 1000000;
+#endif
+}
+
+
+void
+nk_hrtimer_init (struct nk_hrtimer * t, nk_hrtimer_fn_t fn, void * arg)
+{
+    memset(t, 0, sizeof(*t));
+    t->fn  = fn;
+    t->arg = arg;
+}
+
+
+int
+nk_hrtimer_start_tsc (struct nk_hrtimer * t, uint64_t tsc, uint64_t period)
+{
+    struct hrtimer_base * b;
+    uint8_t flags;
+
+    /* a timer moves to the core that (re)starts it */
+    if (t->state == NK_HRTIMER_QUEUED && t->cpu != my_cpu_id()) {
+        nk_hrtimer_cancel(t);
+    }
+
+    flags = irq_disable_save();
+    b = &bases[my_cpu_id()];
+    spin_lock(&b->lock);
+
+    if (t->state == NK_HRTIMER_QUEUED) {
+        heap_remove(b, t->idx);
+    } else if (b->n == NK_HRTIMER_MAX) {
+        spin_unlock(&b->lock);
+        irq_enable_restore(flags);
+        ERROR_PRINT("Too many hrtimers on CPU %u\n", my_cpu_id());
+        return -1;
+    }
+
+    t->expiry = tsc;
+    t->period = period;
+    t->cpu    = my_cpu_id();
+    t->state  = NK_HRTIMER_QUEUED;
+    t->idx    = b->n++;
+    b->heap[t->idx] = t;
+    heap_up(b, t->idx);
+
+    if (t->idx == 0) {
+        hrtimer_reprogram(b);
+    }
+
+    spin_unlock(&b->lock);
+    irq_enable_restore(flags);
+
+    return 0;
+}
+
+
+int
+nk_hrtimer_start (struct nk_hrtimer * t, uint64_t ns, uint64_t period_ns)
+{
+    return nk_hrtimer_start_tsc(t, rdtsc() + ns_to_cycles(ns), ns_to_cycles(period_ns));
+}
+
+
+int
+nk_hrtimer_cancel (struct nk_hrtimer * t)
+{
+    struct hrtimer_base * b;
+    uint8_t flags;
+    uint32_t cpu;
+
+    while (1) {
+        cpu = t->cpu;
+        b = &bases[cpu];
+        flags = spin_lock_irq_save(&b->lock);
+
+        /* it may have been moved while we took the lock */
+        if (t->cpu == cpu) {
+            break;
+        }
+
+        spin_unlock_irq_restore(&b->lock, flags);
+    }
+
+    if (t->state == NK_HRTIMER_QUEUED) {
+        heap_remove(b, t->idx);
+        t->state = NK_HRTIMER_IDLE;
+        spin_unlock_irq_restore(&b->lock, flags);
+        return 0;
+    }
+
+    if (t->state == NK_HRTIMER_RUNNING) {
+        /* keep it from being re-queued once the callback returns */
+        t->period = 0;
+        spin_unlock_irq_restore(&b->lock, flags);
+
+        /*
+         * callbacks run with interrupts off, so on its own core we
+         * can only be the callback cancelling itself
+         */
+        if (cpu != my_cpu_id()) {
+            PAUSE_WHILE(b->running == t);
+        }
+        return 1;
+    }
+
+    spin_unlock_irq_restore(&b->lock, flags);
+    return 1;
+}
+
+
+uint64_t
+nk_hrtimer_next (void)
+{
+    struct hrtimer_base * b;
+    uint64_t next = 0;
+    uint8_t flags;
+
+    flags = irq_disable_save();
+    b = &bases[my_cpu_id()];
+    spin_lock(&b->lock);
+    if (b->n) {
+        next = b->heap[0]->expiry;
+    }
+    spin_unlock(&b->lock);
+    irq_enable_restore(flags);
+
+    return next;
+}
+
+
+void
+nk_hrtimer_program (uint64_t tsc)
+{
+    struct hrtimer_base * b;
+    uint8_t flags;
+
+    flags = irq_disable_save();
+    b = &bases[my_cpu_id()];
+    spin_lock(&b->lock);
+    b->oneshot = 1;
+    b->sched   = tsc;
+    hrtimer_reprogram(b);
+    spin_unlock(&b->lock);
+    irq_enable_restore(flags);
+}
+
+
+/* interrupts are off */
+void
+nk_hrtimer_run (void)
+{
+    struct hrtimer_base * b = &bases[my_cpu_id()];
+    struct nk_hrtimer * t;
+    uint64_t now;
+
+    spin_lock(&b->lock);
+
+    now = rdtsc();
+
+    while (b->n && b->heap[0]->expiry <= now) {
+        t = b->heap[0];
+        heap_remove(b, 0);
+        t->state   = NK_HRTIMER_RUNNING;
+        b->running = t;
+        spin_unlock(&b->lock);
+
+        HRT_DEBUG("timer %p expired %lu cycles late\n", t, rdtsc() - t->expiry);
+        t->fn(t, t->arg);
+
+        spin_lock(&b->lock);
+
+        /* neither restarted nor cancelled by the callback */
+        if (t->state == NK_HRTIMER_RUNNING) {
+            if (t->period && b->n < NK_HRTIMER_MAX) {
+                t->expiry += t->period;
+                if (t->expiry <= now) {
+                    t->expiry += ((now - t->expiry) / t->period + 1) * t->period;
+                }
+                t->state = NK_HRTIMER_QUEUED;
+                t->idx   = b->n++;
+                b->heap[t->idx] = t;
+                heap_up(b, t->idx);
+            } else {
+                t->state = NK_HRTIMER_IDLE;
+            }
+        }
+
+        b->running = NULL;
+        now = rdtsc();
+    }
+
+    hrtimer_reprogram(b);
+
+    spin_unlock(&b->lock);
+}
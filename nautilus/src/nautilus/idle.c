@@ -24,6 +24,14 @@
 #include <nautilus/idle.h>
 #include <nautilus/cpu.h>
 #include <nautilus/thread.h>
+#include <nautilus/percpu.h>
+#include <nautilus/atomic.h>
+#ifdef NAUT_CONFIG_MWAIT_WAKEUP
+#include <nautilus/mwait.h>
+#endif
+#ifdef NAUT_CONFIG_RT_IDLE_CSTATES
+#include <nautilus/rt_scheduler.h>
+#endif
 
 #define TIMEOUT 1000000
 #define INNER_LOOP_DELAY 50000
@@ -43,6 +51,186 @@ idle_delay (unsigned long long n)
 }
 
 
+#ifdef NAUT_CONFIG_MWAIT_WAKEUP
+/* a line to itself, so only a wakeup breaks the wait */
+static struct idle_word {
+    volatile uint32_t waiting;
+} __attribute__((aligned(64))) idle_words[NAUT_CONFIG_MAX_CPUS];
+
+
+int
+nk_idle_wake (int cpu)
+{
+    if (cpu < 0 || cpu >= NAUT_CONFIG_MAX_CPUS) {
+        return 0;
+    }
+
+    return atomic_cmpswap(idle_words[cpu].waiting, 1, 0) == 1;
+}
+
+
+void
+nk_idle_mwait (uint32_t hint)
+{
+    struct idle_word * w = &idle_words[my_cpu_id()];
+
+    /* locked, so a waker sees it before we look for its store */
+    atomic_or(w->waiting, 1);
+    nk_monitor((addr_t)&w->waiting, 0, 0);
+
+    if (w->waiting) {
+        sti();
+        nk_mwait(hint, 0);
+    } else {
+        sti();
+    }
+
+    /* an interrupt may have woken us, wakers must IPI from here */
+    w->waiting = 0;
+}
+
+
+/* MWAIT hint for the deepest C-state up to state the CPU has, -1 if none */
+static int
+idle_hint (int state)
+{
+    uint8_t cstates = nk_mwait_cstates();
+
+    while (state > 1 && !(cstates & (1 << state))) {
+        state--;
+    }
+
+    return (cstates & (1 << state)) ? (state - 1) << 4 : -1;
+}
+
+
+/* interrupts off on entry, on at return */
+static void
+idle_wait (int hint)
+{
+    if (hint < 0) {
+        sti();
+        halt();
+        return;
+    }
+
+    nk_idle_mwait(hint);
+}
+
+
+static void
+idle_enter (void)
+{
+    int hint = idle_hint(NAUT_CONFIG_MWAIT_WAKEUP_CSTATE);
+
+    cli();
+    idle_wait(hint);
+}
+#endif
+
+
+#ifdef NAUT_CONFIG_IDLE_ADAPTIVE
+/*
+ * Adaptive idle. Each wait starts by spinning on the core's wake word
+ * for a window, so work that comes right back is picked up without a
+ * C-state exit; a waker's store ends the spin without an IPI. If no
+ * work shows up, the core MWAITs in C1 when its recent waits have
+ * been short, and in the deepest allowed state when they have been
+ * long.
+ *
+ * The window is learned per core from how each wait ended. Work that
+ * came during the spin leaves it alone. Work that came soon after it
+ * ran out, within the longest window, doubles it. A wait longer than
+ * that halves it, so a quiet core stops spinning.
+ */
+#define IDLE_SPIN_MIN_US 1
+#define IDLE_PREDICT_SHIFT 3
+
+static struct idle_policy {
+    uint64_t spin;          /* current window, cycles */
+    uint64_t predict;       /* decayed length of recent waits, cycles */
+    uint64_t spin_min;
+    uint64_t spin_max;
+    uint64_t deep;          /* waits predicted this long go deep */
+    int shallow_hint;
+    int deep_hint;
+} __attribute__((aligned(64))) idle_policies[NAUT_CONFIG_MAX_CPUS];
+
+
+static void
+idle_policy_init (struct idle_policy * p)
+{
+    uint64_t khz = per_cpu_get(cpu_khz);
+
+    if (!khz) {
+        /* not calibrated, assume a fast clock so windows come out long */
+        khz = 4000000;
+    }
+
+    p->spin_min = (IDLE_SPIN_MIN_US * khz) / 1000;
+    p->spin_max = (NAUT_CONFIG_IDLE_SPIN_MAX_US * khz) / 1000;
+    p->deep = (NAUT_CONFIG_IDLE_DEEP_US * khz) / 1000;
+    p->spin = p->spin_max;
+    p->predict = 0;
+    p->shallow_hint = idle_hint(1);
+    p->deep_hint = idle_hint(NAUT_CONFIG_MWAIT_WAKEUP_CSTATE);
+}
+
+
+static void
+idle_adapt (struct idle_policy * p, uint64_t len, int in_spin)
+{
+    p->predict += (len >> IDLE_PREDICT_SHIFT) - (p->predict >> IDLE_PREDICT_SHIFT);
+
+    if (in_spin) {
+        return;
+    }
+
+    if (len <= p->spin_max) {
+        p->spin = p->spin ? p->spin * 2 : p->spin_min;
+        if (p->spin > p->spin_max) {
+            p->spin = p->spin_max;
+        }
+    } else {
+        p->spin /= 2;
+        if (p->spin < p->spin_min) {
+            p->spin = 0;
+        }
+    }
+}
+
+
+static void
+idle_adaptive (void)
+{
+    struct idle_policy * p = &idle_policies[my_cpu_id()];
+    struct idle_word * w = &idle_words[my_cpu_id()];
+    uint64_t start = rdtsc();
+    uint64_t end;
+
+    if (!p->spin_max) {
+        idle_policy_init(p);
+    }
+
+    /* locked, so a waker sees it before we look for its store */
+    atomic_or(w->waiting, 1);
+    end = start + p->spin;
+    while (w->waiting && rdtsc() < end) {
+        asm volatile ("pause");
+    }
+
+    if (!w->waiting) {
+        idle_adapt(p, rdtsc() - start, 1);
+        return;
+    }
+
+    cli();
+    idle_wait(p->predict < p->deep ? p->shallow_hint : p->deep_hint);
+    idle_adapt(p, rdtsc() - start, 0);
+}
+#endif
+
+
 void 
 idle (void * in, void ** out)
 {
@@ -52,13 +240,30 @@ idle (void * in, void ** out)
 
         nk_yield();
 
+#ifdef NAUT_CONFIG_KMEM_PREZERO
+        /* fill the zeroed-block pool before going to sleep */
+        if (kmem_prezero_idle()) {
+            continue;
+        }
+#endif
+
+#ifdef NAUT_CONFIG_IDLE_ADAPTIVE
+        /* spins for itself, for as long as it has learned to */
+        idle_adaptive();
+        continue;
+#endif
+
 #ifdef NAUT_CONFIG_XEON_PHI
         udelay(1);
 #else
         idle_delay(100);
 #endif
 
-#ifdef NAUT_CONFIG_HALT_WHILE_IDLE
+#ifdef NAUT_CONFIG_RT_IDLE_CSTATES
+        rt_idle_enter();
+#elif defined(NAUT_CONFIG_MWAIT_WAKEUP)
+        idle_enter();
+#elif defined(NAUT_CONFIG_HALT_WHILE_IDLE)
         sti();
         halt();
 #endif
@@ -22,44 +22,45 @@
  */
 #include <nautilus/nautilus.h>
 #include <nautilus/printk.h>
-#include <nautilus/hashtable.h>
 #include <nautilus/naut_string.h>
 #include <nautilus/percpu.h>
 #include <nautilus/atomic.h>
 #include <nautilus/mm.h>
 #include <nautilus/libccompat.h>
 #include <nautilus/irq.h>
+#include <nautilus/cpu.h>
+#include <nautilus/thread.h>
 
 #include <nautilus/instrument.h>
 
+#define NO_INSTR __attribute__((no_instrument_function))
+
 static uint8_t instr_active = 0;
+static uint8_t instr_seen = 0;  /* set once started, shadow stacks may be live */
 static uint64_t instr_start_count = 0;
 static uint64_t instr_end_count = 0;
+static uint64_t instr_start_tsc = 0;
+static uint64_t instr_end_tsc = 0;
 
-struct func_data {
-    uint64_t call_count;
-    uint64_t avg_nsec;
-    uint64_t max_nsec;
-    uint64_t min_nsec;
-    uint64_t start_count;
-    uint64_t total_count;
-};
+extern struct nk_prof_site _prof_sites_start[];
+extern struct nk_prof_site _prof_sites_end[];
 
+#define NUM_SITES ((uint64_t)(_prof_sites_end - _prof_sites_start))
 
-static unsigned 
-instr_hash_fn(addr_t key) {
-    char * name = (char *)key;
-    return nk_hash_buffer((uint8_t *)name, strlen(name));
-}
+#ifdef NAUT_CONFIG_LOCK_PROFILE
+extern struct nk_lock_site _lock_sites_start[];
+extern struct nk_lock_site _lock_sites_end[];
 
+#define NUM_LOCK_SITES ((uint64_t)(_lock_sites_end - _lock_sites_start))
+#define LOCK_PROF_TOP  32
+#endif
 
-static int 
-instr_eq_fn (addr_t key1, addr_t key2) {
-    char * name1 = (char *)key1;
-    char * name2 = (char *)key2;
+#ifdef NAUT_CONFIG_PROFILE_FUNCTIONS
+extern char _text_start[];
+extern char _text_end[];
 
-    return (strcmp(name1, name2) == 0);
-}
+#define NUM_FUNCS ((uint64_t)(_text_end - _text_start) >> NK_PROF_FUNC_SHIFT)
+#endif
 
 
 static void 
@@ -71,78 +72,203 @@ instr_calibrate (void)
 }
 
 
+static inline NO_INSTR void
+prof_push (nk_thread_t * t, const void * key)
+{
+    uint32_t d = t->prof_depth++;
+
+    if (d < NK_PROF_SHADOW_DEPTH) {
+        t->prof_stack[d].key = key;
+        t->prof_stack[d].tsc = rdtsc();
+    }
+}
+
+
+static inline NO_INSTR void
+prof_record (struct nk_prof_slot * slot, uint64_t start)
+{
+    uint64_t time = rdtsc() - start;
+
+    slot->calls++;
+    slot->cycles += time;
+    if (time > slot->max_cycles) {
+        slot->max_cycles = time;
+    }
+}
+
+
 void 
-nk_profile_func_enter (const char  *func)
+nk_profile_site_enter (struct nk_prof_site * site)
 {
-    struct func_data * new = NULL;
-    struct timespec ts;
+    nk_thread_t * t;
 
-    if (!instr_active) {
+    if (!instr_active || !(t = get_cur_thread())) {
         return;
     }
 
-    if (!(per_cpu_get(instr_data)->func_htable)) {
+    prof_push(t, site);
+}
+
+
+/*
+ * Frames pushed while profiling was on are popped even after it is
+ * turned off, so a thread's shadow stack never goes stale.
+ */
+void 
+nk_profile_site_exit (void)
+{
+    struct nk_prof_site * site;
+    nk_thread_t * t;
+    uint32_t d;
+
+    if (!instr_seen || !(t = get_cur_thread()) || !t->prof_depth) {
         return;
     }
 
-    new = (struct func_data*)nk_htable_search(per_cpu_get(instr_data)->func_htable, (addr_t)(func));
+    d = --t->prof_depth;
 
-    if (!new) {
+    if (d >= NK_PROF_SHADOW_DEPTH || !instr_active) {
+        return;
+    }
 
-        new = malloc(sizeof(struct func_data));
-        memset(new, 0, sizeof(struct func_data));
+    site = (struct nk_prof_site *)t->prof_stack[d].key;
 
-        new->call_count  = 1;
-        new->min_nsec = ULONG_MAX;
+    if (site >= _prof_sites_start && site < _prof_sites_end && per_cpu_get(instr_data)->sites) {
+        prof_record(&per_cpu_get(instr_data)->sites[site - _prof_sites_start], t->prof_stack[d].tsc);
+    }
+}
 
-        nk_htable_insert(per_cpu_get(instr_data)->func_htable, (addr_t)func, (addr_t)new);
-    } else {
-        new->call_count++;
+
+#ifdef NAUT_CONFIG_PROFILE_FUNCTIONS
+NO_INSTR void
+__cyg_profile_func_enter (void * fn, void * site)
+{
+    nk_thread_t * t;
+
+    if (!instr_active || !(t = get_cur_thread())) {
+        return;
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    new->start_count = ts.tv_sec * 1000000000 + ts.tv_nsec;
+    prof_push(t, fn);
 }
 
 
-void 
-nk_profile_func_exit (const char *func)
+NO_INSTR void
+__cyg_profile_func_exit (void * fn, void * site)
 {
-    struct timespec te;
-    struct func_data * data = NULL;
-    uint64_t end;
-    uint64_t time;
+    nk_thread_t * t;
+    uint64_t id;
+    uint32_t d;
 
-    if (!instr_active) {
+    if (!instr_seen || !(t = get_cur_thread()) || !t->prof_depth) {
         return;
     }
 
-    if (!(per_cpu_get(instr_data)->func_htable)) {
+    d = --t->prof_depth;
+
+    if (d >= NK_PROF_SHADOW_DEPTH || !instr_active || t->prof_stack[d].key != fn) {
         return;
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &te);
+    id = ((char*)fn - _text_start) >> NK_PROF_FUNC_SHIFT;
+
+    if (id < NUM_FUNCS && per_cpu_get(instr_data)->funcs) {
+        prof_record(&per_cpu_get(instr_data)->funcs[id], t->prof_stack[d].tsc);
+    }
+}
+#endif
 
-    data = (struct func_data*)nk_htable_search(per_cpu_get(instr_data)->func_htable, (addr_t)func);
 
-    if (!data) {
+#ifdef NAUT_CONFIG_LOCK_PROFILE
+/*
+ * Called with the lock held. The held stack is shared with interrupt
+ * handlers taking locks of their own, so it is only touched with
+ * interrupts off.
+ */
+NO_INSTR void
+nk_lock_prof_acquired (volatile uint32_t * lock, struct nk_lock_site * site, uint64_t start)
+{
+    struct nk_instr_data * d;
+    struct nk_lock_slot * slot;
+    uint64_t now;
+    uint8_t flags;
+    uint32_t i;
+
+    if (!instr_active || !(d = per_cpu_get(instr_data)) || !d->locks ||
+        site < _lock_sites_start || site >= _lock_sites_end) {
         return;
-    } else {
-        end = 1000000000 * te.tv_sec + te.tv_nsec;
-        if (end < data->start_count) {
-            return;
+    }
+
+    now   = rdtsc();
+    flags = irq_disable_save();
+    slot  = &d->locks[site - _lock_sites_start];
+
+    slot->acquires++;
+    if (start) {
+        uint64_t wait = now - start;
+        slot->contended++;
+        slot->wait_cycles += wait;
+        if (wait > slot->wait_max) {
+            slot->wait_max = wait;
         }
-        time = end - data->start_count;
-        data->total_count += time;
-        if (time < data->min_nsec) {
-            data->min_nsec = time;
+    }
+
+    /* a full stack most likely holds locks released elsewhere, drop the oldest */
+    if (d->nheld == NK_LOCK_HELD_DEPTH) {
+        for (i = 1; i < NK_LOCK_HELD_DEPTH; i++) {
+            d->held[i - 1] = d->held[i];
         }
-        if (time > data->max_nsec) {
-            data->max_nsec = time;
+        d->nheld--;
+    }
+
+    d->held[d->nheld].lock = lock;
+    d->held[d->nheld].site = site;
+    d->held[d->nheld].tsc  = now;
+    d->nheld++;
+
+    irq_enable_restore(flags);
+}
+
+
+/* called just before the lock is dropped */
+NO_INSTR void
+nk_lock_prof_released (volatile uint32_t * lock)
+{
+    struct nk_instr_data * d;
+    uint8_t flags;
+    uint32_t i;
+
+    if (!instr_seen || !(d = per_cpu_get(instr_data)) || !d->nheld) {
+        return;
+    }
+
+    flags = irq_disable_save();
+
+    for (i = d->nheld; i-- > 0; ) {
+        if (d->held[i].lock != lock) {
+            continue;
         }
-        data->avg_nsec = (((data->avg_nsec * (data->call_count - 1)) + time )/ data->call_count);
+
+        if (instr_active) {
+            struct nk_lock_slot * slot = &d->locks[d->held[i].site - _lock_sites_start];
+            uint64_t hold = rdtsc() - d->held[i].tsc;
+            slot->holds++;
+            slot->hold_cycles += hold;
+            if (hold > slot->hold_max) {
+                slot->hold_max = hold;
+            }
+        }
+
+        for (; i + 1 < d->nheld; i++) {
+            d->held[i] = d->held[i + 1];
+        }
+        d->nheld--;
+        break;
     }
+
+    irq_enable_restore(flags);
 }
+#endif
 
 
 /* TODO: calibrate and subtract the overhead of instrumentation */
@@ -169,13 +295,33 @@ nk_instrument_init (void)
         this_cpu->instr_data->irqstat.min_latency    = ULONG_MAX;
         this_cpu->instr_data->thr_switch.min_latency = ULONG_MAX;
 
-        this_cpu->instr_data->func_htable = nk_create_htable(0, instr_hash_fn, instr_eq_fn);
-        if (!this_cpu->instr_data->func_htable) {
-            ERROR_PRINT("Could not create instrumentation hash table for core %u\n",
-                    i);
+        this_cpu->instr_data->sites = malloc(NUM_SITES * sizeof(struct nk_prof_slot));
+        if (!this_cpu->instr_data->sites) {
+            ERROR_PRINT("Could not allocate profiling sites for core %u\n", i);
+            spin_unlock_irq_restore(&this_cpu->lock, flags2);
+            return;
+        }
+        memset(this_cpu->instr_data->sites, 0, NUM_SITES * sizeof(struct nk_prof_slot));
+
+#ifdef NAUT_CONFIG_PROFILE_FUNCTIONS
+        this_cpu->instr_data->funcs = malloc(NUM_FUNCS * sizeof(struct nk_prof_slot));
+        if (!this_cpu->instr_data->funcs) {
+            ERROR_PRINT("Could not allocate function profile for core %u\n", i);
+            spin_unlock_irq_restore(&this_cpu->lock, flags2);
+            return;
+        }
+        memset(this_cpu->instr_data->funcs, 0, NUM_FUNCS * sizeof(struct nk_prof_slot));
+#endif
+
+#ifdef NAUT_CONFIG_LOCK_PROFILE
+        this_cpu->instr_data->locks = malloc(NUM_LOCK_SITES * sizeof(struct nk_lock_slot));
+        if (!this_cpu->instr_data->locks) {
+            ERROR_PRINT("Could not allocate lock profile for core %u\n", i);
             spin_unlock_irq_restore(&this_cpu->lock, flags2);
             return;
         }
+        memset(this_cpu->instr_data->locks, 0, NUM_LOCK_SITES * sizeof(struct nk_lock_slot));
+#endif
 
         spin_unlock_irq_restore(&this_cpu->lock, flags2);
     }
@@ -191,6 +337,8 @@ nk_instrument_start (void)
     printk("Beginning Instrumentation\n");
     clock_gettime(CLOCK_MONOTONIC, &ts);
     instr_start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+    instr_start_tsc = rdtsc();
+    instr_seen = 1;
     atomic_cmpswap(instr_active, 0, 1);
 }
 
@@ -200,6 +348,7 @@ nk_instrument_end (void)
     struct timespec te;
     clock_gettime(CLOCK_MONOTONIC, &te);
     instr_end_count = 1000000000 * te.tv_sec + te.tv_nsec;
+    instr_end_tsc = rdtsc();
     printk("Deactivating instrumentation\n");
     atomic_cmpswap(instr_active, 1, 0);
 }
@@ -257,13 +406,19 @@ void
 nk_irq_prof_enter (void)
 {
     struct irq_data * irq = NULL;
+    struct nk_instr_data * id;
     struct timespec ts;
 
     if (!instr_active) {
         return;
     }
 
-    irq = &(per_cpu_get(instr_data)->irqstat);
+    id = per_cpu_get(instr_data);
+    if (id->irq_depth++ == 0) {
+        id->irq_tsc = rdtsc();
+    }
+
+    irq = &(id->irqstat);
     irq->count++;
 
     clock_gettime(CLOCK_MONOTONIC, &ts);
@@ -276,15 +431,25 @@ void
 nk_irq_prof_exit (void)
 {
     struct irq_data * irq = NULL;
+    struct nk_instr_data * id;
     struct timespec te;
     uint64_t end;
     uint64_t time;
 
+    if (!instr_seen) {
+        return;
+    }
+
+    id = per_cpu_get(instr_data);
+    if (id->irq_depth) {
+        id->irq_depth--;
+    }
+
     if (!instr_active) {
         return;
     }
 
-    irq = &(per_cpu_get(instr_data)->irqstat);
+    irq = &(id->irqstat);
     
     clock_gettime(CLOCK_MONOTONIC, &te);
 
@@ -303,6 +468,133 @@ nk_irq_prof_exit (void)
 }
 
 
+static inline int
+prof_class (nk_thread_t * t)
+{
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    if (t->rt_thread && t->rt_thread->type < NK_PROF_CLASSES) {
+        return t->rt_thread->type;
+    }
+#endif
+    return 0;
+}
+
+
+/*
+ * Called as a thread is made runnable. If that happens inside an
+ * interrupt the thread is stamped with the interrupt's arrival, and
+ * its first switch-in records how long it took to get the CPU.
+ */
+void
+nk_prof_wakeup (nk_thread_t * t)
+{
+    struct nk_instr_data * id;
+
+    if (!instr_active) {
+        return;
+    }
+
+    id = per_cpu_get(instr_data);
+    if (id->irq_depth && !t->prof_wake_tsc) {
+        t->prof_wake_tsc = id->irq_tsc;
+    }
+}
+
+
+/* on the incoming thread, after its state has been restored */
+static void
+prof_switch_hist (void)
+{
+    struct nk_instr_data * id = per_cpu_get(instr_data);
+    nk_thread_t * t = get_cur_thread();
+    uint64_t now = rdtsc();
+    int c = prof_class(t);
+
+    if (id->switch_tsc && now > id->switch_tsc) {
+        nk_hdr_record(&id->switch_hist[c], now - id->switch_tsc);
+    }
+    id->switch_tsc = 0;
+
+    if (t->prof_wake_tsc) {
+        if (now > t->prof_wake_tsc) {
+            nk_hdr_record(&id->wake_hist[c], now - t->prof_wake_tsc);
+        }
+        t->prof_wake_tsc = 0;
+    }
+}
+
+
+static uint64_t
+hdr_bucket_top (unsigned idx)
+{
+    unsigned e, sub;
+
+    if (idx < (1 << NK_HDR_SUB_BITS)) {
+        return idx;
+    }
+
+    e   = (idx >> NK_HDR_SUB_BITS) + NK_HDR_SUB_BITS - 1;
+    sub = idx & ((1 << NK_HDR_SUB_BITS) - 1);
+
+    return ((((uint64_t)1 << NK_HDR_SUB_BITS) + sub + 1) << (e - NK_HDR_SUB_BITS)) - 1;
+}
+
+
+/*
+ * The value at or below which pct hundredths of a percent of the
+ * recorded values fall, reported as the top of its bucket.
+ */
+uint64_t
+nk_prof_percentile (nk_prof_hist_t which, int cpu, int rt_class, uint32_t pct)
+{
+    int first = cpu < 0 ? 0 : cpu;
+    int last  = cpu < 0 ? nk_get_num_cpus() - 1 : cpu;
+    uint64_t count = 0;
+    uint64_t max = 0;
+    uint64_t want, seen = 0;
+    unsigned b;
+    int i;
+
+    if (rt_class < 0 || rt_class >= NK_PROF_CLASSES || pct > 10000) {
+        return 0;
+    }
+
+    for (i = first; i <= last; i++) {
+        struct nk_instr_data * id = nk_get_nautilus_info()->sys.cpus[i]->instr_data;
+        struct nk_hdr_hist * h = which == NK_PROF_SWITCH ? &id->switch_hist[rt_class] : &id->wake_hist[rt_class];
+
+        count += h->count;
+        if (h->max > max) {
+            max = h->max;
+        }
+    }
+
+    if (!count) {
+        return 0;
+    }
+
+    want = (count * pct + 9999) / 10000;
+    if (!want) {
+        want = 1;
+    }
+
+    for (b = 0; b < NK_HDR_BUCKETS; b++) {
+        for (i = first; i <= last; i++) {
+            struct nk_instr_data * id = nk_get_nautilus_info()->sys.cpus[i]->instr_data;
+            struct nk_hdr_hist * h = which == NK_PROF_SWITCH ? &id->switch_hist[rt_class] : &id->wake_hist[rt_class];
+
+            seen += h->bucket[b];
+        }
+        if (seen >= want) {
+            uint64_t top = hdr_bucket_top(b);
+            return top < max ? top : max;
+        }
+    }
+
+    return max;
+}
+
+
 void
 nk_thr_switch_prof_enter (void)
 {
@@ -313,6 +605,8 @@ nk_thr_switch_prof_enter (void)
         return;
     }
 
+    per_cpu_get(instr_data)->switch_tsc = rdtsc();
+
     thr = &(per_cpu_get(instr_data)->thr_switch);
     thr->count++;
 
@@ -334,6 +628,8 @@ nk_thr_switch_prof_exit (void)
         return;
     }
 
+    prof_switch_hist();
+
     thr = &(per_cpu_get(instr_data)->thr_switch);
 
     if (thr->count == 0) {
@@ -357,6 +653,136 @@ nk_thr_switch_prof_exit (void)
 }
 
 
+/* sites are printed by name, functions by address for addr2line */
+static void
+prof_dump_slots (struct nk_prof_slot * slots, uint64_t n, int sites)
+{
+    uint64_t total = instr_end_tsc - instr_start_tsc;
+    uint64_t j;
+
+    if (!slots || !total) {
+        return;
+    }
+
+    for (j = 0; j < n; j++) {
+        struct nk_prof_slot * d = &slots[j];
+
+        if (!d->calls) {
+            continue;
+        }
+
+        if (sites) {
+            printk("\t%llu%% Func: %s\n", d->cycles * 100 / total, _prof_sites_start[j].name);
+        } else {
+#ifdef NAUT_CONFIG_PROFILE_FUNCTIONS
+            printk("\t%llu%% Func: %p\n", d->cycles * 100 / total,
+                   (void*)(_text_start + (j << NK_PROF_FUNC_SHIFT)));
+#endif
+        }
+        printk("\tCount: %16llu Lat - Avg: %16llucyc Max: %16llucyc\n",
+               d->calls, d->cycles / d->calls, d->max_cycles);
+    }
+}
+
+
+static void
+prof_dump_percentiles (nk_prof_hist_t which, const char * what)
+{
+    static const char * classes[NK_PROF_CLASSES] = { "APERIODIC", "SPORADIC", "PERIODIC" };
+    int c;
+
+    for (c = 0; c < NK_PROF_CLASSES; c++) {
+        if (!nk_prof_percentile(which, -1, c, 10000)) {
+            continue;
+        }
+        printk("%s (%s, cycles): p50 %llu p90 %llu p99 %llu p99.9 %llu max %llu\n",
+               what, classes[c],
+               nk_prof_percentile(which, -1, c, 5000),
+               nk_prof_percentile(which, -1, c, 9000),
+               nk_prof_percentile(which, -1, c, 9900),
+               nk_prof_percentile(which, -1, c, 9990),
+               nk_prof_percentile(which, -1, c, 10000));
+    }
+}
+
+
+#ifdef NAUT_CONFIG_LOCK_PROFILE
+/* sites merged over all cores, the ones waited on longest first */
+static void
+prof_dump_locks (void)
+{
+    struct nk_lock_slot * all;
+    uint64_t j, best;
+    int i, k;
+
+    all = malloc(NUM_LOCK_SITES * sizeof(struct nk_lock_slot));
+    if (!all) {
+        ERROR_PRINT("Could not allocate lock profile summary\n");
+        return;
+    }
+    memset(all, 0, NUM_LOCK_SITES * sizeof(struct nk_lock_slot));
+
+    for (i = 0; i < nk_get_nautilus_info()->sys.num_cpus; i++) {
+        struct nk_instr_data * d = nk_get_nautilus_info()->sys.cpus[i]->instr_data;
+
+        if (!d || !d->locks) {
+            continue;
+        }
+
+        for (j = 0; j < NUM_LOCK_SITES; j++) {
+            all[j].acquires    += d->locks[j].acquires;
+            all[j].contended   += d->locks[j].contended;
+            all[j].wait_cycles += d->locks[j].wait_cycles;
+            all[j].holds       += d->locks[j].holds;
+            all[j].hold_cycles += d->locks[j].hold_cycles;
+            if (d->locks[j].wait_max > all[j].wait_max) {
+                all[j].wait_max = d->locks[j].wait_max;
+            }
+            if (d->locks[j].hold_max > all[j].hold_max) {
+                all[j].hold_max = d->locks[j].hold_max;
+            }
+        }
+    }
+
+    printk("Lock Stats (top %u of %llu sites):\n", LOCK_PROF_TOP, NUM_LOCK_SITES);
+
+    for (k = 0; k < LOCK_PROF_TOP; k++) {
+        struct nk_lock_slot * s;
+        struct nk_lock_site * site;
+
+        best = NUM_LOCK_SITES;
+        for (j = 0; j < NUM_LOCK_SITES; j++) {
+            if (all[j].acquires &&
+                (best == NUM_LOCK_SITES ||
+                 all[j].wait_cycles > all[best].wait_cycles ||
+                 (all[j].wait_cycles == all[best].wait_cycles &&
+                  all[j].hold_cycles > all[best].hold_cycles))) {
+                best = j;
+            }
+        }
+
+        if (best == NUM_LOCK_SITES) {
+            break;
+        }
+
+        s    = &all[best];
+        site = &_lock_sites_start[best];
+
+        printk("\t%s:%llu (%s)\n", site->file, site->line, site->func);
+        printk("\tAcquires: %16llu Contended: %16llu (%llu%%)\n",
+               s->acquires, s->contended, s->contended * 100 / s->acquires);
+        printk("\tWait - Total: %16llucyc Max: %16llucyc Hold - Avg: %16llucyc Max: %16llucyc\n",
+               s->wait_cycles, s->wait_max,
+               s->holds ? s->hold_cycles / s->holds : 0, s->hold_max);
+
+        s->acquires = 0;
+    }
+
+    free(all);
+}
+#endif
+
+
 void 
 nk_instrument_query (void)
 {
@@ -368,31 +794,10 @@ nk_instrument_query (void)
 
 
         printk("Function Table Stats for Core %u:\n", i);
-        struct nk_hashtable_iter * iter = nk_create_htable_iter(this_cpu->instr_data->func_htable);
-        if (!iter) {
-            ERROR_PRINT("Could not iterate over function htable on core %u\n", i);
-            continue;
-        }
-
-        do {
-            char * func = (void*)nk_htable_get_iter_key(iter);
-            struct func_data * data = (struct func_data*)nk_htable_get_iter_value(iter);
-
-            uint64_t total_nsec = (instr_end_count - instr_start_count);
-
-            if (data->call_count > 0) {
-                printk("\t%lu.%lu\% Func: %s\n\tCount: %16u Lat - Avg: %16llunsec Max: %16llunsec Min: %16llunsec\n", 
-                        data->total_count / total_nsec,
-                        data->total_count % total_nsec,
-                        func,
-                        data->call_count,
-                        data->avg_nsec,
-                        data->max_nsec,
-                        data->min_nsec);
-            }
-
-
-        } while (nk_htable_iter_advance(iter) != 0);
+        prof_dump_slots(this_cpu->instr_data->sites, NUM_SITES, 1);
+#ifdef NAUT_CONFIG_PROFILE_FUNCTIONS
+        prof_dump_slots(this_cpu->instr_data->funcs, NUM_FUNCS, 0);
+#endif
 
         printk("Malloc Stats for Core %u:\n", i);
 
@@ -417,6 +822,12 @@ nk_instrument_query (void)
                 this_cpu->instr_data->thr_switch.min_latency);
 
     }
+
+    prof_dump_percentiles(NK_PROF_SWITCH, "Thread Switch");
+    prof_dump_percentiles(NK_PROF_IRQ_WAKE, "IRQ to Thread");
+#ifdef NAUT_CONFIG_LOCK_PROFILE
+    prof_dump_locks();
+#endif
 }
 
 
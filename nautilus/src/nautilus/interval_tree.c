@@ -0,0 +1,178 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/interval_tree.h>
+
+#define IT_ENTRY(n) rb_entry((n), struct nk_interval_node, rb)
+
+
+static void
+it_update (struct rb_node * rb, void * data)
+{
+    struct nk_interval_node * node = IT_ENTRY(rb);
+    uint64_t max = node->last;
+
+    if (rb->rb_left && IT_ENTRY(rb->rb_left)->subtree_last > max) {
+        max = IT_ENTRY(rb->rb_left)->subtree_last;
+    }
+
+    if (rb->rb_right && IT_ENTRY(rb->rb_right)->subtree_last > max) {
+        max = IT_ENTRY(rb->rb_right)->subtree_last;
+    }
+
+    node->subtree_last = max;
+}
+
+
+void
+nk_interval_tree_insert (struct nk_interval_node * node, struct rb_root_cached * root)
+{
+    struct rb_node ** link = &root->rb_root.rb_node;
+    struct rb_node * parent = NULL;
+    int leftmost = 1;
+
+    while (*link) {
+        struct nk_interval_node * p = IT_ENTRY(*link);
+
+        parent = *link;
+
+        // everything we pass ends up with node in its subtree
+        if (p->subtree_last < node->last) {
+            p->subtree_last = node->last;
+        }
+
+        if (node->start < p->start) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+            leftmost = 0;
+        }
+    }
+
+    node->subtree_last = node->last;
+    rb_link_node(&node->rb, parent, link);
+    nk_rb_insert_color_cached(&node->rb, root, leftmost);
+    nk_rb_augment_insert(&node->rb, it_update, NULL);
+}
+
+
+void
+nk_interval_tree_remove (struct nk_interval_node * node, struct rb_root_cached * root)
+{
+    struct rb_node * deepest = nk_rb_augment_erase_begin(&node->rb);
+
+    nk_rb_erase_cached(&node->rb, root);
+    nk_rb_augment_erase_end(deepest, it_update, NULL);
+}
+
+
+/*
+ * The leftmost interval in node's subtree that overlaps [start, last].
+ * A subtree whose subtree_last is below start has nothing for us, and
+ * once a node starts after last neither does anything to its right.
+ */
+static struct nk_interval_node *
+it_subtree_search (struct nk_interval_node * node, uint64_t start, uint64_t last)
+{
+    while (1) {
+        if (node->rb.rb_left) {
+            struct nk_interval_node * left = IT_ENTRY(node->rb.rb_left);
+            if (start <= left->subtree_last) {
+                node = left;
+                continue;
+            }
+        }
+
+        if (node->start <= last) {
+            if (start <= node->last) {
+                return node;
+            }
+            if (node->rb.rb_right) {
+                node = IT_ENTRY(node->rb.rb_right);
+                if (start <= node->subtree_last) {
+                    continue;
+                }
+            }
+        }
+
+        return NULL;
+    }
+}
+
+
+struct nk_interval_node *
+nk_interval_tree_iter_first (struct rb_root_cached * root, uint64_t start, uint64_t last)
+{
+    struct nk_interval_node * node;
+    struct nk_interval_node * leftmost;
+
+    if (!root->rb_root.rb_node) {
+        return NULL;
+    }
+
+    node = IT_ENTRY(root->rb_root.rb_node);
+    if (node->subtree_last < start) {
+        return NULL;
+    }
+
+    leftmost = IT_ENTRY(root->rb_leftmost);
+    if (leftmost->start > last) {
+        return NULL;
+    }
+
+    return it_subtree_search(node, start, last);
+}
+
+
+struct nk_interval_node *
+nk_interval_tree_iter_next (struct nk_interval_node * node, uint64_t start, uint64_t last)
+{
+    struct rb_node * rb = node->rb.rb_right;
+    struct rb_node * prev;
+
+    while (1) {
+        // the rest of our right subtree, if anything in it can overlap
+        if (rb) {
+            struct nk_interval_node * right = IT_ENTRY(rb);
+            if (start <= right->subtree_last) {
+                return it_subtree_search(right, start, last);
+            }
+        }
+
+        // up to the first ancestor we are to the left of
+        do {
+            rb = rb_parent(&node->rb);
+            if (!rb) {
+                return NULL;
+            }
+            prev = &node->rb;
+            node = IT_ENTRY(rb);
+            rb = node->rb.rb_right;
+        } while (prev == rb);
+
+        if (last < node->start) {
+            return NULL;
+        }
+
+        if (start <= node->last) {
+            return node;
+        }
+    }
+}
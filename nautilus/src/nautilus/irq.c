@@ -25,6 +25,23 @@
 #include <nautilus/irq.h>
 #include <nautilus/cpu.h>
 #include <nautilus/mm.h>
+#include <nautilus/smp.h>
+#include <nautilus/cpumask.h>
+#include <nautilus/spinlock.h>
+#include <dev/ioapic.h>
+
+#ifdef NAUT_CONFIG_THREADED_IRQS
+#include <nautilus/thread.h>
+#include <nautilus/atomic.h>
+#include <nautilus/percpu.h>
+#include <dev/timer.h>
+#ifdef NAUT_CONFIG_RT_CBS
+#include <nautilus/rt_scheduler.h>
+#endif
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+#include <nautilus/housekeeping.h>
+#endif
+#endif
 
 
 /* NOTE: the APIC organizes interrupt priorities as follows:
@@ -103,6 +120,111 @@ nk_irq_is_assigned (uint8_t irq)
 }
 
 
+/*
+ * nk_irq_set_affinity
+ *
+ * steer an external IRQ to a CPU by rewriting the destination of
+ * its IOAPIC redirection entry. An interrupt already in flight may
+ * still land on the old CPU.
+ *
+ * returns -1 on error, 0 on success
+ *
+ */
+int
+nk_irq_set_affinity (uint8_t irq, int cpu)
+{
+    struct sys_info * sys = &(nk_get_nautilus_info()->sys);
+    uint32_t apic_id;
+
+    if (!nk_irq_is_assigned(irq)) {
+        ERROR_PRINT("Attempt to set affinity of unassigned IRQ %u\n", irq);
+        return -1;
+    }
+
+    if (cpu < 0 || cpu >= sys->num_cpus) {
+        ERROR_PRINT("Attempt to steer IRQ %u to invalid CPU %d\n", irq, cpu);
+        return -1;
+    }
+
+    apic_id = sys->cpus[cpu]->lapic_id;
+
+    /* IOAPIC destinations are 8 bits without interrupt remapping */
+    if (apic_id > 0xff) {
+        ERROR_PRINT("Cannot steer IRQ %u to CPU %d (APIC ID 0x%x)\n", irq, cpu, apic_id);
+        return -1;
+    }
+
+    ioapic_set_irq_dest(sys->int_info.irq_map[irq].ioapic, irq, apic_id);
+
+    return 0;
+}
+
+
+/*
+ * nk_irq_get_affinity
+ *
+ * returns the CPU an IRQ is currently delivered to, or -1 
+ *
+ */
+int
+nk_irq_get_affinity (uint8_t irq)
+{
+    struct sys_info * sys = &(nk_get_nautilus_info()->sys);
+    uint8_t cpu;
+
+    if (!nk_irq_is_assigned(irq)) {
+        return -1;
+    }
+
+    cpu = nk_get_cpu_by_lapicid(ioapic_get_irq_dest(sys->int_info.irq_map[irq].ioapic, irq));
+
+    return (cpu == 0xff) ? -1 : cpu;
+}
+
+
+/* 
+ * nk_irq_steer_all
+ *
+ * spread every assigned IRQ round robin over a set of housekeeping
+ * CPUs, so that the other cores (e.g. the ones running RT threads)
+ * never see a device interrupt
+ *
+ * returns -1 on error, 0 on success
+ *
+ */
+int
+nk_irq_steer_all (struct nk_cpumask * cpus)
+{
+    uint32_t cpu;
+    int irq;
+
+    if (!nk_cpumask_count(cpus)) {
+        ERROR_PRINT("No housekeeping CPUs to steer IRQs to\n");
+        return -1;
+    }
+
+    cpu = nk_cpumask_next(cpus, 0);
+
+    for (irq = 0; irq < 256; irq++) {
+
+        if (!nk_irq_is_assigned(irq)) {
+            continue;
+        }
+
+        if (nk_irq_set_affinity(irq, cpu) != 0) {
+            return -1;
+        }
+
+        cpu = nk_cpumask_next(cpus, cpu + 1);
+        if (cpu >= NAUT_CONFIG_MAX_CPUS) {
+            cpu = nk_cpumask_next(cpus, 0);
+        }
+    }
+
+    return 0;
+}
+
+
 /* 
  * this should only be used when the OS interrupt vector
  * is known ahead of time, that is, *not* in the case
@@ -131,6 +253,109 @@ register_int_handler (uint16_t int_vec,
 }
 
 
+/* 
+ * vectors for message-signaled interrupts come from here. We stay
+ * below the range the IOAPIC IRQs count down through and away from
+ * the fixed vectors at the bottom, and take only vectors that still
+ * have the null handler
+ */
+#define INT_VEC_DYN_FIRST 0x50
+#define INT_VEC_DYN_LAST  0xbf
+
+extern ulong_t handler_table[NUM_IDT_ENTRIES];
+
+static spinlock_t int_vec_lock;
+
+static int
+unclaimed_vec_handler (excp_entry_t * excp, excp_vec_t vector)
+{
+    WARN_PRINT("Interrupt on reserved vector 0x%x before its handler was registered\n", vector);
+    IRQ_HANDLER_END();
+    return 0;
+}
+
+
+static int
+int_vec_free (uint16_t vec)
+{
+    struct nk_int_info * info = &(nk_get_nautilus_info()->sys.int_info);
+    int i;
+
+    if (handler_table[vec] != (ulong_t)null_irq_handler) {
+        return 0;
+    }
+
+    for (i = 0; i < 256; i++) {
+        if (info->irq_map[i].assigned && info->irq_map[i].vector == vec) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+/*
+ * nk_int_vec_reserve
+ *
+ * reserve n consecutive unused vectors, aligned to n when asked 
+ * (multiple-message MSI needs a power of two, aligned). The vectors 
+ * are routed to a warning until register_int_handler claims them.
+ *
+ * returns -1 on error, 0 on success
+ *
+ */
+int
+nk_int_vec_reserve (uint16_t n, int aligned, uint8_t * first)
+{
+    uint16_t start, i;
+    uint16_t step = aligned ? n : 1;
+    uint8_t flags;
+
+    if (!n || (aligned && (n & (n - 1)))) {
+        ERROR_PRINT("Invalid vector reservation (n=%u, aligned=%d)\n", n, aligned);
+        return -1;
+    }
+
+    flags = spin_lock_irq_save(&int_vec_lock);
+
+    start = (INT_VEC_DYN_FIRST + step - 1) & ~(step - 1);
+
+    for (; start + n - 1 <= INT_VEC_DYN_LAST; start += step) {
+        for (i = 0; i < n && int_vec_free(start + i); i++) {
+        }
+        if (i == n) {
+            for (i = 0; i < n; i++) {
+                idt_assign_entry(start + i, (ulong_t)unclaimed_vec_handler);
+            }
+            spin_unlock_irq_restore(&int_vec_lock, flags);
+            *first = start;
+            return 0;
+        }
+    }
+
+    spin_unlock_irq_restore(&int_vec_lock, flags);
+
+    ERROR_PRINT("Out of interrupt vectors (wanted %u)\n", n);
+
+    return -1;
+}
+
+
+void
+nk_int_vec_release (uint8_t first, uint16_t n)
+{
+    uint8_t flags = spin_lock_irq_save(&int_vec_lock);
+    uint16_t i;
+
+    for (i = 0; i < n; i++) {
+        idt_assign_entry(first + i, (ulong_t)null_irq_handler);
+    }
+
+    spin_unlock_irq_restore(&int_vec_lock, flags);
+}
+
+
 int 
 register_irq_handler (uint16_t irq, 
                       int (*handler)(excp_entry_t *, excp_vec_t),
@@ -156,6 +381,232 @@ register_irq_handler (uint16_t irq,
 }
 
 
+#ifdef NAUT_CONFIG_THREADED_IRQS
+struct irq_thread {
+    uint16_t            irq;
+    nk_irq_ack_t        ack;
+    nk_irq_work_t       work;
+    void *              priv_data;
+    uint64_t            coalesce_ns;
+
+    volatile uint32_t   pending; /* the top half has work for the thread */
+    volatile uint32_t   window;  /* a coalescing timer is armed */
+    nk_thread_queue_t * waitq;   /* NULL until the thread is up */
+
+    uint64_t            num_irqs;
+    uint64_t            num_runs;
+};
+
+/* static, since serial registers before there is an allocator */
+static struct irq_thread irq_threads[MAX_IRQ_NUM + 1];
+static struct irq_thread * irq_thread_by_vec[256];
+
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+#define IRQ_THREAD_CPU nk_housekeeping_cpu()
+#else
+#define IRQ_THREAD_CPU my_cpu_id()
+#endif
+
+
+static inline void
+irq_thread_kick (struct irq_thread * it)
+{
+    nk_thread_queue_wake_word(it->waitq, 0);
+}
+
+
+static void
+irq_window_end (void * arg)
+{
+    struct irq_thread * it = (struct irq_thread*)arg;
+
+    it->window = 0;
+    irq_thread_kick(it);
+}
+
+
+static int
+threaded_irq_entry (excp_entry_t * excp, excp_vec_t vec)
+{
+    struct irq_thread * it = irq_thread_by_vec[vec];
+
+    it->num_irqs++;
+
+    if (it->ack) {
+        it->ack(it->priv_data);
+    }
+
+    IRQ_HANDLER_END();
+
+    if (!it->waitq) {
+        /* early in boot, no thread yet */
+        it->work(it->priv_data);
+        return 0;
+    }
+
+    it->pending = 1;
+
+    if (!it->coalesce_ns) {
+        irq_thread_kick(it);
+        return 0;
+    }
+
+    /* 
+     * the first interrupt in a window arms the timer, and the rest
+     * ride along. The cmpswap also orders the store to pending
+     * against whoever ends the window.
+     */
+    if (atomic_cmpswap(it->window, 0, 1) == 0) {
+        if (nk_timer_callback_arm(it->coalesce_ns, irq_window_end, it) < 0) {
+            it->window = 0;
+            irq_thread_kick(it);
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+irq_thread_func (void * in, void ** out)
+{
+    struct irq_thread * it = (struct irq_thread*)in;
+
+#ifdef NAUT_CONFIG_RT_CBS
+    /* bound the CPU time device work can take from RT threads */
+    rt_server * server = rt_server_create(NAUT_CONFIG_THREADED_IRQS_BUDGET,
+                                          NAUT_CONFIG_THREADED_IRQS_PERIOD);
+
+    if (!server) {
+        ERROR_PRINT("IRQ %u thread is running without a reservation\n", it->irq);
+    } else if (rt_server_attach(server, get_cur_thread()->rt_thread) != 0) {
+        ERROR_PRINT("IRQ %u thread is running without a reservation\n", it->irq);
+        rt_server_destroy(server);
+    }
+#endif
+
+    while (1) {
+        nk_thread_queue_wait_word(it->waitq, &it->pending, 0);
+
+        if (atomic_and(it->pending, 0)) {
+            it->num_runs++;
+            it->work(it->priv_data);
+        }
+    }
+}
+
+
+/*
+ * register_threaded_irq_handler
+ *
+ * like register_irq_handler, but only ack runs in interrupt 
+ * context. ack may be NULL if reading the device can wait.
+ * coalesce_ns of 0 wakes the thread on every interrupt.
+ *
+ */
+int
+register_threaded_irq_handler (uint16_t irq,
+                               nk_irq_ack_t ack,
+                               nk_irq_work_t work,
+                               void * priv_data,
+                               uint64_t coalesce_ns)
+{
+    struct irq_thread * it;
+    uint8_t int_vector;
+
+    if (!work) {
+        ERROR_PRINT("Attempt to register threaded IRQ %d with invalid handler\n", irq);
+        return -1;
+    }
+
+    if (irq > MAX_IRQ_NUM) {
+        ERROR_PRINT("Attempt to register invalid IRQ (0x%x)\n", irq);
+        return -1;
+    }
+
+    it = &irq_threads[irq];
+
+    if (it->work) {
+        ERROR_PRINT("IRQ %d already has a threaded handler\n", irq);
+        return -1;
+    }
+
+    int_vector = irq_to_vec(irq);
+
+    it->irq         = irq;
+    it->ack         = ack;
+    it->work        = work;
+    it->priv_data   = priv_data;
+    it->coalesce_ns = coalesce_ns;
+
+    irq_thread_by_vec[int_vector] = it;
+
+    idt_assign_entry(int_vector, (ulong_t)threaded_irq_entry);
+
+    return 0;
+}
+
+
+/*
+ * nk_irq_threads_start
+ *
+ * start a kernel thread for every threaded IRQ registered so far,
+ * on this CPU. Called once the scheduler is up.
+ *
+ */
+int
+nk_irq_threads_start (void)
+{
+    struct irq_thread * it;
+    nk_thread_queue_t * q;
+    int i;
+
+    for (i = 0; i <= MAX_IRQ_NUM; i++) {
+
+        it = &irq_threads[i];
+
+        if (!it->work || it->waitq) {
+            continue;
+        }
+
+        q = nk_thread_queue_create();
+        if (!q) {
+            ERROR_PRINT("Could not create wait queue for IRQ %d thread\n", i);
+            return -1;
+        }
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+        rt_constraints * c = (rt_constraints*)malloc(sizeof(rt_constraints));
+        if (!c) {
+            ERROR_PRINT("Could not allocate constraints for IRQ %d thread\n", i);
+            nk_thread_queue_destroy(q);
+            return -1;
+        }
+        c->aperiodic.priority = 0;
+#endif
+
+        it->waitq = q;
+
+        /* the top half may see waitq before the thread runs, 
+           which is fine since pending is checked first */
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+        if (nk_thread_start(irq_thread_func, it, NULL, 1, TSTACK_DEFAULT, NULL, IRQ_THREAD_CPU,
+                            APERIODIC, c, 0) != 0) {
+#else
+        if (nk_thread_start(irq_thread_func, it, NULL, 1, TSTACK_DEFAULT, NULL, IRQ_THREAD_CPU) != 0) {
+#endif
+            ERROR_PRINT("Could not start thread for IRQ %d\n", i);
+            it->waitq = NULL;
+            nk_thread_queue_destroy(q);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+
 void 
 disable_8259pic (void)
 {
@@ -270,6 +721,8 @@ nk_int_init (struct sys_info * sys)
     INIT_LIST_HEAD(&(info->int_list));
     INIT_LIST_HEAD(&(info->bus_list));
 
+    spinlock_init(&int_vec_lock);
+
     return 0;
 }
 
@@ -145,11 +145,7 @@ vfprintf (FILE * stream, const char * format, va_list arg)
 
 int 
 rand (void) {
-    int r;
-
-    nk_get_rand_bytes((uint8_t*)&r, 4);
-
-    return RAND_MAX / r;
+    return (int)(nk_get_rand_u64() >> 33);
 }
 
 void 
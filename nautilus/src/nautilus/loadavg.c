@@ -0,0 +1,157 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/percpu.h>
+#include <nautilus/loadavg.h>
+
+#define LOAD_DECAY NAUT_CONFIG_LOAD_AVG_DECAY_SHIFT
+
+/* past this many missed intervals the old average is gone anyway */
+#define LOAD_MAX_STEPS 4096
+
+/*
+ * x86 keeps stores in order and loads in order, so the sequence count
+ * only needs the compiler kept from moving accesses across it.
+ */
+#define load_barrier() asm volatile("" ::: "memory")
+
+/*
+ * One line per core. The owner is the only writer: it makes seq odd,
+ * updates the averages and makes seq even again. A reader that sees
+ * the same even seq before and after copying has a consistent copy.
+ */
+struct load_slot {
+    volatile uint64_t seq;
+    struct nk_load load;
+    uint64_t interval;      /* cycles, owner only */
+    uint64_t next;          /* when the next sample is due, owner only */
+} __attribute__((aligned(64)));
+
+static struct load_slot load_slots[NAUT_CONFIG_MAX_CPUS];
+
+
+int
+nk_load_due (void)
+{
+    return rdtsc() >= load_slots[my_cpu_id()].next;
+}
+
+
+/* avg moved toward sample, by what is left of keep out of NK_LOAD_ONE */
+static inline uint64_t
+load_fold (uint64_t avg, uint64_t sample, uint64_t keep)
+{
+    return (avg * keep + sample * (NK_LOAD_ONE - keep)) >> NK_LOAD_SHIFT;
+}
+
+
+void
+nk_load_sample (uint64_t runnable, uint64_t rt_util, int idle)
+{
+    struct load_slot * s = &load_slots[my_cpu_id()];
+    uint64_t now = rdtsc();
+    uint64_t keep = NK_LOAD_ONE;
+    uint64_t steps, i;
+
+    if (!s->interval) {
+        uint64_t khz = per_cpu_get(cpu_khz);
+
+        /* not calibrated, assume a fast clock so the interval comes out long */
+        s->interval = ((khz ? khz : 4000000) * NAUT_CONFIG_LOAD_AVG_INTERVAL_US) / 1000;
+        if (!s->interval) {
+            s->interval = 1;
+        }
+    }
+
+    /*
+     * One decay step per interval since the last sample: a core that
+     * went quiet for a while has its sample stand for all of it.
+     */
+    steps = s->load.stamp ? (now - s->load.stamp) / s->interval : LOAD_MAX_STEPS;
+    if (!steps) {
+        steps = 1;
+    }
+    if (steps >= LOAD_MAX_STEPS) {
+        keep = 0;
+    }
+    for (i = 0; i < steps && keep; i++) {
+        keep -= keep >> LOAD_DECAY;
+    }
+
+    s->seq++;
+    load_barrier();
+    s->load.runnable = load_fold(s->load.runnable, runnable << NK_LOAD_SHIFT, keep);
+    s->load.rt_util = load_fold(s->load.rt_util, rt_util, keep);
+    s->load.idle = load_fold(s->load.idle, idle ? NK_LOAD_ONE : 0, keep);
+    s->load.stamp = now;
+    load_barrier();
+    s->seq++;
+
+    s->next = now + s->interval;
+}
+
+
+int
+nk_load_read (int cpu, struct nk_load * load)
+{
+    struct load_slot * s;
+    uint64_t seq;
+
+    if (cpu < 0 || cpu >= NAUT_CONFIG_MAX_CPUS) {
+        return -1;
+    }
+    s = &load_slots[cpu];
+
+    do {
+        while ((seq = s->seq) & 1) {
+            asm volatile ("pause");
+        }
+        load_barrier();
+        *load = s->load;
+        load_barrier();
+    } while (s->seq != seq);
+
+    return load->stamp ? 0 : -1;
+}
+
+
+void
+nk_load_dump (void)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    struct nk_load l;
+    uint64_t now = rdtsc();
+    int i;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        if (nk_load_read(i, &l)) {
+            printk("CPU %d: no samples\n", i);
+            continue;
+        }
+        printk("CPU %d: runnable %llu.%02llu rt_util %llu.%03llu%% idle %llu%% (%llu cycles ago)\n",
+               i,
+               l.runnable >> NK_LOAD_SHIFT,
+               ((l.runnable & (NK_LOAD_ONE - 1)) * 100) >> NK_LOAD_SHIFT,
+               l.rt_util / 1000, l.rt_util % 1000,
+               (l.idle * 100) >> NK_LOAD_SHIFT,
+               now - l.stamp);
+    }
+}
@@ -0,0 +1,267 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/mm.h>
+#include <nautilus/arena.h>
+#include <nautilus/thread.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/math.h>
+#include <nautilus/naut_string.h>
+
+#ifndef NAUT_CONFIG_DEBUG_KMEM
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ARENA_DEBUG(fmt, args...) DEBUG_PRINT("ARENA: " fmt, ##args)
+#define ARENA_ERROR(fmt, args...) ERROR_PRINT("ARENA: " fmt, ##args)
+
+/*
+ * Requests bigger than this fraction of the chunk size get a chunk
+ * of their own, so they do not waste the tail of the current one.
+ */
+#define ARENA_BIG_SHIFT 2
+
+struct nk_arena_chunk {
+    struct nk_arena_chunk * next;
+    size_t size;                    /* including this header */
+} __attribute__((aligned(NK_ARENA_ALIGN)));
+
+#define CHUNK_DATA(c) ((char*)(c) + sizeof(struct nk_arena_chunk))
+
+static nk_tls_key_t arena_key;
+static int          arena_key_valid = 0;
+static spinlock_t   arena_key_lock = 0;
+
+
+static struct nk_arena_chunk *
+chunk_alloc (size_t size)
+{
+    struct nk_arena_chunk * c = malloc(size);
+
+    if (!c) {
+        ARENA_ERROR("Could not allocate chunk of %lu bytes\n", size);
+        return NULL;
+    }
+
+    c->next = NULL;
+    c->size = size;
+
+    return c;
+}
+
+
+/*
+ * nk_arena_create
+ *
+ * @chunk_size: bytes taken from the buddy system at a time,
+ *              rounded up to a power of two. 0 means the default
+ *
+ * returns the new arena, or NULL on failure. No memory is taken
+ * until the first allocation.
+ *
+ */
+nk_arena_t *
+nk_arena_create (size_t chunk_size)
+{
+    nk_arena_t * arena = NULL;
+
+    if (!chunk_size) {
+        chunk_size = NK_ARENA_DEFAULT_CHUNK;
+    }
+
+    if (chunk_size < 2 * sizeof(struct nk_arena_chunk)) {
+        chunk_size = 2 * sizeof(struct nk_arena_chunk);
+    }
+
+    arena = malloc(sizeof(nk_arena_t));
+    if (!arena) {
+        ARENA_ERROR("Could not allocate arena\n");
+        return NULL;
+    }
+    memset(arena, 0, sizeof(nk_arena_t));
+
+    arena->chunk_size = roundup_pow_of_two(chunk_size);
+
+    return arena;
+}
+
+
+/*
+ * nk_arena_alloc_slow
+ *
+ * called by nk_arena_alloc() when the current chunk is full. 
+ * size is already rounded to NK_ARENA_ALIGN
+ *
+ */
+void *
+nk_arena_alloc_slow (nk_arena_t * arena, size_t size)
+{
+    struct nk_arena_chunk * c = NULL;
+
+    if (size > (arena->chunk_size >> ARENA_BIG_SHIFT)) {
+        /* a chunk to itself, kept behind the current one */
+        c = chunk_alloc(sizeof(struct nk_arena_chunk) + size);
+        if (!c) {
+            return NULL;
+        }
+
+        if (arena->chunks) {
+            c->next = arena->chunks->next;
+            arena->chunks->next = c;
+        } else {
+            arena->chunks = c;
+        }
+
+        arena->num_chunks++;
+        arena->bytes_allocated += size;
+
+        return CHUNK_DATA(c);
+    }
+
+    c = chunk_alloc(arena->chunk_size);
+    if (!c) {
+        return NULL;
+    }
+
+    c->next       = arena->chunks;
+    arena->chunks = c;
+    arena->num_chunks++;
+
+    arena->cur = CHUNK_DATA(c) + size;
+    arena->end = (char*)c + arena->chunk_size;
+    arena->bytes_allocated += size;
+
+    ARENA_DEBUG("Arena %p grew to %lu chunks\n", arena, arena->num_chunks);
+
+    return CHUNK_DATA(c);
+}
+
+
+/*
+ * nk_arena_reset
+ *
+ * release everything allocated from the arena. One chunk is kept
+ * so the next phase does not go back to the buddy system right away
+ *
+ */
+void
+nk_arena_reset (nk_arena_t * arena)
+{
+    struct nk_arena_chunk * c = arena->chunks;
+    struct nk_arena_chunk * keep = NULL;
+
+    while (c) {
+        struct nk_arena_chunk * next = c->next;
+
+        if (!keep && c->size == arena->chunk_size) {
+            keep = c;
+            keep->next = NULL;
+        } else {
+            free(c);
+        }
+
+        c = next;
+    }
+
+    arena->chunks          = keep;
+    arena->num_chunks      = keep ? 1 : 0;
+    arena->bytes_allocated = 0;
+
+    if (keep) {
+        arena->cur = CHUNK_DATA(keep);
+        arena->end = (char*)keep + arena->chunk_size;
+    } else {
+        arena->cur = arena->end = NULL;
+    }
+}
+
+
+void
+nk_arena_destroy (nk_arena_t * arena)
+{
+    struct nk_arena_chunk * c = NULL;
+
+    if (!arena) {
+        return;
+    }
+
+    c = arena->chunks;
+    while (c) {
+        struct nk_arena_chunk * next = c->next;
+        free(c);
+        c = next;
+    }
+
+    free(arena);
+}
+
+
+static void
+arena_thread_destroy (void * arena)
+{
+    nk_arena_destroy((nk_arena_t*)arena);
+}
+
+
+/*
+ * nk_arena_thread
+ *
+ * returns the calling thread's own arena, making it on first use.
+ * It lives until the thread exits
+ *
+ */
+nk_arena_t *
+nk_arena_thread (void)
+{
+    nk_arena_t * arena = NULL;
+
+    if (!arena_key_valid) {
+        uint8_t flags = spin_lock_irq_save(&arena_key_lock);
+        if (!arena_key_valid) {
+            if (nk_tls_key_create(&arena_key, arena_thread_destroy) != 0) {
+                spin_unlock_irq_restore(&arena_key_lock, flags);
+                ARENA_ERROR("Could not create arena TLS key\n");
+                return NULL;
+            }
+            __sync_synchronize();
+            arena_key_valid = 1;
+        }
+        spin_unlock_irq_restore(&arena_key_lock, flags);
+    }
+
+    arena = nk_tls_get(arena_key);
+    if (arena) {
+        return arena;
+    }
+
+    arena = nk_arena_create(0);
+    if (!arena) {
+        return NULL;
+    }
+
+    if (nk_tls_set(arena_key, arena) != 0) {
+        ARENA_ERROR("Could not set thread arena\n");
+        nk_arena_destroy(arena);
+        return NULL;
+    }
+
+    return arena;
+}
@@ -28,6 +28,13 @@
 #include <nautilus/multiboot2.h>
 #include <nautilus/macros.h>
 #include <lib/bitmap.h>
+#ifdef NAUT_CONFIG_KMEM_PARALLEL_INIT
+#include <nautilus/buddy.h>
+#include <nautilus/numa.h>
+#include <nautilus/smp.h>
+#include <nautilus/atomic.h>
+#include <nautilus/percpu.h>
+#endif
 
 #define CACHE_LINE_SIZE_DEFAULT 64
 
@@ -437,7 +444,14 @@ add_free_pages (struct mem_region * region)
             for (m = 1; m && i < end_pfn; m <<= 1, addr += PAGE_SIZE, i++) {
                 if (v & m) {
                     ++count;
+#ifdef NAUT_CONFIG_KMEM_PARALLEL_INIT
+                    /* other cores may already be allocating from this zone */
+                    uint8_t flags = buddy_lock_irq_save(region->mm_state);
+                    kmem_add_memory(region, addr, PAGE_SIZE);
+                    buddy_unlock_irq_restore(region->mm_state, flags);
+#else
                     kmem_add_memory(region, addr, PAGE_SIZE);
+#endif
                 }
             }
         } else {
@@ -468,6 +482,14 @@ mm_boot_kmem_init (void)
     for (i = 0; i < loc->num_domains; i++) {
         struct mem_region * region = NULL;
         unsigned j = 0;
+#ifdef NAUT_CONFIG_KMEM_PARALLEL_INIT
+        /* the other domains are handed over by their own cores, see
+         * mm_boot_kmem_init_remote() */
+        if (loc->domains[i] != nk_get_nautilus_info()->sys.cpus[0]->domain) {
+            BMM_PRINT("    [Domain %02u] deferred\n", i);
+            continue;
+        }
+#endif
         list_for_each_entry(region, &(loc->domains[i]->regions), entry) {
             ulong_t added = add_free_pages(region);
             BMM_PRINT("    [Domain %02u : Region %02u] (%0lu.%02lu MB)\n", 
@@ -489,6 +511,76 @@ mm_boot_kmem_init (void)
     BMM_PRINT("    [TOTAL] (%lu.%lu MB)\n", count/1000000, count%1000000);
 }
 
+#ifdef NAUT_CONFIG_KMEM_PARALLEL_INIT
+static volatile unsigned remote_pending = 0;
+
+static void
+add_domain_pages (void * arg)
+{
+    struct numa_domain * dom = (struct numa_domain*)arg;
+    struct mem_region * region = NULL;
+    ulong_t added = 0;
+
+    list_for_each_entry(region, &dom->regions, entry) {
+        added += add_free_pages(region);
+    }
+
+    BMM_PRINT("    [Domain %02u] (%0lu.%02lu MB) on core %u\n", 
+            dom->id,
+            added / 1000000,
+            added % 1000000,
+            my_cpu_id());
+
+    atomic_dec(remote_pending);
+}
+
+
+/*
+ * Hands the free pages of every domain but the BSP's to the kernel
+ * memory pool. Each domain is done by one of its own cores, in
+ * parallel, so the buddy metadata is written from local memory.
+ * Domains without a core are done here. Called once the APs are up;
+ * the boot page map is released when all are done.
+ */
+void
+mm_boot_kmem_init_remote (void)
+{
+    struct sys_info * sys = &(nk_get_nautilus_info()->sys);
+    struct nk_locality_info * loc = &(sys->locality_info);
+    unsigned i, c;
+
+    BMM_PRINT("Adding remote memory regions to the kernel memory pool:\n");
+
+    for (i = 0; i < loc->num_domains; i++) {
+        struct numa_domain * dom = loc->domains[i];
+
+        if (dom == sys->cpus[0]->domain) {
+            continue;
+        }
+
+        for (c = 1; c < sys->num_cpus; c++) {
+            if (sys->cpus[c]->domain == dom) {
+                break;
+            }
+        }
+
+        atomic_inc(remote_pending);
+
+        if (c == sys->num_cpus || smp_xcall(c, add_domain_pages, dom, 0) != 0) {
+            add_domain_pages(dom);
+        }
+    }
+
+    BARRIER_WHILE(remote_pending != 0);
+
+    BMM_PRINT("    [Boot alloc. page map] (%0lu.%02lu MB)\n", bootmem.pm_len/1000000, bootmem.pm_len%1000000);
+    kmem_add_memory(kmem_get_region_by_addr(va_to_pa((ulong_t)bootmem.page_map)),
+            va_to_pa((ulong_t)bootmem.page_map), 
+            bootmem.pm_len);
+}
+#endif
+
+
 void 
 mm_boot_kmem_cleanup (void)
 {
@@ -496,12 +588,15 @@ mm_boot_kmem_cleanup (void)
 
     BMM_PRINT("Reclaiming boot sections and data:\n");
 
+#ifndef NAUT_CONFIG_KMEM_PARALLEL_INIT
+    /* otherwise still needed for the remote domains */
     BMM_PRINT("    [Boot alloc. page map] (%0lu.%02lu MB)\n", bootmem.pm_len/1000000, bootmem.pm_len%1000000);
     kmem_add_memory(kmem_get_region_by_addr(va_to_pa((ulong_t)bootmem.page_map)),
             va_to_pa((ulong_t)bootmem.page_map), 
             bootmem.pm_len);
 
     count += bootmem.pm_len;
+#endif
 
     BMM_PRINT("    [Boot page tables and stack]     (%0lu.%02u MB)\n", PAGE_SIZE_4KB*3/1000000, PAGE_SIZE_4KB%1000000);
     kmem_add_memory(kmem_get_region_by_addr(va_to_pa((ulong_t)&pml4)), 
@@ -107,25 +107,6 @@ __clear_bit (ulong_t nr, volatile void * addr)
 }
 #endif
 
-static inline void setb(ulong_t nr, volatile char *addr)
-{
-    ulong_t offset, bitoffset;
-    offset = nr/8;
-    bitoffset = nr % 8;
-
-    addr[offset] |= (0x1UL << offset);
-
-}
-
-static inline void clearb(ulong_t nr, volatile char *addr)
-{
-    ulong_t offset, bitoffset;
-    offset = nr/8;
-    bitoffset = nr % 8;
-
-    addr[offset] &= ~(0x1UL << offset);
-
-}
 /**
  * Converts a block address to its block index in the specified buddy allocator.
  * A block's index is used to find the block's tag bit, mp->tag_bits[block_id].
@@ -168,7 +149,13 @@ mark_available (struct buddy_mempool *mp, struct block *block)
 	BUDDY_DEBUG("Magic block %p: block_to_id=%lu\n", block, block_to_id(mp,block));
     }
 
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+    /* neighbouring bits may belong to blocks on other lists */
+    ulong_t id = block_to_id(mp, block);
+    __sync_fetch_and_or(&mp->tag_bits[id / BITS_PER_LONG], 1UL << (id % BITS_PER_LONG));
+#else
     __set_bit(block_to_id(mp, block), (volatile char*)mp->tag_bits);
+#endif
 }
 
 
@@ -178,10 +165,58 @@ mark_available (struct buddy_mempool *mp, struct block *block)
 static inline void
 mark_allocated (struct buddy_mempool *mp, struct block *block)
 {
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+    ulong_t id = block_to_id(mp, block);
+    __sync_fetch_and_and(&mp->tag_bits[id / BITS_PER_LONG], ~(1UL << (id % BITS_PER_LONG)));
+#else
     __clear_bit(block_to_id(mp, block), (volatile char *)mp->tag_bits);
+#endif
+}
+
+
+/*
+ * Free list helpers. They keep avail_map in step with the lists, so
+ * an allocation can find the smallest non-empty list with one bit
+ * scan instead of walking the empty ones.
+ */
+static inline void
+avail_push (struct buddy_mempool *mp, struct block *block, ulong_t order)
+{
+    block->order = order;
+    mark_available(mp, block);
+    list_add(&block->link, &mp->avail[order]);
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+    __sync_fetch_and_or(&mp->avail_map, 1UL << order);
+#else
+    mp->avail_map |= 1UL << order;
+#endif
+}
+
+
+static inline void
+avail_remove (struct buddy_mempool *mp, struct block *block, ulong_t order)
+{
+    list_del(&block->link);
+    mark_allocated(mp, block);
+    if (list_empty(&mp->avail[order])) {
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+        __sync_fetch_and_and(&mp->avail_map, ~(1UL << order));
+#else
+        mp->avail_map &= ~(1UL << order);
+#endif
+    }
 }
 
 
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+#define ORDER_LOCK(mp, o)   spin_lock(&(mp)->order_locks[o])
+#define ORDER_UNLOCK(mp, o) spin_unlock(&(mp)->order_locks[o])
+#else
+#define ORDER_LOCK(mp, o)
+#define ORDER_UNLOCK(mp, o)
+#endif
+
+
 /**
  * Returns true if block is free, false if it is allocated.
  */
@@ -260,6 +295,19 @@ buddy_init (ulong_t base_addr,
         INIT_LIST_HEAD(&mp->avail[i]);
     }
 
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+    mp->order_locks = mm_boot_alloc((pool_order + 1) * sizeof(spinlock_t));
+
+    if (!mp->order_locks) {
+	ERROR_PRINT("Cannot allocate order locks\n");
+	return NULL;
+    }
+
+    for (i = 0; i <= pool_order; i++) {
+        spinlock_init(&mp->order_locks[i]);
+    }
+#endif
+
     /* Allocate a bitmap with 1 bit per minimum-sized block */
     mp->num_blocks = (1UL << pool_order) / (1UL << min_order);
     mp->tag_bits   = mm_boot_alloc(BITS_TO_LONGS(mp->num_blocks) * sizeof(long));
@@ -315,31 +363,65 @@ buddy_alloc (struct buddy_mempool *mp, ulong_t order)
 	BUDDY_DEBUG("order expanded to %lu\n",order);
     }
 
-    for (j = order; j <= mp->pool_order; j++) {
+    while (1) {
+        ulong_t map = mp->avail_map & ~((1UL << order) - 1);
+
+        if (!map) {
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+            /* a block may be off the lists while being split or merged */
+            if (mp->inflight) {
+                asm volatile ("pause");
+                continue;
+            }
+#endif
+            break;
+        }
+
+        /* smallest order with a free block */
+        j = __builtin_ctzl(map);
+
+        ORDER_LOCK(mp, j);
 
-        /* Try to allocate the first block in the order j list */
         list = &mp->avail[j];
 
         if (list_empty(list)) {
-	    BUDDY_DEBUG("Skipping order %lu as the list is empty\n",j);
+            /* raced with another allocation, rescan */
+            ORDER_UNLOCK(mp, j);
             continue;
         }
 
         block = list_entry(list->next, struct block, link);
-        list_del(&block->link);
-        mark_allocated(mp, block);
+        avail_remove(mp, block, j);
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+        if (j > order) {
+            __sync_fetch_and_add(&mp->inflight, 1);
+        }
+#endif
+
+        ORDER_UNLOCK(mp, j);
 
 	BUDDY_DEBUG("Found block %p at order %lu\n",block,j);
 
         /* Trim if a higher order block than necessary was allocated */
-        while (j > order) {
-            --j;
-            buddy_block = (struct block *)((ulong_t)block + (1UL << j));
-            buddy_block->order = j;
-            mark_available(mp, buddy_block);
-	    BUDDY_DEBUG("Inserted buddy block %p into order %lu\n",buddy_block,j);
-            list_add(&buddy_block->link, &mp->avail[j]);
+        if (j > order) {
+            while (j > order) {
+                --j;
+                buddy_block = (struct block *)((ulong_t)block + (1UL << j));
+                ORDER_LOCK(mp, j);
+                avail_push(mp, buddy_block, j);
+                ORDER_UNLOCK(mp, j);
+                BUDDY_DEBUG("Inserted buddy block %p into order %lu\n",buddy_block,j);
+            }
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+            __sync_fetch_and_sub(&mp->inflight, 1);
+#endif
+        }
+
+#ifdef NAUT_CONFIG_KMEM_NUMA_SPILL
+        if (mp->free_ctr) {
+            __sync_fetch_and_sub(mp->free_ctr, 1UL << order);
         }
+#endif
 
 	BUDDY_DEBUG("Returning block %p\n",block);
 
@@ -352,6 +434,149 @@ buddy_alloc (struct buddy_mempool *mp, ulong_t order)
 }
 
 
+#ifdef NAUT_CONFIG_KMEM_PAGE_COLORS
+/*
+ * Page colors. The cache sets a page maps to are picked by the low
+ * bits of its 4KB frame number, so a block below 2^(12+bits)
+ * bytes covers a run of colors and anything bigger covers them all.
+ * A block of the requested order is allowed if all of its colors
+ * are in the caller's mask.
+ */
+static inline int
+colors_allowed (ulong_t addr, ulong_t order, uint64_t colors, ulong_t bits)
+{
+    ulong_t ncolors = 1UL << bits;
+    ulong_t color = (addr >> PAGE_SHIFT_4KB) & (ncolors - 1);
+    ulong_t n = order > PAGE_SHIFT_4KB ? 1UL << (order - PAGE_SHIFT_4KB) : 1;
+    uint64_t all = ncolors >= 64 ? ~0ULL : (1ULL << ncolors) - 1;
+    uint64_t want;
+
+    if (n >= ncolors) {
+        want = all;
+    } else {
+        /* a zone base need not be aligned to the span, so runs wrap */
+        want = ((1ULL << n) - 1) << color;
+        if (color + n > ncolors) {
+            want |= ((1ULL << n) - 1) >> (ncolors - color);
+        }
+    }
+
+    return (want & all & ~colors) == 0;
+}
+
+
+/*
+ * First sub-block of the given order inside block that is allowed, or
+ * NULL. Colors repeat every 2^(12+bits) bytes, so that much of
+ * the block is all that has to be looked at.
+ */
+static struct block *
+color_fit (struct block *block, ulong_t j, ulong_t order, uint64_t colors, ulong_t bits)
+{
+    ulong_t span = PAGE_SHIFT_4KB + bits;
+    ulong_t step = order > PAGE_SHIFT_4KB ? order : PAGE_SHIFT_4KB;
+    ulong_t n = j > step ? 1UL << ((j < span ? j : span) - (step < span ? step : span)) : 1;
+    ulong_t i;
+
+    /* blocks inside one page share its color, so step a page at least */
+    for (i = 0; i < n; i++) {
+        ulong_t addr = (ulong_t)block + (i << step);
+        if (colors_allowed(addr, order, colors, bits)) {
+            return (struct block *)addr;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Allocates a block of the requested order whose pages all have
+ * colors in the given mask, out of 1 << bits colors. The free lists
+ * are searched from the requested order up, and the block found is
+ * split down toward an allowed sub-block, the rest going back on the
+ * free lists as usual. It costs a walk of the lists below the color
+ * span, so it is meant for setting threads up rather than hot paths.
+ *
+ * Returns:
+ *       Success: Pointer to the start of the allocated memory block.
+ *       Failure: NULL
+ */
+void *
+buddy_alloc_colored (struct buddy_mempool *mp, ulong_t order, uint64_t colors, ulong_t bits)
+{
+    struct block *block = NULL;
+    struct block *target = NULL;
+    struct block *buddy_block;
+    struct list_head *entry;
+    ulong_t j;
+
+    ASSERT(mp);
+
+    if (order > mp->pool_order) {
+        return NULL;
+    }
+    if (order < mp->min_order) {
+        order = mp->min_order;
+    }
+
+    for (j = order; j <= mp->pool_order && !block; j++) {
+        if (!(mp->avail_map & (1UL << j))) {
+            continue;
+        }
+
+        ORDER_LOCK(mp, j);
+        list_for_each(entry, &mp->avail[j]) {
+            struct block *b = list_entry(entry, struct block, link);
+            if ((target = color_fit(b, j, order, colors, bits))) {
+                block = b;
+                avail_remove(mp, block, j);
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+                if (j > order) {
+                    __sync_fetch_and_add(&mp->inflight, 1);
+                }
+#endif
+                break;
+            }
+        }
+        ORDER_UNLOCK(mp, j);
+    }
+
+    if (!block) {
+        BUDDY_DEBUG("No block of order %lu in colors 0x%llx in %p\n", order, colors, mp);
+        return NULL;
+    }
+
+    /* the loop went one past the order the block was found at */
+    if (--j > order) {
+        /* keep the half holding target, give back the other */
+        while (j > order) {
+            --j;
+            buddy_block = (struct block *)((ulong_t)block + (1UL << j));
+            if (target >= buddy_block) {
+                struct block *t = block;
+                block = buddy_block;
+                buddy_block = t;
+            }
+            ORDER_LOCK(mp, j);
+            avail_push(mp, buddy_block, j);
+            ORDER_UNLOCK(mp, j);
+        }
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+        __sync_fetch_and_sub(&mp->inflight, 1);
+#endif
+    }
+
+#ifdef NAUT_CONFIG_KMEM_NUMA_SPILL
+    if (mp->free_ctr) {
+        __sync_fetch_and_sub(mp->free_ctr, 1UL << order);
+    }
+#endif
+
+    return block;
+}
+#endif
+
+
 /**
  * Returns a block of memory to the buddy system memory allocator.
  */
@@ -387,47 +612,53 @@ buddy_free(
 
     ASSERT(!is_available(mp, block));
 
-    /* Coalesce as much as possible with adjacent free buddy blocks */
-    while (order < mp->pool_order) {
+#ifdef NAUT_CONFIG_KMEM_NUMA_SPILL
+    if (mp->free_ctr) {
+        __sync_fetch_and_add(mp->free_ctr, 1UL << order);
+    }
+#endif
 
-        /* Determine our buddy block's address */
-        struct block * buddy = find_buddy(mp, block, order);
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+    __sync_fetch_and_add(&mp->inflight, 1);
+#endif
 
-	BUDDY_DEBUG("buddy at order %lu is %p\n",order,buddy);
+    /* Coalesce as much as possible with adjacent free buddy blocks */
+    while (1) {
 
-        /* Make sure buddy is available and has the same size as us */
-        if (!is_available(mp, buddy)) {
-	    BUDDY_DEBUG("buddy not available\n");
-	    break;
-	}
+        ORDER_LOCK(mp, order);
 
-        if (is_available(mp, buddy) && (buddy->order != order)) {
-	    BUDDY_DEBUG("buddy available but has order %lu\n",buddy->order);
-            break;
-        }
+        if (order < mp->pool_order) {
+            /* Determine our buddy block's address */
+            struct block * buddy = find_buddy(mp, block, order);
 
-	BUDDY_DEBUG("buddy merge\n");
+	    BUDDY_DEBUG("buddy at order %lu is %p\n",order,buddy);
 
-        /* OK, we're good to go... buddy merge! */
-        list_del(&buddy->link);
-        if (buddy < block) {
-            block = buddy;
-	}
-        ++order;
-        block->order = order;
-    }
-    
-    /* Add the (possibly coalesced) block to the appropriate free list */
-    block->order = order;
+            /* Make sure buddy is available and has the same size as us */
+            if (is_available(mp, buddy) && buddy->order == order) {
 
-    BUDDY_DEBUG("End of search: block=%p order=%lu pool_order=%lu block->order=%lu\n",block,order,mp->pool_order,block->order);
+	        BUDDY_DEBUG("buddy merge\n");
 
+                /* OK, we're good to go... buddy merge! */
+                avail_remove(mp, buddy, order);
+                ORDER_UNLOCK(mp, order);
 
-    mark_available(mp, block);
+                if (buddy < block) {
+                    block = buddy;
+                }
+                ++order;
+                continue;
+            }
+        }
 
-    BUDDY_DEBUG("End of mark: block=%p order=%lu pool_order=%lu block->order=%lu\n",block,order,mp->pool_order,block->order);
+        /* Add the (possibly coalesced) block to the appropriate free list */
+        avail_push(mp, block, order);
+        ORDER_UNLOCK(mp, order);
+        break;
+    }
 
-    list_add(&block->link, &mp->avail[order]);
+#ifdef NAUT_CONFIG_BUDDY_ORDER_LOCKS
+    __sync_fetch_and_sub(&mp->inflight, 1);
+#endif
 
     BUDDY_DEBUG("block at %p of order %lu being made available\n",block,block->order);
     
@@ -440,6 +671,44 @@ buddy_free(
 }
 
 
+/**
+ * Fills in the free space statistics of a pool. The caller holds
+ * the pool with buddy_lock().
+ */
+void
+buddy_get_stats (struct buddy_mempool *mp, struct buddy_stats *stats)
+{
+    struct list_head *entry;
+    ulong_t i;
+
+    memset(stats, 0, sizeof(struct buddy_stats));
+    stats->pool_bytes = 1UL << mp->pool_order;
+
+    for (i = mp->min_order; i <= mp->pool_order && i < 64; i++) {
+        ulong_t n = 0;
+
+        if (!(mp->avail_map & (1UL << i))) {
+            continue;
+        }
+
+        ORDER_LOCK(mp, i);
+        list_for_each(entry, &mp->avail[i])
+            ++n;
+        ORDER_UNLOCK(mp, i);
+
+        stats->free_blocks[i] = n;
+        stats->free_bytes    += n << i;
+        if (n) {
+            stats->largest_free = 1UL << i;
+        }
+    }
+
+    if (stats->free_bytes) {
+        stats->frag = 1000 - (stats->largest_free * 1000) / stats->free_bytes;
+    }
+}
+
+
 /**
  * Dumps the state of a buddy system memory allocator object to the console.
  */
@@ -461,4 +730,19 @@ buddy_dump_mempool(struct buddy_mempool *mp)
 
         BUDDY_DEBUG("  order %2lu: %lu free blocks\n", i, num_blocks);
     }
+
+    /* one tag bit is set per free block, whatever its order */
+    num_blocks = 0;
+    for (i = 0; i < BITS_TO_LONGS(mp->num_blocks); i++) {
+        num_blocks += __builtin_popcountl(mp->tag_bits[i]);
+    }
+
+    BUDDY_DEBUG("  total:    %lu free blocks, order map 0x%lx\n", num_blocks, mp->avail_map);
+
+    {
+        struct buddy_stats stats;
+        buddy_get_stats(mp, &stats);
+        BUDDY_DEBUG("  free:     0x%lx of 0x%lx bytes, largest block 0x%lx, fragmentation %lu/1000\n",
+                    stats.free_bytes, stats.pool_bytes, stats.largest_free, stats.frag);
+    }
 }
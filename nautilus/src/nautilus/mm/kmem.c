@@ -33,6 +33,13 @@
 #include <nautilus/math.h>
 #include <nautilus/intrinsics.h>
 #include <nautilus/percpu.h>
+#include <nautilus/irq.h>
+#ifdef NAUT_CONFIG_KMEM_PREZERO
+#include <nautilus/thread.h>
+#endif
+#ifdef NAUT_CONFIG_KMEM_PAGE_COLORS
+#include <nautilus/cpuid.h>
+#endif
 
 #ifndef NAUT_CONFIG_DEBUG_KMEM
 #undef DEBUG_PRINT
@@ -83,7 +90,12 @@ static struct list_head glob_zone_list;
  */
 struct kmem_block_hdr {
     void *   addr;   /* address of block */
+#ifdef NAUT_CONFIG_KMEM_REMOTE_FREE
+    uint32_t order;  /* order of the block allocated from buddy system */
+    uint32_t cpu;    /* CPU that allocated it, where it is freed back to */
+#else
     uint64_t order;  /* order of the block allocated from buddy system */
+#endif
     struct buddy_mempool * zone; /* zone to which this block belongs */
 } __packed;
 
@@ -154,21 +166,32 @@ static inline uint64_t block_hash_hash(const void *ptr)
   return n;
 }
     
+/*
+ * Entries are claimed by a compare-and-swap on addr, so inserts and
+ * deletes on different CPUs never take a lock. A freed entry becomes
+ * a tombstone rather than going back to empty, which keeps every
+ * live entry ahead of the first empty slot on its probe path. So a
+ * lookup may stop at an empty slot instead of scanning the table, and
+ * a stale entry with the same address can never be found again.
+ */
+#define BLOCK_HASH_TOMB ((void *)1)
+
 static inline struct kmem_block_hdr * block_hash_find_entry(const void *ptr)
 {
-  uint64_t i;
-  uint64_t start = block_hash_hash(ptr);
+  uint64_t i, n;
+  void *a;
   
-  for (i=start;i<block_hash_num_entries;i++) { 
-    if (block_hash_entries[i].addr == ptr) { 
-      KMEM_DEBUG("Find entry scanned %lu entries\n", i-start+1);
+  for (i=block_hash_hash(ptr), n=0; n<block_hash_num_entries; n++) { 
+    a = block_hash_entries[i].addr;
+    if (a == ptr) { 
+      KMEM_DEBUG("Find entry scanned %lu entries\n", n+1);
       return &block_hash_entries[i];
     }
-  }
-  for (i=0;i<start;i++) { 
-    if (block_hash_entries[i].addr == ptr) { 
-      KMEM_DEBUG("Find entry scanned %lu entries\n", block_hash_num_entries-start + i + 1);
-      return &block_hash_entries[i];
+    if (!a) {
+      break;
+    }
+    if (++i == block_hash_num_entries) {
+      i = 0;
     }
   }
   return 0;
@@ -176,19 +199,18 @@ static inline struct kmem_block_hdr * block_hash_find_entry(const void *ptr)
 
 static inline struct kmem_block_hdr * block_hash_alloc(void *ptr)
 {
-  uint64_t i;
-  uint64_t start = block_hash_hash(ptr);
+  uint64_t i, n;
+  void *a;
   
-  for (i=start;i<block_hash_num_entries;i++) { 
-    if (__sync_bool_compare_and_swap(&block_hash_entries[i].order,0,1)) {
-      KMEM_DEBUG("Allocation scanned %lu entries\n", i-start+1);
+  for (i=block_hash_hash(ptr), n=0; n<block_hash_num_entries; n++) { 
+    a = block_hash_entries[i].addr;
+    if ((!a || a == BLOCK_HASH_TOMB) &&
+        __sync_bool_compare_and_swap(&block_hash_entries[i].addr,a,ptr)) {
+      KMEM_DEBUG("Allocation scanned %lu entries\n", n+1);
       return &block_hash_entries[i];
     }
-  }
-  for (i=0;i<start;i++) { 
-    if (__sync_bool_compare_and_swap(&block_hash_entries[i].order,0,1)) {
-      KMEM_DEBUG("Allocation scanned %lu entries\n", block_hash_num_entries-start + i + 1);
-      return &block_hash_entries[i];
+    if (++i == block_hash_num_entries) {
+      i = 0;
     }
   }
   return 0;
@@ -196,21 +218,483 @@ static inline struct kmem_block_hdr * block_hash_alloc(void *ptr)
 
 static inline void block_hash_free_entry(struct kmem_block_hdr *b)
 {
-  __sync_fetch_and_and (&b->order,0);
+  b->order = 0;
+  b->zone = 0;
+  (void)__sync_lock_test_and_set(&b->addr, BLOCK_HASH_TOMB);
+}
+
+
+#ifdef NAUT_CONFIG_KMEM_FRAME_MAP
+/*
+ * Blocks of 4KB and up are not kept in the hash at all. Each 4KB frame
+ * of a zone has a 16 bit entry in a two level radix tree, keyed on the
+ * frame number. The entry of a block's first frame holds its order
+ * plus one in the low bits and the index of its zone above that. Only
+ * the owner of a block writes its entry, so no atomics are needed,
+ * and a lookup costs two loads however many blocks are live.
+ */
+#define FRAME_SHIFT      12
+#define LEAF_SHIFT       30     /* each leaf covers 1GB */
+#define LEAF_FRAMES      (1UL << (LEAF_SHIFT - FRAME_SHIFT))
+#define FRAME_ORDER_BITS 6
+#define FRAME_ORDER_MASK ((1U << FRAME_ORDER_BITS) - 1)
+#define FRAME_MAX_ZONES  (1U << (16 - FRAME_ORDER_BITS))
+
+static uint16_t **             frame_map=0;
+static uint64_t                frame_map_leaves=0;
+static struct buddy_mempool *  frame_zones[FRAME_MAX_ZONES];
+static uint64_t                frame_num_zones=0;
+
+static int frame_map_init(void)
+{
+  struct mem_region * region = NULL;
+  uint64_t end = 0, leaf;
+
+  list_for_each_entry(region, &glob_zone_list, glob_link) {
+    uint64_t e = (uint64_t)pa_to_va(region->base_addr) + region->len;
+    if (e > end) {
+      end = e;
+    }
+  }
+
+  frame_map_leaves = ((end - 1) >> LEAF_SHIFT) + 1;
+  frame_map = mm_boot_alloc(frame_map_leaves * sizeof(uint16_t *));
+  if (!frame_map) {
+    KMEM_ERROR("frame_map_init failed\n");
+    return -1;
+  }
+  memset(frame_map, 0, frame_map_leaves * sizeof(uint16_t *));
+
+  list_for_each_entry(region, &glob_zone_list, glob_link) {
+    uint64_t base = (uint64_t)pa_to_va(region->base_addr);
+
+    for (leaf = base >> LEAF_SHIFT; leaf <= (base + region->len - 1) >> LEAF_SHIFT; leaf++) {
+      if (frame_map[leaf]) {
+        continue;
+      }
+      frame_map[leaf] = mm_boot_alloc(LEAF_FRAMES * sizeof(uint16_t));
+      if (!frame_map[leaf]) {
+        KMEM_ERROR("Could not allocate frame map leaf %lu\n", leaf);
+        return -1;
+      }
+      memset(frame_map[leaf], 0, LEAF_FRAMES * sizeof(uint16_t));
+    }
+
+    if (frame_num_zones < FRAME_MAX_ZONES) {
+      frame_zones[frame_num_zones++] = region->mm_state;
+    } else {
+      KMEM_WARN("Too many zones for the frame map, tracking [%p] in the hash\n", region->base_addr);
+    }
+  }
+
+  KMEM_DEBUG("frame map with %lu leaves of %lu bytes\n", frame_map_leaves, LEAF_FRAMES * sizeof(uint16_t));
+
+  return 0;
+}
+
+static inline uint16_t * frame_entry(const void *addr)
+{
+  uint64_t a = (uint64_t)addr;
+  uint64_t leaf = a >> LEAF_SHIFT;
+
+  if (a & ((1UL << FRAME_SHIFT) - 1) || leaf >= frame_map_leaves || !frame_map[leaf]) {
+    return 0;
+  }
+  return &frame_map[leaf][(a >> FRAME_SHIFT) & (LEAF_FRAMES - 1)];
+}
+
+static inline int frame_zone_id(struct buddy_mempool *zone)
+{
+  uint64_t i;
+
+  for (i=0;i<frame_num_zones;i++) {
+    if (frame_zones[i] == zone) {
+      return i;
+    }
+  }
+  return -1;
+}
+#endif
+
+
+/* 
+ * Record the order and zone of a block handed out by the buddy system.
+ * Returns 0 on success, -1 if there is no room to track it.
+ */
+static inline int block_track(void *block, ulong_t order, struct buddy_mempool *zone)
+{
+  struct kmem_block_hdr *hdr;
+
+#ifdef NAUT_CONFIG_KMEM_FRAME_MAP
+  if (order >= FRAME_SHIFT) {
+    uint16_t *e = frame_entry(block);
+    int id = frame_zone_id(zone);
+
+    if (e && id >= 0) {
+      *e = (id << FRAME_ORDER_BITS) | (order + 1);
+      return 0;
+    }
+  }
+#endif
+
+  hdr = block_hash_alloc(block);
+  if (!hdr) {
+    return -1;
+  }
+  hdr->order = order;
+  hdr->zone = zone;
+#ifdef NAUT_CONFIG_KMEM_REMOTE_FREE
+  hdr->cpu = my_cpu_id();
+#endif
+  return 0;
 }
 
-static inline int block_hash_free(void *ptr)
+/*
+ * Returns 0 and the block's order and zone, or -1 if it is not ours.
+ * cpu, if given, gets the CPU that allocated it, or -1 if that is
+ * not recorded.
+ */
+static inline int block_lookup(void *addr, ulong_t *order, struct buddy_mempool **zone, int *cpu)
 {
-  struct kmem_block_hdr *b = block_hash_find_entry(ptr);
+  struct kmem_block_hdr *hdr;
+
+  if (cpu) {
+    *cpu = -1;
+  }
 
-  if (!b) { 
+#ifdef NAUT_CONFIG_KMEM_FRAME_MAP
+  uint16_t *e = frame_entry(addr);
+
+  if (e && (*e & FRAME_ORDER_MASK)) {
+    *order = (*e & FRAME_ORDER_MASK) - 1;
+    *zone = frame_zones[*e >> FRAME_ORDER_BITS];
+    return 0;
+  }
+#endif
+
+  hdr = block_hash_find_entry(addr);
+  if (!hdr) {
     return -1;
-  } else {
-    block_hash_free_entry(b);
+  }
+  *order = hdr->order;
+  *zone = hdr->zone;
+#ifdef NAUT_CONFIG_KMEM_REMOTE_FREE
+  if (cpu) {
+    *cpu = hdr->cpu;
+  }
+#endif
+  return 0;
+}
+
+/* Like block_lookup(), but the block stops being tracked */
+static inline int block_untrack(void *addr, ulong_t *order, struct buddy_mempool **zone)
+{
+  struct kmem_block_hdr *hdr;
+
+#ifdef NAUT_CONFIG_KMEM_FRAME_MAP
+  uint16_t *e = frame_entry(addr);
+
+  if (e && (*e & FRAME_ORDER_MASK)) {
+    *order = (*e & FRAME_ORDER_MASK) - 1;
+    *zone = frame_zones[*e >> FRAME_ORDER_BITS];
+    *e = 0;
     return 0;
   }
+#endif
+
+  hdr = block_hash_find_entry(addr);
+  if (!hdr) {
+    return -1;
+  }
+  *order = hdr->order;
+  *zone = hdr->zone;
+  block_hash_free_entry(hdr);
+  return 0;
+}
+
+
+#ifdef NAUT_CONFIG_KMEM_STATS
+static inline struct kmem_order_stats *
+kmem_stat_slot (ulong_t order)
+{
+    struct kmem_data * kmem = &(this_cpu()->kmem);
+    return &kmem->stats[order < KMEM_STAT_ORDERS ? order : KMEM_STAT_ORDERS - 1];
+}
+
+/* threads do not migrate, so the local counters need no atomics */
+static inline void
+kmem_stat_alloc (void * block, ulong_t order)
+{
+    struct kmem_order_stats * s = kmem_stat_slot(order);
+
+    if (block) {
+        s->allocs++;
+    } else {
+        s->fails++;
+    }
+}
+
+static inline void
+kmem_stat_free (ulong_t order)
+{
+    kmem_stat_slot(order)->frees++;
+}
+#else
+#define kmem_stat_alloc(block, order)
+#define kmem_stat_free(order)
+#endif
+
+
+#ifdef NAUT_CONFIG_KMEM_PAGE_COLORS
+/*
+ * Page coloring, for cache isolation where there is no CAT. Pages
+ * whose frame numbers agree in the low kmem_color_bits bits share
+ * LLC sets. Colors can be reserved: allocations smaller than the
+ * color span then stay out of them, and malloc_colored() hands them
+ * out to whoever they were reserved for, typically the stacks and
+ * data of real-time threads. Bigger allocations cover every color
+ * and cannot be kept out.
+ */
+static ulong_t kmem_color_bits;
+static uint64_t kmem_reserved_colors;
+
+static void
+kmem_colors_init (void)
+{
+    cpuid_ret_t r;
+    uint64_t way_bytes = 0;
+    uint32_t i;
+
+    if (NAUT_CONFIG_KMEM_PAGE_COLOR_BITS) {
+        kmem_color_bits = NAUT_CONFIG_KMEM_PAGE_COLOR_BITS;
+    } else {
+        cpuid(0, &r);
+        if (r.a >= 4) {
+            /* bytes per way of the outermost cache, in pages */
+            for (i = 0; ; i++) {
+                cpuid_sub(4, i, &r);
+                if ((r.a & 0x1f) == 0) {
+                    break;
+                }
+                way_bytes = (uint64_t)(((r.b >> 12) & 0x3ff) + 1) * ((r.b & 0xfff) + 1) * (r.c + 1);
+            }
+        }
+        for (kmem_color_bits = 0; (PAGE_SIZE_4KB << (kmem_color_bits + 1)) <= way_bytes &&
+                                  kmem_color_bits < 6; kmem_color_bits++)
+            ;
+    }
+
+    KMEM_PRINT("%lu page colors\n", 1UL << kmem_color_bits);
+}
+
+
+/* number of page colors, 1 if the cache cannot be colored */
+int
+kmem_page_colors (void)
+{
+    return 1 << kmem_color_bits;
+}
+
+
+uint64_t
+kmem_colors_reserved (void)
+{
+    return kmem_reserved_colors;
+}
+
+
+/*
+ * Keep the colors in the mask for malloc_colored() from now on. At
+ * least one color has to be left for everything else. Blocks already
+ * handed out, or sitting in magazines, are not moved.
+ */
+int
+kmem_reserve_colors (uint64_t colors)
+{
+    uint64_t all = kmem_color_bits >= 6 ? ~0ULL : (1ULL << (1 << kmem_color_bits)) - 1;
+
+    if ((colors & ~all) || colors == all) {
+        KMEM_ERROR("Cannot reserve colors 0x%llx of 0x%llx\n", colors, all);
+        return -1;
+    }
+
+    kmem_reserved_colors = colors;
+    return 0;
+}
+#endif
+
+
+/*
+ * Every allocation for general use goes through here, so that it
+ * stays out of reserved page colors when it can. Caller holds the
+ * zone lock.
+ */
+static inline void *
+zone_alloc (struct buddy_mempool * zone, ulong_t order)
+{
+#ifdef NAUT_CONFIG_KMEM_PAGE_COLORS
+    if (kmem_reserved_colors && order < PAGE_SHIFT_4KB + kmem_color_bits) {
+        return buddy_alloc_colored(zone, order, ~kmem_reserved_colors, kmem_color_bits);
+    }
+#endif
+    return buddy_alloc(zone, order);
+}
+
+
+#ifdef NAUT_CONFIG_KMEM_MAGAZINES
+/*
+ * Per-CPU magazines. Blocks sitting in a magazine are still allocated
+ * as far as the buddy system and the block hash are concerned, so
+ * moving a block in or out of one touches neither. They are only
+ * touched when a magazine is refilled or drained, half a magazine
+ * at a time. Magazines are only used by their own CPU with interrupts
+ * off, which is all the locking they need.
+ */
+#define MAG_MAX_ORDER (MIN_ORDER + KMEM_MAG_ORDERS - 1)
+#define MAG_BATCH     ((NAUT_CONFIG_KMEM_MAGAZINE_SIZE + 1) / 2)
+
+static void mag_refill (struct kmem_data * kmem, struct kmem_magazine * mag, ulong_t order)
+{
+    struct mem_reg_entry * reg = NULL;
+
+    list_for_each_entry(reg, &(kmem->ordered_regions), mem_ent) {
+        struct buddy_mempool * zone = reg->mem->mm_state;
+
+        buddy_lock(zone);
+        while (mag->count < MAG_BATCH) {
+            void *block = zone_alloc(zone, order);
+
+            if (!block) {
+                break;
+            }
+
+            if (block_track(block, order, zone)) {
+                buddy_free(zone, block, order);
+                buddy_unlock(zone);
+                return;
+            }
+
+            atomic_add(kmem_bytes_allocated, (1UL << order));
+            mag->blocks[mag->count++] = block;
+        }
+        buddy_unlock(zone);
+
+        if (mag->count >= MAG_BATCH) {
+            return;
+        }
+    }
+}
+
+static void mag_drain (struct kmem_magazine * mag)
+{
+    struct buddy_mempool * zone = NULL;
+
+    while (mag->count > MAG_BATCH) {
+        void *block = mag->blocks[--mag->count];
+        struct buddy_mempool * bzone;
+        ulong_t order;
+
+        if (block_untrack(block, &order, &bzone)) {
+            KMEM_ERROR("Magazine block %p is not tracked\n", block);
+            continue;
+        }
+
+        /* blocks may have come from different zones */
+        if (bzone != zone) {
+            if (zone) {
+                buddy_unlock(zone);
+            }
+            zone = bzone;
+            buddy_lock(zone);
+        }
+
+        atomic_sub(kmem_bytes_allocated, (1UL << order));
+        buddy_free(zone, block, order);
+    }
+
+    if (zone) {
+        buddy_unlock(zone);
+    }
+}
+#endif
+
+
+#ifdef NAUT_CONFIG_KMEM_REMOTE_FREE
+/*
+ * Remote frees. A block freed on a CPU other than the one that
+ * allocated it is pushed onto the owner's remote_free stack, linked
+ * through its first word, without a lock and without touching the
+ * owner's magazines or zone locks. The owner takes the whole stack
+ * with one exchange on its next malloc(), so there is only ever one
+ * popper, and puts the blocks into its magazines, or back into their
+ * zones once those are full, a zone lock per run of blocks rather
+ * than per block. Blocks the frame map tracks have no recorded owner
+ * and are freed directly.
+ */
+static void zone_free_range(struct buddy_mempool * zone, addr_t addr, ulong_t len);
+
+static void
+remote_free_push (int cpu, void * block)
+{
+    struct kmem_data * kmem = &(nk_get_nautilus_info()->sys.cpus[cpu]->kmem);
+    void * head;
+
+    do {
+        head = kmem->remote_free;
+        *(void**)block = head;
+    } while (atomic_cmpswap(kmem->remote_free, head, block) != head);
 }
 
+/* interrupts off */
+static void
+remote_free_reclaim (struct kmem_data * kmem)
+{
+    struct buddy_mempool * zone = NULL;
+    struct buddy_mempool * bzone;
+    void * block = xchg64((void**)&kmem->remote_free, NULL);
+    void * next;
+    ulong_t order;
+
+    for (; block; block = next) {
+        next = *(void**)block;
+
+#ifdef NAUT_CONFIG_KMEM_MAGAZINES
+        if (!block_lookup(block, &order, &bzone, NULL) && order <= MAG_MAX_ORDER) {
+            struct kmem_magazine * mag = &(kmem->mags[order - MIN_ORDER]);
+
+            if (mag->count < NAUT_CONFIG_KMEM_MAGAZINE_SIZE) {
+                mag->blocks[mag->count++] = block;
+                continue;
+            }
+        }
+#endif
+
+        if (block_untrack(block, &order, &bzone)) {
+            KMEM_ERROR("Remotely freed block %p is not tracked\n", block);
+            continue;
+        }
+
+        if (bzone != zone) {
+            if (zone) {
+                buddy_unlock(zone);
+            }
+            zone = bzone;
+            buddy_lock(zone);
+        }
+
+        atomic_sub(kmem_bytes_allocated, (1UL << order));
+        if (((addr_t)block - zone->base_addr) & ((1UL << order) - 1)) {
+            zone_free_range(zone, (addr_t)block, 1UL << order);
+        } else {
+            buddy_free(zone, block, order);
+        }
+    }
+
+    if (zone) {
+        buddy_unlock(zone);
+    }
+}
+#endif
 
 struct mem_region *
 kmem_get_base_zone (void)
@@ -274,7 +758,15 @@ create_zone (struct mem_region * region)
     list_add_tail(&(region->glob_link), &glob_zone_list);
 
     /* Initialize the underlying buddy allocator */
-    return buddy_init(pa_to_va(region->base_addr), pool_order, min_order);
+    pool = buddy_init(pa_to_va(region->base_addr), pool_order, min_order);
+
+#ifdef NAUT_CONFIG_KMEM_NUMA_SPILL
+    if (pool) {
+        pool->free_ctr = &(nk_get_nautilus_info()->sys.locality_info.domains[region->domain_id]->free_bytes);
+    }
+#endif
+
+    return pool;
 }
 
 
@@ -301,7 +793,7 @@ kmem_add_memory (struct mem_region * mem,
     buddy_free(mem->mm_state, (void*)pa_to_va(base_addr), ilog2(size));
 
     /* Update statistics */
-    kmem_bytes_managed += size;
+    atomic_add(kmem_bytes_managed, size);
 }
 
 
@@ -335,7 +827,8 @@ nk_kmem_init (void)
 
     /* now, to avoid this logic at allocation time, 
      * we give each core an ordered list of regions 
-     * based on distance from its home node. 
+     * based on distance from its home node (the adjacency
+     * lists are in SLIT order when there is a SLIT). 
      * We'll try to allocate from these in order */
     for (i = 0; i < sys->num_cpus; i++) {
         struct list_head * local_regions = &(sys->cpus[i]->kmem.ordered_regions);
@@ -392,18 +885,94 @@ nk_kmem_init (void)
     
     KMEM_PRINT("Malloc configured to support a maximum of: 0x%lx bytes\n", total_mem);
 
+#ifdef NAUT_CONFIG_KMEM_PAGE_COLORS
+    kmem_colors_init();
+#endif
+
     if (block_hash_init(total_mem)) { 
       KMEM_ERROR("Failed to initialize block hash\n");
       return -1;
     }
 
+#ifdef NAUT_CONFIG_KMEM_FRAME_MAP
+    if (frame_map_init()) { 
+      KMEM_ERROR("Failed to initialize frame map\n");
+      return -1;
+    }
+#endif
+
     return 0;
 }
 
 
+#ifdef NAUT_CONFIG_KMEM_NUMA_SPILL
+/* bytes free in a domain's zones */
+uint64_t
+kmem_node_free (unsigned node)
+{
+    struct nk_locality_info * numa_info = &(nk_get_nautilus_info()->sys.locality_info);
+
+    if (node >= numa_info->num_domains || !numa_info->domains[node]) {
+        return 0;
+    }
+
+    return numa_info->domains[node]->free_bytes;
+}
+
+/*
+ * Once a domain is down to its reserve, its CPUs allocate from the
+ * other domains first and take local memory only when those fail.
+ */
+static inline int
+kmem_spill (struct numa_domain * dom)
+{
+    return dom->free_bytes < ((uint64_t)NAUT_CONFIG_KMEM_NUMA_SPILL_MB << 20);
+}
+#endif
+
+
+#ifdef NAUT_CONFIG_NUMA_BENCH
+/*
+ * Re-sort the calling CPU's region affinity list by cost[domain],
+ * cheapest first, keeping the existing order between equal costs.
+ * Must run on the CPU that owns the list with interrupts off, so no
+ * allocation on this CPU is walking it. A walker preempted mid-list
+ * still reaches the head, as no entry leaves the list.
+ */
+void
+kmem_order_regions (const uint32_t * cost)
+{
+    struct kmem_data * my_kmem = &(this_cpu()->kmem);
+    struct list_head sorted;
+    struct mem_reg_entry * reg = NULL;
+
+    INIT_LIST_HEAD(&sorted);
+
+    while (!list_empty(&my_kmem->ordered_regions)) {
+        struct mem_reg_entry * first = list_first_entry(&my_kmem->ordered_regions, struct mem_reg_entry, mem_ent);
+        struct list_head * at = &sorted;
+
+        /* after the last entry that costs no more */
+        list_for_each_entry_reverse(reg, &sorted, mem_ent) {
+            if (cost[reg->mem->domain_id] <= cost[first->mem->domain_id]) {
+                at = &reg->mem_ent;
+                break;
+            }
+        }
+
+        list_del(&first->mem_ent);
+        list_add(&first->mem_ent, at);
+    }
+
+    list_splice(&sorted, &my_kmem->ordered_regions);
+}
+#endif
+
+
 /**
  * Allocates memory from the kernel memory pool. This will return a memory
- * region that is at least 16-byte aligned. The memory returned is zeroed.
+ * region that is at least 16-byte aligned. The memory returned is not
+ * zeroed, use malloc_zeroed() for that.
  *
  * Arguments:
  *       [IN] size: Amount of memory to allocate in bytes.
@@ -416,7 +985,6 @@ void *
 malloc (size_t size)
 {
     void *block = 0;
-    struct kmem_block_hdr *hdr = NULL;
     struct mem_reg_entry * reg = NULL;
     ulong_t order;
     cpu_id_t my_id = my_cpu_id();
@@ -429,34 +997,78 @@ malloc (size_t size)
         order = MIN_ORDER;
     }
 
+#ifdef NAUT_CONFIG_KMEM_REMOTE_FREE
+    if (my_kmem->remote_free) {
+        uint8_t flags = irq_disable_save();
+        remote_free_reclaim(&(this_cpu()->kmem));
+        irq_enable_restore(flags);
+    }
+#endif
+
+#ifdef NAUT_CONFIG_KMEM_MAGAZINES
+    if (order <= MAG_MAX_ORDER) {
+        uint8_t flags = irq_disable_save();
+        struct kmem_data * kmem = &(this_cpu()->kmem);
+        struct kmem_magazine * mag = &(kmem->mags[order - MIN_ORDER]);
+
+        if (!mag->count) {
+            mag_refill(kmem, mag, order);
+        }
+        if (mag->count) {
+            block = mag->blocks[--mag->count];
+        }
+        kmem_stat_alloc(block, order);
+        irq_enable_restore(flags);
+
+        return block;
+    }
+#endif
+
+#ifdef NAUT_CONFIG_KMEM_NUMA_SPILL
+    struct numa_domain * my_dom = nk_get_nautilus_info()->sys.cpus[my_id]->domain;
+    int spill = kmem_spill(my_dom);
+    int pass;
+
+    /* when spilling, remote regions in the first pass, local in the second */
+    for (pass = 0; pass <= spill && !block; pass++) {
+#endif
+
     /* scan the blocks in order of affinity */
     list_for_each_entry(reg, &(my_kmem->ordered_regions), mem_ent) {
         struct buddy_mempool * zone = reg->mem->mm_state;
 
+#ifdef NAUT_CONFIG_KMEM_NUMA_SPILL
+        if (spill && (reg->mem->domain_id == my_dom->id) != pass) {
+            continue;
+        }
+#endif
+
         /* Allocate memory from the underlying buddy system */
-        uint8_t flags = spin_lock_irq_save(&zone->lock);
-        block = buddy_alloc(zone, order);
-        spin_unlock_irq_restore(&zone->lock, flags);
+        uint8_t flags = buddy_lock_irq_save(zone);
+        block = zone_alloc(zone, order);
+        buddy_unlock_irq_restore(zone, flags);
 
 	if (block) {
-	  hdr = block_hash_alloc(block);
-	  if (!hdr) {
-	    buddy_free(zone,block,order);
+	  if (!block_track(block, order, zone)) {
+	    break;
 	  }
+	  flags = buddy_lock_irq_save(zone);
+	  buddy_free(zone,block,order);
+	  buddy_unlock_irq_restore(zone, flags);
+	  block = 0;
 	}
-
-        if (hdr) {
-	    hdr->addr = block;
-	    hdr->order = order;
-            hdr->zone = zone;
-            break;
-        }
         
     }
 
-    if (hdr) {
-        kmem_bytes_allocated += (1UL << order);
-    } else {
+#ifdef NAUT_CONFIG_KMEM_NUMA_SPILL
+    }
+#endif
+
+    kmem_stat_alloc(block, order);
+
+    if (block) {
+        atomic_add(kmem_bytes_allocated, (1UL << order));
+    } else {
         return NULL;
     }
 
@@ -465,6 +1077,37 @@ malloc (size_t size)
 }
 
 
+/*
+ * Returns [addr, addr+len) to a zone as the largest blocks that are
+ * aligned relative to the zone base, for blocks handed out at an
+ * offset the buddy system would not give them. Caller holds the
+ * zone lock.
+ */
+static void
+zone_free_range (struct buddy_mempool * zone, addr_t addr, ulong_t len)
+{
+    ulong_t off = addr - zone->base_addr;
+
+    while (len) {
+        ulong_t order = off ? __builtin_ctzl(off) : zone->pool_order;
+
+        while ((1UL << order) > len) {
+            order--;
+        }
+        ASSERT(order >= MIN_ORDER);
+
+        buddy_free(zone, (void*)(zone->base_addr + off), order);
+        off += 1UL << order;
+        len -= 1UL << order;
+    }
+}
+
+
+#ifdef NAUT_CONFIG_KMEM_INTERLEAVE
+static void interleave_free(void * addr);
+#endif
+
+
 /**
  * Frees memory previously allocated with kmem_alloc().
  *
@@ -479,27 +1122,767 @@ malloc (size_t size)
 void
 free (void * addr)
 {
-    struct kmem_block_hdr *hdr;
     struct buddy_mempool * zone;
+    ulong_t order;
+    int owner;
 
     if (!addr) {
         return;
     }
 
-    hdr = block_hash_find_entry(addr);
+#ifdef NAUT_CONFIG_KMEM_INTERLEAVE
+    if ((addr_t)addr >= NK_REMAP_BASE) {
+        interleave_free(addr);
+        return;
+    }
+#endif
 
-    if (!hdr) { 
+    if (block_lookup(addr, &order, &zone, &owner)) { 
       KMEM_DEBUG("Failed to find entry for block %p\n",addr);
       return;
     }
 
-    zone = hdr->zone;
+#ifdef NAUT_CONFIG_KMEM_REMOTE_FREE
+    if (owner >= 0 && owner != my_cpu_id()) {
+        kmem_stat_free(order);
+        remote_free_push(owner, addr);
+        return;
+    }
+#endif
+
+#ifdef NAUT_CONFIG_KMEM_MAGAZINES
+    if (order <= MAG_MAX_ORDER) {
+        uint8_t flags = irq_disable_save();
+        struct kmem_data * kmem = &(this_cpu()->kmem);
+        struct kmem_magazine * mag = &(kmem->mags[order - MIN_ORDER]);
+
+        if (mag->count == NAUT_CONFIG_KMEM_MAGAZINE_SIZE) {
+            mag_drain(mag);
+        }
+        mag->blocks[mag->count++] = addr;
+        kmem_stat_free(order);
+        irq_enable_restore(flags);
+        return;
+    }
+#endif
+
+    block_untrack(addr, &order, &zone);
+    kmem_stat_free(order);
 
     /* Return block to the underlying buddy system */
-    uint8_t flags = spin_lock_irq_save(&zone->lock);
-    kmem_bytes_allocated -= (1UL << hdr->order);
-    buddy_free(zone, addr, hdr->order);
-    spin_unlock_irq_restore(&zone->lock, flags);
-    block_hash_free_entry(hdr);
+    uint8_t flags = buddy_lock_irq_save(zone);
+    atomic_sub(kmem_bytes_allocated, (1UL << order));
+    if (((addr_t)addr - zone->base_addr) & ((1UL << order) - 1)) {
+        /* a malloc_huge() block realigned within its zone */
+        zone_free_range(zone, (addr_t)addr, 1UL << order);
+    } else {
+        buddy_free(zone, addr, order);
+    }
+    buddy_unlock_irq_restore(zone, flags);
+}
+
+
+/*
+ * Tells whether addr is a block malloc() handed out, as opposed to
+ * memory an allocator layered on kmem_alloc_block() carved out. This
+ * is the lookup free() makes.
+ */
+int
+kmem_is_block (void * addr)
+{
+    struct buddy_mempool * zone;
+    ulong_t order;
+
+#ifdef NAUT_CONFIG_KMEM_INTERLEAVE
+    if ((addr_t)addr >= NK_REMAP_BASE) {
+        return 1;
+    }
+#endif
+
+    return block_lookup(addr, &order, &zone, NULL) == 0;
+}
+
+
+#ifdef NAUT_CONFIG_KMEM_PREZERO
+/*
+ * Pre-zeroed blocks. Each NUMA domain keeps up to
+ * NAUT_CONFIG_KMEM_PREZERO_DEPTH zeroed blocks of each order from
+ * 64KB to 2MB, allocated from its own zones. Idle threads top them up
+ * with kmem_prezero_idle(), a 64KB piece at a time so that they get
+ * out of the way as soon as there is something else to run, and
+ * malloc_zeroed() takes from them. The blocks are ordinary allocated
+ * blocks the whole time.
+ */
+#define PREZERO_MIN_ORDER 16
+#define PREZERO_MAX_ORDER 21
+#define PREZERO_ORDERS    (PREZERO_MAX_ORDER - PREZERO_MIN_ORDER + 1)
+#define PREZERO_CHUNK     (1UL << PREZERO_MIN_ORDER)
+
+struct prezero_pool {
+    spinlock_t lock;
+    uint32_t   count[PREZERO_ORDERS];
+    uint32_t   filling[PREZERO_ORDERS];  /* being zeroed right now */
+    void *     blocks[PREZERO_ORDERS][NAUT_CONFIG_KMEM_PREZERO_DEPTH];
+} __attribute__((aligned(64)));
+
+static struct prezero_pool prezero_pools[MAX_NUMA_DOMAINS];
+
+static inline unsigned
+prezero_domain (void)
+{
+    struct numa_domain * dom = this_cpu()->domain;
+
+    return dom ? dom->id : 0;
+}
+
+/*
+ * Zeroes a block for the local domain's pool, if it is short of one.
+ * Returns 1 if there was something to do, 0 if the pool is full.
+ */
+int
+kmem_prezero_idle (void)
+{
+    unsigned node = prezero_domain();
+    struct prezero_pool * p = &prezero_pools[node];
+    unsigned i;
+    ulong_t off;
+    uint8_t flags;
+    char * block;
+
+    flags = spin_lock_irq_save(&p->lock);
+    for (i = 0; i < PREZERO_ORDERS; i++) {
+        if (p->count[i] + p->filling[i] < NAUT_CONFIG_KMEM_PREZERO_DEPTH) {
+            p->filling[i]++;
+            break;
+        }
+    }
+    spin_unlock_irq_restore(&p->lock, flags);
+
+    if (i == PREZERO_ORDERS) {
+        return 0;
+    }
+
+    block = malloc_node(1UL << (PREZERO_MIN_ORDER + i), node);
+
+    if (block) {
+        for (off = 0; off < (1UL << (PREZERO_MIN_ORDER + i)); off += PREZERO_CHUNK) {
+            memset(block + off, 0, PREZERO_CHUNK);
+            nk_yield();
+        }
+    }
+
+    flags = spin_lock_irq_save(&p->lock);
+    p->filling[i]--;
+    if (block) {
+        p->blocks[i][p->count[i]++] = block;
+    }
+    spin_unlock_irq_restore(&p->lock, flags);
+
+    return block != NULL;
+}
+#endif
+
+
+/**
+ * Like malloc(), but the memory returned is zeroed. Large requests
+ * are served from the local domain's pre-zeroed blocks when there
+ * are some.
+ */
+void *
+malloc_zeroed (size_t size)
+{
+    void * block = NULL;
+
+#ifdef NAUT_CONFIG_KMEM_PREZERO
+    ulong_t order = ilog2(roundup_pow_of_two(size));
+
+    if (order >= PREZERO_MIN_ORDER && order <= PREZERO_MAX_ORDER) {
+        struct prezero_pool * p = &prezero_pools[prezero_domain()];
+        unsigned i = order - PREZERO_MIN_ORDER;
+        uint8_t flags = spin_lock_irq_save(&p->lock);
+
+        if (p->count[i]) {
+            block = p->blocks[i][--p->count[i]];
+        }
+        spin_unlock_irq_restore(&p->lock, flags);
+
+        if (block) {
+            kmem_stat_alloc(block, order);
+            return block;
+        }
+    }
+#endif
+
+    block = malloc(size);
+    if (block) {
+        memset(block, 0, size);
+    }
+
+    return block;
+}
+
+
+/**
+ * Allocates memory from the zones of one NUMA domain only. Unlike
+ * malloc() this never falls back to a remote domain. The memory is
+ * released with free().
+ *
+ * Arguments:
+ *       [IN] size: Amount of memory to allocate in bytes.
+ *       [IN] node: NUMA domain to allocate from
+ *
+ * Returns:
+ *       Success: Pointer to the start of the allocated memory.
+ *       Failure: NULL
+ */
+void *
+malloc_node (size_t size, unsigned node)
+{
+    struct nk_locality_info * numa_info = &(nk_get_nautilus_info()->sys.locality_info);
+    struct mem_region * reg = NULL;
+    void * block = 0;
+    ulong_t order;
+
+    if (node >= numa_info->num_domains || !numa_info->domains[node]) {
+        KMEM_DEBUG("No NUMA domain %u\n", node);
+        return NULL;
+    }
+
+    order = ilog2(roundup_pow_of_two(size));
+    if (order < MIN_ORDER) {
+        order = MIN_ORDER;
+    }
+
+    list_for_each_entry(reg, &(numa_info->domains[node]->regions), entry) {
+        struct buddy_mempool * zone = reg->mm_state;
+
+        if (!zone) {
+            continue;
+        }
+
+        uint8_t flags = buddy_lock_irq_save(zone);
+        block = zone_alloc(zone, order);
+        buddy_unlock_irq_restore(zone, flags);
+
+        if (block) {
+            if (!block_track(block, order, zone)) {
+                break;
+            }
+            flags = buddy_lock_irq_save(zone);
+            buddy_free(zone, block, order);
+            buddy_unlock_irq_restore(zone, flags);
+            block = 0;
+        }
+    }
+
+    kmem_stat_alloc(block, order);
+
+    if (!block) {
+        return NULL;
+    }
+
+    atomic_add(kmem_bytes_allocated, (1UL << order));
+
+    return block;
 }
 
+
+#ifdef NAUT_CONFIG_KMEM_PAGE_COLORS
+/**
+ * Allocates memory whose pages all have colors in the given mask,
+ * normally the ones set aside with kmem_reserve_colors(). Only sizes
+ * below the color span, the LLC size over its associativity, can be
+ * kept to a subset of colors. The memory is released with free().
+ *
+ * Arguments:
+ *       [IN] size:   Amount of memory to allocate in bytes.
+ *       [IN] colors: bit c set if color c may be used
+ *
+ * Returns:
+ *       Success: Pointer to the start of the allocated memory.
+ *       Failure: NULL
+ */
+void *
+malloc_colored (size_t size, uint64_t colors)
+{
+    struct mem_reg_entry * reg = NULL;
+    void * block = 0;
+    ulong_t order;
+
+    order = ilog2(roundup_pow_of_two(size));
+    if (order < MIN_ORDER) {
+        order = MIN_ORDER;
+    }
+
+    list_for_each_entry(reg, &(this_cpu()->kmem.ordered_regions), mem_ent) {
+        struct buddy_mempool * zone = reg->mem->mm_state;
+
+        uint8_t flags = buddy_lock_irq_save(zone);
+        block = buddy_alloc_colored(zone, order, colors, kmem_color_bits);
+        buddy_unlock_irq_restore(zone, flags);
+
+        if (block) {
+            if (!block_track(block, order, zone)) {
+                break;
+            }
+            flags = buddy_lock_irq_save(zone);
+            buddy_free(zone, block, order);
+            buddy_unlock_irq_restore(zone, flags);
+            block = 0;
+        }
+    }
+
+    kmem_stat_alloc(block, order);
+
+    if (!block) {
+        return NULL;
+    }
+
+    atomic_add(kmem_bytes_allocated, (1UL << order));
+
+    return block;
+}
+#endif
+
+
+/**
+ * Allocates memory aligned to a 2MB or 1GB page, so that it is mapped
+ * by as few TLB entries as the kernel identity map allows. The size
+ * is rounded up to a power of two of at least the page size. Zones
+ * whose base is not aligned to the page size are used too: a block
+ * twice the size is taken and the unaligned head and tail are given
+ * back. The memory is released with free().
+ *
+ * Arguments:
+ *       [IN] size:      Amount of memory to allocate in bytes.
+ *       [IN] page_size: PAGE_SIZE_2MB or PAGE_SIZE_1GB
+ *
+ * Returns:
+ *       Success: Pointer to the start of the allocated memory.
+ *       Failure: NULL
+ */
+void *
+malloc_huge (size_t size, ulong_t page_size)
+{
+    struct mem_reg_entry * reg = NULL;
+    struct kmem_data * my_kmem = &(this_cpu()->kmem);
+    ulong_t align = page_size;
+    ulong_t order;
+    void * block = 0;
+
+    if (align != PAGE_SIZE_2MB && align != PAGE_SIZE_1GB) {
+        KMEM_ERROR("malloc_huge: unsupported page size 0x%lx\n", align);
+        return NULL;
+    }
+
+    if (align > ps_type_to_size(nk_kern_page_size())) {
+        KMEM_ERROR("malloc_huge: kernel is not mapped with 0x%lx byte pages\n", align);
+        return NULL;
+    }
+
+    order = ilog2(roundup_pow_of_two(size));
+    if ((1UL << order) < align) {
+        order = ilog2(align);
+    }
+
+    list_for_each_entry(reg, &(my_kmem->ordered_regions), mem_ent) {
+        struct buddy_mempool * zone = reg->mem->mm_state;
+        ulong_t skew = (-zone->base_addr) & (align - 1);
+        ulong_t got  = skew ? order + 1 : order;
+        uint8_t flags;
+        void * raw;
+
+        if (got > zone->pool_order) {
+            continue;
+        }
+
+        flags = buddy_lock_irq_save(zone);
+        raw = buddy_alloc(zone, got);
+        if (raw && skew) {
+            /* raw is aligned to 2^got relative to the zone base */
+            block = (void*)((addr_t)raw + skew);
+            zone_free_range(zone, (addr_t)raw, skew);
+            zone_free_range(zone, (addr_t)block + (1UL << order), (1UL << order) - skew);
+        } else {
+            block = raw;
+        }
+        buddy_unlock_irq_restore(zone, flags);
+
+        if (block) {
+            if (!block_track(block, order, zone)) {
+                break;
+            }
+            flags = buddy_lock_irq_save(zone);
+            zone_free_range(zone, (addr_t)block, 1UL << order);
+            buddy_unlock_irq_restore(zone, flags);
+            block = 0;
+        }
+    }
+
+    kmem_stat_alloc(block, order);
+
+    if (!block) {
+        return NULL;
+    }
+
+    atomic_add(kmem_bytes_allocated, (1UL << order));
+
+    return block;
+}
+
+
+#ifdef NAUT_CONFIG_KMEM_INTERLEAVE
+/*
+ * An interleaved buffer is a run of 2MB-aligned buddy blocks, one per
+ * stride, taken round robin from the NUMA domains and mapped back to
+ * back in the remap window. Window space is handed out by bumping a
+ * pointer and is never reused, so a freed range can not be revisited
+ * through a stale TLB entry on another core and no shootdown is
+ * needed when it is unmapped.
+ */
+struct kmem_ivl_stride {
+    void *                 block;
+    struct buddy_mempool * zone;
+};
+
+struct kmem_interleave {
+    struct list_head       node;
+    addr_t                 base;
+    ulong_t                num_strides;
+    ulong_t                order;
+    struct kmem_ivl_stride strides[0];
+};
+
+static LIST_HEAD(ivl_list);
+static spinlock_t ivl_lock = 0;
+static addr_t     ivl_next = NK_REMAP_BASE;
+
+
+static void *
+ivl_alloc_stride (unsigned node, ulong_t order, struct buddy_mempool ** zone)
+{
+    struct nk_locality_info * numa_info = &(nk_get_nautilus_info()->sys.locality_info);
+    struct mem_region * reg = NULL;
+    unsigned i;
+
+    /* preferred node first, then the rest in id order */
+    for (i = 0; i < numa_info->num_domains; i++) {
+        unsigned n = (node + i) % numa_info->num_domains;
+
+        if (!numa_info->domains[n]) {
+            continue;
+        }
+
+        list_for_each_entry(reg, &(numa_info->domains[n]->regions), entry) {
+            struct buddy_mempool * z = reg->mm_state;
+            void * block;
+
+            if (!z || (z->base_addr & (PAGE_SIZE_2MB - 1))) {
+                continue;
+            }
+
+            uint8_t flags = buddy_lock_irq_save(z);
+            block = buddy_alloc(z, order);
+            if (block) {
+                atomic_add(kmem_bytes_allocated, (1UL << order));
+            }
+            buddy_unlock_irq_restore(z, flags);
+
+            if (block) {
+                *zone = z;
+                return block;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ivl_release (struct kmem_interleave * ivl, ulong_t n)
+{
+    ulong_t i, j;
+
+    for (i = 0; i < n; i++) {
+        struct kmem_ivl_stride * s = &ivl->strides[i];
+        addr_t va = ivl->base + (i << ivl->order);
+
+        for (j = 0; j < (1UL << ivl->order); j += PAGE_SIZE_2MB) {
+            nk_unmap_2mb(va + j);
+        }
+
+        kmem_free_block(s->zone, s->block, ivl->order);
+    }
+
+    free(ivl);
+}
+
+
+/**
+ * Allocates memory whose consecutive strides come from consecutive
+ * NUMA domains, so that a large buffer streamed by every socket
+ * spreads its traffic over all memory controllers. If a domain is
+ * out of memory its stride is taken from the next one instead. The
+ * memory is released with free().
+ *
+ * Arguments:
+ *       [IN] size:   Amount of memory to allocate in bytes.
+ *       [IN] stride: Bytes placed on a node before moving on to the
+ *                    next. Rounded up to a power of two of at least 2MB.
+ *
+ * Returns:
+ *       Success: Pointer to the start of the allocated memory.
+ *       Failure: NULL
+ */
+void *
+malloc_interleave (size_t size, size_t stride)
+{
+    struct nk_locality_info * numa_info = &(nk_get_nautilus_info()->sys.locality_info);
+    struct kmem_interleave * ivl = NULL;
+    ulong_t order, n, i, j;
+    uint8_t flags;
+
+    if (!size) {
+        return NULL;
+    }
+
+    if (stride < PAGE_SIZE_2MB) {
+        stride = PAGE_SIZE_2MB;
+    }
+    order = ilog2(roundup_pow_of_two(stride));
+    n     = (size + (1UL << order) - 1) >> order;
+
+    ivl = malloc(sizeof(struct kmem_interleave) + n * sizeof(struct kmem_ivl_stride));
+    if (!ivl) {
+        KMEM_ERROR("Could not allocate interleave descriptor\n");
+        return NULL;
+    }
+
+    ivl->num_strides = n;
+    ivl->order       = order;
+
+    /* carve out the window range, aligned to the stride */
+    flags = spin_lock_irq_save(&ivl_lock);
+    ivl->base = (ivl_next + (1UL << order) - 1) & ~((1UL << order) - 1);
+    if (ivl->base + (n << order) > NK_REMAP_BASE + NK_REMAP_SIZE ||
+        ivl->base + (n << order) < ivl->base) {
+        spin_unlock_irq_restore(&ivl_lock, flags);
+        KMEM_ERROR("Interleave window exhausted (%lu bytes requested)\n", size);
+        free(ivl);
+        return NULL;
+    }
+    ivl_next = ivl->base + (n << order);
+    spin_unlock_irq_restore(&ivl_lock, flags);
+
+    for (i = 0; i < n; i++) {
+        struct kmem_ivl_stride * s = &ivl->strides[i];
+        addr_t va = ivl->base + (i << order);
+
+        s->block = ivl_alloc_stride(i % numa_info->num_domains, order, &s->zone);
+        if (!s->block) {
+            KMEM_DEBUG("Out of memory for interleave stride %lu of %lu\n", i, n);
+            ivl_release(ivl, i);
+            return NULL;
+        }
+
+        for (j = 0; j < (1UL << order); j += PAGE_SIZE_2MB) {
+            if (nk_remap_2mb(va + j, va_to_pa((addr_t)s->block) + j)) {
+                kmem_free_block(s->zone, s->block, order);
+                ivl_release(ivl, i);
+                return NULL;
+            }
+        }
+    }
+
+    flags = spin_lock_irq_save(&ivl_lock);
+    list_add(&ivl->node, &ivl_list);
+    spin_unlock_irq_restore(&ivl_lock, flags);
+
+    return (void*)ivl->base;
+}
+
+
+static void
+interleave_free (void * addr)
+{
+    struct kmem_interleave * ivl = NULL;
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&ivl_lock);
+    list_for_each_entry(ivl, &ivl_list, node) {
+        if (ivl->base == (addr_t)addr) {
+            list_del(&ivl->node);
+            spin_unlock_irq_restore(&ivl_lock, flags);
+            ivl_release(ivl, ivl->num_strides);
+            return;
+        }
+    }
+    spin_unlock_irq_restore(&ivl_lock, flags);
+
+    KMEM_DEBUG("Failed to find interleaved buffer %p\n", addr);
+}
+#endif
+
+
+#if defined(NAUT_CONFIG_KMEM_SLAB) || defined(NAUT_CONFIG_KMEM_INTERLEAVE)
+/**
+ * Allocates a 2^order byte block straight from the buddy system, for
+ * allocators layered on top of it (the slab caches). The block is
+ * aligned to its own size, so zones whose base is not aligned that
+ * far are skipped. It has no block hash entry, and must be given
+ * back with kmem_free_block() together with the zone returned here.
+ *
+ * Arguments:
+ *       [IN]  order: log2 of the block size
+ *       [OUT] zone:  the zone the block came from
+ *
+ * Returns:
+ *       Success: Pointer to the block.
+ *       Failure: NULL
+ */
+void *
+kmem_alloc_block (ulong_t order, struct buddy_mempool ** zone)
+{
+    struct mem_reg_entry * reg = NULL;
+    struct kmem_data * my_kmem = &(this_cpu()->kmem);
+    void * block;
+
+    list_for_each_entry(reg, &(my_kmem->ordered_regions), mem_ent) {
+        struct buddy_mempool * z = reg->mem->mm_state;
+
+        if (z->base_addr & ((1UL << order) - 1)) {
+            continue;
+        }
+
+        uint8_t flags = buddy_lock_irq_save(z);
+        block = zone_alloc(z, order);
+        if (block) {
+            atomic_add(kmem_bytes_allocated, (1UL << order));
+        }
+        buddy_unlock_irq_restore(z, flags);
+
+        if (block) {
+            *zone = z;
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+
+void
+kmem_free_block (struct buddy_mempool * zone, void * block, ulong_t order)
+{
+    uint8_t flags = buddy_lock_irq_save(zone);
+    atomic_sub(kmem_bytes_allocated, (1UL << order));
+    buddy_free(zone, block, order);
+    buddy_unlock_irq_restore(zone, flags);
+}
+#endif
+
+
+#ifdef NAUT_CONFIG_KMEM_STATS
+/**
+ * Fills in allocator statistics summed over all CPUs. The per-CPU
+ * counters are read without stopping their owners, so the result is
+ * a close approximation while allocation is in progress.
+ *
+ * Returns 0 on success
+ */
+int
+nk_kmem_stats (struct nk_kmem_stats * stats)
+{
+    struct sys_info * sys = &(nk_get_nautilus_info()->sys);
+    struct mem_region * reg = NULL;
+    unsigned i, j;
+
+    memset(stats, 0, sizeof(struct nk_kmem_stats));
+
+    stats->bytes_managed   = kmem_bytes_managed;
+    stats->bytes_allocated = kmem_bytes_allocated;
+
+    list_for_each_entry(reg, &glob_zone_list, glob_link) {
+        stats->num_zones++;
+    }
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        struct kmem_order_stats * s = sys->cpus[i]->kmem.stats;
+
+        for (j = 0; j < KMEM_STAT_ORDERS; j++) {
+            stats->orders[j].allocs += s[j].allocs;
+            stats->orders[j].frees  += s[j].frees;
+            stats->orders[j].fails  += s[j].fails;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Fills in the free space and fragmentation of one zone, numbered in
+ * the order the zones were created.
+ *
+ * Returns 0 on success, -1 if there is no such zone
+ */
+int
+nk_kmem_zone_stats (unsigned zone, struct buddy_stats * stats)
+{
+    struct mem_region * reg = NULL;
+    unsigned i = 0;
+
+    list_for_each_entry(reg, &glob_zone_list, glob_link) {
+        if (i++ == zone) {
+            uint8_t flags = buddy_lock_irq_save(reg->mm_state);
+            buddy_get_stats(reg->mm_state, stats);
+            buddy_unlock_irq_restore(reg->mm_state, flags);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+void
+nk_kmem_stats_dump (void)
+{
+    struct nk_kmem_stats * stats = malloc(sizeof(struct nk_kmem_stats));
+    struct buddy_stats zs;
+    unsigned i;
+
+    if (!stats) {
+        KMEM_ERROR("Could not allocate stats snapshot\n");
+        return;
+    }
+
+    nk_kmem_stats(stats);
+
+    KMEM_PRINT("0x%lx of 0x%lx bytes allocated in %lu zones\n",
+               stats->bytes_allocated, stats->bytes_managed, stats->num_zones);
+
+    for (i = 0; i < KMEM_STAT_ORDERS; i++) {
+        struct kmem_order_stats * s = &stats->orders[i];
+        if (s->allocs || s->frees || s->fails) {
+            KMEM_PRINT("    order %2u%s: %lu allocs, %lu frees, %lu failures\n",
+                       i, i == KMEM_STAT_ORDERS - 1 ? "+" : " ",
+                       s->allocs, s->frees, s->fails);
+        }
+    }
+
+    for (i = 0; nk_kmem_zone_stats(i, &zs) == 0; i++) {
+        KMEM_PRINT("    zone %u: 0x%lx of 0x%lx bytes free, largest block 0x%lx, fragmentation %lu/1000\n",
+                   i, zs.free_bytes, zs.pool_bytes, zs.largest_free, zs.frag);
+    }
+
+#ifdef NAUT_CONFIG_KMEM_NUMA_SPILL
+    for (i = 0; i < nk_get_num_domains(); i++) {
+        KMEM_PRINT("    domain %u: 0x%lx bytes free\n", i, kmem_node_free(i));
+    }
+#endif
+
+    free(stats);
+}
+#endif
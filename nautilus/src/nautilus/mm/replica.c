@@ -0,0 +1,146 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/mm.h>
+#include <nautilus/paging.h>
+#include <nautilus/numa.h>
+#include <nautilus/replica.h>
+#include <nautilus/naut_string.h>
+
+#ifndef NAUT_CONFIG_DEBUG_KMEM
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define REPLICA_DEBUG(fmt, args...) DEBUG_PRINT("REPLICA: " fmt, ##args)
+#define REPLICA_ERROR(fmt, args...) ERROR_PRINT("REPLICA: " fmt, ##args)
+
+
+int
+nk_numa_node_of (void * addr)
+{
+    struct mem_region * reg = kmem_get_region_by_addr(va_to_pa((addr_t)addr));
+
+    return reg ? (int)reg->domain_id : -1;
+}
+
+
+/*
+ * nk_numa_replicate
+ *
+ * @data: the range to replicate, which stays where it is
+ * @len:  its length in bytes
+ *
+ * returns the handle, with a copy in every domain but the one data is
+ * in, or NULL on failure. Domains that are out of memory share the
+ * original.
+ *
+ */
+struct nk_numa_replica *
+nk_numa_replicate (void * data, size_t len)
+{
+    unsigned n = nk_get_num_domains();
+    struct nk_numa_replica * r;
+    int home = nk_numa_node_of(data);
+    unsigned i;
+
+    r = malloc(sizeof(struct nk_numa_replica) + n * sizeof(void*));
+    if (!r) {
+        REPLICA_ERROR("Could not allocate replica of %lu bytes\n", len);
+        return NULL;
+    }
+
+    r->orig        = data;
+    r->len         = len;
+    r->home        = home < 0 ? 0 : home;
+    r->num_domains = n;
+
+    for (i = 0; i < n; i++) {
+        if (i == r->home) {
+            r->copy[i] = data;
+            continue;
+        }
+
+        r->copy[i] = malloc_node(len, i);
+        if (!r->copy[i]) {
+            REPLICA_DEBUG("No room in domain %u, it will read the original\n", i);
+            r->copy[i] = data;
+            continue;
+        }
+
+        memcpy(r->copy[i], data, len);
+    }
+
+    return r;
+}
+
+
+/* copies the original over the replicas again */
+int
+nk_numa_replica_sync (struct nk_numa_replica * r)
+{
+    unsigned i;
+
+    for (i = 0; i < r->num_domains; i++) {
+        if (r->copy[i] != r->orig) {
+            memcpy(r->copy[i], r->orig, r->len);
+        }
+    }
+
+    return 0;
+}
+
+
+/* frees the copies, but not the original */
+void
+nk_numa_replica_destroy (struct nk_numa_replica * r)
+{
+    unsigned i;
+
+    for (i = 0; i < r->num_domains; i++) {
+        if (r->copy[i] != r->orig) {
+            free(r->copy[i]);
+        }
+    }
+
+    free(r);
+}
+
+
+void *
+nk_numa_migrate (void * data, size_t len, unsigned node)
+{
+    void * to;
+
+    if (nk_numa_node_of(data) == (int)node) {
+        return data;
+    }
+
+    to = malloc_node(len, node);
+    if (!to) {
+        REPLICA_ERROR("No room for %lu bytes in domain %u\n", len, node);
+        return NULL;
+    }
+
+    memcpy(to, data, len);
+    free(data);
+
+    return to;
+}
@@ -0,0 +1,353 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/mm.h>
+#include <nautilus/slab.h>
+#include <nautilus/buddy.h>
+#include <nautilus/list.h>
+#include <nautilus/irq.h>
+#include <nautilus/percpu.h>
+#include <nautilus/atomic.h>
+#include <nautilus/macros.h>
+#include <nautilus/naut_string.h>
+
+#ifndef NAUT_CONFIG_DEBUG_KMEM
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define SLAB_DEBUG(fmt, args...) DEBUG_PRINT("SLAB: " fmt, ##args)
+#define SLAB_ERROR(fmt, args...) ERROR_PRINT("SLAB: " fmt, ##args)
+
+/*
+ * Slabs are at least 2^SLAB_MIN_ORDER bytes and are grown until
+ * SLAB_MIN_OBJS objects fit, up to 2^SLAB_MAX_ORDER.
+ */
+#define SLAB_MIN_ORDER 16
+#define SLAB_MAX_ORDER 21
+#define SLAB_MIN_OBJS  8
+#define SLAB_NAME_LEN  32
+
+/*
+ * Header at the start of each slab. A slab is aligned to its size,
+ * so the slab an object belongs to is found by masking its address.
+ * A slab is only touched by the CPU that made it, with interrupts off.
+ */
+struct nk_slab {
+    struct list_head node;          /* on its CPU's partial list, if partial */
+    struct nk_slab_cache * cache;
+    struct buddy_mempool * zone;
+    void * free;                    /* free objects, linked through their link word */
+    uint32_t inuse;
+    uint32_t cpu;
+};
+
+struct slab_cpu {
+    struct list_head partial;       /* slabs with some objects free */
+    struct nk_slab * empty;         /* one empty slab kept in reserve */
+    void * remote;                  /* objects freed by other CPUs */
+};
+
+struct nk_slab_cache {
+    char name[SLAB_NAME_LEN];
+    size_t size;
+    size_t stride;                  /* distance between objects */
+    size_t first;                   /* offset of the first object */
+    size_t link;                    /* offset of the free list link in an object */
+    ulong_t order;                  /* log2 of the slab size */
+    uint32_t per_slab;
+    void (*ctor)(void * obj);
+    uint64_t num_slabs;
+    struct slab_cpu cpus[NAUT_CONFIG_MAX_CPUS];
+};
+
+
+static inline void **
+obj_link (struct nk_slab_cache * cache, void * obj)
+{
+    return (void **)((char *)obj + cache->link);
+}
+
+
+static inline struct nk_slab *
+slab_of (struct nk_slab_cache * cache, void * obj)
+{
+    return (struct nk_slab *)((ulong_t)obj & ~((1UL << cache->order) - 1));
+}
+
+
+static struct nk_slab *
+slab_grow (struct nk_slab_cache * cache, int cpu)
+{
+    struct buddy_mempool * zone = NULL;
+    struct nk_slab * slab = kmem_alloc_block(cache->order, &zone);
+    uint32_t i;
+
+    if (!slab) {
+        SLAB_ERROR("Could not grow cache %s\n", cache->name);
+        return NULL;
+    }
+
+    slab->cache = cache;
+    slab->zone  = zone;
+    slab->free  = NULL;
+    slab->inuse = 0;
+    slab->cpu   = cpu;
+    INIT_LIST_HEAD(&slab->node);
+
+    /* built back to front, so objects go out in address order */
+    for (i = cache->per_slab; i > 0; i--) {
+        void * obj = (char *)slab + cache->first + (i - 1) * cache->stride;
+        if (cache->ctor) {
+            cache->ctor(obj);
+        }
+        *obj_link(cache, obj) = slab->free;
+        slab->free = obj;
+    }
+
+    atomic_inc(cache->num_slabs);
+    SLAB_DEBUG("Cache %s grew by slab %p on cpu %d\n", cache->name, slab, cpu);
+
+    return slab;
+}
+
+
+static void
+slab_release (struct nk_slab_cache * cache, struct nk_slab * slab)
+{
+    atomic_dec(cache->num_slabs);
+    kmem_free_block(slab->zone, slab, cache->order);
+}
+
+
+/* give an object back to a slab of this CPU */
+static void
+slab_put (struct nk_slab_cache * cache, struct slab_cpu * c, struct nk_slab * slab, void * obj)
+{
+    if (!slab->free) {
+        /* was full */
+        list_add(&slab->node, &c->partial);
+    }
+
+    *obj_link(cache, obj) = slab->free;
+    slab->free = obj;
+
+    if (--slab->inuse == 0) {
+        list_del_init(&slab->node);
+        if (!c->empty) {
+            c->empty = slab;
+        } else {
+            slab_release(cache, slab);
+        }
+    }
+}
+
+
+static void
+slab_drain_remote (struct nk_slab_cache * cache, struct slab_cpu * c)
+{
+    void * obj = xchg64(&c->remote, NULL);
+    void * next;
+
+    while (obj) {
+        next = *obj_link(cache, obj);
+        slab_put(cache, c, slab_of(cache, obj), obj);
+        obj = next;
+    }
+}
+
+
+struct nk_slab_cache *
+nk_slab_cache_create (const char * name, size_t size, size_t align, void (*ctor)(void * obj))
+{
+    struct nk_slab_cache * cache = NULL;
+    size_t obj_size;
+    int i;
+
+    if (!align) {
+        align = sizeof(void *);
+    }
+
+    if (align & (align - 1)) {
+        SLAB_ERROR("Alignment %lu of cache %s is not a power of two\n", align, name);
+        return NULL;
+    }
+
+    cache = malloc(sizeof(struct nk_slab_cache));
+    if (!cache) {
+        SLAB_ERROR("Could not allocate cache %s\n", name);
+        return NULL;
+    }
+    memset(cache, 0, sizeof(struct nk_slab_cache));
+
+    strncpy(cache->name, name, SLAB_NAME_LEN);
+    cache->name[SLAB_NAME_LEN - 1] = 0;
+    cache->size = size;
+    cache->ctor = ctor;
+
+    /* a constructed object keeps its state while free, so link after it */
+    if (ctor) {
+        cache->link = round_up(size, sizeof(void *));
+        obj_size = cache->link + sizeof(void *);
+    } else {
+        cache->link = 0;
+        obj_size = (size > sizeof(void *)) ? size : sizeof(void *);
+    }
+
+    cache->stride = round_up(obj_size, align);
+    cache->first  = round_up(sizeof(struct nk_slab), align);
+
+    for (cache->order = SLAB_MIN_ORDER; cache->order <= SLAB_MAX_ORDER; cache->order++) {
+        if (((1UL << cache->order) - cache->first) / cache->stride >= SLAB_MIN_OBJS) {
+            break;
+        }
+    }
+
+    if (cache->order > SLAB_MAX_ORDER) {
+        SLAB_ERROR("Objects of cache %s (%lu bytes) are too large\n", name, size);
+        free(cache);
+        return NULL;
+    }
+
+    cache->per_slab = ((1UL << cache->order) - cache->first) / cache->stride;
+
+    for (i = 0; i < NAUT_CONFIG_MAX_CPUS; i++) {
+        INIT_LIST_HEAD(&cache->cpus[i].partial);
+    }
+
+    SLAB_DEBUG("Created cache %s: %lu byte objects, %u per %lu byte slab\n",
+               cache->name, cache->stride, cache->per_slab, 1UL << cache->order);
+
+    return cache;
+}
+
+
+/*
+ * Only succeeds once every object has been freed. Must not race
+ * with allocations or frees on the cache.
+ */
+int
+nk_slab_cache_destroy (struct nk_slab_cache * cache)
+{
+    int i;
+
+    for (i = 0; i < NAUT_CONFIG_MAX_CPUS; i++) {
+        struct slab_cpu * c = &cache->cpus[i];
+
+        slab_drain_remote(cache, c);
+        if (c->empty) {
+            slab_release(cache, c->empty);
+            c->empty = NULL;
+        }
+    }
+
+    if (cache->num_slabs) {
+        SLAB_ERROR("Cache %s still has %lu slabs in use\n", cache->name, cache->num_slabs);
+        return -1;
+    }
+
+    free(cache);
+    return 0;
+}
+
+
+void *
+nk_slab_alloc (struct nk_slab_cache * cache)
+{
+    uint8_t flags = irq_disable_save();
+    int cpu = my_cpu_id();
+    struct slab_cpu * c = &cache->cpus[cpu];
+    struct nk_slab * slab;
+    void * obj = NULL;
+
+    if (list_empty(&c->partial) && c->remote) {
+        slab_drain_remote(cache, c);
+    }
+
+    if (list_empty(&c->partial)) {
+        if (c->empty) {
+            slab = c->empty;
+            c->empty = NULL;
+        } else {
+            slab = slab_grow(cache, cpu);
+        }
+        if (!slab) {
+            goto out;
+        }
+        list_add(&slab->node, &c->partial);
+    }
+
+    slab = list_first_entry(&c->partial, struct nk_slab, node);
+    obj = slab->free;
+    slab->free = *obj_link(cache, obj);
+    slab->inuse++;
+
+    if (!slab->free) {
+        /* full, found again through slab_of() when an object comes back */
+        list_del_init(&slab->node);
+    }
+
+out:
+    irq_enable_restore(flags);
+    return obj;
+}
+
+
+void
+nk_slab_free (struct nk_slab_cache * cache, void * obj)
+{
+    struct nk_slab * slab;
+    struct slab_cpu * c;
+    uint8_t flags;
+    void * head;
+
+    if (!obj) {
+        return;
+    }
+
+    slab = slab_of(cache, obj);
+    c = &cache->cpus[slab->cpu];
+
+    flags = irq_disable_save();
+    if (slab->cpu == my_cpu_id()) {
+        slab_put(cache, c, slab, obj);
+    } else {
+        /* the owner collects these when it runs out of partial slabs */
+        do {
+            head = c->remote;
+            *obj_link(cache, obj) = head;
+        } while (atomic_cmpswap(c->remote, head, obj) != head);
+    }
+    irq_enable_restore(flags);
+}
+
+
+ulong_t
+nk_slab_cache_order (struct nk_slab_cache * cache)
+{
+    return cache->order;
+}
+
+
+struct nk_slab_cache *
+nk_slab_cache_of (void * obj, ulong_t order)
+{
+    return ((struct nk_slab *)((ulong_t)obj & ~((1UL << order) - 1)))->cache;
+}
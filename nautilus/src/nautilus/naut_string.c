@@ -24,6 +24,7 @@
 #include <nautilus/naut_string.h>
 #include <nautilus/naut_types.h>
 #include <nautilus/mm.h>
+#include <nautilus/cpuid.h>
 
 unsigned char _ctype[] = {
 _C,_C,_C,_C,_C,_C,_C,_C,			/* 0-7 */
@@ -53,8 +54,36 @@ _L,_L,_L,_L,_L,_L,_L,_P,_L,_L,_L,_L,_L,_L,_L,_L};      /* 240-255 */
 
 
 #ifdef NAUT_CONFIG_USE_NAUT_BUILTINS
+/*
+ * strlen(), strchr() and strcmp() go through str_ops. They start out as
+ * the plain byte loops, which is all we can use before fpu_init() has
+ * turned SSE on, and nk_string_simd_init() moves them to the SSE4.2
+ * versions below once every core has been through fpu_init().
+ */
+static size_t str_strlen_scalar (const char * str);
+static char * str_strchr_scalar (const char * s, int c);
+static int    str_strcmp_scalar (const char * s1, const char * s2);
+
+static struct {
+    size_t (*strlen)(const char *);
+    char * (*strchr)(const char *, int);
+    int    (*strcmp)(const char *, const char *);
+} str_ops = {
+    .strlen = str_strlen_scalar,
+    .strchr = str_strchr_scalar,
+    .strcmp = str_strcmp_scalar,
+};
+
+
 size_t 
 strlen (const char * str)
+{
+    return str_ops.strlen(str);
+}
+
+
+static size_t
+str_strlen_scalar (const char * str)
 {
     size_t ret = 0;
     while (str[ret] != 0) {
@@ -76,33 +105,228 @@ strnlen (const char * str, size_t max)
 }
 
 
-void *
+/*
+ * memcpy() and friends
+ *
+ * Every buffer copy in the kernel comes through here, so these move a
+ * word at a time and hand anything sizeable to the string instructions.
+ * How is decided once, by nk_string_init(), from CPUID: with ERMS, rep
+ * movsb/stosb beat anything we could write, without it rep movsq does,
+ * and past about half the last level cache the copy goes around the
+ * caches with movnti so it doesn't evict everything else on its way.
+ * Until then (early boot) the rep movsq path is used.
+ *
+ * Only general purpose registers are touched. These are called from
+ * interrupt handlers, which don't save FPU/SIMD state, and under lazy
+ * FPU switching a vector instruction here would make whatever thread
+ * happened to call us take the #NM and own the FPU.
+ */
+
+// below this many bytes the string instructions' startup costs too much
+#define STR_SMALL 64
+
+typedef uint64_t __attribute__((__may_alias__)) str_word_t;
+
+// rep movsb/stosb are fast (CPUID.7.0:EBX[9])
+static uint8_t str_erms = 0;
+// bytes from which copies and fills bypass the cache, 0 for never
+static size_t str_nt_thresh = 0;
+
+/*
+ * gcc turns a simple copy loop back into a call to memcpy(), which here
+ * is a call to ourselves
+ */
+#define STR_NO_LIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+
+static inline STR_NO_LIBCALL void
+str_copy_small (unsigned char * d, const unsigned char * s, size_t n)
+{
+    while (n >= 8) {
+        *(str_word_t *)d = *(const str_word_t *)s;
+        d += 8;
+        s += 8;
+        n -= 8;
+    }
+    while (n--) {
+        *d++ = *s++;
+    }
+}
+
+
+static inline STR_NO_LIBCALL void
+str_set_small (unsigned char * d, uint64_t w, size_t n)
+{
+    while (n >= 8) {
+        *(str_word_t *)d = w;
+        d += 8;
+        n -= 8;
+    }
+    while (n--) {
+        *d++ = (unsigned char)w;
+    }
+}
+
+
+static inline void
+str_rep_movsb (void * d, const void * s, size_t n)
+{
+    asm volatile ("rep movsb"
+                  : "+D"(d), "+S"(s), "+c"(n)
+                  :
+                  : "memory");
+}
+
+
+static inline void
+str_rep_movsq (void * d, const void * s, size_t nwords)
+{
+    asm volatile ("rep movsq"
+                  : "+D"(d), "+S"(s), "+c"(nwords)
+                  :
+                  : "memory");
+}
+
+
+static inline void
+str_rep_stosb (void * d, uint8_t c, size_t n)
+{
+    asm volatile ("rep stosb"
+                  : "+D"(d), "+c"(n)
+                  : "a"(c)
+                  : "memory");
+}
+
+
+static inline void
+str_rep_stosq (void * d, uint64_t w, size_t nwords)
+{
+    asm volatile ("rep stosq"
+                  : "+D"(d), "+c"(nwords)
+                  : "a"(w)
+                  : "memory");
+}
+
+
+/* dst is 8 byte aligned and n is a multiple of 32 */
+static inline void
+str_copy_nt (unsigned char * d, const unsigned char * s, size_t n)
+{
+    for (; n; n -= 32, d += 32, s += 32) {
+        uint64_t a = ((const str_word_t *)s)[0];
+        uint64_t b = ((const str_word_t *)s)[1];
+        uint64_t c = ((const str_word_t *)s)[2];
+        uint64_t e = ((const str_word_t *)s)[3];
+        asm volatile ("movnti %1, 0(%0)\n\t"
+                      "movnti %2, 8(%0)\n\t"
+                      "movnti %3, 16(%0)\n\t"
+                      "movnti %4, 24(%0)"
+                      :
+                      : "r"(d), "r"(a), "r"(b), "r"(c), "r"(e)
+                      : "memory");
+    }
+    // the stores are weakly ordered, make them visible like any others
+    asm volatile ("sfence" ::: "memory");
+}
+
+
+/* dst is 8 byte aligned and n is a multiple of 32 */
+static inline void
+str_set_nt (unsigned char * d, uint64_t w, size_t n)
+{
+    for (; n; n -= 32, d += 32) {
+        asm volatile ("movnti %1, 0(%0)\n\t"
+                      "movnti %1, 8(%0)\n\t"
+                      "movnti %1, 16(%0)\n\t"
+                      "movnti %1, 24(%0)"
+                      :
+                      : "r"(d), "r"(w)
+                      : "memory");
+    }
+    asm volatile ("sfence" ::: "memory");
+}
+
+
+void * STR_NO_LIBCALL
 memcpy (void * dst, const void * src, size_t n)
 {
     unsigned char * d = (unsigned char *)dst;
-    unsigned char * s = (unsigned char *)src;
+    const unsigned char * s = (const unsigned char *)src;
+    size_t head;
 
-    while (n--) {
-        *d++ = *s++;
+    if (n < STR_SMALL) {
+        str_copy_small(d, s, n);
+        return dst;
+    }
+
+    if (str_nt_thresh && n >= str_nt_thresh) {
+        head = -(addr_t)d & 7;
+        str_copy_small(d, s, head);
+        d += head;
+        s += head;
+        n -= head;
+        str_copy_nt(d, s, n & ~(size_t)31);
+        str_copy_small(d + (n & ~(size_t)31), s + (n & ~(size_t)31), n & 31);
+        return dst;
+    }
+
+    if (str_erms) {
+        str_rep_movsb(d, s, n);
+        return dst;
     }
 
+    // align the destination, stores crossing lines cost more than loads
+    head = -(addr_t)d & 7;
+    str_copy_small(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+    str_rep_movsq(d, s, n >> 3);
+    str_copy_small(d + (n & ~(size_t)7), s + (n & ~(size_t)7), n & 7);
+
     return dst;
 }
 
 
-void * 
+void * STR_NO_LIBCALL
 memset (void * dst, char c, size_t n)
 {
     unsigned char * d = (unsigned char *)dst;
-    while (n--) {
-        *d++ = c;
+    uint64_t w = 0x0101010101010101ULL * (unsigned char)c;
+    size_t head;
+
+    if (n < STR_SMALL) {
+        str_set_small(d, w, n);
+        return dst;
+    }
+
+    if (str_nt_thresh && n >= str_nt_thresh) {
+        head = -(addr_t)d & 7;
+        str_set_small(d, w, head);
+        d += head;
+        n -= head;
+        str_set_nt(d, w, n & ~(size_t)31);
+        str_set_small(d + (n & ~(size_t)31), w, n & 31);
+        return dst;
     }
 
+    if (str_erms) {
+        str_rep_stosb(d, (uint8_t)c, n);
+        return dst;
+    }
+
+    head = -(addr_t)d & 7;
+    str_set_small(d, w, head);
+    d += head;
+    n -= head;
+    str_rep_stosq(d, w, n >> 3);
+    str_set_small(d + (n & ~(size_t)7), w, n & 7);
+
     return dst;
 }
 
 
-void * 
+void * STR_NO_LIBCALL
 memmove (void * dst, const void * src, size_t n)
 {
     unsigned long int dstp = (long int) dst;
@@ -114,29 +338,27 @@ memmove (void * dst, const void * src, size_t n)
         /* Copy from the beginning to the end.  */
         dst = memcpy (dst, src, n);
     } else {
-        /* Copy from the end to the beginning.  */
-        srcp += n;
-        dstp += n;
-
-        /* If there not too few bytes to copy, use word copy.  */
-        if (n >= OP_T_THRES)
-        {
-            /* Copy just a few bytes to make DSTP aligned.  */
-            n -= dstp % OPSIZ;
-            BYTE_COPY_BWD (dstp, srcp, dstp % OPSIZ);
-
-            /* Copy from SRCP to DSTP taking advantage of the known
-               alignment of DSTP.  Number of bytes remaining is put
-               in the third argument, i.e. in LEN.  This number may
-               vary from machine to machine.  */
-
-            WORD_COPY_BWD (dstp, srcp, n, n);
+        /* Copy from the end to the beginning, a word at a time.  The
+           string instructions are slow with the direction flag set.  */
+        unsigned char * d = (unsigned char *)dst + n;
+        const unsigned char * s = (const unsigned char *)src + n;
+
+        /* Copy just a few bytes to make the end of DST aligned.  */
+        while (n && ((addr_t)d & 7)) {
+            *--d = *--s;
+            --n;
+        }
 
-            /* Fall out and copy the tail.  */
+        while (n >= 8) {
+            d -= 8;
+            s -= 8;
+            *(str_word_t *)d = *(const str_word_t *)s;
+            n -= 8;
         }
 
-        /* There are just a few bytes to copy.  Use byte memory operations.  */
-        BYTE_COPY_BWD (dstp, srcp, n);
+        while (n--) {
+            *--d = *--s;
+        }
     }
 
     return dst;
@@ -147,8 +369,15 @@ memmove (void * dst, const void * src, size_t n)
 int 
 memcmp (const void * s1_, const void * s2_, size_t n) 
 {
-    const char * s1 = s1_;
-    const char * s2 = s2_;
+    const unsigned char * s1 = s1_;
+    const unsigned char * s2 = s2_;
+
+    /* skip the equal words, the first difference is in the next one */
+    while (n >= 8 && *(const str_word_t *)s1 == *(const str_word_t *)s2) {
+        s1 += 8;
+        s2 += 8;
+        n  -= 8;
+    }
 
     while (n > 0) {
 
@@ -170,15 +399,25 @@ memcmp (const void * s1_, const void * s2_, size_t n)
 int 
 strcmp (const char * s1, const char * s2) 
 {
+    return str_ops.strcmp(s1, s2);
+}
+
+
+static int
+str_strcmp_scalar (const char * s1, const char * s2)
+{
+    const unsigned char * a = (const unsigned char *)s1;
+    const unsigned char * b = (const unsigned char *)s2;
+
     while (1) {
-    int cmp = (*s1 - *s2);
+    int cmp = (*a - *b);
 
-    if ((cmp != 0) || (*s1 == '\0') || (*s2 == '\0')) {
+    if ((cmp != 0) || (*a == '\0') || (*b == '\0')) {
         return cmp;
     }
 
-    ++s1;
-    ++s2;
+    ++a;
+    ++b;
     }
 }
 
@@ -362,13 +601,20 @@ strncpy (char * dest, const char * src, size_t limit)
 
 char * 
 strchr (const char * s, int c) 
+{
+    return str_ops.strchr(s, c);
+}
+
+
+static char *
+str_strchr_scalar (const char * s, int c) 
 {
     while (*s != '\0') {
-    if (*s == c)
+    if (*s == (char)c)
         return (char *)s;
     ++s;
     }
-    return 0;
+    return (char)c ? 0 : (char *)s;
 }
 
 
@@ -389,6 +635,152 @@ strrchr (const char * s, int c)
 }
 
 
+/*
+ * SSE4.2 versions of strlen(), strchr() and strcmp()
+ *
+ * pcmpistri looks at 16 bytes at a time. Its loads are kept from running
+ * off the end of a page the string doesn't reach into: strlen() and
+ * strchr() walk aligned blocks, strcmp() steps a byte at a time
+ * whenever either string is within 16 bytes of a page boundary.
+ *
+ * The xmm register used is put back before returning. Interrupt entry
+ * doesn't save FPU state and these are called from handlers (printk()),
+ * so whatever we borrow has to look untouched to the code we interrupted.
+ */
+
+static size_t
+str_strlen_sse42 (const char * str)
+{
+    uint8_t save[16] __attribute__((aligned(16)));
+    const char * p = str;
+    unsigned long idx;
+
+    for (; (addr_t)p & 15; ++p) {
+        if (*p == '\0') {
+            return p - str;
+        }
+    }
+
+    // equal each against the empty string: the index of the NUL
+    asm volatile ("movdqa %%xmm0, (%[save])\n\t"
+                  "pxor %%xmm0, %%xmm0\n\t"
+                  "sub $16, %[p]\n"
+                  "1:\n\t"
+                  "add $16, %[p]\n\t"
+                  "pcmpistri $0x08, (%[p]), %%xmm0\n\t"
+                  "jnz 1b\n\t"
+                  "movdqa (%[save]), %%xmm0"
+                  : [p] "+r"(p), "=&c"(idx)
+                  : [save] "r"(save)
+                  : "cc", "memory");
+
+    return p - str + idx;
+}
+
+
+static char *
+str_strchr_sse42 (const char * s, int c)
+{
+    uint8_t save[16] __attribute__((aligned(16)));
+    const char * p = s;
+    unsigned long idx;
+    uint8_t found;
+
+    if ((char)c == '\0') {
+        return (char *)s + str_strlen_sse42(s);
+    }
+
+    for (; (addr_t)p & 15; ++p) {
+        if (*p == (char)c) {
+            return (char *)p;
+        }
+        if (*p == '\0') {
+            return 0;
+        }
+    }
+
+    // equal any against {c}: stops at the first c or at the NUL
+    asm volatile ("movdqa %%xmm0, (%[save])\n\t"
+                  "movd %k[c], %%xmm0\n\t"
+                  "sub $16, %[p]\n"
+                  "1:\n\t"
+                  "add $16, %[p]\n\t"
+                  "pcmpistri $0x00, (%[p]), %%xmm0\n\t"
+                  "ja 1b\n\t"
+                  "setc %[found]\n\t"
+                  "movdqa (%[save]), %%xmm0"
+                  : [p] "+r"(p), "=&c"(idx), [found] "=&r"(found)
+                  : [save] "r"(save), [c] "r"((uint32_t)(unsigned char)c)
+                  : "cc", "memory");
+
+    return found ? (char *)p + idx : 0;
+}
+
+
+static int
+str_strcmp_sse42 (const char * s1, const char * s2)
+{
+    uint8_t save[16] __attribute__((aligned(16)));
+    const unsigned char * a = (const unsigned char *)s1;
+    const unsigned char * b = (const unsigned char *)s2;
+    unsigned long idx, t;
+    int state;
+
+    while (1) {
+        /*
+         * equal each, negated: the index of the first difference, the
+         * end of a shorter string counting as one. state is 1 for a
+         * difference, 2 if both strings ended together, 0 if a or b
+         * got too close to a page end.
+         */
+        asm volatile ("movdqa %%xmm0, (%[save])\n\t"
+                      "xor %k[st], %k[st]\n"
+                      "1:\n\t"
+                      "mov %[a], %[t]\n\t"
+                      "and $0xfff, %[t]\n\t"
+                      "cmp $0xff0, %[t]\n\t"
+                      "ja 4f\n\t"
+                      "mov %[b], %[t]\n\t"
+                      "and $0xfff, %[t]\n\t"
+                      "cmp $0xff0, %[t]\n\t"
+                      "ja 4f\n\t"
+                      "movdqu (%[a]), %%xmm0\n\t"
+                      "pcmpistri $0x18, (%[b]), %%xmm0\n\t"
+                      "jc 2f\n\t"
+                      "jz 3f\n\t"
+                      "add $16, %[a]\n\t"
+                      "add $16, %[b]\n\t"
+                      "jmp 1b\n"
+                      "2:\n\t"
+                      "mov $1, %k[st]\n\t"
+                      "jmp 4f\n"
+                      "3:\n\t"
+                      "mov $2, %k[st]\n"
+                      "4:\n\t"
+                      "movdqa (%[save]), %%xmm0"
+                      : [a] "+r"(a), [b] "+r"(b), [st] "=&r"(state),
+                        [t] "=&r"(t), "=&c"(idx)
+                      : [save] "r"(save)
+                      : "cc", "memory");
+
+        if (state == 1) {
+            return a[idx] - b[idx];
+        }
+
+        if (state == 2) {
+            return 0;
+        }
+
+        // a byte at a time over the page boundary
+        if (*a != *b || *a == '\0') {
+            return *a - *b;
+        }
+
+        ++a;
+        ++b;
+    }
+}
+
 #endif  /* USE_NAUT_BUILTINS */
 
 int 
@@ -580,4 +972,70 @@ str_toupper (char * s)
 }
 
 
+/*
+ * Pick the memcpy()/memset() strategy, once, on the BSP. The last level
+ * cache's size comes from the deterministic cache parameters leaf where
+ * there is one; without it we guess.
+ */
+void
+nk_string_init (void)
+{
+#ifdef NAUT_CONFIG_USE_NAUT_BUILTINS
+    cpuid_ret_t r;
+    size_t llc = 0;
+    uint32_t max, i;
+
+    cpuid(0, &r);
+    max = r.a;
+
+    if (max >= 7) {
+        cpuid_sub(7, 0, &r);
+        str_erms = !!(r.b & (1 << 9));
+    }
+
+    if (max >= 4) {
+        for (i = 0; ; i++) {
+            size_t size;
+            cpuid_sub(4, i, &r);
+            if ((r.a & 0x1f) == 0) {
+                break;
+            }
+            // ways * partitions * line size * sets
+            size = (size_t)(((r.b >> 22) & 0x3ff) + 1) *
+                   (((r.b >> 12) & 0x3ff) + 1) *
+                   ((r.b & 0xfff) + 1) *
+                   (r.c + 1);
+            if (size > llc) {
+                llc = size;
+            }
+        }
+    }
+
+    str_nt_thresh = llc ? llc / 2 : (1UL << 20);
+#endif
+}
 
+
+/*
+ * Move strlen() and friends to their SSE4.2 versions. Call once all of
+ * the cores have run fpu_init(), on one where SSE isn't enabled yet
+ * they would fault.
+ */
+void
+nk_string_simd_init (void)
+{
+#ifdef NAUT_CONFIG_USE_NAUT_BUILTINS
+    cpuid_ret_t r;
+
+    cpuid(1, &r);
+
+    // CPUID.1:ECX[20]
+    if (!(r.c & (1 << 20))) {
+        return;
+    }
+
+    str_ops.strlen = str_strlen_sse42;
+    str_ops.strchr = str_strchr_sse42;
+    str_ops.strcmp = str_strcmp_sse42;
+#endif
+}
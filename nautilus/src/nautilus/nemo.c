@@ -27,6 +27,8 @@
 #include <nautilus/irq.h>
 #include <nautilus/mm.h>
 #include <nautilus/naut_assert.h>
+#include <nautilus/atomic.h>
+#include <nautilus/smp.h>
 
 #include <dev/apic.h>
 
@@ -36,14 +38,50 @@
 #define NEMO_WARN(fmt, args...)  WARN_PRINT("NEMO: " fmt, ##args)
 
 
+/* 
+ * Events to a CPU go through a bounded MPSC ring of (event, payload)
+ * slots, so events in flight to the same CPU no longer overwrite
+ * each other. Senders only send an IPI if they are the one to raise
+ * ipi_pending, and the handler drains everything it finds, so a burst
+ * of events costs one interrupt.
+ *
+ * Broadcasts don't go through the rings; each one sets its event's
+ * bit in every other CPU's bcast mask. Broadcasting an event that is
+ * still pending on a CPU is coalesced into the pending one there.
+ */
+struct nemo_ring_slot {
+	volatile uint64_t seq;
+	nemo_event_id_t   eid;
+	uint64_t          payload;
+};
+
+#define NEMO_RING_MASK   (NEMO_RING_SIZE - 1)
+#define NEMO_BCAST_WORDS (NEMO_MAX_EVENTS / 64)
+
+struct nemo_cpu {
+	/* written by senders */
+	volatile uint64_t     tail;
+	volatile uint32_t     ipi_pending;
+	volatile uint64_t     bcast[NEMO_BCAST_WORDS];
+
+	/* only touched by the owning CPU */
+	uint64_t              head __align(64);
+	uint64_t              handled;
+	uint64_t              ipis;
+
+	struct nemo_ring_slot ring[NEMO_RING_SIZE] __align(64);
+};
+
+
 static nemo_event_t * nemo_action_table[NEMO_MAX_EVENTS] __align(64);
-static nemo_event_id_t nemo_lookup_table[NAUT_CONFIG_MAX_CPUS] __align(64);
+static struct nemo_cpu * nemo_cpus[NAUT_CONFIG_MAX_CPUS] __align(64);
+static int nemo_inited = 0;
 
 
 static inline int
 event_is_valid (nemo_event_id_t id)
 {
-	if (id < NEMO_MAX_EVENTS && 
+	if (id >= 0 && id < NEMO_MAX_EVENTS && 
 		nemo_action_table[id]) {
 		return 1;
 	}
@@ -52,21 +90,85 @@ event_is_valid (nemo_event_id_t id)
 }
 
 
+static inline void
+nemo_run_event (nemo_event_id_t eid, uint64_t payload)
+{
+	nemo_event_t * event = nemo_action_table[eid];
+
+	/* unregistered while it was in flight */
+	if (!event) {
+		return;
+	}
+
+	NEMO_DEBUG("Recv'd notification for task id=%u\n", eid);
+
+	if (event->data_action) {
+		event->data_action(payload, event->priv_data);
+	} else {
+		event->action();
+	}
+}
+
+
+/*
+ * At most NEMO_RING_SIZE ring entries per interrupt. Anything still
+ * there was posted after we cleared ipi_pending, so its sender has
+ * sent another IPI.
+ */
+static void
+nemo_drain (struct nemo_cpu * c)
+{
+	struct nemo_ring_slot * slot;
+	nemo_event_id_t eid;
+	uint64_t payload;
+	uint64_t w;
+	unsigned i;
+
+	for (i = 0; i < NEMO_BCAST_WORDS; i++) {
+		if (!c->bcast[i]) {
+			continue;
+		}
+		w = atomic_and(c->bcast[i], 0);
+		while (w) {
+			nemo_run_event(i * 64 + __builtin_ctzll(w), 0);
+			c->handled++;
+			w &= w - 1;
+		}
+	}
+
+	for (i = 0; i < NEMO_RING_SIZE; i++) {
+		slot = &c->ring[c->head & NEMO_RING_MASK];
+		if (slot->seq != c->head + 1) {
+			break;
+		}
+
+		eid     = slot->eid;
+		payload = slot->payload;
+		asm volatile ("" ::: "memory");
+
+		/* hand the slot back to producers one lap ahead */
+		slot->seq = c->head + NEMO_RING_SIZE;
+		c->head++;
+
+		nemo_run_event(eid, payload);
+		c->handled++;
+	}
+}
+
+
 static int
 nemo_ipi_event_recv (excp_entry_t * excp, excp_vec_t v)
 {
-	nemo_event_id_t eid = nemo_lookup_table[my_cpu_id()];
+	struct nemo_cpu * c = nemo_cpus[my_cpu_id()];
 
-	ASSERT(eid < NEMO_MAX_EVENTS);
-
-	nemo_event_t * event = nemo_action_table[eid];
+	ASSERT(c);
 
-	ASSERT(event);
-	ASSERT(event->action);
+	c->ipis++;
 
-	NEMO_DEBUG("Recv'd notification for task id=%u func=%p\n", eid, (void*)event->action);
+	/* locked, so it is ordered before the ring reads below */
+	atomic_and(c->ipi_pending, 0);
 
-	event->action();
+	nemo_drain(c);
 
 	IRQ_HANDLER_END();
 
@@ -74,16 +176,68 @@ nemo_ipi_event_recv (excp_entry_t * excp, excp_vec_t v)
 }
 
 
-void
-nemo_event_notify (nemo_event_id_t eid, int cpu)
+static int
+nemo_ring_post (struct nemo_cpu * c, nemo_event_id_t eid, uint64_t payload)
+{
+	struct nemo_ring_slot * slot;
+	uint64_t pos = c->tail;
+	uint64_t old;
+	sint64_t dif;
+
+	while (1) {
+		slot = &c->ring[pos & NEMO_RING_MASK];
+		dif  = (sint64_t)(slot->seq - pos);
+
+		if (dif == 0) {
+			old = atomic_cmpswap(c->tail, pos, pos + 1);
+			if (old == pos) {
+				break;
+			}
+			pos = old;
+		} else if (dif < 0) {
+			/* the target hasn't caught up a full lap */
+			return -1;
+		} else {
+			pos = c->tail;
+		}
+	}
+
+	slot->eid     = eid;
+	slot->payload = payload;
+	asm volatile ("" ::: "memory");
+	slot->seq     = pos + 1;
+
+	return 0;
+}
+
+
+int
+nemo_event_notify_data (nemo_event_id_t eid, int cpu, uint64_t payload)
 {
 	ASSERT(event_is_valid(eid));
-	ASSERT(cpu < NAUT_CONFIG_MAX_CPUS && cpu >= 0);
+	ASSERT(cpu < nk_get_num_cpus() && cpu >= 0);
 
-	unsigned remote_apic   = nk_get_nautilus_info()->sys.cpus[cpu]->lapic_id;
-	struct apic_dev * apic = per_cpu_get(apic);
+	struct nemo_cpu * c = nemo_cpus[cpu];
+
+	if (nemo_ring_post(c, eid, payload) != 0) {
+		NEMO_DEBUG("Event ring for core %d is full\n", cpu);
+		return -1;
+	}
 
-	apic_ipi(apic, remote_apic, NEMO_INT_VEC);
+	if (atomic_cmpswap(c->ipi_pending, 0, 1) == 0) {
+		unsigned remote_apic   = nk_get_nautilus_info()->sys.cpus[cpu]->lapic_id;
+		struct apic_dev * apic = per_cpu_get(apic);
+		apic_ipi(apic, remote_apic, NEMO_INT_VEC);
+	}
+
+	return 0;
+}
+
+
+int
+nemo_event_notify (nemo_event_id_t eid, int cpu)
+{
+	return nemo_event_notify_data(eid, cpu, 0);
 }
 
 
@@ -91,8 +245,42 @@ void
 nemo_event_broadcast (nemo_event_id_t eid)
 {
 	ASSERT(event_is_valid(eid));
-	struct apic_dev * apic = per_cpu_get(apic);
-	apic_bcast_ipi(apic, NEMO_INT_VEC);
+
+	uint64_t bit = 1ULL << (eid % 64);
+	int me   = my_cpu_id();
+	int need = 0;
+	int i;
+
+	for (i = 0; i < nk_get_num_cpus(); i++) {
+
+		if (i == me) {
+			continue;
+		}
+
+		/* still pending there from an earlier broadcast */
+		if (atomic_or(nemo_cpus[i]->bcast[eid / 64], bit) & bit) {
+			continue;
+		}
+
+		if (atomic_cmpswap(nemo_cpus[i]->ipi_pending, 0, 1) == 0) {
+			need = 1;
+		}
+	}
+
+	if (need) {
+		struct apic_dev * apic = per_cpu_get(apic);
+		apic_bcast_ipi(apic, NEMO_INT_VEC);
+	}
+}
+
+
+void
+nemo_get_stats (int cpu, uint64_t * handled, uint64_t * ipis)
+{
+	ASSERT(cpu < nk_get_num_cpus() && cpu >= 0);
+
+	*handled = nemo_cpus[cpu]->handled;
+	*ipis    = nemo_cpus[cpu]->ipis;
 }
 
 
@@ -111,11 +299,11 @@ allocate_event_id (void)
 }
 
 
-nemo_event_id_t
-nemo_register_event_action (void (*func)(void), void * priv_data)
+static nemo_event_id_t
+register_event (void (*func)(void), nemo_data_action_t data_func, void * priv_data)
 {
 
-	if (!func) {
+	if (!func && !data_func) {
 		NEMO_ERR("Invalid function provided to nemo_regiser_task\n");
 		return -1;
 	}
@@ -128,8 +316,9 @@ nemo_register_event_action (void (*func)(void), void * priv_data)
 	}
 	memset(new_event, 0, sizeof(nemo_event_t));
 
-	new_event->action    = func;
-	new_event->priv_data = priv_data;
+	new_event->action      = func;
+	new_event->data_action = data_func;
+	new_event->priv_data   = priv_data;
 
 	nemo_event_id_t id   = allocate_event_id();
 
@@ -152,6 +341,24 @@ out:
 }
 
 
+nemo_event_id_t
+nemo_register_event_action (void (*func)(void), void * priv_data)
+{
+	return register_event(func, NULL, priv_data);
+}
+
+
+/* 
+ * Like nemo_register_event_action, but the action gets the payload
+ * passed to nemo_event_notify_data (0 for a broadcast) and priv_data
+ */
+nemo_event_id_t
+nemo_register_event_data_action (nemo_data_action_t func, void * priv_data)
+{
+	return register_event(NULL, func, priv_data);
+}
+
+
 void
 nemo_unregister_event_action (nemo_event_id_t id)
 {
@@ -178,13 +385,41 @@ nemo_event_await (void)
 int
 nemo_init (void)
 {
+	int i, j;
+
+	if (nemo_inited) {
+		return 0;
+	}
+
+	for (i = 0; i < nk_get_num_cpus(); i++) {
+		nemo_cpus[i] = malloc(sizeof(struct nemo_cpu));
+		if (!nemo_cpus[i]) {
+			NEMO_ERR("Could not allocate event ring for core %d\n", i);
+			goto out_err;
+		}
+		memset(nemo_cpus[i], 0, sizeof(struct nemo_cpu));
+		for (j = 0; j < NEMO_RING_SIZE; j++) {
+			nemo_cpus[i]->ring[j].seq = j;
+		}
+	}
 
 	if (register_int_handler(NEMO_INT_VEC, nemo_ipi_event_recv, NULL) != 0) {
 		NEMO_ERR("Could not register Nemo interrupt handler\n");
-		return -1;
+		goto out_err;
 	}
+
+	nemo_inited = 1;
 	
 	return 0;
+
+out_err:
+	for (i = 0; i < nk_get_num_cpus(); i++) {
+		if (nemo_cpus[i]) {
+			free(nemo_cpus[i]);
+			nemo_cpus[i] = NULL;
+		}
+	}
+	return -1;
 }
 
 
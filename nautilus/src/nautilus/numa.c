@@ -90,25 +90,58 @@ has_htt (void)
     return !!(ret.d & (1<<28));
 }
 
+/* 
+ * subleaf n of 0xB describes one level, SMT first, with the number of
+ * APIC ID bits to shift off to get to the next level up
+ */
 static void 
 intel_probe_with_leafb (struct nk_topo_params *tp)
 {
-    panic("Intel CPUID leaf 0xB not currently supported\n");
+    cpuid_ret_t ret;
+    uint32_t level, type, shift;
+    uint32_t smt_shift = 0, core_shift = 0;
+
+    NUMA_DEBUG("Intel probing topo with leaf 0xB\n");
+
+    for (level = 0; level < 8; level++) {
+        cpuid_sub(0xb, level, &ret);
+        type  = (ret.c >> 8) & 0xff;
+        shift = ret.a & 0x1f;
+
+        if (type == 0) {
+            break;
+        } else if (type == 1) {
+            smt_shift = shift;
+        } else if (type == 2) {
+            core_shift = shift;
+        }
+    }
+
+    tp->smt_bits  = smt_shift;
+    tp->core_bits = (core_shift > smt_shift) ? core_shift - smt_shift : 0;
+}
+
+static inline uint32_t
+bits_for (uint32_t count)
+{
+    return (count > 1) ? ilog2(next_pow2(count)) : 0;
 }
 
 static void
 intel_probe_with_leaves14 (struct nk_topo_params * tp)
 {
     cpuid_ret_t ret;
+    uint32_t logical = get_max_id_per_pkg();
+
     if (cpuid_leaf_max() >= 0x4) {
         NUMA_DEBUG("Intel probing topo with leaves 1 and 4\n");
         cpuid_sub(4, 0, &ret);
-        uint32_t eax_bits = (ret.a >> 26) & 0xff;
-        tp->smt_bits  = next_pow2(get_max_id_per_pkg());
-        tp->core_bits = next_pow2(eax_bits >> tp->smt_bits);
+        uint32_t cores = ((ret.a >> 26) & 0x3f) + 1;
+        tp->core_bits = bits_for(cores);
+        tp->smt_bits  = bits_for(logical > cores ? logical / cores : 1);
     } else { 
         NUMA_DEBUG("Intel probing topo using leaf 1 only\n");
-        tp->smt_bits  = next_pow2(get_max_id_per_pkg());
+        tp->smt_bits  = bits_for(logical);
         tp->core_bits = 0;
     }
 }
@@ -151,7 +184,7 @@ amd_get_topo_secondary (struct nk_topo_params * tp)
 
     } else {
         NUMA_DEBUG("AMD probing topo using CPUID FN 0x0000_0001\n");
-        tp->core_bits = next_pow2(get_max_id_per_pkg());
+        tp->core_bits = bits_for(get_max_id_per_pkg());
         tp->smt_bits  = 0;
     }
 }
@@ -205,7 +238,7 @@ assign_core_coords (struct cpu * me, struct nk_cpu_coords * coord, struct nk_top
 
     coord->smt_id  = my_apic_id & ((1 << tp->smt_bits) - 1);
     coord->core_id = (my_apic_id >> tp->smt_bits) & ((1 << tp->core_bits) - 1);
-    coord->pkg_id  = my_apic_id & ~((1 << (tp->smt_bits + tp->core_bits)) - 1);
+    coord->pkg_id  = my_apic_id >> (tp->smt_bits + tp->core_bits);
 
     NUMA_DEBUG("Core OS ID: %u (APIC ID=0x%x):\n", me->id, my_apic_id);
     NUMA_DEBUG("\tLogical Core ID:  %u\n", coord->smt_id);
@@ -255,6 +288,144 @@ out_err:
 }
 
 
+/*
+ * SMT topology for the schedulers and for placement. Physical cores
+ * are numbered densely in the order their first CPU appears, and the
+ * spread order lists the first hardware thread of every physical core,
+ * then the second of every core, and so on. Until nk_topo_init() has
+ * run, and for CPUs that recorded no coordinates, every CPU is taken
+ * to be a core of its own.
+ */
+static struct {
+    int      ready;
+    unsigned threads_per_core;
+    unsigned num_cores;
+    uint32_t core[NAUT_CONFIG_MAX_CPUS];    /* physical core of each CPU */
+    uint32_t rank[NAUT_CONFIG_MAX_CPUS];    /* its place among the core's threads */
+    cpu_id_t spread[NAUT_CONFIG_MAX_CPUS];
+} topo;
+
+
+static int
+same_phys_core (struct cpu * a, struct cpu * b)
+{
+    if (!a->coord || !b->coord) {
+        return a == b;
+    }
+    return a->coord->pkg_id == b->coord->pkg_id &&
+           a->coord->core_id == b->coord->core_id;
+}
+
+
+/* 
+ *
+ * only called by BSP once, after every core has discovered its coordinates
+ *
+ */
+int
+nk_topo_init (void)
+{
+    struct sys_info * sys = &(nk_get_nautilus_info()->sys);
+    unsigned n = sys->num_cpus;
+    unsigned i, j, r, k = 0;
+
+    topo.num_cores        = 0;
+    topo.threads_per_core = 1;
+
+    for (i = 0; i < n; i++) {
+        topo.core[i] = topo.num_cores;
+        topo.rank[i] = 0;
+
+        for (j = 0; j < i; j++) {
+            if (same_phys_core(sys->cpus[i], sys->cpus[j])) {
+                topo.core[i] = topo.core[j];
+                topo.rank[i]++;
+            }
+        }
+
+        if (topo.rank[i] == 0) {
+            topo.num_cores++;
+        } else if (topo.rank[i] + 1 > topo.threads_per_core) {
+            topo.threads_per_core = topo.rank[i] + 1;
+        }
+    }
+
+    for (r = 0; r < topo.threads_per_core; r++) {
+        for (i = 0; i < n; i++) {
+            if (topo.rank[i] == r) {
+                topo.spread[k++] = i;
+            }
+        }
+    }
+
+    topo.ready = 1;
+
+    NUMA_PRINT("%u CPUs on %u physical cores, up to %u threads each\n",
+               n, topo.num_cores, topo.threads_per_core);
+
+    return 0;
+}
+
+
+unsigned
+nk_topo_threads_per_core (void)
+{
+    return topo.ready ? topo.threads_per_core : 1;
+}
+
+
+unsigned
+nk_topo_num_phys_cores (void)
+{
+    return topo.ready ? topo.num_cores : nk_get_num_cpus();
+}
+
+
+unsigned
+nk_topo_phys_core (cpu_id_t cpu)
+{
+    return topo.ready ? topo.core[cpu] : cpu;
+}
+
+
+int
+nk_topo_same_core (cpu_id_t a, cpu_id_t b)
+{
+    return topo.ready ? topo.core[a] == topo.core[b] : a == b;
+}
+
+
+int
+nk_topo_siblings (cpu_id_t cpu, cpu_id_t * sibs, int max)
+{
+    unsigned i, n = nk_get_num_cpus();
+    int count = 0;
+
+    if (!topo.ready || topo.threads_per_core == 1) {
+        return 0;
+    }
+
+    for (i = 0; i < n && count < max; i++) {
+        if (i != cpu && topo.core[i] == topo.core[cpu]) {
+            sibs[count++] = i;
+        }
+    }
+
+    return count;
+}
+
+
+cpu_id_t
+nk_topo_spread_cpu (unsigned idx)
+{
+    unsigned n = nk_get_num_cpus();
+
+    idx %= n;
+
+    return topo.ready ? topo.spread[idx] : idx;
+}
+
+
 
 static void 
 dump_mem_regions (struct numa_domain * d)
@@ -358,23 +529,24 @@ __associate_domains_slit (struct nk_locality_info * loc)
             if (j == i) continue;
 
             struct domain_adj_entry * new_dom_ent = mm_boot_alloc(sizeof(struct domain_adj_entry));
+            struct domain_adj_entry * ent = NULL;
+            struct list_head * at = &(loc->domains[i]->adj_list);
+            uint8_t dist_to_j = *(loc->numa_matrix + i*loc->num_domains + j);
+
             new_dom_ent->domain = loc->domains[j];
-            if (list_empty(&(loc->domains[i]->adj_list))) {
-                list_add(&(new_dom_ent->list_ent), &(loc->domains[i]->adj_list));
-            } else {
-                struct domain_adj_entry * ent = NULL;
-                list_for_each_entry(ent, &(loc->domains[i]->adj_list), list_ent) {
-                    uint8_t dist_to_j = *(loc->numa_matrix + i*loc->num_domains + j);
-                    uint8_t dist_to_other = *(loc->numa_matrix + i*loc->num_domains + ent->domain->id);
-
-                    if (dist_to_j < dist_to_other) {
-                        list_add_tail(&(new_dom_ent->list_ent), &(ent->list_ent));
-                        continue;
-                    }
+
+            /* in front of the first domain that is farther away */
+            list_for_each_entry(ent, &(loc->domains[i]->adj_list), list_ent) {
+                uint8_t dist_to_other = *(loc->numa_matrix + i*loc->num_domains + ent->domain->id);
+
+                if (dist_to_j < dist_to_other) {
+                    at = &(ent->list_ent);
+                    break;
                 }
-                list_add_tail(&(new_dom_ent->list_ent), &(loc->domains[i]->adj_list));
             }
 
+            list_add_tail(&(new_dom_ent->list_ent), at);
+
         }
     }
 }
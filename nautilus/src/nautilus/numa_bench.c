@@ -0,0 +1,439 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/numa.h>
+#include <nautilus/mm.h>
+#include <nautilus/irq.h>
+#include <nautilus/thread.h>
+#include <nautilus/smp.h>
+#include <nautilus/naut_string.h>
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+#include <nautilus/rt_scheduler.h>
+#endif
+
+/*
+ * Measured NUMA costs.
+ *
+ * For every CPU and every memory domain we time a dependent pointer
+ * chase through a buffer well beyond the LLC, for load latency, and a
+ * STREAM triad (a = b + s*c, SSE2 through GCC vectors), for
+ * bandwidth. CPUs are measured one after another, each by a thread
+ * bound to it with interrupts off, so the numbers are not disturbed
+ * by other cores or by the CPU's own timer.
+ *
+ * The results replace the firmware's view. numa_matrix becomes the
+ * measured latency between domains scaled like the SLIT (10 is local),
+ * each domain's adjacency list is resorted by it, and each CPU's
+ * allocation order is resorted by that CPU's own latencies. The SLIT
+ * is kept in slit_matrix.
+ */
+
+#define NUMA_BENCH_BYTES  (NAUT_CONFIG_NUMA_BENCH_MB * 1024ULL * 1024ULL)
+#define NUMA_BENCH_LINE   64
+#define NUMA_BENCH_LOADS  (1 << 18)
+#define NUMA_BENCH_REPS   4
+
+#define NUMA_PRINT(fmt, args...) printk("NUMA: " fmt, ##args)
+#define NUMA_ERROR(fmt, args...) ERROR_PRINT("NUMA: " fmt, ##args)
+
+typedef double v2df __attribute__ ((vector_size (16)));
+
+struct bench_arg {
+    void ** chase[MAX_NUMA_DOMAINS];
+    char * buf[MAX_NUMA_DOMAINS];
+    uint32_t * lat;     /* this CPU's row */
+    uint32_t * bw;
+};
+
+
+static inline uint64_t
+bench_rand (uint64_t * state)
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ULL;
+}
+
+/*
+ * Link every line of buf into one cycle in random order (Sattolo's
+ * shuffle), so each load depends on the last and the prefetchers
+ * cannot guess the next one.
+ */
+static void **
+build_chase (char * buf, uint64_t bytes)
+{
+    uint64_t lines = bytes / NUMA_BENCH_LINE;
+    uint64_t seed = rdtsc() | 1;
+    uint32_t * perm = malloc(lines * sizeof(uint32_t));
+    uint64_t i;
+
+    if (!perm) {
+        return NULL;
+    }
+
+    for (i = 0; i < lines; i++) {
+        perm[i] = i;
+    }
+
+    for (i = lines - 1; i > 0; i--) {
+        uint64_t j = bench_rand(&seed) % i;
+        uint32_t t = perm[i];
+        perm[i] = perm[j];
+        perm[j] = t;
+    }
+
+    for (i = 0; i < lines; i++) {
+        *(void **)(buf + i * NUMA_BENCH_LINE) = buf + (uint64_t)perm[i] * NUMA_BENCH_LINE;
+    }
+
+    free(perm);
+
+    return (void **)buf;
+}
+
+
+static inline uint64_t
+cycles_to_ns (uint64_t cycles)
+{
+    return cycles * 1000000ULL / per_cpu_get(cpu_khz);
+}
+
+/* average cycles to follow one pointer, in ns */
+static uint32_t
+time_chase (void ** start)
+{
+    void ** p = start;
+    uint64_t t0, t1;
+    int i;
+
+    /* one short lap to get the TLB and page walk caches warm */
+    for (i = 0; i < NUMA_BENCH_LOADS / 16; i++) {
+        p = (void **)*p;
+    }
+
+    t0 = rdtsc();
+    for (i = 0; i < NUMA_BENCH_LOADS; i++) {
+        p = (void **)*p;
+    }
+    t1 = rdtsc();
+
+    asm volatile ("" : : "r" (p));
+
+    return cycles_to_ns(t1 - t0) / NUMA_BENCH_LOADS;
+}
+
+/* best-of triad bandwidth over a, b and c, in MB/s */
+static uint32_t
+time_triad (char * buf)
+{
+    uint64_t n = NUMA_BENCH_BYTES / 3 / sizeof(v2df);
+    v2df * a = (v2df *)buf;
+    v2df * b = a + n;
+    v2df * c = b + n;
+    v2df s = { 3.0, 3.0 };
+    uint64_t best = -1ULL, t0, ns, i;
+    int r;
+
+    for (i = 0; i < n; i++) {
+        b[i] = (v2df){ 1.0, 1.0 };
+        c[i] = (v2df){ 2.0, 2.0 };
+    }
+
+    for (r = 0; r < NUMA_BENCH_REPS; r++) {
+        t0 = rdtsc();
+        for (i = 0; i < n; i++) {
+            a[i] = b[i] + s * c[i];
+        }
+        t0 = rdtsc() - t0;
+        if (t0 < best) {
+            best = t0;
+        }
+    }
+
+    ns = cycles_to_ns(best);
+    if (!ns) {
+        return 0;
+    }
+
+    /* STREAM counts two reads and one write per element */
+    return (3 * n * sizeof(v2df) * 1000ULL) / ns;
+}
+
+static void
+bench_cpu (void * in, void ** out)
+{
+    struct bench_arg * arg = (struct bench_arg *)in;
+    unsigned d, n = nk_get_num_domains();
+    uint8_t flags;
+
+    for (d = 0; d < n; d++) {
+        if (!arg->buf[d]) {
+            arg->lat[d] = arg->bw[d] = 0;
+            continue;
+        }
+
+        flags = irq_disable_save();
+        arg->lat[d] = time_chase(arg->chase[d]);
+        arg->bw[d]  = time_triad(arg->buf[d]);
+        irq_enable_restore(flags);
+    }
+}
+
+
+static int
+bench_on (cpu_id_t cpu, struct bench_arg * arg)
+{
+    nk_thread_id_t tid;
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    rt_constraints c = { .aperiodic = { .priority = 0 } };
+
+    if (nk_thread_start(bench_cpu, arg, NULL, 0, TSTACK_DEFAULT, &tid, cpu,
+                        APERIODIC, &c, 0) != 0) {
+#else
+    if (nk_thread_start(bench_cpu, arg, NULL, 0, TSTACK_DEFAULT, &tid, cpu) != 0) {
+#endif
+        return -1;
+    }
+
+    return nk_join(tid, NULL);
+}
+
+
+/* 
+ * Domain i to j is the mean over the CPUs in i, scaled so that i to
+ * itself is 10. Domains without CPUs keep what the SLIT said.
+ */
+static void
+update_distances (struct sys_info * sys, uint8_t * m)
+{
+    struct nk_locality_info * loc = &sys->locality_info;
+    unsigned n = loc->num_domains;
+    unsigned i, j, c;
+
+    for (i = 0; i < n; i++) {
+        uint64_t sum[MAX_NUMA_DOMAINS];
+        unsigned cpus = 0;
+
+        memset(sum, 0, sizeof(sum));
+
+        for (c = 0; c < sys->num_cpus; c++) {
+            if (sys->cpus[c]->domain->id != i) {
+                continue;
+            }
+            for (j = 0; j < n; j++) {
+                sum[j] += loc->lat_ns[c * n + j];
+            }
+            cpus++;
+        }
+
+        if (!cpus || !sum[i]) {
+            continue;
+        }
+
+        for (j = 0; j < n; j++) {
+            uint64_t d = (i == j) ? 10 : (10 * sum[j] + sum[i] / 2) / sum[i];
+            m[i * n + j] = d > 254 ? 254 : (d < 10 ? 10 : d);
+        }
+    }
+}
+
+static void
+sort_adj_list (struct nk_locality_info * loc, struct numa_domain * d)
+{
+    struct list_head sorted;
+    struct domain_adj_entry * ent = NULL;
+    unsigned n = loc->num_domains;
+
+    INIT_LIST_HEAD(&sorted);
+
+    while (!list_empty(&d->adj_list)) {
+        struct domain_adj_entry * first = list_first_entry(&d->adj_list, struct domain_adj_entry, list_ent);
+        struct list_head * at = &sorted;
+
+        list_for_each_entry_reverse(ent, &sorted, list_ent) {
+            if (loc->numa_matrix[d->id * n + ent->domain->id] <=
+                loc->numa_matrix[d->id * n + first->domain->id]) {
+                at = &ent->list_ent;
+                break;
+            }
+        }
+
+        list_del(&first->list_ent);
+        list_add(&first->list_ent, at);
+    }
+
+    list_splice(&sorted, &d->adj_list);
+}
+
+static void
+order_regions (void * arg)
+{
+    kmem_order_regions((const uint32_t *)arg);
+}
+
+
+void
+nk_numa_bench_dump (void)
+{
+    struct sys_info * sys = &(nk_get_nautilus_info()->sys);
+    struct nk_locality_info * loc = &sys->locality_info;
+    unsigned n = loc->num_domains;
+    unsigned c, d;
+
+    if (!loc->lat_ns) {
+        return;
+    }
+
+    printk("Measured NUMA latency (ns) / triad bandwidth (MB/s):\n");
+    printk("CPU ");
+    for (d = 0; d < n; d++) {
+        printk("   Domain %02u   ", d);
+    }
+    printk("\n");
+
+    for (c = 0; c < sys->num_cpus; c++) {
+        printk("%03u ", c);
+        for (d = 0; d < n; d++) {
+            printk("%5u / %6u  ", loc->lat_ns[c * n + d], loc->bw_mbs[c * n + d]);
+        }
+        printk("\n");
+    }
+}
+
+
+/*
+ * Measure every CPU against every domain and feed the results back
+ * into the locality info. Only meant to be run once, from the BSP,
+ * before anything latency sensitive is running.
+ */
+int
+nk_numa_bench (void)
+{
+    struct sys_info * sys = &(nk_get_nautilus_info()->sys);
+    struct nk_locality_info * loc = &sys->locality_info;
+    unsigned n = loc->num_domains;
+    struct bench_arg arg;
+    uint32_t * lat, * bw;
+    uint8_t * m;
+    unsigned c, d, missing = 0;
+    int rc = -1;
+
+    memset(&arg, 0, sizeof(arg));
+
+    lat = malloc(sys->num_cpus * n * sizeof(uint32_t));
+    bw  = malloc(sys->num_cpus * n * sizeof(uint32_t));
+    m   = malloc(n * n);
+
+    if (!lat || !bw || !m) {
+        NUMA_ERROR("Could not allocate benchmark results\n");
+        goto out;
+    }
+
+    memset(lat, 0, sys->num_cpus * n * sizeof(uint32_t));
+    memset(bw, 0, sys->num_cpus * n * sizeof(uint32_t));
+
+    for (d = 0; d < n; d++) {
+        arg.buf[d] = malloc_node(NUMA_BENCH_BYTES, d);
+        if (!arg.buf[d] || !(arg.chase[d] = build_chase(arg.buf[d], NUMA_BENCH_BYTES))) {
+            NUMA_ERROR("Could not set up a %lu MB buffer in domain %u, skipping it\n",
+                       NUMA_BENCH_BYTES >> 20, d);
+            if (arg.buf[d]) {
+                free(arg.buf[d]);
+                arg.buf[d] = NULL;
+            }
+            missing++;
+        }
+    }
+
+    NUMA_PRINT("Measuring %u CPUs against %u domains\n", sys->num_cpus, n);
+
+    for (c = 0; c < sys->num_cpus; c++) {
+        arg.lat = &lat[c * n];
+        arg.bw  = &bw[c * n];
+        if (bench_on(c, &arg)) {
+            NUMA_ERROR("Could not run the benchmark on CPU %u\n", c);
+            goto out;
+        }
+    }
+
+    loc->lat_ns = lat;
+    loc->bw_mbs = bw;
+    lat = bw = NULL;
+
+    /* a partial picture would sort the unmeasured domains first */
+    if (missing) {
+        NUMA_ERROR("%u domains unmeasured, keeping the firmware distances\n", missing);
+        nk_numa_bench_dump();
+        rc = 0;
+        goto out;
+    }
+
+    /* start from the firmware's view, or a flat one without a SLIT */
+    if (loc->numa_matrix) {
+        memcpy(m, loc->numa_matrix, n * n);
+    } else {
+        for (c = 0; c < n; c++) {
+            for (d = 0; d < n; d++) {
+                m[c * n + d] = (c == d) ? 10 : 20;
+            }
+        }
+    }
+    update_distances(sys, m);
+
+    /* readers index whichever matrix they see, the old one stays valid */
+    loc->slit_matrix = loc->numa_matrix;
+    __sync_synchronize();
+    loc->numa_matrix = m;
+    m = NULL;
+
+    for (d = 0; d < n; d++) {
+        sort_adj_list(loc, loc->domains[d]);
+    }
+
+    for (c = 0; c < sys->num_cpus; c++) {
+        smp_xcall(c, order_regions, &loc->lat_ns[c * n], 1);
+    }
+
+    nk_numa_bench_dump();
+    rc = 0;
+
+out:
+    for (d = 0; d < n; d++) {
+        if (arg.buf[d]) {
+            free(arg.buf[d]);
+        }
+    }
+    if (lat) {
+        free(lat);
+    }
+    if (bw) {
+        free(bw);
+    }
+    if (m) {
+        free(m);
+    }
+    return rc;
+}
@@ -35,6 +35,7 @@
 #include <nautilus/mm.h>
 #include <lib/bitmap.h>
 #include <nautilus/percpu.h>
+#include <nautilus/spinlock.h>
 
 #ifdef NAUT_CONFIG_XEON_PHI
 #include <nautilus/sfi.h>
@@ -44,6 +45,15 @@
 #include <arch/hrt/hrt.h>
 #endif
 
+#ifdef NAUT_CONFIG_TLB_SHOOTDOWN
+#include <nautilus/tlb.h>
+#endif
+
+#if defined(NAUT_CONFIG_PAGE_FAULT_STATS) && defined(NAUT_CONFIG_USE_RT_SCHEDULER)
+#include <nautilus/thread.h>
+#include <nautilus/rt_scheduler.h>
+#endif
+
 #ifndef NAUT_CONFIG_DEBUG_PAGING
 #undef DEBUG_PRINT
 #define DEBUG_PRINT(fmt, args...)
@@ -104,6 +114,18 @@ largest_page_size (void)
     return PS_2M;
 }
 
+
+/*
+ * the page size the kernel identity map is built with, 
+ * so every suitably aligned block of this size is covered by
+ * a single TLB entry
+ */
+page_size_t
+nk_kern_page_size (void)
+{
+    return largest_page_size();
+}
+
 /*
 static int 
 drill_pt (pte_t * pt, addr_t addr, addr_t map_addr, uint64_t flags)
@@ -195,6 +217,55 @@ drill_pd (pde_t * pd, addr_t addr, addr_t map_addr, uint64_t flags)
 }
 
 
+/*
+ * page table pages needed after boot (e.g. to split a large
+ * page for an uncached device mapping) come from kmem once the
+ * boot allocator has been retired
+ */
+static void *
+alloc_pt_page (void)
+{
+    void * page = boot_mm_inactive ? malloc(PAGE_SIZE_4KB) : 
+                                     mm_boot_alloc_aligned(PAGE_SIZE_4KB, PAGE_SIZE_4KB);
+
+    if (page) {
+        memset(page, 0, PAGE_SIZE_4KB);
+    }
+
+    return page;
+}
+
+
+/*
+ * replace a 1GB mapping with a page directory of 2MB pages that
+ * translate exactly the same range, so a single 2MB entry in it can
+ * then be changed
+ */
+static pde_t *
+split_1gb_page (pdpte_t * pdpte)
+{
+    ulong_t base  = *pdpte & PTE_ADDR_MASK & ~(PAGE_SIZE_1GB - 1);
+    ulong_t flags = *pdpte & ((1ULL << PAGE_SHIFT_4KB) - 1);
+    pde_t * pd    = alloc_pt_page();
+    unsigned i;
+
+    if (!pd) {
+        return NULL;
+    }
+
+    for (i = 0; i < NUM_PD_ENTRIES; i++) {
+        pd[i] = (base + i * PAGE_SIZE_2MB) | flags;
+    }
+
+    *pdpte = (ulong_t)pd | PTE_PRESENT_BIT | PTE_WRITABLE_BIT;
+
+    /* the translations are unchanged, only their size is */
+    write_cr3(read_cr3());
+
+    return pd;
+}
+
+
 static int 
 drill_pdpt (pdpte_t * pdpt, addr_t addr, addr_t map_addr, uint64_t flags)
 {
@@ -203,7 +274,17 @@ drill_pdpt (pdpte_t * pdpt, addr_t addr, addr_t map_addr, uint64_t flags)
 
     DEBUG_PRINT("drilling pdpt, pdpt idx: 0x%x\n", pdpt_idx);
 
-    if (PDPTE_PRESENT(pdpt[pdpt_idx])) {
+    if (PDPTE_PRESENT(pdpt[pdpt_idx]) && (pdpt[pdpt_idx] & PTE_PAGE_SIZE_BIT)) {
+
+        DEBUG_PRINT("pdpt entry is a 1GB page, splitting it\n");
+        pd = split_1gb_page(&pdpt[pdpt_idx]);
+
+        if (!pd) {
+            ERROR_PRINT("out of memory in %s\n", __FUNCTION__);
+            return -EINVAL;
+        }
+
+    } else if (PDPTE_PRESENT(pdpt[pdpt_idx])) {
 
         DEBUG_PRINT("pdpt entry is present\n");
         pd = (pde_t*)(pdpt[pdpt_idx] & PTE_ADDR_MASK);
@@ -211,7 +292,7 @@ drill_pdpt (pdpte_t * pdpt, addr_t addr, addr_t map_addr, uint64_t flags)
     } else {
 
         DEBUG_PRINT("pdpt entry not there, creating a new page directory\n");
-        pd = (pde_t*)mm_boot_alloc_aligned(PAGE_SIZE_4KB, PAGE_SIZE_4KB);
+        pd = (pde_t*)alloc_pt_page();
         DEBUG_PRINT("page dir allocated at %p\n", pd);
 
         if (!pd) {
@@ -219,8 +300,6 @@ drill_pdpt (pdpte_t * pdpt, addr_t addr, addr_t map_addr, uint64_t flags)
             return -EINVAL;
         }
 
-        memset((void*)pd, 0, NUM_PD_ENTRIES*sizeof(pde_t));
-
         pdpt[pdpt_idx] = (ulong_t)pd | PTE_PRESENT_BIT | PTE_WRITABLE_BIT;
 
     }
@@ -284,6 +363,13 @@ nk_map_page (addr_t vaddr, addr_t paddr, uint64_t flags, page_size_t ps)
         return -EINVAL;
     }
 
+#ifdef NAUT_CONFIG_TLB_SHOOTDOWN
+    {
+        struct nk_tlb_range r = { ROUND_DOWN_TO_PAGE(paddr), PAGE_SIZE, PAGE_SIZE };
+        nk_tlb_shootdown(&r, 1);
+    }
+#endif
+
     return 0;
 }
 
@@ -311,11 +397,107 @@ nk_map_page_nocache (addr_t paddr, uint64_t flags, page_size_t ps)
     return 0;
 }
 
+#ifdef NAUT_CONFIG_THREAD_LAZY_STACKS
+static int vstack_map (addr_t addr);
+#endif
+
+#define PF_WRITE_MASK 0x2
+#define PF_RSVD_MASK  0x8
+
+/* physical address held in a paging entry, as a pointer we can use */
+#define PF_TABLE(e) ((uint64_t*)pa_to_va((e) & 0x000ffffffffff000ULL))
+
+
+/*
+ * did this fault happen on a translation that is valid now? That is
+ * a TLB entry that was stale, or a mapping another core finished
+ * while we were faulting on it; all it needs is the INVLPG
+ */
+static int
+pf_spurious (addr_t addr, ulong_t err)
+{
+    uint64_t need = PTE_PRESENT_BIT | ((err & PF_WRITE_MASK) ? PTE_WRITABLE_BIT : 0);
+    uint64_t * table = PF_TABLE(read_cr3());
+    uint64_t e;
+
+    if (err & PF_RSVD_MASK) {
+        return 0;
+    }
+
+    e = table[PADDR_TO_PML4_IDX(addr)];
+    if ((e & need) != need) {
+        return 0;
+    }
+
+    e = PF_TABLE(e)[PADDR_TO_PDPT_IDX(addr)];
+    if ((e & need) != need) {
+        return 0;
+    }
+
+    if (!(e & PTE_PAGE_SIZE_BIT)) {
+        e = PF_TABLE(e)[PADDR_TO_PD_IDX(addr)];
+        if ((e & need) != need) {
+            return 0;
+        }
+
+        if (!(e & PTE_PAGE_SIZE_BIT)) {
+            e = PF_TABLE(e)[PADDR_TO_PT_IDX(addr)];
+            if ((e & need) != need) {
+                return 0;
+            }
+        }
+    }
+
+    invlpg(addr);
+    return 1;
+}
+
+
+#ifdef NAUT_CONFIG_PAGE_FAULT_STATS
+/* one cache line or more per CPU, so counting never shares lines */
+static struct pf_cpu_stats {
+    struct nk_pf_stats s;
+} __align(64) pf_stats[NAUT_CONFIG_MAX_CPUS];
+
+static inline void
+pf_account (cpu_id_t id, nk_pf_type_t type, uint64_t start)
+{
+    struct nk_pf_stats * s;
+
+    if (id >= NAUT_CONFIG_MAX_CPUS) {
+        return;
+    }
+
+    /* only ever written by its own CPU, with interrupts off */
+    s = &pf_stats[id].s;
+    s->count[type]++;
+
+    if (type != NK_PF_FATAL) {
+        s->cycles += rdtsc() - start;
+    }
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    {
+        nk_thread_t * t = get_cur_thread();
+        if (t && t->rt_thread && t->rt_thread->type != APERIODIC) {
+            s->rt++;
+        }
+    }
+#endif
+}
+
+#define PF_ACCOUNT(id, type, start) pf_account(id, type, start)
+#else
+#define PF_ACCOUNT(id, type, start)
+#endif
+
 
 /*
  * nk_pf_handler
  *
- * page fault handler
+ * page fault handler. Faults we can resolve (HRT upcalls, lazy
+ * stack growth, spurious faults) return straight away; only the
+ * fatal ones print
  *
  */
 int
@@ -325,13 +507,34 @@ nk_pf_handler (excp_entry_t * excp,
 {
 
     cpu_id_t id = cpu_info_ready ? my_cpu_id() : 0xffffffff;
+#ifdef NAUT_CONFIG_PAGE_FAULT_STATS
+    uint64_t start = rdtsc();
+#endif
 
 #ifdef NAUT_CONFIG_HVM_HRT
     if (excp->error_code == UPCALL_MAGIC_ERROR) {
+        PF_ACCOUNT(id, NK_PF_UPCALL, start);
         return nautilus_hrt_upcall_handler(NULL, 0);
     }
 #endif
 
+#ifdef NAUT_CONFIG_THREAD_LAZY_STACKS
+    if (nk_vstack_owns((void*)fault_addr)) {
+        if (likely(vstack_map(fault_addr) == 0)) {
+            PF_ACCOUNT(id, NK_PF_STACK, start);
+            return 0;
+        }
+        printk("\n+++ Stack overflow or out of stack pages at 0x%llx +++\n", fault_addr);
+    }
+#endif
+
+    if (pf_spurious(fault_addr, excp->error_code)) {
+        PF_ACCOUNT(id, NK_PF_SPURIOUS, start);
+        return 0;
+    }
+
+    PF_ACCOUNT(id, NK_PF_FATAL, start);
+
     printk("\n+++ Page Fault +++\n"
             "RIP: %p    Fault Address: 0x%llx \n"
             "Error Code: 0x%x    (core=%u)\n", 
@@ -349,6 +552,80 @@ nk_pf_handler (excp_entry_t * excp,
 }
 
 
+#ifdef NAUT_CONFIG_PAGE_FAULT_STATS
+/*
+ * nk_pf_stats
+ *
+ * copy out one CPU's fault counters, or the sum over all CPUs
+ * if cpu is negative
+ *
+ */
+int
+nk_pf_stats (int cpu, struct nk_pf_stats * stats)
+{
+    int ncpus = cpu_info_ready ? nk_get_num_cpus() : 1;
+    int i, t;
+
+    if (cpu >= ncpus || cpu >= NAUT_CONFIG_MAX_CPUS) {
+        return -EINVAL;
+    }
+
+    if (cpu >= 0) {
+        *stats = pf_stats[cpu].s;
+        return 0;
+    }
+
+    memset(stats, 0, sizeof(struct nk_pf_stats));
+
+    for (i = 0; i < ncpus && i < NAUT_CONFIG_MAX_CPUS; i++) {
+        for (t = 0; t < NK_PF_TYPES; t++) {
+            stats->count[t] += pf_stats[i].s.count[t];
+        }
+        stats->cycles += pf_stats[i].s.cycles;
+        stats->rt     += pf_stats[i].s.rt;
+    }
+
+    return 0;
+}
+
+
+void
+nk_pf_stats_dump (void)
+{
+    int ncpus = cpu_info_ready ? nk_get_num_cpus() : 1;
+    struct nk_pf_stats s;
+    int i;
+
+    for (i = -1; i < ncpus; i++) {
+        uint64_t handled;
+
+        if (nk_pf_stats(i, &s) != 0) {
+            break;
+        }
+
+        handled = s.count[NK_PF_STACK] + s.count[NK_PF_SPURIOUS] + s.count[NK_PF_UPCALL];
+
+        if (i >= 0 && !handled && !s.count[NK_PF_FATAL]) {
+            continue;
+        }
+
+        if (i < 0) {
+            printk("Page faults on %d CPUs:\n", ncpus);
+            printk("    total  : ");
+        } else {
+            printk("    CPU %3d: ", i);
+        }
+
+        printk("%lu stack, %lu spurious, %lu upcall, %lu fatal, "
+               "%lu on RT threads, %lu cycles/handled fault\n",
+               s.count[NK_PF_STACK], s.count[NK_PF_SPURIOUS],
+               s.count[NK_PF_UPCALL], s.count[NK_PF_FATAL],
+               s.rt, handled ? s.cycles / handled : 0);
+    }
+}
+#endif
+
+
 /* don't really use the page size here, unless we get bigger pages 
  * someday
  */
@@ -507,98 +784,402 @@ __construct_tables_4k (pml4e_t * pml, ulong_t bytes)
 }
 
 
-static void
-__construct_tables_2m (pml4e_t * pml, ulong_t bytes)
+/*
+ * The large page ident maps are built flat: every level is one
+ * physically contiguous run of table pages, so entry i of a level
+ * simply points at table i of the level below and the leaf level is
+ * a single linear pass. With 1GB pages, each 512GB of RAM costs one
+ * 4KB PDPT. With 2MB pages, each 1GB costs one 4KB PD.
+ */
+static void *
+__alloc_table_run (ulong_t ntables)
 {
-    ulong_t npages    = (bytes + PAGE_SIZE_2MB - 1)/PAGE_SIZE_2MB;
-    ulong_t num_pds   = (npages + NUM_PD_ENTRIES - 1)/NUM_PD_ENTRIES;
-    ulong_t num_pdpts = (num_pds + NUM_PDPT_ENTRIES - 1)/NUM_PDPT_ENTRIES;
-    ulong_t filled_pdpts = 0;
-    ulong_t filled_pds   = 0;
-    ulong_t filled_pgs   = 0;
-    unsigned i, j;
-    ulong_t addr = 0;
-
-    __fill_pml(pml, PS_2M, addr, num_pdpts, PTE_PRESENT_BIT | PTE_WRITABLE_BIT);
-
-    for (i = 0; i < NUM_PML4_ENTRIES && filled_pdpts < num_pdpts; i++) {
+    void * run = mm_boot_alloc_aligned(ntables * PAGE_SIZE_4KB, PAGE_SIZE_4KB);
 
-        pdpte_t * pdpt = (pdpte_t*)PTE_ADDR(pml[i]);
-        __fill_pdpt(pdpt, PS_2M, addr, num_pds, PTE_PRESENT_BIT | PTE_WRITABLE_BIT);
-
-        for (j = 0; j < NUM_PDPT_ENTRIES && filled_pds < num_pds; j++) {
-
-            pde_t * pd = (pde_t*)PTE_ADDR(pdpt[j]);
-
-            ulong_t to_fill = ((npages - filled_pgs) > NUM_PD_ENTRIES) ? NUM_PD_ENTRIES : 
-                npages - filled_pgs;
-
-            __fill_pd(pd, PS_2M, addr, to_fill, PTE_PRESENT_BIT | PTE_WRITABLE_BIT);
-
-            filled_pgs += to_fill;
-            addr += PAGE_SIZE_2MB*to_fill;
-
-            ++filled_pds;
-        }
-
-        ++filled_pdpts;
+    if (!run) {
+        ERROR_PRINT("Could not allocate %lu page table pages\n", ntables);
+        return NULL;
     }
 
-    ASSERT(filled_pgs == npages);
+    memset(run, 0, ntables * PAGE_SIZE_4KB);
+    return run;
 }
 
 
-static void
-__construct_tables_1g (pml4e_t * pml, ulong_t bytes)
+static ulong_t
+__construct_tables_large (pml4e_t * pml, page_size_t ps, ulong_t bytes)
 {
-    ulong_t npages = (bytes + PAGE_SIZE_1GB - 1)/PAGE_SIZE_1GB;
-    ulong_t num_pdpts = (npages + NUM_PDPT_ENTRIES - 1)/NUM_PDPT_ENTRIES;
-    ulong_t filled_pdpts = 0;
-    ulong_t filled_pgs   = 0;
-    unsigned i;
-    ulong_t addr = 0;
+    ulong_t flags     = PTE_PRESENT_BIT | PTE_WRITABLE_BIT;
+    ulong_t pgsize    = ps_type_to_size(ps);
+    ulong_t npages    = (bytes + pgsize - 1) / pgsize;
+    ulong_t num_pds   = (ps == PS_2M) ? (npages + NUM_PD_ENTRIES - 1) / NUM_PD_ENTRIES : 0;
+    ulong_t num_pdpts = (ps == PS_2M) ? (num_pds + NUM_PDPT_ENTRIES - 1) / NUM_PDPT_ENTRIES :
+                                        (npages + NUM_PDPT_ENTRIES - 1) / NUM_PDPT_ENTRIES;
+    pdpte_t * pdpt;
+    pde_t * pd = NULL;
+    ulong_t i;
 
-    __fill_pml(pml, PS_1G, addr, num_pdpts, PTE_PRESENT_BIT | PTE_WRITABLE_BIT);
+    ASSERT(ps == PS_2M || ps == PS_1G);
 
-    for (i = 0; i < NUM_PML4_ENTRIES && filled_pdpts < num_pdpts; i++) {
+    if (num_pdpts > NUM_PML4_ENTRIES) {
+        ERROR_PRINT("Cannot identity map %lu bytes\n", bytes);
+        return 0;
+    }
 
-        pdpte_t * pdpt = (pdpte_t*)PTE_ADDR(pml[i]);
+    pdpt = __alloc_table_run(num_pdpts);
+    if (!pdpt) {
+        return 0;
+    }
 
-        ulong_t to_fill = ((npages - filled_pgs) > NUM_PDPT_ENTRIES) ? NUM_PDPT_ENTRIES : 
-            npages - filled_pgs;
+    if (ps == PS_2M) {
+        pd = __alloc_table_run(num_pds);
+        if (!pd) {
+            return 0;
+        }
 
-        __fill_pdpt(pdpt, PS_1G, addr, to_fill, PTE_PRESENT_BIT | PTE_WRITABLE_BIT);
+        for (i = 0; i < npages; i++) {
+            pd[i] = (i << PAGE_SHIFT_2MB) | flags | PTE_PAGE_SIZE_BIT;
+        }
 
-        filled_pgs += to_fill;
-        addr += PAGE_SIZE_1GB*to_fill;
+        for (i = 0; i < num_pds; i++) {
+            pdpt[i] = (ulong_t)(pd + i * NUM_PD_ENTRIES) | flags;
+        }
+    } else {
+        for (i = 0; i < npages; i++) {
+            pdpt[i] = (i << PAGE_SHIFT_1GB) | flags | PTE_PAGE_SIZE_BIT;
+        }
+    }
 
-        ++filled_pdpts;
+    for (i = 0; i < num_pdpts; i++) {
+        pml[i] = (ulong_t)(pdpt + i * NUM_PDPT_ENTRIES) | flags;
     }
+
+    return (num_pdpts + num_pds) * PAGE_SIZE_4KB;
 }
 
 
 static void 
 construct_ident_map (pml4e_t * pml, page_size_t ptype, ulong_t bytes)
 {
-    ulong_t ps = ps_type_to_size(ptype);
+    ulong_t tbytes = 0;
 
     switch (ptype) {
         case PS_4K:
             __construct_tables_4k(pml, bytes);
-            break;
+            return;
         case PS_2M:
-            __construct_tables_2m(pml, bytes);
-            break;
         case PS_1G:
-            __construct_tables_1g(pml, bytes);
+            tbytes = __construct_tables_large(pml, ptype, bytes);
             break;
         default:
             ERROR_PRINT("Undefined page type (%u)\n", ptype);
             return;
     }
+
+    printk("Identity map uses %lu KB of page tables\n", tbytes >> 10);
+}
+
+
+#ifdef NAUT_CONFIG_THREAD_LAZY_STACKS
+/*
+ * Lazily backed thread stacks. A stack faults its pages in one at a
+ * time, mapping VSTACK_SLACK pages below the faulting one as well, so
+ * that an interrupt frame pushed just below the deepest touched page
+ * never lands on an unmapped page (it has no IST stack to fall back
+ * on). Frames larger than the slack that are not touched top down
+ * before an interrupt arrives are not covered.
+ *
+ * Faults take pages from a pool that is refilled in 2MB chunks by
+ * nk_vstack_alloc(), never from malloc(), since the faulting code may
+ * hold a zone lock. Pages only ever leave the pool, so the lock-free
+ * pop cannot suffer ABA.
+ *
+ * A freed stack's slot keeps its mappings and is handed to the next
+ * stack as is. No mapping is ever changed once present, so no TLB
+ * shootdown is needed.
+ */
+#define VSTACK_SLOTS       NAUT_CONFIG_THREAD_LAZY_STACK_SLOTS
+#define VSTACK_SLACK       4
+#define VSTACK_POOL_LOW    1024
+#define VSTACK_POOL_CHUNK  PAGE_SIZE_2MB
+
+static pde_t *           vstack_pds   = 0;   /* two PDEs per slot */
+static pte_t **          vstack_pts   = 0;   /* page table of each slot's stack half */
+static uint32_t *        vstack_free  = 0;
+static uint32_t          vstack_nfree = 0;
+static uint32_t          vstack_next  = 0;
+static spinlock_t        vstack_lock  = 0;
+
+static void * volatile   vstack_pool    = 0;
+static volatile uint64_t vstack_pool_n  = 0;
+
+
+static void
+vstack_window_init (pml4e_t * pml)
+{
+    ulong_t npds = NK_VSTACK_SIZE >> PAGE_SHIFT_1GB;
+    pdpte_t * pdpt = NULL;
+    ulong_t i;
+
+    pdpt       = mm_boot_alloc_aligned(PAGE_SIZE_4KB, PAGE_SIZE_4KB);
+    vstack_pds = mm_boot_alloc_aligned(npds * PAGE_SIZE_4KB, PAGE_SIZE_4KB);
+    vstack_pts = mm_boot_alloc(VSTACK_SLOTS * sizeof(pte_t*));
+    vstack_free = mm_boot_alloc(VSTACK_SLOTS * sizeof(uint32_t));
+    if (!pdpt || !vstack_pds || !vstack_pts || !vstack_free) {
+        ERROR_PRINT("Could not allocate lazy stack window tables\n");
+        vstack_pds = 0;
+        return;
+    }
+
+    memset(pdpt, 0, PAGE_SIZE_4KB);
+    memset(vstack_pds, 0, npds * PAGE_SIZE_4KB);
+    memset(vstack_pts, 0, VSTACK_SLOTS * sizeof(pte_t*));
+
+    for (i = 0; i < npds; i++) {
+        pdpt[i] = (ulong_t)(vstack_pds + i * NUM_PD_ENTRIES) | PTE_PRESENT_BIT | PTE_WRITABLE_BIT;
+    }
+    pml[PADDR_TO_PML4_IDX(NK_VSTACK_BASE)] = (ulong_t)pdpt | PTE_PRESENT_BIT | PTE_WRITABLE_BIT;
+
+    printk("Lazy stack window at [%p - %p], %u slots\n", 
+            (void*)NK_VSTACK_BASE, 
+            (void*)(NK_VSTACK_BASE + NK_VSTACK_SIZE),
+            VSTACK_SLOTS);
+}
+
+
+static void
+vstack_pool_refill (void)
+{
+    while (vstack_pool_n < VSTACK_POOL_LOW) {
+        char * chunk = malloc(VSTACK_POOL_CHUNK);
+        ulong_t off;
+
+        if (!chunk) {
+            ERROR_PRINT("Could not refill lazy stack page pool\n");
+            return;
+        }
+
+        ASSERT(!((addr_t)chunk & (PAGE_SIZE_4KB - 1)));
+
+        for (off = 0; off < VSTACK_POOL_CHUNK; off += PAGE_SIZE_4KB) {
+            void * page = chunk + off;
+            void * old;
+
+            do {
+                old = vstack_pool;
+                *(void**)page = old;
+            } while (!__sync_bool_compare_and_swap(&vstack_pool, old, page));
+        }
+
+        __sync_fetch_and_add(&vstack_pool_n, VSTACK_POOL_CHUNK / PAGE_SIZE_4KB);
+    }
 }
 
 
+static void *
+vstack_pool_get (void)
+{
+    void * page, * next;
+
+    do {
+        page = vstack_pool;
+        if (!page) {
+            return NULL;
+        }
+        next = *(void**)page;
+    } while (!__sync_bool_compare_and_swap(&vstack_pool, page, next));
+
+    __sync_fetch_and_sub(&vstack_pool_n, 1);
+
+    return page;
+}
+
+
+/*
+ * Back the page holding addr, and the slack below it, of a slot's
+ * stack half. Returns 0 on success
+ */
+static int
+vstack_map (addr_t addr)
+{
+    ulong_t slot  = (addr - NK_VSTACK_BASE) / NK_VSTACK_SLOT_SIZE;
+    addr_t  low   = NK_VSTACK_BASE + slot * NK_VSTACK_SLOT_SIZE + NK_VSTACK_MAX;
+    addr_t  page  = addr & ~(PAGE_SIZE_4KB - 1);
+    pte_t * pt    = vstack_pts[slot];
+    int i;
+
+    if (!pt || addr < low) {
+        return -1;
+    }
+
+    for (i = 0; i < VSTACK_SLACK && page >= low; i++, page -= PAGE_SIZE_4KB) {
+        pte_t * pte = &pt[(page - low) >> PAGE_SHIFT_4KB];
+        void * frame;
+
+        if (*pte & PTE_PRESENT_BIT) {
+            continue;
+        }
+
+        frame = vstack_pool_get();
+        if (!frame) {
+            return i ? 0 : -1;
+        }
+
+        memset(frame, 0, PAGE_SIZE_4KB);
+        *pte = va_to_pa((addr_t)frame) | PTE_PRESENT_BIT | PTE_WRITABLE_BIT;
+    }
+
+    return 0;
+}
+
+
+/*
+ * nk_vstack_alloc
+ *
+ * reserve a stack of up to NK_VSTACK_MAX bytes. The returned
+ * address is the stack's lowest byte; it is backed on demand
+ *
+ */
+void *
+nk_vstack_alloc (ulong_t size)
+{
+    uint32_t slot = VSTACK_SLOTS;
+    addr_t top;
+    uint8_t flags;
+
+    if (!vstack_pds || !size || size > NK_VSTACK_MAX) {
+        return NULL;
+    }
+
+    flags = spin_lock_irq_save(&vstack_lock);
+    if (vstack_nfree) {
+        slot = vstack_free[--vstack_nfree];
+    } else if (vstack_next < VSTACK_SLOTS) {
+        slot = vstack_next++;
+    }
+    spin_unlock_irq_restore(&vstack_lock, flags);
+
+    if (slot == VSTACK_SLOTS) {
+        ERROR_PRINT("Out of lazy stack slots\n");
+        return NULL;
+    }
+
+    if (!vstack_pts[slot]) {
+        pte_t * pt = malloc(PAGE_SIZE_4KB);
+
+        if (!pt || ((addr_t)pt & (PAGE_SIZE_4KB - 1))) {
+            ERROR_PRINT("Could not allocate page table for stack slot %u\n", slot);
+            free(pt);
+            nk_vstack_free((void*)(NK_VSTACK_BASE + slot * NK_VSTACK_SLOT_SIZE + NK_VSTACK_MAX));
+            return NULL;
+        }
+
+        memset(pt, 0, PAGE_SIZE_4KB);
+        vstack_pts[slot] = pt;
+        vstack_pds[2 * slot + 1] = va_to_pa((addr_t)pt) | PTE_PRESENT_BIT | PTE_WRITABLE_BIT;
+    }
+
+    vstack_pool_refill();
+
+    /* the top pages are written right away by thread setup */
+    top = NK_VSTACK_BASE + (slot + 1) * NK_VSTACK_SLOT_SIZE;
+    if (vstack_map(top - sizeof(uint64_t)) != 0) {
+        ERROR_PRINT("Could not back stack slot %u\n", slot);
+    }
+
+    return (void*)(top - size);
+}
+
+
+void
+nk_vstack_free (void * stack)
+{
+    uint32_t slot = ((addr_t)stack - NK_VSTACK_BASE) / NK_VSTACK_SLOT_SIZE;
+    uint8_t flags;
+
+    if (!nk_vstack_owns(stack)) {
+        return;
+    }
+
+    flags = spin_lock_irq_save(&vstack_lock);
+    vstack_free[vstack_nfree++] = slot;
+    spin_unlock_irq_restore(&vstack_lock, flags);
+}
+#endif
+
+
+#ifdef NAUT_CONFIG_KMEM_INTERLEAVE
+/* one page directory per GB of the remap window, back to back */
+static pde_t * remap_pds = 0;
+
+static void
+remap_window_init (pml4e_t * pml)
+{
+    ulong_t npds = NK_REMAP_SIZE >> PAGE_SHIFT_1GB;
+    pdpte_t * pdpt = NULL;
+    ulong_t i;
+
+    pdpt      = mm_boot_alloc_aligned(PAGE_SIZE_4KB, PAGE_SIZE_4KB);
+    remap_pds = mm_boot_alloc_aligned(npds * PAGE_SIZE_4KB, PAGE_SIZE_4KB);
+    if (!pdpt || !remap_pds) {
+        ERROR_PRINT("Could not allocate remap window tables\n");
+        remap_pds = 0;
+        return;
+    }
+
+    memset(pdpt, 0, PAGE_SIZE_4KB);
+    memset(remap_pds, 0, npds * PAGE_SIZE_4KB);
+
+    for (i = 0; i < npds; i++) {
+        pdpt[i] = (ulong_t)(remap_pds + i * NUM_PD_ENTRIES) | PTE_PRESENT_BIT | PTE_WRITABLE_BIT;
+    }
+    pml[PADDR_TO_PML4_IDX(NK_REMAP_BASE)] = (ulong_t)pdpt | PTE_PRESENT_BIT | PTE_WRITABLE_BIT;
+
+    printk("Remap window at [%p - %p]\n", 
+            (void*)NK_REMAP_BASE, 
+            (void*)(NK_REMAP_BASE + NK_REMAP_SIZE));
+}
+
+
+/*
+ * nk_remap_2mb
+ *
+ * map the 2MB page at paddr at vaddr in the remap window.
+ * Only this core's TLB is flushed, so callers must not
+ * reuse a window address another core may have seen
+ *
+ */
+int
+nk_remap_2mb (addr_t vaddr, addr_t paddr)
+{
+    if (!remap_pds ||
+        vaddr < NK_REMAP_BASE || vaddr - NK_REMAP_BASE >= NK_REMAP_SIZE ||
+        ((vaddr | paddr) & (PAGE_SIZE_2MB - 1))) {
+        ERROR_PRINT("Cannot remap %p to %p\n", (void*)vaddr, (void*)paddr);
+        return -EINVAL;
+    }
+
+    remap_pds[(vaddr - NK_REMAP_BASE) >> PAGE_SHIFT_2MB] = 
+        paddr | PTE_PRESENT_BIT | PTE_WRITABLE_BIT | PTE_PAGE_SIZE_BIT;
+    invlpg(vaddr);
+
+    return 0;
+}
+
+
+void
+nk_unmap_2mb (addr_t vaddr)
+{
+    if (!remap_pds || vaddr < NK_REMAP_BASE || vaddr - NK_REMAP_BASE >= NK_REMAP_SIZE) {
+        return;
+    }
+
+    remap_pds[(vaddr - NK_REMAP_BASE) >> PAGE_SHIFT_2MB] = 0;
+    invlpg(vaddr);
+}
+#endif
+
+
 /* 
  * Identity map all of physical memory using
  * the largest pages possible
@@ -626,6 +1207,14 @@ kern_ident_map (struct nk_mem_info * mem, ulong_t mbd)
 
     construct_ident_map(pml, lps, last_pfn<<PAGE_SHIFT);
 
+#ifdef NAUT_CONFIG_KMEM_INTERLEAVE
+    remap_window_init(pml);
+#endif
+
+#ifdef NAUT_CONFIG_THREAD_LAZY_STACKS
+    vstack_window_init(pml);
+#endif
+
     /* install the new tables, this will also flush the TLB */
     write_cr3((ulong_t)pml);
 }
@@ -0,0 +1,498 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/atomic.h>
+#include <nautilus/numa.h>
+#include <nautilus/parallel.h>
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+#include <nautilus/rt_scheduler.h>
+#endif
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+#include <nautilus/housekeeping.h>
+#endif
+
+#define PAR_PRINT(fmt, args...) printk("PARALLEL: " fmt, ##args)
+#define PAR_ERROR(fmt, args...) ERROR_PRINT("PARALLEL: " fmt, ##args)
+
+struct par_loop;
+
+/* a task, or one participant's share of a loop */
+struct par_item {
+    void (*run)(struct par_item * it);
+    struct par_item * next;
+
+    nk_task_fn_t fn;
+    void * arg;
+    nk_task_group_t * group;
+
+    struct par_loop * loop;
+    unsigned slot;
+};
+
+struct par_worker {
+    spinlock_t lock;
+    struct par_item * head;
+    struct par_item * tail;
+
+    volatile uint32_t seq;        /* bumped on every push */
+    nk_thread_queue_t * waitq;
+    nk_thread_t * thread;         /* NULL if the core has no worker */
+
+    struct par_item loop_item;    /* its share of the current loop */
+} __attribute__((aligned(64)));
+
+/* the next iteration a participant's block hands out */
+struct par_range {
+    volatile uint64_t next;
+    uint64_t end;
+} __attribute__((aligned(64)));
+
+struct par_loop {
+    nk_par_for_fn_t fn;
+    void * state;
+    uint64_t grain;
+    nk_par_sched_t sched;
+    unsigned n;
+    volatile uint64_t left;       /* participants not yet done */
+};
+
+static struct par_worker par_workers[NAUT_CONFIG_MAX_CPUS];
+static struct par_range par_ranges[NAUT_CONFIG_MAX_CPUS];
+
+/* every core, ordered by NUMA domain */
+static int par_order[NAUT_CONFIG_MAX_CPUS];
+static unsigned par_ncpus;
+static unsigned par_nworkers;
+
+static volatile uint32_t par_loop_busy;
+static volatile uint64_t par_next_worker;
+
+
+static inline int
+in_worker (void)
+{
+    return par_workers[my_cpu_id()].thread == get_cur_thread();
+}
+
+
+static void
+par_push (struct par_worker * w, struct par_item * it)
+{
+    uint8_t flags;
+
+    it->next = NULL;
+
+    flags = spin_lock_irq_save(&w->lock);
+    if (w->tail) {
+        w->tail->next = it;
+    } else {
+        w->head = it;
+    }
+    w->tail = it;
+    spin_unlock_irq_restore(&w->lock, flags);
+
+    atomic_inc(w->seq);
+    nk_thread_queue_wake_word(w->waitq, 0);
+}
+
+
+static struct par_item *
+par_pop (struct par_worker * w)
+{
+    struct par_item * it;
+    uint8_t flags;
+
+    if (!w->head) {
+        return NULL;
+    }
+
+    flags = spin_lock_irq_save(&w->lock);
+    it = w->head;
+    if (it) {
+        w->head = it->next;
+        if (!w->head) {
+            w->tail = NULL;
+        }
+    }
+    spin_unlock_irq_restore(&w->lock, flags);
+
+    return it;
+}
+
+
+/* from our own queue, then from the others, nearest domain first */
+static struct par_item *
+par_find (int cpu)
+{
+    struct par_item * it;
+    unsigned i, start = 0;
+
+    it = par_pop(&par_workers[cpu]);
+    if (it) {
+        return it;
+    }
+
+    for (i = 0; i < par_ncpus; i++) {
+        if (par_order[i] == cpu) {
+            start = i;
+            break;
+        }
+    }
+
+    for (i = 1; i < par_ncpus; i++) {
+        struct par_worker * w = &par_workers[par_order[(start + i) % par_ncpus]];
+        if (w->thread && (it = par_pop(w))) {
+            return it;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+par_worker_func (void * in, void ** out)
+{
+    struct par_worker * w = (struct par_worker*)in;
+    struct par_item * it;
+    uint32_t seq;
+
+    w->thread = get_cur_thread();
+
+    while (1) {
+        seq = w->seq;
+        it = par_find(my_cpu_id());
+        if (it) {
+            it->run(it);
+            continue;
+        }
+        nk_thread_queue_wait_word(w->waitq, &w->seq, seq);
+    }
+}
+
+
+static void
+run_task (struct par_item * it)
+{
+    nk_task_group_t * g = it->group;
+
+    it->fn(it->arg);
+    free(it);
+
+    /* the group may be gone once we let go of it */
+    atomic_dec(g->pending);
+}
+
+
+/* the next chunk of a block, 0 once it is used up */
+static int
+range_take (struct par_range * r, struct par_loop * l, uint64_t * b, uint64_t * e)
+{
+    uint64_t chunk = l->grain;
+    uint64_t start;
+
+    if (l->sched == NK_PAR_GUIDED) {
+        uint64_t next = r->next;
+        if (next >= r->end) {
+            return 0;
+        }
+        if ((r->end - next) / 2 > chunk) {
+            chunk = (r->end - next) / 2;
+        }
+    }
+
+    start = atomic_add(r->next, chunk);
+    if (start >= r->end) {
+        return 0;
+    }
+
+    *b = start;
+    *e = (r->end - start < chunk) ? r->end : start + chunk;
+
+    return 1;
+}
+
+
+static void
+run_slot (struct par_loop * l, unsigned slot)
+{
+    struct par_range * r = &par_ranges[slot];
+    uint64_t b, e;
+    unsigned i;
+
+    if (l->sched == NK_PAR_STATIC) {
+        if (r->next < r->end) {
+            l->fn(r->next, r->end, l->state);
+        }
+    } else {
+        for (i = 0; i < l->n; i++) {
+            r = &par_ranges[(slot + i) % l->n];
+            while (range_take(r, l, &b, &e)) {
+                l->fn(b, e, l->state);
+            }
+        }
+    }
+
+    atomic_dec(l->left);
+}
+
+
+static void
+run_loop_item (struct par_item * it)
+{
+    run_slot(it->loop, it->slot);
+}
+
+
+int
+nk_parallel_for_sched (uint64_t begin,
+                       uint64_t end,
+                       uint64_t grain,
+                       nk_par_sched_t sched,
+                       nk_par_for_fn_t fn,
+                       void * state)
+{
+    struct par_loop l;
+    int cpus[NAUT_CONFIG_MAX_CPUS];
+    uint64_t total, max, per, extra, at;
+    unsigned i, n, others, me = 0;
+    int my_cpu;
+
+    if (end <= begin) {
+        return 0;
+    }
+
+    if (grain == 0) {
+        grain = 1;
+    }
+
+    if (!par_nworkers || in_worker() ||
+        atomic_cmpswap(par_loop_busy, 0, 1) != 0) {
+        fn(begin, end, state);
+        return 0;
+    }
+
+    my_cpu = my_cpu_id();
+    total  = end - begin;
+
+    /* the largest number of participants that still get a chunk each */
+    max = (total - 1) / grain + 1;
+
+    /* the caller and as many workers, other than its own core's, as that allows */
+    for (i = 0, n = 0, others = 0; i < par_ncpus; i++) {
+        int cpu = par_order[i];
+        if (cpu == my_cpu) {
+            cpus[n++] = cpu;
+        } else if (par_workers[cpu].thread && others + 1 < max) {
+            cpus[n++] = cpu;
+            others++;
+        }
+    }
+
+    l.fn    = fn;
+    l.state = state;
+    l.grain = grain;
+    l.sched = sched;
+    l.n     = n;
+    l.left  = n;
+
+    per   = total / n;
+    extra = total % n;
+    at    = begin;
+
+    for (i = 0; i < n; i++) {
+        par_ranges[i].next = at;
+        at += per + (i < extra);
+        par_ranges[i].end = at;
+        if (cpus[i] == my_cpu) {
+            me = i;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        struct par_worker * w = &par_workers[cpus[i]];
+        if (i == me) {
+            continue;
+        }
+        w->loop_item.run  = run_loop_item;
+        w->loop_item.loop = &l;
+        w->loop_item.slot = i;
+        par_push(w, &w->loop_item);
+    }
+
+    run_slot(&l, me);
+
+    while (l.left) {
+        nk_yield();
+    }
+
+    par_loop_busy = 0;
+
+    return 0;
+}
+
+
+int
+nk_parallel_for (uint64_t begin,
+                 uint64_t end,
+                 uint64_t grain,
+                 nk_par_for_fn_t fn,
+                 void * state)
+{
+    return nk_parallel_for_sched(begin, end, grain, NK_PAR_DYNAMIC, fn, state);
+}
+
+
+void
+nk_task_group_init (nk_task_group_t * g)
+{
+    g->pending = 0;
+}
+
+
+int
+nk_task_group_spawn (nk_task_group_t * g, nk_task_fn_t fn, void * arg)
+{
+    struct par_item * it;
+    unsigned i;
+
+    if (!par_nworkers) {
+        fn(arg);
+        return 0;
+    }
+
+    it = malloc(sizeof(*it));
+    if (!it) {
+        PAR_ERROR("Could not allocate task\n");
+        return -1;
+    }
+
+    it->run   = run_task;
+    it->fn    = fn;
+    it->arg   = arg;
+    it->group = g;
+
+    atomic_inc(g->pending);
+
+    /* round robin over the workers */
+    do {
+        i = atomic_add(par_next_worker, 1) % par_ncpus;
+    } while (!par_workers[par_order[i]].thread);
+
+    par_push(&par_workers[par_order[i]], it);
+
+    return 0;
+}
+
+
+void
+nk_task_group_wait (nk_task_group_t * g)
+{
+    struct par_item * it;
+
+    while (g->pending) {
+        /* whatever is queued, ours or not, gets us there sooner */
+        it = par_find(my_cpu_id());
+        if (it) {
+            it->run(it);
+        } else {
+            nk_yield();
+        }
+    }
+}
+
+
+static int
+par_domain (int cpu)
+{
+    struct cpu * c = nk_get_nautilus_info()->sys.cpus[cpu];
+
+    return c->domain ? c->domain->id : 0;
+}
+
+
+int
+nk_parallel_init (void)
+{
+    unsigned i, j;
+    int cpu;
+
+    par_ncpus = nk_get_num_cpus();
+
+    /* stable insertion sort by domain */
+    for (i = 0; i < par_ncpus; i++) {
+        cpu = i;
+        for (j = i; j > 0 && par_domain(par_order[j - 1]) > par_domain(cpu); j--) {
+            par_order[j] = par_order[j - 1];
+        }
+        par_order[j] = cpu;
+    }
+
+    for (i = 0; i < par_ncpus; i++) {
+        struct par_worker * w = &par_workers[i];
+
+        spinlock_init(&w->lock);
+
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+        if (nk_is_housekeeping(i)) {
+            continue;
+        }
+#endif
+
+        w->waitq = nk_thread_queue_create();
+        if (!w->waitq) {
+            PAR_ERROR("Could not create wait queue for CPU %u worker\n", i);
+            return -1;
+        }
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+        rt_constraints * c = (rt_constraints*)malloc(sizeof(rt_constraints));
+        if (!c) {
+            PAR_ERROR("Could not allocate constraints for CPU %u worker\n", i);
+            return -1;
+        }
+        c->aperiodic.priority = 0;
+
+        if (nk_thread_start(par_worker_func, w, NULL, 1, TSTACK_DEFAULT, NULL, i,
+                            APERIODIC, c, 0) != 0) {
+#else
+        if (nk_thread_start(par_worker_func, w, NULL, 1, TSTACK_DEFAULT, NULL, i) != 0) {
+#endif
+            PAR_ERROR("Could not start worker on CPU %u\n", i);
+            return -1;
+        }
+    }
+
+    /* the workers fill in their thread pointers as they come up */
+    for (i = 0; i < par_ncpus; i++) {
+        if (par_workers[i].waitq) {
+            while (!par_workers[i].thread) {
+                nk_yield();
+            }
+            par_nworkers++;
+        }
+    }
+
+    PAR_PRINT("%u workers\n", par_nworkers);
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/percpu.h>
+#include <nautilus/mm.h>
+#include <nautilus/numa.h>
+
+#define PERCPU_ERROR(fmt, args...) ERROR_PRINT("PERCPU: " fmt, ##args)
+#define PERCPU_PRINT(fmt, args...) printk("PERCPU: " fmt, ##args)
+
+extern char _percpu_start[], _percpu_end[];
+
+/*
+ * Give every core its copy of the DEFINE_PER_CPU variables, on its
+ * own NUMA domain where there is memory there. Runs on the BSP once
+ * GS points at its struct cpu and the kernel allocator is up, before
+ * anything touches a per-CPU variable, so the template is still as
+ * the compiler left it.
+ */
+int
+nk_percpu_init (struct naut_info * naut)
+{
+    size_t size = _percpu_end - _percpu_start;
+    struct cpu * c;
+    char * area;
+    int i;
+
+    if (!size) {
+        return 0;
+    }
+
+    for (i = 0; i < naut->sys.num_cpus; i++) {
+        c = naut->sys.cpus[i];
+
+        area = c->domain ? malloc_node(size, c->domain->id) : NULL;
+        if (!area) {
+            area = malloc(size);
+        }
+        if (!area) {
+            PERCPU_ERROR("Could not allocate per-CPU area for cpu %d\n", i);
+            return -1;
+        }
+
+        memcpy(area, _percpu_start, size);
+        c->percpu_off = (addr_t)area - (addr_t)_percpu_start;
+    }
+
+    PERCPU_PRINT("%lu bytes of per-CPU variables on %u cpus\n", size, naut->sys.num_cpus);
+
+    return 0;
+}
@@ -23,6 +23,8 @@
 #include <nautilus/msr.h>
 #include <nautilus/nautilus.h>
 #include <nautilus/cpu.h>
+#include <nautilus/cpuid.h>
+#include <nautilus/atomic.h>
 #include <nautilus/pmc.h>
 #include <nautilus/mm.h>
 
@@ -33,6 +35,9 @@
 #define PMC_WARN(fmt, args...)  WARN_PRINT("PMC: " fmt, ##args)
 
 static perf_slot_t  pmc_slots[NUM_PERF_SLOTS];
+static struct pmc_hw pmc_hw;
+static uint8_t       pmc_hw_valid;
+static volatile uint8_t pmc_reserved;
 
 static event_prop_t event_props[256] = 
 { 
@@ -40,6 +45,8 @@ static event_prop_t event_props[256] =
     [AMD_PMC_ICACHE_MISS]  = {"Instruction Cache Misses",       0x07},
     [AMD_PMC_L2_MISS]      = {"L2 Cache Misses",                0x07},
     [AMD_PMC_TLB_MISS]     = {"Unified TLB Misses",             0x07},
+    [AMD_PMC_CPU_CLOCKS]   = {"CPU Clocks not Halted",          0x3f},
+    [AMD_PMC_INSTR_RETIRED] = {"Retired Instructions",          0x3f},
     [AMD_PMC_SMI_CNT]      = {"SMI Interrupts",                 0x3f},
     [AMD_PMC_IFETCH_STALL] = {"Instruction Fetch Stalls",       0x07},
     [AMD_PMC_BRANCH_MISS]  = {"Mispredicted Branches Retired",  0x3f},
@@ -48,6 +55,95 @@ static event_prop_t event_props[256] =
 
 
 
+/*
+ * Find out which counters we have. AMD needs the core performance
+ * counter extensions, which are the only counters pmc.c drives; Intel
+ * needs an architectural PMU. All cores are assumed to match.
+ */
+const struct pmc_hw *
+pmc_detect (void)
+{
+    cpuid_ret_t ret;
+
+    if (pmc_hw_valid) {
+        return &pmc_hw;
+    }
+
+    memset(&pmc_hw, 0, sizeof(pmc_hw));
+
+    cpuid(0, &ret);
+
+    /* "GenuineIntel" */
+    if (ret.b == 0x756e6547 && ret.a >= 0xa) {
+        cpuid(0xa, &ret);
+        if ((ret.a & 0xff) >= 1 && ((ret.a >> 8) & 0xff) >= 1) {
+            pmc_hw.arch   = PMC_ARCH_INTEL;
+            pmc_hw.num    = ((ret.a >> 8) & 0xff) > 8 ? 8 : ((ret.a >> 8) & 0xff);
+            pmc_hw.global = (ret.a & 0xff) >= 2;
+        }
+    } else if (ret.b == 0x68747541) { /* "AuthenticAMD" */
+        cpuid(CPUID_AMD_BASIC_INFO, &ret);
+        if (ret.a >= CPUID_AMD_FEATURE_INFO) {
+            cpuid(CPUID_AMD_FEATURE_INFO, &ret);
+            if (ret.c & (1 << 23)) {
+                pmc_hw.arch = PMC_ARCH_AMD;
+                pmc_hw.num  = AMD_PERF_SLOTS;
+            }
+        }
+    }
+
+    pmc_hw_valid = 1;
+
+    return &pmc_hw;
+}
+
+
+uint32_t
+pmc_ctl_msr (uint8_t idx)
+{
+    return pmc_hw.arch == PMC_ARCH_INTEL ? INTEL_PERFEVTSEL0_MSR + idx : PERF_CTL_MSR_N(idx);
+}
+
+
+uint32_t
+pmc_ctr_msr (uint8_t idx)
+{
+    return pmc_hw.arch == PMC_ARCH_INTEL ? INTEL_PMC0_MSR + idx : PERF_CTR_MSR_N(idx);
+}
+
+
+/* counters an event may be placed on */
+uint8_t
+pmc_event_slots (uint8_t event_id)
+{
+    if (pmc_hw.arch == PMC_ARCH_AMD && event_props[event_id].slot_mask) {
+        return event_props[event_id].slot_mask;
+    }
+    return 0xff;
+}
+
+
+void
+pmc_reserve (uint8_t idx)
+{
+    atomic_or(pmc_reserved, 1 << idx);
+}
+
+
+void
+pmc_unreserve (uint8_t idx)
+{
+    atomic_and(pmc_reserved, ~(1 << idx));
+}
+
+
+uint8_t
+pmc_reserved_mask (void)
+{
+    return pmc_reserved;
+}
+
+
 static inline uint64_t
 read_pmc_ctl (uint8_t idx)
 {
@@ -125,6 +221,7 @@ assign_perf_event (uint8_t event_id, uint8_t unit_mask)
             ctl.unit_mask     = unit_mask;
 
             slot->status = PMC_SLOT_USED;
+            pmc_reserve(i);
 
             write_pmc_ctl(i, ctl.val);
             /* clear it just in case */
@@ -254,6 +351,7 @@ release_perf_event (perf_event_t * event)
     if (slot->status == PMC_SLOT_USED) {
         slot->status = PMC_SLOT_FREE;
         slot->event  = NULL;
+        pmc_unreserve(idx);
         write_pmc_ctl(idx, 0);
         write_pmc_ctr(idx, 0);
     }
@@ -0,0 +1,423 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/msr.h>
+#include <nautilus/irq.h>
+#include <nautilus/percpu.h>
+#include <nautilus/thread.h>
+#include <nautilus/intrinsics.h>
+#include <nautilus/mm.h>
+#include <nautilus/smp.h>
+#include <nautilus/pmc.h>
+#include <nautilus/pmc_sample.h>
+#include <nautilus/backtrace.h>
+#include <dev/apic.h>
+
+#define SAMPLE_INFO(fmt, args...) printk("SAMPLE: " fmt, ##args)
+#define SAMPLE_ERR(fmt, args...)  ERROR_PRINT("SAMPLE: " fmt, ##args)
+
+#define SAMPLE_ENTRIES NAUT_CONFIG_PMC_SAMPLE_ENTRIES
+
+struct sample_cpu {
+    struct nk_sample * buf;
+    uint64_t head;
+    uint64_t dropped;
+} __align(64);
+
+static DEFINE_PER_CPU(struct sample_cpu, sample_cpu);
+
+static const struct pmc_hw * hw;
+static perf_event_t * amd_event;    /* slot reserved in pmc.c */
+static int intel_idx = -1;          /* counter reserved on Intel */
+static uint64_t ctl_msr;
+static uint64_t ctr_msr;
+static uint64_t ctl_val;
+static uint64_t period;
+static volatile uint8_t sampling;
+
+
+static inline void
+sample_arm (void)
+{
+    msr_write(ctr_msr, (-period) & PMC_CTR_MASK);
+}
+
+
+static void
+sample_start_local (void * arg)
+{
+    struct apic_dev * apic = per_cpu_get(apic);
+
+    msr_write(ctl_msr, 0);
+    sample_arm();
+    apic_write(apic, APIC_REG_LVTPC, APIC_DEL_MODE_FIXED | APIC_PC_INT_VEC);
+
+    if (hw->global) {
+        msr_write(INTEL_PERF_GLOBAL_OVF_CTRL, 1ULL << intel_idx);
+        msr_write(INTEL_PERF_GLOBAL_CTRL, msr_read(INTEL_PERF_GLOBAL_CTRL) | (1ULL << intel_idx));
+    }
+
+    msr_write(ctl_msr, ctl_val);
+}
+
+
+static void
+sample_stop_local (void * arg)
+{
+    struct apic_dev * apic = per_cpu_get(apic);
+
+    msr_write(ctl_msr, 0);
+    apic_write(apic, APIC_REG_LVTPC, APIC_DEL_MODE_FIXED | APIC_LVT_DISABLED | APIC_PC_INT_VEC);
+}
+
+
+/*
+ * Overflow interrupt. The saved registers sit just below the exception
+ * frame, and the interrupted RBP starts the walk up the caller's
+ * frames, bounded by the thread's stack.
+ */
+void
+nk_sample_overflow (struct excp_entry_state * excp)
+{
+    struct sample_cpu * s = this_cpu_ptr(sample_cpu);
+    struct nk_regs * r = (struct nk_regs*)((char*)excp - 128);
+    nk_thread_t * t = get_cur_thread();
+
+    if (!sampling) {
+        goto out;
+    }
+
+    if (hw->global) {
+        if (!(msr_read(INTEL_PERF_GLOBAL_STATUS) & (1ULL << intel_idx))) {
+            goto out;
+        }
+        msr_write(INTEL_PERF_GLOBAL_OVF_CTRL, 1ULL << intel_idx);
+    } else if (hw->arch == PMC_ARCH_AMD && (msr_read(ctr_msr) & (1ULL << 47))) {
+        /* still counting up to the wrap, not ours */
+        goto out;
+    }
+
+    if (s->head < SAMPLE_ENTRIES) {
+        struct nk_sample * e = &s->buf[s->head++];
+
+        e->rip   = excp->rip;
+        e->tid   = t ? t->tid : 0;
+        e->depth = t ? nk_backtrace_collect((void**)r->rbp,
+                                            t->stack,
+                                            (char*)t->stack + t->stack_size,
+                                            e->calls,
+                                            NK_SAMPLE_DEPTH) : 0;
+    } else {
+        s->dropped++;
+    }
+
+    sample_arm();
+
+out:
+    /* Intel masks LVTPC when it delivers the interrupt */
+    if (sampling) {
+        apic_write(per_cpu_get(apic), APIC_REG_LVTPC, APIC_DEL_MODE_FIXED | APIC_PC_INT_VEC);
+    }
+}
+
+
+int
+nk_sample_start (uint64_t cycles)
+{
+    pmc_ctl_t ctl;
+    int i;
+
+    if (sampling) {
+        SAMPLE_ERR("Sampling is already running\n");
+        return -1;
+    }
+
+    /* legacy counter writes sign-extend bit 31 */
+    if (cycles == 0 || cycles >= (1ULL << 31)) {
+        SAMPLE_ERR("Invalid sampling period %llu\n", cycles);
+        return -1;
+    }
+
+    hw = pmc_detect();
+
+    ctl.val        = 0;
+    ctl.usr        = 1;
+    ctl.os         = 1;
+    ctl.int_enable = 1;
+    ctl.en         = 1;
+
+    switch (hw->arch) {
+        case PMC_ARCH_INTEL:
+            for (i = 0; i < hw->num; i++) {
+                if (!(pmc_reserved_mask() & (1 << i))) {
+                    break;
+                }
+            }
+            if (i == hw->num) {
+                SAMPLE_ERR("No free performance counter\n");
+                return -1;
+            }
+            intel_idx = i;
+            pmc_reserve(intel_idx);
+            ctl.event_select0 = INTEL_PMC_CORE_CYCLES;
+            ctl_msr = pmc_ctl_msr(intel_idx);
+            ctr_msr = pmc_ctr_msr(intel_idx);
+            break;
+        case PMC_ARCH_AMD:
+            amd_event = assign_perf_event(AMD_PMC_CPU_CLOCKS, 0);
+            if (!amd_event) {
+                return -1;
+            }
+            ctl.event_select0 = AMD_PMC_CPU_CLOCKS;
+            ctl_msr = PERF_CTL_MSR_N(amd_event->assigned_idx);
+            ctr_msr = PERF_CTR_MSR_N(amd_event->assigned_idx);
+            break;
+        default:
+            SAMPLE_ERR("No usable performance counters\n");
+            return -1;
+    }
+
+    ctl_val = ctl.val;
+    period  = cycles;
+
+    for (i = 0; i < nk_get_num_cpus(); i++) {
+        struct sample_cpu * s = per_cpu_ptr(sample_cpu, i);
+
+        if (!s->buf) {
+            s->buf = malloc(sizeof(struct nk_sample) * SAMPLE_ENTRIES);
+            if (!s->buf) {
+                SAMPLE_ERR("Could not allocate sample buffer for cpu %d\n", i);
+                nk_sample_stop();
+                return -1;
+            }
+        }
+    }
+
+    sampling = 1;
+
+    for (i = 0; i < nk_get_num_cpus(); i++) {
+        smp_xcall(i, sample_start_local, NULL, 1);
+    }
+
+    SAMPLE_INFO("Sampling every %llu cycles on %d cores\n", cycles, nk_get_num_cpus());
+
+    return 0;
+}
+
+
+void
+nk_sample_stop (void)
+{
+    int i;
+
+    if (sampling) {
+        sampling = 0;
+        for (i = 0; i < nk_get_num_cpus(); i++) {
+            smp_xcall(i, sample_stop_local, NULL, 1);
+        }
+    }
+
+    if (amd_event) {
+        release_perf_event(amd_event);
+        amd_event = NULL;
+    }
+
+    if (intel_idx >= 0) {
+        pmc_unreserve(intel_idx);
+        intel_idx = -1;
+    }
+}
+
+
+void
+nk_sample_reset (void)
+{
+    int i;
+
+    for (i = 0; i < nk_get_num_cpus(); i++) {
+        struct sample_cpu * s = per_cpu_ptr(sample_cpu, i);
+
+        s->head    = 0;
+        s->dropped = 0;
+    }
+}
+
+
+uint64_t
+nk_sample_read (int cpu, struct nk_sample * dst, uint64_t max)
+{
+    struct sample_cpu * s = per_cpu_ptr(sample_cpu, cpu);
+    uint64_t n = s->head < max ? s->head : max;
+
+    if (!s->buf || n == 0) {
+        return 0;
+    }
+
+    memcpy(dst, s->buf, n * sizeof(struct nk_sample));
+
+    return n;
+}
+
+
+/*
+ * Reports. Samples from every core are folded into an open-addressed
+ * table, keyed by RIP for the flat profile and by RIP plus call chain
+ * for the call graph, and the heaviest entries are printed.
+ */
+struct sample_bucket {
+    struct nk_sample * s;
+    uint64_t hash;
+    uint64_t count;
+};
+
+
+static inline uint64_t
+sample_hash (struct nk_sample * s, int chain)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ s->rip;
+    uint32_t i;
+
+    h *= 0x100000001b3ULL;
+    if (chain) {
+        for (i = 0; i < s->depth; i++) {
+            h = (h ^ s->calls[i]) * 0x100000001b3ULL;
+        }
+    }
+    return h ? h : 1;
+}
+
+
+static inline int
+sample_same (struct nk_sample * a, struct nk_sample * b, int chain)
+{
+    if (a->rip != b->rip) {
+        return 0;
+    }
+    if (!chain) {
+        return 1;
+    }
+    return a->depth == b->depth &&
+           !memcmp(a->calls, b->calls, a->depth * sizeof(uint64_t));
+}
+
+
+static void
+sample_report (unsigned top, int chain)
+{
+    struct sample_bucket * tab;
+    uint64_t total = 0;
+    uint64_t dropped = 0;
+    uint64_t size = 1;
+    uint64_t i, j;
+    int cpu;
+
+    if (sampling) {
+        SAMPLE_ERR("Stop sampling before reporting\n");
+        return;
+    }
+
+    for (cpu = 0; cpu < nk_get_num_cpus(); cpu++) {
+        total   += per_cpu_ptr(sample_cpu, cpu)->head;
+        dropped += per_cpu_ptr(sample_cpu, cpu)->dropped;
+    }
+
+    if (total == 0) {
+        SAMPLE_INFO("No samples\n");
+        return;
+    }
+
+    while (size < 2 * total) {
+        size <<= 1;
+    }
+
+    tab = malloc(size * sizeof(struct sample_bucket));
+    if (!tab) {
+        SAMPLE_ERR("Could not allocate report table\n");
+        return;
+    }
+    memset(tab, 0, size * sizeof(struct sample_bucket));
+
+    for (cpu = 0; cpu < nk_get_num_cpus(); cpu++) {
+        struct sample_cpu * s = per_cpu_ptr(sample_cpu, cpu);
+
+        for (i = 0; i < s->head; i++) {
+            struct nk_sample * e = &s->buf[i];
+            uint64_t h = sample_hash(e, chain);
+
+            for (j = h & (size - 1); tab[j].hash; j = (j + 1) & (size - 1)) {
+                if (tab[j].hash == h && sample_same(tab[j].s, e, chain)) {
+                    break;
+                }
+            }
+            if (!tab[j].hash) {
+                tab[j].hash = h;
+                tab[j].s    = e;
+            }
+            tab[j].count++;
+        }
+    }
+
+    SAMPLE_INFO("++++++++ %s (%llu samples, %llu dropped) ++++++++\n",
+                chain ? "Call Graph" : "Flat Profile", total, dropped);
+
+    /* selection by repeated maximum, top is expected to be small */
+    while (top--) {
+        struct sample_bucket * best = NULL;
+        uint32_t k;
+
+        for (j = 0; j < size; j++) {
+            if (tab[j].count && (!best || tab[j].count > best->count)) {
+                best = &tab[j];
+            }
+        }
+        if (!best) {
+            break;
+        }
+
+        SAMPLE_INFO("%8llu %3llu%%  %p\n", best->count, best->count * 100 / total,
+                    (void*)best->s->rip);
+        if (chain) {
+            for (k = 0; k < best->s->depth; k++) {
+                SAMPLE_INFO("               <- %p\n", (void*)best->s->calls[k]);
+            }
+        }
+
+        best->count = 0;
+    }
+
+    SAMPLE_INFO("++++++++ Report End ++++++++\n");
+
+    free(tab);
+}
+
+
+void
+nk_sample_report_flat (unsigned top)
+{
+    sample_report(top, 0);
+}
+
+
+void
+nk_sample_report_graph (unsigned top)
+{
+    sample_report(top, 1);
+}
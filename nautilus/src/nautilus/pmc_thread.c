@@ -0,0 +1,331 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/msr.h>
+#include <nautilus/irq.h>
+#include <nautilus/thread.h>
+#include <nautilus/mm.h>
+#include <nautilus/pmc.h>
+#include <nautilus/pmc_thread.h>
+
+#define PMC_THREAD_INFO(fmt, args...) printk("PMC: " fmt, ##args)
+#define PMC_THREAD_ERR(fmt, args...)  ERROR_PRINT("PMC: " fmt, ##args)
+
+#define SLOT_NONE 0xff
+
+
+/* read back and stop whatever p has loaded, interrupts off */
+static void
+pmc_thread_out (struct nk_pmc_thread * p)
+{
+    uint64_t d = rdtsc() - p->in_tsc;
+    uint8_t reserved = pmc_reserved_mask();
+    int i;
+
+    for (i = 0; i < p->num; i++) {
+        uint8_t k = p->slot[i];
+
+        p->ev[i].enabled += d;
+
+        if (k == SLOT_NONE) {
+            continue;
+        }
+
+        /* taken over machine-wide while we held it: the count is lost */
+        if (!(reserved & (1 << k))) {
+            msr_write(pmc_ctl_msr(k), 0);
+            p->ev[i].count   += msr_read(pmc_ctr_msr(k)) & PMC_CTR_MASK;
+            p->ev[i].running += d;
+        }
+
+        p->slot[i] = SLOT_NONE;
+    }
+}
+
+
+/* program p's events onto the free counters, starting at p->rotate */
+static void
+pmc_thread_in (struct nk_pmc_thread * p)
+{
+    const struct pmc_hw * hw = pmc_detect();
+    uint8_t avail = ((1 << hw->num) - 1) & ~pmc_reserved_mask();
+    uint8_t loaded = 0;
+    uint8_t used = 0;
+    int i;
+
+    for (i = 0; i < p->num && avail; i++) {
+        uint8_t e = (p->rotate + i) % p->num;
+        uint8_t fit = avail & pmc_event_slots(p->ctl[e] & 0xff);
+        uint8_t k;
+
+        if (!fit) {
+            continue;
+        }
+
+        k = __builtin_ctz(fit);
+        avail &= ~(1 << k);
+        used  |= 1 << k;
+        loaded++;
+
+        msr_write(pmc_ctl_msr(k), 0);
+        msr_write(pmc_ctr_msr(k), 0);
+        msr_write(pmc_ctl_msr(k), p->ctl[e]);
+
+        p->slot[e] = k;
+    }
+
+    if (loaded < p->num) {
+        p->rotate = (p->rotate + loaded) % p->num;
+    }
+
+    if (hw->global && used) {
+        msr_write(INTEL_PERF_GLOBAL_CTRL, msr_read(INTEL_PERF_GLOBAL_CTRL) | used);
+    }
+
+    p->in_tsc = rdtsc();
+}
+
+
+/*
+ * Called from nk_thread_switch() with interrupts off, before the
+ * current thread changes.
+ */
+void
+nk_pmc_thread_switch (struct nk_thread * next)
+{
+    struct nk_thread * cur = get_cur_thread();
+
+    if (cur->pmc) {
+        pmc_thread_out(cur->pmc);
+    }
+
+    if (next->pmc) {
+        pmc_thread_in(next->pmc);
+    }
+}
+
+
+/* rotate a multiplexed set that has held the core for a while */
+void
+nk_pmc_thread_tick (void)
+{
+    struct nk_thread * cur = get_cur_thread();
+    struct nk_pmc_thread * p = cur ? cur->pmc : NULL;
+
+    if (!p || p->num <= pmc_detect()->num) {
+        return;
+    }
+
+    if (rdtsc() - p->in_tsc >= NK_PMC_ROTATE_CYCLES) {
+        pmc_thread_out(p);
+        pmc_thread_in(p);
+    }
+}
+
+
+int
+nk_pmc_thread_add (uint8_t event, uint8_t unit_mask)
+{
+    struct nk_thread * t = get_cur_thread();
+    struct nk_pmc_thread * p = t->pmc;
+    pmc_ctl_t ctl;
+    uint8_t flags;
+    int idx;
+    int i;
+
+    if (pmc_detect()->arch == PMC_ARCH_NONE) {
+        PMC_THREAD_ERR("No usable performance counters\n");
+        return -1;
+    }
+
+    if (!p) {
+        p = malloc(sizeof(struct nk_pmc_thread));
+        if (!p) {
+            PMC_THREAD_ERR("Could not allocate thread counter set\n");
+            return -1;
+        }
+        memset(p, 0, sizeof(struct nk_pmc_thread));
+        for (i = 0; i < NK_PMC_THREAD_EVENTS; i++) {
+            p->slot[i] = SLOT_NONE;
+        }
+    }
+
+    if (p->num == NK_PMC_THREAD_EVENTS) {
+        PMC_THREAD_ERR("Thread %lu already has %d events\n", t->tid, NK_PMC_THREAD_EVENTS);
+        return -1;
+    }
+
+    ctl.val           = 0;
+    ctl.event_select0 = event;
+    ctl.unit_mask     = unit_mask;
+    ctl.usr           = 1;
+    ctl.os            = 1;
+    ctl.en            = 1;
+
+    /* reload the set with the new event in it */
+    flags = irq_disable_save();
+
+    if (t->pmc) {
+        pmc_thread_out(p);
+    }
+
+    idx = p->num;
+    p->ctl[idx] = ctl.val;
+    memset(&p->ev[idx], 0, sizeof(struct nk_pmc_count));
+    p->num++;
+
+    t->pmc = p;
+    pmc_thread_in(p);
+
+    irq_enable_restore(flags);
+
+    return idx;
+}
+
+
+int
+nk_pmc_thread_add_generic (nk_pmc_generic_t event)
+{
+    static const uint8_t intel[4][2] = {
+        [NK_PMC_CYCLES]        = {INTEL_PMC_CORE_CYCLES,   0x00},
+        [NK_PMC_INSTRUCTIONS]  = {INTEL_PMC_INSTR_RETIRED, 0x00},
+        [NK_PMC_LLC_MISSES]    = {INTEL_PMC_LLC_MISS,      0x41},
+        [NK_PMC_BRANCH_MISSES] = {INTEL_PMC_BRANCH_MISS,   0x00},
+    };
+    static const uint8_t amd[4][2] = {
+        [NK_PMC_CYCLES]        = {AMD_PMC_CPU_CLOCKS,    0x00},
+        [NK_PMC_INSTRUCTIONS]  = {AMD_PMC_INSTR_RETIRED, 0x00},
+        [NK_PMC_LLC_MISSES]    = {AMD_PMC_L2_MISS,       0x07},
+        [NK_PMC_BRANCH_MISSES] = {AMD_PMC_BRANCH_MISS,   0x00},
+    };
+
+    if (event > NK_PMC_BRANCH_MISSES) {
+        PMC_THREAD_ERR("Unknown generic event %d\n", event);
+        return -1;
+    }
+
+    switch (pmc_detect()->arch) {
+        case PMC_ARCH_INTEL:
+            return nk_pmc_thread_add(intel[event][0], intel[event][1]);
+        case PMC_ARCH_AMD:
+            return nk_pmc_thread_add(amd[event][0], amd[event][1]);
+        default:
+            PMC_THREAD_ERR("No usable performance counters\n");
+            return -1;
+    }
+}
+
+
+/*
+ * Counts for the calling thread are brought up to date first. Another
+ * thread's are as of its last switch-out.
+ */
+int
+nk_pmc_thread_read (struct nk_thread * t, int idx, struct nk_pmc_count * c)
+{
+    struct nk_pmc_thread * p = t->pmc;
+    uint8_t flags;
+
+    if (!p || idx < 0 || idx >= p->num) {
+        return -1;
+    }
+
+    flags = irq_disable_save();
+
+    if (t == get_cur_thread()) {
+        pmc_thread_out(p);
+        pmc_thread_in(p);
+    }
+
+    *c = p->ev[idx];
+
+    irq_enable_restore(flags);
+
+    return 0;
+}
+
+
+/* count * enabled / running, without a 128-bit divide */
+uint64_t
+nk_pmc_count_scaled (struct nk_pmc_count * c)
+{
+    uint64_t enabled = c->enabled;
+    uint64_t running = c->running;
+
+    if (!running) {
+        return 0;
+    }
+    if (running >= enabled) {
+        return c->count;
+    }
+
+    while (enabled >> 32) {
+        enabled >>= 1;
+        running >>= 1;
+    }
+    if (!running) {
+        return c->count;
+    }
+
+    return (c->count / running) * enabled + (c->count % running) * enabled / running;
+}
+
+
+void
+nk_pmc_thread_report (struct nk_thread * t)
+{
+    struct nk_pmc_thread * p = t->pmc;
+    struct nk_pmc_count c;
+    int i;
+
+    if (!p) {
+        PMC_THREAD_INFO("Thread %lu has no counters\n", t->tid);
+        return;
+    }
+
+    PMC_THREAD_INFO("++++++++ Thread %lu Counters ++++++++\n", t->tid);
+
+    for (i = 0; i < p->num; i++) {
+        if (nk_pmc_thread_read(t, i, &c)) {
+            continue;
+        }
+        PMC_THREAD_INFO("[%d] event 0x%02llx umask 0x%02llx %llu (raw %llu, on counter %llu%%)\n",
+                        i,
+                        p->ctl[i] & 0xff,
+                        (p->ctl[i] >> 8) & 0xff,
+                        nk_pmc_count_scaled(&c),
+                        c.count,
+                        c.enabled ? c.running * 100 / c.enabled : 0);
+    }
+
+    PMC_THREAD_INFO("++++++++ Thread Counters End ++++++++\n");
+}
+
+
+/* when the thread is destroyed, it is not running */
+void
+nk_pmc_thread_free (struct nk_thread * t)
+{
+    if (t->pmc) {
+        free(t->pmc);
+        t->pmc = NULL;
+    }
+}
@@ -0,0 +1,346 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/mm.h>
+#include <nautilus/mwait.h>
+#include <nautilus/thread.h>
+#include <nautilus/percpu.h>
+#include <nautilus/pollio.h>
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+#include <nautilus/rt_scheduler.h>
+#endif
+
+#ifndef NAUT_CONFIG_DEBUG_POLL_IO
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define INFO(fmt, args...) printk("POLLIO: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("POLLIO: DEBUG: " fmt, ##args)
+#define ERROR(fmt, args...) printk("POLLIO: ERROR: " fmt, ##args)
+
+/* empty passes before a core goes to MWAIT */
+#define POLL_SPINS NAUT_CONFIG_POLL_IO_SPINS
+
+static struct nk_poll_core * poll_cores[NAUT_CONFIG_MAX_CPUS];
+
+
+struct nk_poll_ring *
+nk_poll_ring_create (uint32_t size)
+{
+    struct nk_poll_ring * r;
+
+    if (!size || (size & (size - 1))) {
+        ERROR("Ring size %u is not a power of two\n", size);
+        return NULL;
+    }
+
+    r = malloc(sizeof(struct nk_poll_ring) + size * sizeof(void *));
+    if (!r) {
+        ERROR("Cannot allocate ring\n");
+        return NULL;
+    }
+    memset(r, 0, sizeof(struct nk_poll_ring));
+
+    r->mask = size - 1;
+    r->wq = nk_thread_queue_create();
+    if (!r->wq) {
+        ERROR("Cannot allocate ring wait queue\n");
+        free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+
+void
+nk_poll_ring_destroy (struct nk_poll_ring * r)
+{
+    nk_thread_queue_destroy(r->wq);
+    free(r);
+}
+
+
+void
+nk_poll_ring_kick (struct nk_poll_ring * r)
+{
+    /* tail is out before we look for a sleeper, pairs with the fence in wait */
+    __sync_synchronize();
+
+    if (r->waiting) {
+        r->waiting = 0;
+        nk_thread_queue_wake_word(r->wq, 1);
+    }
+}
+
+
+void *
+nk_poll_ring_wait (struct nk_poll_ring * r)
+{
+    void * item;
+
+    while (!(item = nk_poll_ring_pop(r))) {
+        uint32_t t = r->head;
+
+        r->waiting = 1;
+        __sync_synchronize();
+
+        /* either the producer sees waiting, or we see its tail here */
+        if (r->tail == t) {
+            nk_thread_queue_wait_word(r->wq, &r->tail, t);
+        }
+    }
+
+    return item;
+}
+
+
+static int
+poll_pass (struct nk_poll_core * core)
+{
+    int n = core->nsrc;
+    int work = 0;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        work += core->src[i].poll(core->src[i].priv);
+    }
+
+    return work;
+}
+
+
+/* the one line that changes when there is work, NULL if there is none */
+static volatile void *
+poll_monitor_addr (struct nk_poll_core * core)
+{
+    int n = core->nsrc;
+    int i, watched = 0;
+
+    for (i = 0; i < n; i++) {
+        if (core->src[i].monitor) {
+            watched++;
+        }
+    }
+
+    if (!watched) {
+        return &core->doorbell;
+    }
+
+    if (watched == 1 && n == 1) {
+        return core->src[0].monitor;
+    }
+
+    return NULL;
+}
+
+
+static void
+poll_idle (struct nk_poll_core * core, int can_mwait)
+{
+    volatile void * addr = can_mwait ? poll_monitor_addr(core) : NULL;
+
+    if (!addr) {
+        asm volatile ("pause");
+        return;
+    }
+
+    nk_monitor((addr_t)addr, 0, 0);
+
+    /* anything that arrived before the monitor was armed */
+    if (poll_pass(core)) {
+        return;
+    }
+
+    core->sleeps++;
+    nk_mwait(0, 0);
+}
+
+
+static void
+poll_core_loop (void * in, void ** out)
+{
+    struct nk_poll_core * core = (struct nk_poll_core *)in;
+    int can_mwait = nk_mwait_cstates() != 0;
+    int idle = 0;
+
+    core->tid = get_cur_thread();
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    if (nk_rt_reserve_self()) {
+        ERROR("Cannot reserve CPU %d with the RT scheduler\n", core->cpu);
+    }
+#endif
+
+    INFO("CPU %d polling%s\n", core->cpu, can_mwait ? ", MWAIT when idle" : "");
+
+    while (!core->stop) {
+        int work = poll_pass(core);
+
+        core->passes++;
+
+        if (work) {
+            core->work += work;
+            idle = 0;
+        } else if (++idle >= POLL_SPINS) {
+            poll_idle(core, can_mwait);
+        } else {
+            asm volatile ("pause");
+        }
+    }
+
+    INFO("CPU %d stopped polling after %lu passes, %lu items, %lu sleeps\n",
+         core->cpu, core->passes, core->work, core->sleeps);
+
+    core->running = 0;
+}
+
+
+int
+nk_poll_core_start (int cpu)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    struct nk_poll_core * core;
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    rt_constraints c = { .aperiodic = { .priority = 0 } };
+#endif
+
+    if (cpu < 0 || cpu >= sys->num_cpus) {
+        ERROR("Invalid CPU %d\n", cpu);
+        return -1;
+    }
+
+    if ((core = poll_cores[cpu])) {
+        if (core->running) {
+            ERROR("CPU %d is already a poll core\n", cpu);
+            return -1;
+        }
+        /* stopped, resume with the sources it had */
+        core->stop = 0;
+        goto start;
+    }
+
+    /* malloc blocks are naturally aligned, so the lines stay apart */
+    core = malloc(sizeof(struct nk_poll_core));
+    if (!core) {
+        ERROR("Cannot allocate poll core\n");
+        return -1;
+    }
+    memset(core, 0, sizeof(struct nk_poll_core));
+
+    core->cpu = cpu;
+    spinlock_init(&core->lock);
+
+ start:
+    core->running = 1;
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    if (nk_thread_start(poll_core_loop, core, 0, 1, TSTACK_DEFAULT, 0, cpu, APERIODIC, &c, 0)) {
+#else
+    if (nk_thread_start(poll_core_loop, core, 0, 1, TSTACK_DEFAULT, 0, cpu)) {
+#endif
+        ERROR("Cannot start poll thread on CPU %d\n", cpu);
+        core->running = 0;
+        if (!poll_cores[cpu]) {
+            free(core);
+        }
+        return -1;
+    }
+
+    poll_cores[cpu] = core;
+
+    return 0;
+}
+
+
+/* the core stays reserved and keeps its sources, starting it again resumes */
+int
+nk_poll_core_stop (int cpu)
+{
+    struct nk_poll_core * core = nk_poll_core_get(cpu);
+
+    if (!core) {
+        return -1;
+    }
+
+    core->stop = 1;
+    nk_poll_core_ring(core);
+
+    return 0;
+}
+
+
+struct nk_poll_core *
+nk_poll_core_get (int cpu)
+{
+    if (cpu < 0 || cpu >= NAUT_CONFIG_MAX_CPUS) {
+        return NULL;
+    }
+    return poll_cores[cpu];
+}
+
+
+int
+nk_poll_cpu_reserved (int cpu)
+{
+    return nk_poll_core_get(cpu) != NULL;
+}
+
+
+int
+nk_poll_add (int cpu, nk_poll_fn_t poll, void * priv, volatile void * monitor)
+{
+    struct nk_poll_core * core = nk_poll_core_get(cpu);
+    uint8_t flags;
+    int i;
+
+    if (!core || !poll) {
+        ERROR("No poll core on CPU %d\n", cpu);
+        return -1;
+    }
+
+    flags = spin_lock_irq_save(&core->lock);
+
+    i = core->nsrc;
+    if (i >= NK_POLL_MAX_SOURCES) {
+        spin_unlock_irq_restore(&core->lock, flags);
+        ERROR("CPU %d has no room for another source\n", cpu);
+        return -1;
+    }
+
+    core->src[i].poll = poll;
+    core->src[i].priv = priv;
+    core->src[i].monitor = monitor;
+
+    /* the slot is complete before the loop can see it */
+    __sync_synchronize();
+    core->nsrc = i + 1;
+
+    spin_unlock_irq_restore(&core->lock, flags);
+
+    /* a sleeping core may be watching the wrong line now */
+    nk_poll_core_ring(core);
+
+    DEBUG("CPU %d: source %d added\n", cpu, i);
+
+    return 0;
+}
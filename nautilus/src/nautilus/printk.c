@@ -44,6 +44,13 @@
 #include <nautilus/math.h>
 #include <nautilus/vc.h>
 
+#ifdef NAUT_CONFIG_SERIAL_ASYNC
+#include <dev/serial.h>
+#endif
+#ifdef NAUT_CONFIG_VIRTIO_CONSOLE
+#include <dev/virtio_console.h>
+#endif
+
 // All output is handled via the virtual console
 #define do_putchar(x) do { nk_vc_putchar(x);} while (0)
 #define do_puts(x)    do { nk_vc_puts(x); } while (0)
@@ -121,6 +128,21 @@ panic (const char * fmt, ...)
 {
     va_list arg;
 
+#ifdef NAUT_CONFIG_SERIAL_ASYNC
+    /* get everything queued out, and send the rest synchronously */
+    serial_async_panic();
+#endif
+
+#ifdef NAUT_CONFIG_VIRTIO_CONSOLE
+    /* no more completion interrupts, push each write out as it comes */
+    virtio_console_panic();
+#endif
+
+#ifdef NAUT_CONFIG_PRINTK_FAST
+    /* what was logged before the panic comes first */
+    nk_printk_fast_panic();
+#endif
+
     va_start(arg, fmt);
     vprintk(fmt, arg);
     va_end(arg);
@@ -0,0 +1,351 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+#include <nautilus/housekeeping.h>
+#endif
+#include <nautilus/thread.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/intrinsics.h>
+#include <nautilus/printk.h>
+#include <dev/timer.h>
+
+/*
+ * Deferred-format printk.
+ *
+ * printk_fast() stores the format pointer and the raw arguments in a
+ * binary record on the calling core's ring and returns; nothing is
+ * formatted and no lock is taken. A drain thread on a housekeeping
+ * core turns the records into text every few milliseconds and prints
+ * them with the core and TSC they were logged at.
+ *
+ * A record's slot is claimed with an unlocked XADD, as in trace.c, so
+ * an interrupt that logs in the middle of a record takes the next
+ * slot. The record's seq is cleared while it is written and set to
+ * its slot number plus one once it is whole, which tells the drainer
+ * both that it is complete and that it has not been overwritten.
+ */
+
+#define PFAST_ENTRIES NAUT_CONFIG_PRINTK_FAST_ENTRIES
+
+#if (PFAST_ENTRIES & (PFAST_ENTRIES - 1)) != 0
+#error "NAUT_CONFIG_PRINTK_FAST_ENTRIES must be a power of two"
+#endif
+
+#define PFAST_LINE 256
+
+#define pfast_barrier() asm volatile ("" ::: "memory")
+
+struct pfast_rec {
+    volatile uint64_t seq;
+    uint64_t          tsc;
+    const char *      fmt;
+    uint64_t          nargs;
+    uint64_t          args[PRINTK_FAST_MAX_ARGS];
+};
+
+struct pfast_ring {
+    volatile uint64_t  head;    /* records ever claimed */
+    uint64_t           tail;    /* next record the drainer wants */
+    uint64_t           lost;
+    struct pfast_rec * recs;
+} __align(64);
+
+static struct pfast_ring rings[NAUT_CONFIG_MAX_CPUS];
+
+static spinlock_t drain_lock;
+
+static volatile uint8_t pfast_on = 0;
+
+extern uint8_t cpu_info_ready;
+
+
+int
+nk_printk_fast (const char * fmt, int nargs, ...)
+{
+    struct pfast_ring * r;
+    struct pfast_rec * rec;
+    va_list args;
+    uint64_t i = 1;
+    int k;
+
+    va_start(args, nargs);
+
+    /* until the rings are up, and for calls we cannot record, print now */
+    if (!pfast_on || !cpu_info_ready || nargs > PRINTK_FAST_MAX_ARGS) {
+        k = vprintk(fmt, args);
+        va_end(args);
+        return k;
+    }
+
+    r = &rings[my_cpu_id()];
+
+    asm volatile ("xaddq %0, %1" : "+r"(i), "+m"(r->head) : : "memory");
+
+    rec = &r->recs[i & (PFAST_ENTRIES - 1)];
+    rec->seq = 0;
+    pfast_barrier();
+
+    rec->tsc   = rdtsc();
+    rec->fmt   = fmt;
+    rec->nargs = nargs;
+
+    /*
+     * every integer or pointer argument has a full 8 byte slot on
+     * x86-64, so they can all be taken as 64 bits here and narrowed
+     * again by their conversion when the record is formatted
+     */
+    for (k = 0; k < nargs; k++) {
+        rec->args[k] = va_arg(args, uint64_t);
+    }
+
+    pfast_barrier();
+    rec->seq = i + 1;
+
+    va_end(args);
+
+    return 0;
+}
+
+
+/*
+ * Format one record into buf. Conversions are handed one at a time
+ * to snprintf with the argument cast to the type the length modifier
+ * asks for. There is no floating point and no '*' width, since the
+ * arguments were never captured as such; those are copied out as-is.
+ */
+static int
+pfast_format (char * buf, int size, struct pfast_rec * rec)
+{
+    const char * f = rec->fmt;
+    char spec[16];
+    int len = 0;
+    int arg = 0;
+    int n, longs;
+
+    while (*f && len < size - 1) {
+
+        if (*f != '%') {
+            buf[len++] = *f++;
+            continue;
+        }
+
+        if (f[1] == '%') {
+            buf[len++] = '%';
+            f += 2;
+            continue;
+        }
+
+        /* %, flags, width, precision and length, then the conversion */
+        n = 0;
+        longs = 0;
+        spec[n++] = *f++;
+        while (*f && strchr("-+ #0123456789.", *f) && n < (int)sizeof(spec) - 4) {
+            spec[n++] = *f++;
+        }
+        while (*f && strchr("hlzjtq", *f) && n < (int)sizeof(spec) - 2) {
+            if (*f == 'l' || *f == 'z' || *f == 'j' || *f == 't' || *f == 'q') {
+                longs++;
+            }
+            spec[n++] = *f++;
+        }
+        if (!*f) {
+            break;
+        }
+        spec[n++] = *f;
+        spec[n] = 0;
+
+        if (!strchr("diuxXocsp", *f) || arg >= rec->nargs) {
+            len += snprintf(buf + len, size - len, "%s", spec);
+        } else if (*f == 's') {
+            len += snprintf(buf + len, size - len, spec, (char *)rec->args[arg++]);
+        } else if (*f == 'p') {
+            len += snprintf(buf + len, size - len, spec, (void *)rec->args[arg++]);
+        } else if (longs) {
+            len += snprintf(buf + len, size - len, spec, rec->args[arg++]);
+        } else {
+            len += snprintf(buf + len, size - len, spec, (unsigned int)rec->args[arg++]);
+        }
+        f++;
+
+        if (len > size - 1) {
+            len = size - 1;
+        }
+    }
+
+    buf[len] = 0;
+
+    return len;
+}
+
+
+static void
+pfast_drain_ring (int cpu)
+{
+    struct pfast_ring * r = &rings[cpu];
+    struct pfast_rec rec;
+    char line[PFAST_LINE];
+    uint64_t head, i;
+
+    if (!r->recs) {
+        return;
+    }
+
+    head = r->head;
+
+    if (head - r->tail > PFAST_ENTRIES) {
+        r->lost += head - r->tail - PFAST_ENTRIES;
+        r->tail  = head - PFAST_ENTRIES;
+    }
+
+    for (i = r->tail; i < head; i++) {
+        struct pfast_rec * slot = &r->recs[i & (PFAST_ENTRIES - 1)];
+
+        if (slot->seq != i + 1) {
+            if (r->head - i <= PFAST_ENTRIES) {
+                /* still being written, pick it up next time */
+                break;
+            }
+            r->lost++;
+            continue;
+        }
+
+        rec = *slot;
+        pfast_barrier();
+
+        if (slot->seq != i + 1 || rec.nargs > PRINTK_FAST_MAX_ARGS) {
+            /* overwritten while we copied it */
+            r->lost++;
+            continue;
+        }
+
+        pfast_format(line, PFAST_LINE, &rec);
+        printk("[%d %lu] %s", cpu, rec.tsc, line);
+    }
+
+    r->tail = i;
+
+    if (r->lost) {
+        printk("printk_fast: cpu %d lost %lu records\n", cpu, r->lost);
+        r->lost = 0;
+    }
+}
+
+
+void
+nk_printk_fast_flush (void)
+{
+    int cpu;
+
+    spin_lock(&drain_lock);
+    for (cpu = 0; cpu < nk_get_num_cpus(); cpu++) {
+        pfast_drain_ring(cpu);
+    }
+    spin_unlock(&drain_lock);
+}
+
+
+/* from panic, where the drainer may be stuck holding the lock */
+void
+nk_printk_fast_panic (void)
+{
+    int cpu;
+
+    if (!pfast_on) {
+        return;
+    }
+
+    pfast_on = 0;
+    for (cpu = 0; cpu < nk_get_num_cpus(); cpu++) {
+        pfast_drain_ring(cpu);
+    }
+}
+
+
+static void
+pfast_drain (void * in, void ** out)
+{
+    while (1) {
+        nk_sleep(NAUT_CONFIG_PRINTK_FAST_MS);
+        nk_printk_fast_flush();
+    }
+}
+
+
+int
+nk_printk_fast_init (void)
+{
+    int i;
+
+    spinlock_init(&drain_lock);
+
+    for (i = 0; i < nk_get_num_cpus(); i++) {
+        rings[i].recs = malloc(PFAST_ENTRIES * sizeof(struct pfast_rec));
+        if (!rings[i].recs) {
+            printk("printk_fast: could not allocate ring for cpu %d\n", i);
+            return -1;
+        }
+        memset(rings[i].recs, 0, PFAST_ENTRIES * sizeof(struct pfast_rec));
+        rings[i].head = 0;
+        rings[i].tail = 0;
+        rings[i].lost = 0;
+    }
+
+    pfast_on = 1;
+    mbarrier();
+
+    return 0;
+}
+
+
+/* records pile up from init on, and are printed once this thread runs */
+int
+nk_printk_fast_start (void)
+{
+    int cpu = NAUT_CONFIG_PRINTK_FAST_CPU;
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    rt_constraints c = { .aperiodic = { .priority = 0 } };
+#endif
+
+    if (cpu >= nk_get_num_cpus()) {
+        cpu = 0;
+    }
+
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+    if (!nk_is_housekeeping(cpu)) {
+        cpu = nk_housekeeping_cpu();
+    }
+#endif
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    if (nk_thread_start(pfast_drain, 0, 0, 1, TSTACK_DEFAULT, 0, cpu, APERIODIC, &c, 0)) {
+#else
+    if (nk_thread_start(pfast_drain, 0, 0, 1, TSTACK_DEFAULT, 0, cpu)) {
+#endif
+        printk("printk_fast: cannot start drain thread\n");
+        return -1;
+    }
+
+    printk("printk_fast: %d records per cpu, drained every %d ms on cpu %d\n",
+           PFAST_ENTRIES, NAUT_CONFIG_PRINTK_FAST_MS, cpu);
+
+    return 0;
+}
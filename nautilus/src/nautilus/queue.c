@@ -24,14 +24,45 @@
 #include <nautilus/spinlock.h>
 #include <nautilus/intrinsics.h>
 #include <nautilus/mm.h>
+#ifdef NAUT_CONFIG_KMEM_SLAB
+#include <nautilus/slab.h>
+#include <nautilus/atomic.h>
+#endif
 
 
 
+#ifdef NAUT_CONFIG_KMEM_SLAB
+static struct nk_slab_cache * queue_slab = NULL;
+
+/* made on first use, a core that loses the race drops its own */
+static struct nk_slab_cache *
+queue_cache (void)
+{
+    struct nk_slab_cache * c;
+
+    if (likely(queue_slab != NULL)) {
+        return queue_slab;
+    }
+
+    c = nk_slab_cache_create("nk_queue", sizeof(nk_queue_t), 0, NULL);
+    if (c && atomic_cmpswap(queue_slab, NULL, c) != NULL) {
+        nk_slab_cache_destroy(c);
+    }
+    return queue_slab;
+}
+#endif
+
+
 nk_queue_t*
 nk_queue_create (void)
 {
     nk_queue_t * q = NULL;
+#ifdef NAUT_CONFIG_KMEM_SLAB
+    struct nk_slab_cache * c = queue_cache();
+    q = c ? nk_slab_alloc(c) : NULL;
+#else
     q = malloc(sizeof(nk_queue_t));
+#endif
     if (unlikely(!q)) {
         return NULL;
     }
@@ -41,6 +72,12 @@ nk_queue_create (void)
 
     spinlock_init(&(q->lock));
 
+#ifdef NAUT_CONFIG_LOCKFREE_RUNQ
+    q->mpsc_head = &(q->mpsc_stub);
+    q->mpsc_tail = &(q->mpsc_stub);
+    q->mpsc_stub.node.next = NULL;
+#endif
+
     return q;
 }
 
@@ -58,7 +95,11 @@ nk_queue_destroy (nk_queue_t * q, uint8_t free_entries)
         }
     }
 
+#ifdef NAUT_CONFIG_KMEM_SLAB
+    nk_slab_free(queue_slab, q);
+#else
     free(q);
+#endif
 }
 
 
@@ -116,6 +157,52 @@ nk_dequeue_first_atomic (nk_queue_t * q)
 
 
 
+#ifdef NAUT_CONFIG_LOCKFREE_RUNQ
+#define mpsc_next(e) ((nk_queue_entry_t*)((e)->node.next))
+
+/*
+ * Owner only. Returns the oldest entry in the inbox, or NULL if it is
+ * empty or the only entry left is still being linked in by a producer
+ * (it shows up on the next pop).
+ */
+nk_queue_entry_t*
+nk_queue_mpsc_pop (nk_queue_t * q)
+{
+    nk_queue_entry_t * tail = q->mpsc_tail;
+    nk_queue_entry_t * next = mpsc_next(tail);
+
+    if (tail == &(q->mpsc_stub)) {
+        if (!next) {
+            return NULL;
+        }
+        q->mpsc_tail = next;
+        tail = next;
+        next = mpsc_next(next);
+    }
+
+    if (next) {
+        q->mpsc_tail = next;
+        return tail;
+    }
+
+    if (tail != q->mpsc_head) {
+        return NULL;
+    }
+
+    /* tail is the last entry, put the stub behind it so it can go */
+    nk_queue_mpsc_push(q, &(q->mpsc_stub));
+
+    next = mpsc_next(tail);
+    if (next) {
+        q->mpsc_tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
+#endif
+
+
 uint8_t 
 nk_queue_empty_atomic (nk_queue_t * q)
 {
@@ -29,17 +29,37 @@
 #include <nautilus/spinlock.h>
 #include <nautilus/random.h>
 #include <nautilus/mm.h>
-#include <dev/apic.h>
+#include <nautilus/cpuid.h>
+
+
+/*
+ * Each CPU has a splitmix64 generator: a counter that moves by a fixed
+ * odd constant and a finalizer that scrambles it into the output. The
+ * whole state is that one word, so taking a value is a single xadd on
+ * our own cache line. That is safe against interrupts on this CPU and
+ * against a thread that migrates halfway through, neither of which the
+ * old per-CPU lock could do without turning interrupts off.
+ */
+#define RAND_GAMMA 0x9e3779b97f4a7c15ULL
+
+typedef uint64_t __attribute__((__may_alias__)) rand_word_t;
+
+static inline uint64_t
+rand_mix (uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
 
 
 void
 nk_rand_seed (uint64_t seed) {
     struct nk_rand_info * rand = per_cpu_get(rand);
-    uint8_t flags = spin_lock_irq_save(&rand->lock);
+    rand->ctr  = seed;
     rand->xi   = seed;
     rand->seed = seed;
     rand->n    = 0;
-    spin_unlock_irq_restore(&rand->lock, flags);
 }
 
 
@@ -57,56 +77,119 @@ nk_rand_set_xi (uint64_t xi)
 }
 
 
-#define _AB(x,n) ((char)(((x) >> (n)) & 0xff))
-/* 
- * To get something appearing random, 
- * we fold the APIC IRRs together and 
- * then combine them with the cycle count
- *
- * this is likely pretty bogus, but 
- * we don't need any kind of security for now,
- * just something that appears random
- */
-static char
-get_rand_byte (void) 
+uint64_t
+nk_get_rand_u64 (void)
 {
-    struct apic_dev * apic = per_cpu_get(apic);
     struct nk_rand_info * rand = per_cpu_get(rand);
-    uint64_t cycles;
-    uint32_t val;
-    char b =  0xff;
-    char b2 = 0;
-    uint8_t i;
-
-
-    for (i = 0; i < 8; i++) {
-        val = apic_read(apic, APIC_GET_IRR(i)) ^ (rand->seed & 0xffffffff);
-        b ^= ~(_AB(val, 0) ^
-               _AB(val, 1) ^
-               _AB(val, 2) ^
-               _AB(val, 3));
+    return rand_mix(__sync_add_and_fetch(&rand->ctr, RAND_GAMMA));
+}
+
+
+/*
+ * Reserves all of the counter values it needs with one xadd, after which
+ * the words are independent of each other. Four are made per iteration
+ * so the multiplies of one overlap with those of the others; the work
+ * stays in general purpose registers, see memcpy() for why.
+ */
+void
+nk_get_rand_bytes (uint8_t * buf, unsigned len)
+{
+    struct nk_rand_info * rand;
+    uint64_t nwords = (len + 7) / 8;
+    uint64_t c;
+    uint64_t w;
+
+    if (!buf || !len) {
+        return;
     }
 
-    cycles = rdtsc();
+    rand = per_cpu_get(rand);
+    c = __sync_fetch_and_add(&rand->ctr, nwords * RAND_GAMMA);
+
+    for (; len >= 32; len -= 32, buf += 32, c += 4 * RAND_GAMMA) {
+        uint64_t w0 = rand_mix(c + RAND_GAMMA);
+        uint64_t w1 = rand_mix(c + 2 * RAND_GAMMA);
+        uint64_t w2 = rand_mix(c + 3 * RAND_GAMMA);
+        uint64_t w3 = rand_mix(c + 4 * RAND_GAMMA);
+        ((rand_word_t *)buf)[0] = w0;
+        ((rand_word_t *)buf)[1] = w1;
+        ((rand_word_t *)buf)[2] = w2;
+        ((rand_word_t *)buf)[3] = w3;
+    }
 
-    for (i = 0; i < 8; i++) {
-        b2 ^= _AB(cycles, i);
+    for (; len >= 8; len -= 8, buf += 8) {
+        c += RAND_GAMMA;
+        *(rand_word_t *)buf = rand_mix(c);
     }
 
-    return b + b2;
+    if (len) {
+        w = rand_mix(c + RAND_GAMMA);
+        while (len--) {
+            *buf++ = w & 0xff;
+            w >>= 8;
+        }
+    }
 }
 
 
-void
-nk_get_rand_bytes (uint8_t * buf, unsigned len)
+/*
+ * A seed from the hardware's entropy source where there is one, RDSEED
+ * before RDRAND. Otherwise the cycle count, which at least differs from
+ * one CPU and one boot to the next.
+ */
+static inline int
+rand_rdseed (uint64_t * v)
 {
-    if (!buf) {
-        return;
+    uint8_t ok;
+    asm volatile ("rdseed %0; setc %1" : "=r"(*v), "=qm"(ok) : : "cc");
+    return ok;
+}
+
+
+static inline int
+rand_rdrand (uint64_t * v)
+{
+    uint8_t ok;
+    asm volatile ("rdrand %0; setc %1" : "=r"(*v), "=qm"(ok) : : "cc");
+    return ok;
+}
+
+
+static uint64_t
+rand_hw_seed (struct cpu * cpu)
+{
+    cpuid_ret_t r;
+    uint32_t max;
+    uint64_t v;
+    int i;
+
+    cpuid(0, &r);
+    max = r.a;
+
+    if (max >= 7) {
+        cpuid_sub(7, 0, &r);
+        // CPUID.7.0:EBX[18]
+        if (r.b & (1 << 18)) {
+            for (i = 0; i < 16; i++) {
+                if (rand_rdseed(&v)) {
+                    return v;
+                }
+            }
+        }
     }
 
-    while (len--) {
-        *buf++ = get_rand_byte();
+    cpuid(1, &r);
+
+    // CPUID.1:ECX[30]
+    if (r.c & (1 << 30)) {
+        for (i = 0; i < 16; i++) {
+            if (rand_rdrand(&v)) {
+                return v;
+            }
+        }
     }
+
+    return rand_mix(rdtsc() ^ ((uint64_t)cpu->id << 32));
 }
 
 
@@ -122,5 +205,7 @@ nk_rand_init (struct cpu * cpu)
 
     spinlock_init(&cpu->rand->lock);
 
+    cpu->rand->ctr = rand_hw_seed(cpu);
+
     return 0;
 }
@@ -391,3 +391,153 @@ void nk_rb_replace_node(struct rb_node *victim, struct rb_node *new,
     *new = *victim;
 }
 
+
+
+/*
+ * Augmented trees
+ *
+ * A node can carry something computed from its subtree (a maximum, a
+ * count). Insertion and erasure only ever change the subtrees of the
+ * nodes along one path and their siblings, so recomputing those from
+ * the bottom up is enough to keep every node's value right. func
+ * recomputes one node from its children.
+ */
+static void nk_rb_augment_path(struct rb_node *node, nk_rb_augment_f func,
+			       void *data)
+{
+    struct rb_node *parent;
+
+    while (1) {
+	func(node, data);
+	parent = rb_parent(node);
+	if (!parent)
+	    return;
+
+	if (node == parent->rb_left && parent->rb_right)
+	    func(parent->rb_right, data);
+	else if (parent->rb_left)
+	    func(parent->rb_left, data);
+
+	node = parent;
+    }
+}
+
+
+/*
+ * after nk_rb_insert_color()
+ */
+void nk_rb_augment_insert(struct rb_node *node, nk_rb_augment_f func,
+			  void *data)
+{
+    if (node->rb_left)
+	node = node->rb_left;
+    else if (node->rb_right)
+	node = node->rb_right;
+
+    nk_rb_augment_path(node, func, data);
+}
+
+
+/*
+ * before nk_rb_erase(): the deepest node whose subtree the erase will
+ * change, to hand to nk_rb_augment_erase_end() afterwards
+ */
+struct rb_node *nk_rb_augment_erase_begin(struct rb_node *node)
+{
+    struct rb_node *deepest;
+
+    if (!node->rb_right && !node->rb_left)
+	deepest = rb_parent(node);
+    else if (!node->rb_right)
+	deepest = node->rb_left;
+    else if (!node->rb_left)
+	deepest = node->rb_right;
+    else {
+	deepest = nk_rb_next(node);
+	if (deepest->rb_right)
+	    deepest = deepest->rb_right;
+	else if (rb_parent(deepest) != node)
+	    deepest = rb_parent(deepest);
+    }
+
+    return deepest;
+}
+
+
+void nk_rb_augment_erase_end(struct rb_node *node, nk_rb_augment_f func,
+			     void *data)
+{
+    if (node)
+	nk_rb_augment_path(node, func, data);
+}
+
+
+/*
+ * Order statistics: each node counts the nodes in its subtree, so the
+ * k-th node and a node's rank are found in O(log n).
+ */
+static inline unsigned long os_size(struct rb_node *n)
+{
+    return n ? rb_entry(n, struct nk_rb_os_node, rb)->size : 0;
+}
+
+
+static void os_update(struct rb_node *n, void *data)
+{
+    rb_entry(n, struct nk_rb_os_node, rb)->size =
+	1 + os_size(n->rb_left) + os_size(n->rb_right);
+}
+
+
+void nk_rb_os_insert_color(struct nk_rb_os_node *node, struct rb_root *root)
+{
+    node->size = 1;
+    nk_rb_insert_color(&node->rb, root);
+    nk_rb_augment_insert(&node->rb, os_update, NULL);
+}
+
+
+void nk_rb_os_erase(struct nk_rb_os_node *node, struct rb_root *root)
+{
+    struct rb_node *deepest = nk_rb_augment_erase_begin(&node->rb);
+
+    nk_rb_erase(&node->rb, root);
+    nk_rb_augment_erase_end(deepest, os_update, NULL);
+}
+
+
+struct nk_rb_os_node *nk_rb_os_select(struct rb_root *root, unsigned long k)
+{
+    struct rb_node *n = root->rb_node;
+
+    while (n) {
+	unsigned long left = os_size(n->rb_left);
+
+	if (k < left) {
+	    n = n->rb_left;
+	} else if (k == left) {
+	    return rb_entry(n, struct nk_rb_os_node, rb);
+	} else {
+	    k -= left + 1;
+	    n = n->rb_right;
+	}
+    }
+
+    return NULL;
+}
+
+
+unsigned long nk_rb_os_rank(struct nk_rb_os_node *node)
+{
+    struct rb_node *n = &node->rb;
+    struct rb_node *parent;
+    unsigned long rank = os_size(n->rb_left);
+
+    while ((parent = rb_parent(n))) {
+	if (n == parent->rb_right)
+	    rank += os_size(parent->rb_left) + 1;
+	n = parent;
+    }
+
+    return rank;
+}
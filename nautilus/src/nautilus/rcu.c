@@ -0,0 +1,306 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/smp.h>
+#include <nautilus/cpu.h>
+#include <nautilus/irq.h>
+#include <nautilus/atomic.h>
+#include <nautilus/percpu.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/intrinsics.h>
+#include <nautilus/rcu.h>
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+#include <nautilus/housekeeping.h>
+#endif
+
+#ifndef NAUT_CONFIG_DEBUG_SYNCH
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define RCU_DEBUG(fmt, args...) DEBUG_PRINT("RCU: " fmt, ##args)
+
+/*
+ * Grace periods are numbered. cur is the last one started and done
+ * the last one completed, so one is in progress while cur != done.
+ * Anyone who needs a grace period raises want, and a new one is
+ * started whenever the previous completes and want is ahead of it.
+ */
+static struct {
+    spinlock_t        lock;
+    volatile uint64_t cur;
+    volatile uint64_t done;
+    uint64_t          want;
+    volatile uint64_t remaining;   /* cores yet to pass a QS in cur */
+    uint32_t          ncpus;
+} __align(64) rcu;
+
+struct rcu_cpu {
+    volatile uint64_t    qs_gp;      /* last grace period we passed a QS in */
+    struct nk_rcu_head * next;       /* queued, no grace period assigned yet */
+    struct nk_rcu_head ** next_tail;
+    struct nk_rcu_head * wait;       /* waiting for wait_gp to complete */
+    uint64_t             wait_gp;
+} __align(64);
+
+static struct rcu_cpu rcu_cpus[NAUT_CONFIG_MAX_CPUS];
+
+static volatile uint8_t rcu_ready = 0;
+
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+/* callbacks queued on the other cores, taken by a housekeeping core */
+static struct {
+    spinlock_t            lock;
+    struct nk_rcu_head *  head;
+    struct nk_rcu_head ** tail;
+} __align(64) rcu_offload;
+
+
+/* interrupts off */
+static void
+rcu_take_offload (struct rcu_cpu * c)
+{
+    spin_lock(&rcu_offload.lock);
+    if (rcu_offload.head) {
+        *c->next_tail     = rcu_offload.head;
+        c->next_tail      = rcu_offload.tail;
+        rcu_offload.head  = NULL;
+        rcu_offload.tail  = &rcu_offload.head;
+    }
+    spin_unlock(&rcu_offload.lock);
+}
+#endif
+
+
+/* rcu.lock held */
+static void
+rcu_start_gp (void)
+{
+    if (rcu.cur == rcu.done && rcu.want > rcu.done) {
+        rcu.remaining = rcu.ncpus;
+        mbarrier();
+        rcu.cur = rcu.cur + 1;
+        RCU_DEBUG("grace period %lu started\n", rcu.cur);
+    }
+}
+
+
+/*
+ * The grace period whose completion covers every reader running now.
+ * If one is already in progress, some cores may have passed their QS
+ * in it before these readers started, so we need the next one; if
+ * none is, we need the next one to start. Either way that is cur + 1.
+ */
+static uint64_t
+rcu_request_gp (void)
+{
+    uint8_t flags;
+    uint64_t gp;
+
+    flags = spin_lock_irq_save(&rcu.lock);
+    gp = rcu.cur + 1;
+    if (rcu.want < gp) {
+        rcu.want = gp;
+    }
+    rcu_start_gp();
+    spin_unlock_irq_restore(&rcu.lock, flags);
+
+    return gp;
+}
+
+
+/* interrupts off, and no reader in flight on this core */
+static void
+rcu_note_qs (struct rcu_cpu * c)
+{
+    uint64_t cur = rcu.cur;
+
+    if (c->qs_gp == cur) {
+        return;
+    }
+
+    c->qs_gp = cur;
+
+    if (atomic_dec_val(rcu.remaining) == 0) {
+        spin_lock(&rcu.lock);
+        rcu.done = cur;
+        RCU_DEBUG("grace period %lu complete\n", cur);
+        rcu_start_gp();
+        spin_unlock(&rcu.lock);
+    }
+}
+
+
+static void
+rcu_do_callbacks (struct rcu_cpu * c)
+{
+    struct nk_rcu_head * h;
+    struct nk_rcu_head * n;
+
+    if (c->wait && rcu.done >= c->wait_gp) {
+        h = c->wait;
+        c->wait = NULL;
+        while (h) {
+            n = h->next;
+            h->func(h);
+            h = n;
+        }
+    }
+
+    if (!c->wait && c->next) {
+        c->wait      = c->next;
+        c->next      = NULL;
+        c->next_tail = &c->next;
+        c->wait_gp   = rcu_request_gp();
+    }
+}
+
+
+void
+nk_rcu_check (void)
+{
+    struct rcu_cpu * c;
+
+    if (unlikely(!rcu_ready)) {
+        return;
+    }
+
+    c = &rcu_cpus[my_cpu_id()];
+
+    if (c->qs_gp != rcu.cur) {
+        rcu_note_qs(c);
+    }
+
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+    if (rcu_offload.head && nk_is_housekeeping(my_cpu_id())) {
+        rcu_take_offload(c);
+    }
+#endif
+
+    if (c->wait || c->next) {
+        rcu_do_callbacks(c);
+    }
+}
+
+
+void
+nk_call_rcu (struct nk_rcu_head * head, void (*func)(struct nk_rcu_head * head))
+{
+    struct rcu_cpu * c;
+    uint8_t flags;
+
+    head->func = func;
+    head->next = NULL;
+
+    /* one core, and the caller is not a reader, so nobody can see it */
+    if (!rcu_ready) {
+        func(head);
+        return;
+    }
+
+    flags = irq_disable_save();
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+    if (!nk_is_housekeeping(my_cpu_id())) {
+        spin_lock(&rcu_offload.lock);
+        *rcu_offload.tail = head;
+        rcu_offload.tail  = &head->next;
+        spin_unlock(&rcu_offload.lock);
+        irq_enable_restore(flags);
+        return;
+    }
+#endif
+    c = &rcu_cpus[my_cpu_id()];
+    *c->next_tail = head;
+    c->next_tail  = &head->next;
+    irq_enable_restore(flags);
+}
+
+
+/* runs from the xcall interrupt, so the interrupted context is not a reader */
+static void
+rcu_qs_xcall (void * arg)
+{
+    rcu_note_qs(&rcu_cpus[my_cpu_id()]);
+}
+
+
+/*
+ * Wait out a grace period. Cores are normally pushed through their
+ * quiescent states by their own timer and device interrupts, but an
+ * idle core may see none, so stragglers get an xcall that reports
+ * for them. Must be called with interrupts on and outside any
+ * read-side section.
+ */
+void
+nk_rcu_synchronize (void)
+{
+    uint64_t gp;
+    uint64_t cur;
+    uint32_t i;
+
+    if (!rcu_ready) {
+        return;
+    }
+
+    gp = rcu_request_gp();
+
+    while (rcu.done < gp) {
+        cur = rcu.cur;
+        for (i = 0; i < rcu.ncpus && rcu.done < gp; i++) {
+            if (rcu_cpus[i].qs_gp < cur) {
+                smp_xcall(i, rcu_qs_xcall, NULL, 1);
+            }
+        }
+        PAUSE_WHILE(rcu.cur == cur && rcu.done < cur);
+    }
+}
+
+
+int
+nk_rcu_init (void)
+{
+    uint32_t i;
+
+    spinlock_init(&rcu.lock);
+    rcu.cur   = 0;
+    rcu.done  = 0;
+    rcu.want  = 0;
+    rcu.ncpus = nk_get_num_cpus();
+
+    for (i = 0; i < NAUT_CONFIG_MAX_CPUS; i++) {
+        rcu_cpus[i].qs_gp     = 0;
+        rcu_cpus[i].next      = NULL;
+        rcu_cpus[i].next_tail = &rcu_cpus[i].next;
+        rcu_cpus[i].wait      = NULL;
+    }
+
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+    spinlock_init(&rcu_offload.lock);
+    rcu_offload.head = NULL;
+    rcu_offload.tail = &rcu_offload.head;
+#endif
+
+    mbarrier();
+    rcu_ready = 1;
+
+    RCU_DEBUG("RCU ready on %u cores\n", rcu.ncpus);
+
+    return 0;
+}
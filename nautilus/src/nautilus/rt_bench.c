@@ -0,0 +1,333 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/rt_scheduler.h>
+#include <nautilus/rt_bench.h>
+#include <nautilus/cpu.h>
+#include <nautilus/smp.h>
+
+#define RT_BENCH_PRINT(fmt, args...) printk("RT BENCH: " fmt, ##args)
+#define RT_BENCH_ERROR(fmt, args...) printk("RT BENCH ERROR: " fmt, ##args)
+
+#ifndef MAX
+#define MAX(x, y) (((x) >(y)) ? (x) : (y))
+#endif
+
+// Gaps in the TSC longer than this are time the job did not run
+#define RT_BENCH_GAP 2000
+
+// Most threads in one set, bounded by the simulator's pool
+#define RT_BENCH_MAX_TASKS 256
+
+// Period multipliers, all divisors of 120
+static const uint32_t period_mult[] = { 1, 2, 3, 4, 5, 6, 8, 10, 12, 15, 20, 24, 30, 40, 60, 120 };
+#define NUM_MULT (sizeof(period_mult) / sizeof(period_mult[0]))
+
+typedef struct rt_bench_task {
+    nk_thread_id_t tid;
+    volatile uint64_t end;      /* no job is started after this */
+    uint64_t exec;              /* cycles of work per job */
+    volatile uint8_t done;
+    rt_stats stats;
+} rt_bench_task;
+
+typedef struct rt_bench_point {
+    uint64_t sets, admitted, sim_ok, sim_failed;
+    uint64_t false_accept;      /* admitted, but the simulator misses */
+    uint64_t false_reject;      /* the simulator meets every deadline */
+    uint64_t sim_optimistic;    /* simulated clean, missed in the run */
+    uint64_t releases, misses, skipped;
+    uint64_t passes, pass_cycles, pass_max;
+} rt_bench_point;
+
+
+/* xorshift64*, so a seed reproduces its task sets */
+static uint64_t bench_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ULL;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b)
+{
+    while (b) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/*
+ * UUniFast draws utilizations uniformly from the simplex summing to
+ * util. Sorting n-1 uniform points on [0, util] and taking the gaps
+ * between them has the same distribution and needs no n-th roots, so
+ * it is what we do here.
+ */
+uint64_t nk_rt_taskset_gen(uint64_t *seed, uint32_t n, uint64_t util,
+                           uint64_t period_min, uint64_t period_max,
+                           rt_constraints *set)
+{
+    uint64_t cut[RT_BENCH_MAX_TASKS + 1];
+    uint64_t lcm = 1, prev = 0;
+    uint32_t mults = 0, i, j;
+
+    if (n == 0 || n > RT_BENCH_MAX_TASKS || period_min == 0 || period_max < period_min) {
+        return 0;
+    }
+
+    while (mults < NUM_MULT && period_min * period_mult[mults] <= period_max) {
+        mults++;
+    }
+
+    for (i = 0; i + 1 < n; i++) {
+        uint64_t c = bench_rand(seed) % (util + 1);
+
+        for (j = i; j > 0 && cut[j - 1] > c; j--) {
+            cut[j] = cut[j - 1];
+        }
+        cut[j] = c;
+    }
+    cut[n - 1] = util;
+
+    for (i = 0; i < n; i++) {
+        uint32_t m = period_mult[bench_rand(seed) % mults];
+        uint64_t u = cut[i] - prev;
+
+        prev = cut[i];
+        memset(&set[i], 0, sizeof(rt_constraints));
+        set[i].periodic.period = period_min * m;
+        set[i].periodic.slice = (set[i].periodic.period / 100000) * u;
+        if (set[i].periodic.slice == 0) {
+            set[i].periodic.slice = 1;
+        }
+        lcm = lcm / gcd(lcm, m) * m;
+    }
+
+    return period_min * lcm;
+}
+
+void nk_rt_bench_defaults(struct nk_rt_bench_cfg *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->cpu = -1;
+    cfg->sets = 10;
+    cfg->tasks = 8;
+    cfg->util_lo = 20000;
+    cfg->util_hi = 100000;
+    cfg->util_step = 20000;
+    cfg->period_min = 1000000;
+    cfg->period_max = 20000000;
+    cfg->hyperperiods = 4;
+    cfg->fill = 90;
+}
+
+
+/* spin for cycles of our own time, not counting preemptions */
+static void burn(uint64_t cycles)
+{
+    uint64_t last = rdtsc(), now, d, done = 0;
+
+    while (done < cycles) {
+        now = rdtsc();
+        d = now - last;
+        if (d < RT_BENCH_GAP) {
+            done += d;
+        }
+        last = now;
+    }
+}
+
+static void bench_task(void *in, void **out)
+{
+    rt_bench_task *task = (rt_bench_task *)in;
+    rt_thread *rt = get_cur_thread()->rt_thread;
+
+    while (rdtsc() < task->end) {
+        burn(task->exec);
+        rt_thread_job_done();
+    }
+    rt_thread_get_stats(rt, &task->stats);
+
+    task->done = 1;
+}
+
+/* start one set on cpu, returns 1 if every thread was admitted */
+static int bench_run_set(struct nk_rt_bench_cfg *cfg, rt_constraints *set,
+                         rt_bench_task *tasks, uint64_t hyper, rt_bench_point *pt)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    rt_scheduler *scheduler = sys->cpus[cfg->cpu]->rt_sched;
+    uint64_t passes = scheduler->passes, cycles = scheduler->pass_cycles;
+    uint64_t end = rdtsc() + cfg->period_max + hyper * cfg->hyperperiods;
+    uint32_t i, started = 0;
+    int admitted = 1;
+
+    scheduler->pass_max = 0;
+
+    for (i = 0; i < cfg->tasks; i++) {
+        memset(&tasks[i], 0, sizeof(rt_bench_task));
+        tasks[i].end = end;
+        tasks[i].exec = set[i].periodic.slice / 100 * cfg->fill;
+        if (nk_thread_start(bench_task, &tasks[i], NULL, 0, TSTACK_DEFAULT, &tasks[i].tid,
+                            cfg->cpu, PERIODIC, &set[i], 0)) {
+            /* admission turned it away, or it could not be created */
+            admitted = 0;
+            break;
+        }
+        started++;
+    }
+
+    /* a partial set is not worth running out */
+    if (!admitted) {
+        for (i = 0; i < started; i++) {
+            tasks[i].end = 0;
+        }
+    }
+
+    for (i = 0; i < started; i++) {
+        while (!tasks[i].done) {
+            nk_yield();
+        }
+        nk_join(tasks[i].tid, NULL);
+    }
+
+    if (admitted) {
+        for (i = 0; i < cfg->tasks; i++) {
+            pt->releases += tasks[i].stats.releases;
+            pt->misses += tasks[i].stats.misses;
+            pt->skipped += tasks[i].stats.skipped;
+        }
+        pt->passes += scheduler->passes - passes;
+        pt->pass_cycles += scheduler->pass_cycles - cycles;
+        pt->pass_max = MAX(pt->pass_max, scheduler->pass_max);
+    }
+
+    return admitted;
+}
+
+static void bench_report(uint64_t util, rt_bench_point *pt)
+{
+    RT_BENCH_PRINT("U=%llu.%03llu sets=%llu admitted=%llu sim_ok=%llu sim_failed=%llu "
+                   "false_accept=%llu false_reject=%llu sim_optimistic=%llu\n",
+                   util / 100000, (util % 100000) / 100, pt->sets, pt->admitted,
+                   pt->sim_ok, pt->sim_failed, pt->false_accept, pt->false_reject,
+                   pt->sim_optimistic);
+    RT_BENCH_PRINT("U=%llu.%03llu jobs=%llu misses=%llu (%llu ppm) skipped=%llu "
+                   "passes=%llu avg=%llu max=%llu cycles\n",
+                   util / 100000, (util % 100000) / 100, pt->releases, pt->misses,
+                   pt->releases ? pt->misses * 1000000 / pt->releases : 0,
+                   pt->skipped, pt->passes,
+                   pt->passes ? pt->pass_cycles / pt->passes : 0, pt->pass_max);
+}
+
+int nk_rt_bench(struct nk_rt_bench_cfg *user)
+{
+    struct nk_rt_bench_cfg cfg;
+    rt_constraints *set;
+    rt_bench_task *tasks;
+    uint64_t seed, util;
+    uint32_t s;
+    int rc = -1;
+
+    if (user) {
+        cfg = *user;
+    } else {
+        nk_rt_bench_defaults(&cfg);
+    }
+
+    if (cfg.cpu < 0 || (uint32_t)cfg.cpu >= nk_get_num_cpus()) {
+        cfg.cpu = nk_get_num_cpus() - 1;
+    }
+    if (cfg.tasks == 0 || cfg.tasks > RT_BENCH_MAX_TASKS || cfg.util_step == 0 ||
+        cfg.fill == 0 || cfg.fill > 100) {
+        RT_BENCH_ERROR("Bad configuration\n");
+        return -1;
+    }
+
+    seed = cfg.seed ? cfg.seed : rdtsc() | 1;
+
+    set = (rt_constraints *)malloc(sizeof(rt_constraints) * cfg.tasks);
+    tasks = (rt_bench_task *)malloc(sizeof(rt_bench_task) * cfg.tasks);
+    if (!set || !tasks) {
+        RT_BENCH_ERROR("Could not allocate %u tasks\n", cfg.tasks);
+        goto out;
+    }
+
+    RT_BENCH_PRINT("cpu %d, %u sets of %u threads, periods %llu-%llu, %u hyperperiods, %u%% fill, seed %llu\n",
+                   cfg.cpu, cfg.sets, cfg.tasks, cfg.period_min, cfg.period_max,
+                   cfg.hyperperiods, cfg.fill, seed);
+
+    for (util = cfg.util_lo; util <= cfg.util_hi; util += cfg.util_step) {
+        rt_bench_point pt;
+
+        memset(&pt, 0, sizeof(pt));
+
+        for (s = 0; s < cfg.sets; s++) {
+            uint64_t hyper = nk_rt_taskset_gen(&seed, cfg.tasks, util, cfg.period_min,
+                                               cfg.period_max, set);
+            uint64_t misses = pt.misses;
+            int sim, admitted;
+
+            if (!hyper) {
+                RT_BENCH_ERROR("Could not generate a task set\n");
+                goto out;
+            }
+
+            sim = rt_simulate_taskset(cfg.cpu, set, cfg.tasks, hyper * cfg.hyperperiods, NULL);
+            admitted = bench_run_set(&cfg, set, tasks, hyper, &pt);
+
+            pt.sets++;
+            pt.admitted += admitted;
+            if (sim < 0) {
+                pt.sim_failed++;
+                continue;
+            }
+            pt.sim_ok += sim;
+            if (admitted && !sim) {
+                pt.false_accept++;
+            }
+            if (!admitted && sim) {
+                pt.false_reject++;
+            }
+            if (admitted && sim && pt.misses != misses) {
+                pt.sim_optimistic++;
+            }
+        }
+
+        bench_report(util, &pt);
+    }
+    rc = 0;
+
+out:
+    if (set) {
+        free(set);
+    }
+    if (tasks) {
+        free(tasks);
+    }
+    return rc;
+}
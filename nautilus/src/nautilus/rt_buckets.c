@@ -0,0 +1,209 @@
+//
+//  rt_buckets.c
+//
+//  Deadline-bucketed run queue for the real-time scheduler.
+//
+//  A deadline d falls in absolute slot d >> RT_BUCKET_SHIFT. The queue
+//  covers RT_BUCKET_SLOTS consecutive slots starting at base, each a
+//  FIFO list, and slot a lives at index a & RT_BUCKET_MASK so the
+//  window rotates as base moves forward without anything being moved.
+//  One bit per slot plus a summary bit per 64 slots means the earliest
+//  occupied slot is two bit scans away however many threads there are,
+//  and insertion and removal are a list operation and a bit flip.
+//
+//  The price is that threads in the same slot run in arrival order
+//  rather than strict deadline order, so a job can be overtaken by
+//  others whose deadlines are up to one slot width later. Admission
+//  control accounts for this (see bucket_density() in rt_scheduler.c).
+//
+//  base only ever advances to the earlier of the current time and the
+//  earliest occupied slot, so no thread is ever behind it except jobs
+//  whose deadline has already passed, which all share the first slot.
+//  Deadlines beyond the end of the window are kept on an unordered far
+//  list and pulled in as the window reaches them.
+//
+
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/rt_scheduler.h>
+#include <nautilus/rt_buckets.h>
+
+#define RT_BUCKETS_ERROR(fmt, args...) printk("RT BUCKETS ERROR: " fmt, ##args)
+
+static inline uint64_t rotr64(uint64_t x, uint64_t n)
+{
+    return n ? ((x >> n) | (x << (64 - n))) : x;
+}
+
+static inline void slot_set(rt_buckets *buckets, uint64_t idx)
+{
+    buckets->map[idx >> 6] |= (1ULL << (idx & 63));
+    buckets->summary |= (1ULL << (idx >> 6));
+}
+
+static inline void slot_clear(rt_buckets *buckets, uint64_t idx)
+{
+    buckets->map[idx >> 6] &= ~(1ULL << (idx & 63));
+    if (!buckets->map[idx >> 6]) {
+        buckets->summary &= ~(1ULL << (idx >> 6));
+    }
+}
+
+static void bucket_insert(rt_buckets *buckets, rt_thread *thread)
+{
+    uint64_t slot = thread->deadline >> RT_BUCKET_SHIFT;
+    uint64_t idx;
+
+    if (slot < buckets->base) {
+        /* already late */
+        slot = buckets->base;
+    }
+
+    if (slot - buckets->base >= RT_BUCKET_SLOTS) {
+        list_add_tail(&thread->bucket_node, &buckets->far);
+        thread->bucket_slot = RT_BUCKET_FAR;
+        if (!buckets->far_count++ || slot < buckets->far_min) {
+            buckets->far_min = slot;
+        }
+    } else {
+        idx = slot & RT_BUCKET_MASK;
+        list_add_tail(&thread->bucket_node, &buckets->slots[idx]);
+        slot_set(buckets, idx);
+        thread->bucket_slot = idx;
+    }
+    buckets->count++;
+}
+
+/* distance from base to the earliest occupied slot in the window */
+static uint64_t first_slot(rt_buckets *buckets)
+{
+    uint64_t pos = buckets->base & RT_BUCKET_MASK;
+    uint64_t word = pos >> 6, bits, k;
+
+    if (!buckets->summary) {
+        return RT_BUCKET_SLOTS;
+    }
+
+    bits = buckets->map[word] >> (pos & 63);
+    if (bits) {
+        return __builtin_ctzll(bits);
+    }
+
+    /* word itself comes last, where only its bits below pos are left */
+    k = __builtin_ctzll(rotr64(buckets->summary, (word + 1) & 63));
+    word = (word + 1 + k) & 63;
+    return ((word << 6) + __builtin_ctzll(buckets->map[word]) - pos) & RT_BUCKET_MASK;
+}
+
+static void bucket_advance(rt_buckets *buckets, uint64_t now)
+{
+    uint64_t target = now >> RT_BUCKET_SHIFT;
+    uint64_t first = first_slot(buckets);
+    uint64_t slot, end;
+    rt_thread *thread, *next;
+
+    if (first < RT_BUCKET_SLOTS && buckets->base + first < target) {
+        target = buckets->base + first;
+    }
+    if (target <= buckets->base) {
+        return;
+    }
+    buckets->base = target;
+
+    end = buckets->base + RT_BUCKET_SLOTS;
+    if (!buckets->far_count || buckets->far_min >= end) {
+        return;
+    }
+
+    buckets->far_min = (uint64_t)-1;
+    list_for_each_entry_safe(thread, next, &buckets->far, bucket_node) {
+        slot = thread->deadline >> RT_BUCKET_SHIFT;
+        if (slot < end) {
+            list_del_init(&thread->bucket_node);
+            buckets->far_count--;
+            buckets->count--;
+            bucket_insert(buckets, thread);
+        } else if (slot < buckets->far_min) {
+            buckets->far_min = slot;
+        }
+    }
+}
+
+rt_buckets* rt_buckets_create(uint64_t now)
+{
+    rt_buckets *buckets = (rt_buckets *)malloc(sizeof(rt_buckets));
+    int slot;
+
+    if (!buckets) {
+        RT_BUCKETS_ERROR("Could not allocate deadline buckets\n");
+        return NULL;
+    }
+
+    memset(buckets, 0, sizeof(rt_buckets));
+    for (slot = 0; slot < RT_BUCKET_SLOTS; slot++) {
+        INIT_LIST_HEAD(&buckets->slots[slot]);
+    }
+    INIT_LIST_HEAD(&buckets->far);
+    buckets->base = now >> RT_BUCKET_SHIFT;
+    return buckets;
+}
+
+void rt_buckets_destroy(rt_buckets *buckets)
+{
+    free(buckets);
+}
+
+int rt_buckets_linked(rt_thread *thread)
+{
+    return !list_empty(&thread->bucket_node);
+}
+
+void rt_buckets_add(rt_buckets *buckets, rt_thread *thread)
+{
+    if (rt_buckets_linked(thread)) {
+        rt_buckets_remove(buckets, thread);
+    }
+    bucket_insert(buckets, thread);
+}
+
+void rt_buckets_remove(rt_buckets *buckets, rt_thread *thread)
+{
+    if (!rt_buckets_linked(thread)) {
+        return;
+    }
+
+    list_del_init(&thread->bucket_node);
+    if (thread->bucket_slot == RT_BUCKET_FAR) {
+        /* far_min stays a lower bound, which only costs a rescan */
+        buckets->far_count--;
+    } else if (list_empty(&buckets->slots[thread->bucket_slot])) {
+        slot_clear(buckets, thread->bucket_slot);
+    }
+    buckets->count--;
+}
+
+rt_thread* rt_buckets_first(rt_buckets *buckets, uint64_t now)
+{
+    rt_thread *thread, *best = NULL;
+    uint64_t k;
+
+    if (!buckets->count) {
+        return NULL;
+    }
+
+    bucket_advance(buckets, now);
+
+    k = first_slot(buckets);
+    if (k < RT_BUCKET_SLOTS) {
+        return list_first_entry(&buckets->slots[(buckets->base + k) & RT_BUCKET_MASK],
+                                rt_thread, bucket_node);
+    }
+
+    /* only far deadlines left, which is rare enough to scan for */
+    list_for_each_entry(thread, &buckets->far, bucket_node) {
+        if (!best || thread->deadline < best->deadline) {
+            best = thread;
+        }
+    }
+    return best;
+}
@@ -0,0 +1,243 @@
+//
+//  rt_cat.c
+//
+//  Cache and memory bandwidth partitioning for the real-time scheduler.
+//
+//  Classes of service are kept in one table, the same for every core.
+//  Each core loads the table into its mask and throttle MSRs lazily: a
+//  change bumps a generation count, and a core that sees a newer one
+//  at a context switch reprograms itself before it continues. The
+//  class itself is switched by writing IA32_PQR_ASSOC, only when the
+//  incoming thread's class differs from the one already loaded.
+//
+//  A periodic or sporadic thread's slice is a WCET measured with some
+//  share of the LLC. Asking for a class promises admission that the
+//  share stays its own, so rt_cat_admit() lets the thread in only if
+//  no other class, the default and background ones included, can fill
+//  any of its ways. From then on the class is locked: it cannot be
+//  redefined, and no other class may be given any of its ways.
+//
+
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/cpuid.h>
+#include <nautilus/msr.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/rt_scheduler.h>
+#include <nautilus/rt_cat.h>
+
+#define RT_CAT_PRINT(fmt, args...) printk("RT CAT: " fmt, ##args)
+#define RT_CAT_ERROR(fmt, args...) printk("RT CAT ERROR: " fmt, ##args)
+
+static struct {
+    int classes;            /* usable classes, 0 without L3 CAT */
+    uint32_t ways;          /* length of a capacity bitmask */
+    uint32_t mba_max;       /* largest throttle value, 0 without MBA */
+    int background;         /* class of every aperiodic thread */
+    volatile uint64_t gen;  /* bumped by every change to the table */
+    spinlock_t lock;
+    rt_cat_class table[RT_CAT_CLASSES];
+} cat;
+
+void rt_cat_init(void)
+{
+    cpuid_ret_t ret;
+    int l3_cos;
+
+    if (cat.gen) {
+        return;
+    }
+    spinlock_init(&cat.lock);
+    cat.gen = 1;
+
+    cpuid_sub(0x7, 0, &ret);
+    if (!(ret.b & (1 << 15))) {
+        RT_CAT_PRINT("No resource director allocation\n");
+        return;
+    }
+
+    cpuid_sub(0x10, 0, &ret);
+    if (!(ret.b & (1 << 1))) {
+        RT_CAT_PRINT("No L3 cache allocation\n");
+        return;
+    }
+    if (ret.b & (1 << 3)) {
+        cpuid_sub(0x10, 3, &ret);
+        cat.mba_max = (ret.a & 0xfff) + 1;
+    }
+
+    cpuid_sub(0x10, 1, &ret);
+    cat.ways = (ret.a & 0x1f) + 1;
+    l3_cos = (ret.d & 0xffff) + 1;
+    cat.classes = l3_cos < RT_CAT_CLASSES ? l3_cos : RT_CAT_CLASSES;
+
+    /* out of reset every class may use the whole cache */
+    cat.table[RT_CAT_DEFAULT].l3_mask = (1ULL << cat.ways) - 1;
+    cat.background = RT_CAT_DEFAULT;
+
+    RT_CAT_PRINT("%d classes over %u ways%s\n", cat.classes, cat.ways,
+                 cat.mba_max ? ", with bandwidth throttling" : "");
+}
+
+int rt_cat_classes(void)
+{
+    return cat.classes;
+}
+
+/* ways of other classes that overlap mask */
+static uint64_t overlap(int cos, uint64_t mask, int locked_only)
+{
+    uint64_t shared = 0;
+    int i;
+
+    for (i = 0; i < cat.classes; i++) {
+        if (i != cos && (!locked_only || cat.table[i].locked)) {
+            shared |= cat.table[i].l3_mask;
+        }
+    }
+    return shared & mask;
+}
+
+int rt_cat_class_set(int cos, uint64_t l3_mask, uint32_t mba_delay)
+{
+    uint64_t full = (1ULL << cat.ways) - 1;
+    uint8_t flags;
+    int rc = -1;
+
+    if (cos < 0 || cos >= cat.classes) {
+        RT_CAT_ERROR("No class of service %d\n", cos);
+        return -1;
+    }
+
+    /* a capacity bitmask must be a single run of ways */
+    if (!l3_mask || (l3_mask & ~full) ||
+        ((l3_mask >> __builtin_ctzll(l3_mask)) & ((l3_mask >> __builtin_ctzll(l3_mask)) + 1))) {
+        RT_CAT_ERROR("Bad capacity mask 0x%llx for class %d\n", l3_mask, cos);
+        return -1;
+    }
+
+    if (mba_delay && !cat.mba_max) {
+        RT_CAT_ERROR("No bandwidth throttling on this machine\n");
+        return -1;
+    }
+    if (mba_delay > cat.mba_max) {
+        mba_delay = cat.mba_max;
+    }
+
+    flags = spin_lock_irq_save(&cat.lock);
+    if (cat.table[cos].locked) {
+        RT_CAT_ERROR("Class %d is isolating admitted threads\n", cos);
+    } else if (overlap(cos, l3_mask, 1)) {
+        RT_CAT_ERROR("Mask 0x%llx takes ways from an isolated class\n", l3_mask);
+    } else {
+        cat.table[cos].l3_mask = l3_mask;
+        cat.table[cos].mba_delay = mba_delay;
+        __sync_synchronize();
+        cat.gen++;
+        rc = 0;
+    }
+    spin_unlock_irq_restore(&cat.lock, flags);
+    return rc;
+}
+
+int rt_cat_set_background(int cos)
+{
+    uint8_t flags;
+    int rc = -1;
+
+    if (cos < 0 || cos >= cat.classes) {
+        RT_CAT_ERROR("No class of service %d\n", cos);
+        return -1;
+    }
+
+    flags = spin_lock_irq_save(&cat.lock);
+    if (cat.table[cos].locked) {
+        RT_CAT_ERROR("Class %d is isolating admitted threads\n", cos);
+    } else if (!cat.table[cos].l3_mask) {
+        RT_CAT_ERROR("Class %d is not defined\n", cos);
+    } else {
+        cat.background = cos;
+        rc = 0;
+    }
+    spin_unlock_irq_restore(&cat.lock, flags);
+    return rc;
+}
+
+static inline int thread_class(rt_thread *thread)
+{
+    switch (thread->type) {
+        case PERIODIC:
+            return thread->constraints->periodic.cache_class;
+        case SPORADIC:
+            return thread->constraints->sporadic.cache_class;
+        default:
+            return cat.background;
+    }
+}
+
+int rt_cat_admit(rt_thread *thread)
+{
+    int cos;
+    uint8_t flags;
+    int rc = 0;
+
+    if (thread->type == APERIODIC || (cos = thread_class(thread)) == RT_CAT_DEFAULT) {
+        return 0;
+    }
+
+    if (cos >= cat.classes) {
+        RT_CAT_ERROR("Thread %p asks for class %d of %d\n", thread, cos, cat.classes);
+        return -1;
+    }
+
+    flags = spin_lock_irq_save(&cat.lock);
+    if (cos == cat.background || !cat.table[cos].l3_mask ||
+        overlap(cos, cat.table[cos].l3_mask, 0)) {
+        rc = -1;
+    } else {
+        cat.table[cos].locked = 1;
+    }
+    spin_unlock_irq_restore(&cat.lock, flags);
+    return rc;
+}
+
+static void cat_sync(rt_scheduler *scheduler)
+{
+    uint64_t gen = cat.gen;
+    int i;
+
+    __sync_synchronize();
+    for (i = 0; i < cat.classes; i++) {
+        if (cat.table[i].l3_mask) {
+            msr_write(IA32_L3_QOS_MASK(i), cat.table[i].l3_mask);
+        }
+        if (cat.mba_max) {
+            msr_write(IA32_MBA_THRTL(i), cat.table[i].mba_delay);
+        }
+    }
+    scheduler->cat_gen = gen;
+}
+
+void rt_cat_switch(struct nk_thread *next)
+{
+    rt_scheduler *scheduler = per_cpu_get(rt_sched);
+    int cos;
+
+    if (!cat.classes || !scheduler || !next->rt_thread) {
+        return;
+    }
+
+    if (scheduler->cat_gen != cat.gen) {
+        cat_sync(scheduler);
+    }
+
+    cos = thread_class(next->rt_thread);
+    if (cos >= cat.classes) {
+        cos = RT_CAT_DEFAULT;
+    }
+    if (cos != scheduler->cat_class) {
+        /* the class lives in the upper half, RMID (monitoring) is left at 0 */
+        msr_write(IA32_PQR_ASSOC, (uint64_t)cos << 32);
+        scheduler->cat_class = cos;
+    }
+}
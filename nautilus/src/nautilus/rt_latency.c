@@ -0,0 +1,351 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/rt_scheduler.h>
+#include <nautilus/rt_latency.h>
+#include <nautilus/cpu.h>
+#include <nautilus/smp.h>
+#include <dev/apic.h>
+#include <dev/serial.h>
+
+#define RT_LAT_PRINT(fmt, args...) printk("RT LATENCY: " fmt, ##args)
+#define RT_LAT_ERROR(fmt, args...) printk("RT LATENCY ERROR: " fmt, ##args)
+
+// Blocks each malloc load thread keeps live at once
+#define RT_LAT_MALLOC_LIVE 16
+
+#define RT_LAT_LOADS 3
+
+typedef struct rt_lat_hist {
+    uint64_t n, sum, min, max;
+    uint64_t buckets[RT_LAT_BUCKETS];
+} rt_lat_hist;
+
+typedef struct rt_lat_core {
+    int cpu;
+    nk_thread_id_t tid;
+    uint32_t loops;
+    uint64_t bucket;
+    rt_constraints constraints;
+    volatile uint8_t done;
+    rt_lat_hist hist;
+} rt_lat_core;
+
+typedef struct rt_lat_load {
+    int cpu;
+    uint32_t kind;
+    nk_thread_id_t tid;
+    volatile uint8_t *stop;
+    volatile uint8_t done;
+} rt_lat_load;
+
+
+void nk_rt_latency_defaults(struct nk_rt_latency_cfg *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->period = 1000000;
+    cfg->slice = 50000;
+    cfg->loops = 10000;
+    cfg->bucket = 100;
+    cfg->load = RT_LAT_LOAD_MALLOC | RT_LAT_LOAD_IPI;
+}
+
+
+static void hist_add(rt_lat_hist *h, uint64_t bucket, uint64_t lat)
+{
+    uint64_t i = lat / bucket;
+
+    if (i < RT_LAT_BUCKETS) {
+        h->buckets[i]++;
+    }
+    if (!h->n || lat < h->min) {
+        h->min = lat;
+    }
+    if (lat > h->max) {
+        h->max = lat;
+    }
+    h->n++;
+    h->sum += lat;
+}
+
+static void hist_merge(rt_lat_hist *into, rt_lat_hist *h)
+{
+    uint64_t i;
+
+    if (!h->n) {
+        return;
+    }
+    for (i = 0; i < RT_LAT_BUCKETS; i++) {
+        into->buckets[i] += h->buckets[i];
+    }
+    if (!into->n || h->min < into->min) {
+        into->min = h->min;
+    }
+    if (h->max > into->max) {
+        into->max = h->max;
+    }
+    into->n += h->n;
+    into->sum += h->sum;
+}
+
+/*
+ * Latency that num/den of the samples are at or below, to the top of
+ * its bucket. Past the last bucket all we know is the max.
+ */
+static uint64_t hist_percentile(rt_lat_hist *h, uint64_t bucket, uint64_t num, uint64_t den)
+{
+    uint64_t want = (h->n * num + den - 1) / den, seen = 0, i;
+
+    for (i = 0; i < RT_LAT_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= want) {
+            uint64_t top = (i + 1) * bucket - 1;
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+static void hist_report(const char *who, rt_lat_hist *h, uint64_t bucket)
+{
+    if (!h->n) {
+        RT_LAT_PRINT("%s: no samples\n", who);
+        return;
+    }
+    RT_LAT_PRINT("%s: %llu samples min=%llu avg=%llu p99=%llu p99.99=%llu max=%llu cycles\n",
+                 who, h->n, h->min, h->sum / h->n,
+                 hist_percentile(h, bucket, 99, 100),
+                 hist_percentile(h, bucket, 9999, 10000), h->max);
+}
+
+
+static void lat_task(void *in, void **out)
+{
+    rt_lat_core *core = (rt_lat_core *)in;
+    rt_thread *rt = get_cur_thread()->rt_thread;
+    uint32_t i;
+
+    /* the first job starts at admission, not on a timer */
+    rt_thread_job_done();
+    for (i = 0; i < core->loops; i++) {
+        uint64_t now = cur_time();
+        hist_add(&core->hist, core->bucket, now > rt->release ? now - rt->release : 0);
+        rt_thread_job_done();
+    }
+
+    core->done = 1;
+}
+
+
+/* xorshift64* */
+static uint64_t lat_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ULL;
+}
+
+static void load_malloc(rt_lat_load *load)
+{
+    void *live[RT_LAT_MALLOC_LIVE] = { 0 };
+    uint64_t seed = rdtsc() | 1;
+    uint32_t i = 0;
+
+    while (!*load->stop) {
+        if (live[i]) {
+            free(live[i]);
+        }
+        /* 32 bytes to 64KB, log-uniform */
+        live[i] = malloc(1UL << (5 + lat_rand(&seed) % 12));
+        i = (i + 1) % RT_LAT_MALLOC_LIVE;
+    }
+
+    for (i = 0; i < RT_LAT_MALLOC_LIVE; i++) {
+        if (live[i]) {
+            free(live[i]);
+        }
+    }
+}
+
+static void load_ipi(rt_lat_load *load)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint32_t target = (load->cpu + 1) % sys->num_cpus;
+
+    while (!*load->stop) {
+        apic_ipi(per_cpu_get(apic), sys->cpus[target]->lapic_id, APIC_NULL_KICK_VEC);
+    }
+}
+
+static void load_serial(rt_lat_load *load)
+{
+    char line[64];
+
+    snprintf(line, sizeof(line), "rt latency serial load from cpu %d\n", load->cpu);
+    while (!*load->stop) {
+        serial_write(line);
+    }
+}
+
+static void load_task(void *in, void **out)
+{
+    rt_lat_load *load = (rt_lat_load *)in;
+
+    switch (load->kind) {
+        case RT_LAT_LOAD_MALLOC:
+            load_malloc(load);
+            break;
+        case RT_LAT_LOAD_IPI:
+            load_ipi(load);
+            break;
+        case RT_LAT_LOAD_SERIAL:
+            load_serial(load);
+            break;
+    }
+
+    load->done = 1;
+}
+
+
+/* start the kinds of load cfg asks for on every core */
+static uint32_t start_loads(struct nk_rt_latency_cfg *cfg, rt_lat_load *loads,
+                            volatile uint8_t *stop, uint32_t cpus)
+{
+    rt_constraints c = { .aperiodic = { .priority = 0 } };
+    uint32_t kind, cpu, n = 0;
+
+    for (cpu = 0; cpu < cpus; cpu++) {
+        for (kind = 1; kind <= RT_LAT_LOAD_SERIAL; kind <<= 1) {
+            if (!(cfg->load & kind) || (kind == RT_LAT_LOAD_IPI && cpus < 2)) {
+                continue;
+            }
+            loads[n].cpu = cpu;
+            loads[n].kind = kind;
+            loads[n].stop = stop;
+            loads[n].done = 0;
+            if (nk_thread_start(load_task, &loads[n], NULL, 0, TSTACK_DEFAULT, &loads[n].tid,
+                                cpu, APERIODIC, &c, 0)) {
+                RT_LAT_ERROR("Could not start load on cpu %u\n", cpu);
+                continue;
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+int nk_rt_latency(struct nk_rt_latency_cfg *user)
+{
+    struct nk_rt_latency_cfg cfg;
+    uint32_t cpus = nk_get_num_cpus(), nloads, i;
+    volatile uint8_t stop = 0;
+    rt_lat_core *cores;
+    rt_lat_load *loads;
+    rt_lat_hist *all;
+    char who[16];
+    int rc = -1;
+
+    if (user) {
+        cfg = *user;
+    } else {
+        nk_rt_latency_defaults(&cfg);
+    }
+
+    if (cfg.period == 0 || cfg.slice == 0 || cfg.slice > cfg.period || cfg.bucket == 0) {
+        RT_LAT_ERROR("Bad configuration\n");
+        return -1;
+    }
+
+    cores = (rt_lat_core *)malloc(sizeof(rt_lat_core) * cpus);
+    loads = (rt_lat_load *)malloc(sizeof(rt_lat_load) * cpus * RT_LAT_LOADS);
+    all = (rt_lat_hist *)malloc(sizeof(rt_lat_hist));
+    if (!cores || !loads || !all) {
+        RT_LAT_ERROR("Could not allocate state for %u cpus\n", cpus);
+        goto out;
+    }
+    memset(cores, 0, sizeof(rt_lat_core) * cpus);
+    memset(all, 0, sizeof(rt_lat_hist));
+
+    RT_LAT_PRINT("%u cpus, period %llu, slice %llu, %u loops, load%s%s%s%s\n",
+                 cpus, cfg.period, cfg.slice, cfg.loops,
+                 cfg.load & RT_LAT_LOAD_MALLOC ? " malloc" : "",
+                 cfg.load & RT_LAT_LOAD_IPI ? " ipi" : "",
+                 cfg.load & RT_LAT_LOAD_SERIAL ? " serial" : "",
+                 cfg.load ? "" : " none");
+
+    nloads = start_loads(&cfg, loads, &stop, cpus);
+
+    for (i = 0; i < cpus; i++) {
+        cores[i].cpu = i;
+        cores[i].loops = cfg.loops;
+        cores[i].bucket = cfg.bucket;
+        cores[i].constraints.periodic.period = cfg.period;
+        cores[i].constraints.periodic.slice = cfg.slice;
+        if (nk_thread_start(lat_task, &cores[i], NULL, 0, TSTACK_DEFAULT, &cores[i].tid,
+                            i, PERIODIC, &cores[i].constraints, 0)) {
+            RT_LAT_ERROR("Could not start the measuring thread on cpu %u\n", i);
+            cores[i].tid = NULL;
+        }
+    }
+
+    for (i = 0; i < cpus; i++) {
+        if (!cores[i].tid) {
+            continue;
+        }
+        while (!cores[i].done) {
+            nk_yield();
+        }
+        nk_join(cores[i].tid, NULL);
+    }
+
+    stop = 1;
+    __sync_synchronize();
+    for (i = 0; i < nloads; i++) {
+        while (!loads[i].done) {
+            nk_yield();
+        }
+        nk_join(loads[i].tid, NULL);
+    }
+
+    for (i = 0; i < cpus; i++) {
+        snprintf(who, sizeof(who), "cpu %u", i);
+        hist_report(who, &cores[i].hist, cfg.bucket);
+        hist_merge(all, &cores[i].hist);
+    }
+    hist_report("all", all, cfg.bucket);
+    rc = 0;
+
+out:
+    if (cores) {
+        free(cores);
+    }
+    if (loads) {
+        free(loads);
+    }
+    if (all) {
+        free(all);
+    }
+    return rc;
+}
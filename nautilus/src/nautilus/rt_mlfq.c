@@ -0,0 +1,159 @@
+//
+//  rt_mlfq.c
+//
+//  Multi-level feedback queue for the aperiodic class of the real-time
+//  scheduler.
+//
+//  Every thread starts on level 0 and is demoted one level each time
+//  it has run for the whole quantum of its level, however many times
+//  it was switched in to do so, so a thread cannot stay on top by
+//  yielding just before its quantum runs out. Threads that block
+//  early keep their level and get in ahead of the batch work below
+//  them, which in turn runs with longer quanta.
+//
+//  The non-empty levels are kept in a bitmap, so picking the next
+//  thread is one bit scan and insertion and removal are a list
+//  operation and a bit flip.
+//
+//  Every RT_MLFQ_BOOST cycles the lower levels are spliced onto level
+//  0 so that nothing starves. A boost touches only the lists: it
+//  advances the queue's epoch, and a thread whose mlfq_epoch is older
+//  is known to be on level 0 with a fresh quantum, which is written
+//  back the next time the thread is looked at.
+//
+
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/rt_scheduler.h>
+#include <nautilus/rt_mlfq.h>
+
+#define RT_MLFQ_ERROR(fmt, args...) printk("RT MLFQ ERROR: " fmt, ##args)
+
+static inline uint64_t level_quantum(uint64_t level)
+{
+    return (uint64_t)RT_MLFQ_QUANTUM << level;
+}
+
+static inline uint64_t thread_level(rt_mlfq *mlfq, rt_thread *thread)
+{
+    if (thread->mlfq_epoch != mlfq->epoch) {
+        thread->mlfq_epoch = mlfq->epoch;
+        thread->mlfq_level = 0;
+        thread->mlfq_used = 0;
+    }
+    return thread->mlfq_level;
+}
+
+static void mlfq_boost(rt_mlfq *mlfq, uint64_t now)
+{
+    uint64_t level;
+
+    for (level = 1; level < RT_MLFQ_LEVELS; level++) {
+        if (mlfq->bitmap & (1ULL << level)) {
+            /* behind what is already on level 0, in level order */
+            list_splice_init(&mlfq->levels[level], mlfq->levels[0].prev);
+        }
+    }
+    if (mlfq->bitmap) {
+        mlfq->bitmap = 1;
+    }
+    mlfq->epoch++;
+    mlfq->last_boost = now;
+}
+
+rt_mlfq* rt_mlfq_create(uint64_t now)
+{
+    rt_mlfq *mlfq = (rt_mlfq *)malloc(sizeof(rt_mlfq));
+    int level;
+
+    if (!mlfq) {
+        RT_MLFQ_ERROR("Could not allocate feedback queue\n");
+        return NULL;
+    }
+
+    memset(mlfq, 0, sizeof(rt_mlfq));
+    for (level = 0; level < RT_MLFQ_LEVELS; level++) {
+        INIT_LIST_HEAD(&mlfq->levels[level]);
+    }
+    mlfq->last_boost = now;
+    return mlfq;
+}
+
+void rt_mlfq_destroy(rt_mlfq *mlfq)
+{
+    free(mlfq);
+}
+
+void rt_mlfq_reset(rt_thread *thread)
+{
+    thread->mlfq_level = 0;
+    thread->mlfq_used = 0;
+    thread->mlfq_mark = thread->run_time;
+}
+
+void rt_mlfq_add(rt_mlfq *mlfq, rt_thread *thread)
+{
+    uint64_t level = thread_level(mlfq, thread);
+
+    if (!list_empty(&thread->mlfq_node)) {
+        rt_mlfq_remove(mlfq, thread);
+    }
+    list_add_tail(&thread->mlfq_node, &mlfq->levels[level]);
+    mlfq->bitmap |= (1ULL << level);
+    mlfq->count++;
+}
+
+void rt_mlfq_remove(rt_mlfq *mlfq, rt_thread *thread)
+{
+    uint64_t level;
+
+    if (list_empty(&thread->mlfq_node)) {
+        return;
+    }
+
+    level = thread_level(mlfq, thread);
+    list_del_init(&thread->mlfq_node);
+    if (list_empty(&mlfq->levels[level])) {
+        mlfq->bitmap &= ~(1ULL << level);
+    }
+    mlfq->count--;
+}
+
+rt_thread* rt_mlfq_first(rt_mlfq *mlfq, uint64_t now)
+{
+    if (now - mlfq->last_boost >= RT_MLFQ_BOOST) {
+        mlfq_boost(mlfq, now);
+    }
+
+    if (!mlfq->count) {
+        return NULL;
+    }
+    return list_first_entry(&mlfq->levels[__builtin_ctzll(mlfq->bitmap)],
+                            rt_thread, mlfq_node);
+}
+
+void rt_mlfq_charge(rt_mlfq *mlfq, rt_thread *thread)
+{
+    uint64_t level = thread_level(mlfq, thread);
+
+    /* run_time starts over when a thread is demoted to this class */
+    thread->mlfq_used += (thread->run_time >= thread->mlfq_mark) ?
+                         thread->run_time - thread->mlfq_mark : thread->run_time;
+    thread->mlfq_mark = thread->run_time;
+
+    if (thread->mlfq_used >= level_quantum(level) && level < RT_MLFQ_LEVELS - 1) {
+        thread->mlfq_level = level + 1;
+        thread->mlfq_used = 0;
+    }
+}
+
+uint64_t rt_mlfq_quantum(rt_mlfq *mlfq, rt_thread *thread)
+{
+    uint64_t quantum = level_quantum(thread_level(mlfq, thread));
+
+    if (thread->mlfq_used >= quantum) {
+        /* the bottom level, which just starts over */
+        thread->mlfq_used = 0;
+    }
+    return quantum - thread->mlfq_used;
+}
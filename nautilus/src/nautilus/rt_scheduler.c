@@ -12,12 +12,26 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/thread.h>
+#include <nautilus/idle.h>
 #include <nautilus/rt_scheduler.h>
+#include <nautilus/rt_heap.h>
 #include <nautilus/irq.h>
 #include <nautilus/cpu.h>
 #include <nautilus/cpuid.h>
+#include <nautilus/numa.h>
+#include <nautilus/smp.h>
 #include <dev/apic.h>
 #include <dev/timer.h>
+#ifdef NAUT_CONFIG_HRTIMERS
+#include <nautilus/hrtimer.h>
+#endif
+#include <nautilus/atomic.h>
+#ifdef NAUT_CONFIG_RT_IDLE_CSTATES
+#include <nautilus/mwait.h>
+#ifdef NAUT_CONFIG_HPET_BROADCAST
+#include <dev/hpet.h>
+#endif
+#endif
 
 
 #define INFO(fmt, args...) printk("RT SCHED: " fmt, ##args)
@@ -30,9 +44,7 @@
 #define RT_SCHED_DEBUG(fmt, args...) printk("RT SCHED: " fmt, ##args)
 #endif
 
-#define parent(i) ((i) ? (((i) - 1) >> 1) : 0)
-#define left_child(i) (((i) << 1) + 1)
-#define right_child(i) (((i) << 1) + 2)
+#define RT_QUEUE_MIN 8
 
 #ifndef MIN
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
@@ -53,6 +65,13 @@
 #define SPORADIC_UTIL 18000
 #define APERIODIC_UTIL 9000
 
+// Hardware threads of one physical core compete for its pipeline, so
+// together their periodic utilization may only reach this share, in
+// percent, of what each could be given running alone
+#define RT_SMT_SHARE 75
+// Hardware threads per physical core we look at, at most
+#define RT_SMT_MAX 8
+
 #define ARRIVED 0
 #define ADMITTED 1
 #define WAITING 2
@@ -69,19 +88,49 @@
 #define WAITING_QUEUE 4
 #define SLEEPING_QUEUE 5
 #define EXITED_QUEUE 6
+#define SERVER_QUEUE 7
+#define SUSPENDED_QUEUE 8
+#define GROUP_EDF_QUEUE 9
+#define GROUP_FP_QUEUE 10
 #define MAX_QUEUE 256
 
 #define QUANTUM 10000000
 
+// Fixed point for the running sum of 100000/period kept on queues
+#define RT_FREQ_SHIFT 16
+
+// Floor on the per-switch overhead assumed by admission control,
+// until enough scheduling passes have been measured
+#define RT_MIN_OVERHEAD 10000
+
+#ifdef NAUT_CONFIG_RT_DEMAND_ANALYSIS
+// Supply assumed by the demand test, x100000
+#define RT_DEMAND_SUPPLY (NAUT_CONFIG_RT_DEMAND_CAPACITY * 1000)
+// Give up (and deny) after this many QPA steps
+#define RT_DEMAND_MAX_STEPS 1024
+#endif
+
+#ifdef NAUT_CONFIG_RT_SIM_ADMISSION
+// Give up (and deny) after this many simulated events
+#define RT_SIM_MAX_STEPS 8192
+#endif
+
+#ifdef NAUT_CONFIG_RT_BENCH
+// A benchmark set is simulated over many hyperperiods
+#define RT_BENCH_SIM_STEPS (1 << 22)
+#endif
+
 typedef struct rt_thread_sim {
     rt_type type;
     queue_type q_type;
     rt_status status;
-    rt_constraints *constraints;
+    rt_constraints constraints;
     uint64_t start_time; 
     uint64_t run_time;
     uint64_t deadline;
     uint64_t exit_time;
+    uint64_t release;   /* of the current job */
+    uint64_t budget;    /* per job, overhead included */
 } rt_thread_sim;
 
 typedef struct rt_queue_sim {
@@ -94,12 +143,18 @@ typedef struct rt_simulator {
     rt_queue_sim *runnable;
     rt_queue_sim *pending;
     rt_queue_sim *aperiodic;
+    uint64_t used;                  /* pool entries handed out */
+    rt_thread_sim pool[MAX_QUEUE];
 } rt_simulator;
 
 static rt_simulator* init_simulator();
 
 // Switching thread function
 static int check_deadlines(rt_thread *t);
+static rt_miss_policy miss_action(rt_thread *t);
+static void mpsc_push(rt_mpsc *list, rt_thread *thread);
+static rt_thread* mpsc_take(rt_mpsc *list);
+static void handle_miss(rt_scheduler *scheduler, rt_thread *t);
 static inline void update_periodic(rt_thread *t);
 static void set_timer(rt_scheduler *scheduler, rt_thread *thread, uint64_t end_time, uint64_t slack);
 
@@ -112,8 +167,9 @@ static inline void update_exit_logic(rt_thread_sim *t, uint64_t time);
 static inline void update_enter_logic(rt_thread_sim *t, uint64_t time);
 static int check_deadlines_logic(rt_thread_sim *t, uint64_t time);
 static inline void update_periodic_logic(rt_thread_sim *t, uint64_t time);
-static void copy_threads_sim(rt_simulator *simulator, rt_scheduler *scheduler);
+static int copy_threads_sim(rt_simulator *simulator, rt_scheduler *scheduler);
 static void free_threads_sim(rt_simulator *simulator);
+static rt_thread_sim* sim_get(rt_simulator *simulator);
 
 static rt_thread* max_periodic(rt_scheduler *scheduler);
 
@@ -121,33 +177,243 @@ static inline uint64_t get_min_per(rt_queue *runnable, rt_queue *queue, rt_threa
 static inline uint64_t get_avg_per(rt_queue *runnable, rt_queue *pending, rt_thread *thread);
 static inline uint64_t get_per_util(rt_queue *runnable, rt_queue *pending);
 static inline uint64_t get_spor_util(rt_queue *runnable);
+#if defined(NAUT_CONFIG_RT_CHARGE_OVERHEAD) || defined(NAUT_CONFIG_RT_OVERHEAD_HIST)
+static inline uint64_t get_overhead_util(rt_scheduler *scheduler, rt_thread *thread);
+#endif
 static inline uint64_t umin(uint64_t x, uint64_t y);
+static inline uint64_t periodic_budget(rt_thread *thread);
+static inline uint64_t core_per_util(rt_scheduler *scheduler);
+static int smt_admit(int cpu, uint64_t util);
+static inline void demand_changed(rt_scheduler *scheduler);
+#ifdef NAUT_CONFIG_RT_DEMAND_ANALYSIS
+static int rt_admit_demand(rt_scheduler *scheduler, rt_thread *thread);
+#endif
+static int rt_migrate(rt_thread *thread, int cpu);
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+static int rt_admit_util(rt_scheduler *scheduler, rt_thread *thread);
+#endif
+static int job_handoff(rt_scheduler *scheduler, rt_thread *thread);
+static void drain_migrations(rt_scheduler *scheduler);
+static void drain_submissions(rt_scheduler *scheduler);
+static rt_thread* pick_runnable(rt_scheduler *scheduler);
+static inline uint64_t job_deadline(rt_thread *thread);
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+static int mc_admit(rt_scheduler *scheduler, rt_thread *thread);
+static void mc_reserve(rt_scheduler *scheduler, rt_thread *thread, int add);
+static inline int mc_overrun(rt_scheduler *scheduler, rt_thread *thread);
+static inline int mc_idle(rt_scheduler *scheduler, rt_thread *thread);
+static void crit_switch(rt_scheduler *scheduler, rt_thread *thread);
+static void crit_restore(rt_scheduler *scheduler);
+#endif
+#ifdef NAUT_CONFIG_RT_RECLAIM
+static inline int slack_usable(rt_scheduler *scheduler, uint64_t now);
+static void reclaim_slack(rt_scheduler *scheduler, rt_thread *thread);
+#endif
+#ifdef NAUT_CONFIG_RT_CBS
+static inline int is_server_proxy(rt_thread *thread);
+static inline rt_queue* member_queue(rt_thread *thread);
+static rt_thread* server_resched(rt_scheduler *scheduler, rt_thread *member);
+static uint64_t server_remaining(rt_server *server);
+#endif
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+static int rt_admit_split(rt_scheduler *scheduler, rt_thread *thread);
+#endif
+static void thread_removed(rt_thread *thread);
+static int queue_keep(rt_queue *queue, uint64_t n);
+static int sched_own(rt_scheduler *scheduler, rt_thread *thread);
+static int sched_own_irq(rt_scheduler *scheduler, rt_thread *thread);
+static void sched_disown(rt_thread *thread);
+static void drain_unblocked(rt_scheduler *scheduler);
+static void place_release(rt_thread *thread);
+#ifdef NAUT_CONFIG_RT_MUTEX
+static void drain_boosts(rt_scheduler *scheduler, rt_thread *current);
+#endif
+#ifdef NAUT_CONFIG_RT_IDLE_CSTATES
+static void idle_init(rt_scheduler *scheduler);
+static void idle_sample(rt_scheduler *scheduler);
+static int idle_pick(rt_scheduler *scheduler, uint64_t gap);
+#endif
 /********** Function definitions *************/
 
 
 // SCHEDULE FUNCTIONS
 static void sched_sim(void *scheduler);
 
+/*
+ * rt_thread objects come from a per-CPU cache rather than malloc(),
+ * which takes the allocator lock with interrupts off. The owning core
+ * pops and pushes its free list with interrupts off and nothing else.
+ * Objects freed on another core are pushed onto the owner's remote
+ * list, lock-free like the arrival lists, and collected the next time
+ * the owner runs dry. Only when both are empty is a chunk of
+ * RT_SLAB_CHUNK objects taken from malloc(). Chunks are never given
+ * back, so the cache settles at the peak thread count.
+ */
+#define RT_SLAB_CHUNK 32
+
+typedef struct rt_slab {
+    rt_thread *free;    /* owning core only, linked through mpsc_next */
+    rt_mpsc remote;     /* freed by other cores */
+} rt_slab;
+
+static rt_slab rt_slabs[NAUT_CONFIG_MAX_CPUS];
+
+static int rt_slab_grow(rt_slab *slab, int cpu)
+{
+    rt_thread *chunk = (rt_thread *)malloc(RT_SLAB_CHUNK * sizeof(rt_thread));
+    int i;
+
+    if (!chunk) {
+        RT_SCHED_ERROR("Could not grow rt_thread cache on cpu %d\n", cpu);
+        return -1;
+    }
+
+    for (i = 0; i < RT_SLAB_CHUNK; i++) {
+        chunk[i].slab_cpu = cpu;
+        chunk[i].mpsc_next = slab->free;
+        slab->free = &chunk[i];
+    }
+    return 0;
+}
+
+static rt_thread* rt_slab_alloc(void)
+{
+    int cpu = my_cpu_id();
+    rt_slab *slab = &rt_slabs[cpu];
+    rt_thread *t = NULL;
+    uint8_t flags = irq_disable_save();
+
+    if (!slab->free) {
+        slab->free = mpsc_take(&slab->remote);
+    }
+    if (slab->free || !rt_slab_grow(slab, cpu)) {
+        t = slab->free;
+        slab->free = t->mpsc_next;
+    }
+
+    irq_enable_restore(flags);
+    return t;
+}
+
+void rt_thread_free(rt_thread *thread)
+{
+    rt_slab *slab;
+    uint8_t flags;
+
+    if (!thread) {
+        return;
+    }
+
+    slab = &rt_slabs[thread->slab_cpu];
+    if (thread->slab_cpu != my_cpu_id()) {
+        mpsc_push(&slab->remote, thread);
+        return;
+    }
+
+    flags = irq_disable_save();
+    thread->mpsc_next = slab->free;
+    slab->free = thread;
+    irq_enable_restore(flags);
+}
+
 rt_thread* rt_thread_init(int type,
                           rt_constraints *constraints,
                           uint64_t deadline,
                           struct nk_thread *thread
                           )
 {
-    rt_thread *t = (rt_thread *)malloc(sizeof(rt_thread));
+    rt_thread *t = rt_slab_alloc();
+    uint64_t now = cur_time();
+
+    if (!t) {
+        return NULL;
+    }
+
     t->type = type;
     t->status = ARRIVED;
-    t->constraints = constraints;
+    /* copied, so the caller's constraints need not outlive the call */
+    if (constraints) {
+        t->constr = *constraints;
+    } else {
+        memset(&t->constr, 0, sizeof(rt_constraints));
+    }
+    t->constraints = &t->constr;
     t->start_time = 0;
     t->run_time = 0;
     t->deadline = 0;
+    t->release = now;
+    t->q_index = RT_NOT_QUEUED;
+    t->q_account = APERIODIC;
+    t->migrate_cpu = -1;
+    t->placed_cpu = -1;
+    t->placed_util = 0;
+    t->owner_cpu = -1;
+    t->mpsc_next = NULL;
+    t->job_done = 0;
+    t->admitted = 0;
+    t->rel_deadline = 0;
+    t->sporadic_state = RT_SPORADIC_ACTIVE;
+#ifdef NAUT_CONFIG_RT_TASK_SETS
+    t->set = NULL;
+    t->set_start = 0;
+#endif
+    memset(&t->stats, 0, sizeof(rt_stats));
+#ifdef NAUT_CONFIG_RT_HISTOGRAMS
+    t->job_started = 0;
+    t->job_preempts = 0;
+#endif
+    memset(&t->miss, 0, sizeof(rt_miss_handler));
+#ifdef NAUT_CONFIG_RT_CBS
+    t->server = NULL;
+#endif
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+    t->g_util = 0;
+    t->g_owned = 0;
+#endif
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+    t->mc_admitted = 0;
+#endif
+#ifdef NAUT_CONFIG_RT_MUTEX
+    t->blocked_on = NULL;
+    t->mutex_next = NULL;
+    t->boost_next = NULL;
+    t->inherited = 0;
+    t->base_deadline = 0;
+    t->mutex_held = 0;
+    t->boost_queued = 0;
+    t->boosted = 0;
+#endif
+    t->blocking = 0;
+    t->joiner = NULL;
+    t->join_count = 0;
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+    t->split_cpu = -1;
+    t->split_home = -1;
+    t->split_phase = 0;
+    t->split_slice = 0;
+    t->split_home_util = 0;
+    t->split_util = 0;
+#endif
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+    INIT_LIST_HEAD(&t->wheel_node);
+    t->wheel_expiry = 0;
+#endif
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+    INIT_LIST_HEAD(&t->bucket_node);
+#endif
+#ifdef NAUT_CONFIG_RT_APERIODIC_MLFQ
+    INIT_LIST_HEAD(&t->mlfq_node);
+    t->mlfq_epoch = 0;
+    rt_mlfq_reset(t);
+#endif
 
     if (type == PERIODIC)
     {
-        t->deadline = cur_time() + constraints->periodic.period;
+        t->deadline = now + constraints->periodic.period;
     } else if (type == SPORADIC)
     {
-        t->deadline = cur_time() + deadline;
+        t->deadline = now + deadline;
+        t->rel_deadline = deadline;
     }
     
     thread->rt_thread = t;
@@ -155,87 +421,362 @@ rt_thread* rt_thread_init(int type,
     return t;
 }
 
+static rt_queue* rt_queue_create(queue_type type)
+{
+    rt_queue *queue = (rt_queue *)malloc(sizeof(rt_queue));
+    rt_thread **threads = (rt_thread **)malloc(RT_QUEUE_MIN * sizeof(rt_thread *));
+
+    if (!queue || !threads) {
+        RT_SCHED_ERROR("Could not allocate rt queue\n");
+        if (queue) {
+            free(queue);
+        }
+        if (threads) {
+            free(threads);
+        }
+        return NULL;
+    }
+
+    memset(queue, 0, sizeof(rt_queue));
+    queue->type = type;
+    queue->capacity = RT_QUEUE_MIN;
+    queue->threads = threads;
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+    if (type == RUNNABLE_QUEUE && !(queue->buckets = rt_buckets_create(cur_time()))) {
+        free(threads);
+        free(queue);
+        return NULL;
+    }
+#endif
+#ifdef NAUT_CONFIG_RT_APERIODIC_MLFQ
+    if (type == APERIODIC_QUEUE && !(queue->mlfq = rt_mlfq_create(cur_time()))) {
+        free(threads);
+        free(queue);
+        return NULL;
+    }
+#endif
+    return queue;
+}
+
+static void rt_queue_destroy(rt_queue *queue)
+{
+    if (queue) {
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+        if (queue->buckets) {
+            rt_buckets_destroy(queue->buckets);
+        }
+#endif
+#ifdef NAUT_CONFIG_RT_APERIODIC_MLFQ
+        if (queue->mlfq) {
+            rt_mlfq_destroy(queue->mlfq);
+        }
+#endif
+        free(queue->threads);
+        free(queue);
+    }
+}
+
+static inline uint64_t thread_util(rt_thread *thread)
+{
+    if (thread->type == PERIODIC) {
+        return (thread->constraints->periodic.slice * 100000) / thread->constraints->periodic.period;
+    } else if (thread->type == SPORADIC) {
+        uint64_t now = cur_time();
+        if (thread->deadline <= now) {
+            return 100000;
+        }
+        return (thread->constraints->sporadic.work * 100000) / (thread->deadline - now);
+    }
+    return 0;
+}
+
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+/*
+ * Global EDF: every CPU's scheduler shares one deadline-ordered
+ * runnable heap, so a job can run on whichever core frees up first.
+ * Pending releases and aperiodic threads stay per-CPU. Each CPU
+ * publishes the deadline of the job it is running in running[],
+ * which is read without the lock to pick a core to preempt.
+ */
+typedef struct rt_global {
+    spinlock_t lock;
+    rt_queue *runnable;
+    uint64_t util;      /* admitted utilization, x100000 */
+    uint64_t max_util;  /* largest single-thread utilization admitted */
+    uint64_t owned;     /* threads runnable keeps room for */
+    volatile uint64_t running[NAUT_CONFIG_MAX_CPUS];
+} rt_global;
+
+#define RT_NO_DEADLINE ((uint64_t)-1)
+
+static rt_global *global_edf = NULL;
+
+static rt_global* rt_global_init(void)
+{
+    rt_global *global = (rt_global *)malloc(sizeof(rt_global));
+    int i;
+
+    if (!global) {
+        RT_SCHED_ERROR("Could not allocate global EDF state\n");
+        return NULL;
+    }
+
+    memset(global, 0, sizeof(rt_global));
+    spinlock_init(&global->lock);
+    global->runnable = rt_queue_create(RUNNABLE_QUEUE);
+    if (!global->runnable) {
+        free(global);
+        return NULL;
+    }
+
+    for (i = 0; i < NAUT_CONFIG_MAX_CPUS; i++) {
+        global->running[i] = RT_NO_DEADLINE;
+    }
+    return global;
+}
+
+static inline uint64_t running_deadline(rt_thread *thread)
+{
+    if (thread && (thread->type == PERIODIC || thread->type == SPORADIC)) {
+        return thread->deadline;
+    }
+    return RT_NO_DEADLINE;
+}
+
+/*
+ * Called with the global lock held. Every thread that may be queued on
+ * the shared heap is counted once, here, however many cores it visits.
+ */
+static int rt_global_own(rt_thread *thread)
+{
+    if (thread->g_owned) {
+        return 0;
+    }
+    if (queue_keep(global_edf->runnable, global_edf->owned + 1)) {
+        return -1;
+    }
+    atomic_inc(global_edf->owned);
+    thread->g_owned = 1;
+    return 0;
+}
+
+uint8_t rt_global_lock(void)
+{
+    return spin_lock_irq_save(&global_edf->lock);
+}
+
+void rt_global_unlock(uint8_t flags)
+{
+    spin_unlock_irq_restore(&global_edf->lock, flags);
+}
+
+/*
+ * Admission for global EDF using the Goossens-Funk-Baruah bound,
+ * U <= m - (m - 1) * u_max, with each core's capacity taken as
+ * PERIODIC_UTIL rather than 1 to keep the usual headroom.
+ */
+int rt_global_admit(rt_thread *thread)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t m = sys->num_cpus;
+    uint64_t u = thread_util(thread);
+    uint64_t u_max, bound;
+    int ok = 0;
+    uint8_t flags;
+
+    if (thread->type != PERIODIC && thread->type != SPORADIC) {
+        return 1;
+    }
+
+#ifdef NAUT_CONFIG_RT_CACHE_PARTITION
+    if (rt_cat_admit(thread)) {
+        RT_SCHED_ERROR("GLOBAL EDF: Admission denied, cache class is not isolated\n");
+        return 0;
+    }
+#endif
+
+    flags = rt_global_lock();
+    u_max = MAX(global_edf->max_util, u);
+    bound = (m * PERIODIC_UTIL > (m - 1) * u_max) ? m * PERIODIC_UTIL - (m - 1) * u_max : 0;
+    if (u_max <= PERIODIC_UTIL && global_edf->util + u <= bound && !rt_global_own(thread)) {
+        global_edf->util += u;
+        global_edf->max_util = u_max;
+        thread->g_util = u;
+        ok = 1;
+    }
+    rt_global_unlock(flags);
+
+    if (!ok) {
+        RT_SCHED_ERROR("GLOBAL EDF: Admission denied (util %llu + %llu, u_max %llu, %llu cpus)\n",
+                       global_edf->util, u, u_max, m);
+    }
+    return ok;
+}
+
+/*
+ * Called with the global lock held. If the earliest runnable job
+ * beats the latest deadline running anywhere else, claim that core
+ * and return it so the caller can kick it once the lock is dropped.
+ */
+static int rt_global_pick_victim(void)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t top, latest = 0;
+    int cpu, victim = -1;
+
+    if (global_edf->runnable->size == 0) {
+        return -1;
+    }
+    top = global_edf->runnable->threads[0]->deadline;
+
+    for (cpu = 0; cpu < sys->num_cpus; cpu++) {
+        if (cpu == my_cpu_id() || !sys->cpus[cpu]->rt_sched) {
+            continue;
+        }
+#ifdef NAUT_CONFIG_POLL_IO
+        if (sys->cpus[cpu]->rt_sched->reserved) {
+            continue;
+        }
+#endif
+        if (global_edf->running[cpu] >= latest) {
+            latest = global_edf->running[cpu];
+            victim = cpu;
+        }
+    }
+
+    if (victim < 0 || top >= latest) {
+        return -1;
+    }
+
+    /* so that concurrent passes don't pile onto the same core */
+    global_edf->running[victim] = top;
+    return victim;
+}
+
+static void rt_global_kick(int cpu)
+{
+    struct sys_info *sys = per_cpu_get(system);
+
+    if (cpu >= 0 && !nk_idle_wake(cpu)) {
+        apic_ipi(per_cpu_get(apic), sys->cpus[cpu]->lapic_id, APIC_NULL_KICK_VEC);
+    }
+}
+
+void rt_global_enqueue(rt_thread *thread)
+{
+    uint8_t flags = rt_global_lock();
+    int victim;
+
+    enqueue_thread(global_edf->runnable, thread);
+    victim = rt_global_pick_victim();
+    rt_global_unlock(flags);
+    rt_global_kick(victim);
+}
+
+void rt_global_release(rt_thread *thread)
+{
+    uint8_t flags = rt_global_lock();
+    if (global_edf->util >= thread->g_util) {
+        global_edf->util -= thread->g_util;
+    }
+    thread->g_util = 0;
+    rt_global_unlock(flags);
+}
+#endif
+
 rt_scheduler* rt_scheduler_init(rt_thread *main_thread)
 {
     rt_scheduler* scheduler = (rt_scheduler *)malloc(sizeof(rt_scheduler));
-    rt_queue *runnable = (rt_queue *)malloc(sizeof(rt_queue) + MAX_QUEUE * sizeof(rt_thread *));
-    rt_queue *pending = (rt_queue *)malloc(sizeof(rt_queue) + MAX_QUEUE * sizeof(rt_thread *));
-    rt_queue *aperiodic = (rt_queue *)malloc(sizeof(rt_queue) + MAX_QUEUE * sizeof(rt_thread *));
-    rt_queue *arrival = (rt_queue *)malloc(sizeof(rt_queue) + MAX_QUEUE * sizeof(rt_thread *));
-    rt_queue *waiting = (rt_queue *)malloc(sizeof(rt_queue) + MAX_QUEUE * sizeof(rt_thread *));
-    rt_queue *sleeping = (rt_queue *)malloc(sizeof(rt_queue) + MAX_QUEUE * sizeof(rt_thread *));
-    rt_queue *exited = (rt_queue *)malloc(sizeof(rt_queue) + MAX_QUEUE * sizeof(rt_thread *));
-    rt_queue *trash = (rt_queue *)malloc(sizeof(rt_queue) + MAX_QUEUE * sizeof(rt_thread *));
-
     tsc_info *info = (tsc_info *)malloc(sizeof(tsc_info));
-	main_thread->status = ADMITTED;
-	scheduler->main_thread = main_thread;
 
-    if (!scheduler || !runnable || ! pending || !aperiodic || !arrival || !waiting || !info || !sleeping || !exited || !trash) {
+    if (!scheduler || !info) {
         RT_SCHED_ERROR("Could not allocate rt scheduler\n");
-        return NULL;
-    } else {
+        goto out_err;
+    }
+
 #define ZERO(x) memset(x, 0, sizeof(*x))
-#define ZERO_QUEUE(x) memset(x, 0, sizeof(rt_queue) + MAX_QUEUE * sizeof(rt_thread *))
-
-		ZERO(scheduler);
-		ZERO(info);
-		ZERO_QUEUE(runnable);
-		ZERO_QUEUE(pending);
-		ZERO_QUEUE(aperiodic);
-		ZERO_QUEUE(arrival);
-		ZERO_QUEUE(waiting);
-        ZERO_QUEUE(sleeping);
-        ZERO_QUEUE(exited);
-        ZERO_QUEUE(trash);
-		
-        runnable->type = RUNNABLE_QUEUE;
-        runnable->size = 0;
-        scheduler->runnable = runnable;
-        
-        pending->type = PENDING_QUEUE;
-        pending->size = 0;
-        scheduler->pending = pending;
-        
-        aperiodic->type = APERIODIC_QUEUE;
-        aperiodic->size = 0;
-        scheduler->aperiodic = aperiodic;
-
-        arrival->type = ARRIVAL_QUEUE;
-        arrival->size = 0;
-        arrival->head = 0;
-        arrival->tail = 0;
-        scheduler->arrival = arrival;
-
-        waiting->type = WAITING_QUEUE;
-        waiting->size = 0;
-        waiting->head = 0;
-        waiting->tail = 0;
-        scheduler->waiting = waiting;
-		
-        sleeping->type = SLEEPING_QUEUE;
-		sleeping->size = 0;
-        sleeping->head = 0;
-        sleeping->tail = 0;
-        scheduler->sleeping = sleeping;
-
-        exited->type = EXITED_QUEUE;
-        exited->size = 0;
-        exited->head = 0;
-        exited->tail = 0;
-        scheduler->exited = exited;
-
-        trash->size = 0;
-        trash->head = 0;
-        trash->tail = 0;
-        scheduler->trash = trash;
-
-        scheduler->tsc = info;
-
-    }
-
-    enqueue_thread(aperiodic, main_thread);
+    ZERO(scheduler);
+    ZERO(info);
+
+    scheduler->cpu = my_cpu_id();
+#ifdef NAUT_CONFIG_RT_CACHE_PARTITION
+    rt_cat_init();
+#endif
+
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+    if (!global_edf && !(global_edf = rt_global_init())) {
+        goto out_err;
+    }
+    scheduler->runnable = global_edf->runnable;
+#else
+    scheduler->runnable = rt_queue_create(RUNNABLE_QUEUE);
+#endif
+    scheduler->pending = rt_queue_create(PENDING_QUEUE);
+    scheduler->aperiodic = rt_queue_create(APERIODIC_QUEUE);
+    scheduler->sleeping = rt_queue_create(SLEEPING_QUEUE);
+    scheduler->exited = rt_queue_create(EXITED_QUEUE);
+    scheduler->trash = rt_queue_create(EXITED_QUEUE);
+#ifdef NAUT_CONFIG_RT_IDLE_CSTATES
+    idle_init(scheduler);
+#endif
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+    scheduler->crit_mode = RT_CRIT_LO;
+    scheduler->vd_scale = 100000;
+    scheduler->suspended = rt_queue_create(SUSPENDED_QUEUE);
+    if (!scheduler->suspended) {
+        RT_SCHED_ERROR("Could not allocate rt scheduler\n");
+        goto out_err;
+    }
+#endif
+
+    if (!scheduler->runnable || !scheduler->pending || !scheduler->aperiodic ||
+        !scheduler->sleeping ||
+        !scheduler->exited || !scheduler->trash) {
+        RT_SCHED_ERROR("Could not allocate rt scheduler\n");
+        goto out_err;
+    }
+
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+    scheduler->wheel = rt_wheel_create(cur_time());
+    if (!scheduler->wheel) {
+        goto out_err;
+    }
+#endif
+
+    scheduler->tsc = info;
+
+    if (sched_own_irq(scheduler, main_thread)) {
+        goto out_err;
+    }
+    main_thread->status = ADMITTED;
+    scheduler->main_thread = main_thread;
+    enqueue_thread(scheduler->aperiodic, main_thread);
     return scheduler;
+
+out_err:
+    if (scheduler) {
+#ifndef NAUT_CONFIG_RT_GLOBAL_EDF
+        rt_queue_destroy(scheduler->runnable);
+#endif
+        rt_queue_destroy(scheduler->pending);
+        rt_queue_destroy(scheduler->aperiodic);
+        rt_queue_destroy(scheduler->sleeping);
+        rt_queue_destroy(scheduler->exited);
+        rt_queue_destroy(scheduler->trash);
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+        rt_queue_destroy(scheduler->suspended);
+#endif
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+        if (scheduler->wheel) {
+            rt_wheel_destroy(scheduler->wheel);
+        }
+#endif
+        free(scheduler);
+    }
+    if (info) {
+        free(info);
+    }
+    return NULL;
 }
 
 static rt_simulator* init_simulator() {
@@ -246,8 +787,22 @@ static rt_simulator* init_simulator() {
 
     if (!simulator || !runnable || ! pending || !aperiodic) {
         RT_SCHED_ERROR("Could not allocate rt simulator\n");
+        if (simulator) {
+            free(simulator);
+        }
+        if (runnable) {
+            free(runnable);
+        }
+        if (pending) {
+            free(pending);
+        }
+        if (aperiodic) {
+            free(aperiodic);
+        }
         return NULL;
     } else {
+        simulator->used = 0;
+
         runnable->type = RUNNABLE_QUEUE;
         runnable->size = 0;
         simulator->runnable = runnable;
@@ -264,662 +819,988 @@ static rt_simulator* init_simulator() {
 }
 
 
-void enqueue_thread(rt_queue *queue, rt_thread *thread)
+/* key of a server's group member queue, either GROUP_FP or GROUP_EDF */
+static inline uint64_t group_key(rt_queue *queue, rt_thread *thread)
 {
-    if (queue->type == RUNNABLE_QUEUE)
-    {
-        if (queue->size == MAX_QUEUE)
-        {
-            RT_SCHED_ERROR("RUN QUEUE IS FULL!");
-            return;
-        }
-        
-        uint64_t pos = queue->size++;
-        queue->threads[pos] = thread;
-        while (queue->threads[parent(pos)]->deadline > thread->deadline && pos != parent(pos))
-        {
-            queue->threads[pos] = queue->threads[parent(pos)];
-            pos = parent(pos);
-        }
-        thread->q_type = RUNNABLE_QUEUE;
-        queue->threads[pos] = thread;
-        
-    } else if (queue->type == PENDING_QUEUE)
-    {
-        if (queue->size == MAX_QUEUE)
-        {
-            RT_SCHED_ERROR("PENDING QUEUE IS FULL!");
-            return;
-        }
-        
-        uint64_t pos = queue->size++;
-        queue->threads[pos] = thread;
-        while (queue->threads[parent(pos)]->deadline > thread->deadline && pos != parent(pos))
-        {
-            queue->threads[pos] = queue->threads[parent(pos)];
-            pos = parent(pos);
-        }
-        thread->q_type = PENDING_QUEUE;
-        queue->threads[pos] = thread;
-        
-    } else if (queue->type == APERIODIC_QUEUE)
-    {
-        if (queue->size == MAX_QUEUE) {
-            return;
-        }
-        
-        uint64_t pos = queue->size++;
-        queue->threads[pos] = thread;
-        while (queue->threads[parent(pos)]->constraints->aperiodic.priority > thread->constraints->aperiodic.priority && pos != parent(pos))
-        {
-            queue->threads[pos] = queue->threads[parent(pos)];
-            pos = parent(pos);
-        }
-        thread->q_type = APERIODIC_QUEUE;
-        queue->threads[pos] = thread;
-    } else if (queue->type == ARRIVAL_QUEUE) 
-    {
-        if (queue->size == MAX_QUEUE) {
-            RT_SCHED_ERROR("ARRIVAL QUEUE IS FULL!");
-            return;
-        }
+    if (queue->type == GROUP_FP_QUEUE) {
+        /* rate monotonic, everything else in the background */
+        return thread->type == PERIODIC ? thread->constraints->periodic.period : (uint64_t)-1;
+    }
+    return thread->type == APERIODIC ? (uint64_t)-1 : thread->deadline;
+}
 
-        queue->size++;
-        uint64_t pos = queue->tail++;
+/*
+ * With the timer wheel, release order for PENDING is kept by the
+ * wheel and the pending queue is only an unordered bag of the
+ * threads on it (still indexed by q_index so removal is O(1)).
+ */
+static inline int is_bag_queue(queue_type type)
+{
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+    return (type == PENDING_QUEUE);
+#else
+    return 0;
+#endif
+}
 
-        if (queue->tail == MAX_QUEUE) {
-            queue->tail = 0;
-        }
+static inline int is_heap_queue(queue_type type)
+{
+    if (is_bag_queue(type)) {
+        return 0;
+    }
+    return (type == RUNNABLE_QUEUE || type == PENDING_QUEUE || type == APERIODIC_QUEUE ||
+            type == GROUP_EDF_QUEUE || type == GROUP_FP_QUEUE);
+}
 
-        thread->q_type = ARRIVAL_QUEUE;
-		thread->status = ARRIVED;
-        queue->threads[pos] = thread;
-    } else if (queue->type == WAITING_QUEUE) 
-    {
-        if (queue->size == MAX_QUEUE) {
-            RT_SCHED_ERROR("WAITING QUEUE IS FULL!");
-            return;
-        }
+/*
+ * Queues start with RT_QUEUE_MIN slots, double when they fill and
+ * halve once they drop below a quarter full, so their footprint
+ * follows the number of threads actually on them. Rings are
+ * unwrapped into the new array so that head is always 0 afterwards.
+ */
+static int queue_resize(rt_queue *queue, uint64_t capacity)
+{
+    rt_thread **threads = (rt_thread **)malloc(capacity * sizeof(rt_thread *));
+    uint64_t i;
 
-        queue->size++;
-        uint64_t pos = queue->tail++;
+    if (!threads) {
+        return -1;
+    }
 
-        if (queue->tail == MAX_QUEUE) {
-            queue->tail = 0;
-        }
-        thread->q_type = WAITING_QUEUE;
-		thread->status = WAITING;
-        queue->threads[pos] = thread;
-    } else if (queue->type == SLEEPING_QUEUE) 
-    {
-        if (queue->size == MAX_QUEUE) {
-            RT_SCHED_ERROR("WAITING QUEUE IS FULL!");
-            return;
+    if (is_heap_queue(queue->type) || is_bag_queue(queue->type)) {
+        memcpy(threads, queue->threads, queue->size * sizeof(rt_thread *));
+    } else {
+        for (i = 0; i < queue->size; i++) {
+            threads[i] = queue->threads[(queue->head + i) % queue->capacity];
         }
+        queue->head = 0;
+        queue->tail = (queue->size == capacity) ? 0 : queue->size;
+    }
 
-        queue->size++;
-        uint64_t pos = queue->tail++;
+    free(queue->threads);
+    queue->threads = threads;
+    queue->capacity = capacity;
+    return 0;
+}
 
-        if (queue->tail == MAX_QUEUE) {
-            queue->tail = 0;
-        }
-        thread->q_type = SLEEPING_QUEUE;
-        thread->status = SLEEPING;
-        queue->threads[pos] = thread;
-    } else if (queue->type == EXITED_QUEUE) 
-    {
-        if (queue->size == MAX_QUEUE) {
-            RT_SCHED_ERROR("EXITED QUEUE IS FULL!");
-            return;
-        }
+/* make room for n more threads */
+static int queue_reserve_n(rt_queue *queue, uint64_t n)
+{
+    uint64_t capacity = queue->capacity;
 
-        queue->size++;
-        uint64_t pos = queue->tail++;
+    if (queue->size + n <= capacity) {
+        return 0;
+    }
 
-        if (queue->tail == MAX_QUEUE) {
-            queue->tail = 0;
-        }
-        thread->q_type = EXITED_QUEUE;
-        queue->threads[pos] = thread;
+    while (capacity < queue->size + n) {
+        capacity <<= 1;
     }
 
+    if (queue_resize(queue, capacity)) {
+        RT_SCHED_ERROR("Could not grow rt queue (type %d, size %llu)\n", queue->type, queue->size);
+        return -1;
+    }
+    return 0;
 }
 
-rt_thread* remove_thread(rt_thread *thread) {
-    rt_queue *queue = NULL;
-	queue_type type = thread->q_type;
+static inline int queue_reserve(rt_queue *queue)
+{
+    return queue_reserve_n(queue, 1);
+}
+
+static inline void queue_trim(rt_queue *queue)
+{
+    if (queue->capacity > RT_QUEUE_MIN && (queue->capacity >> 1) >= queue->floor &&
+        queue->size < (queue->capacity >> 2)) {
+        queue_resize(queue, queue->capacity >> 1);
+    }
+}
+
+/* room for n threads in all, and no shrinking below that */
+static int queue_keep(rt_queue *queue, uint64_t n)
+{
+    if (n > queue->size && queue_reserve_n(queue, n - queue->size)) {
+        return -1;
+    }
+    queue->floor = n;
+    return 0;
+}
+
+/*
+ * A core owns the threads it has taken on, and its queues each keep
+ * room for all of them at once. The room is made when a thread
+ * arrives, where running out of memory can still be reported or the
+ * thread left waiting, so the enqueues of a scheduling pass never
+ * fail. Only the core itself makes room, with interrupts off and,
+ * under global EDF, the global lock held. A core gives up a thread
+ * when it is removed or another core takes it over, from any core,
+ * and its floors drop back the next time it takes one on.
+ */
+static int sched_own(rt_scheduler *scheduler, rt_thread *thread)
+{
     struct sys_info *sys = per_cpu_get(system);
-    rt_scheduler *scheduler = sys->cpus[my_cpu_id()]->rt_sched;
+    uint64_t n = scheduler->owned + 1;
+    int old = thread->owner_cpu;
 
-	if (type == RUNNABLE_QUEUE) {
-        queue = scheduler->runnable;
+    if (old == scheduler->cpu) {
+        return 0;
+    }
 
-        if (queue == NULL) {
-            RT_SCHED_ERROR("RUNNABLE QUEUE NOT FOUND\n");
-            return NULL;
+    if (queue_keep(scheduler->pending, n) || queue_keep(scheduler->aperiodic, n) ||
+        queue_keep(scheduler->sleeping, n)) {
+        return -1;
+    }
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+    if (queue_keep(scheduler->suspended, n)) {
+        return -1;
+    }
+#endif
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+    if (scheduler->runnable == global_edf->runnable) {
+        if (rt_global_own(thread)) {
+            return -1;
         }
+    } else
+#endif
+    if (queue_keep(scheduler->runnable, n)) {
+        return -1;
+    }
 
-		if (queue->size < 1) {
-			RT_SCHED_ERROR("RUNNABLE QUEUE IS EMPTY. CAN'T REMOVE.\n");
-            return NULL;
-		}
+    atomic_inc(scheduler->owned);
+    thread->owner_cpu = scheduler->cpu;
+    if (old >= 0) {
+        atomic_dec(sys->cpus[old]->rt_sched->owned);
+    }
+    return 0;
+}
 
-        rt_thread *target_thread, *last;
-        int i = 0, target_index = queue->size, now, child;
-        for (i = 0; i < queue->size; i++) {
-            if (thread = queue->threads[i]) {
-                target_index = i;
-                break;
-            }
-        }
+/* sched_own() from outside a scheduling pass */
+static int sched_own_irq(rt_scheduler *scheduler, rt_thread *thread)
+{
+    uint8_t flags;
+    int rc;
+
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+    flags = rt_global_lock();
+    rc = sched_own(scheduler, thread);
+    rt_global_unlock(flags);
+#else
+    flags = irq_disable_save();
+    rc = sched_own(scheduler, thread);
+    irq_enable_restore(flags);
+#endif
+    return rc;
+}
 
-        if (target_index == queue->size) {
-            RT_SCHED_ERROR("THREAD NOT FOUND ON QUEUE\n");
-            return NULL;
-        }
-        target_thread = queue->threads[target_index];
-        last = queue->threads[--queue->size];
+static void sched_disown(rt_thread *thread)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    int cpu = thread->owner_cpu;
 
-        for (now = target_index; left_child(now) < queue->size; now = child)
-        {
-            child = left_child(now);
-            if (child < queue->size && queue->threads[right_child(now)]->deadline < queue->threads[left_child(now)]->deadline)
-            {
-                child = right_child(now);
-            }
-            
-            if (last->deadline > queue->threads[child]->deadline)
-            {
-                queue->threads[now] = queue->threads[child];
-            } else {
-                break;
-            }
-        }
-        
-        queue->threads[now] = last;
-        return thread;
-	} else if (type == PENDING_QUEUE) {
-        queue = scheduler->pending;
+    if (cpu >= 0 && atomic_cmpswap(thread->owner_cpu, cpu, -1) == cpu) {
+        atomic_dec(sys->cpus[cpu]->rt_sched->owned);
+    }
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+    if (atomic_cmpswap(thread->g_owned, 1, 0) == 1) {
+        atomic_dec(global_edf->owned);
+    }
+#endif
+}
 
-        if (queue == NULL) {
-            RT_SCHED_ERROR("PENDING QUEUE NOT FOUND\n");
-            return NULL;
-        }
+/*
+ * RUNNABLE and PENDING queues keep running totals over the threads on
+ * them, so admission control gets utilization and period statistics
+ * without walking the queues. Each thread records what it was counted
+ * as in q_account, and exactly that is taken back out when it leaves.
+ * The minimum period cannot be maintained on removal, so once the
+ * last thread at the minimum leaves it is marked stale and recomputed
+ * the next time it is asked for.
+ */
+static inline int is_accounted_queue(queue_type type)
+{
+    return (type == RUNNABLE_QUEUE || type == PENDING_QUEUE);
+}
 
-        if (queue->size < 1) {
-            RT_SCHED_ERROR("PENDING QUEUE IS EMPTY. CAN'T REMOVE.\n");
-            return NULL;
-        }
+static void queue_account(rt_queue *queue, rt_thread *thread)
+{
+    uint64_t period;
 
-        rt_thread *target_thread, *last;
-        int i = 0, target_index = queue->size, now, child;
-        for (i = 0; i < queue->size; i++) {
-            if (thread = queue->threads[i]) {
-                target_index = i;
-                break;
-            }
-        }
+    thread->q_account = APERIODIC;
+    if (!is_accounted_queue(queue->type)) {
+        return;
+    }
 
-        if (target_index == queue->size) {
-            RT_SCHED_ERROR("THREAD NOT FOUND ON QUEUE\n");
-            return NULL;
-        }
-        target_thread = queue->threads[target_index];
-        last = queue->threads[--queue->size];
+    if (thread->type == SPORADIC) {
+        queue->num_sporadic++;
+        thread->q_spor_util = thread_util(thread);
+        queue->spor_util += thread->q_spor_util;
+        thread->q_account = SPORADIC;
+        return;
+    }
 
-        for (now = target_index; left_child(now) < queue->size; now = child)
-        {
-            child = left_child(now);
-            if (child < queue->size && queue->threads[right_child(now)]->deadline < queue->threads[left_child(now)]->deadline)
-            {
-                child = right_child(now);
-            }
-            
-            if (last->deadline > queue->threads[child]->deadline)
-            {
-                queue->threads[now] = queue->threads[child];
-            } else {
-                break;
-            }
-        }
-        
-        queue->threads[now] = last;
-        return thread;
-    }  else if (type == APERIODIC_QUEUE) {
-        queue = scheduler->aperiodic;
+    if (thread->type != PERIODIC) {
+        return;
+    }
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+    if (thread->split_cpu >= 0) {
+        /* reserved separately through split_util */
+        return;
+    }
+#endif
+#ifdef NAUT_CONFIG_RT_CBS
+    if (thread->server) {
+        /* reserved for as long as the server exists, in server_util,
+           or out of its group's budget */
+        return;
+    }
+#endif
 
-        if (queue == NULL) {
-            RT_SCHED_ERROR("APERIODIC QUEUE NOT FOUND\n");
-            return NULL;
+    period = thread->constraints->periodic.period;
+    queue->util += (thread->constraints->periodic.slice * 100000) / period;
+    queue->sum_period += period;
+    queue->sum_freq += (100000ULL << RT_FREQ_SHIFT) / period;
+    queue->num_periodic++;
+
+    if (!queue->min_stale) {
+        if (queue->num_periodic == 1 || period < queue->min_period) {
+            queue->min_period = period;
+            queue->min_count = 1;
+        } else if (period == queue->min_period) {
+            queue->min_count++;
         }
+    }
+    thread->q_account = PERIODIC;
+}
 
-        if (queue->size < 1) {
-            RT_SCHED_ERROR("APERIODIC QUEUE IS EMPTY. CAN'T REMOVE.\n");
-            return NULL;
+static void queue_unaccount(rt_queue *queue, rt_thread *thread)
+{
+    uint64_t period;
+
+    if (thread->q_account == SPORADIC) {
+        queue->num_sporadic--;
+        queue->spor_util -= thread->q_spor_util;
+    } else if (thread->q_account == PERIODIC) {
+        period = thread->constraints->periodic.period;
+        queue->util -= (thread->constraints->periodic.slice * 100000) / period;
+        queue->sum_period -= period;
+        queue->sum_freq -= (100000ULL << RT_FREQ_SHIFT) / period;
+        queue->num_periodic--;
+
+        if (queue->num_periodic == 0) {
+            queue->min_stale = 0;
+            queue->min_count = 0;
+        } else if (!queue->min_stale && period == queue->min_period && --queue->min_count == 0) {
+            queue->min_stale = 1;
         }
+    }
+    thread->q_account = APERIODIC;
+}
 
-        rt_thread *target_thread, *last;
-        int i = 0, target_index = queue->size, now, child;
-        for (i = 0; i < queue->size; i++) {
-            if (thread = queue->threads[i]) {
-                target_index = i;
-                break;
-            }
-        }
+static uint64_t queue_min_period(rt_queue *queue)
+{
+    uint64_t i;
 
-        if (target_index == queue->size) {
-            RT_SCHED_ERROR("THREAD NOT FOUND ON QUEUE\n");
-            return NULL;
-        }
-        target_thread = queue->threads[target_index];
-        last = queue->threads[--queue->size];
+    if (queue->num_periodic == 0) {
+        return 0xFFFFFFFFFFFFFFFF;
+    }
 
-        for (now = target_index; left_child(now) < queue->size; now = child)
-        {
-            child = left_child(now);
-            if (child < queue->size && queue->threads[right_child(now)]->constraints->aperiodic.priority < queue->threads[left_child(now)]->constraints->aperiodic.priority)
-            {
-                child = right_child(now);
+    if (queue->min_stale) {
+        queue->min_period = 0xFFFFFFFFFFFFFFFF;
+        queue->min_count = 0;
+        for (i = 0; i < queue->size; i++) {
+            rt_thread *thread = queue->threads[i];
+            if (thread->q_account != PERIODIC) {
+                continue;
             }
-            
-            if (last->constraints->aperiodic.priority > queue->threads[child]->constraints->aperiodic.priority)
-            {
-                queue->threads[now] = queue->threads[child];
-            } else {
-                break;
+            if (thread->constraints->periodic.period < queue->min_period) {
+                queue->min_period = thread->constraints->periodic.period;
+                queue->min_count = 1;
+            } else if (thread->constraints->periodic.period == queue->min_period) {
+                queue->min_count++;
             }
         }
-        
-        queue->threads[now] = last;
-        return thread;
-    } else if (queue->type == ARRIVAL_QUEUE)
-    {
-        queue = scheduler->arrival;
-        if (queue->head == queue->tail) {
-            return NULL;
-        }
+        queue->min_stale = 0;
+    }
+    return queue->min_period;
+}
 
-        int i = queue->head;
-        while (i != queue->tail) {
-            if (queue->threads[i] == thread) {
-                break;
-            }
-            i = (i + 1) % (MAX_QUEUE);
-        }
-        if (i == queue->tail) {
-            RT_SCHED_ERROR("THREAD NOT FOUND.\n");
-            return NULL;
-        }
+#if defined(NAUT_CONFIG_RT_EDF_BUCKETS) || defined(NAUT_CONFIG_RT_APERIODIC_MLFQ)
+/*
+ * With deadline buckets the RUNNABLE queue, and with the feedback
+ * queue the APERIODIC one, keep their threads array only as a bag
+ * indexed by q_index, and the index decides the order. The first
+ * thread is kept in threads[0], where the rest of the scheduler
+ * expects the top of the heap, by swapping it in whenever the head
+ * may have changed.
+ */
+static inline int queue_indexed(rt_queue *queue)
+{
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+    if (queue->buckets) {
+        return 1;
+    }
+#endif
+#ifdef NAUT_CONFIG_RT_APERIODIC_MLFQ
+    if (queue->mlfq) {
+        return 1;
+    }
+#endif
+    return 0;
+}
 
-        while (i != queue->tail) {
-            int next = ((i + 1) % (MAX_QUEUE));
-            if (next == queue->tail) {
-                break;
-            }
-            queue->threads[i] = queue->threads[next];
-        }
+static void index_head(rt_queue *queue)
+{
+    rt_thread *head = NULL;
+    uint64_t pos;
 
-        if (queue->tail == 0) {
-            queue->tail = MAX_QUEUE - 1;
-        } else {
-            queue->tail--;
-        }
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+    if (queue->buckets) {
+        head = rt_buckets_first(queue->buckets, cur_time());
+    }
+#endif
+#ifdef NAUT_CONFIG_RT_APERIODIC_MLFQ
+    if (queue->mlfq) {
+        head = rt_mlfq_first(queue->mlfq, cur_time());
+    }
+#endif
 
-        queue->size--;
-        return thread;
-    } else if (queue->type == WAITING_QUEUE)
-    {
-        queue = scheduler->waiting;
+    if (!head || head->q_index == 0) {
+        return;
+    }
 
-        if (queue->head == queue->tail) {
-            return NULL;
-        }
+    pos = head->q_index;
+    queue->threads[pos] = queue->threads[0];
+    queue->threads[pos]->q_index = pos;
+    queue->threads[0] = head;
+    head->q_index = 0;
+}
 
-        int i = queue->head;
-        while (i != queue->tail) {
-            if (queue->threads[i] == thread) {
-                break;
-            }
-            i = (i + 1) % (MAX_QUEUE);
-        }
-        if (i == queue->tail) {
-            RT_SCHED_ERROR("THREAD NOT FOUND.\n");
-            return NULL;
-        }
+static void index_add(rt_queue *queue, rt_thread *thread)
+{
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+    if (queue->buckets) {
+        rt_buckets_add(queue->buckets, thread);
+    }
+#endif
+#ifdef NAUT_CONFIG_RT_APERIODIC_MLFQ
+    if (queue->mlfq) {
+        rt_mlfq_add(queue->mlfq, thread);
+    }
+#endif
+}
 
-        while (i != queue->tail) {
-            int next = ((i + 1) % (MAX_QUEUE));
-            if (next == queue->tail) {
-                break;
-            }
-            queue->threads[i] = queue->threads[next];
-        }
-        if (queue->tail == 0) {
-            queue->tail = MAX_QUEUE - 1;
-        } else {
-            queue->tail--;
-        }
-        queue->size--;
-        return thread;
-    }  else if (queue->type == SLEEPING_QUEUE)
-    {
-        queue = scheduler->sleeping;
+static void index_remove(rt_queue *queue, rt_thread *thread)
+{
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+    if (queue->buckets) {
+        rt_buckets_remove(queue->buckets, thread);
+    }
+#endif
+#ifdef NAUT_CONFIG_RT_APERIODIC_MLFQ
+    if (queue->mlfq) {
+        rt_mlfq_remove(queue->mlfq, thread);
+    }
+#endif
+}
+#else
+static inline int queue_indexed(rt_queue *queue)
+{
+    return 0;
+}
+#endif
 
-        if (queue->head == queue->tail) {
-            return NULL;
-        }
+/*
+ * Heap queues (RUNNABLE, PENDING, APERIODIC and the group queues of
+ * servers) are 4-ary min-heaps: shallower than a binary heap, and the
+ * children of a node share a cache line. Each thread's position is
+ * kept in thread->q_index, so any thread can be removed or re-keyed
+ * with a single sift instead of a scan of the heap.
+ *
+ * RT_QUEUE_HEAP() instantiates the heap from rt_heap.h for one key and
+ * wraps it with the queue's bookkeeping as name_insert(),
+ * name_remove_at() and name_dequeue(). Code that knows which queue it
+ * holds calls these directly, so the key is compiled into every sift;
+ * only enqueue_thread() and friends look at queue->type.
+ */
+#define DEADLINE_KEY(queue, thread) ((thread)->deadline)
+#define PRIORITY_KEY(queue, thread) ((thread)->constraints->aperiodic.priority)
+#define SET_Q_INDEX(thread, pos) ((thread)->q_index = (pos))
+
+/* returns 1 if the queue's index took the thread instead of the heap */
+static inline int heap_enter(rt_queue *queue, rt_thread *thread)
+{
+    thread->q_type = queue->type;
+    queue_account(queue, thread);
+#if defined(NAUT_CONFIG_RT_EDF_BUCKETS) || defined(NAUT_CONFIG_RT_APERIODIC_MLFQ)
+    if (queue_indexed(queue)) {
+        thread->q_index = queue->size;
+        queue->threads[queue->size++] = thread;
+        index_add(queue, thread);
+        index_head(queue);
+        return 1;
+    }
+#endif
+    return 0;
+}
 
-        int i = queue->head;
-        while (i != queue->tail) {
-            if (queue->threads[i] == thread) {
-                break;
-            }
-            i = (i + 1) % (MAX_QUEUE);
-        }
-        if (i == queue->tail) {
-            RT_SCHED_ERROR("THREAD NOT FOUND.\n");
-            return NULL;
+static inline rt_thread* heap_leave(rt_queue *queue, rt_thread *target)
+{
+    target->q_index = RT_NOT_QUEUED;
+    queue_unaccount(queue, target);
+    queue_trim(queue);
+    return target;
+}
+
+#if defined(NAUT_CONFIG_RT_EDF_BUCKETS) || defined(NAUT_CONFIG_RT_APERIODIC_MLFQ)
+static rt_thread* index_remove_at(rt_queue *queue, uint64_t pos)
+{
+    rt_thread *target = queue->threads[pos];
+    rt_thread *last = queue->threads[--queue->size];
+
+    index_remove(queue, target);
+    if (pos != queue->size) {
+        queue->threads[pos] = last;
+        last->q_index = pos;
+    }
+    if (pos == 0) {
+        index_head(queue);
+    }
+    return heap_leave(queue, target);
+}
+#else
+static inline rt_thread* index_remove_at(rt_queue *queue, uint64_t pos)
+{
+    return NULL;
+}
+#endif
+
+#define RT_QUEUE_HEAP(name, KEY)                                               \
+RT_HEAP_DEFINE(name##_heap, rt_queue, rt_thread, KEY, SET_Q_INDEX)            \
+                                                                              \
+static inline void name##_insert(rt_queue *queue, rt_thread *thread)          \
+{                                                                             \
+    if (!heap_enter(queue, thread)) {                                         \
+        name##_heap_push(queue, thread);                                      \
+    }                                                                         \
+}                                                                             \
+                                                                              \
+static inline rt_thread* name##_remove_at(rt_queue *queue, uint64_t pos)      \
+{                                                                             \
+    if (queue_indexed(queue)) {                                               \
+        return index_remove_at(queue, pos);                                   \
+    }                                                                         \
+    return heap_leave(queue, name##_heap_remove_at(queue, pos));              \
+}                                                                             \
+                                                                              \
+static rt_thread* name##_dequeue(rt_queue *queue)                             \
+{                                                                             \
+    rt_thread *min;                                                           \
+                                                                              \
+    while (queue->size > 0) {                                                 \
+        min = name##_remove_at(queue, 0);                                     \
+        if (min->status != TOBE_REMOVED) {                                    \
+            return min;                                                       \
+        }                                                                     \
+        thread_removed(min);                                                  \
+    }                                                                         \
+    RT_SCHED_ERROR("QUEUE %d EMPTY! CAN'T DEQUEUE!\n", queue->type);          \
+    return NULL;                                                              \
+}
+
+RT_QUEUE_HEAP(deadline, DEADLINE_KEY)
+RT_QUEUE_HEAP(priority, PRIORITY_KEY)
+RT_QUEUE_HEAP(group, group_key)
+
+/* for the few paths that are handed an arbitrary heap queue */
+static void sift_up(rt_queue *queue, uint64_t pos)
+{
+    switch (queue->type) {
+        case APERIODIC_QUEUE:
+            priority_heap_sift_up(queue, pos);
+            break;
+        case GROUP_EDF_QUEUE:
+        case GROUP_FP_QUEUE:
+            group_heap_sift_up(queue, pos);
+            break;
+        default:
+            deadline_heap_sift_up(queue, pos);
+            break;
+    }
+}
+
+static void sift_down(rt_queue *queue, uint64_t pos)
+{
+    switch (queue->type) {
+        case APERIODIC_QUEUE:
+            priority_heap_sift_down(queue, pos);
+            break;
+        case GROUP_EDF_QUEUE:
+        case GROUP_FP_QUEUE:
+            group_heap_sift_down(queue, pos);
+            break;
+        default:
+            deadline_heap_sift_down(queue, pos);
+            break;
+    }
+}
+
+static rt_thread* heap_remove_at(rt_queue *queue, uint64_t pos)
+{
+    switch (queue->type) {
+        case APERIODIC_QUEUE:
+            return priority_remove_at(queue, pos);
+        case GROUP_EDF_QUEUE:
+        case GROUP_FP_QUEUE:
+            return group_remove_at(queue, pos);
+        default:
+            return deadline_remove_at(queue, pos);
+    }
+}
+
+/*
+ * Batch insertion. Threads are appended with heap_append() (room must
+ * already be reserved) and the heap is repaired once with
+ * heap_fixup(). For a large batch that is Floyd's bottom-up heapify,
+ * linear in the size of the heap, rather than one sift per thread.
+ */
+static inline void heap_append(rt_queue *queue, rt_thread *thread)
+{
+    uint64_t pos = queue->size++;
+    queue->threads[pos] = thread;
+    thread->q_index = pos;
+    thread->q_type = queue->type;
+    queue_account(queue, thread);
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+    if (queue->buckets) {
+        rt_buckets_add(queue->buckets, thread);
+    }
+#endif
+}
+
+static void heap_fixup(rt_queue *queue, uint64_t first)
+{
+    uint64_t added = queue->size - first;
+    uint64_t depth = 1, n, i;
+
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+    if (queue->buckets) {
+        /* appended threads are already filed; a full fixup means keys changed */
+        for (i = 0; first == 0 && i < queue->size; i++) {
+            rt_buckets_add(queue->buckets, queue->threads[i]);
         }
+        index_head(queue);
+        return;
+    }
+#endif
 
-        while (i != queue->tail) {
-            int next = ((i + 1) % (MAX_QUEUE));
-            if (next == queue->tail) {
-                break;
-            }
-            queue->threads[i] = queue->threads[next];
+    if (added == 0) {
+        return;
+    }
+
+    for (n = queue->size; n >= RT_HEAP_ARITY; n /= RT_HEAP_ARITY) {
+        depth++;
+    }
+
+    if (added * depth > queue->size) {
+        for (i = rt_heap_parent(queue->size - 1) + 1; i-- > 0; ) {
+            sift_down(queue, i);
         }
-        if (queue->tail == 0) {
-            queue->tail = MAX_QUEUE - 1;
-        } else {
-            queue->tail--;
+    } else {
+        for (i = first; i < queue->size; i++) {
+            sift_up(queue, i);
         }
-        queue->size--;
-        return thread;
     }
+}
 
-    return NULL;
+static inline void bag_insert(rt_queue *queue, rt_thread *thread)
+{
+    thread->q_index = queue->size;
+    queue->threads[queue->size++] = thread;
+    thread->q_type = queue->type;
+    queue_account(queue, thread);
 }
 
-rt_thread* dequeue_thread(rt_queue *queue)
+static rt_thread* bag_remove_at(rt_queue *queue, uint64_t pos)
 {
-    if (queue->type == RUNNABLE_QUEUE)
-    {
-        if (queue->size < 1)
-        {
-            RT_SCHED_ERROR("RUNNABLE QUEUE EMPTY! CAN'T DEQUEUE!\n");
+    rt_thread *target = queue->threads[pos];
+
+    if (pos != --queue->size) {
+        queue->threads[pos] = queue->threads[queue->size];
+        queue->threads[pos]->q_index = pos;
+    }
+    target->q_index = RT_NOT_QUEUED;
+    queue_unaccount(queue, target);
+    queue_trim(queue);
+    return target;
+}
+
+static inline void ring_insert(rt_queue *queue, rt_thread *thread)
+{
+    queue->size++;
+    queue->threads[queue->tail++] = thread;
+    if (queue->tail == queue->capacity) {
+        queue->tail = 0;
+    }
+    thread->q_type = queue->type;
+}
+
+static rt_queue* thread_queue(rt_scheduler *scheduler, rt_thread *thread)
+{
+    switch (thread->q_type) {
+        case RUNNABLE_QUEUE:
+            return scheduler->runnable;
+        case PENDING_QUEUE:
+            return scheduler->pending;
+        case APERIODIC_QUEUE:
+            return scheduler->aperiodic;
+        case SLEEPING_QUEUE:
+            return scheduler->sleeping;
+        case EXITED_QUEUE:
+            return scheduler->exited;
+#ifdef NAUT_CONFIG_RT_CBS
+        case SERVER_QUEUE:
+        case GROUP_EDF_QUEUE:
+        case GROUP_FP_QUEUE:
+            return thread->server ? member_queue(thread) : NULL;
+#endif
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+        case SUSPENDED_QUEUE:
+            return scheduler->suspended;
+#endif
+        default:
             return NULL;
-        }
-        
-        rt_thread *min, *last;
-        int now, child;
-        
-        min = queue->threads[0];
-        last = queue->threads[--queue->size];
-        
-        for (now = 0; left_child(now) < queue->size; now = child)
-        {
-            child = left_child(now);
-            if (child < queue->size && queue->threads[right_child(now)]->deadline < queue->threads[left_child(now)]->deadline)
-            {
-                child = right_child(now);
-            }
-            
-            if (last->deadline > queue->threads[child]->deadline)
-            {
-                queue->threads[now] = queue->threads[child];
-            } else {
-                break;
-            }
-        }
-        
-        queue->threads[now] = last;
+    }
+}
+
+static rt_thread* ring_dequeue(rt_queue *queue)
+{
+    rt_thread *t;
 
-        if (min->status == TOBE_REMOVED) {
-            min->status == REMOVED;
-            return dequeue_thread(queue);
+    while (queue->size > 0) {
+        t = queue->threads[queue->head++];
+        if (queue->head == queue->capacity) {
+            queue->head = 0;
         }
+        queue->size--;
+        queue_trim(queue);
 
-        return min;
-    } else if (queue->type == PENDING_QUEUE)
-    {
-        if (queue->size < 1)
-        {
-            RT_SCHED_ERROR("PENDING QUEUE EMPTY! CAN'T DEQUEUE!\n");
-            return NULL;
+        if (t->status != TOBE_REMOVED || queue->type == EXITED_QUEUE) {
+            return t;
         }
-        rt_thread *min, *last;
-        int now, child;
-        
-        min = queue->threads[0];
-        last = queue->threads[--queue->size];
-        
-        for (now = 0; left_child(now) < queue->size; now = child)
-        {
-            child = left_child(now);
-            if (child < queue->size && queue->threads[right_child(now)]->deadline < queue->threads[left_child(now)]->deadline)
-            {
-                child = right_child(now);
-            }
-            
-            if (last->deadline > queue->threads[child]->deadline)
-            {
-                queue->threads[now] = queue->threads[child];
-            } else {
-                break;
+        thread_removed(t);
+    }
+    return NULL;
+}
+
+/*
+ * Typed entry points, for callers that know which of the scheduler's
+ * queues they are handing a thread to.
+ */
+static inline void enqueue_runnable(rt_queue *queue, rt_thread *thread)
+{
+    if (!queue_reserve(queue)) {
+        deadline_insert(queue, thread);
+    }
+}
+
+static inline void enqueue_pending(rt_queue *queue, rt_thread *thread)
+{
+    if (queue_reserve(queue)) {
+        return;
+    }
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+    bag_insert(queue, thread);
+    rt_wheel_add(per_cpu_get(rt_sched)->wheel, thread, thread->deadline);
+#else
+    deadline_insert(queue, thread);
+#endif
+}
+
+static inline void enqueue_aperiodic(rt_queue *queue, rt_thread *thread)
+{
+    if (!queue_reserve(queue)) {
+        priority_insert(queue, thread);
+    }
+}
+
+static inline rt_thread* dequeue_runnable(rt_queue *queue)
+{
+    return deadline_dequeue(queue);
+}
+
+static inline rt_thread* dequeue_aperiodic(rt_queue *queue)
+{
+    return priority_dequeue(queue);
+}
+
+void enqueue_thread(rt_queue *queue, rt_thread *thread)
+{
+    switch (queue->type) {
+        case RUNNABLE_QUEUE:
+            enqueue_runnable(queue, thread);
+            return;
+        case PENDING_QUEUE:
+            enqueue_pending(queue, thread);
+            return;
+        case APERIODIC_QUEUE:
+            enqueue_aperiodic(queue, thread);
+            return;
+        case GROUP_EDF_QUEUE:
+        case GROUP_FP_QUEUE:
+            if (!queue_reserve(queue)) {
+                group_insert(queue, thread);
             }
+            return;
+        default:
+            break;
+    }
+
+    if (queue_reserve(queue)) {
+        return;
+    }
+    ring_insert(queue, thread);
+    if (queue->type == ARRIVAL_QUEUE) {
+        thread->status = ARRIVED;
+    } else if (queue->type == WAITING_QUEUE) {
+        thread->status = WAITING;
+    } else if (queue->type == SLEEPING_QUEUE) {
+        thread->status = SLEEPING;
+    }
+}
+
+static rt_thread* ring_remove(rt_queue *queue, rt_thread *thread)
+{
+    uint64_t i = queue->head, next, n;
+
+    for (n = 0; n < queue->size; n++) {
+        if (queue->threads[i] == thread) {
+            break;
         }
-        
-        queue->threads[now] = last;
+        i = (i + 1) % queue->capacity;
+    }
+    if (n == queue->size) {
+        RT_SCHED_ERROR("THREAD NOT FOUND.\n");
+        return NULL;
+    }
+
+    for (n++; n < queue->size; n++) {
+        next = (i + 1) % queue->capacity;
+        queue->threads[i] = queue->threads[next];
+        i = next;
+    }
+    queue->tail = i;
+    queue->size--;
+    queue_trim(queue);
+    return thread;
+}
+
+rt_thread* remove_thread(rt_thread *thread) {
+    rt_scheduler *scheduler = per_cpu_get(rt_sched);
+    rt_queue *queue = thread_queue(scheduler, thread);
 
-        if (min->status == TOBE_REMOVED) {
-            min->status == REMOVED;
-            return dequeue_thread(queue);
+    if (queue == NULL) {
+        RT_SCHED_ERROR("QUEUE NOT FOUND\n");
+        return NULL;
+    }
+
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+    if (rt_wheel_pending(thread)) {
+        rt_wheel_remove(scheduler->wheel, thread);
+        if (queue->type == SLEEPING_QUEUE) {
+            /* timed sleepers live only on the wheel */
+            return thread;
         }
+    }
+#endif
 
-        return min;
-    } else if (queue->type == APERIODIC_QUEUE)
-    {
-        if (queue->size < 1)
-        {
-            RT_SCHED_ERROR("APERIODIC QUEUE EMPTY! CAN'T DEQUEUE!\n");
+    if (is_heap_queue(queue->type) || is_bag_queue(queue->type)) {
+        if (queue->size < 1) {
+            RT_SCHED_ERROR("QUEUE IS EMPTY. CAN'T REMOVE.\n");
             return NULL;
         }
-        rt_thread *min, *last;
-        int now, child;
-        
-        min = queue->threads[0];
-        last = queue->threads[--queue->size];
-        
-        for (now = 0; left_child(now) < queue->size; now = child)
-        {
-            child = left_child(now);
-            if (child < queue->size && queue->threads[right_child(now)]->constraints->aperiodic.priority < queue->threads[left_child(now)]->constraints->aperiodic.priority)
-            {
-                child = right_child(now);
-            }
-            
-            if (last->constraints->aperiodic.priority > queue->threads[child]->constraints->aperiodic.priority)
-            {
-                queue->threads[now] = queue->threads[child];
-            } else {
-                break;
-            }
-        }
-        
-        queue->threads[now] = last;
 
-        if (min->status == TOBE_REMOVED) {
-            min->status == REMOVED;
-            return dequeue_thread(queue);
+        if (thread->q_index >= queue->size || queue->threads[thread->q_index] != thread) {
+            RT_SCHED_ERROR("THREAD NOT FOUND ON QUEUE\n");
+            return NULL;
         }
 
-        return min;
-    } else if (queue->type == ARRIVAL_QUEUE || queue->type = WAITING_QUEUE || queue->type == SLEEPING_QUEUE || queue->type == EXITED_QUEUE)
-    {
-        if (queue->head == queue->tail) {
-            RT_SCHED_ERROR("QUEUE EMPTY! CAN'T DEQUEUE!\n");
-            return NULL;
+        if (is_bag_queue(queue->type)) {
+            return bag_remove_at(queue, thread->q_index);
         }
-        uint64_t pos = queue->head++;
-        if (queue->head == MAX_QUEUE) {
-            queue->head = 0;
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+        if (queue == global_edf->runnable) {
+            uint8_t flags = rt_global_lock();
+            rt_thread *t = NULL;
+            if (thread->q_index < queue->size && queue->threads[thread->q_index] == thread) {
+                t = heap_remove_at(queue, thread->q_index);
+            }
+            rt_global_unlock(flags);
+            return t;
         }
-        queue->size--;
+#endif
+        return heap_remove_at(queue, thread->q_index);
+    }
 
-        rt_thread *t = queue->threads[pos];
-        if (t->status == TOBE_REMOVED) {
-            t->status == REMOVED;
-            return dequeue_thread(queue);
-        }
+    return ring_remove(queue, thread);
+}
 
-        return queue->threads[pos];
+/*
+ * Re-key a thread in place. If it is sitting on one of the heap
+ * queues it is sifted to its new position, otherwise only the key
+ * changes and is honored on its next enqueue.
+ */
+static void requeue_thread(rt_thread *thread, uint64_t old_key, uint64_t new_key)
+{
+    rt_scheduler *scheduler = per_cpu_get(rt_sched);
+    rt_queue *queue = thread_queue(scheduler, thread);
+
+    if (!queue || !is_heap_queue(queue->type) ||
+        thread->q_index >= queue->size ||
+        queue->threads[thread->q_index] != thread) {
+        return;
+    }
+
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+    if (queue->buckets) {
+        rt_buckets_add(queue->buckets, thread);
+        index_head(queue);
+        return;
+    }
+#endif
+#ifdef NAUT_CONFIG_RT_APERIODIC_MLFQ
+    if (queue->mlfq) {
+        /* the feedback queue does not order by priority */
+        return;
+    }
+#endif
+    if (new_key < old_key) {
+        sift_up(queue, thread->q_index);
+    } else if (new_key > old_key) {
+        sift_down(queue, thread->q_index);
+    }
+}
+
+void rt_thread_set_deadline(rt_thread *thread, uint64_t deadline)
+{
+    uint64_t old = thread->deadline;
+    thread->deadline = deadline;
+    if (thread->q_type != APERIODIC_QUEUE) {
+        requeue_thread(thread, old, deadline);
+    }
+}
+
+void rt_thread_set_priority(rt_thread *thread, uint64_t priority)
+{
+    uint64_t old = thread->constraints->aperiodic.priority;
+    thread->constraints->aperiodic.priority = priority;
+    if (thread->q_type == APERIODIC_QUEUE) {
+        requeue_thread(thread, old, priority);
+    }
+}
+
+rt_thread* dequeue_thread(rt_queue *queue)
+{
+    switch (queue->type) {
+        case RUNNABLE_QUEUE:
+            return dequeue_runnable(queue);
+        case PENDING_QUEUE:
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+            /* released through release_pending(), not in order */
+            return NULL;
+#else
+            return deadline_dequeue(queue);
+#endif
+        case APERIODIC_QUEUE:
+            return dequeue_aperiodic(queue);
+        case GROUP_EDF_QUEUE:
+        case GROUP_FP_QUEUE:
+            return group_dequeue(queue);
+        default:
+            return ring_dequeue(queue);
     }
-    return NULL;
 }
 
+/*
+ * The simulator's queues are the same heaps over its own thread copies,
+ * which do not track their position.
+ */
+#define SIM_DEADLINE_KEY(queue, thread) ((thread)->deadline)
+#define SIM_PRIORITY_KEY(queue, thread) ((thread)->constraints.aperiodic.priority)
+
+RT_HEAP_DEFINE(sim_deadline_heap, rt_queue_sim, rt_thread_sim, SIM_DEADLINE_KEY, RT_HEAP_NO_POS)
+RT_HEAP_DEFINE(sim_priority_heap, rt_queue_sim, rt_thread_sim, SIM_PRIORITY_KEY, RT_HEAP_NO_POS)
+
 static void enqueue_thread_logic(rt_queue_sim *queue, rt_thread_sim *thread)
 {
-    if (queue->type == RUNNABLE_QUEUE)
-    {
-        uint64_t pos = queue->size++;
-        queue->threads[pos] = thread;
-        while (queue->threads[parent(pos)]->deadline > thread->deadline && pos != parent(pos))
-        {
-            queue->threads[pos] = queue->threads[parent(pos)];
-            pos = parent(pos);
-        }
-        thread->q_type = RUNNABLE_QUEUE;
-        queue->threads[pos] = thread;
-        
-    } else if (queue->type == PENDING_QUEUE)
-    {
-        uint64_t pos = queue->size++;
-        queue->threads[pos] = thread;
-        while (queue->threads[parent(pos)]->deadline > thread->deadline && pos != parent(pos))
-        {
-            queue->threads[pos] = queue->threads[parent(pos)];
-            pos = parent(pos);
-        }
-        thread->q_type = PENDING_QUEUE;
-        queue->threads[pos] = thread;
-        
-    } else if (queue->type == APERIODIC_QUEUE)
-    {
-        uint64_t pos = queue->size++;
-        queue->threads[pos] = thread;
-        while (queue->threads[parent(pos)]->constraints->aperiodic.priority > thread->constraints->aperiodic.priority && pos != parent(pos))
-        {
-            queue->threads[pos] = queue->threads[parent(pos)];
-            pos = parent(pos);
-        }
-        thread->q_type = APERIODIC_QUEUE;
-        queue->threads[pos] = thread;
-    } 
+    if (queue->type == APERIODIC_QUEUE) {
+        sim_priority_heap_push(queue, thread);
+    } else {
+        sim_deadline_heap_push(queue, thread);
+    }
+    thread->q_type = queue->type;
 }
 
 static rt_thread_sim* dequeue_thread_logic(rt_queue_sim *queue)
 {
-    if (queue->type == RUNNABLE_QUEUE)
-    {
-        if (queue->size < 1)
-        {
-            RT_SCHED_ERROR("RUNNABLE QUEUE EMPTY! CAN'T DEQUEUE!\n");
-            return NULL;
-        }
-        
-        rt_thread_sim *min, *last;
-        int now, child;
-        
-        min = queue->threads[0];
-        last = queue->threads[--queue->size];
-        
-        for (now = 0; left_child(now) < queue->size; now = child)
-        {
-            child = left_child(now);
-            if (child < queue->size && queue->threads[right_child(now)]->deadline < queue->threads[left_child(now)]->deadline)
-            {
-                child = right_child(now);
-            }
-            
-            if (last->deadline > queue->threads[child]->deadline)
-            {
-                queue->threads[now] = queue->threads[child];
-            } else {
-                break;
-            }
-        }
-        
-        queue->threads[now] = last;
-        
-        return min;
-    } else if (queue->type == PENDING_QUEUE)
+    if (queue->size < 1)
     {
-        if (queue->size < 1)
-        {
-            RT_SCHED_ERROR("PENDING QUEUE EMPTY! CAN'T DEQUEUE!\n");
-            return NULL;
-        }
-        rt_thread_sim *min, *last;
-        int now, child;
-        
-        min = queue->threads[0];
-        last = queue->threads[--queue->size];
-        
-        for (now = 0; left_child(now) < queue->size; now = child)
-        {
-            child = left_child(now);
-            if (child < queue->size && queue->threads[right_child(now)]->deadline < queue->threads[left_child(now)]->deadline)
-            {
-                child = right_child(now);
-            }
-            
-            if (last->deadline > queue->threads[child]->deadline)
-            {
-                queue->threads[now] = queue->threads[child];
-            } else {
-                break;
-            }
+        RT_SCHED_ERROR("SIMULATED QUEUE %d EMPTY! CAN'T DEQUEUE!\n", queue->type);
+        return NULL;
+    }
+
+    if (queue->type == APERIODIC_QUEUE) {
+        return sim_priority_heap_remove_at(queue, 0);
+    }
+    return sim_deadline_heap_remove_at(queue, 0);
+}
+
+#ifdef NAUT_CONFIG_RT_HISTOGRAMS
+static inline void rt_hist_add(rt_hist *h, uint64_t v)
+{
+    int b = v ? 64 - __builtin_clzll(v) : 0;
+
+    h->count[b < RT_HIST_BUCKETS ? b : RT_HIST_BUCKETS - 1]++;
+}
+
+static void rt_hist_dump(const char *name, rt_hist *h)
+{
+    int i;
+
+    printk("%s:\n", name);
+    for (i = 0; i < RT_HIST_BUCKETS; i++) {
+        if (!h->count[i]) {
+            continue;
         }
-        
-        queue->threads[now] = last;
-        
-        return min;
-    } else if (queue->type == APERIODIC_QUEUE)
-    {
-        if (queue->size < 1)
-        {
-            RT_SCHED_ERROR("APERIODIC QUEUE EMPTY! CAN'T DEQUEUE!\n");
-            return NULL;
+        if (i == 0) {
+            printk("  0\t\t\t%llu\n", h->count[i]);
+        } else {
+            printk("  [%llu, %llu)\t%llu\n", 1ULL << (i - 1),
+                   i < RT_HIST_BUCKETS - 1 ? 1ULL << i : -1ULL, h->count[i]);
         }
+    }
+}
 
-        rt_thread_sim *min, *last;
-        int now, child;
-        
-        min = queue->threads[0];
-        last = queue->threads[--queue->size];
-        
-        for (now = 0; left_child(now) < queue->size; now = child)
-        {
-            child = left_child(now);
-            if (child < queue->size && queue->threads[right_child(now)]->constraints->aperiodic.priority < queue->threads[left_child(now)]->constraints->aperiodic.priority)
-            {
-                child = right_child(now);
-            }
-            
-            if (last->constraints->aperiodic.priority > queue->threads[child]->constraints->aperiodic.priority)
-            {
-                queue->threads[now] = queue->threads[child];
-            } else {
-                break;
-            }
-        }
-        
-        queue->threads[now] = last;
-        
-        return min;
-    } 
-    return NULL;
+/*
+ * Called as a thread is switched in. The first dispatch of a job
+ * measures its release jitter, every later one that follows another
+ * thread is a preemption being resumed. Jobs are closed out by
+ * check_deadlines().
+ */
+void rt_stats_enter(rt_thread *thread, rt_thread *prev)
+{
+    if (thread->type == APERIODIC) {
+        return;
+    }
+    if (!thread->job_started) {
+        thread->job_started = 1;
+        thread->job_preempts = 0;
+        rt_hist_add(&thread->stats.jitter,
+                    thread->start_time > thread->release ? thread->start_time - thread->release : 0);
+    } else if (thread != prev) {
+        thread->job_preempts++;
+    }
 }
+#endif
 
 void rt_thread_dump(rt_thread *thread)
 {
@@ -931,340 +1812,3994 @@ void rt_thread_dump(rt_thread *thread)
     {
         RT_SCHED_DEBUG("Work: %llu\t\t", thread->constraints->sporadic.work);
     }
+#ifdef NAUT_CONFIG_RT_HISTOGRAMS
+    if (thread->type != APERIODIC) {
+        rt_hist_dump("RESPONSE (cycles)", &thread->stats.response);
+        rt_hist_dump("LATENESS (cycles)", &thread->stats.lateness);
+        rt_hist_dump("RELEASE JITTER (cycles)", &thread->stats.jitter);
+        rt_hist_dump("PREEMPTIONS", &thread->stats.preempts);
+    }
+#endif
 }
 
+void rt_thread_get_stats(rt_thread *thread, rt_stats *stats)
+{
+    *stats = thread->stats;
+}
 
-static void set_timer(rt_scheduler *scheduler, rt_thread *current_thread, uint64_t end_time, uint64_t slack)
+int rt_thread_set_miss_policy(rt_thread *thread, rt_miss_policy policy, uint64_t overrun,
+                              rt_miss_callback fn, void *state)
 {
-    scheduler->tsc->start_time = cur_time();
-    struct sys_info *sys = per_cpu_get(system);
-    struct apic_dev *apic = sys->cpus[my_cpu_id()]->apic;
-    if (scheduler->pending->size > 0 && current_thread) {
-        rt_thread *thread = scheduler->pending->threads[0];
-        uint64_t completion_time = 0;
-        if (current_thread->type == PERIODIC)
-        {
-            apic_oneshot_write(apic, umin(thread->deadline - end_time, (current_thread->constraints->periodic.slice - current_thread->run_time) + slack));
-            scheduler->tsc->set_time = umin(thread->deadline - end_time, (current_thread->constraints->periodic.slice - current_thread->run_time));
-        } else if (current_thread->type == SPORADIC)
-        {
-            apic_oneshot_write(apic, umin(thread->deadline - end_time, (current_thread->constraints->sporadic.work - current_thread->run_time) + slack));
-            scheduler->tsc->set_time = umin(thread->deadline - end_time, (current_thread->constraints->sporadic.work - current_thread->run_time) + slack);
-        } else
-        {
-            apic_oneshot_write(apic, umin(thread->deadline - end_time, QUANTUM));
-            scheduler->tsc->set_time = umin(thread->deadline - end_time, QUANTUM);
-        }
-    } else if (scheduler->pending->size == 0 && current_thread) {
-        if (current_thread->type == PERIODIC)
-        {
-            apic_oneshot_write(apic, (current_thread->constraints->periodic.slice - current_thread->run_time) + slack);
-            scheduler->tsc->set_time = (current_thread->constraints->periodic.slice - current_thread->run_time) + slack;
+    uint8_t flags;
+
+    if (policy > RT_MISS_CALLBACK || (policy == RT_MISS_CALLBACK && !fn)) {
+        RT_SCHED_ERROR("Invalid deadline miss policy %d\n", policy);
+        return -1;
+    }
+
+    flags = irq_disable_save();
+    thread->miss.policy = policy;
+    thread->miss.overrun = overrun;
+    thread->miss.fn = fn;
+    thread->miss.state = state;
+    irq_enable_restore(flags);
+    return 0;
+}
+
+
+/*
+ * TSC time at which the next pending thread (or, with the timer
+ * wheel, timed sleeper) is due, 0 if nothing is waiting on time.
+ */
+static inline uint64_t next_release(rt_scheduler *scheduler)
+{
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+    return rt_wheel_next(scheduler->wheel);
+#else
+    return scheduler->pending->size > 0 ? scheduler->pending->threads[0]->deadline : 0;
+#endif
+}
+
+/*
+ * Program the oneshot to fire delta cycles after end_time, the point
+ * at which the next thread starts running. A delta of 0 switches the
+ * timer off. With hrtimers the deadline is handed to them instead,
+ * and they fire the timer early if one of theirs is due first.
+ */
+static inline void arm_timer(struct apic_dev *apic, uint64_t end_time, uint64_t delta)
+{
+#ifdef NAUT_CONFIG_HRTIMERS
+    nk_hrtimer_program(delta ? end_time + delta : 0);
+#else
+    apic_deadline_write(apic, delta ? end_time + delta : 0);
+#endif
+}
+
+#ifdef NAUT_CONFIG_RT_LAZY_RESCHED
+/*
+ * Lazy rescheduling. Every interrupt ends in rt_need_resched(), but
+ * most of them are not our timer and change nothing. After each full
+ * pass the scheduler notes what it chose, when its timer will fire,
+ * and the state of the queues that could make it choose differently.
+ * If none of that has moved, the next pass keeps the current thread
+ * and leaves the timer as it is.
+ *
+ * A relative oneshot can fire a little early (the count is truncated
+ * and the calibration is not exact). So in that mode the expiry is
+ * pulled in by 1/64 of the interval. Otherwise a timer that fired
+ * early would be taken for a foreign interrupt and never re-armed.
+ */
+static inline void lazy_snapshot(rt_scheduler *scheduler, rt_thread *thread, struct apic_dev *apic)
+{
+    uint64_t delta = scheduler->tsc->set_time;
+
+    scheduler->lazy_thread = thread;
+    if (delta == 0) {
+        scheduler->lazy_expiry = (uint64_t)-1;
+    } else {
+        scheduler->lazy_expiry = scheduler->tsc->end_time + delta - (apic->tsc_deadline ? 0 : (delta >> 6));
+    }
+    scheduler->lazy_head = scheduler->runnable->size ? scheduler->runnable->threads[0] : NULL;
+    scheduler->lazy_runnable = scheduler->runnable->size;
+    scheduler->lazy_pending = scheduler->pending->size;
+    scheduler->lazy_aperiodic = scheduler->aperiodic->size;
+}
+
+static inline int lazy_resched_ok(rt_scheduler *scheduler, rt_thread *thread)
+{
+    if (scheduler->unblocked.head) {
+        return 0;
+    }
+#ifdef NAUT_CONFIG_RT_MUTEX
+    if (scheduler->boost.head) {
+        return 0;
+    }
+#endif
+    return thread == scheduler->lazy_thread &&
+           (thread->status == ADMITTED || thread->status == RUNNING || thread->status == ARRIVED) &&
+           !thread->job_done &&
+           !scheduler->inbox.head &&
+           !scheduler->arrival.head && !scheduler->waiting.head &&
+           !scheduler->unblocked.head &&
+           scheduler->runnable->size == scheduler->lazy_runnable &&
+           (scheduler->runnable->size == 0 || scheduler->runnable->threads[0] == scheduler->lazy_head) &&
+           scheduler->pending->size == scheduler->lazy_pending &&
+           scheduler->aperiodic->size == scheduler->lazy_aperiodic &&
+           cur_time() + scheduler->run_time < scheduler->lazy_expiry;
+}
+#endif
+
+/* time slice of an aperiodic thread */
+static inline uint64_t aperiodic_slice(rt_scheduler *scheduler, rt_thread *thread)
+{
+#ifdef NAUT_CONFIG_RT_APERIODIC_MLFQ
+    if (thread->type == APERIODIC && scheduler->aperiodic->mlfq) {
+        return rt_mlfq_quantum(scheduler->aperiodic->mlfq, thread);
+    }
+#endif
+    return QUANTUM;
+}
+
+static void set_timer(rt_scheduler *scheduler, rt_thread *current_thread, uint64_t end_time, uint64_t slack)
+{
+    scheduler->tsc->start_time = cur_time();
+    struct apic_dev *apic = per_cpu_get(apic);
+    uint64_t release = next_release(scheduler);
+    uint64_t until_release = (release > end_time) ? release - end_time : 1;
+#ifdef NAUT_CONFIG_RT_IDLE_CSTATES
+    scheduler->idle_state = 0;
+    scheduler->idle_wake = 0;
+    if (current_thread && current_thread->thread && current_thread->thread->is_idle &&
+        scheduler->runnable->size == 0 && scheduler->aperiodic->size == 0) {
+        /* nothing but idle until the next release: sleep deep, wake early */
+        uint64_t gap, delta;
+        int state;
+
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+        gap = release ? until_release : (uint64_t)-1;
+#else
+        gap = release ? umin(until_release, QUANTUM) : QUANTUM;
+#endif
+#ifdef NAUT_CONFIG_HRTIMERS
+        /* an hrtimer will wake us as well */
+        uint64_t hr = nk_hrtimer_next();
+        if (hr) {
+            gap = umin(gap, (hr > end_time) ? hr - end_time : 1);
+        }
+#endif
+        state = idle_pick(scheduler, gap);
+        delta = (gap == (uint64_t)-1) ? 0 : MAX(gap - scheduler->idle_latency[state], 1);
+
+        scheduler->idle_state = state;
+        scheduler->idle_wake = delta ? end_time + delta : 0;
+        arm_timer(apic, end_time, delta);
+        scheduler->tsc->set_time = delta;
+        scheduler->tsc->end_time = end_time;
+#ifdef NAUT_CONFIG_RT_LAZY_RESCHED
+        lazy_snapshot(scheduler, current_thread, apic);
+#endif
+        return;
+    }
+#endif
+#ifdef NAUT_CONFIG_RT_CBS
+    if (current_thread && current_thread->server) {
+        /* a member runs until its server's budget is gone */
+        uint64_t delta = server_remaining(current_thread->server);
+
+        if (current_thread->type == SPORADIC) {
+            uint64_t work = current_thread->constraints->sporadic.work;
+            delta = umin(delta, (work > current_thread->run_time) ? work - current_thread->run_time : 0);
+        } else if (current_thread->type == PERIODIC) {
+            uint64_t slice = periodic_budget(current_thread);
+            delta = umin(delta, (slice > current_thread->run_time) ? slice - current_thread->run_time : 0);
+        } else {
+            delta = umin(delta, QUANTUM);
+        }
+        if (release) {
+            delta = umin(delta, until_release);
+        }
+        delta = MAX(delta, 1);
+        arm_timer(apic, end_time, delta);
+        scheduler->tsc->set_time = delta;
+        scheduler->tsc->end_time = end_time;
+#ifdef NAUT_CONFIG_RT_LAZY_RESCHED
+        lazy_snapshot(scheduler, current_thread, apic);
+#endif
+        return;
+    }
+#endif
+#ifdef NAUT_CONFIG_RT_RECLAIM
+    if (current_thread && current_thread->type == APERIODIC &&
+        scheduler->runnable->size > 0 && slack_usable(scheduler, end_time)) {
+        /* ahead of the run queue on reclaimed budget, all of it at once */
+        uint64_t delta = umin(scheduler->slack, scheduler->slack_deadline - end_time);
+
+        if (release) {
+            delta = umin(delta, until_release);
+        }
+        scheduler->slack_thread = current_thread;
+        scheduler->slack_mark = current_thread->run_time;
+        arm_timer(apic, end_time, delta);
+        scheduler->tsc->set_time = delta;
+        scheduler->tsc->end_time = end_time;
+#ifdef NAUT_CONFIG_RT_LAZY_RESCHED
+        lazy_snapshot(scheduler, current_thread, apic);
+#endif
+        return;
+    }
+#endif
+    if (release && current_thread) {
+        uint64_t completion_time = 0;
+        if (current_thread->type == PERIODIC)
+        {
+            arm_timer(apic, end_time, umin(until_release, (periodic_budget(current_thread) - current_thread->run_time) + slack));
+            scheduler->tsc->set_time = umin(until_release, (periodic_budget(current_thread) - current_thread->run_time));
+        } else if (current_thread->type == SPORADIC)
+        {
+            arm_timer(apic, end_time, umin(until_release, (current_thread->constraints->sporadic.work - current_thread->run_time) + slack));
+            scheduler->tsc->set_time = umin(until_release, (current_thread->constraints->sporadic.work - current_thread->run_time) + slack);
+        }
+#ifdef NAUT_CONFIG_RT_RECLAIM
+        else if (scheduler->runnable->size == 0 && scheduler->aperiodic->size == 0)
+        {
+            /* the only thing that can run: let it have the whole gap */
+            arm_timer(apic, end_time, until_release);
+            scheduler->tsc->set_time = until_release;
+        }
+#endif
+        else
+        {
+            uint64_t quantum = aperiodic_slice(scheduler, current_thread);
+            arm_timer(apic, end_time, umin(until_release, quantum));
+            scheduler->tsc->set_time = umin(until_release, quantum);
+        }
+    } else if (!release && current_thread) {
+        if (current_thread->type == PERIODIC)
+        {
+            arm_timer(apic, end_time, (periodic_budget(current_thread) - current_thread->run_time) + slack);
+            scheduler->tsc->set_time = (periodic_budget(current_thread) - current_thread->run_time) + slack;
         } else if (current_thread->type == SPORADIC)
         {
-            apic_oneshot_write(apic, (current_thread->constraints->sporadic.work - current_thread->run_time) + slack);
+            arm_timer(apic, end_time, (current_thread->constraints->sporadic.work - current_thread->run_time) + slack);
             scheduler->tsc->set_time = (current_thread->constraints->sporadic.work - current_thread->run_time) + slack;
         }
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+        else if (scheduler->runnable->size == 0 && scheduler->aperiodic->size == 0 &&
+                 !scheduler->arrival.head) {
+            /* nothing else can run and nothing is due: stay tickless */
+            arm_timer(apic, end_time, 0);
+            scheduler->tsc->set_time = 0;
+        }
+#endif
         else {
-            apic_oneshot_write(apic, QUANTUM);
-            scheduler->tsc->set_time = QUANTUM;
+            uint64_t quantum = aperiodic_slice(scheduler, current_thread);
+            arm_timer(apic, end_time, quantum);
+            scheduler->tsc->set_time = quantum;
         }
     } else {
-        apic_oneshot_write(apic, QUANTUM);
+        arm_timer(apic, end_time, QUANTUM);
         scheduler->tsc->set_time = QUANTUM;
     }
 	scheduler->tsc->end_time = end_time;
+#ifdef NAUT_CONFIG_RT_LAZY_RESCHED
+    lazy_snapshot(scheduler, current_thread, apic);
+#endif
 }
 
-
-struct nk_thread *rt_need_resched()
+/*
+ * Move every thread whose release time has passed by end_time from
+ * the pending queue to the run queue (and wake timed sleepers). Jobs
+ * released together, as in harmonic task sets, are appended to the
+ * runnable heap and the heap is repaired once for the whole batch.
+ */
+static void release_pending(rt_scheduler *scheduler, uint64_t end_time)
 {
-    struct sys_info *sys = per_cpu_get(system);
-    rt_scheduler *scheduler = sys->cpus[my_cpu_id()]->rt_sched;
-    
-    struct nk_thread *c = get_cur_thread();
-    rt_thread *rt_c = c->rt_thread;
-    
-    
-    uint64_t end_time = scheduler->run_time + cur_time();
-    uint64_t slack = 0;
-    scheduler->tsc->end_time = cur_time();
-    
-    rt_thread *rt_n = NULL;
-    
-    while (scheduler->pending->size > 0)
-    {
-        if (scheduler->pending->threads[0]->deadline < end_time)
-        {
-            rt_thread *arrived_thread = dequeue_thread(scheduler->pending);
+    rt_queue *runnable = scheduler->runnable;
+    uint64_t first = runnable->size;
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+    struct list_head expired;
+    rt_thread *thread, *next;
+    uint64_t n;
+    int batch;
+
+    INIT_LIST_HEAD(&expired);
+    n = rt_wheel_advance(scheduler->wheel, end_time, &expired);
+    if (n == 0) {
+        return;
+    }
+
+    /* without the room, fall back to one insertion at a time */
+    batch = !queue_reserve_n(runnable, n);
+
+    list_for_each_entry_safe(thread, next, &expired, wheel_node) {
+        list_del_init(&thread->wheel_node);
 
-            if (arrived_thread == NULL) {
+        if (thread->q_type == PENDING_QUEUE) {
+            bag_remove_at(scheduler->pending, thread->q_index);
+            if (thread->status == TOBE_REMOVED) {
+                thread_removed(thread);
                 continue;
             }
+            update_periodic(thread);
+#ifdef NAUT_CONFIG_RT_GROUPS
+            if (thread->server) {
+                rt_server_wake(thread);
+                continue;
+            }
+#endif
+            if (batch) {
+                heap_append(runnable, thread);
+            } else {
+                enqueue_runnable(runnable, thread);
+            }
+        } else if (thread->q_type == SLEEPING_QUEUE) {
+            thread->status = ADMITTED;
+#ifdef NAUT_CONFIG_RT_CBS
+            if (thread->server) {
+                rt_server_wake(thread);
+                continue;
+            }
+#endif
+            if (thread->type == APERIODIC) {
+                enqueue_aperiodic(scheduler->aperiodic, thread);
+            } else if (batch) {
+                heap_append(runnable, thread);
+            } else {
+                enqueue_runnable(runnable, thread);
+            }
+        }
+    }
+#else
+    rt_queue *pending = scheduler->pending;
+
+    while (pending->size > 0 && pending->threads[0]->deadline < end_time)
+    {
+        rt_thread *arrived_thread = deadline_remove_at(pending, 0);
 
-            update_periodic(arrived_thread);
-            enqueue_thread(scheduler->runnable, arrived_thread);
+        if (arrived_thread->status == TOBE_REMOVED) {
+            thread_removed(arrived_thread);
             continue;
-        } else
-        {
+        }
+
+        if (queue_reserve(runnable)) {
+            enqueue_pending(pending, arrived_thread);
             break;
         }
+
+        update_periodic(arrived_thread);
+#ifdef NAUT_CONFIG_RT_GROUPS
+        if (arrived_thread->server) {
+            rt_server_wake(arrived_thread);
+            continue;
+        }
+#endif
+        heap_append(runnable, arrived_thread);
     }
-    
-    switch (rt_c->type) {
-        case APERIODIC:
-            rt_c->constraints->aperiodic.priority = rt_c->run_time;
-            enqueue_thread(scheduler->aperiodic, rt_c);
+#endif
+    heap_fixup(runnable, first);
+}
 
-            if (scheduler->runnable->size > 0)
-            {
-                rt_n = dequeue_thread(scheduler->runnable);
-                if (rt_n != NULL) {
-                    set_timer(scheduler, rt_n, end_time, slack);
-                    return rt_n->thread;
-                }
-            }
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+/*
+ * Put the calling thread to sleep until the TSC reaches wake_time.
+ * It is parked on this CPU's timer wheel and requeued by
+ * release_pending() once it is due.
+ */
+int rt_thread_sleep_until(uint64_t wake_time)
+{
+    uint8_t flags = irq_disable_save();
+    rt_scheduler *scheduler = per_cpu_get(rt_sched);
+    rt_thread *t = get_cur_thread()->rt_thread;
+
+    if (wake_time > cur_time()) {
+        t->status = SLEEPING;
+        t->q_type = SLEEPING_QUEUE;
+        rt_wheel_add(scheduler->wheel, t, wake_time);
+        nk_schedule();
+    }
 
-            rt_n = dequeue_thread(scheduler->aperiodic);
-            if (rt_n == NULL) {
-                    RT_SCHED_ERROR("APERIODIC QUEUE IS EMPTY.\n THE WORLD IS GOVERNED BY MADNESS.\n");
-                    panic("ATTEMPTING TO RUN A NULL RT_THREAD.\n");
-            }
-            set_timer(scheduler, rt_n, end_time, slack);
-            return rt_n->thread;
-            break;
-            
-        case SPORADIC:
-            if (rt_c->run_time >= rt_c->constraints->sporadic.work) {
-                check_deadlines(rt_c);
+    irq_enable_restore(flags);
+    return 0;
+}
+#endif
 
-                if (scheduler->runnable->size > 0) {
-                    rt_n = dequeue_thread(scheduler->runnable);
-                    if (rt_n != NULL) {
-                        set_timer(scheduler, rt_n, end_time, slack);
-                        return rt_n->thread;
-                    }
-                }
-                rt_n = dequeue_thread(scheduler->aperiodic);
-                if (rt_n == NULL) {
-                    RT_SCHED_ERROR("APERIODIC QUEUE IS EMPTY.\n THE WORLD IS GOVERNED BY MADNESS.\n");
-                    panic("ATTEMPTING TO RUN A NULL RT_THREAD.\n");
-                }
-                set_timer(scheduler, rt_n, end_time, slack);
-                return rt_n->thread;
-            } else {
-                if (scheduler->runnable->size > 0)
-                {
-                    if (rt_c->deadline > scheduler->runnable->threads[0]->deadline) {
-                        rt_n = dequeue_thread(scheduler->runnable);
-                        if (rt_n != NULL) {
-                            enqueue_thread(scheduler->runnable, rt_c);
-                            set_timer(scheduler, rt_n, end_time, slack);
-                            return rt_n->thread;
-                        }
-                    }
-                }
-            }
-            set_timer(scheduler, rt_c, end_time, slack);
-            return rt_c->thread;
-            break;
-            
-        case PERIODIC:
-            if (rt_c->run_time >= rt_c->constraints->periodic.slice) {
-                if (check_deadlines(rt_c)) {
-                    update_periodic(rt_c);
-                    enqueue_thread(scheduler->runnable, rt_c);
-                } else {
-                    enqueue_thread(scheduler->pending, rt_c);
-                }
+#ifdef NAUT_CONFIG_RT_CBS
+/******************************************************************
+ CONSTANT BANDWIDTH SERVERS
+
+ A server reserves budget Q every period T on one core for a group of
+ aperiodic or sporadic member threads. It competes under EDF with the
+ periodic threads through a proxy rt_thread on the runnable heap,
+ keyed on the server deadline. When the proxy is picked, the next
+ ready member runs in its place, round robin, and what it runs is
+ charged to the server. An exhausted server has its deadline pushed
+ back by T and its budget refilled (the CBS rule). So a burst from its
+ members never takes more than Q/T of the core from the periodic
+ threads. A server that wakes up idle gets a fresh deadline, unless
+ what is left of its budget still fits before its old one.
+ ******************************************************************/
+
+static inline int is_server_proxy(rt_thread *thread)
+{
+    return thread->server && !thread->thread;
+}
 
-                if (scheduler->runnable->size > 0) {
-                    rt_n = dequeue_thread(scheduler->runnable);
-                    if (rt_n != NULL) {
-                        set_timer(scheduler, rt_n, end_time, slack);
-                        return rt_n->thread;
-                    }
-                }
-                rt_n = dequeue_thread(scheduler->aperiodic);
-                if (rt_n == NULL) {
-                    RT_SCHED_ERROR("APERIODIC QUEUE IS EMPTY.\n THE WORLD IS GOVERNED BY MADNESS.\n");
-                    panic("ATTEMPTING TO RUN A NULL RT_THREAD.\n");
-                }
-                set_timer(scheduler, rt_n, end_time, slack);
-                return rt_n->thread;
-            } else {
-                if (scheduler->runnable->size > 0)
-                {
-                    if (rt_c->deadline > scheduler->runnable->threads[0]->deadline) {
-                        rt_n = dequeue_thread(scheduler->runnable);
-                        if (rt_n != NULL) {
-                            enqueue_thread(scheduler->runnable, rt_c);
-                            set_timer(scheduler, rt_n, end_time, slack);
-                            return rt_n->thread;
-                        }
-                    }
-                }
-            }
-            set_timer(scheduler, rt_c, end_time, slack);
-            return rt_c->thread;
-            break;
-        default:
-            set_timer(scheduler, rt_c, end_time, slack);
-            return c;
+static inline rt_server* server_parent(rt_server *server)
+{
+#ifdef NAUT_CONFIG_RT_GROUPS
+    return server->parent;
+#else
+    return NULL;
+#endif
+}
+
+/* the queue a member (or a child group's proxy) waits on */
+static inline rt_queue* member_queue(rt_thread *thread)
+{
+    if (is_server_proxy(thread)) {
+        rt_server *parent = server_parent(thread->server);
+        return parent ? parent->members : NULL;
+    }
+    return thread->server->members;
+}
+
+static inline uint64_t server_util(uint64_t budget, uint64_t period)
+{
+    return (budget * 100000) / period;
+}
+
+/* budget left to a member, which is bounded by every enclosing group */
+static uint64_t server_remaining(rt_server *server)
+{
+    uint64_t remaining = server->remaining;
+
+    for (server = server_parent(server); server; server = server_parent(server)) {
+        remaining = umin(remaining, server->remaining);
+    }
+    return remaining;
+}
+
+/* what member ran is charged to its server and every group above it */
+static void server_charge(rt_server *server, rt_thread *member)
+{
+    uint64_t used;
+
+    for (; server; server = server_parent(server)) {
+        used = member->run_time - server->active_mark;
+
+        server->remaining = (used >= server->remaining) ? 0 : server->remaining - used;
+        server->active = NULL;
+
+        if (server->remaining == 0) {
+            server->proxy->deadline += server->period;
+            server->remaining = server->budget;
+        }
+    }
+}
+
+/* put the proxy back on the run queue (or its group) if the server has work */
+static void server_requeue(rt_scheduler *scheduler, rt_server *server)
+{
+    rt_server *parent;
+
+    for (; server; server = parent) {
+        parent = server_parent(server);
+        if (server->members->size > 0 && !server->active &&
+            server->proxy->q_index == RT_NOT_QUEUED) {
+            enqueue_thread(parent ? parent->members : scheduler->runnable, server->proxy);
+        }
+    }
+}
+
+/* pick a member to run from server, descending into child groups */
+static rt_thread* server_pick(rt_server *server)
+{
+    rt_thread *member, *leaf;
+
+    while ((member = dequeue_thread(server->members)) != NULL) {
+        if (!is_server_proxy(member)) {
+            server->active = member;
+            return member;
+        }
+        leaf = server_pick(member->server);
+        if (leaf) {
+            server->active = member;
+            return leaf;
+        }
+        /* child group with nothing ready, requeued when it has */
+    }
+    return NULL;
+}
+
+static rt_thread* server_dispatch(rt_scheduler *scheduler, rt_server *server)
+{
+    rt_thread *member = server_pick(server);
+    rt_server *s;
+
+    if (member == NULL) {
+        /* its members exited while it was queued */
+        return pick_runnable(scheduler);
+    }
+
+    for (s = member->server; s; s = server_parent(s)) {
+        s->active_mark = member->run_time;
+    }
+    member->status = ADMITTED;
+    return member;
+}
+
+/*
+ * Called with rt_c being a member of a server: charge the server,
+ * requeue the member behind its siblings unless it is done, asleep
+ * or gone, then choose what runs next.
+ */
+static rt_thread* server_resched(rt_scheduler *scheduler, rt_thread *member)
+{
+    rt_server *server = member->server;
+    rt_thread *next;
+
+    server_charge(server, member);
+
+    if (member->blocking) {
+        /* waiting on an rt_mutex or a join, whoever ends it wakes it */
+        member->blocking = 0;
+    } else
+    if (member->status == TOBE_REMOVED || member->status == SLEEPING ||
+        member->status == WAITING) {
+        /* not ready, it comes back through rt_server_wake() */
+    } else if (member->type == SPORADIC && member->run_time >= member->constraints->sporadic.work) {
+        if (check_deadlines(member)) {
+            miss_action(member);
+        }
+    } else if (member->type == PERIODIC && member->run_time >= periodic_budget(member)) {
+        if (check_deadlines(member)) {
+            /* its next job is already due */
+            update_periodic(member);
+            enqueue_thread(server->members, member);
+        } else {
+            member->deadline = job_deadline(member);
+            enqueue_pending(scheduler->pending, member);
+        }
+    } else {
+        enqueue_thread(server->members, member);
+    }
+    server_requeue(scheduler, server);
+
+    next = pick_runnable(scheduler);
+    if (next == NULL) {
+        next = dequeue_aperiodic(scheduler->aperiodic);
+    }
+    if (next == NULL) {
+        RT_SCHED_ERROR("APERIODIC QUEUE IS EMPTY.\n THE WORLD IS GOVERNED BY MADNESS.\n");
+        panic("ATTEMPTING TO RUN A NULL RT_THREAD.\n");
+    }
+    return next;
+}
+
+static rt_server* server_alloc(uint64_t budget, uint64_t period, queue_type members)
+{
+    rt_server *server;
+    rt_thread *proxy;
+
+    server = (rt_server *)malloc(sizeof(rt_server));
+    proxy = (rt_thread *)malloc(sizeof(rt_thread));
+    if (!server || !proxy) {
+        goto out_err;
+    }
+    memset(server, 0, sizeof(rt_server));
+    memset(proxy, 0, sizeof(rt_thread));
+
+    server->members = rt_queue_create(members);
+    if (!server->members) {
+        goto out_err;
+    }
+
+    server->budget = budget;
+    server->period = period;
+    server->remaining = budget;
+    server->cpu = my_cpu_id();
+    server->constraints.periodic.period = period;
+    server->constraints.periodic.slice = budget;
+
+    /* stand-in on the runnable heap, never run itself */
+    proxy->type = PERIODIC;
+    proxy->status = ADMITTED;
+    proxy->constraints = &server->constraints;
+    proxy->q_index = RT_NOT_QUEUED;
+    proxy->q_account = APERIODIC;
+    proxy->migrate_cpu = -1;
+    proxy->owner_cpu = -1;
+    proxy->deadline = cur_time() + period;
+    proxy->server = server;
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+    proxy->split_cpu = -1;
+#endif
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+    INIT_LIST_HEAD(&proxy->wheel_node);
+#endif
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+    INIT_LIST_HEAD(&proxy->bucket_node);
+#endif
+    server->proxy = proxy;
+    return server;
+
+out_err:
+    RT_SCHED_ERROR("Could not allocate rt server\n");
+    if (server) {
+        free(server);
+    }
+    if (proxy) {
+        free(proxy);
+    }
+    return NULL;
+}
+
+rt_server* rt_server_create(uint64_t budget, uint64_t period)
+{
+    rt_scheduler *scheduler = per_cpu_get(rt_sched);
+    rt_server *server;
+    uint64_t util;
+
+    if (!budget || budget > period) {
+        RT_SCHED_ERROR("CBS: invalid budget %llu for period %llu\n", budget, period);
+        return NULL;
+    }
+
+    util = server_util(budget, period);
+    if (core_per_util(scheduler) + util > PERIODIC_UTIL) {
+        RT_SCHED_ERROR("CBS: Admission denied utilization factor overflow!\n");
+        return NULL;
+    }
+
+    server = server_alloc(budget, period, SERVER_QUEUE);
+    if (!server) {
+        return NULL;
+    }
+
+    /* its proxy is queued on the runnable heap like any thread */
+    if (sched_own_irq(scheduler, server->proxy)) {
+        rt_queue_destroy(server->members);
+        free(server->proxy);
+        free(server);
+        return NULL;
+    }
+
+    atomic_add(scheduler->server_util, util);
+    demand_changed(scheduler);
+    return server;
+}
+
+#ifdef NAUT_CONFIG_RT_GROUPS
+/*
+ * Admission inside a group. A group with budget Q every T may supply
+ * nothing for up to 2(T - Q), after which it supplies at least Q/T of
+ * the core, so a periodic member (C, P) is admitted by its density
+ * against the shortened period, C / (P - 2(T - Q)). Under EDF the
+ * densities may add up to Q/T; under fixed priority to ln 2 of that.
+ */
+static uint64_t group_density(rt_server *group, uint64_t slice, uint64_t period)
+{
+    uint64_t blackout = 2 * (group->period - group->budget);
+
+    if (period <= blackout + slice) {
+        return (uint64_t)-1;
+    }
+    return (slice * 100000) / (period - blackout);
+}
+
+static int group_admit(rt_server *group, uint64_t slice, uint64_t period)
+{
+    uint64_t density = group_density(group, slice, period);
+    uint64_t cap = server_util(group->budget, group->period);
+
+    if (group->policy == RT_GROUP_FP) {
+        cap = (cap * 69314) / 100000;
+    }
+
+    if (group->policy == RT_GROUP_RR || density == (uint64_t)-1 ||
+        group->child_util + density > cap) {
+        RT_SCHED_ERROR("GROUP: Admission denied for %llu/%llu in group %p\n", slice, period, group);
+        return 0;
+    }
+    group->child_util += density;
+    return 1;
+}
+
+static void group_release(rt_server *group, uint64_t slice, uint64_t period)
+{
+    uint64_t density = group_density(group, slice, period);
+
+    group->child_util -= MIN(density, group->child_util);
+}
+
+rt_server* rt_group_create(rt_server *parent, uint64_t budget, uint64_t period,
+                           rt_group_policy policy)
+{
+    rt_scheduler *scheduler = per_cpu_get(rt_sched);
+    rt_server *group;
+    uint8_t flags;
+
+    if (!parent) {
+        group = rt_server_create(budget, period);
+    } else if (!budget || budget > period || parent->cpu != my_cpu_id()) {
+        RT_SCHED_ERROR("GROUP: invalid group %llu/%llu under %p\n", budget, period, parent);
+        return NULL;
+    } else {
+        flags = irq_disable_save();
+        if (queue_keep(parent->members, parent->num_members + 1) ||
+            !group_admit(parent, budget, period)) {
+            irq_enable_restore(flags);
+            return NULL;
+        }
+        parent->num_members++;
+        irq_enable_restore(flags);
+
+        group = server_alloc(budget, period, SERVER_QUEUE);
+        if (!group) {
+            flags = irq_disable_save();
+            group_release(parent, budget, period);
+            parent->num_members--;
+            irq_enable_restore(flags);
+            return NULL;
+        }
+        demand_changed(scheduler);
+    }
+
+    if (!group) {
+        return NULL;
+    }
+
+    if (policy != RT_GROUP_RR) {
+        rt_queue *members = rt_queue_create(policy == RT_GROUP_EDF ? GROUP_EDF_QUEUE : GROUP_FP_QUEUE);
+
+        if (!members) {
+            group->parent = parent;
+            rt_server_destroy(group);
+            return NULL;
+        }
+        rt_queue_destroy(group->members);
+        group->members = members;
+    }
+    group->policy = policy;
+    group->parent = parent;
+    return group;
+}
+#endif
+
+int rt_server_destroy(rt_server *server)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    rt_scheduler *scheduler = sys->cpus[server->cpu]->rt_sched;
+    uint8_t flags;
+
+    if (server->num_members || server->cpu != my_cpu_id()) {
+        RT_SCHED_ERROR("CBS: server %p still has members or is not local\n", server);
+        return -1;
+    }
+
+    flags = irq_disable_save();
+    if (server->proxy->q_index != RT_NOT_QUEUED) {
+        remove_thread(server->proxy);
+    }
+#ifdef NAUT_CONFIG_RT_GROUPS
+    if (server->parent) {
+        group_release(server->parent, server->budget, server->period);
+        server->parent->num_members--;
+    } else
+#endif
+    atomic_sub(scheduler->server_util, server_util(server->budget, server->period));
+    irq_enable_restore(flags);
+
+    sched_disown(server->proxy);
+    demand_changed(scheduler);
+    rt_queue_destroy(server->members);
+    free(server->proxy);
+    free(server);
+    return 0;
+}
+
+/*
+ * A server with nothing queued or running has become busy: give it a
+ * fresh deadline unless its old budget still fits, and queue its proxy
+ * on the run queue or, for a child group, on its parent.
+ */
+static void server_activate(rt_scheduler *scheduler, rt_server *server)
+{
+    rt_server *parent;
+    uint64_t now;
+
+    for (; server; server = parent) {
+        if (server->active || server->proxy->q_index != RT_NOT_QUEUED) {
+            return;
+        }
+
+        now = cur_time();
+        if (server->proxy->deadline <= now ||
+            server->remaining * server->period >= (server->proxy->deadline - now) * server->budget) {
+            server->proxy->deadline = now + server->period;
+            server->remaining = server->budget;
+        }
+
+        parent = server_parent(server);
+        enqueue_thread(parent ? parent->members : scheduler->runnable, server->proxy);
+    }
+}
+
+/* thread has become ready to run under its server */
+void rt_server_wake(rt_thread *thread)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    rt_server *server = thread->server;
+    rt_scheduler *scheduler;
+
+    if (server->cpu != my_cpu_id()) {
+        rt_migrate(thread, server->cpu);
+        return;
+    }
+
+    scheduler = sys->cpus[server->cpu]->rt_sched;
+    thread->status = ADMITTED;
+    enqueue_thread(server->members, thread);
+    server_activate(scheduler, server);
+}
+
+int rt_server_attach(rt_server *server, rt_thread *thread)
+{
+    uint8_t flags;
+
+#ifdef NAUT_CONFIG_RT_GROUPS
+    if (thread->server || (thread->type == PERIODIC && server->policy == RT_GROUP_RR)) {
+        RT_SCHED_ERROR("GROUP: periodic threads need an EDF or FP group, and may join only one\n");
+        return -1;
+    }
+#else
+    if (thread->type == PERIODIC || thread->server) {
+        RT_SCHED_ERROR("CBS: only an unattached aperiodic or sporadic thread can join a server\n");
+        return -1;
+    }
+#endif
+
+    if (thread->thread->bound_cpu != server->cpu || server->cpu != my_cpu_id()) {
+        RT_SCHED_ERROR("CBS: thread and server must be on this cpu\n");
+        return -1;
+    }
+
+    flags = irq_disable_save();
+    /* room on the member queue, so that waking it cannot fail */
+    if (queue_keep(server->members, server->num_members + 1)) {
+        irq_enable_restore(flags);
+        return -1;
+    }
+#ifdef NAUT_CONFIG_RT_GROUPS
+    if (thread->type == PERIODIC &&
+        !group_admit(server, thread->constraints->periodic.slice, thread->constraints->periodic.period)) {
+        irq_enable_restore(flags);
+        return -1;
+    }
+#endif
+    server->num_members++;
+
+    if (thread == get_cur_thread()->rt_thread) {
+        /* charged from now on, at its next scheduling pass */
+        uint64_t now = cur_time();
+        rt_thread *active = thread;
+        rt_server *s;
+
+        thread->server = server;
+        for (s = server; s; s = server_parent(s)) {
+            s->active = active;
+            s->active_mark = thread->run_time + (now - thread->start_time);
+            if (s->proxy->deadline <= now) {
+                s->proxy->deadline = now + s->period;
+                s->remaining = s->budget;
+            }
+            active = s->proxy;
+        }
+    } else if (thread->q_index != RT_NOT_QUEUED &&
+               (thread->q_type == APERIODIC_QUEUE || thread->q_type == RUNNABLE_QUEUE)) {
+        remove_thread(thread);
+        thread->server = server;
+        rt_server_wake(thread);
+    } else if (thread->q_index != RT_NOT_QUEUED && thread->q_type == PENDING_QUEUE) {
+        /* requeued so that the core stops counting it */
+        struct sys_info *sys = per_cpu_get(system);
+
+        remove_thread(thread);
+        thread->server = server;
+        enqueue_pending(sys->cpus[server->cpu]->rt_sched->pending, thread);
+    } else {
+        /* waiting or asleep, it joins the server when it wakes */
+        thread->server = server;
+    }
+
+    irq_enable_restore(flags);
+    return 0;
+}
+#endif
+
+#ifdef NAUT_CONFIG_RT_MUTEX
+/******************************************************************
+ REAL-TIME MUTEXES
+
+ A thread that finds an rt_mutex held queues on it in deadline order
+ and blocks. Its deadline is lent to the holder: the holder's core is
+ told through its boost list, and at its next scheduling pass the
+ holder is moved onto the runnable heap with that deadline, even if it
+ is aperiodic. A chain of holders that are blocked behind each other
+ is followed for a few steps. The unlock hands the mutex straight to
+ the first waiter and wakes it through its core's unblocked list. The
+ holder keeps the earliest deadline it was lent until it has released
+ every rt_mutex it holds. Then it goes back to its own deadline. So a
+ waiter is only ever blocked by the critical sections in front of it,
+ not by unrelated threads with deadlines between its own and the
+ holder's. Critical sections are expected to end within the job
+ they start in.
+ ******************************************************************/
+
+#define RT_MUTEX_CHAIN 4
+
+static inline rt_thread* mutex_owner(uint64_t owner)
+{
+    return (rt_thread *)(owner & ~RT_MUTEX_WAITERS);
+}
+
+/* what a waiter lends its holder, aperiodic threads lend nothing */
+static inline uint64_t waiter_key(rt_thread *thread)
+{
+    if (thread->type == APERIODIC && !thread->boosted) {
+        return (uint64_t)-1;
+    }
+    return thread->deadline;
+}
+
+static void boost_push(rt_mpsc *list, rt_thread *thread)
+{
+    rt_thread *head;
+
+    do {
+        head = list->head;
+        thread->boost_next = head;
+    } while (atomic_cmpswap(list->head, head, thread) != head);
+}
+
+static void mutex_boost(rt_thread *holder, uint64_t key)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    rt_mutex *next;
+    uint64_t cur;
+    int depth, cpu;
+
+    if (key == (uint64_t)-1) {
+        return;
+    }
+
+    for (depth = 0; holder && depth < RT_MUTEX_CHAIN; depth++) {
+        do {
+            cur = holder->inherited;
+            if (cur && cur <= key) {
+                return;
+            }
+        } while (atomic_cmpswap(holder->inherited, cur, key) != cur);
+
+        if (atomic_cmpswap(holder->boost_queued, 0, 1) == 0) {
+            cpu = holder->thread->bound_cpu;
+            boost_push(&sys->cpus[cpu]->rt_sched->boost, holder);
+            if (cpu != my_cpu_id() && !nk_idle_wake(cpu)) {
+                apic_ipi(per_cpu_get(apic), sys->cpus[cpu]->lapic_id, APIC_NULL_KICK_VEC);
+            }
+        }
+
+        /* the holder's own holder is read unlocked, it is only a hint */
+        next = holder->blocked_on;
+        holder = next ? mutex_owner(next->owner) : NULL;
+    }
+}
+
+static inline void boost_set(rt_thread *thread, uint64_t key)
+{
+    if (!thread->boosted) {
+        thread->base_deadline = thread->deadline;
+        thread->boosted = 1;
+    }
+    thread->deadline = key;
+}
+
+/* 0 if the holder is somewhere it cannot be boosted from yet */
+static int apply_boost(rt_scheduler *scheduler, rt_thread *thread, rt_thread *current)
+{
+    uint64_t key = thread->inherited;
+    uint64_t old;
+
+    if (!key || key >= waiter_key(thread) ||
+        thread->status == TOBE_REMOVED || thread->status == REMOVED) {
+        return 1;
+    }
+#ifdef NAUT_CONFIG_RT_CBS
+    if (thread->server) {
+        /* its server's reservation is what bounds it */
+        return 1;
+    }
+#endif
+
+    if (thread == current) {
+        boost_set(thread, key);
+        return 1;
+    }
+
+    switch (thread->q_type) {
+        case RUNNABLE_QUEUE:
+            old = thread->deadline;
+            boost_set(thread, key);
+            requeue_thread(thread, old, key);
+            return 1;
+        case APERIODIC_QUEUE:
+            if (remove_thread(thread) != thread) {
+                return 0;
+            }
+            boost_set(thread, key);
+            enqueue_runnable(scheduler->runnable, thread);
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static void drain_boosts(rt_scheduler *scheduler, rt_thread *current)
+{
+    rt_thread *thread, *head, *next;
+
+    if (!scheduler->boost.head) {
+        return;
+    }
+
+    head = (rt_thread *)xchg64((void **)&scheduler->boost.head, NULL);
+    for (thread = head; thread; thread = next) {
+        next = thread->boost_next;
+        thread->boost_next = NULL;
+        if (apply_boost(scheduler, thread, current)) {
+            thread->boost_queued = 0;
+        } else {
+            /* tried again on the next pass */
+            boost_push(&scheduler->boost, thread);
+        }
+    }
+}
+
+#endif
+
+static void drain_unblocked(rt_scheduler *scheduler)
+{
+    rt_thread *thread, *next;
+
+    if (!scheduler->unblocked.head) {
+        return;
+    }
+
+    for (thread = mpsc_take(&scheduler->unblocked); thread; thread = next) {
+        next = thread->mpsc_next;
+        thread->mpsc_next = NULL;
+#ifdef NAUT_CONFIG_RT_CBS
+        if (thread->server) {
+            rt_server_wake(thread);
+            continue;
+        }
+#endif
+        thread->status = ADMITTED;
+        if (thread->type == APERIODIC
+#ifdef NAUT_CONFIG_RT_MUTEX
+            && !thread->boosted
+#endif
+            ) {
+            enqueue_aperiodic(scheduler->aperiodic, thread);
+        } else {
+            enqueue_runnable(scheduler->runnable, thread);
+        }
+    }
+}
+
+/*
+ * Marks a thread gone for good and, if someone joined it, counts the
+ * joiner down and hands it back to its core once nothing is left.
+ */
+static void thread_removed(rt_thread *thread)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    rt_thread *joiner = (rt_thread *)xchg64((void **)&thread->joiner, NULL);
+    int cpu;
+
+    thread->status = REMOVED;
+    sched_disown(thread);
+
+    if (!joiner || atomic_dec_val(joiner->join_count) != 0) {
+        return;
+    }
+
+    cpu = joiner->thread->bound_cpu;
+    mpsc_push(&sys->cpus[cpu]->rt_sched->unblocked, joiner);
+    if (cpu != my_cpu_id() && !nk_idle_wake(cpu)) {
+        apic_ipi(per_cpu_get(apic), sys->cpus[cpu]->lapic_id, APIC_NULL_KICK_VEC);
+    }
+}
+
+/*
+ * Hands a thread that blocked itself (BLOCKED, with blocking set) back
+ * to its core, from thread or interrupt context on any core.
+ */
+void rt_thread_unblock(rt_thread *thread)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    int cpu = thread->thread->bound_cpu;
+
+    mpsc_push(&sys->cpus[cpu]->rt_sched->unblocked, thread);
+    if (cpu != my_cpu_id() && !nk_idle_wake(cpu)) {
+        apic_ipi(per_cpu_get(apic), sys->cpus[cpu]->lapic_id, APIC_NULL_KICK_VEC);
+    }
+}
+
+/*
+ * Makes the current thread a joiner of thread. The caller sets its
+ * join_count to the number of threads it joins plus one, the one
+ * being its own, dropped in rt_thread_join_wait(). A thread that is
+ * already gone is counted off here. Returns 0 if we are waiting on it.
+ */
+int rt_thread_join_on(rt_thread *thread)
+{
+    rt_thread *me = get_cur_thread()->rt_thread;
+
+    thread->joiner = me;
+    mbarrier();
+    if (thread->status == REMOVED &&
+        (rt_thread *)xchg64((void **)&thread->joiner, NULL) == me) {
+        atomic_dec(me->join_count);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Blocks until every thread we joined has been removed. Whoever
+ * takes the count to zero wakes us, so if that is us, nobody will.
+ */
+void rt_thread_join_wait(void)
+{
+    rt_thread *me = get_cur_thread()->rt_thread;
+    uint8_t flags = irq_disable_save();
+
+    if (atomic_dec_val(me->join_count) != 0) {
+        do {
+            me->status = BLOCKED;
+            me->blocking = 1;
+            nk_schedule();
+        } while (me->join_count);
+    }
+    irq_enable_restore(flags);
+}
+
+#ifdef NAUT_CONFIG_RT_MUTEX
+
+/* waiters are kept earliest deadline first, FIFO among equals */
+static void waiter_insert(rt_mutex *mutex, rt_thread *thread)
+{
+    uint64_t key = waiter_key(thread);
+    rt_thread **pos = &mutex->waiters;
+
+    while (*pos && waiter_key(*pos) <= key) {
+        pos = &(*pos)->mutex_next;
+    }
+    thread->mutex_next = *pos;
+    *pos = thread;
+}
+
+void rt_mutex_init(rt_mutex *mutex)
+{
+    spinlock_init(&mutex->lock);
+    mutex->owner = 0;
+    mutex->waiters = NULL;
+}
+
+int rt_mutex_trylock(rt_mutex *mutex)
+{
+    rt_thread *me = get_cur_thread()->rt_thread;
+
+    if (atomic_cmpswap(mutex->owner, 0, (uint64_t)me) != 0) {
+        return -1;
+    }
+    me->mutex_held++;
+    return 0;
+}
+
+void rt_mutex_lock(rt_mutex *mutex)
+{
+    rt_thread *me = get_cur_thread()->rt_thread;
+    uint64_t owner;
+    uint8_t flags;
+
+    if (rt_mutex_trylock(mutex) == 0) {
+        return;
+    }
+
+    flags = spin_lock_irq_save(&mutex->lock);
+    for (;;) {
+        owner = mutex->owner;
+        if (mutex_owner(owner) == me) {
+            /* handed to us by the unlock */
+            break;
+        }
+        if (owner == 0) {
+            if (atomic_cmpswap(mutex->owner, 0, (uint64_t)me) == 0) {
+                me->mutex_held++;
+                break;
+            }
+            continue;
+        }
+        if (!(owner & RT_MUTEX_WAITERS) &&
+            atomic_cmpswap(mutex->owner, owner, owner | RT_MUTEX_WAITERS) != owner) {
+            /* released or contended meanwhile, look again */
+            continue;
+        }
+
+        if (me->blocked_on != mutex) {
+            waiter_insert(mutex, me);
+            me->blocked_on = mutex;
+        }
+        mutex_boost(mutex_owner(owner), waiter_key(me));
+
+        me->status = BLOCKED;
+        me->blocking = 1;
+        spin_unlock(&mutex->lock);
+        nk_schedule();
+        spin_lock(&mutex->lock);
+    }
+    spin_unlock_irq_restore(&mutex->lock, flags);
+}
+
+void rt_mutex_unlock(rt_mutex *mutex)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    rt_thread *me = get_cur_thread()->rt_thread;
+    rt_thread *next;
+    uint8_t flags;
+    int cpu = -1;
+
+    flags = spin_lock_irq_save(&mutex->lock);
+    if (mutex_owner(mutex->owner) != me) {
+        RT_SCHED_ERROR("rt_mutex %p unlocked by thread %p, not its holder\n", mutex, me->thread);
+        spin_unlock_irq_restore(&mutex->lock, flags);
+        return;
+    }
+
+    next = mutex->waiters;
+    if (next) {
+        mutex->waiters = next->mutex_next;
+        next->mutex_next = NULL;
+        next->blocked_on = NULL;
+        next->mutex_held++;
+        mutex->owner = (uint64_t)next | (mutex->waiters ? RT_MUTEX_WAITERS : 0);
+        if (mutex->waiters) {
+            mutex_boost(next, waiter_key(mutex->waiters));
+        }
+    } else {
+        mutex->owner = 0;
+    }
+
+    if (--me->mutex_held == 0) {
+        me->inherited = 0;
+        if (me->boosted) {
+            me->deadline = me->base_deadline;
+            me->boosted = 0;
+        }
+    }
+
+    if (next) {
+        cpu = next->thread->bound_cpu;
+        mpsc_push(&sys->cpus[cpu]->rt_sched->unblocked, next);
+        if (cpu != my_cpu_id() && !nk_idle_wake(cpu)) {
+            apic_ipi(per_cpu_get(apic), sys->cpus[cpu]->lapic_id, APIC_NULL_KICK_VEC);
+        }
+    }
+    spin_unlock(&mutex->lock);
+
+    if (cpu == my_cpu_id()) {
+        /* the new holder may now be more urgent than we are */
+        nk_schedule();
+    }
+    irq_enable_restore(flags);
+}
+#endif
+
+#ifdef NAUT_CONFIG_RT_RECLAIM
+/******************************************************************
+ SLACK RECLAMATION
+
+ When a periodic job blocks, sleeps or finishes before its budget is
+ used, the rest of its budget is handed to the aperiodic queue. EDF
+ had set that time aside before the job's deadline, so it can be
+ spent by anyone, as if it were a job with that deadline. It runs
+ ahead of runnable jobs with later deadlines.
+
+ There is one slack bucket per core. A donation with a different
+ deadline replaces the bucket only if it is larger. Whoever runs on
+ slack gets a single timer for all of it, and is charged for what it
+ actually ran at its next scheduling pass.
+ ******************************************************************/
+
+static inline int slack_usable(rt_scheduler *scheduler, uint64_t now)
+{
+    return scheduler->slack > 0 && scheduler->slack_deadline > now;
+}
+
+static void donate_slack(rt_scheduler *scheduler, uint64_t amount, uint64_t deadline)
+{
+    if (!slack_usable(scheduler, cur_time()) || deadline == scheduler->slack_deadline) {
+        if (deadline != scheduler->slack_deadline) {
+            scheduler->slack = 0;
+        }
+        scheduler->slack += amount;
+        scheduler->slack_deadline = deadline;
+    } else if (amount > scheduler->slack) {
+        scheduler->slack = amount;
+        scheduler->slack_deadline = deadline;
+    }
+}
+
+static void reclaim_slack(rt_scheduler *scheduler, rt_thread *thread)
+{
+    uint64_t budget;
+
+    if (scheduler->slack_thread == thread) {
+        uint64_t used = thread->run_time - scheduler->slack_mark;
+        scheduler->slack = (used >= scheduler->slack) ? 0 : scheduler->slack - used;
+        scheduler->slack_thread = NULL;
+    }
+
+    if (thread->type != PERIODIC) {
+        return;
+    }
+
+    if (thread->status != SLEEPING && thread->status != WAITING && !thread->job_done) {
+        return;
+    }
+
+    budget = periodic_budget(thread);
+    if (thread->run_time < budget && thread->deadline > cur_time()) {
+        donate_slack(scheduler, budget - thread->run_time, thread->deadline);
+    }
+}
+#endif
+
+/*
+ * Next thread off the runnable heap. A server proxy stands for the
+ * next ready member of its server.
+ */
+static rt_thread* pick_runnable(rt_scheduler *scheduler)
+{
+    rt_thread *thread;
+
+    if (scheduler->runnable->size == 0) {
+        return NULL;
+    }
+
+#ifdef NAUT_CONFIG_RT_RECLAIM
+    if (scheduler->aperiodic->size > 0 && slack_usable(scheduler, cur_time()) &&
+        scheduler->slack_deadline <= scheduler->runnable->threads[0]->deadline) {
+        /* reclaimed budget goes first, the aperiodic queue gets it */
+        return NULL;
+    }
+#endif
+
+    thread = dequeue_runnable(scheduler->runnable);
+#ifdef NAUT_CONFIG_RT_CBS
+    if (thread && is_server_proxy(thread)) {
+        return server_dispatch(scheduler, thread->server);
+    }
+#endif
+    return thread;
+}
+
+/*
+ * Called by a periodic thread whose current job is finished. It gives
+ * up the rest of its slice and runs again at its next release.
+ */
+int rt_thread_job_done(void)
+{
+    uint8_t flags = irq_disable_save();
+    rt_thread *t = get_cur_thread()->rt_thread;
+
+    if (t->type != PERIODIC) {
+        irq_enable_restore(flags);
+        return -1;
+    }
+
+    t->job_done = 1;
+    nk_schedule();
+    irq_enable_restore(flags);
+    return 0;
+}
+
+/* the work and deadline of a sporadic thread's next job count from now */
+static inline void sporadic_renew(rt_thread *t)
+{
+    t->run_time = 0;
+    t->deadline = cur_time() + t->rel_deadline;
+}
+
+/*
+ * A sporadic thread that has used up its work waits for its next
+ * release, or runs again at once if that came while it ran.
+ */
+static void sporadic_job_end(rt_scheduler *scheduler, rt_thread *t)
+{
+    if (atomic_cmpswap(t->sporadic_state, RT_SPORADIC_ACTIVE, RT_SPORADIC_PARKED) == RT_SPORADIC_ACTIVE) {
+        t->status = SLEEPING;
+        return;
+    }
+    /* only its own core moves it out of PENDING */
+    t->sporadic_state = RT_SPORADIC_ACTIVE;
+    sporadic_renew(t);
+    enqueue_runnable(scheduler->runnable, t);
+}
+
+/*
+ * Ends the calling thread's current job. A periodic thread gives up
+ * the rest of its slice as with rt_thread_job_done(). A sporadic
+ * thread is parked off every queue until rt_sporadic_release(), or
+ * starts its next job at once if it was released while this one ran.
+ */
+int rt_wait_next_period(void)
+{
+    rt_thread *t = get_cur_thread()->rt_thread;
+    uint8_t flags;
+
+    if (t->type == PERIODIC) {
+        return rt_thread_job_done();
+    }
+    if (t->type != SPORADIC) {
+        return -1;
+    }
+
+    flags = irq_disable_save();
+    while (atomic_cmpswap(t->sporadic_state, RT_SPORADIC_ACTIVE, RT_SPORADIC_PARKED) != RT_SPORADIC_ACTIVE) {
+        if (atomic_cmpswap(t->sporadic_state, RT_SPORADIC_PENDING, RT_SPORADIC_ACTIVE) == RT_SPORADIC_PENDING) {
+            sporadic_renew(t);
+            irq_enable_restore(flags);
+            return 0;
+        }
+    }
+
+    t->status = SLEEPING;
+    t->blocking = 1;
+    nk_schedule();
+    irq_enable_restore(flags);
+    return 0;
+}
+
+/*
+ * Releases the next job of a sporadic thread, from thread or interrupt
+ * context on any core. A parked thread gets a fresh deadline and is
+ * handed to its core through the unblocked list; one still in its job
+ * starts the next when it calls rt_wait_next_period(). A release that
+ * finds one already pending is merged into it. Releases are not
+ * admitted again, so the caller keeps to the inter-arrival time the
+ * thread was admitted with.
+ */
+int rt_sporadic_release(struct nk_thread *thread)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    rt_thread *t = thread ? thread->rt_thread : NULL;
+    uint64_t state;
+    int cpu;
+
+    if (!t || t->type != SPORADIC) {
+        return -1;
+    }
+
+    for (;;) {
+        state = t->sporadic_state;
+        if (state == RT_SPORADIC_PENDING) {
+            return 0;
+        }
+        if (atomic_cmpswap(t->sporadic_state, state,
+                           state == RT_SPORADIC_ACTIVE ? RT_SPORADIC_PENDING : RT_SPORADIC_ACTIVE) == state) {
+            break;
+        }
+    }
+    if (state == RT_SPORADIC_ACTIVE) {
+        return 0;
+    }
+
+    sporadic_renew(t);
+    cpu = t->thread->bound_cpu;
+    mpsc_push(&sys->cpus[cpu]->rt_sched->unblocked, t);
+    if (cpu != my_cpu_id() && !nk_idle_wake(cpu)) {
+        apic_ipi(per_cpu_get(apic), sys->cpus[cpu]->lapic_id, APIC_NULL_KICK_VEC);
+    }
+    return 0;
+}
+
+static struct nk_thread *__rt_need_resched(void);
+
+#ifdef NAUT_CONFIG_RT_BENCH
+/* the whole pass as the caller sees it, padding included */
+static inline void pass_account(uint64_t start)
+{
+    rt_scheduler *scheduler = per_cpu_get(rt_sched);
+    uint64_t cost = cur_time() - start;
+
+    scheduler->passes++;
+    scheduler->pass_cycles += cost;
+    if (cost > scheduler->pass_max) {
+        scheduler->pass_max = cost;
+    }
+}
+#endif
+
+#ifdef NAUT_CONFIG_RT_OVERHEAD_HIST
+/* passes seen before the histograms are trusted over the worst case */
+#define RT_OH_MIN_SAMPLES 1000
+
+static inline int oh_bucket(uint64_t v)
+{
+    int msb, shift;
+
+    if (v < (1ULL << RT_OH_SUB_BITS)) {
+        return (int)v;
+    }
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - RT_OH_SUB_BITS;
+    return ((shift + 1) << RT_OH_SUB_BITS) + (int)((v >> shift) & ((1 << RT_OH_SUB_BITS) - 1));
+}
+
+/* the largest value bucket b counts */
+static inline uint64_t oh_bucket_top(int b)
+{
+    int shift = (b >> RT_OH_SUB_BITS) - 1;
+    uint64_t sub = b & ((1 << RT_OH_SUB_BITS) - 1);
+
+    if (shift <= 0) {
+        return (uint64_t)b;
+    }
+    return (((1ULL << RT_OH_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+static inline void oh_add(rt_overhead_hist *h, uint64_t v)
+{
+    h->count[oh_bucket(v)]++;
+    h->total++;
+}
+
+/* pct in hundredths of a percent, 10000 for the largest value seen */
+uint64_t rt_overhead_percentile(rt_overhead_hist *h, uint32_t pct)
+{
+    uint64_t want, seen = 0;
+    int i;
+
+    if (!h->total) {
+        return 0;
+    }
+    want = (h->total * pct + 9999) / 10000;
+    if (!want) {
+        want = 1;
+    }
+    for (i = 0; i < RT_OH_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen >= want) {
+            return oh_bucket_top(i);
+        }
+    }
+    return oh_bucket_top(RT_OH_BUCKETS - 1);
+}
+
+/* called by nk_need_resched() once the pass (and any padding) is done */
+void rt_overhead_decided(uint64_t cycles, int switching)
+{
+    rt_scheduler *scheduler = per_cpu_get(rt_sched);
+
+    oh_add(&scheduler->decision, cycles);
+    scheduler->switch_mark = switching ? rdtsc() : 0;
+}
+
+/* called from nk_thread_switch() on the incoming thread's stack */
+void rt_overhead_switched(void)
+{
+    rt_scheduler *scheduler = per_cpu_get(rt_sched);
+
+    if (scheduler && scheduler->switch_mark) {
+        oh_add(&scheduler->cswitch, rdtsc() - scheduler->switch_mark);
+        scheduler->switch_mark = 0;
+    }
+}
+
+void rt_overhead_dump(int cpu)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    rt_scheduler *scheduler = sys->cpus[cpu]->rt_sched;
+    uint32_t pct = NAUT_CONFIG_RT_OVERHEAD_PERCENTILE;
+
+    printk("CPU %d: %llu passes, p50 %llu p99 %llu p(%u) %llu max %llu cycles\n",
+           cpu, scheduler->decision.total,
+           rt_overhead_percentile(&scheduler->decision, 5000),
+           rt_overhead_percentile(&scheduler->decision, 9900), pct,
+           rt_overhead_percentile(&scheduler->decision, pct),
+           rt_overhead_percentile(&scheduler->decision, 10000));
+    printk("CPU %d: %llu switches, p50 %llu p99 %llu p(%u) %llu max %llu cycles\n",
+           cpu, scheduler->cswitch.total,
+           rt_overhead_percentile(&scheduler->cswitch, 5000),
+           rt_overhead_percentile(&scheduler->cswitch, 9900), pct,
+           rt_overhead_percentile(&scheduler->cswitch, pct),
+           rt_overhead_percentile(&scheduler->cswitch, 10000));
+}
+#endif
+
+/*
+ * What one scheduling pass and the switch after it cost on this core,
+ * as admission charges it. Without the histograms, or before they hold
+ * enough passes, that is the worst pass seen so far.
+ */
+static inline uint64_t sched_overhead(rt_scheduler *scheduler)
+{
+#ifdef NAUT_CONFIG_RT_OVERHEAD_HIST
+    if (scheduler->decision.total >= RT_OH_MIN_SAMPLES) {
+        return rt_overhead_percentile(&scheduler->decision, NAUT_CONFIG_RT_OVERHEAD_PERCENTILE) +
+               rt_overhead_percentile(&scheduler->cswitch, NAUT_CONFIG_RT_OVERHEAD_PERCENTILE);
+    }
+#endif
+    return MAX(scheduler->run_time, RT_MIN_OVERHEAD);
+}
+
+/*
+ * Under global EDF the whole decision is made with the shared heap
+ * locked, after which this core publishes what it is now running and
+ * kicks a core running a later deadline if one is left waiting.
+ */
+struct nk_thread *rt_need_resched()
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+{
+    struct nk_thread *n;
+    int victim;
+
+#ifdef NAUT_CONFIG_RT_BENCH
+    uint64_t start = cur_time();
+#endif
+
+    spin_lock(&global_edf->lock);
+    n = __rt_need_resched();
+    if (n->rt_thread->type != APERIODIC) {
+        /* it may have migrated here from another core */
+        n->bound_cpu = my_cpu_id();
+    }
+    global_edf->running[my_cpu_id()] = running_deadline(n->rt_thread);
+    victim = rt_global_pick_victim();
+    spin_unlock(&global_edf->lock);
+
+    rt_global_kick(victim);
+#ifdef NAUT_CONFIG_RT_BENCH
+    pass_account(start);
+#endif
+    return n;
+}
+#else
+{
+#ifdef NAUT_CONFIG_RT_BENCH
+    uint64_t start = cur_time();
+    struct nk_thread *n = __rt_need_resched();
+
+    pass_account(start);
+    return n;
+#else
+    return __rt_need_resched();
+#endif
+}
+#endif
+
+static struct nk_thread *__rt_need_resched(void)
+{
+    rt_scheduler *scheduler = per_cpu_get(rt_sched);
+    
+    struct nk_thread *c = get_cur_thread();
+    rt_thread *rt_c = c->rt_thread;
+    
+#ifdef NAUT_CONFIG_RT_IDLE_CSTATES
+    idle_sample(scheduler);
+#endif
+#ifdef NAUT_CONFIG_RT_LAZY_RESCHED
+    if (lazy_resched_ok(scheduler, rt_c)) {
+        return c;
+    }
+#endif
+    
+#ifdef NAUT_CONFIG_RT_CHARGE_OVERHEAD
+    /* overhead is billed to the next thread, not padded out */
+    uint64_t end_time = cur_time();
+#else
+    uint64_t end_time = scheduler->run_time + cur_time();
+#endif
+    uint64_t slack = 0;
+    scheduler->tsc->end_time = cur_time();
+    
+    rt_thread *rt_n = NULL;
+    
+    drain_migrations(scheduler);
+    drain_submissions(scheduler);
+    drain_unblocked(scheduler);
+#ifdef NAUT_CONFIG_RT_MUTEX
+    drain_boosts(scheduler, rt_c);
+#endif
+    release_pending(scheduler, end_time);
+
+#ifdef NAUT_CONFIG_RT_RECLAIM
+    reclaim_slack(scheduler, rt_c);
+#endif
+#ifdef NAUT_CONFIG_RT_APERIODIC_MLFQ
+    if (rt_c->type == APERIODIC) {
+        /* before it can be queued again, blocked or not */
+        rt_mlfq_charge(scheduler->aperiodic->mlfq, rt_c);
+    }
+#endif
+    if (rt_c->job_done) {
+        /* finished early, wait for the next release like any other job */
+        rt_c->job_done = 0;
+        if (rt_c->type == PERIODIC) {
+            rt_c->run_time = MAX(rt_c->run_time, periodic_budget(rt_c));
+        }
+    }
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+    else if (mc_overrun(scheduler, rt_c)) {
+        crit_switch(scheduler, rt_c);
+    }
+    if (scheduler->crit_mode == RT_CRIT_HI && mc_idle(scheduler, rt_c)) {
+        crit_restore(scheduler);
+    }
+#endif
+
+#ifdef NAUT_CONFIG_RT_CBS
+    if (rt_c->server) {
+        rt_n = server_resched(scheduler, rt_c);
+        set_timer(scheduler, rt_n, end_time, slack);
+        return rt_n->thread;
+    }
+#endif
+
+    if (rt_c->blocking) {
+        /* rt_c is waiting on an rt_mutex or a join, it is handed back */
+        rt_c->blocking = 0;
+        if (scheduler->runnable->size > 0) {
+            rt_n = pick_runnable(scheduler);
+        }
+        if (rt_n == NULL) {
+            rt_n = dequeue_aperiodic(scheduler->aperiodic);
+        }
+        if (rt_n == NULL) {
+            RT_SCHED_ERROR("APERIODIC QUEUE IS EMPTY.\n THE WORLD IS GOVERNED BY MADNESS.\n");
+            panic("ATTEMPTING TO RUN A NULL RT_THREAD.\n");
+        }
+        set_timer(scheduler, rt_n, end_time, slack);
+        return rt_n->thread;
+    }
+
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+    if (rt_c->status == SLEEPING) {
+        /* rt_c went to sleep on the wheel, do not requeue it */
+        if (scheduler->runnable->size > 0) {
+            rt_n = pick_runnable(scheduler);
+        }
+        if (rt_n == NULL) {
+            rt_n = dequeue_aperiodic(scheduler->aperiodic);
+        }
+        if (rt_n == NULL) {
+            RT_SCHED_ERROR("APERIODIC QUEUE IS EMPTY.\n THE WORLD IS GOVERNED BY MADNESS.\n");
+            panic("ATTEMPTING TO RUN A NULL RT_THREAD.\n");
+        }
+        set_timer(scheduler, rt_n, end_time, slack);
+        return rt_n->thread;
+    }
+#endif
+    
+    switch (rt_c->type) {
+        case APERIODIC:
+#ifndef NAUT_CONFIG_RT_APERIODIC_MLFQ
+            rt_c->constraints->aperiodic.priority = rt_c->run_time;
+#endif
+            if (rt_c->migrate_cpu >= 0 && rt_c->migrate_cpu != my_cpu_id()) {
+                /* rebound by rt_thread_migrate() */
+                rt_migrate(rt_c, rt_c->migrate_cpu);
+            } else {
+                rt_c->migrate_cpu = -1;
+#ifdef NAUT_CONFIG_RT_MUTEX
+                if (rt_c->boosted) {
+                    /* holds an rt_mutex a deadline thread is waiting for */
+                    enqueue_runnable(scheduler->runnable, rt_c);
+                } else
+#endif
+                enqueue_aperiodic(scheduler->aperiodic, rt_c);
+            }
+
+            if (scheduler->runnable->size > 0)
+            {
+                rt_n = pick_runnable(scheduler);
+                if (rt_n != NULL) {
+                    set_timer(scheduler, rt_n, end_time, slack);
+                    return rt_n->thread;
+                }
+            }
+
+            rt_n = dequeue_aperiodic(scheduler->aperiodic);
+            if (rt_n == NULL) {
+                    RT_SCHED_ERROR("APERIODIC QUEUE IS EMPTY.\n THE WORLD IS GOVERNED BY MADNESS.\n");
+                    panic("ATTEMPTING TO RUN A NULL RT_THREAD.\n");
+            }
+            set_timer(scheduler, rt_n, end_time, slack);
+            return rt_n->thread;
+            break;
+            
+        case SPORADIC:
+            if (rt_c->run_time >= rt_c->constraints->sporadic.work) {
+                if (check_deadlines(rt_c)) {
+                    miss_action(rt_c);
+                }
+                sporadic_job_end(scheduler, rt_c);
+
+                if (scheduler->runnable->size > 0) {
+                    rt_n = pick_runnable(scheduler);
+                    if (rt_n != NULL) {
+                        set_timer(scheduler, rt_n, end_time, slack);
+                        return rt_n->thread;
+                    }
+                }
+                rt_n = dequeue_aperiodic(scheduler->aperiodic);
+                if (rt_n == NULL) {
+                    RT_SCHED_ERROR("APERIODIC QUEUE IS EMPTY.\n THE WORLD IS GOVERNED BY MADNESS.\n");
+                    panic("ATTEMPTING TO RUN A NULL RT_THREAD.\n");
+                }
+                set_timer(scheduler, rt_n, end_time, slack);
+                return rt_n->thread;
+            } else {
+                if (scheduler->runnable->size > 0)
+                {
+                    if (rt_c->deadline > scheduler->runnable->threads[0]->deadline) {
+                        rt_n = pick_runnable(scheduler);
+                        if (rt_n != NULL) {
+                            enqueue_runnable(scheduler->runnable, rt_c);
+                            set_timer(scheduler, rt_n, end_time, slack);
+                            return rt_n->thread;
+                        }
+                    }
+                }
+            }
+            set_timer(scheduler, rt_c, end_time, slack);
+            return rt_c->thread;
+            break;
+            
+        case PERIODIC:
+            if (rt_c->run_time >= periodic_budget(rt_c)) {
+                if (!job_handoff(scheduler, rt_c)) {
+                    if (check_deadlines(rt_c)) {
+                        handle_miss(scheduler, rt_c);
+                    } else {
+                        /* pending is keyed on the next release */
+                        rt_c->deadline = job_deadline(rt_c);
+                        enqueue_pending(scheduler->pending, rt_c);
+                    }
+                }
+
+                if (scheduler->runnable->size > 0) {
+                    rt_n = pick_runnable(scheduler);
+                    if (rt_n != NULL) {
+                        set_timer(scheduler, rt_n, end_time, slack);
+                        return rt_n->thread;
+                    }
+                }
+                rt_n = dequeue_aperiodic(scheduler->aperiodic);
+                if (rt_n == NULL) {
+                    RT_SCHED_ERROR("APERIODIC QUEUE IS EMPTY.\n THE WORLD IS GOVERNED BY MADNESS.\n");
+                    panic("ATTEMPTING TO RUN A NULL RT_THREAD.\n");
+                }
+                set_timer(scheduler, rt_n, end_time, slack);
+                return rt_n->thread;
+            } else {
+                if (scheduler->runnable->size > 0)
+                {
+                    if (rt_c->deadline > scheduler->runnable->threads[0]->deadline) {
+                        rt_n = pick_runnable(scheduler);
+                        if (rt_n != NULL) {
+                            enqueue_runnable(scheduler->runnable, rt_c);
+                            set_timer(scheduler, rt_n, end_time, slack);
+                            return rt_n->thread;
+                        }
+                    }
+                }
+            }
+            set_timer(scheduler, rt_c, end_time, slack);
+            return rt_c->thread;
+            break;
+        default:
+            set_timer(scheduler, rt_c, end_time, slack);
+            return c;
+    }
+}
+
+
+
+/* counts a miss in the thread's stats, nothing is printed here */
+static int check_deadlines(rt_thread *t)
+{
+    uint64_t deadline = job_deadline(t);
+
+#ifdef NAUT_CONFIG_RT_HISTOGRAMS
+    rt_hist_add(&t->stats.response, t->exit_time > t->release ? t->exit_time - t->release : 0);
+    rt_hist_add(&t->stats.lateness, t->exit_time > deadline ? t->exit_time - deadline : 0);
+    rt_hist_add(&t->stats.preempts, t->job_preempts);
+    t->job_started = 0;
+#endif
+
+    if (t->exit_time > deadline) {
+        uint64_t lateness = t->exit_time - deadline;
+
+        t->stats.misses++;
+        if (lateness > t->stats.lateness_max) {
+            t->stats.lateness_max = lateness;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/* what the thread's miss policy says to do about the job just checked */
+static rt_miss_policy miss_action(rt_thread *t)
+{
+    uint64_t lateness = t->exit_time - job_deadline(t);
+    rt_miss_policy policy = t->miss.policy;
+
+    if (policy == RT_MISS_CALLBACK) {
+        policy = t->miss.fn(t, lateness, t->miss.state);
+    }
+
+    if (policy == RT_MISS_OVERRUN) {
+        if (lateness <= t->miss.overrun) {
+            t->stats.overruns++;
+            policy = RT_MISS_NONE;
+        } else {
+            policy = RT_MISS_SKIP;
+        }
+    }
+    return policy;
+}
+
+/*
+ * A periodic job completed late. Its next release (the old deadline)
+ * has already passed, so by default that job is made runnable at once.
+ */
+static void handle_miss(rt_scheduler *scheduler, rt_thread *t)
+{
+    uint64_t period = t->constraints->periodic.period;
+
+    switch (miss_action(t)) {
+        case RT_MISS_SKIP:
+            /* wait for the release after the one we missed */
+            t->release += period;
+            t->deadline = t->release + period;
+            t->stats.skipped++;
+            enqueue_pending(scheduler->pending, t);
+            break;
+
+        case RT_MISS_DEMOTE:
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+            /* rt_need_resched() holds the global lock */
+            if (global_edf->util >= t->g_util) {
+                global_edf->util -= t->g_util;
+            }
+            t->g_util = 0;
+#endif
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+            mc_reserve(scheduler, t, 0);
+#endif
+            t->type = APERIODIC;
+            t->run_time = 0;
+            t->constraints->aperiodic.priority = 0;
+#ifdef NAUT_CONFIG_RT_APERIODIC_MLFQ
+            rt_mlfq_reset(t);
+#endif
+            t->stats.demotions++;
+            demand_changed(scheduler);
+            enqueue_aperiodic(scheduler->aperiodic, t);
+            break;
+
+        default:
+            update_periodic(t);
+            enqueue_runnable(scheduler->runnable, t);
+            break;
+    }
+}
+
+/*
+ * Start the next job of a periodic thread. Releases are taken from the
+ * thread's own timeline, one period after the previous release, and not
+ * from the time we got around to it, so scheduling latency shows up as
+ * jitter and not as drift. A job that lost more than a whole period
+ * drops the releases it missed and keeps its phase.
+ */
+static inline void update_periodic(rt_thread *t)
+{
+    if (t->type == PERIODIC)
+    {
+        uint64_t period = t->constraints->periodic.period;
+        uint64_t now = cur_time();
+        uint64_t late;
+
+        t->release += period;
+        if (now >= t->release + period) {
+            late = (now - t->release) / period;
+            t->release += late * period;
+            t->stats.skipped += late;
+        }
+
+        late = now > t->release ? now - t->release : 0;
+        t->stats.releases++;
+        t->stats.jitter_sum += late;
+        if (late > t->stats.jitter_max) {
+            t->stats.jitter_max = late;
+        }
+
+        t->deadline = t->release + period;
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+        {
+            rt_scheduler *scheduler = per_cpu_get(rt_sched);
+
+            if (scheduler->crit_mode == RT_CRIT_LO &&
+                t->constraints->periodic.criticality == RT_CRIT_HI) {
+                /* EDF-VD: HI jobs run early in LO mode */
+                t->deadline = t->release + (period * scheduler->vd_scale) / 100000;
+            }
+        }
+#endif
+        t->run_time = 0;
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+        if (t->split_cpu >= 0) {
+            /* C=D: the first portion must finish within its own budget */
+            t->split_phase = 0;
+            t->deadline = t->release + t->split_slice;
+        }
+#endif
+    }
+}
+
+/*
+ * Execution budget for the current job (or portion of it) of a
+ * periodic thread. A split job's first portion only gets split_slice
+ * on its home core before moving to its second core.
+ */
+static inline uint64_t periodic_budget(rt_thread *thread)
+{
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+    if (thread->split_cpu >= 0 && thread->split_phase == 0) {
+        return thread->split_slice;
+    }
+#endif
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+    if (thread->constraints->periodic.criticality == RT_CRIT_HI) {
+
+        if (per_cpu_get(rt_sched)->crit_mode == RT_CRIT_HI) {
+            return MAX(thread->constraints->periodic.slice, thread->constraints->periodic.slice_hi);
+        }
+    }
+#endif
+    return thread->constraints->periodic.slice;
+}
+
+/*
+ * The deadline a job is held to. It is the deadline the thread is
+ * queued by, except for a HI thread's virtual deadline in LO mode.
+ */
+static inline uint64_t job_deadline(rt_thread *thread)
+{
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+    if (thread->type == PERIODIC && thread->constraints->periodic.criticality == RT_CRIT_HI) {
+        return thread->release + thread->constraints->periodic.period;
+    }
+#endif
+    return thread->deadline;
+}
+
+/*
+ * Moving threads between cores. A thread only changes core at the end
+ * of a job: the core it leaves puts it on the target's inbox and kicks
+ * it, and the target files it into its own queues the next time it
+ * schedules. Threads move because job splitting sends the second
+ * portion of a job elsewhere, or because nk_rt_place() rebalanced
+ * them (migrate_cpu). The inbox is linked through the threads, so a
+ * move never allocates; the target takes the thread out only once it
+ * owns it, and until then it waits there.
+ */
+static int rt_migrate(rt_thread *thread, int cpu)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    rt_scheduler *target = sys->cpus[cpu]->rt_sched;
+
+    thread->status = ARRIVED;
+    thread->q_type = ARRIVAL_QUEUE;
+    mpsc_push(&target->inbox, thread);
+
+    if (cpu != my_cpu_id() && !nk_idle_wake(cpu)) {
+        apic_ipi(per_cpu_get(apic), sys->cpus[cpu]->lapic_id, APIC_NULL_KICK_VEC);
+    }
+    return 0;
+}
+
+/* returns 1 if the job thread just completed has left this core */
+static int job_handoff(rt_scheduler *scheduler, rt_thread *thread)
+{
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+    if (thread->split_cpu >= 0) {
+        check_deadlines(thread);
+
+        if (thread->split_phase == 0) {
+            thread->split_phase = 1;
+            thread->deadline = thread->release + thread->constraints->periodic.period;
+            rt_migrate(thread, thread->split_cpu);
+        } else {
+            thread->split_phase = 0;
+            rt_migrate(thread, thread->split_home);
+        }
+        demand_changed(scheduler);
+        return 1;
+    }
+#endif
+    if (thread->migrate_cpu >= 0 && thread->migrate_cpu != my_cpu_id()) {
+        check_deadlines(thread);
+        atomic_sub(scheduler->migrating_out, thread_util(thread));
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+        mc_reserve(scheduler, thread, 0);
+        thread->deadline = job_deadline(thread);
+#endif
+        rt_migrate(thread, thread->migrate_cpu);
+        demand_changed(scheduler);
+        return 1;
+    }
+    return 0;
+}
+
+static void drain_migrations(rt_scheduler *scheduler)
+{
+    rt_thread *thread, *next;
+
+    if (!scheduler->inbox.head) {
+        return;
+    }
+
+    for (thread = mpsc_take(&scheduler->inbox); thread; thread = next) {
+        next = thread->mpsc_next;
+        if (sched_own(scheduler, thread)) {
+            /* no room for them here yet, they wait for the next pass */
+            for (; thread; thread = next) {
+                next = thread->mpsc_next;
+                mpsc_push(&scheduler->inbox, thread);
+            }
+            break;
+        }
+        thread->mpsc_next = NULL;
+#ifdef NAUT_CONFIG_TSC_SYNC
+        /* its times were taken on the core it came from */
+        sint64_t skew = nk_tsc_skew(my_cpu_id()) - nk_tsc_skew(thread->thread->bound_cpu);
+        thread->release  += skew;
+        thread->deadline += skew;
+#endif
+        thread->status = ADMITTED;
+        thread->thread->bound_cpu = my_cpu_id();
+
+        if (thread->migrate_cpu == my_cpu_id()) {
+            /* now counted by this core's queues */
+            atomic_sub(scheduler->migrating_in, thread_util(thread));
+            thread->migrate_cpu = -1;
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+            mc_reserve(scheduler, thread, 1);
+#endif
+        }
+
+#ifdef NAUT_CONFIG_RT_CBS
+        if (thread->server) {
+            /* a member woken on another core */
+            rt_server_wake(thread);
+            continue;
+        }
+#endif
+
+        if (thread->type == APERIODIC) {
+            enqueue_aperiodic(scheduler->aperiodic, thread);
+            continue;
+        }
+
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+        if (thread->split_cpu >= 0 && thread->split_phase == 1) {
+            enqueue_runnable(scheduler->runnable, thread);
+            continue;
+        }
+#endif
+        if (thread->deadline <= cur_time()) {
+            /* already past its next release */
+            update_periodic(thread);
+            enqueue_runnable(scheduler->runnable, thread);
+        } else {
+            enqueue_pending(scheduler->pending, thread);
+        }
+    }
+    demand_changed(scheduler);
+}
+
+/*
+ * Handing threads to a core. Thread creation, fork and wakeups may run
+ * on any core, so rather than touching the target's queues they push
+ * onto its arrival list (threads that need admission) or its waiting
+ * list (aperiodic threads), and the target files them the next time it
+ * schedules.
+ */
+static void mpsc_push(rt_mpsc *list, rt_thread *thread)
+{
+    rt_thread *head;
+
+    do {
+        head = list->head;
+        thread->mpsc_next = head;
+    } while (atomic_cmpswap(list->head, head, thread) != head);
+}
+
+/* takes everything pushed so far, oldest first */
+static rt_thread* mpsc_take(rt_mpsc *list)
+{
+    rt_thread *thread = (rt_thread *)xchg64((void **)&list->head, NULL);
+    rt_thread *fifo = NULL, *next;
+
+    while (thread) {
+        next = thread->mpsc_next;
+        thread->mpsc_next = fifo;
+        fifo = thread;
+        thread = next;
+    }
+    return fifo;
+}
+
+void rt_thread_submit(int cpu, rt_thread *thread)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    rt_scheduler *target = sys->cpus[cpu]->rt_sched;
+
+    thread->q_index = RT_NOT_QUEUED;
+    if (thread->type == APERIODIC) {
+        thread->status = WAITING;
+        thread->q_type = WAITING_QUEUE;
+        mpsc_push(&target->waiting, thread);
+    } else {
+        thread->status = ARRIVED;
+        thread->q_type = ARRIVAL_QUEUE;
+        mpsc_push(&target->arrival, thread);
+    }
+
+    if (cpu != my_cpu_id() && !nk_idle_wake(cpu)) {
+        apic_ipi(per_cpu_get(apic), sys->cpus[cpu]->lapic_id, APIC_NULL_KICK_VEC);
+    }
+}
+
+#ifdef NAUT_CONFIG_RT_TASK_SETS
+/* the last a core touches of the set, which may be gone right after */
+static inline void set_decided(rt_thread *thread, int admitted)
+{
+    rt_set *set = thread->set;
+
+    if (!set) {
+        return;
+    }
+    thread->set = NULL;
+    if (!admitted) {
+        atomic_inc(set->refused);
+    }
+    atomic_dec(set->undecided);
+}
+
+/*
+ * An admitted member of a task set waits on the pending queue, which
+ * is keyed on the next release, for the set's start time. Its first
+ * job is then released by release_pending() like any other.
+ */
+static void set_hold(rt_scheduler *scheduler, rt_thread *thread)
+{
+    uint64_t period = thread->constraints->periodic.period;
+    uint64_t start = thread->set_start;
+
+    thread->release = (start > period) ? start - period : 0;
+    thread->deadline = start;
+    enqueue_pending(scheduler->pending, thread);
+    set_decided(thread, 1);
+}
+#endif
+
+static void drain_submissions(rt_scheduler *scheduler)
+{
+    rt_thread *thread, *next;
+
+    if (scheduler->waiting.head) {
+        for (thread = mpsc_take(&scheduler->waiting); thread; thread = next) {
+            next = thread->mpsc_next;
+            thread->mpsc_next = NULL;
+            if (thread->status == TOBE_REMOVED) {
+                thread_removed(thread);
+                continue;
+            }
+            if (sched_own(scheduler, thread)) {
+                /* no room for it yet, tried again on the next pass */
+                mpsc_push(&scheduler->waiting, thread);
+                continue;
+            }
+            thread->status = ADMITTED;
+            enqueue_aperiodic(scheduler->aperiodic, thread);
+        }
+    }
+
+    if (scheduler->arrival.head) {
+        for (thread = mpsc_take(&scheduler->arrival); thread; thread = next) {
+            next = thread->mpsc_next;
+            thread->mpsc_next = NULL;
+            if (thread->status == TOBE_REMOVED) {
+                thread_removed(thread);
+                continue;
+            }
+            /* already holds its share here, it only needs queueing */
+            if (thread->admitted > 0) {
+                if (sched_own(scheduler, thread)) {
+                    mpsc_push(&scheduler->arrival, thread);
+                    continue;
+                }
+                thread->status = ADMITTED;
+                enqueue_runnable(scheduler->runnable, thread);
+                continue;
+            }
+            /* the room it needs is refused like any other shortfall */
+            if (sched_own(scheduler, thread) || !rt_admit(scheduler, thread)) {
+                RT_SCHED_ERROR("Thread %p not admitted on cpu %d\n", thread->thread, my_cpu_id());
+#ifdef NAUT_CONFIG_RT_TASK_SETS
+                set_decided(thread, 0);
+#endif
+                thread_removed(thread);
+                /* the creator reclaims it once it sees this */
+                mbarrier();
+                thread->admitted = -1;
+                continue;
+            }
+            thread->status = ADMITTED;
+            thread->admitted = 1;
+#ifdef NAUT_CONFIG_RT_TASK_SETS
+            if (thread->set) {
+                set_hold(scheduler, thread);
+                continue;
+            }
+#endif
+            enqueue_runnable(scheduler->runnable, thread);
+        }
+    }
+}
+
+#ifdef NAUT_CONFIG_RT_IDLE_CSTATES
+/*
+ * Idle C-state selection. When the idle thread is all that is left,
+ * set_timer() knows how long the core has until the next release. It
+ * picks the deepest C-state whose exit latency, together with a
+ * residency of twice that latency, fits in the gap. The timer is then
+ * armed that much early, so the core is awake again by the release.
+ * Exit latencies start from conservative defaults. Every time the idle
+ * thread is woken from MWAIT by that timer, the overshoot is taken as
+ * a new sample: it raises the estimate at once and lowers it slowly.
+ */
+static const uint64_t idle_default_us[RT_IDLE_STATES] = { 0, 2, 50, 100, 200 };
+
+static void idle_init(rt_scheduler *scheduler)
+{
+    uint64_t khz = per_cpu_get(cpu_khz);
+    int i;
+
+    if (!khz) {
+        /* not calibrated, assume a fast clock so latencies come out long */
+        khz = 4000000;
+    }
+
+    scheduler->idle_cstates = nk_mwait_cstates();
+    for (i = 0; i < RT_IDLE_STATES; i++) {
+        scheduler->idle_latency[i] = (idle_default_us[i] * khz) / 1000;
+    }
+#ifdef NAUT_CONFIG_HPET_BROADCAST
+    {
+        cpuid_ret_t ret;
+        cpuid(0x6, &ret);
+        scheduler->idle_arat = (ret.a >> 2) & 1;
+    }
+#endif
+}
+
+static int idle_pick(rt_scheduler *scheduler, uint64_t gap)
+{
+    int state;
+
+    for (state = RT_IDLE_STATES - 1; state > 0; state--) {
+        if ((scheduler->idle_cstates & (1 << state)) &&
+            scheduler->idle_latency[state] * 3 <= gap) {
+            return state;
+        }
+    }
+    return 0;
+}
+
+static void idle_sample(rt_scheduler *scheduler)
+{
+    uint64_t now, late, *latency;
+    int state = scheduler->idle_entered;
+
+    if (!state || !scheduler->idle_wake) {
+        return;
+    }
+
+    now = cur_time();
+    if (now < scheduler->idle_wake) {
+        /* woken by something else, not a sample */
+        return;
+    }
+
+    late = now - scheduler->idle_wake;
+    latency = &scheduler->idle_latency[state];
+    if (late > *latency) {
+        *latency = late;
+    } else {
+        *latency -= (*latency - late) >> 4;
+    }
+    scheduler->idle_entered = 0;
+    scheduler->idle_wake = 0;
+}
+
+/* called by the idle thread in place of hlt */
+void rt_idle_enter(void)
+{
+    rt_scheduler *scheduler = per_cpu_get(rt_sched);
+    int state;
+
+    cli();
+    state = scheduler ? scheduler->idle_state : 0;
+    if (!state) {
+        sti();
+        halt();
+        return;
+    }
+
+#ifdef NAUT_CONFIG_HPET_BROADCAST
+    /* below C1 the APIC timer may stop, so have the HPET wake us */
+    if (state > 1 && !scheduler->idle_arat && scheduler->idle_wake &&
+        nk_hpet_bcast_enter(scheduler->idle_wake) != 0) {
+        state = 1;
+    }
+#endif
+
+    scheduler->idle_entered = state;
+#ifdef NAUT_CONFIG_MWAIT_WAKEUP
+    nk_idle_mwait((state - 1) << 4);
+#else
+    nk_monitor((addr_t)&scheduler->idle_entered, 0, 0);
+    sti();
+    nk_mwait((state - 1) << 4, 0);
+#endif
+    scheduler->idle_entered = 0;
+#ifdef NAUT_CONFIG_HPET_BROADCAST
+    nk_hpet_bcast_exit();
+#endif
+}
+#endif
+
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+/*
+ * Mixed-criticality scheduling with EDF-VD.
+ *
+ * Every core keeps three totals over its admitted periodic threads: LO
+ * threads on their budget (U_LO), HI threads on their LO budget
+ * (U_HI^LO) and HI threads on their HI budget (U_HI^HI). If
+ * U_LO + U_HI^HI fits, plain EDF suffices. Otherwise HI jobs in LO
+ * mode are given virtual deadlines x * period with
+ *
+ *     x = U_HI^LO / (B - U_LO),   admitted if x * U_LO + U_HI^HI <= B
+ *
+ * where B is PERIODIC_UTIL. A HI job that exhausts its LO budget
+ * switches the core to HI mode, in which LO threads are suspended and
+ * HI jobs run to their HI budget against their real deadlines.
+ */
+static int mc_totals(rt_scheduler *scheduler, rt_thread *thread,
+                     uint64_t *lo, uint64_t *hi_lo, uint64_t *hi)
+{
+    struct periodic_constraints *c = &thread->constraints->periodic;
+    uint64_t u_lo = (c->slice * 100000) / c->period;
+
+    *lo = scheduler->mc_lo_util;
+    *hi_lo = scheduler->mc_hi_lo_util;
+    *hi = scheduler->mc_hi_util;
+
+    if (c->criticality == RT_CRIT_HI) {
+        *hi_lo += u_lo;
+        *hi += (MAX(c->slice, c->slice_hi) * 100000) / c->period;
+    } else {
+        *lo += u_lo;
+    }
+    return c->criticality == RT_CRIT_HI;
+}
+
+static uint64_t mc_scale(uint64_t lo, uint64_t hi_lo, uint64_t hi)
+{
+    if (lo + hi <= PERIODIC_UTIL || lo >= PERIODIC_UTIL) {
+        return 100000;
+    }
+    return MIN(100000, (hi_lo * 100000) / (PERIODIC_UTIL - lo));
+}
+
+static int mc_admit(rt_scheduler *scheduler, rt_thread *thread)
+{
+    uint64_t lo, hi_lo, hi, x;
+
+    mc_totals(scheduler, thread, &lo, &hi_lo, &hi);
+    if (lo + hi_lo > PERIODIC_UTIL) {
+        return 0;
+    }
+    if (lo + hi <= PERIODIC_UTIL) {
+        return 1;
+    }
+    x = mc_scale(lo, hi_lo, hi);
+    return (x * lo) / 100000 + hi <= PERIODIC_UTIL;
+}
+
+static void mc_reserve(rt_scheduler *scheduler, rt_thread *thread, int add)
+{
+    struct periodic_constraints *c = &thread->constraints->periodic;
+    uint64_t u_lo, u_hi;
+
+    if (thread->type != PERIODIC || thread->mc_admitted == add) {
+        return;
+    }
+
+    u_lo = (c->slice * 100000) / c->period;
+    u_hi = (MAX(c->slice, c->slice_hi) * 100000) / c->period;
+
+    if (c->criticality == RT_CRIT_HI) {
+        scheduler->mc_hi_lo_util = add ? scheduler->mc_hi_lo_util + u_lo :
+                                         scheduler->mc_hi_lo_util - MIN(u_lo, scheduler->mc_hi_lo_util);
+        scheduler->mc_hi_util = add ? scheduler->mc_hi_util + u_hi :
+                                      scheduler->mc_hi_util - MIN(u_hi, scheduler->mc_hi_util);
+    } else {
+        scheduler->mc_lo_util = add ? scheduler->mc_lo_util + u_lo :
+                                      scheduler->mc_lo_util - MIN(u_lo, scheduler->mc_lo_util);
+    }
+    thread->mc_admitted = add;
+
+    /* applies from each HI thread's next release */
+    scheduler->vd_scale = mc_scale(scheduler->mc_lo_util, scheduler->mc_hi_lo_util,
+                                   scheduler->mc_hi_util);
+}
+
+/* a HI job used up its LO budget without completing */
+static inline int mc_overrun(rt_scheduler *scheduler, rt_thread *thread)
+{
+    struct periodic_constraints *c = &thread->constraints->periodic;
+
+    return scheduler->crit_mode == RT_CRIT_LO &&
+           thread->type == PERIODIC && c->criticality == RT_CRIT_HI &&
+           c->slice_hi > c->slice && thread->run_time >= c->slice &&
+           (thread->status == ADMITTED || thread->status == RUNNING || thread->status == ARRIVED);
+}
+
+/* no periodic or sporadic work left to run on this core */
+static inline int mc_idle(rt_scheduler *scheduler, rt_thread *thread)
+{
+    if (scheduler->runnable->size > 0) {
+        return 0;
+    }
+    if (thread->type == APERIODIC ||
+        (thread->status != ADMITTED && thread->status != RUNNING && thread->status != ARRIVED)) {
+        return 1;
+    }
+    return thread->type == PERIODIC && thread->run_time >= periodic_budget(thread);
+}
+
+/* move the LO threads on queue to the suspended ring */
+static void mc_suspend_queue(rt_scheduler *scheduler, rt_queue *queue)
+{
+    rt_thread *thread;
+    uint64_t i, j;
+
+    for (i = 0, j = 0; i < queue->size; i++) {
+        thread = queue->threads[i];
+        if (thread->type == PERIODIC && thread->mc_admitted &&
+            thread->constraints->periodic.criticality == RT_CRIT_LO) {
+            queue_unaccount(queue, thread);
+#ifdef NAUT_CONFIG_RT_TIMER_WHEEL
+            rt_wheel_remove(scheduler->wheel, thread);
+#endif
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+            if (queue->buckets) {
+                rt_buckets_remove(queue->buckets, thread);
+            }
+#endif
+            enqueue_thread(scheduler->suspended, thread);
+        } else {
+            queue->threads[j] = thread;
+            thread->q_index = j++;
+        }
+    }
+    queue->size = j;
+    if (is_heap_queue(queue->type)) {
+        heap_fixup(queue, 0);
+    }
+}
+
+static void crit_switch(rt_scheduler *scheduler, rt_thread *thread)
+{
+    rt_queue *runnable = scheduler->runnable;
+    uint64_t i;
+
+    scheduler->crit_mode = RT_CRIT_HI;
+    scheduler->mode_switches++;
+
+    mc_suspend_queue(scheduler, runnable);
+    mc_suspend_queue(scheduler, scheduler->pending);
+
+    /* HI jobs are held to their real deadlines from now on */
+    thread->deadline = job_deadline(thread);
+    for (i = 0; i < runnable->size; i++) {
+        runnable->threads[i]->deadline = job_deadline(runnable->threads[i]);
+    }
+    heap_fixup(runnable, 0);
+    demand_changed(scheduler);
+}
+
+/*
+ * Back to LO mode at an idle instant. Suspended threads rejoin at
+ * their next release on their original phase; jobs lost in HI mode
+ * count as skipped.
+ */
+static void crit_restore(rt_scheduler *scheduler)
+{
+    uint64_t now = cur_time();
+    uint64_t period, late;
+    rt_thread *thread;
+
+    scheduler->crit_mode = RT_CRIT_LO;
+
+    while ((thread = dequeue_thread(scheduler->suspended)) != NULL) {
+        period = thread->constraints->periodic.period;
+        if (now >= thread->release + period) {
+            late = (now - thread->release) / period;
+            thread->release += late * period;
+            thread->stats.skipped += late;
+        }
+        thread->deadline = thread->release + period;
+        enqueue_pending(scheduler->pending, thread);
+    }
+    demand_changed(scheduler);
+}
+#endif
+
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+/*
+ * Semi-partitioned scheduling with C=D job splitting.
+ *
+ * A periodic thread that fits on no single core may be split across
+ * its home core and one other. On each release its first portion,
+ * split_slice, runs on the home core with a deadline equal to that
+ * budget, so it runs ahead of everything else there. When that
+ * budget is spent, the job moves to split_cpu and runs the rest of
+ * its slice against the job's real deadline. Once it completes, it
+ * goes back home to wait for its next release. Both migration points
+ * are fixed at admission. Each core's share is held in its
+ * split_util and left out of get_per_util().
+ */
+static int rt_admit_split(rt_scheduler *scheduler, rt_thread *thread)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t period = thread->constraints->periodic.period;
+    uint64_t slice = thread->constraints->periodic.slice;
+    uint64_t util = core_per_util(scheduler);
+    uint64_t room = (util < PERIODIC_UTIL) ? PERIODIC_UTIL - util : 0;
+    uint64_t c1 = (room * period) / 100000;
+    uint64_t c2, density;
+    int home = thread->thread->bound_cpu;
+    int cpu;
+
+    if (c1 == 0 || c1 >= slice) {
+        return 0;
+    }
+
+    c2 = slice - c1;
+    density = (c2 * 100000) / (period - c1);
+
+    for (cpu = 0; cpu < sys->num_cpus; cpu++) {
+        rt_scheduler *other = sys->cpus[cpu]->rt_sched;
+
+        if (cpu == home || !other) {
+            continue;
+        }
+
+        if (core_per_util(other) + density > PERIODIC_UTIL) {
+            continue;
+        }
+
+        thread->split_home = home;
+        thread->split_cpu = cpu;
+        thread->split_slice = c1;
+        thread->split_home_util = (c1 * 100000) / period;
+        thread->split_util = density;
+        atomic_add(scheduler->split_util, thread->split_home_util);
+        atomic_add(other->split_util, density);
+
+        thread->release = cur_time();
+        thread->split_phase = 0;
+        thread->deadline = thread->release + c1;
+
+        RT_SCHED_DEBUG("PERIODIC: split %llu/%llu between cpu %d and cpu %d\n", c1, c2, home, cpu);
+        return 1;
+    }
+    return 0;
+}
+#endif
+
+uint64_t cur_time()
+{
+    return rdtsc();
+}
+
+
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+/*
+ * Jobs sharing a bucket run in arrival order, so a job can be
+ * overtaken by jobs whose deadlines are up to one bucket width W
+ * later. EDF still meets every deadline if the set is schedulable
+ * with each deadline moved W earlier, which for a periodic thread
+ * turns C / P into C / (P - W). Over the whole core that adds at
+ * most U * W / (P_min - W), which is what this charges.
+ */
+static uint64_t bucket_penalty(rt_scheduler *scheduler, rt_thread *thread)
+{
+    uint64_t util = core_per_util(scheduler) + thread_util(thread);
+    uint64_t min = MIN(MIN(queue_min_period(scheduler->runnable), queue_min_period(scheduler->pending)),
+                       thread->constraints->periodic.period);
+
+    if (min <= RT_BUCKET_WIDTH) {
+        /* a period within one bucket cannot be told apart at all */
+        return PERIODIC_UTIL + 1;
+    }
+    return (util * RT_BUCKET_WIDTH) / (min - RT_BUCKET_WIDTH);
+}
+#endif
+
+int rt_admit(rt_scheduler *scheduler, rt_thread *thread)
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+{
+    place_release(thread);
+    if (thread->type == PERIODIC && !mc_admit(scheduler, thread)) {
+        RT_SCHED_ERROR("PERIODIC: Admission denied, fails the mixed-criticality test!\n");
+        return 0;
+    }
+    if (!rt_admit_util(scheduler, thread)) {
+        return 0;
+    }
+    if (thread->type == PERIODIC) {
+        mc_reserve(scheduler, thread, 1);
+    }
+    return 1;
+}
+
+static int rt_admit_util(rt_scheduler *scheduler, rt_thread *thread)
+#endif
+{
+    if (thread->type == PERIODIC)
+    {
+        uint64_t util = thread_util(thread);
+        uint64_t per_util;
+
+        /* its own reservation is not competition, and it is decided now */
+        place_release(thread);
+
+#ifdef NAUT_CONFIG_RT_CACHE_PARTITION
+        if (rt_cat_admit(thread)) {
+            RT_SCHED_ERROR("PERIODIC: Admission denied, its cache class is not isolated!\n");
+            return 0;
+        }
+#endif
+
+        /* no test of this core alone makes up for full siblings */
+        if (!smt_admit(scheduler->cpu, util)) {
+            RT_SCHED_ERROR("PERIODIC: Admission denied, the physical core is full!\n");
+            return 0;
+        }
+
+        per_util = core_per_util(scheduler);
+#if defined(NAUT_CONFIG_RT_CHARGE_OVERHEAD) || defined(NAUT_CONFIG_RT_OVERHEAD_HIST)
+        per_util += get_overhead_util(scheduler, thread);
+#endif
+#ifdef NAUT_CONFIG_RT_EDF_BUCKETS
+        per_util += bucket_penalty(scheduler, thread);
+#endif
+        RT_SCHED_DEBUG("UTIL FACTOR =  \t%llu\n", per_util);
+        
+        if ((per_util + (thread->constraints->periodic.slice * 100000) / thread->constraints->periodic.period) > PERIODIC_UTIL) {
+#ifdef NAUT_CONFIG_RT_DEMAND_ANALYSIS
+            if (rt_admit_demand(scheduler, thread)) {
+                demand_changed(scheduler);
+                return 1;
+            }
+#endif
+#ifdef NAUT_CONFIG_RT_SIM_ADMISSION
+            if (rt_admit_simulate(scheduler, thread, NULL)) {
+                demand_changed(scheduler);
+                return 1;
+            }
+#endif
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+            if (rt_admit_split(scheduler, thread)) {
+                demand_changed(scheduler);
+                return 1;
+            }
+#endif
+            RT_SCHED_ERROR("PERIODIC: Admission denied utilization factor overflow!\n");
+            return 0;
+        }
+    } else if (thread->type == SPORADIC)
+    {
+        uint64_t spor_util = get_spor_util(scheduler->runnable);
+        
+#ifdef NAUT_CONFIG_RT_CACHE_PARTITION
+        if (rt_cat_admit(thread)) {
+            RT_SCHED_ERROR("SPORADIC: Admission denied, its cache class is not isolated!\n");
+            return 0;
+        }
+#endif
+        if (spor_util > SPORADIC_UTIL) {
+#ifdef NAUT_CONFIG_RT_DEMAND_ANALYSIS
+            if (rt_admit_demand(scheduler, thread)) {
+                demand_changed(scheduler);
+                return 1;
+            }
+#endif
+#ifdef NAUT_CONFIG_RT_SIM_ADMISSION
+            if (rt_admit_simulate(scheduler, thread, NULL)) {
+                demand_changed(scheduler);
+                return 1;
+            }
+#endif
+            RT_SCHED_DEBUG("SPORADIC: Admission denied utilization factor overflow!\n");
+            return 0;
+        }
+    }
+
+    demand_changed(scheduler);
+    return 1;
+}
+
+static inline uint64_t get_avg_per(rt_queue *runnable, rt_queue *pending, rt_thread *new_thread)
+{
+    uint64_t sum_period = runnable->sum_period + pending->sum_period;
+    uint64_t num_periodic = runnable->num_periodic + pending->num_periodic;
+    
+    if (new_thread->type == PERIODIC)
+    {
+        sum_period += new_thread->constraints->periodic.period;
+        num_periodic++;
+    }
+    
+    sum_period += QUANTUM;
+    num_periodic++;
+    return (sum_period / num_periodic);
+}
+
+static inline uint64_t get_min_per(rt_queue *runnable, rt_queue *pending, rt_thread *thread)
+{
+    return MIN(queue_min_period(runnable), queue_min_period(pending));
+}
+
+static inline uint64_t get_per_util(rt_queue *runnable, rt_queue *pending)
+{
+    return runnable->util + pending->util;
+}
+
+#if defined(NAUT_CONFIG_RT_CHARGE_OVERHEAD) || defined(NAUT_CONFIG_RT_OVERHEAD_HIST)
+/*
+ * Utilization lost to scheduling overhead. Each switch is charged to
+ * the budget of the thread being switched in, and under EDF a job is
+ * dispatched at most twice (once on release, once after being
+ * preempted), so every periodic thread pays two passes per period,
+ * at their worst case or at the measured percentile.
+ */
+static inline uint64_t get_overhead_util(rt_scheduler *scheduler, rt_thread *new_thread)
+{
+    uint64_t overhead = 2 * sched_overhead(scheduler);
+    uint64_t util;
+
+    util = (overhead * (scheduler->runnable->sum_freq + scheduler->pending->sum_freq)) >> RT_FREQ_SHIFT;
+
+    if (new_thread->type == PERIODIC) {
+        util += (overhead * 100000) / new_thread->constraints->periodic.period;
+    }
+    return util;
+}
+#endif
+
+static inline uint64_t get_spor_util(rt_queue *runnable)
+{
+    uint64_t util = 0;
+    
+    int i;
+
+    /* depends on the current time, so only the scan is skipped */
+    if (runnable->num_sporadic == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < runnable->size; i++)
+    {
+        rt_thread *thread = runnable->threads[i];
+        if (thread->type == SPORADIC)
+        {
+            /* a job at or past its deadline counts as a full core */
+            util += thread_util(thread);
+        }
+    }
+    return util;
+}
+
+/*
+ * Periodic utilization this core is committed to: what is on its
+ * queues, plus split portions, placements not admitted yet and
+ * threads on their way in, less threads on their way out.
+ */
+static inline uint64_t core_per_util(rt_scheduler *scheduler)
+{
+    uint64_t util = get_per_util(scheduler->runnable, scheduler->pending);
+
+    util += scheduler->placed_util + scheduler->migrating_in;
+#ifdef NAUT_CONFIG_RT_CBS
+    util += scheduler->server_util;
+#endif
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+    util += scheduler->split_util;
+#endif
+    return (util > scheduler->migrating_out) ? util - scheduler->migrating_out : 0;
+}
+
+#ifdef NAUT_CONFIG_LOAD_AVG
+/* what the load averages sample as this core's real-time load */
+uint64_t rt_load_util(rt_scheduler *scheduler)
+{
+    return core_per_util(scheduler) + scheduler->runnable->spor_util;
+}
+#endif
+
+/*
+ * Periodic utilization of the whole physical core cpu belongs to, and
+ * the number of hardware threads it has.
+ */
+static uint64_t smt_core_util(int cpu, unsigned *threads)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    cpu_id_t sibs[RT_SMT_MAX];
+    int i, n = nk_topo_siblings(cpu, sibs, RT_SMT_MAX);
+    uint64_t util = sys->cpus[cpu]->rt_sched ? core_per_util(sys->cpus[cpu]->rt_sched) : 0;
+
+    for (i = 0; i < n; i++) {
+        rt_scheduler *sibling = sys->cpus[sibs[i]]->rt_sched;
+        if (sibling) {
+            util += core_per_util(sibling);
+        }
+    }
+
+    if (threads) {
+        *threads = n + 1;
+    }
+    return util;
+}
+
+/*
+ * Would util more on cpu leave its physical core within RT_SMT_SHARE?
+ * Siblings' figures are read without their owners, like placement's.
+ */
+static int smt_admit(int cpu, uint64_t util)
+{
+    unsigned threads;
+    uint64_t core_util;
+
+    if (nk_topo_threads_per_core() == 1) {
+        return 1;
+    }
+
+    core_util = smt_core_util(cpu, &threads);
+    if (threads == 1) {
+        return 1;
+    }
+
+    return core_util + util <= (PERIODIC_UTIL * threads * RT_SMT_SHARE) / 100;
+}
+
+static inline void demand_changed(rt_scheduler *scheduler)
+{
+#ifdef NAUT_CONFIG_RT_DEMAND_ANALYSIS
+    scheduler->demand_gen++;
+#endif
+}
+
+#ifdef NAUT_CONFIG_RT_DEMAND_ANALYSIS
+/******************************************************************
+ DEMAND ANALYSIS
+
+ Exact EDF test used when the utilization bound in rt_admit() fails.
+ Every periodic thread contributes its current job (what is left of
+ it, due at its deadline) and then one job per period after that,
+ each charged two scheduling passes of overhead. A sporadic thread
+ contributes its remaining work at its deadline. The set is
+ schedulable iff the demand due by t never exceeds the supply
+ RT_DEMAND_SUPPLY * t.
+
+ Demand is bounded above by A + U*t, so nothing past
+ L = A / (supply - U) needs checking. Below L the deadlines are
+ walked backwards with QPA (Zhang and Burns), which normally needs a
+ handful of steps instead of visiting every deadline up to L.
+
+ The list of threads on this core is kept between admissions and
+ only rebuilt when demand_gen says the set has changed.
+ ******************************************************************/
+
+typedef struct rt_demand_task {
+    uint64_t rem;       /* demand of the first job */
+    uint64_t first;     /* its deadline, relative to now */
+    uint64_t cost;      /* demand of each later job, 0 if none */
+    uint64_t period;
+} rt_demand_task;
+
+typedef struct rt_demand {
+    uint64_t gen;
+    uint64_t count, capacity;
+    rt_thread **threads;
+    rt_demand_task *tasks;
+} rt_demand;
+
+static int demand_reserve(rt_demand *demand, uint64_t count)
+{
+    uint64_t capacity = demand->capacity ? demand->capacity : RT_QUEUE_MIN;
+    rt_thread **threads;
+    rt_demand_task *tasks;
+
+    if (count <= demand->capacity) {
+        return 0;
+    }
+
+    while (capacity < count) {
+        capacity <<= 1;
+    }
+
+    threads = (rt_thread **)malloc(capacity * sizeof(rt_thread *));
+    tasks = (rt_demand_task *)malloc(capacity * sizeof(rt_demand_task));
+    if (!threads || !tasks) {
+        RT_SCHED_ERROR("Could not grow demand table to %llu\n", capacity);
+        if (threads) {
+            free(threads);
+        }
+        if (tasks) {
+            free(tasks);
+        }
+        return -1;
+    }
+
+    if (demand->threads) {
+        memcpy(threads, demand->threads, demand->count * sizeof(rt_thread *));
+        free(demand->threads);
+        free(demand->tasks);
+    }
+    demand->threads = threads;
+    demand->tasks = tasks;
+    demand->capacity = capacity;
+    return 0;
+}
+
+static void demand_collect(rt_demand *demand, rt_queue *queue)
+{
+    uint64_t i;
+
+    for (i = 0; i < queue->size; i++) {
+        rt_thread *thread = queue->threads[i];
+
+        if (thread->type == APERIODIC || thread->status == TOBE_REMOVED) {
+            continue;
+        }
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+        if (thread->split_cpu >= 0) {
+            /* accounted for through split_util */
+            continue;
+        }
+#endif
+#ifdef NAUT_CONFIG_RT_CBS
+        if (thread->server) {
+            /* servers are accounted for through server_util */
+            continue;
+        }
+#endif
+        if (demand_reserve(demand, demand->count + 2)) {
+            return;
+        }
+        demand->threads[demand->count++] = thread;
+    }
+}
+
+static rt_demand* demand_table(rt_scheduler *scheduler)
+{
+    rt_demand *demand = scheduler->demand;
+
+    if (!demand) {
+        demand = (rt_demand *)malloc(sizeof(rt_demand));
+        if (!demand) {
+            RT_SCHED_ERROR("Could not allocate demand table\n");
+            return NULL;
+        }
+        memset(demand, 0, sizeof(rt_demand));
+        demand->gen = scheduler->demand_gen - 1;
+        scheduler->demand = demand;
+    }
+
+    if (demand->gen != scheduler->demand_gen) {
+        demand->count = 0;
+        demand_collect(demand, scheduler->runnable);
+        demand_collect(demand, scheduler->pending);
+        demand->gen = scheduler->demand_gen;
+    }
+
+    /* room for the thread being admitted */
+    if (demand_reserve(demand, demand->count + 1)) {
+        return NULL;
+    }
+    return demand;
+}
+
+static void demand_task(rt_demand_task *task, rt_thread *thread, uint64_t now, uint64_t overhead)
+{
+    if (thread->type == SPORADIC) {
+        uint64_t work = thread->constraints->sporadic.work;
+        task->rem = (work > thread->run_time) ? work - thread->run_time : 0;
+        task->first = (thread->deadline > now) ? thread->deadline - now : 0;
+        task->cost = 0;
+        task->period = 0;
+        return;
+    }
+
+    task->period = thread->constraints->periodic.period;
+    task->cost = thread->constraints->periodic.slice + overhead;
+
+    if (thread->q_type == PENDING_QUEUE) {
+        /* waiting for its release at deadline */
+        task->rem = task->cost;
+        task->first = ((thread->deadline > now) ? thread->deadline - now : 0) + task->period;
+    } else if (thread->deadline > now) {
+        task->rem = (task->cost > thread->run_time) ? task->cost - thread->run_time : 0;
+        task->first = thread->deadline - now;
+    } else {
+        /* current job already missed, it is handled by the miss path */
+        task->rem = task->cost;
+        task->first = task->period;
+    }
+}
+
+/* demand due by t, scaled to the time the supply needs to serve it */
+static uint64_t demand_at(rt_demand_task *tasks, uint64_t n, uint64_t t, uint64_t supply)
+{
+    uint64_t dbf = 0, i;
+
+    for (i = 0; i < n; i++) {
+        if (t < tasks[i].first) {
+            continue;
+        }
+        dbf += tasks[i].rem;
+        if (tasks[i].period) {
+            dbf += ((t - tasks[i].first) / tasks[i].period) * tasks[i].cost;
+        }
+    }
+    return (dbf * 100000) / supply;
+}
+
+/* latest deadline strictly before t, 0 if there is none */
+static uint64_t deadline_before(rt_demand_task *tasks, uint64_t n, uint64_t t)
+{
+    uint64_t best = 0, d, i;
+
+    for (i = 0; i < n; i++) {
+        if (tasks[i].first >= t) {
+            continue;
+        }
+        d = tasks[i].first;
+        if (tasks[i].period) {
+            d += ((t - 1 - tasks[i].first) / tasks[i].period) * tasks[i].period;
+        }
+        best = MAX(best, d);
+    }
+    return best;
+}
+
+static int rt_admit_demand(rt_scheduler *scheduler, rt_thread *thread)
+{
+    rt_demand *demand = demand_table(scheduler);
+    uint64_t overhead = 2 * sched_overhead(scheduler);
+    uint64_t now = cur_time();
+    uint64_t supply = RT_DEMAND_SUPPLY;
+    uint64_t util = 0, excess = 0, d_min = (uint64_t)-1;
+    uint64_t reserved, t, g, limit, n, i;
+    rt_demand_task *tasks;
+    int steps;
+
+    if (!demand) {
+        return 0;
+    }
+
+    /* capacity promised on this core but not on its queues */
+    reserved = scheduler->placed_util + scheduler->migrating_in;
+#ifdef NAUT_CONFIG_RT_CBS
+    reserved += scheduler->server_util;
+#endif
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+    reserved += scheduler->split_util;
+#endif
+    if (reserved >= supply) {
+        return 0;
+    }
+    supply -= reserved;
+
+    tasks = demand->tasks;
+    n = demand->count;
+    for (i = 0; i < n; i++) {
+        demand_task(&tasks[i], demand->threads[i], now, overhead);
+    }
+    if (thread->type == PERIODIC) {
+        /* a new thread has its whole first job ahead of it */
+        tasks[n].period = thread->constraints->periodic.period;
+        tasks[n].cost = thread->constraints->periodic.slice + overhead;
+        tasks[n].rem = tasks[n].cost;
+        tasks[n].first = (thread->deadline > now) ? thread->deadline - now : tasks[n].period;
+    } else {
+        demand_task(&tasks[n], thread, now, overhead);
+    }
+    n++;
+
+    for (i = 0; i < n; i++) {
+        uint64_t u = tasks[i].period ? (tasks[i].cost * 100000) / tasks[i].period : 0;
+        uint64_t early = (tasks[i].first * u) / 100000;
+
+        util += u;
+        excess += (tasks[i].rem > early) ? tasks[i].rem - early : 0;
+        if (tasks[i].rem) {
+            d_min = MIN(d_min, tasks[i].first);
+        }
+    }
+
+    if (util >= supply) {
+        RT_SCHED_DEBUG("DEMAND: utilization %llu exceeds supply %llu\n", util, supply);
+        return 0;
+    }
+
+    if (d_min == (uint64_t)-1) {
+        return 1;
+    }
+
+    limit = (excess * 100000) / (supply - util) + 1;
+    for (i = 0; i < n; i++) {
+        /* every first deadline is checked, even past the bound */
+        limit = MAX(limit, tasks[i].first + 1);
+    }
+
+    t = deadline_before(tasks, n, limit);
+    for (steps = 0; steps < RT_DEMAND_MAX_STEPS; steps++) {
+        g = demand_at(tasks, n, t, supply);
+        if (g > t) {
+            RT_SCHED_DEBUG("DEMAND: demand %llu exceeds supply at %llu\n", g, t);
+            return 0;
+        }
+        if (g <= d_min) {
+            return 1;
+        }
+        t = (g < t) ? g : deadline_before(tasks, n, t);
+        if (t == 0) {
+            return 1;
+        }
+    }
+
+    RT_SCHED_DEBUG("DEMAND: gave up after %d steps\n", steps);
+    return 0;
+}
+#endif
+
+#if defined(NAUT_CONFIG_RT_SIM_ADMISSION) || defined(NAUT_CONFIG_RT_BENCH)
+/******************************************************************
+ SIMULATED ADMISSION
+
+ Used when the utilization bound in rt_admit() fails. The core's
+ current jobs and the new thread are loaded into the simulator and
+ EDF is run forward, event by event, for RT_SIM_HORIZON periods of
+ the slowest thread. Jobs are charged two scheduling passes of
+ overhead each, as in the demand test. The set is admitted if no job
+ finishes after its deadline within the horizon. What a short
+ horizon cannot see is long-run overload, so total utilization must
+ also stay within the core.
+
+ The benchmark in rt_bench.c runs the same simulation on a whole
+ generated task set, to check admission against it.
+ ******************************************************************/
+
+static inline void sim_late(rt_thread_sim *t, uint64_t time, uint64_t *late)
+{
+    if (time > t->deadline && time - t->deadline > *late) {
+        *late = time - t->deadline;
+    }
+}
+
+/* run EDF from now to end, returns the worst lateness or -1 if it gave up */
+static uint64_t sim_run(rt_simulator *simulator, uint64_t now, uint64_t end, int max_steps)
+{
+    rt_queue_sim *runnable = simulator->runnable;
+    rt_queue_sim *pending = simulator->pending;
+    uint64_t time = now, late = 0, next, i;
+    rt_thread_sim *t;
+    int steps;
+
+    for (steps = 0; steps < max_steps; steps++) {
+        while (pending->size > 0 && pending->threads[0]->deadline <= time) {
+            t = dequeue_thread_logic(pending);
+            t->release = t->deadline;
+            t->deadline = t->release + t->constraints.periodic.period;
+            t->run_time = 0;
+            enqueue_thread_logic(runnable, t);
+        }
+
+        if (time >= end || (runnable->size == 0 && pending->size == 0)) {
+            break;
+        }
+
+        if (runnable->size == 0) {
+            time = MIN(pending->threads[0]->deadline, end);
+            continue;
+        }
+
+        /* earliest deadline runs until it completes or is preempted */
+        t = runnable->threads[0];
+        next = time + (t->budget - t->run_time);
+        if (pending->size > 0) {
+            next = MIN(next, pending->threads[0]->deadline);
+        }
+        next = MIN(next, end);
+        t->run_time += next - time;
+        time = next;
+
+        if (t->run_time >= t->budget) {
+            dequeue_thread_logic(runnable);
+            sim_late(t, time, &late);
+            if (t->type == PERIODIC) {
+                t->deadline = t->release + t->constraints.periodic.period;
+                enqueue_thread_logic(pending, t);
+            }
+        }
+    }
+
+    if (steps == max_steps) {
+        RT_SCHED_DEBUG("SIM: gave up after %d steps\n", steps);
+        return (uint64_t)-1;
+    }
+
+    /* jobs still unfinished at the horizon are late by at least this */
+    for (i = 0; i < runnable->size; i++) {
+        sim_late(runnable->threads[i], time, &late);
+    }
+    return late;
+}
+#endif
+
+#ifdef NAUT_CONFIG_RT_SIM_ADMISSION
+static rt_simulator* sim_table(rt_scheduler *scheduler)
+{
+    if (!scheduler->sim) {
+        scheduler->sim = init_simulator();
+    }
+    return scheduler->sim;
+}
+
+int rt_admit_simulate(rt_scheduler *scheduler, rt_thread *thread, uint64_t *lateness)
+{
+    rt_simulator *simulator = sim_table(scheduler);
+    uint64_t overhead = 2 * sched_overhead(scheduler);
+    uint64_t now = cur_time();
+    uint64_t util = 0, horizon = 0, late = (uint64_t)-1, i;
+    rt_thread_sim *d;
+
+    if (!simulator || thread->type == APERIODIC) {
+        goto out;
+    }
+
+    if (copy_threads_sim(simulator, scheduler)) {
+        goto out;
+    }
+
+    if (!(d = sim_get(simulator))) {
+        goto out;
+    }
+    d->type = thread->type;
+    d->status = thread->status;
+    d->constraints = *thread->constraints;
+    if (thread->type == PERIODIC) {
+        uint64_t period = thread->constraints->periodic.period;
+
+        if (period == 0) {
+            goto out;
+        }
+        /* a new thread has its whole first job ahead of it */
+        d->budget = thread->constraints->periodic.slice + overhead;
+        d->deadline = (thread->deadline > now) ? thread->deadline : now + period;
+        d->release = (d->deadline > period) ? d->deadline - period : 0;
+    } else {
+        d->budget = thread->constraints->sporadic.work;
+        d->deadline = thread->deadline;
+    }
+    enqueue_thread_logic(simulator->runnable, d);
+
+    for (i = 0; i < simulator->used; i++) {
+        d = &simulator->pool[i];
+        if (d->type == PERIODIC) {
+            util += (d->budget * 100000) / d->constraints.periodic.period;
+            horizon = MAX(horizon, d->constraints.periodic.period * NAUT_CONFIG_RT_SIM_HORIZON);
+        } else if (d->deadline > now) {
+            horizon = MAX(horizon, d->deadline - now);
+        }
+    }
+
+    if (util > 100000) {
+        RT_SCHED_DEBUG("SIM: utilization %llu overloads the core\n", util);
+        goto out;
+    }
+
+    late = sim_run(simulator, now, now + horizon, RT_SIM_MAX_STEPS);
+    RT_SCHED_DEBUG("SIM: %llu jobs over %llu cycles, worst lateness %llu\n", simulator->used, horizon, late);
+
+out:
+    if (simulator) {
+        free_threads_sim(simulator);
+    }
+    if (lateness) {
+        *lateness = late;
+    }
+    return late == 0;
+}
+#endif
+
+#ifdef NAUT_CONFIG_RT_BENCH
+/*
+ * Simulate a set of periodic threads on its own, all released at
+ * once, over end cycles. Jobs carry the overhead admission control
+ * would charge on cpu. Returns 1 if no job finishes late, 0 if one
+ * does and -1 if the set could not be simulated.
+ */
+int rt_simulate_taskset(int cpu, rt_constraints *set, uint64_t n, uint64_t end, uint64_t *lateness)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    rt_scheduler *scheduler = sys->cpus[cpu]->rt_sched;
+    uint64_t overhead = 2 * sched_overhead(scheduler);
+    uint64_t late = (uint64_t)-1, i;
+    rt_simulator *simulator;
+    rt_thread_sim *d;
+    int rc = -1;
+
+    if (n > MAX_QUEUE || !(simulator = init_simulator())) {
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!(d = sim_get(simulator)) || set[i].periodic.period == 0) {
+            goto out_free;
+        }
+        d->type = PERIODIC;
+        d->constraints = set[i];
+        d->budget = set[i].periodic.slice + overhead;
+        d->release = 0;
+        d->deadline = set[i].periodic.period;
+        enqueue_thread_logic(simulator->runnable, d);
+    }
+
+    late = sim_run(simulator, 0, end, RT_BENCH_SIM_STEPS);
+    if (late != (uint64_t)-1) {
+        rc = (late == 0);
+    }
+
+out_free:
+    free(simulator->runnable);
+    free(simulator->pending);
+    free(simulator->aperiodic);
+    free(simulator);
+out:
+    if (lateness) {
+        *lateness = late;
+    }
+    return rc;
+}
+#endif
+
+/******************************************************************
+ PLACEMENT
+
+ nk_rt_place() chooses a core for a periodic or sporadic thread
+ before it is started, using the same utilization figures as
+ rt_admit(). The result is meant to be passed as bound_cpu to
+ nk_thread_start(), with RT_PLACED or'd into its type. Periodic
+ placements are reserved on the chosen core until the thread they
+ were made for is admitted or refused, so a burst of placements does
+ not pile onto one core. Only other cores' running totals are read,
+ without their owner's cooperation, so the figures are a snapshot and
+ the owning core still has the final say in rt_admit(). A thread to
+ move for rebalancing is chosen by its own core, over an xcall.
+
+ Cores are tried in nk_topo_spread_cpu() order, so first fit fills
+ the first hardware thread of every physical core before any of
+ their siblings, and worst fit compares whole physical cores before
+ the hardware threads on them.
+ ******************************************************************/
+
+static uint64_t place_util(rt_type type, rt_constraints *constraints, uint64_t deadline)
+{
+    if (type == PERIODIC) {
+        return (constraints->periodic.slice * 100000) / constraints->periodic.period;
+    } else if (type == SPORADIC) {
+        return deadline ? (constraints->sporadic.work * 100000) / deadline : 100000;
+    }
+    return 0;
+}
+
+static inline uint64_t core_load(rt_scheduler *scheduler, rt_type type)
+{
+    /* another core's queues may change under us, only its totals are safe */
+    if (type == SPORADIC) {
+        return scheduler->runnable->spor_util;
+    }
+    return core_per_util(scheduler);
+}
+
+static int place_pick(rt_type type, uint64_t util, rt_place_policy policy, int skip)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t cap = (type == SPORADIC) ? SPORADIC_UTIL : PERIODIC_UTIL;
+    uint64_t load, best_load = 0, core_load_sum = 0, best_core_load = 0;
+    int i, cpu, best = -1;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        rt_scheduler *scheduler;
+
+        cpu = nk_topo_spread_cpu(i);
+        scheduler = sys->cpus[cpu]->rt_sched;
+
+        if (cpu == skip || !scheduler) {
+            continue;
+        }
+#ifdef NAUT_CONFIG_POLL_IO
+        if (scheduler->reserved) {
+            continue;
+        }
+#endif
+
+        load = core_load(scheduler, type);
+        if (load + util > cap) {
+            continue;
+        }
+        if (type == PERIODIC && !smt_admit(cpu, util)) {
+            continue;
+        }
+
+        if (policy == RT_PLACE_FIRST_FIT) {
+            return cpu;
+        }
+
+        if (policy == RT_PLACE_WORST_FIT && type == PERIODIC) {
+            core_load_sum = smt_core_util(cpu, NULL);
+        }
+
+        if (best < 0 ||
+            (policy == RT_PLACE_BEST_FIT && load > best_load) ||
+            (policy == RT_PLACE_WORST_FIT &&
+             (core_load_sum < best_core_load ||
+              (core_load_sum == best_core_load && load < best_load)))) {
+            best = cpu;
+            best_load = load;
+            best_core_load = core_load_sum;
+        }
+    }
+    return best;
+}
+
+/* what place_rebalance() asks of a core, and what it gets back */
+typedef struct place_move {
+    uint64_t room;
+    rt_place_policy policy;
+    int target;         /* where the victim goes, -1 if none was found */
+} place_move;
+
+/*
+ * Find a periodic thread on queue worth at least room that another
+ * core can take, and claim it for that core. Called on queue's own
+ * core with interrupts off, so the queue and its threads stay put.
+ */
+static int place_claim(rt_scheduler *scheduler, rt_queue *queue, place_move *move)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t i, util;
+    int target;
+
+    for (i = 0; i < queue->size; i++) {
+        rt_thread *thread = queue->threads[i];
+
+        if (thread->type != PERIODIC || thread->migrate_cpu >= 0 ||
+            thread->status == TOBE_REMOVED) {
+            continue;
+        }
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+        if (thread->split_cpu >= 0) {
+            continue;
+        }
+#endif
+#ifdef NAUT_CONFIG_RT_CBS
+        if (thread->server) {
+            continue;
+        }
+#endif
+        util = thread_util(thread);
+        if (util < move->room) {
+            continue;
+        }
+
+        target = place_pick(PERIODIC, util, move->policy, scheduler->cpu);
+        if (target < 0) {
+            continue;
+        }
+
+        atomic_add(sys->cpus[target]->rt_sched->migrating_in, util);
+        atomic_add(scheduler->migrating_out, util);
+        if (atomic_cmpswap(thread->migrate_cpu, -1, target) != -1) {
+            /* rt_thread_migrate() got to it first */
+            atomic_sub(sys->cpus[target]->rt_sched->migrating_in, util);
+            atomic_sub(scheduler->migrating_out, util);
+            continue;
+        }
+
+        RT_SCHED_DEBUG("PLACE: moving thread %p from cpu %d to cpu %d\n",
+                       thread->thread, scheduler->cpu, target);
+        move->target = target;
+        return 0;
+    }
+    return -1;
+}
+
+/* xcall: pick this core's victim among its own threads */
+static void place_move_local(void *arg)
+{
+    place_move *move = (place_move *)arg;
+    rt_scheduler *scheduler = per_cpu_get(rt_sched);
+
+    move->target = -1;
+    if (place_claim(scheduler, scheduler->pending, move)) {
+        place_claim(scheduler, scheduler->runnable, move);
     }
 }
 
+/*
+ * No core has room for util. Look for a core where moving one of its
+ * periodic threads elsewhere would make room, and mark that thread to
+ * migrate at the end of its current job. Only a core's totals are
+ * read from here; the thread itself is chosen by that core.
+ */
+static int place_rebalance(uint64_t util, rt_place_policy policy)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    place_move move;
+    uint64_t load;
+    int cpu;
+
+    if (util > PERIODIC_UTIL) {
+        return -1;
+    }
 
+    for (cpu = 0; cpu < sys->num_cpus; cpu++) {
+        rt_scheduler *scheduler = sys->cpus[cpu]->rt_sched;
 
-static int check_deadlines(rt_thread *t)
+        if (!scheduler) {
+            continue;
+        }
+
+        load = core_per_util(scheduler);
+        move.room = (load + util > PERIODIC_UTIL) ? load + util - PERIODIC_UTIL : 0;
+        move.policy = policy;
+        move.target = -1;
+
+        if (smp_xcall(cpu, place_move_local, &move, 1) == 0 && move.target >= 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Move a thread to cpu on request, for load balancers. A periodic
+ * thread has to fit under the target's utilization bound. The target
+ * counts it from now on, and it leaves at the end of its current job,
+ * like a thread nk_rt_place() moved. An aperiodic thread leaves the next
+ * time it is descheduled. Sporadic threads run their one job where they
+ * were admitted. Returns 0 if the move is under way.
+ */
+int rt_thread_migrate(rt_thread *thread, int cpu)
 {
-    if (t->exit_time > t->deadline) {
-        RT_SCHED_ERROR("Missed Deadline = %llu\t\t Current Timer = %llu\n", t->deadline, t->exit_time);
-        RT_SCHED_ERROR("Difference =  %llu\n", t->exit_time - t->deadline);
-		
-		rt_thread_dump(t);
-		return 1;
+    struct sys_info *sys = per_cpu_get(system);
+    int from = thread->thread->bound_cpu;
+    rt_scheduler *home, *target;
+    uint64_t util = 0;
+
+    if (cpu < 0 || cpu >= sys->num_cpus || !(target = sys->cpus[cpu]->rt_sched) ||
+        from < 0 || from >= sys->num_cpus || !(home = sys->cpus[from]->rt_sched)) {
+        RT_SCHED_ERROR("MIGRATE: no scheduler to move thread %p to cpu %d\n", thread->thread, cpu);
+        return -1;
+    }
+
+    if (from == cpu) {
+        return 0;
+    }
+
+    if (thread == home->main_thread || thread->type == SPORADIC ||
+        thread->status == TOBE_REMOVED || thread->status == REMOVED) {
+        RT_SCHED_ERROR("MIGRATE: thread %p cannot change core\n", thread->thread);
+        return -1;
+    }
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+    if (thread->split_cpu >= 0) {
+        return -1;
+    }
+#endif
+#ifdef NAUT_CONFIG_RT_CBS
+    if (thread->server) {
+        return -1;
+    }
+#endif
+
+    if (thread->type == PERIODIC) {
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+        /* jobs already run wherever a core is free */
+        return 0;
+#endif
+        util = thread_util(thread);
+        if (core_per_util(target) + util > PERIODIC_UTIL ||
+            (!nk_topo_same_core(from, cpu) && !smt_admit(cpu, util))) {
+            RT_SCHED_ERROR("MIGRATE: cpu %d cannot admit thread %p\n", cpu, thread->thread);
+            return -1;
+        }
+        atomic_add(target->migrating_in, util);
+        atomic_add(home->migrating_out, util);
+    }
+
+    if (atomic_cmpswap(thread->migrate_cpu, -1, cpu) != -1) {
+        /* already on its way somewhere */
+        atomic_sub(target->migrating_in, util);
+        atomic_sub(home->migrating_out, util);
+        return -1;
     }
+
+    RT_SCHED_DEBUG("MIGRATE: moving thread %p from cpu %d to cpu %d\n", thread->thread, from, cpu);
     return 0;
 }
 
-static inline void update_periodic(rt_thread *t)
+int nk_rt_place(rt_type type, rt_constraints *constraints, uint64_t deadline,
+                rt_place_policy policy, int flags)
 {
-    if (t->type == PERIODIC)
-    {
-        t->deadline  = cur_time() + t->constraints->periodic.period;
-        t->run_time = 0;
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t util = place_util(type, constraints, deadline);
+    int cpu;
+
+    if (type == APERIODIC) {
+        return my_cpu_id();
+    }
+
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+    /* every core shares one run queue, there is nothing to place */
+    return my_cpu_id();
+#else
+    cpu = place_pick(type, util, policy, -1);
+    if (cpu < 0 && type == PERIODIC && (flags & RT_PLACE_REBALANCE)) {
+        cpu = place_rebalance(util, policy);
+    }
+
+    if (cpu < 0) {
+        RT_SCHED_ERROR("PLACE: no core can admit a thread of utilization %llu\n", util);
+        return -1;
+    }
+
+    if (type == PERIODIC) {
+        atomic_add(sys->cpus[cpu]->rt_sched->placed_util, util);
     }
+    return cpu;
+#endif
 }
 
-uint64_t cur_time()
+/* thread was started on the cpu nk_rt_place() reserved for it */
+void rt_thread_placed(rt_thread *thread, int cpu)
 {
-    return rdtsc();
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+    /* nk_rt_place() reserved nothing */
+    return;
+#endif
+    if (thread->type != PERIODIC) {
+        return;
+    }
+    thread->placed_cpu = cpu;
+    thread->placed_util = place_util(PERIODIC, thread->constraints, 0);
 }
 
+/* gives back what rt_thread_placed() recorded, the first time only */
+static void place_release(rt_thread *thread)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    int cpu = thread->placed_cpu;
+
+    if (cpu < 0) {
+        return;
+    }
+    thread->placed_cpu = -1;
+    atomic_sub(sys->cpus[cpu]->rt_sched->placed_util, thread->placed_util);
+    thread->placed_util = 0;
+}
 
-int rt_admit(rt_scheduler *scheduler, rt_thread *thread)
+void nk_rt_unplace(int cpu, rt_type type, rt_constraints *constraints)
 {
-    if (thread->type == PERIODIC)
-    {
-        uint64_t per_util = get_per_util(scheduler->runnable, scheduler->pending);
-        printk("UTIL FACTOR =  \t%llu\n", per_util);
-        
-        if ((per_util + (thread->constraints->periodic.slice * 100000) / thread->constraints->periodic.period) > PERIODIC_UTIL) {
-            RT_SCHED_ERROR("PERIODIC: Admission denied utilization factor overflow!\n");
-            return 0;
-        }
-    } else if (thread->type == SPORADIC)
-    {
-        uint64_t spor_util = get_spor_util(scheduler->runnable);
-        
-        if (spor_util > SPORADIC_UTIL) {
-            RT_SCHED_DEBUG("SPORADIC: Admission denied utilization factor overflow!\n");
-            return 0;
-        }
+    struct sys_info *sys = per_cpu_get(system);
+    rt_scheduler *scheduler = sys->cpus[cpu]->rt_sched;
+    uint64_t util = place_util(type, constraints, 0);
+
+    if (type != PERIODIC || !scheduler) {
+        return;
     }
 
-    return 1;
+    if (scheduler->placed_util >= util) {
+        atomic_sub(scheduler->placed_util, util);
+    }
 }
 
-static inline uint64_t get_avg_per(rt_queue *runnable, rt_queue *pending, rt_thread *new_thread)
+#ifdef NAUT_CONFIG_RT_TASK_SETS
+/*
+ * Task sets. A set of periodic threads is placed as a whole before
+ * any of its threads exist, largest utilization first, so a set that
+ * fits is not turned away for the order its members came in. Every
+ * member gets a placement reservation or none does, and set
+ * placements are made one at a time so two sets never count on the
+ * same room. Each core then admits its members in rt_admit() as
+ * usual, but holds them on its pending queue until the set's start
+ * time instead of making them runnable.
+ */
+static spinlock_t rt_set_lock = SPINLOCK_INITIALIZER;
+
+typedef struct rt_set_order {
+    int index;
+    uint64_t util;
+} rt_set_order;
+
+int rt_set_place(struct nk_rt_set_member *set, int n, rt_place_policy policy)
 {
-    uint64_t sum_period = 0;
-    uint64_t num_periodic = 0;
-    int i;
-    
-    for (i = 0; i < runnable->size; i++)
-    {
-        rt_thread *thread = runnable->threads[i];
-        if (thread->type == PERIODIC) {
-            sum_period += thread->constraints->periodic.period;
-            num_periodic++;
-        }
+    struct sys_info *sys = per_cpu_get(system);
+    rt_set_order *order = (rt_set_order *)malloc(n * sizeof(rt_set_order));
+    rt_set_order key;
+    uint8_t flags;
+    int i, j, cpu;
+
+    if (!order) {
+        RT_SCHED_ERROR("SET: could not allocate the placement order\n");
+        return -1;
     }
-    
-    for (i = 0; i < pending->size; i++)
-    {
-        rt_thread *thread = pending->threads[i];
-        if (thread->type == PERIODIC) {
-            sum_period += thread->constraints->periodic.period;
-            num_periodic++;
+
+    for (i = 0; i < n; i++) {
+        rt_constraints *c = set[i].constraints;
+
+        if (!c || !c->periodic.period || c->periodic.slice > c->periodic.period) {
+            RT_SCHED_ERROR("SET: member %d has no valid periodic constraints\n", i);
+            free(order);
+            return -1;
         }
+        key.index = i;
+        key.util = place_util(PERIODIC, c, 0);
+
+        /* insertion sort, largest first: sets are dozens of threads */
+        for (j = i; j > 0 && order[j - 1].util < key.util; j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = key;
     }
-    
-    if (new_thread->type == PERIODIC)
-    {
-        sum_period += new_thread->constraints->periodic.period;
-        num_periodic++;
-    }
-    
-    sum_period += QUANTUM;
-    num_periodic++;
-    return (sum_period / num_periodic);
-}
 
-static inline uint64_t get_min_per(rt_queue *runnable, rt_queue *pending, rt_thread *thread)
-{
-    uint64_t min_period = 0xFFFFFFFFFFFFFFFF;
-    int i;
-    for (i = 0; i < runnable->size; i++)
-    {
-        rt_thread *thread = runnable->threads[i];
-        if (thread->type == PERIODIC)
-        {
-            min_period = MIN(thread->constraints->periodic.period, min_period);
+    flags = spin_lock_irq_save(&rt_set_lock);
+    for (i = 0; i < n; i++) {
+        cpu = place_pick(PERIODIC, order[i].util, policy, -1);
+        if (cpu < 0) {
+            break;
         }
+        atomic_add(sys->cpus[cpu]->rt_sched->placed_util, order[i].util);
+        set[order[i].index].cpu = cpu;
     }
-    
-    for (i = 0; i < pending->size; i++)
-    {
-        rt_thread *thread = pending->threads[i];
-        if (thread->type == PERIODIC)
-        {
-            min_period = MIN(thread->constraints->periodic.period, min_period);
+    if (i < n) {
+        RT_SCHED_ERROR("SET: no core can admit member %d of utilization %llu\n",
+                       order[i].index, order[i].util);
+        while (i-- > 0) {
+            nk_rt_unplace(set[order[i].index].cpu, PERIODIC, set[order[i].index].constraints);
         }
     }
-    return min_period;
+    spin_unlock_irq_restore(&rt_set_lock, flags);
+
+    j = (i < n) ? -1 : 0;
+    free(order);
+    return j;
 }
 
-static inline uint64_t get_per_util(rt_queue *runnable, rt_queue *pending)
+void rt_set_unplace(struct nk_rt_set_member *set, int n)
 {
-    uint64_t util = 0;
-    
     int i;
-    for (i = 0; i < runnable->size; i++)
-    {
-        rt_thread *thread = runnable->threads[i];
-        if (thread->type == PERIODIC) {
-            util += (thread->constraints->periodic.slice * 100000) / thread->constraints->periodic.period;
-        }
-    }
-    
-    for (i = 0; i < pending->size; i++)
-    {
-        rt_thread *thread = pending->threads[i];
-        if (thread->type == PERIODIC) {
-            util += (thread->constraints->periodic.slice * 100000) / thread->constraints->periodic.period;
-        }
+
+    for (i = 0; i < n; i++) {
+        nk_rt_unplace(set[i].cpu, PERIODIC, set[i].constraints);
     }
-    
-    return util;
 }
 
-static inline uint64_t get_spor_util(rt_queue *runnable)
+void rt_set_submit(int cpu, rt_thread *thread, rt_set *set, uint64_t start)
 {
-    uint64_t util = 0;
-    
-    int i;
-    for (i = 0; i < runnable->size; i++)
-    {
-        rt_thread *thread = runnable->threads[i];
-        if (thread->type == SPORADIC)
-        {
-            util += (thread->constraints->sporadic.work * 100000) / (thread->deadline - cur_time());
-        }
+    rt_thread_placed(thread, cpu);
+    thread->set = set;
+    thread->set_start = start;
+    rt_thread_submit(cpu, thread);
+}
+
+/*
+ * Take back a member that was admitted and is held for the start
+ * time. The flag is all its core looks at before releasing it, and it
+ * is dropped from the pending queue then.
+ */
+void rt_set_withdraw(rt_thread *thread)
+{
+    thread->status = TOBE_REMOVED;
+    mbarrier();
+}
+#endif
+
+#ifdef NAUT_CONFIG_POLL_IO
+/*
+ * Run on the core being reserved, by the thread that will own it.
+ * Placement skips the core from here on; under global EDF it gets a
+ * runnable heap of its own, empty, so shared jobs never land here.
+ * Threads already admitted to the core stay.
+ */
+int nk_rt_reserve_self(void)
+{
+    rt_scheduler *scheduler = per_cpu_get(rt_sched);
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+    rt_queue *own;
+    uint8_t flags;
+#endif
+
+    if (!scheduler) {
+        return -1;
     }
-    return util;
+
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+    if (!(own = rt_queue_create(RUNNABLE_QUEUE))) {
+        return -1;
+    }
+    flags = rt_global_lock();
+    if (queue_keep(own, scheduler->owned)) {
+        rt_global_unlock(flags);
+        rt_queue_destroy(own);
+        return -1;
+    }
+    scheduler->runnable = own;
+    global_edf->running[my_cpu_id()] = RT_NO_DEADLINE;
+    scheduler->reserved = 1;
+    rt_global_unlock(flags);
+#else
+    scheduler->reserved = 1;
+#endif
+
+    return 0;
 }
+#endif
 
 static void test_real_time(void *in)
 {
@@ -1298,12 +5833,11 @@ static void sched_sim(void *scheduler) {
 	}
 	rt_simulator *sim = init_simulator();
 
-    struct sys_info *sys = per_cpu_get(system);
-    rt_scheduler *sched = sys->cpus[my_cpu_id()]->rt_sched;
+    rt_scheduler *sched = per_cpu_get(rt_sched);
 
     while (1) {
         // Admit the new queues
-        rt_thread *new = dequeue_thread(sched->arrival);
+        rt_thread *new = mpsc_take(&sched->arrival);
         if (new != NULL) {
             int admission_check = rt_admit(sched, new);
             if (admission_check) {
@@ -1320,7 +5854,7 @@ static void sched_sim(void *scheduler) {
             if (d->status != REMOVED && e == NULL) {
                 RT_SCHED_ERROR("REMOVING THREAD INCORRECTLY.\n");
             } else {
-                d->status == REMOVED;
+                thread_removed(d);
             }
         }
 
@@ -1357,97 +5891,172 @@ static rt_thread* max_periodic(rt_scheduler *scheduler) {
     return max_thread;
 }
 
-static void copy_threads_sim(rt_simulator *simulator, rt_scheduler *scheduler) {
-    int i;
-    simulator->runnable->size = scheduler->runnable->size;
-    for (i = 0; i < simulator->runnable->size; i++) {
-        rt_thread *s = scheduler->runnable->threads[i];
-        rt_thread_sim *d = (rt_thread_sim *)malloc(sizeof(rt_thread_sim));
-        d->type = s->type;
-        d->q_type = s->q_type;
-        d->status = s->status;
-
-        rt_constraints *constraints = (rt_constraints *)malloc(sizeof(rt_constraints));
-        if (d->type == PERIODIC) {
-            struct periodic_constraints constr = {(s->constraints->periodic.period), (s->constraints->periodic.slice)};
-            constraints->periodic = constr;
-        } else if (d->type == SPORADIC) {
-            struct sporadic_constraints constr = {(s->constraints->sporadic.work)};
-            constraints->sporadic = constr;
-        }
-        d->constraints = constraints;
-        d->start_time = s->start_time;
-        d->run_time = s->run_time;
-        d->deadline = s->deadline;
-        d->exit_time = s->exit_time;
-        simulator->runnable->threads[i] = d;
-    }
-
-    simulator->aperiodic->size = scheduler->aperiodic->size;
-    for (i = 0; i < simulator->aperiodic->size; i++) {
-        rt_thread *s = scheduler->aperiodic->threads[i];
-        rt_thread_sim *d = (rt_thread_sim *)malloc(sizeof(rt_thread_sim));
-        d->type = s->type;
-        d->q_type = s->q_type;
-        d->status = s->status;
-
-        rt_constraints *constraints = (rt_constraints *)malloc(sizeof(rt_constraints));
-        struct aperiodic_constraints constr = {(s->constraints->aperiodic.priority)};
-        constraints->aperiodic = constr;
-
-        d->constraints = constraints;
-        d->start_time = s->start_time;
-        d->run_time = s->run_time;
-        d->deadline = s->deadline;
-        d->exit_time = s->exit_time;
-        simulator->aperiodic->threads[i] = d;
-    }
-
-    simulator->pending->size = scheduler->pending->size;
-    for (i = 0; i < simulator->pending->size; i++) {
-        rt_thread *s = scheduler->pending->threads[i];
-        rt_thread_sim *d = (rt_thread_sim *)malloc(sizeof(rt_thread_sim));
-        d->type = s->type;
-        d->q_type = s->q_type;
-        d->status = s->status;
-
-        rt_constraints *constraints = (rt_constraints *)malloc(sizeof(rt_constraints));
-        if (d->type == PERIODIC) {
-            struct periodic_constraints constr = {(s->constraints->periodic.period), (s->constraints->periodic.slice)};
-            constraints->periodic = constr;
-        } else if (d->type == SPORADIC) {
-            struct sporadic_constraints constr = {(s->constraints->sporadic.work)};
-            constraints->sporadic = constr;
-        }
+static rt_thread_sim* sim_get(rt_simulator *simulator)
+{
+    rt_thread_sim *d;
 
-        d->constraints = constraints;
-        d->start_time = s->start_time;
-        d->run_time = s->run_time;
-        d->deadline = s->deadline;
-        d->exit_time = s->exit_time;
-        simulator->pending->threads[i] = d;
+    if (simulator->used >= MAX_QUEUE) {
+        RT_SCHED_ERROR("Simulator pool exhausted\n");
+        return NULL;
     }
+    d = &simulator->pool[simulator->used++];
+    memset(d, 0, sizeof(rt_thread_sim));
+    return d;
 }
 
-static void free_threads_sim(rt_simulator *simulator) {
-    int i = 0;
-    for (i = 0; i < simulator->runnable->size; i++) {
-        free(simulator->runnable->threads[i]->constraints);
-        free(simulator->runnable->threads[i]);
+/*
+ * Copy one thread's current job into the simulator. A periodic thread
+ * waiting in pending has its next release in deadline, which is also
+ * what the simulated pending queue is keyed on.
+ */
+static int copy_thread_sim(rt_simulator *simulator, rt_thread *s, uint64_t now, uint64_t overhead)
+{
+    rt_thread_sim *d;
+
+    if (s->type == PERIODIC && s->constraints->periodic.period == 0) {
+        return 0;
+    }
+    if (!(d = sim_get(simulator))) {
+        return -1;
     }
-    simulator->runnable->size = 0;
 
-    for (i = 0; i < simulator->aperiodic->size; i++) {
-        free(simulator->aperiodic->threads[i]->constraints);
-        free(simulator->aperiodic->threads[i]);
+    d->type = s->type;
+    d->status = s->status;
+    d->constraints = *s->constraints;
+    d->start_time = s->start_time;
+    d->exit_time = s->exit_time;
+    d->deadline = s->deadline;
+
+    if (s->type == SPORADIC) {
+        d->budget = s->constraints->sporadic.work;
+        d->run_time = MIN(s->run_time, d->budget);
+        enqueue_thread_logic(simulator->runnable, d);
+        return 0;
     }
-    simulator->aperiodic->size = 0;
 
-    for (i = 0; i < simulator->pending->size; i++) {
-        free(simulator->pending->threads[i]->constraints);
-        free(simulator->pending->threads[i]);
+    d->budget = periodic_budget(s) + overhead;
+    if (s->q_type == PENDING_QUEUE && s->q_index != RT_NOT_QUEUED) {
+        d->deadline = MAX(s->deadline, now);
+        enqueue_thread_logic(simulator->pending, d);
+        return 0;
     }
+
+    if (s->deadline > now) {
+        d->run_time = MIN(s->run_time, d->budget);
+    } else {
+        /* current job already missed, it is handled by the miss path */
+        d->deadline = now + d->constraints.periodic.period;
+    }
+    d->release = (d->deadline > d->constraints.periodic.period) ? d->deadline - d->constraints.periodic.period : 0;
+    enqueue_thread_logic(simulator->runnable, d);
+    return 0;
+}
+
+static int copy_queue_sim(rt_simulator *simulator, rt_queue *queue, uint64_t now, uint64_t overhead)
+{
+    uint64_t i;
+
+    for (i = 0; i < queue->size; i++) {
+        rt_thread *s = queue->threads[i];
+
+        if (s->type == APERIODIC || s->status == TOBE_REMOVED) {
+            continue;
+        }
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+        if (s->split_cpu >= 0) {
+            continue;
+        }
+#endif
+#ifdef NAUT_CONFIG_RT_CBS
+        if (s->server) {
+            continue;
+        }
+#endif
+        if (copy_thread_sim(simulator, s, now, overhead)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Load the real-time work on a core into the simulator: every job on
+ * its runnable and pending queues, the thread it is running, and one
+ * periodic task of period QUANTUM standing in for capacity reserved
+ * by servers, split threads and placements. Aperiodic threads only
+ * run when nothing else can, so they are left out. Simulated threads
+ * come from the pool, nothing is allocated.
+ */
+static int copy_threads_sim(rt_simulator *simulator, rt_scheduler *scheduler)
+{
+    uint64_t overhead = 2 * sched_overhead(scheduler);
+    uint64_t now = cur_time();
+    uint64_t reserved;
+    rt_thread_sim *d;
+
+    free_threads_sim(simulator);
+
+    if (copy_queue_sim(simulator, scheduler->runnable, now, overhead) ||
+        copy_queue_sim(simulator, scheduler->pending, now, overhead)) {
+        return -1;
+    }
+
+    if (per_cpu_get(rt_sched) == scheduler) {
+        rt_thread *c = get_cur_thread()->rt_thread;
+
+        if (c && c->type != APERIODIC && c->status == RUNNING && c->q_index == RT_NOT_QUEUED
+#ifdef NAUT_CONFIG_RT_CBS
+            && !c->server
+#endif
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+            && c->split_cpu < 0
+#endif
+            ) {
+            uint64_t run_time = c->run_time;
+            int rc;
+
+            /* count the part of its slice it is in the middle of */
+            if (c->start_time < now) {
+                c->run_time += now - c->start_time;
+            }
+            rc = copy_thread_sim(simulator, c, now, overhead);
+            c->run_time = run_time;
+            if (rc) {
+                return -1;
+            }
+        }
+    }
+
+    reserved = scheduler->placed_util + scheduler->migrating_in;
+#ifdef NAUT_CONFIG_RT_CBS
+    reserved += scheduler->server_util;
+#endif
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+    reserved += scheduler->split_util;
+#endif
+    if (reserved) {
+        if (!(d = sim_get(simulator))) {
+            return -1;
+        }
+        d->type = PERIODIC;
+        d->status = ADMITTED;
+        d->constraints.periodic.period = QUANTUM;
+        d->constraints.periodic.slice = (MIN(reserved, 100000) * QUANTUM) / 100000;
+        d->budget = d->constraints.periodic.slice;
+        d->release = now;
+        d->deadline = now + QUANTUM;
+        enqueue_thread_logic(simulator->runnable, d);
+    }
+    return 0;
+}
+
+/* return every simulated thread to the pool */
+static void free_threads_sim(rt_simulator *simulator)
+{
+    simulator->runnable->size = 0;
+    simulator->aperiodic->size = 0;
     simulator->pending->size = 0;
+    simulator->used = 0;
 }
 
 static rt_thread_sim* rt_need_resched_logic(rt_simulator *simulator, rt_thread_sim *thread, uint64_t time)
@@ -1468,7 +6077,7 @@ static rt_thread_sim* rt_need_resched_logic(rt_simulator *simulator, rt_thread_s
     
     switch (thread->type) {
         case APERIODIC:
-            thread->constraints->aperiodic.priority = thread->run_time;
+            thread->constraints.aperiodic.priority = thread->run_time;
             
             if (simulator->runnable->size > 0)
             {
@@ -1486,7 +6095,7 @@ static rt_thread_sim* rt_need_resched_logic(rt_simulator *simulator, rt_thread_s
             break;
             
         case SPORADIC:
-            if (thread->run_time >= thread->constraints->sporadic.work) {
+            if (thread->run_time >= thread->constraints.sporadic.work) {
                 if (simulator->runnable->size > 0) {
                     next = dequeue_thread_logic(simulator->runnable);
                     set_timer_logic(simulator, next, time);
@@ -1512,7 +6121,7 @@ static rt_thread_sim* rt_need_resched_logic(rt_simulator *simulator, rt_thread_s
             break;
             
         case PERIODIC:
-            if (thread->run_time >= thread->constraints->periodic.slice) {
+            if (thread->run_time >= thread->constraints.periodic.slice) {
                 if (check_deadlines_logic(thread, time)) {
                     update_periodic_logic(thread, time);
                     enqueue_thread_logic(simulator->runnable, thread);
@@ -1569,7 +6178,7 @@ static inline void update_periodic_logic(rt_thread_sim *t, uint64_t time)
 {
     if (t->type == PERIODIC)
     {
-        t->deadline  = time + t->constraints->periodic.period;
+        t->deadline  = time + t->constraints.periodic.period;
         t->run_time = 0;
     }
 }
@@ -1580,7 +6189,7 @@ static uint64_t set_timer_logic(rt_simulator *simulator, rt_thread_sim *thread,
         rt_thread_sim *next = simulator->pending->threads[0];
         if (thread->type == PERIODIC)
         {
-            return umin(next->deadline - time, (thread->constraints->periodic.slice - thread->run_time));
+            return umin(next->deadline - time, (thread->constraints.periodic.slice - thread->run_time));
         } else
         {
             return umin(next->deadline - time, QUANTUM);
@@ -1588,7 +6197,7 @@ static uint64_t set_timer_logic(rt_simulator *simulator, rt_thread_sim *thread,
     } else if (simulator->pending->size == 0 && thread) {
         if (thread->type == PERIODIC)
         {
-            return (thread->constraints->periodic.slice - thread->run_time);
+            return (thread->constraints.periodic.slice - thread->run_time);
         } else {
             return QUANTUM;
         }
@@ -1660,15 +6269,67 @@ static inline uint64_t umin(uint64_t x, uint64_t y)
     return (x < y) ? x : y;
 }
 
-void rt_thread_exit(rt_thread *thread) {
+int rt_thread_exit(rt_thread *thread) {
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+    rt_global_release(thread);
+#endif
     thread->status = TOBE_REMOVED;
     struct sys_info *sys = per_cpu_get(system);
-    rt_scheduler *sched = sys->cpus[my_cpu_id()]->rt_sched;
-    enqueue_thread(sched->exited, thread);
-}
+    rt_scheduler *sched = per_cpu_get(rt_sched);
+    rt_queue *queue = thread_queue(sched, thread);
+    int to = thread->migrate_cpu;
+
+    place_release(thread);
+
+    /*
+     * A move that will not happen now. It is still on the core it was
+     * leaving, so both ends hold its utilization.
+     */
+    if (to >= 0 && atomic_cmpswap(thread->migrate_cpu, to, -1) == to &&
+        thread->type == PERIODIC) {
+        uint64_t util = thread_util(thread);
+
+        atomic_sub(sys->cpus[to]->rt_sched->migrating_in, util);
+        atomic_sub(sys->cpus[thread->thread->bound_cpu]->rt_sched->migrating_out, util);
+    }
 
-void rt_thread_free(rt_thread *thread) {
+#ifdef NAUT_CONFIG_RT_CBS
+    if (thread->server) {
+        /* dropped from the member ring when it comes up */
+        thread->server->num_members--;
+#ifdef NAUT_CONFIG_RT_GROUPS
+        if (thread->type == PERIODIC) {
+            group_release(thread->server, thread->constraints->periodic.slice,
+                          thread->constraints->periodic.period);
+        }
+#endif
+    }
+#endif
 
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+    if (queue == global_edf->runnable) {
+        /* shared heap, left to be dropped when it is dequeued */
+        queue = NULL;
+    }
+#endif
+    /* stop counting it now rather than when it is finally dequeued */
+    if (queue && is_accounted_queue(queue->type) && thread->q_index < queue->size &&
+        queue->threads[thread->q_index] == thread) {
+        queue_unaccount(queue, thread);
+    }
+#ifdef NAUT_CONFIG_RT_MIXED_CRITICALITY
+    mc_reserve(sched, thread, 0);
+#endif
+#ifdef NAUT_CONFIG_RT_SEMI_PARTITIONED
+    if (thread->split_cpu >= 0) {
+        atomic_sub(sys->cpus[thread->split_home]->rt_sched->split_util, thread->split_home_util);
+        atomic_sub(sys->cpus[thread->split_cpu]->rt_sched->split_util, thread->split_util);
+        thread->split_cpu = -1;
+    }
+#endif
+    enqueue_thread(sched->exited, thread);
+    demand_changed(sched);
+    return 0;
 }
 
 
@@ -1676,3 +6337,4 @@ void rt_thread_free(rt_thread *thread) {
 
 
 
+
@@ -0,0 +1,225 @@
+//
+//  rt_wheel.c
+//
+//  Hierarchical timing wheel for the real-time scheduler.
+//
+//  Time is counted in ticks of 2^RT_WHEEL_SHIFT TSC cycles. Level L
+//  has RT_WHEEL_SIZE slots of 2^(L * RT_WHEEL_BITS) ticks each, so a
+//  thread due within 64 ticks sits directly on level 0 and threads
+//  further out sit on higher levels until the wheel reaches their
+//  slot, at which point they are cascaded down. Insertion and removal
+//  are O(1). Per-level occupancy bitmaps let the wheel jump straight
+//  to the next tick that has work instead of stepping through empty
+//  ones, which is what allows the scheduler to stay tickless.
+//
+
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/rt_scheduler.h>
+#include <nautilus/rt_wheel.h>
+
+#define RT_WHEEL_ERROR(fmt, args...) printk("RT WHEEL ERROR: " fmt, ##args)
+
+#define LEVEL_SHIFT(l) ((l) * RT_WHEEL_BITS)
+#define LEVEL_MASK(l)  ((1ULL << LEVEL_SHIFT(l)) - 1)
+#define WHEEL_SPAN     ((1ULL << LEVEL_SHIFT(RT_WHEEL_LEVELS)) - 1)
+
+static inline uint64_t rotr64(uint64_t x, uint64_t n)
+{
+    return n ? ((x >> n) | (x << (64 - n))) : x;
+}
+
+static void wheel_insert(rt_wheel *wheel, rt_thread *thread)
+{
+    uint64_t ticks = thread->wheel_expiry >> RT_WHEEL_SHIFT;
+    uint64_t delta, slot;
+    int level;
+
+    if (ticks < wheel->now) {
+        ticks = wheel->now;
+    }
+
+    delta = ticks - wheel->now;
+    if (delta > WHEEL_SPAN) {
+        /* parked on the top level, re-filed when it cascades */
+        delta = WHEEL_SPAN;
+        ticks = wheel->now + WHEEL_SPAN;
+    }
+
+    for (level = 0; level < RT_WHEEL_LEVELS - 1; level++) {
+        if (delta < (1ULL << LEVEL_SHIFT(level + 1))) {
+            break;
+        }
+    }
+
+    slot = (ticks >> LEVEL_SHIFT(level)) & RT_WHEEL_MASK;
+    list_add_tail(&thread->wheel_node, &wheel->slots[level][slot]);
+    wheel->bitmap[level] |= (1ULL << slot);
+    thread->wheel_slot = level * RT_WHEEL_SIZE + slot;
+    wheel->count++;
+}
+
+static void wheel_cascade(rt_wheel *wheel, int level, uint64_t slot)
+{
+    struct list_head moving;
+    rt_thread *thread, *next;
+
+    INIT_LIST_HEAD(&moving);
+    list_splice_init(&wheel->slots[level][slot], &moving);
+    wheel->bitmap[level] &= ~(1ULL << slot);
+
+    list_for_each_entry_safe(thread, next, &moving, wheel_node) {
+        list_del_init(&thread->wheel_node);
+        wheel->count--;
+        wheel_insert(wheel, thread);
+    }
+}
+
+/*
+ * First tick >= wheel->now at which something happens: a level 0
+ * slot comes due, or an occupied slot on a higher level is cascaded.
+ * A higher level slot is cascaded when the low LEVEL_SHIFT(level)
+ * bits of the tick are zero, so if we are already past that point in
+ * the current slot its next cascade is a full lap away.
+ */
+static uint64_t wheel_next_tick(rt_wheel *wheel)
+{
+    uint64_t best = (uint64_t)-1;
+    uint64_t bits, idx, k, tick;
+    int level;
+
+    for (level = 0; level < RT_WHEEL_LEVELS; level++) {
+        if (!wheel->bitmap[level]) {
+            continue;
+        }
+
+        idx = (wheel->now >> LEVEL_SHIFT(level)) & RT_WHEEL_MASK;
+        bits = rotr64(wheel->bitmap[level], idx);
+
+        if (level > 0 && (wheel->now & LEVEL_MASK(level)) && (bits & 1)) {
+            bits &= ~1ULL;
+            k = bits ? __builtin_ctzll(bits) : RT_WHEEL_SIZE;
+        } else {
+            k = __builtin_ctzll(bits);
+        }
+
+        if (level == 0) {
+            tick = wheel->now + k;
+        } else {
+            tick = ((wheel->now >> LEVEL_SHIFT(level)) + k) << LEVEL_SHIFT(level);
+        }
+
+        if (tick < best) {
+            best = tick;
+        }
+    }
+    return best;
+}
+
+static uint64_t wheel_process_tick(rt_wheel *wheel, struct list_head *expired)
+{
+    uint64_t tick = wheel->now;
+    uint64_t slot = tick & RT_WHEEL_MASK;
+    uint64_t n = 0;
+    rt_thread *thread, *next;
+    int level;
+
+    for (level = 1; level < RT_WHEEL_LEVELS; level++) {
+        if (tick & LEVEL_MASK(level)) {
+            break;
+        }
+        wheel_cascade(wheel, level, (tick >> LEVEL_SHIFT(level)) & RT_WHEEL_MASK);
+    }
+
+    list_for_each_entry_safe(thread, next, &wheel->slots[0][slot], wheel_node) {
+        list_move_tail(&thread->wheel_node, expired);
+        n++;
+    }
+    wheel->bitmap[0] &= ~(1ULL << slot);
+    wheel->count -= n;
+    return n;
+}
+
+rt_wheel* rt_wheel_create(uint64_t now)
+{
+    rt_wheel *wheel = (rt_wheel *)malloc(sizeof(rt_wheel));
+    int level, slot;
+
+    if (!wheel) {
+        RT_WHEEL_ERROR("Could not allocate timer wheel\n");
+        return NULL;
+    }
+
+    memset(wheel, 0, sizeof(rt_wheel));
+    for (level = 0; level < RT_WHEEL_LEVELS; level++) {
+        for (slot = 0; slot < RT_WHEEL_SIZE; slot++) {
+            INIT_LIST_HEAD(&wheel->slots[level][slot]);
+        }
+    }
+    wheel->now = now >> RT_WHEEL_SHIFT;
+    return wheel;
+}
+
+void rt_wheel_destroy(rt_wheel *wheel)
+{
+    free(wheel);
+}
+
+int rt_wheel_pending(rt_thread *thread)
+{
+    return !list_empty(&thread->wheel_node);
+}
+
+void rt_wheel_add(rt_wheel *wheel, rt_thread *thread, uint64_t expiry)
+{
+    if (rt_wheel_pending(thread)) {
+        rt_wheel_remove(wheel, thread);
+    }
+    thread->wheel_expiry = expiry;
+    wheel_insert(wheel, thread);
+}
+
+void rt_wheel_remove(rt_wheel *wheel, rt_thread *thread)
+{
+    uint64_t level = thread->wheel_slot / RT_WHEEL_SIZE;
+    uint64_t slot = thread->wheel_slot % RT_WHEEL_SIZE;
+
+    if (!rt_wheel_pending(thread)) {
+        return;
+    }
+
+    list_del_init(&thread->wheel_node);
+    if (list_empty(&wheel->slots[level][slot])) {
+        wheel->bitmap[level] &= ~(1ULL << slot);
+    }
+    wheel->count--;
+}
+
+uint64_t rt_wheel_advance(rt_wheel *wheel, uint64_t now, struct list_head *expired)
+{
+    uint64_t target = now >> RT_WHEEL_SHIFT;
+    uint64_t n = 0, tick;
+
+    while (wheel->count) {
+        tick = wheel_next_tick(wheel);
+        if (tick > target) {
+            break;
+        }
+        wheel->now = tick;
+        n += wheel_process_tick(wheel, expired);
+        wheel->now = tick + 1;
+    }
+
+    if (wheel->now <= target) {
+        wheel->now = target + 1;
+    }
+    return n;
+}
+
+uint64_t rt_wheel_next(rt_wheel *wheel)
+{
+    if (!wheel->count) {
+        return 0;
+    }
+    return wheel_next_tick(wheel) << RT_WHEEL_SHIFT;
+}
@@ -26,6 +26,9 @@
 #include <nautilus/intrinsics.h>
 #include <nautilus/thread.h>
 #include <nautilus/mm.h>
+#include <nautilus/atomic.h>
+#include <nautilus/percpu.h>
+#include <nautilus/smp.h>
 
 #ifndef NAUT_CONFIG_DEBUG_SYNCH
 #undef DEBUG_PRINT
@@ -143,6 +146,139 @@ nk_rwlock_wr_unlock_irq_restore (nk_rwlock_t * l, uint8_t flags)
 }
 
 
+extern uint8_t cpu_info_ready;
+
+int
+nk_brlock_init (nk_brlock_t * l)
+{
+    uint32_t n = cpu_info_ready ? nk_get_num_cpus() : NAUT_CONFIG_MAX_CPUS;
+
+    DEBUG_PRINT("brlock init (%p, %u cpus)\n", (void*)l, n);
+
+    l->cpus = malloc(sizeof(struct nk_brlock_cpu) * n);
+    if (!l->cpus) {
+        ERROR_PRINT("Could not allocate brlock reader counts\n");
+        return -1;
+    }
+    memset(l->cpus, 0, sizeof(struct nk_brlock_cpu) * n);
+
+    l->ncpus  = n;
+    l->writer = 0;
+    spinlock_init(&l->wlock);
+    return 0;
+}
+
+
+void
+nk_brlock_deinit (nk_brlock_t * l)
+{
+    free(l->cpus);
+    l->cpus  = NULL;
+    l->ncpus = 0;
+}
+
+
+/*
+ * The increment of the local count and the check of the writer word
+ * pair up with the writer setting its word and then scanning the
+ * counts: the locked add and the writer's mfence order both sides,
+ * so at least one of them sees the other.
+ */
+int
+nk_brlock_rd_lock (nk_brlock_t * l)
+{
+    int slot;
+
+    NK_PROFILE_ENTRY();
+
+    while (1) {
+        slot = cpu_info_ready ? (int)(my_cpu_id() % l->ncpus) : 0;
+
+        atomic_inc(l->cpus[slot].readers);
+
+        if (likely(!l->writer)) {
+            break;
+        }
+
+        /* a writer is in or pending; back off until it is done */
+        atomic_dec(l->cpus[slot].readers);
+        PAUSE_WHILE(l->writer);
+    }
+
+    NK_PROFILE_EXIT();
+    return slot;
+}
+
+
+void
+nk_brlock_rd_unlock (nk_brlock_t * l, int slot)
+{
+    NK_PROFILE_ENTRY();
+    atomic_dec(l->cpus[slot].readers);
+    NK_PROFILE_EXIT();
+}
+
+
+static inline void
+brlock_drain_readers (nk_brlock_t * l)
+{
+    uint32_t i;
+
+    l->writer = 1;
+    mbarrier();
+
+    for (i = 0; i < l->ncpus; i++) {
+        PAUSE_WHILE(l->cpus[i].readers);
+    }
+}
+
+
+void
+nk_brlock_wr_lock (nk_brlock_t * l)
+{
+    NK_PROFILE_ENTRY();
+    DEBUG_PRINT("brlock write lock: %p\n", (void*)l);
+    spin_lock(&l->wlock);
+    brlock_drain_readers(l);
+    NK_PROFILE_EXIT();
+}
+
+
+void
+nk_brlock_wr_unlock (nk_brlock_t * l)
+{
+    NK_PROFILE_ENTRY();
+    DEBUG_PRINT("brlock write unlock: %p\n", (void*)l);
+    l->writer = 0;
+    spin_unlock(&l->wlock);
+    NK_PROFILE_EXIT();
+}
+
+
+uint8_t
+nk_brlock_wr_lock_irq_save (nk_brlock_t * l)
+{
+    uint8_t flags;
+    NK_PROFILE_ENTRY();
+    DEBUG_PRINT("brlock write lock (irq): %p\n", (void*)l);
+    flags = spin_lock_irq_save(&l->wlock);
+    brlock_drain_readers(l);
+    NK_PROFILE_EXIT();
+    return flags;
+}
+
+
+void
+nk_brlock_wr_unlock_irq_restore (nk_brlock_t * l, uint8_t flags)
+{
+    NK_PROFILE_ENTRY();
+    DEBUG_PRINT("brlock write unlock (irq): %p\n", (void*)l);
+    l->writer = 0;
+    spin_unlock_irq_restore(&l->wlock, flags);
+    NK_PROFILE_EXIT();
+}
+
+
 static void 
 reader1 (void * in, void ** out) 
 {
@@ -171,6 +171,7 @@ parse_sfi_cpu (struct sfi_cpu_tbl * tbl, struct sys_info * sys)
             panic("Couldn't allocate new CPU struct (%u)\n", sys->num_cpus);
         }
         memset(new_cpu, 0, sizeof(struct cpu));
+        new_cpu->self = new_cpu;
 
         if (apicid == get_my_apicid()) { 
             new_cpu->is_bsp = 1;
@@ -35,10 +35,22 @@
 #include <nautilus/numa.h>
 #include <nautilus/mm.h>
 #include <nautilus/percpu.h>
+#include <nautilus/cpuid.h>
+#include <nautilus/limits.h>
+#include <nautilus/intrinsics.h>
+#include <nautilus/trace.h>
 #include <dev/ioapic.h>
 #include <dev/apic.h>
 #include <dev/timer.h>
 
+#ifdef NAUT_CONFIG_THREAD_LAZY_STACKS
+#include <nautilus/tss.h>
+#endif
+
+#ifdef NAUT_CONFIG_TLB_SHOOTDOWN
+#include <nautilus/tlb.h>
+#endif
+
 #ifndef NAUT_CONFIG_DEBUG_SMP
 #undef DEBUG_PRINT
 #define DEBUG_PRINT(fmt, args...)
@@ -58,6 +70,192 @@ extern addr_t end_smp_boot;
 uint8_t cpu_info_ready = 0;
 
 
+#ifdef NAUT_CONFIG_TSC_SYNC
+/*
+ * TSC synchronization. As each AP comes up the BSP plays ping-pong
+ * with it: the BSP reads its TSC and posts a ping, the AP answers with
+ * its own TSC, and the BSP reads its TSC again. The AP's reading was
+ * taken somewhere between the BSP's two, which bounds the skew, and
+ * the bounds from every round are intersected. If the bounds exclude
+ * zero and the AP has IA32_TSC_ADJUST, the AP moves its TSC by the
+ * midpoint and the skew is measured again.
+ *
+ * Commands go in one cache line and answers in another, so each
+ * round costs two line transfers.
+ */
+#define TSC_SYNC_ROUNDS 64
+
+#define TSC_SYNC_PING   1
+#define TSC_SYNC_ADJUST 2
+#define TSC_SYNC_DONE   3
+
+static struct {
+    volatile uint32_t seq;
+    volatile uint32_t op;
+    volatile sint64_t adjust;
+} __align(64) tsc_cmd;
+
+static struct {
+    volatile uint32_t seq;
+    volatile uint64_t tsc;
+} __align(64) tsc_ack;
+
+static uint64_t tsc_skew_bound = 0;
+
+#ifdef NAUT_CONFIG_SMP_PARALLEL_BOOT
+/* the core the BSP syncs next when all came up together, -1 once it has answered */
+static volatile int tsc_turn = -1;
+#endif
+
+
+/* rdtsc may otherwise run ahead of the loads and stores around it */
+static inline uint64_t
+tsc_read_ordered (void)
+{
+    uint64_t t;
+
+    asm volatile ("lfence" ::: "memory");
+    t = rdtsc();
+    asm volatile ("lfence" ::: "memory");
+
+    return t;
+}
+
+
+static uint8_t
+tsc_adjust_avail (void)
+{
+    cpuid_ret_t ret;
+
+    cpuid(0, &ret);
+    if (ret.a < 7) {
+        return 0;
+    }
+
+    cpuid_sub(7, 0, &ret);
+    return (ret.b >> 1) & 1;
+}
+
+
+/* the AP's side, seq is the command count from before it said it booted */
+static void
+tsc_sync_ap (uint32_t seq)
+{
+    while (1) {
+        BARRIER_WHILE(tsc_cmd.seq == seq);
+        seq = tsc_cmd.seq;
+
+        switch (tsc_cmd.op) {
+            case TSC_SYNC_PING:
+                tsc_ack.tsc = tsc_read_ordered();
+                break;
+            case TSC_SYNC_ADJUST:
+                msr_write(IA32_MSR_TSC_ADJUST, msr_read(IA32_MSR_TSC_ADJUST) - tsc_cmd.adjust);
+                break;
+            case TSC_SYNC_DONE:
+                tsc_ack.seq = seq;
+                return;
+        }
+
+        tsc_ack.seq = seq;
+    }
+}
+
+
+static void
+tsc_sync_post (uint32_t op)
+{
+    uint32_t seq = tsc_cmd.seq + 1;
+
+    tsc_cmd.op  = op;
+    tsc_cmd.seq = seq;
+    BARRIER_WHILE(tsc_ack.seq != seq);
+}
+
+
+static void
+tsc_sync_measure (struct cpu * core)
+{
+    sint64_t lo = LLONG_MIN;
+    sint64_t hi = LLONG_MAX;
+    uint64_t t0, t1;
+    int i;
+
+    for (i = 0; i < TSC_SYNC_ROUNDS; i++) {
+        t0 = tsc_read_ordered();
+        tsc_sync_post(TSC_SYNC_PING);
+        t1 = tsc_read_ordered();
+
+        if ((sint64_t)(tsc_ack.tsc - t1) > lo) {
+            lo = tsc_ack.tsc - t1;
+        }
+        if ((sint64_t)(tsc_ack.tsc - t0) < hi) {
+            hi = tsc_ack.tsc - t0;
+        }
+    }
+
+    core->tsc_skew_lo = lo;
+    core->tsc_skew_hi = hi;
+}
+
+
+/* the BSP's side, once core has set its boot flag */
+static void
+tsc_sync_bsp (struct cpu * core, uint8_t can_adjust)
+{
+    uint8_t flags = irq_disable_save();
+    sint64_t mid;
+
+    tsc_sync_measure(core);
+
+    if (can_adjust && (core->tsc_skew_lo > 0 || core->tsc_skew_hi < 0)) {
+        mid = core->tsc_skew_lo + (core->tsc_skew_hi - core->tsc_skew_lo) / 2;
+        SMP_DEBUG("Adjusting TSC of core %u by %ld cycles\n", core->id, -mid);
+        tsc_cmd.adjust = mid;
+        tsc_sync_post(TSC_SYNC_ADJUST);
+        tsc_sync_measure(core);
+    }
+
+    tsc_sync_post(TSC_SYNC_DONE);
+
+    irq_enable_restore(flags);
+
+    SMP_PRINT("Core %u TSC skew in [%ld, %ld] cycles\n", core->id, core->tsc_skew_lo, core->tsc_skew_hi);
+}
+
+
+/* sync core and widen [lo, hi] to take in its skew */
+static void
+tsc_sync_core (struct cpu * core, uint8_t can_adjust, sint64_t * lo, sint64_t * hi)
+{
+    tsc_sync_bsp(core, can_adjust);
+
+    if (core->tsc_skew_lo < *lo) {
+        *lo = core->tsc_skew_lo;
+    }
+    if (core->tsc_skew_hi > *hi) {
+        *hi = core->tsc_skew_hi;
+    }
+}
+
+
+sint64_t
+nk_tsc_skew (cpu_id_t cpu)
+{
+    struct cpu * core = per_cpu_get(system)->cpus[cpu];
+
+    return core->tsc_skew_lo + (core->tsc_skew_hi - core->tsc_skew_lo) / 2;
+}
+
+
+uint64_t
+nk_tsc_skew_bound (void)
+{
+    return tsc_skew_bound;
+}
+#endif
+
+
 
 int 
 smp_early_init (struct naut_info * naut)
@@ -115,6 +313,162 @@ smp_wait_for_ap (struct naut_info * naut, unsigned int core_num)
 }
 
 
+#ifdef NAUT_CONFIG_SMP_PARALLEL_BOOT
+static volatile unsigned smp_ap_booted = 0;
+
+/*
+ * Boots every AP at once with a broadcast INIT-SIPI-SIPI. The APs all
+ * run the trampoline together, so each finds its boot stack and cpu
+ * in tables indexed by the initial APIC ID it reads with CPUID; a
+ * core that is not in the tables (e.g. disabled in the MADT) parks
+ * itself. We then wait on a single count of booted APs.
+ *
+ * Returns -1 without sending anything if the APIC IDs don't fit in
+ * the tables, so the caller can boot the cores one at a time.
+ */
+static int
+smp_bringup_aps_parallel (struct naut_info * naut,
+                          struct ap_init_area * ap_area,
+                          struct apic_dev * apic,
+                          uint8_t target_vec,
+                          int maxlvt)
+{
+    struct sys_info * sys = &naut->sys;
+    uint64_t * stacks = NULL;
+    struct cpu ** cpus = NULL;
+    int status = 0;
+    int err = 0;
+    int i, j;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        if (sys->cpus[i]->lapic_id >= AP_MAX_APIC_ID) {
+            SMP_PRINT("APIC ID %u too large for parallel boot, booting cores one at a time\n",
+                      sys->cpus[i]->lapic_id);
+            return -1;
+        }
+    }
+
+    stacks = malloc(AP_MAX_APIC_ID * sizeof(uint64_t));
+    cpus   = malloc(AP_MAX_APIC_ID * sizeof(struct cpu *));
+    if (!stacks || !cpus) {
+        ERROR_PRINT("Could not allocate AP boot tables\n");
+        goto out_err;
+    }
+    memset(stacks, 0, AP_MAX_APIC_ID * sizeof(uint64_t));
+    memset(cpus, 0, AP_MAX_APIC_ID * sizeof(struct cpu *));
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        void * stack;
+
+        if (sys->cpus[i]->is_bsp) {
+            continue;
+        }
+
+        stack = malloc(AP_BOOT_STACK_SIZE);
+        if (!stack) {
+            ERROR_PRINT("Could not allocate boot stack for core %u\n", i);
+            goto out_err;
+        }
+
+        stacks[sys->cpus[i]->lapic_id] = (uint64_t)stack + AP_BOOT_STACK_SIZE;
+        cpus[sys->cpus[i]->lapic_id]   = sys->cpus[i];
+    }
+
+    if (init_ap_area(ap_area, naut, sys->bsp_id) == -1) {
+        ERROR_PRINT("Error initializing ap area\n");
+        goto out_err;
+    }
+
+    ap_area->stacks = stacks;
+    ap_area->cpus   = cpus;
+    mbarrier();
+
+    SMP_DEBUG("Broadcasting INIT to all APs\n");
+    apic_bcast_iipi(apic);
+    status = apic_wait_for_send(apic);
+    mbarrier();
+
+    /* 10ms delay */
+    udelay(10000);
+
+    apic_bcast_deinit_iipi(apic);
+
+    for (j = 1; j <= 2; j++) {
+        if (maxlvt > 3) {
+            apic_write(apic, APIC_REG_ESR, 0);
+        }
+        apic_read(apic, APIC_REG_ESR);
+
+        SMP_DEBUG("Broadcasting SIPI %u (vec=%x)\n", j, target_vec);
+        apic_bcast_sipi(apic, target_vec);
+
+        udelay(300);
+
+        status = apic_wait_for_send(apic);
+
+        udelay(200);
+
+        err = apic_read(apic, APIC_REG_ESR) & 0xef;
+
+        if (status || err) {
+            break;
+        }
+
+        /* a core that has started ignores the second SIPI anyway */
+        if (smp_ap_booted == sys->num_cpus - 1) {
+            break;
+        }
+    }
+
+    if (status) {
+        ERROR_PRINT("APIC wasn't delivered!\n");
+    }
+
+    if (err) {
+        ERROR_PRINT("ERROR delivering SIPI\n");
+    }
+
+#ifdef NAUT_CONFIG_XEON_PHI
+    while (smp_ap_booted != sys->num_cpus - 1) {
+        udelay(1);
+    }
+#else
+    BARRIER_WHILE(smp_ap_booted != sys->num_cpus - 1);
+#endif
+
+    /*
+     * The APs are on their thread stacks before they count themselves,
+     * so the boot stacks can go. The tables stay: a parked core may
+     * still be on its way to reading them.
+     */
+    for (i = 0; i < AP_MAX_APIC_ID; i++) {
+        if (stacks[i]) {
+            free((void*)(stacks[i] - AP_BOOT_STACK_SIZE));
+            stacks[i] = 0;
+        }
+    }
+
+    SMP_DEBUG("%u APs booted in parallel\n", smp_ap_booted);
+
+    return status | err;
+
+out_err:
+    if (stacks) {
+        for (i = 0; i < AP_MAX_APIC_ID; i++) {
+            if (stacks[i]) {
+                free((void*)(stacks[i] - AP_BOOT_STACK_SIZE));
+            }
+        }
+        free(stacks);
+    }
+    if (cpus) {
+        free(cpus);
+    }
+    return -1;
+}
+#endif
+
+
 int
 smp_bringup_aps (struct naut_info * naut)
 {
@@ -129,6 +483,10 @@ smp_bringup_aps (struct naut_info * naut)
     int status = 0; 
     int err = 0;
     int i, j, maxlvt;
+#ifdef NAUT_CONFIG_TSC_SYNC
+    uint8_t can_adjust = tsc_adjust_avail();
+    sint64_t lo = 0, hi = 0;
+#endif
 
     if (naut->sys.num_cpus == 1) {
         return 0;
@@ -153,6 +511,25 @@ smp_bringup_aps (struct naut_info * naut)
 
     SMP_DEBUG("Passing AP area at %p\n", (void*)ap_area);
 
+#ifdef NAUT_CONFIG_SMP_PARALLEL_BOOT
+    status = smp_bringup_aps_parallel(naut, ap_area, apic, target_vec, maxlvt);
+    if (status >= 0) {
+#ifdef NAUT_CONFIG_TSC_SYNC
+        /* they are all up, sync them one at a time */
+        for (i = 0; i < naut->sys.num_cpus; i++) {
+            if (naut->sys.cpus[i]->is_bsp) {
+                continue;
+            }
+            tsc_turn = i;
+            BARRIER_WHILE(tsc_turn == i);
+            tsc_sync_core(naut->sys.cpus[i], can_adjust, &lo, &hi);
+        }
+#endif
+        goto all_booted;
+    }
+    status = 0;
+#endif
+
     /* START BOOTING AP CORES */
     
     /* we, of course, skip the BSP (NOTE: assuming it's 0...) */
@@ -230,13 +607,25 @@ smp_bringup_aps (struct naut_info * naut)
         /* wait for AP to set its boot flag */
         smp_wait_for_ap(naut, i);
 
+#ifdef NAUT_CONFIG_TSC_SYNC
+        tsc_sync_core(naut->sys.cpus[i], can_adjust, &lo, &hi);
+#endif
+
         SMP_DEBUG("Bringup for core %u done.\n", i);
     }
 
+#ifdef NAUT_CONFIG_SMP_PARALLEL_BOOT
+all_booted:
+#endif
     BARRIER_WHILE(smp_core_count != naut->sys.num_cpus);
 
     SMP_DEBUG("ALL CPUS BOOTED\n");
 
+#ifdef NAUT_CONFIG_TSC_SYNC
+    tsc_skew_bound = hi - lo;
+    SMP_PRINT("TSCs agree to within %lu cycles\n", tsc_skew_bound);
+#endif
+
     /* we can now use gs-based percpu data */
     cpu_info_ready = 1;
 
@@ -259,6 +648,21 @@ smp_xcall_init_queue (struct cpu * core)
         return -1;
     }
 
+#ifdef NAUT_CONFIG_XCALL_RINGS
+    {
+        size_t size = sizeof(struct nk_xcall_ring) * core->system->num_cpus;
+        struct nk_xcall_ring * rings = malloc(size);
+
+        if (!rings) {
+            ERROR_PRINT("Could not allocate xcall rings on cpu %u\n", core->id);
+            return -1;
+        }
+
+        memset(rings, 0, size);
+        core->xcall_rings = rings;
+    }
+#endif
+
     return 0;
 }
 
@@ -291,6 +695,13 @@ smp_ap_setup (struct cpu * core)
 
     // set GS base (for per-cpu state)
     msr_write(MSR_GS_BASE, (uint64_t)core_addr);
+
+#ifdef NAUT_CONFIG_THREAD_LAZY_STACKS
+    if (nk_tss_init(core) != 0) {
+        ERROR_PRINT("Could not setup TSS for core %u\n", core->id);
+        return -1;
+    }
+#endif
     
     apic_init(core);
 
@@ -316,12 +727,35 @@ smp_ap_finish (struct cpu * core)
 {
     fpu_init();
 
+#ifdef NAUT_CONFIG_TLB_SHOOTDOWN
+    nk_tlb_init(core);
+#endif
+
     nk_rand_init(core);
 
     nk_cpu_topo_discover(core);
 
+#ifdef NAUT_CONFIG_TSC_SYNC
+    uint32_t tsc_seq = tsc_cmd.seq;
+#endif
+
     PAUSE_WHILE(atomic_cmpswap(core->booted, 0, 1) != 0);
 
+#ifdef NAUT_CONFIG_SMP_PARALLEL_BOOT
+    atomic_inc(smp_ap_booted);
+#ifdef NAUT_CONFIG_TSC_SYNC
+    /* the BSP syncs us once everyone is up, wait to be called */
+    BARRIER_WHILE(tsc_turn != core->id);
+    tsc_seq = tsc_cmd.seq;
+    mbarrier();
+    tsc_turn = -1;
+#endif
+#endif
+
+#ifdef NAUT_CONFIG_TSC_SYNC
+    tsc_sync_ap(tsc_seq);
+#endif
+
 #ifndef NAUT_CONFIG_HVM_HRT
     atomic_inc(smp_core_count);
 
@@ -385,12 +819,30 @@ nk_get_num_cpus (void)
     return sys->num_cpus;
 }
 
-static void
-init_xcall (struct nk_xcall * x, void * arg, nk_xcall_func_t fun)
+
+/* returns 0xff if no CPU has this local APIC */
+uint8_t
+nk_get_cpu_by_lapicid (uint8_t lapicid)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    int i;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        if (sys->cpus[i]->lapic_id == lapicid) {
+            return i;
+        }
+    }
+
+    return 0xff;
+}
+
+static inline void
+init_xcall (struct nk_xcall * x, void * arg, nk_xcall_func_t fun, uint8_t wait)
 {
     x->data       = arg;
     x->fun        = fun;
     x->xcall_done = 0;
+    x->has_waiter = wait;
 }
 
 
@@ -411,6 +863,212 @@ mark_xcall_done (struct nk_xcall * x)
 }
 
 
+#ifdef NAUT_CONFIG_XCALL_RINGS
+/*
+ * run everything queued for this core. Called from the xcall IPI,
+ * and by senders stuck waiting with interrupts off, so that two
+ * cores calling each other cannot deadlock
+ */
+static void
+xcall_drain (struct cpu * me)
+{
+    struct nk_xcall_ring * r;
+    struct nk_xcall_slot s;
+    uint64_t bits;
+    unsigned w, sender;
+
+    for (w = 0; w < NK_XCALL_PENDING_WORDS; w++) {
+
+        if (!me->xcall_pending[w]) {
+            continue;
+        }
+
+        bits = atomic_and(me->xcall_pending[w], 0);
+
+        while (bits) {
+            sender = w * 64 + __builtin_ctzll(bits);
+            bits  &= bits - 1;
+            r      = &me->xcall_rings[sender];
+
+            while (r->head != r->tail) {
+                s = r->slots[r->head % NK_XCALL_RING_SIZE];
+                /* the slot is free again once we've copied it */
+                r->head = r->head + 1;
+
+                NK_TRACE(NK_TRACE_XCALL, get_cur_thread()->tid, (uint64_t)s.fun, sender);
+                s.fun(s.arg);
+
+                if (s.tok) {
+                    atomic_dec(s.tok->pending);
+                }
+            }
+        }
+    }
+}
+
+
+static int
+xcall_handler (excp_entry_t * e, excp_vec_t v) 
+{
+    struct cpu * me = get_cpu();
+
+    /* ack first, the functions may block (e.g. core barrier) */
+    IRQ_HANDLER_END();
+
+    /* anyone posting after this sends a fresh IPI */
+    me->xcall_ipi = 0;
+    mbarrier();
+
+    xcall_drain(me);
+
+    return 0;
+}
+
+
+/*
+ * smp_xcall_async
+ *
+ * queue a cross-core call without waiting for it. If a token is
+ * given it is counted up now and back down once the call has run,
+ * so a caller can fire off calls to many cores and wait once with
+ * smp_xcall_token_wait()
+ *
+ * @cpu_id: the cpu to execute the call on
+ * @fun: the function to invoke
+ * @arg: the argument to the function
+ * @tok: completion token, or NULL
+ *
+ * returns 0 on success, -1 on error
+ *
+ */
+int
+smp_xcall_async (cpu_id_t cpu_id,
+                 nk_xcall_func_t fun,
+                 void * arg,
+                 nk_xcall_token_t * tok)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    struct cpu * target;
+    struct nk_xcall_ring * r;
+    struct nk_xcall_slot * s;
+    cpu_id_t me;
+    uint8_t flags;
+
+    if (cpu_id >= nk_get_num_cpus()) {
+        ERROR_PRINT("Attempt to execute xcall on invalid cpu (%u)\n", cpu_id);
+        return -1;
+    }
+
+    flags = irq_disable_save();
+    me    = my_cpu_id();
+
+    if (cpu_id == me) {
+        fun(arg);
+        irq_enable_restore(flags);
+        return 0;
+    }
+
+    target = sys->cpus[cpu_id];
+
+    if (!target->xcall_rings) {
+        irq_enable_restore(flags);
+        ERROR_PRINT("Attempt by cpu %u to initiate xcall on invalid xcall ring (for cpu %u)\n", 
+                    me, cpu_id);
+        return -1;
+    }
+
+    r = &target->xcall_rings[me];
+
+    /* ring full, keep answering our own calls until the target catches up */
+    while (r->tail - r->head == NK_XCALL_RING_SIZE) {
+        xcall_drain(sys->cpus[me]);
+        asm volatile ("pause");
+    }
+
+    s      = &r->slots[r->tail % NK_XCALL_RING_SIZE];
+    s->fun = fun;
+    s->arg = arg;
+    s->tok = tok;
+
+    if (tok) {
+        atomic_inc(tok->pending);
+    }
+
+    /* publish the slot, then say which ring to look at */
+    asm volatile ("" ::: "memory");
+    r->tail = r->tail + 1;
+
+    atomic_or(target->xcall_pending[me / 64], 1ULL << (me % 64));
+
+    if (atomic_cmpswap(target->xcall_ipi, 0, 1) == 0) {
+        apic_ipi(per_cpu_get(apic), target->apic->id, IPI_VEC_XCALL);
+    }
+
+    irq_enable_restore(flags);
+
+    return 0;
+}
+
+
+/*
+ * smp_xcall_token_wait
+ *
+ * wait for every call issued against a token to complete
+ *
+ */
+void
+smp_xcall_token_wait (nk_xcall_token_t * tok)
+{
+    struct cpu * me = get_cpu();
+
+    while (tok->pending) {
+        if (!irqs_enabled()) {
+            xcall_drain(me);
+        }
+        asm volatile ("pause");
+    }
+}
+
+
+/* 
+ * smp_xcall
+ *
+ * initiate cross-core call. 
+ * 
+ * @cpu_id: the cpu to execute the call on
+ * @fun: the function to invoke
+ * @arg: the argument to the function
+ * @wait: this function should block until the reciever finishes
+ *        executing the function
+ *
+ */
+int
+smp_xcall (cpu_id_t cpu_id, 
+           nk_xcall_func_t fun,
+           void * arg,
+           uint8_t wait)
+{
+    nk_xcall_token_t tok;
+
+    SMP_DEBUG("Initiating SMP XCALL from core %u to core %u\n", my_cpu_id(), cpu_id);
+
+    if (!wait) {
+        return smp_xcall_async(cpu_id, fun, arg, NULL);
+    }
+
+    smp_xcall_token_init(&tok);
+
+    if (smp_xcall_async(cpu_id, fun, arg, &tok) != 0) {
+        return -1;
+    }
+
+    smp_xcall_token_wait(&tok);
+
+    return 0;
+}
+
+#else /* !NAUT_CONFIG_XCALL_RINGS */
+
 static int
 xcall_handler (excp_entry_t * e, excp_vec_t v) 
 {
@@ -436,6 +1094,7 @@ xcall_handler (excp_entry_t * e, excp_vec_t v)
         // because it may end up blocking (e.g. core barrier)
         IRQ_HANDLER_END(); 
 
+        NK_TRACE(NK_TRACE_XCALL, get_cur_thread()->tid, (uint64_t)x->fun, 0);
         x->fun(x->data);
 
         /* we need to notify the waiter we're done */
@@ -500,7 +1159,7 @@ smp_xcall (cpu_id_t cpu_id,
             xc = &(sys->cpus[cpu_id]->xcall_nowait_info);
         }
 
-        init_xcall(xc, arg, fun);
+        init_xcall(xc, arg, fun, wait);
 
         xcq = sys->cpus[cpu_id]->xcall_q;
         if (!xcq) {
@@ -534,3 +1193,183 @@ smp_xcall (cpu_id_t cpu_id,
 
     return 0;
 }
+
+
+/* 
+ * without the rings a target has one slot for unwaited calls, so
+ * the asynchronous interface completes each call before returning
+ */
+int
+smp_xcall_async (cpu_id_t cpu_id,
+                 nk_xcall_func_t fun,
+                 void * arg,
+                 nk_xcall_token_t * tok)
+{
+    return smp_xcall(cpu_id, fun, arg, 1);
+}
+
+
+void
+smp_xcall_token_wait (nk_xcall_token_t * tok)
+{
+}
+
+#endif /* !NAUT_CONFIG_XCALL_RINGS */
+
+
+#ifdef NAUT_CONFIG_XCALL_RINGS
+/*
+ * Multicast xcalls are relayed down a tree of the target cores. The
+ * initiator sends to the first XCALL_FANOUT targets, and the target
+ * at position p forwards to positions XCALL_FANOUT * (p + 1) on
+ * before running the function itself. Every target then counts down
+ * the same token.
+ */
+#define XCALL_FANOUT 4
+
+struct xcall_mcast;
+
+struct xcall_mcast_pos {
+    cpu_id_t             cpu;
+    struct xcall_mcast * m;
+};
+
+struct xcall_mcast {
+    nk_xcall_func_t        fun;
+    void *                 arg;
+    uint32_t               n;
+    uint8_t                wait;
+    nk_xcall_token_t       tok;
+    struct xcall_mcast_pos pos[0];
+};
+
+
+static void mcast_relay (void * arg);
+
+static void
+mcast_forward (struct xcall_mcast * m, int p)
+{
+    uint32_t c, first = XCALL_FANOUT * (p + 1);
+
+    for (c = first; c < first + XCALL_FANOUT && c < m->n; c++) {
+        smp_xcall_async(m->pos[c].cpu, mcast_relay, &m->pos[c], NULL);
+    }
+}
+
+
+static void
+mcast_relay (void * arg)
+{
+    struct xcall_mcast_pos * pos = (struct xcall_mcast_pos*)arg;
+    struct xcall_mcast * m = pos->m;
+
+    mcast_forward(m, pos - m->pos);
+
+    m->fun(m->arg);
+
+    /* nobody waits on an unwaited multicast, the last one out frees it */
+    if (atomic_dec_val(m->tok.pending) == 0 && !m->wait) {
+        free(m);
+    }
+}
+#endif
+
+
+/*
+ * smp_xcall_mask
+ *
+ * run a function on every core in a set. The calling core, if it is
+ * in the set, runs it directly. With the xcall rings the others are
+ * reached through a relay tree, so the initiator only sends a
+ * handful of IPIs; otherwise each is called in turn and waited on
+ *
+ * @mask: the cores to run on
+ * @fun: the function to invoke
+ * @arg: the argument to the function
+ * @wait: block until every core has run the function
+ *
+ * returns 0 on success, -1 on error
+ *
+ */
+int
+smp_xcall_mask (const nk_cpumask_t * mask,
+                nk_xcall_func_t fun,
+                void * arg,
+                uint8_t wait)
+{
+    cpu_id_t me = my_cpu_id();
+    uint32_t ncpus = nk_get_num_cpus();
+    uint8_t flags;
+    cpu_id_t cpu;
+
+#ifdef NAUT_CONFIG_XCALL_RINGS
+    struct xcall_mcast * m = NULL;
+    uint32_t n = nk_cpumask_count(mask) - nk_cpumask_test(mask, me);
+
+    if (n) {
+        m = malloc(sizeof(struct xcall_mcast) + n * sizeof(struct xcall_mcast_pos));
+        if (!m) {
+            ERROR_PRINT("Could not allocate multicast xcall\n");
+            return -1;
+        }
+
+        m->fun         = fun;
+        m->arg         = arg;
+        m->wait        = wait;
+        m->n           = 0;
+        m->tok.pending = n;
+
+        nk_cpumask_for_each(cpu, mask) {
+            if (cpu >= ncpus) {
+                break;
+            }
+            if (cpu != me) {
+                m->pos[m->n].cpu = cpu;
+                m->pos[m->n].m   = m;
+                m->n++;
+            }
+        }
+
+        if (m->n != n) {
+            ERROR_PRINT("Multicast xcall to invalid cpus\n");
+            free(m);
+            return -1;
+        }
+
+        /* after this m may already be gone unless we wait */
+        mcast_forward(m, -1);
+    }
+
+    if (nk_cpumask_test(mask, me)) {
+        flags = irq_disable_save();
+        fun(arg);
+        irq_enable_restore(flags);
+    }
+
+    if (n && wait) {
+        smp_xcall_token_wait(&m->tok);
+        free(m);
+    }
+
+#else
+
+    nk_cpumask_for_each(cpu, mask) {
+        if (cpu >= ncpus) {
+            ERROR_PRINT("Multicast xcall to invalid cpu %u\n", cpu);
+            return -1;
+        }
+        if (cpu != me && smp_xcall(cpu, fun, arg, 1) != 0) {
+            return -1;
+        }
+    }
+
+    if (nk_cpumask_test(mask, me)) {
+        flags = irq_disable_save();
+        fun(arg);
+        irq_enable_restore(flags);
+    }
+
+#endif
+
+    return 0;
+}
@@ -23,6 +23,11 @@
 #include <nautilus/spinlock.h>
 #include <nautilus/irq.h>
 
+#ifdef NAUT_CONFIG_SPINLOCK_QUEUED
+#include <nautilus/smp.h>
+#include <nautilus/percpu.h>
+#endif
+
 void 
 spinlock_init (volatile spinlock_t * lock) 
 {
@@ -39,17 +44,128 @@ spinlock_deinit (volatile spinlock_t * lock)
 void
 spin_lock_nopause (volatile spinlock_t * lock)
 {
-    while (__sync_lock_test_and_set(lock, 1)) {
-        /* nothing */
-    }
+    __spin_acquire_nopause(lock);
 }
 
 uint8_t
 spin_lock_irq_save_nopause (volatile spinlock_t * lock)
 {
     uint8_t flags = irq_disable_save();
-    while (__sync_lock_test_and_set(lock, 1)) {
-        /* nothing */
-    }
+    __spin_acquire_nopause(lock);
     return flags;
 }
+
+
+#ifdef NAUT_CONFIG_SPINLOCK_QUEUED
+/*
+ * Queued spinlocks. Each CPU has a node for each level a lock can be
+ * taken at while another is being waited for (thread, interrupt, an
+ * exception inside that). A waiter swaps its node in as the tail of
+ * the word, links itself behind the previous tail and spins on its
+ * own node until that one hands over the front of the queue. The
+ * front waiter alone watches the word, takes the held flag when it
+ * clears, then passes the front on, so its node is free again as
+ * soon as it owns the lock and unlock never needs it.
+ *
+ * Until every core has per-CPU data, and past the nesting depth,
+ * waiters just compete for the held flag on the word.
+ */
+#define SPIN_Q_NESTING 4
+
+#define SPIN_Q_TAIL(cpu, idx) ((((cpu) + 1) << 18) | ((idx) << 16))
+#define SPIN_Q_CPU(tail)      (((tail) >> 18) - 1)
+#define SPIN_Q_IDX(tail)      (((tail) >> 16) & (SPIN_Q_NESTING - 1))
+
+struct spin_q_node {
+    struct spin_q_node * volatile next;
+    volatile uint32_t front;     /* handed the front of the queue */
+    uint32_t depth;              /* nodes in use, kept in node 0 */
+} __align(64);
+
+static struct spin_q_node spin_q_nodes[NAUT_CONFIG_MAX_CPUS][SPIN_Q_NESTING];
+
+extern uint8_t cpu_info_ready;
+
+
+static void
+spin_lock_compete (volatile spinlock_t * lock)
+{
+    uint32_t val;
+
+    while (1) {
+        val = *lock;
+        if (!(val & SPIN_Q_LOCKED) &&
+            __sync_bool_compare_and_swap(lock, val, val | SPIN_Q_LOCKED)) {
+            return;
+        }
+        asm volatile ("pause");
+    }
+}
+
+
+void
+__spin_lock_queued (volatile spinlock_t * lock)
+{
+    struct spin_q_node * node, * next;
+    uint32_t tail, old, val;
+    unsigned idx;
+    cpu_id_t cpu;
+    uint8_t flags;
+
+    if (!cpu_info_ready) {
+        spin_lock_compete(lock);
+        return;
+    }
+
+    /* the node is ours until we leave, so stay on this CPU */
+    flags = irq_disable_save();
+
+    cpu = my_cpu_id();
+    idx = spin_q_nodes[cpu][0].depth++;
+
+    if (idx >= SPIN_Q_NESTING) {
+        spin_lock_compete(lock);
+        goto out;
+    }
+
+    node        = &spin_q_nodes[cpu][idx];
+    node->next  = NULL;
+    node->front = 0;
+    tail        = SPIN_Q_TAIL(cpu, idx);
+
+    do {
+        old = *lock;
+    } while (!__sync_bool_compare_and_swap(lock, old, (old & ~SPIN_Q_TAIL_MASK) | tail));
+
+    if (old & SPIN_Q_TAIL_MASK) {
+        struct spin_q_node * prev = &spin_q_nodes[SPIN_Q_CPU(old)][SPIN_Q_IDX(old)];
+        prev->next = node;
+        PAUSE_WHILE(!node->front);
+    }
+
+    while (1) {
+        val = *lock;
+
+        if (val & SPIN_Q_LOCKED) {
+            asm volatile ("pause");
+            continue;
+        }
+
+        if ((val & SPIN_Q_TAIL_MASK) == tail) {
+            /* no one behind us, the queue empties */
+            if (__sync_bool_compare_and_swap(lock, val, SPIN_Q_LOCKED)) {
+                break;
+            }
+        } else if (__sync_bool_compare_and_swap(lock, val, val | SPIN_Q_LOCKED)) {
+            /* the next waiter may not have linked itself yet */
+            PAUSE_WHILE(!(next = node->next));
+            next->front = 1;
+            break;
+        }
+    }
+
+out:
+    spin_q_nodes[cpu][0].depth--;
+    irq_enable_restore(flags);
+}
+#endif
@@ -0,0 +1,125 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/pmc_thread.h>
+#include <nautilus/switch_bench.h>
+
+#define SWITCH_PRINT(fmt, args...) printk("SWITCH: " fmt, ##args)
+#define SWITCH_ERROR(fmt, args...) ERROR_PRINT("SWITCH: " fmt, ##args)
+
+#define CACHE_LINE 64
+
+struct switch_side {
+    uint64_t switches;
+    struct nk_pmc_count cycles;
+    struct nk_pmc_count misses;
+    int ok;
+    volatile int done;
+};
+
+
+static void
+switch_loop (struct switch_side * s)
+{
+    int cyc = nk_pmc_thread_add_generic(NK_PMC_CYCLES);
+    int llc = nk_pmc_thread_add_generic(NK_PMC_LLC_MISSES);
+    uint64_t i;
+
+    s->ok = cyc >= 0 && llc >= 0;
+
+    for (i = 0; i < s->switches; i++) {
+        nk_yield();
+    }
+
+    if (s->ok) {
+        nk_pmc_thread_read(get_cur_thread(), cyc, &s->cycles);
+        nk_pmc_thread_read(get_cur_thread(), llc, &s->misses);
+    }
+}
+
+
+static void
+switch_partner (void * in, void ** out)
+{
+    struct switch_side * s = (struct switch_side *)in;
+
+    switch_loop(s);
+    s->done = 1;
+}
+
+
+/* cache lines spanned by [first, last] */
+#define LINES(first, last) (((last) / CACHE_LINE) - ((first) / CACHE_LINE) + 1)
+
+static void
+switch_layout (void)
+{
+    SWITCH_PRINT("nk_thread is %lu bytes, its switch fields span %lu cache line(s)\n",
+                 sizeof(struct nk_thread),
+                 LINES(offsetof(struct nk_thread, rsp),
+                       offsetof(struct nk_thread, runq_node) + sizeof(nk_queue_entry_t) - 1));
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    SWITCH_PRINT("rt_thread is %lu bytes, its scheduling fields span %lu cache line(s)\n",
+                 sizeof(rt_thread),
+                 LINES(offsetof(rt_thread, type),
+                       offsetof(rt_thread, constr) + sizeof(rt_constraints) - 1));
+#endif
+}
+
+
+int
+nk_switch_bench (uint64_t switches)
+{
+    struct switch_side me = { .switches = switches };
+    struct switch_side partner = { .switches = switches };
+    uint64_t n, cycles, misses;
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    rt_constraints c = { .aperiodic = { .priority = 0 } };
+
+    if (nk_thread_start(switch_partner, &partner, 0, 1, TSTACK_DEFAULT, 0, my_cpu_id(), APERIODIC, &c, 0)) {
+#else
+    if (nk_thread_start(switch_partner, &partner, 0, 1, TSTACK_DEFAULT, 0, my_cpu_id())) {
+#endif
+        SWITCH_ERROR("Could not start partner thread\n");
+        return -1;
+    }
+
+    switch_loop(&me);
+
+    while (!partner.done) {
+        nk_yield();
+    }
+
+    if (!me.ok || !partner.ok) {
+        SWITCH_ERROR("Could not get counters for both threads\n");
+        return -1;
+    }
+
+    n      = 2 * switches;
+    cycles = nk_pmc_count_scaled(&me.cycles) + nk_pmc_count_scaled(&partner.cycles);
+    misses = nk_pmc_count_scaled(&me.misses) + nk_pmc_count_scaled(&partner.misses);
+
+    SWITCH_PRINT("%lu switches: %lu cycles and %lu.%02lu LLC misses per switch\n",
+                 n, cycles / n, misses / n, (misses * 100 / n) % 100);
+    switch_layout();
+
+    return 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/percpu.h>
+#include <nautilus/thread.h>
+#include <nautilus/paging.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/telemetry.h>
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+#include <nautilus/rt_scheduler.h>
+#endif
+#ifdef NAUT_CONFIG_LOAD_AVG
+#include <nautilus/loadavg.h>
+#endif
+#ifdef NAUT_CONFIG_PMC_THREAD
+#include <nautilus/pmc_thread.h>
+#endif
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+#include <nautilus/housekeeping.h>
+#endif
+
+#define TELEM_PRINT(fmt, args...) printk("TELEMETRY: " fmt, ##args)
+#define TELEM_ERROR(fmt, args...) ERROR_PRINT("TELEMETRY: " fmt, ##args)
+
+/* the host only ever reads, x86 keeps our stores in order */
+#define telem_barrier() asm volatile("" ::: "memory")
+
+static struct nk_telemetry telem __attribute__((aligned(PAGE_SIZE_4KB)));
+
+/* keeps seq odd for one writer at a time */
+static spinlock_t telem_lock;
+
+
+static void
+fill_cpu (int cpu, struct nk_telemetry_cpu * tc)
+{
+#ifdef NAUT_CONFIG_LOAD_AVG
+    struct nk_load l;
+
+    if (!nk_load_read(cpu, &l)) {
+        tc->runnable = l.runnable;
+        tc->rt_util = l.rt_util;
+        tc->idle = l.idle;
+    }
+#endif
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    struct sys_info * sys = per_cpu_get(system);
+    rt_scheduler * s = sys->cpus[cpu]->rt_sched;
+
+    if (!s) {
+        return;
+    }
+
+    tc->sched_pass = s->run_time;
+#ifdef NAUT_CONFIG_RT_OVERHEAD_HIST
+    tc->passes = s->decision.total;
+    tc->decision_pct = rt_overhead_percentile(&s->decision, NAUT_CONFIG_RT_OVERHEAD_PERCENTILE);
+    tc->cswitch_pct = rt_overhead_percentile(&s->cswitch, NAUT_CONFIG_RT_OVERHEAD_PERCENTILE);
+#endif
+#endif
+}
+
+
+/* under the thread list lock, with interrupts off */
+static int
+fill_thread (nk_thread_t * t, void * state)
+{
+    struct nk_telemetry_thread * tt;
+
+    if (telem.num_threads >= telem.max_threads) {
+        telem.lost_threads++;
+        return 0;
+    }
+
+    tt = &telem.thread[telem.num_threads++];
+    memset(tt, 0, sizeof(*tt));
+
+    tt->tid = t->tid;
+    tt->cpu = t->bound_cpu;
+    tt->status = t->status;
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    rt_thread * rt = t->rt_thread;
+
+    if (rt) {
+        tt->rt_type = rt->type;
+        tt->rt_status = rt->status;
+        tt->deadline = rt->deadline;
+        tt->run_time = rt->run_time;
+        if (rt->type == PERIODIC) {
+            tt->period = rt->constraints->periodic.period;
+            tt->slice = rt->constraints->periodic.slice;
+        } else if (rt->type == SPORADIC) {
+            tt->period = rt->constraints->sporadic.work;
+        } else {
+            tt->slice = rt->constraints->aperiodic.priority;
+        }
+        tt->releases = rt->stats.releases;
+        tt->misses = rt->stats.misses;
+        tt->skipped = rt->stats.skipped;
+        tt->overruns = rt->stats.overruns;
+        tt->lateness_max = rt->stats.lateness_max;
+        tt->jitter_max = rt->stats.jitter_max;
+        tt->jitter_sum = rt->stats.jitter_sum;
+    }
+#endif
+
+#ifdef NAUT_CONFIG_PMC_THREAD
+    struct nk_pmc_count c;
+    int i;
+
+    for (i = 0; i < NK_TELEMETRY_PMC && !nk_pmc_thread_read(t, i, &c); i++) {
+        tt->pmc[i] = nk_pmc_count_scaled(&c);
+    }
+    tt->npmc = i;
+#endif
+
+    return 0;
+}
+
+
+void
+nk_telemetry_update (void)
+{
+    int i;
+
+    spin_lock(&telem_lock);
+
+    telem.seq++;
+    telem_barrier();
+
+    memset(telem.cpu, 0, sizeof(telem.cpu));
+    for (i = 0; i < telem.num_cpus; i++) {
+        fill_cpu(i, &telem.cpu[i]);
+    }
+
+    telem.num_threads = 0;
+    telem.lost_threads = 0;
+    nk_thread_for_each(fill_thread, NULL);
+
+    telem.stamp = rdtsc();
+    telem.updates++;
+
+    telem_barrier();
+    telem.seq++;
+
+    spin_unlock(&telem_lock);
+}
+
+
+static void
+telemetry_thread (void * in, void ** out)
+{
+    while (1) {
+        nk_telemetry_update();
+        nk_sleep(NAUT_CONFIG_TELEMETRY_INTERVAL_MS);
+    }
+}
+
+
+int
+nk_telemetry_start (void)
+{
+    int cpu = 0;
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    rt_constraints c = { .aperiodic = { .priority = 0 } };
+#endif
+
+    spinlock_init(&telem_lock);
+
+    memset(&telem, 0, sizeof(telem));
+    telem.version = NK_TELEMETRY_VERSION;
+    telem.size = sizeof(telem);
+    telem.num_cpus = nk_get_num_cpus();
+    telem.max_threads = NAUT_CONFIG_TELEMETRY_THREADS;
+    telem.cpu_khz = per_cpu_get(cpu_khz);
+    telem.interval_ms = NAUT_CONFIG_TELEMETRY_INTERVAL_MS;
+
+    /* a scan must not find a region that is not filled in yet */
+    telem_barrier();
+    telem.magic = NK_TELEMETRY_MAGIC;
+
+#ifdef NAUT_CONFIG_HOUSEKEEPING
+    cpu = nk_housekeeping_cpu();
+#endif
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    if (nk_thread_start(telemetry_thread, 0, 0, 1, TSTACK_DEFAULT, 0, cpu, APERIODIC, &c, 0)) {
+#else
+    if (nk_thread_start(telemetry_thread, 0, 0, 1, TSTACK_DEFAULT, 0, cpu)) {
+#endif
+        TELEM_ERROR("Cannot start update thread\n");
+        return -1;
+    }
+
+    TELEM_PRINT("%u bytes at GPA %p, updated every %d ms on cpu %d\n",
+                telem.size, (void*)va_to_pa((addr_t)&telem),
+                NAUT_CONFIG_TELEMETRY_INTERVAL_MS, cpu);
+
+    return 0;
+}
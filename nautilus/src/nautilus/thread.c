@@ -33,6 +33,22 @@
 #include <nautilus/list.h>
 #include <nautilus/errno.h>
 #include <nautilus/mm.h>
+#include <nautilus/fpu.h>
+#include <nautilus/trace.h>
+#include <nautilus/numa.h>
+#include <nautilus/msr.h>
+#ifdef NAUT_CONFIG_PMC_THREAD
+#include <nautilus/pmc_thread.h>
+#endif
+#ifdef NAUT_CONFIG_KMEM_SLAB
+#include <nautilus/slab.h>
+#endif
+#ifdef NAUT_CONFIG_RCU
+#include <nautilus/rcu.h>
+#endif
+#ifdef NAUT_CONFIG_LOAD_AVG
+#include <nautilus/loadavg.h>
+#endif
 
 #ifdef NAUT_CONFIG_USE_RT_SCHEDULER
 #include <nautilus/rt_scheduler.h>
@@ -63,7 +79,10 @@ extern uint8_t malloc_cpus_ready;
 #define RT_THREAD_DEBUG(fmt, args...) printk("THREAD: " fmt, ##args)
 #endif
 
-static unsigned long next_tid = 0;
+static unsigned long next_tid = 0;   /* where the next core's range of ids starts */
+
+// ids a core takes at a time
+#define TID_RANGE 256
 
 static struct nk_sched_state * glob_sched_state;
 
@@ -72,17 +91,81 @@ extern void nk_thread_switch(nk_thread_t*);
 extern void nk_thread_entry(void *);
 static struct nk_tls tls_keys[TLS_MAX_KEYS];
 
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
 static inline void update_exit(rt_thread *t);
-static inline void update_enter(rt_thread *t);
+static inline void update_enter(rt_thread *t, rt_thread *prev, uint64_t now);
 
 static inline void update_exit(rt_thread *t) {
 	t->exit_time = rdtsc();
 	t->run_time += (t->exit_time - t->start_time);
 }
 
-static inline void update_enter(rt_thread *t) {
-	t->start_time = rdtsc();
+static inline void update_enter(rt_thread *t, rt_thread *prev, uint64_t now) {
+	t->start_time = now;
+#ifdef NAUT_CONFIG_RT_HISTOGRAMS
+    rt_stats_enter(t, prev);
+#endif
+}
+
+/*
+ * Hand a new thread to the scheduler. Under global EDF a periodic or
+ * sporadic thread is admitted against the whole machine and goes
+ * straight onto the shared run queue, otherwise it is submitted to
+ * cpu, which admits it the next time it schedules.
+ */
+static inline void rt_thread_arrive(int cpu, rt_thread *rt)
+{
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+    if (rt->type != APERIODIC && rt_global_admit(rt)) {
+        rt->admitted = 1;
+        rt_global_enqueue(rt);
+        return;
+    }
+#endif
+    rt_thread_submit(cpu, rt);
+}
+
+/* waits for cpu to admit or refuse a periodic/sporadic thread */
+static inline int rt_thread_admission(rt_thread *rt)
+{
+    while (!rt->admitted) {
+        asm volatile ("pause");
+    }
+    return rt->admitted > 0 ? 0 : -1;
+}
+#endif
+
+#ifdef NAUT_CONFIG_LOCKFREE_RUNQ
+/*
+ * A run queue's list belongs to its CPU and is only touched there with
+ * interrupts off. Other CPUs push onto its inbox, which the owner
+ * drains before it picks a thread.
+ */
+#define runq_lock(q)          irq_disable_save()
+#define runq_unlock(q, flags) irq_enable_restore(flags)
+
+static inline uint8_t
+runq_empty (nk_thread_queue_t * q)
+{
+    return nk_queue_empty(q) && nk_queue_mpsc_empty(q);
+}
+
+static inline void
+runq_drain (nk_thread_queue_t * q)
+{
+    nk_queue_entry_t * elm;
+
+    while ((elm = nk_queue_mpsc_pop(q))) {
+        nk_enqueue_entry(q, elm);
+    }
 }
+#else
+#define runq_lock(q)          spin_lock_irq_save(&((q)->lock))
+#define runq_unlock(q, flags) spin_unlock_irq_restore(&((q)->lock), flags)
+#define runq_empty(q)         nk_queue_empty(q)
+#endif
+
+static void thread_reap(nk_thread_t * thethread);
 
 /****** SEE BELOW FOR EXTERNAL THREAD INTERFACE ********/
 
@@ -137,7 +220,23 @@ nk_enqueue_thread_on_runq (nk_thread_t * t, int cpu)
     t->cur_run_q = q;
     t->status    = NK_THR_SUSPENDED;
     
+    /* the idle thread waits in its CPU's slot, not on the queue */
+    if (unlikely(t->is_idle)) {
+        NK_PROFILE_EXIT();
+        return;
+    }
+    
+#ifdef NAUT_CONFIG_LOCKFREE_RUNQ
+    if (q == per_cpu_get(run_q)) {
+        uint8_t flags = runq_lock(q);
+        nk_enqueue_entry(q, &(t->runq_node));
+        runq_unlock(q, flags);
+    } else {
+        nk_queue_mpsc_push(q, &(t->runq_node));
+    }
+#else
     nk_enqueue_entry_atomic(q, &(t->runq_node));
+#endif
     NK_PROFILE_EXIT();
 }
 
@@ -180,7 +279,16 @@ nk_dequeue_thread_from_runq (nk_thread_t * t)
         return NULL;
     }
     
+#ifdef NAUT_CONFIG_LOCKFREE_RUNQ
+    /* the list is private to its CPU, only threads not on it can be let go */
+    if (t->status == NK_THR_SUSPENDED) {
+        ERROR_PRINT("Cannot pull queued thread %lu off a lock-free run queue (cpu=%u)\n", t->tid, my_cpu_id());
+        return NULL;
+    }
+    elm = &(t->runq_node);
+#else
     elm = nk_dequeue_entry_atomic(q, &(t->runq_node));
+#endif
     ret = container_of(elm, nk_thread_t, runq_node);
     
     t->status    = NK_THR_SUSPENDED;
@@ -190,29 +298,399 @@ nk_dequeue_thread_from_runq (nk_thread_t * t)
 }
 
 
+#ifdef NAUT_CONFIG_THREAD_WORK_STEALING
+/*
+ * Work stealing
+ *
+ * Each CPU has a Chase-Lev deque of threads that were created with
+ * CPU_ANY and have not run yet. Only the owner pushes (at creation
+ * time) and pops (newest first) at the bottom, with interrupts off.
+ * Other CPUs steal the oldest thread from the top with a CAS on top.
+ * The buffer does not grow, so when it is full new threads go on the
+ * run queue as before. A thread that has started running is never
+ * moved again, it is rescheduled through its run queue like any
+ * other, so preempted threads still round-robin.
+ *
+ * With SMT, a thief whose siblings are busy holds off for a few tries
+ * while some physical core has nothing running at all, so threads go
+ * to idle physical cores before doubling up on one.
+ */
+#define STEAL_DEQUE_SIZE 1024
+#define STEAL_DEQUE_MASK (STEAL_DEQUE_SIZE - 1)
+#define STEAL_SMT_DEFER  16
+#define STEAL_SMT_MAX    8
+
+struct nk_steal_deque {
+    volatile sint64_t top;
+    volatile sint64_t bottom;
+    nk_thread_t * volatile buf[STEAL_DEQUE_SIZE];
+
+    /* other CPUs, nearest first, built on first use */
+    uint32_t num_victims;
+    cpu_id_t victims[NAUT_CONFIG_MAX_CPUS];
+
+    /* tries held off for an idle physical core */
+    uint32_t smt_deferred;
+};
+
+
+static struct nk_steal_deque *
+steal_deque_create (void)
+{
+    struct nk_steal_deque * dq = malloc(sizeof(struct nk_steal_deque));
+
+    if (!dq) {
+        return NULL;
+    }
+    memset(dq, 0, sizeof(struct nk_steal_deque));
+    return dq;
+}
+
+
+static int
+steal_push (nk_thread_t * t)
+{
+    struct nk_steal_deque * dq = per_cpu_get(steal_q);
+    sint64_t b;
+    uint8_t flags;
+
+    if (!dq) {
+        return -1;
+    }
+
+    flags = irq_disable_save();
+
+    b = dq->bottom;
+    if (b - dq->top >= STEAL_DEQUE_SIZE) {
+        irq_enable_restore(flags);
+        return -1;
+    }
+
+    t->cur_run_q = per_cpu_get(run_q);
+    t->status    = NK_THR_SUSPENDED;
+
+    dq->buf[b & STEAL_DEQUE_MASK] = t;
+    /* stores are not reordered on x86, only keep the compiler honest */
+    asm volatile ("":::"memory");
+    dq->bottom = b + 1;
+
+    irq_enable_restore(flags);
+    return 0;
+}
+
+
+/* owner only, interrupts off */
+static nk_thread_t *
+steal_pop (struct nk_steal_deque * dq)
+{
+    sint64_t b = dq->bottom - 1;
+    sint64_t t;
+    nk_thread_t * th = NULL;
+
+    dq->bottom = b;
+    mbarrier();
+    t = dq->top;
+
+    if (t <= b) {
+        th = dq->buf[b & STEAL_DEQUE_MASK];
+        if (t == b) {
+            /* last one, race thieves for it */
+            if (atomic_cmpswap(dq->top, t, t + 1) != t) {
+                th = NULL;
+            }
+            dq->bottom = b + 1;
+        }
+    } else {
+        dq->bottom = b + 1;
+    }
+
+    return th;
+}
+
+
+static nk_thread_t *
+steal_take (struct nk_steal_deque * dq)
+{
+    sint64_t t = dq->top;
+    sint64_t b;
+    nk_thread_t * th;
+
+    asm volatile ("":::"memory");
+    b = dq->bottom;
+
+    if (t >= b) {
+        return NULL;
+    }
+
+    th = dq->buf[t & STEAL_DEQUE_MASK];
+    if (atomic_cmpswap(dq->top, t, t + 1) != t) {
+        return NULL;
+    }
+
+    return th;
+}
+
+
+/* SLIT distance between the domains of two CPUs, 0 within a domain */
+static uint32_t
+steal_distance (struct sys_info * sys, cpu_id_t a, cpu_id_t b)
+{
+    struct nk_locality_info * loc = &sys->locality_info;
+    struct numa_domain * da = sys->cpus[a] ? sys->cpus[a]->domain : NULL;
+    struct numa_domain * db = sys->cpus[b] ? sys->cpus[b]->domain : NULL;
+
+    if (!da || !db || da == db) {
+        return 0;
+    }
+
+    if (!loc->numa_matrix || da->id >= loc->num_domains || db->id >= loc->num_domains) {
+        return 1;
+    }
+
+    return loc->numa_matrix[da->id * loc->num_domains + db->id];
+}
+
+
+/*
+ * Order the other CPUs by NUMA distance. The sort is stable and starts
+ * from the next CPU up, so CPUs at the same distance are tried in ring
+ * order and thieves in one domain do not all hit the same victim.
+ */
+static void
+steal_order (struct nk_steal_deque * dq, cpu_id_t me)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    uint32_t n = 0, i, j;
+
+    for (i = 1; i < sys->num_cpus; i++) {
+        cpu_id_t cpu = (me + i) % sys->num_cpus;
+        uint32_t d = steal_distance(sys, me, cpu);
+
+        for (j = n; j > 0 && steal_distance(sys, me, dq->victims[j - 1]) > d; j--) {
+            dq->victims[j] = dq->victims[j - 1];
+        }
+        dq->victims[j] = cpu;
+        n++;
+    }
+
+    dq->num_victims = n;
+}
+
+
+static inline int
+cpu_busy (struct sys_info * sys, cpu_id_t cpu)
+{
+    nk_thread_t * t = sys->cpus[cpu] ? sys->cpus[cpu]->cur_thread : NULL;
+    return t && !t->is_idle;
+}
+
+
+/* should this CPU leave the stealing to a physical core that is all idle? */
+static int
+steal_defer (struct sys_info * sys, struct nk_steal_deque * dq, cpu_id_t me)
+{
+    uint64_t busy[(NAUT_CONFIG_MAX_CPUS + 63) / 64] = { 0 };
+    cpu_id_t sibs[STEAL_SMT_MAX];
+    unsigned mine = nk_topo_phys_core(me);
+    int i, n;
+
+    if (nk_topo_threads_per_core() == 1 || dq->smt_deferred >= STEAL_SMT_DEFER) {
+        goto steal;
+    }
+
+    n = nk_topo_siblings(me, sibs, STEAL_SMT_MAX);
+    for (i = 0; i < n && !cpu_busy(sys, sibs[i]); i++) {
+    }
+    if (i == n) {
+        /* this whole physical core is idle already */
+        goto steal;
+    }
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        if (cpu_busy(sys, i)) {
+            unsigned core = nk_topo_phys_core(i);
+            busy[core / 64] |= 1ULL << (core % 64);
+        }
+    }
+
+    for (i = 0; i < nk_topo_num_phys_cores(); i++) {
+        if (i != mine && !(busy[i / 64] & (1ULL << (i % 64)))) {
+            dq->smt_deferred++;
+            return 1;
+        }
+    }
+
+steal:
+    dq->smt_deferred = 0;
+    return 0;
+}
+
+
+static nk_thread_t *
+steal_work (cpu_id_t cpu)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    struct nk_steal_deque * dq = sys->cpus[cpu]->steal_q;
+    nk_thread_t * th;
+    uint32_t i;
+
+    if (!dq) {
+        return NULL;
+    }
+
+    if (dq->num_victims != sys->num_cpus - 1) {
+        steal_order(dq, cpu);
+    }
+
+    if (steal_defer(sys, dq, cpu)) {
+        return NULL;
+    }
+
+    for (i = 0; i < dq->num_victims; i++) {
+        struct cpu * victim = sys->cpus[dq->victims[i]];
+
+        if (!victim || !victim->steal_q) {
+            continue;
+        }
+
+        th = steal_take(victim->steal_q);
+        if (th) {
+            SCHED_DEBUG("CPU %u stole thread %lu from CPU %u\n", cpu, th->tid, dq->victims[i]);
+            th->bound_cpu = cpu;
+            th->cur_run_q = sys->cpus[cpu]->run_q;
+            return th;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* would this CPU otherwise switch to its idle thread (or halt)? */
+static inline int
+steal_wanted (void)
+{
+    nk_thread_t * me = get_cur_thread();
+    return me->is_idle || me->status != NK_THR_RUNNING;
+}
+#endif /* NAUT_CONFIG_THREAD_WORK_STEALING */
+
+
+/* threads that were not bound to a CPU can be stolen until they first run */
+static inline void
+enqueue_new_thread (nk_thread_t * t, int cpu)
+{
+#ifdef NAUT_CONFIG_THREAD_WORK_STEALING
+    if (t->is_stealable && cpu == my_cpu_id() && steal_push(t) == 0) {
+        return;
+    }
+#endif
+    nk_enqueue_thread_on_runq(t, cpu);
+}
+
+
 static inline void
 enqueue_thread_on_tlist (nk_thread_t * t)
 {
-    nk_thread_queue_t * q = glob_sched_state->thread_list;
-    nk_enqueue_entry_atomic(q, &(t->thr_list_node));
-    
-    glob_sched_state->num_threads++;
+    uint8_t flags = irq_disable_save();
+    int cpu = my_cpu_id();
+    struct nk_thread_list * l = &glob_sched_state->thread_lists[cpu];
+    
+    spin_lock(&l->lock);
+    list_add_tail(&(t->thr_list_node), &l->threads);
+    t->tlist_cpu = cpu;
+    l->count++;
+    spin_unlock(&l->lock);
+    irq_enable_restore(flags);
 }
 
 
 static inline nk_thread_t*
 dequeue_thread_from_tlist (nk_thread_t * t)
 {
-    nk_queue_entry_t * elm = NULL;
-    nk_thread_t * ret = NULL;
+    struct nk_thread_list * l = &glob_sched_state->thread_lists[t->tlist_cpu];
+    uint8_t flags = spin_lock_irq_save(&l->lock);
+    
+    list_del_init(&(t->thr_list_node));
+    l->count--;
+    spin_unlock_irq_restore(&l->lock, flags);
     
-    nk_thread_queue_t * q = glob_sched_state->thread_list;
-    elm = nk_dequeue_entry_atomic(q, &(t->thr_list_node));
-    ret = container_of(elm, nk_thread_t, thr_list_node);
+    return t;
+}
+
+
+/* 
+ * the next id from this core's range, taking a new range
+ * from the shared counter once it runs out
+ */
+static unsigned long
+tid_alloc (void)
+{
+    uint8_t flags = irq_disable_save();
+    struct nk_thread_list * l = &glob_sched_state->thread_lists[my_cpu_id()];
+    unsigned long tid;
     
-    glob_sched_state->num_threads--;
+    if (l->next_tid == l->end_tid) {
+        l->next_tid = atomic_add(next_tid, TID_RANGE) + 1;
+        l->end_tid  = l->next_tid + TID_RANGE;
+    }
+    tid = l->next_tid++;
+    irq_enable_restore(flags);
     
-    return ret;
+    return tid;
+}
+
+
+/*
+ * nk_thread_for_each
+ *
+ * Visit every thread in the system. Each core's list is
+ * locked only while it is walked, so creation and exit on
+ * other cores carry on meanwhile, and a thread created or
+ * destroyed during the walk may or may not be seen.
+ * fn runs with interrupts off and must not block.
+ *
+ * @fn: called for each thread, a nonzero return ends the walk
+ * @state: passed to fn
+ *
+ * returns whatever fn returned last
+ *
+ */
+int
+nk_thread_for_each (int (*fn)(nk_thread_t * t, void * state), void * state)
+{
+    struct nk_thread_list * l;
+    nk_thread_t * t;
+    uint8_t flags;
+    int cpu;
+    int rc = 0;
+    
+    for (cpu = 0; cpu < nk_get_num_cpus() && !rc; cpu++) {
+        l = &glob_sched_state->thread_lists[cpu];
+        flags = spin_lock_irq_save(&l->lock);
+        list_for_each_entry(t, &l->threads, thr_list_node) {
+            if ((rc = fn(t, state))) {
+                break;
+            }
+        }
+        spin_unlock_irq_restore(&l->lock, flags);
+    }
+    
+    return rc;
+}
+
+
+uint64_t
+nk_thread_count (void)
+{
+    uint64_t n = 0;
+    int cpu;
+    
+    for (cpu = 0; cpu < nk_get_num_cpus(); cpu++) {
+        n += glob_sched_state->thread_lists[cpu].count;
+    }
+    
+    return n;
 }
 
 
@@ -251,6 +729,10 @@ tls_exit (void)
     unsigned i, j;
     uint8_t called = 0;
     
+    if (!t->tls) {
+        return;
+    }
+    
     for (i = 0; i < MIN_DESTRUCT_ITER; i++) {
         for (j = 0 ; j < TLS_MAX_KEYS; j++) {
             void * val = (void*)t->tls[j];
@@ -268,6 +750,71 @@ tls_exit (void)
 }
 
 
+/*
+ * The idle thread does not live on the run queue, it sits in its CPU's
+ * idle_thread slot and is only chosen when the queue is empty and the
+ * current thread cannot go on (it is blocking or exiting). A running
+ * thread, idle or not, simply keeps the CPU.
+ */
+static inline nk_thread_t *
+idle_thread (struct cpu * cpu)
+{
+    nk_thread_t * me   = get_cur_thread();
+    nk_thread_t * idle = cpu->idle_thread;
+    
+    if (!idle || idle == me || me->status == NK_THR_RUNNING) {
+        return NULL;
+    }
+    
+    idle->status = NK_THR_RUNNING;
+    return idle;
+}
+
+
+/*
+ * Gets another CPU to look at its run queue now rather than at its
+ * next tick: an idle CPU waiting in MWAIT just needs a store, any
+ * other takes an IPI
+ */
+static inline void
+kick_cpu (int cpu)
+{
+#if defined(NAUT_CONFIG_KICK_SCHEDULE) || defined(NAUT_CONFIG_MWAIT_WAKEUP)
+    if (cpu == my_cpu_id() || nk_idle_wake(cpu)) {
+        return;
+    }
+#ifdef NAUT_CONFIG_KICK_SCHEDULE
+    apic_ipi(per_cpu_get(apic),
+             nk_get_nautilus_info()->sys.cpus[cpu]->lapic_id,
+             APIC_NULL_KICK_VEC);
+#endif
+#endif
+}
+
+
+/*
+ * A thread rebound by nk_thread_migrate() while it was queued here is
+ * passed on to its new CPU when this one would have run it. Only this
+ * CPU takes threads off its queue, so the thread is never running when
+ * it moves.
+ */
+static inline int
+thread_forward (nk_thread_t * t, uint32_t cpu)
+{
+    int to = t->bound_cpu;
+    
+    if (likely(to == cpu) || to < 0 || to >= per_cpu_get(system)->num_cpus) {
+        return 0;
+    }
+    
+    SCHED_DEBUG("Forwarding thread %lu from CPU %u to CPU %d\n", t->tid, cpu, to);
+    nk_enqueue_thread_on_runq(t, to);
+    kick_cpu(to);
+    
+    return 1;
+}
+
+
 /*
  * get_runnable_thread
  *
@@ -295,74 +842,357 @@ get_runnable_thread (uint32_t cpu)
     
     ASSERT(runq);
     
-    if (nk_queue_empty(runq)) {
+#ifdef NAUT_CONFIG_LOCKFREE_RUNQ
+    ASSERT(!irqs_enabled());
+    runq_drain(runq);
+#endif
+    
+again:
+#ifdef NAUT_CONFIG_THREAD_WORK_STEALING
+    /* threads nobody has run yet go first */
+    if (sys->cpus[cpu]->steal_q &&
+        (runnable = steal_pop(sys->cpus[cpu]->steal_q))) {
+        if (thread_forward(runnable, cpu)) {
+            goto again;
+        }
+        runnable->status = NK_THR_RUNNING;
+        return runnable;
+    }
+#endif
+    
+    if (nk_queue_empty(runq)) {
+#ifdef NAUT_CONFIG_THREAD_WORK_STEALING
+        /* about to go idle, see if a neighbour has something first */
+        if (steal_wanted() && (runnable = steal_work(cpu))) {
+            runnable->status = NK_THR_RUNNING;
+            return runnable;
+        }
+#endif
+        return idle_thread(sys->cpus[cpu]);
+    }
+    
+    flags = runq_lock(runq);
+    
+    elm = nk_dequeue_first(runq);
+    
+    ASSERT(elm);
+    
+    runnable = container_of(elm, nk_thread_t, runq_node);
+    
+    runq_unlock(runq, flags);
+    //irq_enable_restore(flags);
+    
+    if (thread_forward(runnable, cpu)) {
+        goto again;
+    }
+    
+    runnable->status = NK_THR_RUNNING;
+    return runnable;
+}
+
+
+static inline nk_thread_t * __always_inline
+get_runnable_thread_myq (void)
+{
+    cpu_id_t id = my_cpu_id();
+    return get_runnable_thread(id);
+}
+
+
+/*
+ * The XSAVE area may be larger than the fpu_state array it starts in,
+ * which is the last thing in the struct
+ */
+static inline size_t
+thread_struct_size (void)
+{
+#ifdef NAUT_CONFIG_FPU_XSAVE
+    return sizeof(nk_thread_t) - FXSAVE_SIZE + nk_fpu_state_size();
+#else
+    return sizeof(nk_thread_t);
+#endif
+}
+
+
+#ifdef NAUT_CONFIG_KMEM_SLAB
+static struct nk_slab_cache * thread_slab = NULL;
+#endif
+
+/*
+ * Memory a thread bound to cpu will use for its whole life comes
+ * from that CPU's domain when it can, from anywhere otherwise
+ */
+static inline void *
+thread_mem_alloc (size_t size, int cpu)
+{
+    void * p = malloc_node(size, nk_get_nautilus_info()->sys.cpus[cpu]->domain->id);
+
+    return p ? p : malloc(size);
+}
+
+
+static inline nk_thread_t *
+thread_struct_alloc (int cpu)
+{
+#ifdef NAUT_CONFIG_KMEM_SLAB
+    return nk_slab_alloc(thread_slab);
+#else
+    return thread_mem_alloc(thread_struct_size(), cpu);
+#endif
+}
+
+
+static inline void
+thread_struct_free (nk_thread_t * t)
+{
+#ifdef NAUT_CONFIG_KMEM_SLAB
+    nk_slab_free(thread_slab, t);
+#else
+    free(t);
+#endif
+}
+
+
+#ifdef NAUT_CONFIG_HW_TLS
+extern char _tls_start[], _tdata_end[], _tls_end[];
+
+/*
+ * Fill in a thread's copy of the __thread variables from the ELF
+ * template, .tdata followed by a zeroed .tbss. As x86-64 wants it,
+ * the block ends where FS points, and the word there holds its own
+ * address. The linker pads the template to 64 bytes so that offsets
+ * it computed hold here for variables aligned to at most that.
+ */
+static int
+thread_tls_init (nk_thread_t * t, int cpu)
+{
+    size_t size  = _tls_end - _tls_start;
+    size_t tdata = _tdata_end - _tls_start;
+    
+    if (!t->tls_block) {
+        t->tls_block = thread_mem_alloc(size + 64, cpu);
+        if (!t->tls_block) {
+            ERROR_PRINT("Could not allocate TLS block\n");
+            return -1;
+        }
+    }
+    
+    memcpy(t->tls_block, _tls_start, tdata);
+    memset(t->tls_block + tdata, 0, size - tdata);
+    
+    t->fs_base = (addr_t)t->tls_block + size;
+    *(addr_t*)t->fs_base = t->fs_base;
+    
+    return 0;
+}
+
+
+void
+nk_tls_switch (nk_thread_t * next)
+{
+    msr_write(MSR_FS_BASE, next->fs_base);
+}
+#endif
+
+
+/*
+ * The stack size a request actually gets
+ */
+static inline nk_stack_size_t
+thread_stack_size (nk_stack_size_t stack_size)
+{
+#ifndef NAUT_CONFIG_THREAD_OPTIMIZE
+    return stack_size ? stack_size : PAGE_SIZE;
+#else
+    return PAGE_SIZE_4KB;
+#endif
+}
+
+
+/*
+ * Stacks bigger than a page are demand-paged when lazy stacks are
+ * enabled, anything else comes from malloc()
+ */
+static inline void *
+thread_stack_alloc (nk_stack_size_t size, int cpu)
+{
+#ifdef NAUT_CONFIG_THREAD_LAZY_STACKS
+    if (size > PAGE_SIZE_4KB) {
+        void * stack = nk_vstack_alloc(size);
+        if (stack) {
+            return stack;
+        }
+    }
+#endif
+    return thread_mem_alloc(size, cpu);
+}
+
+
+static inline void
+thread_stack_free (void * stack)
+{
+#ifdef NAUT_CONFIG_THREAD_LAZY_STACKS
+    if (nk_vstack_owns(stack)) {
+        nk_vstack_free(stack);
+        return;
+    }
+#endif
+    free(stack);
+}
+
+
+#if defined(NAUT_CONFIG_KMEM_PAGE_COLORS) && defined(NAUT_CONFIG_USE_RT_SCHEDULER)
+/*
+ * Move a real-time thread that has not run yet onto a stack in the
+ * reserved page colors, when colors are reserved and the stack is
+ * small enough to be kept to them
+ */
+static void
+thread_stack_recolor (nk_thread_t * t)
+{
+    uint64_t colors = kmem_colors_reserved();
+    void * stack;
+
+    if (!colors || !(stack = malloc_colored(t->stack_size, colors))) {
+        return;
+    }
+
+    thread_stack_free(t->stack);
+    t->stack = stack;
+    t->rsp   = (uint64_t)stack + t->stack_size - sizeof(uint64_t);
+}
+#endif
+
+
+#ifdef NAUT_CONFIG_THREAD_CACHE
+/*
+ * Per-CPU caches of dead threads, one list per stack size class. A
+ * thread is pushed on the cache of the CPU that destroys it and popped
+ * by the next create of the same size on that CPU, keeping its stack
+ * and its wait queue. Both ends run with interrupts off on their own
+ * CPU, so no lock is needed.
+ */
+#define THREAD_CACHE_CLASSES 3
+
+struct thread_cache {
+    nk_thread_t * head[THREAD_CACHE_CLASSES];
+    unsigned count[THREAD_CACHE_CLASSES];
+};
+
+static struct thread_cache thread_caches[NAUT_CONFIG_MAX_CPUS];
+
+
+static inline int
+thread_cache_class (nk_stack_size_t size)
+{
+    switch (size) {
+        case TSTACK_4KB: return 0;
+        case TSTACK_1MB: return 1;
+        case TSTACK_2MB: return 2;
+        default:         return -1;
+    }
+}
+
+
+/*
+ * Make a cached thread look freshly allocated. The stack is left as it
+ * is (it is never cleared on creation either) and tls[] is only cleared
+ * if the last owner set a key. fpu_state is set up by thread_init().
+ */
+static void
+thread_cache_reset (nk_thread_t * t)
+{
+    void * stack                = t->stack;
+    nk_stack_size_t stack_size  = t->stack_size;
+    nk_thread_queue_t * waitq   = t->waitq;
+    uint8_t tls_dirty           = t->tls_dirty;
+    const void ** tls           = t->tls;
+#ifdef NAUT_CONFIG_HW_TLS
+    void * tls_block            = t->tls_block;
+#endif
+    
+    memset(t, 0, offsetof(struct nk_thread, fpu_state));
+    
+    if (tls && tls_dirty) {
+        memset(tls, 0, TLS_MAX_KEYS * sizeof(void*));
+    }
+    
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    t->rt_thread = NULL;
+#endif
+    
+    t->stack      = stack;
+    t->stack_size = stack_size;
+    t->waitq      = waitq;
+    t->tls        = tls;
+#ifdef NAUT_CONFIG_HW_TLS
+    t->tls_block  = tls_block;
+#endif
+}
+
+
+static nk_thread_t *
+thread_cache_get (nk_stack_size_t size)
+{
+    int cls = thread_cache_class(size);
+    struct thread_cache * c;
+    nk_thread_t * t;
+    uint8_t flags;
+    
+    if (cls < 0) {
         return NULL;
     }
     
-    flags = spin_lock_irq_save(&runq->lock);
-    
-    elm = nk_dequeue_first(runq);
-    
-    ASSERT(elm);
-    
-    runnable = container_of(elm, nk_thread_t, runq_node);
-    
-    if (!get_cur_thread()->is_idle &&
-        get_cur_thread()->status == NK_THR_RUNNING) {
-        
-        /* the next thing is an idle thread, but do we have something else to run? */
-        if (runnable->is_idle)  {
-            
-            if (!nk_queue_empty(runq)) {
-                
-                nk_thread_t * idle = runnable;
-                elm = nk_dequeue_first(runq);
-                
-                ASSERT(elm);
-                
-                runnable = container_of(elm, nk_thread_t, runq_node);
-                
-                ASSERT(runnable);
-                
-                
-                idle->status    = NK_THR_SUSPENDED;
-                nk_enqueue_entry(runq, &(idle->runq_node));
-                
-                //nk_enqueue_thread_on_runq(idle, cpu);
-                
-                
-            } else  {
-                /* we put the idle thread back when it is the only thing on the queue */
-                runnable->status = NK_THR_SUSPENDED;
-                nk_enqueue_entry(runq, &(runnable->runq_node));
-                //nk_enqueue_thread_on_runq(runnable, cpu);
-                runnable  = NULL;
-            }
-            
-        } else {
-            /* all good, we switch to runnable */
-        }
-        
-    } else {
-        /* if we're the idle thread, we *ALWAYS* run the next thing */
+    flags = irq_disable_save();
+    c = &thread_caches[my_cpu_id()];
+    t = c->head[cls];
+    if (t) {
+        c->head[cls] = t->cache_next;
+        c->count[cls]--;
     }
+    irq_enable_restore(flags);
     
-    if (runnable) {
-        runnable->status = NK_THR_RUNNING;
+    if (t) {
+        thread_cache_reset(t);
     }
     
-    spin_unlock_irq_restore(&runq->lock, flags);
-    //irq_enable_restore(flags);
-    return runnable;
+    return t;
 }
 
 
-static inline nk_thread_t * __always_inline
-get_runnable_thread_myq (void)
+/*
+ * returns 0 if the thread was kept, -1 if the caller should free it
+ */
+static int
+thread_cache_put (nk_thread_t * t)
 {
-    cpu_id_t id = my_cpu_id();
-    return get_runnable_thread(id);
+    int cls = thread_cache_class(t->stack_size);
+    struct thread_cache * c;
+    uint8_t flags;
+    int ret = -1;
+    
+    if (cls < 0) {
+        return -1;
+    }
+    
+    flags = irq_disable_save();
+    c = &thread_caches[my_cpu_id()];
+    if (c->count[cls] < NAUT_CONFIG_THREAD_CACHE_DEPTH) {
+        /* a wait queue with entries left is torn down as usual */
+        if (!nk_queue_empty(t->waitq)) {
+            nk_thread_queue_destroy(t->waitq);
+            t->waitq = NULL;
+        }
+        t->cache_next = c->head[cls];
+        c->head[cls]  = t;
+        c->count[cls]++;
+        ret = 0;
+    }
+    irq_enable_restore(flags);
+    
+    return ret;
 }
+#endif /* NAUT_CONFIG_THREAD_CACHE */
 
 
 static int
@@ -380,11 +1210,17 @@ thread_init (nk_thread_t * t,
     
     t->stack      = stack;
     t->rsp        = (uint64_t)stack + t->stack_size - sizeof(uint64_t);
-    t->tid        = atomic_inc(next_tid) + 1;
+    t->tid        = tid_alloc();
     t->refcount   = is_detached ? 1 : 2; // thread references itself as well
     t->parent     = parent;
     t->bound_cpu  = cpu;
     t->fpu_state_offset = offsetof(struct nk_thread, fpu_state);
+#ifdef NAUT_CONFIG_FPU_SAVE
+    nk_fpu_state_init(t->fpu_state);
+#endif
+#ifdef NAUT_CONFIG_FPU_LAZY
+    t->fpu_cpu = -1;
+#endif
     
     INIT_LIST_HEAD(&(t->children));
     
@@ -393,6 +1229,10 @@ thread_init (nk_thread_t * t,
         list_add_tail(&(t->child_node), &(parent->children));
     }
     
+#ifdef NAUT_CONFIG_THREAD_CACHE
+    /* a cached thread keeps its (empty) wait queue */
+    if (!t->waitq)
+#endif
     t->waitq = nk_thread_queue_create();
     if (!t->waitq) {
         ERROR_PRINT("Could not create thread's wait queue\n");
@@ -508,6 +1348,7 @@ nk_thread_create (nk_thread_fun_t fun,
 {
     nk_thread_t * t = NULL;
     void * stack    = NULL;
+    int any_cpu     = (cpu == CPU_ANY);
     
     if (cpu == CPU_ANY) {
         cpu = my_cpu_id();
@@ -522,7 +1363,15 @@ nk_thread_create (nk_thread_fun_t fun,
     }
 #endif
     
-    t = malloc(sizeof(nk_thread_t));
+#ifdef NAUT_CONFIG_THREAD_CACHE
+    t = thread_cache_get(thread_stack_size(stack_size));
+    if (t) {
+        stack = t->stack;
+        goto have_thread;
+    }
+#endif
+    
+    t = thread_struct_alloc(cpu);
     
 #ifndef NAUT_CONFIG_THREAD_OPTIMIZE
     ASSERT(t);
@@ -530,31 +1379,34 @@ nk_thread_create (nk_thread_fun_t fun,
         ERROR_PRINT("Could not allocate thread struct\n");
         return -EINVAL;
     }
-    memset(t, 0, sizeof(nk_thread_t));
+    memset(t, 0, thread_struct_size());
 #endif
     
     
-#ifndef NAUT_CONFIG_THREAD_OPTIMIZE
-    if (stack_size) {
-        stack         = (void*)malloc(stack_size);
-        t->stack_size = stack_size;
-    } else {
-        stack         = (void*)malloc(PAGE_SIZE);
-        t->stack_size =  PAGE_SIZE;
-    }
-#else
-    stack         = malloc(PAGE_SIZE_4KB);
-    t->stack_size = PAGE_SIZE_4KB;
-#endif
+    t->stack_size = thread_stack_size(stack_size);
+    stack         = thread_stack_alloc(t->stack_size, cpu);
     
     ASSERT(stack);
     
+#ifdef NAUT_CONFIG_THREAD_CACHE
+    t->waitq = NULL;
+have_thread:
+#endif
     if (thread_init(t, stack, is_detached, cpu, get_cur_thread()) < 0) {
         ERROR_PRINT("Could not initialize thread\n");
         goto out_err1;
     }
     
+#ifdef NAUT_CONFIG_HW_TLS
+    if (thread_tls_init(t, cpu) < 0) {
+        goto out_err1;
+    }
+#endif
+    
     t->status = NK_THR_INIT;
+#ifdef NAUT_CONFIG_THREAD_WORK_STEALING
+    t->is_stealable = any_cpu;
+#endif
     
     t->fun = fun;
     t->input = input;
@@ -571,8 +1423,12 @@ nk_thread_create (nk_thread_fun_t fun,
     return 0;
     
 out_err1:
-    free(stack);
-    free(t);
+    free(t->tls);
+#ifdef NAUT_CONFIG_HW_TLS
+    free(t->tls_block);
+#endif
+    thread_stack_free(stack);
+    thread_struct_free(t);
     return -1;
 }
 
@@ -594,6 +1450,8 @@ out_err1:
  *
  *
  * on error, returns -EINVAL, otherwise 0
+ * under the RT scheduler a periodic or sporadic thread that its CPU
+ * will not admit is reclaimed, and this returns -1
  */
 
 #ifndef NAUT_CONFIG_USE_RT_SCHEDULER
@@ -622,40 +1480,66 @@ nk_thread_start (nk_thread_fun_t fun,
 {
     nk_thread_id_t newtid   = NULL;
     nk_thread_t * newthread = NULL;
-    
-    /* put it on the current CPU */
-    if (cpu == CPU_ANY) {
-        cpu = my_cpu_id();
-    }
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    int placed = rt_type & RT_PLACED;
+
+    rt_type &= ~RT_PLACED;
+#endif
     
     if (nk_thread_create(fun, input, output, is_detached, stack_size, &newtid, cpu) < 0) {
         ERROR_PRINT("Could not create thread\n");
         return -1;
     }
     
+    /* put it on the current CPU */
+    if (cpu == CPU_ANY) {
+        cpu = my_cpu_id();
+    }
+    
     newthread = (nk_thread_t*)newtid;
     
     if (tid) {
         *tid = newtid;
     }
     
+#if defined(NAUT_CONFIG_KMEM_PAGE_COLORS) && defined(NAUT_CONFIG_USE_RT_SCHEDULER)
+    if (rt_type != APERIODIC) {
+        thread_stack_recolor(newthread);
+    }
+#endif
     thread_setup_init_stack(newthread, fun, input);
 
 #ifdef NAUT_CONFIG_USE_RT_SCHEDULER
     rt_thread *rt = rt_thread_init(rt_type, rt_constraints, rt_deadline, newthread);
     struct sys_info *sys = per_cpu_get(system);
+    if (!rt) {
+        ERROR_PRINT("Could not create real-time thread\n");
+        return -1;
+    }
+    if (placed) {
+        rt_thread_placed(rt, cpu);
+    }
     if (sys->cpus[cpu]->rt_sched)
     {
-        if (rt_type == APERIODIC) {
-            enqueue_thread(sys->cpus[cpu]->rt_sched->aperiodic, rt);
-        } else {
-            enqueue_thread(sys->cpus[cpu]->rt_sched->arrival, rt);
-        }
+        rt_thread_arrive(cpu, rt);
     }
 
     nk_schedule();
+
+    if (rt_type != APERIODIC && sys->cpus[cpu]->rt_sched && rt_thread_admission(rt)) {
+        ERROR_PRINT("Thread not admitted on cpu %d\n", cpu);
+        if (tid) {
+            *tid = NULL;
+        }
+        /* it never ran, so nobody but us knows of it */
+        uint8_t flags = irq_disable_save();
+        list_del(&(newthread->child_node));
+        thread_reap(newthread);
+        irq_enable_restore(flags);
+        return -1;
+    }
 #else
-    nk_enqueue_thread_on_runq(newthread, cpu);
+    enqueue_new_thread(newthread, cpu);
 #endif
     
     
@@ -667,18 +1551,87 @@ nk_thread_start (nk_thread_fun_t fun,
     }
 #endif
     
-#ifdef NAUT_CONFIG_KICK_SCHEDULE
-    // kick it
-    if (cpu != my_cpu_id()) {
-        apic_ipi(per_cpu_get(apic),
-                 nk_get_nautilus_info()->sys.cpus[cpu]->lapic_id,
-                 APIC_NULL_KICK_VEC);
-    }
-#endif
+    kick_cpu(cpu);
     
     return 0;
 }
 
+#if defined(NAUT_CONFIG_USE_RT_SCHEDULER) && defined(NAUT_CONFIG_RT_TASK_SETS)
+/* cycles from the call to the default start time of a task set */
+#define RT_SET_LEAD 10000000ULL
+
+/*
+ * nk_rt_admit_set
+ *
+ * places, admits and starts n periodic threads as one set: either
+ * all of them run, with their first jobs released together at start
+ * (a TSC time, 0 for shortly after the call), or none does
+ *
+ * @set: the members, their cpu and tid are filled in
+ * @n: the number of members
+ * @policy: an rt_place_policy, applied to the members largest first
+ * @start: common release time of the first jobs
+ *
+ * returns 0 once every member is admitted, -1 otherwise
+ */
+int nk_rt_admit_set (nk_rt_set_member *set, int n, int policy, uint64_t start)
+{
+    rt_set status = { 0, 0 };
+    nk_thread_t *t;
+    rt_thread *rt;
+    int i, made;
+
+    if (n <= 0 || rt_set_place(set, n, (rt_place_policy)policy)) {
+        return -1;
+    }
+
+    if (!start) {
+        start = cur_time() + RT_SET_LEAD;
+    }
+
+    /* all the threads exist before any is handed over */
+    for (made = 0; made < n; made++) {
+        if (nk_thread_create(set[made].fun, set[made].input, set[made].output, 0,
+                             set[made].stack_size, &set[made].tid, set[made].cpu) < 0) {
+            break;
+        }
+        t = (nk_thread_t *)set[made].tid;
+        thread_setup_init_stack(t, set[made].fun, set[made].input);
+        if (!rt_thread_init(PERIODIC, set[made].constraints, 0, t)) {
+            break;
+        }
+    }
+    if (made < n) {
+        ERROR_PRINT("Could not create member %d of a real-time task set\n", made);
+        rt_set_unplace(set + made, n - made);
+    }
+
+    /* the cores admit their members, then hold them until start */
+    status.undecided = made;
+    for (i = 0; i < made; i++) {
+        t = (nk_thread_t *)set[i].tid;
+        rt_set_submit(set[i].cpu, t->rt_thread, &status, start);
+    }
+    while (status.undecided) {
+        nk_yield();
+    }
+
+    if (made == n && !status.refused) {
+        return 0;
+    }
+
+    /* refused ones are gone already, the rest never see their start */
+    for (i = 0; i < made; i++) {
+        rt = ((nk_thread_t *)set[i].tid)->rt_thread;
+        if (rt->status == ADMITTED) {
+            rt_set_withdraw(rt);
+        }
+    }
+    ERROR_PRINT("Real-time task set of %d threads not admitted\n", n);
+    return -1;
+}
+#endif
+
 int nk_thread_run(nk_thread_id_t t)
 {
     nk_thread_t * newthread = (nk_thread_t*)t;
@@ -699,15 +1652,7 @@ int nk_thread_run(nk_thread_id_t t)
     }
 #endif
     
-#ifdef NAUT_CONFIG_KICK_SCHEDULE
-    // kick it
-    // this really should not fire on CPU_ANY....
-    if (newthread->bound_cpu != my_cpu_id()) {
-        apic_ipi(per_cpu_get(apic),
-                 nk_get_nautilus_info()->sys.cpus[newthread->bound_cpu]->lapic_id,
-                 APIC_NULL_KICK_VEC);
-    }
-#endif
+    kick_cpu(newthread->bound_cpu);
     
     return 0;
 }
@@ -774,43 +1719,105 @@ nk_thread_exit (void * retval)
 
 
 /*
- * nk_thread_destroy
+ * thread_reap
  *
- * destroys a thread and reclaims its memory (its stack page mostly)
+ * the part of destroying a thread that waits and frees
  * interrupts should be off
  *
- * @t: the thread to destroy
+ * @thethread: the thread to reap, already handed to rt_thread_exit()
  *
  */
-void
-nk_thread_destroy (nk_thread_id_t t)
+static void
+thread_reap (nk_thread_t * thethread)
 {
-    nk_thread_t * thethread = (nk_thread_t*)t;
-    
-    SCHED_DEBUG("Destroying thread (%p, tid=%lu)\n", (void*)thethread, thethread->tid);
-
     #ifdef NAUT_CONFIG_USE_RT_SCHEDULER
-        rt_thread *t = ((nk_thread_t *)t)->rt_thread;
-        rt_thread_exit(t);
+        rt_thread *rt = thethread->rt_thread;
         while (rt->status != REMOVED);
-        free(rt->constraints);
-        free(rt);
+        rt_thread_free(rt);
         
     #endif
 
     ASSERT(!irqs_enabled());
     nk_dequeue_thread_from_runq(thethread);
     dequeue_thread_from_tlist(thethread);
+
+#ifdef NAUT_CONFIG_PMC_THREAD
+    nk_pmc_thread_free(thethread);
+#endif
     
     /* remove it from any wait queues */
     nk_dequeue_entry(&(thethread->wait_node));
     
+#ifdef NAUT_CONFIG_THREAD_CACHE
+    if (thread_cache_put(thethread) == 0) {
+        return;
+    }
+#endif
+    
     /* remove its own wait queue
      * (waiters should already have been notified */
     nk_thread_queue_destroy(thethread->waitq);
     
-    free(thethread->stack);
-    free(thethread);
+    free(thethread->tls);
+#ifdef NAUT_CONFIG_HW_TLS
+    free(thethread->tls_block);
+#endif
+    thread_stack_free(thethread->stack);
+    thread_struct_free(thethread);
+}
+
+
+#ifdef NAUT_CONFIG_WORKQUEUE
+static void
+thread_reap_work (struct nk_work * w)
+{
+    nk_thread_t * thethread = container_of(w, nk_thread_t, reap_work);
+    uint8_t flags;
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    /* the scheduler has not let go of it yet, try again later */
+    if (thethread->rt_thread->status != REMOVED) {
+        nk_work_retry(w);
+        return;
+    }
+#endif
+
+    flags = irq_disable_save();
+    thread_reap(thethread);
+    irq_enable_restore(flags);
+}
+#endif
+
+
+/*
+ * nk_thread_destroy
+ *
+ * destroys a thread and reclaims its memory (its stack page mostly)
+ * interrupts should be off
+ *
+ * with the work queue the reclaiming is left to this core's worker,
+ * if it has one
+ *
+ * @t: the thread to destroy
+ *
+ */
+void
+nk_thread_destroy (nk_thread_id_t t)
+{
+    nk_thread_t * thethread = (nk_thread_t*)t;
+    
+    SCHED_DEBUG("Destroying thread (%p, tid=%lu)\n", (void*)thethread, thethread->tid);
+
+    #ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+        rt_thread_exit(thethread->rt_thread);
+    #endif
+
+#ifdef NAUT_CONFIG_WORKQUEUE
+    if (nk_work_queue(&thethread->reap_work, thread_reap_work) == 0) {
+        return;
+    }
+#endif
+    thread_reap(thethread);
 }
 
 
@@ -868,8 +1875,12 @@ out:
 {
     nk_thread_t *thethread = (nk_thread_t*)t;
     rt_thread *rt = thethread->rt_thread;
+    rt_thread *me = get_cur_thread()->rt_thread;
+
+    me->join_count = 2;
+    rt_thread_join_on(rt);
     rt_thread_exit(rt);
-    while (rt->status != REMOVED);
+    rt_thread_join_wait();
 
     return 0;
 }
@@ -891,6 +1902,7 @@ out:
  */
 int
 nk_join_all_children (int (*func)(void * res))
+#ifndef NAUT_CONFIG_USE_RT_SCHEDULER
 {
     nk_thread_t * elm = NULL;
     nk_thread_t * tmp = NULL;
@@ -918,6 +1930,37 @@ nk_join_all_children (int (*func)(void * res))
     
     return ret;
 }
+#else
+{
+    nk_thread_t * elm = NULL;
+    nk_thread_t * me         = get_cur_thread();
+    uint64_t n               = 0;
+    int ret                  = 0;
+
+    /* one wait for all of them rather than one per child */
+    list_for_each_entry(elm, &(me->children), child_node) {
+        n++;
+    }
+    me->rt_thread->join_count = n + 1;
+
+    list_for_each_entry(elm, &(me->children), child_node) {
+        rt_thread_join_on(elm->rt_thread);
+        rt_thread_exit(elm->rt_thread);
+    }
+    rt_thread_join_wait();
+
+    if (func) {
+        list_for_each_entry(elm, &(me->children), child_node) {
+            if (func(elm->output) < 0) {
+                ERROR_PRINT("Could not invoke destructo for child thread (t=%p)\n", elm);
+                ret = -1;
+            }
+        }
+    }
+
+    return ret;
+}
+#endif
 
 
 /*
@@ -964,40 +2007,118 @@ nk_yield (void)
     nk_thread_t * runme = NULL;
     nk_thread_t * me    = get_cur_thread();
     uint8_t flags       = irq_disable_save();
-    if (nk_queue_empty(per_cpu_get(run_q))) {
+#ifndef NAUT_CONFIG_THREAD_WORK_STEALING
+    /* with work stealing there may be something to take even so */
+    if (runq_empty(per_cpu_get(run_q))) {
         irq_enable_restore(flags);
         return;
     }
-    /* only put myself on the run queue if there
-     * is something else to run */
-    if ((runme = get_runnable_thread_myq())) {
+#endif
+    /* only put myself on the run queue if there
+     * is something else to run */
+    if ((runme = get_runnable_thread_myq())) {
+        
+        /* requeued here even if rebound, see thread_forward() */
+        nk_enqueue_thread_on_runq(me, my_cpu_id());
+#ifdef NAUT_CONFIG_ENABLE_STACK_CHECK
+        if (me->rsp <= (uint64_t)(me->stack)) {
+            panic("This thread (%p, tid=%u) has run off the end of its stack! (start=%p, rsp=%p, start size=%lx)\n",
+                  (void*)me,
+                  me->tid,
+                  me->stack,
+                  (void*)me->rsp,
+                  me->stack_size);
+        }
+#endif /* !NAUT_CONFIG_ENABLE_STACK_CHECK */
+        NK_TRACE(NK_TRACE_SWITCH, runme->tid, 0, 0);
+        nk_thread_switch(runme);
+        
+    }
+    irq_enable_restore(flags);
+}
+#else
+{
+
+    // Dequeue aperiodic 
+        // Enqueue current queue
+    // Else if hard real-time
+        // Dequeue run queue
+        // enqueue current queue on arrival queue
+    // Switch to new queue
+    // nk_thread_switch()
+}
+#endif
+
+
+/*
+ * nk_thread_migrate
+ *
+ * rebinds a thread to another CPU without tearing it down. The thread
+ * moves the next time the CPU it is on would run it: a queued thread is
+ * forwarded by that CPU's scheduler and a waiting thread is woken onto
+ * the new CPU. The caller moves right away if this CPU has something
+ * else to run. Under the RT scheduler the target must admit the thread,
+ * and it moves at the end of its current job (aperiodic threads when
+ * they are next descheduled).
+ *
+ * @tid: the thread to move
+ * @cpu: the CPU to bind it to
+ *
+ * returns -EINVAL on error, 0 on success
+ *
+ */
+int
+nk_thread_migrate (nk_thread_id_t tid, int cpu)
+#ifndef NAUT_CONFIG_USE_RT_SCHEDULER
+{
+    nk_thread_t * t       = (nk_thread_t*)tid;
+    nk_thread_t * me      = get_cur_thread();
+    nk_thread_t * runme   = NULL;
+    struct sys_info * sys = per_cpu_get(system);
+    uint8_t flags;
+    
+    if (!t || cpu < 0 || cpu >= sys->num_cpus || !sys->cpus[cpu]) {
+        ERROR_PRINT("Invalid thread migration (t=%p, cpu=%d)\n", (void*)t, cpu);
+        return -EINVAL;
+    }
+    
+    if (t->is_idle) {
+        ERROR_PRINT("Idle thread %lu cannot change CPU\n", t->tid);
+        return -EINVAL;
+    }
+    
+    flags = irq_disable_save();
+    
+    t->bound_cpu = cpu;
+    
+    if (t == me && cpu != my_cpu_id()) {
+        /* lets the idle thread take over if there is nothing else */
+        me->status = NK_THR_SUSPENDED;
         
-        nk_enqueue_thread_on_runq(me, me->bound_cpu);
-#ifdef NAUT_CONFIG_ENABLE_STACK_CHECK
-        if (me->rsp <= (uint64_t)(me->stack)) {
-            panic("This thread (%p, tid=%u) has run off the end of its stack! (start=%p, rsp=%p, start size=%lx)\n",
-                  (void*)me,
-                  me->tid,
-                  me->stack,
-                  (void*)me->rsp,
-                  me->stack_size);
+        if ((runme = get_runnable_thread_myq())) {
+            nk_enqueue_thread_on_runq(me, my_cpu_id());
+            NK_TRACE(NK_TRACE_SWITCH, runme->tid, 0, 0);
+            nk_thread_switch(runme);
+        } else {
+            /* we go on our next yield */
+            me->status = NK_THR_RUNNING;
         }
-#endif /* !NAUT_CONFIG_ENABLE_STACK_CHECK */
-        nk_thread_switch(runme);
-        
     }
+    
     irq_enable_restore(flags);
+    return 0;
 }
 #else
 {
-
-    // Dequeue aperiodic 
-        // Enqueue current queue
-    // Else if hard real-time
-        // Dequeue run queue
-        // enqueue current queue on arrival queue
-    // Switch to new queue
-    // nk_thread_switch()
+    nk_thread_t * t       = (nk_thread_t*)tid;
+    struct sys_info * sys = per_cpu_get(system);
+    
+    if (!t || !t->rt_thread || cpu < 0 || cpu >= sys->num_cpus) {
+        ERROR_PRINT("Invalid thread migration (t=%p, cpu=%d)\n", (void*)t, cpu);
+        return -EINVAL;
+    }
+    
+    return rt_thread_migrate(t->rt_thread, cpu) ? -EINVAL : 0;
 }
 #endif
 
@@ -1016,6 +2137,33 @@ nk_set_thread_fork_output (void * result)
 }
 
 
+/*
+ * wake_waiter
+ *
+ * make runnable a thread just unlinked from a wait queue. Under the RT
+ * scheduler it blocked itself in nk_thread_queue_wait_word() and goes
+ * back to its core's scheduler, which never saw it as waiting
+ *
+ * @t: the thread, still marked NK_THR_WAITING
+ *
+ */
+static inline void
+wake_waiter (nk_thread_t * t)
+{
+    NK_PROF_WAKEUP(t);
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    /* what the sleeper checks once it runs again */
+    t->status = NK_THR_SUSPENDED;
+    mbarrier();
+    rt_thread_unblock(t->rt_thread);
+#else
+    nk_enqueue_thread_on_runq(t, t->bound_cpu);
+    
+    kick_cpu(t->bound_cpu);
+#endif
+}
+
+
 /*
  * nk_thread_queue_sleep
  *
@@ -1036,6 +2184,131 @@ nk_thread_queue_sleep (nk_thread_queue_t * q)
 }
 
 
+/*
+ * nk_thread_queue_wait_word
+ *
+ * futex-style wait: sleep on the queue only if *word still holds val.
+ * The word is checked without any lock first, then again under the
+ * queue lock so that a wakeup between the check and the sleep cannot be
+ * lost. Sleepers are counted in q->waiters, which is what lets
+ * nk_thread_queue_wake_word() skip the queue entirely when nobody is
+ * there.
+ *
+ * @q: the thread queue to sleep on
+ * @word: the word the waker changes before waking
+ * @val: the value that means "keep waiting"
+ *
+ * returns -EAGAIN if the word had already changed, 0 after a wakeup
+ *
+ */
+int
+nk_thread_queue_wait_word (nk_thread_queue_t * q, volatile uint32_t * word, uint32_t val)
+{
+    nk_thread_t * t = get_cur_thread();
+    uint8_t flags;
+    
+    if (*word != val) {
+        return -EAGAIN;
+    }
+    
+    /* a full barrier, the waker must see us before we look again */
+    atomic_inc(q->waiters);
+    
+    flags = spin_lock_irq_save(&(q->lock));
+    
+    if (*word != val) {
+        spin_unlock_irq_restore(&(q->lock), flags);
+        atomic_dec(q->waiters);
+        return -EAGAIN;
+    }
+    
+    ASSERT(t->status != NK_THR_WAITING);
+    t->status = NK_THR_WAITING;
+    nk_enqueue_entry(q, &(t->wait_node));
+    
+    /* interrupts stay off until we are off the CPU */
+    spin_unlock(&(q->lock));
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+    /*
+     * The RT scheduler does not look at our status, we block with it
+     * and the waker, having unlinked us, hands us back to our core
+     */
+    do {
+        t->rt_thread->status = BLOCKED;
+        t->rt_thread->blocking = 1;
+        nk_schedule();
+    } while (t->status == NK_THR_WAITING);
+    t->status = NK_THR_RUNNING;
+#else
+    nk_schedule();
+#endif
+    irq_enable_restore(flags);
+    
+    atomic_dec(q->waiters);
+    return 0;
+}
+
+
+/*
+ * nk_thread_queue_wake_word
+ *
+ * wake up after changing a word others wait on with
+ * nk_thread_queue_wait_word(). When no one is waiting this is just a
+ * fence and a read, no lock and no scheduler.
+ *
+ * @q: the queue the waiters sleep on
+ * @all: wake all waiters instead of one
+ *
+ * returns -EINVAL on error, 0 on success
+ *
+ */
+int
+nk_thread_queue_wake_word (nk_thread_queue_t * q, uint8_t all)
+{
+    /* order the caller's store to the word before the read of waiters */
+    mbarrier();
+    
+    if (likely(!q->waiters)) {
+        return 0;
+    }
+    
+    return all ? nk_thread_queue_wake_all(q) : nk_thread_queue_wake_one(q);
+}
+
+
+/*
+ * nk_thread_queue_wake_thread
+ *
+ * wake one particular thread if it is still asleep on this queue,
+ * for instance because its wait timed out. A thread just taken off
+ * the queue by a waker is still marked waiting, but its wait_node
+ * has already been unlinked, which is what we check under the lock.
+ *
+ * @q: the queue the thread sleeps on
+ * @t: the thread to wake
+ *
+ * returns 0 if the thread was woken, -EINVAL if it was not waiting
+ *
+ */
+int
+nk_thread_queue_wake_thread (nk_thread_queue_t * q, nk_thread_t * t)
+{
+    uint8_t flags = spin_lock_irq_save(&q->lock);
+    
+    if (t->status != NK_THR_WAITING || 
+        t->wait_node.node.next == (struct list_head*)LIST_POISON1) {
+        spin_unlock_irq_restore(&q->lock, flags);
+        return -EINVAL;
+    }
+    
+    nk_dequeue_entry(&(t->wait_node));
+    wake_waiter(t);
+    
+    spin_unlock_irq_restore(&q->lock, flags);
+    return 0;
+}
+
+
 /*
  * nk_thread_queue_wake_one
  *
@@ -1048,7 +2321,6 @@ nk_thread_queue_sleep (nk_thread_queue_t * q)
  */
 int
 nk_thread_queue_wake_one (nk_thread_queue_t * q)
-#ifndef NAUT_CONFIG_USE_RT_SCHEDULER
 {
     nk_queue_entry_t * elm = NULL;
     nk_thread_t * t = NULL;
@@ -1071,38 +2343,12 @@ nk_thread_queue_wake_one (nk_thread_queue_t * q)
     ASSERT(t);
     ASSERT(t->status == NK_THR_WAITING);
     
-    nk_enqueue_thread_on_runq(t, t->bound_cpu);
-    
-#ifdef NAUT_CONFIG_KICK_SCHEDULE
-    // kick it
-    if (t->bound_cpu != my_cpu_id()) {
-        apic_ipi(per_cpu_get(apic),
-                 nk_get_nautilus_info()->sys.cpus[t->bound_cpu]->lapic_id,
-                 APIC_NULL_KICK_VEC);
-    }
-#endif
+    wake_waiter(t);
     
 out:
     irq_enable_restore(flags);
     return 0;
 }
-#else
-{
-    struct sys_info *sys = per_cpu_get(system);
-    rt_scheduler *sched = sys->cpus[my_cpu_id()];
-    rt_thread *woke = dequeue_thread(sched->sleeping);
-
-    if (woke != NULL) {
-        if (woke->type == APERIODIC) {
-            woke->status = ADMITTED;
-            enqueue_thread(sched->aperiodic, woke);
-        } else {
-            woke->status = ARRIVED;
-            enqueue_thread(sched->arrival, woke);
-        }
-    }
-}
-#endif
 
 
 /*
@@ -1117,7 +2363,6 @@ out:
  */
 int
 nk_thread_queue_wake_all (nk_thread_queue_t * q)
-#ifndef NAUT_CONFIG_USE_RT_SCHEDULER
 {
     nk_queue_entry_t * elm = NULL;
     nk_thread_t * t = NULL;
@@ -1135,41 +2380,12 @@ nk_thread_queue_wake_all (nk_thread_queue_t * q)
         ASSERT(t);
         ASSERT(t->status == NK_THR_WAITING);
         
-        nk_enqueue_thread_on_runq(t, t->bound_cpu);
-        
-#ifdef NAUT_CONFIG_KICK_SCHEDULE
-        if (t->bound_cpu != my_cpu_id()) {
-            apic_ipi(per_cpu_get(apic),
-                     nk_get_nautilus_info()->sys.cpus[t->bound_cpu]->lapic_id,
-                     APIC_NULL_KICK_VEC);
-        }
-#endif
-        
+        wake_waiter(t);
     }
     
     spin_unlock_irq_restore(&q->lock, flags);
     return 0;
 }
-#else
-{
-    struct sys_info *sys = per_cpu_get(system);
-    rt_scheduler *sched = sys->cpus[my_cpu_id()];
-    rt_thread *woke = dequeue_thread(sched->sleeping);
-
-    while (woke != NULL) {
-        if (woke->type == APERIODIC) {
-            woke->status = ADMITTED;
-            enqueue_thread(sched->aperiodic, woke);
-        } else {
-            woke->status = ARRIVED;
-            enqueue_thread(sched->arrival, woke);
-        }
-        woke = dequeue_thread(sched->sleeping);
-    }
-
-    return 0;
-}
-#endif
 
 
 /*
@@ -1252,7 +2468,7 @@ nk_tls_get (nk_tls_key_t key)
     }
     
     t = get_cur_thread();
-    return (void*)t->tls[key];
+    return t->tls ? (void*)t->tls[key] : NULL;
 }
 
 
@@ -1262,7 +2478,10 @@ nk_tls_get (nk_tls_key_t key)
  * @key: the key to use for index lookup
  * @val: the new value to set at this key
  *
- * returns -EINVAL on error, 0 on success
+ * The thread's values are allocated by its first set.
+ *
+ * returns -EINVAL on a bad key, -ENOMEM if the values
+ * could not be allocated, 0 on success
  *
  */
 int
@@ -1277,7 +2496,17 @@ nk_tls_set (nk_tls_key_t key, const void * val)
     }
     
     t = get_cur_thread();
+    if (!t->tls) {
+        t->tls = malloc(TLS_MAX_KEYS * sizeof(void*));
+        if (!t->tls) {
+            return -ENOMEM;
+        }
+        memset(t->tls, 0, TLS_MAX_KEYS * sizeof(void*));
+    }
     t->tls[key] = val;
+#ifdef NAUT_CONFIG_THREAD_CACHE
+    t->tls_dirty = 1;
+#endif
     return 0;
 }
 
@@ -1423,23 +2652,79 @@ __thread_fork (void)
     rt_thread *rt_parent = me->rt_thread;
     rt_thread *rt = rt_thread_init(rt_parent->type, rt_parent->constraints, rt_parent->deadline, tid);
     struct sys_info *sys = per_cpu_get(system);
+    if (!rt) {
+        RT_THREAD_DEBUG("REAL-TIME FORK FAILED.\n");
+        return 0;
+    }
     if (sys->cpus[cpu]->rt_sched)
     {
-        if (rt->type == APERIODIC) {
-            enqueue_thread(sys->cpus[cpu]->rt_sched->aperiodic, rt);
-        } else {
-            enqueue_thread(sys->cpus[cpu]->rt_sched->arrival, rt);  
-        }
+        rt_thread_arrive(cpu, rt);
     }
 
 #else 
-    nk_enqueue_thread_on_runq(t, t->bound_cpu);
+    enqueue_new_thread(t, t->bound_cpu);
 #endif
     // return child's tid to parent
     return tid;
 }
 
 
+#ifdef NAUT_CONFIG_LOAD_AVG
+/*
+ * This core's sample for the load averages, taken on the way into a
+ * scheduling decision at most once per sampling interval. The run
+ * queue is walked for its length, which is no worse than the lookup
+ * that follows.
+ */
+static void
+load_tick (void)
+#ifndef NAUT_CONFIG_USE_RT_SCHEDULER
+{
+    nk_thread_queue_t * runq = per_cpu_get(run_q);
+    nk_thread_t * me = get_cur_thread();
+    struct list_head * pos;
+    uint64_t n = me->is_idle ? 0 : 1;
+    uint8_t flags;
+
+    if (!runq || !nk_load_due()) {
+        return;
+    }
+
+    flags = runq_lock(runq);
+#ifdef NAUT_CONFIG_LOCKFREE_RUNQ
+    runq_drain(runq);
+#endif
+    list_for_each(pos, &runq->queue) {
+        n++;
+    }
+    runq_unlock(runq, flags);
+
+#ifdef NAUT_CONFIG_THREAD_WORK_STEALING
+    if (per_cpu_get(steal_q)) {
+        struct nk_steal_deque * d = per_cpu_get(steal_q);
+        sint64_t queued = d->bottom - d->top;
+        n += queued > 0 ? queued : 0;
+    }
+#endif
+
+    nk_load_sample(n, 0, me->is_idle);
+}
+#else
+{
+    rt_scheduler * sched = per_cpu_get(rt_sched);
+    nk_thread_t * me = get_cur_thread();
+
+    if (!sched || !nk_load_due()) {
+        return;
+    }
+
+    nk_load_sample(sched->runnable->size + sched->aperiodic->size + !me->is_idle,
+                   rt_load_util(sched), me->is_idle);
+}
+#endif
+#endif
+
+
 nk_thread_t*
 nk_need_resched (void)
 #ifndef NAUT_CONFIG_USE_RT_SCHEDULER
@@ -1447,12 +2732,24 @@ nk_need_resched (void)
     nk_thread_t * p;
     nk_thread_t * c;
     ASSERT(!irqs_enabled());
+
+#ifdef NAUT_CONFIG_RCU
+    nk_rcu_check();
+#endif
+#ifdef NAUT_CONFIG_PMC_THREAD
+    nk_pmc_thread_tick();
+#endif
+#ifdef NAUT_CONFIG_LOAD_AVG
+    load_tick();
+#endif
     
     c = get_cur_thread();
     p = get_runnable_thread_myq();
     
     if (p) {
-        nk_enqueue_thread_on_runq(c, c->bound_cpu);
+        /* requeued here even if rebound, see thread_forward() */
+        nk_enqueue_thread_on_runq(c, my_cpu_id());
+        NK_TRACE(NK_TRACE_SWITCH, p->tid, 0, 0);
     }
     
     return p;
@@ -1461,6 +2758,15 @@ nk_need_resched (void)
 {
     uint64_t start_time = rdtsc();
     ASSERT(!irqs_enabled());
+#ifdef NAUT_CONFIG_RCU
+    nk_rcu_check();
+#endif
+#ifdef NAUT_CONFIG_PMC_THREAD
+    nk_pmc_thread_tick();
+#endif
+#ifdef NAUT_CONFIG_LOAD_AVG
+    load_tick();
+#endif
 	nk_thread_t * current = get_cur_thread();
     update_exit(current->rt_thread);
 	nk_thread_t * thread = rt_need_resched();
@@ -1468,8 +2774,24 @@ nk_need_resched (void)
 	rt_scheduler *sched = sys->cpus[thread->bound_cpu]->rt_sched; 
     uint64_t end_time = rdtsc();
 	sched->run_time = sched->run_time > (end_time - start_time) ? sched->run_time : (end_time - start_time);
-    while (rdtsc() < sched->tsc->end_time); 
-	update_enter(thread->rt_thread);
+#ifdef NAUT_CONFIG_RT_CHARGE_OVERHEAD
+    /* no padding: the time spent deciding comes out of the incoming thread's budget */
+    update_enter(thread->rt_thread, current->rt_thread, start_time);
+#else
+    /* a TSC-deadline timer is armed in absolute time, nothing to pad out */
+    if (!per_cpu_get(apic)->tsc_deadline) {
+        while (rdtsc() < sched->tsc->end_time);
+    }
+	update_enter(thread->rt_thread, current->rt_thread, rdtsc());
+#endif
+#ifdef NAUT_CONFIG_RT_OVERHEAD_HIST
+    /* what the pass took as the caller sees it, padding included */
+    rt_overhead_decided(rdtsc() - start_time, thread != current);
+#endif
+    NK_TRACE(NK_TRACE_RESCHED, thread->tid, thread->rt_thread->deadline, thread->rt_thread->run_time);
+    if (thread != current) {
+        NK_TRACE(NK_TRACE_SWITCH, thread->tid, thread->rt_thread->deadline, thread->rt_thread->run_time);
+    }
 	return thread;
 }
 #endif
@@ -1514,6 +2836,7 @@ nk_schedule (void)
 #endif /* !NAUT_CONFIG_ENABLE_STACK_CHECK */
     
     
+    NK_TRACE(NK_TRACE_SWITCH, runme->tid, 0, 0);
     nk_thread_switch(runme);
 }
 #else
@@ -1534,6 +2857,35 @@ nk_schedule (void)
 #endif
 
 
+#if defined(NAUT_CONFIG_USE_IDLE_THREADS) && !defined(NAUT_CONFIG_USE_RT_SCHEDULER)
+/*
+ * Create this CPU's idle thread straight into its idle_thread slot.
+ * It is never put on the run queue.
+ */
+static int
+start_idle_thread (struct cpu * my_cpu, cpu_id_t id)
+{
+    nk_thread_id_t tid = NULL;
+    nk_thread_t * t    = NULL;
+    
+    if (nk_thread_create(idle, NULL, NULL, 0, TSTACK_DEFAULT, &tid, id) < 0) {
+        ERROR_PRINT("Could not create idle thread for CPU %u\n", id);
+        return -1;
+    }
+    
+    t = (nk_thread_t*)tid;
+    thread_setup_init_stack(t, idle, NULL);
+    
+    t->is_idle   = 1;
+    t->status    = NK_THR_SUSPENDED;
+    t->cur_run_q = my_cpu->run_q;
+    my_cpu->idle_thread = t;
+    
+    return 0;
+}
+#endif
+
+
 /*
  * sched_init_ap
  *
@@ -1559,13 +2911,20 @@ nk_sched_init_ap (void)
         ERROR_PRINT("Could not create run queue for CPU %u)\n", id);
         goto out_err;
     }
+
+#ifdef NAUT_CONFIG_THREAD_WORK_STEALING
+    my_cpu->steal_q = steal_deque_create();
+    if (!my_cpu->steal_q) {
+        SCHED_WARN("Could not create steal deque for CPU %u, it will not share work\n", id);
+    }
+#endif
     
-    me = malloc(sizeof(nk_thread_t));
+    me = thread_struct_alloc(id);
     if (!me) {
         ERROR_PRINT("Could not allocate thread for CPU (%u)\n", id);
         goto out_err1;
     }
-    memset(me, 0, sizeof(nk_thread_t));
+    memset(me, 0, thread_struct_size());
     
     my_stack = malloc(PAGE_SIZE);
     if (!my_stack) {
@@ -1581,6 +2940,14 @@ nk_sched_init_ap (void)
         ERROR_PRINT("Could not init start thread on core %u\n", id);
         goto out_err3;
     }
+    
+#ifdef NAUT_CONFIG_HW_TLS
+    /* nothing switches to it, so load FS by hand */
+    if (thread_tls_init(me, id) != 0) {
+        goto out_err3;
+    }
+    nk_tls_switch(me);
+#endif
     me->status = NK_THR_RUNNING;
     
     me->waitq = nk_thread_queue_create();
@@ -1601,7 +2968,7 @@ nk_sched_init_ap (void)
     // start another idle thread
 #if defined(NAUT_CONFIG_USE_IDLE_THREADS) && !defined(NAUT_CONFIG_USE_RT_SCHEDULER)
     SCHED_DEBUG("Starting idle thread for cpu %d\n", id);
-    nk_thread_start(idle, NULL, NULL, 0, TSTACK_DEFAULT, NULL, id);
+    start_idle_thread(my_cpu, id);
 #endif
     
     irq_enable_restore(flags);
@@ -1610,7 +2977,7 @@ nk_sched_init_ap (void)
 out_err3:
     free(me->stack);
 out_err2:
-    free(me);
+    thread_struct_free(me);
 out_err1:
     nk_thread_queue_destroy(my_cpu->run_q);
 out_err:
@@ -1633,6 +3000,7 @@ nk_sched_init (void)
     nk_thread_t * main = NULL;
     void * my_stack = NULL;
     int flags;
+    int i;
     
     flags = irq_disable_save();
     
@@ -1650,22 +3018,36 @@ nk_sched_init (void)
         ERROR_PRINT("Could not create run queue\n");
         goto out_err1;
     }
+
+#ifdef NAUT_CONFIG_THREAD_WORK_STEALING
+    my_cpu->steal_q = steal_deque_create();
+    if (!my_cpu->steal_q) {
+        SCHED_WARN("Could not create steal deque, the BSP will not share work\n");
+    }
+#endif
     
-    sched->thread_list = nk_thread_queue_create();
-    if (!sched->thread_list) {
-        ERROR_PRINT("Could not create thread list\n");
-        goto out_err2;
+    for (i = 0; i < NAUT_CONFIG_MAX_CPUS; i++) {
+        spinlock_init(&sched->thread_lists[i].lock);
+        INIT_LIST_HEAD(&sched->thread_lists[i].threads);
     }
     
     glob_sched_state = sched;
+
+#ifdef NAUT_CONFIG_KMEM_SLAB
+    thread_slab = nk_slab_cache_create("nk_thread", thread_struct_size(), FPU_STATE_ALIGN, NULL);
+    if (!thread_slab) {
+        ERROR_PRINT("Could not create thread cache\n");
+        goto out_err3;
+    }
+#endif
     
     // first we need to add our current thread as the current thread
-    main  = malloc(sizeof(nk_thread_t));
+    main  = thread_struct_alloc(my_cpu_id());
     if (!main) {
         ERROR_PRINT("Could not allocate main thread\n");
         goto out_err3;
     }
-    memset(main, 0, sizeof(nk_thread_t));
+    memset(main, 0, thread_struct_size());
     
     my_stack = malloc(PAGE_SIZE);
     if (!my_stack) {
@@ -1678,6 +3060,14 @@ nk_sched_init (void)
     
     thread_init(main, my_stack, 1, 0, NULL);
     main->status = NK_THR_RUNNING;
+    
+#ifdef NAUT_CONFIG_HW_TLS
+    /* nothing switches to it, so load FS by hand */
+    if (thread_tls_init(main, my_cpu_id()) != 0) {
+        goto out_err5;
+    }
+    nk_tls_switch(main);
+#endif
     main->waitq = nk_thread_queue_create();
     if (!main->waitq) {
         ERROR_PRINT("Could not create main thread's wait queue\n");
@@ -1693,7 +3083,7 @@ nk_sched_init (void)
     
 #if defined(NAUT_CONFIG_USE_IDLE_THREADS) && !defined(NAUT_CONFIG_USE_RT_SCHEDULER)
     SCHED_DEBUG("Starting idle thread for cpu %d\n", my_cpu->id);
-    nk_thread_start(idle, NULL, NULL, 0, TSTACK_DEFAULT, NULL, my_cpu->id);
+    start_idle_thread(my_cpu, my_cpu->id);
 #endif
     
     irq_enable_restore(flags);
@@ -1703,11 +3093,9 @@ nk_sched_init (void)
 out_err5:
     free(main->stack);
 out_err4:
-    free(main);
+    thread_struct_free(main);
 out_err3:
-    free(sched->thread_list);
-out_err2:
-    free(my_cpu->run_q);
+    nk_thread_queue_destroy(my_cpu->run_q);
 out_err1:
     free(sched);
 out_err0:
@@ -1772,6 +3160,7 @@ out_err:
     free(keys);
 }
 
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
 int
 nk_thread_start_sim (nk_thread_fun_t fun,
                  void *input,
@@ -1804,13 +3193,26 @@ nk_thread_start_sim (nk_thread_fun_t fun,
         *tid = newtid;
     }
     
+#if defined(NAUT_CONFIG_KMEM_PAGE_COLORS) && defined(NAUT_CONFIG_USE_RT_SCHEDULER)
+    if (rt_type != APERIODIC) {
+        thread_stack_recolor(newthread);
+    }
+#endif
     thread_setup_init_stack(newthread, fun, input);
 
 #ifdef NAUT_CONFIG_USE_RT_SCHEDULER
     rt_thread *rt = rt_thread_init(rt_type, rt_constraints, rt_deadline, newthread);
     struct sys_info *sys = per_cpu_get(system);
+    if (!rt) {
+        ERROR_PRINT("Could not create real-time thread\n");
+        return -1;
+    }
     if (sys->cpus[cpu]->rt_sched) {
+#ifdef NAUT_CONFIG_RT_GLOBAL_EDF
+        rt_global_enqueue(rt);
+#else
         enqueue_thread(sys->cpus[cpu]->rt_sched->runnable, rt);
+#endif
     }
     nk_schedule();
 #else
@@ -1826,14 +3228,7 @@ nk_thread_start_sim (nk_thread_fun_t fun,
     }
 #endif
     
-#ifdef NAUT_CONFIG_KICK_SCHEDULE
-    // kick it
-    if (cpu != my_cpu_id()) {
-        apic_ipi(per_cpu_get(apic),
-                 nk_get_nautilus_info()->sys.cpus[cpu]->lapic_id,
-                 APIC_NULL_KICK_VEC);
-    }
-#endif
+    kick_cpu(cpu);
     
     return 0;
 }
@@ -1841,3 +3236,4 @@ nk_thread_start_sim (nk_thread_fun_t fun,
 
 
 
+#endif
@@ -0,0 +1,284 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/smp.h>
+#include <nautilus/cpu.h>
+#include <nautilus/cpuid.h>
+#include <nautilus/irq.h>
+#include <nautilus/queue.h>
+#include <nautilus/atomic.h>
+#include <nautilus/percpu.h>
+#include <nautilus/paging.h>
+#include <nautilus/tlb.h>
+
+#define TLB_INVLPG_MAX NAUT_CONFIG_TLB_INVLPG_THRESHOLD
+
+#define INVPCID_SINGLE_CONTEXT 1
+
+/* the shootdown in flight, there is only ever one */
+struct tlb_shootdown {
+    struct nk_tlb_range * ranges;
+    unsigned              n;       /* no ranges means a context flush */
+    volatile uint64_t     pending;
+};
+
+static struct tlb_shootdown shootdown;
+static volatile uint64_t    shootdown_busy = 0;
+
+static uint8_t have_invpcid = 0;
+
+
+static inline void
+invpcid (uint64_t type, uint64_t pcid, addr_t addr)
+{
+    struct {
+        uint64_t pcid;
+        uint64_t addr;
+    } desc = { pcid, addr };
+
+    asm volatile ("invpcid %0, %1" :: "m" (desc), "r" (type) : "memory");
+}
+
+
+/*
+ * drop every non-global translation of the kernel's context. Under
+ * PCIDs, INVPCID leaves other contexts' entries alone; without it we
+ * reload CR3, which with PCIDs enabled also only hits this context
+ */
+static inline void
+flush_context (void)
+{
+    if (have_invpcid) {
+        invpcid(INVPCID_SINGLE_CONTEXT, NK_TLB_KERNEL_PCID, 0);
+    } else {
+        write_cr3(read_cr3());
+    }
+}
+
+
+static ulong_t
+tlb_pages (struct nk_tlb_range * ranges, unsigned n)
+{
+    ulong_t pages = 0;
+    unsigned i;
+
+    for (i = 0; i < n && pages <= TLB_INVLPG_MAX; i++) {
+        ulong_t ps  = ranges[i].page_size ? ranges[i].page_size : PAGE_SIZE_4KB;
+        ulong_t off = ranges[i].addr & (ps - 1);
+        pages += (ranges[i].len + off + ps - 1) / ps;
+    }
+
+    return pages;
+}
+
+
+/*
+ * nk_tlb_flush_local
+ *
+ * drop the given ranges from this core's TLB only
+ *
+ */
+void
+nk_tlb_flush_local (struct nk_tlb_range * ranges, unsigned n)
+{
+    unsigned i;
+
+    if (!ranges || !n || tlb_pages(ranges, n) > TLB_INVLPG_MAX) {
+        flush_context();
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        ulong_t ps  = ranges[i].page_size ? ranges[i].page_size : PAGE_SIZE_4KB;
+        addr_t  end = ranges[i].addr + ranges[i].len;
+        addr_t  va;
+
+        for (va = ranges[i].addr & ~(ps - 1); va < end; va += ps) {
+            invlpg(va);
+        }
+    }
+}
+
+
+static void
+tlb_remote (void * arg)
+{
+    struct tlb_shootdown * s = (struct tlb_shootdown*)arg;
+
+    nk_tlb_flush_local(s->ranges, s->n);
+    atomic_dec(s->pending);
+}
+
+
+/*
+ * nk_tlb_shootdown
+ *
+ * drop the given ranges from every core's TLB, returning once all
+ * of them have. An empty list flushes the kernel context everywhere
+ *
+ */
+int
+nk_tlb_shootdown (struct nk_tlb_range * ranges, unsigned n)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    cpu_id_t me;
+    uint8_t flags;
+    unsigned i;
+
+    /* interrupts stay on while we wait, so we still answer the
+       shootdown that currently owns the slot */
+    while (1) {
+        flags = irq_disable_save();
+        if (atomic_cmpswap(shootdown_busy, 0, 1) == 0) {
+            break;
+        }
+        irq_enable_restore(flags);
+        asm volatile ("pause");
+    }
+
+    me = my_cpu_id();
+
+    nk_tlb_flush_local(ranges, n);
+
+    shootdown.ranges  = ranges;
+    shootdown.n       = ranges ? n : 0;
+    shootdown.pending = 0;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+
+        if (i == me || !sys->cpus[i] || !sys->cpus[i]->xcall_q) {
+            continue;
+        }
+
+        atomic_inc(shootdown.pending);
+
+        /* another core's no-wait xcall may still be in the queue */
+        PAUSE_WHILE(!nk_queue_empty_atomic(sys->cpus[i]->xcall_q));
+
+        while (smp_xcall(i, tlb_remote, &shootdown, 0) != 0) {
+            asm volatile ("pause");
+        }
+    }
+
+    BARRIER_WHILE(shootdown.pending);
+
+    shootdown_busy = 0;
+    irq_enable_restore(flags);
+
+    return 0;
+}
+
+
+int
+nk_tlb_shootdown_all (void)
+{
+    return nk_tlb_shootdown(NULL, 0);
+}
+
+
+/*
+ * nk_tlb_batch_add
+ *
+ * queue a range for the next nk_tlb_batch_flush(). Ranges that
+ * extend the previous one are merged into it, and a batch that runs
+ * out of room degrades to a full flush
+ *
+ */
+void
+nk_tlb_batch_add (struct nk_tlb_batch * b, addr_t addr, ulong_t len, ulong_t page_size)
+{
+    struct nk_tlb_range * last = b->n ? &b->ranges[b->n - 1] : NULL;
+
+    if (b->full) {
+        return;
+    }
+
+    if (last && last->page_size == page_size && last->addr + last->len == addr) {
+        last->len += len;
+        return;
+    }
+
+    if (b->n == NK_TLB_BATCH_MAX) {
+        b->full = 1;
+        return;
+    }
+
+    b->ranges[b->n].addr      = addr;
+    b->ranges[b->n].len       = len;
+    b->ranges[b->n].page_size = page_size;
+    b->n++;
+}
+
+
+int
+nk_tlb_batch_flush (struct nk_tlb_batch * b)
+{
+    int ret = 0;
+
+    if (b->full) {
+        ret = nk_tlb_shootdown_all();
+    } else if (b->n) {
+        ret = nk_tlb_shootdown(b->ranges, b->n);
+    }
+
+    nk_tlb_batch_init(b);
+
+    return ret;
+}
+
+
+/*
+ * nk_tlb_init
+ *
+ * turn on PCIDs for this core if it has them. The kernel runs in
+ * NK_TLB_KERNEL_PCID, which is what CR3 already names
+ *
+ */
+int
+nk_tlb_init (struct cpu * core)
+{
+    struct cpuid_ecx_flags ecx;
+    struct cpuid_ext_feat_flags_ebx ebx;
+    cpuid_ret_t ret;
+    uint8_t pcid = 0;
+
+    cpuid(CPUID_FEATURE_INFO, &ret);
+    ecx.val = ret.c;
+    pcid    = ecx.pcid;
+
+    if (cpuid_leaf_max() >= CPUID_LEAF_EXT_FEATS) {
+        cpuid_sub(CPUID_LEAF_EXT_FEATS, 0, &ret);
+        ebx.val = ret.b;
+        have_invpcid = ebx.invpcid;
+    }
+
+    if (pcid && !(read_cr3() & 0xfff)) {
+        write_cr4(read_cr4() | CR4_PCIDE);
+    }
+
+    if (core->is_bsp) {
+        printk("TLB shootdown: PCID %s, INVPCID %s, INVLPG up to %u pages\n",
+                pcid ? "on" : "off",
+                have_invpcid ? "on" : "off",
+                TLB_INVLPG_MAX);
+    }
+
+    return 0;
+}
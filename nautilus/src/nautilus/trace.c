@@ -0,0 +1,211 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/percpu.h>
+#include <nautilus/thread.h>
+#include <nautilus/intrinsics.h>
+#include <nautilus/trace.h>
+
+#define TRACE_PRINT(fmt, args...) printk("TRACE: " fmt, ##args)
+
+#define TRACE_ENTRIES NAUT_CONFIG_SCHED_TRACE_ENTRIES
+
+#if (TRACE_ENTRIES & (TRACE_ENTRIES - 1)) != 0
+#error "NAUT_CONFIG_SCHED_TRACE_ENTRIES must be a power of two"
+#endif
+
+struct trace_ring {
+    volatile uint64_t     head;     /* records ever written */
+    struct nk_trace_rec * recs;
+} __align(64);
+
+static DEFINE_PER_CPU(struct trace_ring, trace_ring);
+
+static volatile uint8_t trace_on = 0;
+
+extern uint8_t cpu_info_ready;
+
+
+void
+nk_trace (uint32_t event, uint32_t tid, uint64_t deadline, uint64_t run_time)
+{
+    struct trace_ring * r;
+    struct nk_trace_rec * rec;
+    uint64_t i = 1;
+
+    if (!trace_on || !cpu_info_ready) {
+        return;
+    }
+
+    r = this_cpu_ptr(trace_ring);
+    if (!r->recs) {
+        return;
+    }
+
+    /* no lock prefix, only interrupts on this core can race with us */
+    asm volatile ("xaddq %0, %1" : "+r"(i), "+m"(r->head) : : "memory");
+
+    rec = &r->recs[i & (TRACE_ENTRIES - 1)];
+    rec->tsc      = rdtsc();
+    rec->event    = event;
+    rec->tid      = tid;
+    rec->deadline = deadline;
+    rec->run_time = run_time;
+}
+
+
+void
+nk_trace_irq_enter (uint64_t vec)
+{
+    nk_trace(NK_TRACE_IRQ_ENTER, get_cur_thread()->tid, vec, 0);
+}
+
+
+void
+nk_trace_irq_exit (uint64_t vec)
+{
+    nk_trace(NK_TRACE_IRQ_EXIT, get_cur_thread()->tid, vec, 0);
+}
+
+
+void
+nk_trace_enable (int on)
+{
+    trace_on = on;
+    mbarrier();
+}
+
+
+/* tracing should be off */
+void
+nk_trace_reset (void)
+{
+    int i;
+
+    for (i = 0; i < nk_get_num_cpus(); i++) {
+        per_cpu_ptr(trace_ring, i)->head = 0;
+    }
+}
+
+
+uint64_t
+nk_trace_read (int cpu, struct nk_trace_rec * dst, uint64_t max)
+{
+    struct trace_ring * r = per_cpu_ptr(trace_ring, cpu);
+    uint64_t head = r->head;
+    uint64_t first, n;
+
+    if (!r->recs) {
+        return 0;
+    }
+
+    n = (head < TRACE_ENTRIES) ? head : TRACE_ENTRIES;
+    if (n > max) {
+        n = max;
+    }
+    first = head - n;
+
+    for (max = 0; max < n; max++) {
+        dst[max] = r->recs[(first + max) & (TRACE_ENTRIES - 1)];
+    }
+
+    return n;
+}
+
+
+static const char *
+trace_event_name (uint32_t event)
+{
+    switch (event) {
+        case NK_TRACE_RESCHED:   return "resched";
+        case NK_TRACE_SWITCH:    return "switch";
+        case NK_TRACE_IRQ_ENTER: return "irq-enter";
+        case NK_TRACE_IRQ_EXIT:  return "irq-exit";
+        case NK_TRACE_XCALL:     return "xcall";
+        case NK_TRACE_LEGION_TASK:         return "legion-task";
+        case NK_TRACE_LEGION_MAP:          return "legion-map";
+        case NK_TRACE_LEGION_CLOSE:        return "legion-close";
+        case NK_TRACE_LEGION_COPY:         return "legion-copy";
+        case NK_TRACE_LEGION_INST_CREATE:  return "legion-inst-create";
+        case NK_TRACE_LEGION_INST_DESTROY: return "legion-inst-destroy";
+        default:                 return "?";
+    }
+}
+
+
+/* print every core's ring, oldest first. Slow, so only after a run */
+void
+nk_trace_dump (void)
+{
+    struct trace_ring * r;
+    struct nk_trace_rec * rec;
+    uint64_t head, i;
+    int cpu;
+
+    for (cpu = 0; cpu < nk_get_num_cpus(); cpu++) {
+        r    = per_cpu_ptr(trace_ring, cpu);
+        head = r->head;
+
+        if (!r->recs) {
+            continue;
+        }
+
+        TRACE_PRINT("cpu %d: %lu records, %lu lost\n", cpu, head,
+                    head > TRACE_ENTRIES ? head - TRACE_ENTRIES : 0);
+
+        for (i = (head > TRACE_ENTRIES) ? head - TRACE_ENTRIES : 0; i < head; i++) {
+            rec = &r->recs[i & (TRACE_ENTRIES - 1)];
+            if (rec->event >= NK_TRACE_LEGION && rec->event < NK_TRACE_LEGION + NK_TRACE_LEGION_KINDS) {
+                /* the ProfKind is all there is to tell these apart */
+                printk("%d %lu legion-prof kind=%u proc=%u %lu\n", cpu, rec->tsc,
+                       rec->event - NK_TRACE_LEGION, rec->tid, rec->deadline);
+                continue;
+            }
+            printk("%d %lu %s tid=%u %lu %lu\n", cpu, rec->tsc, trace_event_name(rec->event),
+                   rec->tid, rec->deadline, rec->run_time);
+        }
+    }
+}
+
+
+int
+nk_trace_init (void)
+{
+    int i;
+
+    for (i = 0; i < nk_get_num_cpus(); i++) {
+        struct trace_ring * r = per_cpu_ptr(trace_ring, i);
+
+        r->recs = malloc(TRACE_ENTRIES * sizeof(struct nk_trace_rec));
+        if (!r->recs) {
+            ERROR_PRINT("Could not allocate trace ring for cpu %d\n", i);
+            return -1;
+        }
+        memset(r->recs, 0, TRACE_ENTRIES * sizeof(struct nk_trace_rec));
+        r->head = 0;
+    }
+
+    TRACE_PRINT("%d records per cpu\n", TRACE_ENTRIES);
+
+    trace_on = 1;
+
+    return 0;
+}
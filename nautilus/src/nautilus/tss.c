@@ -0,0 +1,102 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/smp.h>
+#include <nautilus/gdt.h>
+#include <nautilus/idt.h>
+#include <nautilus/tss.h>
+#include <nautilus/naut_string.h>
+
+/* null, code, data, then the two halves of the TSS descriptor */
+#define GDT_ENTRIES 5
+
+struct tss_cpu {
+    uint64_t     gdt[GDT_ENTRIES];
+    struct tss64 tss;
+} __align(16);
+
+static struct tss_cpu tss_cpus[NAUT_CONFIG_MAX_CPUS];
+
+extern struct gate_desc64 idt64[];
+
+
+static inline void
+ltr (uint16_t sel)
+{
+    asm volatile ("ltr %0" :: "r" (sel));
+}
+
+
+/*
+ * nk_tss_init
+ *
+ * switch this core to its own GDT and TSS. On the BSP this also
+ * points the page fault and double fault gates at their IST stacks,
+ * so the APs must call it before they can take a fault
+ *
+ */
+int
+nk_tss_init (struct cpu * core)
+{
+    struct tss_cpu * tc = &tss_cpus[core->id];
+    struct gdt_desc64 gdtr;
+    uint64_t base = (uint64_t)&tc->tss;
+    uint64_t limit = sizeof(struct tss64) - 1;
+    void * pf_stack = malloc(TSS_IST_SIZE);
+    void * df_stack = malloc(TSS_IST_SIZE);
+
+    if (!pf_stack || !df_stack) {
+        ERROR_PRINT("Could not allocate IST stacks for core %u\n", core->id);
+        free(pf_stack);
+        free(df_stack);
+        return -1;
+    }
+
+    memset(tc, 0, sizeof(struct tss_cpu));
+
+    tc->tss.ist[TSS_IST_PF - 1] = (uint64_t)pf_stack + TSS_IST_SIZE;
+    tc->tss.ist[TSS_IST_DF - 1] = (uint64_t)df_stack + TSS_IST_SIZE;
+    tc->tss.iomap_base          = sizeof(struct tss64);
+
+    /* same code and data segments as the boot GDT */
+    tc->gdt[1] = 0x00a09a0000000000ULL;
+    tc->gdt[2] = 0x00a0920000000000ULL;
+
+    /* available 64-bit TSS, present */
+    tc->gdt[3] = (limit & 0xffff)              |
+                 ((base & 0xffffff) << 16)     |
+                 (0x89ULL << 40)               |
+                 (((limit >> 16) & 0xf) << 48) |
+                 (((base >> 24) & 0xff) << 56);
+    tc->gdt[4] = base >> 32;
+
+    gdtr.limit = sizeof(tc->gdt) - 1;
+    gdtr.base  = (uint64_t)tc->gdt;
+
+    lgdt64(&gdtr);
+    ltr(KERNEL_TSS);
+
+    if (core->is_bsp) {
+        idt64[PF_EXCP].ist = TSS_IST_PF;
+        idt64[DF_EXCP].ist = TSS_IST_DF;
+    }
+
+    return 0;
+}
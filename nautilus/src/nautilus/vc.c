@@ -28,6 +28,7 @@
 #include <nautilus/thread.h>
 #include <nautilus/queue.h>
 #include <nautilus/list.h>
+#include <nautilus/atomic.h>
 #include <dev/kbd.h>
 #include <nautilus/vc.h>
 #include <nautilus/printk.h>
@@ -39,6 +40,9 @@
 #ifdef NAUT_CONFIG_HVM_HRT
 #include <arch/hrt/hrt.h>
 #endif
+#ifdef NAUT_CONFIG_VC_DEFERRED_RENDER
+#include <dev/timer.h>
+#endif
 
 #ifndef NAUT_CONFIG_DEBUG_VIRTUAL_CONSOLE
 #undef DEBUG_PRINT
@@ -70,8 +74,6 @@ static nk_thread_id_t list_tid;
 struct nk_virtual_console {
   enum nk_vc_type type;
   char name[32];
-  // held with interrupts off => coordinate with interrupt handler
-  spinlock_t       queue_lock;
   // held without interrupt change => coordinate with threads
   spinlock_t       buf_lock;
   union queue{
@@ -79,8 +81,13 @@ struct nk_virtual_console {
     nk_keycode_t k_queue[Keycode_QUEUE_SIZE];
   } keyboard_queue;
   uint16_t BUF[VGA_WIDTH * VGA_HEIGHT];
+#ifdef NAUT_CONFIG_VC_DEFERRED_RENDER
+  uint8_t top;              // line of BUF shown as screen row 0
+  volatile uint32_t dirty;  // screen rows not yet on the display
+#endif
   uint8_t cur_x, cur_y, cur_attr;
-  uint16_t head, tail;
+  // input ring: the keyboard interrupt alone moves tail, readers move head
+  volatile uint32_t head, tail;
   void    (*raw_noqueue_callback)(nk_scancode_t);
   uint32_t num_threads;
   struct list_head vc_node;
@@ -88,6 +95,33 @@ struct nk_virtual_console {
 };
 
 
+#ifdef NAUT_CONFIG_VC_DEFERRED_RENDER
+/*
+ * Deferred rendering. BUF is a ring of lines with screen row 0 at
+ * line top, so a scroll moves top and clears one line instead of
+ * copying the screen. Once the render thread is up, changes to the
+ * console on display only mark its rows dirty. Once a frame the
+ * thread copies the dirty rows out under the console's lock and
+ * writes them and the cursor to the VGA after dropping it, so any
+ * number of scrolls within a frame cost one redraw.
+ */
+#if VGA_HEIGHT > 32
+#error Dirty rows do not fit in a word
+#endif
+#define VC_ROW(vc, y)   (&(vc)->BUF[(((vc)->top + (y)) % VGA_HEIGHT) * VGA_WIDTH])
+#define VC_ALL_ROWS     ((uint32_t)((1ULL << VGA_HEIGHT) - 1))
+#define VC_DIRTY(vc, m) __sync_fetch_and_or(&(vc)->dirty, (m))
+
+static volatile int vc_deferred = 0;
+
+// the display itself is only touched here, otherwise by the render thread
+#define VC_ON_SCREEN(vc) ((vc) == cur_vc && !vc_deferred)
+#else
+#define VC_ROW(vc, y)    (&(vc)->BUF[(y) * VGA_WIDTH])
+#define VC_ON_SCREEN(vc) ((vc) == cur_vc)
+#endif
+
+
 inline int nk_vc_is_active()
 {
   return cur_vc!=0;
@@ -99,6 +133,9 @@ static inline void copy_display_to_vc(struct nk_virtual_console *vc)
 #ifdef NAUT_CONFIG_X86_64_HOST
   vga_copy_out((void *)vc->BUF,sizeof(vc->BUF));
 #endif
+#ifdef NAUT_CONFIG_VC_DEFERRED_RENDER
+  vc->top = 0;
+#endif
 #ifdef NAUT_CONFIG_XEON_PHI
   vga_copy_out((void *)vc->BUF,sizeof(vc->BUF));
 #endif
@@ -109,7 +146,17 @@ static inline void copy_display_to_vc(struct nk_virtual_console *vc)
 
 static inline void copy_vc_to_display(struct nk_virtual_console *vc) 
 { 
-#ifdef NAUT_CONFIG_X86_64_HOST
+#ifdef NAUT_CONFIG_VC_DEFERRED_RENDER
+  int y;
+
+  if (vc_deferred) {
+    VC_DIRTY(vc, VC_ALL_ROWS);
+    return;
+  }
+  for (y = 0; y < VGA_HEIGHT; y++) {
+    vga_copy_in_row(y, VC_ROW(vc, y));
+  }
+#elif defined(NAUT_CONFIG_X86_64_HOST)
   vga_copy_in((void*)vc->BUF,sizeof(vc->BUF));
 #endif
 #ifdef NAUT_CONFIG_XEON_PHI
@@ -136,7 +183,6 @@ struct nk_virtual_console *nk_create_vc(char *name, enum nk_vc_type new_vc_type,
   strncpy(new_vc->name,name,32);
   new_vc->raw_noqueue_callback = callback;
   new_vc->cur_attr = attr;
-  spinlock_init(&new_vc->queue_lock);
   spinlock_init(&new_vc->buf_lock);
   new_vc->head = 0;
   new_vc->tail = 0;
@@ -208,14 +254,20 @@ int nk_switch_to_vc(struct nk_virtual_console *vc)
   }
   LOCK();
   if (vc!=cur_vc) { 
+#ifdef NAUT_CONFIG_VC_DEFERRED_RENDER
+    // the display lags the buffer, which is already up to date
+    if (!vc_deferred)
+#endif
     copy_display_to_vc(cur_vc);
     cur_vc = vc;
     copy_vc_to_display(cur_vc);
+    if (VC_ON_SCREEN(cur_vc)) {
 #ifdef NAUT_CONFIG_X86_64_HOST
-    vga_set_cursor(cur_vc->cur_x, cur_vc->cur_y);
+      vga_set_cursor(cur_vc->cur_x, cur_vc->cur_y);
 #elif NAUT_CONFIG_XEON_PHI
-    phi_cons_set_cursor(cur_vc->cur_x, cur_vc->cur_y);
+      phi_cons_set_cursor(cur_vc->cur_x, cur_vc->cur_y);
 #endif
+    }
   }
   UNLOCK();
   return 0;
@@ -258,6 +310,15 @@ static int _vc_scrollup (struct nk_virtual_console *vc)
   }
 #endif
 
+#ifdef NAUT_CONFIG_VC_DEFERRED_RENDER
+  uint16_t *row;
+
+  vc->top = (vc->top + 1) % VGA_HEIGHT;
+  row = VC_ROW(vc, VGA_HEIGHT-1);
+  for (i = 0; i < VGA_WIDTH; i++) {
+    row[i] = vga_make_entry(' ', vc->cur_attr);
+  }
+#else
   for (i=0;
        i<VGA_WIDTH*(VGA_HEIGHT-1);
        i++) {
@@ -269,11 +330,13 @@ static int _vc_scrollup (struct nk_virtual_console *vc)
        i++) {
     vc->BUF[i] = vga_make_entry(' ', vc->cur_attr);
   }
+#endif
 
   if(vc == cur_vc) {
     copy_vc_to_display(vc);
 #ifdef NAUT_CONFIG_XEON_PHI
-    phi_cons_notify_redraw();
+    // drawn with the rest of the line at the next flush
+    phi_cons_mark_dirty_all();
 #endif
   }
 
@@ -303,8 +366,13 @@ static int _vc_display_char_specific(struct nk_virtual_console *vc, uint8_t c, u
   if(x >= VGA_WIDTH || y >= VGA_HEIGHT) {
     return -1;
   } else {
-    vc->BUF[y * VGA_WIDTH + x] = val;
-    if(vc == cur_vc) {
+    VC_ROW(vc, y)[x] = val;
+#ifdef NAUT_CONFIG_VC_DEFERRED_RENDER
+    if (vc == cur_vc && vc_deferred) {
+      VC_DIRTY(vc, 1U << y);
+    }
+#endif
+    if(VC_ON_SCREEN(vc)) {
 #ifdef NAUT_CONFIG_X86_64_HOST
       vga_write_screen(x,y,val);
       vga_set_cursor(cur_vc->cur_x, cur_vc->cur_y);
@@ -361,7 +429,7 @@ static int _vc_putchar_specific(struct nk_virtual_console *vc, uint8_t c)
     vc->cur_x = 0;
 #ifdef NAUT_CONFIG_XEON_PHI
     if (vc==cur_vc) { 
-      phi_cons_notify_line_draw(vc->cur_y);
+      phi_cons_mark_dirty(vc->cur_y);
     }
 #endif
     vc->cur_y++;
@@ -369,7 +437,7 @@ static int _vc_putchar_specific(struct nk_virtual_console *vc, uint8_t c)
       _vc_scrollup(vc);
       vc->cur_y--;
     }
-    if (vc==cur_vc) {
+    if (VC_ON_SCREEN(vc)) {
 #ifdef NAUT_CONFIG_X86_64_HOST
       vga_set_cursor(vc->cur_x,vc->cur_y);
 #elif NAUT_CONFIG_XEON_PHI
@@ -384,7 +452,7 @@ static int _vc_putchar_specific(struct nk_virtual_console *vc, uint8_t c)
     vc->cur_x = 0;
 #ifdef NAUT_CONFIG_XEON_PHI
     if (vc==cur_vc) {
-      phi_cons_notify_line_draw(vc->cur_y);
+      phi_cons_mark_dirty(vc->cur_y);
     }
 #endif
     vc->cur_y++;
@@ -393,7 +461,7 @@ static int _vc_putchar_specific(struct nk_virtual_console *vc, uint8_t c)
       vc->cur_y--;
     }
   }
-  if (vc==cur_vc) { 
+  if (VC_ON_SCREEN(vc)) { 
 #ifdef NAUT_CONFIG_X86_64_HOST
     vga_set_cursor(vc->cur_x, vc->cur_y);
 #elif NAUT_CONFIG_XEON_PHI
@@ -434,6 +502,11 @@ int nk_vc_putchar(uint8_t c)
       _vc_putchar_specific(vc,c);
       spin_unlock(&vc->buf_lock);
     }
+#ifdef NAUT_CONFIG_XEON_PHI
+    if (c == '\n') {
+      phi_cons_flush();
+    }
+#endif
   } else {
 #ifdef NAUT_CONFIG_X86_64_HOST
     vga_putchar(c);
@@ -479,6 +552,9 @@ int nk_vc_print(char *s)
       _vc_print_specific(vc,s);
       spin_unlock(&vc->buf_lock);
     }
+#ifdef NAUT_CONFIG_XEON_PHI
+    phi_cons_flush();
+#endif
   } else {
 #ifdef NAUT_CONFIG_X86_64_HOST
     vga_print(s);
@@ -586,11 +662,15 @@ int nk_vc_clear(uint8_t attr)
   for (i = 0; i < VGA_HEIGHT*VGA_WIDTH; i++) {
     vc->BUF[i] = val;
   }
+#ifdef NAUT_CONFIG_VC_DEFERRED_RENDER
+  vc->top = 0;
+#endif
   
   if (vc==cur_vc) { 
     copy_vc_to_display(vc);
 #ifdef NAUT_CONFIG_XEON_PHI
-    phi_cons_notify_redraw();
+    // drawn with the rest of the line at the next flush
+    phi_cons_mark_dirty_all();
 #endif
   }
   
@@ -603,8 +683,16 @@ int nk_vc_clear(uint8_t attr)
 
 
 
-// called assuming lock is held
-static inline int next_index_on_queue(enum nk_vc_type type, int index) 
+/*
+ * The input queue is a single-producer ring. Only the keyboard
+ * interrupt handler enqueues, so it publishes a slot by moving tail
+ * with no lock and never turns interrupts off. Readers take a slot by
+ * moving head with a compare-and-swap, which keeps two threads on one
+ * console from getting the same key. A reader with nothing to read
+ * sleeps futex-style on tail, and waking costs the interrupt a fence
+ * and a read when nobody is asleep.
+ */
+static inline uint32_t next_index_on_queue(enum nk_vc_type type, uint32_t index) 
 {
   if (type == RAW) {
     return (index + 1) % Scancode_QUEUE_SIZE;
@@ -616,110 +704,111 @@ static inline int next_index_on_queue(enum nk_vc_type type, int index)
   }
 }
 
-// called assuming lock is held
 static inline int is_queue_empty(struct nk_virtual_console *vc) 
 {
   return vc->head == vc->tail;
 }
 
-// called assuming lock is held
 static inline int is_queue_full(struct nk_virtual_console *vc) 
 {
   return next_index_on_queue(vc->type, vc->tail) == vc->head;
 }
 
-// called without lock
-int nk_enqueue_scancode(struct nk_virtual_console *vc, nk_scancode_t scan) 
+// the slot is written before tail moves past it, then sleepers are woken
+static inline void publish_input(struct nk_virtual_console *vc)
 {
-  uint8_t flags;
+  __sync_synchronize();
+  vc->tail = next_index_on_queue(vc->type, vc->tail);
+  nk_thread_queue_wake_word(vc->waiting_threads, 1);
+}
 
+// interrupt context only
+int nk_enqueue_scancode(struct nk_virtual_console *vc, nk_scancode_t scan) 
+{
   if (vc->type==RAW_NOQUEUE) { 
     vc->raw_noqueue_callback(scan);
     return 0;
   }
 
-  flags = spin_lock_irq_save(&vc->queue_lock);
-
   if(vc->type != RAW || is_queue_full(vc)) {
     DEBUG("Cannot enqueue scancode 0x%x (queue is %s)\n",scan, is_queue_full(vc) ? "full" : "not full");
-    spin_unlock_irq_restore(&vc->queue_lock,flags);
     return -1;
   } else {
     vc->keyboard_queue.s_queue[vc->tail] = scan;
-    vc->tail = next_index_on_queue(vc->type, vc->tail);
-    spin_unlock_irq_restore(&vc->queue_lock,flags);
-    nk_thread_queue_wake_all(vc->waiting_threads);
+    publish_input(vc);
     return 0;
   }
 }
 
+// interrupt context only
 int nk_enqueue_keycode(struct nk_virtual_console *vc, nk_keycode_t key) 
 {
-  uint8_t flags;
-
-  flags = spin_lock_irq_save(&vc->queue_lock);
-
   if(vc->type != COOKED || is_queue_full(vc)) {
     DEBUG("Cannot enqueue keycode 0x%x (queue is %s)\n",key,is_queue_full(vc) ? "full" : "not full");
-    spin_unlock_irq_restore(&vc->queue_lock,flags);
     return -1;
   } else {
     vc->keyboard_queue.k_queue[vc->tail] = key;
-    vc->tail = next_index_on_queue(vc->type, vc->tail);
-    spin_unlock_irq_restore(&vc->queue_lock,flags);
-    nk_thread_queue_wake_all(vc->waiting_threads);
+    publish_input(vc);
     return 0;
   }
 }
 
 nk_scancode_t nk_dequeue_scancode(struct nk_virtual_console *vc) 
 {
-  uint8_t flags;
-
-  flags = spin_lock_irq_save(&vc->queue_lock);
+  uint32_t h;
+  nk_scancode_t result;
 
-  if(vc->type != RAW || is_queue_empty(vc)) {
-    DEBUG("Cannot dequeue scancode (queue is %s)\n",is_queue_empty(vc) ? "empty" : "not empty");
-    spin_unlock_irq_restore(&vc->queue_lock,flags);
+  if (vc->type != RAW) {
+    DEBUG("Cannot dequeue scancode (not a raw VC)\n");
     return NO_SCANCODE;
-  } else {
-    nk_scancode_t result;
-    result = vc->keyboard_queue.s_queue[vc->head];
-    vc->head = next_index_on_queue(vc->type, vc->head);
-    spin_unlock_irq_restore(&vc->queue_lock,flags);
-    return result;
   }
+
+  do {
+    h = vc->head;
+    if (h == vc->tail) {
+      return NO_SCANCODE;
+    }
+    // the producer will not reuse the slot until head moves past it
+    result = vc->keyboard_queue.s_queue[h];
+  } while (atomic_cmpswap(vc->head, h, next_index_on_queue(vc->type, h)) != h);
+
+  return result;
 }
 
 nk_keycode_t nk_dequeue_keycode(struct nk_virtual_console *vc) 
 {
-  uint8_t flags;
-
-  flags = spin_lock_irq_save(&vc->queue_lock);
+  uint32_t h;
+  nk_keycode_t result;
 
-  if (vc->type != COOKED || is_queue_empty(vc)) {
-    DEBUG("Cannot dequeue keycode (queue is %s)\n",is_queue_empty(vc) ? "empty" : "not empty");
-    spin_unlock_irq_restore(&vc->queue_lock,flags);
+  if (vc->type != COOKED) {
+    DEBUG("Cannot dequeue keycode (not a cooked VC)\n");
     return NO_KEY;
-  } else {
-    nk_keycode_t result;
-    result = vc->keyboard_queue.k_queue[vc->head];
-    vc->head = next_index_on_queue(vc->type, vc->head);
-    spin_unlock_irq_restore(&vc->queue_lock,flags);
-    return result;
   }
+
+  do {
+    h = vc->head;
+    if (h == vc->tail) {
+      return NO_KEY;
+    }
+    result = vc->keyboard_queue.k_queue[h];
+  } while (atomic_cmpswap(vc->head, h, next_index_on_queue(vc->type, h)) != h);
+
+  return result;
 }
 
 
 void nk_vc_wait()
 {
   struct nk_virtual_console *vc = get_cur_thread()->vc;
+  uint32_t h;
 
   if (!vc) { 
     vc = default_vc;
   }
 
-  nk_thread_queue_sleep(vc->waiting_threads);
+  // the queue is empty exactly when tail is at head, so sleep until it moves
+  h = vc->head;
+  nk_thread_queue_wait_word(vc->waiting_threads, &vc->tail, h);
 }
 
 
@@ -917,6 +1006,80 @@ static int start_list()
   return 0;
 }
 
+#ifdef NAUT_CONFIG_VC_DEFERRED_RENDER
+static void vc_render_frame(void)
+{
+  static uint16_t frame[VGA_WIDTH * VGA_HEIGHT];
+  static uint8_t shown_x = 0xff, shown_y = 0xff;
+  struct nk_virtual_console *vc;
+  uint32_t dirty;
+  uint8_t x, y, flags;
+  int i;
+
+  LOCK();
+  vc = cur_vc;
+  if (!vc) {
+    UNLOCK();
+    return;
+  }
+  flags = spin_lock_irq_save(&vc->buf_lock);
+  dirty = __sync_lock_test_and_set(&vc->dirty, 0);
+  for (i = 0; i < VGA_HEIGHT; i++) {
+    if (dirty & (1U << i)) {
+      memcpy(&frame[i * VGA_WIDTH], VC_ROW(vc, i), VGA_WIDTH * sizeof(uint16_t));
+    }
+  }
+  x = vc->cur_x;
+  y = vc->cur_y;
+  spin_unlock_irq_restore(&vc->buf_lock, flags);
+  UNLOCK();
+
+  for (i = 0; i < VGA_HEIGHT; i++) {
+    if (dirty & (1U << i)) {
+      vga_copy_in_row(i, &frame[i * VGA_WIDTH]);
+    }
+  }
+
+  if (x != shown_x || y != shown_y) {
+    vga_set_cursor(x, y);
+    shown_x = x;
+    shown_y = y;
+  }
+}
+
+static void render(void *in, void **out)
+{
+  while (1) {
+    nk_sleep(NAUT_CONFIG_VC_RENDER_MS);
+    vc_render_frame();
+  }
+}
+
+// until this succeeds the console draws directly, as without deferral
+static int start_render()
+{
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+  rt_constraints c = { .aperiodic = { .priority = 0 } };
+
+  if (nk_thread_start(render, 0, 0, 1, TSTACK_DEFAULT, 0, my_cpu_id(), APERIODIC, &c, 0)) {
+#else
+  if (nk_thread_start(render, 0, 0, 1, TSTACK_DEFAULT, 0, my_cpu_id())) {
+#endif
+    ERROR("Cannot start render thread, drawing directly\n");
+    return -1;
+  }
+
+  vc_deferred = 1;
+  if (cur_vc) {
+    VC_DIRTY(cur_vc, VC_ALL_ROWS);
+  }
+
+  INFO("Render thread launched\n");
+
+  return 0;
+}
+#endif
+
 int nk_vc_init() 
 {
   INFO("init\n");
@@ -958,6 +1121,10 @@ int nk_vc_init()
   phi_cons_set_cursor(cur_vc->cur_x, cur_vc->cur_y);
 #endif
 
+#ifdef NAUT_CONFIG_VC_DEFERRED_RENDER
+  start_render();
+#endif
+
   return 0;
 }
 
@@ -0,0 +1,179 @@
+/* 
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the 
+ * United States National  Science Foundation and the Department of Energy.  
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national 
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org> 
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/thread.h>
+#include <nautilus/atomic.h>
+#include <nautilus/workqueue.h>
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+#include <nautilus/rt_scheduler.h>
+#endif
+
+#define WQ_PRINT(fmt, args...) printk("WORKQUEUE: " fmt, ##args)
+#define WQ_ERROR(fmt, args...) ERROR_PRINT("WORKQUEUE: " fmt, ##args)
+
+struct wq_cpu {
+    struct nk_work * volatile head; /* newest first */
+    volatile uint32_t seq;          /* bumped when head goes from empty */
+    volatile uint8_t running;       /* set by the worker once it is up */
+    nk_thread_queue_t * waitq;
+    struct nk_work * retry;         /* the worker's own, to run after a back-off */
+} __attribute__((aligned(64)));
+
+static struct wq_cpu wq_cpus[NAUT_CONFIG_MAX_CPUS];
+
+
+int
+nk_work_queue_on (int cpu, struct nk_work * work, void (*func)(struct nk_work * work))
+{
+    struct wq_cpu * q = &wq_cpus[cpu];
+    struct nk_work * old;
+
+    /* nobody would ever run it */
+    if (!q->running) {
+        return -1;
+    }
+
+    work->func = func;
+
+    do {
+        old = q->head;
+        work->next = old;
+    } while (!__sync_bool_compare_and_swap(&q->head, old, work));
+
+    /* a worker with work left over has not gone to sleep */
+    if (!old) {
+        atomic_inc(q->seq);
+        nk_thread_queue_wake_word(q->waitq, 0);
+    }
+
+    return 0;
+}
+
+
+int
+nk_work_queue (struct nk_work * work, void (*func)(struct nk_work * work))
+{
+    return nk_work_queue_on(my_cpu_id(), work, func);
+}
+
+
+/* func runs on its worker, so this core's retry list is the worker's */
+void
+nk_work_retry (struct nk_work * work)
+{
+    struct wq_cpu * q = &wq_cpus[my_cpu_id()];
+
+    work->next = q->retry;
+    q->retry = work;
+}
+
+
+/* everything queued so far, oldest first */
+static struct nk_work *
+wq_take (struct wq_cpu * q)
+{
+    struct nk_work * w, * next, * fifo = NULL;
+
+    if (!q->head) {
+        return NULL;
+    }
+
+    w = __sync_lock_test_and_set(&q->head, NULL);
+    for (; w; w = next) {
+        next = w->next;
+        w->next = fifo;
+        fifo = w;
+    }
+
+    return fifo;
+}
+
+
+static void
+wq_worker (void * in, void ** out)
+{
+    struct wq_cpu * q = (struct wq_cpu*)in;
+    struct nk_work * w, * next;
+    uint32_t seq;
+
+    q->running = 1;
+
+    while (1) {
+        seq = q->seq;
+        w = wq_take(q);
+        if (!w && q->retry) {
+            /* whatever it waits for gets a chance to happen */
+            nk_sleep(NK_WORK_RETRY_MS);
+            w = q->retry;
+            q->retry = NULL;
+        }
+        if (!w) {
+            nk_thread_queue_wait_word(q->waitq, &q->seq, seq);
+            continue;
+        }
+        for (; w; w = next) {
+            next = w->next;
+            w->func(w);
+        }
+    }
+}
+
+
+int
+nk_workqueue_init (void)
+{
+    int i, n = nk_get_num_cpus();
+
+    for (i = 0; i < n; i++) {
+        struct wq_cpu * q = &wq_cpus[i];
+        nk_thread_queue_t * waitq = nk_thread_queue_create();
+
+        if (!waitq) {
+            WQ_ERROR("Could not create wait queue for CPU %d worker\n", i);
+            return -1;
+        }
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+        rt_constraints * c = (rt_constraints*)malloc(sizeof(rt_constraints));
+        if (!c) {
+            WQ_ERROR("Could not allocate constraints for CPU %d worker\n", i);
+            return -1;
+        }
+        c->aperiodic.priority = 0;
+#endif
+
+        q->waitq = waitq;
+
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+        if (nk_thread_start(wq_worker, q, NULL, 1, TSTACK_DEFAULT, NULL, i,
+                            APERIODIC, c, 0) != 0) {
+#else
+        if (nk_thread_start(wq_worker, q, NULL, 1, TSTACK_DEFAULT, NULL, i) != 0) {
+#endif
+            WQ_ERROR("Could not start worker on CPU %d\n", i);
+            return -1;
+        }
+    }
+
+    WQ_PRINT("%d workers\n", n);
+
+    return 0;
+}
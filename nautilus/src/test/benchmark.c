@@ -55,6 +55,10 @@
 
 #include "benchmark.h"
 
+#if !defined(__USER) && defined(NAUT_CONFIG_USE_RT_SCHEDULER)
+static rt_constraints bench_aperiodic = { .aperiodic = { .priority = 0 } };
+#endif
+
 #define rdtscll(val)                    \
     do {                        \
     uint64_t tsc;                   \
@@ -251,7 +255,7 @@ void time_cvar_bcast (void)
 	container_t * cont = malloc(sizeof(container_t));
 	THREAD_T t[NUM_THREADS];
 	
-    udelay(100);
+    DELAY(100);
 
 	my_id = GETCPU();
 
@@ -291,7 +295,7 @@ void time_cvar_bcast (void)
 			pthread_create(&t[j], NULL, waitonit, cont);
 			pthread_setaffinity_np(t[j], sizeof(cpu_set_t), &cpuset);
 #else
-			nk_thread_start(waitonit, cont, NULL, 0, TSTACK_DEFAULT, &t[j], j);
+			THREAD_START(waitonit, cont, &t[j], j);
 #endif
 		
 		}
@@ -365,7 +369,7 @@ void time_condvar (void) {
             pthread_create(&t, NULL, wakeme, &c);
             pthread_setaffinity_np(t, sizeof(cpu_set_t), &cpuset);
 #else
-            nk_thread_start(wakeme, &c, NULL, 0, TSTACK_DEFAULT, &t, j);
+            THREAD_START(wakeme, &c, &t, j);
 #endif
 
             MUTEX_LOCK(&l);
@@ -500,12 +504,127 @@ void time_spinlock (void)
 }
 
 
+/*
+ * Trial functions for the benchmark registry at the bottom of this
+ * file. Each one runs a single iteration, cleans up after itself,
+ * and returns the cycles the measured part took.
+ */
+
+static inline void
+start_on (FUNC_TYPE (*fn) FUNC_HDR, void * arg, int core, THREAD_T * t)
+{
+#ifdef __USER
+    pthread_attr_t attr;
+    cpu_set_t cpus;
+    pthread_attr_init(&attr);
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+    pthread_create(t, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+#else
+    THREAD_START(fn, arg, t, core);
+#endif
+}
+
+
+static uint64_t tsc_overhead = 0;
+
+static void
+bench_spinlock_setup (void)
+{
+    uint64_t start, end, total = 0;
+    int i;
+
+    for (i = 0; i < SPINLOCK_LOOPS; i++) {
+        rdtscll(start);
+        rdtscll(end);
+        total += end - start;
+    }
+
+    tsc_overhead = total / SPINLOCK_LOOPS;
+}
+
+/* uncontended lock+unlock, back-to-back RDTSC cost subtracted */
+static uint64_t
+bench_spinlock (void)
+{
+    static LOCK_T l;
+    static int inited = 0;
+    uint64_t start, end;
+
+    if (!inited) {
+        LOCK_INIT(&l);
+        inited = 1;
+    }
+
+    rdtscll(start);
+    LOCK(&l);
+    UNLOCK(&l);
+    rdtscll(end);
+
+    return (end - start > tsc_overhead) ? end - start - tsc_overhead : 0;
+}
+
+
+/* from signal on REM_CORE until the waiter here holds the lock again */
+static uint64_t
+bench_condvar (void)
+{
+    COND_T c;
+    MUTEX_T l;
+    THREAD_T t;
+
+    MUTEX_INIT(&l);
+    COND_INIT(&c);
+
+    MUTEX_LOCK(&l);
+
+    start_on(wakeme, &c, REM_CORE, &t);
+
+    COND_WAIT(&c, &l);
+
+    rdtscll(cond_time.end);
+
+    MUTEX_UNLOCK(&l);
+
+    JOIN_FUNC(t, NULL);
+
+#ifdef __USER
+    pthread_cond_destroy(&c);
+#else
+    nk_condvar_destroy(&c);
+#endif
+    MUTEX_DEINIT(&l);
+
+    return cond_time.end - cond_time.start;
+}
+
+
 static FUNC_TYPE
 create_test_func FUNC_HDR
 {
     RETURN;
 }
 
+/* cost of the create call alone, the thread runs later on REM_CORE */
+static uint64_t
+bench_thread_create (void)
+{
+    THREAD_T t;
+    uint64_t start, end;
+
+    rdtscll(start);
+    start_on(create_test_func, NULL, REM_CORE, &t);
+    rdtscll(end);
+
+    DELAY(10000);
+
+    JOIN_FUNC(t, NULL);
+
+    return end - start;
+}
+
 
 void time_threads_long(void);
 void time_threads_long(void)
@@ -533,7 +652,7 @@ void time_threads_long(void)
 				pthread_create(&t[j], NULL, create_test_func, NULL);
 				pthread_setaffinity_np(t[j], sizeof(cpu_set_t), &cpuset);
 #else
-				nk_thread_start(create_test_func, NULL, NULL, 0, TSTACK_DEFAULT, &t[j], j);
+				THREAD_START(create_test_func, NULL, &t[j], j);
 #endif
 			}
 
@@ -559,39 +678,6 @@ void time_threads_long(void)
 }
 
 
-void time_thread_create(void);
-void
-time_thread_create (void)
-{
-    THREAD_T t;
-
-    int i;
-	uint64_t start,end;
-
-    for (i = 0; i < THR_CREATE_LOOPS; i++) {
-        rdtscll(start);
-    #ifdef __USER
-		pthread_attr_t attr;
-		cpu_set_t cpus;
-		pthread_attr_init(&attr);
-
-		CPU_ZERO(&cpus);
-		CPU_SET(1, &cpus);
-		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
-        pthread_create(&t, &attr, create_test_func, NULL);
-    #else
-        nk_thread_start(create_test_func, NULL, NULL, 0, TSTACK_DEFAULT, &t, 1);
-    #endif
-        rdtscll(end);
-
-		DELAY(10000);
-		PRINT("Trial %u %llu \n", i, end-start);
-
-        JOIN_FUNC(t, NULL);
-
-    }
-}
-
 
 static volatile int thread_run_done = 0;
 
@@ -602,83 +688,52 @@ thread_run_func FUNC_HDR
     RETURN;
 }
 
-
-#define RUN_TRIALS 100
-
-void time_thread_run(void);
-void
-time_thread_run (void)
+/* from create returning until the new thread is running */
+static uint64_t
+bench_thread_run (void)
 {
 	THREAD_T t;
-	unsigned i;
 	uint64_t start, end;
 
-	for (i = 0; i < RUN_TRIALS; i++) {
-#ifdef __USER
-		pthread_attr_t attr;
-		cpu_set_t cpus;
-		pthread_attr_init(&attr);
-		CPU_ZERO(&cpus);
-		CPU_SET(1, &cpus);
-		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
-		pthread_create(&t, &attr, thread_run_func, NULL);
-#else
-        nk_thread_start(thread_run_func, NULL, NULL, 0, TSTACK_DEFAULT, &t, 1);
-#endif
+	start_on(thread_run_func, NULL, REM_CORE, &t);
 
-		rdtscll(start);
+	rdtscll(start);
 
-		while (!thread_run_done);
+	while (!thread_run_done);
 
-		rdtscll(end);
+	rdtscll(end);
 
-		DELAY(100);
-	
-		JOIN_FUNC(t, NULL);
+	DELAY(100);
 
-		thread_run_done = 0;
+	JOIN_FUNC(t, NULL);
 
-		PRINT("TRIAL %u %llu cycles\n", i, end-start);
-	}
+	thread_run_done = 0;
+
+	return end - start;
 }
 
 /* this includes both the create and the latency for the thread to actually run */
-void time_thread_both(void);
-void
-time_thread_both (void)
+static uint64_t
+bench_thread_both (void)
 {
 	THREAD_T t;
-	unsigned i;
 	uint64_t start, end;
 
-	for (i = 0; i < RUN_TRIALS; i++) {
+	rdtscll(start);
 
-		rdtscll(start);
+	start_on(thread_run_func, NULL, REM_CORE, &t);
 
-#ifdef __USER
-		pthread_attr_t attr;
-		cpu_set_t cpus;
-		pthread_attr_init(&attr);
-		CPU_ZERO(&cpus);
-		CPU_SET(1, &cpus);
-		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
-		pthread_create(&t, &attr, thread_run_func, NULL);
-#else
-        nk_thread_start(thread_run_func, NULL, NULL, 0, TSTACK_DEFAULT, &t, 1);
-#endif
+	while (!thread_run_done);
 
-		while (!thread_run_done);
+	rdtscll(end);
 
-		rdtscll(end);
+	DELAY(100);
 
-		DELAY(100);
-	
-		JOIN_FUNC(t, NULL);
+	JOIN_FUNC(t, NULL);
 
-		thread_run_done = 0;
+	thread_run_done = 0;
 
-		PRINT("TRIAL %u %llu cycles\n", i, end-start);
-	}
+	return end - start;
 }
 
 
@@ -686,10 +741,8 @@ static volatile int done[2];
 static volatile int ready[2];
 static volatile int go;
 #define YIELD_COUNT 100
-#define CTX_SWITCH_TRIALS 100
 
 typedef struct switch_cont {
-	BARRIER_T * b;
 	unsigned char id; /* 0 or 1 */
 } switch_cont_t;
 
@@ -704,7 +757,6 @@ thread_switch_func FUNC_HDR
 	YIELD();
 
 	while (!go) { YIELD(); }
-//BARRIER_WAIT(t->b);
 
 	int i;
 	for (i = 0; i < YIELD_COUNT; i++) {
@@ -716,95 +768,62 @@ thread_switch_func FUNC_HDR
 	RETURN;
 }
 
-
-
-void time_ctx_switch(void);
-void
-time_ctx_switch (void)
+/* two threads on REM_CORE yielding to each other, cycles per switch */
+static uint64_t
+bench_ctx_switch (void)
 {
+	static switch_cont_t cont[2] = { { 0 }, { 1 } };
 	THREAD_T t[2];
-	BARRIER_T * b = malloc(sizeof(BARRIER_T));
-	switch_cont_t * cont1 = malloc(sizeof(switch_cont_t));
-	switch_cont_t * cont2 = malloc(sizeof(switch_cont_t));
-	uint64_t start = 0;
-	uint64_t end = 0;
-	int i;
-
-	/* setup thread arguments */
-	cont1->b = b;
-	cont1->id = 0;
-	cont2->b = b;
-	cont2->id = 1;
-
-	for (i = 0; i < CTX_SWITCH_TRIALS; i++)  {
-
-		BARRIER_INIT(b, 3);
-
-		// pin them both to core 1
-#ifdef __USER
-		cpu_set_t cpuset;
-		CPU_ZERO(&cpuset);
-		CPU_SET(1, &cpuset);
-
-		pthread_create(&t[0], NULL, thread_switch_func, cont1);
-		pthread_setaffinity_np(t[0], sizeof(cpu_set_t), &cpuset);
-
-		pthread_create(&t[1], NULL, thread_switch_func, cont2);
-		pthread_setaffinity_np(t[1], sizeof(cpu_set_t), &cpuset);
-#else
-		nk_thread_start(thread_switch_func, cont1, NULL, 0, TSTACK_DEFAULT, &t[0], 1);
-		nk_thread_start(thread_switch_func, cont2, NULL, 0, TSTACK_DEFAULT, &t[1], 1);
+	uint64_t start, end;
 
-#endif
+	start_on(thread_switch_func, &cont[0], REM_CORE, &t[0]);
+	start_on(thread_switch_func, &cont[1], REM_CORE, &t[1]);
 
-		DELAY(10000);
+	DELAY(10000);
 
-		while ( !(ready[0] && ready[1]) );
+	while ( !(ready[0] && ready[1]) );
 
-		go = 1;
+	go = 1;
 
-		//BARRIER_WAIT(b);
+	rdtscll(start);
+	while ( !(done[0] && done[1]) );
+	rdtscll(end);
 
-		rdtscll(start);
-		while ( !(done[0] && done[1]) );
-		rdtscll(end);
+	JOIN_FUNC(t[0], NULL);
+	JOIN_FUNC(t[1], NULL);
 
-		/* is this accurate? */
-		PRINT("TRIAL %u %llu\n", i, (end-start)/(YIELD_COUNT*2));
+	done[0] = 0;
+	done[1] = 0;
+	ready[0] = 0;
+	ready[1] = 0;
+	go = 0;
 
-		JOIN_FUNC(t[0], NULL);
-		JOIN_FUNC(t[1], NULL);
+	/* is this accurate? */
+	return (end - start) / (YIELD_COUNT * 2);
+}
 
-		BARRIER_DESTROY(b);
 
-		done[0] = 0;
-		done[1] = 0;
-		ready[0] = 0;
-		ready[1] = 0;
-		go = 0;
+#ifndef __USER
 
-	}
-}
+#define TRIALS 100
 
-void time_ipi_send (void);
-void
-time_ipi_send(void)
+/* sender-side cost of a fixed IPI to REM_CORE */
+static uint64_t
+bench_ipi_send (void)
 {
-    int i;
     struct apic_dev * apic = per_cpu_get(apic);
     uint64_t start, end;
-    for (i = 0; i < 100; i++) {
-        rdtscll(start);
 
-        apic_ipi(apic, 1, APIC_NULL_KICK_VEC);
+    rdtscll(start);
 
-        rdtscll(end);
+    apic_ipi(apic, REM_CORE, APIC_NULL_KICK_VEC);
 
-        PRINT("TRIAL %u %llu\n", i, end-start);
-    }
+    rdtscll(end);
+
+    return end - start;
 }
 
-#define TRIALS 100
+
 static uint64_t int80_end = 0;
 
 static int
@@ -814,26 +833,27 @@ int80_handler (excp_entry_t * excp, excp_vec_t v)
     return 0;
 }
 
-void time_int80 (void);
-void
-time_int80 (void)
+static void
+bench_int80_setup (void)
 {
-    int i;
-    uint64_t start;
     register_int_handler(0x80, int80_handler, NULL);
     sti();
-    for (i = 0; i < TRIALS; i++) {
-        rdtscll(start);
-        asm volatile ("":::"memory");
-        asm volatile ("int $0x80");
+}
 
-        PRINT("TRIAL %u %llu\n", i, int80_end-start);
+/* software interrupt entry, up to the handler body */
+static uint64_t
+bench_int80 (void)
+{
+    uint64_t start;
 
-        int80_end = 0;
-        start = 0;
-    }
+    rdtscll(start);
+    asm volatile ("":::"memory");
+    asm volatile ("int $0x80");
+
+    return int80_end - start;
 }
 
+
 uint64_t syscall_end = 0;
 static uint64_t syscall_start = 0;
 
@@ -857,32 +877,17 @@ syscall_setup (void)
     msr_write(AMD_MSR_LSTAR, (uint64_t)syscall_handler);
 }
 
-
-void time_syscall (void);
-void
-time_syscall (void)
+static uint64_t
+bench_syscall (void)
 {
-    int i;
-    uint64_t start;
-
-    syscall_setup();
-
-    for (i = 0; i < TRIALS; i++) {
-
-        rdtscll(syscall_start);
-
-        /* the callee will just do a retq, no sysret. Demeted huh? */
-        asm volatile ("pushq $b\n\t"
-                      "syscall\n\t"
-                      "b:\n\t" : : : "memory", "rcx");
+    rdtscll(syscall_start);
 
+    /* the callee will just do a retq, no sysret. Demeted huh? */
+    asm volatile ("pushq $b\n\t"
+                  "syscall\n\t"
+                  "b:\n\t" : : : "memory", "rcx");
 
-        PRINT("TRIAL %u %llu\n", i, syscall_end-syscall_start);
-
-        syscall_end  = 0;
-
-    }
-
+    return syscall_end - syscall_start;
 }
 
 static uint64_t nemo_end = 0;
@@ -894,6 +899,14 @@ nemo_wakeup (void)
     nemo_done = 1;
 }
 
+#define NEMO_LOAD_EVENTS 100000ULL
+static volatile uint64_t nemo_count_val = 0;
+static void
+nemo_count (uint64_t payload, void * priv)
+{
+    nemo_count_val++;
+}
+
 void time_nemo_event (void);
 void
 time_nemo_event (void)
@@ -932,6 +945,43 @@ time_nemo_event (void)
 
         }
     }
+
+    /* throughput: keep each target's ring busy and count what lands */
+    nemo_event_id_t cid = nemo_register_event_data_action(nemo_count, NULL);
+
+    if (cid < 0) {
+        printk("couldn't register test nemo counter\n");
+        return;
+    }
+
+    for (i = 0; i < NUM_THREADS; i++) {
+
+        uint64_t end, handled, ipis;
+
+        if (i == BSP_CORE) continue;
+
+        nemo_count_val = 0;
+
+        rdtscll(start);
+
+        for (j = 0; j < NEMO_LOAD_EVENTS; j++) {
+            while (nemo_event_notify_data(cid, i, j) != 0);
+        }
+
+        while (nemo_count_val != NEMO_LOAD_EVENTS);
+
+        rdtscll(end);
+
+        nemo_get_stats(i, &handled, &ipis);
+
+        PRINT("LOAD RC: %u %llu events/s (%llu events, %llu IPIs total)\n",
+            i,
+            NEMO_LOAD_EVENTS * per_cpu_get(cpu_khz) * 1000ULL / (end - start),
+            handled,
+            ipis);
+    }
+
+    nemo_unregister_event_action(cid);
 }
 
 
@@ -985,6 +1035,47 @@ time_nemo_bcast (void)
         memset((void*)core_counters, 0, sizeof(uint64_t)*NUM_THREADS);
 
     }
+
+    /* 
+     * throughput: back-to-back broadcasts coalesce on cores that
+     * haven't handled the last one yet, so count both what we sent
+     * and what actually ran
+     */
+    uint64_t end, sent_before = 0, sent_after = 0, h, ipis;
+
+    for (i = 0; i < NUM_THREADS; i++) {
+        if (i == BSP_CORE) continue;
+        nemo_get_stats(i, &h, &ipis);
+        sent_before += h;
+    }
+
+    rdtscll(start);
+
+    for (i = 0; i < NEMO_LOAD_EVENTS; i++) {
+        nemo_event_broadcast(id);
+    }
+
+    rdtscll(end);
+
+    /* one more so we know every core has drained */
+    cores_wait();
+    memset((void*)core_recvd, 0, sizeof(uint64_t)*4);
+    nemo_event_broadcast(id);
+    cores_wait();
+
+    for (i = 0; i < NUM_THREADS; i++) {
+        if (i == BSP_CORE) continue;
+        nemo_get_stats(i, &h, &ipis);
+        sent_after += h;
+    }
+
+    PRINT("LOAD %llu bcasts/s, %llu of %llu deliveries ran after coalescing\n",
+        NEMO_LOAD_EVENTS * per_cpu_get(cpu_khz) * 1000ULL / (end - start),
+        sent_after - sent_before,
+        (NEMO_LOAD_EVENTS + 1) * (NUM_THREADS - 1));
+
+    memset((void*)core_recvd, 0, sizeof(uint64_t)*4);
+    memset((void*)core_counters, 0, sizeof(uint64_t)*NUM_THREADS);
 }
 
 static volatile int sync_go = 0;
@@ -1019,7 +1110,7 @@ time_sync_event (void)
 
             THREAD_T t;
 
-            nk_thread_start(sync_wakeup, NULL, NULL, 0, TSTACK_DEFAULT, &t, i);
+            THREAD_START(sync_wakeup, NULL, &t, i);
 
             DELAY(100000);
 
@@ -1041,7 +1132,6 @@ time_sync_event (void)
     }
 }
 
-#ifndef __USER
 #if 0
 void page_alloc_test(void);
 void 
@@ -1080,62 +1170,300 @@ malloc_test (void)
 {
 	void * x[N];
 	int i;
+	uint64_t start, end;
 		
 
+	rdtscll(start);
 	for (i = 0; i < N; i++) {
 		x[i] = malloc(4096);
 		memset(x[i], 0, 4096);
 	}
+	rdtscll(end);
+	printk("malloc(4096)+memset: %lu cycles avg\n", (end - start) / N);
 
 
+	rdtscll(start);
 	for (i = 0; i < N; i++) {
 		free(x[i]);
 	}
+	rdtscll(end);
+	printk("free(4096): %lu cycles avg\n", (end - start) / N);
 
+	/* small objects that die young, the common case in the kernel */
+	rdtscll(start);
+	for (i = 0; i < N; i++) {
+		free(malloc(64));
+	}
+	rdtscll(end);
+	printk("malloc(64)+free: %lu cycles avg\n", (end - start) / N);
+
+#ifdef NAUT_CONFIG_KMEM_STATS
+	nk_kmem_stats_dump();
+#endif
 }
 
+#endif /* !__USER */
+
+
+/*
+ * Benchmark registry and harness
+ *
+ * Every entry is run for a number of untimed warmup iterations and
+ * then for the requested number of timed ones. The samples are sorted
+ * and summarized as min/median/p99/max/mean, in cycles. Output goes
+ * through PRINT, so on Nautilus it ends up on the serial console and
+ * can be grepped out of a lab log next to a run of the same binary
+ * built with -D__USER on Linux.
+ */
+struct bench {
+    const char * name;
+    void       (*setup)(void);
+    uint64_t   (*trial)(void);
+};
+
+static struct bench benchmarks[] = {
+    { "spinlock",      bench_spinlock_setup, bench_spinlock },
+    { "condvar",       NULL,                 bench_condvar },
+    { "thread_create", NULL,                 bench_thread_create },
+    { "thread_run",    NULL,                 bench_thread_run },
+    { "thread_both",   NULL,                 bench_thread_both },
+    { "ctx_switch",    NULL,                 bench_ctx_switch },
+#ifndef __USER
+    { "ipi_send",      NULL,                 bench_ipi_send },
+    { "int80",         bench_int80_setup,    bench_int80 },
+    { "syscall",       syscall_setup,        bench_syscall },
 #endif
+};
 
-void run_benchmarks(void);
-void 
-run_benchmarks(void)
+#define NUM_BENCHMARKS (sizeof(benchmarks)/sizeof(benchmarks[0]))
+
+#ifdef __USER
+#define BENCH_PLATFORM "linux"
+#else
+#define BENCH_PLATFORM "nautilus"
+#endif
+
+
+static void
+sift_down (uint64_t * a, unsigned i, unsigned n)
+{
+    for (;;) {
+        unsigned c = 2*i + 1;
+        uint64_t tmp;
+
+        if (c >= n) {
+            return;
+        }
+
+        if (c + 1 < n && a[c+1] > a[c]) {
+            c++;
+        }
+
+        if (a[i] >= a[c]) {
+            return;
+        }
+
+        tmp  = a[i];
+        a[i] = a[c];
+        a[c] = tmp;
+        i    = c;
+    }
+}
+
+/* heapsort: no libc qsort in the kernel, and no recursion on big runs */
+static void
+sort_samples (uint64_t * a, unsigned n)
 {
-    time_syscall();
+    unsigned i;
+    uint64_t tmp;
+
+    for (i = n / 2; i-- > 0; ) {
+        sift_down(a, i, n);
+    }
+
+    for (i = n; i-- > 1; ) {
+        tmp  = a[0];
+        a[0] = a[i];
+        a[i] = tmp;
+        sift_down(a, 0, i);
+    }
 }
 
-#ifdef __USER 
+/* nearest-rank percentile of a sorted, non-empty array */
+static inline uint64_t
+pctile (uint64_t * a, unsigned n, unsigned pct)
+{
+    return a[((uint64_t)n * pct + 99) / 100 - 1];
+}
 
-int main () {
 
-#ifdef CREATE
-    time_thread_create();
-#endif
+static void
+bench_header (bench_fmt_t fmt)
+{
+    if (fmt == BENCH_FMT_CSV) {
+        PRINT("bench,platform,unit,warmup,iters,min,median,p99,max,mean\n");
+    }
+}
 
-#ifdef CREATE_LONG
-    time_threads_long();
-#endif
+static int
+bench_one (struct bench * b, unsigned warmup, unsigned iters, bench_fmt_t fmt)
+{
+    uint64_t * s = malloc(sizeof(uint64_t) * iters);
+    uint64_t sum = 0;
+    uint64_t mean;
+    unsigned i;
 
-#ifdef RUN
-	time_thread_run();
-#endif
+    if (!s) {
+        PRINT("Could not allocate %u samples for benchmark %s\n", iters, b->name);
+        return -1;
+    }
 
-#ifdef BOTH
-	time_thread_both();
-#endif
+    if (b->setup) {
+        b->setup();
+    }
 
-#ifdef CONDVAR
-    time_condvar();
-#endif
+    for (i = 0; i < warmup; i++) {
+        (void)b->trial();
+    }
 
-#ifdef CONDVAR_BCAST
-    time_cvar_bcast();
-#endif
+    for (i = 0; i < iters; i++) {
+        s[i] = b->trial();
+        sum += s[i];
+    }
+
+    sort_samples(s, iters);
+    mean = sum / iters;
+
+    switch (fmt) {
+        case BENCH_FMT_CSV:
+            PRINT("%s,%s,cycles,%u,%u,%lu,%lu,%lu,%lu,%lu\n",
+                  b->name, BENCH_PLATFORM, warmup, iters,
+                  s[0], pctile(s, iters, 50), pctile(s, iters, 99),
+                  s[iters-1], mean);
+            break;
+        case BENCH_FMT_JSON:
+            PRINT("{\"bench\":\"%s\",\"platform\":\"%s\",\"unit\":\"cycles\","
+                  "\"warmup\":%u,\"iters\":%u,\"min\":%lu,\"median\":%lu,"
+                  "\"p99\":%lu,\"max\":%lu,\"mean\":%lu}\n",
+                  b->name, BENCH_PLATFORM, warmup, iters,
+                  s[0], pctile(s, iters, 50), pctile(s, iters, 99),
+                  s[iters-1], mean);
+            break;
+        default:
+            PRINT("BENCH %-14s (%s, warmup=%u, iters=%u) cycles - Min: %lu Median: %lu P99: %lu Max: %lu Avg: %lu\n",
+                  b->name, BENCH_PLATFORM, warmup, iters,
+                  s[0], pctile(s, iters, 50), pctile(s, iters, 99),
+                  s[iters-1], mean);
+            break;
+    }
+
+    free(s);
 
-#ifdef CTX_SWITCH
-    time_ctx_switch();
-#endif
     return 0;
 }
 
 
+/*
+ * Run the benchmark called name, or every registered one if name is
+ * NULL. Returns the number of benchmarks run, -1 on an unknown name
+ * or a bad iteration count.
+ */
+int
+run_benchmark (const char * name, unsigned warmup, unsigned iters, bench_fmt_t fmt)
+{
+    unsigned i;
+    int ran = 0;
+
+    if (!iters) {
+        PRINT("Benchmark iteration count must be non-zero\n");
+        return -1;
+    }
+
+    bench_header(fmt);
+
+    for (i = 0; i < NUM_BENCHMARKS; i++) {
+        if (name && strcmp(name, benchmarks[i].name)) {
+            continue;
+        }
+        if (bench_one(&benchmarks[i], warmup, iters, fmt) == 0) {
+            ran++;
+        }
+    }
+
+    if (name && !ran) {
+        PRINT("No benchmark named %s\n", name);
+        return -1;
+    }
+
+    return ran;
+}
+
+void 
+run_benchmarks (void)
+{
+    run_benchmark(NULL, BENCH_WARMUP, BENCH_ITERS, BENCH_FMT);
+}
+
+#ifdef __USER 
+
+static void
+usage (const char * prog)
+{
+    unsigned i;
+
+    fprintf(stderr, "usage: %s [-w warmup] [-n iters] [-f text|csv|json] [bench...]\n", prog);
+    fprintf(stderr, "benchmarks:");
+    for (i = 0; i < NUM_BENCHMARKS; i++) {
+        fprintf(stderr, " %s", benchmarks[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main (int argc, char ** argv) {
+
+    unsigned warmup = BENCH_WARMUP;
+    unsigned iters  = BENCH_ITERS;
+    bench_fmt_t fmt = BENCH_FMT;
+    int opt, rc = 0;
+
+    while ((opt = getopt(argc, argv, "w:n:f:h")) != -1) {
+        switch (opt) {
+            case 'w':
+                warmup = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                iters = strtoul(optarg, NULL, 0);
+                break;
+            case 'f':
+                if (!strcmp(optarg, "csv")) {
+                    fmt = BENCH_FMT_CSV;
+                } else if (!strcmp(optarg, "json")) {
+                    fmt = BENCH_FMT_JSON;
+                } else if (!strcmp(optarg, "text")) {
+                    fmt = BENCH_FMT_TEXT;
+                } else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (optind == argc) {
+        return run_benchmark(NULL, warmup, iters, fmt) < 0;
+    }
+
+    for (; optind < argc; optind++) {
+        if (run_benchmark(argv[optind], warmup, iters, fmt) < 0) {
+            rc = 1;
+        }
+    }
+
+    return rc;
+}
+
+
 #endif
@@ -66,6 +66,14 @@ typedef unsigned long ulong_t;
 #define DELAY(x)        udelay(x)
 #define GETCPU()        my_cpu_id()
 
+/* the RT scheduler wants constraints, benchmark threads are aperiodic */
+#ifdef NAUT_CONFIG_USE_RT_SCHEDULER
+#define THREAD_START(f, a, t, c) nk_thread_start(f, a, NULL, 0, TSTACK_DEFAULT, t, c, \
+                                                 APERIODIC, &bench_aperiodic, 0)
+#else
+#define THREAD_START(f, a, t, c) nk_thread_start(f, a, NULL, 0, TSTACK_DEFAULT, t, c)
+#endif
+
 #endif
 
 static inline void 
@@ -75,4 +83,30 @@ bset (unsigned int nr, unsigned long * addr)
             : "+m" (*(volatile long *)(addr)) : "Ir" (nr) : "memory");
 }
 
+/* 
+ * Harness defaults, override with -D on either build. Samples are in
+ * cycles; the format picks human text, CSV rows with one header line,
+ * or one JSON object per line.
+ */
+#ifndef BENCH_WARMUP
+#define BENCH_WARMUP    10
+#endif
+
+#ifndef BENCH_ITERS
+#define BENCH_ITERS     100
+#endif
+
+typedef enum {
+    BENCH_FMT_TEXT,
+    BENCH_FMT_CSV,
+    BENCH_FMT_JSON,
+} bench_fmt_t;
+
+#ifndef BENCH_FMT
+#define BENCH_FMT       BENCH_FMT_TEXT
+#endif
+
+int  run_benchmark (const char * name, unsigned warmup, unsigned iters, bench_fmt_t fmt);
+void run_benchmarks (void);
+
 #endif
@@ -129,6 +129,19 @@ CGMapper::map_task(LegionRuntime::HighLevel::Task *task)
     // put everything in the system memory
     assert(localSysMem.exists());
     for (unsigned idx = 0; idx < task->regions.size(); idx++) {
+        // points sharing a region simultaneously must use the same
+        // instance, so go wherever a full one already is
+        if (SIMULTANEOUS == task->regions[idx].prop) {
+            typedef std::map<Memory, bool>::const_iterator CIIter;
+            const std::map<Memory, bool> &ci =
+                task->regions[idx].current_instances;
+            for (CIIter it = ci.begin(); it != ci.end(); it++) {
+                if (it->second && it->first != localSysMem) {
+                    task->regions[idx].target_ranking.push_back(it->first);
+                    break;
+                }
+            }
+        }
         task->regions[idx].target_ranking.push_back(localSysMem);
         task->regions[idx].virtual_map = false;
         task->regions[idx].enable_WAR_optimization = war_enabled;
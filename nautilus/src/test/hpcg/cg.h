@@ -41,6 +41,7 @@
 #include "comp-spmv.h"
 #include "comp-waxpby.h"
 #include "comp-dotprod.h"
+#include "comp-fused.h"
 #include "comp-mg.h"
 #include "comp-symgs.h"
 #include "setup-halo.h"
@@ -65,6 +66,7 @@ preSolvPrep(lgncg::SparseMatrix &A,
             lgncg::CGData &cgData,
             int64_t nParts,
             bool doMGPrecondPrep,
+            bool mixedPrecision,
             LegionRuntime::HighLevel::Context &ctx,
             LegionRuntime::HighLevel::HighLevelRuntime *lrt)
 {
@@ -77,7 +79,7 @@ preSolvPrep(lgncg::SparseMatrix &A,
     if (doMGPrecondPrep) {
         lgncg::Vector &r = cgData.r;
         lgncg::Vector &z = cgData.z;
-        mgPrep(A, r, z, ctx, lrt);
+        mgPrep(A, r, z, mixedPrecision, ctx, lrt);
     }
 }
 
@@ -101,7 +103,11 @@ typedef unsigned char uchar_t;
     } while (0)
 
 /**
- * interface that performs the CG solve.
+ * interface that performs the CG solve. with mixedPrecision, the
+ * multigrid preconditioner works from single precision copies of the
+ * matrices while the CG iteration itself stays in double: each
+ * preconditioner application is a cheap, less accurate correction that
+ * the double precision residual keeps refining.
  */
 static inline void
 solv(SparseMatrix &A,
@@ -110,6 +116,7 @@ solv(SparseMatrix &A,
      int64_t maxIters,
      Vector &x,
      bool doPreconditioning,
+     bool mixedPrecision,
      LegionRuntime::HighLevel::Context &ctx,
      LegionRuntime::HighLevel::HighLevelRuntime *lrt)
 {
@@ -123,7 +130,8 @@ solv(SparseMatrix &A,
     // A, x, and b all have the same number of rows, so choose one
     CGData cgData(A.nRows, ctx, lrt);
     // performs all prep on the data structures we are going to work on
-    preSolvPrep(A, b, x, cgData, A.geom.size, doPreconditioning, ctx, lrt);
+    preSolvPrep(A, b, x, cgData, A.geom.size, doPreconditioning,
+                mixedPrecision, ctx, lrt);
     // convenience refs to CG data
     Vector &r  = cgData.r;
     Vector &z  = cgData.z;
@@ -132,6 +140,9 @@ solv(SparseMatrix &A,
     if (!doPreconditioning) {
         printf("*** WARNING: PERFORMING UNPRECONDITIONED ITERATIONS ***\n");
     }
+    else if (mixedPrecision) {
+        printf("  . single precision preconditioner\n");
+    }
     // p = x
     veccp(x, p, ctx, lrt);
     // Ap = A * p
@@ -180,17 +191,13 @@ solv(SparseMatrix &A,
 		//printf("Solv: 2nd step = %llu cycles\n", stop-start);
 
 		rdtscll(start);
-        // Ap = A * p
-        spmv(A, p, Ap, ctx, lrt);
-        // pAp = p' * Ap
-        dotprod(p, Ap, pAp, ctx, lrt);
+        // Ap = A * p ; pAp = p' * Ap
+        spmvDot(A, p, Ap, pAp, ctx, lrt);
         alpha = rtz / pAp;
         // x = 1 * x + alpha * p
         waxpby(1.0, x, alpha, p, x, ctx, lrt);
-        // r = 1 * r + -alpha * p
-        waxpby(1.0, r, -alpha, Ap, r, ctx, lrt);
-        // normr = r' * r
-        dotprod(r, r, normr, ctx, lrt);
+        // r = r + -alpha * Ap ; normr = r' * r
+        axpyDot(-alpha, Ap, r, normr, ctx, lrt);
         normr = sqrt(normr);
 		rdtscll(stop);
 		//printf("Solv: 3rd step = %llu cycles\n", stop-start);
@@ -271,10 +278,55 @@ init(void)
         TaskConfigOptions(true /* leaf task */),
         "lgncg-dotprod-task"
     );
+    HighLevelRuntime::register_legion_task<double, spmvDotTask>(
+        LGNCG_SPMV_DOT_TID /* task id */,
+        Processor::LOC_PROC /* proc kind  */,
+        true /* single */,
+        true /* index */,
+        AUTO_GENERATE_ID,
+        TaskConfigOptions(true /* leaf task */),
+        "lgncg-spmv-dot-task"
+    );
+    HighLevelRuntime::register_legion_task<double, axpyDotTask>(
+        LGNCG_AXPY_DOT_TID /* task id */,
+        Processor::LOC_PROC /* proc kind  */,
+        true /* single */,
+        true /* index */,
+        AUTO_GENERATE_ID,
+        TaskConfigOptions(true /* leaf task */),
+        "lgncg-axpy-dot-task"
+    );
+    HighLevelRuntime::register_legion_task<sellBuildTask>(
+        LGNCG_SELL_BUILD_TID /* task id */,
+        Processor::LOC_PROC /* proc kind  */,
+        true /* single */,
+        true /* index */,
+        AUTO_GENERATE_ID,
+        TaskConfigOptions(true /* leaf task */),
+        "lgncg-sell-build-task"
+    );
+    HighLevelRuntime::register_legion_task<spmvSELLTask>(
+        LGNCG_SPMV_SELL_TID /* task id */,
+        Processor::LOC_PROC /* proc kind  */,
+        true /* single */,
+        true /* index */,
+        AUTO_GENERATE_ID,
+        TaskConfigOptions(true /* leaf task */),
+        "lgncg-spmv-sell-task"
+    );
+    HighLevelRuntime::register_legion_task<double, spmvDotSELLTask>(
+        LGNCG_SPMV_DOT_SELL_TID /* task id */,
+        Processor::LOC_PROC /* proc kind  */,
+        true /* single */,
+        true /* index */,
+        AUTO_GENERATE_ID,
+        TaskConfigOptions(true /* leaf task */),
+        "lgncg-spmv-dot-sell-task"
+    );
     HighLevelRuntime::register_reduction_op<DotProdAccumulate>(
         LGNCG_DOTPROD_RED_ID
     );
-    HighLevelRuntime::register_legion_task<symgsTask>(
+    HighLevelRuntime::register_legion_task<symgsTask<double> >(
         LGNCG_SYMGS_TID /* task id */,
         Processor::LOC_PROC /* proc kind  */,
         true /* single */,
@@ -283,7 +335,16 @@ init(void)
         TaskConfigOptions(true /* leaf task */),
         "lgncg-symgs-task"
     );
-    HighLevelRuntime::register_legion_task<restrictionTask>(
+    HighLevelRuntime::register_legion_task<symgsTask<float> >(
+        LGNCG_SYMGS_F_TID /* task id */,
+        Processor::LOC_PROC /* proc kind  */,
+        true /* single */,
+        true /* index */,
+        AUTO_GENERATE_ID,
+        TaskConfigOptions(true /* leaf task */),
+        "lgncg-symgs-f-task"
+    );
+    HighLevelRuntime::register_legion_task<restrictionTask<double> >(
         LGNCG_RESTRICTION_TID /* task id */,
         Processor::LOC_PROC /* proc kind  */,
         true /* single */,
@@ -292,6 +353,24 @@ init(void)
         TaskConfigOptions(true /* leaf task */),
         "lgncg-restriction-task"
     );
+    HighLevelRuntime::register_legion_task<restrictionTask<float> >(
+        LGNCG_RESTRICTION_F_TID /* task id */,
+        Processor::LOC_PROC /* proc kind  */,
+        true /* single */,
+        true /* index */,
+        AUTO_GENERATE_ID,
+        TaskConfigOptions(true /* leaf task */),
+        "lgncg-restriction-f-task"
+    );
+    HighLevelRuntime::register_legion_task<vecnarrowTask>(
+        LGNCG_VEC_NARROW_TID /* task id */,
+        Processor::LOC_PROC /* proc kind  */,
+        true /* single */,
+        true /* index */,
+        AUTO_GENERATE_ID,
+        TaskConfigOptions(true /* leaf task */),
+        "lgncg-vecnarrow-task"
+    );
     HighLevelRuntime::register_legion_task<prolongationTask>(
         LGNCG_PROLONGATION_TID /* task id */,
         Processor::LOC_PROC /* proc kind  */,
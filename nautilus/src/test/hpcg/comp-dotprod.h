@@ -39,8 +39,6 @@
 
 namespace {
 
-#define LGNCG_DENSE_DOTPROD_STRIP_SIZE 256
-
 #define GDRA LegionRuntime::Accessor::RegionAccessor \
     <LegionRuntime::Accessor::AccessorType::Generic, double>
 
@@ -59,39 +57,12 @@ denseDotProd(const Rect<1> &subGridBounds,
 
 	unsigned long long start = rdtsc();
 
-    Rect<1> subrect;
-    ByteOffset inOffsets[1], offsets[1];
-    //
-    const double *xp = faX.raw_rect_ptr<1>(
-        subGridBounds, subrect, inOffsets
-    );
-    if (!xp || (subrect != subGridBounds) ||
-        !offsetsAreDense<1, double>(subGridBounds, inOffsets)) return false;
-    //
-    double *yp = faY.raw_rect_ptr<1>(
-        subGridBounds, subrect, offsets
-    );
-    if (!yp || (subrect != subGridBounds) ||
-        offsetMismatch(1, inOffsets, offsets)) return false;
+    const double *xp = densePtr(faX, subGridBounds);
+    if (!xp) return false;
+    const double *yp = densePtr(faY, subGridBounds);
+    if (!yp) return false;
     // if we are here, then let the calculation begin
-    int nPnts = subGridBounds.volume();
-    result = 0.0;
-    while (nPnts > 0) {
-        if (nPnts >= LGNCG_DENSE_DOTPROD_STRIP_SIZE) {
-            for (int i = 0; i < LGNCG_DENSE_DOTPROD_STRIP_SIZE; i++) {
-                result += (xp[i] * yp[i]);
-            }
-            nPnts -= LGNCG_DENSE_DOTPROD_STRIP_SIZE;
-            xp += LGNCG_DENSE_DOTPROD_STRIP_SIZE;
-            yp += LGNCG_DENSE_DOTPROD_STRIP_SIZE;
-        }
-        else {
-            for (int i = 0; i < nPnts; i++) {
-                result += (xp[i] * yp[i]);
-            }
-            nPnts = 0;
-        }
-    }
+    result = kahanDot(xp, yp, subGridBounds.volume());
 	unsigned long long stop = rdtsc();
 	//printf("dense dot prod took %llu cycles\n", stop-start);
     return true;
@@ -190,9 +161,14 @@ dotProdTask(const LegionRuntime::HighLevel::Task *task,
         //return localRes;
     }
     // else slower path
-    for (GenericPointInRectIterator<1> itr(xDom.get_rect<1>()); itr; itr++) {
-        localRes += x.read(DomainPoint::from_point<1>(itr.p)) *
-                    y.read(DomainPoint::from_point<1>(itr.p));
+    {
+        KahanSum sum;
+        for (GenericPointInRectIterator<1> itr(xDom.get_rect<1>());
+             itr; itr++) {
+            sum.add(x.read(DomainPoint::from_point<1>(itr.p)) *
+                    y.read(DomainPoint::from_point<1>(itr.p)));
+        }
+        localRes = sum.value();
     }
 
 out1:
@@ -0,0 +1,362 @@
+/**
+ * Copyright (c) 2014      Los Alamos National Security, LLC
+ *                         All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * LA-CC 10-123
+ */
+
+#ifndef LGNCG_COMP_FUSED_H_INCLUDED
+#define LGNCG_COMP_FUSED_H_INCLUDED
+
+#include "tids.h"
+#include "vector.h"
+#include "sparsemat.h"
+#include "utils.h"
+#include "comp-spmv.h"
+#include "dotprod-accumulate.h"
+
+#include "legion.h"
+
+/**
+ * fused CG kernels. each of these does the work of two of the separate
+ * kernels in one pass over the vectors, so every element is read from
+ * memory once instead of once per kernel.
+ */
+
+namespace {
+
+#define GDRA LegionRuntime::Accessor::RegionAccessor \
+    <LegionRuntime::Accessor::AccessorType::Generic, double>
+
+#define GLRA LegionRuntime::Accessor::RegionAccessor \
+    <LegionRuntime::Accessor::AccessorType::Generic, int64_t>
+
+struct axpyDotTaskArgs {
+    double alpha;
+    axpyDotTaskArgs(double alpha) : alpha(alpha) { ; }
+};
+
+/**
+ * y = A * x over nRows rows of nZeros entries each, returns x' * y. x
+ * starts at xLo, row i of y is element yLo + i of x. WIDTH as in
+ * spmvRows.
+ */
+template<int WIDTH>
+static inline double
+spmvDotRows(int64_t nRows,
+            int64_t nZeros,
+            const int64_t *colp,
+            const double *valp,
+            const double *xp,
+            int64_t xLo,
+            int64_t yLo,
+            double *yp)
+{
+    const int64_t w = WIDTH ? WIDTH : nZeros;
+    const double *xown = xp + (yLo - xLo);
+    lgncg::KahanSum dot;
+    for (int64_t i = 0; i < nRows; ++i) {
+        double sum = 0.0;
+        for (int64_t j = 0; j < w; ++j) {
+            sum += valp[j] * xp[colp[j] - xLo];
+        }
+        yp[i] = sum;
+        dot.add(xown[i] * sum);
+        colp += w;
+        valp += w;
+    }
+    return dot.value();
+}
+
+static inline bool
+denseSPMVDot(const Rect<1> &subGridBounds,
+             const Rect<1> &elemBounds,
+             const Rect<1> &vecBounds,
+             int64_t nZeros,
+             GLRA &faCol,
+             GDRA &faVal,
+             GDRA &faX,
+             GDRA &faY,
+             double &result)
+{
+    using namespace lgncg;
+
+    const int64_t *colp = densePtr(faCol, elemBounds);
+    if (!colp) return false;
+    const double *valp = densePtr(faVal, elemBounds);
+    if (!valp) return false;
+    const double *xp = densePtr(faX, vecBounds);
+    if (!xp) return false;
+    double *yp = densePtr(faY, subGridBounds);
+    if (!yp) return false;
+
+    const int64_t nRows = subGridBounds.volume();
+    const int64_t xLo = vecBounds.lo[0];
+    const int64_t yLo = subGridBounds.lo[0];
+    switch (nZeros) {
+        case 27:
+            result = spmvDotRows<27>(nRows, nZeros, colp, valp,
+                                     xp, xLo, yLo, yp);
+            break;
+        default:
+            result = spmvDotRows<0>(nRows, nZeros, colp, valp,
+                                    xp, xLo, yLo, yp);
+            break;
+    }
+    return true;
+}
+
+/**
+ * y = y + alpha * x, returns y' * y
+ */
+static inline bool
+denseAXPYDot(const Rect<1> &subGridBounds,
+             double alpha,
+             GDRA &faX,
+             GDRA &faY,
+             double &result)
+{
+    using namespace lgncg;
+
+    const double *xp = densePtr(faX, subGridBounds);
+    if (!xp) return false;
+    double *yp = densePtr(faY, subGridBounds);
+    if (!yp) return false;
+
+    const int64_t nPnts = subGridBounds.volume();
+    KahanSum dot;
+    for (int64_t i = 0; i < nPnts; i++) {
+        const double v = yp[i] + alpha * xp[i];
+        yp[i] = v;
+        dot.add(v * v);
+    }
+    result = dot.value();
+    return true;
+}
+
+#undef GDRA
+#undef GLRA
+
+}
+
+namespace lgncg {
+
+/**
+ * y = A * x and result = x' * y in one launch. this is spmv followed by
+ * dotprod(x, y), the p' * Ap of a CG iteration.
+ */
+static inline void
+spmvDot(const SparseMatrix &A,
+        const Vector &x,
+        Vector &y,
+        double &result,
+        LegionRuntime::HighLevel::Context &ctx,
+        LegionRuntime::HighLevel::HighLevelRuntime *lrt)
+{
+    using namespace LegionRuntime::HighLevel;
+    int idx = 0;
+    // sanity - make sure that all launch domains are the same size
+    assert(A.vals.lDom().get_volume() == x.lDom().get_volume() &&
+           x.lDom().get_volume() == y.lDom().get_volume());
+    if (A.sell) {
+        spmvSELL(A, x, y, true, &result, ctx, lrt);
+        return;
+    }
+    ArgumentMap argMap;
+    spmvTaskArgs targs(A.nCols);
+    IndexLauncher il(LGNCG_SPMV_DOT_TID, A.vals.lDom(),
+                     TaskArgument(&targs, sizeof(targs)), argMap);
+    // A's regions /////////////////////////////////////////////////////////////
+    il.add_region_requirement(
+        RegionRequirement(A.vals.lp(), 0, READ_ONLY, EXCLUSIVE, A.vals.lr)
+    );
+    il.add_field(idx++, A.vals.fid);
+    il.add_region_requirement(
+        RegionRequirement(A.mIdxs.lp(), 0, READ_ONLY, EXCLUSIVE, A.mIdxs.lr)
+    );
+    il.add_field(idx++, A.mIdxs.fid);
+    // x's regions /////////////////////////////////////////////////////////////
+    il.add_region_requirement(
+        /* our cells and the neighbors' ghost cells */
+        RegionRequirement(A.haloLP(x, ctx, lrt), 0, READ_ONLY, EXCLUSIVE, x.lr)
+    );
+    il.add_field(idx++, x.fid);
+    // y's regions /////////////////////////////////////////////////////////////
+    il.add_region_requirement(
+        RegionRequirement(y.lp(), 0, WRITE_DISCARD, EXCLUSIVE, y.lr)
+    );
+    il.add_field(idx++, y.fid);
+    // execute the thing...
+    Future fResult = lrt->execute_index_space(ctx, il, LGNCG_DOTPROD_RED_ID);
+    result = fResult.get_result<double>();
+}
+
+/**
+ * y = y + alpha * x and result = y' * y in one launch. this is the
+ * waxpby(1.0, y, alpha, x, y) followed by dotprod(y, y) that updates the
+ * residual of a CG iteration and takes its norm.
+ */
+static inline void
+axpyDot(double alpha,
+        const Vector &x,
+        Vector &y,
+        double &result,
+        LegionRuntime::HighLevel::Context &ctx,
+        LegionRuntime::HighLevel::HighLevelRuntime *lrt)
+{
+    using namespace LegionRuntime::HighLevel;
+    int idx = 0;
+    // sanity - make sure that all launch domains are the same size
+    assert(x.lDom().get_volume() == y.lDom().get_volume());
+    assert(!Vector::same(x, y));
+    ArgumentMap argMap;
+    axpyDotTaskArgs targs(alpha);
+    IndexLauncher il(LGNCG_AXPY_DOT_TID, x.lDom(),
+                     TaskArgument(&targs, sizeof(targs)), argMap);
+    // x's regions /////////////////////////////////////////////////////////////
+    il.add_region_requirement(
+        RegionRequirement(x.lp(), 0, READ_ONLY, EXCLUSIVE, x.lr)
+    );
+    il.add_field(idx++, x.fid);
+    // y's regions /////////////////////////////////////////////////////////////
+    il.add_region_requirement(
+        RegionRequirement(y.lp(), 0, READ_WRITE, EXCLUSIVE, y.lr)
+    );
+    il.add_field(idx++, y.fid);
+    // execute the thing...
+    Future fResult = lrt->execute_index_space(ctx, il, LGNCG_DOTPROD_RED_ID);
+    result = fResult.get_result<double>();
+}
+
+/**
+ * computes: y = A * x ; returns x' * y
+ */
+inline double
+spmvDotTask(const LegionRuntime::HighLevel::Task *task,
+            const std::vector<LegionRuntime::HighLevel::PhysicalRegion> &rgns,
+            LegionRuntime::HighLevel::Context ctx,
+            LegionRuntime::HighLevel::HighLevelRuntime *lrt)
+{
+    using namespace LegionRuntime::HighLevel;
+    using namespace LegionRuntime::Accessor;
+    using LegionRuntime::Arrays::Rect;
+    static const uint8_t aValsRID  = 0;
+    static const uint8_t aMIdxsRID = 1;
+    static const uint8_t xRID      = 2;
+    static const uint8_t yRID      = 3;
+    // A (x2), x, y
+    assert(4 == rgns.size());
+    const spmvTaskArgs targs = *(spmvTaskArgs *)task->args;
+    // convenience typedefs
+    typedef RegionAccessor<AccessorType::Generic, double>  GDRA;
+    typedef RegionAccessor<AccessorType::Generic, int64_t> GLRA;
+    // sparse matrix
+    GDRA av = rgns[aValsRID].get_field_accessor(0).typeify<double>();
+    GLRA ai = rgns[aMIdxsRID].get_field_accessor(0).typeify<int64_t>();
+    const Domain aMIdxsDom = lrt->get_index_space_domain(
+        ctx, task->regions[aMIdxsRID].region.get_index_space()
+    );
+    // vectors
+    GDRA x = rgns[xRID].get_field_accessor(0).typeify<double>();
+    const Domain xDom = lrt->get_index_space_domain(
+        ctx, task->regions[xRID].region.get_index_space()
+    );
+    GDRA y = rgns[yRID].get_field_accessor(0).typeify<double>();
+    const Domain yDom = lrt->get_index_space_domain(
+        ctx, task->regions[yRID].region.get_index_space()
+    );
+    // now, actually perform the computation
+    const int64_t maxNon0sInCol = targs.nCols;
+    Rect<1> rowRect  = yDom.get_rect<1>();
+    Rect<1> elemRect = aMIdxsDom.get_rect<1>();
+    Rect<1> vecRect  = xDom.get_rect<1>();
+    double localRes = 0.0;
+    // try fast path
+    if (denseSPMVDot(rowRect, elemRect, vecRect, maxNon0sInCol,
+                     ai, av, x, y, localRes)) {
+        return localRes;
+    }
+    // else slower path
+    KahanSum dot;
+    DomainPoint pir; pir.dim = 1;
+    GenericPointInRectIterator<1> ciItr(elemRect);
+    for (GenericPointInRectIterator<1> rowItr(rowRect); rowItr; rowItr++) {
+        const DomainPoint row = DomainPoint::from_point<1>(rowItr.p);
+        double sum = 0.0;
+        for (int64_t j = 0; j < maxNon0sInCol; ++j, ciItr++) {
+            pir.point_data[0] = ai.read(DomainPoint::from_point<1>(ciItr.p));
+            sum += av.read(DomainPoint::from_point<1>(ciItr.p)) * x.read(pir);
+        }
+        y.write(row, sum);
+        dot.add(x.read(row) * sum);
+    }
+    return dot.value();
+}
+
+/**
+ * computes: y = y + alpha * x ; returns y' * y
+ */
+inline double
+axpyDotTask(const LegionRuntime::HighLevel::Task *task,
+            const std::vector<LegionRuntime::HighLevel::PhysicalRegion> &rgns,
+            LegionRuntime::HighLevel::Context ctx,
+            LegionRuntime::HighLevel::HighLevelRuntime *lrt)
+{
+    using namespace LegionRuntime::HighLevel;
+    using namespace LegionRuntime::Accessor;
+    using LegionRuntime::Arrays::Rect;
+    static const uint8_t xRID = 0;
+    static const uint8_t yRID = 1;
+    // x, y
+    assert(2 == rgns.size());
+    const axpyDotTaskArgs targs = *(axpyDotTaskArgs *)task->args;
+    // convenience typedefs
+    typedef RegionAccessor<AccessorType::Generic, double>  GDRA;
+    // vectors
+    GDRA x = rgns[xRID].get_field_accessor(0).typeify<double>();
+    GDRA y = rgns[yRID].get_field_accessor(0).typeify<double>();
+    const Domain yDom = lrt->get_index_space_domain(
+        ctx, task->regions[yRID].region.get_index_space()
+    );
+    // now, actually perform the computation
+    const double alpha = targs.alpha;
+    double localRes = 0.0;
+    if (denseAXPYDot(yDom.get_rect<1>(), alpha, x, y, localRes)) {
+        return localRes;
+    }
+    // else slower path
+    KahanSum dot;
+    for (GenericPointInRectIterator<1> itr(yDom.get_rect<1>()); itr; itr++) {
+        const DomainPoint pnt = DomainPoint::from_point<1>(itr.p);
+        const double v = y.read(pnt) + alpha * x.read(pnt);
+        y.write(pnt, v);
+        dot.add(v * v);
+    }
+    return dot.value();
+}
+
+} // end lgncg namespace
+
+#endif
@@ -39,26 +39,48 @@
 #include "comp-symgs.h"
 #include "comp-restriction.h"
 #include "comp-prolongation.h"
+#include "vec-narrow.h"
 
 namespace lgncg {
 
+/**
+ * gives A single precision copies of its values and diagonal, partitioned
+ * like the originals, for the preconditioner to use.
+ */
+static inline void
+mgMixedPrep(SparseMatrix &A,
+            LegionRuntime::HighLevel::Context &ctx,
+            LegionRuntime::HighLevel::HighLevelRuntime *lrt)
+{
+    if (A.mixed) return;
+    A.valsF.create<float>(A.vals.len, ctx, lrt);
+    A.diagF.create<float>(A.diag.len, ctx, lrt);
+    A.valsF.partition(A.nParts, ctx, lrt);
+    A.diagF.partition(A.nParts, ctx, lrt);
+    vecnarrow(A.vals, A.valsF, ctx, lrt);
+    vecnarrow(A.diag, A.diagF, ctx, lrt);
+    A.mixed = true;
+}
+
 static inline void
 mgPrep(SparseMatrix &A,
        Vector &r,
        Vector &x,
+       bool mixed,
        LegionRuntime::HighLevel::Context &ctx,
        LegionRuntime::HighLevel::HighLevelRuntime *lrt)
 {
+    // every level smooths, the coarsest one included
+    if (mixed) mgMixedPrep(A, ctx, lrt);
     // recursively push partition schemes on the target data structures.
     if (A.mgData) {
-        //A.mgData->Axf.partition(A.nParts, ctx, lrt); // already partitioned
         r.partition(A.nParts, ctx, lrt);
         x.partition(A.nParts, ctx, lrt);
         //A.Ac->partition(A.geom, ctx, lrt); // already partitioned
         A.mgData->rc.partition(A.nParts, ctx, lrt);
         A.mgData->xc.partition(A.nParts, ctx, lrt);
         // now do the same for the next coarsest level
-        mgPrep(*A.Ac, A.mgData->rc, A.mgData->xc, ctx, lrt);
+        mgPrep(*A.Ac, A.mgData->rc, A.mgData->xc, mixed, ctx, lrt);
     }
 }
 
@@ -77,14 +99,15 @@ mg(SparseMatrix &A,
         for (int64_t i = 0; i < nPresmootherSteps; ++i) {
             symgs(A, x, r, ctx, lrt);
         }
-        spmv(A, x, A.mgData->Axf, ctx, lrt);
-        // perform restriction operation using simple injection
-        restriction(A, r, ctx, lrt);
+        // perform restriction of the residual using simple injection
+        restriction(A, x, r, ctx, lrt);
         mg(*A.Ac, A.mgData->rc, A.mgData->xc, ctx, lrt);
         prolongation(A, x, ctx, lrt);
+        // the coarse correction only lands on the first color's rows, which
+        // a sweep starting there would recompute before anything read them
         const int64_t nPostsmootherSteps = A.mgData->nPostsmootherSteps;
         for (int64_t i = 0; i < nPostsmootherSteps; ++i) {
-            symgs(A, x, r, ctx, lrt);
+            symgs(A, x, r, ctx, lrt, true /* last color first */);
         }
     }
     else {
@@ -37,18 +37,30 @@
 
 #include "legion.h"
 
+namespace {
+
+struct restrictionTaskArgs {
+    int64_t nCols;
+    restrictionTaskArgs(int64_t nCols) : nCols(nCols) { ; }
+};
+
+}
+
 /**
- * computes the coarse residual vector.
+ * computes the coarse residual vector. injection only keeps the fine rows
+ * f2cOp names, so the fine residual is only computed for those rows, in
+ * the same pass that injects it.
  */
 
 namespace lgncg {
 
 /**
  * responsible for setting up the task launch of the compute restriction
- * operation.
+ * operation: rc = (rf - A * xf) at the fine rows in A.mgData->f2cOp.
  */
 static inline void
 restriction(SparseMatrix &A,
+            const Vector &xf,
             Vector &rf,
             LegionRuntime::HighLevel::Context &ctx,
             LegionRuntime::HighLevel::HighLevelRuntime *lrt)
@@ -56,14 +68,28 @@ restriction(SparseMatrix &A,
     using namespace LegionRuntime::HighLevel;
     int idx = 0;
     ArgumentMap argMap;
-    IndexLauncher il(LGNCG_RESTRICTION_TID, A.mgData->Axf.lDom(),
-                     TaskArgument(NULL, 0), argMap);
-    // A.mgData->Axf
+    restrictionTaskArgs targs(A.nCols);
+    // a mixed precision matrix restricts with its float values
+    const Vector &vals = A.mixed ? A.valsF : A.vals;
+    const int tid = A.mixed ? LGNCG_RESTRICTION_F_TID : LGNCG_RESTRICTION_TID;
+    IndexLauncher il(tid, A.mgData->rc.lDom(),
+                     TaskArgument(&targs, sizeof(targs)), argMap);
+    // A's vals
+    il.add_region_requirement(
+        RegionRequirement(vals.lp(), 0, READ_ONLY, EXCLUSIVE, vals.lr)
+    );
+    il.add_field(idx++, vals.fid);
+    // A's mIdxs
     il.add_region_requirement(
-        RegionRequirement(A.mgData->Axf.lp(), 0, READ_ONLY,
-                          EXCLUSIVE, A.mgData->Axf.lr)
+        RegionRequirement(A.mIdxs.lp(), 0, READ_ONLY, EXCLUSIVE, A.mIdxs.lr)
     );
-    il.add_field(idx++, A.mgData->Axf.fid);
+    il.add_field(idx++, A.mIdxs.fid);
+    // xf, our cells and the neighbors' ghost cells
+    il.add_region_requirement(
+        RegionRequirement(A.haloLP(xf, ctx, lrt), 0, READ_ONLY,
+                          EXCLUSIVE, xf.lr)
+    );
+    il.add_field(idx++, xf.fid);
     // rf
     il.add_region_requirement(
         RegionRequirement(rf.lp(), 0, READ_ONLY, EXCLUSIVE, rf.lr)
@@ -86,8 +112,9 @@ restriction(SparseMatrix &A,
 }
 
 /**
- *
+ * T is the type A's values are stored as.
  */
+template <typename T>
 inline void
 restrictionTask(
     const LegionRuntime::HighLevel::Task *task,
@@ -100,64 +127,71 @@ restrictionTask(
     using namespace LegionRuntime::Accessor;
     using LegionRuntime::Arrays::Rect;
     (void)ctx; (void)lrt;
-    static const uint8_t AxfRID  = 0;
-    static const uint8_t rfRID   = 1;
-    static const uint8_t rcRID   = 2;
-    static const uint8_t f2cRID  = 3;
-    // A.mgData->Axf, rf, A.mgData->rc, A.mgData->f2cOp
-    assert(4 == rgns.size());
-    // name the regions
-    const PhysicalRegion &Axfpr = rgns[AxfRID];
-    const PhysicalRegion &rfpr  = rgns[rfRID];
-    const PhysicalRegion &rcpr  = rgns[rcRID];
-    const PhysicalRegion &f2cpr = rgns[f2cRID];
+    static const uint8_t aValsRID  = 0;
+    static const uint8_t aMIdxsRID = 1;
+    static const uint8_t xfRID     = 2;
+    static const uint8_t rfRID     = 3;
+    static const uint8_t rcRID     = 4;
+    static const uint8_t f2cRID    = 5;
+    // A (x2), xf, rf, A.mgData->rc, A.mgData->f2cOp
+    assert(6 == rgns.size());
+    const restrictionTaskArgs targs = *(restrictionTaskArgs *)task->args;
     // convenience typedefs
     typedef RegionAccessor<AccessorType::Generic, double>  GDRA;
+    typedef RegionAccessor<AccessorType::Generic, T>       GTRA;
     typedef RegionAccessor<AccessorType::Generic, int64_t> GLRA;
+    // sparse matrix
+    GTRA av = rgns[aValsRID].get_field_accessor(0).template typeify<T>();
+    GLRA ai = rgns[aMIdxsRID].get_field_accessor(0).typeify<int64_t>();
+    const Domain aValsDom = lrt->get_index_space_domain(
+        ctx, task->regions[aValsRID].region.get_index_space()
+    );
     // vectors
-    GDRA Axf = Axfpr.get_field_accessor(0).typeify<double>();
-    const Domain AxfDom = lrt->get_index_space_domain(
-        ctx, task->regions[AxfRID].region.get_index_space()
+    GDRA xf = rgns[xfRID].get_field_accessor(0).typeify<double>();
+    const Domain xfDom = lrt->get_index_space_domain(
+        ctx, task->regions[xfRID].region.get_index_space()
     );
-    GDRA rf  = rfpr.get_field_accessor(0).typeify<double>();
+    GDRA rf = rgns[rfRID].get_field_accessor(0).typeify<double>();
     const Domain rfDom = lrt->get_index_space_domain(
         ctx, task->regions[rfRID].region.get_index_space()
     );
-    GDRA rc  = rcpr.get_field_accessor(0).typeify<double>();
+    GDRA rc = rgns[rcRID].get_field_accessor(0).typeify<double>();
     const Domain rcDom = lrt->get_index_space_domain(
         ctx, task->regions[rcRID].region.get_index_space()
     );
-    GLRA f2c = f2cpr.get_field_accessor(0).typeify<int64_t>();
+    GLRA f2c = rgns[f2cRID].get_field_accessor(0).typeify<int64_t>();
     const Domain f2cDom = lrt->get_index_space_domain(
         ctx, task->regions[f2cRID].region.get_index_space()
     );
-    Rect<1> myGridBounds = AxfDom.get_rect<1>();
-    Rect<1> rec; ByteOffset boff[1];
-    // Axf
-    const double *const Axfp = Axf.raw_rect_ptr<1>(myGridBounds, rec, boff);
-    bool offd = offsetsAreDense<1, double>(myGridBounds, boff);
-    assert(offd);
-    // rf
-    myGridBounds = rfDom.get_rect<1>();
-    const double *const rfp = rf.raw_rect_ptr<1>(myGridBounds, rec, boff);
-    offd = offsetsAreDense<1, double>(myGridBounds, boff);
-    assert(offd);
-    // rc
-    myGridBounds = rcDom.get_rect<1>();
-    double *rcp = rc.raw_rect_ptr<1>(myGridBounds, rec, boff);
-    offd = offsetsAreDense<1, double>(myGridBounds, boff);
-    assert(offd);
-    // f2c
-    myGridBounds = f2cDom.get_rect<1>();
-    Rect<1> f2csr; ByteOffset f2cOff[1];
-    const int64_t *const f2cp = f2c.raw_rect_ptr<1>(myGridBounds,
-                                                    f2csr, f2cOff);
-    offd = offsetsAreDense<1, int64_t>(myGridBounds, boff);
-    assert(offd);
+    const Rect<1> aRect = aValsDom.get_rect<1>();
+    const T *const avp = densePtr(av, aRect);
+    assert(avp);
+    const int64_t *const aip = densePtr(ai, aRect);
+    assert(aip);
+    // xf (our cells and the ghosts), starting at "real" index xLo
+    const Rect<1> xfRect = xfDom.get_rect<1>();
+    const int64_t xLo = xfRect.lo[0];
+    const double *const xfp = densePtr(xf, xfRect);
+    assert(xfp);
+    const double *const rfp = densePtr(rf, rfDom.get_rect<1>());
+    assert(rfp);
+    double *const rcp = densePtr(rc, rcDom.get_rect<1>());
+    assert(rcp);
+    // f2c holds local fine rows
+    const int64_t *const f2cp = densePtr(f2c, f2cDom.get_rect<1>());
+    assert(f2cp);
     // now, actually perform the computation
+    const int64_t nCols = targs.nCols;
     const int64_t nc = rcDom.get_rect<1>().volume();
     for (int64_t i = 0; i < nc; ++i) {
-        rcp[i] = rfp[f2cp[i]] - Axfp[f2cp[i]];
+        const int64_t f = f2cp[i];
+        const T *const cVals = avp + f * nCols;
+        const int64_t *const cIndx = aip + f * nCols;
+        double Axf = 0.0;
+        for (int64_t j = 0; j < nCols; ++j) {
+            Axf += cVals[j] * xfp[cIndx[j] - xLo];
+        }
+        rcp[i] = rfp[f] - Axf;
     }
 }
 
@@ -34,13 +34,12 @@
 #include "sparsemat.h"
 #include "utils.h"
 #include "tids.h"
+#include "sell.h"
 
 #include "legion.h"
 
 namespace {
 
-#define LGNCG_DENSE_SPMV_STRIP_SIZE 256
-
 #define GDRA LegionRuntime::Accessor::RegionAccessor \
     <LegionRuntime::Accessor::AccessorType::Generic, double>
 
@@ -52,82 +51,68 @@ struct spmvTaskArgs {
     spmvTaskArgs(int64_t nCols) : nCols(nCols) { ; }
 };
 
+/**
+ * y = A * x over nRows rows of nZeros entries each. WIDTH is nZeros when
+ * it is known at compile time (the inner loop then unrolls), 0 when it
+ * is not.
+ */
+template<int WIDTH>
+static inline void
+spmvRows(int64_t nRows,
+         int64_t nZeros,
+         const int64_t *colp,
+         const double *valp,
+         const double *xp,
+         int64_t xLo,
+         double *yp)
+{
+    const int64_t w = WIDTH ? WIDTH : nZeros;
+    for (int64_t i = 0; i < nRows; ++i) {
+        double sum = 0.0;
+        for (int64_t j = 0; j < w; ++j) {
+            sum += valp[j] * xp[colp[j] - xLo];
+        }
+        yp[i] = sum;
+        colp += w;
+        valp += w;
+    }
+}
+
 /**
  * Adapted from another Legion CG code.
  */
-template<int MAX_NZEROS>
-bool
+static inline bool
 denseSPMV(
     const Rect<1> &subGridBounds,
     const Rect<1> &elemBounds,
     const Rect<1> &vecBounds,
+    int64_t nZeros,
     GLRA &faCol,
     GDRA &faVal,
     GDRA &faX,
     GDRA &faY)
 {
     using namespace lgncg;
-    using namespace LegionRuntime::HighLevel;
-    using namespace LegionRuntime::Accessor;
 
-    Rect<1> subrect;
-    ByteOffset inOffsets[1], offsets[1];
-    //
-    const int64_t *colp = faCol.raw_rect_ptr<1>(
-        elemBounds, subrect, inOffsets
-    );
-    if (!colp || (subrect != elemBounds) ||
-        !offsetsAreDense<1, double>(elemBounds, inOffsets)) return false;
-    //
-    const double *valp = faVal.raw_rect_ptr<1>(
-        elemBounds, subrect, offsets
-    );
-    if (!valp || (subrect != elemBounds) ||
-        offsetMismatch(1, inOffsets, offsets)) return false;
-    //
-    const double *xp = faX.raw_rect_ptr<1>(
-        vecBounds, subrect, offsets
-    );
-    if (!xp || (subrect != vecBounds) ||
-        !offsetsAreDense<1, double>(vecBounds, offsets)) return false;
-    //
-    double *yp = faY.raw_rect_ptr<1>(
-        subGridBounds, subrect, offsets
-    );
-    if (!yp || (subrect != subGridBounds) ||
-        !offsetsAreDense<1, double>(subGridBounds, offsets)) return false;
-    // if we are here, then let the calculation begin
-    int nRows = subGridBounds.volume();
-    while (nRows > 0) {
-        if (nRows >= LGNCG_DENSE_SPMV_STRIP_SIZE) {
-            for (int i = 0; i < LGNCG_DENSE_SPMV_STRIP_SIZE; ++i) {
-                double sum = 0.0;
-                for (int j = 0; j < MAX_NZEROS; ++j) {
-                    const int index = colp[i * MAX_NZEROS + j];
-                    const double val = valp[i * MAX_NZEROS + j];
-                    const double xval = xp[index];
-                    sum += (val * xval);
-                }
-                yp[i] = sum;
-            }
-            nRows -= LGNCG_DENSE_SPMV_STRIP_SIZE;
-            colp += (MAX_NZEROS * LGNCG_DENSE_SPMV_STRIP_SIZE);
-            valp += (MAX_NZEROS * LGNCG_DENSE_SPMV_STRIP_SIZE);
-            yp += LGNCG_DENSE_SPMV_STRIP_SIZE;
-        }
-        else {
-            for (int i = 0; i < nRows; ++i) {
-                double sum = 0.0;
-                for (int j = 0; j < MAX_NZEROS; ++j) {
-                    const int index = colp[i * MAX_NZEROS + j];
-                    const double val = valp[i * MAX_NZEROS + j];
-                    const double xval = xp[index];
-                    sum += (val * xval);
-                }
-                yp[i] = sum;
-            }
-            nRows = 0;
-        }
+    const int64_t *colp = densePtr(faCol, elemBounds);
+    if (!colp) return false;
+    const double *valp = densePtr(faVal, elemBounds);
+    if (!valp) return false;
+    const double *xp = densePtr(faX, vecBounds);
+    if (!xp) return false;
+    double *yp = densePtr(faY, subGridBounds);
+    if (!yp) return false;
+    // if we are here, then let the calculation begin. x is only our part
+    // of it, and starts at vecBounds.lo.
+    const int64_t nRows = subGridBounds.volume();
+    const int64_t xLo = vecBounds.lo[0];
+    switch (nZeros) {
+        case 27:
+            spmvRows<27>(nRows, nZeros, colp, valp, xp, xLo, yp);
+            break;
+        default:
+            spmvRows<0>(nRows, nZeros, colp, valp, xp, xLo, yp);
+            break;
     }
     return true;
 }
@@ -159,6 +144,10 @@ spmv(const SparseMatrix &A,
     // sanity - make sure that all launch domains are the same size
     assert(A.vals.lDom().get_volume() == x.lDom().get_volume() &&
            x.lDom().get_volume() == y.lDom().get_volume());
+    if (A.sell) {
+        spmvSELL(A, x, y, false, NULL, ctx, lrt);
+        return;
+    }
     // setup per-task args
     ArgumentMap argMap;
     spmvTaskArgs targs(A.nCols);
@@ -177,8 +166,8 @@ spmv(const SparseMatrix &A,
     il.add_field(idx++, A.mIdxs.fid);
     // x's regions /////////////////////////////////////////////////////////////
     il.add_region_requirement(
-        /* notice we are using the entire region here */
-        RegionRequirement(x.lr, 0, READ_ONLY, EXCLUSIVE, x.lr)
+        /* our cells and the neighbors' ghost cells */
+        RegionRequirement(A.haloLP(x, ctx, lrt), 0, READ_ONLY, EXCLUSIVE, x.lr)
     );
     il.add_field(idx++, x.fid);
     // y's regions /////////////////////////////////////////////////////////////
@@ -248,13 +237,9 @@ spmvTask(const LegionRuntime::HighLevel::Task *task,
     Rect<1> elemRect = aMIdxsDom.get_rect<1>();
     Rect<1> vecRect  = xDom.get_rect<1>();
     // try fast path
-    switch (maxNon0sInCol) {
-        case 27: {
-            if (denseSPMV<27>(rowRect, elemRect, vecRect, ai, av, x, y)) {
-                // done
-                return;
-            }
-        }
+    if (denseSPMV(rowRect, elemRect, vecRect, maxNon0sInCol, ai, av, x, y)) {
+        // done
+        return;
     }
     // if here, then we are going with the slower path
     DomainPoint pir; pir.dim = 1;
@@ -40,10 +40,17 @@
 namespace {
 
 struct symgsTaskArgs {
-    uint8_t sweepi;
+    // rows of this color are updated, see symgsColorOf
+    uint8_t color;
     uint64_t nMatCols;
+    // local and processor grid dimensions, for finding row colors
+    int64_t nx, ny, nz;
+    int64_t npx, npy;
 
-    symgsTaskArgs(uint8_t s, uint64_t n) : sweepi(s), nMatCols(n) { ; }
+    symgsTaskArgs(uint8_t c, uint64_t n, const lgncg::Geometry &geom)
+        : color(c), nMatCols(n),
+          nx(geom.nx), ny(geom.ny), nz(geom.nz),
+          npx(geom.npx), npy(geom.npy) { ; }
 };
 
 }
@@ -54,44 +61,56 @@ struct symgsTaskArgs {
 namespace lgncg {
 
 /**
- * responsible for setting up the task launch of the symmetric gauss-seidel
- * where x is unknown.
+ * rows are colored by the parity of their global (x, y, z) coordinates.
+ * no two neighbors in a 27-point stencil share a color, so all rows of a
+ * color can be relaxed at once, and each color only reads the others.
+ */
+static const uint8_t SYMGS_N_COLORS = 8;
+
+/**
+ * responsible for setting up the task launches of the symmetric
+ * gauss-seidel where x is unknown: a forward sweep over the colors, then a
+ * backward one, or the other way around if lastColorFirst. x is updated in
+ * place; the subgrids of one color launch never write a cell another of
+ * them reads, so they share their halos of x with simultaneous coherence
+ * instead of each taking a private copy.
  */
 static inline void
 symgs(const SparseMatrix &A,
       Vector &x,
       const Vector &r,
       LegionRuntime::HighLevel::Context &ctx,
-      LegionRuntime::HighLevel::HighLevelRuntime *lrt)
+      LegionRuntime::HighLevel::HighLevelRuntime *lrt,
+      bool lastColorFirst = false)
 {
     using namespace LegionRuntime::HighLevel;
     // sanity - make sure that all launch domains are the same size
     assert(A.vals.lDom().get_volume() == x.lDom().get_volume() &&
            x.lDom().get_volume() == r.lDom().get_volume());
-    // create tmp array - not ideal, but seems to work.
-    Vector tmpX;
-    tmpX.create<double>(x.len, ctx, lrt);
-    tmpX.partition(A.nParts, ctx, lrt);
+    // a mixed precision matrix is smoothed from its float values
+    const Vector &vals = A.mixed ? A.valsF : A.vals;
+    const Vector &diag = A.mixed ? A.diagF : A.diag;
+    const int tid = A.mixed ? LGNCG_SYMGS_F_TID : LGNCG_SYMGS_TID;
     ArgumentMap argMap;
-    // FIXME - i don't like this. Performance and memory usage shortcomings.
-    static const uint8_t N_SWEEPS = 2;
-    for (uint8_t sweepi = 0; sweepi < N_SWEEPS; ++sweepi) {
-        veccp(x, tmpX, ctx, lrt);
-        symgsTaskArgs taskArgs(sweepi, A.nCols);
+    for (uint8_t step = 0; step < 2 * SYMGS_N_COLORS; ++step) {
+        uint8_t color = (step < SYMGS_N_COLORS) ?
+                        step : (2 * SYMGS_N_COLORS - 1 - step);
+        if (lastColorFirst) color = SYMGS_N_COLORS - 1 - color;
+        symgsTaskArgs taskArgs(color, A.nCols, A.geom);
         int idx = 0;
-        IndexLauncher il(LGNCG_SYMGS_TID, A.vals.lDom(),
+        IndexLauncher il(tid, A.vals.lDom(),
                          TaskArgument(&taskArgs, sizeof(taskArgs)), argMap);
         // A's regions /////////////////////////////////////////////////////////
         // vals
         il.add_region_requirement(
-            RegionRequirement(A.vals.lp(), 0, READ_ONLY, EXCLUSIVE, A.vals.lr)
+            RegionRequirement(vals.lp(), 0, READ_ONLY, EXCLUSIVE, vals.lr)
         );
-        il.add_field(idx++, A.vals.fid);
+        il.add_field(idx++, vals.fid);
         // diag
         il.add_region_requirement(
-            RegionRequirement(A.diag.lp(), 0, READ_ONLY, EXCLUSIVE, A.diag.lr)
+            RegionRequirement(diag.lp(), 0, READ_ONLY, EXCLUSIVE, diag.lr)
         );
-        il.add_field(idx++, A.diag.fid);
+        il.add_field(idx++, diag.fid);
         // mIdxs
         il.add_region_requirement(
             RegionRequirement(A.mIdxs.lp(), 0, READ_ONLY, EXCLUSIVE, A.mIdxs.lr)
@@ -103,15 +122,11 @@ symgs(const SparseMatrix &A,
         );
         il.add_field(idx++, A.nzir.fid);
         // x's regions /////////////////////////////////////////////////////////
-        // read/write view of x
-        il.add_region_requirement(
-            RegionRequirement(tmpX.lp(), 0, READ_WRITE, EXCLUSIVE, tmpX.lr)
-        );
-        il.add_field(idx++, tmpX.fid);
-        // read only view of all of x. FIXME only use required cells
+        // our cells of x and the neighbors' ghost cells, shared with the
+        // neighbors working on this color
         il.add_region_requirement(
-            /* notice we are using the entire region here */
-            RegionRequirement(x.lr, 0, READ_ONLY, EXCLUSIVE, x.lr)
+            RegionRequirement(A.haloLP(x, ctx, lrt), 0,
+                              READ_WRITE, SIMULTANEOUS, x.lr)
         );
         il.add_field(idx++, x.fid);
         // r's regions /////////////////////////////////////////////////////////
@@ -121,15 +136,14 @@ symgs(const SparseMatrix &A,
         il.add_field(idx++, r.fid);
         // execute the thing...
         (void)lrt->execute_index_space(ctx, il);
-        // copy back
-        veccp(tmpX, x, ctx, lrt);
     }
-    tmpX.free(ctx, lrt);
 }
 
 /**
- * computes: symgs for Ax = r
+ * computes: symgs for Ax = r. T is the type A's values are stored as, x
+ * and r are always double.
  */
+template <typename T>
 inline void
 symgsTask(const LegionRuntime::HighLevel::Task *task,
           const std::vector<LegionRuntime::HighLevel::PhysicalRegion> &rgns,
@@ -144,11 +158,10 @@ symgsTask(const LegionRuntime::HighLevel::Task *task,
     static const uint8_t aDiagRID  = 1;
     static const uint8_t aMIdxsRID = 2;
     static const uint8_t aNZiRRID  = 3;
-    static const uint8_t xRWRID    = 4;
-    static const uint8_t xRID      = 5;
-    static const uint8_t rRID      = 6;
-    // A (x4), x (x2), b
-    assert(7 == rgns.size());
+    static const uint8_t xRID      = 4;
+    static const uint8_t rRID      = 5;
+    // A (x4), x, b
+    assert(6 == rgns.size());
     const symgsTaskArgs args = *(symgsTaskArgs *)task->args;
     const int64_t nMatCols = args.nMatCols;
     // name the regions
@@ -158,29 +171,25 @@ symgsTask(const LegionRuntime::HighLevel::Task *task,
     const PhysicalRegion &aipr = rgns[aMIdxsRID];
     const PhysicalRegion &azpr = rgns[aNZiRRID];
     // vector regions
-    const PhysicalRegion &xrwpr = rgns[xRWRID]; // read/write sub-region
-    const PhysicalRegion &xpr   = rgns[xRID]; // read only region (entire)
-    const PhysicalRegion &rpr   = rgns[rRID];
+    const PhysicalRegion &xpr  = rgns[xRID]; // read/write region (halo)
+    const PhysicalRegion &rpr  = rgns[rRID];
     // convenience typedefs
     typedef RegionAccessor<AccessorType::Generic, double>  GDRA;
+    typedef RegionAccessor<AccessorType::Generic, T>       GTRA;
     typedef RegionAccessor<AccessorType::Generic, int64_t> GLRA;
     typedef RegionAccessor<AccessorType::Generic, uint8_t> GSRA;
     // sparse matrix
-    GDRA av = avpr.get_field_accessor(0).typeify<double>();
+    GTRA av = avpr.get_field_accessor(0).template typeify<T>();
     const Domain aValsDom = lrt->get_index_space_domain(
         ctx, task->regions[aValsRID].region.get_index_space()
     );
-    GDRA ad = adpr.get_field_accessor(0).typeify<double>();
+    GTRA ad = adpr.get_field_accessor(0).template typeify<T>();
     const Domain aDiagDom = lrt->get_index_space_domain(
         ctx, task->regions[aDiagRID].region.get_index_space()
     );
     GLRA ai = aipr.get_field_accessor(0).typeify<int64_t>();
     GSRA az = azpr.get_field_accessor(0).typeify<uint8_t>();
     // vectors
-    GDRA xrw = xrwpr.get_field_accessor(0).typeify<double>();
-    const Domain xRWDom = lrt->get_index_space_domain(
-        ctx, task->regions[xRWRID].region.get_index_space()
-    );
     GDRA x = xpr.get_field_accessor(0).typeify<double>();
     const Domain xDom = lrt->get_index_space_domain(
         ctx, task->regions[xRID].region.get_index_space()
@@ -192,90 +201,65 @@ symgsTask(const LegionRuntime::HighLevel::Task *task,
     // calculate nRows and nCols for the local subgrid
     Rect<1> myGridBounds = aValsDom.get_rect<1>();
     assert(0 == myGridBounds.volume() % nMatCols);
-    const int64_t lNRows = myGridBounds.volume() / nMatCols;
     const int64_t lNCols = nMatCols;
     //
-    Rect<1> avsr; ByteOffset avOff[1];
-    const double *const avp = av.raw_rect_ptr<1>(myGridBounds, avsr, avOff);
-    bool offd = offsetsAreDense<1, double>(myGridBounds, avOff);
-    assert(offd);
+    const T *const avp = densePtr(av, myGridBounds);
+    assert(avp);
     // remember that vals and mIdxs should be the same size
-    Rect<1> aisr; ByteOffset aiOff[1];
-    const int64_t *const aip = ai.raw_rect_ptr<1>(myGridBounds, aisr, aiOff);
-    offd = offsetsAreDense<1, int64_t>(myGridBounds, aiOff);
-    assert(offd);
+    const int64_t *const aip = densePtr(ai, myGridBounds);
+    assert(aip);
     // diag and nzir are smaller (by a stencil size factor).
-    Rect<1> adsr; ByteOffset adOff[1];
     myGridBounds = aDiagDom.get_rect<1>();
-    const double *const adp = ad.raw_rect_ptr<1>(myGridBounds, adsr, adOff);
-    offd = offsetsAreDense<1, double>(myGridBounds, adOff);
-    assert(offd);
+    const T *const adp = densePtr(ad, myGridBounds);
+    assert(adp);
     // remember nzir and diag are the same length
-    Rect<1> azsr; ByteOffset azOff[1];
-    const uint8_t *const azp = az.raw_rect_ptr<1>(myGridBounds, azsr, azOff);
-    offd = offsetsAreDense<1, uint8_t>(myGridBounds, adOff);
-    assert(offd);
-    // x - read/write
-    myGridBounds = xRWDom.get_rect<1>();
-    Rect<1> xrwsr; ByteOffset xrwOff[1];
-    double *xrwp = xrw.raw_rect_ptr<1>(myGridBounds, xrwsr, xrwOff);
-    offd = offsetsAreDense<1, double>(myGridBounds, xrwOff);
-    assert(offd);
-    // x (all of X)
-    Rect<1> xsr; ByteOffset xOff[1];
-    myGridBounds = xDom.get_rect<1>();
-    const double *const xp = x.raw_rect_ptr<1>(myGridBounds, xsr, xOff);
-    offd = offsetsAreDense<1, double>(myGridBounds, xOff);
-    assert(offd);
+    const uint8_t *const azp = densePtr(az, myGridBounds);
+    assert(azp);
+    // x (our cells and the ghosts), starting at "real" index xLo
+    const Rect<1> xRect = xDom.get_rect<1>();
+    const int64_t xLo = xRect.lo[0];
+    double *const xp = densePtr(x, xRect);
+    assert(xp);
     // r
-    Rect<1> rsr; ByteOffset rOff[1];
-    myGridBounds = rDom.get_rect<1>();
-    const double *const rp = r.raw_rect_ptr<1>(myGridBounds, rsr, rOff);
-    offd = offsetsAreDense<1, double>(myGridBounds, rOff);
-    assert(offd);
-    // now, actually perform the computation
-    // forward sweep
-    if (0 == args.sweepi) {
-        for (int64_t i = 0; i < lNRows; ++i) {
-            // get to base of next row of values
-            const double *const cVals = (avp + (i * lNCols));
-            // get to base of next row of "real" indices of values
-            const int64_t *const cIndx = (aip + (i * lNCols));
-            // capture how many non-zero values are in this particular row
-            const int64_t cnnz = azp[i];
-            // current diagonal value
-            const double curDiag = adp[i];
-            // RHS value
-            double sum = rp[i];
-            for (int64_t j = 0; j < cnnz; ++j) {
-                const int64_t curCol = cIndx[j];
-                sum -= cVals[j] * xp[curCol];
-            }
-            // remove diagonal contribution from previous loop
-            sum += xrwp[i] * curDiag;
-            xrwp[i] = sum / curDiag;
-        }
-    }
-    else {
-        // back sweep
-        for (int64_t i = lNRows - 1; i >= 0; --i) {
-            // get to base of next row of values
-            const double *const cVals = (avp + (i * lNCols));
-            // get to base of next row of "real" indices of values
-            const int64_t *const cIndx = (aip + (i * lNCols));
-            // capture how many non-zero values are in this particular row
-            const int64_t cnnz = azp[i];
-            // current diagonal value
-            const double curDiag = adp[i];
-            // RHS value
-            double sum = rp[i]; // RHS value
-            for (int64_t j = 0; j < cnnz; ++j) {
-                const int64_t curCol = cIndx[j];
-                sum -= cVals[j] * xp[curCol];
+    const Rect<1> rRect = rDom.get_rect<1>();
+    const double *const rp = densePtr(r, rRect);
+    assert(rp);
+    // our rows of x start where our rows of r do
+    double *const xrwp = xp + (rRect.lo[0] - xLo);
+    // where our subgrid sits in the processor grid
+    const int64_t taskID = getTaskID(task);
+    const int64_t nx = args.nx, ny = args.ny, nz = args.nz;
+    const int64_t ipz = taskID / (args.npx * args.npy);
+    const int64_t ipy = (taskID - ipz * args.npx * args.npy) / args.npx;
+    const int64_t ipx = taskID % args.npx;
+    // first local coordinate of each dimension that has our color's parity
+    const int64_t ix0 = ((args.color & 1) ^ (ipx * nx)) & 1;
+    const int64_t iy0 = (((args.color >> 1) & 1) ^ (ipy * ny)) & 1;
+    const int64_t iz0 = (((args.color >> 2) & 1) ^ (ipz * nz)) & 1;
+    // now, actually perform the computation. the rows of a color do not
+    // depend on each other, so the order they go in does not matter.
+    for (int64_t iz = iz0; iz < nz; iz += 2) {
+        for (int64_t iy = iy0; iy < ny; iy += 2) {
+            for (int64_t ix = ix0; ix < nx; ix += 2) {
+                const int64_t i = iz * nx * ny + iy * nx + ix;
+                // get to base of next row of values
+                const T *const cVals = (avp + (i * lNCols));
+                // get to base of next row of "real" indices of values
+                const int64_t *const cIndx = (aip + (i * lNCols));
+                // capture how many non-zero values are in this particular row
+                const int64_t cnnz = azp[i];
+                // current diagonal value
+                const double curDiag = adp[i];
+                // RHS value
+                double sum = rp[i];
+                for (int64_t j = 0; j < cnnz; ++j) {
+                    const int64_t curCol = cIndx[j];
+                    sum -= cVals[j] * xp[curCol - xLo];
+                }
+                // remove diagonal contribution from previous loop
+                sum += xrwp[i] * curDiag;
+                xrwp[i] = sum / curDiag;
             }
-            // remove diagonal contribution from previous loop
-            sum += xrwp[i] * curDiag;
-            xrwp[i] = sum / curDiag;
         }
     }
 }
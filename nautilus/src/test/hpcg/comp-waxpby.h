@@ -39,8 +39,6 @@
 
 namespace {
 
-#define LGNCG_DENSE_WAXPBY_STRIP_SIZE 256
-
 #define GDRA LegionRuntime::Accessor::RegionAccessor \
     <LegionRuntime::Accessor::AccessorType::Generic, double>
 
@@ -74,37 +72,16 @@ denseWAXPBY(const Rect<1> &subgridBounds,
     using namespace LegionRuntime::HighLevel;
     using namespace LegionRuntime::Accessor;
 
-    Rect<1> subrect;
-    ByteOffset inOffsets[1], offsets[1], woffsets[1];
-    //
-    const double *xp = fax.raw_rect_ptr<1>(subgridBounds, subrect, inOffsets);
-    if (!xp || (subrect != subgridBounds) ||
-        !offsetsAreDense<1, double>(subgridBounds, inOffsets)) return false;
-    //
-    double *yp = fay.raw_rect_ptr<1>(subgridBounds, subrect, offsets);
-    if (!yp || (subrect != subgridBounds) ||
-        offsetMismatch(1, inOffsets, offsets)) return false;
-    //
-    double *wp = faw.raw_rect_ptr<1>(subgridBounds, subrect, woffsets);
-    if (!wp || (subrect != subgridBounds) ||
-        !offsetsAreDense<1, double>(subgridBounds, woffsets)) return false;
-
-    int npts = subgridBounds.volume();
-    while (npts > 0) {
-        if (npts >= LGNCG_DENSE_WAXPBY_STRIP_SIZE) {
-            for (int i = 0; i < LGNCG_DENSE_WAXPBY_STRIP_SIZE; i++) {
-                wp[i] = (alpha * xp[i]) + (beta * yp[i]);
-            }
-            npts -= LGNCG_DENSE_WAXPBY_STRIP_SIZE;
-            xp   += LGNCG_DENSE_WAXPBY_STRIP_SIZE;
-            yp   += LGNCG_DENSE_WAXPBY_STRIP_SIZE;
-            wp   += LGNCG_DENSE_WAXPBY_STRIP_SIZE;
-        } else {
-            for (int i = 0; i < npts; i++) {
-                wp[i] = (alpha * xp[i]) + (beta * yp[i]);
-            }
-            npts = 0;
-        }
+    const double *xp = densePtr(fax, subgridBounds);
+    if (!xp) return false;
+    const double *yp = densePtr(fay, subgridBounds);
+    if (!yp) return false;
+    double *wp = densePtr(faw, subgridBounds);
+    if (!wp) return false;
+
+    const int64_t npts = subgridBounds.volume();
+    for (int64_t i = 0; i < npts; i++) {
+        wp[i] = (alpha * xp[i]) + (beta * yp[i]);
     }
     return true;
 }
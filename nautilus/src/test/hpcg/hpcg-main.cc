@@ -66,6 +66,10 @@ struct DriverParams {
     double tolerance;
     // flag indicating whether or not we are going to use a preconditioner
     bool doPreconditioning;
+    // flag indicating whether the preconditioner uses single precision
+    bool mixedPrecision;
+    // flag indicating whether SpMV uses a SELL-C-sigma copy of the matrix
+    bool useSELL;
     // approximating a 27-point finite element/volume/difference 3D stencil
     static const int64_t stencilSize = 27;
     /**
@@ -86,6 +90,8 @@ struct DriverParams {
         nMGLevels = 4;
         tolerance = 0.001;
         doPreconditioning = true;
+        mixedPrecision = false;
+        useSELL = false;
     }
 };
 
@@ -129,11 +135,17 @@ getParamsFromArgs(DriverParams &params)
         if (!strcmp(cArgs.argv[i], "-no-precond")) {
             params.doPreconditioning = false;
         }
+        if (!strcmp(cArgs.argv[i], "-mixed")) {
+            params.mixedPrecision = true;
+        }
+        if (!strcmp(cArgs.argv[i], "-sell")) {
+            params.useSELL = true;
+        }
         if (!strcmp(cArgs.argv[i], "-h") || !strcmp(cArgs.argv[i], "-help")) {
             std::cout << "usage: " << DRIVER_NAME
                       << " [-npx X] [-npy Y] [-npz Z] [-nx X] [-ny Y] [-nz Z]"
                          " [-i MAX_ITERS] [-s N_SUBR] [-nmg N_MGL]"
-                         " [-no-precond] [-h | --help]"
+                         " [-no-precond] [-mixed] [-sell] [-h | --help]"
                       << std::endl;
             exit(EXIT_SUCCESS);
         }
@@ -277,7 +289,7 @@ mainTask(const lrthl::Task *task,
                         params.nx,  params.ny,  params.nz);
     // now construct the problem
     Problem problem(globalGeom, params.stencilSize, params.doPreconditioning,
-                    params.nMGLevels, params.nSubRgns, ctx, lrt);
+                    params.useSELL, params.nMGLevels, params.nSubRgns, ctx, lrt);
     // now that we have all problem-related info, let the user know the setup
     echoBanner(params);
     // sets initial conditions for all grid levels
@@ -295,6 +307,7 @@ mainTask(const lrthl::Task *task,
                   params.maxIters,
                   problem.x,
                   params.doPreconditioning,
+                  params.mixedPrecision,
                   ctx,
                   lrt);
     //double stop = LegionRuntime::TimeStamp::get_current_time_in_micros();
@@ -50,138 +50,147 @@
 #include <cstdlib>
 #include <set>
 
-////////////////////////////////////////////////////////////////////////////////
-// TODO
-// pass raw pointers to this routine to keep memory usage down
-////////////////////////////////////////////////////////////////////////////////
+/**
+ * where a task's rows go. row i's maxNon0sInCol values and column indices
+ * start at vals and mIdxs + i * maxNon0sInCol, everything else has one
+ * entry per row. b may be NULL.
+ */
+struct ProblemRows {
+    double *vals;
+    int64_t *mIdxs;
+    double *diag;
+    uint8_t *non0sInRow;
+    lgncg::I64Tuple *g2g;
+    double *b;
+};
+
+/**
+ * akin to HPCG's GenerateProblem. writes taskID's rows straight into out,
+ * which can be the task's own region instances, and returns how many
+ * non-zeros they hold.
+ */
+static inline int64_t
+generateProblem(const lgncg::Geometry &geom,
+                int64_t maxNon0sInCol,
+                int taskID,
+                const ProblemRows &out)
+{
+    const int64_t nx  = geom.nx;
+    const int64_t ny  = geom.ny;
+    const int64_t nz  = geom.nz;
+    const int64_t npx = geom.npx;
+    const int64_t npy = geom.npy;
+    const int64_t npz = geom.npz;
+    //current task's z location in the npx by npy by npz processor grid
+    const int64_t ipz = taskID / (npx * npy);
+    //current task's y location in the npx by npy by npz processor grid
+    const int64_t ipy = (taskID - ipz * npx * npy) / npx;
+    //current task's x location in the npx by npy by npz processor grid
+    const int64_t ipx = taskID % npx;
+    // global geometry
+    const int64_t gnx = npx * nx;
+    const int64_t gny = npy * ny;
+    const int64_t gnz = npz * nz;
+    // number of local rows for this task
+    const int64_t nLocalRows = nx * ny * nz;
+    // where our rows start in the global vectors
+    const int64_t rowOffset = taskID * nLocalRows;
+    // max stencilSize for number of non-zeros per row
+    const int64_t nNon0sPerRow = maxNon0sInCol;
+    // rows with fewer neighbors are padded with zeros
+    (void)memset(out.vals, 0, nLocalRows * nNon0sPerRow * sizeof(double));
+    int64_t locNNon0s = 0;
+    for (int64_t iz = 0; iz < nz; iz++) {
+        int64_t giz = ipz * nz + iz;
+        for (int64_t iy = 0; iy < ny; iy++) {
+            int64_t giy = ipy * ny + iy;
+            for (int64_t ix = 0; ix < nx; ix++) {
+                int64_t gix = ipx * nx + ix;
+                // current local row
+                int64_t curLocRow = iz * nx * ny + iy * nx + ix;
+                int64_t curGlobRow = giz * gnx * gny + giy * gnx + gix;
+                // we'll setup the g2l map later in halo setup
+                out.g2g[curLocRow] = lgncg::I64Tuple(rowOffset + curLocRow,
+                                                     curGlobRow);
+                char nNon0sInRow = 0;
+                // pointer to current value in current row
+                double *curValPtr = out.vals + curLocRow * nNon0sPerRow;
+                // pointer to current index in current row
+                int64_t *currentIndexPointerG =
+                    out.mIdxs + curLocRow * nNon0sPerRow;
+                for (int64_t sz = -1; sz <= 1; sz++) {
+                    if (giz + sz > -1 && giz + sz < gnz) {
+                        for (int64_t sy = -1; sy <= 1; sy++) {
+                            if (giy + sy > -1 && giy + sy < gny) {
+                                for (int64_t sx = -1; sx <= 1; sx++) {
+                                    if (gix + sx > -1 && gix + sx < gnx) {
+                                        int64_t curcol = curGlobRow + sz *
+                                                         gnx * gny + sy *
+                                                         gnx + sx;
+                                        if (curcol == curGlobRow) {
+                                            out.diag[curLocRow] = 26.0;
+                                            *curValPtr++ = 26.0;
+                                        }
+                                        else {
+                                            *curValPtr++ = -1.0;
+                                        }
+                                        *currentIndexPointerG++ = curcol;
+                                        nNon0sInRow++;
+                                    } // end x bounds test
+                                } // end sx loop
+                            } // end y bounds test
+                        } // end sy loop
+                    } // end z bounds test
+                } // end sz loop
+                // padding points at our own cell, which every task that
+                // reads this row has
+                for (int64_t j = nNon0sInRow; j < nNon0sPerRow; ++j) {
+                    *currentIndexPointerG++ = curGlobRow;
+                }
+                out.non0sInRow[curLocRow] = nNon0sInRow;
+                locNNon0s += nNon0sInRow;
+                if (out.b) {
+                    out.b[curLocRow] = 26.0 - (double)(nNon0sInRow - 1);
+                }
+            } // end ix loop
+        } // end iy loop
+    } // end iz loop
+    return locNNon0s;
+}
 
+/**
+ * holds a task's rows when its region instances can't be written through
+ * raw pointers.
+ */
 struct ProblemGenerator {
-    // here for destructor
     int64_t nLocalRows;
-    // sparse matrix stuff
-    double **A;
-    uint8_t *non0sInRow;
-    int64_t **mtxInd;
-    double  **matDiag;
-    int64_t *l2gTab;
-    // b vector stuff
-    double *b;
+    ProblemRows rows;
     // total number of non-zeros
     int64_t tNon0s;
-    /**
-     * akin to HPCG's GenerateProblem
-     */
+
     ProblemGenerator(const lgncg::Geometry &geom,
                      int64_t maxNon0sInCol,
                      int taskID)
     {
-        using lgncg::Geometry;
-
-        const int64_t nx  = geom.nx;
-        const int64_t ny  = geom.ny;
-        const int64_t nz  = geom.nz;
-        const int64_t npx = geom.npx;
-        const int64_t npy = geom.npy;
-        const int64_t npz = geom.npz;
-        //current task's z location in the npx by npy by npz processor grid
-        const int64_t ipz = taskID / (npx * npy);
-        //current task's y location in the npx by npy by npz processor grid
-        const int64_t ipy = (taskID - ipz * npx * npy) / npx;
-        //current task's x location in the npx by npy by npz processor grid
-        const int64_t ipx = taskID % npx;
-        // global geometry
-        const int64_t gnx = npx * nx;
-        const int64_t gny = npy * ny;
-        const int64_t gnz = npz * nz;
-        // number of local rows for this task
-        this->nLocalRows = nx * ny * nz;
-        // stencil size
-        const int64_t stencilSize = maxNon0sInCol;
-        // max stencilSize for number of non-zeros per row
-        const int64_t nNon0sPerRow = stencilSize;
-        // allocate arrays that are of length nLocalRows
-        non0sInRow = new uint8_t[nLocalRows];
-        mtxInd = new int64_t *[nLocalRows];
-        A = new double *[nLocalRows];
-        matDiag = new double *[nLocalRows];
-        b = new double[nLocalRows];
-        l2gTab = new int64_t[nLocalRows];
-        // NULLify some things
-        for (int64_t i = 0; i < nLocalRows; ++i) {
-            A[i] = NULL;
-            matDiag[i] = NULL;
-            mtxInd[i] = NULL;
-        }
-        // now allocate the arrays pointed to
-        for (int64_t i = 0; i < nLocalRows; ++i) {
-            A[i] = new double[nNon0sPerRow];
-            (void)memset(A[i], 0, nNon0sPerRow * sizeof(double));
-            mtxInd[i] = new int64_t[nNon0sPerRow];
-            (void)memset(mtxInd[i], 0, nNon0sPerRow * sizeof(double));
-        }
-        int64_t locNNon0s = 0;
-        for (int64_t iz = 0; iz < nz; iz++) {
-            int64_t giz = ipz * nz + iz;
-            for (int64_t iy = 0; iy < ny; iy++) {
-                int64_t giy = ipy * ny + iy;
-                for (int64_t ix = 0; ix < nx; ix++) {
-                    int64_t gix = ipx * nx + ix;
-                    // current local row
-                    int64_t curLocRow = iz * nx * ny + iy * nx + ix;
-                    int64_t curGlobRow = giz * gnx * gny + giy * gnx + gix;
-                    l2gTab[curLocRow] = curGlobRow;
-                    // we'll setup the g2l map later in halo setup
-                    char nNon0sInRow = 0;
-                    // pointer to current value in current row
-                    double *curValPtr = A[curLocRow];
-                    // pointer to current index in current row
-                    int64_t *currentIndexPointerG = mtxInd[curLocRow];
-                    for (int64_t sz = -1; sz <= 1; sz++) {
-                        if (giz + sz > -1 && giz + sz < gnz) {
-                            for (int64_t sy = -1; sy <= 1; sy++) {
-                                if (giy + sy > -1 && giy + sy < gny) {
-                                    for (int64_t sx = -1; sx <= 1; sx++) {
-                                        if (gix + sx > -1 && gix + sx < gnx) {
-                                            int64_t curcol = curGlobRow + sz *
-                                                             gnx * gny + sy *
-                                                             gnx + sx;
-                                            if (curcol == curGlobRow) {
-                                                matDiag[curLocRow] = curValPtr;
-                                                *curValPtr++ = 26.0;
-                                            }
-                                            else {
-                                                *curValPtr++ = -1.0;
-                                            }
-                                            *currentIndexPointerG++ = curcol;
-                                            nNon0sInRow++;
-                                        } // end x bounds test
-                                    } // end sx loop
-                                } // end y bounds test
-                            } // end sy loop
-                        } // end z bounds test
-                    } // end sz loop
-                    tNon0s += nNon0sInRow;
-                    non0sInRow[curLocRow] = nNon0sInRow;
-                    locNNon0s += nNon0sInRow;
-                    b[curLocRow] = 26.0 - (double)(nNon0sInRow - 1);
-                } // end ix loop
-            } // end iy loop
-        } // end iz loop
+        nLocalRows = geom.nx * geom.ny * geom.nz;
+        rows.vals = new double[nLocalRows * maxNon0sInCol];
+        rows.mIdxs = new int64_t[nLocalRows * maxNon0sInCol];
+        rows.diag = new double[nLocalRows];
+        rows.non0sInRow = new uint8_t[nLocalRows];
+        rows.g2g = new lgncg::I64Tuple[nLocalRows];
+        rows.b = new double[nLocalRows];
+        tNon0s = generateProblem(geom, maxNon0sInCol, taskID, rows);
     }
     /**
      * destructor
      */
     ~ProblemGenerator(void) {
-        delete[] non0sInRow;
-        delete[] b;
-        for (int64_t i = 0; i < nLocalRows; ++i) {
-            delete[] A[i];
-            delete[] mtxInd[i];
-        }
-        delete[] A;
-        delete[] mtxInd;
-        delete[] matDiag;
-        delete[] l2gTab;
+        delete[] rows.vals;
+        delete[] rows.mIdxs;
+        delete[] rows.diag;
+        delete[] rows.non0sInRow;
+        delete[] rows.g2g;
+        delete[] rows.b;
     }
 private:
     ProblemGenerator(void);
@@ -209,39 +209,67 @@ setICsTask(
         ctx, task->regions[aG2GRID].region.get_index_space()
     );
     Rect<1> aG2GRect = aG2GDom.get_rect<1>();
-    ////////////////////////////////////////////////////////////////////////////
-    // all problem setup logic in the ProblemGenerator /////////////////////////
-    ////////////////////////////////////////////////////////////////////////////
-    // construct new initial conditions for this sub-region
-    ProblemGenerator ic(targs.geom, targs.maxColNonZeros, taskID);
-    // setup to avoid memory bloat during init
-    // the bounds of all entries
     typedef GenericPointInRectIterator<1> GPRI1D;
     typedef DomainPoint DomPt;
-    do {
+    ////////////////////////////////////////////////////////////////////////////
+    // Vector b
+    ////////////////////////////////////////////////////////////////////////////
+    GDRA b;
+    Rect<1> bRect;
+    if (haveB) {
+        const PhysicalRegion &vecBPr = rgns[bRID];
+        b = vecBPr.get_field_accessor(0).typeify<double>();
+        const Domain bDom = lrt->get_index_space_domain(
+            ctx, task->regions[bRID].region.get_index_space()
+        );
+        bRect = bDom.get_rect<1>();
+    }
+    ////////////////////////////////////////////////////////////////////////////
+    // all problem setup logic in generateProblem //////////////////////////////
+    ////////////////////////////////////////////////////////////////////////////
+    // if all of our instances are dense, generate the rows right where they
+    // go. this runs on the processor the instances were mapped next to, so
+    // it is also what first touches them.
+    ProblemRows rows;
+    rows.vals = densePtr(av, aValsRect);
+    rows.mIdxs = densePtr(ai, aValsRect);
+    rows.diag = densePtr(ad, aDiagRect);
+    rows.non0sInRow = densePtr(az, aDiagRect);
+    rows.g2g = densePtr(at, aG2GRect);
+    rows.b = haveB ? densePtr(b, bRect) : NULL;
+    if (rows.vals && rows.mIdxs && rows.diag && rows.non0sInRow &&
+        rows.g2g && (!haveB || rows.b)) {
+        (void)generateProblem(targs.geom, targs.maxColNonZeros, taskID, rows);
+    }
+    else {
+        // construct new initial conditions for this sub-region and copy
+        // them in element by element
+        ProblemGenerator ic(targs.geom, targs.maxColNonZeros, taskID);
         const int64_t nLocalCols = targs.maxColNonZeros;
         const int64_t nLocalRows = aDiagRect.volume();
         GPRI1D p(aValsRect);
         GPRI1D q(aDiagRect);
         for (int64_t i = 0; i < nLocalRows; ++i, q++) {
             for (int64_t j = 0; j < nLocalCols; ++j, p++) {
-                av.write(DomPt::from_point<1>(p.p), ic.A[i][j]);
-                ai.write(DomPt::from_point<1>(p.p), ic.mtxInd[i][j]);
+                av.write(DomPt::from_point<1>(p.p),
+                         ic.rows.vals[i * nLocalCols + j]);
+                ai.write(DomPt::from_point<1>(p.p),
+                         ic.rows.mIdxs[i * nLocalCols + j]);
             }
-            // SKG - i'm a little confused by why matDiag is not just an array
-            ad.write(DomPt::from_point<1>(q.p), ic.matDiag[i][0]);
-            az.write(DomPt::from_point<1>(q.p), ic.non0sInRow[i]);
+            ad.write(DomPt::from_point<1>(q.p), ic.rows.diag[i]);
+            az.write(DomPt::from_point<1>(q.p), ic.rows.non0sInRow[i]);
         }
-    } while(0);
-    // Populate g2g
-    do {
-        const int64_t offset = taskID * aG2GRect.volume();
         int64_t row = 0;
-        for (GPRI1D p(aG2GRect); p; p++, row++) {
-            at.write(DomPt::from_point<1>(p.p),
-                     I64Tuple(offset + row, ic.l2gTab[row]));
+        for (GPRI1D g(aG2GRect); g; g++, row++) {
+            at.write(DomPt::from_point<1>(g.p), ic.rows.g2g[row]);
         }
-    } while(0);
+        if (haveB) {
+            GPRI1D r(bRect);
+            for (int64_t i = 0; r; ++i, r++) {
+                b.write(DomPt::from_point<1>(r.p), ic.rows.b[i]);
+            }
+        }
+    }
     if (haveX) {
         ////////////////////////////////////////////////////////////////////////
         // Vector x - initial guess of all zeros
@@ -252,23 +280,14 @@ setICsTask(
             ctx, task->regions[xRID].region.get_index_space()
         );
         Rect<1> xRect = xDom.get_rect<1>();
-        for (GPRI1D p(xRect); p; p++) {
-            x.write(DomPt::from_point<1>(p.p), 0.0);
+        double *xp = densePtr(x, xRect);
+        if (xp) {
+            (void)memset(xp, 0, xRect.volume() * sizeof(double));
         }
-    }
-    if (haveB) {
-        ////////////////////////////////////////////////////////////////////////
-        // Vector b
-        ////////////////////////////////////////////////////////////////////////
-        const PhysicalRegion &vecBPr = rgns[bRID];
-        GDRA b = vecBPr.get_field_accessor(0).typeify<double>();
-        const Domain bDom = lrt->get_index_space_domain(
-            ctx, task->regions[bRID].region.get_index_space()
-        );
-        Rect<1> bRect = bDom.get_rect<1>();
-        GPRI1D p(bRect);
-        for (int64_t i = 0; p; ++i, p++) {
-            b.write(DomPt::from_point<1>(p.p), ic.b[i]);
+        else {
+            for (GPRI1D p(xRect); p; p++) {
+                x.write(DomPt::from_point<1>(p.p), 0.0);
+            }
         }
     }
 }
@@ -53,6 +53,8 @@ struct Problem {
     static int populatef2cTID;
     // boolean indicating whether or not we are doing MG
     bool doMG;
+    // whether SpMV on the fine matrix uses a SELL-C-sigma copy of it
+    bool useSELL;
     // number of mg levels
     int64_t nmgl;
     /**
@@ -66,6 +68,7 @@ struct Problem {
     Problem(const lgncg::Geometry &geom,
             int64_t stencilSize,
             bool doMG,
+            bool useSELL,
             int64_t numMGLevels,
             int64_t nSubRgns,
             LegionRuntime::HighLevel::Context &ctx,
@@ -73,6 +76,7 @@ struct Problem {
     {
         this->nmgl = numMGLevels;
         this->doMG = doMG;
+        this->useSELL = useSELL;
         const int64_t globalXYZ = geom.npx * geom.nx *
                                   geom.npy * geom.ny * 
                                   geom.npz * geom.nz;
@@ -113,6 +117,8 @@ struct Problem {
         setICs(A, &x, &b, ctx, lrt);
         // now setup the halo
         setupHalo(A, ctx, lrt);
+        // the coarse levels only see SymGS and restriction, leave them be
+        if (useSELL) lgncg::sellPrep(A, ctx, lrt);
         // if we are doing MG, then set that up
         if (doMG) {
             // geometry at finest level already setup, so just generate the rest
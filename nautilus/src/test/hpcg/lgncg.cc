@@ -55,11 +55,12 @@ cgSolv(SparseMatrix &A,
        int64_t maxIters,
        Vector &x,
        bool doPreconditioning,
+       bool mixedPrecision,
        LegionRuntime::HighLevel::Context ctx,
        LegionRuntime::HighLevel::HighLevelRuntime *lrt)
 {
     lgncg::cg::solv(A, b, tolerance, maxIters, x,
-                    doPreconditioning, ctx, lrt);
+                    doPreconditioning, mixedPrecision, ctx, lrt);
 }
 
 std::ostream &
@@ -34,6 +34,7 @@
 #include "vector.h"
 #include "sparsemat.h"
 #include "setup-halo.h"
+#include "sell.h"
 
 #include "../../legion_runtime/legion.h"
 
@@ -55,6 +56,7 @@ cgSolv(SparseMatrix &A,
        int64_t maxIters,
        Vector &x,
        bool doPreconditioning,
+       bool mixedPrecision,
        LegionRuntime::HighLevel::Context ctx,
        LegionRuntime::HighLevel::HighLevelRuntime *lrt);
 
@@ -54,10 +54,6 @@ struct MGData {
     // stencil size)). since we are dealing with square matrices, then that
     // corresponds to the coarse number of rows. so, cnx * cny * cnz
     Vector xc;
-    // fine grid residual vector
-    // length: fnx * fny * fnz (see: comments about xc -- similar thing here,
-    // but for the fine grid matrix).
-    Vector Axf;
 
     MGData(void)
     {
@@ -75,8 +71,6 @@ struct MGData {
         // XXX - in HPCG the length of f2cOp is nFineRows, but I don't think
         // that's needed -- at least based on how it's used in this code.
         f2cOp.create<int64_t>(nCoarseRows, ctx, lrt);
-        // about the size here: read comment above.
-        Axf.create<double>(nFineRows, ctx, lrt);
         rc.create<double>(nCoarseRows, ctx, lrt);
         // about the size here: read comment above.
         xc.create<double>(nCoarseRows, ctx, lrt);
@@ -89,7 +83,6 @@ struct MGData {
         f2cOp.free(ctx, lrt);
         rc.free(ctx, lrt);
         xc.free(ctx, lrt);
-        Axf.free(ctx, lrt);
     }
 
     void
@@ -100,7 +93,6 @@ struct MGData {
         f2cOp.partition(nParts, ctx, lrt);
         rc.partition(nParts, ctx, lrt);
         xc.partition(nParts, ctx, lrt);
-        Axf.partition(nParts, ctx, lrt);
     }
 };
 
@@ -0,0 +1,436 @@
+/**
+ * Copyright (c) 2014      Los Alamos National Security, LLC
+ *                         All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * LA-CC 10-123
+ */
+
+#ifndef LGNCG_SELL_H_INCLUDED
+#define LGNCG_SELL_H_INCLUDED
+
+#include "tids.h"
+#include "vector.h"
+#include "sparsemat.h"
+#include "utils.h"
+
+#include "legion.h"
+
+#include <nautilus/fpu.h>
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+/**
+ * an optional SELL-C-sigma copy of a matrix for SpMV. each subgrid's rows
+ * are sorted by length within windows of SELL_SIGMA rows, then cut into
+ * chunks of SELL_C rows. a chunk is as wide as its longest row and stored
+ * column by column, so one vector register holds the same entry of C
+ * rows: the loads of the values and column indices are contiguous and x
+ * is gathered. the row-major layout in vals and mIdxs stays, SymGS and
+ * restriction walk rows one at a time and keep using it.
+ */
+
+namespace lgncg {
+
+// rows per chunk, one AVX-512 register of doubles
+static const int64_t SELL_C = 8;
+// rows sorted together, a multiple of SELL_C
+static const int64_t SELL_SIGMA = 4 * SELL_C;
+
+static inline int64_t
+sellNChunks(int64_t nLocalRows)
+{
+    return (nLocalRows + SELL_C - 1) / SELL_C;
+}
+
+/**
+ * whether the gather kernel can run here, asked once
+ */
+static inline bool
+sellHaveAVX512(void)
+{
+    static int have = -1;
+    if (have < 0) {
+        unsigned a, b, c, d;
+        // SSE, AVX and all of the AVX-512 state enabled in XCR0
+        static const uint64_t xcr0AVX512 = 0xe6;
+        have = 0;
+        __cpuid(1, a, b, c, d);
+        if ((c & bit_OSXSAVE) &&
+            (nk_fpu_xcr0() & xcr0AVX512) == xcr0AVX512) {
+            __cpuid_count(7, 0, a, b, c, d);
+            have = (b & bit_AVX512F) ? 1 : 0;
+        }
+    }
+    return have == 1;
+}
+
+} // end lgncg namespace
+
+namespace {
+
+/**
+ * y = A * x over a subgrid's chunks, returns x' * y if DOT. x starts at
+ * "real" index xLo, row r of y is element yLo + r of x.
+ */
+template <bool DOT>
+static inline double
+sellRows(int64_t nRows,
+         const lgncg::I64Tuple *chunks,
+         const int64_t *rows,
+         const double *valp,
+         const int64_t *colp,
+         const double *xp,
+         int64_t xLo,
+         int64_t yLo,
+         double *yp)
+{
+    using lgncg::SELL_C;
+    const double *xown = xp + (yLo - xLo);
+    lgncg::KahanSum dot;
+    const int64_t nChunks = lgncg::sellNChunks(nRows);
+    for (int64_t c = 0; c < nChunks; ++c) {
+        const int64_t off = chunks[c].a;
+        const int64_t w = chunks[c].b;
+        const int64_t lanes = (nRows - c * SELL_C < SELL_C) ?
+                              nRows - c * SELL_C : SELL_C;
+        double sum[SELL_C] = { 0.0 };
+        for (int64_t j = 0; j < w; ++j) {
+            const double *v = valp + off + j * lanes;
+            const int64_t *col = colp + off + j * lanes;
+            for (int64_t l = 0; l < lanes; ++l) {
+                sum[l] += v[l] * xp[col[l] - xLo];
+            }
+        }
+        for (int64_t l = 0; l < lanes; ++l) {
+            const int64_t r = rows[c * SELL_C + l];
+            yp[r] = sum[l];
+            if (DOT) dot.add(xown[r] * sum[l]);
+        }
+    }
+    return dot.value();
+}
+
+/**
+ * sellRows with AVX-512 for the full chunks.
+ */
+template <bool DOT>
+__attribute__((target("avx512f")))
+static double
+sellRowsAVX512(int64_t nRows,
+               const lgncg::I64Tuple *chunks,
+               const int64_t *rows,
+               const double *valp,
+               const int64_t *colp,
+               const double *xp,
+               int64_t xLo,
+               int64_t yLo,
+               double *yp)
+{
+    using lgncg::SELL_C;
+    const double *xown = xp + (yLo - xLo);
+    lgncg::KahanSum dot;
+    const int64_t nFull = nRows / SELL_C;
+    const __m512i xLoV = _mm512_set1_epi64(xLo);
+    for (int64_t c = 0; c < nFull; ++c) {
+        const int64_t off = chunks[c].a;
+        const int64_t w = chunks[c].b;
+        __m512d acc = _mm512_setzero_pd();
+        for (int64_t j = 0; j < w; ++j) {
+            const __m512d v = _mm512_loadu_pd(valp + off + j * SELL_C);
+            const __m512i col = _mm512_sub_epi64(
+                _mm512_loadu_si512((const void *)(colp + off + j * SELL_C)),
+                xLoV
+            );
+            acc = _mm512_fmadd_pd(v, _mm512_i64gather_pd(col, xp, 8), acc);
+        }
+        double sum[SELL_C];
+        _mm512_storeu_pd(sum, acc);
+        for (int64_t l = 0; l < SELL_C; ++l) {
+            const int64_t r = rows[c * SELL_C + l];
+            yp[r] = sum[l];
+            if (DOT) dot.add(xown[r] * sum[l]);
+        }
+    }
+    // the short chunk at the end, if there is one
+    if (nFull * SELL_C < nRows) {
+        const int64_t done = nFull * SELL_C;
+        const double rest = sellRows<DOT>(nRows - done, chunks + nFull,
+                                          rows + done, valp, colp,
+                                          xp, xLo, yLo, yp);
+        if (DOT) dot.add(rest);
+    }
+    return dot.value();
+}
+
+/**
+ * the common part of the SELL SpMV tasks
+ */
+template <bool DOT>
+static inline double
+sellSPMVTask(const LegionRuntime::HighLevel::Task *task,
+             const std::vector<LegionRuntime::HighLevel::PhysicalRegion> &rgns,
+             LegionRuntime::HighLevel::Context ctx,
+             LegionRuntime::HighLevel::HighLevelRuntime *lrt)
+{
+    using namespace LegionRuntime::HighLevel;
+    using namespace LegionRuntime::Accessor;
+    using namespace lgncg;
+    using LegionRuntime::Arrays::Rect;
+    static const uint8_t valsRID   = 0;
+    static const uint8_t idxsRID   = 1;
+    static const uint8_t chunksRID = 2;
+    static const uint8_t rowsRID   = 3;
+    static const uint8_t xRID      = 4;
+    static const uint8_t yRID      = 5;
+    // A (x4), x, y
+    assert(6 == rgns.size());
+    typedef RegionAccessor<AccessorType::Generic, double>   GDRA;
+    typedef RegionAccessor<AccessorType::Generic, int64_t>  GLRA;
+    typedef RegionAccessor<AccessorType::Generic, I64Tuple> GTRA;
+#define RECT(rid) lrt->get_index_space_domain(                                 \
+        ctx, task->regions[rid].region.get_index_space()).get_rect<1>()
+    GDRA av = rgns[valsRID].get_field_accessor(0).typeify<double>();
+    GLRA ai = rgns[idxsRID].get_field_accessor(0).typeify<int64_t>();
+    GTRA ac = rgns[chunksRID].get_field_accessor(0).typeify<I64Tuple>();
+    GLRA ar = rgns[rowsRID].get_field_accessor(0).typeify<int64_t>();
+    GDRA x = rgns[xRID].get_field_accessor(0).typeify<double>();
+    GDRA y = rgns[yRID].get_field_accessor(0).typeify<double>();
+    const Rect<1> aRect = RECT(valsRID);
+    const Rect<1> xRect = RECT(xRID);
+    const Rect<1> yRect = RECT(yRID);
+    const double *valp = densePtr(av, aRect);
+    const int64_t *colp = densePtr(ai, aRect);
+    const I64Tuple *chunks = densePtr(ac, RECT(chunksRID));
+    const int64_t *rows = densePtr(ar, RECT(rowsRID));
+    const double *xp = densePtr(x, xRect);
+    double *yp = densePtr(y, yRect);
+#undef RECT
+    // only ever built from dense instances
+    assert(valp && colp && chunks && rows && xp && yp);
+    const int64_t nRows = yRect.volume();
+    if (sellHaveAVX512()) {
+        return sellRowsAVX512<DOT>(nRows, chunks, rows, valp, colp,
+                                   xp, xRect.lo[0], yRect.lo[0], yp);
+    }
+    return sellRows<DOT>(nRows, chunks, rows, valp, colp,
+                         xp, xRect.lo[0], yRect.lo[0], yp);
+}
+
+}
+
+namespace lgncg {
+
+/**
+ * builds A's SELL copy from vals, mIdxs and nzir. call after setupHalo,
+ * the copy has the "real" column indices.
+ */
+static inline void
+sellPrep(SparseMatrix &A,
+         LegionRuntime::HighLevel::Context &ctx,
+         LegionRuntime::HighLevel::HighLevelRuntime *lrt)
+{
+    using namespace LegionRuntime::HighLevel;
+    if (A.sell) return;
+    const int64_t nLocalRows = A.nRows / A.nParts;
+    A.sellVals.create<double>(A.vals.len, ctx, lrt);
+    A.sellIdxs.create<int64_t>(A.mIdxs.len, ctx, lrt);
+    A.sellChunks.create<I64Tuple>(A.nParts * sellNChunks(nLocalRows),
+                                  ctx, lrt);
+    A.sellRows.create<int64_t>(A.nRows, ctx, lrt);
+    A.sellVals.partition(A.nParts, ctx, lrt);
+    A.sellIdxs.partition(A.nParts, ctx, lrt);
+    A.sellChunks.partition(A.nParts, ctx, lrt);
+    A.sellRows.partition(A.nParts, ctx, lrt);
+
+    int idx = 0;
+    const int64_t nCols = A.nCols;
+    ArgumentMap argMap;
+    IndexLauncher il(LGNCG_SELL_BUILD_TID, A.vals.lDom(),
+                     TaskArgument(&nCols, sizeof(nCols)), argMap);
+    const Vector *in[] = { &A.vals, &A.mIdxs, &A.nzir };
+    for (int i = 0; i < 3; ++i) {
+        il.add_region_requirement(
+            RegionRequirement(in[i]->lp(), 0, READ_ONLY, EXCLUSIVE, in[i]->lr)
+        );
+        il.add_field(idx++, in[i]->fid);
+    }
+    Vector *out[] = { &A.sellVals, &A.sellIdxs, &A.sellChunks, &A.sellRows };
+    for (int i = 0; i < 4; ++i) {
+        il.add_region_requirement(
+            RegionRequirement(out[i]->lp(), 0, WRITE_DISCARD,
+                              EXCLUSIVE, out[i]->lr)
+        );
+        il.add_field(idx++, out[i]->fid);
+    }
+    lrt->execute_index_space(ctx, il).wait_all_results();
+    A.sell = true;
+}
+
+/**
+ * sorts, chunks and transposes one subgrid's rows.
+ */
+inline void
+sellBuildTask(const LegionRuntime::HighLevel::Task *task,
+              const std::vector<LegionRuntime::HighLevel::PhysicalRegion> &rgns,
+              LegionRuntime::HighLevel::Context ctx,
+              LegionRuntime::HighLevel::HighLevelRuntime *lrt)
+{
+    using namespace LegionRuntime::HighLevel;
+    using namespace LegionRuntime::Accessor;
+    using LegionRuntime::Arrays::Rect;
+    // A's vals, mIdxs, nzir, then the SELL vals, idxs, chunks, rows
+    assert(7 == rgns.size());
+    const int64_t nCols = *(const int64_t *)task->args;
+    typedef RegionAccessor<AccessorType::Generic, double>   GDRA;
+    typedef RegionAccessor<AccessorType::Generic, int64_t>  GLRA;
+    typedef RegionAccessor<AccessorType::Generic, uint8_t>  GSRA;
+    typedef RegionAccessor<AccessorType::Generic, I64Tuple> GTRA;
+#define RECT(rid) lrt->get_index_space_domain(                                 \
+        ctx, task->regions[rid].region.get_index_space()).get_rect<1>()
+    GDRA av = rgns[0].get_field_accessor(0).typeify<double>();
+    GLRA ai = rgns[1].get_field_accessor(0).typeify<int64_t>();
+    GSRA az = rgns[2].get_field_accessor(0).typeify<uint8_t>();
+    GDRA sv = rgns[3].get_field_accessor(0).typeify<double>();
+    GLRA si = rgns[4].get_field_accessor(0).typeify<int64_t>();
+    GTRA sc = rgns[5].get_field_accessor(0).typeify<I64Tuple>();
+    GLRA sr = rgns[6].get_field_accessor(0).typeify<int64_t>();
+    const Rect<1> aRect = RECT(0);
+    const Rect<1> zRect = RECT(2);
+    const double *avp = densePtr(av, aRect);
+    const int64_t *aip = densePtr(ai, aRect);
+    const uint8_t *azp = densePtr(az, zRect);
+    double *svp = densePtr(sv, RECT(3));
+    int64_t *sip = densePtr(si, RECT(4));
+    I64Tuple *scp = densePtr(sc, RECT(5));
+    int64_t *srp = densePtr(sr, RECT(6));
+#undef RECT
+    assert(avp && aip && azp && svp && sip && scp && srp);
+    const int64_t nRows = zRect.volume();
+    // sort each window of rows by length, longest first. insertion sort,
+    // the windows are short and mostly sorted already.
+    for (int64_t r = 0; r < nRows; ++r) srp[r] = r;
+    for (int64_t s = 0; s < nRows; s += SELL_SIGMA) {
+        const int64_t e = (s + SELL_SIGMA < nRows) ? s + SELL_SIGMA : nRows;
+        for (int64_t i = s + 1; i < e; ++i) {
+            const int64_t r = srp[i];
+            int64_t j = i;
+            for (; j > s && azp[srp[j - 1]] < azp[r]; --j) {
+                srp[j] = srp[j - 1];
+            }
+            srp[j] = r;
+        }
+    }
+    // lay the chunks out one after another, column by column. padding in
+    // the rows (a zero value at the row's own column) keeps its place.
+    int64_t off = 0;
+    for (int64_t c = 0; c < sellNChunks(nRows); ++c) {
+        const int64_t lanes = (nRows - c * SELL_C < SELL_C) ?
+                              nRows - c * SELL_C : SELL_C;
+        int64_t w = 0;
+        for (int64_t l = 0; l < lanes; ++l) {
+            const int64_t r = srp[c * SELL_C + l];
+            if (azp[r] > w) w = azp[r];
+        }
+        scp[c] = I64Tuple(off, w);
+        for (int64_t j = 0; j < w; ++j) {
+            for (int64_t l = 0; l < lanes; ++l) {
+                const int64_t r = srp[c * SELL_C + l];
+                svp[off + j * lanes + l] = avp[r * nCols + j];
+                sip[off + j * lanes + l] = aip[r * nCols + j];
+            }
+        }
+        off += w * lanes;
+    }
+    assert(off <= (int64_t)aRect.volume());
+}
+
+/**
+ * y = A * x from A's SELL copy, see spmv
+ */
+static inline void
+spmvSELL(const SparseMatrix &A,
+         const Vector &x,
+         Vector &y,
+         bool dot,
+         double *result,
+         LegionRuntime::HighLevel::Context &ctx,
+         LegionRuntime::HighLevel::HighLevelRuntime *lrt)
+{
+    using namespace LegionRuntime::HighLevel;
+    int idx = 0;
+    assert(A.sell);
+    ArgumentMap argMap;
+    IndexLauncher il(dot ? LGNCG_SPMV_DOT_SELL_TID : LGNCG_SPMV_SELL_TID,
+                     A.vals.lDom(), TaskArgument(NULL, 0), argMap);
+    const Vector *in[] = {
+        &A.sellVals, &A.sellIdxs, &A.sellChunks, &A.sellRows
+    };
+    for (int i = 0; i < 4; ++i) {
+        il.add_region_requirement(
+            RegionRequirement(in[i]->lp(), 0, READ_ONLY, EXCLUSIVE, in[i]->lr)
+        );
+        il.add_field(idx++, in[i]->fid);
+    }
+    // our cells of x and the neighbors' ghost cells
+    il.add_region_requirement(
+        RegionRequirement(A.haloLP(x, ctx, lrt), 0, READ_ONLY, EXCLUSIVE, x.lr)
+    );
+    il.add_field(idx++, x.fid);
+    il.add_region_requirement(
+        RegionRequirement(y.lp(), 0, WRITE_DISCARD, EXCLUSIVE, y.lr)
+    );
+    il.add_field(idx++, y.fid);
+    if (dot) {
+        Future f = lrt->execute_index_space(ctx, il, LGNCG_DOTPROD_RED_ID);
+        *result = f.get_result<double>();
+    }
+    else {
+        (void)lrt->execute_index_space(ctx, il);
+    }
+}
+
+inline void
+spmvSELLTask(const LegionRuntime::HighLevel::Task *task,
+             const std::vector<LegionRuntime::HighLevel::PhysicalRegion> &rgns,
+             LegionRuntime::HighLevel::Context ctx,
+             LegionRuntime::HighLevel::HighLevelRuntime *lrt)
+{
+    (void)sellSPMVTask<false>(task, rgns, ctx, lrt);
+}
+
+inline double
+spmvDotSELLTask(
+    const LegionRuntime::HighLevel::Task *task,
+    const std::vector<LegionRuntime::HighLevel::PhysicalRegion> &rgns,
+    LegionRuntime::HighLevel::Context ctx,
+    LegionRuntime::HighLevel::HighLevelRuntime *lrt)
+{
+    return sellSPMVTask<true>(task, rgns, ctx, lrt);
+}
+
+} // end lgncg namespace
+
+#endif
@@ -52,14 +52,86 @@
 #include "../../legion_runtime/legion.h"
 
 #include <map>
+#include <set>
 
 /**
- * Implements the halo setup. Well... Not really. Just updates indices for now.
- * This will implement halo setup at some point.
+ * Implements the halo setup: updates indices to "real" ones and works out
+ * which cells each subgrid needs from its neighbors.
  */
 
 namespace lgncg {
 
+/**
+ * fills in halo with, for each subgrid (color), the "real" indices of its
+ * own cells and of the cells of its neighbors that its 27-point stencil
+ * reaches. subgrid t's cells are [t * nx * ny * nz, (t + 1) * nx * ny * nz)
+ * in local row order. cells are gathered into as few rects as the layout
+ * allows: a z face is one rect, a y face one per plane, an x face one per
+ * row.
+ */
+static inline void
+buildHalo(const Geometry &geom,
+          LegionRuntime::HighLevel::MultiDomainColoring &halo)
+{
+    using namespace LegionRuntime::HighLevel;
+    using LegionRuntime::Arrays::Rect;
+
+    const int64_t nx = geom.nx, ny = geom.ny, nz = geom.nz;
+    const int64_t npx = geom.npx, npy = geom.npy, npz = geom.npz;
+    const int64_t nLocalRows = nx * ny * nz;
+    halo.clear();
+    for (int64_t t = 0; t < geom.size; ++t) {
+        const int64_t ipz = t / (npx * npy);
+        const int64_t ipy = (t - ipz * npx * npy) / npx;
+        const int64_t ipx = t % npx;
+        std::set<Domain> &cells = halo[t];
+        for (int64_t dz = -1; dz <= 1; dz++) {
+            const int64_t jz = ipz + dz;
+            if (jz < 0 || jz >= npz) continue;
+            for (int64_t dy = -1; dy <= 1; dy++) {
+                const int64_t jy = ipy + dy;
+                if (jy < 0 || jy >= npy) continue;
+                for (int64_t dx = -1; dx <= 1; dx++) {
+                    const int64_t jx = ipx + dx;
+                    if (jx < 0 || jx >= npx) continue;
+                    const int64_t n = jx + jy * npx + jz * npx * npy;
+                    if (n >= geom.size) continue;
+                    // the neighbor's cells on our side, in its coordinates
+                    const int64_t xlo = (dx < 0) ? nx - 1 : 0;
+                    const int64_t xhi = (dx > 0) ? 0 : nx - 1;
+                    const int64_t ylo = (dy < 0) ? ny - 1 : 0;
+                    const int64_t yhi = (dy > 0) ? 0 : ny - 1;
+                    const int64_t zlo = (dz < 0) ? nz - 1 : 0;
+                    const int64_t zhi = (dz > 0) ? 0 : nz - 1;
+                    // runs along x, joined when they happen to touch
+                    int64_t runLo = -1, runHi = -2;
+                    for (int64_t iz = zlo; iz <= zhi; iz++) {
+                        for (int64_t iy = ylo; iy <= yhi; iy++) {
+                            const int64_t lo = n * nLocalRows +
+                                               iz * nx * ny + iy * nx + xlo;
+                            const int64_t hi = lo + (xhi - xlo);
+                            if (lo == runHi + 1) {
+                                runHi = hi;
+                                continue;
+                            }
+                            if (runLo >= 0) {
+                                cells.insert(Domain::from_rect<1>(
+                                    Rect<1>(Point<1>(runLo), Point<1>(runHi))
+                                ));
+                            }
+                            runLo = lo;
+                            runHi = hi;
+                        }
+                    }
+                    cells.insert(Domain::from_rect<1>(
+                        Rect<1>(Point<1>(runLo), Point<1>(runHi))
+                    ));
+                }
+            }
+        }
+    }
+}
+
 /**
  *
  */
@@ -87,6 +159,8 @@ setupHalo(SparseMatrix &A,
     // ... and go! Wait here for more accurate timings (at least we hope)... The
     // idea is that we want to separate initialization from the solve.
     lrt->execute_index_space(ctx, il).wait_all_results();
+    // ghost cells for the vectors A will be applied to
+    buildHalo(A.geom, A.halo);
 }
 
 /**
@@ -37,6 +37,7 @@
 #include "../../legion_runtime/legion.h"
 
 #include <iostream>
+#include <map>
 
 namespace lgncg {
 
@@ -65,6 +66,19 @@ struct SparseMatrix {
     Vector mIdxs;
     // # non-0s in row
     Vector nzir;
+    // single precision copies of vals and diag that the multigrid
+    // preconditioner works from when mixed is set. see mgPrep.
+    Vector valsF;
+    Vector diagF;
+    bool mixed;
+    // a SELL-C-sigma copy of vals and mIdxs for SpMV when sell is set: the
+    // values and columns by chunk, each chunk's (offset, width) and the row
+    // in each slot. see sell.h.
+    Vector sellVals;
+    Vector sellIdxs;
+    Vector sellChunks;
+    Vector sellRows;
+    bool sell;
     ////////////////////////////////////////////////////////////////////////////
     // metadata vectors
     ////////////////////////////////////////////////////////////////////////////
@@ -76,6 +90,13 @@ struct SparseMatrix {
     MGData *mgData;
     // current number of partitions XXX remove?
     int64_t nParts;
+    // the cells of a vector each subgrid reads when this matrix is applied
+    // to it: its own and its neighbors' ghost cells. set up by setupHalo.
+    LegionRuntime::HighLevel::MultiDomainColoring halo;
+    // halo partitions of the vectors this matrix has been applied to, by
+    // index space
+    mutable std::map<LegionRuntime::HighLevel::IndexSpace,
+                     LegionRuntime::HighLevel::LogicalPartition> haloParts;
     /**
      *
      */
@@ -86,6 +107,8 @@ struct SparseMatrix {
         tNon0 = 0;
         Ac = NULL;
         mgData = NULL;
+        mixed = false;
+        sell = false;
     }
     /**
      *
@@ -126,6 +149,16 @@ struct SparseMatrix {
         mIdxs.free(ctx, lrt);
         nzir.free(ctx, lrt);
         g2g.free(ctx, lrt);
+        if (mixed) {
+            valsF.free(ctx, lrt);
+            diagF.free(ctx, lrt);
+        }
+        if (sell) {
+            sellVals.free(ctx, lrt);
+            sellIdxs.free(ctx, lrt);
+            sellChunks.free(ctx, lrt);
+            sellRows.free(ctx, lrt);
+        }
         if (Ac) {
             Ac->free(ctx, lrt);
             delete Ac;
@@ -148,6 +181,25 @@ struct SparseMatrix {
         nzir.partition(nParts, ctx, lrt);
         g2g.partition(nParts, ctx, lrt);
     }
+    /**
+     * returns x partitioned by this matrix's halo, creating the partition
+     * the first time x is seen.
+     */
+    LegionRuntime::HighLevel::LogicalPartition
+    haloLP(const Vector &x,
+           LegionRuntime::HighLevel::Context &ctx,
+           LegionRuntime::HighLevel::HighLevelRuntime *lrt) const
+    {
+        using namespace LegionRuntime::HighLevel;
+        assert(!halo.empty());
+        const IndexSpace is = x.lr.get_index_space();
+        std::map<IndexSpace, LogicalPartition>::iterator it =
+            haloParts.find(is);
+        if (it != haloParts.end()) return it->second;
+        LogicalPartition lp = x.aliasedPartition(vals.lDom(), halo, ctx, lrt);
+        haloParts[is] = lp;
+        return lp;
+    }
     // TODO add unpartition
 };
 
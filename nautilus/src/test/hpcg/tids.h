@@ -41,7 +41,15 @@ enum {
     LGNCG_SYMGS_TID        = 9,
     LGNCG_RESTRICTION_TID  = 10,
     LGNCG_PROLONGATION_TID = 11,
-    LGNCG_SETUP_HALO_TID   = 12
+    LGNCG_SETUP_HALO_TID   = 12,
+    LGNCG_SPMV_DOT_TID     = 13,
+    LGNCG_AXPY_DOT_TID     = 14,
+    LGNCG_VEC_NARROW_TID   = 15,
+    LGNCG_SYMGS_F_TID      = 16,
+    LGNCG_RESTRICTION_F_TID = 17,
+    LGNCG_SELL_BUILD_TID   = 18,
+    LGNCG_SPMV_SELL_TID    = 19,
+    LGNCG_SPMV_DOT_SELL_TID = 20
 };
 
 enum {
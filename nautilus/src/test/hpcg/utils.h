@@ -85,6 +85,81 @@ offsetMismatch(int i,
     return false;
 }
 
+/**
+ * returns a pointer to the element at bounds.lo if fa's elements over
+ * bounds are densely packed, NULL otherwise. element i of bounds is at
+ * ptr[i - bounds.lo].
+ */
+template <typename T>
+static inline T *
+densePtr(const LegionRuntime::Accessor::RegionAccessor<
+             LegionRuntime::Accessor::AccessorType::Generic, T
+         > &fa,
+         const Rect<1> &bounds)
+{
+    using namespace LegionRuntime::Accessor;
+    typedef AccessorType::Affine<1, sizeof(T)> DenseAT;
+    if (!fa.template can_convert<DenseAT>(bounds)) return NULL;
+    RegionAccessor<DenseAT, T> da = fa.template convert<DenseAT>(bounds);
+    return da.ptr(bounds.lo);
+}
+
+/**
+ * a compensated (Kahan) running sum. c carries the low-order bits each
+ * addition loses, so the error stays at about one rounding no matter
+ * how many terms there are. only correct without -ffast-math.
+ */
+struct KahanSum {
+    double sum;
+    double c;
+
+    KahanSum(void) : sum(0.0), c(0.0) { ; }
+
+    void
+    add(double v) {
+        const double y = v - c;
+        const double t = sum + y;
+        c = (t - sum) - y;
+        sum = t;
+    }
+
+    void
+    add(const KahanSum &other) {
+        add(other.sum);
+        add(-other.c);
+    }
+
+    double
+    value(void) const { return sum - c; }
+};
+
+/**
+ * returns x' * y over n elements. four independent compensated sums run
+ * side by side, which the compiler can keep in vector registers, and
+ * are only combined at the end.
+ */
+static inline double
+kahanDot(const double *xp,
+         const double *yp,
+         int64_t n)
+{
+    KahanSum s0, s1, s2, s3;
+    int64_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0.add(xp[i + 0] * yp[i + 0]);
+        s1.add(xp[i + 1] * yp[i + 1]);
+        s2.add(xp[i + 2] * yp[i + 2]);
+        s3.add(xp[i + 3] * yp[i + 3]);
+    }
+    for (; i < n; ++i) {
+        s0.add(xp[i] * yp[i]);
+    }
+    s0.add(s1);
+    s2.add(s3);
+    s0.add(s2);
+    return s0.value();
+}
+
 } // end lgncg namespace
 
 #endif
@@ -0,0 +1,111 @@
+/**
+ * Copyright (c) 2014      Los Alamos National Security, LLC
+ *                         All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+ * THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * LA-CC 10-123
+ */
+
+#ifndef LGNCG_VEC_NARROW_H_INCLUDED
+#define LGNCG_VEC_NARROW_H_INCLUDED
+
+#include "tids.h"
+#include "vector.h"
+#include "utils.h"
+
+#include "legion.h"
+
+namespace lgncg {
+
+/**
+ * dst = (float)src, partition by partition. both must be partitioned the
+ * same way.
+ */
+static inline void
+vecnarrow(const Vector &src,
+          Vector &dst,
+          LegionRuntime::HighLevel::Context &ctx,
+          LegionRuntime::HighLevel::HighLevelRuntime *lrt)
+{
+    using namespace LegionRuntime::HighLevel;
+    int idx = 0;
+    assert(src.lDom().get_volume() == dst.lDom().get_volume());
+    ArgumentMap argMap;
+    IndexLauncher il(LGNCG_VEC_NARROW_TID, src.lDom(),
+                     TaskArgument(NULL, 0), argMap);
+    il.add_region_requirement(
+        RegionRequirement(src.lp(), 0, READ_ONLY, EXCLUSIVE, src.lr)
+    );
+    il.add_field(idx++, src.fid);
+    il.add_region_requirement(
+        RegionRequirement(dst.lp(), 0, WRITE_DISCARD, EXCLUSIVE, dst.lr)
+    );
+    il.add_field(idx++, dst.fid);
+    // execute the thing...
+    (void)lrt->execute_index_space(ctx, il);
+}
+
+/**
+ * vecnarrow task
+ */
+inline void
+vecnarrowTask(const LegionRuntime::HighLevel::Task *task,
+              const std::vector<LegionRuntime::HighLevel::PhysicalRegion> &rgns,
+              LegionRuntime::HighLevel::Context ctx,
+              LegionRuntime::HighLevel::HighLevelRuntime *lrt)
+{
+    using namespace LegionRuntime::HighLevel;
+    using namespace LegionRuntime::Accessor;
+    using LegionRuntime::Arrays::Rect;
+    static const uint8_t srcRID = 0;
+    static const uint8_t dstRID = 1;
+    assert(2 == rgns.size());
+    // convenience typedefs
+    typedef RegionAccessor<AccessorType::Generic, double> GDRA;
+    typedef RegionAccessor<AccessorType::Generic, float>  GFRA;
+    GDRA src = rgns[srcRID].get_field_accessor(0).typeify<double>();
+    GFRA dst = rgns[dstRID].get_field_accessor(0).typeify<float>();
+    const Domain dom = lrt->get_index_space_domain(
+        ctx, task->regions[srcRID].region.get_index_space()
+    );
+    const Rect<1> rect = dom.get_rect<1>();
+    const double *sp = densePtr(src, rect);
+    float *dp = densePtr(dst, rect);
+    if (sp && dp) {
+        const int64_t n = rect.volume();
+        for (int64_t i = 0; i < n; ++i) {
+            dp[i] = (float)sp[i];
+        }
+        return;
+    }
+    // else slow path
+    for (GenericPointInRectIterator<1> itr(rect); itr; itr++) {
+        const DomainPoint pnt = DomainPoint::from_point<1>(itr.p);
+        dst.write(pnt, (float)src.read(pnt));
+    }
+}
+
+} // end lgncg namespace
+
+#endif
@@ -230,6 +230,27 @@ public:
         this->pvec.push_back(PVecItem(subgridBnds, lDom, lp));
     }
 
+    /**
+     * creates an aliased partition of this vector from a coloring of its
+     * cells. unlike partition(), the result is not pushed as a partition
+     * scheme; it is for requirements that want other cells than a
+     * subgrid's own, e.g. its ghost cells.
+     */
+    LegionRuntime::HighLevel::LogicalPartition
+    aliasedPartition(const LegionRuntime::HighLevel::Domain &colorDomain,
+                     const LegionRuntime::HighLevel::MultiDomainColoring &c,
+                     LegionRuntime::HighLevel::Context &ctx,
+                     LegionRuntime::HighLevel::HighLevelRuntime *lrt) const
+    {
+        using namespace LegionRuntime::HighLevel;
+        IndexPartition iPart = lrt->create_index_partition(
+                                   ctx, this->is,
+                                   colorDomain, c,
+                                   false /* aliased */
+                               );
+        return lrt->get_logical_partition(ctx, this->lr, iPart);
+    }
+
     /**
      * convenience routine that dumps the contents of this vector.
      */
@@ -61,6 +61,11 @@ run_legion_tests (void)
     nk_thread_id_t t;
     unsigned i;
 
+#ifdef NAUT_CONFIG_CXX_LAZY_INIT
+    extern void nk_cxx_ensure_init(void);
+    nk_cxx_ensure_init();
+#endif
+
     /* I will now pull some
      * devious NUMA hackery out of my...
      */
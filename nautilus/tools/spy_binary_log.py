@@ -0,0 +1,114 @@
+#!/usr/bin/env python
+#
+# Turns the binary Legion Spy log (LEGION_RT_SPY_BINARY) back into the
+# text log the spy tools read.
+#
+#   spy_binary_log.py serial.log > legion_spy.log
+#   spy_binary_log.py --raw legion-spy.ring > legion_spy.log
+#
+# By default the input is a serial capture, and the stream is taken
+# from its "SPYB " hex lines, ignoring all other output. With --raw
+# the input is the stream itself, as read from the "legion-spy" HRT
+# ring. See legion_spy.cc for the layout.
+#
+
+import re
+import struct
+import sys
+
+FRAME_FORMAT = 0x46595053
+FRAME_RECORDS = 0x52595053
+SERIAL_TAG = "SPYB "
+
+# the same conversions the kernel side knows about
+CONVERSION = re.compile(r"%([-+ #0-9.]*)([hlz]*)([a-zA-Z%])")
+
+
+def serial_stream(f):
+    data = bytearray()
+    for line in f:
+        line = line.decode("ascii", "replace").strip()
+        idx = line.find(SERIAL_TAG)
+        if idx >= 0:
+            data += bytearray.fromhex(line[idx + len(SERIAL_TAG):])
+    return bytes(data)
+
+
+def python_format(fmt):
+    # Python has no length modifiers and no %u
+    def fix(m):
+        if m.group(3) == "%":
+            return "%%"
+        conv = "d" if m.group(3) in "ui" else m.group(3)
+        if conv == "p":
+            return "0x%" + m.group(1) + "x"
+        return "%" + m.group(1) + conv
+    kinds = [(m.group(3), m.group(2)) for m in CONVERSION.finditer(fmt)
+             if m.group(3) != "%"]
+    return CONVERSION.sub(fix, fmt), kinds
+
+
+def integer(value, kind):
+    # integers come sign extended from their C type
+    conv, modifiers = kind
+    if conv in "di":
+        return value - (1 << 64) if value >= (1 << 63) else value
+    if not modifiers or modifiers.startswith("h"):
+        return value & 0xffffffff
+    return value
+
+
+def convert(data, out):
+    formats = {}
+    pos = 0
+    while pos + 8 <= len(data):
+        kind, length = struct.unpack_from("<II", data, pos)
+        pos += 8
+        payload = data[pos:pos + length]
+        pos += length
+        if len(payload) < length:
+            sys.stderr.write("truncated frame at the end of the stream\n")
+            break
+        if kind == FRAME_FORMAT:
+            fid = struct.unpack_from("<I", payload, 0)[0]
+            formats[fid] = python_format(payload[4:].decode("ascii", "replace"))
+        elif kind == FRAME_RECORDS:
+            proc = struct.unpack_from("<Q", payload, 0)[0]
+            at = 8
+            while at < len(payload):
+                fid = struct.unpack_from("<H", payload, at)[0]
+                at += 2
+                fmt, kinds = formats[fid]
+                args = []
+                for k in kinds:
+                    if k[0] == "s":
+                        slen = struct.unpack_from("<H", payload, at)[0]
+                        at += 2
+                        args.append(payload[at:at + slen].decode("ascii", "replace"))
+                        at += slen
+                    else:
+                        value = struct.unpack_from("<Q", payload, at)[0]
+                        at += 8
+                        args.append(integer(value, k))
+                # the prefix Logger::logvprintf puts on every line
+                out.write("[0 - %x] {INFO}{legion_spy}: %s\n" %
+                          (proc, fmt % tuple(args)))
+        else:
+            sys.stderr.write("unknown frame 0x%x, giving up\n" % kind)
+            break
+
+
+def main(argv):
+    raw = "--raw" in argv
+    files = [a for a in argv[1:] if a != "--raw"]
+    if len(files) != 1:
+        sys.stderr.write("usage: %s [--raw] input\n" % argv[0])
+        return 1
+    with open(files[0], "rb") as f:
+        data = f.read() if raw else serial_stream(f)
+    convert(data, sys.stdout)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -21,6 +21,8 @@
 #include <linux/kd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
 
 #define DEBUG 1
 
@@ -78,6 +80,51 @@
 
 #define LINE_REG_OFFSET 0x4
 
+/* 
+ * bulk transfer window, must match include/arch/k1om/phi_xfer.h
+ * on the Nautilus side
+ */
+#define WC_MEM_FILE        "/device/resource0_wc"
+#define PHI_XFER_BASE      0x1000000ULL
+#define PHI_XFER_CTRL_LEN  0x1000
+#define PHI_XFER_CHUNK     (4*1024*1024)
+#define PHI_XFER_NBUFS     2
+#define PHI_XFER_LEN       (PHI_XFER_CTRL_LEN + PHI_XFER_NBUFS*PHI_XFER_CHUNK)
+#define PHI_XFER_MAGIC     0x78666572
+#define PHI_XFER_NAME_LEN  256
+
+#define PHI_XFER_REQ_NONE   0
+#define PHI_XFER_REQ_OPEN   1
+#define PHI_XFER_REQ_CLOSE  2
+
+#define PHI_XFER_RD 1
+#define PHI_XFER_WR 2
+
+#define PHI_XFER_BUF_EMPTY 0
+#define PHI_XFER_BUF_FULL  1
+#define PHI_XFER_BUF_EOF   2
+
+struct phi_xfer_buf {
+    volatile uint32_t state;
+    volatile uint32_t len;
+} __attribute__((packed));
+
+struct phi_xfer_ctrl {
+    volatile uint32_t magic;
+    uint32_t chunk;
+    uint32_t nbufs;
+
+    volatile uint32_t req;
+    volatile uint32_t req_seq;
+    volatile uint32_t ack_seq;
+    volatile int32_t  status;
+    uint32_t mode;
+    volatile uint64_t size;
+    char name[PHI_XFER_NAME_LEN];
+
+    struct phi_xfer_buf bufs[PHI_XFER_NBUFS];
+} __attribute__((packed));
+
 
 typedef enum {
     TYPE_NO_UPDATE = 0,
@@ -87,6 +134,7 @@ typedef enum {
     TYPE_SCREEN_REDRAW,
     TYPE_CONSOLE_SHUTDOWN,
     TYPE_SCROLLUP,
+    TYPE_LINES_DRAWN,
     TYPE_INVAL
 } update_type_t;
 
@@ -131,14 +179,25 @@ struct line_elm {
 
 static char* micnum = "0";
 
+static struct {
+    volatile struct phi_xfer_ctrl * ctrl;
+    volatile uint8_t * data;    /* write-combined if we could get it */
+    const char * dir;           /* files are served from here */
+    int fd;
+    int mode;
+    unsigned cur;
+    uint32_t last_seq;
+} xfer = { .fd = -1, .dir = "." };
+
 static void
 usage (char * prog)
 {
-    fprintf(stderr, "\nUsage: %s -b <bootloader> -k <kernel> [-t <timeout> ] [-m <micnum> ] [-o <file>] [-h] \n"
+    fprintf(stderr, "\nUsage: %s -b <bootloader> -k <kernel> [-t <timeout> ] [-m <micnum> ] [-d <dir>] [-o <file>] [-h] \n"
                     "\t-t    Timeout to use. Default is 60 seconds\n"
                     "\t-m    Which MIC device to use. Default is 0\n"
                     "\t-b    Path to the bootloader to boot with\n"
                     "\t-k    Path to the kernel to boot with\n"
+                    "\t-d    Directory the card may read and write files in. Default is .\n"
                     "\t-o    Output to file\n"
                     "\t-h    Print this message\n\n", prog);
     exit(EXIT_SUCCESS);
@@ -450,6 +509,28 @@ handle_line_update (void)
 #endif
 }
 
+
+/* 
+ * the card batches its output and tells us once about a run of rows,
+ * first in the low half of the line register and last in the high half
+ */
+static int
+handle_lines_update (void)
+{
+    uint32_t range = console_read_reg(LINE_REG_OFFSET);
+    uint32_t first = range & 0xffff;
+    uint32_t last  = range >> 16;
+
+    assert(first <= last && last < PHI_FB_HEIGHT);
+    assert(console.fb);
+
+    DEBUG_SCREEN("Handling line update for lines %u-%u\n", first, last);
+
+    draw_output_win();
+
+    return 0;
+}
+
 /* dir = 1 => forward 
  * dir = 0 => backward
  */
@@ -547,11 +628,213 @@ handle_screen_redraw (void)
 
 
 
+/* 
+ * Bulk transfers. The card asks for a file through the control
+ * block and the two of us pass the data buffers back and forth: we
+ * fill one from the file while the card drains the other, or write
+ * one out while the card fills the other. There is no SCIF here, so
+ * the data goes through the BAR aperture, write-combined when the
+ * driver offers it.
+ */
+static void
+xfer_init (void * mapped_phi_gddr)
+{
+    char mempath[128];
+    int memfd;
+    void * wc;
+
+    xfer.ctrl = (void*)((char*)mapped_phi_gddr + PHI_XFER_BASE);
+    xfer.data = (void*)((char*)mapped_phi_gddr + PHI_XFER_BASE + PHI_XFER_CTRL_LEN);
+
+    memset(mempath, 0, sizeof(mempath));
+    strcat(mempath, MEM_BASE_PATH);
+    strcat(mempath, micnum);
+    strcat(mempath, WC_MEM_FILE);
+
+    memfd = open(mempath, O_RDWR);
+    if (memfd < 0) {
+        DEBUG_PRINT("No write-combined mapping (%s), transfers go uncached\n", strerror(errno));
+        return;
+    }
+
+    wc = mmap(NULL, 
+              PHI_XFER_NBUFS*PHI_XFER_CHUNK,
+              PROT_READ | PROT_WRITE,
+              MAP_SHARED,
+              memfd,
+              PHI_XFER_BASE + PHI_XFER_CTRL_LEN);
+
+    close(memfd);
+
+    if (wc != MAP_FAILED) {
+        xfer.data = wc;
+    }
+}
+
+
+/* names are taken relative to the served directory, and must stay in it */
+static int
+xfer_open (void)
+{
+    char name[PHI_XFER_NAME_LEN];
+    char path[PATH_MAX];
+    struct stat s;
+    int mode = xfer.ctrl->mode;
+    int fd;
+
+    memcpy(name, (void*)xfer.ctrl->name, sizeof(name));
+    name[sizeof(name)-1] = 0;
+
+    if (xfer.fd >= 0 || name[0] == '/' || strstr(name, "..")) {
+        return -EINVAL;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", xfer.dir, name);
+
+    if (mode == PHI_XFER_RD) {
+        fd = open(path, O_RDONLY);
+    } else if (mode == PHI_XFER_WR) {
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    } else {
+        return -EINVAL;
+    }
+
+    if (fd < 0) {
+        return -errno;
+    }
+
+    xfer.ctrl->size = (fstat(fd, &s) == 0) ? s.st_size : 0;
+
+    xfer.fd   = fd;
+    xfer.mode = mode;
+    xfer.cur  = 0;
+
+    DEBUG_SCREEN("Card opened %s for %s\n", path, mode == PHI_XFER_RD ? "reading" : "writing");
+
+    return 0;
+}
+
+
+static void
+xfer_close (void)
+{
+    if (xfer.fd >= 0) {
+        close(xfer.fd);
+        xfer.fd = -1;
+        DEBUG_SCREEN("Card closed its transfer\n");
+    }
+}
+
+
+/* move whatever buffers are ours right now, returns how many */
+static int
+xfer_move (void)
+{
+    volatile struct phi_xfer_buf * b;
+    unsigned moved = 0;
+
+    while (moved < PHI_XFER_NBUFS) {
+        uint8_t * data;
+        ssize_t n;
+
+        b    = &xfer.ctrl->bufs[xfer.cur];
+        data = (uint8_t*)(xfer.data + xfer.cur*PHI_XFER_CHUNK);
+
+        if (xfer.mode == PHI_XFER_RD) {
+            if (b->state != PHI_XFER_BUF_EMPTY) {
+                break;
+            }
+
+            n = read(xfer.fd, data, PHI_XFER_CHUNK);
+            if (n < 0) {
+                n = 0;
+            }
+
+            b->len = n;
+            __sync_synchronize();
+            b->state = (n < PHI_XFER_CHUNK) ? PHI_XFER_BUF_EOF : PHI_XFER_BUF_FULL;
+
+            if (n < PHI_XFER_CHUNK) {
+                /* nothing more until the card closes */
+                xfer.mode = 0;
+            }
+        } else if (xfer.mode == PHI_XFER_WR) {
+            uint32_t state = b->state;
+
+            if (state == PHI_XFER_BUF_EMPTY) {
+                break;
+            }
+
+            __sync_synchronize();
+            if (write(xfer.fd, data, b->len) != b->len) {
+                fprintf(stderr, "Error writing transfer data (%s)\n", strerror(errno));
+            }
+
+            b->state = PHI_XFER_BUF_EMPTY;
+
+            if (state == PHI_XFER_BUF_EOF) {
+                xfer.mode = 0;
+            }
+        } else {
+            break;
+        }
+
+        xfer.cur = (xfer.cur + 1) % PHI_XFER_NBUFS;
+        moved++;
+    }
+
+    return moved;
+}
+
+
+static void
+xfer_poll (void)
+{
+    uint32_t seq;
+
+    if (!xfer.ctrl || xfer.ctrl->magic != PHI_XFER_MAGIC) {
+        return;
+    }
+
+    /* keep the pipe full for as long as the card keeps up */
+    if (xfer.fd >= 0) {
+        while (xfer_move()) {
+        }
+    }
+
+    seq = xfer.ctrl->req_seq;
+    if (seq == xfer.last_seq) {
+        return;
+    }
+
+    __sync_synchronize();
+
+    switch (xfer.ctrl->req) {
+        case PHI_XFER_REQ_OPEN:
+            xfer.ctrl->status = xfer_open();
+            break;
+        case PHI_XFER_REQ_CLOSE:
+            xfer_close();
+            xfer.ctrl->status = 0;
+            break;
+        default:
+            xfer.ctrl->status = -EINVAL;
+            break;
+    }
+
+    __sync_synchronize();
+    xfer.last_seq = seq;
+    xfer.ctrl->ack_seq = seq;
+}
+
+
 static int
 console_main_loop (void) 
 {
     while (1) {
 
+        xfer_poll();
+
         update_type_t update = wait_for_cons_update();
 
         switch (update) {
@@ -591,6 +874,12 @@ console_main_loop (void)
                     return -1;
                 }
                 break;
+            case TYPE_LINES_DRAWN:
+                if (handle_lines_update() != 0) {
+                    fprintf(stderr, "Error handling lines update\n");
+                    return -1;
+                }
+                break;
             default: 
                 fprintf(stderr, "Unknown update type (0x%x)\n", update);
                 return -1;
@@ -930,7 +1219,7 @@ main (int argc, char ** argv)
 
     opterr = 0;
 
-    while ((c = getopt(argc, argv, "htm:b:k:")) != -1) {
+    while ((c = getopt(argc, argv, "htm:b:k:d:")) != -1) {
         switch (c) {
             case 'h': 
                 usage(argv[0]);
@@ -952,8 +1241,11 @@ main (int argc, char ** argv)
             case 'b':
                 bootloader = optarg;
                 break;
+            case 'd':
+                xfer.dir = optarg;
+                break;
             case '?':
-                if (optopt == 'm' || optopt == 't') {
+                if (optopt == 'm' || optopt == 't' || optopt == 'd') {
                     fprintf(stderr, "Option -%c requires argument\n", optopt);
                 } else if (isprint(optopt)) {
                     fprintf(stderr, "Unknown option `-%c'\n", optopt);
@@ -998,6 +1290,7 @@ main (int argc, char ** argv)
     DEBUG_PRINT("Initializing screen\n");
 
     console_init(buf);
+    xfer_init(buf);
 
     // create the screen
     initscr();